@@ -28,8 +28,10 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor.h"
+#include "qjson.h"
 #include "sysemu.h"
 #include "arch_init.h"
 #include "audio/audio.h"
@@ -37,7 +39,14 @@
 #include "hw/pci.h"
 #include "hw/audiodev.h"
 #include "kvm.h"
+#include "cpus.h"
 #include "migration.h"
+#include "migration-compress.h"
+#include "migration-xbzrle.h"
+#include "migration-postcopy.h"
+#include "migration-channels.h"
+#include "savevm-lazy.h"
+#include "block.h"
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
@@ -89,107 +98,489 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_ZLIB     0x40
+#define RAM_SAVE_FLAG_XBZRLE   0x80
+#define RAM_SAVE_FLAG_POSTCOPY 0x100
+#define RAM_SAVE_FLAG_CHANNELS 0x200
+#define RAM_SAVE_FLAG_FLAT     0x400
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
-    uint32_t val = ch << 24 | ch << 16 | ch << 8 | ch;
-    uint32_t *array = (uint32_t *)page;
-    int i;
+    return buffer_is_filled(page, ch, TARGET_PAGE_SIZE);
+}
+
+/* How the pages of the last incoming RAM state were encoded; channel
+   threads load pages too, so these are updated atomically */
+static struct {
+    int64_t dup, full, zlib, xbzrle, cont;
+} ram_load_pages;
+
+static RAMBlock *last_block;
+static ram_addr_t last_offset;
+static RAMBlock *last_sent_block;
+
+/* Stripes of 64 pages go to the same extra channel */
+#define RAM_CHANNEL_STRIPE_BITS 6
+
+static MigrationChannels *ram_channels;
+static int ram_n_channels;
+static RAMBlock *ram_channel_last_block[MIGRATION_CHANNELS_MAX];
 
-    for (i = 0; i < (TARGET_PAGE_SIZE / 4); i++) {
-        if (array[i] != val) {
+/* Number of pages compressed in one go by the compression threads */
+#define RAM_COMPRESS_BATCH 256
+
+static CompressPool *compress_pool;
+
+static XBZRLECache *xbzrle_cache;
+static uint8_t *xbzrle_current;         /* copy of the page being encoded */
+static uint8_t *xbzrle_encoded;         /* encoded page for ram_save_block */
+
+/* *last is the block of the previous page sent on f */
+static void save_block_hdr(QEMUFile *f, RAMBlock **last, RAMBlock *block,
+                           ram_addr_t offset, int flag)
+{
+    int cont = (block == *last) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    qemu_put_be64(f, offset | cont | flag);
+    if (!cont) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        *last = block;
+    }
+}
+
+/* Find the next dirty page, starting at the last one found, and clear its
+   dirty flag.  Returns 0 if no page is dirty. */
+static int ram_find_dirty_page(RAMBlock **pblock, ram_addr_t *poffset)
+{
+    RAMBlock *block = last_block;
+    RAMBlock *start;
+    ram_addr_t offset = last_offset;
+    ram_addr_t addr, end;
+    int wrapped = 0;
+
+    if (!ram_list.migration_dirty_pages) {
+        return 0;
+    }
+    if (!block) {
+        block = QLIST_FIRST(&ram_list.blocks);
+        offset = 0;
+    }
+    start = block;
+
+    /* Scan from the last page found to the end of its block, then the
+       other blocks, and finally the start of that block again */
+    for (;;) {
+        end = block->offset + block->length;
+        addr = cpu_physical_memory_find_migration_dirty(block->offset + offset,
+                                                        end);
+        if (addr != end) {
+            break;
+        }
+        if (wrapped) {
             return 0;
         }
+        offset = 0;
+        block = QLIST_NEXT(block, next);
+        if (!block) {
+            block = QLIST_FIRST(&ram_list.blocks);
+        }
+        wrapped = block == start;
     }
 
+    cpu_physical_memory_reset_dirty(addr, addr + TARGET_PAGE_SIZE,
+                                    MIGRATION_DIRTY_FLAG);
+
+    last_block = block;
+    last_offset = addr - block->offset;
+
+    *pblock = block;
+    *poffset = last_offset;
     return 1;
 }
 
-static RAMBlock *last_block;
-static ram_addr_t last_offset;
+/* Encode the changes to the page at *pdata since it was last sent into
+   dst.  Returns the encoded length, or 0 if the page must be sent in full.
+   Either way the cache is updated, and *pdata then points to the cached
+   copy, which must be sent instead of the live page so that it matches
+   what the destination gets. */
+static int ram_xbzrle_encode(RAMBlock *block, ram_addr_t offset,
+                             uint8_t **pdata, uint8_t *dst)
+{
+    ram_addr_t addr = block->offset + offset;
+    uint8_t *old = xbzrle_cache_lookup(xbzrle_cache, addr);
+    int len;
+
+    if (!old) {
+        old = xbzrle_cache_insert(xbzrle_cache, addr);
+        memcpy(old, *pdata, TARGET_PAGE_SIZE);
+        *pdata = old;
+        return 0;
+    }
 
-static int ram_save_block(QEMUFile *f)
+    /* The guest keeps running, encode a stable copy */
+    memcpy(xbzrle_current, *pdata, TARGET_PAGE_SIZE);
+    len = xbzrle_encode(old, xbzrle_current, TARGET_PAGE_SIZE, dst,
+                        TARGET_PAGE_SIZE / 2);
+    memcpy(old, xbzrle_current, TARGET_PAGE_SIZE);
+    *pdata = old;
+    return len < 0 ? 0 : len;
+}
+
+/* The destination fills duplicate pages, keep a cached copy in sync */
+static void ram_xbzrle_dup_page(RAMBlock *block, ram_addr_t offset, int ch)
 {
-    RAMBlock *block = last_block;
-    ram_addr_t offset = last_offset;
-    ram_addr_t current_addr;
-    int bytes_sent = 0;
+    uint8_t *old;
 
-    if (!block)
-        block = QLIST_FIRST(&ram_list.blocks);
+    if (xbzrle_cache) {
+        old = xbzrle_cache_lookup(xbzrle_cache, block->offset + offset);
+        if (old) {
+            memset(old, ch, TARGET_PAGE_SIZE);
+        }
+    }
+}
 
-    current_addr = block->offset + offset;
+/* Guest RAM stays mapped and whatever it holds when the file is flushed
+   is fine, it was marked clean before being read; a cached copy of the
+   delta encoder must be copied as it is now */
+static void ram_put_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         uint8_t *p)
+{
+    if (p == block->host + offset) {
+        qemu_put_buffer_ref(f, p, TARGET_PAGE_SIZE);
+    } else {
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+    }
+}
 
-    do {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
-
-            p = block->host + offset;
-
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-            }
+static int ram_send_page(QEMUFile *f, RAMBlock **last, RAMBlock *block,
+                         ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+    int len;
 
-            break;
+    if (is_dup_page(p, *p)) {
+        save_block_hdr(f, last, block, offset, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        ram_xbzrle_dup_page(block, offset, *p);
+        return 1;
+    }
+
+    if (xbzrle_cache) {
+        len = ram_xbzrle_encode(block, offset, &p, xbzrle_encoded);
+        if (len) {
+            save_block_hdr(f, last, block, offset, RAM_SAVE_FLAG_XBZRLE);
+            qemu_put_be16(f, len);
+            qemu_put_buffer(f, xbzrle_encoded, len);
+            return len + 2;
         }
+    }
+
+    save_block_hdr(f, last, block, offset, RAM_SAVE_FLAG_PAGE);
+    ram_put_page(f, block, offset, p);
+    return TARGET_PAGE_SIZE;
+}
+
+static int ram_save_block(QEMUFile *f)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    int i;
 
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+    if (!ram_find_dirty_page(&block, &offset)) {
+        return 0;
+    }
+    if (ram_channels) {
+        /* Always the same channel for a page, see migration-channels.c */
+        i = ((block->offset + offset) >>
+             (TARGET_PAGE_BITS + RAM_CHANNEL_STRIPE_BITS)) % ram_n_channels;
+        return ram_send_page(migration_channel_file(ram_channels, i),
+                             &ram_channel_last_block[i], block, offset);
+    }
+    return ram_send_page(f, &last_sent_block, block, offset);
+}
+
+typedef struct RAMCompressPage {
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *data;              /* page contents to send */
+    int job;                    /* compression job, -1 for duplicate pages,
+                                   -2 for delta encoded pages */
+    int len;                    /* length of the delta encoding */
+} RAMCompressPage;
+
+static uint8_t *compress_encoded;       /* delta encodings of a batch */
+
+/* Like ram_save_block(), but collect a batch of dirty pages, compress them
+   in parallel and send them in order.  Returns the number of bytes sent. */
+static int ram_save_compressed_batch(QEMUFile *f)
+{
+    RAMCompressPage pages[RAM_COMPRESS_BATCH];
+    int i, n = 0, bytes_sent = 0;
+
+    while (n < RAM_COMPRESS_BATCH &&
+           ram_find_dirty_page(&pages[n].block, &pages[n].offset)) {
+        RAMCompressPage *page = &pages[n++];
+        uint8_t *p = page->block->host + page->offset;
+
+        page->data = p;
+        if (is_dup_page(p, *p)) {
+            page->job = -1;
+            continue;
         }
+        if (xbzrle_cache) {
+            page->len = ram_xbzrle_encode(page->block, page->offset,
+                                          &page->data, compress_encoded +
+                                          TARGET_PAGE_SIZE * (n - 1));
+            if (page->len) {
+                page->job = -2;
+                continue;
+            }
+        }
+        page->job = compress_pool_add(compress_pool, page->data);
+    }
 
-        current_addr = block->offset + offset;
+    compress_pool_run(compress_pool);
 
-    } while (current_addr != last_block->offset + last_offset);
+    for (i = 0; i < n; i++) {
+        uint8_t *p = pages[i].data;
+        const uint8_t *data;
+        size_t len;
 
-    last_block = block;
-    last_offset = offset;
+        if (pages[i].job == -1) {
+            save_block_hdr(f, &last_sent_block, pages[i].block,
+                           pages[i].offset, RAM_SAVE_FLAG_COMPRESS);
+            qemu_put_byte(f, *p);
+            ram_xbzrle_dup_page(pages[i].block, pages[i].offset, *p);
+            bytes_sent += 1;
+            continue;
+        }
+        if (pages[i].job == -2) {
+            save_block_hdr(f, &last_sent_block, pages[i].block,
+                           pages[i].offset, RAM_SAVE_FLAG_XBZRLE);
+            qemu_put_be16(f, pages[i].len);
+            qemu_put_buffer(f, compress_encoded + TARGET_PAGE_SIZE * i,
+                            pages[i].len);
+            bytes_sent += pages[i].len + 2;
+            continue;
+        }
+
+        data = compress_pool_result(compress_pool, pages[i].job, &len);
+        if (data) {
+            save_block_hdr(f, &last_sent_block, pages[i].block,
+                           pages[i].offset, RAM_SAVE_FLAG_ZLIB);
+            qemu_put_be16(f, len);
+            qemu_put_buffer(f, data, len);
+            bytes_sent += len + 2;
+        } else {
+            save_block_hdr(f, &last_sent_block, pages[i].block,
+                           pages[i].offset, RAM_SAVE_FLAG_PAGE);
+            ram_put_page(f, pages[i].block, pages[i].offset, p);
+            bytes_sent += TARGET_PAGE_SIZE;
+        }
+    }
+    compress_pool_clear(compress_pool);
 
     return bytes_sent;
 }
 
+static void ram_compress_stop(void)
+{
+    if (compress_pool) {
+        compress_pool_free(compress_pool);
+        compress_pool = NULL;
+    }
+    if (xbzrle_cache) {
+        xbzrle_cache_free(xbzrle_cache);
+        xbzrle_cache = NULL;
+    }
+    qemu_free(xbzrle_current);
+    qemu_free(xbzrle_encoded);
+    qemu_free(compress_encoded);
+    xbzrle_current = xbzrle_encoded = compress_encoded = NULL;
+}
+
 static uint64_t bytes_transferred;
 
+static void ram_channels_open(QEMUFile *f)
+{
+    ram_n_channels = migrate_channels();
+    ram_channels = migration_channels_open(ram_n_channels);
+    if (!ram_channels) {
+        qemu_file_set_error(f);
+        return;
+    }
+    memset(ram_channel_last_block, 0, sizeof(ram_channel_last_block));
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNELS);
+    qemu_put_be32(f, ram_n_channels);
+}
+
+/* Once all pages are queued, end the channels and tell the destination to
+   wait for them */
+static void ram_channels_finish(QEMUFile *f)
+{
+    int i;
+
+    for (i = 0; i < ram_n_channels; i++) {
+        qemu_put_be64(migration_channel_file(ram_channels, i),
+                      RAM_SAVE_FLAG_EOS);
+    }
+    if (migration_channels_finish(ram_channels) < 0) {
+        qemu_file_set_error(f);
+    }
+    ram_channels = NULL;
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNELS);
+    qemu_put_be32(f, 0);
+}
+
+static void ram_channels_abort(void)
+{
+    if (ram_channels) {
+        migration_channels_abort(ram_channels);
+        ram_channels = NULL;
+    }
+}
+
+static int ram_channels_rate_limit(QEMUFile *f)
+{
+    return ram_channels &&
+           migration_channels_rate_limit(ram_channels,
+                                         qemu_file_get_rate_limit(f));
+}
+
+/* Vcpu throttling for migrate_auto_converge(), in percent */
+#define RAM_THROTTLE_INITIAL    20
+#define RAM_THROTTLE_STEP       10
+/* Iterations predicted not to converge before throttling more */
+#define RAM_THROTTLE_STALLED    3
+/* Not converging unless the dirty backlog shrinks by at least 1/n of the
+   transfer rate */
+#define RAM_CONVERGE_MIN_GAIN   20
+
+/* Progress of the iterative phase, measured from one call of
+   ram_save_live() to the next.  Rates are in bytes of guest RAM per ns;
+   duplicate pages are cheap to send, so what gets sent is counted in
+   pages rather than in bytes of the stream. */
+static struct {
+    int64_t time;               /* start of the previous iteration */
+    ram_addr_t synced;          /* dirty pages it started with */
+    ram_addr_t remaining;       /* dirty pages left once it was done */
+    double dirty_rate;
+    double xfer_rate;
+    int iterations;
+    int stalled;
+} conv;
+
 static ram_addr_t ram_save_remaining(void)
 {
-    RAMBlock *block;
-    ram_addr_t count = 0;
+    return ram_list.migration_dirty_pages;
+}
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = block->offset; addr < block->offset + block->length;
-             addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-                count++;
-            }
-        }
+static void ram_convergence_start(void)
+{
+    memset(&conv, 0, sizeof(conv));
+    conv.time = qemu_get_clock_ns(rt_clock);
+    conv.synced = conv.remaining = ram_save_remaining();
+}
+
+/* Account what was sent and what the guest dirtied since the previous
+   iteration, called right after syncing the dirty bitmap */
+static void ram_convergence_update(void)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    double elapsed = now - conv.time;
+    double dirty_rate, xfer_rate;
+
+    if (elapsed <= 0) {
+        return;
+    }
+    dirty_rate = ram_save_remaining() > conv.remaining ?
+        (double)(ram_save_remaining() - conv.remaining) * TARGET_PAGE_SIZE /
+        elapsed : 0;
+    xfer_rate = (double)(conv.synced - conv.remaining) * TARGET_PAGE_SIZE /
+                elapsed;
+
+    /* Single iterations are noisy, keep a running average */
+    if (conv.iterations++) {
+        dirty_rate = (conv.dirty_rate + dirty_rate) / 2;
+        xfer_rate = (conv.xfer_rate + xfer_rate) / 2;
     }
+    conv.dirty_rate = dirty_rate;
+    conv.xfer_rate = xfer_rate;
+    conv.time = now;
+    conv.synced = ram_save_remaining();
+}
+
+/* Slow down the guest while it keeps dirtying memory faster than it can be
+   sent, or migration would never converge */
+static void ram_convergence_throttle(void)
+{
+    int throttle = cpu_throttle_get();
 
-    return count;
+    if (!migrate_auto_converge() || ram_converge_time() >= 0) {
+        conv.stalled = 0;
+        return;
+    }
+    if (++conv.stalled < RAM_THROTTLE_STALLED) {
+        return;
+    }
+    conv.stalled = 0;
+    cpu_throttle_set(throttle ? throttle + RAM_THROTTLE_STEP :
+                                RAM_THROTTLE_INITIAL);
+}
+
+/* Whether the remaining RAM can be sent within the maximum downtime */
+static int ram_converged(void)
+{
+    if (!ram_save_remaining()) {
+        return 1;
+    }
+    return conv.xfer_rate > 0 &&
+           ram_bytes_remaining() / conv.xfer_rate <= migrate_max_downtime();
+}
+
+int ram_iterations(void)
+{
+    return conv.iterations;
+}
+
+/* Smoothed rate at which the guest dirties memory, in bytes per second */
+uint64_t ram_dirty_rate(void)
+{
+    return conv.dirty_rate * 1e9;
+}
+
+/* Smoothed rate at which dirty RAM is sent, in bytes per second */
+uint64_t ram_transfer_rate(void)
+{
+    return conv.xfer_rate * 1e9;
+}
+
+/* Pause needed to send the remaining RAM with the guest stopped, in ms,
+   or -1 before the transfer rate is known */
+int64_t ram_expected_downtime(void)
+{
+    if (conv.xfer_rate <= 0) {
+        return -1;
+    }
+    return ram_bytes_remaining() / conv.xfer_rate / 1e6;
+}
+
+/* Predicted time until the remaining RAM fits within the maximum downtime,
+   in ms, or -1 if the guest dirties memory about as fast as it is sent */
+int64_t ram_converge_time(void)
+{
+    double excess, net;
+
+    excess = ram_bytes_remaining() - conv.xfer_rate * migrate_max_downtime();
+    if (excess <= 0) {
+        return 0;
+    }
+    net = conv.xfer_rate - conv.dirty_rate;
+    if (net <= conv.xfer_rate / RAM_CONVERGE_MIN_GAIN) {
+        return -1;
+    }
+    return excess / net / 1e6;
 }
 
 uint64_t ram_bytes_remaining(void)
@@ -246,15 +637,253 @@ static void sort_ram_list(void)
     qemu_free(blocks);
 }
 
+static void ram_save_block_list(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+}
+
+/*
+ * Incremental snapshots store RAM in place, in the VM state area of the
+ * image: every page at base plus its RAM address, base lying well past the
+ * end of the usual stream.  Zero pages are not stored, they are flagged in
+ * a bitmap in the stream instead.  After such a savevm or loadvm, the area
+ * holds the RAM of that snapshot, so the next savevm -i only has to write
+ * the pages dirtied since then.
+ */
+#define RAM_FLAT_ALIGN (1ULL << 30)
+#define RAM_FLAT_CHUNK 256          /* pages written or read at once */
+
+static struct {
+    BlockDriverState *bs;       /* drive holding the base, NULL if none */
+    char device[32];
+    int64_t base;
+    ram_addr_t size;            /* of the RAM address space */
+    uint8_t *zero;              /* one bit per page zero in the base */
+} ram_flat;
+
+static ram_addr_t ram_flat_size(void)
+{
+    RAMBlock *block;
+    ram_addr_t size = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        size = MAX(size, block->offset + block->length);
+    }
+    return size;
+}
+
+static int ram_flat_is_zero(ram_addr_t addr)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+
+    return ram_flat.zero[page / 8] & (1 << (page % 8));
+}
+
+static void ram_flat_set_zero(ram_addr_t addr, int zero)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+
+    if (zero) {
+        ram_flat.zero[page / 8] |= 1 << (page % 8);
+    } else {
+        ram_flat.zero[page / 8] &= ~(1 << (page % 8));
+    }
+}
+
+/* The bitmap of block as sent in the stream, one bit per page */
+static size_t ram_flat_bitmap_size(RAMBlock *block)
+{
+    return ((block->length >> TARGET_PAGE_BITS) + 7) / 8;
+}
+
+static void ram_flat_get_bitmap(RAMBlock *block, uint8_t *bitmap)
+{
+    ram_addr_t offset;
+
+    memset(bitmap, 0, ram_flat_bitmap_size(block));
+    for (offset = 0; offset < block->length; offset += TARGET_PAGE_SIZE) {
+        if (ram_flat_is_zero(block->offset + offset)) {
+            ram_addr_t page = offset >> TARGET_PAGE_BITS;
+
+            bitmap[page / 8] |= 1 << (page % 8);
+        }
+    }
+}
+
+static void ram_flat_put_bitmap(RAMBlock *block, const uint8_t *bitmap)
+{
+    ram_addr_t offset;
+
+    for (offset = 0; offset < block->length; offset += TARGET_PAGE_SIZE) {
+        ram_addr_t page = offset >> TARGET_PAGE_BITS;
+
+        ram_flat_set_zero(block->offset + offset,
+                          bitmap[page / 8] & (1 << (page % 8)));
+    }
+}
+
+static void ram_flat_reset(void)
+{
+    ram_flat.bs = NULL;
+    qemu_free(ram_flat.zero);
+    ram_flat.zero = NULL;
+    cpu_physical_memory_set_snapshot_tracking(0);
+}
+
+static void ram_flat_init(int64_t base)
+{
+    ram_flat_reset();
+    ram_flat.base = base;
+    ram_flat.size = ram_flat_size();
+    ram_flat.zero = qemu_mallocz(((ram_flat.size >> TARGET_PAGE_BITS) + 7) /
+                                 8);
+}
+
+/* The VM state area of bs now holds the RAM of the guest, track what the
+   guest dirties from here on */
+static void ram_flat_set_base(BlockDriverState *bs)
+{
+    RAMBlock *block;
+
+    ram_flat.bs = bs;
+    pstrcpy(ram_flat.device, sizeof(ram_flat.device),
+            bdrv_get_device_name(bs));
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        cpu_physical_memory_reset_dirty(block->offset,
+                                        block->offset + block->length,
+                                        SNAPSHOT_DIRTY_FLAG);
+    }
+    cpu_physical_memory_set_snapshot_tracking(1);
+}
+
+static int ram_save_flat(QEMUFile *f, BlockDriverState *bs)
+{
+    ram_addr_t size = ram_flat_size();
+    int64_t base = (2 * (int64_t)size + RAM_FLAT_ALIGN - 1) &
+                   ~(RAM_FLAT_ALIGN - 1);
+    RAMBlock *block;
+    uint8_t *bitmap;
+    int incremental, n = 0;
+
+    incremental = ram_flat.bs == bs &&
+                  !strcmp(ram_flat.device, bdrv_get_device_name(bs)) &&
+                  ram_flat.size == size && ram_flat.base == base;
+    if (!incremental) {
+        ram_flat_init(base);
+    }
+    /* the area is neither the base nor the new snapshot until complete */
+    ram_flat.bs = NULL;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ram_addr_t offset = 0, start;
+
+        while (offset < block->length) {
+            if (incremental &&
+                !cpu_physical_memory_get_dirty(block->offset + offset,
+                                               SNAPSHOT_DIRTY_FLAG)) {
+                offset += TARGET_PAGE_SIZE;
+                continue;
+            }
+            if (buffer_is_zero(block->host + offset, TARGET_PAGE_SIZE)) {
+                ram_flat_set_zero(block->offset + offset, 1);
+                offset += TARGET_PAGE_SIZE;
+                continue;
+            }
+
+            /* write a run of pages at once */
+            start = offset;
+            do {
+                ram_flat_set_zero(block->offset + offset, 0);
+                offset += TARGET_PAGE_SIZE;
+            } while (offset < block->length &&
+                     offset - start < RAM_FLAT_CHUNK * TARGET_PAGE_SIZE &&
+                     (!incremental ||
+                      cpu_physical_memory_get_dirty(block->offset + offset,
+                                                    SNAPSHOT_DIRTY_FLAG)) &&
+                     !buffer_is_zero(block->host + offset, TARGET_PAGE_SIZE));
+
+            if (bdrv_save_vmstate(bs, block->host + start,
+                                  base + block->offset + start,
+                                  offset - start) < 0) {
+                ram_flat_reset();
+                qemu_file_set_error(f);
+                return -EIO;
+            }
+        }
+        n++;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_FLAT);
+    qemu_put_be64(f, base);
+    qemu_put_be32(f, n);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+
+        bitmap = qemu_malloc(ram_flat_bitmap_size(block));
+        ram_flat_get_bitmap(block, bitmap);
+        qemu_put_buffer(f, bitmap, ram_flat_bitmap_size(block));
+        qemu_free(bitmap);
+    }
+
+    ram_flat_set_base(bs);
+    return 0;
+}
+
+/* savevm -i: all of RAM is written once the VM is stopped */
+static int ram_save_live_flat(QEMUFile *f, int stage, BlockDriverState *bs)
+{
+    if (stage == 1) {
+        sort_ram_list();
+        ram_save_block_list(f);
+    } else if (stage == 3) {
+        if (ram_save_flat(f, bs) < 0) {
+            return 0;
+        }
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return stage == 2;
+}
+
+/* Set while pre-copy sends RAM from the dirty bitmap */
+static int ram_precopy_active;
+
+/* The guest gave up [start, start + len) and the host dropped it.  Until
+ * the guest writes those pages again, which dirties them anew, pre-copy need
+ * not send them: their content is of no use to the guest.  Post-copy and
+ * flat snapshots send every page exactly once, so they keep them. */
+void ram_discard_range(ram_addr_t start, ram_addr_t len)
+{
+    if (ram_precopy_active) {
+        cpu_physical_memory_reset_dirty(start, start + len,
+                                        MIGRATION_DIRTY_FLAG);
+    }
+}
+
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
     ram_addr_t addr;
-    uint64_t bytes_transferred_last;
-    double bwidth = 0;
-    uint64_t expected_time = 0;
+
+    if (stage != 2) {
+        cpu_throttle_set(0);
+        ram_precopy_active = 0;
+    }
 
     if (stage < 0) {
         cpu_physical_memory_set_dirty_tracking(0);
+        ram_compress_stop();
+        ram_channels_abort();
         return 0;
     }
 
@@ -263,13 +892,35 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         return 0;
     }
 
+    if (savevm_incremental() && qemu_file_bdrv(f)) {
+        return ram_save_live_flat(f, stage, qemu_file_bdrv(f));
+    }
+
     if (stage == 1) {
         RAMBlock *block;
         bytes_transferred = 0;
         last_block = NULL;
         last_offset = 0;
+        last_sent_block = NULL;
         sort_ram_list();
 
+        ram_compress_stop();
+        ram_channels_abort();
+        if (migrate_compress_threads() > 0) {
+            compress_pool = compress_pool_new(migrate_compress_threads(),
+                                              migrate_compress_level(),
+                                              TARGET_PAGE_SIZE,
+                                              RAM_COMPRESS_BATCH);
+            compress_encoded = qemu_malloc(TARGET_PAGE_SIZE *
+                                           RAM_COMPRESS_BATCH);
+        }
+        if (migrate_xbzrle_cache_size() > 0) {
+            xbzrle_cache = xbzrle_cache_new(migrate_xbzrle_cache_size(),
+                                            TARGET_PAGE_SIZE);
+            xbzrle_current = qemu_malloc(TARGET_PAGE_SIZE);
+            xbzrle_encoded = qemu_malloc(TARGET_PAGE_SIZE);
+        }
+
         /* Make sure all dirty bits are set */
         QLIST_FOREACH(block, &ram_list.blocks, next) {
             for (addr = block->offset; addr < block->offset + block->length;
@@ -284,70 +935,143 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         /* Enable dirty memory tracking */
         cpu_physical_memory_set_dirty_tracking(1);
 
-        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+        ram_save_block_list(f);
 
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            qemu_put_byte(f, strlen(block->idstr));
-            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-            qemu_put_be64(f, block->length);
+        /* Compressed batches and post-copy pages go on the main channel */
+        if (migrate_channels() > 1 && !compress_pool && !migrate_postcopy()) {
+            ram_channels_open(f);
+            if (!ram_channels) {
+                return 0;
+            }
+        }
+        ram_convergence_start();
+    } else {
+        ram_convergence_update();
+    }
+
+    if (migrate_postcopy()) {
+        /* All of RAM follows the device state, see ram_postcopy_push() */
+        if (stage == 3) {
+            last_sent_block = NULL;
+            qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+            cpu_physical_memory_set_dirty_tracking(0);
+            ram_compress_stop();
         }
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return stage == 2;
+    }
+    if (stage == 1) {
+        ram_precopy_active = 1;
     }
 
-    bytes_transferred_last = bytes_transferred;
-    bwidth = qemu_get_clock_ns(rt_clock);
+    if (ram_channels && migration_channels_has_error(ram_channels)) {
+        qemu_file_set_error(f);
+        return 0;
+    }
 
-    while (!qemu_file_rate_limit(f)) {
+    while (!qemu_file_rate_limit(f) && !ram_channels_rate_limit(f)) {
         int bytes_sent;
 
-        bytes_sent = ram_save_block(f);
+        bytes_sent = compress_pool ? ram_save_compressed_batch(f) :
+                                     ram_save_block(f);
         bytes_transferred += bytes_sent;
         if (bytes_sent == 0) { /* no more blocks */
             break;
         }
     }
 
-    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
-    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
-
-    /* if we haven't transferred anything this round, force expected_time to a
-     * a very high value, but without crashing */
-    if (bwidth == 0) {
-        bwidth = 0.000001;
-    }
+    conv.remaining = ram_save_remaining();
 
     /* try transferring iterative blocks of memory */
     if (stage == 3) {
         int bytes_sent;
 
         /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
+        while ((bytes_sent = compress_pool ? ram_save_compressed_batch(f) :
+                                             ram_save_block(f)) != 0) {
             bytes_transferred += bytes_sent;
         }
+        if (ram_channels) {
+            ram_channels_finish(f);
+        }
         cpu_physical_memory_set_dirty_tracking(0);
+        ram_compress_stop();
     }
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    if (stage != 2) {
+        return 0;
+    }
+    if (ram_converged()) {
+        return 1;
+    }
+    ram_convergence_throttle();
+    return 0;
+}
+
+/* Push the pages a post-copy destination did not ask for yet.  Returns 1
+   once all are sent, 0 if rate limited, -1 on error. */
+int ram_postcopy_push(QEMUFile *f)
+{
+    int bytes_sent;
 
-    return (stage == 2) && (expected_time <= migrate_max_downtime());
+    while (!qemu_file_rate_limit(f)) {
+        bytes_sent = ram_save_block(f);
+        bytes_transferred += bytes_sent;
+        if (bytes_sent == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(f);
+            return qemu_file_has_error(f) ? -1 : 1;
+        }
+    }
+    return qemu_file_has_error(f) ? -1 : 0;
 }
 
+/* Send the page a post-copy destination faulted on, unless already sent */
+void ram_postcopy_request(QEMUFile *f, const char *idstr, uint64_t offset)
+{
+    RAMBlock *block;
+    ram_addr_t addr;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            break;
+        }
+    }
+    offset &= TARGET_PAGE_MASK;
+    if (!block || offset >= block->length) {
+        fprintf(stderr, "post-copy: bad page request %s+0x%" PRIx64 "\n",
+                idstr, offset);
+        return;
+    }
+
+    addr = block->offset + offset;
+    if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
+        cpu_physical_memory_reset_dirty(addr, addr + TARGET_PAGE_SIZE,
+                                        MIGRATION_DIRTY_FLAG);
+        bytes_transferred += ram_send_page(f, &last_sent_block, block,
+                                           offset);
+    }
+}
+
+/* *pblock is the block of the previous page loaded from f */
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
-                                            int flags)
+                                            int flags,
+                                            RAMBlock **pblock)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!*pblock) {
             fprintf(stderr, "Ack, bad migration stream!\n");
             return NULL;
         }
 
-        return block->host + offset;
+        return (*pblock)->host + offset;
     }
 
     len = qemu_get_byte(f);
@@ -355,22 +1079,374 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     id[len] = 0;
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *pblock = block;
             return block->host + offset;
+        }
     }
 
     fprintf(stderr, "Can't find block %s!\n", id);
     return NULL;
 }
 
+/* Runs in the post-copy load thread, with the guest running */
+static int ram_postcopy_load(void *opaque)
+{
+    QEMUFile *f = opaque;
+    uint8_t buf[TARGET_PAGE_SIZE];
+    RAMBlock *block = NULL;
+    ram_addr_t addr;
+    void *host;
+    int flags, ret;
+
+    for (;;) {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (qemu_file_has_error(f)) {
+            return -EIO;
+        }
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            return 0;
+        }
+
+        host = host_from_stream_offset(f, addr, flags, &block);
+        if (!host) {
+            return -EINVAL;
+        }
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            uint8_t ch = qemu_get_byte(f);
+
+            if (ch == 0) {
+                ret = postcopy_place_zero_page(host);
+            } else {
+                memset(buf, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, buf);
+            }
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+            ret = postcopy_place_page(host, buf);
+        } else {
+            return -EINVAL;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+#define RAM_PAGE_FLAGS (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE | \
+                        RAM_SAVE_FLAG_ZLIB | RAM_SAVE_FLAG_XBZRLE)
+
+/* Load the page of a record with RAM_PAGE_FLAGS */
+static int ram_load_page(QEMUFile *f, ram_addr_t addr, int flags,
+                         RAMBlock **pblock, int version_id)
+{
+    void *host;
+
+    if (version_id == 3) {
+        host = qemu_get_ram_ptr(addr);
+    } else {
+        host = host_from_stream_offset(f, addr, flags, pblock);
+    }
+    if (!host) {
+        return -EINVAL;
+    }
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        __sync_fetch_and_add(&ram_load_pages.cont, 1);
+    }
+
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        uint8_t ch;
+
+        __sync_fetch_and_add(&ram_load_pages.dup, 1);
+
+        ch = qemu_get_byte(f);
+        memset(host, ch, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+        if (ch == 0 &&
+            (!kvm_enabled() || kvm_has_sync_mmu())) {
+            qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+        }
+#endif
+    } else if (flags & RAM_SAVE_FLAG_PAGE) {
+        __sync_fetch_and_add(&ram_load_pages.full, 1);
+        qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+    } else if (flags & RAM_SAVE_FLAG_ZLIB) {
+        uint8_t buf[TARGET_PAGE_SIZE];
+        uLongf host_len = TARGET_PAGE_SIZE;
+        int len;
+
+        __sync_fetch_and_add(&ram_load_pages.zlib, 1);
+        len = qemu_get_be16(f);
+        if (len >= TARGET_PAGE_SIZE) {
+            return -EINVAL;
+        }
+        qemu_get_buffer(f, buf, len);
+        if (uncompress(host, &host_len, buf, len) != Z_OK ||
+            host_len != TARGET_PAGE_SIZE) {
+            fprintf(stderr, "Corrupt compressed page in migration stream\n");
+            return -EINVAL;
+        }
+    } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+        uint8_t buf[TARGET_PAGE_SIZE];
+        int len;
+
+        __sync_fetch_and_add(&ram_load_pages.xbzrle, 1);
+        len = qemu_get_be16(f);
+        if (len >= TARGET_PAGE_SIZE) {
+            return -EINVAL;
+        }
+        qemu_get_buffer(f, buf, len);
+        if (xbzrle_decode(buf, len, host, TARGET_PAGE_SIZE) < 0) {
+            fprintf(stderr, "Corrupt delta encoded page in migration "
+                    "stream\n");
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/* Runs in a thread per channel of a multi-channel migration */
+static int ram_channel_load(QEMUFile *f)
+{
+    RAMBlock *block = NULL;
+    ram_addr_t addr;
+    int flags, ret;
+
+    for (;;) {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (qemu_file_has_error(f)) {
+            return -EIO;
+        }
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            return 0;
+        }
+        if (!(flags & RAM_PAGE_FLAGS)) {
+            return -EINVAL;
+        }
+        ret = ram_load_page(f, addr, flags, &block, 4);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+static int ram_load_flat_block(BlockDriverState *bs, RAMBlock *block)
+{
+    ram_addr_t offset, n, i, zero;
+
+    for (offset = 0; offset < block->length; offset += n * TARGET_PAGE_SIZE) {
+        uint8_t *host = block->host + offset;
+
+        n = MIN(RAM_FLAT_CHUNK, (block->length - offset) >> TARGET_PAGE_BITS);
+        for (i = zero = 0; i < n; i++) {
+            zero += ram_flat_is_zero(block->offset + offset +
+                                     i * TARGET_PAGE_SIZE);
+        }
+
+        if (zero == n) {
+            memset(host, 0, n * TARGET_PAGE_SIZE);
+#ifndef _WIN32
+            if (!kvm_enabled() || kvm_has_sync_mmu()) {
+                qemu_madvise(host, n * TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+            }
+#endif
+            continue;
+        }
+
+        if (bdrv_load_vmstate(bs, host, ram_flat.base + block->offset + offset,
+                              n * TARGET_PAGE_SIZE) < 0) {
+            return -EIO;
+        }
+        /* the area may still hold an older version of zero pages */
+        for (i = 0; i < n && zero; i++) {
+            if (ram_flat_is_zero(block->offset + offset +
+                                 i * TARGET_PAGE_SIZE)) {
+                memset(host + i * TARGET_PAGE_SIZE, 0, TARGET_PAGE_SIZE);
+            }
+        }
+    }
+    return 0;
+}
+
+/* RAM stored in place in the VM state, see ram_save_flat() */
+static int ram_load_flat(QEMUFile *f)
+{
+    BlockDriverState *bs = qemu_file_bdrv(f);
+    RAMBlock *block;
+    uint8_t *bitmap;
+    int64_t base;
+    int n, lazy, ret = 0;
+
+    base = qemu_get_be64(f);
+    n = qemu_get_be32(f);
+    if (!bs) {
+        fprintf(stderr, "RAM stored in place can only be loaded from a "
+                "snapshot\n");
+        return -EINVAL;
+    }
+
+    ram_flat_init(base);
+    while (n-- > 0) {
+        char id[256];
+        ram_addr_t length;
+        uint8_t len;
+
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        length = qemu_get_be64(f);
+
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || block->length != length) {
+            fprintf(stderr, "Unknown ramblock \"%s\", cannot load "
+                    "snapshot\n", id);
+            ram_flat_reset();
+            return -EINVAL;
+        }
+
+        bitmap = qemu_malloc(ram_flat_bitmap_size(block));
+        qemu_get_buffer(f, bitmap, ram_flat_bitmap_size(block));
+        ram_flat_put_bitmap(block, bitmap);
+        qemu_free(bitmap);
+    }
+    if (qemu_file_has_error(f)) {
+        ram_flat_reset();
+        return -EIO;
+    }
+
+    lazy = 0;
+    if (loadvm_lazy()) {
+        /* Pages go straight into anonymous memory, as for post-copy */
+        lazy = !mem_path && lazy_restore_init(bs, TARGET_PAGE_SIZE) == 0;
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!lazy) {
+                break;
+            }
+            bitmap = qemu_malloc(ram_flat_bitmap_size(block));
+            ram_flat_get_bitmap(block, bitmap);
+            lazy = lazy_restore_add_block(block->idstr, block->host,
+                                          block->length, base + block->offset,
+                                          bitmap) == 0;
+            qemu_free(bitmap);
+        }
+        if (lazy && lazy_restore_start() < 0) {
+            lazy = 0;
+        }
+        if (!lazy) {
+            lazy_restore_abort();
+            fprintf(stderr, "cannot restore RAM lazily, restoring all of it "
+                    "now\n");
+        }
+    }
+
+    if (!lazy) {
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            ret = ram_load_flat_block(bs, block);
+            if (ret < 0) {
+                ram_flat_reset();
+                return ret;
+            }
+        }
+    }
+
+    ram_flat_set_base(bs);
+    return 0;
+}
+
+/* Read past RAM in the stream without touching guest memory, for
+   loadvm_skip_ram(); only the framing of each record is looked at */
+static int ram_skip(QEMUFile *f, int version_id)
+{
+    uint8_t buf[TARGET_PAGE_SIZE];
+    ram_addr_t addr;
+    int flags, len;
+
+    do {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if ((flags & RAM_SAVE_FLAG_MEM_SIZE) && version_id == 4) {
+            ram_addr_t total_ram_bytes = addr;
+
+            while (total_ram_bytes && !qemu_file_has_error(f)) {
+                len = qemu_get_byte(f);
+                qemu_get_buffer(f, buf, len);
+                total_ram_bytes -= qemu_get_be64(f);
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_FLAT) {
+            int n;
+
+            qemu_get_be64(f);
+            n = qemu_get_be32(f);
+            while (n-- > 0 && !qemu_file_has_error(f)) {
+                ram_addr_t bitmap_size;
+
+                len = qemu_get_byte(f);
+                qemu_get_buffer(f, buf, len);
+                bitmap_size = ((qemu_get_be64(f) >> TARGET_PAGE_BITS) + 7) / 8;
+                while (bitmap_size && !qemu_file_has_error(f)) {
+                    len = MIN(bitmap_size, sizeof(buf));
+                    qemu_get_buffer(f, buf, len);
+                    bitmap_size -= len;
+                }
+            }
+        }
+
+        /* The pages themselves went over connections of their own */
+        if (flags & RAM_SAVE_FLAG_CHANNELS) {
+            qemu_get_be32(f);
+        }
+
+        if (flags & RAM_PAGE_FLAGS) {
+            if (version_id == 4 && !(flags & RAM_SAVE_FLAG_CONTINUE)) {
+                len = qemu_get_byte(f);
+                qemu_get_buffer(f, buf, len);
+            }
+            if (flags & RAM_SAVE_FLAG_COMPRESS) {
+                qemu_get_byte(f);
+            } else if (flags & RAM_SAVE_FLAG_PAGE) {
+                qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+            } else {
+                len = qemu_get_be16(f);
+                if (len >= TARGET_PAGE_SIZE) {
+                    return -EINVAL;
+                }
+                qemu_get_buffer(f, buf, len);
+            }
+        }
+        if (qemu_file_has_error(f)) {
+            return -EIO;
+        }
+    } while (!(flags & RAM_SAVE_FLAG_EOS));
+
+    return 0;
+}
+
 int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
+    static RAMBlock *block;
     ram_addr_t addr;
-    int flags;
+    int flags, ret;
 
     if (version_id < 3 || version_id > 4) {
         return -EINVAL;
     }
+    if (loadvm_skip_ram()) {
+        return ram_skip(f, version_id);
+    }
 
     do {
         addr = qemu_get_be64(f);
@@ -379,6 +1455,10 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
         addr &= TARGET_PAGE_MASK;
 
         if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
+            /* Whatever RAM an incremental snapshot was based on is gone */
+            ram_flat_reset();
+            memset(&ram_load_pages, 0, sizeof(ram_load_pages));
+
             if (version_id == 3) {
                 if (addr != ram_bytes_total()) {
                     return -EINVAL;
@@ -417,35 +1497,58 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
-            void *host;
-            uint8_t ch;
-
-            if (version_id == 3)
-                host = qemu_get_ram_ptr(addr);
-            else
-                host = host_from_stream_offset(f, addr, flags);
-            if (!host) {
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            RAMBlock *block;
+
+            /* Pages go straight into anonymous memory */
+            if (mem_path) {
+                fprintf(stderr, "post-copy migration does not support "
+                        "-mem-path\n");
+                return -EINVAL;
+            }
+            if (postcopy_incoming_init(TARGET_PAGE_SIZE,
+                                       ram_postcopy_load) < 0) {
                 return -EINVAL;
             }
+            QLIST_FOREACH(block, &ram_list.blocks, next) {
+                postcopy_incoming_add_range(block->idstr, block->host,
+                                            block->length);
+            }
+        }
 
-            ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
-#ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+        if (flags & RAM_SAVE_FLAG_FLAT) {
+            ret = ram_load_flat(f);
+            if (ret < 0) {
+                return ret;
             }
-#endif
-        } else if (flags & RAM_SAVE_FLAG_PAGE) {
-            void *host;
+        }
 
-            if (version_id == 3)
-                host = qemu_get_ram_ptr(addr);
-            else
-                host = host_from_stream_offset(f, addr, flags);
+        if (flags & RAM_SAVE_FLAG_CHANNELS) {
+            static MigrationChannels *channels;
+            int n = qemu_get_be32(f);
+
+            /* Sent with the count when starting, 0 once all is sent */
+            if (n > 0 && !channels) {
+                channels = migration_channels_accept(n, ram_channel_load);
+                if (!channels) {
+                    return -EINVAL;
+                }
+            } else if (n == 0 && channels) {
+                ret = migration_channels_join(channels);
+                channels = NULL;
+                if (ret < 0) {
+                    return ret;
+                }
+            } else {
+                return -EINVAL;
+            }
+        }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        if (flags & RAM_PAGE_FLAGS) {
+            ret = ram_load_page(f, addr, flags, &block, version_id);
+            if (ret < 0) {
+                return ret;
+            }
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
@@ -455,6 +1558,18 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+/* Pages of the last incoming RAM state by encoding; "continue" counts the
+   pages of any encoding that did not repeat the name of their block */
+QObject *ram_load_page_stats(void)
+{
+    return qobject_from_jsonf("{ 'dup': %" PRId64 ", 'full': %" PRId64
+                              ", 'zlib': %" PRId64 ", 'xbzrle': %" PRId64
+                              ", 'continue': %" PRId64 " }",
+                              ram_load_pages.dup, ram_load_pages.full,
+                              ram_load_pages.zlib, ram_load_pages.xbzrle,
+                              ram_load_pages.cont);
+}
+
 void qemu_service_io(void)
 {
     qemu_notify_event();
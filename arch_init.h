@@ -23,6 +23,8 @@ extern const uint32_t arch_type;
 void select_soundhw(const char *optarg);
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
+int ram_postcopy_push(QEMUFile *f);
+void ram_postcopy_request(QEMUFile *f, const char *idstr, uint64_t offset);
 void do_acpitable_option(const char *optarg);
 void do_smbios_option(const char *optarg);
 void cpudef_init(void);
@@ -24,6 +24,8 @@
 
 #include "qemu-common.h"
 #include "qemu-aio.h"
+#include "qemu-queue.h"
+#include "qemu-barrier.h"
 
 /*
  * An AsyncContext protects the callbacks of AIO requests and Bottom Halves
@@ -48,8 +50,12 @@ struct AsyncContext {
     /* Consecutive number of the AsyncContext (position in the stack) */
     int id;
 
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
+    /* All the Bottom Halves belonging to the context */
+    QLIST_HEAD(, QEMUBH) bhs;
+
+    /* Bottom Halves scheduled or deleted since the last poll, most recent
+     * first.  Any thread may push to it, only qemu_bh_poll() takes from it */
+    struct QEMUBH *pending;
 
     /* Link to parent context */
     struct AsyncContext *parent;
@@ -58,6 +64,8 @@ struct AsyncContext {
 /* The currently active AsyncContext */
 static struct AsyncContext *async_context = &(struct AsyncContext) { 0 };
 
+static void bh_context_move(struct AsyncContext *from, struct AsyncContext *to);
+
 /*
  * Enter a new AsyncContext. Already scheduled Bottom Halves and AIO callbacks
  * won't be called until this context is left again.
@@ -92,12 +100,14 @@ void async_context_pop(void)
 
     /* Switch back to the parent context */
     async_context = async_context->parent;
-    qemu_free(old);
-
     if (async_context == NULL) {
         abort();
     }
 
+    /* The parent takes over the Bottom Halves that are left */
+    bh_context_move(old, async_context);
+    qemu_free(old);
+
     /* Schedule BH to run any queued AIO completions as soon as possible */
     bh = qemu_malloc(sizeof(*bh));
     *bh = qemu_bh_new(bh_run_aio_completions, bh);
@@ -121,28 +131,91 @@ struct QEMUBH {
     int scheduled;
     int idle;
     int deleted;
-    QEMUBH *next;
+    int queued;                 /* on the pending list of its context */
+    struct AsyncContext *ctx;
+    QLIST_ENTRY(QEMUBH) entry;
+    QEMUBH *pending_next;
 };
 
+/* Put bh on the pending list of its context unless it already is, so that
+ * the next qemu_bh_poll() looks at it. */
+static void bh_queue(QEMUBH *bh)
+{
+    struct AsyncContext *ctx = bh->ctx;
+    QEMUBH *head;
+
+    /* pairs with the barrier in qemu_bh_poll(): either it sees the flags
+     * that were just set, or it has already unqueued bh and it is pushed
+     * again here */
+    smp_mb();
+    if (!__sync_bool_compare_and_swap(&bh->queued, 0, 1)) {
+        return;
+    }
+    do {
+        head = ctx->pending;
+        bh->pending_next = head;
+    } while (!__sync_bool_compare_and_swap(&ctx->pending, head, bh));
+}
+
+/* Take the pending list of ctx, in the order the Bottom Halves were queued */
+static QEMUBH *bh_take_pending(struct AsyncContext *ctx)
+{
+    QEMUBH *bh, *next, *list = NULL;
+
+    bh = __sync_lock_test_and_set(&ctx->pending, NULL);
+    while (bh) {
+        next = bh->pending_next;
+        bh->pending_next = list;
+        list = bh;
+        bh = next;
+    }
+    return list;
+}
+
+static void bh_context_move(struct AsyncContext *from, struct AsyncContext *to)
+{
+    QEMUBH *bh, *next;
+
+    QLIST_FOREACH_SAFE(bh, &from->bhs, entry, next) {
+        QLIST_REMOVE(bh, entry);
+        bh->ctx = to;
+        QLIST_INSERT_HEAD(&to->bhs, bh, entry);
+    }
+    for (bh = bh_take_pending(from); bh; bh = next) {
+        next = bh->pending_next;
+        bh->queued = 0;
+        bh_queue(bh);
+    }
+}
+
 QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
 {
     QEMUBH *bh;
     bh = qemu_mallocz(sizeof(QEMUBH));
     bh->cb = cb;
     bh->opaque = opaque;
-    bh->next = async_context->first_bh;
-    async_context->first_bh = bh;
+    bh->ctx = async_context;
+    QLIST_INSERT_HEAD(&async_context->bhs, bh, entry);
     return bh;
 }
 
+/* Only the Bottom Halves that were queued are looked at */
 int qemu_bh_poll(void)
 {
-    QEMUBH *bh, **bhp;
+    QEMUBH *bh, *next;
     int ret;
 
     ret = 0;
-    for (bh = async_context->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
+    for (bh = bh_take_pending(async_context); bh; bh = next) {
+        /* the callback may queue bh again */
+        next = bh->pending_next;
+        bh->queued = 0;
+        smp_mb();
+
+        if (bh->deleted) {
+            QLIST_REMOVE(bh, entry);
+            qemu_free(bh);
+        } else if (bh->scheduled) {
             bh->scheduled = 0;
             if (!bh->idle)
                 ret = 1;
@@ -151,17 +224,6 @@ int qemu_bh_poll(void)
         }
     }
 
-    /* remove deleted bhs */
-    bhp = &async_context->first_bh;
-    while (*bhp) {
-        bh = *bhp;
-        if (bh->deleted) {
-            *bhp = bh->next;
-            qemu_free(bh);
-        } else
-            bhp = &bh->next;
-    }
-
     return ret;
 }
 
@@ -171,14 +233,16 @@ void qemu_bh_schedule_idle(QEMUBH *bh)
         return;
     bh->scheduled = 1;
     bh->idle = 1;
+    bh_queue(bh);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
     if (bh->scheduled)
         return;
-    bh->scheduled = 1;
     bh->idle = 0;
+    bh->scheduled = 1;
+    bh_queue(bh);
     /* stop the currently executing CPU to execute the BH ASAP */
     qemu_notify_event();
 }
@@ -188,22 +252,24 @@ void qemu_bh_cancel(QEMUBH *bh)
     bh->scheduled = 0;
 }
 
+/* bh is freed by the next qemu_bh_poll() of its context */
 void qemu_bh_delete(QEMUBH *bh)
 {
     bh->scheduled = 0;
     bh->deleted = 1;
+    bh_queue(bh);
 }
 
-void qemu_bh_update_timeout(int *timeout)
+void qemu_bh_update_timeout(int64_t *timeout)
 {
     QEMUBH *bh;
 
-    for (bh = async_context->first_bh; bh; bh = bh->next) {
+    for (bh = async_context->pending; bh; bh = bh->pending_next) {
         if (!bh->deleted && bh->scheduled) {
             if (bh->idle) {
                 /* idle bottom halves will be polled at least
                  * every 10ms */
-                *timeout = MIN(10, *timeout);
+                *timeout = MIN(10000000, *timeout);
             } else {
                 /* non-idle bottom halves will be executed
                  * immediately */
@@ -1003,13 +1003,27 @@ static int audio_pcm_hw_get_live_out (HWVoiceOut *hw, int *nb_live)
     return 0;
 }
 
+/* Whether len samples at buf are what audio_pcm_info_clear_buf() writes,
+   for the formats where that is a single repeated byte */
+static int audio_pcm_info_is_silent (struct audio_pcm_info *info, void *buf,
+                                     int len)
+{
+    if (info->sign) {
+        return buffer_is_filled (buf, 0x00, len << info->shift);
+    }
+    if (info->bits == 8) {
+        return buffer_is_filled (buf, 0x80, len << info->shift);
+    }
+    return 0;
+}
+
 /*
  * Soft voice (playback)
  */
 int audio_pcm_sw_write (SWVoiceOut *sw, void *buf, int size)
 {
     int hwsamples, samples, isamp, osamp, wpos, live, dead, left, swlim, blck;
-    int ret = 0, pos = 0, total = 0;
+    int ret = 0, pos = 0, total = 0, silent;
 
     if (!sw) {
         return size;
@@ -1036,7 +1050,13 @@ int audio_pcm_sw_write (SWVoiceOut *sw, void *buf, int size)
     dead = hwsamples - live;
     swlim = ((int64_t) dead << 32) / sw->ratio;
     swlim = audio_MIN (swlim, samples);
-    if (swlim) {
+    /* Mixing silence in leaves hw->mix_buf as it is, only the positions
+       need to move */
+    silent = audio_pcm_info_is_silent (&sw->info, buf, swlim);
+#ifdef CONFIG_MIXEMU
+    silent |= sw->vol.mute;
+#endif
+    if (swlim && !silent) {
         sw->conv (sw->buf, buf, swlim);
         mixeng_volume (sw->buf, swlim, &sw->vol);
     }
@@ -1050,7 +1070,7 @@ int audio_pcm_sw_write (SWVoiceOut *sw, void *buf, int size)
         }
         isamp = swlim;
         osamp = blck;
-        st_rate_flow_mix (
+        (silent ? st_rate_flow_skip : st_rate_flow_mix) (
             sw->rate,
             sw->buf + pos,
             sw->hw->mix_buf + wpos,
@@ -1114,7 +1134,7 @@ static int audio_is_timer_needed (void)
 static void audio_reset_timer (AudioState *s)
 {
     if (audio_is_timer_needed ()) {
-        qemu_mod_timer (s->ts, qemu_get_clock (vm_clock) + 1);
+        qemu_mod_timer (s->ts, qemu_get_clock (vm_clock) + conf.period.ticks);
     }
     else {
         qemu_del_timer (s->ts);
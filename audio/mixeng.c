@@ -28,6 +28,10 @@
 #define AUDIO_CAP "mixeng"
 #include "audio_int.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* 8 bit */
 #define ENDIAN_CONVERSION natural
 #define ENDIAN_CONVERT(v) (v)
@@ -143,6 +147,85 @@
 #undef IN_T
 #undef SHIFT
 
+#if defined(__SSE2__) && !defined(FLOAT_MIXENG)
+/* Signed 16 bit stereo in host byte order is what both ends of the mixing
+   buffer use by default, so convert it eight values at a time.  A stereo
+   st_sample is the same values as the input, widened to 64 bit. */
+
+static inline void conv_s16_store4 (int64_t *out, __m128i v)
+{
+    __m128i sign = _mm_srai_epi32 (v, 31);
+
+    _mm_storeu_si128 ((__m128i *) out,
+                      _mm_slli_epi64 (_mm_unpacklo_epi32 (v, sign), 16));
+    _mm_storeu_si128 ((__m128i *) (out + 2),
+                      _mm_slli_epi64 (_mm_unpackhi_epi32 (v, sign), 16));
+}
+
+static void conv_natural_int16_t_to_stereo_sse2
+    (struct st_sample *dst, const void *src, int samples)
+{
+    const int16_t *in = src;
+    int64_t *out = (int64_t *) dst;
+    int i, n = samples * 2;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128 ((const __m128i *) (in + i));
+
+        conv_s16_store4 (out + i, _mm_srai_epi32 (_mm_unpacklo_epi16 (x, x), 16));
+        conv_s16_store4 (out + i + 4,
+                         _mm_srai_epi32 (_mm_unpackhi_epi16 (x, x), 16));
+    }
+    conv_natural_int16_t_to_stereo (dst + i / 2, in + i, (n - i) / 2);
+}
+
+static inline __m128i clip_s16_select (__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128 (_mm_and_si128 (mask, a), _mm_andnot_si128 (mask, b));
+}
+
+/* Four values clipped like clip_natural_int16_t(), as 32 bit integers */
+static inline __m128i clip_s16_load4 (const int64_t *in)
+{
+    __m128i a = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) in),
+                                   _MM_SHUFFLE (3, 1, 2, 0));
+    __m128i b = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) (in + 2)),
+                                   _MM_SHUFFLE (3, 1, 2, 0));
+    __m128i lo = _mm_unpacklo_epi64 (a, b);
+    __m128i hi = _mm_unpackhi_epi64 (a, b);
+    __m128i max = _mm_set1_epi32 (SHRT_MAX);
+    __m128i min = _mm_set1_epi32 (SHRT_MIN);
+    /* the value fits in 32 bits if the high half only repeats the sign */
+    __m128i fits = _mm_cmpeq_epi32 (hi, _mm_srai_epi32 (lo, 31));
+    __m128i big = _mm_cmpgt_epi32 (lo, _mm_set1_epi32 (0x7effffff));
+    __m128i val = clip_s16_select (big, max, _mm_srai_epi32 (lo, 16));
+    __m128i sat = clip_s16_select (_mm_srai_epi32 (hi, 31), min, max);
+
+    return clip_s16_select (fits, val, sat);
+}
+
+static void clip_natural_int16_t_from_stereo_sse2
+    (void *dst, const struct st_sample *src, int samples)
+{
+    const int64_t *in = (const int64_t *) src;
+    int16_t *out = dst;
+    int i, n = samples * 2;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        _mm_storeu_si128 ((__m128i *) (out + i),
+                          _mm_packs_epi32 (clip_s16_load4 (in + i),
+                                           clip_s16_load4 (in + i + 4)));
+    }
+    clip_natural_int16_t_from_stereo (out + i, src + i / 2, (n - i) / 2);
+}
+
+#define CONV_NATURAL_S16_STEREO conv_natural_int16_t_to_stereo_sse2
+#define CLIP_NATURAL_S16_STEREO clip_natural_int16_t_from_stereo_sse2
+#else
+#define CONV_NATURAL_S16_STEREO conv_natural_int16_t_to_stereo
+#define CLIP_NATURAL_S16_STEREO clip_natural_int16_t_from_stereo
+#endif
+
 t_sample *mixeng_conv[2][2][2][3] = {
     {
         {
@@ -186,7 +269,7 @@ t_sample *mixeng_conv[2][2][2][3] = {
         {
             {
                 conv_natural_int8_t_to_stereo,
-                conv_natural_int16_t_to_stereo,
+                CONV_NATURAL_S16_STEREO,
                 conv_natural_int32_t_to_stereo
             },
             {
@@ -241,7 +324,7 @@ f_sample *mixeng_clip[2][2][2][3] = {
         {
             {
                 clip_natural_int8_t_from_stereo,
-                clip_natural_int16_t_from_stereo,
+                CLIP_NATURAL_S16_STEREO,
                 clip_natural_int32_t_from_stereo
             },
             {
@@ -324,6 +407,24 @@ void *st_rate_start (int inrate, int outrate)
 #define OP(a, b) a = b
 #include "rate_template.h"
 
+static void st_rate_flow_none (void *opaque, struct st_sample *ibuf,
+                               struct st_sample *obuf, int *isamp, int *osamp);
+#define NAME st_rate_flow_none
+#define OP(a, b) (void) (b)
+#include "rate_template.h"
+
+/* What st_rate_flow_mix() does with silent input: only the positions move,
+   ibuf is not looked at */
+void st_rate_flow_skip (void *opaque, struct st_sample *ibuf,
+                        struct st_sample *obuf, int *isamp, int *osamp)
+{
+    struct rate *rate = opaque;
+
+    st_rate_flow_none (rate, ibuf, obuf, isamp, osamp);
+    rate->ilast.l = 0;
+    rate->ilast.r = 0;
+}
+
 void st_rate_stop (void *opaque)
 {
     qemu_free (opaque);
@@ -0,0 +1,134 @@
+/*
+ * Microbenchmark for the qcow2 and QED cluster lookups
+ *
+ * Creates an image of each format on a file in memory (/dev/shm when
+ * there is one, the temporary directory otherwise), allocates every other
+ * cluster, and then times bdrv_is_allocated() and 4k reads at random
+ * clusters with the metadata caches warm, so that what is measured is the
+ * lookup and the block layer rather than the host disk.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "block_int.h"
+#include "bench.h"
+
+#define BENCH_OPS       200000
+#define IMAGE_SIZE      (1024LL << 20)
+#define CLUSTER_SECTORS 128             /* 64k, the default for both */
+
+static void report(const char *fmt, const char *what, int64_t start, int ops)
+{
+    int64_t ns = get_clock() - start;
+    char test[64];
+
+    printf("%-6s %-14s %8.1f ns/op\n", fmt, what, (double)ns / ops);
+    snprintf(test, sizeof(test), "%s %s", fmt, what);
+    bench_result(test, (double)ns / ops, "ns/op");
+}
+
+static BlockDriverState *create_image(const char *fmt, char *filename)
+{
+    BlockDriver *drv = bdrv_find_format(fmt);
+    QEMUOptionParameter *param;
+    BlockDriverState *bs;
+    int ret;
+
+    param = parse_option_parameters("", drv->create_options, NULL);
+    set_option_parameter_int(param, BLOCK_OPT_SIZE, IMAGE_SIZE);
+    ret = bdrv_create(drv, filename, param);
+    free_option_parameters(param);
+    if (ret < 0) {
+        fprintf(stderr, "bench-block: could not create %s image: %s\n",
+                fmt, strerror(-ret));
+        exit(1);
+    }
+
+    bs = bdrv_new("");
+    ret = bdrv_open(bs, filename, BDRV_O_RDWR | BDRV_O_CACHE_WB, drv);
+    if (ret < 0) {
+        fprintf(stderr, "bench-block: could not open %s image: %s\n",
+                fmt, strerror(-ret));
+        exit(1);
+    }
+    return bs;
+}
+
+static void bench(const char *fmt, const char *dir)
+{
+    int64_t clusters = IMAGE_SIZE / (CLUSTER_SECTORS * BDRV_SECTOR_SIZE);
+    uint8_t *buf = qemu_blockalign(NULL, 4096);
+    char filename[1024];
+    BlockDriverState *bs;
+    int64_t start, i;
+    int fd, pnum, allocated = 0;
+
+    snprintf(filename, sizeof(filename), "%s/bench-block.XXXXXX", dir);
+    fd = mkstemp(filename);
+    if (fd < 0) {
+        perror("bench-block");
+        exit(1);
+    }
+    close(fd);
+    bs = create_image(fmt, filename);
+
+    memset(buf, 0x5a, 4096);
+    for (i = 0; i < clusters; i += 2) {
+        if (bdrv_write(bs, i * CLUSTER_SECTORS, buf, 8) < 0) {
+            fprintf(stderr, "bench-block: %s write failed\n", fmt);
+            exit(1);
+        }
+    }
+
+    srand(1);
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS; i++) {
+        int64_t cluster = rand() % clusters;
+
+        allocated += bdrv_is_allocated(bs, cluster * CLUSTER_SECTORS,
+                                       CLUSTER_SECTORS, &pnum);
+    }
+    report(fmt, "is_allocated", start, BENCH_OPS);
+    if (allocated < BENCH_OPS / 3) {
+        fprintf(stderr, "bench-block: %s lost its clusters\n", fmt);
+        exit(1);
+    }
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 4; i++) {
+        int64_t cluster = rand() % clusters;
+
+        if (bdrv_read(bs, cluster * CLUSTER_SECTORS, buf, 8) < 0) {
+            fprintf(stderr, "bench-block: %s read failed\n", fmt);
+            exit(1);
+        }
+    }
+    report(fmt, "read 4k", start, BENCH_OPS / 4);
+
+    bdrv_delete(bs);
+    unlink(filename);
+    qemu_vfree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "/dev/shm";
+
+    if (access(dir, W_OK) < 0) {
+        dir = getenv("TMPDIR") ? : "/tmp";
+    }
+
+    bench_init("block");
+    bdrv_init();
+    bench("qcow2", dir);
+    bench("qed", dir);
+    return 0;
+}
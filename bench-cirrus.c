@@ -0,0 +1,367 @@
+/*
+ * Microbenchmark for the cirrus bitblt ROP engine
+ *
+ * Runs the screen to screen copies, solid fills and pattern fills of every
+ * ROP in hw/cirrus_vga_rop.h on a 1024x768 frame buffer and prints their
+ * throughput.  Each function is first checked against a byte at a time
+ * version of the same operation, with overlapping copies in both
+ * directions and widths that are not a multiple of the word size.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "bench.h"
+
+#define VRAM_SIZE       (8 << 20)
+#define PITCH           4096
+#define BLT_WIDTH       640             /* pixels */
+#define BLT_HEIGHT      480
+#define BENCH_BYTES     (1LL << 30)
+
+#define CIRRUS_BLTMODEEXT_COLOREXPINV      0x02
+
+/* What the ROP templates use of the device state */
+typedef struct CirrusVGAState {
+    struct {
+        uint8_t gr[256];
+    } vga;
+    uint32_t cirrus_blt_fgcol;
+    uint32_t cirrus_blt_bgcol;
+    uint32_t cirrus_blt_srcaddr;
+    uint8_t cirrus_blt_modeext;
+} CirrusVGAState;
+
+typedef void (*cirrus_bitblt_rop_t)(CirrusVGAState *s,
+                                    uint8_t *dst, const uint8_t *src,
+                                    int dstpitch, int srcpitch,
+                                    int bltwidth, int bltheight);
+typedef void (*cirrus_fill_t)(CirrusVGAState *s,
+                              uint8_t *dst, int dst_pitch,
+                              int width, int height);
+typedef void (*rop_8_t)(uint8_t *dst, uint8_t src);
+
+/* The same ROPs as hw/cirrus_vga.c, NOP aside.  The templates also define
+   the transparent and colour expanding blits, which are not measured.  */
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+#define ROP_NAME 0
+#define ROP_FN(d, s) 0
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME src_and_dst
+#define ROP_FN(d, s) (s) & (d)
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME src_and_notdst
+#define ROP_FN(d, s) (s) & (~(d))
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME notdst
+#define ROP_FN(d, s) ~(d)
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME src
+#define ROP_FN(d, s) s
+#define ROP_COPY
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME 1
+#define ROP_FN(d, s) ~0
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME notsrc_and_dst
+#define ROP_FN(d, s) (~(s)) & (d)
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME src_xor_dst
+#define ROP_FN(d, s) (s) ^ (d)
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME src_or_dst
+#define ROP_FN(d, s) (s) | (d)
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME notsrc_or_notdst
+#define ROP_FN(d, s) (~(s)) | (~(d))
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME src_notxor_dst
+#define ROP_FN(d, s) ~((s) ^ (d))
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME src_or_notdst
+#define ROP_FN(d, s) (s) | (~(d))
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME notsrc
+#define ROP_FN(d, s) (~(s))
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME notsrc_or_dst
+#define ROP_FN(d, s) (~(s)) | (d)
+#include "hw/cirrus_vga_rop.h"
+
+#define ROP_NAME notsrc_and_notdst
+#define ROP_FN(d, s) (~(s)) & (~(d))
+#include "hw/cirrus_vga_rop.h"
+
+typedef struct Rop {
+    const char *name;
+    rop_8_t rop_8;
+    cirrus_bitblt_rop_t fwd, bkwd;
+    cirrus_bitblt_rop_t patternfill[3];     /* 8, 16, 32 bpp */
+    cirrus_fill_t fill[3];
+} Rop;
+
+#define ROP(name) { #name, rop_8_ ## name,                              \
+        cirrus_bitblt_rop_fwd_ ## name, cirrus_bitblt_rop_bkwd_ ## name, \
+        { cirrus_patternfill_ ## name ## _8,                            \
+          cirrus_patternfill_ ## name ## _16,                           \
+          cirrus_patternfill_ ## name ## _32 },                         \
+        { cirrus_fill_ ## name ## _8,                                   \
+          cirrus_fill_ ## name ## _16,                                  \
+          cirrus_fill_ ## name ## _32 } }
+
+static const Rop rops[] = {
+    ROP(0),
+    ROP(src_and_dst),
+    ROP(src_and_notdst),
+    ROP(notdst),
+    ROP(src),
+    ROP(1),
+    ROP(notsrc_and_dst),
+    ROP(src_xor_dst),
+    ROP(src_or_dst),
+    ROP(notsrc_or_notdst),
+    ROP(src_notxor_dst),
+    ROP(src_or_notdst),
+    ROP(notsrc),
+    ROP(notsrc_or_dst),
+    ROP(notsrc_and_notdst),
+};
+
+static const int depths[3] = { 1, 2, 4 };
+
+static CirrusVGAState state;
+static uint8_t *vram, *ref, *init;
+
+/* Byte at a time versions, as the templates were written */
+
+static void ref_copy(rop_8_t rop, uint8_t *dst, const uint8_t *src,
+                     int dstpitch, int srcpitch, int bltwidth, int bltheight,
+                     int dir)
+{
+    int x, y;
+
+    for (y = 0; y < bltheight; y++) {
+        for (x = 0; x < bltwidth; x++) {
+            rop(dst + x * dir, src[x * dir]);
+        }
+        dst += dstpitch;
+        src += srcpitch;
+    }
+}
+
+static void ref_fill(rop_8_t rop, uint8_t *dst, int dst_pitch,
+                     int width, int height, int depth)
+{
+    uint8_t col8 = state.cirrus_blt_fgcol;
+    uint16_t col16 = state.cirrus_blt_fgcol;
+    uint32_t col32 = state.cirrus_blt_fgcol;
+    const uint8_t *col = depth == 1 ? &col8 :
+                         depth == 2 ? (uint8_t *)&col16 : (uint8_t *)&col32;
+    int x, y, i;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x += depth) {
+            for (i = 0; i < depth; i++) {
+                rop(dst + x + i, col[i]);
+            }
+        }
+        dst += dst_pitch;
+    }
+}
+
+static void ref_patternfill(rop_8_t rop, uint8_t *dst, const uint8_t *src,
+                            int dstpitch, int bltwidth, int bltheight,
+                            int depth)
+{
+    int skipleft = (state.vga.gr[0x2f] & 0x07) * depth;
+    int pattern_y = state.cirrus_blt_srcaddr & 7;
+    int x, y, i;
+
+    for (y = 0; y < bltheight; y++) {
+        const uint8_t *src1 = src + pattern_y * 8 * depth;
+        for (x = skipleft; x < bltwidth; x += depth) {
+            for (i = 0; i < depth; i++) {
+                rop(dst + x + i, src1[x % (8 * depth) + i]);
+            }
+        }
+        pattern_y = (pattern_y + 1) & 7;
+        dst += dstpitch;
+    }
+}
+
+static void check(const Rop *r, const char *what)
+{
+    if (memcmp(vram, ref, VRAM_SIZE)) {
+        fprintf(stderr, "%s: %s differs from the byte at a time version\n",
+                r->name, what);
+        exit(1);
+    }
+}
+
+static void reset(void)
+{
+    memcpy(vram, init, VRAM_SIZE);
+    memcpy(ref, init, VRAM_SIZE);
+}
+
+static void check_rop(const Rop *r)
+{
+    static const int widths[] = { 1, 7, 8, 9, 15, 17, 63, 640 };
+    static const int shifts[] = { 0, 1, 3, 7, 8, 9, 100, PITCH };
+    int i, j, k, off = 64 * PITCH + 512;
+
+    for (i = 0; i < ARRAY_SIZE(widths); i++) {
+        for (j = 0; j < ARRAY_SIZE(shifts); j++) {
+            int w = widths[i], d = shifts[j];
+
+            /* forward copies, dst before or after src */
+            reset();
+            r->fwd(&state, vram + off, vram + off + d, PITCH, PITCH, w, 16);
+            ref_copy(r->rop_8, ref + off, ref + off + d, PITCH, PITCH,
+                     w, 16, 1);
+            check(r, "forward copy");
+            reset();
+            r->fwd(&state, vram + off + d, vram + off, PITCH, PITCH, w, 16);
+            ref_copy(r->rop_8, ref + off + d, ref + off, PITCH, PITCH,
+                     w, 16, 1);
+            check(r, "forward copy");
+
+            /* backward copies start at the end of the last line */
+            reset();
+            r->bkwd(&state, vram + off + d, vram + off, -PITCH, -PITCH,
+                    w, 16);
+            ref_copy(r->rop_8, ref + off + d, ref + off, -PITCH, -PITCH,
+                     w, 16, -1);
+            check(r, "backward copy");
+            reset();
+            r->bkwd(&state, vram + off, vram + off + d, -PITCH, -PITCH,
+                    w, 16);
+            ref_copy(r->rop_8, ref + off, ref + off + d, -PITCH, -PITCH,
+                     w, 16, -1);
+            check(r, "backward copy");
+        }
+
+        for (k = 0; k < 3; k++) {
+            int w = widths[i] * depths[k];
+
+            reset();
+            r->fill[k](&state, vram + off, PITCH, w, 16);
+            ref_fill(r->rop_8, ref + off, PITCH, w, 16, depths[k]);
+            check(r, "fill");
+
+            for (j = 0; j < 8; j++) {
+                state.vga.gr[0x2f] = j;
+                state.cirrus_blt_srcaddr = j * 3;
+                reset();
+                r->patternfill[k](&state, vram + off, init, PITCH, 0, w, 16);
+                ref_patternfill(r->rop_8, ref + off, init, PITCH, w, 16,
+                                depths[k]);
+                check(r, "pattern fill");
+            }
+            state.vga.gr[0x2f] = 0;
+        }
+    }
+}
+
+static const char *op_names[] = { "fwd copy", "bkwd copy", "fill", "pat" };
+
+/* MB/s of dst written */
+static double bench(const Rop *r, int op, int k)
+{
+    int64_t start, bytes = 0;
+    int w = BLT_WIDTH * depths[k];
+    char test[64];
+    double mbs;
+    uint8_t *dst = vram + PITCH * 8 + 32;
+    uint8_t *src = vram + PITCH * (BLT_HEIGHT + 16);
+
+    start = get_clock();
+    while (bytes < BENCH_BYTES) {
+        switch (op) {
+        case 0:
+            r->fwd(&state, dst, src, PITCH, PITCH, w, BLT_HEIGHT);
+            break;
+        case 1:
+            r->bkwd(&state, dst + PITCH * (BLT_HEIGHT - 1) + w - 1,
+                    src + PITCH * (BLT_HEIGHT - 1) + w - 1,
+                    -PITCH, -PITCH, w, BLT_HEIGHT);
+            break;
+        case 2:
+            r->fill[k](&state, dst, PITCH, w, BLT_HEIGHT);
+            break;
+        case 3:
+            r->patternfill[k](&state, dst, src, PITCH, 0, w, BLT_HEIGHT);
+            break;
+        }
+        bytes += (int64_t)w * BLT_HEIGHT;
+    }
+    mbs = bytes / ((get_clock() - start) / 1e9) / (1 << 20);
+
+    if (op < 2) {
+        snprintf(test, sizeof(test), "%s, %s", r->name, op_names[op]);
+    } else {
+        snprintf(test, sizeof(test), "%s, %s %d", r->name, op_names[op],
+                 depths[k] * 8);
+    }
+    bench_result(test, mbs, "MB/s");
+    return mbs;
+}
+
+int main(int argc, char **argv)
+{
+    int i, k;
+
+    bench_init("cirrus");
+    vram = qemu_malloc(VRAM_SIZE);
+    ref = qemu_malloc(VRAM_SIZE);
+    init = qemu_malloc(VRAM_SIZE);
+    for (i = 0; i < VRAM_SIZE; i++) {
+        init[i] = rand();
+    }
+    state.cirrus_blt_fgcol = 0x12345678;
+    state.cirrus_blt_bgcol = 0x9abcdef0;
+    state.vga.gr[0x34] = 0x55;
+    state.vga.gr[0x35] = 0xaa;
+
+    for (i = 0; i < ARRAY_SIZE(rops); i++) {
+        check_rop(&rops[i]);
+    }
+
+    printf("%d x %d blits, MB/s    fwd copy  bkwd copy"
+           "   fill 8  fill 16  fill 32    pat 8   pat 16   pat 32\n",
+           BLT_WIDTH, BLT_HEIGHT);
+    memcpy(vram, init, VRAM_SIZE);
+    for (i = 0; i < ARRAY_SIZE(rops); i++) {
+        printf("%-22s %9.0f  %9.0f", rops[i].name,
+               bench(&rops[i], 0, 0), bench(&rops[i], 1, 0));
+        for (k = 0; k < 3; k++) {
+            printf("%9.0f", bench(&rops[i], 2, k));
+        }
+        for (k = 0; k < 3; k++) {
+            printf("%9.0f", bench(&rops[i], 3, k));
+        }
+        printf("\n");
+    }
+    return 0;
+}
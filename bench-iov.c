@@ -0,0 +1,192 @@
+/*
+ * Microbenchmark for the iovec and buffer helpers
+ *
+ * Copies between flat buffers and scatter lists shaped like a virtio-net
+ * packet and a block request, checksums them, and checks pages for a
+ * single repeated byte the way RAM migration's is_dup_page() does,
+ * printing the time each operation takes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "iov.h"
+#include "net/checksum.h"
+#include "bench.h"
+
+#define BENCH_OPS   1000000
+#define PAGE_SIZE   4096
+
+static void report(const char *what, int64_t start, int ops)
+{
+    int64_t ns = get_clock() - start;
+
+    printf("%-40s %8.1f ns/op\n", what, (double)ns / ops);
+    bench_result(what, (double)ns / ops, "ns/op");
+}
+
+/* What net_checksum_add() used to be, a byte at a time */
+static uint32_t checksum_bytewise(int len, const uint8_t *buf)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        sum += (i & 1) ? buf[i] : (uint32_t)buf[i] << 8;
+    }
+    return sum;
+}
+
+/* A header, then the payload split in n pieces of len bytes */
+static void bench_iov(const char *name, int n, size_t len)
+{
+    struct iovec *iov = qemu_malloc((n + 1) * sizeof(*iov));
+    struct iovec *copy = qemu_malloc((n + 1) * sizeof(*copy));
+    size_t total = 12 + n * len;
+    uint8_t *buf = qemu_mallocz(total);
+    QEMUIOVector qiov;
+    uint16_t csum;
+    char what[64];
+    int64_t start;
+    int i;
+
+    iov[0].iov_base = qemu_mallocz(12);
+    iov[0].iov_len = 12;
+    copy[0].iov_base = qemu_mallocz(12);
+    copy[0].iov_len = 12;
+    for (i = 1; i <= n; i++) {
+        iov[i].iov_base = qemu_mallocz(len);
+        iov[i].iov_len = len;
+        copy[i].iov_base = qemu_mallocz(len);
+        copy[i].iov_len = len;
+    }
+    qemu_iovec_init_external(&qiov, iov, n + 1);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS; i++) {
+        if (iov_size(iov, n + 1) != total) {
+            abort();
+        }
+    }
+    snprintf(what, sizeof(what), "iov_size, %s", name);
+    report(what, start, BENCH_OPS);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 10; i++) {
+        iov_from_buf(iov, n + 1, buf, total);
+    }
+    snprintf(what, sizeof(what), "iov_from_buf, %s", name);
+    report(what, start, BENCH_OPS / 10);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 10; i++) {
+        iov_to_buf(iov, n + 1, buf, 0, total);
+    }
+    snprintf(what, sizeof(what), "iov_to_buf, %s", name);
+    report(what, start, BENCH_OPS / 10);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 10; i++) {
+        qemu_iovec_from_buffer(&qiov, buf, total);
+    }
+    snprintf(what, sizeof(what), "qemu_iovec_from_buffer, %s", name);
+    report(what, start, BENCH_OPS / 10);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 10; i++) {
+        iov_copy_data(copy, n + 1, 0, iov, n + 1, 0, total);
+    }
+    snprintf(what, sizeof(what), "iov_copy_data, %s", name);
+    report(what, start, BENCH_OPS / 10);
+
+    for (i = 0; i < total; i++) {
+        buf[i] = rand();
+    }
+    iov_from_buf(iov, n + 1, buf, total);
+    csum = net_checksum_finish(checksum_bytewise(total, buf));
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 10; i++) {
+        if (net_checksum_finish(checksum_bytewise(total, buf)) != csum) {
+            abort();
+        }
+    }
+    snprintf(what, sizeof(what), "checksum bytewise, %s", name);
+    report(what, start, BENCH_OPS / 10);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 10; i++) {
+        if (net_checksum_finish(net_checksum_add(total, buf)) != csum) {
+            abort();
+        }
+    }
+    snprintf(what, sizeof(what), "net_checksum_add, %s", name);
+    report(what, start, BENCH_OPS / 10);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 10; i++) {
+        if (net_checksum_finish(net_checksum_add_iov(iov, n + 1, 0,
+                                                     total)) != csum) {
+            abort();
+        }
+    }
+    snprintf(what, sizeof(what), "net_checksum_add_iov, %s", name);
+    report(what, start, BENCH_OPS / 10);
+
+    /* From an odd offset, so that every piece is shifted */
+    if (net_checksum_finish(net_checksum_add_iov(iov, n + 1, 1, total - 1)) !=
+        net_checksum_finish(checksum_bytewise(total - 1, buf + 1))) {
+        abort();
+    }
+
+    for (i = 0; i <= n; i++) {
+        qemu_free(iov[i].iov_base);
+        qemu_free(copy[i].iov_base);
+    }
+    qemu_free(iov);
+    qemu_free(copy);
+    qemu_free(buf);
+}
+
+/* A page that differs from the filled pattern at byte diff, if any */
+static void bench_dup_page(const char *name, int diff)
+{
+    uint8_t *page = qemu_memalign(PAGE_SIZE, PAGE_SIZE);
+    char what[64];
+    int64_t start;
+    int i, dup = 0;
+
+    memset(page, 0, PAGE_SIZE);
+    if (diff >= 0) {
+        page[diff] = 1;
+    }
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS; i++) {
+        dup += buffer_is_filled(page, *page, PAGE_SIZE);
+    }
+    snprintf(what, sizeof(what), "is_dup_page, %s", name);
+    report(what, start, BENCH_OPS);
+    if (dup != (diff < 0 ? BENCH_OPS : 0)) {
+        abort();
+    }
+    qemu_vfree(page);
+}
+
+int main(int argc, char **argv)
+{
+    bench_init("iov");
+    bench_iov("packet 1514", 1, 1514);
+    bench_iov("packet 16 x 4k", 16, 4096);
+    bench_iov("request 32 x 512", 32, 512);
+    bench_dup_page("zero page", -1);
+    bench_dup_page("differs at 64", 64);
+    bench_dup_page("differs at 4095", PAGE_SIZE - 1);
+    return 0;
+}
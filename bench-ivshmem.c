@@ -0,0 +1,214 @@
+/*
+ * Microbenchmark for inter-VM communication as ivshmem does it
+ *
+ * Two processes share memory and ring each other's doorbell, an eventfd,
+ * the way two guests with ivshmem do once KVM signals the eventfd of a
+ * doorbell write and QEMU turns the peer's eventfd into an interrupt.  It
+ * prints the round trip time of a ping-pong and the throughput of a stream
+ * of messages through a ring, with a doorbell per batch of messages.  The
+ * guests add their exits and interrupt delivery on top of these figures.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "qemu-barrier.h"
+#include "bench.h"
+
+#define PING_PONGS      100000
+#define STREAM_BYTES    (4LL << 30)
+#define MSG_SIZE        4096
+#define RING_SLOTS      256
+
+typedef struct Shared {
+    volatile uint64_t ping;
+    volatile uint64_t pong;
+    volatile uint64_t head;             /* messages produced */
+    volatile uint64_t tail;             /* messages consumed */
+    uint8_t ring[RING_SLOTS][MSG_SIZE];
+} Shared;
+
+static Shared *shm;
+static int doorbell[2];                 /* to the child, to the parent */
+
+static void ring_doorbell(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+        exit(1);
+    }
+}
+
+/* What the QEMU main loop does with the eventfd of a vector */
+static void wait_doorbell(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint64_t count;
+
+    if (poll(&pfd, 1, -1) != 1 ||
+        read(fd, &count, sizeof(count)) != sizeof(count)) {
+        perror("doorbell");
+        exit(1);
+    }
+}
+
+static void ping_pong_peer(int unused)
+{
+    uint64_t i;
+
+    for (i = 1; i <= PING_PONGS; i++) {
+        while (shm->ping != i) {
+            wait_doorbell(doorbell[0]);
+        }
+        shm->pong = i;
+        smp_mb();
+        ring_doorbell(doorbell[1]);
+    }
+}
+
+static void ping_pong(int unused)
+{
+    int64_t start = get_clock();
+    uint64_t i;
+    double us;
+
+    for (i = 1; i <= PING_PONGS; i++) {
+        shm->ping = i;
+        smp_mb();
+        ring_doorbell(doorbell[0]);
+        while (shm->pong != i) {
+            wait_doorbell(doorbell[1]);
+        }
+    }
+    us = (get_clock() - start) / 1000.0 / PING_PONGS;
+
+    printf("ping-pong            %8.2f us/round trip\n", us);
+    bench_result("ping-pong", us, "us/round trip");
+}
+
+/* The consumer rings back once per batch it took, so that the producer
+   finds room again */
+static void stream_peer(int batch)
+{
+    uint64_t msgs = STREAM_BYTES / MSG_SIZE;
+    uint64_t tail = 0;
+
+    while (tail < msgs) {
+        while (shm->head == tail) {
+            wait_doorbell(doorbell[0]);
+        }
+        smp_rmb();
+        while (tail < shm->head) {
+            if (*(volatile uint8_t *)shm->ring[tail % RING_SLOTS] !=
+                (uint8_t)tail) {
+                exit(1);
+            }
+            tail++;
+            if (tail % batch == 0 || tail == msgs) {
+                smp_mb();
+                shm->tail = tail;
+                ring_doorbell(doorbell[1]);
+            }
+        }
+    }
+}
+
+static void stream(int batch)
+{
+    uint64_t msgs = STREAM_BYTES / MSG_SIZE;
+    int64_t start = get_clock();
+    uint64_t head, doorbells = 0;
+    char test[32];
+    double secs;
+
+    for (head = 0; head < msgs; head++) {
+        while (head - shm->tail >= RING_SLOTS) {
+            wait_doorbell(doorbell[1]);
+        }
+        memset(shm->ring[head % RING_SLOTS], head, MSG_SIZE);
+        if ((head + 1) % batch == 0 || head + 1 == msgs) {
+            smp_wmb();
+            shm->head = head + 1;
+            smp_mb();
+            ring_doorbell(doorbell[0]);
+            doorbells++;
+        }
+    }
+    while (shm->tail != msgs) {
+        wait_doorbell(doorbell[1]);
+    }
+
+    secs = (get_clock() - start) / 1e9;
+    printf("stream, batch %3d    %8.1f MB/s  %8.0f doorbells/s\n", batch,
+           STREAM_BYTES / secs / (1 << 20), doorbells / secs);
+    snprintf(test, sizeof(test), "stream, batch %d", batch);
+    bench_result(test, STREAM_BYTES / secs / (1 << 20), "MB/s");
+    snprintf(test, sizeof(test), "stream, batch %d, doorbells", batch);
+    bench_result(test, doorbells / secs, "doorbells/s");
+}
+
+static void run(void (*parent)(int), void (*child)(int), int arg)
+{
+    uint64_t count;
+    pid_t pid;
+    int status, i;
+
+    memset(shm, 0, sizeof(*shm));
+    for (i = 0; i < 2; i++) {
+        /* nonblocking, so this fails if nothing is left over */
+        if (read(doorbell[i], &count, sizeof(count)) < 0) {
+            count = 0;
+        }
+    }
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        child(arg);
+        exit(0);
+    }
+    parent(arg);
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status)) {
+        fprintf(stderr, "peer failed\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const int batches[] = { 1, 16, 64 };
+    int i;
+
+    bench_init("ivshmem");
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    doorbell[0] = eventfd(0, EFD_NONBLOCK);
+    doorbell[1] = eventfd(0, EFD_NONBLOCK);
+    if (shm == MAP_FAILED || doorbell[0] < 0 || doorbell[1] < 0) {
+        perror("bench-ivshmem");
+        return 1;
+    }
+
+    run(ping_pong, ping_pong_peer, 0);
+    for (i = 0; i < ARRAY_SIZE(batches); i++) {
+        run(stream, stream_peer, batches[i]);
+    }
+    return 0;
+}
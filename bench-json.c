@@ -0,0 +1,119 @@
+/*
+ * Microbenchmark for the JSON parsers
+ *
+ * Parses a sample of the inputs from check-qjson.c, plus some typical QMP
+ * commands, once with the token based lexer, streamer and parser and once
+ * with the splitter and the single-pass parser that QMP uses, and prints
+ * the time each takes per message.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "qstring.h"
+#include "json-parser.h"
+#include "json-streamer.h"
+#include "bench.h"
+
+#define BENCH_OPS   200000
+
+static const char *inputs[] = {
+    /* from check-qjson.c */
+    "\"hello world \\\"embedded string\\\"\"",
+    "\"triple byte utf-8 \\u20AC\"",
+    "-0.22",
+    "1024e-2",
+    "[32, 42, 'hello', 'world']",
+    "{\"abc\": 32, \"def\": 43}",
+    "{'abc': {'def': 32, 'ghi': [1, 2, 3]}, 'jkl': true}",
+    "[[[[[[[[1]]]]]]]]",
+    /* QMP */
+    "{ \"execute\": \"qmp_capabilities\" }",
+    "{ \"execute\": \"query-status\", \"id\": 1 }",
+    "{ \"execute\": \"blockdev-snapshot-sync\", \"arguments\": "
+    "{ \"device\": \"ide-hd0\", \"snapshot-file\": "
+    "\"/some/place/my-image\", \"format\": \"qcow2\" }, \"id\": 42 }",
+};
+
+static int parsed;
+
+static void old_emit(JSONMessageParser *parser, QList *tokens)
+{
+    QObject *obj = json_parser_parse(tokens, NULL);
+
+    parsed += obj != NULL;
+    qobject_decref(obj);
+}
+
+static void new_emit(JSONMessageSplitter *splitter, const char *buf,
+                     size_t len)
+{
+    QObject *obj = json_parser_parse_buf(buf, len, NULL);
+
+    parsed += obj != NULL;
+    qobject_decref(obj);
+}
+
+static void bench(const char *input)
+{
+    JSONMessageParser parser;
+    JSONMessageSplitter splitter;
+    size_t len = strlen(input);
+    int64_t start, old_ns, new_ns;
+    char test[64];
+    int i;
+
+    /* the trailing newline terminates top-level scalars in both */
+    parsed = 0;
+    json_message_parser_init(&parser, old_emit);
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS; i++) {
+        json_message_parser_feed(&parser, input, len);
+        json_message_parser_feed(&parser, "\n", 1);
+    }
+    old_ns = get_clock() - start;
+    json_message_parser_destroy(&parser);
+    if (parsed != BENCH_OPS) {
+        fprintf(stderr, "old parser failed on %s\n", input);
+        exit(1);
+    }
+
+    parsed = 0;
+    json_message_splitter_init(&splitter, new_emit);
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS; i++) {
+        json_message_splitter_feed(&splitter, input, len);
+        json_message_splitter_feed(&splitter, "\n", 1);
+    }
+    new_ns = get_clock() - start;
+    json_message_splitter_destroy(&splitter);
+    if (parsed != BENCH_OPS) {
+        fprintf(stderr, "new parser failed on %s\n", input);
+        exit(1);
+    }
+
+    printf("%8.1f ns/msg old  %8.1f ns/msg new  %5.1fx  %.40s\n",
+           (double)old_ns / BENCH_OPS, (double)new_ns / BENCH_OPS,
+           (double)old_ns / new_ns, input);
+    snprintf(test, sizeof(test), "old, %.40s", input);
+    bench_result(test, (double)old_ns / BENCH_OPS, "ns/msg");
+    snprintf(test, sizeof(test), "new, %.40s", input);
+    bench_result(test, (double)new_ns / BENCH_OPS, "ns/msg");
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    bench_init("json");
+    for (i = 0; i < ARRAY_SIZE(inputs); i++) {
+        bench(inputs[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Packet rate microbenchmark for the net layer
+ *
+ * Sends minimum size frames from a backend to a NIC, both dummies that do
+ * no work of their own, and prints the packets per second of each way
+ * they can be connected: -netdev peers, a -net vlan with just the two of
+ * them, which is sent point to point, and a vlan with a third client,
+ * like a dump, which goes through the hub.  A last round has the NIC
+ * refuse every other packet, so that half of them are queued.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "qemu-error.h"
+#include "qerror.h"
+#include "monitor.h"
+#include "net.h"
+#include "qemu-config.h"
+#include "net/dump.h"
+#include "net/slirp.h"
+#include "net/socket.h"
+#include "net/tap.h"
+#include "bench.h"
+
+#define BENCH_NS        500000000LL
+#define BENCH_BATCH     4096
+
+static uint64_t received;
+static int refuse;
+
+/* The rest of the emulator, as much of it as net.c wants */
+int nb_nics;
+NICInfo nd_table[MAX_NICS];
+
+void qerror_report_internal(const char *file, int linenr, const char *func,
+                            const char *fmt, ...)
+{
+    abort();
+}
+
+int monitor_get_fd(Monitor *mon, const char *fdname)
+{
+    return -1;
+}
+
+static QemuOptsList empty_opts = {
+    .name = "empty",
+    .head = QTAILQ_HEAD_INITIALIZER(empty_opts.head),
+    .desc = { { } },
+};
+
+QemuOptsList *qemu_find_opts(const char *group)
+{
+    return &empty_opts;
+}
+
+int net_init_dump(QemuOpts *opts, Monitor *mon, const char *name,
+                  VLANState *vlan)
+{
+    return -1;
+}
+
+int net_init_slirp(QemuOpts *opts, Monitor *mon, const char *name,
+                   VLANState *vlan)
+{
+    return -1;
+}
+
+int net_slirp_parse_legacy(QemuOptsList *opts_list, const char *optarg,
+                           int *ret)
+{
+    return 0;
+}
+
+int net_init_socket(QemuOpts *opts, Monitor *mon, const char *name,
+                    VLANState *vlan)
+{
+    return -1;
+}
+
+int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name,
+                 VLANState *vlan)
+{
+    return -1;
+}
+
+struct vhost_net *tap_get_vhost_net(VLANClientState *vc)
+{
+    return NULL;
+}
+
+/* The NIC: takes everything, or every other packet when refusing */
+static int nic_can_receive(VLANClientState *nc)
+{
+    return 1;
+}
+
+static ssize_t nic_receive(VLANClientState *nc, const uint8_t *buf,
+                           size_t size)
+{
+    if (refuse && (refuse ^= 2) & 2) {
+        return 0;
+    }
+    received++;
+    return size;
+}
+
+static ssize_t nic_receive_iov(VLANClientState *nc, const struct iovec *iov,
+                               int iovcnt)
+{
+    return nic_receive(nc, iov[0].iov_base, iov[0].iov_len);
+}
+
+static NetClientInfo nic_info = {
+    .type = NET_CLIENT_TYPE_NIC,
+    .size = sizeof(NICState),
+    .can_receive = nic_can_receive,
+    .receive = nic_receive,
+    .receive_iov = nic_receive_iov,
+};
+
+/* The backend, and a listener that only looks, like a dump */
+static ssize_t null_receive(VLANClientState *nc, const uint8_t *buf,
+                            size_t size)
+{
+    return size;
+}
+
+static NetClientInfo backend_info = {
+    .type = NET_CLIENT_TYPE_TAP,
+    .size = sizeof(VLANClientState),
+    .receive = null_receive,
+};
+
+static NetClientInfo listener_info = {
+    .type = NET_CLIENT_TYPE_DUMP,
+    .size = sizeof(VLANClientState),
+    .receive = null_receive,
+};
+
+static NICConf conf;
+
+/* Queued packets are let through once the sender has stopped */
+static void sent(VLANClientState *sender, ssize_t ret)
+{
+}
+
+static double run(VLANClientState *backend, VLANClientState *nic, int iov)
+{
+    uint8_t frame[60] = { 0 };
+    struct iovec v = { frame, sizeof(frame) };
+    int64_t start, elapsed;
+    uint64_t sent_packets = 0;
+    int i;
+
+    received = 0;
+    start = get_clock();
+    do {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            ssize_t ret;
+
+            if (iov) {
+                ret = qemu_sendv_packet_async(backend, &v, 1, sent);
+            } else {
+                ret = qemu_send_packet_async(backend, frame, sizeof(frame),
+                                             sent);
+            }
+            if (!ret) {
+                qemu_flush_queued_packets(nic);
+            }
+        }
+        sent_packets += BENCH_BATCH;
+        elapsed = get_clock() - start;
+    } while (elapsed < BENCH_NS);
+
+    if (received != sent_packets) {
+        fprintf(stderr, "bench-net: %" PRIu64 " packets sent, %" PRIu64
+                " received\n", sent_packets, received);
+        exit(1);
+    }
+    return sent_packets * 1e9 / elapsed;
+}
+
+static void bench(const char *name, int clients, int refusing)
+{
+    VLANClientState *backend, *nic, *listener = NULL;
+    VLANState *vlan = NULL;
+    double pps, pps_iov;
+    char test[64];
+
+    if (clients) {
+        vlan = qemu_find_vlan(clients, 1);
+        conf.vlan = vlan;
+        conf.peer = NULL;
+        nic = &qemu_new_nic(&nic_info, &conf, "nic", NULL, NULL)->nc;
+        backend = qemu_new_net_client(&backend_info, vlan, NULL,
+                                      "backend", NULL);
+        if (clients > 2) {
+            listener = qemu_new_net_client(&listener_info, vlan, NULL,
+                                           "dump", NULL);
+        }
+    } else {
+        backend = qemu_new_net_client(&backend_info, NULL, NULL,
+                                      "backend", NULL);
+        conf.vlan = NULL;
+        conf.peer = backend;
+        nic = &qemu_new_nic(&nic_info, &conf, "nic", NULL, NULL)->nc;
+    }
+
+    refuse = refusing;
+    pps = run(backend, nic, 0);
+    pps_iov = run(backend, nic, 1);
+    refuse = 0;
+    printf("%-26s %8.2f Mpps %8.2f Mpps\n", name, pps / 1e6, pps_iov / 1e6);
+    snprintf(test, sizeof(test), "%s, send", name);
+    bench_result(test, pps / 1e6, "Mpps");
+    snprintf(test, sizeof(test), "%s, sendv", name);
+    bench_result(test, pps_iov / 1e6, "Mpps");
+
+    /* a NIC outlives its netdev peer */
+    if (listener) {
+        qemu_del_vlan_client(listener);
+    }
+    qemu_del_vlan_client(backend);
+    qemu_del_vlan_client(nic);
+}
+
+int main(int argc, char **argv)
+{
+    bench_init("net");
+    default_net = 0;
+    net_init_clients();
+
+    printf("%-26s %13s %13s\n", "", "send", "sendv");
+    bench("netdev peers", 0, 0);
+    bench("vlan, point to point", 2, 0);
+    bench("vlan, hub with a dump", 3, 0);
+    bench("netdev peers, half queued", 0, 1);
+    bench("vlan hub, half queued", 3, 1);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Microbenchmark for QDict, QList and the JSON encoder and parser
+ *
+ * Builds, looks up and frees dictionaries and lists of the sizes QMP
+ * replies have, and converts a reply like one entry of query-blockstats
+ * to JSON and back, printing the time each operation takes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "qemu-objects.h"
+#include "bench.h"
+
+#define BENCH_OPS   200000
+
+static void report(const char *what, int n, int64_t start, int ops)
+{
+    int64_t ns = get_clock() - start;
+    char test[64];
+
+    printf("%-14s %5d  %8.1f ns/op\n", what, n, (double)ns / ops);
+    snprintf(test, sizeof(test), "%s, %d", what, n);
+    bench_result(test, (double)ns / ops, "ns/op");
+}
+
+static void bench_qdict(int n)
+{
+    char (*keys)[16] = qemu_malloc(n * sizeof(*keys));
+    QDict *qdict;
+    int64_t start;
+    int i, ops = BENCH_OPS / n;
+
+    for (i = 0; i < n; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "key-%d", i);
+    }
+
+    start = get_clock();
+    for (i = 0; i < ops; i++) {
+        int j;
+
+        qdict = qdict_new();
+        for (j = 0; j < n; j++) {
+            qdict_put(qdict, keys[j], qint_from_int(j));
+        }
+        QDECREF(qdict);
+    }
+    report("qdict put", n, start, ops * n);
+
+    qdict = qdict_new();
+    for (i = 0; i < n; i++) {
+        qdict_put(qdict, keys[i], qint_from_int(i));
+    }
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS; i++) {
+        if (qdict_get_int(qdict, keys[i % n]) != i % n) {
+            abort();
+        }
+    }
+    report("qdict get", n, start, BENCH_OPS);
+    QDECREF(qdict);
+    qemu_free(keys);
+}
+
+static void bench_qlist(int n)
+{
+    QList *qlist;
+    QListEntry *e;
+    int64_t start, sum = 0;
+    int i, ops = BENCH_OPS / n;
+
+    start = get_clock();
+    for (i = 0; i < ops; i++) {
+        int j;
+
+        qlist = qlist_new();
+        for (j = 0; j < n; j++) {
+            qlist_append(qlist, qint_from_int(j));
+        }
+        QDECREF(qlist);
+    }
+    report("qlist append", n, start, ops * n);
+
+    qlist = qlist_new();
+    for (i = 0; i < n; i++) {
+        qlist_append(qlist, qint_from_int(i));
+    }
+    start = get_clock();
+    for (i = 0; i < ops; i++) {
+        QLIST_FOREACH_ENTRY(qlist, e) {
+            sum += qint_get_int(qobject_to_qint(e->value));
+        }
+    }
+    report("qlist iterate", n, start, ops * n);
+    if (sum != (int64_t)ops * n * (n - 1) / 2) {
+        abort();
+    }
+    QDECREF(qlist);
+}
+
+static QObject *sample_reply(void)
+{
+    return qobject_from_jsonf(
+        "{ 'device': 'ide0-hd0', 'stats': {"
+        "'rd_bytes': %" PRId64 ", 'wr_bytes': %" PRId64 ", "
+        "'rd_operations': 36604, 'wr_operations': 692, "
+        "'rd_merged': 12, 'wr_merged': 3, "
+        "'wr_highest_offset': 2821110784, "
+        "'rd_latency': { 'count': 36604, 'time-ns': 9123456789, "
+        "'histogram': [0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 12, 345, 6789, 12345, "
+        "9876, 5432, 1234, 321, 12] } }, "
+        "'parent': { 'stats': { 'rd_bytes': 1, 'wr_bytes': 2, "
+        "'rd_operations': 3, 'wr_operations': 4, 'rd_merged': 0, "
+        "'wr_merged': 0, 'wr_highest_offset': 3686448128 } }, "
+        "'locked': false, 'removable': true, 'ratio': 0.25, "
+        "'file': '/var/lib/images/guest.qcow2' }",
+        (int64_t)122739200, (int64_t)9786368);
+}
+
+static void bench_json(void)
+{
+    QObject *obj = sample_reply();
+    QString *json = qobject_to_json(obj);
+    const char *str = qstring_get_str(json);
+    int64_t start;
+    int i;
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 10; i++) {
+        QDECREF(qobject_to_json(obj));
+    }
+    report("json encode", strlen(str), start, BENCH_OPS / 10);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS / 10; i++) {
+        QObject *parsed = qobject_from_json(str);
+
+        if (!parsed) {
+            abort();
+        }
+        qobject_decref(parsed);
+    }
+    report("json parse", strlen(str), start, BENCH_OPS / 10);
+
+    QDECREF(json);
+    qobject_decref(obj);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 4, 32, 512 };
+    int i;
+
+    bench_init("qobject");
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        bench_qdict(sizes[i]);
+    }
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        bench_qlist(sizes[i]);
+    }
+    bench_json();
+    return 0;
+}
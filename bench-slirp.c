@@ -0,0 +1,307 @@
+/*
+ * Throughput benchmark for user mode networking
+ *
+ * Runs a slirp instance with a minimal TCP stack on the guest side, and
+ * connects from the "guest" to a socket the benchmark listens on through
+ * the host alias (10.0.2.2), as a guest would with a server on the host.
+ * It then prints the throughput of a bulk transfer each way, guest to
+ * host and host to guest.  Everything happens on loopback, so the cost
+ * measured is that of slirp itself (plus a little of the guest side).
+ *
+ * The guest acknowledges what it received once per main loop iteration,
+ * as a guest taking one interrupt for several packets would, and always
+ * offers a full window.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/tcp.h>
+
+#include "qemu-common.h"
+#include "qemu_socket.h"
+#include "qemu-timer.h"
+#include "monitor.h"
+#include "qemu-char.h"
+#include "hw/hw.h"
+#include "net/checksum.h"
+#include "slirp/libslirp.h"
+#include "bench.h"
+
+#define BENCH_NS        1000000000LL
+#define GUEST_MSS       1460
+#define GUEST_WINDOW    65535
+#define GUEST_PORT      40000
+
+#define TH_FIN  0x01
+#define TH_SYN  0x02
+#define TH_PUSH 0x08
+#define TH_ACK  0x10
+
+/* The rest of the emulator, as much of it as slirp wants */
+Monitor *default_mon;
+
+int register_savevm(DeviceState *dev, const char *idstr, int instance_id,
+                    int version_id, SaveStateHandler *save_state,
+                    LoadStateHandler *load_state, void *opaque)
+{
+    return 0;
+}
+
+void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
+{
+}
+
+int qemu_chr_write(CharDriverState *s, const uint8_t *buf, int len)
+{
+    return len;
+}
+
+/* slirp_state_save() and slirp_state_load() are never called */
+void qemu_put_byte(QEMUFile *f, int v) { abort(); }
+void qemu_put_be16(QEMUFile *f, unsigned int v) { abort(); }
+void qemu_put_be32(QEMUFile *f, unsigned int v) { abort(); }
+void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size) { abort(); }
+int qemu_get_byte(QEMUFile *f) { abort(); }
+unsigned int qemu_get_be16(QEMUFile *f) { abort(); }
+unsigned int qemu_get_be32(QEMUFile *f) { abort(); }
+int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size) { abort(); }
+
+/* The guest */
+static Slirp *slirp;
+static const uint8_t guest_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+static uint8_t slirp_mac[6];
+static uint8_t addrs[8];            /* guest, then host IP, as in headers */
+static uint16_t host_port;
+
+static int established;
+static uint32_t snd_una, snd_nxt, snd_wnd;
+static uint32_t rcv_nxt, rcv_acked;
+static uint64_t received;
+
+static void guest_send(int flags, int len)
+{
+    static uint8_t frame[14 + 20 + 24 + GUEST_MSS];
+    uint8_t *ip = frame + 14, *tcp = ip + 20;
+    int hlen = (flags & TH_SYN) ? 24 : 20;
+    uint16_t sum;
+
+    memcpy(frame, slirp_mac, 6);
+    memcpy(frame + 6, guest_mac, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    cpu_to_be16wu((uint16_t *)(ip + 2), 20 + hlen + len);
+    ip[6] = 0x40;                   /* DF */
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, addrs, 8);
+    sum = net_checksum_finish(net_checksum_add(20, ip));
+    cpu_to_be16wu((uint16_t *)(ip + 10), sum);
+
+    memset(tcp, 0, hlen);
+    cpu_to_be16wu((uint16_t *)(tcp + 0), GUEST_PORT);
+    cpu_to_be16wu((uint16_t *)(tcp + 2), host_port);
+    cpu_to_be32wu((uint32_t *)(tcp + 4), snd_nxt);
+    cpu_to_be32wu((uint32_t *)(tcp + 8), rcv_nxt);
+    tcp[12] = (hlen / 4) << 4;
+    tcp[13] = flags;
+    cpu_to_be16wu((uint16_t *)(tcp + 14), GUEST_WINDOW);
+    if (flags & TH_SYN) {
+        tcp[20] = 2;                /* MSS */
+        tcp[21] = 4;
+        cpu_to_be16wu((uint16_t *)(tcp + 22), GUEST_MSS);
+    }
+    /* the payload is whatever the frame buffer holds */
+    sum = net_checksum_tcpudp(hlen + len, 6, addrs, tcp);
+    cpu_to_be16wu((uint16_t *)(tcp + 16), sum);
+
+    rcv_acked = rcv_nxt;
+    snd_nxt += len + ((flags & TH_SYN) ? 1 : 0);
+    slirp_input(slirp, frame, 14 + 20 + hlen + len);
+}
+
+static void guest_send_arp(void)
+{
+    uint8_t frame[42];
+
+    memset(frame, 0xff, 6);
+    memcpy(frame + 6, guest_mac, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x06;
+    cpu_to_be16wu((uint16_t *)(frame + 14), 1);         /* Ethernet */
+    cpu_to_be16wu((uint16_t *)(frame + 16), 0x0800);    /* IP */
+    frame[18] = 6;
+    frame[19] = 4;
+    cpu_to_be16wu((uint16_t *)(frame + 20), 1);         /* request */
+    memcpy(frame + 22, guest_mac, 6);
+    memcpy(frame + 28, addrs, 4);
+    memset(frame + 32, 0, 6);
+    memcpy(frame + 38, addrs + 4, 4);
+    slirp_input(slirp, frame, sizeof(frame));
+}
+
+int slirp_can_output(void *opaque)
+{
+    return 1;
+}
+
+void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
+{
+    const uint8_t *ip = pkt + 14, *tcp;
+    int ihl, len, flags;
+    uint32_t seq, ack;
+
+    if (pkt[12] == 0x08 && pkt[13] == 0x06) {
+        memcpy(slirp_mac, pkt + 6, 6);
+        return;
+    }
+    if (pkt[12] != 0x08 || pkt[13] != 0x00 || ip[9] != 6) {
+        return;
+    }
+    ihl = (ip[0] & 0xf) * 4;
+    tcp = ip + ihl;
+    len = be16_to_cpup((uint16_t *)(ip + 2)) - ihl - (tcp[12] >> 4) * 4;
+    flags = tcp[13];
+    seq = be32_to_cpupu((uint32_t *)(tcp + 4));
+    ack = be32_to_cpupu((uint32_t *)(tcp + 8));
+
+    if ((flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+        rcv_nxt = seq + 1;
+        snd_una = ack;
+        snd_wnd = be16_to_cpup((uint16_t *)(tcp + 14));
+        established = 1;
+        guest_send(TH_ACK, 0);
+        return;
+    }
+    if (flags & TH_ACK && (int32_t)(ack - snd_una) > 0) {
+        snd_una = ack;
+    }
+    snd_wnd = be16_to_cpup((uint16_t *)(tcp + 14));
+    if (len > 0 && seq == rcv_nxt) {
+        rcv_nxt += len;
+        received += len;
+    }
+}
+
+/* One main loop iteration, with the host end of the connection */
+static void iterate(int fd, int host_writes)
+{
+    fd_set rfds, wfds, xfds;
+    struct timeval tv = { 0, 1000 };
+    int nfds = -1, ret;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+    if (fd >= 0) {
+        FD_SET(fd, host_writes ? &wfds : &rfds);
+        nfds = MAX(nfds, fd);
+    }
+    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    slirp_select_poll(&rfds, &wfds, &xfds, ret < 0);
+
+    if (rcv_nxt != rcv_acked) {
+        guest_send(TH_ACK, 0);
+    }
+}
+
+static void guest_fill_window(void)
+{
+    while (snd_nxt - snd_una + GUEST_MSS <= snd_wnd) {
+        guest_send(TH_ACK, GUEST_MSS);
+    }
+}
+
+static void print_rate(const char *name, uint64_t bytes, int64_t ns)
+{
+    printf("%-16s %8.1f Mbit/s\n", name, bytes * 8 * 1e3 / ns);
+    bench_result(name, bytes * 8 * 1e3 / ns, "Mbit/s");
+}
+
+int main(int argc, char **argv)
+{
+    struct in_addr net = { htonl(0x0a000200) }, mask = { htonl(0xffffff00) };
+    struct in_addr host = { htonl(0x0a000202) }, dhcp = { htonl(0x0a00020f) };
+    struct in_addr dns = { htonl(0x0a000203) };
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof(sa);
+    static char buf[65536];
+    int lfd, fd = -1, one = 1;
+    int64_t start, elapsed;
+    uint64_t bytes;
+
+    bench_init("slirp");
+    lfd = socket(PF_INET, SOCK_STREAM, 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        listen(lfd, 1) < 0 ||
+        getsockname(lfd, (struct sockaddr *)&sa, &sa_len) < 0) {
+        perror("bench-slirp: listen");
+        return 1;
+    }
+    host_port = ntohs(sa.sin_port);
+
+    slirp = slirp_init(0, net, mask, host, NULL, NULL, NULL, dhcp, dns, NULL);
+    memcpy(addrs, &dhcp, 4);
+    memcpy(addrs + 4, &host, 4);
+
+    /* ARP, so that slirp knows the guest's MAC, then the handshake */
+    guest_send_arp();
+    snd_nxt = 1000;
+    guest_send(TH_SYN, 0);
+    while (fd < 0 || !established) {
+        iterate(-1, 0);
+        if (fd < 0) {
+            fd = accept(lfd, NULL, NULL);
+        }
+    }
+    socket_set_nonblock(fd);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    /* Guest to host: the guest sends as much as the window allows */
+    bytes = 0;
+    start = get_clock();
+    do {
+        ssize_t n;
+
+        guest_fill_window();
+        iterate(fd, 0);
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            bytes += n;
+        }
+        elapsed = get_clock() - start;
+    } while (elapsed < BENCH_NS);
+    print_rate("guest to host", bytes, elapsed);
+
+    /* Wait for the last segments to be acknowledged */
+    while (snd_una != snd_nxt) {
+        iterate(fd, 0);
+        while (read(fd, buf, sizeof(buf)) > 0) {
+        }
+    }
+
+    /* Host to guest: the host writes as much as the socket takes */
+    received = 0;
+    start = get_clock();
+    do {
+        while (write(fd, buf, sizeof(buf)) > 0) {
+        }
+        iterate(fd, 1);
+        elapsed = get_clock() - start;
+    } while (elapsed < BENCH_NS);
+    print_rate("host to guest", received, elapsed);
+
+    close(fd);
+    close(lfd);
+    return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Microbenchmark for the QEMUTimer lists
+ *
+ * Arms, cancels and expires timers on the host clock, with as many timers
+ * pending as a VM with lots of devices has, and prints the time each
+ * operation takes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "sysemu.h"
+#include "hw/hw.h"
+#include "qemu-char.h"
+#include "bench.h"
+
+#define BENCH_OPS   2000000
+
+/* What qemu-timer.c needs from the rest of the emulator */
+int vm_running = 1;
+int use_icount;
+int64_t qemu_icount;
+QEMUClock *rtc_clock;
+const VMStateInfo vmstate_info_int64;
+
+int64_t cpu_get_icount(void)
+{
+    return 0;
+}
+
+void qemu_notify_event(void)
+{
+}
+
+int qemu_set_fd_handler(int fd, IOHandler *fd_read, IOHandler *fd_write,
+                        void *opaque)
+{
+    return 0;
+}
+
+VMChangeStateEntry *qemu_add_vm_change_state_handler(VMChangeStateHandler *cb,
+                                                     void *opaque)
+{
+    return NULL;
+}
+
+int vmstate_register(DeviceState *dev, int instance_id,
+                     const VMStateDescription *vmsd, void *base)
+{
+    return 0;
+}
+
+uint64_t qemu_get_be64(QEMUFile *f)
+{
+    return 0;
+}
+
+void qemu_put_be64(QEMUFile *f, uint64_t v)
+{
+}
+
+static int expired;
+
+static void bench_cb(void *opaque)
+{
+    expired++;
+}
+
+static void report(const char *what, int n, int64_t start)
+{
+    int64_t ns = get_clock() - start;
+    char test[32];
+
+    printf("%-8s %6d timers  %8.1f ns/op\n", what, n, (double)ns / BENCH_OPS);
+    snprintf(test, sizeof(test), "%s, %d timers", what, n);
+    bench_result(test, (double)ns / BENCH_OPS, "ns/op");
+}
+
+static void bench(int n)
+{
+    QEMUTimer **timers = qemu_malloc(n * sizeof(*timers));
+    int64_t now = qemu_get_clock_ns(host_clock);
+    int64_t start;
+    int i, done;
+
+    srand(n);
+    for (i = 0; i < n; i++) {
+        timers[i] = qemu_new_timer(host_clock, bench_cb, NULL);
+        qemu_mod_timer(timers[i], now + 1000000000LL + rand() % 1000000000);
+    }
+
+    /* rearm pending timers, as periodic device timers do */
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS; i++) {
+        qemu_mod_timer(timers[i % n],
+                       now + 1000000000LL + rand() % 1000000000);
+    }
+    report("arm", n, start);
+
+    /* cancel and rearm */
+    start = get_clock();
+    for (i = 0; i < BENCH_OPS; i++) {
+        qemu_del_timer(timers[i % n]);
+        qemu_mod_timer(timers[i % n],
+                       now + 1000000000LL + rand() % 1000000000);
+    }
+    report("cancel", n, start);
+
+    /* let a slice of them expire, rearm them, and so on */
+    start = get_clock();
+    for (done = 0; done < BENCH_OPS; ) {
+        int batch = MIN(n, 64);
+
+        for (i = 0; i < batch; i++) {
+            qemu_mod_timer(timers[(done + i) % n], rand() % 1000);
+        }
+        expired = 0;
+        qemu_run_all_timers();
+        done += expired;
+    }
+    report("expire", n, start);
+
+    for (i = 0; i < n; i++) {
+        qemu_del_timer(timers[i]);
+        qemu_free_timer(timers[i]);
+    }
+    qemu_free(timers);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 16, 256, 4096 };
+    int i;
+
+    bench_init("timer");
+    init_clocks();
+    if (init_timer_alarm() < 0) {
+        fprintf(stderr, "could not initialize alarm timer\n");
+        return 1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        bench(sizes[i]);
+    }
+    quit_timers();
+    return 0;
+}
@@ -0,0 +1,533 @@
+/*
+ * Benchmark for the VNC framebuffer encoders
+ *
+ * Replays a sequence of frames through the raw, hextile, zlib and tight
+ * encoders (plus tight's JPEG and PNG modes when built in) and prints, for
+ * each one, the input throughput, the compression ratio and a CRC of the
+ * encoded stream.  Each frame is sent as the bounding box of the pixels
+ * that changed since the previous one, the way a VNC client would see it.
+ *
+ * With no arguments three synthetic sequences are used: a scrolling
+ * terminal, a panning photographic image and a desktop with a few changing
+ * icons.  Otherwise the arguments are binary PPM files (P6, for instance
+ * from the monitor's "screendump"), all of the same size, replayed in
+ * order as one sequence.
+ *
+ * The CRC only depends on the encoder output, so it can be compared
+ * between builds to check that an optimisation did not change the stream.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "ui/vnc.h"
+#include "bench.h"
+
+#define SYNTH_WIDTH     640
+#define SYNTH_HEIGHT    480
+#define SYNTH_FRAMES    24
+#define BENCH_NS        500000000LL
+#define BENCH_COMPRESSION 6         /* zlib and tight level, 0-9 */
+
+typedef struct Sequence {
+    const char *name;
+    int width, height, frames;
+    uint32_t **frame;
+} Sequence;
+
+typedef struct Encoder {
+    const char *name;
+    int encoding;
+    int quality;        /* tight JPEG quality, -1 for none */
+} Encoder;
+
+static const Encoder encoders[] = {
+    { "raw",        VNC_ENCODING_RAW,       -1 },
+    { "hextile",    VNC_ENCODING_HEXTILE,   -1 },
+    { "zlib",       VNC_ENCODING_ZLIB,      -1 },
+    { "tight",      VNC_ENCODING_TIGHT,     -1 },
+#ifdef CONFIG_VNC_JPEG
+    { "tight-jpeg", VNC_ENCODING_TIGHT,     6 },
+#endif
+#ifdef CONFIG_VNC_PNG
+    { "tight-png",  VNC_ENCODING_TIGHT_PNG, -1 },
+#endif
+};
+
+static VncState *vs;
+static VncDisplay vd;
+static DisplayState ds;
+static DisplaySurface surface;
+
+/*
+ * The parts of ui/vnc.c the encoders call back into.
+ */
+
+void buffer_reserve(Buffer *buffer, size_t len)
+{
+    if ((buffer->capacity - buffer->offset) < len) {
+        buffer->capacity += (len + 1024);
+        buffer->buffer = qemu_realloc(buffer->buffer, buffer->capacity);
+    }
+}
+
+void buffer_reset(Buffer *buffer)
+{
+    buffer->offset = 0;
+}
+
+void buffer_free(Buffer *buffer)
+{
+    qemu_free(buffer->buffer);
+    buffer->offset = 0;
+    buffer->capacity = 0;
+    buffer->buffer = NULL;
+}
+
+void vnc_write(VncState *vs, const void *data, size_t len)
+{
+    buffer_reserve(&vs->output, len);
+    memcpy(vs->output.buffer + vs->output.offset, data, len);
+    vs->output.offset += len;
+}
+
+void vnc_write_u8(VncState *vs, uint8_t value)
+{
+    vnc_write(vs, &value, 1);
+}
+
+void vnc_write_u16(VncState *vs, uint16_t value)
+{
+    uint8_t buf[2] = { value >> 8, value };
+
+    vnc_write(vs, buf, 2);
+}
+
+void vnc_write_u32(VncState *vs, uint32_t value)
+{
+    uint8_t buf[4] = { value >> 24, value >> 16, value >> 8, value };
+
+    vnc_write(vs, buf, 4);
+}
+
+void vnc_write_s32(VncState *vs, int32_t value)
+{
+    vnc_write_u32(vs, value);
+}
+
+void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
+                            int32_t encoding)
+{
+    vnc_write_u16(vs, x);
+    vnc_write_u16(vs, y);
+    vnc_write_u16(vs, w);
+    vnc_write_u16(vs, h);
+    vnc_write_s32(vs, encoding);
+}
+
+int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+{
+    uint8_t *row = surface.data + y * surface.linesize + x * 4;
+    int i;
+
+    for (i = 0; i < h; i++) {
+        vs->write_pixels(vs, &surface.pf, row, w * 4);
+        row += surface.linesize;
+    }
+    return 1;
+}
+
+static void write_pixels_copy(VncState *vs, struct PixelFormat *pf,
+                              void *pixels, int size)
+{
+    vnc_write(vs, pixels, size);
+}
+
+/* Client and server formats are the same, so hextile never converts. */
+void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v)
+{
+    abort();
+}
+
+/* vd.non_adaptive is set, so the update statistics are never asked for. */
+int vnc_update_freq(VncState *vs, int x, int y, int w, int h)
+{
+    return 0;
+}
+
+void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h)
+{
+}
+
+/*
+ * Frame sequences.
+ */
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(void)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return rnd_state >> 8;
+}
+
+static uint32_t **alloc_frames(int width, int height, int frames)
+{
+    uint32_t **frame = qemu_mallocz(frames * sizeof(*frame));
+    int i;
+
+    for (i = 0; i < frames; i++) {
+        frame[i] = qemu_mallocz(width * height * 4);
+    }
+    return frame;
+}
+
+/* An 8x16 glyph-ish pattern in fg over bg. */
+static void draw_char(uint32_t *fb, int width, int x, int y,
+                      uint32_t fg, uint32_t bg)
+{
+    uint32_t bits = rnd();
+    int i, j;
+
+    for (j = 0; j < 16; j++) {
+        uint8_t row = (j < 2 || j > 13) ? 0 : (bits >> (j % 12)) & 0x7e;
+        for (i = 0; i < 8; i++) {
+            fb[(y + j) * width + x + i] = (row >> i) & 1 ? fg : bg;
+        }
+    }
+}
+
+static void synth_terminal(Sequence *s)
+{
+    int w = SYNTH_WIDTH, h = SYNTH_HEIGHT;
+    int f, x, y;
+
+    s->name = "terminal";
+    s->width = w;
+    s->height = h;
+    s->frames = SYNTH_FRAMES;
+    s->frame = alloc_frames(w, h, s->frames);
+
+    for (y = 0; y < h; y += 16) {
+        for (x = 0; x < w; x += 8) {
+            draw_char(s->frame[0], w, x, y, 0xc0c0c0, 0x000000);
+        }
+    }
+    for (f = 1; f < s->frames; f++) {
+        memcpy(s->frame[f], s->frame[f - 1] + 16 * w, (h - 16) * w * 4);
+        for (x = 0; x < w; x += 8) {
+            draw_char(s->frame[f], w, x, h - 16,
+                      x < 8 * 10 ? 0x40ff40 : 0xc0c0c0, 0x000000);
+        }
+    }
+}
+
+static void synth_photo(Sequence *s)
+{
+    int w = SYNTH_WIDTH, h = SYNTH_HEIGHT;
+    int f, x, y;
+
+    s->name = "photo";
+    s->width = w;
+    s->height = h;
+    s->frames = SYNTH_FRAMES;
+    s->frame = alloc_frames(w, h, s->frames);
+
+    for (f = 0; f < s->frames; f++) {
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                double u = (x + 6 * f) / 80.0, v = y / 60.0;
+                int r = 128 + 100 * sin(u) * cos(v);
+                int g = 128 + 90 * sin(u * 0.7 + v);
+                int b = 128 + 110 * cos(u * 0.3 - v * 1.3);
+
+                r += rnd() % 5;
+                s->frame[f][y * w + x] = (r << 16) | (g << 8) | b;
+            }
+        }
+    }
+}
+
+static void synth_desktop(Sequence *s)
+{
+    static const uint32_t colours[] = {
+        0x3a6ea5, 0xffffff, 0x000000, 0xd4d0c8, 0x808080, 0x0a246a,
+        0xffcc00, 0x008000, 0xc00000, 0x404040, 0xa0a0a0, 0x6080c0,
+    };
+    int w = SYNTH_WIDTH, h = SYNTH_HEIGHT;
+    int f, i, x, y;
+
+    s->name = "desktop";
+    s->width = w;
+    s->height = h;
+    s->frames = SYNTH_FRAMES;
+    s->frame = alloc_frames(w, h, s->frames);
+
+    for (i = 0; i < w * h; i++) {
+        s->frame[0][i] = colours[0];
+    }
+    for (f = 0; f < s->frames; f++) {
+        if (f) {
+            memcpy(s->frame[f], s->frame[f - 1], w * h * 4);
+        }
+        /* a few 32x32 icons in up to six colours */
+        for (i = 0; i < (f ? 3 : 40); i++) {
+            int x0 = rnd() % (w - 32), y0 = rnd() % (h - 32);
+            uint32_t pal = rnd();
+
+            for (y = 0; y < 32; y++) {
+                for (x = 0; x < 32; x++) {
+                    int c = ((x / 4) ^ (y / 8) ^ (pal >> (x & 7))) % 6;
+                    s->frame[f][(y0 + y) * w + x0 + x] =
+                        colours[(pal + c) % ARRAY_SIZE(colours)];
+                }
+            }
+        }
+    }
+}
+
+static int read_ppm(const char *filename, int *width, int *height,
+                    uint32_t **data)
+{
+    FILE *f = fopen(filename, "rb");
+    int w, h, max, i;
+    uint8_t *rgb;
+
+    if (!f) {
+        perror(filename);
+        return -1;
+    }
+    if (fscanf(f, "P6 %d %d %d", &w, &h, &max) != 3 || max != 255 ||
+        fgetc(f) == EOF) {
+        fprintf(stderr, "%s: not a binary 8-bit PPM file\n", filename);
+        fclose(f);
+        return -1;
+    }
+    rgb = qemu_malloc(w * h * 3);
+    if (fread(rgb, 3, w * h, f) != w * h) {
+        fprintf(stderr, "%s: short file\n", filename);
+        qemu_free(rgb);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    *data = qemu_malloc(w * h * 4);
+    for (i = 0; i < w * h; i++) {
+        (*data)[i] = (rgb[i * 3] << 16) | (rgb[i * 3 + 1] << 8) | rgb[i * 3 + 2];
+    }
+    qemu_free(rgb);
+    *width = w;
+    *height = h;
+    return 0;
+}
+
+static int load_ppm_sequence(Sequence *s, int argc, char **argv)
+{
+    int i, w, h;
+
+    s->name = "capture";
+    s->frames = argc;
+    s->frame = qemu_mallocz(argc * sizeof(*s->frame));
+    for (i = 0; i < argc; i++) {
+        if (read_ppm(argv[i], &w, &h, &s->frame[i]) < 0) {
+            return -1;
+        }
+        if (i && (w != s->width || h != s->height)) {
+            fprintf(stderr, "%s: frame size differs from %s\n",
+                    argv[i], argv[0]);
+            return -1;
+        }
+        s->width = w;
+        s->height = h;
+    }
+    return 0;
+}
+
+/*
+ * Encoding.
+ */
+
+static void setup_display(int width, int height)
+{
+    memset(&surface, 0, sizeof(surface));
+    surface.width = width;
+    surface.height = height;
+    surface.linesize = width * 4;
+    surface.data = qemu_mallocz(width * height * 4);
+    surface.pf.bits_per_pixel = 32;
+    surface.pf.bytes_per_pixel = 4;
+    surface.pf.depth = 24;
+    surface.pf.rmask = 0xff0000;
+    surface.pf.gmask = 0x00ff00;
+    surface.pf.bmask = 0x0000ff;
+    surface.pf.rshift = 16;
+    surface.pf.gshift = 8;
+    surface.pf.bshift = 0;
+    surface.pf.rbits = surface.pf.gbits = surface.pf.bbits = 8;
+    surface.pf.rmax = surface.pf.gmax = surface.pf.bmax = 0xff;
+
+    ds.surface = &surface;
+    vd.ds = &ds;
+    vd.server = &surface;
+    /* lossy enables the gradient filter and JPEG, as with -vnc lossy */
+    vd.lossy = 1;
+    vd.non_adaptive = 1;
+}
+
+static void reset_encoder(const Encoder *enc)
+{
+    if (vs) {
+        vnc_zlib_clear(vs);
+        vnc_tight_clear(vs);
+        buffer_free(&vs->output);
+        qemu_free(vs);
+    }
+    vs = qemu_mallocz(sizeof(*vs));
+    vs->vd = &vd;
+    vs->ds = &ds;
+    vs->clientds = surface;
+    vs->write_pixels = write_pixels_copy;
+    vs->vnc_encoding = enc->encoding;
+    vs->tight.compression = BENCH_COMPRESSION;
+    vs->tight.quality = enc->quality;
+    vnc_hextile_set_pixel_conversion(vs, 0);
+}
+
+/* Bounding box of the pixels that differ between two frames. */
+static int frame_diff(const uint32_t *a, const uint32_t *b, int width,
+                      int height, int *x, int *y, int *w, int *h)
+{
+    int x0 = width, x1 = -1, y0 = height, y1 = -1;
+    int i, j;
+
+    for (j = 0; j < height; j++) {
+        const uint32_t *ra = a + j * width, *rb = b + j * width;
+
+        if (!memcmp(ra, rb, width * 4)) {
+            continue;
+        }
+        y0 = MIN(y0, j);
+        y1 = j;
+        for (i = 0; i < x0 && ra[i] == rb[i]; i++) {
+        }
+        x0 = MIN(x0, i);
+        for (i = width - 1; i > x1 && ra[i] == rb[i]; i--) {
+        }
+        x1 = MAX(x1, i);
+    }
+    if (y1 < 0) {
+        return 0;
+    }
+    *x = x0;
+    *y = y0;
+    *w = x1 - x0 + 1;
+    *h = y1 - y0 + 1;
+    return 1;
+}
+
+static void run(const Sequence *s, const Encoder *enc)
+{
+    int64_t start, elapsed = 0;
+    uint64_t in = 0, out = 0;
+    uint32_t crc = 0;
+    char test[64];
+    int f, pass, x, y, w, h;
+
+    for (pass = 0; ; pass++) {
+        reset_encoder(enc);
+        start = get_clock();
+        for (f = 0; f < s->frames; f++) {
+            memcpy(surface.data, s->frame[f], s->width * s->height * 4);
+            if (f == 0) {
+                x = y = 0;
+                w = s->width;
+                h = s->height;
+            } else if (!frame_diff(s->frame[f - 1], s->frame[f],
+                                   s->width, s->height, &x, &y, &w, &h)) {
+                continue;
+            }
+            buffer_reset(&vs->output);
+            switch (enc->encoding) {
+            case VNC_ENCODING_HEXTILE:
+                vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_HEXTILE);
+                vnc_hextile_send_framebuffer_update(vs, x, y, w, h);
+                break;
+            case VNC_ENCODING_ZLIB:
+                vnc_zlib_send_framebuffer_update(vs, x, y, w, h);
+                break;
+            case VNC_ENCODING_TIGHT:
+                vnc_tight_send_framebuffer_update(vs, x, y, w, h);
+                break;
+            case VNC_ENCODING_TIGHT_PNG:
+                vnc_tight_png_send_framebuffer_update(vs, x, y, w, h);
+                break;
+            default:
+                vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_RAW);
+                vnc_raw_send_framebuffer_update(vs, x, y, w, h);
+                break;
+            }
+            if (pass == 0) {
+                in += w * h * 4;
+                out += vs->output.offset;
+                crc = crc32(crc, vs->output.buffer, vs->output.offset);
+            }
+        }
+        /* the first pass warms up and collects the stream statistics */
+        if (pass == 0) {
+            continue;
+        }
+        elapsed += get_clock() - start;
+        if (elapsed >= BENCH_NS) {
+            break;
+        }
+    }
+
+    printf("%-10s %-11s %9.1f MB/s %8.2f:1  crc %08x\n", s->name, enc->name,
+           in * pass / (elapsed / 1e9) / (1 << 20), (double)in / out, crc);
+    snprintf(test, sizeof(test), "%s, %s", s->name, enc->name);
+    bench_result(test, in * pass / (elapsed / 1e9) / (1 << 20), "MB/s");
+    snprintf(test, sizeof(test), "%s, %s, ratio", s->name, enc->name);
+    bench_result(test, (double)in / out, "ratio");
+}
+
+static void run_sequence(const Sequence *s)
+{
+    int i;
+
+    setup_display(s->width, s->height);
+    for (i = 0; i < ARRAY_SIZE(encoders); i++) {
+        run(s, &encoders[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Sequence s;
+
+    bench_init("vnc");
+    if (argc > 1) {
+        memset(&s, 0, sizeof(s));
+        if (load_ppm_sequence(&s, argc - 1, argv + 1) < 0) {
+            return 1;
+        }
+        run_sequence(&s);
+        return 0;
+    }
+
+    synth_terminal(&s);
+    run_sequence(&s);
+    synth_photo(&s);
+    run_sequence(&s);
+    synth_desktop(&s);
+    run_sequence(&s);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Reporting for the microbenchmarks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qemu-common.h"
+#include "bench.h"
+
+static const char *bench_name;
+
+void bench_init(const char *name)
+{
+    bench_name = name;
+}
+
+static void bench_put_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+        }
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+void bench_result(const char *test, double value, const char *unit)
+{
+    const char *filename = getenv("QEMU_BENCH_JSON");
+    FILE *f;
+
+    if (!filename || !*filename) {
+        return;
+    }
+    f = fopen(filename, "a");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fprintf(f, "{\"bench\": ");
+    bench_put_string(f, bench_name);
+    fprintf(f, ", \"test\": ");
+    bench_put_string(f, test);
+    fprintf(f, ", \"value\": %.6g, \"unit\": ", value);
+    bench_put_string(f, unit);
+    fprintf(f, ", \"version\": \"%s\"}\n", QEMU_VERSION);
+    fclose(f);
+}
@@ -0,0 +1,20 @@
+/*
+ * Reporting for the microbenchmarks
+ *
+ * Each bench-* program prints its results for people to read, and also
+ * hands every number to bench_result().  When QEMU_BENCH_JSON names a
+ * file, each result is appended to it as one JSON object per line, for
+ * comparing builds and tracking the numbers over time.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+void bench_init(const char *name);
+void bench_result(const char *test, double value, const char *unit);
+
+#endif
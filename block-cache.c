@@ -0,0 +1,443 @@
+/*
+ * Read cache for backing files
+ *
+ * Many images often share the same read only base image, and with
+ * cache=none each of them reads the same clusters of it from the storage
+ * again.  The backing file cache keeps what was read from backing files in
+ * a memory area of a fixed size, one for all images, in lines keyed by the
+ * backing file and the line in it.  Backing files are found by their real
+ * path, so that drives sharing a base image share its lines.
+ *
+ * The memory area can be a file in a directory, e.g. on hugetlbfs for huge
+ * pages or on an SSD for a cache larger than the RAM to spare.
+ *
+ * Lines are only filled by whole requests that missed, and evicted least
+ * recently used first.  A backing file must not change while it is cached;
+ * bdrv_commit() invalidates what it writes to.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "qemu-objects.h"
+#include "monitor.h"
+#include "block.h"
+#include "block-cache.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#define BLOCK_CACHE_LINE_SIZE (BLOCK_CACHE_LINE_SECTORS * BDRV_SECTOR_SIZE)
+
+typedef struct BlockCacheLine {
+    BlockCacheImage *img;       /* NULL while free */
+    int64_t index;              /* line in the image */
+    uint8_t *data;
+    QLIST_ENTRY(BlockCacheLine) hash_entry;
+    QLIST_ENTRY(BlockCacheLine) img_entry;
+    QTAILQ_ENTRY(BlockCacheLine) lru_entry;
+} BlockCacheLine;
+
+struct BlockCacheImage {
+    char *filename;
+    int refcount;
+    int nb_lines;
+    uint64_t hits;              /* requests served from the cache */
+    uint64_t misses;
+    QLIST_HEAD(, BlockCacheLine) lines;
+    QLIST_ENTRY(BlockCacheImage) next;
+};
+
+typedef struct BlockCache {
+    uint8_t *mem;
+    size_t size;
+    int mapped;                 /* mem is a mapped file */
+    BlockCacheLine *lines;
+    int nb_lines;
+    int nb_used;
+    QLIST_HEAD(, BlockCacheLine) *hash;
+    unsigned int hash_mask;
+    QTAILQ_HEAD(BlockCacheLRU, BlockCacheLine) lru; /* most recent first */
+    QTAILQ_HEAD(, BlockCacheLine) free_lines;
+    QLIST_HEAD(, BlockCacheImage) images;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} BlockCache;
+
+static BlockCache *block_cache;
+
+#ifndef _WIN32
+/* Map a deleted file in path, e.g. on hugetlbfs or an SSD */
+static uint8_t *block_cache_map_file(const char *path, size_t *size)
+{
+    char *filename;
+    struct stat st;
+    void *area;
+    int fd;
+
+    if (asprintf(&filename, "%s/qemu_backing_cache.XXXXXX", path) == -1) {
+        return NULL;
+    }
+    fd = mkstemp(filename);
+    if (fd < 0) {
+        fprintf(stderr, "cannot create the backing file cache in %s: %s\n",
+                path, strerror(errno));
+        free(filename);
+        return NULL;
+    }
+    unlink(filename);
+    free(filename);
+
+    /* whole huge pages on hugetlbfs */
+    if (fstat(fd, &st) == 0 && st.st_blksize > 0) {
+        *size = (*size + st.st_blksize - 1) & ~((size_t)st.st_blksize - 1);
+    }
+    if (ftruncate(fd, *size) < 0) {
+        /* not supported by hugetlbfs on older hosts, mmap will tell */
+        perror("ftruncate");
+    }
+    area = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (area == MAP_FAILED) {
+        fprintf(stderr, "cannot map the backing file cache in %s: %s\n",
+                path, strerror(errno));
+        return NULL;
+    }
+    return area;
+}
+#endif
+
+/* Cache what is read from backing files in size bytes of memory, allocated
+   in a file in path if path is not NULL */
+int block_cache_init(int64_t size, const char *path)
+{
+    BlockCache *c;
+    size_t mem_size = size;
+    int i;
+
+    if (block_cache) {
+        fprintf(stderr, "the backing file cache is already set up\n");
+        return -EEXIST;
+    }
+    if (size < BLOCK_CACHE_LINE_SIZE || mem_size != size) {
+        fprintf(stderr, "invalid backing file cache size %" PRId64 "\n",
+                size);
+        return -EINVAL;
+    }
+
+    c = qemu_mallocz(sizeof(*c));
+    if (path) {
+#ifndef _WIN32
+        c->mem = block_cache_map_file(path, &mem_size);
+        if (!c->mem) {
+            qemu_free(c);
+            return -EIO;
+        }
+        c->mapped = 1;
+#else
+        fprintf(stderr, "the backing file cache cannot be in a file\n");
+        qemu_free(c);
+        return -ENOTSUP;
+#endif
+    } else {
+        c->mem = qemu_vmalloc(mem_size);
+    }
+    c->size = mem_size;
+
+    c->nb_lines = mem_size / BLOCK_CACHE_LINE_SIZE;
+    c->lines = qemu_mallocz(c->nb_lines * sizeof(*c->lines));
+    QTAILQ_INIT(&c->lru);
+    QTAILQ_INIT(&c->free_lines);
+    for (i = 0; i < c->nb_lines; i++) {
+        c->lines[i].data = c->mem + (size_t)i * BLOCK_CACHE_LINE_SIZE;
+        QTAILQ_INSERT_TAIL(&c->free_lines, &c->lines[i], lru_entry);
+    }
+
+    /* about two lines per bucket */
+    for (c->hash_mask = 1; c->hash_mask < c->nb_lines / 2; ) {
+        c->hash_mask <<= 1;
+    }
+    c->hash = qemu_mallocz(c->hash_mask * sizeof(*c->hash));
+    c->hash_mask--;
+
+    QLIST_INIT(&c->images);
+    block_cache = c;
+    return 0;
+}
+
+int block_cache_enabled(void)
+{
+    return block_cache != NULL;
+}
+
+static unsigned int block_cache_hash(BlockCacheImage *img, int64_t index)
+{
+    uint64_t h = (uintptr_t)img ^ (index * 0x9e3779b97f4a7c15ULL);
+
+    return (h ^ (h >> 32)) & block_cache->hash_mask;
+}
+
+static BlockCacheLine *block_cache_lookup(BlockCacheImage *img,
+                                          int64_t index)
+{
+    BlockCacheLine *line;
+
+    QLIST_FOREACH(line, &block_cache->hash[block_cache_hash(img, index)],
+                  hash_entry) {
+        if (line->img == img && line->index == index) {
+            return line;
+        }
+    }
+    return NULL;
+}
+
+static void block_cache_drop(BlockCacheLine *line)
+{
+    BlockCache *c = block_cache;
+
+    QLIST_REMOVE(line, hash_entry);
+    QLIST_REMOVE(line, img_entry);
+    QTAILQ_REMOVE(&c->lru, line, lru_entry);
+    QTAILQ_INSERT_TAIL(&c->free_lines, line, lru_entry);
+    line->img->nb_lines--;
+    line->img = NULL;
+    c->nb_used--;
+}
+
+/* Returns a reference to the cache of filename, NULL without a cache */
+BlockCacheImage *block_cache_open(const char *filename)
+{
+    BlockCacheImage *img;
+    char *path;
+
+    if (!block_cache) {
+        return NULL;
+    }
+
+#ifndef _WIN32
+    path = realpath(filename, NULL);
+    if (path) {
+        char *tmp = qemu_strdup(path);
+        free(path);
+        path = tmp;
+    } else
+#endif
+    {
+        /* protocols, e.g. nbd: */
+        path = qemu_strdup(filename);
+    }
+
+    QLIST_FOREACH(img, &block_cache->images, next) {
+        if (!strcmp(img->filename, path)) {
+            qemu_free(path);
+            img->refcount++;
+            return img;
+        }
+    }
+
+    img = qemu_mallocz(sizeof(*img));
+    img->filename = path;
+    img->refcount = 1;
+    QLIST_INIT(&img->lines);
+    QLIST_INSERT_HEAD(&block_cache->images, img, next);
+    return img;
+}
+
+void block_cache_ref(BlockCacheImage *img)
+{
+    img->refcount++;
+}
+
+/* Drops a reference; the lines of an image go with its last one */
+void block_cache_close(BlockCacheImage *img)
+{
+    if (--img->refcount > 0) {
+        return;
+    }
+    block_cache_invalidate(img);
+    QLIST_REMOVE(img, next);
+    qemu_free(img->filename);
+    qemu_free(img);
+}
+
+void block_cache_invalidate(BlockCacheImage *img)
+{
+    while (!QLIST_EMPTY(&img->lines)) {
+        block_cache_drop(QLIST_FIRST(&img->lines));
+    }
+}
+
+/* Copy len bytes of buf to offset in qiov */
+static void block_cache_copy_to_iov(QEMUIOVector *qiov, size_t offset,
+                                    const uint8_t *buf, size_t len)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov && len > 0; i++) {
+        struct iovec *iov = &qiov->iov[i];
+        size_t n;
+
+        if (offset >= iov->iov_len) {
+            offset -= iov->iov_len;
+            continue;
+        }
+        n = MIN(len, iov->iov_len - offset);
+        memcpy((uint8_t *)iov->iov_base + offset, buf, n);
+        buf += n;
+        len -= n;
+        offset = 0;
+    }
+}
+
+/* Reads nb_sectors at sector_num into qiov if they are all cached; returns
+   1 then, and 0 if the request has to go to the image */
+int block_cache_read(BlockCacheImage *img, int64_t sector_num,
+                     QEMUIOVector *qiov, int nb_sectors)
+{
+    BlockCache *c = block_cache;
+    int64_t first = sector_num / BLOCK_CACHE_LINE_SECTORS;
+    int64_t last = (sector_num + nb_sectors - 1) / BLOCK_CACHE_LINE_SECTORS;
+    int64_t index;
+    size_t done = 0;
+
+    for (index = first; index <= last; index++) {
+        if (!block_cache_lookup(img, index)) {
+            img->misses++;
+            c->misses++;
+            return 0;
+        }
+    }
+
+    for (index = first; index <= last; index++) {
+        BlockCacheLine *line = block_cache_lookup(img, index);
+        int64_t start = MAX(sector_num, index * BLOCK_CACHE_LINE_SECTORS);
+        int64_t end = MIN(sector_num + nb_sectors,
+                          (index + 1) * BLOCK_CACHE_LINE_SECTORS);
+        size_t len = (end - start) * BDRV_SECTOR_SIZE;
+
+        block_cache_copy_to_iov(qiov, done, line->data +
+            (start - index * BLOCK_CACHE_LINE_SECTORS) * BDRV_SECTOR_SIZE,
+            len);
+        done += len;
+
+        QTAILQ_REMOVE(&c->lru, line, lru_entry);
+        QTAILQ_INSERT_HEAD(&c->lru, line, lru_entry);
+    }
+    img->hits++;
+    c->hits++;
+    return 1;
+}
+
+/* Caches the whole lines in buf, read at the line aligned sector_num */
+void block_cache_insert(BlockCacheImage *img, int64_t sector_num,
+                        const uint8_t *buf, int nb_sectors)
+{
+    BlockCache *c = block_cache;
+    int64_t index = sector_num / BLOCK_CACHE_LINE_SECTORS;
+    int i;
+
+    assert(sector_num % BLOCK_CACHE_LINE_SECTORS == 0);
+
+    for (i = 0; i < nb_sectors / BLOCK_CACHE_LINE_SECTORS; i++, index++) {
+        BlockCacheLine *line = block_cache_lookup(img, index);
+
+        if (!line) {
+            if (QTAILQ_EMPTY(&c->free_lines)) {
+                block_cache_drop(QTAILQ_LAST(&c->lru, BlockCacheLRU));
+                c->evictions++;
+            }
+            line = QTAILQ_FIRST(&c->free_lines);
+            QTAILQ_REMOVE(&c->free_lines, line, lru_entry);
+            line->img = img;
+            line->index = index;
+            memcpy(line->data, buf + (size_t)i * BLOCK_CACHE_LINE_SIZE,
+                   BLOCK_CACHE_LINE_SIZE);
+            QLIST_INSERT_HEAD(&c->hash[block_cache_hash(img, index)], line,
+                              hash_entry);
+            QLIST_INSERT_HEAD(&img->lines, line, img_entry);
+            img->nb_lines++;
+            c->nb_used++;
+        } else {
+            QTAILQ_REMOVE(&c->lru, line, lru_entry);
+        }
+        QTAILQ_INSERT_HEAD(&c->lru, line, lru_entry);
+    }
+}
+
+void block_cache_info(Monitor *mon, QObject **ret_data)
+{
+    BlockCache *c = block_cache;
+    BlockCacheImage *img;
+    QList *images = qlist_new();
+    QObject *obj;
+
+    if (!c) {
+        *ret_data = qobject_from_jsonf("{ 'enabled': false }");
+        QDECREF(images);
+        return;
+    }
+
+    QLIST_FOREACH(img, &c->images, next) {
+        qlist_append_obj(images, qobject_from_jsonf(
+            "{ 'file': %s, 'used': %" PRId64 ", 'hits': %" PRId64 ", "
+            "'misses': %" PRId64 " }",
+            img->filename, (int64_t)(img->nb_lines * BLOCK_CACHE_LINE_SIZE),
+            img->hits, img->misses));
+    }
+
+    obj = qobject_from_jsonf("{ 'enabled': true, 'size': %" PRId64 ", "
+                             "'used': %" PRId64 ", 'hits': %" PRId64 ", "
+                             "'misses': %" PRId64 ", "
+                             "'evictions': %" PRId64 ", 'file': %i }",
+                             (int64_t)c->size,
+                             (int64_t)(c->nb_used * BLOCK_CACHE_LINE_SIZE),
+                             c->hits, c->misses, c->evictions, c->mapped);
+    qdict_put_obj(qobject_to_qdict(obj), "images", QOBJECT(images));
+    *ret_data = obj;
+}
+
+static int block_cache_hit_rate(QDict *dict)
+{
+    int64_t hits = qdict_get_int(dict, "hits");
+    int64_t total = hits + qdict_get_int(dict, "misses");
+
+    return total ? hits * 100 / total : 0;
+}
+
+static void block_cache_image_print(QObject *obj, void *opaque)
+{
+    QDict *img = qobject_to_qdict(obj);
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "%s: %" PRId64 " bytes, %" PRId64 " hits, "
+                   "%" PRId64 " misses (%d%% hit rate)\n",
+                   qdict_get_str(img, "file"), qdict_get_int(img, "used"),
+                   qdict_get_int(img, "hits"), qdict_get_int(img, "misses"),
+                   block_cache_hit_rate(img));
+}
+
+void block_cache_info_print(Monitor *mon, const QObject *data)
+{
+    QDict *dict = qobject_to_qdict(data);
+
+    if (!qdict_get_bool(dict, "enabled")) {
+        monitor_printf(mon, "Backing file cache disabled\n");
+        return;
+    }
+    monitor_printf(mon, "size: %" PRId64 " bytes%s\n"
+                   "used: %" PRId64 " bytes\n"
+                   "hits: %" PRId64 "\n"
+                   "misses: %" PRId64 " (%d%% hit rate)\n"
+                   "evictions: %" PRId64 "\n",
+                   qdict_get_int(dict, "size"),
+                   qdict_get_bool(dict, "file") ? " in a file" : "",
+                   qdict_get_int(dict, "used"), qdict_get_int(dict, "hits"),
+                   qdict_get_int(dict, "misses"), block_cache_hit_rate(dict),
+                   qdict_get_int(dict, "evictions"));
+    qlist_iter(qdict_get_qlist(dict, "images"), block_cache_image_print, mon);
+}
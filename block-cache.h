@@ -0,0 +1,36 @@
+/*
+ * Read cache for backing files
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_BLOCK_CACHE_H
+#define QEMU_BLOCK_CACHE_H
+
+#include "qemu-common.h"
+#include "qobject.h"
+
+/* The cache works on lines of this many sectors */
+#define BLOCK_CACHE_LINE_SECTORS 128
+
+typedef struct BlockCacheImage BlockCacheImage;
+
+int block_cache_init(int64_t size, const char *path);
+int block_cache_enabled(void);
+
+BlockCacheImage *block_cache_open(const char *filename);
+void block_cache_ref(BlockCacheImage *img);
+void block_cache_close(BlockCacheImage *img);
+void block_cache_invalidate(BlockCacheImage *img);
+
+int block_cache_read(BlockCacheImage *img, int64_t sector_num,
+                     QEMUIOVector *qiov, int nb_sectors);
+void block_cache_insert(BlockCacheImage *img, int64_t sector_num,
+                        const uint8_t *buf, int nb_sectors);
+
+void block_cache_info(Monitor *mon, QObject **ret_data);
+void block_cache_info_print(Monitor *mon, const QObject *data);
+
+#endif
@@ -27,9 +27,15 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* reads in flight a device starts with, and the window over which its
+   read bandwidth is measured to adapt that */
+#define BLK_MIG_INITIAL_DEPTH 2
+#define BLK_MIG_ADAPT_WINDOW 100000000LL
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -51,6 +57,12 @@ typedef struct BlkMigDevState {
     int64_t dirty;
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
     unsigned long *aio_bitmap;
+    int submitted;              /* reads in flight */
+    int aio_depth;              /* reads it may currently have in flight */
+    int64_t busy_start;         /* when the current window started */
+    int64_t busy_time;          /* ns with reads in flight in this window */
+    int64_t window_bytes;       /* read in this window */
+    long double prev_bwidth;    /* bytes per ns read in the last window */
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
@@ -83,20 +95,50 @@ typedef struct BlkMigState {
 
 static BlkMigState block_mig_state;
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, int flags)
 {
     int len;
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
-    len = strlen(blk->bmds->bs->device_name);
+    len = strlen(bmds->bs->device_name);
     qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+    qemu_put_buffer(f, (uint8_t *)bmds->bs->device_name, len);
+}
+
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
+    int flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    /* zero blocks, most of a sparse image, are sent without their data */
+    if (buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    }
+
+    blk_send_header(f, blk->bmds, blk->sector, flags);
+
+    if (!(flags & BLK_MIG_FLAG_ZERO_BLOCK)) {
+        qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    }
+}
+
+/* Whether nothing is allocated in the image itself from sector on */
+static int blk_is_unallocated(BlockDriverState *bs, int64_t sector,
+                              int nr_sectors)
+{
+    int n;
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    while (nr_sectors > 0) {
+        if (bdrv_is_allocated(bs, sector, nr_sectors, &n) || n <= 0) {
+            return 0;
+        }
+        sector += n;
+        nr_sectors -= n;
+    }
+    return 1;
 }
 
 int blk_mig_active(void)
@@ -189,22 +231,108 @@ static void alloc_aio_bitmap(BlkMigDevState *bmds)
     bmds->aio_bitmap = qemu_mallocz(bitmap_size);
 }
 
+/* Once a window worth of reads of a device completed, let it have one read
+   more in flight if its bandwidth went up noticeably since the last window,
+   one less if it went down, up to the configured queue depth */
+static void bmds_adapt_depth(BlkMigDevState *bmds, int64_t now)
+{
+    int64_t busy = bmds->busy_time;
+    long double bwidth;
+
+    if (bmds->submitted) {
+        busy += now - bmds->busy_start;
+    }
+    if (busy < BLK_MIG_ADAPT_WINDOW) {
+        return;
+    }
+
+    bwidth = bmds->window_bytes / (long double)busy;
+    if (bwidth > bmds->prev_bwidth * 1.1) {
+        bmds->aio_depth++;
+    } else if (bwidth < bmds->prev_bwidth * 0.9) {
+        bmds->aio_depth--;
+    }
+    bmds->aio_depth = MAX(1, MIN(bmds->aio_depth,
+                                 migrate_block_queue_depth()));
+    DPRINTF("%s read %Lg bytes/ns, depth %d\n", bmds->bs->device_name,
+            bwidth, bmds->aio_depth);
+
+    bmds->prev_bwidth = bwidth;
+    bmds->window_bytes = 0;
+    bmds->busy_time = 0;
+    bmds->busy_start = now;
+}
+
 static void blk_mig_read_cb(void *opaque, int ret)
 {
     BlkMigBlock *blk = opaque;
+    BlkMigDevState *bmds = blk->bmds;
+    int64_t now = qemu_get_clock_ns(rt_clock);
 
     blk->ret = ret;
 
-    blk->time = qemu_get_clock_ns(rt_clock) - blk->time;
+    blk->time = now - blk->time;
 
     add_avg_read_time(blk->time);
 
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
-    bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
+    bmds_set_aio_inflight(bmds, blk->sector, blk->nr_sectors, 0);
 
     block_mig_state.submitted--;
     block_mig_state.read_done++;
     assert(block_mig_state.submitted >= 0);
+
+    bmds->submitted--;
+    bmds->window_bytes += blk->nr_sectors << BDRV_SECTOR_BITS;
+    if (bmds->submitted == 0) {
+        bmds->busy_time += now - bmds->busy_start;
+    }
+    bmds_adapt_depth(bmds, now);
+}
+
+static int blk_mig_read_async(BlkMigBlock *blk)
+{
+    BlkMigDevState *bmds = blk->bmds;
+
+    blk->iov.iov_base = blk->buf;
+    blk->iov.iov_len = blk->nr_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+    blk->time = qemu_get_clock_ns(rt_clock);
+
+    blk->aiocb = bdrv_aio_readv(bmds->bs, blk->sector, &blk->qiov,
+                                blk->nr_sectors, blk_mig_read_cb, blk);
+    if (!blk->aiocb) {
+        return -1;
+    }
+    block_mig_state.submitted++;
+
+    if (bmds->submitted++ == 0) {
+        bmds->busy_start = blk->time;
+    }
+    return 0;
+}
+
+/* Whether to stop queueing reads for now: the device being migrated has
+   as many in flight as it takes, a tick worth of data already waits to be
+   sent, or the file is rate limited */
+static int blk_mig_queue_full(QEMUFile *f)
+{
+    BlkMigDevState *bmds;
+
+    if (qemu_file_rate_limit(f) ||
+        block_mig_state.read_done * BLOCK_SIZE >=
+        qemu_file_get_rate_limit(f)) {
+        return 1;
+    }
+
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        if (block_mig_state.bulk_completed ?
+            bmds->cur_dirty < bmds->total_sectors : !bmds->bulk_completed) {
+            return bmds->submitted >= bmds->aio_depth;
+        }
+    }
+    return 0;
 }
 
 static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
@@ -229,10 +357,35 @@ static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
         return 1;
     }
 
-    bmds->completed_sectors = cur_sector;
-
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
+    if (!bmds->shared_base && !bs->backing_hd) {
+        /* Unallocated chunks of a thin image read as zeroes, skip reading
+           them.  Their dirty bit is left alone: a write of the guest still
+           in flight would not show as allocated yet. */
+        while (cur_sector < total_sectors && !qemu_file_rate_limit(f)) {
+            nr_sectors = MIN(BDRV_SECTORS_PER_DIRTY_CHUNK,
+                             total_sectors - cur_sector);
+            if (!blk_is_unallocated(bs, cur_sector, nr_sectors)) {
+                break;
+            }
+            blk_send_header(f, bmds, cur_sector, BLK_MIG_FLAG_DEVICE_BLOCK |
+                                                 BLK_MIG_FLAG_ZERO_BLOCK);
+            cur_sector += nr_sectors;
+        }
+        bmds->cur_sector = cur_sector;
+        if (cur_sector >= total_sectors) {
+            bmds->completed_sectors = total_sectors;
+            return 1;
+        }
+        if (qemu_file_rate_limit(f)) {
+            bmds->completed_sectors = cur_sector;
+            return 0;
+        }
+    }
+
+    bmds->completed_sectors = cur_sector;
+
     /* we are going to transfer a full block even if it is not allocated */
     nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
 
@@ -246,18 +399,9 @@ static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
     blk->sector = cur_sector;
     blk->nr_sectors = nr_sectors;
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-    blk->time = qemu_get_clock_ns(rt_clock);
-
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
-    if (!blk->aiocb) {
+    if (blk_mig_read_async(blk) < 0) {
         goto error;
     }
-    block_mig_state.submitted++;
 
     bdrv_reset_dirty(bs, cur_sector, nr_sectors);
     bmds->cur_sector = cur_sector + nr_sectors;
@@ -299,6 +443,8 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
         bmds->total_sectors = sectors;
         bmds->completed_sectors = 0;
         bmds->shared_base = block_mig_state.shared_base;
+        bmds->aio_depth = MIN(BLK_MIG_INITIAL_DEPTH,
+                              migrate_block_queue_depth());
         alloc_aio_bitmap(bmds);
         drive_get_ref(drive_get_by_blockdev(bs));
         bdrv_set_in_use(bs, 1);
@@ -389,7 +535,7 @@ static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
 
     for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
         if (bmds_aio_inflight(bmds, sector)) {
-            qemu_aio_flush();
+            bdrv_drain_all();
         }
         if (bdrv_get_dirty(bmds->bs, sector)) {
 
@@ -405,18 +551,9 @@ static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
             blk->nr_sectors = nr_sectors;
 
             if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                blk->time = qemu_get_clock_ns(rt_clock);
-
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                if (!blk->aiocb) {
+                if (blk_mig_read_async(blk) < 0) {
                     goto error;
                 }
-                block_mig_state.submitted++;
                 bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
             } else {
                 if (bdrv_read(bmds->bs, sector, blk->buf,
@@ -461,7 +598,7 @@ static int blk_mig_save_dirty_block(Monitor *mon, QEMUFile *f, int is_async)
     return ret;
 }
 
-static void flush_blks(QEMUFile* f)
+static void flush_blks(QEMUFile* f, int rate_limited)
 {
     BlkMigBlock *blk;
 
@@ -470,7 +607,7 @@ static void flush_blks(QEMUFile* f)
             block_mig_state.transferred);
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
-        if (qemu_file_rate_limit(f)) {
+        if (rate_limited && qemu_file_rate_limit(f)) {
             break;
         }
         if (blk->ret < 0) {
@@ -578,7 +715,13 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         set_dirty_tracking(1);
     }
 
-    flush_blks(f);
+    if (stage == 3) {
+        /* the vm may have been stopped already, without waiting for the
+           reads of stage 2; all of them must be sent now */
+        bdrv_drain_all();
+    }
+
+    flush_blks(f, stage != 3);
 
     if (qemu_file_has_error(f)) {
         blk_mig_cleanup(mon);
@@ -589,9 +732,7 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
     if (stage == 2) {
         /* control the rate of transfer */
-        while ((block_mig_state.submitted +
-                block_mig_state.read_done) * BLOCK_SIZE <
-               qemu_file_get_rate_limit(f)) {
+        while (!blk_mig_queue_full(f)) {
             if (block_mig_state.bulk_completed == 0) {
                 /* first finish the bulk phase */
                 if (blk_mig_save_bulked_block(mon, f) == 0) {
@@ -606,7 +747,7 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
             }
         }
 
-        flush_blks(f);
+        flush_blks(f, 1);
 
         if (qemu_file_has_error(f)) {
             blk_mig_cleanup(mon);
@@ -684,12 +825,21 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = qemu_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
-            ret = bdrv_write(bs, addr, buf, nr_sectors);
+            if ((flags & BLK_MIG_FLAG_ZERO_BLOCK) && !bs->backing_hd &&
+                blk_is_unallocated(bs, addr, nr_sectors)) {
+                /* already reads as zeroes, keep the image thin */
+                ret = 0;
+            } else {
+                if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                    buf = qemu_mallocz(BLOCK_SIZE);
+                } else {
+                    buf = qemu_malloc(BLOCK_SIZE);
+                    qemu_get_buffer(f, buf, BLOCK_SIZE);
+                }
+                ret = bdrv_write(bs, addr, buf, nr_sectors);
 
-            qemu_free(buf);
+                qemu_free(buf);
+            }
             if (ret < 0) {
                 return ret;
             }
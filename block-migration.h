@@ -14,6 +14,8 @@
 #ifndef BLOCK_MIGRATION_H
 #define BLOCK_MIGRATION_H
 
+#define BLK_MIG_QUEUE_DEPTH_MAX 256
+
 void blk_mig_init(void);
 int blk_mig_active(void);
 uint64_t blk_mig_bytes_transferred(void);
@@ -0,0 +1,310 @@
+/*
+ * Background streaming of backing files into images
+ *
+ * A stream job copies every cluster that an image does not allocate from
+ * its backing chain into the image, and drops the backing file once the
+ * image holds all of its data.  It copies with copy on read, so that the
+ * guest keeps running and its writes are never overwritten by a copy.
+ *
+ * The job runs from an rt_clock timer, one chunk at a time, and waits
+ * between chunks to stay under its speed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "monitor.h"
+#include "qjson.h"
+#include "qlist.h"
+#include "block_int.h"
+#include "block-stream.h"
+
+/* Bytes copied at once */
+#define STREAM_CHUNK_SIZE (512 * 1024)
+
+typedef struct BlockStreamJob {
+    BlockDriverState *bs;
+    int64_t sector_num;         /* where the copy is */
+    int64_t total_sectors;
+    int64_t speed;              /* bytes per second, 0 for no limit */
+    int64_t next_chunk;         /* rt_clock ns the next chunk may start */
+    int nb_sectors;             /* being copied */
+    BlockDriverAIOCB *aiocb;
+    QEMUTimer *timer;
+    QLIST_ENTRY(BlockStreamJob) next;
+} BlockStreamJob;
+
+static QLIST_HEAD(, BlockStreamJob) stream_jobs =
+    QLIST_HEAD_INITIALIZER(stream_jobs);
+
+static BlockStreamJob *stream_find(const char *device)
+{
+    BlockStreamJob *job;
+
+    QLIST_FOREACH(job, &stream_jobs, next) {
+        if (!strcmp(bdrv_get_device_name(job->bs), device)) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static QObject *stream_info(BlockStreamJob *job)
+{
+    return qobject_from_jsonf("{ 'device': %s, 'type': 'stream', "
+                              "'len': %" PRId64 ", 'offset': %" PRId64 ", "
+                              "'speed': %" PRId64 " }",
+                              bdrv_get_device_name(job->bs),
+                              job->total_sectors << BDRV_SECTOR_BITS,
+                              job->sector_num << BDRV_SECTOR_BITS,
+                              job->speed);
+}
+
+static void stream_end(BlockStreamJob *job, int ret, int cancelled)
+{
+    QObject *data = stream_info(job);
+
+    if (ret < 0) {
+        qdict_put(qobject_to_qdict(data), "error",
+                  qstring_from_str(strerror(-ret)));
+    }
+    monitor_protocol_event(cancelled ? QEVENT_BLOCK_JOB_CANCELLED :
+                           QEVENT_BLOCK_JOB_COMPLETED, data);
+    qobject_decref(data);
+
+    QLIST_REMOVE(job, next);
+    qemu_del_timer(job->timer);
+    qemu_free_timer(job->timer);
+    bdrv_disable_copy_on_read(job->bs);
+    bdrv_set_in_use(job->bs, 0);
+    qemu_free(job);
+}
+
+/* The first sector from sector_num on not allocated in bs, or the end */
+static int64_t stream_find_backing(BlockDriverState *bs, int64_t sector_num,
+                                   int64_t total_sectors, int64_t *pnum)
+{
+    BlockExtent e;
+    int n;
+
+    while (sector_num < total_sectors) {
+        n = bdrv_get_block_map(bs, sector_num, total_sectors - sector_num,
+                               &e, 1);
+        if (n < 0) {
+            return n;
+        } else if (n == 0) {
+            break;
+        } else if (!(e.flags & BDRV_EXTENT_ALLOCATED)) {
+            *pnum = e.nb_sectors;
+            return e.sector_num;
+        }
+        sector_num = e.sector_num + e.nb_sectors;
+    }
+    return total_sectors;
+}
+
+/* The image has all of its data, make it stand on its own */
+static int stream_drop_backing(BlockDriverState *bs)
+{
+    int ret;
+
+    /* reads that went to the backing file before the last copy */
+    bdrv_drain_all();
+
+    ret = bdrv_change_backing_file(bs, NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    bdrv_delete(bs->backing_hd);
+    bs->backing_hd = NULL;
+    bs->backing_file[0] = '\0';
+    bs->backing_format[0] = '\0';
+    return 0;
+}
+
+static void stream_cb(void *opaque, int ret)
+{
+    BlockStreamJob *job = opaque;
+
+    job->aiocb = NULL;
+    if (ret < 0) {
+        stream_end(job, ret, 0);
+        return;
+    }
+    job->sector_num += job->nb_sectors;
+
+    /* go on from the main loop, not from the completion */
+    qemu_mod_timer(job->timer, qemu_get_clock(rt_clock));
+}
+
+static void stream_run(void *opaque)
+{
+    BlockStreamJob *job = opaque;
+    BlockDriverState *bs = job->bs;
+    int64_t sector_num, nb_sectors = 0, now;
+
+    sector_num = stream_find_backing(bs, job->sector_num, job->total_sectors,
+                                     &nb_sectors);
+    if (sector_num == job->total_sectors && job->sector_num > 0) {
+        /* check that nothing was left behind, e.g. after an error */
+        sector_num = stream_find_backing(bs, 0, job->total_sectors,
+                                         &nb_sectors);
+    }
+    if (sector_num < 0) {
+        stream_end(job, sector_num, 0);
+        return;
+    }
+    job->sector_num = sector_num;
+    if (sector_num == job->total_sectors) {
+        stream_end(job, stream_drop_backing(bs), 0);
+        return;
+    }
+
+    now = qemu_get_clock_ns(rt_clock);
+    if (job->speed && now < job->next_chunk) {
+        /* rt_clock timers have a ms resolution */
+        qemu_mod_timer(job->timer, (job->next_chunk + 999999) / 1000000);
+        return;
+    }
+
+    job->nb_sectors = MIN(nb_sectors, STREAM_CHUNK_SIZE / BDRV_SECTOR_SIZE);
+    if (job->speed) {
+        job->next_chunk = MAX(now, job->next_chunk) +
+            job->nb_sectors * BDRV_SECTOR_SIZE * 1000000000LL / job->speed;
+    }
+    job->aiocb = bdrv_aio_copy_backing(bs, job->sector_num, job->nb_sectors,
+                                       stream_cb, job);
+    if (!job->aiocb) {
+        stream_end(job, -EIO, 0);
+    }
+}
+
+static int stream_get_speed(const QDict *qdict, const char *name,
+                            int64_t *speed)
+{
+    *speed = qdict_get_try_int(qdict, name, 0);
+    if (*speed < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, name,
+                      "a non-negative value");
+        return -1;
+    }
+    return 0;
+}
+
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+    BlockStreamJob *job;
+    int64_t speed;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+    if (stream_find(device)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+    if (!bs->backing_hd || bdrv_is_read_only(bs) ||
+        !bs->drv->bdrv_change_backing_file) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "device",
+                      "a writable image with a backing file");
+        return -1;
+    }
+    if (stream_get_speed(qdict, "speed", &speed) < 0) {
+        return -1;
+    }
+
+    job = qemu_mallocz(sizeof(*job));
+    job->bs = bs;
+    job->total_sectors = bdrv_getlength(bs) / BDRV_SECTOR_SIZE;
+    job->speed = speed;
+    job->timer = qemu_new_timer(rt_clock, stream_run, job);
+    QLIST_INSERT_HEAD(&stream_jobs, job, next);
+
+    bdrv_set_in_use(bs, 1);
+    bdrv_enable_copy_on_read(bs);
+    qemu_mod_timer(job->timer, qemu_get_clock(rt_clock));
+    return 0;
+}
+
+int do_block_job_set_speed(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockStreamJob *job = stream_find(device);
+    int64_t speed;
+
+    if (!job) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+    if (stream_get_speed(qdict, "value", &speed) < 0) {
+        return -1;
+    }
+    job->speed = speed;
+    job->next_chunk = 0;
+    return 0;
+}
+
+int do_block_job_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockStreamJob *job = stream_find(device);
+
+    if (!job) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+    if (job->aiocb) {
+        bdrv_aio_cancel(job->aiocb);
+    }
+    stream_end(job, 0, 1);
+    return 0;
+}
+
+static void block_job_print(QObject *obj, void *opaque)
+{
+    QDict *job = qobject_to_qdict(obj);
+    Monitor *mon = opaque;
+    int64_t len = qdict_get_int(job, "len");
+
+    monitor_printf(mon, "%s: %s %" PRId64 " of %" PRId64 " bytes (%d%%), "
+                   "speed limit %" PRId64 " bytes/s\n",
+                   qdict_get_str(job, "device"),
+                   qdict_get_str(job, "type"),
+                   qdict_get_int(job, "offset"), len,
+                   len ? (int)(qdict_get_int(job, "offset") * 100 / len) : 100,
+                   qdict_get_int(job, "speed"));
+}
+
+void do_info_block_jobs_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No active jobs\n");
+        return;
+    }
+    qlist_iter(list, block_job_print, mon);
+}
+
+void do_info_block_jobs(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+    BlockStreamJob *job;
+
+    QLIST_FOREACH(job, &stream_jobs, next) {
+        qlist_append_obj(list, stream_info(job));
+    }
+    *ret_data = QOBJECT(list);
+}
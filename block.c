@@ -27,7 +27,9 @@
 #include "monitor.h"
 #include "block_int.h"
 #include "module.h"
+#include "qemu-timer.h"
 #include "qemu-objects.h"
+#include "host-utils.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -192,6 +194,10 @@ BlockDriverState *bdrv_new(const char *device_name)
 
     bs = qemu_mallocz(sizeof(BlockDriverState));
     pstrcpy(bs->device_name, sizeof(bs->device_name), device_name);
+    QTAILQ_INIT(&bs->throttled_reqs[0]);
+    QTAILQ_INIT(&bs->throttled_reqs[1]);
+    QTAILQ_INIT(&bs->elevator_reqs);
+    QTAILQ_INIT(&bs->cor_reqs);
     if (device_name[0] != '\0') {
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
     }
@@ -525,6 +531,14 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     return 0;
 }
 
+/* Backing files go through the backing file cache if there is one */
+static void bdrv_open_read_cache(BlockDriverState *bs)
+{
+    if (block_cache_enabled() && bs->read_only) {
+        bs->read_cache = block_cache_open(bs->filename);
+    }
+}
+
 /*
  * Opens a disk image (raw, qcow2, vmdk, ...)
  */
@@ -633,6 +647,7 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
             bdrv_close(bs);
             return ret;
         }
+        bdrv_open_read_cache(bs->backing_hd);
         if (bs->is_temporary) {
             bs->backing_hd->keep_read_only = !(flags & BDRV_O_RDWR);
         } else {
@@ -657,9 +672,20 @@ unlink_and_fail:
     return ret;
 }
 
+static void bdrv_io_limits_flush(BlockDriverState *bs);
+static void bdrv_elevator_flush(BlockDriverState *bs);
+
 void bdrv_close(BlockDriverState *bs)
 {
     if (bs->drv) {
+        /* the limits stay for the next medium, held back requests go now */
+        bdrv_elevator_flush(bs);
+        bdrv_io_limits_flush(bs);
+        bs->cor_cluster_sectors = 0;
+        if (bs->read_cache) {
+            block_cache_close(bs->read_cache);
+            bs->read_cache = NULL;
+        }
         if (bs == bs_snapshots) {
             bs_snapshots = NULL;
         }
@@ -712,6 +738,13 @@ void bdrv_delete(BlockDriverState *bs)
     }
 
     assert(bs != bs_snapshots);
+    if (bs->io_limits_timer) {
+        qemu_del_timer(bs->io_limits_timer);
+        qemu_free_timer(bs->io_limits_timer);
+    }
+    if (bs->elevator_bh) {
+        qemu_bh_delete(bs->elevator_bh);
+    }
     qemu_free(bs);
 }
 
@@ -802,6 +835,7 @@ int bdrv_commit(BlockDriverState *bs)
                 return ret;
             }
             bs->backing_hd = bs_ro;
+            bdrv_open_read_cache(bs->backing_hd);
             return rw_ret;
         }
         bs->backing_hd = bs_rw;
@@ -855,6 +889,11 @@ ro_cleanup:
         }
         bs->backing_hd = bs_ro;
         bs->backing_hd->keep_read_only = 0;
+        bdrv_open_read_cache(bs->backing_hd);
+        if (bs->backing_hd->read_cache) {
+            /* other drives may share it */
+            block_cache_invalidate(bs->backing_hd->read_cache);
+        }
     }
 
     return ret;
@@ -1521,6 +1560,19 @@ int bdrv_has_zero_init(BlockDriverState *bs)
     return 1;
 }
 
+int bdrv_get_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (drv->bdrv_get_fd) {
+        return drv->bdrv_get_fd(bs);
+    }
+    return -ENOTSUP;
+}
+
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
 {
     if (!bs->drv) {
@@ -1532,6 +1584,53 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
     return bs->drv->bdrv_discard(bs, sector_num, nb_sectors);
 }
 
+static int bdrv_discard_range_cmp(const void *a, const void *b)
+{
+    const BlockDiscardRange *ra = a, *rb = b;
+
+    if (ra->sector_num != rb->sector_num) {
+        return ra->sector_num < rb->sector_num ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Largest discard passed down at once, a multiple of any cluster size */
+#define BDRV_DISCARD_MAX_SECTORS (1 << 30)
+
+/*
+ * Discard the ranges a guest command lists, which may come in any order.
+ * Adjacent and overlapping ranges are merged first, so that the format
+ * sees as few and as large discards as possible: qcow2 can only free the
+ * clusters a discard covers whole.  ranges is sorted in place.
+ */
+int bdrv_discard_ranges(BlockDriverState *bs, BlockDiscardRange *ranges,
+                        int nb_ranges)
+{
+    int64_t sector_num, end;
+    int i, j, ret;
+
+    qsort(ranges, nb_ranges, sizeof(*ranges), bdrv_discard_range_cmp);
+
+    for (i = 0; i < nb_ranges; i = j) {
+        sector_num = ranges[i].sector_num;
+        end = sector_num + ranges[i].nb_sectors;
+        for (j = i + 1; j < nb_ranges && ranges[j].sector_num <= end; j++) {
+            end = MAX(end, ranges[j].sector_num + ranges[j].nb_sectors);
+        }
+
+        while (sector_num < end) {
+            int n = MIN(end - sector_num, BDRV_DISCARD_MAX_SECTORS);
+
+            ret = bdrv_discard(bs, sector_num, n);
+            if (ret < 0) {
+                return ret;
+            }
+            sector_num += n;
+        }
+    }
+    return 0;
+}
+
 /*
  * Returns true iff the specified sector is present in the disk image. Drivers
  * not implementing the functionality are assumed to not support backing files,
@@ -1559,6 +1658,111 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
+/*
+ * Appends nb_sectors at sector_num, which follow the last of the
+ * *nb_extents extents, in the state flags.  Returns 0 when extents is
+ * full and the caller should stop, 1 otherwise.
+ */
+int bdrv_block_map_add(BlockExtent *extents, int *nb_extents, int max_extents,
+                       int64_t sector_num, int64_t nb_sectors, int flags)
+{
+    BlockExtent *e = *nb_extents ? &extents[*nb_extents - 1] : NULL;
+
+    if (e && e->flags == flags) {
+        e->nb_sectors += nb_sectors;
+        return 1;
+    }
+    if (*nb_extents == max_extents) {
+        return 0;
+    }
+    e = &extents[(*nb_extents)++];
+    e->sector_num = sector_num;
+    e->nb_sectors = nb_sectors;
+    e->flags = flags;
+    return 1;
+}
+
+/* Builds the map out of bdrv_is_allocated() for the drivers without one */
+static int bdrv_get_block_map_generic(BlockDriverState *bs, int64_t sector_num,
+                                      int64_t nb_sectors, BlockExtent *extents,
+                                      int max_extents)
+{
+    int n = 0, num;
+
+    while (nb_sectors > 0) {
+        int allocated = bdrv_is_allocated(bs, sector_num,
+                                          MIN(nb_sectors, INT_MAX >> 1), &num);
+        if (num <= 0) {
+            break;
+        }
+        if (!bdrv_block_map_add(extents, &n, max_extents, sector_num, num,
+                                allocated ? BDRV_EXTENT_ALLOCATED : 0)) {
+            break;
+        }
+        sector_num += num;
+        nb_sectors -= num;
+    }
+    return n;
+}
+
+/*
+ * Describes up to nb_sectors from sector_num on in at most max_extents
+ * extents, in order and without gaps; two extents in a row always differ
+ * in their flags.  The map stops early at the end of the image or when
+ * extents is full.  Returns the number of extents, or -errno.
+ *
+ * This is much cheaper than a bdrv_is_allocated() loop on large sparse
+ * images, because the formats look at whole tables at once.
+ */
+int bdrv_get_block_map(BlockDriverState *bs, int64_t sector_num,
+                       int64_t nb_sectors, BlockExtent *extents,
+                       int max_extents)
+{
+    BlockDriver *drv = bs->drv;
+    int64_t total_sectors;
+    int i, j, n;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    total_sectors = bdrv_getlength(bs);
+    if (total_sectors < 0) {
+        return total_sectors;
+    }
+    total_sectors >>= BDRV_SECTOR_BITS;
+    if (sector_num < 0 || max_extents <= 0) {
+        return -EINVAL;
+    }
+    nb_sectors = MIN(nb_sectors, total_sectors - sector_num);
+    if (nb_sectors <= 0) {
+        return 0;
+    }
+
+    if (drv->bdrv_get_block_map) {
+        n = drv->bdrv_get_block_map(bs, sector_num, nb_sectors, extents,
+                                    max_extents);
+    } else {
+        n = bdrv_get_block_map_generic(bs, sector_num, nb_sectors, extents,
+                                       max_extents);
+    }
+    if (n <= 0 || bs->backing_hd) {
+        return n;
+    }
+
+    /* Without a backing file, what is not allocated reads as zeroes */
+    for (i = 0, j = 0; i < n; i++) {
+        if (!(extents[i].flags & BDRV_EXTENT_ALLOCATED)) {
+            extents[i].flags |= BDRV_EXTENT_ZERO;
+        }
+        if (j > 0 && extents[j - 1].flags == extents[i].flags) {
+            extents[j - 1].nb_sectors += extents[i].nb_sectors;
+        } else {
+            extents[j++] = extents[i];
+        }
+    }
+    return j;
+}
+
 void bdrv_mon_event(const BlockDriverState *bdrv,
                     BlockMonEventAction action, int is_read)
 {
@@ -1617,6 +1821,14 @@ static void bdrv_print_dict(QObject *obj, void *opaque)
                             qdict_get_bool(qdict, "ro"),
                             qdict_get_str(qdict, "drv"),
                             qdict_get_bool(qdict, "encrypted"));
+        if (qdict_haskey(qdict, "bps_rd")) {
+            monitor_printf(mon, " bps_rd=%" PRId64 " bps_wr=%" PRId64
+                                " iops_rd=%" PRId64 " iops_wr=%" PRId64,
+                                qdict_get_int(qdict, "bps_rd"),
+                                qdict_get_int(qdict, "bps_wr"),
+                                qdict_get_int(qdict, "iops_rd"),
+                                qdict_get_int(qdict, "iops_wr"));
+        }
     } else {
         monitor_printf(mon, " [not inserted]");
     }
@@ -1671,6 +1883,15 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
                 qdict_put(qdict, "backing_file",
                           qstring_from_str(bs->backing_file));
             }
+            if (bs->io_limits_enabled) {
+                QDict *qdict = qobject_to_qdict(obj);
+                qdict_put(qdict, "bps_rd", qint_from_int(bs->io_limits.bps[0]));
+                qdict_put(qdict, "bps_wr", qint_from_int(bs->io_limits.bps[1]));
+                qdict_put(qdict, "iops_rd",
+                          qint_from_int(bs->io_limits.iops[0]));
+                qdict_put(qdict, "iops_wr",
+                          qint_from_int(bs->io_limits.iops[1]));
+            }
 
             qdict_put_obj(bs_dict, "inserted", obj);
         }
@@ -1680,24 +1901,136 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
     *ret_data = QOBJECT(bs_list);
 }
 
+/* The thread pool stats of a device, which belong to its image file */
+static QDict *bdrv_stats_thread_pool(QDict *qdict)
+{
+    while (qdict) {
+        QDict *stats = qdict_get_qdict(qdict, "stats");
+
+        if (qdict_haskey(stats, "thread_pool")) {
+            return qdict_get_qdict(stats, "thread_pool");
+        }
+        qdict = qdict_haskey(qdict, "parent") ?
+            qdict_get_qdict(qdict, "parent") : NULL;
+    }
+    return NULL;
+}
+
+/* Index of the bucket holding the sample at frac of a histogram, -1 if it
+   is empty */
+static int bdrv_stats_percentile(QList *buckets, double frac)
+{
+    int64_t count = 0, seen = 0;
+    QListEntry *e;
+    int i = 0;
+
+    QLIST_FOREACH_ENTRY(buckets, e) {
+        count += qint_get_int(qobject_to_qint(e->value));
+    }
+    if (!count) {
+        return -1;
+    }
+    QLIST_FOREACH_ENTRY(buckets, e) {
+        seen += qint_get_int(qobject_to_qint(e->value));
+        if (seen > count * frac) {
+            break;
+        }
+        i++;
+    }
+    return i;
+}
+
+static void bdrv_stats_print_latency(Monitor *mon, const char *what,
+                                     QDict *stats)
+{
+    char key[32];
+    QDict *latency;
+    int64_t count;
+    int p99;
+
+    snprintf(key, sizeof(key), "%s_latency", what);
+    latency = qdict_get_qdict(stats, key);
+    count = qdict_get_int(latency, "count");
+    p99 = bdrv_stats_percentile(qdict_get_qlist(latency, "histogram"), 0.99);
+    monitor_printf(mon, " %s_latency_ns=%" PRId64 " %s_p99_ns=%" PRId64,
+                   what, qdict_get_int(latency, "time-ns") / MAX(count, 1),
+                   what, p99 < 0 ? 0 : (int64_t)2 << p99);
+}
+
 static void bdrv_stats_iter(QObject *data, void *opaque)
 {
-    QDict *qdict;
+    QDict *qdict, *pool;
     Monitor *mon = opaque;
 
     qdict = qobject_to_qdict(data);
     monitor_printf(mon, "%s:", qdict_get_str(qdict, "device"));
 
+    pool = bdrv_stats_thread_pool(qdict);
     qdict = qobject_to_qdict(qdict_get(qdict, "stats"));
     monitor_printf(mon, " rd_bytes=%" PRId64
                         " wr_bytes=%" PRId64
                         " rd_operations=%" PRId64
                         " wr_operations=%" PRId64
-                        "\n",
+                        " rd_merged=%" PRId64
+                        " wr_merged=%" PRId64,
                         qdict_get_int(qdict, "rd_bytes"),
                         qdict_get_int(qdict, "wr_bytes"),
                         qdict_get_int(qdict, "rd_operations"),
-                        qdict_get_int(qdict, "wr_operations"));
+                        qdict_get_int(qdict, "wr_operations"),
+                        qdict_get_int(qdict, "rd_merged"),
+                        qdict_get_int(qdict, "wr_merged"));
+    if (qdict_haskey(qdict, "queue_depth")) {
+        int p99;
+
+        monitor_printf(mon, " flush_operations=%" PRId64,
+                       qdict_get_int(qdict_get_qdict(qdict, "flush_latency"),
+                                     "count"));
+        bdrv_stats_print_latency(mon, "rd", qdict);
+        bdrv_stats_print_latency(mon, "wr", qdict);
+        bdrv_stats_print_latency(mon, "flush", qdict);
+        p99 = bdrv_stats_percentile(qdict_get_qlist(qdict, "queue_depth"),
+                                    0.99);
+        monitor_printf(mon, " queue_depth_p99=%d", (1 << MAX(p99, 0)) - 1);
+    }
+    if (qdict_haskey(qdict, "metadata_cache")) {
+        QDict *cache = qdict_get_qdict(qdict, "metadata_cache");
+
+        monitor_printf(mon, " l2_tables=%" PRId64
+                            " l2_hits=%" PRId64
+                            " l2_misses=%" PRId64
+                            " l2_evictions=%" PRId64
+                            " refcount_blocks=%" PRId64
+                            " refcount_hits=%" PRId64
+                            " refcount_misses=%" PRId64
+                            " refcount_evictions=%" PRId64,
+                            qdict_get_int(cache, "l2_tables"),
+                            qdict_get_int(cache, "l2_hits"),
+                            qdict_get_int(cache, "l2_misses"),
+                            qdict_get_int(cache, "l2_evictions"),
+                            qdict_get_int(cache, "refcount_blocks"),
+                            qdict_get_int(cache, "refcount_hits"),
+                            qdict_get_int(cache, "refcount_misses"),
+                            qdict_get_int(cache, "refcount_evictions"));
+    }
+    if (pool) {
+        monitor_printf(mon, " aio_threads=%" PRId64
+                            " aio_idle_threads=%" PRId64
+                            " aio_queued=%" PRId64
+                            " aio_requests=%" PRId64
+                            " aio_latency_ns=%" PRId64
+                            " aio_queue_depth=%" PRId64
+                            " aio_bounces=%" PRId64
+                            " aio_bounce_allocs=%" PRId64,
+                            qdict_get_int(pool, "threads"),
+                            qdict_get_int(pool, "idle_threads"),
+                            qdict_get_int(pool, "queued"),
+                            qdict_get_int(pool, "requests"),
+                            qdict_get_int(pool, "avg_latency_ns"),
+                            qdict_get_int(pool, "avg_queue_depth"),
+                            qdict_get_int(pool, "bounces"),
+                            qdict_get_int(pool, "bounce_allocs"));
+    }
+    monitor_printf(mon, "\n");
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1705,6 +2038,28 @@ void bdrv_stats_print(Monitor *mon, const QObject *data)
     qlist_iter(qobject_to_qlist(data), bdrv_stats_iter, mon);
 }
 
+static QObject *bdrv_histogram_to_qobject(const uint32_t *buckets, int n)
+{
+    QList *list = qlist_new();
+    int i;
+
+    while (n > 1 && !buckets[n - 1]) {
+        n--;
+    }
+    for (i = 0; i < n; i++) {
+        qlist_append(list, qint_from_int(buckets[i]));
+    }
+    return QOBJECT(list);
+}
+
+static QObject *bdrv_latency_to_qobject(const BlockLatencyStats *l)
+{
+    return qobject_from_jsonf("{ 'count': %" PRId64 ", 'time-ns': %" PRId64
+                              ", 'histogram': %p }", l->count, l->total_ns,
+                              bdrv_histogram_to_qobject(l->buckets,
+                                                        BDRV_LATENCY_BUCKETS));
+}
+
 static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
 {
     QObject *res;
@@ -1715,16 +2070,34 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              "'wr_bytes': %" PRId64 ","
                              "'rd_operations': %" PRId64 ","
                              "'wr_operations': %" PRId64 ","
+                             "'rd_merged': %" PRId64 ","
+                             "'wr_merged': %" PRId64 ","
                              "'wr_highest_offset': %" PRId64
                              "} }",
                              bs->rd_bytes, bs->wr_bytes,
                              bs->rd_ops, bs->wr_ops,
+                             bs->rd_merged, bs->wr_merged,
                              bs->wr_highest_sector *
                              (uint64_t)BDRV_SECTOR_SIZE);
     dict  = qobject_to_qdict(res);
 
+    if (bs->drv && bs->drv->bdrv_get_stats) {
+        bs->drv->bdrv_get_stats(bs, qdict_get_qdict(dict, "stats"));
+    }
+
     if (*bs->device_name) {
+        QDict *stats = qdict_get_qdict(dict, "stats");
+
         qdict_put(dict, "device", qstring_from_str(bs->device_name));
+        qdict_put_obj(stats, "rd_latency",
+                      bdrv_latency_to_qobject(&bs->latency[BDRV_ACCT_READ]));
+        qdict_put_obj(stats, "wr_latency",
+                      bdrv_latency_to_qobject(&bs->latency[BDRV_ACCT_WRITE]));
+        qdict_put_obj(stats, "flush_latency",
+                      bdrv_latency_to_qobject(&bs->latency[BDRV_ACCT_FLUSH]));
+        qdict_put_obj(stats, "queue_depth",
+                      bdrv_histogram_to_qobject(bs->queue_depth,
+                                                BDRV_DEPTH_BUCKETS));
     }
 
     if (bs->file) {
@@ -1789,6 +2162,59 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+/* Whether bs does bdrv_compress_cluster() and
+   bdrv_write_compressed_cluster() */
+int bdrv_can_compress_cluster(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    return drv && drv->bdrv_compress_cluster &&
+        drv->bdrv_write_compressed_cluster;
+}
+
+/*
+ * Compress the cluster in buf into out_buf, which must hold a cluster, for
+ * bdrv_write_compressed_cluster().  This can run in any thread, so that
+ * many clusters are compressed at once; it returns the compressed length,
+ * 0 if the cluster does not compress, or -errno.
+ */
+int bdrv_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                          uint8_t *out_buf)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_compress_cluster)
+        return -ENOTSUP;
+    return drv->bdrv_compress_cluster(bs, buf, out_buf);
+}
+
+/* Write the cluster at sector_num, of which bdrv_compress_cluster() made
+   the out_len bytes of out_buf */
+int bdrv_write_compressed_cluster(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, const uint8_t *out_buf,
+                                  int out_len)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverInfo bdi;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_write_compressed_cluster)
+        return -ENOTSUP;
+    if (bdrv_get_info(bs, &bdi) < 0 ||
+        bdrv_check_request(bs, sector_num, bdi.cluster_size >> 9))
+        return -EIO;
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, bdi.cluster_size >> 9, 1);
+    }
+
+    return drv->bdrv_write_compressed_cluster(bs, sector_num, buf, out_buf,
+                                              out_len);
+}
+
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BlockDriver *drv = bs->drv;
@@ -1826,6 +2252,23 @@ int bdrv_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     return -ENOTSUP;
 }
 
+/*
+ * Find where the VM state at pos is stored in bs->file, so that it can be
+ * read without going through the block layer.  *file_offset is set to the
+ * offset of pos in bs->file, or -1 if the state there reads as zeroes.
+ * Returns how many bytes, up to size, follow contiguously, or -errno.
+ */
+int64_t bdrv_map_vmstate(BlockDriverState *bs, int64_t pos, int64_t size,
+                         int64_t *file_offset)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (drv->bdrv_map_vmstate)
+        return drv->bdrv_map_vmstate(bs, pos, size, file_offset);
+    return -ENOTSUP;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
 {
     BlockDriver *drv = bs->drv;
@@ -2038,12 +2481,92 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
 /**************************************************************/
 /* async I/Os */
 
+static BlockDriverAIOCB *bdrv_io_limits_intercept(BlockDriverState *bs,
+    int is_write, int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque);
+static BlockDriverAIOCB *bdrv_elevator_intercept(BlockDriverState *bs,
+    int is_write, int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque);
+static BlockDriverAIOCB *bdrv_cor_intercept(BlockDriverState *bs,
+    int is_write, int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque);
+
+static BlockDriverAIOCB *bdrv_cache_intercept(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque);
+
+typedef struct BdrvAcctAIOCB BdrvAcctAIOCB;
+static BdrvAcctAIOCB *bdrv_acct_start(BlockDriverState *bs, int type,
+    BlockDriverCompletionFunc *cb, void *opaque);
+static BlockDriverAIOCB *bdrv_acct_submitted(BdrvAcctAIOCB *acb,
+                                             BlockDriverAIOCB *aiocb);
+static void bdrv_acct_cb(void *opaque, int ret);
+
+static BlockDriverAIOCB *bdrv_aio_readv_driver(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+
+    ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                              cb, opaque);
+
+    if (ret) {
+	/* Update stats even though technically transfer has not happened. */
+	bs->rd_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+	bs->rd_ops ++;
+    }
+
+    return ret;
+}
+
+/* Requests are tracked while copy on read is on, and until the last
+   tracked one is done */
+static int bdrv_cor_tracking(BlockDriverState *bs)
+{
+    return bs->copy_on_read || !QTAILQ_EMPTY(&bs->cor_reqs);
+}
+
+static BlockDriverAIOCB *bdrv_aio_readv_submit(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    if (bs->read_cache) {
+        return bdrv_cache_intercept(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque);
+    }
+    if (bdrv_cor_tracking(bs)) {
+        return bdrv_cor_intercept(bs, 0, sector_num, qiov, nb_sectors,
+                                  cb, opaque);
+    }
+    return bdrv_aio_readv_driver(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque);
+}
+
+/* Past the checks and the accounting, the request may still wait in the
+   elevator or the throttling queue */
+static BlockDriverAIOCB *bdrv_aio_readv_queue(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    if (bs->elevator_enabled && get_async_context_id() == 0) {
+        return bdrv_elevator_intercept(bs, 0, sector_num, qiov, nb_sectors,
+                                       cb, opaque);
+    }
+    if (bs->io_limits_enabled) {
+        return bdrv_io_limits_intercept(bs, 0, sector_num, qiov, nb_sectors,
+                                        cb, opaque);
+    }
+    return bdrv_aio_readv_submit(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque);
+}
+
 BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                  QEMUIOVector *qiov, int nb_sectors,
                                  BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
 
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
@@ -2052,16 +2575,14 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
-    ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
-                              cb, opaque);
+    if (*bs->device_name) {
+        BdrvAcctAIOCB *acb = bdrv_acct_start(bs, BDRV_ACCT_READ, cb, opaque);
 
-    if (ret) {
-	/* Update stats even though technically transfer has not happened. */
-	bs->rd_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-	bs->rd_ops ++;
+        return bdrv_acct_submitted(acb,
+            bdrv_aio_readv_queue(bs, sector_num, qiov, nb_sectors,
+                                 bdrv_acct_cb, acb));
     }
-
-    return ret;
+    return bdrv_aio_readv_queue(bs, sector_num, qiov, nb_sectors, cb, opaque);
 }
 
 typedef struct BlockCompleteData {
@@ -2100,23 +2621,14 @@ static BlockCompleteData *blk_dirty_cb_alloc(BlockDriverState *bs,
     return blkdata;
 }
 
-BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
-                                  QEMUIOVector *qiov, int nb_sectors,
-                                  BlockDriverCompletionFunc *cb, void *opaque)
+static BlockDriverAIOCB *bdrv_aio_writev_driver(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
     BlockDriverAIOCB *ret;
     BlockCompleteData *blk_cb_data;
 
-    trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
-
-    if (!drv)
-        return NULL;
-    if (bs->read_only)
-        return NULL;
-    if (bdrv_check_request(bs, sector_num, nb_sectors))
-        return NULL;
-
     if (bs->dirty_bitmap) {
         blk_cb_data = blk_dirty_cb_alloc(bs, sector_num, nb_sectors, cb,
                                          opaque);
@@ -2139,6 +2651,60 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
+static BlockDriverAIOCB *bdrv_aio_writev_submit(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    if (bdrv_cor_tracking(bs)) {
+        return bdrv_cor_intercept(bs, 1, sector_num, qiov, nb_sectors,
+                                  cb, opaque);
+    }
+    return bdrv_aio_writev_driver(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque);
+}
+
+static BlockDriverAIOCB *bdrv_aio_writev_queue(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    if (bs->elevator_enabled && get_async_context_id() == 0) {
+        return bdrv_elevator_intercept(bs, 1, sector_num, qiov, nb_sectors,
+                                       cb, opaque);
+    }
+    if (bs->io_limits_enabled) {
+        return bdrv_io_limits_intercept(bs, 1, sector_num, qiov, nb_sectors,
+                                        cb, opaque);
+    }
+    return bdrv_aio_writev_submit(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque);
+}
+
+BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                                  QEMUIOVector *qiov, int nb_sectors,
+                                  BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+
+    trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
+
+    if (!drv)
+        return NULL;
+    if (bs->read_only)
+        return NULL;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return NULL;
+
+    if (*bs->device_name) {
+        BdrvAcctAIOCB *acb = bdrv_acct_start(bs, BDRV_ACCT_WRITE, cb, opaque);
+
+        return bdrv_acct_submitted(acb,
+            bdrv_aio_writev_queue(bs, sector_num, qiov, nb_sectors,
+                                  bdrv_acct_cb, acb));
+    }
+    return bdrv_aio_writev_queue(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque);
+}
+
 
 typedef struct MultiwriteCB {
     int error;
@@ -2202,10 +2768,12 @@ static int multiwrite_req_compare(const void *a, const void *b)
 
 /*
  * Takes a bunch of requests and tries to merge them. Returns the number of
- * requests that remain after merging.
+ * requests that remain after merging.  Reads are only merged when they are
+ * exactly sequential, every sector has to land in the buffer it was asked
+ * for.
  */
 static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
-    int num_reqs, MultiwriteCB *mcb)
+    int num_reqs, MultiwriteCB *mcb, int is_write)
 {
     int i, outidx;
 
@@ -2224,12 +2792,15 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
         if (reqs[i].sector <= oldreq_last) {
             merge = 1;
         }
+        if (!is_write && reqs[i].sector != oldreq_last) {
+            merge = 0;
+        }
 
         // The block driver may decide that it makes sense to combine requests
         // even if there is a gap of some sectors between them. In this case,
         // the gap is filled with zeros (therefore only applicable for yet
         // unused space in format like qcow2).
-        if (!merge && bs->drv->bdrv_merge_requests) {
+        if (!merge && is_write && bs->drv->bdrv_merge_requests) {
             merge = bs->drv->bdrv_merge_requests(bs, &reqs[outidx], &reqs[i]);
         }
 
@@ -2276,7 +2847,7 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
 }
 
 /*
- * Submit multiple AIO write requests at once.
+ * Submit multiple AIO read or write requests at once.
  *
  * On success, the function returns 0 and all requests in the reqs array have
  * been submitted. In error case this function returns -1, and any of the
@@ -2289,11 +2860,12 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
  * requests. However, the fields opaque and error are left unmodified as they
  * are used to signal failure for a single request to the caller.
  */
-int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+static int bdrv_aio_multi(BlockDriverState *bs, BlockRequest *reqs,
+                          int num_reqs, int is_write)
 {
     BlockDriverAIOCB *acb;
     MultiwriteCB *mcb;
-    int i;
+    int i, merged;
 
     if (num_reqs == 0) {
         return 0;
@@ -2310,9 +2882,14 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
     }
 
     // Check for mergable requests
-    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb, is_write);
+    merged = mcb->num_callbacks - num_reqs;
 
-    trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
+    if (is_write) {
+        trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
+    } else {
+        trace_bdrv_aio_multiread(mcb, mcb->num_callbacks, num_reqs);
+    }
 
     /*
      * Run the aio requests. As soon as one request can't be submitted
@@ -2338,8 +2915,13 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
     // Run the aio requests
     for (i = 0; i < num_reqs; i++) {
         mcb->num_requests++;
-        acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
-            reqs[i].nb_sectors, multiwrite_cb, mcb);
+        if (is_write) {
+            acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        } else {
+            acb = bdrv_aio_readv(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        }
 
         if (acb == NULL) {
             // We can only fail the whole thing if no request has been
@@ -2356,6 +2938,15 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
         }
     }
 
+    /* the stats count what the guest asked for */
+    if (is_write) {
+        bs->wr_ops += merged;
+        bs->wr_merged += merged;
+    } else {
+        bs->rd_ops += merged;
+        bs->rd_merged += merged;
+    }
+
     /* Complete the dummy request */
     multiwrite_cb(mcb, 0);
 
@@ -2369,18 +2960,44 @@ fail:
     return -1;
 }
 
-BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
-        BlockDriverCompletionFunc *cb, void *opaque)
+int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
 {
-    BlockDriver *drv = bs->drv;
+    return bdrv_aio_multi(bs, reqs, num_reqs, 1);
+}
 
+/*
+ * Submit multiple AIO read requests at once, merging the sequential ones.
+ * Same conventions as bdrv_aio_multiwrite().
+ */
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi(bs, reqs, num_reqs, 0);
+}
+
+static BlockDriverAIOCB *bdrv_aio_flush_submit(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
     if (bs->open_flags & BDRV_O_NO_FLUSH) {
         return bdrv_aio_noop_em(bs, cb, opaque);
     }
+    return bs->drv->bdrv_aio_flush(bs, cb, opaque);
+}
+
+BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
 
     if (!drv)
         return NULL;
-    return drv->bdrv_aio_flush(bs, cb, opaque);
+    if (*bs->device_name) {
+        BdrvAcctAIOCB *acb = bdrv_acct_start(bs, BDRV_ACCT_FLUSH, cb, opaque);
+
+        return bdrv_acct_submitted(acb,
+                                   bdrv_aio_flush_submit(bs, bdrv_acct_cb,
+                                                         acb));
+    }
+    return bdrv_aio_flush_submit(bs, cb, opaque);
 }
 
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
@@ -2388,6 +3005,1075 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
+/*
+ * Tells the driver that more requests follow: those submitted until the
+ * matching bdrv_io_unplug() may be handed to the host in one go.  Calls
+ * nest.  Drivers that do not batch pass this on to their image file.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    bs->io_plugged++;
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    /* the merged requests still get batched by the layers below */
+    assert(bs->io_plugged > 0);
+    if (--bs->io_plugged == 0) {
+        bdrv_elevator_flush(bs);
+    }
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
+/**************************************************************/
+/* latency accounting */
+
+struct BdrvAcctAIOCB {
+    BlockDriverAIOCB common;
+    int type;
+    int64_t start_ns;
+    BlockDriverAIOCB *aiocb;
+};
+
+static void bdrv_acct_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvAcctAIOCB *acb = container_of(blockacb, BdrvAcctAIOCB, common);
+
+    bdrv_aio_cancel(acb->aiocb);
+    acb->common.bs->in_flight--;
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_acct_aio_pool = {
+    .aiocb_size         = sizeof(BdrvAcctAIOCB),
+    .cancel             = bdrv_acct_cancel,
+};
+
+static BdrvAcctAIOCB *bdrv_acct_start(BlockDriverState *bs, int type,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BdrvAcctAIOCB *acb = qemu_aio_get(&bdrv_acct_aio_pool, bs, cb, opaque);
+    int bucket = bs->in_flight ? 64 - clz64(bs->in_flight) : 0;
+
+    acb->type = type;
+    acb->start_ns = get_clock();
+    bs->queue_depth[MIN(bucket, BDRV_DEPTH_BUCKETS - 1)]++;
+    bs->in_flight++;
+    return acb;
+}
+
+static BlockDriverAIOCB *bdrv_acct_submitted(BdrvAcctAIOCB *acb,
+                                             BlockDriverAIOCB *aiocb)
+{
+    if (!aiocb) {
+        acb->common.bs->in_flight--;
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    acb->aiocb = aiocb;
+    return &acb->common;
+}
+
+static void bdrv_acct_cb(void *opaque, int ret)
+{
+    BdrvAcctAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    BlockLatencyStats *l = &bs->latency[acb->type];
+    int64_t ns = get_clock() - acb->start_ns;
+    int bucket = ns > 1 ? 63 - clz64(ns) : 0;
+
+    l->count++;
+    l->total_ns += ns;
+    l->buckets[MIN(bucket, BDRV_LATENCY_BUCKETS - 1)]++;
+    bs->in_flight--;
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+/**************************************************************/
+/* I/O throttling */
+
+typedef struct BdrvThrottledAIOCB {
+    BlockDriverAIOCB common;
+    int is_write;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    BlockDriverAIOCB *aiocb;    /* once submitted */
+    QTAILQ_ENTRY(BdrvThrottledAIOCB) entry;
+} BdrvThrottledAIOCB;
+
+static void bdrv_throttled_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvThrottledAIOCB *acb =
+        container_of(blockacb, BdrvThrottledAIOCB, common);
+
+    if (acb->aiocb) {
+        bdrv_aio_cancel(acb->aiocb);
+    } else {
+        QTAILQ_REMOVE(&acb->common.bs->throttled_reqs[acb->is_write],
+                      acb, entry);
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_throttled_aio_pool = {
+    .aiocb_size         = sizeof(BdrvThrottledAIOCB),
+    .cancel             = bdrv_throttled_cancel,
+};
+
+static void bdrv_throttled_cb(void *opaque, int ret)
+{
+    BdrvThrottledAIOCB *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+/* Drain the buckets of what the limits let through since the last call */
+static void bdrv_io_limits_update(BlockDriverState *bs)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    double elapsed = (double)(now - bs->io_limits_time) / 1000000000LL;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        bs->bps_level[i] = MAX(0, bs->bps_level[i] -
+                                  elapsed * bs->io_limits.bps[i]);
+        bs->iops_level[i] = MAX(0, bs->iops_level[i] -
+                                   elapsed * bs->io_limits.iops[i]);
+    }
+    bs->io_limits_time = now;
+}
+
+static double bdrv_io_limits_bucket_wait(double level, uint64_t limit)
+{
+    double burst = (double)limit * BLOCK_IO_LIMITS_SLICE_NS / 1000000000LL;
+
+    if (!limit || level < burst) {
+        return 0;
+    }
+    return (level - burst) / limit;
+}
+
+/* How many ns the next request in direction is_write has to wait */
+static int64_t bdrv_io_limits_wait(BlockDriverState *bs, int is_write)
+{
+    double wait;
+
+    wait = MAX(bdrv_io_limits_bucket_wait(bs->bps_level[is_write],
+                                          bs->io_limits.bps[is_write]),
+               bdrv_io_limits_bucket_wait(bs->iops_level[is_write],
+                                          bs->io_limits.iops[is_write]));
+    return wait * 1000000000LL;
+}
+
+static void bdrv_throttled_submit(BdrvThrottledAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+
+    QTAILQ_REMOVE(&bs->throttled_reqs[acb->is_write], acb, entry);
+    bs->bps_level[acb->is_write] += acb->nb_sectors * BDRV_SECTOR_SIZE;
+    bs->iops_level[acb->is_write] += 1;
+
+    if (acb->is_write) {
+        acb->aiocb = bdrv_aio_writev_submit(bs, acb->sector_num, acb->qiov,
+                                            acb->nb_sectors,
+                                            bdrv_throttled_cb, acb);
+    } else {
+        acb->aiocb = bdrv_aio_readv_submit(bs, acb->sector_num, acb->qiov,
+                                           acb->nb_sectors,
+                                           bdrv_throttled_cb, acb);
+    }
+    if (!acb->aiocb) {
+        /* the caller was told the request was queued */
+        bdrv_throttled_cb(acb, -EIO);
+    }
+}
+
+static void bdrv_io_limits_schedule(BlockDriverState *bs)
+{
+    int64_t wait = INT64_MAX;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (!QTAILQ_EMPTY(&bs->throttled_reqs[i])) {
+            wait = MIN(wait, bdrv_io_limits_wait(bs, i));
+        }
+    }
+    if (wait != INT64_MAX) {
+        /* rt_clock timers have a ms resolution */
+        qemu_mod_timer(bs->io_limits_timer, qemu_get_clock(rt_clock) +
+                       MAX(1, (wait + 999999) / 1000000));
+    }
+}
+
+static void bdrv_io_limits_timer(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    int i;
+
+    bdrv_io_limits_update(bs);
+    for (i = 0; i < 2; i++) {
+        while (!QTAILQ_EMPTY(&bs->throttled_reqs[i]) &&
+               bdrv_io_limits_wait(bs, i) == 0) {
+            bdrv_throttled_submit(QTAILQ_FIRST(&bs->throttled_reqs[i]));
+        }
+    }
+    bdrv_io_limits_schedule(bs);
+}
+
+static BlockDriverAIOCB *bdrv_io_limits_intercept(BlockDriverState *bs,
+    int is_write, int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BdrvThrottledAIOCB *acb;
+
+    bdrv_io_limits_update(bs);
+    if (QTAILQ_EMPTY(&bs->throttled_reqs[is_write]) &&
+        bdrv_io_limits_wait(bs, is_write) == 0) {
+        bs->bps_level[is_write] += nb_sectors * BDRV_SECTOR_SIZE;
+        bs->iops_level[is_write] += 1;
+        if (is_write) {
+            return bdrv_aio_writev_submit(bs, sector_num, qiov, nb_sectors,
+                                          cb, opaque);
+        }
+        return bdrv_aio_readv_submit(bs, sector_num, qiov, nb_sectors,
+                                     cb, opaque);
+    }
+
+    acb = qemu_aio_get(&bdrv_throttled_aio_pool, bs, cb, opaque);
+    acb->is_write = is_write;
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->aiocb = NULL;
+    QTAILQ_INSERT_TAIL(&bs->throttled_reqs[is_write], acb, entry);
+    bdrv_io_limits_schedule(bs);
+    return &acb->common;
+}
+
+/* Submit the requests held back by the I/O limits, regardless of them */
+static void bdrv_io_limits_flush(BlockDriverState *bs)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        while (!QTAILQ_EMPTY(&bs->throttled_reqs[i])) {
+            bdrv_throttled_submit(QTAILQ_FIRST(&bs->throttled_reqs[i]));
+        }
+    }
+}
+
+/*
+ * Limit the bandwidth and the request rate of reads and writes on bs.
+ * Guest requests over the limits are queued, in order, until the
+ * limits let them through.
+ */
+void bdrv_set_io_limits(BlockDriverState *bs, const BlockIOLimit *io_limits)
+{
+    int enabled = io_limits->bps[0] || io_limits->bps[1] ||
+                  io_limits->iops[0] || io_limits->iops[1];
+
+    if (enabled && !bs->io_limits_enabled) {
+        if (!bs->io_limits_timer) {
+            bs->io_limits_timer = qemu_new_timer(rt_clock,
+                                                 bdrv_io_limits_timer, bs);
+        }
+        memset(bs->bps_level, 0, sizeof(bs->bps_level));
+        memset(bs->iops_level, 0, sizeof(bs->iops_level));
+        bs->io_limits_time = qemu_get_clock_ns(rt_clock);
+    } else if (enabled) {
+        /* drain at the old rates, reschedule at the new ones */
+        bdrv_io_limits_update(bs);
+    }
+
+    bs->io_limits = *io_limits;
+    bs->io_limits_enabled = enabled;
+
+    if (!enabled) {
+        if (bs->io_limits_timer) {
+            qemu_del_timer(bs->io_limits_timer);
+        }
+        bdrv_io_limits_flush(bs);
+    } else {
+        bdrv_io_limits_schedule(bs);
+    }
+}
+
+/**************************************************************/
+/* Request merging */
+
+/* Sectors a merged request may span */
+#define ELEVATOR_MAX_SECTORS 2048
+
+typedef struct BdrvElevatorMerge BdrvElevatorMerge;
+
+typedef struct BdrvElevatorAIOCB {
+    BlockDriverAIOCB common;
+    int is_write;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    int index;                  /* order of arrival, when flushed */
+    BlockDriverAIOCB *aiocb;    /* once submitted on its own */
+    BdrvElevatorMerge *merge;   /* once submitted merged with others */
+    int cancelled;
+    int done;
+    QTAILQ_ENTRY(BdrvElevatorAIOCB) entry;
+} BdrvElevatorAIOCB;
+
+struct BdrvElevatorMerge {
+    QEMUIOVector qiov;
+    int n;
+    BdrvElevatorAIOCB *reqs[];
+};
+
+static void bdrv_elevator_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvElevatorAIOCB *acb =
+        container_of(blockacb, BdrvElevatorAIOCB, common);
+    BlockDriverState *bs = acb->common.bs;
+
+    if (acb->aiocb) {
+        bdrv_aio_cancel(acb->aiocb);
+    } else if (acb->merge) {
+        /* the other requests go on, wait until our buffers are released */
+        acb->cancelled = 1;
+        while (!acb->done) {
+            qemu_aio_wait();
+        }
+    } else {
+        QTAILQ_REMOVE(&bs->elevator_reqs, acb, entry);
+        bs->elevator_queued--;
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_elevator_aio_pool = {
+    .aiocb_size         = sizeof(BdrvElevatorAIOCB),
+    .cancel             = bdrv_elevator_cancel,
+};
+
+static void bdrv_elevator_cb(void *opaque, int ret)
+{
+    BdrvElevatorAIOCB *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static void bdrv_elevator_merge_cb(void *opaque, int ret)
+{
+    BdrvElevatorMerge *merge = opaque;
+    int i;
+
+    for (i = 0; i < merge->n; i++) {
+        BdrvElevatorAIOCB *acb = merge->reqs[i];
+
+        if (acb->cancelled) {
+            acb->done = 1;
+        } else {
+            bdrv_elevator_cb(acb, ret);
+        }
+    }
+    qemu_iovec_destroy(&merge->qiov);
+    qemu_free(merge);
+}
+
+static BlockDriverAIOCB *bdrv_elevator_dispatch(BlockDriverState *bs,
+    int is_write, int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    if (bs->io_limits_enabled) {
+        return bdrv_io_limits_intercept(bs, is_write, sector_num, qiov,
+                                        nb_sectors, cb, opaque);
+    }
+    if (is_write) {
+        return bdrv_aio_writev_submit(bs, sector_num, qiov, nb_sectors,
+                                      cb, opaque);
+    }
+    return bdrv_aio_readv_submit(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque);
+}
+
+/* Submit n requests that follow each other on the disk as one */
+static void bdrv_elevator_submit(BlockDriverState *bs,
+                                 BdrvElevatorAIOCB **reqs, int n)
+{
+    BdrvElevatorAIOCB *first = reqs[0];
+    BdrvElevatorMerge *merge;
+    int i, niov = 0, nb_sectors = 0;
+
+    if (n == 1) {
+        first->aiocb = bdrv_elevator_dispatch(bs, first->is_write,
+                                              first->sector_num, first->qiov,
+                                              first->nb_sectors,
+                                              bdrv_elevator_cb, first);
+        if (!first->aiocb) {
+            /* the caller was told the request was queued */
+            bdrv_elevator_cb(first, -EIO);
+        }
+        return;
+    }
+
+    merge = qemu_malloc(sizeof(*merge) + n * sizeof(merge->reqs[0]));
+    merge->n = n;
+    for (i = 0; i < n; i++) {
+        niov += reqs[i]->qiov->niov;
+    }
+    qemu_iovec_init(&merge->qiov, niov);
+    for (i = 0; i < n; i++) {
+        merge->reqs[i] = reqs[i];
+        reqs[i]->merge = merge;
+        qemu_iovec_concat(&merge->qiov, reqs[i]->qiov, reqs[i]->qiov->size);
+        nb_sectors += reqs[i]->nb_sectors;
+    }
+
+    if (!bdrv_elevator_dispatch(bs, first->is_write, first->sector_num,
+                                &merge->qiov, nb_sectors,
+                                bdrv_elevator_merge_cb, merge)) {
+        bdrv_elevator_merge_cb(merge, -EIO);
+        return;
+    }
+
+    /* the stats count what the guest asked for */
+    if (first->is_write) {
+        bs->wr_ops += n - 1;
+        bs->wr_merged += n - 1;
+    } else {
+        bs->rd_ops += n - 1;
+        bs->rd_merged += n - 1;
+    }
+}
+
+static int bdrv_elevator_compare_sector(const void *a, const void *b)
+{
+    const BdrvElevatorAIOCB *req1 = *(BdrvElevatorAIOCB **)a;
+    const BdrvElevatorAIOCB *req2 = *(BdrvElevatorAIOCB **)b;
+
+    if (req1->sector_num != req2->sector_num) {
+        return req1->sector_num > req2->sector_num ? 1 : -1;
+    }
+    return req1->index - req2->index;
+}
+
+static int bdrv_elevator_compare_index(const void *a, const void *b)
+{
+    const BdrvElevatorAIOCB *req1 = *(BdrvElevatorAIOCB **)a;
+    const BdrvElevatorAIOCB *req2 = *(BdrvElevatorAIOCB **)b;
+
+    return req1->index - req2->index;
+}
+
+/*
+ * Submit the queued requests by sector, merging those of the same
+ * direction that follow each other on the disk.  If some overlap, their
+ * order could matter, and they keep their order of arrival.
+ */
+static void bdrv_elevator_flush(BlockDriverState *bs)
+{
+    BdrvElevatorAIOCB *acb, **reqs;
+    int64_t end = 0;
+    int n = bs->elevator_queued;
+    int i, j;
+
+    if (n == 0) {
+        return;
+    }
+
+    /* completions during the submission may queue new requests */
+    reqs = qemu_malloc(n * sizeof(*reqs));
+    i = 0;
+    while ((acb = QTAILQ_FIRST(&bs->elevator_reqs))) {
+        QTAILQ_REMOVE(&bs->elevator_reqs, acb, entry);
+        acb->index = i;
+        reqs[i++] = acb;
+    }
+    bs->elevator_queued = 0;
+
+    qsort(reqs, n, sizeof(*reqs), bdrv_elevator_compare_sector);
+    for (i = 0; i < n; i++) {
+        if (reqs[i]->sector_num < end) {
+            qsort(reqs, n, sizeof(*reqs), bdrv_elevator_compare_index);
+            break;
+        }
+        end = reqs[i]->sector_num + reqs[i]->nb_sectors;
+    }
+
+    for (i = 0; i < n; i = j) {
+        int niov = reqs[i]->qiov->niov;
+        int nb_sectors = reqs[i]->nb_sectors;
+
+        end = reqs[i]->sector_num + reqs[i]->nb_sectors;
+        for (j = i + 1; j < n; j++) {
+            if (reqs[j]->is_write != reqs[i]->is_write ||
+                reqs[j]->sector_num != end ||
+                niov + reqs[j]->qiov->niov > IOV_MAX ||
+                nb_sectors + reqs[j]->nb_sectors > ELEVATOR_MAX_SECTORS) {
+                break;
+            }
+            niov += reqs[j]->qiov->niov;
+            nb_sectors += reqs[j]->nb_sectors;
+            end += reqs[j]->nb_sectors;
+        }
+        bdrv_elevator_submit(bs, &reqs[i], j - i);
+    }
+    qemu_free(reqs);
+}
+
+static void bdrv_elevator_bh(void *opaque)
+{
+    bdrv_elevator_flush(opaque);
+}
+
+static BlockDriverAIOCB *bdrv_elevator_intercept(BlockDriverState *bs,
+    int is_write, int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BdrvElevatorAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_elevator_aio_pool, bs, cb, opaque);
+    acb->is_write = is_write;
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    bs->elevator_queued++;
+    acb->aiocb = NULL;
+    acb->merge = NULL;
+    acb->cancelled = 0;
+    acb->done = 0;
+    QTAILQ_INSERT_TAIL(&bs->elevator_reqs, acb, entry);
+
+    /* requests of the same main loop iteration go out together, unless
+       the last bdrv_io_unplug() sends them earlier */
+    if (!bs->io_plugged) {
+        qemu_bh_schedule(bs->elevator_bh);
+    }
+    return &acb->common;
+}
+
+/*
+ * Merge the guest requests to bs that follow each other on the disk, and
+ * submit them sorted by sector.  Requests are held back until the end of
+ * the main loop iteration, or until the last bdrv_io_unplug() if a device
+ * plugs bs around the requests it has.
+ */
+void bdrv_set_elevator(BlockDriverState *bs, int enable)
+{
+    if (enable && !bs->elevator_bh) {
+        bs->elevator_bh = qemu_bh_new(bdrv_elevator_bh, bs);
+    }
+    bs->elevator_enabled = enable;
+    if (!enable) {
+        bdrv_elevator_flush(bs);
+    }
+}
+
+/* How much memory the image format of bs may use to cache its metadata,
+   the next time the image is opened; 0 lets the format choose */
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, int64_t size)
+{
+    bs->metadata_cache_size = size;
+}
+
+int64_t bdrv_get_metadata_cache_size(BlockDriverState *bs)
+{
+    return bs->metadata_cache_size;
+}
+
+void bdrv_get_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits)
+{
+    *io_limits = bs->io_limits;
+}
+
+/*
+ * Wait for all guest requests to complete, including those held back by
+ * I/O limits.  Use this rather than qemu_aio_flush() when the guest must
+ * be quiescent.
+ */
+void bdrv_drain_all(void)
+{
+    BlockDriverState *bs;
+    int busy;
+
+    do {
+        busy = 0;
+        QTAILQ_FOREACH(bs, &bdrv_states, list) {
+            if (bs->elevator_queued) {
+                bdrv_elevator_flush(bs);
+                busy = 1;
+            }
+            if (!QTAILQ_EMPTY(&bs->throttled_reqs[0]) ||
+                !QTAILQ_EMPTY(&bs->throttled_reqs[1])) {
+                bdrv_io_limits_flush(bs);
+                busy = 1;
+            }
+        }
+        /* completions may queue new requests */
+        qemu_aio_flush();
+    } while (busy);
+}
+
+
+/**************************************************************/
+/* Copy on read */
+
+/* Extents a read looks up to know what to copy; the rest is not copied */
+#define BDRV_COR_EXTENTS 16
+
+typedef struct BdrvCorAIOCB {
+    BlockDriverAIOCB common;
+    int is_write;
+    int64_t sector_num;
+    QEMUIOVector *qiov;         /* NULL for bdrv_aio_copy_backing() */
+    int nb_sectors;
+    int64_t cluster_start;      /* the clusters the request touches */
+    int64_t cluster_end;
+    int running;
+    int cancelled;
+    BlockDriverAIOCB *aiocb;    /* the read or write in flight */
+
+    /* the clusters are read into bounce, and the parts of them not
+       allocated in the image are written back from there */
+    uint8_t *bounce;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    BlockExtent extents[BDRV_COR_EXTENTS];
+    int nb_extents;
+    int pending;                /* writes back in flight */
+    int ret;
+    QTAILQ_ENTRY(BdrvCorAIOCB) entry;
+} BdrvCorAIOCB;
+
+typedef struct BdrvCorWrite {
+    BdrvCorAIOCB *acb;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} BdrvCorWrite;
+
+static void bdrv_cor_restart(BlockDriverState *bs);
+
+static void bdrv_cor_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvCorAIOCB *acb = container_of(blockacb, BdrvCorAIOCB, common);
+    BlockDriverState *bs = acb->common.bs;
+
+    if (acb->running && !acb->aiocb) {
+        /* writing back, the caller's buffers are not used anymore */
+        acb->cancelled = 1;
+        return;
+    }
+    if (acb->aiocb) {
+        bdrv_aio_cancel(acb->aiocb);
+    }
+    QTAILQ_REMOVE(&bs->cor_reqs, acb, entry);
+    qemu_vfree(acb->bounce);
+    qemu_aio_release(acb);
+    bdrv_cor_restart(bs);
+}
+
+static AIOPool bdrv_cor_aio_pool = {
+    .aiocb_size         = sizeof(BdrvCorAIOCB),
+    .cancel             = bdrv_cor_cancel,
+};
+
+/* Complete acb, the caller restarts the requests that waited for it */
+static void bdrv_cor_finish(BdrvCorAIOCB *acb, int ret)
+{
+    QTAILQ_REMOVE(&acb->common.bs->cor_reqs, acb, entry);
+    if (!acb->cancelled) {
+        acb->common.cb(acb->common.opaque, ret);
+    }
+    qemu_vfree(acb->bounce);
+    qemu_aio_release(acb);
+}
+
+static void bdrv_cor_done(BdrvCorAIOCB *acb, int ret)
+{
+    BlockDriverState *bs = acb->common.bs;
+
+    bdrv_cor_finish(acb, ret);
+    bdrv_cor_restart(bs);
+}
+
+static void bdrv_cor_cb(void *opaque, int ret)
+{
+    BdrvCorAIOCB *acb = opaque;
+
+    acb->aiocb = NULL;
+    bdrv_cor_done(acb, ret);
+}
+
+static void bdrv_cor_write_done(BdrvCorAIOCB *acb, int ret)
+{
+    if (ret < 0 && !acb->ret) {
+        acb->ret = ret;
+    }
+    if (--acb->pending == 0) {
+        /* the guest got its data already, only a copy has to succeed */
+        bdrv_cor_done(acb, acb->qiov ? 0 : acb->ret);
+    }
+}
+
+static void bdrv_cor_write_cb(void *opaque, int ret)
+{
+    BdrvCorWrite *w = opaque;
+    BdrvCorAIOCB *acb = w->acb;
+
+    qemu_free(w);
+    bdrv_cor_write_done(acb, ret);
+}
+
+static void bdrv_cor_read_cb(void *opaque, int ret)
+{
+    BdrvCorAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    int i;
+
+    acb->aiocb = NULL;
+    if (ret < 0) {
+        bdrv_cor_done(acb, ret);
+        return;
+    }
+
+    if (acb->qiov) {
+        qemu_iovec_from_buffer(acb->qiov, acb->bounce +
+                               (acb->sector_num - acb->cluster_start) *
+                               BDRV_SECTOR_SIZE,
+                               acb->nb_sectors * BDRV_SECTOR_SIZE);
+    }
+
+    acb->pending = 1;
+    for (i = 0; i < acb->nb_extents; i++) {
+        BlockExtent *e = &acb->extents[i];
+        BdrvCorWrite *w;
+
+        if (e->flags & BDRV_EXTENT_ALLOCATED) {
+            continue;
+        }
+        w = qemu_malloc(sizeof(*w));
+        w->acb = acb;
+        w->iov.iov_base = acb->bounce +
+            (e->sector_num - acb->cluster_start) * BDRV_SECTOR_SIZE;
+        w->iov.iov_len = e->nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&w->qiov, &w->iov, 1);
+        acb->pending++;
+        if (!bdrv_aio_writev_driver(bs, e->sector_num, &w->qiov,
+                                    e->nb_sectors, bdrv_cor_write_cb, w)) {
+            bdrv_cor_write_cb(w, -EIO);
+        }
+    }
+    bdrv_cor_write_done(acb, 0);
+}
+
+/* Submit acb, its clusters are not used by an earlier request */
+static int bdrv_cor_start(BdrvCorAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    int64_t len = acb->cluster_end - acb->cluster_start;
+    int i, copy = 0;
+
+    acb->running = 1;
+    if (acb->is_write) {
+        acb->aiocb = bdrv_aio_writev_driver(bs, acb->sector_num, acb->qiov,
+                                            acb->nb_sectors, bdrv_cor_cb,
+                                            acb);
+        return acb->aiocb ? 0 : -EIO;
+    }
+
+    if (bs->backing_hd && !bs->read_only) {
+        acb->nb_extents = bdrv_get_block_map(bs, acb->cluster_start, len,
+                                             acb->extents,
+                                             ARRAY_SIZE(acb->extents));
+        if (acb->nb_extents < 0 && !acb->qiov) {
+            return acb->nb_extents;
+        }
+        for (i = 0; i < acb->nb_extents; i++) {
+            copy |= !(acb->extents[i].flags & BDRV_EXTENT_ALLOCATED);
+        }
+    }
+    if (!copy && acb->qiov) {
+        acb->aiocb = bdrv_aio_readv_driver(bs, acb->sector_num, acb->qiov,
+                                           acb->nb_sectors, bdrv_cor_cb, acb);
+    } else {
+        acb->nb_extents = MAX(acb->nb_extents, 0);
+        acb->bounce = qemu_blockalign(bs, len * BDRV_SECTOR_SIZE);
+        acb->iov.iov_base = acb->bounce;
+        acb->iov.iov_len = len * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&acb->bounce_qiov, &acb->iov, 1);
+        acb->aiocb = bdrv_aio_readv_driver(bs, acb->cluster_start,
+                                           &acb->bounce_qiov, len,
+                                           bdrv_cor_read_cb, acb);
+    }
+    return acb->aiocb ? 0 : -EIO;
+}
+
+/* Whether an earlier request touches one of the clusters of acb */
+static int bdrv_cor_blocked(BdrvCorAIOCB *acb)
+{
+    BdrvCorAIOCB *prev;
+
+    for (prev = QTAILQ_PREV(acb, BdrvCorAIOCBHead, entry); prev;
+         prev = QTAILQ_PREV(prev, BdrvCorAIOCBHead, entry)) {
+        if (prev->cluster_start < acb->cluster_end &&
+            acb->cluster_start < prev->cluster_end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Submit the requests that no longer wait for an earlier one */
+static void bdrv_cor_restart(BlockDriverState *bs)
+{
+    BdrvCorAIOCB *acb;
+
+again:
+    QTAILQ_FOREACH(acb, &bs->cor_reqs, entry) {
+        if (!acb->running && !bdrv_cor_blocked(acb) &&
+            bdrv_cor_start(acb) < 0) {
+            /* the caller was told the request was queued */
+            bdrv_cor_finish(acb, -EIO);
+            goto again;
+        }
+    }
+}
+
+static BlockDriverAIOCB *bdrv_cor_intercept(BlockDriverState *bs,
+    int is_write, int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    int64_t cluster_sectors;
+    BdrvCorAIOCB *acb;
+
+    if (!bs->cor_cluster_sectors) {
+        BlockDriverInfo bdi;
+
+        /* copy whole clusters of the image that is open now */
+        bs->cor_cluster_sectors = 1;
+        if (bdrv_get_info(bs, &bdi) == 0 && bdi.cluster_size > 0) {
+            bs->cor_cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
+        }
+    }
+    cluster_sectors = bs->cor_cluster_sectors;
+
+    acb = qemu_aio_get(&bdrv_cor_aio_pool, bs, cb, opaque);
+    acb->is_write = is_write;
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->cluster_start = sector_num / cluster_sectors * cluster_sectors;
+    acb->cluster_end = MIN((sector_num + nb_sectors + cluster_sectors - 1) /
+                           cluster_sectors * cluster_sectors,
+                           MAX(bs->total_sectors, sector_num + nb_sectors));
+    acb->running = 0;
+    acb->cancelled = 0;
+    acb->aiocb = NULL;
+    acb->bounce = NULL;
+    acb->nb_extents = 0;
+    acb->pending = 0;
+    acb->ret = 0;
+    QTAILQ_INSERT_TAIL(&bs->cor_reqs, acb, entry);
+
+    if (!bdrv_cor_blocked(acb) && bdrv_cor_start(acb) < 0) {
+        /* nothing was submitted, no later request can wait for it */
+        QTAILQ_REMOVE(&bs->cor_reqs, acb, entry);
+        qemu_vfree(acb->bounce);
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+
+/*
+ * Copy on read: while it is enabled, the sectors that reads of bs find
+ * in its backing file are also written to bs, so that the next reads do
+ * not go to the backing file.  Reads copy whole clusters, and requests
+ * that touch the clusters of an earlier request wait for it, so that
+ * the copy never overwrites newer data.
+ *
+ * Enabling and disabling nest; entering copy on read waits for the
+ * requests in flight, so call it from the main loop.
+ */
+void bdrv_enable_copy_on_read(BlockDriverState *bs)
+{
+    if (bs->copy_on_read++ == 0) {
+        bdrv_drain_all();
+    }
+}
+
+void bdrv_disable_copy_on_read(BlockDriverState *bs)
+{
+    assert(bs->copy_on_read > 0);
+    bs->copy_on_read--;
+}
+
+int bdrv_get_copy_on_read(BlockDriverState *bs)
+{
+    return bs->copy_on_read;
+}
+
+/*
+ * Copy the sectors of the range that are not allocated in bs from its
+ * backing file, as a read would with copy on read; cb gets the errors of
+ * the writes too.  Copy on read has to be enabled.
+ */
+BlockDriverAIOCB *bdrv_aio_copy_backing(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        BlockDriverCompletionFunc *cb,
+                                        void *opaque)
+{
+    if (!bs->drv || bs->read_only ||
+        bdrv_check_request(bs, sector_num, nb_sectors)) {
+        return NULL;
+    }
+    assert(bs->copy_on_read > 0);
+    return bdrv_cor_intercept(bs, 0, sector_num, NULL, nb_sectors,
+                              cb, opaque);
+}
+
+/**************************************************************/
+/* Backing file cache */
+
+/* Larger reads, e.g. of qemu-img or streaming, do not go through the cache
+   and do not evict what the guests use */
+#define BDRV_CACHE_MAX_SECTORS (16 * BLOCK_CACHE_LINE_SECTORS)
+
+typedef struct BdrvCacheAIOCB {
+    BlockDriverAIOCB common;
+    BlockCacheImage *img;       /* referenced while the read is in flight */
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    int cancelled;
+    QEMUBH *bh;                 /* served from the cache */
+    BlockDriverAIOCB *aiocb;
+
+    /* the whole lines are read into bounce, and cached from there */
+    int64_t line_start;
+    int line_sectors;
+    uint8_t *bounce;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+} BdrvCacheAIOCB;
+
+static void bdrv_cache_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvCacheAIOCB *acb = container_of(blockacb, BdrvCacheAIOCB, common);
+
+    if (acb->bh) {
+        qemu_bh_delete(acb->bh);
+        acb->bh = NULL;
+        qemu_aio_release(acb);
+        return;
+    }
+    /* the lines are still worth caching */
+    acb->cancelled = 1;
+}
+
+static AIOPool bdrv_cache_aio_pool = {
+    .aiocb_size         = sizeof(BdrvCacheAIOCB),
+    .cancel             = bdrv_cache_cancel,
+};
+
+static void bdrv_cache_bh_cb(void *opaque)
+{
+    BdrvCacheAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+    acb->common.cb(acb->common.opaque, 0);
+    qemu_aio_release(acb);
+}
+
+static void bdrv_cache_read_cb(void *opaque, int ret)
+{
+    BdrvCacheAIOCB *acb = opaque;
+
+    if (ret == 0) {
+        block_cache_insert(acb->img, acb->line_start, acb->bounce,
+                           acb->line_sectors);
+        if (!acb->cancelled) {
+            qemu_iovec_from_buffer(acb->qiov, acb->bounce +
+                (acb->sector_num - acb->line_start) * BDRV_SECTOR_SIZE,
+                acb->nb_sectors * BDRV_SECTOR_SIZE);
+        }
+    }
+    if (!acb->cancelled) {
+        acb->common.cb(acb->common.opaque, ret);
+    }
+    block_cache_close(acb->img);
+    qemu_vfree(acb->bounce);
+    qemu_aio_release(acb);
+}
+
+static BlockDriverAIOCB *bdrv_cache_intercept(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BdrvCacheAIOCB *acb;
+    int64_t line_end;
+    int len;
+
+    if (nb_sectors > BDRV_CACHE_MAX_SECTORS) {
+        return bdrv_aio_readv_driver(bs, sector_num, qiov, nb_sectors,
+                                     cb, opaque);
+    }
+
+    acb = qemu_aio_get(&bdrv_cache_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->cancelled = 0;
+    acb->bh = NULL;
+
+    if (block_cache_read(bs->read_cache, sector_num, qiov, nb_sectors)) {
+        acb->bh = qemu_bh_new(bdrv_cache_bh_cb, acb);
+        qemu_bh_schedule(acb->bh);
+        return &acb->common;
+    }
+
+    acb->line_start = sector_num & ~(int64_t)(BLOCK_CACHE_LINE_SECTORS - 1);
+    line_end = (sector_num + nb_sectors + BLOCK_CACHE_LINE_SECTORS - 1) &
+               ~(int64_t)(BLOCK_CACHE_LINE_SECTORS - 1);
+    acb->line_sectors = line_end - acb->line_start;
+
+    /* the end of the last line reads as zeroes, nothing can read it */
+    len = MIN(line_end, bs->total_sectors) - acb->line_start;
+    acb->bounce = qemu_blockalign(bs, acb->line_sectors * BDRV_SECTOR_SIZE);
+    memset(acb->bounce + len * BDRV_SECTOR_SIZE, 0,
+           (acb->line_sectors - len) * BDRV_SECTOR_SIZE);
+    acb->iov.iov_base = acb->bounce;
+    acb->iov.iov_len = len * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&acb->bounce_qiov, &acb->iov, 1);
+
+    acb->img = bs->read_cache;
+    block_cache_ref(acb->img);
+    acb->aiocb = bdrv_aio_readv_driver(bs, acb->line_start, &acb->bounce_qiov,
+                                       len, bdrv_cache_read_cb, acb);
+    if (!acb->aiocb) {
+        block_cache_close(acb->img);
+        qemu_vfree(acb->bounce);
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
 
 /**************************************************************/
 /* async block device emulation */
@@ -2776,10 +4462,15 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs)
     return bs->dirty_count;
 }
 
+/* Users nest, e.g. block migration of a drive that is being streamed */
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
 {
-    assert(bs->in_use != in_use);
-    bs->in_use = in_use;
+    if (in_use) {
+        bs->in_use++;
+    } else {
+        assert(bs->in_use > 0);
+        bs->in_use--;
+    }
 }
 
 int bdrv_in_use(BlockDriverState *bs)
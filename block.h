@@ -16,6 +16,22 @@ typedef struct BlockDriverInfo {
     int64_t vm_state_offset;
 } BlockDriverInfo;
 
+/* A range of sectors in the same state, see bdrv_get_block_map() */
+typedef struct BlockExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+    int flags;
+} BlockExtent;
+
+#define BDRV_EXTENT_ALLOCATED 0x1 /* in the image, not in its backing file */
+#define BDRV_EXTENT_ZERO      0x2 /* reads as zeroes */
+
+/* A range of sectors the guest does not need anymore */
+typedef struct BlockDiscardRange {
+    int64_t sector_num;
+    int64_t nb_sectors;
+} BlockDiscardRange;
+
 typedef struct QEMUSnapshotInfo {
     char id_str[128]; /* unique snapshot id */
     /* the following fields are informative. They are not needed for
@@ -37,6 +53,12 @@ typedef struct QEMUSnapshotInfo {
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH)
 
+/* I/O limits of a drive, indexed by is_write; 0 means no limit */
+typedef struct BlockIOLimit {
+    uint64_t bps[2];    /* bytes per second */
+    uint64_t iops[2];   /* requests per second */
+} BlockIOLimit;
+
 #define BDRV_SECTOR_BITS   9
 #define BDRV_SECTOR_SIZE   (1ULL << BDRV_SECTOR_BITS)
 #define BDRV_SECTOR_MASK   ~(BDRV_SECTOR_SIZE - 1)
@@ -134,6 +156,24 @@ typedef struct BlockRequest {
 
 int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs,
     int num_reqs);
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs,
+    int num_reqs);
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, int64_t size);
+int64_t bdrv_get_metadata_cache_size(BlockDriverState *bs);
+void bdrv_set_io_limits(BlockDriverState *bs, const BlockIOLimit *io_limits);
+void bdrv_set_elevator(BlockDriverState *bs, int enable);
+void bdrv_enable_copy_on_read(BlockDriverState *bs);
+void bdrv_disable_copy_on_read(BlockDriverState *bs);
+int bdrv_get_copy_on_read(BlockDriverState *bs);
+BlockDriverAIOCB *bdrv_aio_copy_backing(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        BlockDriverCompletionFunc *cb,
+                                        void *opaque);
+void bdrv_get_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits);
+void bdrv_drain_all(void);
 
 /* sg packet commands */
 int bdrv_ioctl(BlockDriverState *bs, unsigned long int req, void *buf);
@@ -147,9 +187,16 @@ void bdrv_flush_all(void);
 void bdrv_close_all(void);
 
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors);
+int bdrv_discard_ranges(BlockDriverState *bs, BlockDiscardRange *ranges,
+                        int nb_ranges);
 int bdrv_has_zero_init(BlockDriverState *bs);
+int bdrv_get_fd(BlockDriverState *bs);
+int raw_get_aio_fd(BlockDriverState *bs);
 int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
 	int *pnum);
+int bdrv_get_block_map(BlockDriverState *bs, int64_t sector_num,
+                       int64_t nb_sectors, BlockExtent *extents,
+                       int max_extents);
 
 #define BDRV_TYPE_HD     0
 #define BDRV_TYPE_CDROM  1
@@ -198,6 +245,12 @@ void bdrv_iterate_format(void (*it)(void *opaque, const char *name),
 const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
+int bdrv_can_compress_cluster(BlockDriverState *bs);
+int bdrv_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                          uint8_t *out_buf);
+int bdrv_write_compressed_cluster(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, const uint8_t *out_buf,
+                                  int out_len);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 
 const char *bdrv_get_encrypted_filename(BlockDriverState *bs);
@@ -229,6 +282,9 @@ int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
 int bdrv_load_vmstate(BlockDriverState *bs, uint8_t *buf,
                       int64_t pos, int size);
 
+int64_t bdrv_map_vmstate(BlockDriverState *bs, int64_t pos, int64_t size,
+                         int64_t *file_offset);
+
 int bdrv_img_create(const char *filename, const char *fmt,
                     const char *base_filename, const char *base_fmt,
                     char *options, uint64_t img_size, int flags);
@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 #include "qemu-common.h"
+#include "qemu-queue.h"
 #include "block_int.h"
 #include <curl/curl.h>
 
@@ -38,6 +39,8 @@
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_SIZE (256 * 1024)
+#define CURL_CACHE_SIZE (16 * 1024 * 1024)
+#define CURL_PREFETCH   2
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -66,12 +69,25 @@ typedef struct CURLState
     char in_use;
 } CURLState;
 
+/* A range that was read completely, kept until it is least recently used */
+typedef struct CURLCacheEntry {
+    size_t start;
+    size_t len;
+    char *buf;
+    QTAILQ_ENTRY(CURLCacheEntry) next;
+} CURLCacheEntry;
+
 typedef struct BDRVCURLState {
     CURLM *multi;
     size_t len;
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+    QTAILQ_HEAD(CURLCacheHead, CURLCacheEntry) cache; /* most recent first */
+    size_t cache_size;
+    size_t cache_max;
+    size_t prefetch;            /* readahead-sized ranges fetched ahead */
+    size_t seq_end;             /* where a sequential read would start */
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
@@ -124,8 +140,8 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     if (!s || !s->orig_buf)
         goto read_end;
 
-    memcpy(s->orig_buf + s->buf_off, ptr, realsize);
-    s->buf_off += realsize;
+    memcpy(s->orig_buf + s->buf_off, ptr, MIN(realsize, s->buf_len - s->buf_off));
+    s->buf_off += MIN(realsize, s->buf_len - s->buf_off);
 
     for(i=0; i<CURL_NUM_ACB; i++) {
         CURLAIOCB *acb = s->acb[i];
@@ -146,12 +162,72 @@ read_end:
     return realsize;
 }
 
+static void curl_cache_insert(BDRVCURLState *s, size_t start, char *buf,
+                              size_t len)
+{
+    CURLCacheEntry *e;
+
+    if (len > s->cache_max) {
+        qemu_free(buf);
+        return;
+    }
+    while (s->cache_size + len > s->cache_max) {
+        e = QTAILQ_LAST(&s->cache, CURLCacheHead);
+        QTAILQ_REMOVE(&s->cache, e, next);
+        s->cache_size -= e->len;
+        qemu_free(e->buf);
+        qemu_free(e);
+    }
+
+    e = qemu_malloc(sizeof(*e));
+    e->start = start;
+    e->len = len;
+    e->buf = buf;
+    QTAILQ_INSERT_HEAD(&s->cache, e, next);
+    s->cache_size += len;
+}
+
+static CURLCacheEntry *curl_cache_find(BDRVCURLState *s, size_t start,
+                                       size_t end)
+{
+    CURLCacheEntry *e;
+
+    QTAILQ_FOREACH(e, &s->cache, next) {
+        if (start >= e->start && end <= e->start + e->len) {
+            QTAILQ_REMOVE(&s->cache, e, next);
+            QTAILQ_INSERT_HEAD(&s->cache, e, next);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void curl_cache_free(BDRVCURLState *s)
+{
+    CURLCacheEntry *e;
+
+    while ((e = QTAILQ_FIRST(&s->cache))) {
+        QTAILQ_REMOVE(&s->cache, e, next);
+        qemu_free(e->buf);
+        qemu_free(e);
+    }
+    s->cache_size = 0;
+}
+
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
                          CURLAIOCB *acb)
 {
+    CURLCacheEntry *e;
     int i;
     size_t end = start + len;
 
+    e = curl_cache_find(s, start, end);
+    if (e) {
+        qemu_iovec_from_buffer(acb->qiov, e->buf + (start - e->start), len);
+        acb->common.cb(acb->common.opaque, 0);
+        return FIND_RET_OK;
+    }
+
     for (i=0; i<CURL_NUM_STATES; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
@@ -159,8 +235,6 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
 
         if (!state->orig_buf)
             continue;
-        if (!state->buf_off)
-            continue;
 
         // Does the existing buffer cover our section?
         if ((start >= state->buf_start) &&
@@ -199,6 +273,35 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
+/* A transfer is over; keep what it read if it went through */
+static void curl_finish_state(CURLState *state, CURLcode result)
+{
+    BDRVCURLState *s = state->s;
+    int i;
+
+    for (i = 0; i < CURL_NUM_ACB; i++) {
+        CURLAIOCB *acb = state->acb[i];
+
+        if (acb) {
+            acb->common.cb(acb->common.opaque, -EIO);
+            qemu_aio_release(acb);
+            state->acb[i] = NULL;
+        }
+    }
+
+    if (result == CURLE_OK && state->buf_off) {
+        curl_cache_insert(s, state->buf_start, state->orig_buf,
+                          state->buf_off);
+    } else {
+        DPRINTF("CURL: Transfer of %s failed: %s\n", state->range,
+                state->errmsg);
+        qemu_free(state->orig_buf);
+    }
+    state->orig_buf = NULL;
+    state->buf_off = 0;
+    curl_clean_state(state);
+}
+
 static void curl_multi_do(void *arg)
 {
     BDRVCURLState *s = (BDRVCURLState *)arg;
@@ -229,7 +332,7 @@ static void curl_multi_do(void *arg)
             {
                 CURLState *state = NULL;
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
-                curl_clean_state(state);
+                curl_finish_state(state, msg->data.result);
                 break;
             }
             default:
@@ -239,29 +342,22 @@ static void curl_multi_do(void *arg)
     } while(msgs_in_queue);
 }
 
-static CURLState *curl_init_state(BDRVCURLState *s)
+/* Returns a state that isn't in use, or NULL if all of them are */
+static CURLState *curl_find_state(BDRVCURLState *s)
 {
-    CURLState *state = NULL;
-    int i, j;
+    int i;
 
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
-
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
-        }
-        if (!state) {
-            usleep(100);
-            curl_multi_do(s);
+    for (i=0; i<CURL_NUM_STATES; i++) {
+        if (!s->states[i].in_use) {
+            s->states[i].in_use = 1;
+            return &s->states[i];
         }
-    } while(!state);
+    }
+    return NULL;
+}
 
+static CURLState *curl_setup_state(BDRVCURLState *s, CURLState *state)
+{
     if (state->curl)
         goto has_curl;
 
@@ -289,6 +385,92 @@ has_curl:
     return state;
 }
 
+static CURLState *curl_init_state(BDRVCURLState *s)
+{
+    CURLState *state;
+
+    while (!(state = curl_find_state(s))) {
+        usleep(100);
+        curl_multi_do(s);
+    }
+    return curl_setup_state(s, state);
+}
+
+/* Starts reading len bytes at start into the state's buffer */
+static void curl_start_state(BDRVCURLState *s, CURLState *state,
+                             size_t start, size_t len)
+{
+    size_t end = MIN(start + len, s->len) - 1;
+
+    state->buf_off = 0;
+    if (state->orig_buf)
+        qemu_free(state->orig_buf);
+    state->buf_start = start;
+    state->buf_len = len;
+    state->orig_buf = qemu_malloc(state->buf_len);
+
+    snprintf(state->range, 127, "%zd-%zd", start, end);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+    curl_multi_add_handle(s->multi, state->curl);
+}
+
+/* Whether offset is cached or being read; *end is where that range ends */
+static int curl_is_covered(BDRVCURLState *s, size_t offset, size_t *end)
+{
+    CURLCacheEntry *e;
+    int i;
+
+    QTAILQ_FOREACH(e, &s->cache, next) {
+        if (offset >= e->start && offset < e->start + e->len) {
+            *end = e->start + e->len;
+            return 1;
+        }
+    }
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        CURLState *state = &s->states[i];
+
+        if (state->orig_buf && offset >= state->buf_start &&
+            offset < state->buf_start + state->buf_len) {
+            *end = state->buf_start + state->buf_len;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Keeps the next prefetch readahead-sized ranges after offset cached or on
+ * their way, each on a connection of its own, so that a sequential reader
+ * finds its data waiting rather than one round trip at a time.  Only uses
+ * connections that are free: a prefetch never waits.
+ */
+static void curl_prefetch(BDRVCURLState *s, size_t offset)
+{
+    size_t window = offset + s->prefetch * s->readahead_size;
+    size_t end;
+    CURLState *state;
+
+    while (offset < MIN(window, s->len)) {
+        if (curl_is_covered(s, offset, &end)) {
+            offset = end;
+            continue;
+        }
+        state = curl_find_state(s);
+        if (!state) {
+            break;
+        }
+        if (!curl_setup_state(s, state)) {
+            state->in_use = 0;
+            break;
+        }
+        DPRINTF("CURL (AIO): Prefetching %zd at %zd\n", s->readahead_size,
+                offset);
+        curl_start_state(s, state, offset, MIN(s->readahead_size,
+                                               s->len - offset));
+        offset += s->readahead_size;
+    }
+}
+
 static void curl_clean_state(CURLState *s)
 {
     if (s->s->multi)
@@ -296,47 +478,68 @@ static void curl_clean_state(CURLState *s)
     s->in_use = 0;
 }
 
+/*
+ * Strips a trailing ":name=#:" off file, leaving its leading colon for the
+ * option before it; returns 1 if there was one, with its value in *val.
+ */
+static int curl_strip_option(char *file, const char *name, size_t *val)
+{
+    size_t nlen = strlen(name);
+    char *end = file + strlen(file) - 1;
+    char *p;
+
+    if (end < file || *end != ':') {
+        return 0;
+    }
+    p = end;
+    while (p > file && qemu_isdigit(p[-1])) {
+        p--;
+    }
+    if (p == end || p - file < nlen + 3) {
+        return 0;
+    }
+    p -= nlen + 2;
+    if (p[0] != ':' || strncmp(p + 1, name, nlen) != 0 || p[nlen + 1] != '=') {
+        return 0;
+    }
+    *val = strtoull(p + nlen + 2, NULL, 10);
+    p[1] = '\0';
+    return 1;
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
     double d;
 
-    #define RA_OPTSTR ":readahead="
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
+    int found, stripped = 0;
 
     static int inited = 0;
 
     file = qemu_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
+    s->cache_max = CURL_CACHE_SIZE;
+    s->prefetch = CURL_PREFETCH;
+    QTAILQ_INIT(&s->cache);
 
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        ra--;
+    /* Parse trailing ":readahead=#:", ":cache=#:" and ":prefetch=#:"
+     * params, if present, in any order. */
+    do {
+        found = curl_strip_option(file, "readahead", &s->readahead_size) ||
+                curl_strip_option(file, "cache", &s->cache_max) ||
+                curl_strip_option(file, "prefetch", &s->prefetch);
+        stripped |= found;
+    } while (found);
+    if (stripped) {
+        file[strlen(file) - 1] = '\0';
+    }
+
+    if (s->prefetch > CURL_NUM_STATES / 2) {
+        fprintf(stderr, "CURL: prefetch %zd is more than %d\n", s->prefetch,
+                CURL_NUM_STATES / 2);
+        goto out_noclean;
     }
 
     if ((s->readahead_size & 0x1ff) != 0) {
@@ -411,7 +614,8 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
     BDRVCURLState *s = bs->opaque;
     CURLAIOCB *acb;
     size_t start = sector_num * SECTOR_SIZE;
-    size_t end;
+    size_t len = nb_sectors * SECTOR_SIZE;
+    int sequential = start == s->seq_end;
     CURLState *state;
 
     acb = qemu_aio_get(&curl_aio_pool, bs, cb, opaque);
@@ -419,16 +623,17 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
         return NULL;
 
     acb->qiov = qiov;
+    s->seq_end = start + len;
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
 
-    switch (curl_find_buf(s, start, nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
             qemu_aio_release(acb);
             // fall through
         case FIND_RET_WAIT:
-            return &acb->common;
+            goto out;
         default:
             break;
     }
@@ -440,23 +645,16 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
         return NULL;
 
     acb->start = 0;
-    acb->end = (nb_sectors * SECTOR_SIZE);
-
-    state->buf_off = 0;
-    if (state->orig_buf)
-        qemu_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = qemu_malloc(state->buf_len);
+    acb->end = len;
     state->acb[0] = acb;
 
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+    DPRINTF("CURL (AIO): Reading %zd at %zd\n", len, start);
+    curl_start_state(s, state, start, len + s->readahead_size);
 
-    curl_multi_add_handle(s->multi, state->curl);
+out:
+    if (sequential) {
+        curl_prefetch(s, start + len);
+    }
     curl_multi_do(s);
 
     return &acb->common;
@@ -482,6 +680,7 @@ static void curl_close(BlockDriverState *bs)
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
+    curl_cache_free(s);
     if (s->url)
         free(s->url);
 }
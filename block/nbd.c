@@ -27,6 +27,7 @@
  */
 
 #include "qemu-common.h"
+#include "qemu_socket.h"
 #include "nbd.h"
 #include "module.h"
 
@@ -35,12 +36,335 @@
 
 #define EN_OPTSTR ":exportname="
 
+/*
+ * Requests are pipelined: they are all sent as soon as the socket takes
+ * them and are matched with their replies by handle, so many of them can be
+ * outstanding.  qemu-nbd takes at most 1 MB per request, larger guest
+ * requests are split.
+ */
+#define NBD_MAX_SECTORS 1024
+
+/* a server that went away is noticed by the AIO handlers, not by SIGPIPE */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+typedef struct NBDAIOCB NBDAIOCB;
+
+typedef struct NBDRequest {
+    NBDAIOCB *acb;
+    uint64_t handle;
+    QEMUIOVector qiov;          /* the part of acb->qiov it transfers */
+    uint8_t header[NBD_REQUEST_SIZE];
+    size_t sent;                /* of the header, then of the data */
+    QTAILQ_ENTRY(NBDRequest) send_entry;
+    QLIST_ENTRY(NBDRequest) inflight_entry;
+} NBDRequest;
+
+struct NBDAIOCB {
+    BlockDriverAIOCB common;
+    int is_write;
+    NBDRequest *reqs;
+    int nb_reqs;
+    int pending;                /* requests without a reply yet */
+    int ret;
+    int async_context_id;
+    int cancelled;
+    QLIST_ENTRY(NBDAIOCB) completed_entry;
+};
+
 typedef struct BDRVNBDState {
     int sock;
     off_t size;
     size_t blocksize;
+
+    uint64_t next_handle;
+    QTAILQ_HEAD(, NBDRequest) send_queue;   /* not completely sent yet */
+    QLIST_HEAD(, NBDRequest) inflight;      /* waiting for their reply */
+    QLIST_HEAD(, NBDAIOCB) completed;       /* for another AsyncContext */
+
+    /* the reply being received */
+    uint8_t reply_buf[NBD_REPLY_SIZE];
+    size_t reply_received;
+    NBDRequest *reply_req;
+    size_t data_received;
+
+    int error;                  /* the connection is unusable */
 } BDRVNBDState;
 
+static void nbd_aio_read_response(void *opaque);
+static void nbd_aio_write_request(void *opaque);
+static int nbd_aio_flush_request(void *opaque);
+static int nbd_aio_process_queue(void *opaque);
+
+static void nbd_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    NBDAIOCB *acb = (NBDAIOCB *)blockacb;
+
+    /* requests already sent cannot be taken back, wait for their reply */
+    acb->cancelled = 1;
+    while (acb->pending) {
+        qemu_aio_wait();
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool nbd_aio_pool = {
+    .aiocb_size = sizeof(NBDAIOCB),
+    .cancel = nbd_aio_cancel,
+};
+
+static void nbd_aio_complete(NBDAIOCB *acb)
+{
+    int i;
+
+    for (i = 0; i < acb->nb_reqs; i++) {
+        qemu_iovec_destroy(&acb->reqs[i].qiov);
+    }
+    qemu_free(acb->reqs);
+
+    if (!acb->cancelled) {
+        acb->common.cb(acb->common.opaque, acb->ret);
+        qemu_aio_release(acb);
+    }
+}
+
+/*
+ * Called once per request of acb that got its reply, or failed; acb itself
+ * completes with the last of them, in its own AsyncContext.
+ */
+static void nbd_request_done(BDRVNBDState *s, NBDRequest *req, int ret)
+{
+    NBDAIOCB *acb = req->acb;
+
+    if (ret < 0 && acb->ret == 0) {
+        acb->ret = ret;
+    }
+    if (--acb->pending > 0) {
+        return;
+    }
+
+    if (acb->async_context_id == get_async_context_id() || acb->cancelled) {
+        nbd_aio_complete(acb);
+    } else {
+        QLIST_INSERT_HEAD(&s->completed, acb, completed_entry);
+    }
+}
+
+static int nbd_aio_process_queue(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    NBDAIOCB *acb, *next;
+    int res = 0;
+
+    QLIST_FOREACH_SAFE(acb, &s->completed, completed_entry, next) {
+        if (acb->async_context_id == get_async_context_id()) {
+            QLIST_REMOVE(acb, completed_entry);
+            nbd_aio_complete(acb);
+            res = 1;
+        }
+    }
+    return res;
+}
+
+static void nbd_set_fd_handlers(BDRVNBDState *s)
+{
+    qemu_aio_set_fd_handler(s->sock, nbd_aio_read_response,
+                            QTAILQ_EMPTY(&s->send_queue) ?
+                            NULL : nbd_aio_write_request,
+                            nbd_aio_flush_request, nbd_aio_process_queue, s);
+}
+
+/* The connection is broken: fail everything that is outstanding */
+static void nbd_fail_all(BDRVNBDState *s)
+{
+    NBDRequest *req;
+
+    s->error = 1;
+    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL,
+                            nbd_aio_process_queue, s);
+
+    if (s->reply_req) {
+        req = s->reply_req;
+        s->reply_req = NULL;
+        nbd_request_done(s, req, -EIO);
+    }
+    while ((req = QTAILQ_FIRST(&s->send_queue)) != NULL) {
+        QTAILQ_REMOVE(&s->send_queue, req, send_entry);
+        nbd_request_done(s, req, -EIO);
+    }
+    while ((req = QLIST_FIRST(&s->inflight)) != NULL) {
+        QLIST_REMOVE(req, inflight_entry);
+        nbd_request_done(s, req, -EIO);
+    }
+}
+
+/*
+ * Transfer the bytes of qiov from offset on, as many as the socket takes.
+ * offset must be less than qiov->size.
+ */
+static ssize_t nbd_qiov_io(int sock, QEMUIOVector *qiov, size_t offset,
+                           int do_read)
+{
+    struct iovec *iov = qiov->iov;
+    int niov = qiov->niov;
+    struct msghdr msg;
+    ssize_t ret;
+
+    while (offset >= iov->iov_len) {
+        offset -= iov->iov_len;
+        iov++;
+        niov--;
+    }
+    iov->iov_base += offset;
+    iov->iov_len -= offset;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+    do {
+        if (do_read) {
+            ret = recvmsg(sock, &msg, 0);
+        } else {
+            ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        }
+    } while (ret == -1 && errno == EINTR);
+
+    iov->iov_base -= offset;
+    iov->iov_len += offset;
+    return ret;
+}
+
+/* Send the head of the send queue, and those after it, until the socket
+   is full.  Returns -1 if the connection is broken. */
+static int nbd_send_requests(BDRVNBDState *s)
+{
+    NBDRequest *req;
+
+    while ((req = QTAILQ_FIRST(&s->send_queue)) != NULL) {
+        size_t size = NBD_REQUEST_SIZE;
+        ssize_t ret;
+
+        if (req->acb->is_write) {
+            size += req->qiov.size;
+        }
+
+        while (req->sent < size) {
+            if (req->sent < NBD_REQUEST_SIZE) {
+                do {
+                    ret = send(s->sock, req->header + req->sent,
+                               NBD_REQUEST_SIZE - req->sent,
+                               MSG_NOSIGNAL |
+                               (size > NBD_REQUEST_SIZE ? MSG_MORE : 0));
+                } while (ret == -1 && errno == EINTR);
+            } else {
+                ret = nbd_qiov_io(s->sock, &req->qiov,
+                                  req->sent - NBD_REQUEST_SIZE, 0);
+            }
+            if (ret == -1 && errno == EAGAIN) {
+                return 0;
+            } else if (ret <= 0) {
+                return -1;
+            }
+            req->sent += ret;
+        }
+
+        QTAILQ_REMOVE(&s->send_queue, req, send_entry);
+        QLIST_INSERT_HEAD(&s->inflight, req, inflight_entry);
+    }
+    return 0;
+}
+
+static void nbd_aio_write_request(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+
+    if (nbd_send_requests(s) < 0) {
+        nbd_fail_all(s);
+    } else {
+        nbd_set_fd_handlers(s);
+    }
+}
+
+/* Receive replies, and the data of reads, until the socket is empty */
+static void nbd_aio_read_response(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    ssize_t ret;
+
+    while (!s->error) {
+        NBDRequest *req = s->reply_req;
+
+        if (!req) {
+            struct nbd_reply reply;
+
+            do {
+                ret = recv(s->sock, s->reply_buf + s->reply_received,
+                           NBD_REPLY_SIZE - s->reply_received, 0);
+            } while (ret == -1 && errno == EINTR);
+            if (ret == -1 && errno == EAGAIN) {
+                return;
+            } else if (ret <= 0) {
+                goto fail;
+            }
+            s->reply_received += ret;
+            if (s->reply_received < NBD_REPLY_SIZE) {
+                continue;
+            }
+            s->reply_received = 0;
+
+            if (nbd_decode_reply(s->reply_buf, &reply) == -1) {
+                goto fail;
+            }
+            QLIST_FOREACH(req, &s->inflight, inflight_entry) {
+                if (req->handle == reply.handle) {
+                    break;
+                }
+            }
+            if (!req) {
+                goto fail;
+            }
+            QLIST_REMOVE(req, inflight_entry);
+
+            if (reply.error != 0 || req->acb->is_write) {
+                /* no data follows */
+                nbd_request_done(s, req, -reply.error);
+                continue;
+            }
+            s->reply_req = req;
+            s->data_received = 0;
+        }
+
+        ret = nbd_qiov_io(s->sock, &req->qiov, s->data_received, 1);
+        if (ret == -1 && errno == EAGAIN) {
+            return;
+        } else if (ret <= 0) {
+            goto fail;
+        }
+        s->data_received += ret;
+        if (s->data_received == req->qiov.size) {
+            s->reply_req = NULL;
+            nbd_request_done(s, req, 0);
+        }
+    }
+    return;
+
+fail:
+    /* the server closed the connection or does not speak NBD */
+    nbd_fail_all(s);
+}
+
+static int nbd_aio_flush_request(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+
+    return !QTAILQ_EMPTY(&s->send_queue) || !QLIST_EMPTY(&s->inflight) ||
+        s->reply_req != NULL;
+}
+
 static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
 {
     BDRVNBDState *s = bs->opaque;
@@ -114,6 +438,19 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
     s->sock = sock;
     s->size = size;
     s->blocksize = blocksize;
+    QTAILQ_INIT(&s->send_queue);
+    QLIST_INIT(&s->inflight);
+    QLIST_INIT(&s->completed);
+
+    /* the negotiation is over, from now on the socket is driven by the
+       AIO handlers */
+    socket_set_nonblock(sock);
+    if (!strstart(host, "unix:", NULL)) {
+        int opt = 1;
+
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&opt, sizeof(opt));
+    }
+    nbd_set_fd_handlers(s);
     err = 0;
 
 out:
@@ -121,64 +458,68 @@ out:
     return err;
 }
 
-static int nbd_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static BlockDriverAIOCB *nbd_aio_rw_vector(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
 {
     BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
-    struct nbd_reply reply;
-
-    request.type = NBD_CMD_READ;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
-
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+    NBDAIOCB *acb;
+    size_t offset = 0;
+    int i;
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
-
-    if (reply.error !=0)
-        return -reply.error;
-
-    if (reply.handle != request.handle)
-        return -EIO;
+    if (s->error) {
+        return NULL;
+    }
 
-    if (nbd_wr_sync(s->sock, buf, request.len, 1) != request.len)
-        return -EIO;
+    acb = qemu_aio_get(&nbd_aio_pool, bs, cb, opaque);
+    acb->is_write = is_write;
+    acb->ret = 0;
+    acb->cancelled = 0;
+    acb->async_context_id = get_async_context_id();
+    acb->nb_reqs = (nb_sectors + NBD_MAX_SECTORS - 1) / NBD_MAX_SECTORS;
+    acb->pending = acb->nb_reqs;
+    acb->reqs = qemu_mallocz(sizeof(*acb->reqs) * acb->nb_reqs);
+
+    for (i = 0; i < acb->nb_reqs; i++) {
+        NBDRequest *req = &acb->reqs[i];
+        struct nbd_request request;
+        int n = MIN(nb_sectors, NBD_MAX_SECTORS);
+
+        req->acb = acb;
+        req->handle = s->next_handle++;
+        qemu_iovec_init(&req->qiov, qiov->niov);
+        qemu_iovec_copy(&req->qiov, qiov, offset, n * BDRV_SECTOR_SIZE);
+
+        request.type = is_write ? NBD_CMD_WRITE : NBD_CMD_READ;
+        request.handle = req->handle;
+        request.from = (sector_num * BDRV_SECTOR_SIZE) + offset;
+        request.len = n * BDRV_SECTOR_SIZE;
+        nbd_encode_request(req->header, &request);
+
+        QTAILQ_INSERT_TAIL(&s->send_queue, req, send_entry);
+        offset += n * BDRV_SECTOR_SIZE;
+        nb_sectors -= n;
+    }
 
-    return 0;
+    /* callbacks must not run before we return, so a broken connection is
+       only noticed by the write handler */
+    nbd_send_requests(s);
+    nbd_set_fd_handlers(s);
+    return &acb->common;
 }
 
-static int nbd_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+static BlockDriverAIOCB *nbd_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
 {
-    BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
-    struct nbd_reply reply;
-
-    request.type = NBD_CMD_WRITE;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
-
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
-
-    if (nbd_wr_sync(s->sock, (uint8_t*)buf, request.len, 0) != request.len)
-        return -EIO;
-
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
-
-    if (reply.error !=0)
-        return -reply.error;
-
-    if (reply.handle != request.handle)
-        return -EIO;
+    return nbd_aio_rw_vector(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+}
 
-    return 0;
+static BlockDriverAIOCB *nbd_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return nbd_aio_rw_vector(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
 }
 
 static void nbd_close(BlockDriverState *bs)
@@ -186,11 +527,16 @@ static void nbd_close(BlockDriverState *bs)
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
-    request.type = NBD_CMD_DISC;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = 0;
-    request.len = 0;
-    nbd_send_request(s->sock, &request);
+    qemu_aio_flush();
+    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL, NULL);
+
+    if (!s->error) {
+        request.type = NBD_CMD_DISC;
+        request.handle = s->next_handle++;
+        request.from = 0;
+        request.len = 0;
+        nbd_send_request(s->sock, &request);
+    }
 
     close(s->sock);
 }
@@ -206,8 +552,8 @@ static BlockDriver bdrv_nbd = {
     .format_name	= "nbd",
     .instance_size	= sizeof(BDRVNBDState),
     .bdrv_file_open	= nbd_open,
-    .bdrv_read		= nbd_read,
-    .bdrv_write		= nbd_write,
+    .bdrv_aio_readv	= nbd_aio_readv,
+    .bdrv_aio_writev	= nbd_aio_writev,
     .bdrv_close		= nbd_close,
     .bdrv_getlength	= nbd_getlength,
     .protocol_name	= "nbd",
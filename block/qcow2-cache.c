@@ -26,22 +26,71 @@
 #include "qemu-common.h"
 #include "qcow2.h"
 
+/*
+ * Tables are found through a hash table of their offsets, and the one
+ * replaced on a miss is the least recently used of those not in use.
+ */
+
 typedef struct Qcow2CachedTable {
-    void*   table;
-    int64_t offset;
+    int64_t offset;             /* 0 if the entry is free */
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;          /* next entry of the bucket, -1 at the end */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    uint8_t*                tables;     /* the table of entry i is at
+                                           i * table_size */
+    int*                    buckets;
+    int                     nb_buckets; /* a power of two */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru; /* least recently used first */
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
     bool                    writethrough;
+    Qcow2CacheStats         stats;
 };
 
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->tables + (size_t)i * c->table_size;
+}
+
+static inline int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t i = ((uint8_t *)table - c->tables) / c->table_size;
+
+    assert(i >= 0 && i < c->size);
+    return i;
+}
+
+static inline int qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset / c->table_size) & (c->nb_buckets - 1);
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int b = qcow2_cache_bucket(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[b];
+    c->buckets[b] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_bucket(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p != -1);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     bool writethrough)
 {
@@ -51,11 +100,22 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 
     c = qemu_mallocz(sizeof(*c));
     c->size = num_tables;
+    c->table_size = s->cluster_size;
     c->entries = qemu_mallocz(sizeof(*c->entries) * num_tables);
+    c->tables = qemu_blockalign(bs, (size_t)num_tables * s->cluster_size);
     c->writethrough = writethrough;
 
+    for (c->nb_buckets = 1; c->nb_buckets < num_tables; c->nb_buckets *= 2) {
+        /* nothing */
+    }
+    c->buckets = qemu_malloc(sizeof(*c->buckets) * c->nb_buckets);
+    for (i = 0; i < c->nb_buckets; i++) {
+        c->buckets[i] = -1;
+    }
+
+    QTAILQ_INIT(&c->lru);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     }
 
     return c;
@@ -67,15 +127,26 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->tables);
+    qemu_free(c->buckets);
     qemu_free(c->entries);
     qemu_free(c);
 
     return 0;
 }
 
+int qcow2_cache_size(Qcow2Cache *c)
+{
+    return c->size;
+}
+
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats)
+{
+    *stats = c->stats;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -119,8 +190,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+        qcow2_cache_table(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -183,32 +254,63 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
+    Qcow2CachedTable *e;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
+    /* Only the few tables in use are skipped */
+    QTAILQ_FOREACH(e, &c->lru, lru) {
+        if (!e->ref) {
+            return e - c->entries;
         }
+    }
+
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
 
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+    for (i = c->buckets[qcow2_cache_bucket(c, offset)]; i != -1;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
         }
+    }
+    return -1;
+}
+
+/* Write a table back and free its entry for another one */
+static int qcow2_cache_evict(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i;
+    int ret;
+
+    i = qcow2_cache_find_entry_to_replace(c);
+    if (i < 0) {
+        return i;
+    }
 
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    if (c->entries[i].offset) {
+        c->stats.evictions++;
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
     }
-    return min_index;
+    return i;
+}
+
+static void qcow2_cache_install(Qcow2Cache *c, int i, uint64_t offset)
+{
+    c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
+    QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+    QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -219,45 +321,42 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int ret;
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i != -1) {
+        c->stats.hits++;
+        goto found;
     }
+    c->stats.misses++;
 
     /* If not, write a table back and replace it */
-    i = qcow2_cache_find_entry_to_replace(c);
+    i = qcow2_cache_evict(bs, c);
     if (i < 0) {
         return i;
     }
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
-    }
-
-    c->entries[i].offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    qcow2_cache_install(c, i, offset);
+    c->entries[i].ref++;
+    *table = qcow2_cache_table(c, i);
+    return 0;
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+    QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_table(c, i);
     return 0;
 }
 
@@ -275,16 +374,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
+    int i = qcow2_cache_table_index(c, *table);
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -299,16 +390,96 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
+    c->entries[qcow2_cache_table_index(c, table)].dirty = true;
+}
+
+bool qcow2_cache_is_cached(Qcow2Cache *c, uint64_t offset)
+{
+    return qcow2_cache_lookup(c, offset) != -1;
+}
+
+/*
+ * Asynchronous loading, so that a miss doesn't block the guest while the
+ * table is read.  The table is read into a buffer of its own and only
+ * enters the cache once it is complete, unless a synchronous lookup has
+ * cached it in the meantime.
+ */
+
+typedef struct Qcow2CacheAIOCB {
+    BlockDriverAIOCB common;
+    Qcow2Cache *c;
+    uint64_t offset;
+    void *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    BlockDriverAIOCB *aiocb;
+} Qcow2CacheAIOCB;
+
+static void qcow2_cache_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    Qcow2CacheAIOCB *acb = container_of(blockacb, Qcow2CacheAIOCB, common);
+
+    bdrv_aio_cancel(acb->aiocb);
+    qemu_vfree(acb->buf);
+    qemu_aio_release(acb);
+}
+
+static AIOPool qcow2_cache_aio_pool = {
+    .aiocb_size         = sizeof(Qcow2CacheAIOCB),
+    .cancel             = qcow2_cache_aio_cancel,
+};
+
+static void qcow2_cache_aio_load_cb(void *opaque, int ret)
+{
+    Qcow2CacheAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    Qcow2Cache *c = acb->c;
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
+    if (ret >= 0 && !qcow2_cache_is_cached(c, acb->offset)) {
+        i = qcow2_cache_evict(bs, c);
+        if (i < 0) {
+            ret = i;
+        } else {
+            memcpy(qcow2_cache_table(c, i), acb->buf, c->table_size);
+            qcow2_cache_install(c, i, acb->offset);
         }
     }
-    abort();
 
-found:
-    c->entries[i].dirty = true;
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_vfree(acb->buf);
+    qemu_aio_release(acb);
 }
 
+/*
+ * Start reading the table at offset into c, cb is called once it is
+ * cached.  Call it only for a table that isn't cached yet.
+ */
+BlockDriverAIOCB *qcow2_cache_aio_load(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CacheAIOCB *acb;
+
+    acb = qemu_aio_get(&qcow2_cache_aio_pool, bs, cb, opaque);
+    acb->c = c;
+    acb->offset = offset;
+    acb->buf = qemu_blockalign(bs, c->table_size);
+    acb->iov.iov_base = acb->buf;
+    acb->iov.iov_len = c->table_size;
+    qemu_iovec_init_external(&acb->qiov, &acb->iov, 1);
+
+    c->stats.misses++;
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+    acb->aiocb = bdrv_aio_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                                &acb->qiov, c->table_size >> BDRV_SECTOR_BITS,
+                                qcow2_cache_aio_load_cb, acb);
+    if (!acb->aiocb) {
+        qemu_vfree(acb->buf);
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
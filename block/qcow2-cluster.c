@@ -123,6 +123,36 @@ static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
     return ret;
 }
 
+/*
+ * qcow2_l2_aio_prefetch
+ *
+ * Starts loading the L2 table that maps offset into the cache if it isn't
+ * there yet, so that the lookup that follows doesn't block.
+ *
+ * Returns 1 if cb will be called once the table is cached, with the read
+ * in *aiocb, 0 if nothing needs to be read, or -errno.
+ */
+int qcow2_l2_aio_prefetch(BlockDriverState *bs, uint64_t offset,
+    BlockDriverAIOCB **aiocb, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    unsigned int l1_index;
+    uint64_t l2_offset;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED;
+    if (!l2_offset || qcow2_cache_is_cached(s->l2_table_cache, l2_offset)) {
+        return 0;
+    }
+
+    *aiocb = qcow2_cache_aio_load(bs, s->l2_table_cache, l2_offset, cb, opaque);
+    return *aiocb ? 1 : -EIO;
+}
+
 /*
  * Writes one sector of the L1 table to the disk (can't update single entries
  * and we really don't want bdrv_pread to perform a read-modify-write)
@@ -643,7 +673,10 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
         qcow2_cache_depends_on_flush(s->l2_table_cache);
     }
 
-    qcow2_cache_set_dependency(bs, s->l2_table_cache, s->refcount_block_cache);
+    if (!s->lazy_refcounts) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+            s->refcount_block_cache);
+    }
     ret = get_cluster_table(bs, m->offset, &l2_table, &l2_offset, &l2_index);
     if (ret < 0) {
         goto err;
@@ -687,6 +720,161 @@ err:
     return ret;
  }
 
+/*
+ * Sequential writers allocate clusters next to the ones they allocated
+ * last, in about the order of the guest offsets.  When that happens, a run
+ * of clusters is allocated for the guest clusters that follow and handed
+ * out to the next requests of the writer, so that their refcounts are
+ * updated, and written, once for the whole run.  Requests in flight
+ * together can allocate out of order, so each guest cluster of the run
+ * has its own host cluster, and the previous run is kept for the late
+ * ones.  A run is twice as long as the one before it, up to
+ * PREALLOC_MAX_BYTES.
+ *
+ * Preallocated clusters have a refcount of one but no L2 entry points to
+ * them; the ones left unused are freed on close, or leaked if qemu dies
+ * before that.
+ */
+static bool prealloc_is_used(QCowPrealloc *p, int i)
+{
+    return p->used[i / 8] & (1 << (i % 8));
+}
+
+static void prealloc_free(BlockDriverState *bs, QCowPrealloc *p)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i = 0, start;
+
+    while (i < p->nb_clusters) {
+        if (prealloc_is_used(p, i)) {
+            i++;
+            continue;
+        }
+        start = i;
+        while (i < p->nb_clusters && !prealloc_is_used(p, i)) {
+            i++;
+        }
+        qcow2_free_clusters(bs,
+            p->offset + ((int64_t) start << s->cluster_bits),
+            (int64_t) (i - start) << s->cluster_bits);
+    }
+    qemu_free(p->used);
+    memset(p, 0, sizeof(*p));
+}
+
+void qcow2_prealloc_release(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    prealloc_free(bs, &s->prealloc[0]);
+    prealloc_free(bs, &s->prealloc[1]);
+}
+
+/*
+ * Hands out the clusters of p for up to *nb_clusters guest clusters at
+ * guest_offset, and sets *nb_clusters to their number.
+ *
+ * Returns the offset of the first one, or 0 if p has none for guest_offset.
+ */
+static int64_t prealloc_take(BDRVQcowState *s, QCowPrealloc *p,
+    uint64_t guest_offset, unsigned int *nb_clusters)
+{
+    int64_t first, end, i;
+
+    if (guest_offset < p->guest_offset) {
+        return 0;
+    }
+    first = (guest_offset - p->guest_offset) >> s->cluster_bits;
+    if (first >= p->nb_clusters) {
+        return 0;
+    }
+
+    end = MIN(first + *nb_clusters, p->nb_clusters);
+    for (i = first; i < end && !prealloc_is_used(p, i); i++) {
+        p->used[i / 8] |= 1 << (i % 8);
+    }
+    if (i == first) {
+        return 0;
+    }
+
+    *nb_clusters = i - first;
+    return p->offset + (first << s->cluster_bits);
+}
+
+/*
+ * Allocates the host clusters for up to *nb_clusters guest clusters
+ * starting at offset, and sets *nb_clusters to the number allocated.
+ *
+ * Returns the offset of the first cluster or -errno.
+ */
+static int64_t alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+    unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowPrealloc *cur = &s->prealloc[1];
+    uint64_t guest_offset = offset & ~(s->cluster_size - 1);
+    uint64_t cur_end, start;
+    int max_run = MAX(PREALLOC_MAX_BYTES >> s->cluster_bits, 1);
+    unsigned int n = *nb_clusters, own;
+    int64_t cluster_offset;
+    int run;
+
+    cluster_offset = prealloc_take(s, cur, guest_offset, &n);
+    if (!cluster_offset) {
+        cluster_offset = prealloc_take(s, &s->prealloc[0], guest_offset, &n);
+    }
+    if (cluster_offset) {
+        goto out;
+    }
+
+    cur_end = cur->guest_offset +
+        ((uint64_t) cur->nb_clusters << s->cluster_bits);
+    run = MIN(cur->nb_clusters * 2, max_run);
+    if (cur->nb_clusters && guest_offset >= cur_end &&
+        guest_offset < cur_end + ((uint64_t) run << s->cluster_bits)) {
+        /* The writer went past its run, the next one follows it */
+        start = cur_end;
+    } else if (guest_offset == s->last_alloc_end ||
+               guest_offset + ((uint64_t) n << s->cluster_bits) ==
+               s->last_alloc_start) {
+        /* Next to the last allocation: start a run after both */
+        start = MAX(s->last_alloc_end,
+                    guest_offset + ((uint64_t) n << s->cluster_bits));
+        run = MIN(n, max_run);
+    } else {
+        cluster_offset = qcow2_alloc_clusters(bs,
+            (int64_t) n << s->cluster_bits);
+        if (cluster_offset < 0) {
+            return cluster_offset;
+        }
+        goto out;
+    }
+
+    /* Allocate the request along with the run unless the run covers it */
+    own = start > guest_offset ? n : 0;
+    prealloc_free(bs, &s->prealloc[0]);
+    cluster_offset = qcow2_alloc_clusters(bs,
+        (int64_t) (own + run) << s->cluster_bits);
+    if (cluster_offset < 0) {
+        return cluster_offset;
+    }
+
+    s->prealloc[0] = *cur;
+    cur->guest_offset = start;
+    cur->offset = cluster_offset + ((int64_t) own << s->cluster_bits);
+    cur->nb_clusters = run;
+    cur->used = qemu_mallocz((run + 7) / 8);
+    if (!own) {
+        cluster_offset = prealloc_take(s, cur, guest_offset, &n);
+    }
+
+out:
+    s->last_alloc_start = guest_offset;
+    s->last_alloc_end = guest_offset + ((uint64_t) n << s->cluster_bits);
+    *nb_clusters = n;
+    return cluster_offset;
+}
+
 /*
  * alloc_cluster_offset
  *
@@ -810,7 +998,7 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* allocate a new cluster */
 
-    cluster_offset = qcow2_alloc_clusters(bs, nb_clusters * s->cluster_size);
+    cluster_offset = alloc_data_clusters(bs, offset, &nb_clusters);
     if (cluster_offset < 0) {
         QLIST_REMOVE(m, next_in_flight);
         ret = cluster_offset;
@@ -892,16 +1080,38 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
     return 0;
 }
 
+/*
+ * Free size bytes of contiguous clusters at offset, and give them back to
+ * the file system as well if nothing else refers to them.
+ */
+static void discard_host_clusters(BlockDriverState *bs, uint64_t offset,
+    uint64_t size, int copied)
+{
+    if (!size) {
+        return;
+    }
+
+    qcow2_free_clusters(bs, offset, size);
+    if (copied) {
+        /* the refcount was 1, so it is 0 now */
+        bdrv_discard(bs->file, offset >> BDRV_SECTOR_BITS,
+                     size >> BDRV_SECTOR_BITS);
+    }
+}
+
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
  * all clusters in the same L2 table) and returns the number of discarded
- * clusters.
+ * clusters.  Clusters that are contiguous in the image file have their
+ * refcounts decreased at once.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     unsigned int nb_clusters)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t l2_offset, *l2_table;
+    uint64_t run_offset = 0, run_size = 0;
+    int run_copied = 0;
     int l2_index;
     int ret;
     int i;
@@ -916,8 +1126,10 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
+        int copied;
 
         old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        copied = !!(old_offset & QCOW_OFLAG_COPIED);
         old_offset &= ~QCOW_OFLAG_COPIED;
 
         if (old_offset == 0) {
@@ -929,8 +1141,21 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         l2_table[l2_index + i] = cpu_to_be64(0);
 
         /* Then decrease the refcount */
-        qcow2_free_any_clusters(bs, old_offset, 1);
+        if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            qcow2_free_any_clusters(bs, old_offset, 1);
+            continue;
+        }
+        if (run_size && old_offset == run_offset + run_size &&
+            copied == run_copied) {
+            run_size += s->cluster_size;
+            continue;
+        }
+        discard_host_clusters(bs, run_offset, run_size, run_copied);
+        run_offset = old_offset;
+        run_size = s->cluster_size;
+        run_copied = copied;
     }
+    discard_host_clusters(bs, run_offset, run_size, run_copied);
 
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
@@ -948,7 +1173,13 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     unsigned int nb_clusters;
     int ret;
 
-    end_offset = offset + (nb_sectors << BDRV_SECTOR_BITS);
+    /* Without zero clusters, a discarded cluster would read from the
+       backing file */
+    if (bs->backing_hd) {
+        return 0;
+    }
+
+    end_offset = offset + ((uint64_t)nb_sectors << BDRV_SECTOR_BITS);
 
     /* Round start up and end down */
     offset = align_offset(offset, s->cluster_size);
@@ -431,6 +431,11 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         return 0;
     }
 
+    ret = qcow2_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (addend < 0) {
         qcow2_cache_set_dependency(bs, s->refcount_block_cache,
             s->l2_table_cache);
@@ -538,6 +543,38 @@ static int update_cluster_refcount(BlockDriverState *bs,
 
 
 /* return < 0 if error */
+/*
+ * Starts loading the refcount block where the next allocation will look
+ * for free clusters, if it isn't cached yet, so that allocating clusters
+ * doesn't block.
+ *
+ * Returns 1 if cb will be called once the block is cached, with the read
+ * in *aiocb, 0 if nothing needs to be read, or -errno.
+ */
+int qcow2_refcount_aio_prefetch(BlockDriverState *bs,
+    BlockDriverAIOCB **aiocb, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t refcount_table_index;
+    uint64_t refcount_block_offset;
+
+    refcount_table_index =
+        s->free_cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
+    if (refcount_table_index >= s->refcount_table_size) {
+        return 0;
+    }
+
+    refcount_block_offset = s->refcount_table[refcount_table_index];
+    if (!refcount_block_offset ||
+        qcow2_cache_is_cached(s->refcount_block_cache, refcount_block_offset)) {
+        return 0;
+    }
+
+    *aiocb = qcow2_cache_aio_load(bs, s->refcount_block_cache,
+                                  refcount_block_offset, cb, opaque);
+    return *aiocb ? 1 : -EIO;
+}
+
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
@@ -698,6 +735,45 @@ void qcow2_create_refcount_update(QCowCreateState *s, int64_t offset,
     }
 }
 
+/*
+ * Adds addend to the refcounts of all clusters an L2 table points to.
+ * Runs of contiguous clusters are updated with one update_refcount() call,
+ * which touches each refcount block once for the whole run.
+ */
+static int update_l2_refcounts(BlockDriverState *bs, uint64_t *l2_table,
+                               int addend)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset, run_start = 0, run_end = 0;
+    int j, nb_csectors, ret;
+
+    for (j = 0; j < s->l2_size; j++) {
+        offset = be64_to_cpu(l2_table[j]) & ~QCOW_OFLAG_COPIED;
+        if (offset == 0) {
+            continue;
+        }
+        if (offset & QCOW_OFLAG_COMPRESSED) {
+            nb_csectors = ((offset >> s->csize_shift) & s->csize_mask) + 1;
+            ret = update_refcount(bs, (offset & s->cluster_offset_mask) & ~511,
+                                  nb_csectors * 512, addend);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
+        if (offset != run_end) {
+            ret = update_refcount(bs, run_start, run_end - run_start, addend);
+            if (ret < 0) {
+                return ret;
+            }
+            run_start = offset;
+        }
+        run_end = offset + s->cluster_size;
+    }
+
+    return update_refcount(bs, run_start, run_end - run_start, addend);
+}
+
 /* update the refcounts of snapshots and the copied flag */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
@@ -705,7 +781,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     BDRVQcowState *s = bs->opaque;
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
     int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified, nb_csectors, refcount;
+    int i, j, l1_modified, refcount;
     int ret;
 
     l2_table = NULL;
@@ -742,36 +818,23 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
+            if (addend != 0) {
+                ret = update_l2_refcounts(bs, l2_table, addend);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
+
             for(j = 0; j < s->l2_size; j++) {
                 offset = be64_to_cpu(l2_table[j]);
                 if (offset != 0) {
                     old_offset = offset;
                     offset &= ~QCOW_OFLAG_COPIED;
                     if (offset & QCOW_OFLAG_COMPRESSED) {
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            int ret;
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-
-                            /* TODO Flushing once for the whole function should
-                             * be enough */
-                            bdrv_flush(bs->file);
-                        }
                         /* compressed clusters are never modified */
                         refcount = 2;
                     } else {
-                        if (addend != 0) {
-                            refcount = update_cluster_refcount(bs, offset >> s->cluster_bits, addend);
-                        } else {
-                            refcount = get_refcount(bs, offset >> s->cluster_bits);
-                        }
-
+                        refcount = get_refcount(bs, offset >> s->cluster_bits);
                         if (refcount < 0) {
                             goto fail;
                         }
@@ -798,10 +861,12 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
 
             if (addend != 0) {
-                refcount = update_cluster_refcount(bs, l2_offset >> s->cluster_bits, addend);
-            } else {
-                refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
+                ret = update_refcount(bs, l2_offset, 1, addend);
+                if (ret < 0) {
+                    goto fail;
+                }
             }
+            refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
             if (refcount < 0) {
                 goto fail;
             } else if (refcount == 1) {
@@ -813,6 +878,12 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             }
         }
     }
+
+    /* One flush for the whole sweep rather than one per cluster */
+    if (addend != 0) {
+        bdrv_flush(bs->file);
+    }
+
     if (l1_modified) {
         for(i = 0; i < l1_size; i++)
             cpu_to_be64s(&l1_table[i]);
@@ -1060,49 +1131,50 @@ fail:
 }
 
 /*
- * Checks an image for refcount consistency.
+ * Counts the references to each cluster of the image into a new
+ * *refcount_table of *nb_clusters entries, checking the metadata on the
+ * way.  check_copied also checks the QCOW_OFLAG_COPIED flags of the active
+ * L1 and L2 tables against the refcounts in the image.
  *
- * Returns 0 if no errors are found, the number of errors in case the image is
- * detected as corrupted, and -errno when an internal error occured.
+ * Returns 0 or -errno if an internal error occured.
  */
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
+static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+    uint16_t **refcount_table, int *nb_clusters, int check_copied)
 {
     BDRVQcowState *s = bs->opaque;
-    int64_t size;
-    int nb_clusters, refcount1, refcount2, i;
     QCowSnapshot *sn;
-    uint16_t *refcount_table;
-    int ret;
+    int64_t size;
+    int i, ret;
 
     size = bdrv_getlength(bs->file);
-    nb_clusters = size_to_clusters(s, size);
-    refcount_table = qemu_mallocz(nb_clusters * sizeof(uint16_t));
+    *nb_clusters = size_to_clusters(s, size);
+    *refcount_table = qemu_mallocz(*nb_clusters * sizeof(uint16_t));
 
     /* header */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, *refcount_table, *nb_clusters,
         0, s->cluster_size);
 
     /* current L1 table */
-    ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                       s->l1_table_offset, s->l1_size, 1);
+    ret = check_refcounts_l1(bs, res, *refcount_table, *nb_clusters,
+                       s->l1_table_offset, s->l1_size, check_copied);
     if (ret < 0) {
-        return ret;
+        goto fail;
     }
 
     /* snapshots */
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
-        ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+        ret = check_refcounts_l1(bs, res, *refcount_table, *nb_clusters,
             sn->l1_table_offset, sn->l1_size, 0);
         if (ret < 0) {
-            return ret;
+            goto fail;
         }
     }
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, *refcount_table, *nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
     /* refcount data */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, *refcount_table, *nb_clusters,
         s->refcount_table_offset,
         s->refcount_table_size * sizeof(uint64_t));
 
@@ -1119,23 +1191,48 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
             continue;
         }
 
-        if (cluster >= nb_clusters) {
+        if (cluster >= *nb_clusters) {
             fprintf(stderr, "ERROR refcount block %d is outside image\n", i);
             res->corruptions++;
             continue;
         }
 
         if (offset != 0) {
-            inc_refcounts(bs, res, refcount_table, nb_clusters,
+            inc_refcounts(bs, res, *refcount_table, *nb_clusters,
                 offset, s->cluster_size);
-            if (refcount_table[cluster] != 1) {
+            if ((*refcount_table)[cluster] != 1) {
                 fprintf(stderr, "ERROR refcount block %d refcount=%d\n",
-                    i, refcount_table[cluster]);
+                    i, (*refcount_table)[cluster]);
                 res->corruptions++;
             }
         }
     }
 
+    return 0;
+
+fail:
+    qemu_free(*refcount_table);
+    *refcount_table = NULL;
+    return ret;
+}
+
+/*
+ * Checks an image for refcount consistency.
+ *
+ * Returns 0 if no errors are found, the number of errors in case the image is
+ * detected as corrupted, and -errno when an internal error occured.
+ */
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
+{
+    int nb_clusters, refcount1, refcount2, i;
+    uint16_t *refcount_table;
+    int ret;
+
+    ret = calculate_refcounts(bs, res, &refcount_table, &nb_clusters, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* compare ref counts */
     for(i = 0; i < nb_clusters; i++) {
         refcount1 = get_refcount(bs, i);
@@ -1164,3 +1261,65 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
     return 0;
 }
 
+/*
+ * Sets the refcount of every cluster to the number of references to it,
+ * for images whose refcount updates may not have reached the disk.
+ *
+ * The refcounts are raised before any is lowered, and clusters needed
+ * meanwhile are allocated after the end of the image, so that no cluster
+ * that is in use but not counted yet can be allocated.
+ *
+ * Returns 0 or -errno.
+ */
+int qcow2_rebuild_refcounts(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvCheckResult res;
+    uint16_t *refcount_table;
+    int nb_clusters, refcount, pass, i, fixed = 0;
+    int ret;
+
+    memset(&res, 0, sizeof(res));
+    ret = calculate_refcounts(bs, &res, &refcount_table, &nb_clusters, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    if (res.corruptions || res.check_errors) {
+        fprintf(stderr, "qcow2: cannot rebuild the refcounts of a corrupted "
+            "image\n");
+        ret = -EIO;
+        goto out;
+    }
+
+    s->free_cluster_index = nb_clusters;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < nb_clusters; i++) {
+            refcount = get_refcount(bs, i);
+            if (refcount < 0) {
+                ret = refcount;
+                goto out;
+            }
+            if (pass == 0 ? refcount >= refcount_table[i] :
+                            refcount <= refcount_table[i]) {
+                continue;
+            }
+            ret = update_refcount(bs, (int64_t) i << s->cluster_bits, 1,
+                refcount_table[i] - refcount);
+            if (ret < 0) {
+                goto out;
+            }
+            fixed++;
+        }
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (fixed) {
+        fprintf(stderr, "qcow2: rebuilt the refcounts of %d clusters\n",
+            fixed);
+    }
+
+out:
+    s->free_cluster_index = 0;
+    qemu_free(refcount_table);
+    return ret;
+}
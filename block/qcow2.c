@@ -29,6 +29,7 @@
 #include "block/qcow2.h"
 #include "qemu-error.h"
 #include "qerror.h"
+#include "qemu-objects.h"
 
 /*
   Differences with QCOW:
@@ -53,6 +54,10 @@ typedef struct {
 } QCowExtension;
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
+#define  QCOW2_EXT_MAGIC_LAZY_REFCOUNTS 0x4C5A5246
+
+/* Flags of the lazy refcounts extension */
+#define QCOW2_LAZY_REFCOUNTS_DIRTY 1
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -77,8 +82,10 @@ static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
                                  uint64_t end_offset)
 {
+    BDRVQcowState *s = bs->opaque;
     QCowExtension ext;
     uint64_t offset;
+    uint32_t flags;
 
 #ifdef DEBUG_EXT
     printf("qcow2_read_extensions: start=%ld end=%ld\n", start_offset, end_offset);
@@ -127,6 +134,20 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             offset = ((offset + ext.len + 7) & ~7);
             break;
 
+        case QCOW2_EXT_MAGIC_LAZY_REFCOUNTS:
+            if (ext.len < sizeof(flags)) {
+                fprintf(stderr, "ERROR: ext_lazy_refcounts: len=%u too "
+                        "small\n", ext.len);
+                return 2;
+            }
+            if (bdrv_pread(bs->file, offset, &flags,
+                           sizeof(flags)) != sizeof(flags))
+                return 3;
+            s->lazy_refcounts = true;
+            s->dirty = be32_to_cpu(flags) & QCOW2_LAZY_REFCOUNTS_DIRTY;
+            offset = ((offset + ext.len + 7) & ~7);
+            break;
+
         default:
             /* unknown magic -- just skip it */
             offset = ((offset + ext.len + 7) & ~7);
@@ -138,6 +159,28 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 }
 
 
+/*
+ * Number of L2 tables to cache: what the user asked for, or enough to map
+ * an image of size bytes up to L2_CACHE_AUTO_MAX_BYTES
+ */
+static int qcow2_l2_cache_tables(BlockDriverState *bs, int64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t bytes = bdrv_get_metadata_cache_size(bs);
+    int64_t tables;
+
+    if (!bytes) {
+        int64_t mapped = (int64_t)s->l2_size << s->cluster_bits;
+
+        tables = (size + mapped - 1) / mapped;
+        bytes = MIN(tables * s->cluster_size, L2_CACHE_AUTO_MAX_BYTES);
+    }
+    tables = bytes / s->cluster_size;
+    return MAX(tables, L2_CACHE_SIZE);
+}
+
+static int qcow2_mark_clean(BlockDriverState *bs);
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -228,11 +271,25 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         }
     }
 
+    /* read qcow2 extensions */
+    if (header.backing_file_offset) {
+        ext_end = header.backing_file_offset;
+    } else {
+        ext_end = s->cluster_size;
+    }
+    if (qcow2_read_extensions(bs, sizeof(header), ext_end)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* alloc L2 table/refcount block cache */
     writethrough = ((flags & BDRV_O_CACHE_MASK) == 0);
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE, writethrough);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
+    s->l2_cache_auto = !bdrv_get_metadata_cache_size(bs);
+    s->l2_table_cache = qcow2_cache_create(bs,
+        qcow2_l2_cache_tables(bs, bs->total_sectors * BDRV_SECTOR_SIZE),
         writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
+        writethrough && !s->lazy_refcounts);
 
     s->cluster_cache = qemu_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -247,17 +304,6 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     QLIST_INIT(&s->cluster_allocs);
 
-    /* read qcow2 extensions */
-    if (header.backing_file_offset) {
-        ext_end = header.backing_file_offset;
-    } else {
-        ext_end = s->cluster_size;
-    }
-    if (qcow2_read_extensions(bs, sizeof(header), ext_end)) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -276,6 +322,18 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         goto fail;
     }
 
+    /* Refcount updates may be missing if the image wasn't closed cleanly */
+    if (s->dirty && (flags & BDRV_O_RDWR)) {
+        ret = qcow2_rebuild_refcounts(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = qcow2_mark_clean(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     qcow2_check_refcounts(bs);
 #endif
@@ -352,6 +410,51 @@ static int qcow2_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return (cluster_offset != 0);
 }
 
+static int qcow2_get_block_map(BlockDriverState *bs, int64_t sector_num,
+                               int64_t nb_sectors, BlockExtent *extents,
+                               int max_extents)
+{
+    BDRVQcowState *s = bs->opaque;
+    int l1_bits = s->l2_bits + s->cluster_bits;
+    int n = 0;
+
+    while (nb_sectors > 0) {
+        uint64_t offset = sector_num << BDRV_SECTOR_BITS;
+        uint64_t l1_index = offset >> l1_bits;
+        uint64_t cluster_offset = 0;
+        int64_t num;
+
+        if (l1_index >= s->l1_size) {
+            num = nb_sectors;
+        } else if (!s->l1_table[l1_index]) {
+            /* skip the whole run of missing L2 tables without a lookup */
+            uint64_t end = l1_index + 1;
+
+            while (end < s->l1_size && !s->l1_table[end]) {
+                end++;
+            }
+            num = ((end << l1_bits) >> BDRV_SECTOR_BITS) - sector_num;
+        } else {
+            int c = MIN(nb_sectors, INT_MAX >> 1);
+            int ret = qcow2_get_cluster_offset(bs, offset, &c,
+                                               &cluster_offset);
+            if (ret < 0) {
+                return ret;
+            }
+            num = c;
+        }
+
+        num = MIN(num, nb_sectors);
+        if (!bdrv_block_map_add(extents, &n, max_extents, sector_num, num,
+                                cluster_offset ? BDRV_EXTENT_ALLOCATED : 0)) {
+            break;
+        }
+        sector_num += num;
+        nb_sectors -= num;
+    }
+    return n;
+}
+
 /* handle reading after the end of the backing file */
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors)
@@ -383,6 +486,7 @@ typedef struct QCowAIOCB {
     QEMUBH *bh;
     QCowL2Meta l2meta;
     QLIST_ENTRY(QCowAIOCB) next_depend;
+    int prefetch;   /* metadata prefetches done for the current step */
 } QCowAIOCB;
 
 static void qcow2_aio_cancel(BlockDriverAIOCB *blockacb)
@@ -421,12 +525,33 @@ static int qcow2_schedule_bh(QEMUBHFunc *cb, QCowAIOCB *acb)
     return 0;
 }
 
+static void qcow2_aio_read_complete(QCowAIOCB *acb, int ret)
+{
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_iovec_destroy(&acb->hd_qiov);
+    qemu_aio_release(acb);
+}
+
+static int qcow2_aio_read_next(QCowAIOCB *acb);
+
+static void qcow2_aio_read_prefetch_cb(void *opaque, int ret)
+{
+    QCowAIOCB *acb = opaque;
+
+    acb->hd_aiocb = NULL;
+    if (ret >= 0) {
+        ret = qcow2_aio_read_next(acb);
+    }
+    if (ret < 0) {
+        qcow2_aio_read_complete(acb, ret);
+    }
+}
+
 static void qcow2_aio_read_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
     BDRVQcowState *s = bs->opaque;
-    int index_in_cluster, n1;
 
     acb->hd_aiocb = NULL;
     if (ret < 0)
@@ -465,11 +590,43 @@ static void qcow2_aio_read_cb(void *opaque, int ret)
         acb->cur_nr_sectors = MIN(acb->cur_nr_sectors,
             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
     }
+    acb->prefetch = 0;
+
+    ret = qcow2_aio_read_next(acb);
+    if (ret < 0) {
+        goto done;
+    }
+    return;
+
+done:
+    qcow2_aio_read_complete(acb, ret);
+}
+
+/*
+ * Starts the I/O for the current step of a read, or the load of the
+ * metadata it needs.  Returns 0 once something is in flight, or -errno.
+ */
+static int qcow2_aio_read_next(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster, n1;
+    int ret;
+
+    /* Don't block on an L2 table miss, come back once it is cached */
+    if (acb->prefetch == 0) {
+        acb->prefetch++;
+        ret = qcow2_l2_aio_prefetch(bs, acb->sector_num << 9, &acb->hd_aiocb,
+                                    qcow2_aio_read_prefetch_cb, acb);
+        if (ret != 0) {
+            return MIN(ret, 0);
+        }
+    }
 
     ret = qcow2_get_cluster_offset(bs, acb->sector_num << 9,
         &acb->cur_nr_sectors, &acb->cluster_offset);
     if (ret < 0) {
-        goto done;
+        return ret;
     }
 
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
@@ -489,26 +646,25 @@ static void qcow2_aio_read_cb(void *opaque, int ret)
                 acb->hd_aiocb = bdrv_aio_readv(bs->backing_hd, acb->sector_num,
                                     &acb->hd_qiov, n1, qcow2_aio_read_cb, acb);
                 if (acb->hd_aiocb == NULL) {
-                    ret = -EIO;
-                    goto done;
+                    return -EIO;
                 }
             } else {
                 ret = qcow2_schedule_bh(qcow2_aio_read_bh, acb);
                 if (ret < 0)
-                    goto done;
+                    return ret;
             }
         } else {
             /* Note: in this case, no need to wait */
             qemu_iovec_memset(&acb->hd_qiov, 0, 512 * acb->cur_nr_sectors);
             ret = qcow2_schedule_bh(qcow2_aio_read_bh, acb);
             if (ret < 0)
-                goto done;
+                return ret;
         }
     } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
         /* add AIO support for compressed blocks ? */
         ret = qcow2_decompress_cluster(bs, acb->cluster_offset);
         if (ret < 0) {
-            goto done;
+            return ret;
         }
 
         qemu_iovec_from_buffer(&acb->hd_qiov,
@@ -517,11 +673,10 @@ static void qcow2_aio_read_cb(void *opaque, int ret)
 
         ret = qcow2_schedule_bh(qcow2_aio_read_bh, acb);
         if (ret < 0)
-            goto done;
+            return ret;
     } else {
         if ((acb->cluster_offset & 511) != 0) {
-            ret = -EIO;
-            goto done;
+            return -EIO;
         }
 
         if (s->crypt_method) {
@@ -547,16 +702,11 @@ static void qcow2_aio_read_cb(void *opaque, int ret)
                             &acb->hd_qiov, acb->cur_nr_sectors,
                             qcow2_aio_read_cb, acb);
         if (acb->hd_aiocb == NULL) {
-            ret = -EIO;
-            goto done;
+            return -EIO;
         }
     }
 
-    return;
-done:
-    acb->common.cb(acb->common.opaque, ret);
-    qemu_iovec_destroy(&acb->hd_qiov);
-    qemu_aio_release(acb);
+    return 0;
 }
 
 static QCowAIOCB *qcow2_aio_setup(BlockDriverState *bs, int64_t sector_num,
@@ -621,13 +771,32 @@ static void run_dependent_requests(QCowL2Meta *m)
     QLIST_INIT(&m->dependent_requests);
 }
 
+static void qcow2_aio_write_complete(QCowAIOCB *acb, int ret)
+{
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_iovec_destroy(&acb->hd_qiov);
+    qemu_aio_release(acb);
+}
+
+static int qcow2_aio_write_next(QCowAIOCB *acb);
+
+static void qcow2_aio_write_prefetch_cb(void *opaque, int ret)
+{
+    QCowAIOCB *acb = opaque;
+
+    acb->hd_aiocb = NULL;
+    if (ret >= 0) {
+        ret = qcow2_aio_write_next(acb);
+    }
+    if (ret < 0) {
+        qcow2_aio_write_complete(acb, ret);
+    }
+}
+
 static void qcow2_aio_write_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
-    BDRVQcowState *s = bs->opaque;
-    int index_in_cluster;
-    int n_end;
 
     acb->hd_aiocb = NULL;
 
@@ -650,6 +819,48 @@ static void qcow2_aio_write_cb(void *opaque, int ret)
         goto done;
     }
 
+    acb->prefetch = 0;
+    ret = qcow2_aio_write_next(acb);
+    if (ret < 0) {
+        goto done;
+    }
+    return;
+
+done:
+    qcow2_aio_write_complete(acb, ret);
+}
+
+/*
+ * Starts the I/O for the current step of a write, or the load of the
+ * metadata it needs.  Returns 0 once something is in flight or the request
+ * waits for another one, or -errno.
+ */
+static int qcow2_aio_write_next(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster;
+    int n_end;
+    int ret;
+
+    /*
+     * Don't block on a miss for the L2 table, nor for the refcount block
+     * cluster allocation starts from; come back once they are cached.
+     * Other refcount blocks and the metadata writes are still synchronous.
+     */
+    while (acb->prefetch < 2) {
+        if (acb->prefetch++ == 0) {
+            ret = qcow2_l2_aio_prefetch(bs, acb->sector_num << 9,
+                &acb->hd_aiocb, qcow2_aio_write_prefetch_cb, acb);
+        } else {
+            ret = qcow2_refcount_aio_prefetch(bs, &acb->hd_aiocb,
+                qcow2_aio_write_prefetch_cb, acb);
+        }
+        if (ret != 0) {
+            return MIN(ret, 0);
+        }
+    }
+
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
     n_end = index_in_cluster + acb->remaining_sectors;
     if (s->crypt_method &&
@@ -659,7 +870,7 @@ static void qcow2_aio_write_cb(void *opaque, int ret)
     ret = qcow2_alloc_cluster_offset(bs, acb->sector_num << 9,
         index_in_cluster, n_end, &acb->cur_nr_sectors, &acb->l2meta);
     if (ret < 0) {
-        goto done;
+        return ret;
     }
 
     acb->cluster_offset = acb->l2meta.cluster_offset;
@@ -668,7 +879,7 @@ static void qcow2_aio_write_cb(void *opaque, int ret)
     if (acb->l2meta.nb_clusters == 0 && acb->l2meta.depends_on != NULL) {
         QLIST_INSERT_HEAD(&acb->l2meta.depends_on->dependent_requests,
             acb, next_depend);
-        return;
+        return 0;
     }
 
     assert((acb->cluster_offset & 511) == 0);
@@ -700,20 +911,13 @@ static void qcow2_aio_write_cb(void *opaque, int ret)
                                     &acb->hd_qiov, acb->cur_nr_sectors,
                                     qcow2_aio_write_cb, acb);
     if (acb->hd_aiocb == NULL) {
-        ret = -EIO;
-        goto fail;
+        if (acb->l2meta.nb_clusters != 0) {
+            QLIST_REMOVE(&acb->l2meta, next_in_flight);
+        }
+        return -EIO;
     }
 
-    return;
-
-fail:
-    if (acb->l2meta.nb_clusters != 0) {
-        QLIST_REMOVE(&acb->l2meta, next_in_flight);
-    }
-done:
-    acb->common.cb(acb->common.opaque, ret);
-    qemu_iovec_destroy(&acb->hd_qiov);
-    qemu_aio_release(acb);
+    return 0;
 }
 
 static BlockDriverAIOCB *qcow2_aio_writev(BlockDriverState *bs,
@@ -735,13 +939,61 @@ static BlockDriverAIOCB *qcow2_aio_writev(BlockDriverState *bs,
     return &acb->common;
 }
 
+/* Grow an automatically sized L2 cache with the image */
+static int qcow2_resize_l2_cache(BlockDriverState *bs, int64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    int tables = qcow2_l2_cache_tables(bs, size);
+    int ret;
+
+    if (!s->l2_cache_auto || tables <= qcow2_cache_size(s->l2_table_cache)) {
+        return 0;
+    }
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+    qcow2_cache_destroy(bs, s->l2_table_cache);
+    s->l2_table_cache = qcow2_cache_create(bs, tables,
+        (bs->open_flags & BDRV_O_CACHE_MASK) == 0);
+    return 0;
+}
+
+static void qcow2_get_stats(BlockDriverState *bs, QDict *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CacheStats l2, refcount;
+    QObject *obj;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &l2);
+    qcow2_cache_get_stats(s->refcount_block_cache, &refcount);
+    obj = qobject_from_jsonf("{ 'l2_tables': %d,"
+                             "'l2_hits': %" PRId64 ","
+                             "'l2_misses': %" PRId64 ","
+                             "'l2_evictions': %" PRId64 ","
+                             "'refcount_blocks': %d,"
+                             "'refcount_hits': %" PRId64 ","
+                             "'refcount_misses': %" PRId64 ","
+                             "'refcount_evictions': %" PRId64 " }",
+                             qcow2_cache_size(s->l2_table_cache),
+                             l2.hits, l2.misses, l2.evictions,
+                             qcow2_cache_size(s->refcount_block_cache),
+                             refcount.hits, refcount.misses,
+                             refcount.evictions);
+    qdict_put_obj(stats, "metadata_cache", obj);
+}
+
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_prealloc_release(bs);
     qemu_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
+    qcow2_mark_clean(bs);
 
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
@@ -764,8 +1016,11 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
 {
     size_t backing_file_len = 0;
     size_t backing_fmt_len = 0;
+    size_t lazy_refcounts_len = 0;
     BDRVQcowState *s = bs->opaque;
     QCowExtension ext_backing_fmt = {0, 0};
+    QCowExtension ext_lazy_refcounts = {0, 0};
+    uint32_t lazy_refcounts_flags[2] = {0, 0};
     int ret;
 
     /* Backing file format doesn't make sense without a backing file */
@@ -781,13 +1036,24 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
             + strlen(backing_fmt) + 7) & ~7);
     }
 
+    /* The lazy refcounts extension ends the list of extensions */
+    if (s->lazy_refcounts) {
+        ext_lazy_refcounts.len = cpu_to_be32(sizeof(lazy_refcounts_flags));
+        ext_lazy_refcounts.magic =
+            cpu_to_be32(QCOW2_EXT_MAGIC_LAZY_REFCOUNTS);
+        lazy_refcounts_flags[0] =
+            cpu_to_be32(s->dirty ? QCOW2_LAZY_REFCOUNTS_DIRTY : 0);
+        lazy_refcounts_len = 2 * sizeof(QCowExtension)
+            + sizeof(lazy_refcounts_flags);
+    }
+
     /* Check if we can fit the new header into the first cluster */
     if (backing_file) {
         backing_file_len = strlen(backing_file);
     }
 
     size_t header_size = sizeof(QCowHeader) + backing_file_len
-        + backing_fmt_len;
+        + backing_fmt_len + lazy_refcounts_len;
 
     if (header_size > s->cluster_size) {
         return -ENOSPC;
@@ -799,21 +1065,34 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
     size_t offset = 0;
     size_t backing_file_offset = 0;
 
-    if (backing_file) {
-        if (backing_fmt) {
-            int padding = backing_fmt_len -
-                (sizeof(ext_backing_fmt) + strlen(backing_fmt));
+    if (backing_fmt) {
+        int padding = backing_fmt_len -
+            (sizeof(ext_backing_fmt) + strlen(backing_fmt));
 
-            memcpy(buf + offset, &ext_backing_fmt, sizeof(ext_backing_fmt));
-            offset += sizeof(ext_backing_fmt);
+        memcpy(buf + offset, &ext_backing_fmt, sizeof(ext_backing_fmt));
+        offset += sizeof(ext_backing_fmt);
 
-            memcpy(buf + offset, backing_fmt, strlen(backing_fmt));
-            offset += strlen(backing_fmt);
+        memcpy(buf + offset, backing_fmt, strlen(backing_fmt));
+        offset += strlen(backing_fmt);
 
-            memset(buf + offset, 0, padding);
-            offset += padding;
-        }
+        memset(buf + offset, 0, padding);
+        offset += padding;
+    }
 
+    if (lazy_refcounts_len) {
+        memcpy(buf + offset, &ext_lazy_refcounts, sizeof(ext_lazy_refcounts));
+        offset += sizeof(ext_lazy_refcounts);
+
+        memcpy(buf + offset, lazy_refcounts_flags,
+               sizeof(lazy_refcounts_flags));
+        offset += sizeof(lazy_refcounts_flags);
+
+        /* QCOW2_EXT_MAGIC_END */
+        memset(buf + offset, 0, sizeof(QCowExtension));
+        offset += sizeof(QCowExtension);
+    }
+
+    if (backing_file) {
         memcpy(buf + offset, backing_file, backing_file_len);
         backing_file_offset = sizeof(QCowHeader) + offset;
     }
@@ -844,6 +1123,60 @@ fail:
     return ret;
 }
 
+/* Rewrites the extensions with the current state of the image */
+static int qcow2_rewrite_ext_header(BlockDriverState *bs)
+{
+    return qcow2_update_ext_header(bs,
+        bs->backing_file[0] ? bs->backing_file : NULL,
+        bs->backing_format[0] ? bs->backing_format : NULL);
+}
+
+/*
+ * With lazy refcounts, refcount blocks aren't written before the L2 entries
+ * that use new clusters, so refcounts on disk may be too low until the image
+ * is closed.  It is flagged dirty meanwhile, and its refcounts are rebuilt
+ * when it is opened again after a crash.
+ */
+int qcow2_mark_dirty(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (!s->lazy_refcounts || s->dirty) {
+        return 0;
+    }
+
+    s->dirty = true;
+    ret = qcow2_rewrite_ext_header(bs);
+    if (ret < 0) {
+        s->dirty = false;
+    }
+    return ret;
+}
+
+/* Clears the dirty flag once the refcount blocks are written */
+static int qcow2_mark_clean(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (!s->dirty) {
+        return 0;
+    }
+
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dirty = false;
+    ret = qcow2_rewrite_ext_header(bs);
+    if (ret < 0) {
+        s->dirty = true;
+    }
+    return ret;
+}
+
 static int qcow2_change_backing_file(BlockDriverState *bs,
     const char *backing_file, const char *backing_fmt)
 {
@@ -1024,6 +1357,16 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         }
     }
 
+    if (flags & BLOCK_FLAG_LAZY_REFCOUNTS) {
+        BDRVQcowState *s = bs->opaque;
+
+        s->lazy_refcounts = true;
+        ret = qcow2_update_ext_header(bs, backing_file, backing_format);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     ret = 0;
 out:
     bdrv_delete(bs);
@@ -1049,6 +1392,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
             backing_fmt = options->value.s;
         } else if (!strcmp(options->name, BLOCK_OPT_ENCRYPT)) {
             flags |= options->value.n ? BLOCK_FLAG_ENCRYPT : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
+            flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
         } else if (!strcmp(options->name, BLOCK_OPT_CLUSTER_SIZE)) {
             if (options->value.n) {
                 cluster_size = options->value.n;
@@ -1138,33 +1483,19 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     }
 
     s->l1_vm_state_index = new_l1_size;
-    return 0;
+    return qcow2_resize_l2_cache(bs, be64_to_cpu(offset));
 }
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+/* Deflate the cluster in buf into out_buf, which is cluster_size bytes.
+   Only reads immutable state, so any thread may call it. */
+static int qcow2_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                                  uint8_t *out_buf)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
-
-    if (nb_sectors == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(bs->file);
-        cluster_offset = (cluster_offset + 511) & ~511;
-        bdrv_truncate(bs->file, cluster_offset);
-        return 0;
-    }
-
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
@@ -1172,7 +1503,6 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                        Z_DEFLATED, -12,
                        9, Z_DEFAULT_STRATEGY);
     if (ret != 0) {
-        qemu_free(out_buf);
         return -1;
     }
 
@@ -1183,7 +1513,6 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     ret = deflate(&strm, Z_FINISH);
     if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
         deflateEnd(&strm);
         return -1;
     }
@@ -1192,25 +1521,69 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
     deflateEnd(&strm);
 
     if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+        /* could not compress */
+        return 0;
+    }
+    return out_len;
+}
+
+static int qcow2_write_compressed_cluster(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          const uint8_t *buf,
+                                          const uint8_t *out_buf, int out_len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    if (out_len == 0) {
         /* could not compress: write normal cluster */
-        bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset)
-            return -1;
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+        return bdrv_write(bs, sector_num, buf, s->cluster_sectors);
     }
 
-    qemu_free(out_buf);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset)
+        return -1;
+    cluster_offset &= s->cluster_offset_mask;
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
+        return -1;
+    }
     return 0;
 }
 
+static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret, out_len;
+    uint8_t *out_buf;
+    uint64_t cluster_offset;
+
+    if (nb_sectors == 0) {
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        cluster_offset = bdrv_getlength(bs->file);
+        cluster_offset = (cluster_offset + 511) & ~511;
+        bdrv_truncate(bs->file, cluster_offset);
+        return 0;
+    }
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    out_buf = qemu_malloc(s->cluster_size);
+    out_len = qcow2_compress_cluster(bs, buf, out_buf);
+    if (out_len < 0) {
+        ret = -1;
+    } else {
+        ret = qcow2_write_compressed_cluster(bs, sector_num, buf, out_buf,
+                                             out_len);
+    }
+    qemu_free(out_buf);
+    return ret;
+}
+
 static int qcow2_flush(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1265,6 +1638,14 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result)
 {
+    BDRVQcowState *s = bs->opaque;
+
+    /* unused preallocated clusters would be reported as leaked */
+    qcow2_prealloc_release(bs);
+    if (s->dirty) {
+        fprintf(stderr, "Warning: the image was not closed cleanly, its "
+            "refcounts are rebuilt when it is opened read-write.\n");
+    }
     return qcow2_check_refcounts(bs, result);
 }
 
@@ -1319,6 +1700,34 @@ static int qcow2_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     return ret;
 }
 
+static int64_t qcow2_map_vmstate(BlockDriverState *bs, int64_t pos,
+                                 int64_t size, int64_t *file_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset = qcow2_vm_state_offset(s) + pos;
+    uint64_t cluster_offset;
+    int n, ret;
+
+    if ((offset | size) & 511) {
+        return -EINVAL;
+    }
+
+    n = MIN(size, INT_MAX & ~511) >> 9;
+    ret = qcow2_get_cluster_offset(bs, offset, &n, &cluster_offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
+        return -ENOTSUP;
+    } else if (cluster_offset) {
+        *file_offset = cluster_offset + (offset & (s->cluster_size - 1));
+    } else {
+        *file_offset = -1;
+    }
+    return (int64_t)n << 9;
+}
+
 static QEMUOptionParameter qcow2_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -1350,6 +1759,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_STRING,
         .help = "Preallocation mode (allowed values: off, metadata)"
     },
+    {
+        .name = BLOCK_OPT_LAZY_REFCOUNTS,
+        .type = OPT_FLAG,
+        .help = "Postpone refcount updates"
+    },
     { NULL }
 };
 
@@ -1362,6 +1776,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_create        = qcow2_create,
     .bdrv_flush         = qcow2_flush,
     .bdrv_is_allocated  = qcow2_is_allocated,
+    .bdrv_get_block_map = qcow2_get_block_map,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1372,6 +1787,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_discard           = qcow2_discard,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_compress_cluster  = qcow2_compress_cluster,
+    .bdrv_write_compressed_cluster = qcow2_write_compressed_cluster,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -1382,6 +1799,8 @@ static BlockDriver bdrv_qcow2 = {
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
+    .bdrv_map_vmstate     = qcow2_map_vmstate,
+    .bdrv_get_stats       = qcow2_get_stats,
 
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
@@ -49,11 +49,27 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* L2 tables cached at least, and at most when sized automatically */
 #define L2_CACHE_SIZE 16
+#define L2_CACHE_AUTO_MAX_BYTES (16 * 1024 * 1024)
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
+/* Most data clusters allocated ahead of a sequential writer */
+#define PREALLOC_MAX_BYTES (8 * 1024 * 1024)
+
+/*
+ * A run of data clusters allocated for the guest clusters starting at
+ * guest_offset, before they are written
+ */
+typedef struct QCowPrealloc {
+    uint64_t guest_offset;
+    int64_t offset;
+    int nb_clusters;
+    uint8_t *used;                  /* one bit per cluster handed out */
+} QCowPrealloc;
+
 typedef struct QCowHeader {
     uint32_t magic;
     uint32_t version;
@@ -100,12 +116,20 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    bool l2_cache_auto;         /* sized from the image */
+    bool lazy_refcounts;        /* refcounts written back lazily */
+    bool dirty;                 /* refcounts on disk may be wrong */
 
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
+    /* Clusters allocated ahead of a sequential writer */
+    QCowPrealloc prealloc[2];       /* the previous and the current run */
+    uint64_t last_alloc_start;      /* guest range allocated last */
+    uint64_t last_alloc_end;
+
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
@@ -172,11 +196,14 @@ static inline int64_t align_offset(int64_t offset, int n)
 /* qcow2.c functions */
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors);
+int qcow2_mark_dirty(BlockDriverState *bs);
 
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
 
+int qcow2_refcount_aio_prefetch(BlockDriverState *bs,
+    BlockDriverAIOCB **aiocb, BlockDriverCompletionFunc *cb, void *opaque);
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
@@ -190,10 +217,13 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
 
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res);
+int qcow2_rebuild_refcounts(BlockDriverState *bs);
 
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
+int qcow2_l2_aio_prefetch(BlockDriverState *bs, uint64_t offset,
+    BlockDriverAIOCB **aiocb, BlockDriverCompletionFunc *cb, void *opaque);
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
@@ -204,6 +234,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int n_start, int n_end, int *num, QCowL2Meta *m);
+void qcow2_prealloc_release(BlockDriverState *bs);
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          uint64_t offset,
                                          int compressed_size);
@@ -223,9 +254,17 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
+typedef struct Qcow2CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} Qcow2CacheStats;
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     bool writethrough);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+int qcow2_cache_size(Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -238,5 +277,8 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+bool qcow2_cache_is_cached(Qcow2Cache *c, uint64_t offset);
+BlockDriverAIOCB *qcow2_cache_aio_load(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, BlockDriverCompletionFunc *cb, void *opaque);
 
 #endif
@@ -44,25 +44,48 @@
  *
  * An interesting case occurs when two requests need to access an L2 table that
  * is not in the cache.  Since the operation to read the table from the image
- * file takes some time to complete, both requests may see a cache miss and
- * start reading the L2 table from the image file.  The first to finish will
- * commit its L2 table into the cache.  When the second tries to commit its
- * table will be deleted in favor of the existing cache entry.
+ * file takes some time to complete, both requests may see a cache miss.  The
+ * first one starts reading the L2 table from the image file and the second
+ * one waits for that read to complete, see qed_read_l2_table().  Cache entries
+ * being committed while an equal entry is already cached are deleted in favor
+ * of the existing cache entry.
+ *
+ * Entries are found through a hash table on their offset and the least
+ * recently used entry is evicted when the cache is full.
  */
 
 #include "trace.h"
 #include "qed.h"
 
-/* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
-#define MAX_L2_CACHE_SIZE 50
+static unsigned int qed_l2_cache_hash(L2TableCache *l2_cache, uint64_t offset)
+{
+    /* Tables are at least a cluster apart, drop the low zero bits */
+    return (offset >> 12) & (l2_cache->n_buckets - 1);
+}
 
 /**
  * Initialize the L2 cache
+ *
+ * @max_entries:    Number of L2 tables that may be cached
  */
-void qed_init_l2_cache(L2TableCache *l2_cache)
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries)
 {
+    unsigned int i;
+
     QTAILQ_INIT(&l2_cache->entries);
+    QLIST_INIT(&l2_cache->loads);
     l2_cache->n_entries = 0;
+    l2_cache->max_entries = max_entries;
+
+    l2_cache->n_buckets = 1;
+    while (l2_cache->n_buckets < max_entries) {
+        l2_cache->n_buckets *= 2;
+    }
+    l2_cache->buckets = qemu_malloc(l2_cache->n_buckets *
+                                    sizeof(l2_cache->buckets[0]));
+    for (i = 0; i < l2_cache->n_buckets; i++) {
+        QLIST_INIT(&l2_cache->buckets[i]);
+    }
 }
 
 /**
@@ -76,6 +99,7 @@ void qed_free_l2_cache(L2TableCache *l2_cache)
         qemu_vfree(entry->table);
         qemu_free(entry);
     }
+    qemu_free(l2_cache->buckets);
 }
 
 /**
@@ -124,12 +148,17 @@ void qed_unref_l2_cache_entry(CachedL2Table *entry)
  */
 CachedL2Table *qed_find_l2_cache_entry(L2TableCache *l2_cache, uint64_t offset)
 {
+    unsigned int bucket = qed_l2_cache_hash(l2_cache, offset);
     CachedL2Table *entry;
 
-    QTAILQ_FOREACH(entry, &l2_cache->entries, node) {
+    QLIST_FOREACH(entry, &l2_cache->buckets[bucket], hash_node) {
         if (entry->offset == offset) {
             trace_qed_find_l2_cache_entry(l2_cache, entry, offset, entry->ref);
             entry->ref++;
+
+            /* Most recently used */
+            QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+            QTAILQ_INSERT_TAIL(&l2_cache->entries, entry, node);
             return entry;
         }
     }
@@ -161,13 +190,17 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
         return;
     }
 
-    if (l2_cache->n_entries >= MAX_L2_CACHE_SIZE) {
+    if (l2_cache->n_entries >= l2_cache->max_entries) {
         entry = QTAILQ_FIRST(&l2_cache->entries);
         QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+        QLIST_REMOVE(entry, hash_node);
         l2_cache->n_entries--;
         qed_unref_l2_cache_entry(entry);
     }
 
     l2_cache->n_entries++;
     QTAILQ_INSERT_TAIL(&l2_cache->entries, l2_table, node);
+    QLIST_INSERT_HEAD(&l2_cache->buckets[qed_l2_cache_hash(l2_cache,
+                                                           l2_table->offset)],
+                      l2_table, hash_node);
 }
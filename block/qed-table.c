@@ -217,44 +217,61 @@ int qed_write_l1_table_sync(BDRVQEDState *s, unsigned int index,
     return ret;
 }
 
-typedef struct {
+typedef struct QEDReadL2TableCB {
     GenericCB gencb;
-    BDRVQEDState *s;
-    uint64_t l2_offset;
     QEDRequest *request;
+    QSIMPLEQ_ENTRY(QEDReadL2TableCB) next;
 } QEDReadL2TableCB;
 
+/* An L2 table being read, and the requests waiting for it */
+typedef struct QEDL2TableLoad {
+    BDRVQEDState *s;
+    CachedL2Table *l2_table;
+    uint64_t l2_offset;
+    QSIMPLEQ_HEAD(, QEDReadL2TableCB) waiters;
+    QLIST_ENTRY(QEDL2TableLoad) next;
+} QEDL2TableLoad;
+
 static void qed_read_l2_table_cb(void *opaque, int ret)
 {
-    QEDReadL2TableCB *read_l2_table_cb = opaque;
-    QEDRequest *request = read_l2_table_cb->request;
-    BDRVQEDState *s = read_l2_table_cb->s;
-    CachedL2Table *l2_table = request->l2_table;
+    QEDL2TableLoad *load = opaque;
+    BDRVQEDState *s = load->s;
+    CachedL2Table *l2_table = load->l2_table;
+    QEDReadL2TableCB *read_l2_table_cb;
+
+    QLIST_REMOVE(load, next);
 
     if (ret) {
         /* can't trust loaded L2 table anymore */
         qed_unref_l2_cache_entry(l2_table);
-        request->l2_table = NULL;
     } else {
-        l2_table->offset = read_l2_table_cb->l2_offset;
+        l2_table->offset = load->l2_offset;
 
         qed_commit_l2_cache_entry(&s->l2_cache, l2_table);
 
         /* This is guaranteed to succeed because we just committed the entry
-         * to the cache.
+         * to the cache.  All waiters get their reference before any of them
+         * runs and could evict the entry.
          */
-        request->l2_table = qed_find_l2_cache_entry(&s->l2_cache,
-                                                    l2_table->offset);
-        assert(request->l2_table != NULL);
+        QSIMPLEQ_FOREACH(read_l2_table_cb, &load->waiters, next) {
+            read_l2_table_cb->request->l2_table =
+                qed_find_l2_cache_entry(&s->l2_cache, load->l2_offset);
+            assert(read_l2_table_cb->request->l2_table != NULL);
+        }
     }
 
-    gencb_complete(&read_l2_table_cb->gencb, ret);
+    while ((read_l2_table_cb = QSIMPLEQ_FIRST(&load->waiters))) {
+        QSIMPLEQ_REMOVE_HEAD(&load->waiters, next);
+        gencb_complete(&read_l2_table_cb->gencb, ret);
+    }
+    qemu_free(load);
 }
 
 void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
                        BlockDriverCompletionFunc *cb, void *opaque)
 {
     QEDReadL2TableCB *read_l2_table_cb;
+    QEDL2TableLoad *load;
 
     qed_unref_l2_cache_entry(request->l2_table);
 
@@ -265,17 +282,29 @@ void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
         return;
     }
 
-    request->l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
-    request->l2_table->table = qed_alloc_table(s);
-
     read_l2_table_cb = gencb_alloc(sizeof(*read_l2_table_cb), cb, opaque);
-    read_l2_table_cb->s = s;
-    read_l2_table_cb->l2_offset = offset;
     read_l2_table_cb->request = request;
 
+    /* Wait for the table if another request is reading it already */
+    QLIST_FOREACH(load, &s->l2_cache.loads, next) {
+        if (load->l2_offset == offset) {
+            QSIMPLEQ_INSERT_TAIL(&load->waiters, read_l2_table_cb, next);
+            return;
+        }
+    }
+
+    load = qemu_mallocz(sizeof(*load));
+    load->s = s;
+    load->l2_offset = offset;
+    load->l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
+    load->l2_table->table = qed_alloc_table(s);
+    QSIMPLEQ_INIT(&load->waiters);
+    QSIMPLEQ_INSERT_TAIL(&load->waiters, read_l2_table_cb, next);
+    QLIST_INSERT_HEAD(&s->l2_cache.loads, load, next);
+
     BLKDBG_EVENT(s->bs->file, BLKDBG_L2_LOAD);
-    qed_read_table(s, offset, request->l2_table->table,
-                   qed_read_l2_table_cb, read_l2_table_cb);
+    qed_read_table(s, offset, load->l2_table->table,
+                   qed_read_l2_table_cb, load);
 }
 
 int qed_read_l2_table_sync(BDRVQEDState *s, QEDRequest *request, uint64_t offset)
@@ -16,6 +16,12 @@
 #include "qed.h"
 #include "qerror.h"
 
+/* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
+#define QED_DEFAULT_L2_CACHE_SIZE 50
+
+/* Key of allocating writes that update the L1 table or the header */
+#define QED_ALLOC_ALL UINT_MAX
+
 static void qed_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QEDAIOCB *acb = (QEDAIOCB *)blockacb;
@@ -291,6 +297,20 @@ static CachedL2Table *qed_new_l2_table(BDRVQEDState *s)
 
 static void qed_aio_next_io(void *opaque, int ret);
 
+/**
+ * Number of L2 tables to cache, from the metadata cache size of the drive
+ */
+static unsigned int qed_l2_cache_size(BDRVQEDState *s)
+{
+    int64_t size = bdrv_get_metadata_cache_size(s->bs);
+    int64_t table_bytes = s->header.cluster_size * s->header.table_size;
+
+    if (!size) {
+        return QED_DEFAULT_L2_CACHE_SIZE;
+    }
+    return MAX(MIN(size / table_bytes, INT_MAX), 1);
+}
+
 static int bdrv_qed_open(BlockDriverState *bs, int flags)
 {
     BDRVQEDState *s = bs->opaque;
@@ -299,6 +319,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     int ret;
 
     s->bs = bs;
+    QLIST_INIT(&s->allocating_reqs);
     QSIMPLEQ_INIT(&s->allocating_write_reqs);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
@@ -388,7 +409,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     }
 
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+    qed_init_l2_cache(&s->l2_cache, qed_l2_cache_size(s));
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -565,34 +586,36 @@ static int bdrv_qed_create(const char *filename, QEMUOptionParameter *options)
 }
 
 typedef struct {
-    int is_allocated;
-    int *pnum;
-} QEDIsAllocatedCB;
+    int ret;
+    size_t len;
+} QEDFindClusterSyncCB;
 
-static void qed_is_allocated_cb(void *opaque, int ret, uint64_t offset, size_t len)
+static void qed_find_cluster_sync_cb(void *opaque, int ret, uint64_t offset,
+                                     size_t len)
 {
-    QEDIsAllocatedCB *cb = opaque;
-    *cb->pnum = len / BDRV_SECTOR_SIZE;
-    cb->is_allocated = ret == QED_CLUSTER_FOUND;
+    QEDFindClusterSyncCB *cb = opaque;
+    cb->len = len;
+    cb->ret = ret;
 }
 
-static int bdrv_qed_is_allocated(BlockDriverState *bs, int64_t sector_num,
-                                  int nb_sectors, int *pnum)
+/**
+ * Look up the len bytes at pos and wait for the answer
+ *
+ * Returns the QED_CLUSTER_* state of the first *plen bytes, or -errno.
+ */
+static int qed_find_cluster_sync(BDRVQEDState *s, uint64_t pos, size_t len,
+                                 size_t *plen)
 {
-    BDRVQEDState *s = bs->opaque;
-    uint64_t pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
-    size_t len = (size_t)nb_sectors * BDRV_SECTOR_SIZE;
-    QEDIsAllocatedCB cb = {
-        .is_allocated = -1,
-        .pnum = pnum,
+    QEDFindClusterSyncCB cb = {
+        .ret = -EINPROGRESS,
     };
     QEDRequest request = { .l2_table = NULL };
 
     async_context_push();
 
-    qed_find_cluster(s, &request, pos, len, qed_is_allocated_cb, &cb);
+    qed_find_cluster(s, &request, pos, len, qed_find_cluster_sync_cb, &cb);
 
-    while (cb.is_allocated == -1) {
+    while (cb.ret == -EINPROGRESS) {
         qemu_aio_wait();
     }
 
@@ -600,7 +623,58 @@ static int bdrv_qed_is_allocated(BlockDriverState *bs, int64_t sector_num,
 
     qed_unref_l2_cache_entry(request.l2_table);
 
-    return cb.is_allocated;
+    *plen = cb.len;
+    return cb.ret;
+}
+
+static int bdrv_qed_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors, int *pnum)
+{
+    BDRVQEDState *s = bs->opaque;
+    uint64_t pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
+    size_t len;
+    int ret;
+
+    ret = qed_find_cluster_sync(s, pos, (size_t)nb_sectors * BDRV_SECTOR_SIZE,
+                                &len);
+    *pnum = len / BDRV_SECTOR_SIZE;
+    return ret == QED_CLUSTER_FOUND;
+}
+
+static int bdrv_qed_get_block_map(BlockDriverState *bs, int64_t sector_num,
+                                  int64_t nb_sectors, BlockExtent *extents,
+                                  int max_extents)
+{
+    BDRVQEDState *s = bs->opaque;
+    int n = 0;
+
+    while (nb_sectors > 0) {
+        uint64_t pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
+        size_t len;
+        int64_t num;
+        int ret;
+
+        /* a lookup stops at the end of the L2 table, and costs no I/O if
+         * the L2 table is not allocated at all
+         */
+        len = MIN(nb_sectors, SIZE_MAX >> BDRV_SECTOR_BITS) * BDRV_SECTOR_SIZE;
+        ret = qed_find_cluster_sync(s, pos, len, &len);
+        if (ret < 0) {
+            return ret;
+        }
+        num = len / BDRV_SECTOR_SIZE;
+        if (num <= 0) {
+            break;
+        }
+        if (!bdrv_block_map_add(extents, &n, max_extents, sector_num, num,
+                                ret == QED_CLUSTER_FOUND ?
+                                BDRV_EXTENT_ALLOCATED : 0)) {
+            break;
+        }
+        sector_num += num;
+        nb_sectors -= num;
+    }
+    return n;
 }
 
 static int bdrv_qed_make_empty(BlockDriverState *bs)
@@ -777,6 +851,104 @@ static void qed_aio_complete_bh(void *opaque)
     }
 }
 
+/**
+ * Allocating write locking
+ *
+ * Allocating writes to an L2 table are serialized so that only one request
+ * at a time updates the table: writes of the same sectors of a table must
+ * not be reordered.  Allocating writes that allocate an L2 table and update
+ * the L1 table, or set the need check bit in the header, exclude all others
+ * with QED_ALLOC_ALL.  A request holds at most one lock, from its first
+ * allocation in the table until it is complete or allocates elsewhere, and
+ * waiting requests are woken up in order.
+ */
+static bool qed_alloc_keys_conflict(unsigned int a, unsigned int b)
+{
+    return a == b || a == QED_ALLOC_ALL || b == QED_ALLOC_ALL;
+}
+
+static bool qed_alloc_key_busy(BDRVQEDState *s, unsigned int key)
+{
+    QEDAIOCB *acb;
+
+    QLIST_FOREACH(acb, &s->allocating_reqs, alloc_next) {
+        if (qed_alloc_keys_conflict(acb->alloc_key, key)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void qed_wake_allocating_write_reqs(BDRVQEDState *s)
+{
+    QEDAIOCB *acb;
+
+restart:
+    QSIMPLEQ_FOREACH(acb, &s->allocating_write_reqs, next) {
+        if (qed_alloc_key_busy(s, acb->alloc_key)) {
+            if (acb->alloc_key == QED_ALLOC_ALL) {
+                break; /* nobody may overtake it */
+            }
+            continue;
+        }
+
+        /* Hand the lock over and restart the request */
+        QSIMPLEQ_REMOVE(&s->allocating_write_reqs, acb, QEDAIOCB, next);
+        acb->alloc_locked = true;
+        QLIST_INSERT_HEAD(&s->allocating_reqs, acb, alloc_next);
+        qed_aio_next_io(acb, 0);
+        goto restart;
+    }
+}
+
+static void qed_aio_unlock_alloc(QEDAIOCB *acb)
+{
+    if (!acb->alloc_locked) {
+        return;
+    }
+
+    QLIST_REMOVE(acb, alloc_next);
+    acb->alloc_locked = false;
+    qed_wake_allocating_write_reqs(acb_to_s(acb));
+}
+
+/**
+ * Lock for an allocating write
+ *
+ * Returns true if the request may go on, or false if it is queued and will
+ * be restarted once it holds the lock.
+ */
+static bool qed_aio_lock_alloc(QEDAIOCB *acb, unsigned int key)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+    QEDAIOCB *waiting;
+
+    if (acb->alloc_locked) {
+        if (acb->alloc_key == key || acb->alloc_key == QED_ALLOC_ALL) {
+            return true;
+        }
+        qed_aio_unlock_alloc(acb);
+    }
+
+    acb->alloc_key = key;
+    if (qed_alloc_key_busy(s, key)) {
+        goto wait;
+    }
+    QSIMPLEQ_FOREACH(waiting, &s->allocating_write_reqs, next) {
+        if (qed_alloc_keys_conflict(waiting->alloc_key, key)) {
+            goto wait;
+        }
+    }
+
+    acb->alloc_locked = true;
+    QLIST_INSERT_HEAD(&s->allocating_reqs, acb, alloc_next);
+    return true;
+
+wait:
+    QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
+    return false;
+}
+
 static void qed_aio_complete(QEDAIOCB *acb, int ret)
 {
     BDRVQEDState *s = acb_to_s(acb);
@@ -792,19 +964,13 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
     acb->bh = qemu_bh_new(qed_aio_complete_bh, acb);
     qemu_bh_schedule(acb->bh);
 
-    /* Start next allocating write request waiting behind this one.  Note that
-     * requests enqueue themselves when they first hit an unallocated cluster
-     * but they wait until the entire request is finished before waking up the
-     * next request in the queue.  This ensures that we don't cycle through
+    /* Start allocating write requests waiting behind this one.  Note that
+     * requests lock an L2 table when they first hit an unallocated cluster in
+     * it but they keep the lock until the entire request is finished, unless
+     * they move on to another table.  This ensures that we don't cycle through
      * requests multiple times but rather finish one at a time completely.
      */
-    if (acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
-        acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-        if (acb) {
-            qed_aio_next_io(acb, 0);
-        }
-    }
+    qed_aio_unlock_alloc(acb);
 }
 
 /**
@@ -1007,13 +1173,18 @@ static bool qed_should_set_need_check(BDRVQEDState *s)
 static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
 {
     BDRVQEDState *s = acb_to_s(acb);
+    unsigned int key;
 
-    /* Freeze this request if another allocating write is in progress */
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
+    /* Freeze this request if another allocating write is updating the same
+     * tables */
+    if (acb->find_cluster_ret == QED_CLUSTER_L1 ||
+        qed_should_set_need_check(s)) {
+        key = QED_ALLOC_ALL;
+    } else {
+        key = qed_l1_index(s, acb->cur_pos);
     }
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        return; /* wait for existing request to finish */
+    if (!qed_aio_lock_alloc(acb, key)) {
+        return; /* wait for existing requests to finish */
     }
 
     acb->cur_nclusters = qed_bytes_to_clusters(s,
@@ -1188,6 +1359,7 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
     acb->cur_pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
     acb->end_pos = acb->cur_pos + nb_sectors * BDRV_SECTOR_SIZE;
     acb->request.l2_table = NULL;
+    acb->alloc_locked = false;
     qemu_iovec_init(&acb->cur_qiov, qiov->niov);
 
     /* Start request */
@@ -1353,6 +1525,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_create              = bdrv_qed_create,
     .bdrv_flush               = bdrv_qed_flush,
     .bdrv_is_allocated        = bdrv_qed_is_allocated,
+    .bdrv_get_block_map       = bdrv_qed_get_block_map,
     .bdrv_make_empty          = bdrv_qed_make_empty,
     .bdrv_aio_readv           = bdrv_qed_aio_readv,
     .bdrv_aio_writev          = bdrv_qed_aio_writev,
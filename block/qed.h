@@ -108,12 +108,19 @@ typedef struct CachedL2Table {
     QEDTable *table;
     uint64_t offset;    /* offset=0 indicates an invalidate entry */
     QTAILQ_ENTRY(CachedL2Table) node;
+    QLIST_ENTRY(CachedL2Table) hash_node;
     int ref;
 } CachedL2Table;
 
 typedef struct {
-    QTAILQ_HEAD(, CachedL2Table) entries;
+    QTAILQ_HEAD(, CachedL2Table) entries;   /* least recently used first */
+    QLIST_HEAD(, CachedL2Table) *buckets;
+    unsigned int n_buckets;                 /* a power of two */
     unsigned int n_entries;
+    unsigned int max_entries;
+
+    /* L2 tables being read */
+    QLIST_HEAD(, QEDL2TableLoad) loads;
 } L2TableCache;
 
 typedef struct QEDRequest {
@@ -141,6 +148,11 @@ typedef struct QEDAIOCB {
     int find_cluster_ret;           /* used for L1/L2 update */
 
     QEDRequest request;
+
+    /* Allocating writes */
+    unsigned int alloc_key;         /* L1 index or QED_ALLOC_ALL */
+    bool alloc_locked;
+    QLIST_ENTRY(QEDAIOCB) alloc_next;
 } QEDAIOCB;
 
 typedef struct {
@@ -155,7 +167,8 @@ typedef struct {
     uint32_t l2_shift;
     uint32_t l2_mask;
 
-    /* Allocating write request queue */
+    /* Allocating write requests allocating, and waiting to */
+    QLIST_HEAD(, QEDAIOCB) allocating_reqs;
     QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_reqs;
 } BDRVQEDState;
 
@@ -200,7 +213,7 @@ void gencb_complete(void *opaque, int ret);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
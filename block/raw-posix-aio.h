@@ -26,12 +26,30 @@
 
 
 /* posix-aio-compat.c - thread pool based implementation */
+typedef struct PosixAioPool PosixAioPool;
+
+typedef struct PosixAioPoolStats {
+    int threads;
+    int idle_threads;
+    int max_threads;
+    int queued;
+    uint64_t requests;
+    int64_t avg_latency_ns;
+    int avg_queue_depth;
+    uint64_t bounces;           /* requests copied to an aligned buffer */
+    uint64_t bounce_allocs;     /* of which needed a buffer allocated */
+} PosixAioPoolStats;
+
 int paio_init(void);
-BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
-        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+PosixAioPool *paio_pool_new(void);
+void paio_pool_free(PosixAioPool *pool);
+void paio_pool_init_bounce(PosixAioPool *pool);
+void paio_pool_get_stats(PosixAioPool *pool, PosixAioPoolStats *stats);
+BlockDriverAIOCB *paio_submit(BlockDriverState *bs, PosixAioPool *pool,
+        int fd, int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
-BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
-        unsigned long int req, void *buf,
+BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, PosixAioPool *pool,
+        int fd, unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque);
 
 /* linux-aio.c - Linux native implementation */
@@ -39,5 +57,7 @@ void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx);
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
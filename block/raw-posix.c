@@ -27,6 +27,7 @@
 #include "qemu-log.h"
 #include "block_int.h"
 #include "module.h"
+#include "qemu-objects.h"
 #include "block/raw-posix-aio.h"
 
 #ifdef CONFIG_COCOA
@@ -51,6 +52,10 @@
 #include <sys/param.h>
 #include <linux/cdrom.h>
 #include <linux/fd.h>
+#include <linux/fs.h>
+#ifdef CONFIG_FALLOCATE
+#include <linux/falloc.h>
+#endif
 #endif
 #if defined (__FreeBSD__) || defined(__FreeBSD_kernel__)
 #include <signal.h>
@@ -122,11 +127,13 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+    PosixAioPool *paio_pool;
     uint8_t *aligned_buf;
     unsigned aligned_buf_size;
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
+    bool has_discard : 1;
 } BDRVRawState;
 
 static int fd_open(BlockDriverState *bs);
@@ -167,6 +174,7 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
     }
     s->fd = fd;
     s->aligned_buf = NULL;
+    s->has_discard = 1;
 
     if ((bdrv_flags & BDRV_O_NOCACHE)) {
         /*
@@ -202,6 +210,10 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         s->use_aio = 0;
 #endif
     }
+    s->paio_pool = paio_pool_new();
+    if (s->aligned_buf) {
+        paio_pool_init_bounce(s->paio_pool);
+    }
 
 #ifdef CONFIG_XFS
     if (platform_test_xfs_fd(s->fd)) {
@@ -518,7 +530,8 @@ static int qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
     int i;
 
     for (i = 0; i < qiov->niov; i++) {
-        if ((uintptr_t) qiov->iov[i].iov_base % bs->buffer_alignment) {
+        if ((uintptr_t) qiov->iov[i].iov_base % bs->buffer_alignment ||
+            qiov->iov[i].iov_len % bs->buffer_alignment) {
             return 0;
         }
     }
@@ -551,7 +564,7 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
-    return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
+    return paio_submit(bs, s->paio_pool, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
 
@@ -579,9 +592,140 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
-    return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
+    return paio_submit(bs, s->paio_pool, s->fd, 0, NULL, 0, cb, opaque,
+                       QEMU_AIO_FLUSH);
+}
+
+static void raw_io_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_get_stats(BlockDriverState *bs, QDict *stats)
+{
+    BDRVRawState *s = bs->opaque;
+    PosixAioPoolStats pool;
+    QObject *obj;
+
+    paio_pool_get_stats(s->paio_pool, &pool);
+    obj = qobject_from_jsonf("{ 'threads': %d,"
+                             "'idle_threads': %d,"
+                             "'max_threads': %d,"
+                             "'queued': %d,"
+                             "'requests': %" PRId64 ","
+                             "'avg_latency_ns': %" PRId64 ","
+                             "'avg_queue_depth': %d,"
+                             "'bounces': %" PRId64 ","
+                             "'bounce_allocs': %" PRId64 " }",
+                             pool.threads, pool.idle_threads,
+                             pool.max_threads, pool.queued,
+                             pool.requests, pool.avg_latency_ns,
+                             pool.avg_queue_depth, pool.bounces,
+                             pool.bounce_allocs);
+    qdict_put_obj(stats, "thread_pool", obj);
 }
 
+static int raw_get_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* data read through the page cache may be stale with O_DIRECT */
+    if (s->open_flags & O_DIRECT) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+
+#ifdef CONFIG_LINUX_AIO
+/* The descriptor of a raw image that is accessed with Linux AIO, for users
+   that submit requests to it on their own */
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (bs->drv == bdrv_find_format("raw")) {
+        bs = bs->file;
+    }
+    /* only the drivers in this file */
+    if (!bs->drv || bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+    s = bs->opaque;
+    if (!s->use_aio) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+#endif
+
+#ifdef SEEK_DATA
+/* Holes of the file read as zeroes; a sector that is partly in a hole
+   counts as data */
+static int raw_get_block_map(BlockDriverState *bs, int64_t sector_num,
+                             int64_t nb_sectors, BlockExtent *extents,
+                             int max_extents)
+{
+    BDRVRawState *s = bs->opaque;
+    off_t start = sector_num * BDRV_SECTOR_SIZE;
+    off_t end = (sector_num + nb_sectors) * BDRV_SECTOR_SIZE;
+    int n = 0;
+
+    while (start < end) {
+        off_t data, next;
+        int flags;
+
+        data = lseek(s->fd, start, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            /* in the hole at the end of the file */
+            data = end;
+        } else if (data < 0) {
+            /* no hole information, everything is data */
+            data = start;
+        }
+
+        next = MIN(data, end) & BDRV_SECTOR_MASK;
+        if (next > start) {
+            flags = BDRV_EXTENT_ALLOCATED | BDRV_EXTENT_ZERO;
+        } else {
+            next = data > start ? data : lseek(s->fd, start, SEEK_HOLE);
+            if (next < 0) {
+                next = end;
+            }
+            next = MIN((next + BDRV_SECTOR_SIZE - 1) & BDRV_SECTOR_MASK, end);
+            flags = BDRV_EXTENT_ALLOCATED;
+        }
+
+        if (!bdrv_block_map_add(extents, &n, max_extents,
+                                start / BDRV_SECTOR_SIZE,
+                                (next - start) / BDRV_SECTOR_SIZE, flags)) {
+            break;
+        }
+        start = next;
+    }
+    return n;
+}
+#endif
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -591,6 +735,10 @@ static void raw_close(BlockDriverState *bs)
         if (s->aligned_buf != NULL)
             qemu_vfree(s->aligned_buf);
     }
+    if (s->paio_pool) {
+        paio_pool_free(s->paio_pool);
+        s->paio_pool = NULL;
+    }
 }
 
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
@@ -772,16 +920,30 @@ static int xfs_discard(BDRVRawState *s, int64_t sector_num, int nb_sectors)
 }
 #endif
 
+/* Punch a hole in the file, so that it stays sparse */
 static int raw_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
 {
-#ifdef CONFIG_XFS
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_XFS
     if (s->is_xfs) {
         return xfs_discard(s, sector_num, nb_sectors);
     }
 #endif
 
+#if defined(CONFIG_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (s->has_discard &&
+        fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  sector_num << BDRV_SECTOR_BITS,
+                  (int64_t)nb_sectors << BDRV_SECTOR_BITS) < 0) {
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            return -errno;
+        }
+        /* the file system cannot, don't ask again */
+        s->has_discard = 0;
+    }
+#endif
+
     return 0;
 }
 
@@ -803,6 +965,11 @@ static BlockDriver bdrv_file = {
     .bdrv_read = raw_read,
     .bdrv_write = raw_write,
     .bdrv_close = raw_close,
+    .bdrv_get_stats = raw_get_stats,
+    .bdrv_get_fd = raw_get_fd,
+#ifdef SEEK_DATA
+    .bdrv_get_block_map = raw_get_block_map,
+#endif
     .bdrv_create = raw_create,
     .bdrv_flush = raw_flush,
     .bdrv_discard = raw_discard,
@@ -810,6 +977,8 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -1005,7 +1174,7 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
 
     if (fd_open(bs) < 0)
         return NULL;
-    return paio_ioctl(bs, s->fd, req, buf, cb, opaque);
+    return paio_ioctl(bs, s->paio_pool, s->fd, req, buf, cb, opaque);
 }
 
 #elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -1062,6 +1231,29 @@ static int hdev_has_zero_init(BlockDriverState *bs)
     return 0;
 }
 
+#if defined(__linux__) && defined(BLKDISCARD)
+static int hdev_discard(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    uint64_t range[2];
+
+    if (!s->has_discard) {
+        return 0;
+    }
+
+    range[0] = sector_num << BDRV_SECTOR_BITS;
+    range[1] = (uint64_t)nb_sectors << BDRV_SECTOR_BITS;
+    if (ioctl(s->fd, BLKDISCARD, range) < 0) {
+        if (errno != EOPNOTSUPP && errno != ENOTTY) {
+            return -errno;
+        }
+        s->has_discard = 0;
+    }
+    return 0;
+}
+#endif
+
 static BlockDriver bdrv_host_device = {
     .format_name        = "host_device",
     .protocol_name        = "host_device",
@@ -1069,6 +1261,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_file_open     = hdev_open,
     .bdrv_close         = raw_close,
+    .bdrv_get_stats     = raw_get_stats,
+    .bdrv_get_fd        = raw_get_fd,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
@@ -1077,10 +1271,15 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
     .bdrv_getlength	= raw_getlength,
+#if defined(__linux__) && defined(BLKDISCARD)
+    .bdrv_discard       = hdev_discard,
+#endif
 
     /* generic scsi device */
 #ifdef __linux__
@@ -1184,6 +1383,7 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_probe_device	= floppy_probe_device,
     .bdrv_file_open     = floppy_open,
     .bdrv_close         = raw_close,
+    .bdrv_get_stats     = raw_get_stats,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
@@ -1281,6 +1481,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_get_stats     = raw_get_stats,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
@@ -1404,6 +1605,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_get_stats     = raw_get_stats,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
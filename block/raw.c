@@ -117,6 +117,19 @@ static int raw_has_zero_init(BlockDriverState *bs)
     return bdrv_has_zero_init(bs->file);
 }
 
+static int raw_get_fd(BlockDriverState *bs)
+{
+    return bdrv_get_fd(bs->file);
+}
+
+static int raw_get_block_map(BlockDriverState *bs, int64_t sector_num,
+                             int64_t nb_sectors, BlockExtent *extents,
+                             int max_extents)
+{
+    return bdrv_get_block_map(bs->file, sector_num, nb_sectors, extents,
+                              max_extents);
+}
+
 static BlockDriver bdrv_raw = {
     .format_name        = "raw",
 
@@ -146,6 +159,8 @@ static BlockDriver bdrv_raw = {
     .bdrv_create        = raw_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = raw_has_zero_init,
+    .bdrv_get_fd        = raw_get_fd,
+    .bdrv_get_block_map = raw_get_block_map,
 };
 
 static void bdrv_raw_init(void)
@@ -13,6 +13,8 @@
 
 #include "rbd_types.h"
 #include "block_int.h"
+#include "qemu-timer.h"
+#include "range.h"
 
 #include <rados/librados.h>
 
@@ -21,7 +23,7 @@
 /*
  * When specifying the image filename use:
  *
- * rbd:poolname/devicename
+ * rbd:poolname/devicename[@snapname][:option=value[:option=value]...]
  *
  * poolname must be the name of an existing rados pool
  *
@@ -36,6 +38,16 @@
  * and is attached to the devicename, separated by a dot.
  * e.g. "devicename.1234567890ab"
  *
+ * The options are
+ *
+ * readahead=<bytes>: once a few reads in a row were sequential, read
+ * that much more in advance, and serve the next reads from it.  Off by
+ * default.
+ *
+ * writeback=<bytes>: with cache=writeback, gather up to that much of
+ * contiguous writes and write them at once, unless the guest asks for
+ * a flush before.  One object by default, 0 turns it off.
+ *
  */
 
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
@@ -52,8 +64,16 @@ typedef struct RBDAIOCB {
     int error;
     struct BDRVRBDState *s;
     int cancelled;
+    int writeback;              /* writes out the writeback buffer */
 } RBDAIOCB;
 
+typedef struct RBDFlushAIOCB {
+    BlockDriverAIOCB common;
+    QEMUBH *bh;
+    int ret;
+    QLIST_ENTRY(RBDFlushAIOCB) list;
+} RBDFlushAIOCB;
+
 typedef struct RADOSCB {
     int rcbid;
     RBDAIOCB *acb;
@@ -78,11 +98,41 @@ typedef struct BDRVRBDState {
     int qemu_aio_count;
     int event_reader_pos;
     RADOSCB *event_rcb;
+
+    /* readahead, see rbd_readahead() */
+    uint64_t ra_size;           /* 0 if disabled */
+    uint64_t ra_next;           /* where a sequential read would start */
+    int ra_sequential;          /* reads in a row that were sequential */
+    char *ra_buf;               /* ra_len bytes of the image at ra_start */
+    uint64_t ra_start;
+    uint64_t ra_len;
+    char *ra_fill;              /* being read to replace ra_buf */
+    uint64_t ra_fill_start;
+    uint64_t ra_fill_len;
+    int ra_fill_valid;          /* no write overlapped it since */
+
+    /* writeback, see rbd_writeback() */
+    uint64_t wb_size;           /* 0 if disabled */
+    char *wb_buf;               /* wb_len bytes for wb_start, not issued */
+    uint64_t wb_start;
+    uint64_t wb_len;
+    QEMUTimer *wb_timer;
+    int wb_error;               /* of a buffered write, for the next flush */
+    int writes_inflight;
+    QLIST_HEAD(, RBDFlushAIOCB) flushes;    /* wait for writes_inflight */
 } BDRVRBDState;
 
 typedef struct rbd_obj_header_ondisk RbdHeader1;
 
+/* Sequential reads in a row before reading ahead */
+#define RBD_READAHEAD_TRIGGER 2
+
+/* Upper bound for how long writes stay in the writeback buffer, in ms */
+#define RBD_WRITEBACK_DELAY 100
+
 static void rbd_aio_bh_cb(void *opaque);
+static void rbd_writeback_issue(BlockDriverState *bs);
+static void rbd_writeback_timer(void *opaque);
 
 static int rbd_next_tok(char *dst, int dst_len,
                         char *src, char delim,
@@ -129,6 +179,10 @@ static int rbd_parsename(const char *filename,
     }
 
     buf = qemu_strdup(start);
+    p = strchr(buf, ':');
+    if (p) {
+        *p = '\0';             /* options, see rbd_parseopts() */
+    }
     p = buf;
 
     ret = rbd_next_tok(pool, pool_len, p, '/', "pool name", &p);
@@ -152,6 +206,50 @@ done:
     return ret;
 }
 
+/* Parse the options after the image name */
+static int rbd_parseopts(BDRVRBDState *s, const char *filename)
+{
+    char *buf, *p, *next, *value, *end;
+    int64_t n;
+    int ret = 0;
+
+    p = strchr(filename + strlen("rbd:"), ':');
+    if (!p) {
+        return 0;
+    }
+    buf = qemu_strdup(p + 1);
+
+    for (p = buf; p && ret == 0; p = next) {
+        next = strchr(p, ':');
+        if (next) {
+            *next++ = '\0';
+        }
+        value = strchr(p, '=');
+        if (!value) {
+            error_report("rbd: option %s needs a value", p);
+            ret = -EINVAL;
+            break;
+        }
+        *value++ = '\0';
+
+        n = strtosz_suffix(value, &end, STRTOSZ_DEFSUFFIX_B);
+        if (n < 0 || *end) {
+            error_report("rbd: invalid size %s for %s", value, p);
+            ret = -EINVAL;
+        } else if (!strcmp(p, "readahead")) {
+            s->ra_size = n;
+        } else if (!strcmp(p, "writeback")) {
+            s->wb_size = n;
+        } else {
+            error_report("rbd: unknown option %s", p);
+            ret = -EINVAL;
+        }
+    }
+
+    qemu_free(buf);
+    return ret;
+}
+
 static int create_tmap_op(uint8_t op, const char *name, char **tmap_desc)
 {
     uint32_t len = strlen(name);
@@ -336,6 +434,32 @@ done:
     return ret;
 }
 
+static void rbd_flush_bh_cb(void *opaque)
+{
+    RBDFlushAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_aio_release(acb);
+}
+
+/* Complete the flushes once no write is left in flight */
+static void rbd_write_done(BDRVRBDState *s)
+{
+    RBDFlushAIOCB *acb, *next;
+
+    if (--s->writes_inflight > 0 || QLIST_EMPTY(&s->flushes)) {
+        return;
+    }
+    QLIST_FOREACH_SAFE(acb, &s->flushes, list, next) {
+        QLIST_REMOVE(acb, list);
+        acb->ret = s->wb_error;
+        acb->bh = qemu_bh_new(rbd_flush_bh_cb, acb);
+        qemu_bh_schedule(acb->bh);
+    }
+    s->wb_error = 0;
+}
+
 /*
  * This aio completion is being called from rbd_aio_event_reader() and
  * runs in qemu context. It schedules a bh, but just in case the aio
@@ -348,6 +472,13 @@ static void rbd_complete_aio(RADOSCB *rcb)
 
     acb->aiocnt--;
 
+    if (acb->writeback && rcb->ret < 0) {
+        acb->s->wb_error = rcb->ret;
+    }
+    if (acb->write && !acb->aiocnt) {
+        rbd_write_done(acb->s);
+    }
+
     if (acb->cancelled) {
         if (!acb->aiocnt) {
             qemu_vfree(acb->bounce);
@@ -584,6 +715,20 @@ static int rbd_open(BlockDriverState *bs, const char *filename, int flags)
 
     bs->read_only = (snap != NULL);
 
+    s->ra_size = 0;
+    s->wb_size = s->objsize;
+    r = rbd_parseopts(s, filename);
+    if (r < 0) {
+        goto failed;
+    }
+    if (!(flags & BDRV_O_CACHE_WB)) {
+        s->wb_size = 0;
+    }
+    if (s->wb_size) {
+        s->wb_timer = qemu_new_timer(rt_clock, rbd_writeback_timer, bs);
+    }
+    QLIST_INIT(&s->flushes);
+
     s->event_reader_pos = 0;
     r = qemu_pipe(s->fds);
     if (r < 0) {
@@ -612,6 +757,17 @@ static void rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
+    rbd_writeback_issue(bs);
+    while (s->qemu_aio_count > 0) {
+        qemu_aio_wait();
+    }
+    if (s->wb_timer) {
+        qemu_del_timer(s->wb_timer);
+        qemu_free_timer(s->wb_timer);
+    }
+    qemu_vfree(s->wb_buf);
+    qemu_vfree(s->ra_buf);
+
     close(s->fds[0]);
     close(s->fds[1]);
     qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], NULL , NULL, NULL, NULL,
@@ -629,6 +785,14 @@ static void rbd_close(BlockDriverState *bs)
 static void rbd_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     RBDAIOCB *acb = (RBDAIOCB *) blockacb;
+
+    if (acb->bh) {
+        /* no rados request is left, only the completion */
+        qemu_bh_delete(acb->bh);
+        qemu_vfree(acb->bounce);
+        qemu_aio_release(acb);
+        return;
+    }
     acb->cancelled = 1;
 }
 
@@ -637,6 +801,23 @@ static AIOPool rbd_aio_pool = {
     .cancel = rbd_aio_cancel,
 };
 
+static void rbd_flush_cancel(BlockDriverAIOCB *blockacb)
+{
+    RBDFlushAIOCB *acb = (RBDFlushAIOCB *) blockacb;
+
+    if (acb->bh) {
+        qemu_bh_delete(acb->bh);
+    } else {
+        QLIST_REMOVE(acb, list);
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool rbd_flush_pool = {
+    .aiocb_size = sizeof(RBDFlushAIOCB),
+    .cancel = rbd_flush_cancel,
+};
+
 /*
  * This is the callback function for rados_aio_read and _write
  *
@@ -687,7 +868,7 @@ static void rbd_aio_bh_cb(void *opaque)
 {
     RBDAIOCB *acb = opaque;
 
-    if (!acb->write) {
+    if (!acb->write && acb->qiov) {
         qemu_iovec_from_buffer(acb->qiov, acb->bounce, acb->qiov->size);
     }
     qemu_vfree(acb->bounce);
@@ -698,42 +879,42 @@ static void rbd_aio_bh_cb(void *opaque)
     qemu_aio_release(acb);
 }
 
-static BlockDriverAIOCB *rbd_aio_rw_vector(BlockDriverState *bs,
-                                           int64_t sector_num,
-                                           QEMUIOVector *qiov,
-                                           int nb_sectors,
-                                           BlockDriverCompletionFunc *cb,
-                                           void *opaque, int write)
+static RBDAIOCB *rbd_aio_get(BlockDriverState *bs, int write,
+                             BlockDriverCompletionFunc *cb, void *opaque)
 {
     RBDAIOCB *acb;
-    RADOSCB *rcb;
-    rados_completion_t c;
-    char n[RBD_MAX_SEG_NAME_SIZE];
-    int64_t segnr, segoffs, segsize, last_segnr;
-    int64_t off, size;
-    char *buf;
-
-    BDRVRBDState *s = bs->opaque;
 
     acb = qemu_aio_get(&rbd_aio_pool, bs, cb, opaque);
     acb->write = write;
-    acb->qiov = qiov;
-    acb->bounce = qemu_blockalign(bs, qiov->size);
+    acb->qiov = NULL;
+    acb->bounce = NULL;
     acb->aiocnt = 0;
     acb->ret = 0;
     acb->error = 0;
-    acb->s = s;
+    acb->s = bs->opaque;
     acb->cancelled = 0;
+    acb->writeback = 0;
     acb->bh = NULL;
+    return acb;
+}
 
-    if (write) {
-        qemu_iovec_to_buffer(acb->qiov, acb->bounce);
-    }
+/* For a request that needs no rados request after all */
+static void rbd_aio_complete_now(RBDAIOCB *acb, int ret)
+{
+    acb->ret = ret;
+    acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
+    qemu_bh_schedule(acb->bh);
+}
 
-    buf = acb->bounce;
+/* Issue the rados requests of acb for size bytes at off, to or from buf */
+static void rbd_start_aio(BDRVRBDState *s, RBDAIOCB *acb, int64_t off,
+                          int64_t size, char *buf)
+{
+    RADOSCB *rcb;
+    rados_completion_t c;
+    char n[RBD_MAX_SEG_NAME_SIZE];
+    int64_t segnr, segoffs, segsize, last_segnr;
 
-    off = sector_num * BDRV_SECTOR_SIZE;
-    size = nb_sectors * BDRV_SECTOR_SIZE;
     segnr = off / s->objsize;
     segoffs = off % s->objsize;
     segsize = s->objsize - segoffs;
@@ -742,6 +923,9 @@ static BlockDriverAIOCB *rbd_aio_rw_vector(BlockDriverState *bs,
     acb->aiocnt = (last_segnr - segnr) + 1;
 
     s->qemu_aio_count += acb->aiocnt; /* All the RADOSCB */
+    if (acb->write) {
+        s->writes_inflight++;
+    }
 
     while (size > 0) {
         if (size < segsize) {
@@ -758,7 +942,7 @@ static BlockDriverAIOCB *rbd_aio_rw_vector(BlockDriverState *bs,
         rcb->buf = buf;
         rcb->s = acb->s;
 
-        if (write) {
+        if (acb->write) {
             rados_aio_create_completion(rcb, NULL,
                                         (rados_callback_t) rbd_finish_aiocb,
                                         &c);
@@ -776,7 +960,192 @@ static BlockDriverAIOCB *rbd_aio_rw_vector(BlockDriverState *bs,
         segsize = s->objsize;
         segnr++;
     }
+}
+
+static void rbd_writeback_done(void *opaque, int ret)
+{
+    /* errors are kept for the next flush by rbd_complete_aio() */
+}
+
+/*
+ * Write out the writeback buffer.  Rados keeps the requests to an object
+ * in order, so a read issued after this sees the data.
+ */
+static void rbd_writeback_issue(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+    RBDAIOCB *acb;
+
+    if (!s->wb_len) {
+        return;
+    }
+    qemu_del_timer(s->wb_timer);
+
+    acb = rbd_aio_get(bs, 1, rbd_writeback_done, NULL);
+    acb->writeback = 1;
+    acb->bounce = s->wb_buf;
+    s->wb_buf = NULL;
+    rbd_start_aio(s, acb, s->wb_start, s->wb_len, acb->bounce);
+    s->wb_len = 0;
+}
+
+static void rbd_writeback_timer(void *opaque)
+{
+    rbd_writeback_issue(opaque);
+}
+
+/*
+ * With cache=writeback, contiguous writes are copied to a buffer and
+ * completed at once.  The buffer is written out when a write does not
+ * fit in, when a read needs it, on a flush, or at the latest after
+ * RBD_WRITEBACK_DELAY ms.  Returns 1 if acb was buffered.
+ */
+static int rbd_writeback(BlockDriverState *bs, RBDAIOCB *acb,
+                         int64_t off, int64_t size)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    /* drop what readahead has of the old data */
+    if (s->ra_buf && ranges_overlap(off, size, s->ra_start, s->ra_len)) {
+        qemu_vfree(s->ra_buf);
+        s->ra_buf = NULL;
+    }
+    if (s->ra_fill &&
+        ranges_overlap(off, size, s->ra_fill_start, s->ra_fill_len)) {
+        s->ra_fill_valid = 0;
+    }
+
+    if (!s->wb_size) {
+        return 0;
+    }
+    if (s->wb_len && (off != s->wb_start + s->wb_len ||
+                      s->wb_len + size > s->wb_size)) {
+        rbd_writeback_issue(bs);
+    }
+    if (size > s->wb_size) {
+        return 0;
+    }
+
+    if (!s->wb_len) {
+        if (!s->wb_buf) {
+            s->wb_buf = qemu_blockalign(bs, s->wb_size);
+        }
+        s->wb_start = off;
+        qemu_mod_timer(s->wb_timer,
+                       qemu_get_clock(rt_clock) + RBD_WRITEBACK_DELAY);
+    }
+    memcpy(s->wb_buf + s->wb_len, acb->bounce, size);
+    s->wb_len += size;
+
+    rbd_aio_complete_now(acb, 0);
+    return 1;
+}
 
+static void rbd_readahead_done(void *opaque, int ret)
+{
+    BDRVRBDState *s = opaque;
+
+    if (ret < 0 || !s->ra_fill_valid) {
+        qemu_vfree(s->ra_fill);
+    } else {
+        qemu_vfree(s->ra_buf);
+        s->ra_buf = s->ra_fill;
+        s->ra_start = s->ra_fill_start;
+        s->ra_len = s->ra_fill_len;
+    }
+    s->ra_fill = NULL;
+}
+
+/* Read the readahead window at start, unless a read of it is in flight */
+static void rbd_readahead_fill(BlockDriverState *bs, uint64_t start)
+{
+    BDRVRBDState *s = bs->opaque;
+    RBDAIOCB *acb;
+
+    if (s->ra_fill || start >= s->size) {
+        return;
+    }
+
+    s->ra_fill_start = start;
+    s->ra_fill_len = MIN(s->ra_size, s->size - start);
+    s->ra_fill_valid = 1;
+    if (s->wb_len && ranges_overlap(start, s->ra_fill_len,
+                                    s->wb_start, s->wb_len)) {
+        rbd_writeback_issue(bs);
+    }
+
+    s->ra_fill = qemu_blockalign(bs, s->ra_fill_len);
+    acb = rbd_aio_get(bs, 0, rbd_readahead_done, s);
+    rbd_start_aio(s, acb, start, s->ra_fill_len, s->ra_fill);
+}
+
+/*
+ * After RBD_READAHEAD_TRIGGER sequential reads, the ra_size bytes that
+ * follow are read in advance, and the next window once reads get past
+ * the middle of the current one.  Returns 1 if acb was served from the
+ * readahead buffer.
+ */
+static int rbd_readahead(BlockDriverState *bs, RBDAIOCB *acb,
+                         int64_t off, int64_t size)
+{
+    BDRVRBDState *s = bs->opaque;
+    int sequential = (off == s->ra_next);
+
+    if (s->wb_len && ranges_overlap(off, size, s->wb_start, s->wb_len)) {
+        rbd_writeback_issue(bs);
+    }
+
+    if (!s->ra_size) {
+        return 0;
+    }
+    s->ra_next = off + size;
+    s->ra_sequential = sequential ? s->ra_sequential + 1 : 0;
+
+    if (s->ra_buf && off >= s->ra_start &&
+        off + size <= s->ra_start + s->ra_len) {
+        memcpy(acb->bounce, s->ra_buf + (off - s->ra_start), size);
+        rbd_aio_complete_now(acb, size);
+        if (sequential && off + size > s->ra_start + s->ra_len / 2) {
+            rbd_readahead_fill(bs, s->ra_start + s->ra_len);
+        }
+        return 1;
+    }
+
+    if (s->ra_sequential >= RBD_READAHEAD_TRIGGER) {
+        rbd_readahead_fill(bs, off + size);
+    }
+    return 0;
+}
+
+static BlockDriverAIOCB *rbd_aio_rw_vector(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           QEMUIOVector *qiov,
+                                           int nb_sectors,
+                                           BlockDriverCompletionFunc *cb,
+                                           void *opaque, int write)
+{
+    RBDAIOCB *acb;
+    int64_t off, size;
+
+    BDRVRBDState *s = bs->opaque;
+
+    acb = rbd_aio_get(bs, write, cb, opaque);
+    acb->qiov = qiov;
+    acb->bounce = qemu_blockalign(bs, qiov->size);
+
+    off = sector_num * BDRV_SECTOR_SIZE;
+    size = nb_sectors * BDRV_SECTOR_SIZE;
+
+    if (write) {
+        qemu_iovec_to_buffer(acb->qiov, acb->bounce);
+        if (rbd_writeback(bs, acb, off, size)) {
+            return &acb->common;
+        }
+    } else if (rbd_readahead(bs, acb, off, size)) {
+        return &acb->common;
+    }
+
+    rbd_start_aio(s, acb, off, size, acb->bounce);
     return &acb->common;
 }
 
@@ -798,6 +1167,42 @@ static BlockDriverAIOCB *rbd_aio_writev(BlockDriverState * bs,
     return rbd_aio_rw_vector(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
 }
 
+static BlockDriverAIOCB *rbd_aio_flush(BlockDriverState *bs,
+                                       BlockDriverCompletionFunc *cb,
+                                       void *opaque)
+{
+    BDRVRBDState *s = bs->opaque;
+    RBDFlushAIOCB *acb;
+
+    rbd_writeback_issue(bs);
+
+    acb = qemu_aio_get(&rbd_flush_pool, bs, cb, opaque);
+    acb->bh = NULL;
+    if (s->writes_inflight) {
+        QLIST_INSERT_HEAD(&s->flushes, acb, list);
+    } else {
+        acb->ret = s->wb_error;
+        s->wb_error = 0;
+        acb->bh = qemu_bh_new(rbd_flush_bh_cb, acb);
+        qemu_bh_schedule(acb->bh);
+    }
+    return &acb->common;
+}
+
+static int rbd_flush(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+    int ret;
+
+    rbd_writeback_issue(bs);
+    while (s->writes_inflight) {
+        qemu_aio_wait();
+    }
+    ret = s->wb_error;
+    s->wb_error = 0;
+    return ret;
+}
+
 static int rbd_getinfo(BlockDriverState * bs, BlockDriverInfo * bdi)
 {
     BDRVRBDState *s = bs->opaque;
@@ -1046,6 +1451,8 @@ static BlockDriver bdrv_rbd = {
 
     .bdrv_aio_readv     = rbd_aio_readv,
     .bdrv_aio_writev    = rbd_aio_writev,
+    .bdrv_aio_flush     = rbd_aio_flush,
+    .bdrv_flush         = rbd_flush,
 
     .bdrv_snapshot_create = rbd_snap_create,
     .bdrv_snapshot_list = rbd_snap_list,
@@ -12,6 +12,7 @@
 #include "qemu-common.h"
 #include "qemu-error.h"
 #include "qemu_socket.h"
+#include "qemu-timer.h"
 #include "block_int.h"
 
 #define SD_PROTO_VER 0x01
@@ -83,6 +84,9 @@
 #define SD_INODE_SIZE (sizeof(SheepdogInode))
 #define CURRENT_VDI_ID 0
 
+/* Connections to the sheep the object requests are spread over */
+#define SD_NR_CONNECTIONS 4
+
 typedef struct SheepdogReq {
     uint8_t proto_ver;
     uint8_t opcode;
@@ -241,8 +245,18 @@ static inline int is_snapshot(struct SheepdogInode *inode)
 #endif
 
 typedef struct SheepdogAIOCB SheepdogAIOCB;
+typedef struct BDRVSheepdogState BDRVSheepdogState;
+
+typedef struct SheepdogConn {
+    BDRVSheepdogState *s;
+    int fd;
+    int nr_inflight;            /* requests waiting for a response */
+    int64_t latency;            /* moving average of the response time, ns */
+} SheepdogConn;
+
+typedef struct AIOReq AIOReq;
 
-typedef struct AIOReq {
+struct AIOReq {
     SheepdogAIOCB *aiocb;
     unsigned int iov_offset;
 
@@ -253,9 +267,17 @@ typedef struct AIOReq {
     uint8_t flags;
     uint32_t id;
 
+    SheepdogConn *conn;         /* the request was sent on, NULL until then */
+    int64_t sent;
+
+    /* writes that go on where this one ends, sent along with it */
+    QSIMPLEQ_HEAD(, AIOReq) merged_head;
+    QSIMPLEQ_ENTRY(AIOReq) merged_siblings;
+    AIOReq *leader;             /* for those, the request they go with */
+
     QLIST_ENTRY(AIOReq) outstanding_aio_siblings;
     QLIST_ENTRY(AIOReq) aioreq_siblings;
-} AIOReq;
+};
 
 enum AIOCBState {
     AIOCB_WRITE_UDATA,
@@ -281,7 +303,7 @@ struct SheepdogAIOCB {
     QLIST_HEAD(aioreq_head, AIOReq) aioreq_head;
 };
 
-typedef struct BDRVSheepdogState {
+struct BDRVSheepdogState {
     SheepdogInode inode;
 
     uint32_t min_dirty_data_idx;
@@ -292,11 +314,11 @@ typedef struct BDRVSheepdogState {
 
     char *addr;
     char *port;
-    int fd;
+    SheepdogConn conns[SD_NR_CONNECTIONS];
 
     uint32_t aioreq_seq_num;
     QLIST_HEAD(outstanding_aio_head, AIOReq) outstanding_aio_head;
-} BDRVSheepdogState;
+};
 
 static const char * sd_strerror(int err)
 {
@@ -358,6 +380,14 @@ static const char * sd_strerror(int err)
  *    the write request to the vdi object in sd_write_done, the write
  *    completion function.  The AIOCB callback is not called until all
  *    the requests belonging to the AIOCB are finished.
+ *
+ * There are SD_NR_CONNECTIONS connections to the sheep, so that the
+ * requests to the objects of one AIOCB are served in parallel.  Each
+ * request goes on the connection expected to answer first, from the
+ * requests in flight on it and its response time so far.
+ *
+ * Writes to an object being created wait for the creation to finish;
+ * those that are contiguous then go in a single request.
  */
 
 static inline AIOReq *alloc_aio_req(BDRVSheepdogState *s, SheepdogAIOCB *acb,
@@ -376,6 +406,9 @@ static inline AIOReq *alloc_aio_req(BDRVSheepdogState *s, SheepdogAIOCB *acb,
     aio_req->data_len = data_len;
     aio_req->flags = flags;
     aio_req->id = s->aioreq_seq_num++;
+    aio_req->conn = NULL;
+    QSIMPLEQ_INIT(&aio_req->merged_head);
+    aio_req->leader = NULL;
 
     QLIST_INSERT_HEAD(&s->outstanding_aio_head, aio_req,
                       outstanding_aio_siblings);
@@ -387,6 +420,7 @@ static inline AIOReq *alloc_aio_req(BDRVSheepdogState *s, SheepdogAIOCB *acb,
 static inline int free_aio_req(BDRVSheepdogState *s, AIOReq *aio_req)
 {
     SheepdogAIOCB *acb = aio_req->aiocb;
+
     QLIST_REMOVE(aio_req, outstanding_aio_siblings);
     QLIST_REMOVE(aio_req, aioreq_siblings);
     qemu_free(aio_req);
@@ -748,34 +782,91 @@ static int add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
                            struct iovec *iov, int niov, int create,
                            enum AIOCBState aiocb_type);
 
+/* A request to the object `oid' waiting for another one to finish */
+static AIOReq *find_pending_req(BDRVSheepdogState *s, uint64_t oid,
+                                uint32_t id)
+{
+    AIOReq *aio_req;
+
+    QLIST_FOREACH(aio_req, &s->outstanding_aio_head, outstanding_aio_siblings) {
+        if (aio_req->id != id && aio_req->oid == oid && !aio_req->conn &&
+            !aio_req->leader) {
+            return aio_req;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Merge the pending writes that go on where aio_req ends into it, so
+ * that they are sent as one request.
+ */
+static void merge_pending_req(BDRVSheepdogState *s, AIOReq *aio_req)
+{
+    uint64_t end = aio_req->offset + aio_req->data_len;
+    AIOReq *m;
+
+    if (aio_req->aiocb->aiocb_type != AIOCB_WRITE_UDATA) {
+        return;
+    }
+again:
+    QLIST_FOREACH(m, &s->outstanding_aio_head, outstanding_aio_siblings) {
+        if (m != aio_req && m->oid == aio_req->oid && !m->conn &&
+            !m->leader && m->offset == end &&
+            m->aiocb->aiocb_type == AIOCB_WRITE_UDATA) {
+            m->leader = aio_req;
+            QSIMPLEQ_INSERT_TAIL(&aio_req->merged_head, m, merged_siblings);
+            end += m->data_len;
+            goto again;
+        }
+    }
+}
+
+/*
+ * Free aio_req and the requests merged into it, and complete the AIOCBs
+ * with nothing left in flight, with sd_finish_aiocb() if finish is set.
+ */
+static void complete_aio_req(BDRVSheepdogState *s, AIOReq *aio_req, int ret,
+                             int finish)
+{
+    SheepdogAIOCB *acb = aio_req->aiocb;
+    AIOReq *m;
+
+    while ((m = QSIMPLEQ_FIRST(&aio_req->merged_head)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&aio_req->merged_head, merged_siblings);
+        complete_aio_req(s, m, ret, finish);
+    }
+
+    if (ret < 0) {
+        acb->ret = ret;
+    }
+    if (!free_aio_req(s, aio_req)) {
+        if (finish) {
+            sd_finish_aiocb(acb);
+        } else {
+            acb->aio_done_func(acb);
+        }
+    }
+}
+
 /*
  * This function searchs pending requests to the object `oid', and
  * sends them.
  */
 static void send_pending_req(BDRVSheepdogState *s, uint64_t oid, uint32_t id)
 {
-    AIOReq *aio_req, *next;
+    AIOReq *aio_req;
     SheepdogAIOCB *acb;
     int ret;
 
-    QLIST_FOREACH_SAFE(aio_req, &s->outstanding_aio_head,
-                       outstanding_aio_siblings, next) {
-        if (id == aio_req->id) {
-            continue;
-        }
-        if (aio_req->oid != oid) {
-            continue;
-        }
-
+    while ((aio_req = find_pending_req(s, oid, id)) != NULL) {
         acb = aio_req->aiocb;
+        merge_pending_req(s, aio_req);
         ret = add_aio_request(s, aio_req, acb->qiov->iov,
                               acb->qiov->niov, 0, acb->aiocb_type);
         if (ret < 0) {
             error_report("add_aio_request is failed\n");
-            free_aio_req(s, aio_req);
-            if (QLIST_EMPTY(&acb->aioreq_head)) {
-                sd_finish_aiocb(acb);
-            }
+            complete_aio_req(s, aio_req, -EIO, 1);
         }
     }
 }
@@ -784,20 +875,21 @@ static void send_pending_req(BDRVSheepdogState *s, uint64_t oid, uint32_t id)
  * Receive responses of the I/O requests.
  *
  * This function is registered as a fd handler, and called from the
- * main loop when s->fd is ready for reading responses.
+ * main loop when a connection is ready for reading responses.
  */
 static void aio_read_response(void *opaque)
 {
     SheepdogObjRsp rsp;
-    BDRVSheepdogState *s = opaque;
-    int fd = s->fd;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
+    int fd = conn->fd;
     int ret;
     AIOReq *aio_req = NULL;
     SheepdogAIOCB *acb;
-    int rest;
     unsigned long idx;
+    int64_t latency;
 
-    if (QLIST_EMPTY(&s->outstanding_aio_head)) {
+    if (!conn->nr_inflight) {
         return;
     }
 
@@ -821,6 +913,10 @@ static void aio_read_response(void *opaque)
 
     acb = aio_req->aiocb;
 
+    conn->nr_inflight--;
+    latency = qemu_get_clock_ns(rt_clock) - aio_req->sent;
+    conn->latency = conn->latency ? (conn->latency * 7 + latency) / 8 : latency;
+
     switch (acb->aiocb_type) {
     case AIOCB_WRITE_UDATA:
         if (!is_data_obj(aio_req->oid)) {
@@ -858,25 +954,21 @@ static void aio_read_response(void *opaque)
     }
 
     if (rsp.result != SD_RES_SUCCESS) {
-        acb->ret = -EIO;
         error_report("%s\n", sd_strerror(rsp.result));
     }
 
-    rest = free_aio_req(s, aio_req);
-    if (!rest) {
-        /*
-         * We've finished all requests which belong to the AIOCB, so
-         * we can call the callback now.
-         */
-        acb->aio_done_func(acb);
-    }
+    /*
+     * The callbacks of the AIOCBs are called once all their requests
+     * are finished.
+     */
+    complete_aio_req(s, aio_req, rsp.result == SD_RES_SUCCESS ? 0 : -EIO, 0);
 }
 
 static int aio_flush_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    return !QLIST_EMPTY(&s->outstanding_aio_head);
+    return conn->nr_inflight > 0;
 }
 
 #if !defined(SOL_TCP) || !defined(TCP_CORK)
@@ -910,8 +1002,9 @@ static int set_nodelay(int fd)
  * We cannot use this discriptor for other operations because
  * the block driver may be on waiting response from the server.
  */
-static int get_sheep_fd(BDRVSheepdogState *s)
+static int get_sheep_fd(SheepdogConn *conn)
 {
+    BDRVSheepdogState *s = conn->s;
     int ret, fd;
 
     fd = connect_to_sdog(s->addr, s->port);
@@ -930,10 +1023,58 @@ static int get_sheep_fd(BDRVSheepdogState *s)
     }
 
     qemu_aio_set_fd_handler(fd, aio_read_response, NULL, aio_flush_request,
-                            NULL, s);
+                            NULL, conn);
     return fd;
 }
 
+static void close_sheep_fds(BDRVSheepdogState *s)
+{
+    int i;
+
+    for (i = 0; i < SD_NR_CONNECTIONS; i++) {
+        if (s->conns[i].fd >= 0) {
+            qemu_aio_set_fd_handler(s->conns[i].fd, NULL, NULL, NULL, NULL,
+                                    NULL);
+            closesocket(s->conns[i].fd);
+            s->conns[i].fd = -1;
+        }
+    }
+}
+
+static int get_sheep_fds(BDRVSheepdogState *s)
+{
+    int i;
+
+    for (i = 0; i < SD_NR_CONNECTIONS; i++) {
+        s->conns[i].s = s;
+        s->conns[i].nr_inflight = 0;
+        s->conns[i].latency = 0;
+        s->conns[i].fd = get_sheep_fd(&s->conns[i]);
+        if (s->conns[i].fd < 0) {
+            close_sheep_fds(s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The connection expected to answer a new request first */
+static SheepdogConn *pick_sheep_conn(BDRVSheepdogState *s)
+{
+    SheepdogConn *best = &s->conns[0];
+    int i;
+
+    for (i = 1; i < SD_NR_CONNECTIONS; i++) {
+        SheepdogConn *conn = &s->conns[i];
+
+        if ((conn->nr_inflight + 1) * MAX(conn->latency, 1) <
+            (best->nr_inflight + 1) * MAX(best->latency, 1)) {
+            best = conn;
+        }
+    }
+    return best;
+}
+
 /*
  * Parse a filename
  *
@@ -1066,11 +1207,28 @@ static int add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
     uint64_t offset = aio_req->offset;
     uint8_t flags = aio_req->flags;
     uint64_t old_oid = aio_req->base_oid;
+    unsigned int iov_offset = aio_req->iov_offset;
+    SheepdogConn *conn = pick_sheep_conn(s);
+    QEMUIOVector merged;
+    AIOReq *m;
 
     if (!nr_copies) {
         error_report("bug\n");
     }
 
+    if (!QSIMPLEQ_EMPTY(&aio_req->merged_head)) {
+        qemu_iovec_init(&merged, niov * 2);
+        qemu_iovec_copy(&merged, aio_req->aiocb->qiov, iov_offset, datalen);
+        QSIMPLEQ_FOREACH(m, &aio_req->merged_head, merged_siblings) {
+            qemu_iovec_copy(&merged, m->aiocb->qiov, m->iov_offset,
+                            m->data_len);
+            datalen += m->data_len;
+        }
+        iov = merged.iov;
+        niov = merged.niov;
+        iov_offset = 0;
+    }
+
     memset(&hdr, 0, sizeof(hdr));
 
     if (aiocb_type == AIOCB_READ_UDATA) {
@@ -1096,26 +1254,39 @@ static int add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 
     hdr.id = aio_req->id;
 
-    set_cork(s->fd, 1);
+    set_cork(conn->fd, 1);
 
     /* send a header */
-    ret = do_write(s->fd, &hdr, sizeof(hdr));
+    ret = do_write(conn->fd, &hdr, sizeof(hdr));
     if (ret) {
         error_report("failed to send a req, %s\n", strerror(errno));
-        return -EIO;
+        ret = -EIO;
+        goto out;
     }
 
     if (wlen) {
-        ret = do_writev(s->fd, iov, wlen, aio_req->iov_offset);
+        ret = do_writev(conn->fd, iov, wlen, iov_offset);
         if (ret) {
             error_report("failed to send a data, %s\n", strerror(errno));
-            return -EIO;
+            ret = -EIO;
+            goto out;
         }
     }
 
-    set_cork(s->fd, 0);
+    set_cork(conn->fd, 0);
 
-    return 0;
+    aio_req->conn = conn;
+    aio_req->sent = qemu_get_clock_ns(rt_clock);
+    QSIMPLEQ_FOREACH(m, &aio_req->merged_head, merged_siblings) {
+        m->conn = conn;
+    }
+    conn->nr_inflight++;
+    ret = 0;
+out:
+    if (!QSIMPLEQ_EMPTY(&aio_req->merged_head)) {
+        qemu_iovec_destroy(&merged);
+    }
+    return ret;
 }
 
 static int read_write_object(int fd, char *buf, uint64_t oid, int copies,
@@ -1177,7 +1348,7 @@ static int write_object(int fd, char *buf, uint64_t oid, int copies,
 
 static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 {
-    int ret, fd;
+    int ret, fd, i;
     uint32_t vid = 0;
     BDRVSheepdogState *s = bs->opaque;
     char vdi[SD_MAX_VDI_LEN], tag[SD_MAX_VDI_TAG_LEN];
@@ -1187,15 +1358,16 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
     strstart(filename, "sheepdog:", (const char **)&filename);
 
     QLIST_INIT(&s->outstanding_aio_head);
-    s->fd = -1;
+    for (i = 0; i < SD_NR_CONNECTIONS; i++) {
+        s->conns[i].fd = -1;
+    }
 
     memset(vdi, 0, sizeof(vdi));
     memset(tag, 0, sizeof(tag));
     if (parse_vdiname(s, filename, vdi, &snapid, tag) < 0) {
         goto out;
     }
-    s->fd = get_sheep_fd(s);
-    if (s->fd < 0) {
+    if (get_sheep_fds(s) < 0) {
         goto out;
     }
 
@@ -1233,10 +1405,7 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
     qemu_free(buf);
     return 0;
 out:
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL, NULL);
-    if (s->fd >= 0) {
-        closesocket(s->fd);
-    }
+    close_sheep_fds(s);
     qemu_free(buf);
     return -1;
 }
@@ -1387,8 +1556,7 @@ static void sd_close(BlockDriverState *bs)
         error_report("%s, %s\n", sd_strerror(rsp->result), s->name);
     }
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL, NULL);
-    closesocket(s->fd);
+    close_sheep_fds(s);
     qemu_free(s->addr);
 }
 
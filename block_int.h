@@ -27,9 +27,32 @@
 #include "block.h"
 #include "qemu-option.h"
 #include "qemu-queue.h"
+#include "block-cache.h"
 
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPAT6	4
+#define BLOCK_FLAG_LAZY_REFCOUNTS	8
+
+/* I/O limits allow bursts of what they let through in that time */
+#define BLOCK_IO_LIMITS_SLICE_NS 100000000LL
+
+/* Request latency in log2 nanosecond buckets, and the requests in flight
+   that each new one finds, in log2 buckets too */
+#define BDRV_LATENCY_BUCKETS    40
+#define BDRV_DEPTH_BUCKETS      16
+
+enum {
+    BDRV_ACCT_READ,
+    BDRV_ACCT_WRITE,
+    BDRV_ACCT_FLUSH,
+    BDRV_MAX_ACCT,
+};
+
+typedef struct BlockLatencyStats {
+    uint64_t count;
+    uint64_t total_ns;
+    uint32_t buckets[BDRV_LATENCY_BUCKETS];
+} BlockLatencyStats;
 
 #define BLOCK_OPT_SIZE          "size"
 #define BLOCK_OPT_ENCRYPT       "encryption"
@@ -39,6 +62,7 @@
 #define BLOCK_OPT_CLUSTER_SIZE  "cluster_size"
 #define BLOCK_OPT_TABLE_SIZE    "table_size"
 #define BLOCK_OPT_PREALLOC      "preallocation"
+#define BLOCK_OPT_LAZY_REFCOUNTS "lazy_refcounts"
 
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
@@ -81,12 +105,23 @@ struct BlockDriver {
     int (*bdrv_merge_requests)(BlockDriverState *bs, BlockRequest* a,
         BlockRequest *b);
 
+    /* Batch the requests submitted in between, see bdrv_io_plug() */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /* bdrv_write_compressed() in two steps, see bdrv_compress_cluster() */
+    int (*bdrv_compress_cluster)(BlockDriverState *bs, const uint8_t *buf,
+                                 uint8_t *out_buf);
+    int (*bdrv_write_compressed_cluster)(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         const uint8_t *buf,
+                                         const uint8_t *out_buf, int out_len);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -103,6 +138,8 @@ struct BlockDriver {
                              int64_t pos, int size);
     int (*bdrv_load_vmstate)(BlockDriverState *bs, uint8_t *buf,
                              int64_t pos, int size);
+    int64_t (*bdrv_map_vmstate)(BlockDriverState *bs, int64_t pos,
+                                int64_t size, int64_t *file_offset);
 
     int (*bdrv_change_backing_file)(BlockDriverState *bs,
         const char *backing_file, const char *backing_fmt);
@@ -137,6 +174,25 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Returns a host file descriptor that holds the data of the image as
+     * is, from offset 0, for zero copy I/O; -errno if there is none.
+     */
+    int (*bdrv_get_fd)(BlockDriverState *bs);
+
+    /*
+     * Fills extents with the state of the sectors from sector_num on, see
+     * bdrv_get_block_map().  Drivers add the extents in order with
+     * bdrv_block_map_add() and only need to set BDRV_EXTENT_ZERO on
+     * allocated sectors.
+     */
+    int (*bdrv_get_block_map)(BlockDriverState *bs, int64_t sector_num,
+                              int64_t nb_sectors, BlockExtent *extents,
+                              int max_extents);
+
+    /* Adds statistics of the format to the stats of "info blockstats" */
+    void (*bdrv_get_stats)(BlockDriverState *bs, QDict *stats);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -180,8 +236,43 @@ struct BlockDriverState {
     uint64_t wr_bytes;
     uint64_t rd_ops;
     uint64_t wr_ops;
+    uint64_t rd_merged;
+    uint64_t wr_merged;
     uint64_t wr_highest_sector;
 
+    /* Time from bdrv_aio_* to the completion, for devices only */
+    BlockLatencyStats latency[BDRV_MAX_ACCT];
+    uint32_t queue_depth[BDRV_DEPTH_BUCKETS];
+    int in_flight;
+
+    /* I/O limits, as token buckets drained at the limit rate; requests
+       wait in the queue of their direction while a bucket is full */
+    BlockIOLimit io_limits;
+    int io_limits_enabled;
+    double bps_level[2];
+    double iops_level[2];
+    int64_t io_limits_time;     /* rt_clock ns of the last drain */
+    QEMUTimer *io_limits_timer;
+    QTAILQ_HEAD(, BdrvThrottledAIOCB) throttled_reqs[2];
+
+    /* Request merging: guest requests queue up until the end of the main
+       loop iteration or the last bdrv_io_unplug(), then go out sorted and
+       merged */
+    int elevator_enabled;
+    int io_plugged;
+    int elevator_queued;
+    QEMUBH *elevator_bh;
+    QTAILQ_HEAD(, BdrvElevatorAIOCB) elevator_reqs;
+
+    /* Copy on read, see bdrv_enable_copy_on_read(); the requests are
+       tracked in the order they came in */
+    int copy_on_read;
+    int cor_cluster_sectors;
+    QTAILQ_HEAD(BdrvCorAIOCBHead, BdrvCorAIOCB) cor_reqs;
+
+    /* Read only backing files, with -backing-cache */
+    BlockCacheImage *read_cache;
+
     /* Whether the disk can expand beyond total_sectors */
     int growable;
 
@@ -191,6 +282,9 @@ struct BlockDriverState {
     /* do we need to tell the quest if we have a volatile write cache? */
     int enable_write_cache;
 
+    /* bytes the format may cache its metadata in, 0 to let it choose */
+    int64_t metadata_cache_size;
+
     /* NOTE: the following infos are only hints for real hardware
        drivers. They are not used by the block driver */
     int cyls, heads, secs, translation;
@@ -199,7 +293,8 @@ struct BlockDriverState {
     char device_name[32];
     unsigned long *dirty_bitmap;
     int64_t dirty_count;
-    int in_use; /* users other than guest access, eg. block migration */
+    int in_use; /* users other than guest access, eg. block migration and
+                   streaming */
     QTAILQ_ENTRY(BlockDriverState) list;
     void *private;
 };
@@ -223,6 +318,9 @@ void qemu_aio_release(void *p);
 
 void *qemu_blockalign(BlockDriverState *bs, size_t size);
 
+int bdrv_block_map_add(BlockExtent *extents, int *nb_extents, int max_extents,
+                       int64_t sector_num, int64_t nb_sectors, int flags);
+
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
 #endif
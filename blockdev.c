@@ -237,6 +237,10 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     int snapshot = 0;
+    BlockIOLimit io_limits;
+    int64_t metadata_cache_size;
+    int elevator;
+    int copy_on_read;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -367,6 +371,14 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         }
     }
 
+    io_limits.bps[0] = qemu_opt_get_size(opts, "bps_rd", 0);
+    io_limits.bps[1] = qemu_opt_get_size(opts, "bps_wr", 0);
+    io_limits.iops[0] = qemu_opt_get_number(opts, "iops_rd", 0);
+    io_limits.iops[1] = qemu_opt_get_number(opts, "iops_wr", 0);
+    metadata_cache_size = qemu_opt_get_size(opts, "metadata_cache_size", 0);
+    elevator = qemu_opt_get_bool(opts, "elevator", 0);
+    copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", 0);
+
     on_write_error = BLOCK_ERR_STOP_ENOSPC;
     if ((buf = qemu_opt_get(opts, "werror")) != NULL) {
         if (type != IF_IDE && type != IF_SCSI && type != IF_VIRTIO && type != IF_NONE) {
@@ -473,6 +485,12 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+    bdrv_set_metadata_cache_size(dinfo->bdrv, metadata_cache_size);
+    bdrv_set_elevator(dinfo->bdrv, elevator);
+    if (copy_on_read) {
+        bdrv_enable_copy_on_read(dinfo->bdrv);
+    }
 
     switch(type) {
     case IF_IDE:
@@ -615,7 +633,7 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
 
     flags = bs->open_flags;
@@ -638,6 +656,10 @@ out:
 
 static int eject_device(Monitor *mon, BlockDriverState *bs, int force)
 {
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, bdrv_get_device_name(bs));
+        return -1;
+    }
     if (!force) {
         if (!bdrv_is_removable(bs)) {
             qerror_report(QERR_DEVICE_NOT_REMOVABLE,
@@ -740,7 +762,7 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     }
 
     /* quiesce block driver; prevent further io */
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
     bdrv_close(bs);
 
@@ -770,6 +792,44 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
  * existing QERR_ macro mess is cleaned up.  A good example for better
  * error reports can be found in the qemu-img resize code.
  */
+static int get_io_limit(const QDict *qdict, const char *name,
+                        uint64_t *limit)
+{
+    int64_t value = qdict_get_int(qdict, name);
+
+    if (value < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, name,
+                      "a non-negative value");
+        return -1;
+    }
+    *limit = value;
+    return 0;
+}
+
+int do_block_set_io_throttle(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockIOLimit io_limits;
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    if (get_io_limit(qdict, "bps_rd", &io_limits.bps[0]) < 0 ||
+        get_io_limit(qdict, "bps_wr", &io_limits.bps[1]) < 0 ||
+        get_io_limit(qdict, "iops_rd", &io_limits.iops[0]) < 0 ||
+        get_io_limit(qdict, "iops_wr", &io_limits.iops[1]) < 0) {
+        return -1;
+    }
+
+    bdrv_set_io_limits(bs, &io_limits);
+    return 0;
+}
+
 int do_block_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     const char *device = qdict_get_str(qdict, "device");
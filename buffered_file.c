@@ -17,12 +17,17 @@
 #include "sysemu.h"
 #include "qemu-char.h"
 #include "buffered_file.h"
+#include "iov.h"
+#ifdef CONFIG_THREAD
+#include "qemu-thread.h"
+#endif
 
 //#define DEBUG_BUFFERED_FILE
 
 typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
+    BufferedWritevFunc *writev_buffer;
     BufferedPutReadyFunc *put_ready;
     BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
     BufferedCloseFunc *close;
@@ -36,6 +41,18 @@ typedef struct QEMUFileBuffered
     size_t buffer_size;
     size_t buffer_capacity;
     QEMUTimer *timer;
+#ifdef CONFIG_THREAD
+    /* With a writer, the buffer is drained to the backend by a thread of
+       its own with blocking writes, so the main loop never waits for the
+       network.  lock protects the buffer and the fields below. */
+    BufferedPutFunc *write;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    size_t in_flight;           /* bytes taken by the thread, not written */
+    bool quit;
+    bool write_error;
+#endif
 } QEMUFileBuffered;
 
 #ifdef DEBUG_BUFFERED_FILE
@@ -107,6 +124,91 @@ static void buffered_flush(QEMUFileBuffered *s)
     s->buffer_size -= offset;
 }
 
+#ifdef CONFIG_THREAD
+static void *buffered_writer_thread(void *opaque)
+{
+    QEMUFileBuffered *s = opaque;
+    uint8_t *out = NULL;
+    size_t out_capacity = 0;
+    uint8_t *full;
+    size_t size, capacity;
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->buffer_size && !s->quit) {
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+        if (!s->buffer_size || s->write_error) {
+            break;
+        }
+
+        /* Take the whole buffer, the main loop starts refilling an empty
+           one */
+        full = s->buffer;
+        size = s->buffer_size;
+        capacity = s->buffer_capacity;
+        s->buffer = out;
+        s->buffer_size = 0;
+        s->buffer_capacity = out_capacity;
+        out = full;
+        out_capacity = capacity;
+        s->in_flight = size;
+        qemu_mutex_unlock(&s->lock);
+
+        DPRINTF("writer flushing %zu byte(s)\n", size);
+        if (s->write(s->opaque, out, size) != (ssize_t)size) {
+            DPRINTF("writer error\n");
+            qemu_mutex_lock(&s->lock);
+            s->write_error = true;
+            break;
+        }
+
+        qemu_mutex_lock(&s->lock);
+        s->in_flight = 0;
+    }
+    s->in_flight = 0;
+    qemu_mutex_unlock(&s->lock);
+
+    qemu_free(out);
+    return NULL;
+}
+
+static int buffered_put_buffer_threaded(QEMUFileBuffered *s,
+                                        const struct iovec *iov, int iovcnt)
+{
+    int i, size = iov_size(iov, iovcnt);
+
+    qemu_mutex_lock(&s->lock);
+    if (s->write_error) {
+        s->has_error = 1;
+    }
+    if (!s->has_error) {
+        for (i = 0; i < iovcnt; i++) {
+            buffered_append(s, iov[i].iov_base, iov[i].iov_len);
+        }
+        qemu_cond_signal(&s->cond);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    if (s->has_error) {
+        return -EINVAL;
+    }
+    s->bytes_xfer += size;
+    return size;
+}
+
+/* Bytes queued for the writer, from the main loop */
+static size_t buffered_backlog(QEMUFileBuffered *s)
+{
+    size_t backlog;
+
+    qemu_mutex_lock(&s->lock);
+    backlog = s->buffer_size + s->in_flight;
+    qemu_mutex_unlock(&s->lock);
+    return backlog;
+}
+#endif
+
 static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileBuffered *s = opaque;
@@ -120,6 +222,14 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
         return -EINVAL;
     }
 
+#ifdef CONFIG_THREAD
+    if (s->write) {
+        struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+
+        return buffered_put_buffer_threaded(s, &iov, 1);
+    }
+#endif
+
     DPRINTF("unfreezing output\n");
     s->freeze_output = 0;
 
@@ -167,6 +277,65 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
     return offset;
 }
 
+/* Sends what it can straight from the caller's memory, and only copies
+   what the backend did not take */
+static int buffered_writev_buffer(void *opaque, struct iovec *iov,
+                                  int iovcnt, int64_t pos)
+{
+    QEMUFileBuffered *s = opaque;
+    unsigned int cnt = iovcnt;
+    int size = iov_size(iov, iovcnt);
+    unsigned int i;
+    ssize_t ret;
+
+    DPRINTF("putting %d bytes in %d pieces at %" PRId64 "\n",
+            size, iovcnt, pos);
+
+    if (s->has_error) {
+        DPRINTF("flush when error, bailing\n");
+        return -EINVAL;
+    }
+
+#ifdef CONFIG_THREAD
+    if (s->write) {
+        return buffered_put_buffer_threaded(s, iov, iovcnt);
+    }
+#endif
+
+    s->freeze_output = 0;
+
+    buffered_flush(s);
+
+    while (!s->freeze_output && cnt) {
+        if (s->bytes_xfer > s->xfer_limit) {
+            DPRINTF("transfer limit exceeded when putting\n");
+            break;
+        }
+
+        ret = s->writev_buffer(s->opaque, iov, cnt);
+        if (ret == -EAGAIN) {
+            DPRINTF("backend not ready, freezing\n");
+            s->freeze_output = 1;
+            break;
+        }
+
+        if (ret <= 0) {
+            DPRINTF("error putting\n");
+            s->has_error = 1;
+            return -EINVAL;
+        }
+
+        DPRINTF("put %zd byte(s)\n", ret);
+        iov_skip(&iov, &cnt, ret);
+        s->bytes_xfer += ret;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        buffered_append(s, iov[i].iov_base, iov[i].iov_len);
+    }
+    return size;
+}
+
 static int buffered_close(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -174,6 +343,22 @@ static int buffered_close(void *opaque)
 
     DPRINTF("closing\n");
 
+#ifdef CONFIG_THREAD
+    if (s->write) {
+        /* The thread exits once the buffer is drained */
+        qemu_mutex_lock(&s->lock);
+        s->quit = true;
+        qemu_cond_signal(&s->cond);
+        qemu_mutex_unlock(&s->lock);
+        qemu_thread_join(&s->thread);
+        if (s->write_error) {
+            s->has_error = 1;
+        }
+        qemu_cond_destroy(&s->cond);
+        qemu_mutex_destroy(&s->lock);
+    }
+#endif
+
     while (!s->has_error && s->buffer_size) {
         buffered_flush(s);
         if (s->freeze_output)
@@ -181,6 +366,11 @@ static int buffered_close(void *opaque)
     }
 
     ret = s->close(s->opaque);
+#ifdef CONFIG_THREAD
+    if (s->write && s->has_error && ret == 0) {
+        ret = -EIO;
+    }
+#endif
 
     qemu_del_timer(s->timer);
     qemu_free_timer(s->timer);
@@ -203,6 +393,12 @@ static int buffered_rate_limit(void *opaque)
     if (s->bytes_xfer > s->xfer_limit)
         return 1;
 
+#ifdef CONFIG_THREAD
+    /* Do not queue more than a tick's worth of data for the writer */
+    if (s->write && buffered_backlog(s) > s->xfer_limit)
+        return 1;
+#endif
+
     return 0;
 }
 
@@ -233,6 +429,26 @@ static void buffered_rate_tick(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
 
+#ifdef CONFIG_THREAD
+    if (s->write) {
+        bool write_error;
+
+        qemu_mutex_lock(&s->lock);
+        write_error = s->write_error;
+        qemu_mutex_unlock(&s->lock);
+
+        qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + 100);
+        if (write_error) {
+            /* Let the client notice and close the file */
+            s->has_error = 1;
+            qemu_file_set_error(s->file);
+        }
+        s->bytes_xfer = 0;
+        s->put_ready(s->opaque);
+        return;
+    }
+#endif
+
     if (s->has_error) {
         buffered_close(s);
         return;
@@ -251,9 +467,18 @@ static void buffered_rate_tick(void *opaque)
     s->put_ready(s->opaque);
 }
 
+/* If write, a blocking version of put_buffer that can be called from any
+   thread, is given and threads are available, the buffer is drained by a
+   writer thread.  Write errors are then reported through the file, that
+   put_ready should check.  writev_buffer, if given, is put_buffer for
+   scattered data; RAM pages put with qemu_put_buffer_ref() are then only
+   copied when the backend cannot take them right away, or into the writer
+   thread's buffer. */
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                                   size_t bytes_per_sec,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev_buffer,
+                                  BufferedPutFunc *write,
                                   BufferedPutReadyFunc *put_ready,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close)
@@ -265,6 +490,7 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s->opaque = opaque;
     s->xfer_limit = bytes_per_sec / 10;
     s->put_buffer = put_buffer;
+    s->writev_buffer = writev_buffer;
     s->put_ready = put_ready;
     s->wait_for_unfreeze = wait_for_unfreeze;
     s->close = close;
@@ -273,9 +499,21 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                              buffered_close, buffered_rate_limit,
                              buffered_set_rate_limit,
 			     buffered_get_rate_limit);
+    if (writev_buffer) {
+        qemu_file_set_writev(s->file, buffered_writev_buffer);
+    }
 
     s->timer = qemu_new_timer(rt_clock, buffered_rate_tick, s);
 
+#ifdef CONFIG_THREAD
+    if (write) {
+        s->write = write;
+        qemu_mutex_init(&s->lock);
+        qemu_cond_init(&s->cond);
+        qemu_thread_create(&s->thread, buffered_writer_thread, s);
+    }
+#endif
+
     qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + 100);
 
     return s->file;
@@ -46,19 +46,53 @@ START_TEST(qdict_put_obj_test)
 
     qdict = qdict_new();
 
-    // key "" will have tdb hash 12345
     qdict_put_obj(qdict, "", QOBJECT(qint_from_int(num)));
 
     fail_unless(qdict_size(qdict) == 1);
-    ent = QLIST_FIRST(&qdict->table[12345 % QDICT_BUCKET_MAX]);
+    ent = &qdict->entries[0];
+    fail_unless(strcmp(ent->key, "") == 0);
     qi = qobject_to_qint(ent->value);
     fail_unless(qint_get_int(qi) == num);
 
-    // destroy doesn't exit yet
-    QDECREF(qi);
-    qemu_free(ent->key);
-    qemu_free(ent);
-    qemu_free(qdict);
+    QDECREF(qdict);
+}
+END_TEST
+
+START_TEST(qdict_grow_test)
+{
+    QDict *qdict;
+    const QDictEntry *ent;
+    char key[16];
+    int i;
+
+    qdict = qdict_new();
+
+    /* past the inline entries, so that the dict gets an index */
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        qdict_put(qdict, key, qint_from_int(i));
+    }
+    fail_unless(qdict_size(qdict) == 100);
+    fail_unless(qdict->index != NULL);
+
+    for (i = 0; i < 100; i += 2) {
+        snprintf(key, sizeof(key), "key%d", i);
+        qdict_del(qdict, key);
+    }
+    fail_unless(qdict_size(qdict) == 50);
+
+    /* the rest is still there, in insertion order */
+    i = 1;
+    for (ent = qdict_first(qdict); ent; ent = qdict_next(qdict, ent)) {
+        snprintf(key, sizeof(key), "key%d", i);
+        fail_unless(strcmp(qdict_entry_key(ent), key) == 0);
+        fail_unless(qdict_get_int(qdict, key) == i);
+        i += 2;
+    }
+    fail_unless(i == 101);
+    fail_unless(qdict_haskey(qdict, "key0") == 0);
+
+    QDECREF(qdict);
 }
 END_TEST
 
@@ -353,6 +387,7 @@ static Suite *qdict_suite(void)
     suite_add_tcase(s, qdict_public_tcase);
     tcase_add_test(qdict_public_tcase, qdict_new_test);
     tcase_add_test(qdict_public_tcase, qdict_put_obj_test);
+    tcase_add_test(qdict_public_tcase, qdict_grow_test);
     tcase_add_test(qdict_public_tcase, qdict_destroy_simple_test);
 
     /* Continue, but now with fixtures */
@@ -24,6 +24,7 @@
 #include "qemu-common.h"
 #include "console.h"
 #include "qemu-timer.h"
+#include "qemu-option.h"
 
 //#define DEBUG_CONSOLE
 #define DEFAULT_BACKSCROLL 512
@@ -1580,6 +1581,143 @@ void qemu_console_copy(DisplayState *ds, int src_x, int src_y,
     }
 }
 
+/***********************************************************/
+/* display refresh pacing */
+
+#define DISPLAY_REFRESH_INC 50
+
+struct DisplayRefresh {
+    QEMUTimer *timer;
+    int64_t interval;
+    int64_t last;
+    int idle;
+    QLIST_ENTRY(DisplayRefresh) next;
+};
+
+int display_refresh_fast = GUI_REFRESH_INTERVAL;
+int display_refresh_slow = DISPLAY_REFRESH_SLOW;
+
+static QLIST_HEAD(, DisplayRefresh) display_refreshes =
+    QLIST_HEAD_INITIALIZER(display_refreshes);
+static QEMUBH *display_wakeup_bh;
+
+/* -refresh-rate [min=hz][,max=hz] */
+int display_refresh_set_rates(const char *optarg)
+{
+    char buf[32];
+    double hz;
+
+    if (get_param_value(buf, sizeof(buf), "max", optarg)) {
+        hz = strtod(buf, NULL);
+        if (hz <= 0 || hz > 1000) {
+            fprintf(stderr, "qemu: invalid max refresh rate '%s'\n", buf);
+            return -1;
+        }
+        display_refresh_fast = 1000 / hz;
+    }
+    if (get_param_value(buf, sizeof(buf), "min", optarg)) {
+        hz = strtod(buf, NULL);
+        if (hz < 0 || hz > 1000) {
+            fprintf(stderr, "qemu: invalid min refresh rate '%s'\n", buf);
+            return -1;
+        }
+        display_refresh_slow = hz ? 1000 / hz : 0;
+    }
+    if (display_refresh_slow && display_refresh_slow < display_refresh_fast) {
+        display_refresh_slow = display_refresh_fast;
+    }
+    return 0;
+}
+
+static void display_refresh_wake(DisplayRefresh *r)
+{
+    int64_t now = qemu_get_clock(rt_clock);
+
+    r->idle = 0;
+    r->interval = display_refresh_fast;
+    qemu_mod_timer(r->timer, MAX(now, r->last + r->interval));
+}
+
+/* Keep the dirty-page wakeup armed for as long as anyone is idle.  */
+static void display_refresh_arm(void)
+{
+    DisplayRefresh *r;
+
+    QLIST_FOREACH(r, &display_refreshes, next) {
+        if (r->idle) {
+            cpu_physical_memory_arm_display_wakeup(display_wakeup_bh);
+            return;
+        }
+    }
+    cpu_physical_memory_arm_display_wakeup(NULL);
+}
+
+static void display_refresh_wakeup(void *opaque)
+{
+    DisplayRefresh *r;
+
+    QLIST_FOREACH(r, &display_refreshes, next) {
+        if (r->idle) {
+            display_refresh_wake(r);
+        }
+    }
+}
+
+DisplayRefresh *display_refresh_new(void (*cb)(void *opaque), void *opaque)
+{
+    DisplayRefresh *r = qemu_mallocz(sizeof(*r));
+
+    if (!display_wakeup_bh) {
+        display_wakeup_bh = qemu_bh_new(display_refresh_wakeup, NULL);
+    }
+    r->timer = qemu_new_timer(rt_clock, cb, opaque);
+    r->interval = display_refresh_fast;
+    QLIST_INSERT_HEAD(&display_refreshes, r, next);
+    return r;
+}
+
+void display_refresh_free(DisplayRefresh *r)
+{
+    QLIST_REMOVE(r, next);
+    qemu_del_timer(r->timer);
+    qemu_free_timer(r->timer);
+    qemu_free(r);
+    display_refresh_arm();
+}
+
+/* Something other than guest memory changed (input, a text console):
+ * refresh soon if we were backing off.  */
+void display_refresh_kick(DisplayRefresh *r)
+{
+    if (r->idle) {
+        display_refresh_wake(r);
+        display_refresh_arm();
+    }
+}
+
+/* Called at the end of each refresh pass; active says whether it found
+ * anything to send.  */
+void display_refresh_done(DisplayRefresh *r, int active)
+{
+    r->last = qemu_get_clock(rt_clock);
+    if (active) {
+        r->idle = 0;
+        r->interval = display_refresh_fast;
+    } else {
+        r->idle = 1;
+        r->interval += DISPLAY_REFRESH_INC;
+        if (display_refresh_slow && r->interval > display_refresh_slow) {
+            r->interval = display_refresh_slow;
+        }
+    }
+    if (!r->idle || display_refresh_slow) {
+        qemu_mod_timer(r->timer, r->last + r->interval);
+    } else {
+        qemu_del_timer(r->timer);
+    }
+    display_refresh_arm();
+}
+
 PixelFormat qemu_different_endianness_pixelformat(int bpp)
 {
     PixelFormat pf;
@@ -18,6 +18,7 @@
 
 /* in ms */
 #define GUI_REFRESH_INTERVAL 30
+#define DISPLAY_REFRESH_SLOW 2000
 
 typedef void QEMUPutKBDEvent(void *opaque, int keycode);
 typedef void QEMUPutLEDEvent(void *opaque, int ledstate);
@@ -179,6 +180,11 @@ struct DisplayState {
     struct DisplayAllocator* allocator;
     struct DisplayChangeListener* listeners;
 
+    /* set by display devices whose dpy_update calls only cover pixels
+       the guest really changed (e.g. from guest supplied update rects),
+       so that listeners need not compare the surface themselves */
+    int precise_updates;
+
     void (*mouse_set)(int x, int y, int on);
     void (*cursor_define)(QEMUCursor *cursor);
 
@@ -358,6 +364,22 @@ void qemu_console_resize(DisplayState *ds, int width, int height);
 void qemu_console_copy(DisplayState *ds, int src_x, int src_y,
                        int dst_x, int dst_y, int w, int h);
 
+/* Refresh pacing for displays with no input of their own to poll (VNC).
+ * A pass that found nothing to send backs off towards
+ * display_refresh_slow, and the first guest write to a framebuffer page
+ * scanned since brings the display back to display_refresh_fast at once.
+ * Intervals are in ms; a slow interval of 0 means no polling when idle.  */
+typedef struct DisplayRefresh DisplayRefresh;
+
+extern int display_refresh_fast;
+extern int display_refresh_slow;
+
+int display_refresh_set_rates(const char *optarg);
+DisplayRefresh *display_refresh_new(void (*cb)(void *opaque), void *opaque);
+void display_refresh_free(DisplayRefresh *r);
+void display_refresh_kick(DisplayRefresh *r);
+void display_refresh_done(DisplayRefresh *r, int active);
+
 /* sdl.c */
 void sdl_display_init(DisplayState *ds, int full_screen, int no_frame);
 
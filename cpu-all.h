@@ -759,6 +759,8 @@ int walk_memory_regions(void *, walk_memory_regions_fn);
 
 int page_get_flags(target_ulong address);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
+int page_find_range(target_ulong start, target_ulong end,
+                    target_ulong *range_start, target_ulong *range_end);
 int page_check_range(target_ulong start, target_ulong len, int flags);
 #endif
 
@@ -868,6 +870,7 @@ typedef struct RAMBlock {
     ram_addr_t offset;
     ram_addr_t length;
     char idstr[256];
+    int lazy;                   /* from qemu_ram_alloc_lazy */
     QLIST_ENTRY(RAMBlock) next;
 #if defined(__linux__) && !defined(TARGET_S390X)
     int fd;
@@ -876,6 +879,13 @@ typedef struct RAMBlock {
 
 typedef struct RAMList {
     uint8_t *phys_dirty;
+    /* MIGRATION_DIRTY_FLAG of phys_dirty again, one bit per page, so that
+       migration can skip clean memory 64 pages at a time */
+    uint64_t *migration_dirty;
+    ram_addr_t migration_dirty_pages;
+    /* set while an idle display waits for a page to get VGA_DIRTY_FLAG
+       back; see cpu_physical_memory_arm_display_wakeup() */
+    int display_wakeup;
     QLIST_HEAD(ram, RAMBlock) blocks;
 } RAMList;
 extern RAMList ram_list;
@@ -904,6 +914,7 @@ extern int mem_prealloc;
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
+#define SNAPSHOT_DIRTY_FLAG  0x10
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
@@ -922,17 +933,77 @@ static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
     return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] & dirty_flags;
 }
 
+static inline void cpu_physical_memory_set_migration_dirty(ram_addr_t addr)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    uint64_t *word = &ram_list.migration_dirty[page / 64];
+    uint64_t bit = 1ULL << (page % 64);
+
+    if (!(*word & bit)) {
+        *word |= bit;
+        ram_list.migration_dirty_pages++;
+    }
+}
+
+static inline void cpu_physical_memory_clear_migration_dirty(ram_addr_t addr)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+    uint64_t *word = &ram_list.migration_dirty[page / 64];
+    uint64_t bit = 1ULL << (page % 64);
+
+    if (*word & bit) {
+        *word &= ~bit;
+        ram_list.migration_dirty_pages--;
+    }
+}
+
+void cpu_physical_memory_display_wakeup(void);
+
+/* Only pages a display has scanned and cleaned lack VGA_DIRTY_FLAG, so
+   the first write to one of them means there is something to draw.  */
+static inline void cpu_physical_memory_check_display_wakeup(ram_addr_t addr,
+                                                            int dirty_flags)
+{
+    if (unlikely(ram_list.display_wakeup) && (dirty_flags & VGA_DIRTY_FLAG) &&
+        !(ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] & VGA_DIRTY_FLAG)) {
+        cpu_physical_memory_display_wakeup();
+    }
+}
+
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
+    cpu_physical_memory_check_display_wakeup(addr, VGA_DIRTY_FLAG);
+    cpu_physical_memory_set_migration_dirty(addr);
     ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
 }
 
 static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
                                                       int dirty_flags)
 {
+    cpu_physical_memory_check_display_wakeup(addr, dirty_flags);
+    if (dirty_flags & MIGRATION_DIRTY_FLAG) {
+        cpu_physical_memory_set_migration_dirty(addr);
+    }
     return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
 }
 
+static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
+                                                       ram_addr_t length,
+                                                       int dirty_flags)
+{
+    ram_addr_t page, end;
+
+    end = (start + length + TARGET_PAGE_SIZE - 1) >> TARGET_PAGE_BITS;
+    for (page = start >> TARGET_PAGE_BITS; page < end; page++) {
+        ram_list.phys_dirty[page] |= dirty_flags;
+    }
+    if (dirty_flags & MIGRATION_DIRTY_FLAG) {
+        for (page = start >> TARGET_PAGE_BITS; page < end; page++) {
+            cpu_physical_memory_set_migration_dirty(page << TARGET_PAGE_BITS);
+        }
+    }
+}
+
 static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
                                                         int length,
                                                         int dirty_flags)
@@ -946,14 +1017,28 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
     for (i = 0; i < len; i++) {
         p[i] &= mask;
     }
+    if (dirty_flags & MIGRATION_DIRTY_FLAG) {
+        for (i = 0; i < len; i++) {
+            cpu_physical_memory_clear_migration_dirty(start +
+                                                      i * TARGET_PAGE_SIZE);
+        }
+    }
 }
 
+ram_addr_t cpu_physical_memory_find_migration_dirty(ram_addr_t start,
+                                                    ram_addr_t end);
+void cpu_physical_memory_set_dirty_bits(ram_addr_t start, uint64_t bits);
+
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+int cpu_physical_memory_get_dirty_range(ram_addr_t start, ram_addr_t end,
+                                        int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
 
+int cpu_physical_memory_set_snapshot_tracking(int enable);
+
 int cpu_physical_memory_get_dirty_tracking(void);
 
 int cpu_physical_sync_dirty_bitmap(target_phys_addr_t start_addr,
@@ -966,6 +1051,9 @@ int cpu_physical_log_stop(target_phys_addr_t start_addr,
                           ram_addr_t size);
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
+void tb_profile_start(CPUState *env);
+void tb_profile_stop(CPUState *env);
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int max);
 #endif /* !CONFIG_USER_ONLY */
 
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
@@ -49,6 +49,12 @@ ram_addr_t cpu_get_physical_page_desc(target_phys_addr_t addr);
 ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
                         ram_addr_t size, void *host);
 ram_addr_t qemu_ram_alloc(DeviceState *dev, const char *name, ram_addr_t size);
+/* Like qemu_ram_alloc, for memory that a guest may never touch, such as
+   video RAM: it is always private anonymous memory, even with -mem-path,
+   and is neither bound to a NUMA node nor preallocated, so its pages only
+   exist once they are written */
+ram_addr_t qemu_ram_alloc_lazy(DeviceState *dev, const char *name,
+                               ram_addr_t size);
 void qemu_ram_free(ram_addr_t addr);
 /* This should only be used for ram local to a device.  */
 void *qemu_get_ram_ptr(ram_addr_t addr);
@@ -58,6 +64,8 @@ void *qemu_safe_ram_ptr(ram_addr_t addr);
 /* This should not be used by devices.  */
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
+/* The guest gave the RAM up and its content was dropped (arch_init.c) */
+void ram_discard_range(ram_addr_t start, ram_addr_t len);
 
 int cpu_register_io_memory(CPUReadMemoryFunc * const *mem_read,
                            CPUWriteMemoryFunc * const *mem_write,
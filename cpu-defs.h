@@ -61,7 +61,11 @@ typedef uint64_t target_ulong;
 #define EXCP_DEBUG      0x10002 /* cpu stopped after a breakpoint or singlestep */
 #define EXCP_HALTED     0x10003 /* cpu is halted (waiting for external event) */
 
+/* Can be raised with --extra-cflags for guests with a large code footprint;
+   "info jit" shows how often the jump cache misses */
+#ifndef TB_JMP_CACHE_BITS
 #define TB_JMP_CACHE_BITS 12
+#endif
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
 /* Only the bottom TB_JMP_PAGE_BITS of the jump cache hash bits vary for
@@ -73,8 +77,15 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+#ifdef CONFIG_TLB_BITS
+#define CPU_TLB_BITS CONFIG_TLB_BITS
+#else
 #define CPU_TLB_BITS 8
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* Entries evicted from the direct mapped TLB are kept in a small fully
+   associative one, looked up before walking the guest page tables */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -109,7 +120,14 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    unsigned int vtlb_index;                                            \
+    /* statistics */                                                    \
+    uint64_t tlb_misses;        /* misses in the direct mapped TLB */   \
+    uint64_t tlb_victim_hits;                                           \
+    uint64_t tlb_fills;
 
 #else
 
@@ -132,6 +150,7 @@ typedef struct icount_decr_u16 {
 
 struct kvm_run;
 struct KVMState;
+struct KVMExitStats;
 struct qemu_work_item;
 
 typedef struct CPUBreakpoint {
@@ -210,6 +229,7 @@ typedef struct CPUWatchpoint {
     const char *cpu_model_str;                                          \
     struct KVMState *kvm_state;                                         \
     struct kvm_run *kvm_run;                                            \
+    struct KVMExitStats *kvm_exit_stats;                                \
     int kvm_fd;                                                         \
     int kvm_vcpu_dirty;
 
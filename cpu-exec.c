@@ -141,10 +141,12 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     phys_page2 = -1;
     h = tb_phys_hash_func(phys_pc);
     ptb1 = &tb_phys_hash[h];
+    tb_phys_hash_lookups++;
     for(;;) {
         tb = *ptb1;
         if (!tb)
             goto not_found;
+        tb_phys_hash_steps++;
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
@@ -164,6 +166,7 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     }
  not_found:
    /* if no translated code available, then translate it now */
+    tb_phys_hash_misses++;
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
 
  found:
@@ -178,24 +181,37 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     return tb;
 }
 
-static inline TranslationBlock *tb_find_fast(void)
+/*
+ * Looks the TB up in the CPU's own jump cache, which needs no tb_lock:
+ * other threads only ever clear its entries.  Returns NULL on a miss,
+ * with what tb_find_slow() needs in *pc, *cs_base and *flags.
+ */
+static inline TranslationBlock *tb_find_fast(target_ulong *pc,
+                                             target_ulong *cs_base,
+                                             int *flags)
 {
     TranslationBlock *tb;
-    target_ulong cs_base, pc;
-    int flags;
 
     /* we record a subset of the CPU state. It will
        always be the same before a given translated block
        is executed. */
-    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
-    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
-                 tb->flags != flags)) {
-        tb = tb_find_slow(pc, cs_base, flags);
+    cpu_get_tb_cpu_state(env, pc, cs_base, flags);
+    tb_jmp_cache_lookups++;
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(*pc)];
+    if (unlikely(!tb || tb->pc != *pc || tb->cs_base != *cs_base ||
+                 tb->flags != *flags)) {
+        return NULL;
     }
     return tb;
 }
 
+/* Whether the TB that exited with next_tb still has to be chained to tb */
+static inline int tb_needs_link(TranslationBlock *tb, unsigned long next_tb)
+{
+    return next_tb != 0 && tb->page_addr[1] == -1 &&
+           !((TranslationBlock *)(next_tb & ~3))->jmp_next[next_tb & 3];
+}
+
 /* main execution loop */
 
 volatile sig_atomic_t exit_request;
@@ -207,6 +223,8 @@ int cpu_exec(CPUState *env1)
     TranslationBlock *tb;
     uint8_t *tc_ptr;
     unsigned long next_tb;
+    target_ulong pc, cs_base;
+    int flags;
 
     if (cpu_halted(env1) == EXCP_HALTED)
         return EXCP_HALTED;
@@ -542,29 +560,36 @@ int cpu_exec(CPUState *env1)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
-                tb = tb_find_fast();
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
-                    next_tb = 0;
-                    tb_invalidated_flag = 0;
+                /* Threads that hit in their jump cache and have nothing
+                   to chain run without taking tb_lock at all */
+                tb = tb_find_fast(&pc, &cs_base, &flags);
+                if (unlikely(!tb) || tb_needs_link(tb, next_tb)) {
+                    spin_lock(&tb_lock);
+                    if (!tb) {
+                        tb = tb_find_slow(pc, cs_base, flags);
+                    }
+                    /* Note: we do it here to avoid a gcc bug on Mac OS X when
+                       doing it in tb_find_slow */
+                    if (tb_invalidated_flag) {
+                        /* as some TB could have been invalidated because
+                           of memory exceptions while generating the code, we
+                           must recompute the hash index here */
+                        next_tb = 0;
+                        tb_invalidated_flag = 0;
+                    }
+                    /* see if we can patch the calling TB. When the TB
+                       spans two pages, we cannot safely do a direct
+                       jump. */
+                    if (next_tb != 0 && tb->page_addr[1] == -1) {
+                        tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                    }
+                    spin_unlock(&tb_lock);
                 }
 #ifdef CONFIG_DEBUG_EXEC
                 qemu_log_mask(CPU_LOG_EXEC, "Trace 0x%08lx [" TARGET_FMT_lx "] %s\n",
                              (long)tb->tc_ptr, tb->pc,
                              lookup_symbol(tb->pc));
 #endif
-                /* see if we can patch the calling TB. When the TB
-                   spans two pages, we cannot safely do a direct
-                   jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
-                }
-                spin_unlock(&tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
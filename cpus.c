@@ -122,18 +122,27 @@ static void do_vm_stop(int reason)
         vm_running = 0;
         pause_all_vcpus();
         vm_state_notify(0, reason);
-        qemu_aio_flush();
+        bdrv_drain_all();
         bdrv_flush_all();
         monitor_protocol_event(QEVENT_STOP, NULL);
     }
 }
 
+/* Throttling keeps the vcpus off for a share of every period, so that a
+   migrating guest dirties its memory slower */
+#define CPU_THROTTLE_PERIOD     10 /* ms */
+#define CPU_THROTTLE_MAX        90
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+static bool throttle_sleeping;
+
 static int cpu_can_run(CPUState *env)
 {
     if (env->stop) {
         return 0;
     }
-    if (env->stopped || !vm_running) {
+    if (env->stopped || !vm_running || throttle_sleeping) {
         return 0;
     }
     return 1;
@@ -144,7 +153,7 @@ static bool cpu_thread_is_idle(CPUState *env)
     if (env->stop || env->queued_work_first) {
         return false;
     }
-    if (env->stopped || !vm_running) {
+    if (env->stopped || !vm_running || throttle_sleeping) {
         return true;
     }
     if (!env->halted || qemu_cpu_has_work(env)) {
@@ -165,6 +174,59 @@ static bool all_cpu_threads_idle(void)
     return true;
 }
 
+static void cpu_throttle_kick_all(void)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        qemu_cpu_kick(env);
+    }
+    qemu_notify_event();
+}
+
+static void cpu_throttle_tick(void *opaque)
+{
+    int share;
+
+    throttle_sleeping = !throttle_sleeping;
+    share = throttle_sleeping ? throttle_percentage :
+                                100 - throttle_percentage;
+    cpu_throttle_kick_all();
+    qemu_mod_timer(throttle_timer, qemu_get_clock(rt_clock) +
+                   CPU_THROTTLE_PERIOD * share / 100);
+}
+
+/* Keep the vcpus off for percentage % of the time, 0 stops throttling */
+void cpu_throttle_set(int percentage)
+{
+    percentage = MAX(0, MIN(percentage, CPU_THROTTLE_MAX));
+    if (percentage == throttle_percentage) {
+        return;
+    }
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer(rt_clock, cpu_throttle_tick, NULL);
+    }
+    if (!throttle_percentage) {
+        throttle_sleeping = false;
+        throttle_percentage = percentage;
+        cpu_throttle_tick(NULL);
+    } else if (!percentage) {
+        qemu_del_timer(throttle_timer);
+        throttle_percentage = 0;
+        throttle_sleeping = false;
+        cpu_throttle_kick_all();
+    } else {
+        /* Takes effect with the next period */
+        throttle_percentage = percentage;
+    }
+}
+
+int cpu_throttle_get(void)
+{
+    return throttle_percentage;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -580,6 +642,18 @@ void qemu_notify_event(void)
 
 void qemu_mutex_lock_iothread(void) {}
 void qemu_mutex_unlock_iothread(void) {}
+void qemu_mutex_iothread_set_site(int site) {}
+void qemu_mutex_iothread_bypassed(int site) {}
+
+void do_lockstats(Monitor *mon, const QDict *qdict)
+{
+    monitor_printf(mon, "lock statistics need an I/O thread\n");
+}
+
+void do_info_lockstats(Monitor *mon)
+{
+    monitor_printf(mon, "lock statistics need an I/O thread\n");
+}
 
 void cpu_stop_current(void)
 {
@@ -593,6 +667,8 @@ void vm_stop(int reason)
 #else /* CONFIG_IOTHREAD */
 
 #include "qemu-thread.h"
+#include "qemu-error.h"
+#include <sched.h>
 
 QemuMutex qemu_global_mutex;
 static QemuMutex qemu_fair_mutex;
@@ -610,6 +686,160 @@ static QemuCond qemu_system_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* Who holds qemu_global_mutex, and for how long.  Everything but the
+ * unlocked counts is only touched with the mutex held.
+ */
+typedef struct IOThreadLockStats {
+    uint64_t count;
+    uint64_t contended;
+    uint64_t unlocked;
+    int64_t wait_ns;
+    int64_t hold_ns;
+    int64_t max_hold_ns;
+} IOThreadLockStats;
+
+static const char * const lock_site_names[IOTHREAD_LOCK_MAX] = {
+    [IOTHREAD_LOCK_OTHER]     = "other",
+    [IOTHREAD_LOCK_MAIN_LOOP] = "main loop",
+    [IOTHREAD_LOCK_VCPU]      = "vcpu",
+    [IOTHREAD_LOCK_VCPU_PIO]  = "vcpu pio",
+    [IOTHREAD_LOCK_VCPU_MMIO] = "vcpu mmio",
+};
+
+static int lock_stats_enabled;
+static int64_t lock_stats_start;
+static int64_t lock_stats_end;
+static IOThreadLockStats lock_stats[IOTHREAD_LOCK_MAX];
+static int lock_site;
+static int64_t lock_acquired_at;
+static int64_t lock_wait_ns;
+static bool lock_contended;
+
+/* t0 is when the caller started to wait, or 0 if it did not measure it */
+static void lock_stats_acquired(int64_t t0, bool contended)
+{
+    lock_site = IOTHREAD_LOCK_OTHER;
+    lock_acquired_at = 0;
+    if (lock_stats_enabled) {
+        lock_acquired_at = get_clock();
+        lock_wait_ns = t0 ? lock_acquired_at - t0 : 0;
+        lock_contended = contended;
+    }
+}
+
+static void lock_stats_release(void)
+{
+    IOThreadLockStats *st = &lock_stats[lock_site];
+    int64_t hold;
+
+    if (!lock_acquired_at || !lock_stats_enabled) {
+        return;
+    }
+    hold = get_clock() - lock_acquired_at;
+    st->count++;
+    st->contended += lock_contended;
+    st->wait_ns += lock_wait_ns;
+    st->hold_ns += hold;
+    st->max_hold_ns = MAX(st->max_hold_ns, hold);
+    lock_acquired_at = 0;
+}
+
+/* caller is what mutex statistics attribute the acquisition to */
+static void qemu_global_lock_caller(void *caller)
+{
+    int64_t t0 = lock_stats_enabled ? get_clock() : 0;
+    bool contended = false;
+
+    if (qemu_mutex_trylock_caller(&qemu_global_mutex, caller)) {
+        contended = true;
+        qemu_mutex_lock_caller(&qemu_global_mutex, caller);
+    }
+    lock_stats_acquired(t0, contended);
+}
+
+/* Not inlined, so that its return address is the site that locks */
+static QEMU_NOINLINE void qemu_global_lock(void)
+{
+    qemu_global_lock_caller(__builtin_return_address(0));
+}
+
+static void qemu_global_unlock(void)
+{
+    lock_stats_release();
+    qemu_mutex_unlock(&qemu_global_mutex);
+}
+
+/* Time spent waiting on a condition does not count as holding the mutex */
+static void qemu_global_cond_wait(QemuCond *cond, uint64_t msecs)
+{
+    int site = lock_site;
+
+    lock_stats_release();
+    if (msecs) {
+        qemu_cond_timedwait(cond, &qemu_global_mutex, msecs);
+    } else {
+        qemu_cond_wait(cond, &qemu_global_mutex);
+    }
+    lock_stats_acquired(0, false);
+    lock_site = site;
+}
+
+void qemu_mutex_iothread_set_site(int site)
+{
+    lock_site = site;
+}
+
+void qemu_mutex_iothread_bypassed(int site)
+{
+    if (lock_stats_enabled) {
+        __sync_fetch_and_add(&lock_stats[site].unlocked, 1);
+    }
+}
+
+void do_lockstats(Monitor *mon, const QDict *qdict)
+{
+    int enable = qdict_get_bool(qdict, "enable");
+
+    if (enable && !lock_stats_enabled) {
+        memset(lock_stats, 0, sizeof(lock_stats));
+        lock_stats_start = get_clock();
+    } else if (!enable && lock_stats_enabled) {
+        lock_stats_end = get_clock();
+    }
+    /* The monitor holds the mutex and has not been timed, so there is no
+       hold in progress to account for */
+    lock_acquired_at = 0;
+    lock_stats_enabled = enable;
+}
+
+void do_info_lockstats(Monitor *mon)
+{
+    int64_t elapsed;
+    int i;
+
+    if (!lock_stats_start) {
+        monitor_printf(mon, "lock statistics are not enabled\n");
+        return;
+    }
+    elapsed = (lock_stats_enabled ? get_clock() : lock_stats_end) -
+              lock_stats_start;
+    monitor_printf(mon, "qemu_global_mutex over %0.3f s%s\n",
+                   elapsed / 1e9, lock_stats_enabled ? "" : " (stopped)");
+    monitor_printf(mon, "%-10s %10s %10s %10s %10s %10s %10s %6s\n",
+                   "holder", "count", "contended", "wait(ns)", "hold(ns)",
+                   "max(ns)", "unlocked", "held%");
+    for (i = 0; i < IOTHREAD_LOCK_MAX; i++) {
+        IOThreadLockStats *st = &lock_stats[i];
+        uint64_t n = MAX(st->count, 1);
+
+        monitor_printf(mon, "%-10s %10" PRIu64 " %10" PRIu64 " %10" PRId64
+                       " %10" PRId64 " %10" PRId64 " %10" PRIu64 " %6.2f\n",
+                       lock_site_names[i], st->count, st->contended,
+                       st->wait_ns / n, st->hold_ns / n, st->max_hold_ns,
+                       st->unlocked, st->hold_ns * 100.0 / MAX(elapsed, 1));
+    }
+}
+
 static void cpu_signal(int sig)
 {
     if (cpu_single_env) {
@@ -697,7 +927,8 @@ int qemu_init_main_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_mutex_init(&qemu_fair_mutex);
     qemu_mutex_init(&qemu_global_mutex);
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_mutex_set_name(&qemu_global_mutex, "qemu_global_mutex");
+    qemu_global_lock();
 
     qemu_thread_self(&io_thread);
 
@@ -734,7 +965,7 @@ void run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
     while (!wi.done) {
         CPUState *self_env = cpu_single_env;
 
-        qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
+        qemu_global_cond_wait(&qemu_work_cond, 0);
         cpu_single_env = self_env;
     }
 }
@@ -772,10 +1003,10 @@ static void qemu_tcg_wait_io_event(void)
     CPUState *env;
 
     while (all_cpu_threads_idle()) {
-        qemu_cond_timedwait(tcg_halt_cond, &qemu_global_mutex, 1000);
+        qemu_global_cond_wait(tcg_halt_cond, 1000);
     }
 
-    qemu_mutex_unlock(&qemu_global_mutex);
+    qemu_global_unlock();
 
     /*
      * Users of qemu_global_mutex can be starved, having no chance
@@ -785,17 +1016,209 @@ static void qemu_tcg_wait_io_event(void)
     qemu_mutex_lock(&qemu_fair_mutex);
     qemu_mutex_unlock(&qemu_fair_mutex);
 
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_global_lock();
+    qemu_mutex_iothread_set_site(IOTHREAD_LOCK_VCPU);
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         qemu_wait_io_event_common(env);
     }
 }
 
-static void qemu_kvm_wait_io_event(CPUState *env)
+/* -vcpu settings, for the vcpus first to last; later ones win */
+typedef struct VCPUSettings {
+    unsigned long first, last;
+    int host_cpu_first;         /* -1 to leave the affinity alone */
+    int host_cpu_last;
+    int fifo_prio;              /* 0 for the default scheduling policy */
+    int64_t halt_poll_max;      /* ns */
+    int64_t halt_poll_ns;       /* the window, adjusted as the vcpu halts */
+    QTAILQ_ENTRY(VCPUSettings) next;
+} VCPUSettings;
+
+static QTAILQ_HEAD(, VCPUSettings) vcpu_settings =
+    QTAILQ_HEAD_INITIALIZER(vcpu_settings);
+
+/* The first window, and the smallest one that is not dropped to nothing */
+#define HALT_POLL_START 10000   /* ns */
+
+/* "a" or "a-b" */
+static int parse_range(const char *str, unsigned long *first,
+                       unsigned long *last)
+{
+    const char *p = str;
+    char *end;
+
+    *first = *last = strtoul(p, &end, 10);
+    if (end == p) {
+        return -1;
+    }
+    if (*end == '-') {
+        p = end + 1;
+        *last = strtoul(p, &end, 10);
+        if (end == p) {
+            return -1;
+        }
+    }
+    return *end || *last < *first ? -1 : 0;
+}
+
+int vcpu_settings_add(QemuOpts *opts)
+{
+    VCPUSettings *vs = qemu_mallocz(sizeof(*vs));
+    const char *str;
+    unsigned long first, last;
+
+    str = qemu_opt_get(opts, "vcpu");
+    if (!str) {
+        vs->last = ULONG_MAX;
+    } else if (parse_range(str, &vs->first, &vs->last) < 0) {
+        error_report("vcpu: invalid vcpu range '%s'", str);
+        goto fail;
+    }
+
+    vs->host_cpu_first = vs->host_cpu_last = -1;
+    str = qemu_opt_get(opts, "host-cpus");
+    if (str) {
+#ifdef CONFIG_LINUX
+        if (parse_range(str, &first, &last) < 0 || last >= CPU_SETSIZE) {
+            error_report("vcpu: invalid host-cpus '%s'", str);
+            goto fail;
+        }
+        vs->host_cpu_first = first;
+        vs->host_cpu_last = last;
+#else
+        error_report("vcpu: host-cpus is not supported on this host");
+        goto fail;
+#endif
+    }
+
+    vs->fifo_prio = qemu_opt_get_number(opts, "fifo", 0);
+    if (vs->fifo_prio &&
+        (vs->fifo_prio < sched_get_priority_min(SCHED_FIFO) ||
+         vs->fifo_prio > sched_get_priority_max(SCHED_FIFO))) {
+        error_report("vcpu: fifo priority must be between %d and %d",
+                     sched_get_priority_min(SCHED_FIFO),
+                     sched_get_priority_max(SCHED_FIFO));
+        goto fail;
+    }
+
+    vs->halt_poll_max = qemu_opt_get_number(opts, "halt-poll", 0) * 1000;
+    QTAILQ_INSERT_TAIL(&vcpu_settings, vs, next);
+    return 0;
+
+fail:
+    qemu_free(vs);
+    return -1;
+}
+
+/* What this vcpu thread runs with, merged from all -vcpu options */
+static void vcpu_settings_get(int cpu_index, VCPUSettings *out)
+{
+    VCPUSettings *vs;
+
+    memset(out, 0, sizeof(*out));
+    out->host_cpu_first = out->host_cpu_last = -1;
+    QTAILQ_FOREACH(vs, &vcpu_settings, next) {
+        if (cpu_index < vs->first || cpu_index > vs->last) {
+            continue;
+        }
+        if (vs->host_cpu_first >= 0) {
+            out->host_cpu_first = vs->host_cpu_first;
+            out->host_cpu_last = vs->host_cpu_last;
+        }
+        if (vs->fifo_prio) {
+            out->fifo_prio = vs->fifo_prio;
+        }
+        if (vs->halt_poll_max) {
+            out->halt_poll_max = vs->halt_poll_max;
+        }
+    }
+    out->halt_poll_ns = MIN(HALT_POLL_START, out->halt_poll_max);
+}
+
+/* Applied to the calling thread.  Failing is not fatal, the vcpu just runs
+   like one without the settings. */
+static void vcpu_settings_apply(CPUState *env, VCPUSettings *vs)
 {
+#ifdef CONFIG_LINUX
+    if (vs->host_cpu_first >= 0) {
+        cpu_set_t set;
+        int i;
+
+        CPU_ZERO(&set);
+        for (i = vs->host_cpu_first; i <= vs->host_cpu_last; i++) {
+            CPU_SET(i, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            error_report("vcpu %d: could not set the affinity to host cpus "
+                         "%d-%d: %s", env->cpu_index, vs->host_cpu_first,
+                         vs->host_cpu_last, strerror(errno));
+        }
+    }
+#endif
+    if (vs->fifo_prio) {
+        struct sched_param param = { .sched_priority = vs->fifo_prio };
+        int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+        if (r) {
+            error_report("vcpu %d: could not switch to SCHED_FIFO: %s",
+                         env->cpu_index, strerror(r));
+        }
+    }
+}
+
+/* Spin for up to ns with the global mutex dropped, until the vcpu has
+ * something to do.  A vcpu woken this way does not pay a reschedule of its
+ * thread.  Returns false if it is still idle. */
+static bool qemu_kvm_halt_poll(CPUState *env, int64_t ns)
+{
+    int64_t deadline = get_clock() + ns;
+    bool idle;
+
+    qemu_global_unlock();
+    do {
+        /* racy, but the caller looks again with the mutex held */
+        idle = cpu_thread_is_idle(env);
+    } while (idle && get_clock() < deadline);
+    qemu_global_lock();
+    qemu_mutex_iothread_set_site(IOTHREAD_LOCK_VCPU);
+
+    return !cpu_thread_is_idle(env);
+}
+
+/* Grow the window while halts end soon enough for a window up to the
+ * maximum to catch them, shrink it while they do not */
+static void qemu_kvm_halt_poll_adjust(VCPUSettings *vs, int64_t halted_ns)
+{
+    if (halted_ns <= vs->halt_poll_max) {
+        vs->halt_poll_ns = MIN(MAX(vs->halt_poll_ns * 2, HALT_POLL_START),
+                               vs->halt_poll_max);
+    } else {
+        vs->halt_poll_ns /= 2;
+        if (vs->halt_poll_ns < HALT_POLL_START) {
+            vs->halt_poll_ns = 0;
+        }
+    }
+}
+
+static void qemu_kvm_wait_io_event(CPUState *env, VCPUSettings *vs)
+{
+    int64_t halted_at = 0;
+
+    /* only a halted vcpu of a running VM can get work soon */
+    if (vs->halt_poll_max && env->halted && !env->stopped && vm_running &&
+        cpu_thread_is_idle(env)) {
+        halted_at = get_clock();
+        if (vs->halt_poll_ns && qemu_kvm_halt_poll(env, vs->halt_poll_ns)) {
+            halted_at = 0;
+        }
+    }
+
     while (cpu_thread_is_idle(env)) {
-        qemu_cond_timedwait(env->halt_cond, &qemu_global_mutex, 1000);
+        qemu_global_cond_wait(env->halt_cond, 1000);
+    }
+    if (halted_at) {
+        qemu_kvm_halt_poll_adjust(vs, get_clock() - halted_at);
     }
 
     qemu_kvm_eat_signals(env);
@@ -805,11 +1228,15 @@ static void qemu_kvm_wait_io_event(CPUState *env)
 static void *qemu_kvm_cpu_thread_fn(void *arg)
 {
     CPUState *env = arg;
+    VCPUSettings vs;
     int r;
 
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_global_lock();
     qemu_thread_self(env->thread);
 
+    vcpu_settings_get(env->cpu_index, &vs);
+    vcpu_settings_apply(env, &vs);
+
     r = kvm_init_vcpu(env);
     if (r < 0) {
         fprintf(stderr, "kvm_init_vcpu failed: %s\n", strerror(-r));
@@ -824,17 +1251,18 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
 
     /* and wait for machine initialization */
     while (!qemu_system_ready) {
-        qemu_cond_timedwait(&qemu_system_cond, &qemu_global_mutex, 100);
+        qemu_global_cond_wait(&qemu_system_cond, 100);
     }
 
     while (1) {
         if (cpu_can_run(env)) {
+            startup_profile_cpu_exec();
             r = kvm_cpu_exec(env);
             if (r == EXCP_DEBUG) {
                 cpu_handle_debug_exception(env);
             }
         }
-        qemu_kvm_wait_io_event(env);
+        qemu_kvm_wait_io_event(env, &vs);
     }
 
     return NULL;
@@ -848,7 +1276,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     qemu_thread_self(env->thread);
 
     /* signal CPU creation */
-    qemu_mutex_lock(&qemu_global_mutex);
+    qemu_global_lock();
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         env->created = 1;
     }
@@ -856,9 +1284,10 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     /* and wait for machine initialization */
     while (!qemu_system_ready) {
-        qemu_cond_timedwait(&qemu_system_cond, &qemu_global_mutex, 100);
+        qemu_global_cond_wait(&qemu_system_cond, 100);
     }
 
+    qemu_mutex_iothread_set_site(IOTHREAD_LOCK_VCPU);
     while (1) {
         cpu_exec_all();
         qemu_tcg_wait_io_event();
@@ -900,21 +1329,28 @@ int qemu_cpu_self(void *_env)
 
 void qemu_mutex_lock_iothread(void)
 {
+    void *caller = __builtin_return_address(0);
+
     if (kvm_enabled()) {
-        qemu_mutex_lock(&qemu_global_mutex);
+        qemu_global_lock_caller(caller);
     } else {
+        int64_t t0 = lock_stats_enabled ? get_clock() : 0;
+        bool contended = false;
+
         qemu_mutex_lock(&qemu_fair_mutex);
-        if (qemu_mutex_trylock(&qemu_global_mutex)) {
+        if (qemu_mutex_trylock_caller(&qemu_global_mutex, caller)) {
+            contended = true;
             qemu_thread_signal(tcg_cpu_thread, SIG_IPI);
-            qemu_mutex_lock(&qemu_global_mutex);
+            qemu_mutex_lock_caller(&qemu_global_mutex, caller);
         }
         qemu_mutex_unlock(&qemu_fair_mutex);
+        lock_stats_acquired(t0, contended);
     }
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
-    qemu_mutex_unlock(&qemu_global_mutex);
+    qemu_global_unlock();
 }
 
 static int all_vcpus_paused(void)
@@ -942,7 +1378,7 @@ void pause_all_vcpus(void)
     }
 
     while (!all_vcpus_paused()) {
-        qemu_cond_timedwait(&qemu_pause_cond, &qemu_global_mutex, 100);
+        qemu_global_cond_wait(&qemu_pause_cond, 100);
         penv = first_cpu;
         while (penv) {
             qemu_cpu_kick(penv);
@@ -967,14 +1403,21 @@ static void qemu_tcg_init_vcpu(void *_env)
 {
     CPUState *env = _env;
 
-    /* share a single thread for all cpus with TCG */
+    /* share a single thread for all cpus with TCG.  Running a thread per
+     * cpu would need much more than a lock around tb_gen_code(): the
+     * translation block lists and hash tables, tb_flush() and the code
+     * buffer, the dirty flags that tb_invalidate_phys_page_range() relies
+     * on and cpu_single_env are all global; a TLB flush for one cpu is done
+     * by another; and guest atomics and load-locked/store-conditional pairs
+     * are emulated as plain loads and stores, which only works because no
+     * other cpu runs in between. */
     if (!tcg_cpu_thread) {
         env->thread = qemu_mallocz(sizeof(QemuThread));
         env->halt_cond = qemu_mallocz(sizeof(QemuCond));
         qemu_cond_init(env->halt_cond);
         qemu_thread_create(env->thread, qemu_tcg_cpu_thread_fn, env);
         while (env->created == 0) {
-            qemu_cond_timedwait(&qemu_cpu_cond, &qemu_global_mutex, 100);
+            qemu_global_cond_wait(&qemu_cpu_cond, 100);
         }
         tcg_cpu_thread = env->thread;
         tcg_halt_cond = env->halt_cond;
@@ -991,7 +1434,7 @@ static void qemu_kvm_start_vcpu(CPUState *env)
     qemu_cond_init(env->halt_cond);
     qemu_thread_create(env->thread, qemu_kvm_cpu_thread_fn, env);
     while (env->created == 0) {
-        qemu_cond_timedwait(&qemu_cpu_cond, &qemu_global_mutex, 100);
+        qemu_global_cond_wait(&qemu_cpu_cond, 100);
     }
 }
 
@@ -1095,6 +1538,7 @@ bool cpu_exec_all(void)
             break;
         }
         if (cpu_can_run(env)) {
+            startup_profile_cpu_exec();
             if (kvm_enabled()) {
                 r = kvm_cpu_exec(env);
                 qemu_kvm_eat_signals(env);
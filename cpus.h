@@ -1,12 +1,17 @@
 #ifndef QEMU_CPUS_H
 #define QEMU_CPUS_H
 
+#include "qemu-option.h"
+
 /* cpus.c */
 int qemu_init_main_loop(void);
 void qemu_main_loop_start(void);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
+void cpu_throttle_set(int percentage);
+int cpu_throttle_get(void);
+int vcpu_settings_add(QemuOpts *opts);
 
 /* vl.c */
 extern int smp_cores;
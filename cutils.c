@@ -24,6 +24,9 @@
 #include "qemu-common.h"
 #include "host-utils.h"
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 void pstrcpy(char *buf, int buf_size, const char *str)
 {
@@ -116,6 +119,86 @@ int qemu_fls(int i)
     return 32 - clz32(i);
 }
 
+#define BUFFER_FILL_CHUNK 64
+
+#ifdef __SSE2__
+static int buffer_chunks_filled(const uint8_t *p, size_t n, int c)
+{
+    __m128i pattern = _mm_set1_epi8(c);
+    __m128i diff;
+    size_t i;
+
+    for (i = 0; i < n; i++, p += BUFFER_FILL_CHUNK) {
+        const __m128i *v = (const __m128i *)p;
+
+        diff = _mm_or_si128(_mm_or_si128(_mm_xor_si128(v[0], pattern),
+                                         _mm_xor_si128(v[1], pattern)),
+                            _mm_or_si128(_mm_xor_si128(v[2], pattern),
+                                         _mm_xor_si128(v[3], pattern)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()))
+            != 0xffff) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#else
+static int buffer_chunks_filled(const uint8_t *p, size_t n, int c)
+{
+    unsigned long pattern = ~0UL / 0xff * (uint8_t)c;
+    unsigned long diff;
+    size_t i, j;
+
+    for (i = 0; i < n; i++, p += BUFFER_FILL_CHUNK) {
+        const unsigned long *v = (const unsigned long *)p;
+
+        diff = 0;
+        for (j = 0; j < BUFFER_FILL_CHUNK / sizeof(unsigned long); j++) {
+            diff |= v[j] ^ pattern;
+        }
+        if (diff) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+/*
+ * Return 1 if all len bytes at buf are equal to c, stopping at the first
+ * 64 byte chunk that is not.  Used to detect zero pages and sectors.
+ */
+int buffer_is_filled(const void *buf, int c, size_t len)
+{
+    const uint8_t *p = buf;
+    uint8_t ch = c;
+
+    /* Bytewise up to the first aligned chunk */
+    while (len && ((uintptr_t)p & (BUFFER_FILL_CHUNK - 1))) {
+        if (*p++ != ch) {
+            return 0;
+        }
+        len--;
+    }
+    if (!buffer_chunks_filled(p, len / BUFFER_FILL_CHUNK, ch)) {
+        return 0;
+    }
+    p += len & ~(size_t)(BUFFER_FILL_CHUNK - 1);
+    len &= BUFFER_FILL_CHUNK - 1;
+    while (len) {
+        if (*p++ != ch) {
+            return 0;
+        }
+        len--;
+    }
+    return 1;
+}
+
+int buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_is_filled(buf, 0, len);
+}
+
 /*
  * Make sure data goes on disk, but if possible do not bother to
  * write out the inode just for timestamp updates.
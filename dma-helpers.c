@@ -47,6 +47,7 @@ typedef struct {
     target_phys_addr_t sg_cur_byte;
     QEMUIOVector iov;
     QEMUBH *bh;
+    void *map_client;
 } DMAAIOCB;
 
 static void dma_bdrv_cb(void *opaque, int ret);
@@ -64,6 +65,7 @@ static void continue_after_map_failure(void *opaque)
 {
     DMAAIOCB *dbs = (DMAAIOCB *)opaque;
 
+    dbs->map_client = NULL;
     dbs->bh = qemu_bh_new(reschedule_dma, dbs);
     qemu_bh_schedule(dbs->bh);
 }
@@ -79,6 +81,32 @@ static void dma_bdrv_unmap(DMAAIOCB *dbs)
     }
 }
 
+/* Drop the last bytes of the mapped iovec and step back in the list */
+static void dma_bdrv_trim(DMAAIOCB *dbs, target_phys_addr_t bytes)
+{
+    dbs->iov.size -= bytes;
+    while (bytes) {
+        struct iovec *last = &dbs->iov.iov[dbs->iov.niov - 1];
+        target_phys_addr_t n = MIN(bytes, last->iov_len);
+
+        if (dbs->sg_cur_byte == 0) {
+            dbs->sg_cur_byte = dbs->sg->sg[--dbs->sg_cur_index].len;
+        }
+        n = MIN(n, dbs->sg_cur_byte);
+        dbs->sg_cur_byte -= n;
+        bytes -= n;
+
+        if (n == last->iov_len) {
+            cpu_physical_memory_unmap(last->iov_base, last->iov_len,
+                                      !dbs->is_write, 0);
+            dbs->iov.niov--;
+        } else {
+            /* unmapped later with the shorter length */
+            last->iov_len -= n;
+        }
+    }
+}
+
 static void dma_bdrv_cb(void *opaque, int ret)
 {
     DMAAIOCB *dbs = (DMAAIOCB *)opaque;
@@ -111,8 +139,19 @@ static void dma_bdrv_cb(void *opaque, int ret)
         }
     }
 
+    /*
+     * Whatever could be mapped, directly or through a bounce buffer, is
+     * submitted now and the rest of the list in the next round.  The split
+     * has to fall on a sector boundary, so give back a partial sector (and
+     * wait for a bounce buffer if that was all there was).
+     */
+    if (dbs->sg_cur_index < dbs->sg->nsg && (dbs->iov.size & 511)) {
+        dma_bdrv_trim(dbs, dbs->iov.size & 511);
+    }
+
     if (dbs->iov.size == 0) {
-        cpu_register_map_client(dbs, continue_after_map_failure);
+        dbs->map_client = cpu_register_map_client(dbs,
+                                                  continue_after_map_failure);
         return;
     }
 
@@ -136,6 +175,15 @@ static void dma_aio_cancel(BlockDriverAIOCB *acb)
 
     if (dbs->acb) {
         bdrv_aio_cancel(dbs->acb);
+    } else if (dbs->map_client || dbs->bh) {
+        /* waiting for a bounce buffer, nothing is in flight */
+        if (dbs->map_client) {
+            cpu_unregister_map_client(dbs->map_client);
+        } else {
+            qemu_bh_delete(dbs->bh);
+        }
+        qemu_iovec_destroy(&dbs->iov);
+        qemu_aio_release(dbs);
     }
 }
 
@@ -159,9 +207,10 @@ static BlockDriverAIOCB *dma_bdrv_io(
     dbs->sg_cur_byte = 0;
     dbs->is_write = is_write;
     dbs->bh = NULL;
+    dbs->map_client = NULL;
     qemu_iovec_init(&dbs->iov, sg->nsg);
     dma_bdrv_cb(dbs, 0);
-    if (!dbs->acb) {
+    if (!dbs->acb && !dbs->map_client) {
         qemu_aio_release(dbs);
         return NULL;
     }
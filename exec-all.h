@@ -75,6 +75,9 @@ extern uint16_t gen_opc_icount[OPC_BUF_SIZE];
 
 #include "qemu-log.h"
 
+/* non zero if translated code counts its executions in tb->exec_count */
+extern int tb_profile_enabled;
+
 void gen_intermediate_code(CPUState *env, struct TranslationBlock *tb);
 void gen_intermediate_code_pc(CPUState *env, struct TranslationBlock *tb);
 void gen_pc_load(CPUState *env, struct TranslationBlock *tb,
@@ -107,11 +110,16 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* The physical hash table is sized for one bucket per TB that fits in the
+   translation buffer, between these bounds */
 #define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_PHYS_HASH_MAX_BITS 22
 
 #define MIN_CODE_GEN_BUFFER_SIZE     (1024 * 1024)
 
+/* number of regions the translation buffer is reclaimed by when full */
+#define CODE_GEN_REGIONS 8
+
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
    according to the host CPU */
@@ -158,6 +166,8 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* executions counted by the code of the TB, see tb_profile_enabled */
+    uint64_t exec_count;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -175,9 +185,12 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
+extern TranslationBlock **tb_phys_hash;
+extern unsigned int tb_phys_hash_size;
+
 static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    return (pc >> 2) & (tb_phys_hash_size - 1);
 }
 
 void tb_free(TranslationBlock *tb);
@@ -186,7 +199,11 @@ void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+/* statistics of tb_find_fast and tb_find_slow, for "info jit" */
+extern uint64_t tb_jmp_cache_lookups;
+extern uint64_t tb_phys_hash_lookups;
+extern uint64_t tb_phys_hash_misses;
+extern uint64_t tb_phys_hash_steps;
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -301,6 +318,39 @@ void tlb_fill(target_ulong addr, int is_write, int mmu_idx,
 
 #endif
 
+#if !defined(CONFIG_USER_ONLY)
+/* Look for the page of a missed access in the victim TLB.  On a hit, the
+   entry is swapped with the one at index in the main TLB, where the
+   access is then retried.  elt_ofs selects addr_read, addr_write or
+   addr_code. */
+static inline int tlb_victim_hit(CPUState *env1, int mmu_idx, int index,
+                                 size_t elt_ofs, target_ulong page)
+{
+    CPUTLBEntry *tlb, *vtlb, tmp_tlb;
+    target_phys_addr_t tmp_iotlb;
+    target_ulong cmp;
+    int vidx;
+
+    env1->tlb_misses++;
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        vtlb = &env1->tlb_v_table[mmu_idx][vidx];
+        cmp = *(target_ulong *)((uint8_t *)vtlb + elt_ofs);
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == page) {
+            tlb = &env1->tlb_table[mmu_idx][index];
+            tmp_tlb = *tlb;
+            *tlb = *vtlb;
+            *vtlb = tmp_tlb;
+            tmp_iotlb = env1->iotlb[mmu_idx][index];
+            env1->iotlb[mmu_idx][index] = env1->iotlb_v[mmu_idx][vidx];
+            env1->iotlb_v[mmu_idx][vidx] = tmp_iotlb;
+            env1->tlb_victim_hits++;
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
 #if defined(CONFIG_USER_ONLY)
 static inline tb_page_addr_t get_page_addr_code(CPUState *env1, target_ulong addr)
 {
@@ -22,6 +22,11 @@
 #else
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <signal.h>
+#endif
+#ifdef CONFIG_NUMA
+#include <numaif.h>
 #endif
 
 #include "qemu-common.h"
@@ -33,6 +38,11 @@
 #include "osdep.h"
 #include "kvm.h"
 #include "qemu-timer.h"
+#include "host-utils.h"
+#include "qemu-barrier.h"
+#include "sysemu.h"
+#include "tb-cache.h"
+#include "disas.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #include <signal.h>
@@ -74,7 +84,11 @@
 
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+TranslationBlock **tb_phys_hash;
+unsigned int tb_phys_hash_size;
+/* the live TBs are tbs[tb_first] to tbs[tb_first + nb_tbs - 1], modulo
+   code_gen_max_blocks, oldest first */
+static int tb_first;
 static int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
@@ -101,10 +115,21 @@ static unsigned long code_gen_buffer_size;
 /* threshold to flush the translated code buffer */
 static unsigned long code_gen_buffer_max_size;
 static uint8_t *code_gen_ptr;
+/* The translation buffer is used as a ring.  code_gen_tail is the code of
+   the oldest TB; when code_gen_ptr has wrapped around below it,
+   code_gen_wrap is where the previous lap ended.  Space is reclaimed by
+   evicting the oldest of CODE_GEN_REGIONS equal regions at a time. */
+static uint8_t *code_gen_tail;
+static uint8_t *code_gen_wrap;
+static unsigned long code_gen_region_size;
+
+#define CODE_GEN_MAX_TB_SIZE (TCG_MAX_OP_SIZE * OPC_MAX_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
 int phys_ram_fd;
-static int in_migration;
+static int in_migration;      /* dirty logging, for either of these: */
+static int migration_log;
+static int snapshot_log;
 
 RAMList ram_list = { .blocks = QLIST_HEAD_INITIALIZER(ram_list) };
 #endif
@@ -129,7 +154,8 @@ typedef struct PageDesc {
     unsigned int code_write_count;
     uint8_t *code_bitmap;
 #if defined(CONFIG_USER_ONLY)
-    unsigned long flags;
+    /* PAGE_WRITE was removed because the page holds translated code */
+    int code_protected;
 #endif
 } PageDesc;
 
@@ -150,28 +176,18 @@ typedef struct PageDesc {
 #define L2_SIZE (1 << L2_BITS)
 
 /* The bits remaining after N lower levels of page tables.  */
-#define P_L1_BITS_REM \
-    ((TARGET_PHYS_ADDR_SPACE_BITS - TARGET_PAGE_BITS) % L2_BITS)
 #define V_L1_BITS_REM \
     ((L1_MAP_ADDR_SPACE_BITS - TARGET_PAGE_BITS) % L2_BITS)
 
 /* Size of the L1 page table.  Avoid silly small sizes.  */
-#if P_L1_BITS_REM < 4
-#define P_L1_BITS  (P_L1_BITS_REM + L2_BITS)
-#else
-#define P_L1_BITS  P_L1_BITS_REM
-#endif
-
 #if V_L1_BITS_REM < 4
 #define V_L1_BITS  (V_L1_BITS_REM + L2_BITS)
 #else
 #define V_L1_BITS  V_L1_BITS_REM
 #endif
 
-#define P_L1_SIZE  ((target_phys_addr_t)1 << P_L1_BITS)
 #define V_L1_SIZE  ((target_ulong)1 << V_L1_BITS)
 
-#define P_L1_SHIFT (TARGET_PHYS_ADDR_SPACE_BITS - TARGET_PAGE_BITS - P_L1_BITS)
 #define V_L1_SHIFT (L1_MAP_ADDR_SPACE_BITS - TARGET_PAGE_BITS - V_L1_BITS)
 
 unsigned long qemu_real_host_page_size;
@@ -190,9 +206,25 @@ typedef struct PhysPageDesc {
     ram_addr_t region_offset;
 } PhysPageDesc;
 
-/* This is a multi-level map on the physical address space.
-   The bottom level has pointers to PhysPageDesc.  */
-static void *l1_phys_map[P_L1_SIZE];
+/* The physical address space is a sorted array of sections, each a run
+   of pages whose descriptors follow from that of its first page: the
+   region_offset advances by a page from one page to the next, and so does
+   the phys_offset of RAM, ROM and ROMD.  Pages outside of all sections
+   are unassigned.  So RAM takes one section however large it is, instead
+   of a PhysPageDesc per page.  */
+typedef struct PhysSection {
+    target_phys_addr_t start;       /* index of the first page */
+    target_phys_addr_t end;         /* index of the page after the last */
+    ram_addr_t phys_offset;
+    ram_addr_t region_offset;
+} PhysSection;
+
+static PhysSection *phys_sections;
+static int phys_sections_nr, phys_sections_max;
+
+/* Consecutive lookups mostly hit the same section.  Lookups and updates
+   all happen under the global mutex, so one cache serves every CPU.  */
+static int phys_section_last;
 
 static void io_mem_init(void);
 
@@ -219,7 +251,26 @@ static int log_append = 0;
 static int tlb_flush_count;
 #endif
 static int tb_flush_count;
+static int64_t tb_flush_time;
+static int tb_evict_count;
+static int64_t tb_evict_time;
+static uint64_t tb_evict_tbs;
 static int tb_phys_invalidate_count;
+uint64_t tb_jmp_cache_lookups;
+uint64_t tb_phys_hash_lookups;
+uint64_t tb_phys_hash_misses;
+uint64_t tb_phys_hash_steps;
+
+/* TB execution profile: the counts of the TBs that went away, by guest pc */
+typedef struct TBProfileEntry {
+    target_ulong pc;
+    uint64_t count;
+} TBProfileEntry;
+
+int tb_profile_enabled;
+static TBProfileEntry *tb_profile_table;
+static unsigned int tb_profile_size;
+static unsigned int tb_profile_used;
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -392,49 +443,137 @@ static inline PageDesc *page_find(tb_page_addr_t index)
 }
 
 #if !defined(CONFIG_USER_ONLY)
-static PhysPageDesc *phys_page_find_alloc(target_phys_addr_t index, int alloc)
+static inline int phys_offset_is_linear(ram_addr_t phys_offset)
 {
-    PhysPageDesc *pd;
-    void **lp;
-    int i;
+    return (phys_offset & ~TARGET_PAGE_MASK) <= IO_MEM_ROM ||
+           (phys_offset & IO_MEM_ROMD);
+}
 
-    /* Level 1.  Always allocated.  */
-    lp = l1_phys_map + ((index >> P_L1_SHIFT) & (P_L1_SIZE - 1));
+static PhysPageDesc phys_section_desc(const PhysSection *s,
+                                      target_phys_addr_t index)
+{
+    ram_addr_t delta = (ram_addr_t)(index - s->start) << TARGET_PAGE_BITS;
+    PhysPageDesc pd;
 
-    /* Level 2..N-1.  */
-    for (i = P_L1_SHIFT / L2_BITS - 1; i > 0; i--) {
-        void **p = *lp;
-        if (p == NULL) {
-            if (!alloc) {
-                return NULL;
-            }
-            *lp = p = qemu_mallocz(sizeof(void *) * L2_SIZE);
-        }
-        lp = p + ((index >> (i * L2_BITS)) & (L2_SIZE - 1));
+    pd.phys_offset = s->phys_offset;
+    if (phys_offset_is_linear(s->phys_offset)) {
+        pd.phys_offset += delta;
     }
+    pd.region_offset = s->region_offset + delta;
+    return pd;
+}
 
-    pd = *lp;
-    if (pd == NULL) {
-        int i;
+/* Return the first section that ends after page INDEX */
+static int phys_section_search(target_phys_addr_t index)
+{
+    int lo = 0, hi = phys_sections_nr;
 
-        if (!alloc) {
-            return NULL;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (phys_sections[mid].end <= index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
+    return lo;
+}
 
-        *lp = pd = qemu_malloc(sizeof(PhysPageDesc) * L2_SIZE);
+static PhysPageDesc phys_page_find(target_phys_addr_t index)
+{
+    PhysSection *s;
+    PhysPageDesc pd;
+    int i = phys_section_last;
 
-        for (i = 0; i < L2_SIZE; i++) {
-            pd[i].phys_offset = IO_MEM_UNASSIGNED;
-            pd[i].region_offset = (index + i) << TARGET_PAGE_BITS;
+    if (i >= phys_sections_nr || index < phys_sections[i].start ||
+        index >= phys_sections[i].end) {
+        i = phys_section_search(index);
+        if (i == phys_sections_nr || index < phys_sections[i].start) {
+            pd.phys_offset = IO_MEM_UNASSIGNED;
+            pd.region_offset = index << TARGET_PAGE_BITS;
+            return pd;
         }
+        phys_section_last = i;
     }
 
-    return pd + (index & (L2_SIZE - 1));
+    s = &phys_sections[i];
+    return phys_section_desc(s, index);
 }
 
-static inline PhysPageDesc *phys_page_find(target_phys_addr_t index)
+static int phys_section_can_merge(const PhysSection *a, const PhysSection *b)
 {
-    return phys_page_find_alloc(index, 0);
+    PhysPageDesc pd;
+
+    if (a->end != b->start) {
+        return 0;
+    }
+    pd = phys_section_desc(a, b->start);
+    return pd.phys_offset == b->phys_offset &&
+           pd.region_offset == b->region_offset;
+}
+
+/* Describe pages [START, END) with the descriptor PHYS_OFFSET and
+   REGION_OFFSET for the first one */
+static void phys_section_set(target_phys_addr_t start, target_phys_addr_t end,
+                             ram_addr_t phys_offset, ram_addr_t region_offset)
+{
+    PhysSection new[3];
+    int i, j, k, last, n = 0;
+
+    /* sections [i, j) overlap the range */
+    i = phys_section_search(start);
+    for (j = i; j < phys_sections_nr && phys_sections[j].start < end; j++) {
+        /* nothing */
+    }
+
+    if (i < j && phys_sections[i].start < start) {
+        new[n] = phys_sections[i];
+        new[n].end = start;
+        n++;
+    }
+    if (phys_offset != IO_MEM_UNASSIGNED) {
+        new[n].start = start;
+        new[n].end = end;
+        new[n].phys_offset = phys_offset;
+        new[n].region_offset = region_offset;
+        n++;
+    }
+    if (i < j && phys_sections[j - 1].end > end) {
+        PhysPageDesc pd = phys_section_desc(&phys_sections[j - 1], end);
+
+        new[n].start = end;
+        new[n].end = phys_sections[j - 1].end;
+        new[n].phys_offset = pd.phys_offset;
+        new[n].region_offset = pd.region_offset;
+        n++;
+    }
+
+    if (phys_sections_nr - (j - i) + n > phys_sections_max) {
+        phys_sections_max = MAX(16, phys_sections_max * 2);
+        phys_sections = qemu_realloc(phys_sections,
+                                     phys_sections_max * sizeof(PhysSection));
+    }
+    memmove(&phys_sections[i + n], &phys_sections[j],
+            (phys_sections_nr - j) * sizeof(PhysSection));
+    memcpy(&phys_sections[i], new, n * sizeof(PhysSection));
+    phys_sections_nr += n - (j - i);
+
+    /* join the new sections with their neighbours where possible */
+    last = i + n;
+    for (k = MAX(i - 1, 0); k < last && k + 1 < phys_sections_nr; ) {
+        if (phys_section_can_merge(&phys_sections[k], &phys_sections[k + 1])) {
+            phys_sections[k].end = phys_sections[k + 1].end;
+            memmove(&phys_sections[k + 1], &phys_sections[k + 2],
+                    (phys_sections_nr - k - 2) * sizeof(PhysSection));
+            phys_sections_nr--;
+            last--;
+        } else {
+            k++;
+        }
+    }
+
+    phys_section_last = 0;
 }
 
 static void tlb_protect_code(ram_addr_t ram_addr);
@@ -553,10 +692,18 @@ static void code_gen_alloc(unsigned long tb_size)
 #endif
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size - 
-        (TCG_MAX_OP_SIZE * OPC_MAX_SIZE);
+    code_gen_buffer_max_size = code_gen_buffer_size - CODE_GEN_MAX_TB_SIZE;
+    code_gen_region_size = code_gen_buffer_size / CODE_GEN_REGIONS;
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
     tbs = qemu_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+
+    /* a larger -tb-size would otherwise only make the chains longer */
+    tb_phys_hash_size = 1 << CODE_GEN_PHYS_HASH_BITS;
+    while (tb_phys_hash_size < code_gen_max_blocks &&
+           tb_phys_hash_size < (1 << CODE_GEN_PHYS_HASH_MAX_BITS)) {
+        tb_phys_hash_size <<= 1;
+    }
+    tb_phys_hash = qemu_mallocz(tb_phys_hash_size * sizeof(*tb_phys_hash));
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -566,7 +713,7 @@ void cpu_exec_init_all(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    code_gen_ptr = code_gen_buffer;
+    code_gen_ptr = code_gen_tail = code_gen_buffer;
     page_init();
 #if !defined(CONFIG_USER_ONLY)
     io_mem_init();
@@ -649,18 +796,48 @@ void cpu_exec_init(CPUState *env)
 #endif
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+static inline TranslationBlock *tb_nth(int n)
+{
+    return &tbs[(tb_first + n) % code_gen_max_blocks];
+}
+
+/* Amount of generated code held by the live TBs */
+static unsigned long code_gen_used(void)
+{
+    if (code_gen_ptr >= code_gen_tail) {
+        return code_gen_ptr - code_gen_tail;
+    }
+    return (code_gen_wrap - code_gen_tail) + (code_gen_ptr - code_gen_buffer);
+}
+
+/* Allocate a new translation block. Return NULL if too many translation
+   blocks or too much generated code: the caller must then evict the
+   oldest ones. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    if (nb_tbs == 0) {
+        tb_first = 0;
+        code_gen_ptr = code_gen_tail = code_gen_buffer;
+    }
+    if (nb_tbs >= code_gen_max_blocks)
         return NULL;
-    tb = &tbs[nb_tbs++];
+    if (code_gen_ptr >= code_gen_tail &&
+        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size) {
+        /* wrap around once the start of the buffer has been evicted */
+        if (code_gen_tail - code_gen_buffer <= CODE_GEN_MAX_TB_SIZE)
+            return NULL;
+        code_gen_wrap = code_gen_ptr;
+        code_gen_ptr = code_gen_buffer;
+    }
+    if (code_gen_ptr < code_gen_tail &&
+        code_gen_tail - code_gen_ptr <= CODE_GEN_MAX_TB_SIZE)
+        return NULL;
+    tb = tb_nth(nb_tbs++);
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
     return tb;
 }
 
@@ -669,7 +846,7 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (nb_tbs > 0 && tb == tb_nth(nb_tbs - 1)) {
         code_gen_ptr = tb->tc_ptr;
         nb_tbs--;
     }
@@ -715,33 +892,94 @@ static void page_flush_tb(void)
     }
 }
 
+static void tb_profile_add(target_ulong pc, uint64_t count)
+{
+    TBProfileEntry *old_table;
+    unsigned int old_size, h, i;
+
+    if (tb_profile_used * 2 >= tb_profile_size) {
+        old_table = tb_profile_table;
+        old_size = tb_profile_size;
+        tb_profile_size = old_size ? old_size * 2 : 1024;
+        tb_profile_table = qemu_mallocz(tb_profile_size *
+                                        sizeof(*tb_profile_table));
+        tb_profile_used = 0;
+        for (i = 0; i < old_size; i++) {
+            if (old_table[i].count) {
+                tb_profile_add(old_table[i].pc, old_table[i].count);
+            }
+        }
+        qemu_free(old_table);
+    }
+    /* entries are never removed, so an empty one ends the probe */
+    h = tb_jmp_cache_hash_func(pc) ^ (pc >> TARGET_PAGE_BITS);
+    for (;;) {
+        h &= tb_profile_size - 1;
+        if (!tb_profile_table[h].count) {
+            tb_profile_table[h].pc = pc;
+            tb_profile_used++;
+            break;
+        }
+        if (tb_profile_table[h].pc == pc) {
+            break;
+        }
+        h++;
+    }
+    tb_profile_table[h].count += count;
+}
+
+/* fold the executions counted by a TB into the profile */
+static void tb_profile_retire(TranslationBlock *tb)
+{
+    if (tb->exec_count) {
+        tb_profile_add(tb->pc, tb->exec_count);
+        tb->exec_count = 0;
+    }
+}
+
+static void tb_profile_retire_all(void)
+{
+    TranslationBlock *tb;
+    int i;
+
+    for (i = 0; i < nb_tbs; i++) {
+        tb = tb_nth(i);
+        if (tb->page_addr[0] != -1) {
+            tb_profile_retire(tb);
+        }
+    }
+}
+
 /* flush all the translation blocks */
 /* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+    int64_t ti;
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+           code_gen_used(), nb_tbs, nb_tbs > 0 ? code_gen_used() / nb_tbs : 0);
 #endif
     if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
+    ti = get_clock();
+    tb_profile_retire_all();
+    tb_first = 0;
     nb_tbs = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    memset (tb_phys_hash, 0, tb_phys_hash_size * sizeof (void *));
     page_flush_tb();
 
-    code_gen_ptr = code_gen_buffer;
+    code_gen_ptr = code_gen_tail = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+    tb_flush_time += get_clock() - ti;
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -751,7 +989,7 @@ static void tb_invalidate_check(target_ulong address)
     TranslationBlock *tb;
     int i;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
+    for(i = 0;i < tb_phys_hash_size; i++) {
         for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
@@ -769,7 +1007,7 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
+    for(i = 0;i < tb_phys_hash_size; i++) {
         for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
@@ -902,10 +1140,40 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((long)tb | 2); /* fail safe */
+    tb_profile_retire(tb);
+    /* the TB stays in tbs[] until evicted, do not invalidate it twice */
+    tb->page_addr[0] = -1;
 
     tb_phys_invalidate_count++;
 }
 
+/* Invalidate the TBs whose code lies in the oldest region of the
+   translation buffer.  Unlike tb_flush, the other translations are kept
+   and only the jumps into the evicted TBs are reset. */
+static void tb_evict_region(void)
+{
+    TranslationBlock *tb;
+    uint8_t *region_end;
+    int64_t ti;
+
+    ti = get_clock();
+    region_end = code_gen_buffer + code_gen_region_size *
+        ((code_gen_tail - code_gen_buffer) / code_gen_region_size + 1);
+    while (nb_tbs > 0) {
+        tb = &tbs[tb_first];
+        if (tb->tc_ptr < code_gen_tail || tb->tc_ptr >= region_end)
+            break;
+        if (tb->page_addr[0] != -1)
+            tb_phys_invalidate(tb, -1);
+        tb_first = (tb_first + 1) % code_gen_max_blocks;
+        nb_tbs--;
+        tb_evict_tbs++;
+    }
+    code_gen_tail = nb_tbs > 0 ? tbs[tb_first].tc_ptr : code_gen_ptr;
+    tb_evict_count++;
+    tb_evict_time += get_clock() - ti;
+}
+
 static inline void set_bits(uint8_t *tab, int start, int len)
 {
     int end, mask, end1;
@@ -974,10 +1242,10 @@ TranslationBlock *tb_gen_code(CPUState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
-        /* cannot fail at this point */
-        tb = tb_alloc(pc);
+        /* make room by evicting the oldest translations */
+        do {
+            tb_evict_region();
+        } while ((tb = tb_alloc(pc)) == NULL);
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
@@ -986,7 +1254,10 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
+    if (!tb_cache_load(env, tb, &code_gen_size)) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_cache_store(env, tb, code_gen_size);
+    }
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
@@ -1215,7 +1486,7 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #if defined(TARGET_HAS_SMC) || 1
 
 #if defined(CONFIG_USER_ONLY)
-    if (p->flags & PAGE_WRITE) {
+    if (page_get_flags(page_addr) & PAGE_WRITE) {
         target_ulong addr;
         PageDesc *p2;
         int prot;
@@ -1227,11 +1498,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
         for(addr = page_addr; addr < page_addr + qemu_host_page_size;
             addr += TARGET_PAGE_SIZE) {
 
-            p2 = page_find (addr >> TARGET_PAGE_BITS);
-            if (!p2)
-                continue;
-            prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
+            prot |= page_get_flags(addr);
+            p2 = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
+            p2->code_protected = 1;
           }
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
@@ -1292,35 +1561,48 @@ void tb_link_page(TranslationBlock *tb,
     mmap_unlock();
 }
 
+/* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
+   tb[1].tc_ptr. Return NULL if not found */
+/* Offset of generated code from code_gen_tail, following the ring */
+static inline unsigned long code_gen_ring_offset(unsigned long tc_ptr)
+{
+    if (tc_ptr >= (unsigned long)code_gen_tail) {
+        return tc_ptr - (unsigned long)code_gen_tail;
+    }
+    return (code_gen_wrap - code_gen_tail) +
+        (tc_ptr - (unsigned long)code_gen_buffer);
+}
+
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
 TranslationBlock *tb_find_pc(unsigned long tc_ptr)
 {
     int m_min, m_max, m;
-    unsigned long v;
+    unsigned long v, off;
     TranslationBlock *tb;
 
     if (nb_tbs <= 0)
         return NULL;
     if (tc_ptr < (unsigned long)code_gen_buffer ||
-        tc_ptr >= (unsigned long)code_gen_ptr)
+        code_gen_ring_offset(tc_ptr) >= code_gen_used())
         return NULL;
+    off = code_gen_ring_offset(tc_ptr);
     /* binary search (cf Knuth) */
     m_min = 0;
     m_max = nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
-        v = (unsigned long)tb->tc_ptr;
-        if (v == tc_ptr)
+        tb = tb_nth(m);
+        v = code_gen_ring_offset((unsigned long)tb->tc_ptr);
+        if (v == off)
             return tb;
-        else if (tc_ptr < v) {
+        else if (off < v) {
             m_max = m - 1;
         } else {
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return tb_nth(m_max);
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1382,15 +1664,11 @@ static void breakpoint_invalidate(CPUState *env, target_ulong pc)
     target_phys_addr_t addr;
     target_ulong pd;
     ram_addr_t ram_addr;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     addr = cpu_get_phys_page_debug(env, pc);
     p = phys_page_find(addr >> TARGET_PAGE_BITS);
-    if (!p) {
-        pd = IO_MEM_UNASSIGNED;
-    } else {
-        pd = p->phys_offset;
-    }
+    pd = p.phys_offset;
     ram_addr = (pd & TARGET_PAGE_MASK) | (pc & ~TARGET_PAGE_MASK);
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
 }
@@ -1739,36 +2017,16 @@ static int cpu_notify_migration_log(int enable)
     return 0;
 }
 
-static void phys_page_for_each_1(CPUPhysMemoryClient *client,
-                                 int level, void **lp)
+static void phys_page_for_each(CPUPhysMemoryClient *client)
 {
     int i;
 
-    if (*lp == NULL) {
-        return;
-    }
-    if (level == 0) {
-        PhysPageDesc *pd = *lp;
-        for (i = 0; i < L2_SIZE; ++i) {
-            if (pd[i].phys_offset != IO_MEM_UNASSIGNED) {
-                client->set_memory(client, pd[i].region_offset,
-                                   TARGET_PAGE_SIZE, pd[i].phys_offset);
-            }
-        }
-    } else {
-        void **pp = *lp;
-        for (i = 0; i < L2_SIZE; ++i) {
-            phys_page_for_each_1(client, level - 1, pp + i);
-        }
-    }
-}
+    for (i = 0; i < phys_sections_nr; i++) {
+        PhysSection *s = &phys_sections[i];
 
-static void phys_page_for_each(CPUPhysMemoryClient *client)
-{
-    int i;
-    for (i = 0; i < P_L1_SIZE; ++i) {
-        phys_page_for_each_1(client, P_L1_SHIFT / L2_BITS - 1,
-                             l1_phys_map + 1);
+        client->set_memory(client, s->start << TARGET_PAGE_BITS,
+                           (ram_addr_t)(s->end - s->start) << TARGET_PAGE_BITS,
+                           s->phys_offset);
     }
 }
 
@@ -1941,6 +2199,12 @@ void tlb_flush(CPUState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
@@ -1949,18 +2213,33 @@ void tlb_flush(CPUState *env, int flush_global)
     tlb_flush_count++;
 }
 
+static inline int tlb_entry_is_page(CPUTLBEntry *tlb_entry, target_ulong addr)
+{
+    return addr == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_entry_is_page(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
 
+static inline void tlb_flush_vtlb_page(CPUState *env, int mmu_idx,
+                                       target_ulong addr)
+{
+    int k;
+
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+    }
+}
+
 void tlb_flush_page(CPUState *env, target_ulong addr)
 {
     int i;
@@ -1985,8 +2264,10 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        tlb_flush_vtlb_page(env, mmu_idx, addr);
+    }
 
     tlb_flush_jmp_cache(env, addr);
 }
@@ -2020,6 +2301,37 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
     }
 }
 
+/* Return non-zero if a page in [start, end[ has one of dirty_flags set.
+   Whole words of the dirty bitmap are tested at once, so that a scan
+   over a mostly clean framebuffer stays cheap.  */
+int cpu_physical_memory_get_dirty_range(ram_addr_t start, ram_addr_t end,
+                                        int dirty_flags)
+{
+    const uint8_t *p = ram_list.phys_dirty;
+    unsigned long mask = ~0UL / 0xff * (uint8_t)dirty_flags;
+    ram_addr_t page, last;
+
+    page = start >> TARGET_PAGE_BITS;
+    last = (end + TARGET_PAGE_SIZE - 1) >> TARGET_PAGE_BITS;
+    for (; page < last && (page & (sizeof(unsigned long) - 1)); page++) {
+        if (p[page] & dirty_flags) {
+            return 1;
+        }
+    }
+    for (; page + sizeof(unsigned long) <= last;
+         page += sizeof(unsigned long)) {
+        if (*(const unsigned long *)(p + page) & mask) {
+            return 1;
+        }
+    }
+    for (; page < last; page++) {
+        if (p[page] & dirty_flags) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags)
@@ -2052,16 +2364,78 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
             for(i = 0; i < CPU_TLB_SIZE; i++)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
+            for (i = 0; i < CPU_VTLB_SIZE; i++)
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
         }
     }
 }
 
-int cpu_physical_memory_set_dirty_tracking(int enable)
+/* Return the address of the first page in [start, end) with
+   MIGRATION_DIRTY_FLAG set, or end if there is none */
+ram_addr_t cpu_physical_memory_find_migration_dirty(ram_addr_t start,
+                                                    ram_addr_t end)
+{
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    ram_addr_t last = end >> TARGET_PAGE_BITS;
+    uint64_t word;
+
+    while (page < last) {
+        word = ram_list.migration_dirty[page / 64] >> (page % 64);
+        if (word) {
+            page += ctz64(word);
+            return page < last ? page << TARGET_PAGE_BITS : end;
+        }
+        page = (page | 63) + 1;
+    }
+    return end;
+}
+
+/* Mark dirty all the pages of the 64 from start that are set in bits, in
+   one go: the migration bitmap takes them a word at a time */
+void cpu_physical_memory_set_dirty_bits(ram_addr_t start, uint64_t bits)
+{
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    uint64_t *word = &ram_list.migration_dirty[page / 64];
+    unsigned int shift = page % 64;
+    uint64_t lo = bits << shift;
+    uint64_t hi = shift ? bits >> (64 - shift) : 0;
+
+    ram_list.migration_dirty_pages += ctpop64(lo & ~word[0]);
+    word[0] |= lo;
+    if (hi) {
+        ram_list.migration_dirty_pages += ctpop64(hi & ~word[1]);
+        word[1] |= hi;
+    }
+
+    while (bits) {
+        ram_list.phys_dirty[page + ctz64(bits)] = 0xff;
+        bits &= bits - 1;
+    }
+}
+
+static int cpu_physical_memory_update_dirty_tracking(void)
 {
-    int ret = 0;
+    int enable = migration_log || snapshot_log;
+
+    if (enable == in_migration) {
+        return 0;
+    }
     in_migration = enable;
-    ret = cpu_notify_migration_log(!!enable);
-    return ret;
+    return cpu_notify_migration_log(enable);
+}
+
+int cpu_physical_memory_set_dirty_tracking(int enable)
+{
+    migration_log = !!enable;
+    return cpu_physical_memory_update_dirty_tracking();
+}
+
+/* Keep dirty logging on between snapshots, for SNAPSHOT_DIRTY_FLAG */
+int cpu_physical_memory_set_snapshot_tracking(int enable)
+{
+    snapshot_log = !!enable;
+    return cpu_physical_memory_update_dirty_tracking();
 }
 
 int cpu_physical_memory_get_dirty_tracking(void)
@@ -2069,6 +2443,20 @@ int cpu_physical_memory_get_dirty_tracking(void)
     return in_migration;
 }
 
+static QEMUBH *display_wakeup_bh;
+
+void cpu_physical_memory_arm_display_wakeup(QEMUBH *bh)
+{
+    display_wakeup_bh = bh;
+    ram_list.display_wakeup = bh != NULL;
+}
+
+void cpu_physical_memory_display_wakeup(void)
+{
+    ram_list.display_wakeup = 0;
+    qemu_bh_schedule(display_wakeup_bh);
+}
+
 int cpu_physical_sync_dirty_bitmap(target_phys_addr_t start_addr,
                                    target_phys_addr_t end_addr)
 {
@@ -2131,6 +2519,8 @@ void cpu_tlb_update_dirty(CPUState *env)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         for(i = 0; i < CPU_TLB_SIZE; i++)
             tlb_update_dirty(&env->tlb_table[mmu_idx][i]);
+        for (i = 0; i < CPU_VTLB_SIZE; i++)
+            tlb_update_dirty(&env->tlb_v_table[mmu_idx][i]);
     }
 }
 
@@ -2144,13 +2534,17 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
 {
-    int i;
+    int i, k;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -2183,7 +2577,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
                   target_phys_addr_t paddr, int prot,
                   int mmu_idx, target_ulong size)
 {
-    PhysPageDesc *p;
+    PhysPageDesc p;
     unsigned long pd;
     unsigned int index;
     target_ulong address;
@@ -2198,11 +2592,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
         tlb_add_large_page(env, vaddr, size);
     }
     p = phys_page_find(paddr >> TARGET_PAGE_BITS);
-    if (!p) {
-        pd = IO_MEM_UNASSIGNED;
-    } else {
-        pd = p->phys_offset;
-    }
+    pd = p.phys_offset;
 #if defined(DEBUG_TLB)
     printf("tlb_set_page: vaddr=" TARGET_FMT_lx " paddr=0x" TARGET_FMT_plx
            " prot=%x idx=%d pd=0x%08lx\n",
@@ -2229,12 +2619,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
            and avoid full address decoding in every device.
            We can't use the high bits of pd for this because
            IO_MEM_ROMD uses these as a ram address.  */
-        iotlb = (pd & ~TARGET_PAGE_MASK);
-        if (p) {
-            iotlb += p->region_offset;
-        } else {
-            iotlb += paddr;
-        }
+        iotlb = (pd & ~TARGET_PAGE_MASK) + p.region_offset;
     }
 
     code_address = address;
@@ -2252,8 +2637,22 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     }
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* Drop any older copy of the page from the victim TLB, and move the
+       entry being replaced there */
+    tlb_flush_vtlb_page(env, mmu_idx, vaddr);
+    if (!tlb_entry_is_page(te, vaddr) &&
+        (te->addr_read & te->addr_write & te->addr_code &
+         TLB_INVALID_MASK) == 0) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+    env->tlb_fills++;
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -2292,92 +2691,108 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 {
 }
 
-/*
- * Walks guest process memory "regions" one by one
- * and calls callback function 'fn' for each region.
- */
+/* The flags of the guest pages are kept as a sorted array of maximal
+   runs of pages with the same flags, so that mapping, unmapping and
+   checking a large area costs a binary search rather than a walk over
+   its pages.  Only the pages that hold translated code have a PageDesc;
+   PAGE_WRITE is cleared from their flags while their code_protected
+   is set.  */
+typedef struct PageFlagsRange {
+    target_ulong start;
+    target_ulong end;
+    int flags;
+} PageFlagsRange;
 
-struct walk_memory_regions_data
-{
-    walk_memory_regions_fn fn;
-    void *priv;
-    unsigned long start;
-    int prot;
-};
+static PageFlagsRange *page_ranges;
+static int nb_page_ranges;
+static int page_ranges_size;
 
-static int walk_memory_regions_end(struct walk_memory_regions_data *data,
-                                   abi_ulong end, int new_prot)
+/* index of the first range that ends after addr */
+static int page_range_index(target_ulong addr)
 {
-    if (data->start != -1ul) {
-        int rc = data->fn(data->priv, data->start, end, data->prot);
-        if (rc != 0) {
-            return rc;
+    int lo = 0, hi = nb_page_ranges;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (page_ranges[mid].end <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
 
-    data->start = (new_prot ? end : -1ul);
-    data->prot = new_prot;
+static void page_range_insert(int i, target_ulong start, target_ulong end,
+                              int flags)
+{
+    if (nb_page_ranges == page_ranges_size) {
+        page_ranges_size = page_ranges_size ? page_ranges_size * 2 : 64;
+        page_ranges = qemu_realloc(page_ranges,
+                                   page_ranges_size * sizeof(*page_ranges));
+    }
+    memmove(&page_ranges[i + 1], &page_ranges[i],
+            (nb_page_ranges - i) * sizeof(*page_ranges));
+    page_ranges[i].start = start;
+    page_ranges[i].end = end;
+    page_ranges[i].flags = flags;
+    nb_page_ranges++;
+}
 
-    return 0;
+static void page_range_remove(int i, int n)
+{
+    memmove(&page_ranges[i], &page_ranges[i + n],
+            (nb_page_ranges - i - n) * sizeof(*page_ranges));
+    nb_page_ranges -= n;
 }
 
-static int walk_memory_regions_1(struct walk_memory_regions_data *data,
-                                 abi_ulong base, int level, void **lp)
+/* Return the first PageDesc at or after *index and before end, skipping
+   the page tables that were never allocated.  */
+static PageDesc *page_find_next(tb_page_addr_t *index, tb_page_addr_t end)
 {
-    abi_ulong pa;
-    int i, rc;
+    PageDesc *p;
 
-    if (*lp == NULL) {
-        return walk_memory_regions_end(data, base, 0);
+    while (*index < end) {
+        p = page_find(*index);
+        if (p) {
+            return p;
+        }
+        *index = (*index | (L2_SIZE - 1)) + 1;
     }
+    return NULL;
+}
 
-    if (level == 0) {
-        PageDesc *pd = *lp;
-        for (i = 0; i < L2_SIZE; ++i) {
-            int prot = pd[i].flags;
+/* Find the first mapped range that overlaps [start, end[.  */
+int page_find_range(target_ulong start, target_ulong end,
+                    target_ulong *range_start, target_ulong *range_end)
+{
+    int i = page_range_index(start);
 
-            pa = base | (i << TARGET_PAGE_BITS);
-            if (prot != data->prot) {
-                rc = walk_memory_regions_end(data, pa, prot);
-                if (rc != 0) {
-                    return rc;
-                }
-            }
-        }
-    } else {
-        void **pp = *lp;
-        for (i = 0; i < L2_SIZE; ++i) {
-            pa = base | ((abi_ulong)i <<
-                (TARGET_PAGE_BITS + L2_BITS * level));
-            rc = walk_memory_regions_1(data, pa, level - 1, pp + i);
-            if (rc != 0) {
-                return rc;
-            }
-        }
+    if (i == nb_page_ranges || page_ranges[i].start >= end) {
+        return 0;
     }
-
-    return 0;
+    *range_start = page_ranges[i].start;
+    *range_end = page_ranges[i].end;
+    return 1;
 }
 
+/*
+ * Walks guest process memory "regions" one by one
+ * and calls callback function 'fn' for each region.
+ */
 int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
-    struct walk_memory_regions_data data;
-    unsigned long i;
-
-    data.fn = fn;
-    data.priv = priv;
-    data.start = -1ul;
-    data.prot = 0;
+    int i, rc;
 
-    for (i = 0; i < V_L1_SIZE; i++) {
-        int rc = walk_memory_regions_1(&data, (abi_ulong)i << V_L1_SHIFT,
-                                       V_L1_SHIFT / L2_BITS - 1, l1_map + i);
+    for (i = 0; i < nb_page_ranges; i++) {
+        rc = fn(priv, page_ranges[i].start, page_ranges[i].end,
+                page_ranges[i].flags);
         if (rc != 0) {
             return rc;
         }
     }
-
-    return walk_memory_regions_end(&data, 0, 0);
+    return 0;
 }
 
 static int dump_region(void *priv, abi_ulong start,
@@ -2406,11 +2821,18 @@ void page_dump(FILE *f)
 int page_get_flags(target_ulong address)
 {
     PageDesc *p;
+    int i, flags;
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p)
+    i = page_range_index(address);
+    if (i == nb_page_ranges || page_ranges[i].start > address)
         return 0;
-    return p->flags;
+    flags = page_ranges[i].flags;
+    if (flags & PAGE_WRITE) {
+        p = page_find(address >> TARGET_PAGE_BITS);
+        if (p && p->code_protected)
+            flags &= ~PAGE_WRITE;
+    }
+    return flags;
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
@@ -2418,7 +2840,9 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    tb_page_addr_t index;
+    PageDesc *p;
+    int i, n;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -2435,27 +2859,60 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         flags |= PAGE_WRITE_ORG;
     }
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
+    /* If the write protection bit is set, then we invalidate
+       the code inside.  */
+    for (index = start >> TARGET_PAGE_BITS;
+         (p = page_find_next(&index, end >> TARGET_PAGE_BITS)) != NULL;
+         index++) {
+        if ((flags & PAGE_WRITE) && p->first_tb &&
+            !(page_get_flags(index << TARGET_PAGE_BITS) & PAGE_WRITE)) {
+            tb_invalidate_phys_page(index << TARGET_PAGE_BITS, 0, NULL);
+        }
+        p->code_protected = 0;
+    }
 
-        /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0, NULL);
+    /* cut [start, end[ out of the ranges it overlaps */
+    i = page_range_index(start);
+    if (i < nb_page_ranges && page_ranges[i].start < start) {
+        if (page_ranges[i].end > end) {
+            page_range_insert(i + 1, end, page_ranges[i].end,
+                              page_ranges[i].flags);
         }
-        p->flags = flags;
+        page_ranges[i].end = start;
+        i++;
+    }
+    for (n = 0; i + n < nb_page_ranges && page_ranges[i + n].end <= end; n++) {
+    }
+    page_range_remove(i, n);
+    if (i < nb_page_ranges && page_ranges[i].start < end) {
+        page_ranges[i].start = end;
+    }
+
+    if (!flags) {
+        return;
+    }
+    /* insert the new range, merged with its neighbours */
+    if (i > 0 && page_ranges[i - 1].end == start &&
+        page_ranges[i - 1].flags == flags) {
+        i--;
+        page_ranges[i].end = end;
+    } else {
+        page_range_insert(i, start, end, flags);
+    }
+    if (i + 1 < nb_page_ranges && page_ranges[i + 1].start == end &&
+        page_ranges[i + 1].flags == flags) {
+        page_ranges[i].end = page_ranges[i + 1].end;
+        page_range_remove(i + 1, 1);
     }
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
+    tb_page_addr_t index;
     target_ulong end;
     target_ulong addr;
+    PageDesc *p;
+    int i;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -2475,27 +2932,29 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     end = TARGET_PAGE_ALIGN(start+len); /* must do before we loose bits in the next step */
     start = start & TARGET_PAGE_MASK;
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if( !p )
+    /* the ranges must cover [start, end[ without a hole */
+    addr = start;
+    for (i = page_range_index(start); addr < end; i++) {
+        if (i == nb_page_ranges || page_ranges[i].start > addr)
             return -1;
-        if( !(p->flags & PAGE_VALID) )
+        if (!(page_ranges[i].flags & PAGE_VALID))
             return -1;
-
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ))
+        if ((flags & PAGE_READ) && !(page_ranges[i].flags & PAGE_READ))
+            return -1;
+        if ((flags & PAGE_WRITE) && !(page_ranges[i].flags & PAGE_WRITE_ORG))
             return -1;
-        if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG))
+        addr = page_ranges[i].end;
+    }
+
+    if (flags & PAGE_WRITE) {
+        /* unprotect the pages that were put read-only because they
+           contain translated code */
+        for (index = start >> TARGET_PAGE_BITS;
+             (p = page_find_next(&index, end >> TARGET_PAGE_BITS)) != NULL;
+             index++) {
+            if (p->code_protected &&
+                !page_unprotect(index << TARGET_PAGE_BITS, 0, NULL))
                 return -1;
-            /* unprotect the page if it was put read-only because it
-               contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
-                if (!page_unprotect(addr, 0, NULL))
-                    return -1;
-            }
-            return 0;
         }
     }
     return 0;
@@ -2522,15 +2981,17 @@ int page_unprotect(target_ulong address, unsigned long pc, void *puc)
 
     /* if the page was really writable, then we change its
        protection back to writable */
-    if ((p->flags & PAGE_WRITE_ORG) && !(p->flags & PAGE_WRITE)) {
+    if (p->code_protected && (page_get_flags(address) & PAGE_WRITE_ORG)) {
         host_start = address & qemu_host_page_mask;
         host_end = host_start + qemu_host_page_size;
 
         prot = 0;
         for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
             p = page_find(addr >> TARGET_PAGE_BITS);
-            p->flags |= PAGE_WRITE;
-            prot |= p->flags;
+            if (p) {
+                p->code_protected = 0;
+            }
+            prot |= page_get_flags(addr);
 
             /* and since the content will be modified, we must invalidate
                the corresponding translated code. */
@@ -2602,8 +3063,9 @@ void cpu_register_physical_memory_offset(target_phys_addr_t start_addr,
                                          ram_addr_t phys_offset,
                                          ram_addr_t region_offset)
 {
-    target_phys_addr_t addr, end_addr;
-    PhysPageDesc *p;
+    target_phys_addr_t addr, end_addr, run_end, page, end_page;
+    ram_addr_t delta;
+    PhysPageDesc p;
     CPUState *env;
     ram_addr_t orig_size = size;
     subpage_t *subpage;
@@ -2616,58 +3078,75 @@ void cpu_register_physical_memory_offset(target_phys_addr_t start_addr,
     region_offset &= TARGET_PAGE_MASK;
     size = (size + TARGET_PAGE_SIZE - 1) & TARGET_PAGE_MASK;
     end_addr = start_addr + (target_phys_addr_t)size;
-    for(addr = start_addr; addr != end_addr; addr += TARGET_PAGE_SIZE) {
+    addr = start_addr;
+    while (addr != end_addr) {
+        target_phys_addr_t start_addr2, end_addr2;
+        int need_subpage = 0;
+
         p = phys_page_find(addr >> TARGET_PAGE_BITS);
-        if (p && p->phys_offset != IO_MEM_UNASSIGNED) {
-            ram_addr_t orig_memory = p->phys_offset;
-            target_phys_addr_t start_addr2, end_addr2;
-            int need_subpage = 0;
+        CHECK_SUBPAGE(addr, start_addr, start_addr2, end_addr, end_addr2,
+                      need_subpage);
+        if (need_subpage && (p.phys_offset != IO_MEM_UNASSIGNED ||
+                             !phys_offset_is_linear(phys_offset))) {
+            ram_addr_t subpage_phys = p.phys_offset;
+
+            if (!(p.phys_offset & IO_MEM_SUBPAGE)) {
+                subpage = subpage_init((addr & TARGET_PAGE_MASK),
+                                       &subpage_phys, p.phys_offset,
+                                       p.region_offset);
+            } else {
+                subpage = io_mem_opaque[(p.phys_offset & ~TARGET_PAGE_MASK)
+                                        >> IO_MEM_SHIFT];
+            }
+            subpage_register(subpage, start_addr2, end_addr2, phys_offset,
+                             region_offset);
+            phys_section_set(addr >> TARGET_PAGE_BITS,
+                             (addr >> TARGET_PAGE_BITS) + 1, subpage_phys, 0);
+            region_offset += TARGET_PAGE_SIZE;
+            addr += TARGET_PAGE_SIZE;
+            continue;
+        }
+
+        /* Only the first and the last page can need a subpage, so the
+           pages up to the last one go into a single section */
+        run_end = end_addr;
+        if (end_addr - addr > TARGET_PAGE_SIZE) {
+            target_phys_addr_t last = end_addr - TARGET_PAGE_SIZE;
 
-            CHECK_SUBPAGE(addr, start_addr, start_addr2, end_addr, end_addr2,
+            need_subpage = 0;
+            CHECK_SUBPAGE(last, start_addr, start_addr2, end_addr, end_addr2,
                           need_subpage);
             if (need_subpage) {
-                if (!(orig_memory & IO_MEM_SUBPAGE)) {
-                    subpage = subpage_init((addr & TARGET_PAGE_MASK),
-                                           &p->phys_offset, orig_memory,
-                                           p->region_offset);
-                } else {
-                    subpage = io_mem_opaque[(orig_memory & ~TARGET_PAGE_MASK)
-                                            >> IO_MEM_SHIFT];
-                }
-                subpage_register(subpage, start_addr2, end_addr2, phys_offset,
-                                 region_offset);
-                p->region_offset = 0;
-            } else {
-                p->phys_offset = phys_offset;
-                if ((phys_offset & ~TARGET_PAGE_MASK) <= IO_MEM_ROM ||
-                    (phys_offset & IO_MEM_ROMD))
-                    phys_offset += TARGET_PAGE_SIZE;
+                run_end = last;
             }
-        } else {
-            p = phys_page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
-            p->phys_offset = phys_offset;
-            p->region_offset = region_offset;
-            if ((phys_offset & ~TARGET_PAGE_MASK) <= IO_MEM_ROM ||
-                (phys_offset & IO_MEM_ROMD)) {
-                phys_offset += TARGET_PAGE_SIZE;
-            } else {
-                target_phys_addr_t start_addr2, end_addr2;
-                int need_subpage = 0;
-
-                CHECK_SUBPAGE(addr, start_addr, start_addr2, end_addr,
-                              end_addr2, need_subpage);
-
-                if (need_subpage) {
-                    subpage = subpage_init((addr & TARGET_PAGE_MASK),
-                                           &p->phys_offset, IO_MEM_UNASSIGNED,
-                                           addr & TARGET_PAGE_MASK);
-                    subpage_register(subpage, start_addr2, end_addr2,
-                                     phys_offset, region_offset);
-                    p->region_offset = 0;
-                }
+        }
+
+        /* Pages that are already assigned keep their region_offset,
+           devices that remap parts of their own region rely on it */
+        page = addr >> TARGET_PAGE_BITS;
+        end_page = page + ((run_end - addr) >> TARGET_PAGE_BITS);
+        while (page < end_page) {
+            int i = phys_section_search(page);
+            target_phys_addr_t next = end_page;
+            ram_addr_t region = region_offset;
+
+            if (i < phys_sections_nr && phys_sections[i].start <= page) {
+                next = MIN(next, phys_sections[i].end);
+                region = phys_section_desc(&phys_sections[i],
+                                           page).region_offset;
+            } else if (i < phys_sections_nr) {
+                next = MIN(next, phys_sections[i].start);
             }
+            phys_section_set(page, next, phys_offset, region);
+
+            delta = (ram_addr_t)(next - page) << TARGET_PAGE_BITS;
+            if (phys_offset_is_linear(phys_offset)) {
+                phys_offset += delta;
+            }
+            region_offset += delta;
+            page = next;
         }
-        region_offset += TARGET_PAGE_SIZE;
+        addr = run_end;
     }
 
     /* since each CPU stores ram addresses in its TLB cache, we must
@@ -2681,12 +3160,7 @@ void cpu_register_physical_memory_offset(target_phys_addr_t start_addr,
 /* XXX: temporary until new memory mapping API */
 ram_addr_t cpu_get_physical_page_desc(target_phys_addr_t addr)
 {
-    PhysPageDesc *p;
-
-    p = phys_page_find(addr >> TARGET_PAGE_BITS);
-    if (!p)
-        return IO_MEM_UNASSIGNED;
-    return p->phys_offset;
+    return phys_page_find(addr >> TARGET_PAGE_BITS).phys_offset;
 }
 
 void qemu_register_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size)
@@ -2701,6 +3175,18 @@ void qemu_unregister_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size)
         kvm_uncoalesce_mmio_region(addr, size);
 }
 
+void qemu_register_coalesced_pio(pio_addr_t addr, uint32_t size)
+{
+    if (kvm_enabled())
+        kvm_coalesce_pio_region(addr, size);
+}
+
+void qemu_unregister_coalesced_pio(pio_addr_t addr, uint32_t size)
+{
+    if (kvm_enabled())
+        kvm_uncoalesce_pio_region(addr, size);
+}
+
 void qemu_flush_coalesced_mmio_buffer(void)
 {
     if (kvm_enabled())
@@ -2740,9 +3226,7 @@ static void *file_ram_alloc(RAMBlock *block,
     char *filename;
     void *area;
     int fd;
-#ifdef MAP_POPULATE
     int flags;
-#endif
     unsigned long hpagesize;
 
     hpagesize = gethugepagesize(path);
@@ -2783,16 +3267,13 @@ static void *file_ram_alloc(RAMBlock *block,
     if (ftruncate(fd, memory))
         perror("ftruncate");
 
-#ifdef MAP_POPULATE
-    /* NB: MAP_POPULATE won't exhaustively alloc all phys pages in the case
-     * MAP_PRIVATE is requested.  For mem_prealloc we mmap as MAP_SHARED
-     * to sidestep this quirk.
+    /* For mem_prealloc the pages are faulted in by ram_setup_host, after
+     * the NUMA policy is in place, rather than with MAP_POPULATE.  It
+     * still maps MAP_SHARED so that the huge pages are really reserved
+     * for the file and not just for this mapping.
      */
-    flags = mem_prealloc ? MAP_POPULATE | MAP_SHARED : MAP_PRIVATE;
+    flags = mem_prealloc ? MAP_SHARED : MAP_PRIVATE;
     area = mmap(0, memory, PROT_READ | PROT_WRITE, flags, fd, 0);
-#else
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-#endif
     if (area == MAP_FAILED) {
         perror("file_ram_alloc: can't mmap RAM pages");
         close(fd);
@@ -2803,6 +3284,230 @@ static void *file_ram_alloc(RAMBlock *block,
 }
 #endif
 
+/*
+ * Guest nodes take their node_mem[] share of the main RAM block in the
+ * order they were given, which is also how the firmware lays them out in
+ * guest physical memory.  Other RAM blocks are left to the host's default
+ * policy.
+ */
+static void ram_numa_bind(void *host, ram_addr_t size)
+{
+#ifdef CONFIG_NUMA
+    static const int modes[] = {
+        [NUMA_POLICY_DEFAULT] = MPOL_DEFAULT,
+        [NUMA_POLICY_PREFERRED] = MPOL_PREFERRED,
+        [NUMA_POLICY_BIND] = MPOL_BIND,
+        [NUMA_POLICY_INTERLEAVE] = MPOL_INTERLEAVE,
+    };
+    static int main_ram_bound;
+    ram_addr_t offset, len;
+    unsigned long mask;
+    int i;
+
+    if (main_ram_bound || size != ram_size) {
+        return;
+    }
+    main_ram_bound = 1;
+
+    for (i = 0, offset = 0; i < nb_numa_nodes && offset < size; i++) {
+        len = MIN(node_mem[i], size - offset);
+        if (node_policy[i] != NUMA_POLICY_DEFAULT && len) {
+            mask = node_host_nodes[i];
+            /* maxnode counts one more than the bits in the mask */
+            if (mbind((uint8_t *)host + offset, len, modes[node_policy[i]],
+                      &mask, sizeof(mask) * 8 + 1, 0) < 0) {
+                perror("mbind");
+            }
+        }
+        offset += len;
+    }
+#endif
+}
+
+#ifdef MAP_POPULATE
+#define RAM_PREFAULT_MAX_THREADS 16
+
+typedef struct RAMPrefault {
+    uint8_t *start;
+    size_t len;
+    size_t pagesize;
+} RAMPrefault;
+
+static void *ram_prefault_thread(void *opaque)
+{
+    RAMPrefault *p = opaque;
+    size_t off;
+
+    /* The memory is fresh, so writing the zeroes back is harmless */
+    for (off = 0; off < p->len; off += p->pagesize) {
+        volatile uint8_t *addr = p->start + off;
+        *addr = *addr;
+    }
+    return NULL;
+}
+
+/* Touch every page of the block, splitting it between one thread per
+   host CPU: faulting in hundreds of gigabytes from one thread takes
+   minutes */
+static void ram_prefault(void *host, ram_addr_t size, size_t pagesize)
+{
+    RAMPrefault work[RAM_PREFAULT_MAX_THREADS];
+    pthread_t threads[RAM_PREFAULT_MAX_THREADS];
+    int started[RAM_PREFAULT_MAX_THREADS];
+    sigset_t set, oldset;
+    size_t chunk, off;
+    long nr;
+    int i;
+
+    nr = sysconf(_SC_NPROCESSORS_ONLN);
+    nr = MAX(1, MIN(nr, RAM_PREFAULT_MAX_THREADS));
+    chunk = (size / pagesize + nr - 1) / nr * pagesize;
+
+    /* Like qemu_thread_create, keep signals away from the helpers */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for (i = 0, off = 0; i < nr && off < size; i++, off += chunk) {
+        work[i].start = (uint8_t *)host + off;
+        work[i].len = MIN(chunk, size - off);
+        work[i].pagesize = pagesize;
+        started[i] = !pthread_create(&threads[i], NULL,
+                                     ram_prefault_thread, &work[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    nr = i;
+    for (i = 0; i < nr; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            ram_prefault_thread(&work[i]);
+        }
+    }
+}
+#endif
+
+/* Memory policy and preallocation for freshly allocated guest RAM, before
+   anything has touched it */
+static void ram_setup_host(void *host, ram_addr_t size, size_t pagesize)
+{
+    ram_numa_bind(host, size);
+#ifdef MAP_POPULATE
+    if (mem_prealloc) {
+        ram_prefault(host, size, pagesize);
+    }
+#endif
+}
+
+/*
+ * Sorted copies of ram_list.blocks for the lookups by ram_addr_t and by
+ * host address.  An index is never modified once published, so lookups
+ * take no lock and may run in any thread; it is rebuilt whenever a block
+ * is added or removed.  Readers only hold on to it for the length of a
+ * binary search, and blocks change under the global mutex, so the index
+ * before the current one is freed when the next one is published.
+ */
+typedef struct RAMBlockIndex {
+    int nr;
+    RAMBlock **by_host;         /* second half of by_offset[] */
+    RAMBlock *by_offset[];
+} RAMBlockIndex;
+
+static RAMBlockIndex *ram_block_index;
+static RAMBlockIndex *ram_block_index_old;
+
+static int ram_block_cmp_offset(const void *a, const void *b)
+{
+    const RAMBlock *x = *(RAMBlock **)a, *y = *(RAMBlock **)b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int ram_block_cmp_host(const void *a, const void *b)
+{
+    const RAMBlock *x = *(RAMBlock **)a, *y = *(RAMBlock **)b;
+
+    return x->host < y->host ? -1 : x->host > y->host;
+}
+
+static void ram_block_index_rebuild(void)
+{
+    RAMBlockIndex *index;
+    RAMBlock *block;
+    int nr = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        nr++;
+    }
+
+    index = qemu_malloc(sizeof(*index) + 2 * nr * sizeof(RAMBlock *));
+    index->nr = 0;
+    index->by_host = index->by_offset + nr;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        index->by_offset[index->nr] = block;
+        index->by_host[index->nr] = block;
+        index->nr++;
+    }
+    qsort(index->by_offset, nr, sizeof(RAMBlock *), ram_block_cmp_offset);
+    qsort(index->by_host, nr, sizeof(RAMBlock *), ram_block_cmp_host);
+
+    smp_wmb();
+    qemu_free(ram_block_index_old);
+    ram_block_index_old = ram_block_index;
+    ram_block_index = index;
+}
+
+static RAMBlock *ram_block_from_offset(ram_addr_t addr)
+{
+    RAMBlockIndex *index = ram_block_index;
+    int lo = 0, hi;
+
+    smp_rmb();
+    if (!index) {
+        return NULL;
+    }
+
+    hi = index->nr;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        RAMBlock *block = index->by_offset[mid];
+
+        if (addr < block->offset) {
+            hi = mid;
+        } else if (addr - block->offset >= block->length) {
+            lo = mid + 1;
+        } else {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static RAMBlock *ram_block_from_host(uint8_t *host)
+{
+    RAMBlockIndex *index = ram_block_index;
+    int lo = 0, hi;
+
+    smp_rmb();
+    if (!index) {
+        return NULL;
+    }
+
+    hi = index->nr;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        RAMBlock *block = index->by_host[mid];
+
+        if (host < block->host) {
+            hi = mid;
+        } else if (host - block->host >= block->length) {
+            lo = mid + 1;
+        } else {
+            return block;
+        }
+    }
+    return NULL;
+}
+
 static ram_addr_t find_ram_offset(ram_addr_t size)
 {
     RAMBlock *block, *next_block;
@@ -2840,10 +3545,29 @@ static ram_addr_t last_ram_offset(void)
     return last;
 }
 
-ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
-                                   ram_addr_t size, void *host)
+static void *ram_alloc_lazy(ram_addr_t size)
+{
+#ifdef _WIN32
+    /* VirtualAlloc already commits pages on first touch */
+    return qemu_vmalloc(size);
+#else
+    void *host = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (host == MAP_FAILED) {
+        perror("ram_alloc_lazy: can't mmap RAM pages");
+        exit(1);
+    }
+    return host;
+#endif
+}
+
+static ram_addr_t ram_block_alloc(DeviceState *dev, const char *name,
+                                  ram_addr_t size, void *host, int lazy)
 {
     RAMBlock *new_block, *block;
+    ram_addr_t addr, old_words, new_words;
+    int64_t start = get_clock();
 
     size = TARGET_PAGE_ALIGN(size);
     new_block = qemu_mallocz(sizeof(*new_block));
@@ -2867,13 +3591,23 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
 
     if (host) {
         new_block->host = host;
+    } else if (lazy) {
+        /* No huge pages either, they would be faulted in 2MB at a time */
+        new_block->host = ram_alloc_lazy(size);
+        new_block->lazy = 1;
+        qemu_madvise(new_block->host, size, QEMU_MADV_MERGEABLE);
     } else {
+        size_t pagesize = qemu_real_host_page_size;
+
         if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
             new_block->host = file_ram_alloc(new_block, size, mem_path);
-            if (!new_block->host) {
+            if (new_block->host) {
+                pagesize = gethugepagesize(mem_path);
+            } else {
                 new_block->host = qemu_vmalloc(size);
                 qemu_madvise(new_block->host, size, QEMU_MADV_MERGEABLE);
+                qemu_madvise(new_block->host, size, QEMU_MADV_HUGEPAGE);
             }
 #else
             fprintf(stderr, "-mem-path option unsupported\n");
@@ -2889,28 +3623,57 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
             new_block->host = qemu_vmalloc(size);
 #endif
             qemu_madvise(new_block->host, size, QEMU_MADV_MERGEABLE);
+            qemu_madvise(new_block->host, size, QEMU_MADV_HUGEPAGE);
         }
+        ram_setup_host(new_block->host, size, pagesize);
     }
 
     new_block->offset = find_ram_offset(size);
     new_block->length = size;
 
+    old_words = ((last_ram_offset() >> TARGET_PAGE_BITS) + 63) / 64;
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
+    ram_block_index_rebuild();
+    new_words = ((last_ram_offset() >> TARGET_PAGE_BITS) + 63) / 64;
 
     ram_list.phys_dirty = qemu_realloc(ram_list.phys_dirty,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
     memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
            0xff, size >> TARGET_PAGE_BITS);
 
+    if (new_words > old_words) {
+        ram_list.migration_dirty = qemu_realloc(ram_list.migration_dirty,
+                                                new_words * sizeof(uint64_t));
+        memset(ram_list.migration_dirty + old_words, 0,
+               (new_words - old_words) * sizeof(uint64_t));
+    }
+    for (addr = new_block->offset; addr < new_block->offset + size;
+         addr += TARGET_PAGE_SIZE) {
+        cpu_physical_memory_set_migration_dirty(addr);
+    }
+
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
 
+    startup_profile_account("ram blocks", get_clock() - start);
     return new_block->offset;
 }
 
+ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
+                                   ram_addr_t size, void *host)
+{
+    return ram_block_alloc(dev, name, size, host, 0);
+}
+
 ram_addr_t qemu_ram_alloc(DeviceState *dev, const char *name, ram_addr_t size)
 {
-    return qemu_ram_alloc_from_ptr(dev, name, size, NULL);
+    return ram_block_alloc(dev, name, size, NULL, 0);
+}
+
+ram_addr_t qemu_ram_alloc_lazy(DeviceState *dev, const char *name,
+                               ram_addr_t size)
+{
+    return ram_block_alloc(dev, name, size, NULL, 1);
 }
 
 void qemu_ram_free(ram_addr_t addr)
@@ -2920,7 +3683,16 @@ void qemu_ram_free(ram_addr_t addr)
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
-            if (mem_path) {
+            ram_block_index_rebuild();
+            cpu_physical_memory_mask_dirty_range(block->offset, block->length,
+                                                 MIGRATION_DIRTY_FLAG);
+            if (block->lazy) {
+#ifdef _WIN32
+                qemu_vfree(block->host);
+#else
+                munmap(block->host, block->length);
+#endif
+            } else if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
                 if (block->fd) {
                     munmap(block->host, block->length);
@@ -2953,53 +3725,35 @@ void qemu_ram_free(ram_addr_t addr)
  */
 void *qemu_get_ram_ptr(ram_addr_t addr)
 {
-    RAMBlock *block;
+    RAMBlock *block = ram_block_from_offset(addr);
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            QLIST_REMOVE(block, next);
-            QLIST_INSERT_HEAD(&ram_list.blocks, block, next);
-            return block->host + (addr - block->offset);
-        }
+    if (!block) {
+        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+        abort();
     }
 
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
-
-    return NULL;
+    return block->host + (addr - block->offset);
 }
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
- * Same as qemu_get_ram_ptr but avoid reordering ramblocks.
+ * Same as qemu_get_ram_ptr, whose lookup no longer reorders ramblocks
+ * either.
  */
 void *qemu_safe_ram_ptr(ram_addr_t addr)
 {
-    RAMBlock *block;
-
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            return block->host + (addr - block->offset);
-        }
-    }
-
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
-
-    return NULL;
+    return qemu_get_ram_ptr(addr);
 }
 
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
 {
-    RAMBlock *block;
-    uint8_t *host = ptr;
+    RAMBlock *block = ram_block_from_host(ptr);
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (host - block->host < block->length) {
-            *ram_addr = block->offset + (host - block->host);
-            return 0;
-        }
+    if (!block) {
+        return -1;
     }
-    return -1;
+
+    *ram_addr = block->offset + ((uint8_t *)ptr - block->host);
+    return 0;
 }
 
 /* Some of the softmmu routines need to translate from a host pointer
@@ -3634,6 +4388,51 @@ int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
 }
 
 #else
+/* Length of a RAM access at addr, whose page is mapped by pd, once
+   extended over the following pages for as long as they map the next
+   offsets of the same RAM block in the same way; at most len.  */
+static int phys_ram_run_length(target_phys_addr_t addr, unsigned long pd,
+                               int len)
+{
+    ram_addr_t ram_addr;
+    unsigned long pd1;
+    RAMBlock *block;
+    int l;
+
+    ram_addr = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
+    block = ram_block_from_offset(ram_addr);
+    if (block && block->offset + block->length - ram_addr < len) {
+        len = block->offset + block->length - ram_addr;
+    }
+    l = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+    while (block && l < len) {
+        pd1 = phys_page_find((addr + l) >> TARGET_PAGE_BITS).phys_offset;
+        if ((pd1 & ~TARGET_PAGE_MASK) != (pd & ~TARGET_PAGE_MASK) ||
+            (pd1 & TARGET_PAGE_MASK) != ram_addr + l) {
+            break;
+        }
+        l += TARGET_PAGE_SIZE;
+    }
+    return MIN(l, len);
+}
+
+/* Mark guest RAM dirty after the host wrote it, invalidating the
+   translated code of the pages that may hold some */
+static void cpu_physical_memory_write_dirty(ram_addr_t start, int length)
+{
+    ram_addr_t addr, end, next;
+
+    end = start + length;
+    for (addr = start; addr < end; addr = next) {
+        next = MIN((addr & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE, end);
+        if (!cpu_physical_memory_get_dirty(addr, CODE_DIRTY_FLAG)) {
+            tb_invalidate_phys_page_range(addr, next, 0);
+        }
+    }
+    cpu_physical_memory_set_dirty_range(start, length,
+                                        0xff & ~CODE_DIRTY_FLAG);
+}
+
 void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write)
 {
@@ -3642,7 +4441,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
     uint32_t val;
     target_phys_addr_t page;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
@@ -3650,18 +4449,13 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
         if (l > len)
             l = len;
         p = phys_page_find(page >> TARGET_PAGE_BITS);
-        if (!p) {
-            pd = IO_MEM_UNASSIGNED;
-        } else {
-            pd = p->phys_offset;
-        }
+        pd = p.phys_offset;
 
         if (is_write) {
             if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
                 target_phys_addr_t addr1 = addr;
                 io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
-                if (p)
-                    addr1 = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+                addr1 = (addr & ~TARGET_PAGE_MASK) + p.region_offset;
                 /* XXX: could force cpu_single_env to NULL to avoid
                    potential bugs */
                 if (l >= 4 && ((addr1 & 3) == 0)) {
@@ -3683,16 +4477,11 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
             } else {
                 unsigned long addr1;
                 addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
-                /* RAM case */
+                /* RAM case: copy up to the end of the contiguous run */
+                l = phys_ram_run_length(addr, pd, len);
                 ptr = qemu_get_ram_ptr(addr1);
                 memcpy(ptr, buf, l);
-                if (!cpu_physical_memory_is_dirty(addr1)) {
-                    /* invalidate code */
-                    tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
-                    /* set dirty bit */
-                    cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
-                }
+                cpu_physical_memory_write_dirty(addr1, l);
             }
         } else {
             if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM &&
@@ -3700,8 +4489,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 target_phys_addr_t addr1 = addr;
                 /* I/O case */
                 io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
-                if (p)
-                    addr1 = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+                addr1 = (addr & ~TARGET_PAGE_MASK) + p.region_offset;
                 if (l >= 4 && ((addr1 & 3) == 0)) {
                     /* 32 bit read access */
                     val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr1);
@@ -3719,7 +4507,8 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     l = 1;
                 }
             } else {
-                /* RAM case */
+                /* RAM case: copy up to the end of the contiguous run */
+                l = phys_ram_run_length(addr, pd, len);
                 ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
                     (addr & ~TARGET_PAGE_MASK);
                 memcpy(buf, ptr, l);
@@ -3739,7 +4528,7 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
     uint8_t *ptr;
     target_phys_addr_t page;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
@@ -3747,11 +4536,7 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
         if (l > len)
             l = len;
         p = phys_page_find(page >> TARGET_PAGE_BITS);
-        if (!p) {
-            pd = IO_MEM_UNASSIGNED;
-        } else {
-            pd = p->phys_offset;
-        }
+        pd = p.phys_offset;
 
         if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM &&
             (pd & ~TARGET_PAGE_MASK) != IO_MEM_ROM &&
@@ -3770,13 +4555,49 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
     }
 }
 
+/* Enough bounce buffers that devices doing DMA to MMIO at the same time
+ * (or one device with a few requests in flight) do not wait for each other.
+ * Each one covers at most a page; the memory is kept once allocated.
+ */
+#define BOUNCE_BUFFERS 16
+
 typedef struct {
     void *buffer;
     target_phys_addr_t addr;
     target_phys_addr_t len;
+    int in_use;
 } BounceBuffer;
 
-static BounceBuffer bounce;
+static BounceBuffer bounce[BOUNCE_BUFFERS];
+
+static BounceBuffer *bounce_get(void)
+{
+    int i;
+
+    for (i = 0; i < BOUNCE_BUFFERS; i++) {
+        if (!bounce[i].in_use) {
+            if (!bounce[i].buffer) {
+                bounce[i].buffer = qemu_memalign(TARGET_PAGE_SIZE,
+                                                 TARGET_PAGE_SIZE);
+            }
+            bounce[i].in_use = 1;
+            return &bounce[i];
+        }
+    }
+    return NULL;
+}
+
+static BounceBuffer *bounce_find(void *buffer)
+{
+    int i;
+
+    for (i = 0; i < BOUNCE_BUFFERS; i++) {
+        if (bounce[i].in_use && bounce[i].buffer == buffer) {
+            return &bounce[i];
+        }
+    }
+    return NULL;
+}
 
 typedef struct MapClient {
     void *opaque;
@@ -3834,7 +4655,7 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
     uint8_t *ptr;
     target_phys_addr_t page;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
     unsigned long addr1;
 
     while (len > 0) {
@@ -3843,23 +4664,20 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
         if (l > len)
             l = len;
         p = phys_page_find(page >> TARGET_PAGE_BITS);
-        if (!p) {
-            pd = IO_MEM_UNASSIGNED;
-        } else {
-            pd = p->phys_offset;
-        }
+        pd = p.phys_offset;
 
         if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
-            if (done || bounce.buffer) {
+            BounceBuffer *b;
+
+            if (done || !(b = bounce_get())) {
                 break;
             }
-            bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
-            bounce.addr = addr;
-            bounce.len = l;
+            b->addr = addr;
+            b->len = l;
             if (!is_write) {
-                cpu_physical_memory_rw(addr, bounce.buffer, l, 0);
+                cpu_physical_memory_rw(addr, b->buffer, l, 0);
             }
-            ptr = bounce.buffer;
+            ptr = b->buffer;
         } else {
             addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
             ptr = qemu_get_ram_ptr(addr1);
@@ -3885,7 +4703,9 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
 void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                                int is_write, target_phys_addr_t access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *b = bounce_find(buffer);
+
+    if (!b) {
         if (is_write) {
             ram_addr_t addr1 = qemu_ram_addr_from_host_nofail(buffer);
             while (access_len) {
@@ -3907,10 +4727,9 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
         return;
     }
     if (is_write) {
-        cpu_physical_memory_write(bounce.addr, bounce.buffer, access_len);
+        cpu_physical_memory_write(b->addr, b->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
+    b->in_use = 0;
     cpu_notify_map_clients();
 }
 
@@ -3921,21 +4740,17 @@ uint32_t ldl_phys(target_phys_addr_t addr)
     uint8_t *ptr;
     uint32_t val;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     p = phys_page_find(addr >> TARGET_PAGE_BITS);
-    if (!p) {
-        pd = IO_MEM_UNASSIGNED;
-    } else {
-        pd = p->phys_offset;
-    }
+
+    pd = p.phys_offset;
 
     if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM &&
         !(pd & IO_MEM_ROMD)) {
         /* I/O case */
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
-        if (p)
-            addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        addr = (addr & ~TARGET_PAGE_MASK) + p.region_offset;
         val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
     } else {
         /* RAM case */
@@ -3953,21 +4768,17 @@ uint64_t ldq_phys(target_phys_addr_t addr)
     uint8_t *ptr;
     uint64_t val;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     p = phys_page_find(addr >> TARGET_PAGE_BITS);
-    if (!p) {
-        pd = IO_MEM_UNASSIGNED;
-    } else {
-        pd = p->phys_offset;
-    }
+
+    pd = p.phys_offset;
 
     if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM &&
         !(pd & IO_MEM_ROMD)) {
         /* I/O case */
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
-        if (p)
-            addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        addr = (addr & ~TARGET_PAGE_MASK) + p.region_offset;
 #ifdef TARGET_WORDS_BIGENDIAN
         val = (uint64_t)io_mem_read[io_index][2](io_mem_opaque[io_index], addr) << 32;
         val |= io_mem_read[io_index][2](io_mem_opaque[io_index], addr + 4);
@@ -3999,21 +4810,17 @@ uint32_t lduw_phys(target_phys_addr_t addr)
     uint8_t *ptr;
     uint64_t val;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     p = phys_page_find(addr >> TARGET_PAGE_BITS);
-    if (!p) {
-        pd = IO_MEM_UNASSIGNED;
-    } else {
-        pd = p->phys_offset;
-    }
+
+    pd = p.phys_offset;
 
     if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM &&
         !(pd & IO_MEM_ROMD)) {
         /* I/O case */
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
-        if (p)
-            addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        addr = (addr & ~TARGET_PAGE_MASK) + p.region_offset;
         val = io_mem_read[io_index][1](io_mem_opaque[io_index], addr);
     } else {
         /* RAM case */
@@ -4032,19 +4839,15 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
     int io_index;
     uint8_t *ptr;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     p = phys_page_find(addr >> TARGET_PAGE_BITS);
-    if (!p) {
-        pd = IO_MEM_UNASSIGNED;
-    } else {
-        pd = p->phys_offset;
-    }
+
+    pd = p.phys_offset;
 
     if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
-        if (p)
-            addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        addr = (addr & ~TARGET_PAGE_MASK) + p.region_offset;
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
     } else {
         unsigned long addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
@@ -4068,19 +4871,15 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
     int io_index;
     uint8_t *ptr;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     p = phys_page_find(addr >> TARGET_PAGE_BITS);
-    if (!p) {
-        pd = IO_MEM_UNASSIGNED;
-    } else {
-        pd = p->phys_offset;
-    }
+
+    pd = p.phys_offset;
 
     if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
-        if (p)
-            addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        addr = (addr & ~TARGET_PAGE_MASK) + p.region_offset;
 #ifdef TARGET_WORDS_BIGENDIAN
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val >> 32);
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr + 4, val);
@@ -4101,19 +4900,15 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
     int io_index;
     uint8_t *ptr;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     p = phys_page_find(addr >> TARGET_PAGE_BITS);
-    if (!p) {
-        pd = IO_MEM_UNASSIGNED;
-    } else {
-        pd = p->phys_offset;
-    }
+
+    pd = p.phys_offset;
 
     if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
-        if (p)
-            addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        addr = (addr & ~TARGET_PAGE_MASK) + p.region_offset;
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
     } else {
         unsigned long addr1;
@@ -4144,19 +4939,15 @@ void stw_phys(target_phys_addr_t addr, uint32_t val)
     int io_index;
     uint8_t *ptr;
     unsigned long pd;
-    PhysPageDesc *p;
+    PhysPageDesc p;
 
     p = phys_page_find(addr >> TARGET_PAGE_BITS);
-    if (!p) {
-        pd = IO_MEM_UNASSIGNED;
-    } else {
-        pd = p->phys_offset;
-    }
+
+    pd = p.phys_offset;
 
     if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
-        if (p)
-            addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
+        addr = (addr & ~TARGET_PAGE_MASK) + p.region_offset;
         io_mem_write[io_index][1](io_mem_opaque[io_index], addr, val);
     } else {
         unsigned long addr1;
@@ -4276,7 +5067,9 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int used_buckets, max_chain, chain, jmp_cache_used, jmp_cache_size;
     TranslationBlock *tb;
+    CPUState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
@@ -4284,7 +5077,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
     for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
+        tb = tb_nth(i);
         target_code_size += tb->size;
         if (tb->size > max_target_code_size)
             max_target_code_size = tb->size;
@@ -4297,18 +5090,42 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
             }
         }
     }
+    used_buckets = 0;
+    max_chain = 0;
+    for (i = 0; i < tb_phys_hash_size; i++) {
+        chain = 0;
+        for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+            chain++;
+        }
+        if (chain) {
+            used_buckets++;
+        }
+        if (chain > max_chain) {
+            max_chain = chain;
+        }
+    }
+    jmp_cache_used = 0;
+    jmp_cache_size = 0;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
+            if (env->tb_jmp_cache[i]) {
+                jmp_cache_used++;
+            }
+        }
+        jmp_cache_size += TB_JMP_CACHE_SIZE;
+    }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %ld/%ld\n",
+                code_gen_used(), code_gen_buffer_max_size);
     cpu_fprintf(f, "TB count            %d/%d\n", 
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %ld bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? code_gen_used() / nb_tbs : 0,
+                target_code_size ? (double) code_gen_used() / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4317,13 +5134,112 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+    cpu_fprintf(f, "TB hash buckets     %d/%u used (avg chain %0.2f max=%d)\n",
+                used_buckets, tb_phys_hash_size,
+                used_buckets ? (double)nb_tbs / used_buckets : 0, max_chain);
+    cpu_fprintf(f, "jump cache entries  %d/%d used\n",
+                jmp_cache_used, jmp_cache_size);
     cpu_fprintf(f, "\nStatistics:\n");
-    cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "jump cache lookups  %" PRIu64 " (miss %0.2f%%)\n",
+                tb_jmp_cache_lookups,
+                tb_jmp_cache_lookups ?
+                (double)tb_phys_hash_lookups / tb_jmp_cache_lookups * 100.0 : 0);
+    cpu_fprintf(f, "TB hash lookups     %" PRIu64 " (miss %0.2f%%, "
+                "avg %0.2f TBs compared)\n",
+                tb_phys_hash_lookups,
+                tb_phys_hash_lookups ?
+                (double)tb_phys_hash_misses / tb_phys_hash_lookups * 100.0 : 0,
+                tb_phys_hash_lookups ?
+                (double)tb_phys_hash_steps / tb_phys_hash_lookups : 0);
+    cpu_fprintf(f, "TB flush count      %d (%" PRId64 " us)\n",
+                tb_flush_count, tb_flush_time / 1000);
+    cpu_fprintf(f, "TB region evictions %d (%" PRIu64 " TBs, %" PRId64 " us)\n",
+                tb_evict_count, tb_evict_tbs, tb_evict_time / 1000);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+#if !defined(CONFIG_USER_ONLY)
+    cpu_fprintf(f, "TLB size            %d entries + %d victim entries\n",
+                CPU_TLB_SIZE, CPU_VTLB_SIZE);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_fprintf(f, "CPU #%d TLB misses   %" PRIu64
+                    " (victim hits %0.2f%%, fills %" PRIu64 ")\n",
+                    env->cpu_index, env->tlb_misses,
+                    env->tlb_misses ?
+                    (double)env->tlb_victim_hits / env->tlb_misses * 100.0 : 0,
+                    env->tlb_fills);
+    }
+#endif
     tcg_dump_info(f, cpu_fprintf);
 }
 
+/* Translated code only counts its executions while profiling, so the
+   translation buffer is flushed whenever profiling starts or stops */
+void tb_profile_start(CPUState *env)
+{
+    qemu_free(tb_profile_table);
+    tb_profile_table = NULL;
+    tb_profile_size = 0;
+    tb_profile_used = 0;
+    tb_profile_enabled = 1;
+    tb_flush(env);
+}
+
+void tb_profile_stop(CPUState *env)
+{
+    if (tb_profile_enabled) {
+        tb_flush(env);
+        tb_profile_enabled = 0;
+    }
+}
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    const TBProfileEntry *ea = a, *eb = b;
+
+    if (ea->count != eb->count) {
+        return ea->count < eb->count ? 1 : -1;
+    }
+    return ea->pc < eb->pc ? -1 : ea->pc > eb->pc;
+}
+
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int max)
+{
+    TBProfileEntry *top;
+    uint64_t total;
+    unsigned int i, n;
+
+    if (tb_profile_enabled) {
+        tb_profile_retire_all();
+    }
+    if (!tb_profile_used) {
+        cpu_fprintf(f, tb_profile_enabled ? "no TB executed yet\n" :
+                    "TB profiling is not enabled\n");
+        return;
+    }
+
+    top = qemu_malloc(tb_profile_used * sizeof(*top));
+    total = 0;
+    n = 0;
+    for (i = 0; i < tb_profile_size; i++) {
+        if (tb_profile_table[i].count) {
+            total += tb_profile_table[i].count;
+            top[n++] = tb_profile_table[i];
+        }
+    }
+    qsort(top, n, sizeof(*top), tb_profile_cmp);
+
+    cpu_fprintf(f, "%" PRIu64 " TB executions, %u guest pcs%s\n", total, n,
+                tb_profile_enabled ? "" : " (stopped)");
+    cpu_fprintf(f, "%20s %6s  %-*s symbol\n", "count", "%",
+                (int)sizeof(target_ulong) * 2, "pc");
+    for (i = 0; i < n && i < max; i++) {
+        cpu_fprintf(f, "%20" PRIu64 " %6.2f  " TARGET_FMT_lx " %s\n",
+                    top[i].count, top[i].count * 100.0 / total, top[i].pc,
+                    lookup_symbol(top[i].pc));
+    }
+    qemu_free(top);
+}
+
 #define MMUSUFFIX _cmmu
 #define GETPC() NULL
 #define env cpu_single_env
@@ -35,7 +35,7 @@
 #include "gdbstub.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+#define MAX_PACKET_LENGTH 16384
 
 #include "exec-all.h"
 #include "qemu_socket.h"
@@ -282,6 +282,7 @@ typedef struct GDBState {
     int line_csum;
     uint8_t last_packet[MAX_PACKET_LENGTH + 4];
     int last_packet_len;
+    int noack;          /* QStartNoAckMode: no '+' after each packet */
     int signal;
 #ifdef CONFIG_USER_ONLY
     int fd;
@@ -424,6 +425,45 @@ static void hextomem(uint8_t *mem, const char *buf, int len)
     }
 }
 
+/* Escapes as much of mem as fits in size bytes of buf for a binary packet;
+   returns the length of the result */
+static int memtobin(char *buf, int size, const uint8_t *mem, int len)
+{
+    char *q = buf;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        uint8_t c = mem[i];
+
+        if (c == '#' || c == '$' || c == '*' || c == '}') {
+            if (q + 2 > buf + size)
+                break;
+            *q++ = '}';
+            c ^= 0x20;
+        } else if (q + 1 > buf + size) {
+            break;
+        }
+        *q++ = c;
+    }
+    return q - buf;
+}
+
+/* Unescapes the binary data from buf up to end; returns its length */
+static int bintomem(uint8_t *mem, int size, const char *buf, const char *end)
+{
+    int len;
+
+    for (len = 0; buf < end && len < size; len++) {
+        if (*buf == '}' && buf + 1 < end) {
+            mem[len] = buf[1] ^ 0x20;
+            buf += 2;
+        } else {
+            mem[len] = *buf++;
+        }
+    }
+    return len;
+}
+
 /* return -1 if error, 0 if OK */
 static int put_packet_binary(GDBState *s, const char *buf, int len)
 {
@@ -445,6 +485,10 @@ static int put_packet_binary(GDBState *s, const char *buf, int len)
 
         s->last_packet_len = p - s->last_packet;
         put_buffer(s, (uint8_t *)s->last_packet, s->last_packet_len);
+        if (s->noack) {
+            s->last_packet_len = 0;
+            break;
+        }
 
 #ifdef CONFIG_USER_ONLY
         i = get_char(s);
@@ -1932,6 +1976,9 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         if (*p == ',')
             p++;
         len = strtoull(p, NULL, 16);
+        /* gdb asks again for whatever a short reply leaves out */
+        if (len > MAX_PACKET_LENGTH / 2 - 1)
+            len = MAX_PACKET_LENGTH / 2 - 1;
         if (cpu_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 0) != 0) {
             put_packet (s, "E14");
         } else {
@@ -1939,6 +1986,22 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, buf);
         }
         break;
+    case 'x':
+        /* binary read, "b" followed by the data escaped as for 'X' */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, NULL, 16);
+        if (len > sizeof(mem_buf))
+            len = sizeof(mem_buf);
+        if (cpu_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 0) != 0) {
+            put_packet(s, "E14");
+            break;
+        }
+        buf[0] = 'b';
+        res = memtobin(buf + 1, sizeof(buf) - 1, mem_buf, len);
+        put_packet_binary(s, buf, res + 1);
+        break;
     case 'M':
         addr = strtoull(p, (char **)&p, 16);
         if (*p == ',')
@@ -1946,12 +2009,35 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         len = strtoull(p, (char **)&p, 16);
         if (*p == ':')
             p++;
+        if (len > sizeof(mem_buf) || strlen(p) < len * 2) {
+            put_packet(s, "E22");
+            break;
+        }
         hextomem(mem_buf, p, len);
         if (cpu_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 1) != 0)
             put_packet(s, "E14");
         else
             put_packet(s, "OK");
         break;
+    case 'X':
+        /* binary write; the data may hold NULs, so its end comes from the
+           length of the packet rather than from the string */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, (char **)&p, 16);
+        if (*p == ':')
+            p++;
+        res = bintomem(mem_buf, sizeof(mem_buf), p,
+                       line_buf + s->line_buf_index);
+        if (res != len) {
+            put_packet(s, "E22");
+        } else if (cpu_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 1) != 0) {
+            put_packet(s, "E14");
+        } else {
+            put_packet(s, "OK");
+        }
+        break;
     case 'p':
         /* Older gdb are really dumb, and don't use 'g' if 'p' is avaialable.
            This works, but can be very slow.  Anything new enough to
@@ -2037,6 +2123,12 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
     case 'q':
     case 'Q':
         /* parse any 'q' packets here */
+        if (ch == 'Q' && !strcmp(p, "StartNoAckMode")) {
+            /* gdb still acknowledges this OK, so the '+' is not missed */
+            put_packet(s, "OK");
+            s->noack = 1;
+            break;
+        }
         if (!strcmp(p,"qemu.sstepbits")) {
             /* Query Breakpoint bit definitions */
             snprintf(buf, sizeof(buf), "ENABLE=%x,NOIRQ=%x,NOTIMER=%x",
@@ -2119,7 +2211,8 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         }
 #endif /* !CONFIG_USER_ONLY */
         if (strncmp(p, "Supported", 9) == 0) {
-            snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH);
+            snprintf(buf, sizeof(buf), "PacketSize=%x;QStartNoAckMode+;"
+                     "binary-upload+", MAX_PACKET_LENGTH);
 #ifdef GDB_CORE_XML
             pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
 #endif
@@ -2358,12 +2451,16 @@ static void gdb_read_byte(GDBState *s, int ch)
                 csum += s->line_buf[i];
             }
             if (s->line_csum != (csum & 0xff)) {
-                reply = '-';
-                put_buffer(s, &reply, 1);
+                if (!s->noack) {
+                    reply = '-';
+                    put_buffer(s, &reply, 1);
+                }
                 s->state = RS_IDLE;
             } else {
-                reply = '+';
-                put_buffer(s, &reply, 1);
+                if (!s->noack) {
+                    reply = '+';
+                    put_buffer(s, &reply, 1);
+                }
                 s->state = gdb_handle_packet(s, s->line_buf);
             }
             break;
@@ -2590,6 +2687,7 @@ static void gdb_chr_event(void *opaque, int event)
     case CHR_EVENT_OPENED:
         vm_stop(VMSTOP_USER);
         gdb_has_xml = 0;
+        gdbserver_state->noack = 0;
         break;
     default:
         break;
@@ -70,6 +70,73 @@ but should be used with extreme caution.  Note that this command only
 resizes image files, it can not resize block devices like LVM volumes.
 ETEXI
 
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps_rd:o,bps_wr:o,iops_rd:i,iops_wr:i",
+        .params     = "device bps_rd bps_wr iops_rd iops_wr",
+        .help       = "limit the I/O rate of a block device (0 for no limit)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+STEXI
+@item block_set_io_throttle @var{device} @var{bps_rd} @var{bps_wr} @var{iops_rd} @var{iops_wr}
+@findex block_set_io_throttle
+Limit the read and write bandwidth, in bytes per second, and the read and
+write requests per second of @var{device}; 0 removes a limit.  The guest
+requests over the limits wait until the limits let them through.
+ETEXI
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .help       = "copy the backing file of a block device into its image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device} [@var{speed}]
+@findex block_stream
+Copy the data @var{device} reads from its backing file chain into its
+image in the background, at most @var{speed} bytes per second, and drop
+the backing file once the image holds all of it.  The guest keeps
+running meanwhile; @code{info block-jobs} shows how far the copy is.
+ETEXI
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set the speed limit of a block job (0 for no limit)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+STEXI
+@item block_job_set_speed @var{device} @var{value}
+@findex block_job_set_speed
+Limit the block job of @var{device} to @var{value} bytes per second; 0
+removes the limit.
+ETEXI
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop the block job of a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+STEXI
+@item block_job_cancel @var{device}
+@findex block_job_cancel
+Stop the block job of @var{device}.  What a stream job copied stays in
+the image, a new @code{block_stream} goes on from there.
+ETEXI
+
 
     {
         .name       = "eject",
@@ -222,38 +289,80 @@ STEXI
 @item log @var{item1}[,...]
 @findex log
 Activate logging of the specified items to @file{/tmp/qemu.log}.
+ETEXI
+
+    {
+        .name       = "lockstats",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "start or stop timing the holders of the global mutex",
+        .mhandler.cmd = do_lockstats,
+    },
+
+STEXI
+@item lockstats on|off
+@findex lockstats
+Start or stop timing who holds the global mutex of the I/O thread: the main
+loop, the vcpu threads while they handle port I/O, MMIO or other exits, and
+everyone else.  Starting clears the previous figures; @code{info lockstats}
+shows them.
+ETEXI
+
+    {
+        .name       = "tbprofile",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "start or stop counting the executions of translated blocks",
+        .mhandler.cmd = do_tbprofile,
+    },
+
+STEXI
+@item tbprofile on|off
+@findex tbprofile
+Start or stop counting how many times each translated block runs, to find
+the hot guest code under TCG.  The translated code is flushed on both, as
+only blocks translated while profiling count their executions.  Starting
+clears the previous figures; @code{info tbprofile} shows them.
 ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "incremental:-i,name:s?",
+        .params     = "[-i] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created "
+                      "(use -i to only write the RAM changed since the last snapshot saved or loaded with -i)",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-i] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
-a snapshot with the same tag or ID, it is replaced. More info at
-@ref{vm_snapshots}.
+a snapshot with the same tag or ID, it is replaced. With @option{-i},
+RAM is stored in place, and only the pages written since the previous
+@code{savevm -i} or @code{loadvm} of such a snapshot are saved. More info
+at @ref{vm_snapshots}.
 ETEXI
 
     {
         .name       = "loadvm",
-        .args_type  = "name:s",
-        .params     = "tag|id",
-        .help       = "restore a VM snapshot from its tag or id",
+        .args_type  = "lazy:-l,name:s",
+        .params     = "[-l] tag|id",
+        .help       = "restore a VM snapshot from its tag or id "
+                      "(use -l to restore RAM while the guest runs)",
         .mhandler.cmd = do_loadvm,
     },
 
 STEXI
-@item loadvm @var{tag}|@var{id}
+@item loadvm [-l] @var{tag}|@var{id}
 @findex loadvm
 Set the whole virtual machine to the snapshot identified by the tag
-@var{tag} or the unique snapshot ID @var{id}.
+@var{tag} or the unique snapshot ID @var{id}.  With @option{-l}, a
+snapshot saved with @code{savevm -i} restarts as soon as its device state
+is loaded; RAM is read from the image as the guest touches it, and in the
+background.  This needs a @code{qcow2} image in a plain file and
+userfaultfd support, otherwise all of RAM is restored first.
 ETEXI
 
     {
@@ -587,18 +696,286 @@ ETEXI
 
     {
         .name       = "device_show",
-        .args_type  = "path:Q",
-        .params     = "device [-f]",
-        .help       = "show device state (specify -f for full buffer dumping)",
+        .args_type  = "full:-f,capture:-c,path:Q,max-bytes:i?,max-elems:i?,"
+                      "max-us:i?,continue:s?",
+        .params     = "[-f] [-c] device [max-bytes [max-elems [max-us [continue]]]]",
+        .help       = "show device state (specify -f for full buffer dumping, "
+                      "-c to format a copy without pre_save hooks); stop "
+                      "after max-bytes, max-elems or max-us (0 for no limit) "
+                      "and resume with the continue token",
         .user_print = device_user_print,
         .mhandler.cmd_new = do_device_show,
     },
 
 STEXI
-@item device_show @var{path}
+@item device_show [-f] [-c] @var{path} [@var{max-bytes} [@var{max-elems} [@var{max-us} [@var{continue}]]]]
 @findex device_show
 
-Show Device @var{path}.
+Show Device @var{path}.  Buffers are truncated to their first 16 bytes
+unless @var{-f} is given.  With @var{-c}, the raw field memory is copied
+first and the copy is formatted with the vCPUs running; the device's
+pre_save hooks are not called and queues are not shown.
+
+With @var{max-bytes}, @var{max-elems} or @var{max-us} (0 for no limit),
+showing stops once that many bytes of values or array and queue elements
+were shown, or that many microseconds passed, and ends with a token to pass
+as @var{continue} for the rest.  These cannot be combined with @var{-c}.
+
+Some devices also show state kept in guest memory, under @code{guest state}.
+For virtio devices, that is every configured virtqueue with its ring
+indices, the number of chains the guest made available that were not
+taken yet (@code{pending}) and taken but not completed yet (@code{inuse}),
+and the descriptors of up to 64 of the pending chains.  Virtio devices have
+no state description and show no fields.
+ETEXI
+
+    {
+        .name       = "device_buffer",
+        .args_type  = "path:Q,field:s,offset:i?,length:i?,fd:s?",
+        .params     = "device field [offset [length [fd]]]",
+        .help       = "dump length bytes of a device state field starting at offset",
+        .user_print = device_buffer_user_print,
+        .mhandler.cmd_new = do_device_buffer,
+    },
+
+STEXI
+@item device_buffer @var{path} @var{field} [@var{offset} [@var{length} [@var{fd}]]]
+@findex device_buffer
+
+Dump the raw contents of state field @var{field} of device @var{path},
+like @code{rx[3].status} or @code{mem}.  At most 64 KiB starting at
+@var{offset} are shown at once.  With @var{fd}, the data is written to a
+file descriptor previously passed with @code{getfd} instead.
+ETEXI
+
+    {
+        .name       = "device_queue",
+        .args_type  = "full:-f,path:Q,field:s,start:i?,count:i?",
+        .params     = "[-f] device field [start [count]]",
+        .help       = "show count elements of a device state queue starting at start",
+        .user_print = device_user_print,
+        .mhandler.cmd_new = do_device_queue,
+    },
+
+STEXI
+@item device_queue [-f] @var{path} @var{field} [@var{start} [@var{count}]]
+@findex device_queue
+
+Show @var{count} (default 64) elements of queue @var{field} of device
+@var{path}, starting with element number @var{start}.  @code{device_show}
+only includes the first 16 elements of each queue.
+ETEXI
+
+    {
+        .name       = "device_show_all",
+        .args_type  = "capture:-c,pattern:s?,since:l?",
+        .params     = "[-c] [pattern [since]]",
+        .help       = "show the state of all devices, or of those matching pattern; "
+                      "with since, only of those that may have changed after "
+                      "that generation (-c to format copies in parallel "
+                      "without pre_save hooks)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_show_all,
+    },
+
+STEXI
+@item device_show_all [-c] [@var{pattern} [@var{since}]]
+@findex device_show_all
+
+Show the state of every device in the device tree that has a state
+description or guest state, as device_show would.  With @var{pattern}, only devices whose driver name, instance
+name (like @code{e1000.0}) or ID match the shell wildcard @var{pattern} are
+shown.  With @var{since}, devices that track their state changes are left
+out unless they changed after generation @var{since}; pass the highest
+@code{generation} of the previous call.  With @option{-c}, the fields of
+all devices are copied first and formatted by worker threads without
+holding the global mutex, as for @code{device_show -c}.
+ETEXI
+
+    {
+        .name       = "device_snapshot",
+        .args_type  = "path:Q",
+        .params     = "device",
+        .help       = "take a binary snapshot of the device state",
+        .user_print = device_snapshot_user_print,
+        .mhandler.cmd_new = do_device_snapshot,
+    },
+
+STEXI
+@item device_snapshot @var{path}
+@findex device_snapshot
+
+Copy the state of device @var{path} into one binary blob laid out as
+described by @code{device_schema}.
+ETEXI
+
+    {
+        .name       = "device_schema",
+        .args_type  = "path:Q",
+        .params     = "device",
+        .help       = "show the layout of device_snapshot blobs for a device",
+        .user_print = device_schema_user_print,
+        .mhandler.cmd_new = do_device_schema,
+    },
+
+STEXI
+@item device_schema @var{path}
+@findex device_schema
+
+Show the state layout of device @var{path}.
+ETEXI
+
+    {
+        .name       = "vmstate_schemas",
+        .args_type  = "hash:s?",
+        .params     = "[hash]",
+        .help       = "show the layouts of all device state descriptions",
+        .user_print = vmstate_schemas_user_print,
+        .mhandler.cmd_new = do_vmstate_schemas,
+    },
+
+STEXI
+@item vmstate_schemas [@var{hash}]
+@findex vmstate_schemas
+
+List all state descriptions with their versions and subsections, and the
+hash of their layouts.  Only the hash is shown if it equals @var{hash}.
+ETEXI
+
+    {
+        .name       = "vmstate_bench",
+        .args_type  = "iterations:i?",
+        .params     = "[iterations]",
+        .help       = "measure the device state walkers on every device",
+        .user_print = vmstate_bench_user_print,
+        .mhandler.cmd_new = do_vmstate_bench,
+    },
+
+STEXI
+@item vmstate_bench [@var{iterations}]
+@findex vmstate_bench
+
+Dump, snapshot, save and load the state of every device @var{iterations}
+times (default 1000) with the guest stopped, and show the time, bytes and
+allocations of one call, by device.
+ETEXI
+
+    {
+        .name       = "device_watch",
+        .args_type  = "path:Q,interval:i?",
+        .params     = "device [interval]",
+        .help       = "report device state changes every interval ms as QMP events",
+        .user_print = device_watch_user_print,
+        .mhandler.cmd_new = do_device_watch,
+    },
+
+STEXI
+@item device_watch @var{path} [@var{interval}]
+@findex device_watch
+
+Sample the state of device @var{path} every @var{interval} milliseconds
+(default 1000) and emit a DEVICE_STATE_CHANGE QMP event listing the fields
+that changed since the previous sample.
+ETEXI
+
+    {
+        .name       = "device_unwatch",
+        .args_type  = "id:i",
+        .params     = "id",
+        .help       = "stop a device_watch subscription",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_unwatch,
+    },
+
+STEXI
+@item device_unwatch @var{id}
+@findex device_unwatch
+
+Stop the device state watch @var{id}.
+ETEXI
+
+    {
+        .name       = "device_sample",
+        .args_type  = "delta:-d,path:Q,interval:i?,slots:i?,fields:s?",
+        .params     = "[-d] device [interval [slots [fields]]]",
+        .help       = "sample device state, or only the given fields, every interval ms into a ring of slots records (interval 0 stops, -d to keep deltas)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_sample,
+    },
+
+STEXI
+@item device_sample [-d] @var{path} [@var{interval} [@var{slots} [@var{fields}]]]
+@findex device_sample
+
+Snapshot the state of device @var{path} every @var{interval} milliseconds
+(default 100) into a ring holding the last @var{slots} samples (default
+256).  Restarting sampling discards the history, an @var{interval} of 0
+stops sampling.  With @var{fields}, a comma separated list of integer
+fields, only those are sampled and @code{device_history} shows them as a
+table.  With @option{-d}, each sample is kept as a delta against the
+previous one, which allows much longer histories; @var{slots} is then at
+least 64.
+ETEXI
+
+    {
+        .name       = "device_history",
+        .args_type  = "path:Q,at:l?",
+        .params     = "device [at]",
+        .help       = "return the samples collected by device_sample",
+        .user_print = device_history_user_print,
+        .mhandler.cmd_new = do_device_history,
+    },
+
+STEXI
+@item device_history @var{path} [@var{at}]
+@findex device_history
+
+Show the samples collected by @code{device_sample} for device @var{path},
+or with @var{at} only the last one taken at or before that @code{rt_clock}
+time in nanoseconds.
+ETEXI
+
+    {
+        .name       = "device_export",
+        .args_type  = "chardev:s,interval:i?",
+        .params     = "chardev [interval]",
+        .help       = "write the state of all devices to chardev every interval ms in a fixed binary layout (interval 0 stops)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_export,
+    },
+
+STEXI
+@item device_export @var{chardev} [@var{interval}]
+@findex device_export
+
+Write the state of every device to character device @var{chardev} every
+@var{interval} milliseconds (default 1000), an @var{interval} of 0 stops.
+Each device is one record with its fields at fixed offsets, as described
+once per connection by a layout frame; see hw/qdev-export.c for the
+format.  The character device should not be used for anything else.
+ETEXI
+
+#ifdef CONFIG_POSIX
+    {
+        .name       = "device_shm",
+        .args_type  = "path:F,interval:i?",
+        .params     = "path [interval]",
+        .help       = "copy the state of all devices into shared memory file path every interval ms (interval 0 stops)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_shm,
+    },
+#endif
+
+STEXI
+@item device_shm @var{path} [@var{interval}]
+@findex device_shm
+
+Copy the state of every device into the shared memory file @var{path}
+every @var{interval} milliseconds (default 1000), an @var{interval} of 0
+stops and removes the file.  Each device has a slot with a sequence count
+that is odd while it is written, and its record in the layout of
+@code{device_export}.  Devices that track changes are only copied when they
+changed.  See hw/qdev-shm.c for the format.
 ETEXI
 
     {
@@ -770,24 +1147,31 @@ ETEXI
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
-        .params     = "[-d] [-b] [-i] uri",
+        .args_type  = "detach:-d,blk:-b,inc:-i,postcopy:-p,uri:s",
+        .params     = "[-d] [-b] [-i] [-p] uri",
         .help       = "migrate to URI (using -d to not wait for completion)"
 		      "\n\t\t\t -b for migration without shared storage with"
 		      " full copy of disk\n\t\t\t -i for migration without "
 		      "shared storage with incremental copy of disk "
-		      "(base image shared between src and destination)",
+		      "(base image shared between src and destination)"
+		      "\n\t\t\t -p to run the guest on the destination "
+		      "right away and copy RAM after it (post-copy)",
         .user_print = monitor_user_noop,	
 	.mhandler.cmd_new = do_migrate,
     },
 
 
 STEXI
-@item migrate [-d] [-b] [-i] @var{uri}
+@item migrate [-d] [-b] [-i] [-p] @var{uri}
 @findex migrate
 Migrate to @var{uri} (using -d to not wait for completion).
 	-b for migration with full copy of disk
 	-i for migration with incremental copy of disk (base image is shared)
+	-p for post-copy migration: the guest moves to the destination as
+	   soon as disks are copied, and its RAM follows, pages touched by
+	   the guest first.  Needs a tcp or unix @var{uri}.
+A @var{uri} of file:@var{path} records the migration stream in @var{path},
+to be replayed with -incoming.
 ETEXI
 
     {
@@ -834,6 +1218,95 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_compression",
+        .args_type  = "threads:i,level:i?",
+        .params     = "threads [level]",
+        .help       = "compress RAM pages of the next migrations with threads threads (0 to disable)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compression,
+    },
+
+STEXI
+@item migrate_set_compression @var{threads} [@var{level}]
+@findex migrate_set_compression
+Compress RAM pages of the following migrations with zlib, using @var{threads}
+compression threads and compression @var{level} 1 to 9 (default 1).  0
+threads disable compression.  The destination must support compressed
+pages.
+ETEXI
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set the cache of sent pages for delta encoding of the next migrations to value bytes (0 to disable)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Keep a cache of up to @var{value} bytes of sent pages during the following
+migrations, and send pages that get dirty again as a delta against their
+cached copy.  0 disables the cache.  The destination must support delta
+encoded pages.
+ETEXI
+
+    {
+        .name       = "migrate_set_channels",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "stripe RAM pages of the next tcp migrations over value connections",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_channels,
+    },
+
+STEXI
+@item migrate_set_channels @var{value}
+@findex migrate_set_channels
+Open @var{value} extra connections to the destination of the following tcp
+migrations, each with a thread of its own on both sides, and stripe RAM
+pages over them.  Device state stays on the main connection.  1, the
+default, sends everything over the main connection.
+ETEXI
+
+    {
+        .name       = "migrate_set_auto_converge",
+        .args_type  = "value:b",
+        .params     = "on|off",
+        .help       = "throttle the guest when migration does not converge",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_auto_converge,
+    },
+
+STEXI
+@item migrate_set_auto_converge on|off
+@findex migrate_set_auto_converge
+When the guest keeps dirtying memory faster than migration sends it, keep
+its vcpus off for a growing share of the time, until the remaining memory
+can be sent within the maximum downtime.  @code{info migrate} shows the
+measured rates, the prediction and the current throttling.
+ETEXI
+
+    {
+        .name       = "migrate_set_block_queue_depth",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "let block migration have up to value reads in flight per device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_block_queue_depth,
+    },
+
+STEXI
+@item migrate_set_block_queue_depth @var{value}
+@findex migrate_set_block_queue_depth
+Let block migration keep up to @var{value} reads in flight per device, 16
+by default.  Each device starts with 2 and takes one more as long as that
+raises its measured read bandwidth.
 ETEXI
 
     {
@@ -1067,6 +1540,23 @@ STEXI
 @item set_link @var{name} [on|off]
 @findex set_link
 Switch link @var{name} on (i.e. up) or off (i.e. down).
+ETEXI
+
+    {
+        .name       = "netdev_set_limits",
+        .args_type  = "id:s,bps_tx:o?,bps_rx:o?,pps_tx:i?,pps_rx:i?",
+        .params     = "id [bps_tx] [bps_rx] [pps_tx] [pps_rx]",
+        .help       = "limit the bandwidth and packet rate of a netdev",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_netdev_set_limits,
+    },
+
+STEXI
+@item netdev_set_limits @var{id} [@var{bps_tx} [@var{bps_rx} [@var{pps_tx} [@var{pps_rx}]]]]
+@findex netdev_set_limits
+Limit the bytes and packets per second the guest may send (tx) and receive
+(rx) through netdev @var{id}.  0 removes a limit, and limits not given are
+left as they are.
 ETEXI
 
     {
@@ -1308,6 +1798,10 @@ show the character devices
 show the block devices
 @item info blockstats
 show block device statistics
+@item info block-cache
+show the backing file cache statistics
+@item info block-jobs
+show the running block jobs
 @item info registers
 show the cpu registers
 @item info cpus
@@ -1326,18 +1820,38 @@ show virtual to physical memory mappings (i386, SH4 and SPARC only)
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tbprofile
+show the guest pcs whose translated blocks ran most often, with their symbols
 @item info kvm
 show KVM information
 @item info numa
 show NUMA information
 @item info kvm
 show KVM information
+@item info kvmstat
+show, per vcpu, how often each KVM exit reason and the busiest I/O ports and
+MMIO addresses came up, and how long userspace took to handle them
 @item info usb
 show USB devices plugged on the virtual USB hub
 @item info usbhost
 show all USB host devices
 @item info profile
 show profiling information
+@item info lockstats
+show how long the global mutex was waited for and held, and how many vcpu
+exits were handled without it
+@item info mutexes
+show, for qemu_global_mutex and the posix-aio locks, how many acquisitions
+were contended, histograms of the time they were waited for and held, and
+the callers that waited longest (needs --enable-mutex-stats)
+@item info arenas
+show, for the arena of each monitor, how many allocations it made and how
+many bytes per command, and how often a command left objects alive so that
+the arena could not be reset at once
+@item info virtio-latency
+show, for every virtio queue, how long requests took from the guest's kick
+to the pop, to the submission to the backend, to its completion, to the push
+onto the used ring and to the interrupt (needs --enable-virtio-latency)
 @item info capture
 show information about active capturing
 @item info snapshots
@@ -1350,6 +1864,10 @@ show guest PCMCIA status
 show which guest mouse is receiving events
 @item info vnc
 show the vnc server status
+@item info qxl
+show, per qxl device, how deep the command ring was at each guest notify,
+how many worker wakeups the notifies were coalesced into, and how long
+local rendering updates took
 @item info name
 show the current VM name
 @item info uuid
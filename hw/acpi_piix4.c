@@ -260,6 +260,9 @@ static void pm_io_space_update(PIIX4PMState *s)
         PIIX4_DPRINTF("PM: mapping to 0x%x\n", pm_io_base);
         iorange_init(&s->ioport, &pm_iorange_ops, pm_io_base, 64);
         ioport_register(&s->ioport);
+        /* Reading the PM timer only samples vm_clock and guests using it
+           as a clocksource read it all the time */
+        ioport_set_unlocked(pm_io_base + 0x08, 4, NULL);
     }
 }
 
@@ -74,7 +74,6 @@
 #define MSI_ADDR_DEST_ID_SHIFT		12
 #define	MSI_ADDR_DEST_ID_MASK		0x00ffff0
 
-#define MSI_ADDR_SIZE                   0x100000
 
 typedef struct APICState APICState;
 
@@ -110,6 +109,7 @@ static int apic_irq_delivered;
 
 static void apic_set_irq(APICState *s, int vector_num, int trigger_mode);
 static void apic_update_irq(APICState *s);
+static void apic_set_tpr(APICState *s, uint8_t val);
 static void apic_get_delivery_bitmask(uint32_t *deliver_bitmask,
                                       uint8_t dest, uint8_t dest_mode);
 
@@ -310,6 +310,7 @@ void cpu_set_apic_base(DeviceState *d, uint64_t val)
         cpu_clear_apic_feature(s->cpu_env);
         s->spurious_vec &= ~APIC_SV_ENABLE;
     }
+    qdev_state_changed(&s->busdev.qdev);
 }
 
 uint64_t cpu_get_apic_base(DeviceState *d)
@@ -327,8 +328,7 @@ void cpu_set_apic_tpr(DeviceState *d, uint8_t val)
 
     if (!s)
         return;
-    s->tpr = (val & 0x0f) << 4;
-    apic_update_irq(s);
+    apic_set_tpr(s, (val & 0x0f) << 4);
 }
 
 uint8_t cpu_get_apic_tpr(DeviceState *d)
@@ -404,6 +404,24 @@ static void apic_update_irq(APICState *s)
     }
 }
 
+/*
+ * Guests write the TPR far more often than anything else in the APIC, and
+ * KVM hands back CR8 after every exit.  An interrupt that is already
+ * deliverable has been signalled, and a TPR that stays the same or goes up
+ * can't let a new one through, so only a lower TPR needs the pending
+ * interrupts looked at.
+ */
+static void apic_set_tpr(APICState *s, uint8_t val)
+{
+    uint8_t old = s->tpr;
+
+    s->tpr = val;
+    qdev_state_changed(&s->busdev.qdev);
+    if (val < old) {
+        apic_update_irq(s);
+    }
+}
+
 void apic_reset_irq_delivered(void)
 {
     trace_apic_reset_irq_delivered(apic_irq_delivered);
@@ -429,6 +447,7 @@ static void apic_set_irq(APICState *s, int vector_num, int trigger_mode)
         set_bit(s->tmr, vector_num);
     else
         reset_bit(s->tmr, vector_num);
+    qdev_state_changed(&s->busdev.qdev);
     apic_update_irq(s);
 }
 
@@ -439,6 +458,7 @@ static void apic_eoi(APICState *s)
     if (isrv < 0)
         return;
     reset_bit(s->isr, isrv);
+    qdev_state_changed(&s->busdev.qdev);
     if (!(s->spurious_vec & APIC_SV_DIRECTED_IO) && get_bit(s->tmr, isrv)) {
         ioapic_eoi_broadcast(isrv);
     }
@@ -526,11 +546,13 @@ void apic_init_reset(DeviceState *d)
     s->initial_count_load_time = 0;
     s->next_time = 0;
     s->wait_for_sipi = 1;
+    qdev_state_changed(&s->busdev.qdev);
 }
 
 static void apic_startup(APICState *s, int vector_num)
 {
     s->sipi_vector = vector_num;
+    qdev_state_changed(&s->busdev.qdev);
     cpu_interrupt(s->cpu_env, CPU_INTERRUPT_SIPI);
 }
 
@@ -544,6 +566,7 @@ void apic_sipi(DeviceState *d)
         return;
     cpu_x86_load_seg_cache_sipi(s->cpu_env, s->sipi_vector);
     s->wait_for_sipi = 0;
+    qdev_state_changed(&s->busdev.qdev);
 }
 
 static void apic_deliver(DeviceState *d, uint8_t dest, uint8_t dest_mode,
@@ -579,7 +602,8 @@ static void apic_deliver(DeviceState *d, uint8_t dest, uint8_t dest_mode,
                 int level = (s->icr[0] >> 14) & 1;
                 if (level == 0 && trig_mode == 1) {
                     foreach_apic(apic_iter, deliver_bitmask,
-                                 apic_iter->arb_id = apic_iter->id );
+                                 apic_iter->arb_id = apic_iter->id;
+                                 qdev_state_changed(&apic_iter->busdev.qdev) );
                     return;
                 }
             }
@@ -616,6 +640,7 @@ int apic_get_interrupt(DeviceState *d)
     }
     reset_bit(s->irr, intno);
     set_bit(s->isr, intno);
+    qdev_state_changed(&s->busdev.qdev);
     apic_update_irq(s);
     return intno;
 }
@@ -686,6 +711,7 @@ static void apic_timer(void *opaque)
 
     apic_local_deliver(s, APIC_LVT_TIMER);
     apic_timer_update(s, s->next_time);
+    qdev_state_changed(&s->busdev.qdev);
 }
 
 static uint32_t apic_mem_readb(void *opaque, target_phys_addr_t addr)
@@ -786,7 +812,7 @@ static uint32_t apic_mem_readl(void *opaque, target_phys_addr_t addr)
     return val;
 }
 
-static void apic_send_msi(target_phys_addr_t addr, uint32_t data)
+void apic_send_msi(uint64_t addr, uint32_t data)
 {
     uint8_t dest = (addr & MSI_ADDR_DEST_ID_MASK) >> MSI_ADDR_DEST_ID_SHIFT;
     uint8_t vector = (data & MSI_DATA_VECTOR_MASK) >> MSI_DATA_VECTOR_SHIFT;
@@ -819,6 +845,7 @@ static void apic_mem_writel(void *opaque, target_phys_addr_t addr, uint32_t val)
     s = DO_UPCAST(APICState, busdev.qdev, d);
 
     trace_apic_mem_writel(addr, val);
+    qdev_state_changed(d);
 
     switch(index) {
     case 0x02:
@@ -827,8 +854,7 @@ static void apic_mem_writel(void *opaque, target_phys_addr_t addr, uint32_t val)
     case 0x03:
         break;
     case 0x08:
-        s->tpr = val;
-        apic_update_irq(s);
+        apic_set_tpr(s, val);
         break;
     case 0x09:
     case 0x0a:
@@ -928,12 +954,50 @@ static int apic_load_old(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
-const VMStateDescription vmstate_apic = {
+static const VMStateBit apic_lvt_timer_bits[] = {
+    { "vector",        0xff },
+    { "send_pending",  APIC_SEND_PENDING },
+    { "masked",        APIC_LVT_MASKED },
+    { "periodic",      APIC_LVT_TIMER_PERIODIC },
+    { NULL }
+};
+
+static const VMStateBit apic_lvt_lint_bits[] = {
+    { "vector",        0xff },
+    { "delivery_mode", 0x700 },
+    { "send_pending",  APIC_SEND_PENDING },
+    { "polarity",      APIC_INPUT_POLARITY },
+    { "remote_irr",    APIC_LVT_REMOTE_IRR },
+    { "level_trigger", APIC_LVT_LEVEL_TRIGGER },
+    { "masked",        APIC_LVT_MASKED },
+    { NULL }
+};
+
+static const VMStateBit apic_lvt_error_bits[] = {
+    { "vector",        0xff },
+    { "send_pending",  APIC_SEND_PENDING },
+    { "masked",        APIC_LVT_MASKED },
+    { NULL }
+};
+
+static const VMStateBit apic_icr_bits[] = {
+    { "vector",         0xff },
+    { "delivery_mode",  0x700 },
+    { "dest_mode",      1 << 11 },
+    { "send_pending",   APIC_SEND_PENDING },
+    { "level",          1 << 14 },
+    { "trigger_mode",   1 << 15 },
+    { "dest_shorthand", 3 << 18 },
+    { NULL }
+};
+
+static const VMStateDescription vmstate_apic = {
     .name = "apic",
     .version_id = 3,
     .minimum_version_id = 3,
     .minimum_version_id_old = 1,
     .load_state_old = apic_load_old,
+    .tracks_changes = 1,
     .fields      = (VMStateField []) {
         VMSTATE_UINT32(apicbase, APICState),
         VMSTATE_UINT8(id, APICState),
@@ -947,8 +1011,16 @@ const VMStateDescription vmstate_apic = {
         VMSTATE_UINT32_ARRAY(irr, APICState, 8),
         VMSTATE_UINT32_ARRAY(lvt, APICState, APIC_LVT_NB),
         VMSTATE_UINT32(esr, APICState),
-        VMSTATE_BITFIELD(lvt[APIC_LVT_TIMER], APICState, APIC_LVT_TIMER, APIC_LVT_TIMER_PERIODIC, "APIC_LVT_TIMER_PERIODIC"),
+        VMSTATE_BITFIELD("lvt_timer", lvt[APIC_LVT_TIMER], APICState,
+                         apic_lvt_timer_bits),
+        VMSTATE_BITFIELD("lvt_lint0", lvt[APIC_LVT_LINT0], APICState,
+                         apic_lvt_lint_bits),
+        VMSTATE_BITFIELD("lvt_lint1", lvt[APIC_LVT_LINT1], APICState,
+                         apic_lvt_lint_bits),
+        VMSTATE_BITFIELD("lvt_error", lvt[APIC_LVT_ERROR], APICState,
+                         apic_lvt_error_bits),
         VMSTATE_UINT32_ARRAY(icr, APICState, 2),
+        VMSTATE_BITFIELD("icr_low", icr[0], APICState, apic_icr_bits),
         VMSTATE_UINT32(divide_conf, APICState),
         VMSTATE_INT32(count_shift, APICState),
         VMSTATE_UINT32(initial_count, APICState),
@@ -8,6 +8,9 @@ void apic_deliver_irq(uint8_t dest, uint8_t dest_mode,
                              uint8_t delivery_mode,
                              uint8_t vector_num, uint8_t polarity,
                              uint8_t trigger_mode);
+/* Size of the window at 0xfee00000 whose writes are MSI messages */
+#define MSI_ADDR_SIZE 0x100000
+void apic_send_msi(uint64_t addr, uint32_t data);
 int apic_accept_pic_intr(DeviceState *s);
 void apic_deliver_pic_intr(DeviceState *s, int level);
 int apic_get_interrupt(DeviceState *s);
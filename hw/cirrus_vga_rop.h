@@ -37,9 +37,22 @@ static inline void glue(rop_32_,ROP_NAME)(uint32_t *dst, uint32_t src)
     *dst = ROP_FN(*dst, src);
 }
 
+/* The ROPs are bitwise, so whole words can go through them whatever the
+   depth.  dst and src need not be aligned.  */
+static inline void glue(rop_64_,ROP_NAME)(uint8_t *dst, const uint8_t *src)
+{
+    uint64_t d, s;
+
+    memcpy(&d, dst, 8);
+    memcpy(&s, src, 8);
+    d = ROP_FN(d, s);
+    memcpy(dst, &d, 8);
+}
+
 #define ROP_OP(d, s) glue(rop_8_,ROP_NAME)(d, s)
 #define ROP_OP_16(d, s) glue(rop_16_,ROP_NAME)(d, s)
 #define ROP_OP_32(d, s) glue(rop_32_,ROP_NAME)(d, s)
+#define ROP_OP_64(d, s) glue(rop_64_,ROP_NAME)(d, s)
 #undef ROP_FN
 
 static void
@@ -58,7 +71,25 @@ glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
     }
 
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x++) {
+        x = 0;
+        /* Word at a time unless the byte loop would read back what it has
+           just written in the same row.  */
+#ifdef ROP_COPY
+        if (dst <= src || dst - src >= bltwidth) {
+            memmove(dst, src, bltwidth);
+            x = bltwidth;
+            dst += bltwidth;
+            src += bltwidth;
+        }
+#endif
+        if (dst <= src || dst - src >= 8) {
+            for (; x + 8 <= bltwidth; x += 8) {
+                ROP_OP_64(dst, src);
+                dst += 8;
+                src += 8;
+            }
+        }
+        for (; x < bltwidth; x++) {
             ROP_OP(dst, *src);
             dst++;
             src++;
@@ -78,7 +109,23 @@ glue(cirrus_bitblt_rop_bkwd_, ROP_NAME)(CirrusVGAState *s,
     dstpitch += bltwidth;
     srcpitch += bltwidth;
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x++) {
+        x = 0;
+#ifdef ROP_COPY
+        if (src <= dst || src - dst >= bltwidth) {
+            memmove(dst - bltwidth + 1, src - bltwidth + 1, bltwidth);
+            x = bltwidth;
+            dst -= bltwidth;
+            src -= bltwidth;
+        }
+#endif
+        if (src <= dst || src - dst >= 8) {
+            for (; x + 8 <= bltwidth; x += 8) {
+                ROP_OP_64(dst - 7, src - 7);
+                dst -= 8;
+                src -= 8;
+            }
+        }
+        for (; x < bltwidth; x++) {
             ROP_OP(dst, *src);
             dst--;
             src--;
@@ -206,3 +253,5 @@ glue(glue(cirrus_bitblt_rop_bkwd_transp_, ROP_NAME),_16)(CirrusVGAState *s,
 #undef ROP_OP
 #undef ROP_OP_16
 #undef ROP_OP_32
+#undef ROP_OP_64
+#undef ROP_COPY
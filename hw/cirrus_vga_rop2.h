@@ -66,6 +66,21 @@ glue(glue(glue(cirrus_patternfill_, ROP_NAME), _),DEPTH)
         d = dst + skipleft;
         src1 = src + pattern_y * pattern_pitch;
         for (x = skipleft; x < bltwidth; x += (DEPTH / 8)) {
+#if defined(ROP_COPY) && DEPTH != 24
+            if (x == skipleft + pattern_pitch) {
+                /* the rest of the line repeats the period just drawn,
+                   copy it in ever larger blocks */
+                int end = skipleft + ((bltwidth - skipleft + (DEPTH / 8) - 1) &
+                                      ~((DEPTH / 8) - 1));
+                int n, len;
+
+                for (n = pattern_pitch; x < end; x += len, n *= 2) {
+                    len = MIN(n, end - x);
+                    memcpy(dst + x, dst + skipleft, len);
+                }
+                break;
+            }
+#endif
 #if DEPTH == 8
             col = src1[pattern_x];
             pattern_x = (pattern_x + 1) & 7;
@@ -262,14 +277,40 @@ glue(glue(glue(cirrus_fill_, ROP_NAME), _),DEPTH)
 {
     uint8_t *d, *d1;
     uint32_t col;
+#if DEPTH != 24
+    uint64_t col64;
+#endif
     int x, y;
 
     col = s->cirrus_blt_fgcol;
+#if DEPTH == 8
+    col64 = (uint8_t)col * 0x0101010101010101ULL;
+#elif DEPTH == 16
+    col64 = (uint16_t)col * 0x0001000100010001ULL;
+#elif DEPTH == 32
+    col64 = (uint32_t)col * 0x0000000100000001ULL;
+#endif
 
     d1 = dst;
     for(y = 0; y < height; y++) {
         d = d1;
-        for(x = 0; x < width; x += (DEPTH / 8)) {
+        x = 0;
+#ifdef ROP_COPY
+        /* every line is a copy of the previous one */
+        if (y > 0) {
+            memmove(d1, d1 - dst_pitch,
+                    (width + (DEPTH / 8) - 1) / (DEPTH / 8) * (DEPTH / 8));
+            d1 += dst_pitch;
+            continue;
+        }
+#endif
+#if DEPTH != 24
+        for (; x + 8 <= width; x += 8) {
+            ROP_OP_64(d, (uint8_t *)&col64);
+            d += 8;
+        }
+#endif
+        for(; x < width; x += (DEPTH / 8)) {
             PUTPIXEL();
             d += (DEPTH / 8);
         }
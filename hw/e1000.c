@@ -29,10 +29,13 @@
 #include "pci.h"
 #include "net.h"
 #include "net/checksum.h"
+#include "net/tap.h"
 #include "loader.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 
 #include "e1000_hw.h"
+#include "virtio-net.h"
 
 #define E1000_DEBUG
 
@@ -91,6 +94,15 @@ typedef struct E1000State_st {
     uint32_t rxbuf_size;
     uint32_t rxbuf_min_shift;
     int check_rxov;
+    int has_vnet_hdr;
+    uint32_t compat_flags;
+
+    /* Interrupt moderation: while mit_timer runs, new causes are only
+     * latched in ICR and the line is raised when it expires. */
+    QEMUTimer *mit_timer;
+    int mit_timer_on;
+    int mit_irq_level;
+    uint32_t mit_ide;       // a tx descriptor since the last interrupt had IDE
     struct e1000_tx {
         unsigned char header[256];
         unsigned char vlan_header[4];
@@ -114,6 +126,7 @@ typedef struct E1000State_st {
         int8_t ip;
         int8_t tcp;
         bool cptse;     // current packet tse bit
+        bool gso;       // current packet goes out whole, the peer segments
     } tx;
 
     struct {
@@ -137,9 +150,13 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(ITR),	defreg(RDTR),	defreg(RADV),
+    defreg(TIDV),	defreg(TADV),
 };
 
+#define E1000_FLAG_MIT_BIT 0
+#define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
+
 enum { PHY_R = 1, PHY_W = 2, PHY_RW = PHY_R | PHY_W };
 static const char phy_regcap[0x20] = {
     [PHY_STATUS] = PHY_R,	[M88E1000_EXT_PHY_SPEC_CTRL] = PHY_RW,
@@ -158,14 +175,66 @@ ioport_map(PCIDevice *pci_dev, int region_num, pcibus_t addr,
            " size=0x%08"FMT_PCIBUS"\n", addr, size);
 }
 
+/* Keep the shortest non-zero delay */
+static inline void
+mit_update_delay(uint32_t *curr, uint32_t value)
+{
+    if (value && (*curr == 0 || value < *curr))
+        *curr = value;
+}
+
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    uint32_t pending_ints, mit_delay;
+
     if (val)
         val |= E1000_ICR_INT_ASSERTED;
     s->mac_reg[ICR] = val;
     s->mac_reg[ICS] = val;
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+    qdev_state_changed(&s->dev.qdev);
+
+    pending_ints = s->mac_reg[IMS] & s->mac_reg[ICR];
+    if (!s->mit_irq_level && pending_ints) {
+        /* An interrupt is being raised: hold it back while the moderation
+         * timer runs, else raise it and, if the guest asked for a delay,
+         * start the timer so that the next one waits for it.  Delays are
+         * in 256ns units, as ITR is; RADV and TADV count 1.024us. */
+        if (s->mit_timer_on)
+            return;
+        if (s->compat_flags & E1000_FLAG_MIT) {
+            mit_delay = 0;
+            if (s->mit_ide &&
+                (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW)))
+                mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
+            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0))
+                mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
+            mit_update_delay(&mit_delay, s->mac_reg[ITR]);
+
+            if (mit_delay) {
+                /* the hardware never goes above 7813 interrupts/s */
+                if (mit_delay < 500)
+                    mit_delay = 500;
+                s->mit_timer_on = 1;
+                qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) +
+                               mit_delay * 256);
+            }
+            s->mit_ide = 0;
+        }
+    }
+
+    s->mit_irq_level = (pending_ints != 0);
+    qemu_set_irq(s->dev.irq[0], s->mit_irq_level);
+}
+
+static void
+e1000_mit_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->mit_timer_on = 0;
+    /* raise whatever was latched while the timer ran */
+    set_interrupt_cause(s, 0, s->mac_reg[ICR]);
 }
 
 static void
@@ -354,12 +423,55 @@ fcs_len(E1000State *s)
     return (s->mac_reg[RCTL] & E1000_RCTL_SECRC) ? 0 : 4;
 }
 
+/* Whether the checksum at tucso covers the rest of the packet, which is
+ * all a vnet_hdr peer can be asked to fill in. */
+static inline int
+tx_csum_to_end(struct e1000_tx *tp)
+{
+    return (!tp->tucse || tp->tucse >= tp->size - 1) &&
+           tp->tucso > tp->tucss && tp->tucso < tp->size - 1;
+}
+
+static void
+e1000_send_packet(E1000State *s, struct virtio_net_hdr *hdr)
+{
+    struct e1000_tx *tp = &s->tx;
+    uint8_t *buf = tp->data;
+    unsigned int size = tp->size;
+    struct iovec iov[2];
+
+    if (tp->vlan_needed) {
+        memmove(tp->vlan, tp->data, 4);
+        memmove(tp->data, tp->data + 4, 8);
+        memcpy(tp->data + 8, tp->vlan_header, 4);
+        buf = tp->vlan;
+        size += 4;
+        if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            hdr->csum_start += 4;
+        }
+        if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+            hdr->hdr_len += 4;
+        }
+    }
+
+    if (!s->has_vnet_hdr) {
+        qemu_send_packet(&s->nic->nc, buf, size);
+        return;
+    }
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(*hdr);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = size;
+    qemu_sendv_packet(&s->nic->nc, iov, 2);
+}
+
 static void
 xmit_seg(E1000State *s)
 {
     uint16_t len, *sp;
     unsigned int frames = s->tx.tso_frames, css, sofar, n;
     struct e1000_tx *tp = &s->tx;
+    struct virtio_net_hdr hdr;
 
     if (tp->tse && tp->cptse) {
         css = tp->ipcss;
@@ -380,7 +492,7 @@ xmit_seg(E1000State *s)
             sofar = frames * tp->mss;
             cpu_to_be32wu((uint32_t *)(tp->data+css+4),	// seq
                 be32_to_cpupu((uint32_t *)(tp->data+css+4))+sofar);
-            if (tp->paylen - sofar > tp->mss)
+            if (!tp->gso && tp->paylen - sofar > tp->mss)
                 tp->data[css + 13] &= ~9;		// PSH, FIN
         } else	// UDP
             cpu_to_be16wu((uint16_t *)(tp->data+css+4), len);
@@ -395,21 +507,36 @@ xmit_seg(E1000State *s)
         tp->tso_frames++;
     }
 
-    if (tp->sum_needed & E1000_TXD_POPTS_TXSM)
-        putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+    memset(&hdr, 0, sizeof(hdr));
+    if (tp->sum_needed & E1000_TXD_POPTS_TXSM) {
+        if (s->has_vnet_hdr && tx_csum_to_end(tp)) {
+            // the pseudo-header sum is in place, the peer adds the rest
+            hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            hdr.csum_start = tp->tucss;
+            hdr.csum_offset = tp->tucso - tp->tucss;
+        } else
+            putsum(tp->data, tp->size, tp->tucso, tp->tucss, tp->tucse);
+    }
     if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
         putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
-    if (tp->vlan_needed) {
-        memmove(tp->vlan, tp->data, 4);
-        memmove(tp->data, tp->data + 4, 8);
-        memcpy(tp->data + 8, tp->vlan_header, 4);
-        qemu_send_packet(&s->nic->nc, tp->vlan, tp->size + 4);
-    } else
-        qemu_send_packet(&s->nic->nc, tp->data, tp->size);
-    s->mac_reg[TPT]++;
-    s->mac_reg[GPTC]++;
-    n = s->mac_reg[TOTL];
-    if ((s->mac_reg[TOTL] += s->tx.size) < n)
+
+    frames = 1;
+    n = tp->size;
+    if (tp->gso) {
+        // one frame on the wire for each mss of payload, each with headers
+        hdr.gso_type = tp->ip ? VIRTIO_NET_HDR_GSO_TCPV4 :
+                                VIRTIO_NET_HDR_GSO_TCPV6;
+        hdr.gso_size = tp->mss;
+        hdr.hdr_len = tp->hdr_len;
+        if (tp->size > tp->hdr_len)
+            frames = (tp->size - tp->hdr_len + tp->mss - 1) / tp->mss;
+        n += (frames - 1) * tp->hdr_len;
+    }
+    e1000_send_packet(s, &hdr);
+
+    s->mac_reg[TPT] += frames;
+    s->mac_reg[GPTC] += frames;
+    if ((s->mac_reg[TOTL] += n) < n)
         s->mac_reg[TOTH]++;
 }
 
@@ -465,7 +592,12 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     addr = le64_to_cpu(dp->buffer_addr);
     if (tp->tse && tp->cptse) {
         hdr = tp->hdr_len;
-        msh = hdr + tp->mss;
+        if (!tp->size)
+            tp->gso = s->has_vnet_hdr && tp->tcp && tp->mss &&
+                      (tp->sum_needed & E1000_TXD_POPTS_TXSM) && !tp->tucse &&
+                      hdr + tp->paylen < sizeof(tp->data);
+        // a vnet_hdr peer takes the whole frame, as much as fits in data
+        msh = tp->gso ? sizeof(tp->data) - 1 : hdr + tp->mss;
         do {
             bytes = split_size;
             if (tp->size + bytes > msh)
@@ -498,6 +630,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->vlan_needed = 0;
     tp->size = 0;
     tp->cptse = 0;
+    tp->gso = 0;
 }
 
 static uint32_t
@@ -526,6 +659,7 @@ start_xmit(E1000State *s)
         DBGOUT(TX, "tx disabled\n");
         return;
     }
+    qdev_state_changed(&s->dev.qdev);
 
     while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
         base = ((uint64_t)s->mac_reg[TDBAH] << 32) + s->mac_reg[TDBAL] +
@@ -536,6 +670,7 @@ start_xmit(E1000State *s)
                (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
                desc.upper.data);
 
+        s->mit_ide |= le32_to_cpu(desc.lower.data) & E1000_TXD_CMD_IDE;
         process_tx_desc(s, &desc);
         cause |= txdesc_writeback(base, &desc);
 
@@ -631,10 +766,12 @@ e1000_can_receive(VLANClientState *nc)
     return (s->mac_reg[RCTL] & E1000_RCTL_EN);
 }
 
+/* Receive one packet; the interrupt causes it raises are added to *cause
+ * for the caller to set. */
 static ssize_t
-e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
+e1000_receive_one(E1000State *s, const uint8_t *buf, size_t size,
+                  uint32_t *cause)
 {
-    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
     struct e1000_rx_desc desc;
     target_phys_addr_t base;
     unsigned int n, rdt;
@@ -645,6 +782,15 @@ e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
 
     if (!(s->mac_reg[RCTL] & E1000_RCTL_EN))
         return -1;
+    qdev_state_changed(&s->dev.qdev);
+
+    /* No offloads are enabled on the tap, so the header is always empty */
+    if (s->has_vnet_hdr) {
+        if (size < sizeof(struct virtio_net_hdr))
+            return -1;
+        buf += sizeof(struct virtio_net_hdr);
+        size -= sizeof(struct virtio_net_hdr);
+    }
 
     /* Pad to minimum Ethernet frame length */
     if (size < sizeof(min_buf)) {
@@ -674,7 +820,7 @@ e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
     rdh_start = s->mac_reg[RDH];
     do {
         if (s->mac_reg[RDH] == s->mac_reg[RDT] && s->check_rxov) {
-            set_ics(s, 0, E1000_ICS_RXO);
+            *cause |= E1000_ICS_RXO;
             return -1;
         }
         base = ((uint64_t)s->mac_reg[RDBAH] << 32) + s->mac_reg[RDBAL] +
@@ -699,7 +845,7 @@ e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
         if (s->mac_reg[RDH] == rdh_start) {
             DBGOUT(RXERR, "RDH wraparound @%x, RDT %x, RDLEN %x\n",
                    rdh_start, s->mac_reg[RDT], s->mac_reg[RDLEN]);
-            set_ics(s, 0, E1000_ICS_RXO);
+            *cause |= E1000_ICS_RXO;
             return -1;
         }
     } while (desc.buffer_addr == 0);
@@ -722,11 +868,44 @@ e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
-    set_ics(s, 0, n);
+    *cause |= n;
 
     return size;
 }
 
+static ssize_t
+e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
+{
+    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+    uint32_t cause = 0;
+    ssize_t ret;
+
+    ret = e1000_receive_one(s, buf, size, &cause);
+    if (cause) {
+        set_ics(s, 0, cause);
+    }
+    return ret;
+}
+
+/* Several packets from the peer, with a single interrupt for all of them.
+ * Packets that do not fit are dropped, as e1000_receive does. */
+static int
+e1000_receive_batch(VLANClientState *nc, const struct iovec *pkts, int count)
+{
+    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+    uint32_t cause = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        e1000_receive_one(s, pkts[i].iov_base, pkts[i].iov_len, &cause);
+    }
+    if (cause) {
+        set_ics(s, 0, cause);
+    }
+    return count;
+}
+
+
 static uint32_t
 mac_readreg(E1000State *s, int index)
 {
@@ -749,6 +928,7 @@ mac_read_clr4(E1000State *s, int index)
     uint32_t ret = s->mac_reg[index];
 
     s->mac_reg[index] = 0;
+    qdev_state_changed(&s->dev.qdev);
     return ret;
 }
 
@@ -759,6 +939,7 @@ mac_read_clr8(E1000State *s, int index)
 
     s->mac_reg[index] = 0;
     s->mac_reg[index-1] = 0;
+    qdev_state_changed(&s->dev.qdev);
     return ret;
 }
 
@@ -824,7 +1005,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(RDTR),	getreg(RADV),
+    getreg(TADV),	getreg(ITR),	getreg(TIDV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -846,6 +1028,8 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
+    [RDTR] = set_16bit,	[RADV] = set_16bit,	[TADV] = set_16bit,
+    [ITR] = set_16bit,	[TIDV] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -860,6 +1044,7 @@ e1000_mmio_writel(void *opaque, target_phys_addr_t addr, uint32_t val)
 
     if (index < NWRITEOPS && macreg_writeops[index]) {
         macreg_writeops[index](s, index, val);
+        qdev_state_changed(&s->dev.qdev);
     } else if (index < NREADOPS && macreg_readops[index]) {
         DBGOUT(MMIO, "e1000_mmio_writel RO %x: 0x%04x\n", index<<2, val);
     } else {
@@ -917,11 +1102,56 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+static int e1000_post_load(void *opaque, int version_id)
+{
+    E1000State *s = opaque;
+    struct e1000_tx *tp = &s->tx;
+
+    /* A TSO frame caught half gathered whole carries on that way */
+    tp->gso = tp->tse && tp->cptse && tp->size > tp->hdr_len + tp->mss;
+
+    if (!(s->compat_flags & E1000_FLAG_MIT)) {
+        s->mac_reg[ITR] = s->mac_reg[RDTR] = s->mac_reg[RADV] =
+            s->mac_reg[TADV] = s->mac_reg[TIDV] = 0;
+        s->mit_irq_level = 0;
+    }
+    s->mit_ide = 0;
+    /* Re-evaluate the interrupt line once the guest is running again */
+    s->mit_timer_on = 1;
+    qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) + 1);
+    return 0;
+}
+
+static bool e1000_mit_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->compat_flags & E1000_FLAG_MIT;
+}
+
+static const VMStateDescription vmstate_e1000_mit_state = {
+    .name = "e1000/mit_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_INT32(mit_irq_level, E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .post_load = e1000_post_load,
+    .tracks_changes = 1,
     .fields      = (VMStateField []) {
         VMSTATE_PCI_DEVICE(dev, E1000State),
         VMSTATE_UNUSED_TEST(is_version_1, 4), /* was instance id */
@@ -993,6 +1223,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_e1000_mit_state,
+            .needed = e1000_mit_state_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1077,6 +1315,8 @@ pci_e1000_uninit(PCIDevice *dev)
 {
     E1000State *d = DO_UPCAST(E1000State, dev, dev);
 
+    qemu_del_timer(d->mit_timer);
+    qemu_free_timer(d->mit_timer);
     cpu_unregister_io_memory(d->mmio_index);
     qemu_del_vlan_client(&d->nic->nc);
     return 0;
@@ -1086,6 +1326,10 @@ static void e1000_reset(void *opaque)
 {
     E1000State *d = opaque;
 
+    qemu_del_timer(d->mit_timer);
+    d->mit_timer_on = 0;
+    d->mit_irq_level = 0;
+    d->mit_ide = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
@@ -1099,6 +1343,7 @@ static NetClientInfo net_e1000_info = {
     .size = sizeof(NICState),
     .can_receive = e1000_can_receive,
     .receive = e1000_receive,
+    .receive_batch = e1000_receive_batch,
     .cleanup = e1000_cleanup,
     .link_status_changed = e1000_set_link_status,
 };
@@ -1150,8 +1395,18 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     qemu_format_nic_info_str(&d->nic->nc, macaddr);
 
+    /* TSO frames and checksums are left to a tap peer that understands
+     * virtio_net_hdr; what it sends us still comes complete. */
+    if (d->nic->nc.peer && d->nic->nc.peer->info->type == NET_CLIENT_TYPE_TAP &&
+        tap_has_vnet_hdr(d->nic->nc.peer)) {
+        tap_using_vnet_hdr(d->nic->nc.peer, 1);
+        d->has_vnet_hdr = 1;
+    }
+
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
+    d->mit_timer = qemu_new_timer(vm_clock, e1000_mit_timer, d);
+
     return 0;
 }
 
@@ -1172,6 +1427,8 @@ static PCIDeviceInfo e1000_info = {
     .romfile    = "pxe-e1000.bin",
     .qdev.props = (Property[]) {
         DEFINE_NIC_PROPERTIES(E1000State, conf),
+        DEFINE_PROP_BIT("mitigation", E1000State, compat_flags,
+                        E1000_FLAG_MIT_BIT, true),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
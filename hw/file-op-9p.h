@@ -99,8 +99,8 @@ typedef struct FileOperations
 
 static inline const char *rpath(FsContext *ctx, const char *path)
 {
-    /* FIXME: so wrong... */
-    static char buffer[4096];
+    /* FIXME: so wrong... at least the worker threads get one each */
+    static __thread char buffer[4096];
     snprintf(buffer, sizeof(buffer), "%s/%s", ctx->fs_root, path);
     return buffer;
 }
@@ -38,6 +38,10 @@
 #endif
 
 #define FW_CFG_SIZE 2
+#define FW_CFG_DMA_SIZE 8
+
+#define FW_CFG_FLAG_DMA_BIT 0
+#define FW_CFG_FLAG_DMA (1 << FW_CFG_FLAG_DMA_BIT)
 
 typedef struct FWCfgEntry {
     uint32_t len;
@@ -48,11 +52,13 @@ typedef struct FWCfgEntry {
 
 struct FWCfgState {
     SysBusDevice busdev;
-    uint32_t ctl_iobase, data_iobase;
+    uint32_t ctl_iobase, data_iobase, dma_iobase;
     FWCfgEntry entries[2][FW_CFG_MAX_ENTRY];
     FWCfgFiles *files;
     uint16_t cur_entry;
     uint32_t cur_offset;
+    uint32_t compat_flags;
+    uint64_t dma_addr;          /* high half, until the low half is written */
     Notifier machine_ready;
 };
 
@@ -106,6 +112,98 @@ static uint8_t fw_cfg_read(FWCfgState *s)
     return ret;
 }
 
+/* Carries out the FWCfgDmaAccess at s->dma_addr.  An item is read or
+   written in one go, instead of a port access per byte. */
+static void fw_cfg_dma_transfer(FWCfgState *s)
+{
+    target_phys_addr_t dma_addr = s->dma_addr;
+    int arch;
+    FWCfgEntry *e;
+    FWCfgDmaAccess dma;
+    uint32_t len, control = 0;
+
+    s->dma_addr = 0;
+    cpu_physical_memory_read(dma_addr, (uint8_t *)&dma, sizeof(dma));
+    dma.control = be32_to_cpu(dma.control);
+    dma.length = be32_to_cpu(dma.length);
+    dma.address = be64_to_cpu(dma.address);
+
+    if (dma.control & FW_CFG_DMA_CTL_SELECT) {
+        fw_cfg_select(s, dma.control >> 16);
+    }
+
+    arch = !!(s->cur_entry & FW_CFG_ARCH_LOCAL);
+    e = &s->entries[arch][s->cur_entry & FW_CFG_ENTRY_MASK];
+
+    FW_CFG_DPRINTF("dma control 0x%x length %u address 0x%" PRIx64 "\n",
+                   dma.control, dma.length, dma.address);
+
+    if (dma.control & FW_CFG_DMA_CTL_READ) {
+        static const uint8_t zeroes[256];
+
+        /* Like the data port, reads past the end of the item give zeroes */
+        while (dma.length) {
+            if (s->cur_entry == FW_CFG_INVALID || !e->data ||
+                s->cur_offset >= e->len) {
+                len = MIN(dma.length, sizeof(zeroes));
+                cpu_physical_memory_write(dma.address, zeroes, len);
+            } else {
+                len = MIN(dma.length, e->len - s->cur_offset);
+                cpu_physical_memory_write(dma.address,
+                                          e->data + s->cur_offset, len);
+                s->cur_offset += len;
+            }
+            dma.address += len;
+            dma.length -= len;
+        }
+    } else if (dma.control & FW_CFG_DMA_CTL_WRITE) {
+        if (!(s->cur_entry & FW_CFG_WRITE_CHANNEL) ||
+            s->cur_entry == FW_CFG_INVALID || !e->data ||
+            dma.length > e->len - s->cur_offset) {
+            control = FW_CFG_DMA_CTL_ERROR;
+        } else {
+            cpu_physical_memory_read(dma.address, e->data + s->cur_offset,
+                                     dma.length);
+            s->cur_offset += dma.length;
+            if (s->cur_offset == e->len) {
+                e->callback(e->callback_opaque, e->data);
+                s->cur_offset = 0;
+            }
+        }
+    } else if (dma.control & FW_CFG_DMA_CTL_SKIP) {
+        s->cur_offset += dma.length;
+    }
+
+    control = cpu_to_be32(control);
+    cpu_physical_memory_write(dma_addr, (uint8_t *)&control, sizeof(control));
+}
+
+/* The guest writes the address big endian: the high half first, then the
+   low half, which starts the transfer */
+static void fw_cfg_dma_io_writel(void *opaque, uint32_t addr, uint32_t value)
+{
+    FWCfgState *s = opaque;
+
+    value = bswap32(value);
+    if (addr == s->dma_iobase) {
+        s->dma_addr = (uint64_t)value << 32;
+    } else {
+        s->dma_addr |= value;
+        fw_cfg_dma_transfer(s);
+    }
+}
+
+/* So that the guest can tell the interface is there */
+static uint32_t fw_cfg_dma_io_readl(void *opaque, uint32_t addr)
+{
+    FWCfgState *s = opaque;
+
+    if (addr == s->dma_iobase) {
+        return bswap32(FW_CFG_DMA_SIGNATURE >> 32);
+    }
+    return bswap32((uint32_t)FW_CFG_DMA_SIGNATURE);
+}
+
 static uint32_t fw_cfg_io_readb(void *opaque, uint32_t addr)
 {
     return fw_cfg_read(opaque);
@@ -167,6 +265,7 @@ static void fw_cfg_reset(DeviceState *d)
     FWCfgState *s = DO_UPCAST(FWCfgState, busdev.qdev, d);
 
     fw_cfg_select(s, 0);
+    s->dma_addr = 0;
 }
 
 /* Save restore 32 bit int as uint16_t
@@ -202,6 +301,24 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+static bool fw_cfg_dma_needed(void *opaque)
+{
+    FWCfgState *s = opaque;
+
+    return s->dma_addr != 0;
+}
+
+static const VMStateDescription vmstate_fw_cfg_dma = {
+    .name = "fw_cfg/dma",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(dma_addr, FWCfgState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_fw_cfg = {
     .name = "fw_cfg",
     .version_id = 2,
@@ -212,6 +329,14 @@ static const VMStateDescription vmstate_fw_cfg = {
         VMSTATE_UINT16_HACK(cur_offset, FWCfgState, is_version_1),
         VMSTATE_UINT32_V(cur_offset, FWCfgState, 2),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_fw_cfg_dma,
+            .needed = fw_cfg_dma_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -325,8 +450,11 @@ static void fw_cfg_machine_ready(struct Notifier* n)
     fw_cfg_add_file(s, "bootorder", (uint8_t*)bootindex, len);
 }
 
+/* dma_port is where the DMA address register goes, 0 for none; machine
+   types that predate it turn it off with the dma_enabled property */
 FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
-                        target_phys_addr_t ctl_addr, target_phys_addr_t data_addr)
+                        uint32_t dma_port, target_phys_addr_t ctl_addr,
+                        target_phys_addr_t data_addr)
 {
     DeviceState *dev;
     SysBusDevice *d;
@@ -335,6 +463,7 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     dev = qdev_create(NULL, "fw_cfg");
     qdev_prop_set_uint32(dev, "ctl_iobase", ctl_port);
     qdev_prop_set_uint32(dev, "data_iobase", data_port);
+    qdev_prop_set_uint32(dev, "dma_iobase", dma_port);
     qdev_init_nofail(dev);
     d = sysbus_from_qdev(dev);
 
@@ -347,6 +476,8 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
         sysbus_mmio_map(d, 1, data_addr);
     }
     fw_cfg_add_bytes(s, FW_CFG_SIGNATURE, (uint8_t *)"QEMU", 4);
+    fw_cfg_add_i32(s, FW_CFG_ID, FW_CFG_VERSION |
+                   (s->dma_iobase ? FW_CFG_VERSION_DMA : 0));
     fw_cfg_add_bytes(s, FW_CFG_UUID, qemu_uuid, 16);
     fw_cfg_add_i16(s, FW_CFG_NOGRAPHIC, (uint16_t)(display_type == DT_NOGRAPHIC));
     fw_cfg_add_i16(s, FW_CFG_NB_CPUS, (uint16_t)smp_cpus);
@@ -382,6 +513,15 @@ static int fw_cfg_init1(SysBusDevice *dev)
         register_ioport_read(s->data_iobase, 1, 1, fw_cfg_io_readb, s);
         register_ioport_write(s->data_iobase, 1, 1, fw_cfg_io_writeb, s);
     }
+    if (!(s->compat_flags & FW_CFG_FLAG_DMA)) {
+        s->dma_iobase = 0;
+    }
+    if (s->dma_iobase) {
+        register_ioport_read(s->dma_iobase, FW_CFG_DMA_SIZE, 4,
+                             fw_cfg_dma_io_readl, s);
+        register_ioport_write(s->dma_iobase, FW_CFG_DMA_SIZE, 4,
+                              fw_cfg_dma_io_writel, s);
+    }
     return 0;
 }
 
@@ -395,6 +535,9 @@ static SysBusDeviceInfo fw_cfg_info = {
     .qdev.props = (Property[]) {
         DEFINE_PROP_HEX32("ctl_iobase", FWCfgState, ctl_iobase, -1),
         DEFINE_PROP_HEX32("data_iobase", FWCfgState, data_iobase, -1),
+        DEFINE_PROP_HEX32("dma_iobase", FWCfgState, dma_iobase, 0),
+        DEFINE_PROP_BIT("dma_enabled", FWCfgState, compat_flags,
+                        FW_CFG_FLAG_DMA_BIT, true),
         DEFINE_PROP_END_OF_LIST(),
     },
 };
@@ -31,6 +31,8 @@
 #include "hpet_emul.h"
 #include "sysbus.h"
 #include "mc146818rtc.h"
+#include "kvm.h"
+#include "qemu-barrier.h"
 
 //#define HPET_DEBUG
 #ifdef HPET_DEBUG
@@ -72,6 +74,9 @@ typedef struct HPETState {
     uint64_t isr;               /* interrupt status reg */
     uint64_t hpet_counter;      /* main counter */
     uint8_t  hpet_id;           /* instance id */
+
+    uint32_t counter_seq;       /* odd while the main counter changes */
+    uint8_t  counter_unlocked;  /* reads registered with KVM */
 } HPETState;
 
 static uint32_t hpet_in_legacy_mode(HPETState *s)
@@ -146,6 +151,56 @@ static uint64_t hpet_get_ticks(HPETState *s)
     return ns_to_ticks(qemu_get_clock(vm_clock) + s->hpet_offset);
 }
 
+/*
+ * Guests that use the HPET as their clocksource read the main counter all
+ * the time, so under KVM the vcpu threads read it without qemu_global_mutex.
+ * Whatever it depends on (the enable bit, hpet_offset and hpet_counter) is
+ * changed between hpet_counter_begin() and hpet_counter_end(), and a read
+ * that raced with such a change is retried.
+ */
+static void hpet_counter_begin(HPETState *s)
+{
+    s->counter_seq++;
+    smp_wmb();
+}
+
+static void hpet_counter_end(HPETState *s)
+{
+    smp_wmb();
+    s->counter_seq++;
+}
+
+static uint64_t hpet_read_counter(HPETState *s)
+{
+    uint32_t seq;
+    uint64_t ticks;
+
+    do {
+        seq = s->counter_seq;
+        smp_rmb();
+        if (hpet_enabled(s)) {
+            ticks = hpet_get_ticks(s);
+        } else {
+            ticks = s->hpet_counter;
+        }
+        smp_rmb();
+    } while ((seq & 1) || seq != s->counter_seq);
+    return ticks;
+}
+
+/* Both halves of a 64-bit read come from the same sample */
+static bool hpet_counter_read_unlocked(void *opaque, uint64_t offset,
+                                       unsigned size, uint64_t *val)
+{
+    HPETState *s = opaque;
+
+    if (size < 4 || (offset & (size - 1))) {
+        return false;
+    }
+    *val = hpet_read_counter(s) >> (offset * 8);
+    return true;
+}
+
 /*
  * calculate diff between comparator value and current ticks
  */
@@ -207,7 +262,9 @@ static void hpet_pre_save(void *opaque)
     HPETState *s = opaque;
 
     /* save current counter value */
+    hpet_counter_begin(s);
     s->hpet_counter = hpet_get_ticks(s);
+    hpet_counter_end(s);
 }
 
 static int hpet_pre_load(void *opaque)
@@ -224,7 +281,9 @@ static int hpet_post_load(void *opaque, int version_id)
     HPETState *s = opaque;
 
     /* Recalculate the offset between the main counter and guest time */
+    hpet_counter_begin(s);
     s->hpet_offset = ticks_to_ns(s->hpet_counter) - qemu_get_clock(vm_clock);
+    hpet_counter_end(s);
 
     /* Push number of timers into capability returned via HPET_ID */
     s->capability &= ~HPET_ID_NUM_TIM_MASK;
@@ -400,19 +459,11 @@ static uint32_t hpet_ram_readl(void *opaque, target_phys_addr_t addr)
             DPRINTF("qemu: invalid HPET_CFG + 4 hpet_ram_readl \n");
             return 0;
         case HPET_COUNTER:
-            if (hpet_enabled(s)) {
-                cur_tick = hpet_get_ticks(s);
-            } else {
-                cur_tick = s->hpet_counter;
-            }
+            cur_tick = hpet_read_counter(s);
             DPRINTF("qemu: reading counter  = %" PRIx64 "\n", cur_tick);
             return cur_tick;
         case HPET_COUNTER + 4:
-            if (hpet_enabled(s)) {
-                cur_tick = hpet_get_ticks(s);
-            } else {
-                cur_tick = s->hpet_counter;
-            }
+            cur_tick = hpet_read_counter(s);
             DPRINTF("qemu: reading counter + 4  = %" PRIx64 "\n", cur_tick);
             return cur_tick >> 32;
         case HPET_STATUS:
@@ -543,11 +594,17 @@ static void hpet_ram_writel(void *opaque, target_phys_addr_t addr,
             return;
         case HPET_CFG:
             val = hpet_fixup_reg(new_val, old_val, HPET_CFG_WRITE_MASK);
+            hpet_counter_begin(s);
             s->config = (s->config & 0xffffffff00000000ULL) | val;
             if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
-                /* Enable main counter and interrupt generation. */
                 s->hpet_offset =
                     ticks_to_ns(s->hpet_counter) - qemu_get_clock(vm_clock);
+            } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                s->hpet_counter = hpet_get_ticks(s);
+            }
+            hpet_counter_end(s);
+            if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                /* Enable main counter and interrupt generation. */
                 for (i = 0; i < s->num_timers; i++) {
                     if ((&s->timer[i])->cmp != ~0ULL) {
                         hpet_set_timer(&s->timer[i]);
@@ -555,7 +612,6 @@ static void hpet_ram_writel(void *opaque, target_phys_addr_t addr,
                 }
             } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
                 /* Halt main counter and disable interrupt generation. */
-                s->hpet_counter = hpet_get_ticks(s);
                 for (i = 0; i < s->num_timers; i++) {
                     hpet_del_timer(&s->timer[i]);
                 }
@@ -584,8 +640,10 @@ static void hpet_ram_writel(void *opaque, target_phys_addr_t addr,
             if (hpet_enabled(s)) {
                 DPRINTF("qemu: Writing counter while HPET enabled!\n");
             }
+            hpet_counter_begin(s);
             s->hpet_counter =
                 (s->hpet_counter & 0xffffffff00000000ULL) | value;
+            hpet_counter_end(s);
             DPRINTF("qemu: HPET counter written. ctr = %#x -> %" PRIx64 "\n",
                     value, s->hpet_counter);
             break;
@@ -593,8 +651,10 @@ static void hpet_ram_writel(void *opaque, target_phys_addr_t addr,
             if (hpet_enabled(s)) {
                 DPRINTF("qemu: Writing counter while HPET enabled!\n");
             }
+            hpet_counter_begin(s);
             s->hpet_counter =
                 (s->hpet_counter & 0xffffffffULL) | (((uint64_t)value) << 32);
+            hpet_counter_end(s);
             DPRINTF("qemu: HPET counter + 4 written. ctr = %#x -> %" PRIx64 "\n",
                     value, s->hpet_counter);
             break;
@@ -648,9 +708,11 @@ static void hpet_reset(DeviceState *d)
         timer->wrap_flag = 0;
     }
 
+    hpet_counter_begin(s);
     s->hpet_counter = 0ULL;
     s->hpet_offset = 0ULL;
     s->config = 0ULL;
+    hpet_counter_end(s);
     if (count > 0) {
         /* we don't enable pit when hpet_reset is first called (by hpet_init)
          * because hpet is taking over for pit here. On subsequent invocations,
@@ -662,6 +724,14 @@ static void hpet_reset(DeviceState *d)
     hpet_cfg.hpet[s->hpet_id].event_timer_block_id = (uint32_t)s->capability;
     hpet_cfg.hpet[s->hpet_id].address = sysbus_from_qdev(d)->mmio[0].addr;
     count = 1;
+
+    /* The HPET is mapped by now, and never moves */
+    if (kvm_enabled() && !s->counter_unlocked) {
+        kvm_set_mmio_read_unlocked(sysbus_from_qdev(d)->mmio[0].addr +
+                                   HPET_COUNTER, 8,
+                                   hpet_counter_read_unlocked, s);
+        s->counter_unlocked = 1;
+    }
 }
 
 static void hpet_handle_rtc_irq(void *opaque, int n, int level)
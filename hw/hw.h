@@ -20,6 +20,12 @@
 typedef int (QEMUFilePutBufferFunc)(void *opaque, const uint8_t *buf,
                                     int64_t pos, int size);
 
+/* Like QEMUFilePutBufferFunc, for data scattered in memory.  The handler
+ * may modify the iovec array; it must be done with the data on return.
+ */
+typedef int (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
+                                       int iovcnt, int64_t pos);
+
 /* Read a chunk of data from a file at the given position.  The pos argument
  * can be ignored if the file is only be used for streaming.  The number of
  * bytes actually read should be returned.
@@ -48,15 +54,20 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileRateLimit *rate_limit,
                          QEMUFileSetRateLimit *set_rate_limit,
 			 QEMUFileGetRateLimit *get_rate_limit);
+void qemu_file_set_writev(QEMUFile *f,
+                          QEMUFileWritevBufferFunc *writev_buffer);
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd);
 QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_stdio_fd(QEMUFile *f);
+int qemu_file_socket_fd(QEMUFile *f);
+BlockDriverState *qemu_file_bdrv(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+void qemu_put_buffer_ref(QEMUFile *f, const uint8_t *buf, int size);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
@@ -285,6 +296,9 @@ struct VMStateInfo {
     const char *name;
     int (*get)(QEMUFile *f, void *pv, size_t size);
     void (*put)(QEMUFile *f, void *pv, size_t size);
+    /* optional, n elements size bytes apart in one go */
+    int (*get_array)(QEMUFile *f, void *pv, size_t size, int n);
+    void (*put_array)(QEMUFile *f, void *pv, size_t size, int n);
 };
 
 enum VMStateFlags {
@@ -298,8 +312,9 @@ enum VMStateFlags {
     VMS_VARRAY_UINT16    = 0x080,  /* Array with size in uint16_t field */
     VMS_VBUFFER          = 0x100,  /* Buffer with size in int32_t field */
     VMS_MULTIPLY         = 0x200,  /* multiply "size" field by field_size */
-    VMS_BITFIELD         = 0x400,  /* apply bitfield_mask on field itself */
-    VMS_QUEUE            = 0x800,  /* iterate over buffer */
+    VMS_BITFIELD         = 0x400,  /* decode the named bits in bits */
+    VMS_QUEUE            = 0x800,  /* linked list walked with queue_first
+                                      and queue_next, elements are vmsd */
 };
 
 typedef struct {
@@ -315,13 +330,19 @@ typedef struct {
     enum VMStateFlags flags;
     const VMStateDescription *vmsd;
     int version_id;
-    uint32_t bit_field_mask;
-    bool bit_field_offset;
-    const char *bit_field_name;
-    void (*queue_print_cb) (void *opaque);
+    const struct VMStateBit *bits;
+    void *(*queue_first)(void *queue);
+    void *(*queue_next)(void *elem);
     bool (*field_exists)(void *opaque, int version_id);
 } VMStateField;
 
+/* One named bit or bit range of a VMSTATE_BITFIELD register.  Values of
+   multi-bit masks are shifted down to bit 0. */
+typedef struct VMStateBit {
+    const char *name;
+    uint64_t mask;
+} VMStateBit;
+
 typedef struct VMStateSubsection {
     const VMStateDescription *vmsd;
     bool (*needed)(void *opaque);
@@ -345,6 +366,8 @@ struct VMStateDescription {
     VMStateField *fields;
     const VMStateSubsection *subsections;
     VMStateBitField *bitfields;
+    /* The device calls qdev_state_changed() on every change of its state */
+    int tracks_changes;
 };
 
 extern const VMStateInfo vmstate_info_bool;
@@ -623,25 +646,41 @@ extern const VMStateDescription vmstate_usb_device;
     .offset     = vmstate_offset_macaddr(_state, _field),            \
 }
 
-extern const VMStateDescription vmstate_apic;
+/* Decode integer register _field as the bits listed in _bits, an array
+   terminated by an entry with a NULL name.  The register is read once for
+   all bits.  Bitfields annotate state that is migrated through another
+   field, they are only used by the device state commands. */
+#define VMSTATE_BITFIELD(_name, _field, _state, _bits) {             \
+    .name         = (_name),                                         \
+    .size         = sizeof(typeof_field(_state, _field)),            \
+    .flags        = VMS_BITFIELD,                                    \
+    .offset       = offsetof(_state, _field),                        \
+    .bits         = (_bits),                                         \
+}
 
-#define VMSTATE_BITFIELD(_field, _state, _offset, _mask, _alias) {      \
-    .name         = (stringify(_field)),                        \
-    .vmsd         = (&vmstate_apic),                            \
-    .size         = (sizeof(typeof_field(_state, _field))),                             \
-    .flags        = VMS_BITFIELD,                               \
-    .offset     = offsetof(_state, _field),            \
-    .bit_field_offset = (_offset),                              \
-    .bit_field_mask = (_mask),                                  \
-    .bit_field_name = (_alias),\
+/* _first returns the first element of the queue head at _field, _next
+   the element after elem, both return NULL at the end of the queue.  Each
+   element is a _type described by _vmsd. */
+#define VMSTATE_QUEUE(_field, _state, _first, _next, _vmsd, _type) {  \
+    .name         = (stringify(_field)),                              \
+    .flags        = VMS_QUEUE,                                        \
+    .offset       = offsetof(_state, _field),                         \
+    .size         = sizeof(_type),                                    \
+    .vmsd         = &(_vmsd),                                         \
+    .queue_first  = (_first),                                         \
+    .queue_next   = (_next),                                          \
 }
 
-#define VMSTATE_QUEUE(_field, _state, _cb)\
-{\
-  .name = (stringify (_field)),\
-  .flags = VMS_QUEUE, \
-  .offset   = offsetof(_state, _field),\
-  .queue_print_cb = _cb,\
+/* Define _name##_first and _name##_next iterators for VMSTATE_QUEUE over a
+   QTAILQ of _type linked through _entry */
+#define VMSTATE_QTAILQ_ITERATORS(_name, _type, _entry)                \
+static void *_name##_first(void *queue)                               \
+{                                                                     \
+    return QTAILQ_FIRST((QTAILQ_HEAD(, _type) *)queue);               \
+}                                                                     \
+static void *_name##_next(void *elem)                                 \
+{                                                                     \
+    return QTAILQ_NEXT((_type *)elem, _entry);                        \
 }
 
 /* _f : field name
@@ -854,6 +893,20 @@ int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
                                    const VMStateDescription *vmsd,
                                    void *base, int alias_id,
                                    int required_for_version);
+void vmstate_foreach_section(void (*fn)(const char *idstr,
+                                        const VMStateDescription *vmsd,
+                                        void *opaque),
+                             void *opaque);
 void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
                         void *opaque);
+
+/* Bytes and time of the sections the last save or load did with the
+   guest stopped */
+typedef struct VMStateStats {
+    int64_t bytes;
+    int64_t ns;
+} VMStateStats;
+
+int vmstate_get_stats(const VMStateDescription *vmsd, void *opaque,
+                      VMStateStats *save, VMStateStats *load);
 #endif
@@ -178,6 +178,33 @@ static int64_t pit_get_next_transition_time(PITChannelState *s,
     return next_time;
 }
 
+/*
+ * In the periodic modes, only the rising edges of OUT make interrupts, so
+ * the irq timer only fires for those and pulses the line, rather than
+ * following each transition: that is one wakeup per period instead of two.
+ */
+static int pit_periodic(PITChannelState *s)
+{
+    return s->mode == 2 || s->mode == 3;
+}
+
+/* return the time of the next rising edge in a periodic mode */
+static int64_t pit_get_next_edge_time(PITChannelState *s,
+                                      int64_t current_time)
+{
+    uint64_t d, next_time;
+
+    d = muldiv64(current_time - s->count_load_time, PIT_FREQ,
+                 get_ticks_per_sec());
+    /* d + 1: at an edge, current_time may convert to a tick short of it */
+    next_time = ((d + 1) / s->count + 1) * s->count;
+    next_time = s->count_load_time + muldiv64(next_time, get_ticks_per_sec(),
+                                              PIT_FREQ);
+    if (next_time <= current_time)
+        next_time = current_time + 1;
+    return next_time;
+}
+
 /* val must be 0 or 1 */
 void pit_set_gate(PITState *pit, int channel, int val)
 {
@@ -371,7 +398,11 @@ static void pit_irq_timer_update(PITChannelState *s, int64_t current_time)
 
     if (!s->irq_timer)
         return;
-    expire_time = pit_get_next_transition_time(s, current_time);
+    if (pit_periodic(s)) {
+        expire_time = pit_get_next_edge_time(s, current_time);
+    } else {
+        expire_time = pit_get_next_transition_time(s, current_time);
+    }
     irq_level = pit_get_out1(s, current_time);
     qemu_set_irq(s->irq, irq_level);
 #ifdef DEBUG_PIT
@@ -390,6 +421,15 @@ static void pit_irq_timer(void *opaque)
 {
     PITChannelState *s = opaque;
 
+    if (pit_periodic(s)) {
+        /* a rising edge, and OUT is low again before the next one */
+        qemu_irq_lower(s->irq);
+        qemu_irq_pulse(s->irq);
+        s->next_transition_time = pit_get_next_edge_time(s,
+                                      s->next_transition_time);
+        qemu_mod_timer(s->irq_timer, s->next_transition_time);
+        return;
+    }
     pit_irq_timer_update(s, s->next_transition_time);
 }
 
@@ -534,6 +534,9 @@ static void ahci_reset_port(AHCIState *s, int port)
         qemu_sglist_destroy(&ncq_tfs->sglist);
         ncq_tfs->used = 0;
     }
+    d->ncq_done = 0;
+    d->ncq_failed = 0;
+    qemu_bh_cancel(d->sdb_bh);
 
     s->dev[port].port_state = STATE_RUN;
     if (!ide_state->bs) {
@@ -693,28 +696,52 @@ out:
     return r;
 }
 
-static void ncq_cb(void *opaque, int ret)
+/*
+ * NCQ completions are not reported one by one: each finished tag is only
+ * recorded, and a bottom half sends a single Set Device Bits FIS for all of
+ * the tags that completed in the meantime, with a single interrupt.
+ */
+static void ahci_ncq_sdb_bh(void *opaque)
 {
-    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
-    IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
+    AHCIDevice *ad = opaque;
+    IDEState *ide_state = &ad->port.ifs[0];
+    uint32_t done = ad->ncq_done;
+
+    if (!done) {
+        return;
+    }
 
-    /* Clear bit for this tag in SActive */
-    ncq_tfs->drive->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
+    /* Clear the bits of these tags in SActive */
+    ad->port_regs.scr_act &= ~done;
 
-    if (ret < 0) {
-        /* error */
+    if (ad->ncq_failed) {
         ide_state->error = ABRT_ERR;
         ide_state->status = READY_STAT | ERR_STAT;
-        ncq_tfs->drive->port_regs.scr_err |= (1 << ncq_tfs->tag);
+        ad->port_regs.scr_err |= ad->ncq_failed;
     } else {
         ide_state->status = READY_STAT | SEEK_STAT;
     }
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs->drive->port_no,
-                       (1 << ncq_tfs->tag));
+    ad->ncq_done = 0;
+    ad->ncq_failed = 0;
+
+    DPRINTF(ad->port_no, "NCQ tags %#x finished\n", done);
+    ahci_write_fis_sdb(ad->hba, ad->port_no, done);
+}
+
+static void ncq_cb(void *opaque, int ret)
+{
+    NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
+    AHCIDevice *ad = ncq_tfs->drive;
+
+    ncq_tfs->aiocb = NULL;
+    if (ret < 0) {
+        ad->ncq_failed |= (1 << ncq_tfs->tag);
+    }
+    ad->ncq_done |= (1 << ncq_tfs->tag);
+    qemu_bh_schedule(ad->sdb_bh);
 
-    DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
-            ncq_tfs->tag);
+    DPRINTF(ad->port_no, "NCQ transfer tag %d finished\n", ncq_tfs->tag);
 
     qemu_sglist_destroy(&ncq_tfs->sglist);
     ncq_tfs->used = 0;
@@ -752,8 +779,13 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
             ncq_tfs->lba, ncq_tfs->lba + ncq_tfs->sector_count - 2,
             s->dev[port].port.ifs[0].nb_sectors - 1);
 
-    ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist);
     ncq_tfs->tag = tag;
+    if (ahci_populate_sglist(&s->dev[port], &ncq_tfs->sglist) < 0) {
+        /* leave ncq_cb an empty list to destroy */
+        memset(&ncq_tfs->sglist, 0, sizeof(ncq_tfs->sglist));
+        ncq_cb(ncq_tfs, -EINVAL);
+        return;
+    }
 
     switch(ncq_fis->command) {
         case READ_FPDMA_QUEUED:
@@ -778,8 +810,13 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
             break;
         default:
             DPRINTF(port, "error: tried to process non-NCQ command as NCQ\n");
-            qemu_sglist_destroy(&ncq_tfs->sglist);
-            break;
+            ncq_cb(ncq_tfs, -EINVAL);
+            return;
+    }
+
+    if (!ncq_tfs->aiocb && ncq_tfs->used) {
+        /* failed without calling back */
+        ncq_cb(ncq_tfs, -EIO);
     }
 }
 
@@ -1120,12 +1157,19 @@ void ahci_init(AHCIState *s, DeviceState *qdev, int ports)
         ad->port_no = i;
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
+        ad->port.sync_pio = 1;
+        ad->sdb_bh = qemu_bh_new(ahci_ncq_sdb_bh, ad);
         ad->port_regs.cmd = PORT_CMD_SPIN_UP | PORT_CMD_POWER_ON;
     }
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        qemu_bh_delete(s->dev[i].sdb_bh);
+    }
     qemu_free(s->dev);
 }
 
@@ -272,9 +272,12 @@ struct AHCIDevice {
     int port_no;
     uint32_t port_state;
     uint32_t finished;
+    uint32_t ncq_done;          /* tags completed, not yet in an SDB FIS */
+    uint32_t ncq_failed;
     AHCIPortRegs port_regs;
     struct AHCIState *hba;
     QEMUBH *check_bh;
+    QEMUBH *sdb_bh;
     uint8_t *lst;
     uint8_t *res_fis;
     int dma_status;
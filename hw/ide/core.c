@@ -60,6 +60,7 @@ static inline int media_is_cd(IDEState *s)
 }
 
 static void ide_atapi_cmd_read_dma_cb(void *opaque, int ret);
+static void ide_atapi_cmd_reply_end(IDEState *s);
 static int ide_handle_rw_error(IDEState *s, int error, int op);
 
 static void padstr(char *str, const char *src, int len)
@@ -90,6 +91,14 @@ static void put_le16(uint16_t *p, unsigned int v)
     *p = cpu_to_le16(v);
 }
 
+/* Whether the disk was given a discard granularity, which enables TRIM */
+static int ide_has_trim(IDEState *s)
+{
+    IDEDevice *dev = s->unit ? s->bus->slave : s->bus->master;
+
+    return s->drive_kind == IDE_HD && dev && dev->conf.discard_granularity;
+}
+
 static void ide_identify(IDEState *s)
 {
     uint16_t *p;
@@ -173,6 +182,10 @@ static void ide_identify(IDEState *s)
     dev = s->unit ? s->bus->slave : s->bus->master;
     if (dev && dev->conf.physical_block_size)
         put_le16(p + 106, 0x6000 | get_physical_block_exp(&dev->conf));
+    if (ide_has_trim(s)) {
+        put_le16(p + 105, IDE_DSM_MAX_BLOCKS);
+        put_le16(p + 169, 1); /* TRIM supported */
+    }
 
     memcpy(s->identify_data, p, sizeof(s->identify_data));
     s->identify_set = 1;
@@ -396,9 +409,94 @@ static void ide_rw_error(IDEState *s) {
     ide_set_irq(s->bus);
 }
 
+/*
+ * PIO reads are asynchronous.  While the guest takes one chunk from the
+ * data port, the next one is read into the other half of io_buffer, so
+ * that it is usually there by the time the guest asks for it.  If it is
+ * not, the drive stays busy until it is, and the transfer then goes on
+ * from the completion.  Buses whose start_transfer consumes the data at
+ * once (AHCI) need it there before the call returns, and read in place.
+ *
+ * ATAPI reads, PIO and DMA alike, go through the same machinery but into
+ * cd_cache, two blocks of sectors of which one is sent while the next
+ * is read.  The medium does not change under them, so the blocks outlive
+ * the command, and a command that starts where the last one ended is read
+ * ahead of by a whole block even past its own end.
+ */
+
+/* ATAPI sectors read at once, and where the two blocks are */
+#define IDE_CD_BLOCK_SECTORS (IDE_DMA_BUF_SECTORS / 4)
+#define IDE_CD_BLOCK(s, i) ((s)->cd_cache + (i) * IDE_CD_BLOCK_SECTORS * 2048)
+
+static void ide_pio_read_cb(void *opaque, int ret)
+{
+    IDEState *s = opaque;
+
+    s->pio_aiocb = NULL;
+    s->pio_ahead_ret = ret;
+    if (s->pio_waiting) {
+        s->pio_waiting = 0;
+        if (s->drive_kind == IDE_CD && s->atapi_dma) {
+            s->bus->dma->aiocb = NULL;
+            ide_atapi_cmd_read_dma_cb(s, 0);
+            return;
+        }
+        s->status &= ~BUSY_STAT;
+        if (s->drive_kind == IDE_CD) {
+            ide_atapi_cmd_reply_end(s);
+        } else {
+            ide_sector_read(s);
+        }
+    }
+}
+
+/* Start reading nb_sectors at sector_num into buf */
+static void ide_pio_read(IDEState *s, int64_t sector_num, int nb_sectors,
+                         uint8_t *buf)
+{
+    s->pio_ahead_sector = sector_num;
+    s->pio_ahead_nb_sectors = nb_sectors;
+    s->pio_ahead_buf = buf;
+    if (s->bus->sync_pio && !s->atapi_dma) {
+        s->pio_ahead_ret = bdrv_read(s->bs, sector_num, buf, nb_sectors);
+        return;
+    }
+    s->pio_iov.iov_base = buf;
+    s->pio_iov.iov_len = nb_sectors * 512;
+    qemu_iovec_init_external(&s->pio_qiov, &s->pio_iov, 1);
+    s->pio_aiocb = bdrv_aio_readv(s->bs, sector_num, &s->pio_qiov, nb_sectors,
+                                  ide_pio_read_cb, s);
+    if (!s->pio_aiocb) {
+        s->pio_ahead_ret = bdrv_is_inserted(s->bs) ? -EIO : -ENOMEDIUM;
+    }
+}
+
+/* Whether nb_sectors at sector_num are read, or being read, ahead */
+static int ide_pio_read_ahead(IDEState *s, int64_t sector_num, int nb_sectors)
+{
+    return s->pio_ahead_nb_sectors && s->pio_ahead_sector == sector_num &&
+           s->pio_ahead_nb_sectors >= nb_sectors;
+}
+
+/* Drop whatever was read ahead, and the PIO request in flight if any */
+static void ide_pio_cancel(IDEState *s)
+{
+    if (s->pio_aiocb) {
+        bdrv_aio_cancel(s->pio_aiocb);
+        if (s->bus->dma->aiocb == s->pio_aiocb) {
+            s->bus->dma->aiocb = NULL;
+        }
+        s->pio_aiocb = NULL;
+    }
+    s->pio_waiting = 0;
+    s->pio_ahead_nb_sectors = 0;
+    s->cd_block_count = 0;
+}
+
 void ide_sector_read(IDEState *s)
 {
     int64_t sector_num;
+    uint8_t *buf;
     int ret, n;
 
     s->status = READY_STAT | SEEK_STAT;
@@ -414,7 +512,19 @@ void ide_sector_read(IDEState *s)
 #endif
         if (n > s->req_nb_sectors)
             n = s->req_nb_sectors;
-        ret = bdrv_read(s->bs, sector_num, s->io_buffer, n);
+        if (!ide_pio_read_ahead(s, sector_num, n)) {
+            ide_pio_cancel(s);
+            ide_pio_read(s, sector_num, n, s->io_buffer);
+        }
+        if (s->pio_aiocb) {
+            /* ide_pio_read_cb calls us again */
+            s->status |= BUSY_STAT;
+            s->pio_waiting = 1;
+            return;
+        }
+        ret = s->pio_ahead_ret;
+        buf = s->pio_ahead_buf;
+        s->pio_ahead_nb_sectors = 0;
         if (ret != 0) {
             if (ide_handle_rw_error(s, -ret,
                 BM_STATUS_PIO_RETRY | BM_STATUS_RETRY_READ))
@@ -422,10 +532,17 @@ void ide_sector_read(IDEState *s)
                 return;
             }
         }
-        ide_transfer_start(s, s->io_buffer, 512 * n, ide_sector_read);
+        ide_transfer_start(s, buf, 512 * n, ide_sector_read);
         ide_set_irq(s->bus);
         ide_set_sector(s, sector_num + n);
         s->nsector -= n;
+
+        /* the next chunk goes to the other half of io_buffer */
+        if (s->nsector && !s->bus->sync_pio) {
+            ide_pio_read(s, sector_num + n, MIN(s->nsector, s->req_nb_sectors),
+                         buf == s->io_buffer ?
+                         s->io_buffer + MAX_MULT_SECTORS * 512 : s->io_buffer);
+        }
     }
 }
 
@@ -479,6 +596,48 @@ static int ide_handle_rw_error(IDEState *s, int error, int op)
     return 1;
 }
 
+/*
+ * The DMA data of DSM TRIM is a list of 8 byte entries, each a 48 bit LBA
+ * and a 16 bit sector count, up to the first count of zero.  The ranges
+ * are discarded together, see bdrv_discard_ranges().
+ */
+static void ide_issue_trim(IDEState *s)
+{
+    BlockDiscardRange *ranges;
+    uint8_t *buf;
+    int i, j, n = 0;
+    size_t pos = 0;
+
+    buf = qemu_malloc(s->sg.size);
+    for (i = 0; i < s->sg.nsg; i++) {
+        cpu_physical_memory_read(s->sg.sg[i].base, buf + pos, s->sg.sg[i].len);
+        pos += s->sg.sg[i].len;
+    }
+
+    ranges = qemu_malloc(sizeof(*ranges) * (pos / 8));
+    for (j = 0; j + 8 <= pos; j += 8) {
+        uint64_t entry = le64_to_cpu(*(uint64_t *)(buf + j));
+        int64_t sector_num = entry & 0x0000ffffffffffffULL;
+        int count = entry >> 48;
+
+        if (count == 0) {
+            break;
+        }
+        if (sector_num >= s->nb_sectors) {
+            continue;
+        }
+        ranges[n].sector_num = sector_num;
+        ranges[n].nb_sectors = MIN(count, s->nb_sectors - sector_num);
+        n++;
+    }
+
+    /* TRIM is a hint, the guest need not know if it failed */
+    bdrv_discard_ranges(s->bs, ranges, n);
+
+    qemu_free(ranges);
+    qemu_free(buf);
+}
+
 void ide_dma_cb(void *opaque, int ret)
 {
     IDEState *s = opaque;
@@ -524,6 +683,12 @@ handle_rw_error:
            sector_num, n, s->is_read);
 #endif
 
+    if (s->is_trim) {
+        ide_issue_trim(s);
+        ide_dma_cb(s, 0);
+        return;
+    }
+
     if (s->is_read) {
         s->bus->dma->aiocb = dma_bdrv_read(s->bs, &s->sg, sector_num,
                                            ide_dma_cb, s);
@@ -543,12 +708,13 @@ eot:
    ide_set_inactive(s);
 }
 
-static void ide_sector_start_dma(IDEState *s, int is_read)
+static void ide_start_dma(IDEState *s, int is_read, int is_trim)
 {
     s->status = READY_STAT | SEEK_STAT | DRQ_STAT | BUSY_STAT;
     s->io_buffer_index = 0;
     s->io_buffer_size = 0;
     s->is_read = is_read;
+    s->is_trim = is_trim;
     s->bus->dma->ops->start_dma(s->bus->dma, s, ide_dma_cb);
 }
 
@@ -558,26 +724,25 @@ static void ide_sector_write_timer_cb(void *opaque)
     ide_set_irq(s->bus);
 }
 
-void ide_sector_write(IDEState *s)
+static void ide_sector_write_cb(void *opaque, int ret)
 {
+    IDEState *s = opaque;
     int64_t sector_num;
-    int ret, n, n1;
+    int n, n1;
 
-    s->status = READY_STAT | SEEK_STAT;
-    sector_num = ide_get_sector(s);
-#if defined(DEBUG_IDE)
-    printf("write sector=%" PRId64 "\n", sector_num);
-#endif
-    n = s->nsector;
-    if (n > s->req_nb_sectors)
-        n = s->req_nb_sectors;
-    ret = bdrv_write(s->bs, sector_num, s->io_buffer, n);
+    s->pio_aiocb = NULL;
+    s->status &= ~BUSY_STAT;
 
     if (ret != 0) {
         if (ide_handle_rw_error(s, -ret, BM_STATUS_PIO_RETRY))
             return;
     }
 
+    sector_num = ide_get_sector(s);
+    n = s->nsector;
+    if (n > s->req_nb_sectors)
+        n = s->req_nb_sectors;
+
     s->nsector -= n;
     if (s->nsector == 0) {
         /* no more sectors to write */
@@ -604,6 +769,35 @@ void ide_sector_write(IDEState *s)
     }
 }
 
+/* The drive is busy until the data the guest gave is written */
+void ide_sector_write(IDEState *s)
+{
+    int64_t sector_num;
+    int n;
+
+    s->status = READY_STAT | SEEK_STAT | BUSY_STAT;
+    sector_num = ide_get_sector(s);
+#if defined(DEBUG_IDE)
+    printf("write sector=%" PRId64 "\n", sector_num);
+#endif
+    n = s->nsector;
+    if (n > s->req_nb_sectors)
+        n = s->req_nb_sectors;
+
+    if (s->bus->sync_pio) {
+        ide_sector_write_cb(s, bdrv_write(s->bs, sector_num, s->io_buffer, n));
+        return;
+    }
+    s->pio_iov.iov_base = s->io_buffer;
+    s->pio_iov.iov_len = n * 512;
+    qemu_iovec_init_external(&s->pio_qiov, &s->pio_iov, 1);
+    s->pio_aiocb = bdrv_aio_writev(s->bs, sector_num, &s->pio_qiov, n,
+                                   ide_sector_write_cb, s);
+    if (!s->pio_aiocb) {
+        ide_sector_write_cb(s, -EIO);
+    }
+}
+
 void ide_atapi_cmd_ok(IDEState *s)
 {
     s->error = 0;
@@ -715,26 +909,111 @@ static void cd_data_to_raw(uint8_t *buf, int lba)
     memset(buf, 0, 288);
 }
 
-static int cd_read_sector(BlockDriverState *bs, int lba, uint8_t *buf,
-                           int sector_size)
+/* Whether sector lba is in the block being read ahead, or already read */
+static int cd_read_ahead(IDEState *s, int lba)
 {
-    int ret;
+    int ahead = s->pio_ahead_sector >> 2;
 
-    switch(sector_size) {
-    case 2048:
-        ret = bdrv_read(bs, (int64_t)lba << 2, buf, 4);
-        break;
-    case 2352:
-        ret = bdrv_read(bs, (int64_t)lba << 2, buf + 16, 4);
-        if (ret < 0)
-            return ret;
+    return s->pio_ahead_nb_sectors &&
+           lba >= ahead && lba < ahead + s->pio_ahead_nb_sectors / 4;
+}
+
+/* Make sector lba part of the current block, and have the next block read
+ * ahead.  n is the number of sectors the guest still wants from lba on.
+ * Returns -EINPROGRESS if the block is still being read, in which case
+ * the drive is busy until ide_pio_read_cb goes on with the transfer. */
+static int cd_read_block(IDEState *s, int lba, int n)
+{
+    int sync = s->bus->sync_pio && !s->atapi_dma;
+    int total = s->nb_sectors >> 2;
+    int ret, end;
+
+    if (lba >= s->cd_block_lba && lba < s->cd_block_lba + s->cd_block_count) {
+        return 0;
+    }
+    if (lba < 0 || lba >= total) {
+        return bdrv_is_inserted(s->bs) ? -EIO : -ENOMEDIUM;
+    }
+
+    if (!cd_read_ahead(s, lba)) {
+        ide_pio_cancel(s);
+        end = MIN(lba + (s->cd_sequential ? MAX(n, IDE_CD_BLOCK_SECTORS) : n),
+                  total);
+        ide_pio_read(s, (int64_t)lba << 2,
+                     MIN(end - lba, IDE_CD_BLOCK_SECTORS) * 4,
+                     IDE_CD_BLOCK(s, 0));
+    }
+    if (s->pio_aiocb && !s->atapi_dma &&
+        (s->bus->sync_pio || s->elementary_transfer_size > 0)) {
+        /* neither AHCI nor a guest in the middle of a DRQ block, which
+           does not look at the status, can be kept waiting */
+        bdrv_drain_all();
+    }
+    if (s->pio_aiocb) {
+        if (s->atapi_dma) {
+            /* cancelled or waited for like any other DMA request */
+            s->bus->dma->aiocb = s->pio_aiocb;
+        } else {
+            s->status = (s->status & ~DRQ_STAT) | BUSY_STAT;
+        }
+        s->pio_waiting = 1;
+        return -EINPROGRESS;
+    }
+    ret = s->pio_ahead_ret;
+    s->cd_block_lba = s->pio_ahead_sector >> 2;
+    s->cd_block_count = ret < 0 ? 0 : s->pio_ahead_nb_sectors / 4;
+    s->cd_block_buf = s->pio_ahead_buf;
+    s->pio_ahead_nb_sectors = 0;
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* the next block is read into the other one meanwhile */
+    end = s->cd_block_lba + s->cd_block_count;
+    n = lba + n - end;
+    if (s->cd_sequential) {
+        n = MAX(n, IDE_CD_BLOCK_SECTORS);
+    }
+    n = MIN(n, total - end);
+    if (n > 0 && !sync) {
+        ide_pio_read(s, (int64_t)end << 2, MIN(n, IDE_CD_BLOCK_SECTORS) * 4,
+                     IDE_CD_BLOCK(s, s->cd_block_buf == IDE_CD_BLOCK(s, 0)));
+    }
+    return 0;
+}
+
+/* Copy sector lba, which is in the current block, into buf */
+static void cd_copy_sector(IDEState *s, int lba, uint8_t *buf, int sector_size)
+{
+    uint8_t *block = s->cd_block_buf + (lba - s->cd_block_lba) * 2048;
+
+    if (sector_size == 2048) {
+        memcpy(buf, block, 2048);
+    } else {
+        memcpy(buf + 16, block, 2048);
         cd_data_to_raw(buf, lba);
-        break;
-    default:
-        ret = -EIO;
-        break;
     }
-    return ret;
+}
+
+/* Read sector lba into buf, from the block it was read ahead in.  Returns
+ * -EINPROGRESS if the block is still being read, in which case the drive
+ * is busy until ide_atapi_cmd_reply_end is called again. */
+static int cd_read_sector(IDEState *s, int lba, uint8_t *buf, int sector_size)
+{
+    int ret;
+
+    if (sector_size != 2048 && sector_size != 2352) {
+        return -EIO;
+    }
+
+    /* the sectors of the transfer still to come, from this one */
+    ret = cd_read_block(s, lba, (s->packet_transfer_size + sector_size - 1) /
+                                sector_size);
+    if (ret < 0) {
+        return ret;
+    }
+    cd_copy_sector(s, lba, buf, sector_size);
+    return 0;
 }
 
 void ide_atapi_io_error(IDEState *s, int ret)
@@ -771,7 +1050,10 @@ static void ide_atapi_cmd_reply_end(IDEState *s)
     } else {
         /* see if a new sector must be read */
         if (s->lba != -1 && s->io_buffer_index >= s->cd_sector_size) {
-            ret = cd_read_sector(s->bs, s->lba, s->io_buffer, s->cd_sector_size);
+            ret = cd_read_sector(s, s->lba, s->io_buffer, s->cd_sector_size);
+            if (ret == -EINPROGRESS) {
+                return;
+            }
             if (ret < 0) {
                 ide_transfer_stop(s);
                 ide_atapi_io_error(s, ret);
@@ -865,75 +1147,67 @@ static void ide_atapi_cmd_read_pio(IDEState *s, int lba, int nb_sectors,
 
 /* ATAPI DMA support */
 
-/* XXX: handle read errors */
+/*
+ * For a cdrom read sector command (s->lba != -1), io_buffer is filled with
+ * as many sectors as it holds, from the blocks they were read ahead in, and
+ * sent in one go, until the transfer is done.  If a block has to be waited
+ * for, the filling goes on from where it was when it is there.  For a
+ * command != read (s->lba == -1), the reply data is just transferred.
+ */
 static void ide_atapi_cmd_read_dma_cb(void *opaque, int ret)
 {
     IDEState *s = opaque;
-    int data_offset, n;
+    int i, n, size;
 
     if (ret < 0) {
         ide_atapi_io_error(s, ret);
         goto eot;
     }
 
-    if (s->io_buffer_size > 0) {
-	/*
-	 * For a cdrom read sector command (s->lba != -1),
-	 * adjust the lba for the next s->io_buffer_size chunk
-	 * and dma the current chunk.
-	 * For a command != read (s->lba == -1), just transfer
-	 * the reply data.
-	 */
-	if (s->lba != -1) {
-	    if (s->cd_sector_size == 2352) {
-		n = 1;
-		cd_data_to_raw(s->io_buffer, s->lba);
-	    } else {
-		n = s->io_buffer_size >> 11;
-	    }
-	    s->lba += n;
-	}
-        s->packet_transfer_size -= s->io_buffer_size;
-        if (s->bus->dma->ops->rw_buf(s->bus->dma, 1) == 0)
-            goto eot;
-    }
+    for (;;) {
+        if (s->lba != -1) {
+            size = IDE_DMA_BUF_SECTORS * 512 / s->cd_sector_size;
+            size = MIN(s->packet_transfer_size, size * s->cd_sector_size);
+            while (s->io_buffer_size < size) {
+                n = (s->packet_transfer_size - s->io_buffer_size) /
+                    s->cd_sector_size;
+                ret = cd_read_block(s, s->lba, n);
+                if (ret == -EINPROGRESS) {
+                    return;
+                }
+                if (ret < 0) {
+                    ide_atapi_io_error(s, ret);
+                    goto eot;
+                }
+                n = (size - s->io_buffer_size) / s->cd_sector_size;
+                n = MIN(n, s->cd_block_lba + s->cd_block_count - s->lba);
+                for (i = 0; i < n; i++) {
+                    cd_copy_sector(s, s->lba + i, s->io_buffer +
+                                   s->io_buffer_size + i * s->cd_sector_size,
+                                   s->cd_sector_size);
+                }
+                s->lba += n;
+                s->io_buffer_size += n * s->cd_sector_size;
+            }
+        }
 
-    if (s->packet_transfer_size <= 0) {
-        s->status = READY_STAT | SEEK_STAT;
-        s->nsector = (s->nsector & ~7) | ATAPI_INT_REASON_IO | ATAPI_INT_REASON_CD;
-        ide_set_irq(s->bus);
-    eot:
-        s->bus->dma->ops->add_status(s->bus->dma, BM_STATUS_INT);
-        ide_set_inactive(s);
-        return;
-    }
+        if (s->io_buffer_size > 0) {
+            s->packet_transfer_size -= s->io_buffer_size;
+            s->io_buffer_index = 0;
+            if (s->bus->dma->ops->rw_buf(s->bus->dma, 1) == 0)
+                goto eot;
+            s->io_buffer_size = 0;
+        }
 
-    s->io_buffer_index = 0;
-    if (s->cd_sector_size == 2352) {
-        n = 1;
-        s->io_buffer_size = s->cd_sector_size;
-        data_offset = 16;
-    } else {
-        n = s->packet_transfer_size >> 11;
-        if (n > (IDE_DMA_BUF_SECTORS / 4))
-            n = (IDE_DMA_BUF_SECTORS / 4);
-        s->io_buffer_size = n * 2048;
-        data_offset = 0;
-    }
-#ifdef DEBUG_AIO
-    printf("aio_read_cd: lba=%u n=%d\n", s->lba, n);
-#endif
-    s->bus->dma->iov.iov_base = (void *)(s->io_buffer + data_offset);
-    s->bus->dma->iov.iov_len = n * 4 * 512;
-    qemu_iovec_init_external(&s->bus->dma->qiov, &s->bus->dma->iov, 1);
-    s->bus->dma->aiocb = bdrv_aio_readv(s->bs, (int64_t)s->lba << 2,
-                                       &s->bus->dma->qiov, n * 4,
-                                       ide_atapi_cmd_read_dma_cb, s);
-    if (!s->bus->dma->aiocb) {
-        /* Note: media not present is the most likely case */
-        ide_atapi_cmd_error(s, SENSE_NOT_READY,
-                            ASC_MEDIUM_NOT_PRESENT);
-        goto eot;
+        if (s->packet_transfer_size <= 0) {
+            s->status = READY_STAT | SEEK_STAT;
+            s->nsector = (s->nsector & ~7) | ATAPI_INT_REASON_IO | ATAPI_INT_REASON_CD;
+            ide_set_irq(s->bus);
+        eot:
+            s->bus->dma->ops->add_status(s->bus->dma, BM_STATUS_INT);
+            ide_set_inactive(s);
+            return;
+        }
     }
 }
 
@@ -961,6 +1235,8 @@ static void ide_atapi_cmd_read(IDEState *s, int lba, int nb_sectors,
     printf("read %s: LBA=%d nb_sectors=%d\n", s->atapi_dma ? "dma" : "pio",
 	lba, nb_sectors);
 #endif
+    s->cd_sequential = lba == s->cd_next_lba;
+    s->cd_next_lba = lba + nb_sectors;
     if (s->atapi_dma) {
         ide_atapi_cmd_read_dma(s, lba, nb_sectors, sector_size);
     } else {
@@ -1596,6 +1872,18 @@ static void cdrom_change_cb(void *opaque, int reason)
     bdrv_get_geometry(s->bs, &nb_sectors);
     s->nb_sectors = nb_sectors;
 
+    /* a read in flight is for the old medium */
+    if (s->pio_waiting) {
+        ide_pio_cancel(s);
+        if (s->atapi_dma) {
+            ide_atapi_cmd_read_dma_cb(s, -ENOMEDIUM);
+        } else {
+            ide_transfer_stop(s);
+            ide_atapi_io_error(s, -ENOMEDIUM);
+        }
+    }
+    ide_pio_cancel(s);
+
     s->sense_key = SENSE_UNIT_ATTENTION;
     s->asc = ASC_MEDIUM_MAY_HAVE_CHANGED;
     s->cdrom_changed = 1;
@@ -1719,6 +2007,12 @@ void ide_exec_cmd(IDEBus *bus, uint32_t val)
     if ((s->status & (BUSY_STAT|DRQ_STAT)) && val != WIN_DEVICE_RESET)
         return;
 
+    /* nothing read ahead for an earlier command is of use any more,
+       except on a CD, which keeps its blocks until the medium changes */
+    if (s->drive_kind != IDE_CD || s->pio_waiting) {
+        ide_pio_cancel(s);
+    }
+
     switch(val) {
     case WIN_IDENTIFY:
         if (s->bs && s->drive_kind != IDE_CD) {
@@ -1821,7 +2115,7 @@ void ide_exec_cmd(IDEBus *bus, uint32_t val)
         if (!s->bs)
             goto abort_cmd;
 	ide_cmd_lba48_transform(s, lba48);
-        ide_sector_start_dma(s, 1);
+        ide_start_dma(s, 1, 0);
         break;
 	case WIN_WRITEDMA_EXT:
 	lba48 = 1;
@@ -1830,9 +2124,16 @@ void ide_exec_cmd(IDEBus *bus, uint32_t val)
         if (!s->bs)
             goto abort_cmd;
 	ide_cmd_lba48_transform(s, lba48);
-        ide_sector_start_dma(s, 0);
+        ide_start_dma(s, 0, 0);
         s->media_changed = 1;
         break;
+    case WIN_DSM:
+        if (!s->bs || !ide_has_trim(s) || s->feature != DSM_TRIM) {
+            goto abort_cmd;
+        }
+	ide_cmd_lba48_transform(s, 1);
+        ide_start_dma(s, 0, 1);
+        break;
     case WIN_READ_NATIVE_MAX_EXT:
 	lba48 = 1;
     case WIN_READ_NATIVE_MAX:
@@ -2320,6 +2621,7 @@ void ide_cmd_write(void *opaque, uint32_t addr, uint32_t val)
         /* reset low to high */
         for(i = 0;i < 2; i++) {
             s = &bus->ifs[i];
+            ide_pio_cancel(s);
             s->status = BUSY_STAT | SEEK_STAT;
             s->error = 0x01;
         }
@@ -2430,6 +2732,7 @@ static void ide_reset(IDEState *s)
 #ifdef DEBUG_IDE
     printf("ide: reset\n");
 #endif
+    ide_pio_cancel(s);
     if (s->drive_kind == IDE_CFATA)
         s->mult_sectors = 0;
     else
@@ -2529,6 +2832,10 @@ int ide_init_drive(IDEState *s, BlockDriverState *bs,
     s->smart_selftest_count = 0;
     if (bdrv_get_type_hint(bs) == BDRV_TYPE_CDROM) {
         s->drive_kind = IDE_CD;
+        if (!s->cd_cache) {
+            s->cd_cache = qemu_memalign(2048,
+                                        2 * IDE_CD_BLOCK_SECTORS * 2048);
+        }
         bdrv_set_change_cb(bs, cdrom_change_cb, s);
         bs->buffer_alignment = 2048;
     } else {
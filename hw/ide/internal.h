@@ -61,7 +61,12 @@ typedef struct IDEDMAOps IDEDMAOps;
  */
 #define CFA_REQ_EXT_ERROR_CODE		0x03 /* CFA Request Extended Error Code */
 /*
- *	0x04->0x07 Reserved
+ *	0x04->0x05 Reserved
+ */
+#define WIN_DSM				0x06 /* Data Set Management, 48-Bit */
+#define DSM_TRIM			0x01 /* feature: TRIM */
+/*
+ *	0x07 Reserved
  */
 #define WIN_SRST			0x08 /* ATAPI soft reset command */
 #define WIN_DEVICE_RESET		0x08
@@ -186,6 +191,7 @@ typedef struct IDEDMAOps IDEDMAOps;
 
 /* set to 1 set disable mult support */
 #define MAX_MULT_SECTORS 16
+#define IDE_DSM_MAX_BLOCKS 8    /* of TRIM ranges per DSM command */
 
 #define IDE_DMA_BUF_SECTORS 256
 
@@ -431,6 +437,21 @@ struct IDEState {
     int cur_io_buffer_offset;
     int cur_io_buffer_len;
     uint8_t end_transfer_fn_idx;
+    /* PIO reads and writes go through AIO, and reads are done ahead */
+    BlockDriverAIOCB *pio_aiocb;
+    struct iovec pio_iov;
+    QEMUIOVector pio_qiov;
+    int pio_waiting;            /* the guest waits for pio_aiocb */
+    int64_t pio_ahead_sector;
+    int pio_ahead_nb_sectors;   /* 0 if nothing is read ahead */
+    uint8_t *pio_ahead_buf;
+    int pio_ahead_ret;
+    uint8_t *cd_cache;          /* two blocks of ATAPI sectors */
+    int cd_block_lba;           /* ATAPI sectors already read ahead */
+    int cd_block_count;
+    uint8_t *cd_block_buf;
+    int cd_next_lba;            /* where the last ATAPI read ended */
+    int cd_sequential;
     QEMUTimer *sector_write_timer; /* only used for win2k install hack */
     uint32_t irq_count; /* counts IRQs when using win2k install hack */
     /* CF-ATA extended error */
@@ -440,6 +461,7 @@ struct IDEState {
     uint8_t *mdata_storage;
     int media_changed;
     int is_read;
+    int is_trim;                /* DMA carries DSM TRIM ranges */
     /* SMART */
     uint8_t smart_enabled;
     uint8_t smart_autosave;
@@ -478,6 +500,7 @@ struct IDEBus {
     IDEDMA *dma;
     uint8_t unit;
     uint8_t cmd;
+    uint8_t sync_pio;   /* dma->ops->start_transfer takes PIO data at once */
     qemu_irq irq;
 };
 
@@ -296,7 +296,7 @@ void bmdma_cmd_writeb(void *opaque, uint32_t addr, uint32_t val)
              * aio operation with preadv/pwritev.
              */
             if (bm->bus->dma->aiocb) {
-                qemu_aio_flush();
+                bdrv_drain_all();
 #ifdef DEBUG_IDE
                 if (bm->bus->dma->aiocb)
                     printf("ide_dma_cancel: aiocb still pending");
@@ -18,6 +18,7 @@
 #include "pci.h"
 #include "msix.h"
 #include "kvm.h"
+#include "qemu-timer.h"
 
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -46,6 +47,10 @@ typedef struct Peer {
 typedef struct EventfdEntry {
     PCIDevice *pdev;
     int vector;
+    /* interrupt coalescing: when the vector last fired, and the timer that
+       fires it at the end of the window if doorbells came in meanwhile */
+    int64_t last_irq;
+    QEMUTimer *coalesce_timer;
 } EventfdEntry;
 
 typedef struct IVShmemState {
@@ -59,6 +64,7 @@ typedef struct IVShmemState {
     int ivshmem_mmio_io_addr;
 
     pcibus_t mmio_addr;
+    pcibus_t doorbell_addr; /* where KVM matches doorbells, 0 if nowhere */
     pcibus_t shm_pci_addr;
     uint64_t ivshmem_offset;
     uint64_t ivshmem_size; /* size of shared memory region */
@@ -71,6 +77,7 @@ typedef struct IVShmemState {
     int vm_id;
     uint32_t vectors;
     uint32_t features;
+    uint32_t coalesce_us;   /* minimum time between interrupts of a vector */
     EventfdEntry *eventfd_table;
 
     char * shmobj;
@@ -303,13 +310,36 @@ static void ivshmem_event(void *opaque, int event)
     IVSHMEM_DPRINTF("ivshmem_event %d\n", event);
 }
 
+static void ivshmem_vector_fire(EventfdEntry *entry)
+{
+    IVSHMEM_DPRINTF("interrupt on vector %p %d\n", entry->pdev, entry->vector);
+    entry->last_irq = qemu_get_clock_ns(vm_clock);
+    msix_notify_deferred(entry->pdev, entry->vector);
+}
+
+static void ivshmem_coalesce_timer(void *opaque)
+{
+    ivshmem_vector_fire(opaque);
+}
+
+/* The eventfd counts doorbells rung since it was last read, so a burst
+ * costs a single read here.  Doorbells within coalesce-us of the last
+ * interrupt of the vector are folded into one at the end of that window,
+ * and those of one main loop iteration share an MSI-X message anyway. */
 static void fake_irqfd(void *opaque, const uint8_t *buf, int size) {
 
     EventfdEntry *entry = opaque;
-    PCIDevice *pdev = entry->pdev;
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, entry->pdev);
+    int64_t window = (int64_t)s->coalesce_us * 1000;
 
-    IVSHMEM_DPRINTF("interrupt on vector %p %d\n", pdev, entry->vector);
-    msix_notify(pdev, entry->vector);
+    if (window && qemu_get_clock_ns(vm_clock) < entry->last_irq + window) {
+        if (!qemu_timer_pending(entry->coalesce_timer)) {
+            qemu_mod_timer(entry->coalesce_timer, entry->last_irq + window);
+        }
+        return;
+    }
+    qemu_del_timer(entry->coalesce_timer);
+    ivshmem_vector_fire(entry);
 }
 
 static CharDriverState* create_eventfd_chr_device(void * opaque, int eventfd,
@@ -379,6 +409,23 @@ static void create_shared_memory_BAR(IVShmemState *s, int fd) {
                                 PCI_BASE_ADDRESS_SPACE_MEMORY, ivshmem_map);
 }
 
+/* With ioeventfd, KVM signals the eventfd of a doorbell write itself and the
+ * vcpu goes on without an exit; ivshmem_io_writel() only sees the writes
+ * that match none of them. */
+static void ivshmem_doorbell_set(IVShmemState *s, int posn, int vector,
+                                 bool assign)
+{
+    if (!s->doorbell_addr) {
+        return;
+    }
+    if (kvm_set_ioeventfd_mmio_long(s->peers[posn].eventfds[vector],
+                                    s->doorbell_addr + DOORBELL,
+                                    (posn << 16) | vector, assign) < 0 &&
+        assign) {
+        fprintf(stderr, "ivshmem: ioeventfd not available\n");
+    }
+}
+
 static void close_guest_eventfds(IVShmemState *s, int posn)
 {
     int i, guest_curr_max;
@@ -386,8 +433,7 @@ static void close_guest_eventfds(IVShmemState *s, int posn)
     guest_curr_max = s->peers[posn].nb_eventfds;
 
     for (i = 0; i < guest_curr_max; i++) {
-        kvm_set_ioeventfd_mmio_long(s->peers[posn].eventfds[i],
-                    s->mmio_addr + DOORBELL, (posn << 16) | i, 0);
+        ivshmem_doorbell_set(s, posn, i, false);
         close(s->peers[posn].eventfds[i]);
     }
 
@@ -395,14 +441,20 @@ static void close_guest_eventfds(IVShmemState *s, int posn)
     s->peers[posn].nb_eventfds = 0;
 }
 
-static void setup_ioeventfds(IVShmemState *s) {
+/* Move the doorbells of all peers along with BAR 0 */
+static void setup_ioeventfds(IVShmemState *s, pcibus_t addr) {
 
     int i, j;
 
-    for (i = 0; i <= s->max_peer; i++) {
+    for (i = 0; i <= s->max_peer && s->peers; i++) {
+        for (j = 0; j < s->peers[i].nb_eventfds; j++) {
+            ivshmem_doorbell_set(s, i, j, false);
+        }
+    }
+    s->doorbell_addr = addr;
+    for (i = 0; i <= s->max_peer && s->peers; i++) {
         for (j = 0; j < s->peers[i].nb_eventfds; j++) {
-            kvm_set_ioeventfd_mmio_long(s->peers[i].eventfds[j],
-                    s->mmio_addr + DOORBELL, (i << 16) | j, 1);
+            ivshmem_doorbell_set(s, i, j, true);
         }
     }
 }
@@ -532,10 +584,7 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
     }
 
     if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
-        if (kvm_set_ioeventfd_mmio_long(incoming_fd, s->mmio_addr + DOORBELL,
-                        (incoming_posn << 16) | guest_max_eventfd, 1) < 0) {
-            fprintf(stderr, "ivshmem: ioeventfd not available\n");
-        }
+        ivshmem_doorbell_set(s, incoming_posn, guest_max_eventfd, true);
     }
 
     return;
@@ -559,7 +608,7 @@ static void ivshmem_mmio_map(PCIDevice *pci_dev, int region_num,
                                                 s->ivshmem_mmio_io_addr);
 
     if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
-        setup_ioeventfds(s);
+        setup_ioeventfds(s, addr);
     }
 }
 
@@ -614,6 +663,11 @@ static void ivshmem_setup_msi(IVShmemState * s) {
 
     /* allocate Qemu char devices for receiving interrupts */
     s->eventfd_table = qemu_mallocz(s->vectors * sizeof(EventfdEntry));
+    for (i = 0; i < s->vectors; i++) {
+        s->eventfd_table[i].coalesce_timer =
+            qemu_new_timer(vm_clock, ivshmem_coalesce_timer,
+                           &s->eventfd_table[i]);
+    }
 }
 
 static void ivshmem_save(QEMUFile* f, void *opaque)
@@ -680,11 +734,9 @@ static int pci_ivshmem_init(PCIDevice *dev)
     register_savevm(&s->dev.qdev, "ivshmem", 0, 0, ivshmem_save, ivshmem_load,
                                                                         dev);
 
-    /* IRQFD requires MSI */
-    if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD) &&
-        !ivshmem_has_feature(s, IVSHMEM_MSI)) {
-        fprintf(stderr, "ivshmem: ioeventfd/irqfd requires MSI\n");
-        exit(1);
+    /* the doorbells stay in QEMU without enough ioeventfds for them */
+    if (!kvm_enabled() || !kvm_has_many_ioeventfds()) {
+        s->features &= ~(1 << IVSHMEM_IOEVENTFD);
     }
 
     /* check that role is reasonable */
@@ -796,7 +848,14 @@ static int pci_ivshmem_init(PCIDevice *dev)
 static int pci_ivshmem_uninit(PCIDevice *dev)
 {
     IVShmemState *s = DO_UPCAST(IVShmemState, dev, dev);
+    int i;
 
+    if (s->eventfd_table) {
+        for (i = 0; i < s->vectors; i++) {
+            qemu_del_timer(s->eventfd_table[i].coalesce_timer);
+            qemu_free_timer(s->eventfd_table[i].coalesce_timer);
+        }
+    }
     cpu_unregister_io_memory(s->ivshmem_mmio_io_addr);
     unregister_savevm(&dev->qdev, "ivshmem", s);
 
@@ -813,7 +872,8 @@ static PCIDeviceInfo ivshmem_info = {
         DEFINE_PROP_CHR("chardev", IVShmemState, server_chr),
         DEFINE_PROP_STRING("size", IVShmemState, sizearg),
         DEFINE_PROP_UINT32("vectors", IVShmemState, vectors, 1),
-        DEFINE_PROP_BIT("ioeventfd", IVShmemState, features, IVSHMEM_IOEVENTFD, false),
+        DEFINE_PROP_BIT("ioeventfd", IVShmemState, features, IVSHMEM_IOEVENTFD, true),
+        DEFINE_PROP_UINT32("coalesce-us", IVShmemState, coalesce_us, 0),
         DEFINE_PROP_BIT("msi", IVShmemState, features, IVSHMEM_MSI, true),
         DEFINE_PROP_STRING("shm", IVShmemState, shmobj),
         DEFINE_PROP_STRING("role", IVShmemState, role),
@@ -49,11 +49,41 @@
 #include "uboot_image.h"
 #include "loader.h"
 #include "fw_cfg.h"
+#include "qemu-timer.h"
 
 #include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 static int roms_loaded;
 
+/* A private, copy-on-write mapping of the first size bytes of fd, or NULL
+   if the file can't be mapped.  Every QEMU process that maps the same
+   image shares its pages until it writes to them, and pages that are
+   never read are never loaded. */
+static void *map_fd(int fd, size_t size)
+{
+#ifndef _WIN32
+    void *p;
+
+    if (size == 0) {
+        return NULL;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    return p == MAP_FAILED ? NULL : p;
+#else
+    return NULL;
+#endif
+}
+
+static void unmap_fd(void *p, size_t size)
+{
+#ifndef _WIN32
+    munmap(p, size);
+#endif
+}
+
 /* return the size or -1 if error */
 int get_image_size(const char *filename)
 {
@@ -84,6 +114,30 @@ int load_image(const char *filename, uint8_t *addr)
     return size;
 }
 
+/* return the contents of the file, mapped if possible, and its size in
+   *size; NULL if error.  The buffer is never freed. */
+uint8_t *map_image(const char *filename, int *size)
+{
+    uint8_t *data;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return NULL;
+    *size = lseek(fd, 0, SEEK_END);
+    data = map_fd(fd, *size);
+    if (!data) {
+        data = qemu_malloc(*size);
+        lseek(fd, 0, SEEK_SET);
+        if (read(fd, data, *size) != *size) {
+            qemu_free(data);
+            data = NULL;
+        }
+    }
+    close(fd);
+    return data;
+}
+
 /* read()-like version */
 int read_targphys(const char *name,
                   int fd, target_phys_addr_t dst_addr, size_t nbytes)
@@ -528,6 +582,7 @@ struct Rom {
     char *path;
     size_t romsize;
     uint8_t *data;
+    int mapped;                 /* data is map_fd() of the file */
     int isrom;
     char *fw_dir;
     char *fw_file;
@@ -539,6 +594,16 @@ struct Rom {
 static FWCfgState *fw_cfg;
 static QTAILQ_HEAD(, Rom) roms = QTAILQ_HEAD_INITIALIZER(roms);
 
+static void rom_free_data(Rom *rom)
+{
+    if (rom->mapped) {
+        unmap_fd(rom->data, rom->romsize);
+    } else {
+        qemu_free(rom->data);
+    }
+    rom->data = NULL;
+}
+
 static void rom_insert(Rom *rom)
 {
     Rom *item;
@@ -563,6 +628,7 @@ int rom_add_file(const char *file, const char *fw_dir,
     Rom *rom;
     int rc, fd = -1;
     char devpath[100];
+    int64_t start = get_clock();
 
     rom = qemu_mallocz(sizeof(*rom));
     rom->name = qemu_strdup(file);
@@ -584,16 +650,23 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
     rom->addr    = addr;
     rom->romsize = lseek(fd, 0, SEEK_END);
-    rom->data    = qemu_mallocz(rom->romsize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->romsize);
-    if (rc != rom->romsize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->romsize);
-        goto err;
+    rom->data    = map_fd(fd, rom->romsize);
+    if (rom->data) {
+        rom->mapped = 1;
+    } else {
+        rom->data = qemu_mallocz(rom->romsize);
+        lseek(fd, 0, SEEK_SET);
+        rc = read(fd, rom->data, rom->romsize);
+        if (rc != rom->romsize) {
+            fprintf(stderr,
+                    "rom: file %-20s: read error: rc=%d (expected %zd)\n",
+                    rom->name, rc, rom->romsize);
+            goto err;
+        }
     }
     close(fd);
     rom_insert(rom);
+    startup_profile_account("rom files", get_clock() - start);
     if (rom->fw_file && fw_cfg) {
         const char *basename;
         char fw_file_name[56];
@@ -618,7 +691,7 @@ int rom_add_file(const char *file, const char *fw_dir,
 err:
     if (fd != -1)
         close(fd);
-    qemu_free(rom->data);
+    rom_free_data(rom);
     qemu_free(rom->path);
     qemu_free(rom->name);
     qemu_free(rom);
@@ -652,6 +725,7 @@ int rom_add_option(const char *file, int32_t bootindex)
 
 static void rom_reset(void *unused)
 {
+    int64_t start = get_clock();
     Rom *rom;
 
     QTAILQ_FOREACH(rom, &roms, next) {
@@ -664,10 +738,10 @@ static void rom_reset(void *unused)
         cpu_physical_memory_write_rom(rom->addr, rom->data, rom->romsize);
         if (rom->isrom) {
             /* rom needs to be written only once */
-            qemu_free(rom->data);
-            rom->data = NULL;
+            rom_free_data(rom);
         }
     }
+    startup_profile_account("rom copies", get_clock() - start);
 }
 
 int rom_load_all(void)
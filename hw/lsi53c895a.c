@@ -173,6 +173,17 @@ do { fprintf(stderr, "lsi_scsi: error: " fmt , ## __VA_ARGS__);} while (0)
 /* Flag set if this is a tagged command.  */
 #define LSI_TAG_VALID     (1 << 16)
 
+/* SCRIPTS and their tables are fetched a line at a time, as the prefetch
+   unit of the chip does, instead of a dword at a time.  */
+#define LSI_PREFETCH_LINES 2
+#define LSI_PREFETCH_SIZE  128
+
+typedef struct {
+    uint32_t addr;
+    int valid;
+    uint8_t data[LSI_PREFETCH_SIZE];
+} LSIPrefetchLine;
+
 typedef struct lsi_request {
     uint32_t tag;
     uint32_t dma_len;
@@ -272,6 +283,9 @@ typedef struct {
 
     /* Script ram is stored as 32-bit words in host byteorder.  */
     uint32_t script_ram[2048];
+
+    LSIPrefetchLine prefetch[LSI_PREFETCH_LINES];
+    int prefetch_last;
 } LSIState;
 
 static inline int lsi_irq_on_rsl(LSIState *s)
@@ -386,6 +400,65 @@ static void lsi_reg_writeb(LSIState *s, int offset, uint8_t val);
 static void lsi_execute_script(LSIState *s);
 static void lsi_reselect(LSIState *s, lsi_request *p);
 
+/*
+ * The prefetched lines are dropped whenever SCRIPTS are (re)started, when the
+ * driver asks for it with DCNTL.PFF, and when the chip writes over them, so
+ * a script that the guest or the chip itself modifies is seen as modified.
+ */
+static void lsi_prefetch_flush(LSIState *s)
+{
+    int i;
+
+    for (i = 0; i < LSI_PREFETCH_LINES; i++) {
+        s->prefetch[i].valid = 0;
+    }
+}
+
+static void lsi_fetch(LSIState *s, uint32_t addr, void *buf, int len)
+{
+    uint32_t line = addr & ~(LSI_PREFETCH_SIZE - 1);
+    LSIPrefetchLine *l;
+    int i;
+
+    if ((addr & (LSI_PREFETCH_SIZE - 1)) + len > LSI_PREFETCH_SIZE ||
+        (addr & 0xffffe000) == s->script_ram_base) {
+        cpu_physical_memory_read(addr, buf, len);
+        return;
+    }
+
+    for (i = 0; i < LSI_PREFETCH_LINES; i++) {
+        l = &s->prefetch[i];
+        if (l->valid && l->addr == line) {
+            goto hit;
+        }
+    }
+
+    /* replace the line that was not used last */
+    i = (s->prefetch_last + 1) % LSI_PREFETCH_LINES;
+    l = &s->prefetch[i];
+    cpu_physical_memory_read(line, l->data, LSI_PREFETCH_SIZE);
+    l->addr = line;
+    l->valid = 1;
+hit:
+    s->prefetch_last = i;
+    memcpy(buf, l->data + (addr - line), len);
+}
+
+static void lsi_mem_write(LSIState *s, target_phys_addr_t addr,
+                          const uint8_t *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < LSI_PREFETCH_LINES; i++) {
+        LSIPrefetchLine *l = &s->prefetch[i];
+        if (l->valid && addr < l->addr + LSI_PREFETCH_SIZE &&
+            addr + len > l->addr) {
+            l->valid = 0;
+        }
+    }
+    cpu_physical_memory_write(addr, buf, len);
+}
+
 static inline uint32_t read_dword(LSIState *s, uint32_t addr)
 {
     uint32_t buf;
@@ -394,7 +467,7 @@ static inline uint32_t read_dword(LSIState *s, uint32_t addr)
     if ((addr & 0xffffe000) == s->script_ram_base) {
         return s->script_ram[(addr & 0x1fff) >> 2];
     }
-    cpu_physical_memory_read(addr, (uint8_t *)&buf, 4);
+    lsi_fetch(s, addr, &buf, 4);
     return cpu_to_le32(buf);
 }
 
@@ -576,7 +649,7 @@ static void lsi_do_dma(LSIState *s, int out)
     if (out) {
         cpu_physical_memory_read(addr, s->current->dma_buf, count);
     } else {
-        cpu_physical_memory_write(addr, s->current->dma_buf, count);
+        lsi_mem_write(s, addr, s->current->dma_buf, count);
     }
     s->current->dma_len -= count;
     if (s->current->dma_len == 0) {
@@ -790,7 +863,7 @@ static void lsi_do_status(LSIState *s)
     s->dbc = 1;
     sense = s->sense;
     s->sfbr = sense;
-    cpu_physical_memory_write(s->dnad, &sense, 1);
+    lsi_mem_write(s, s->dnad, &sense, 1);
     lsi_set_phase(s, PHASE_MI);
     s->msg_action = 1;
     lsi_add_msg_byte(s, 0); /* COMMAND COMPLETE */
@@ -804,7 +877,7 @@ static void lsi_do_msgin(LSIState *s)
     len = s->msg_len;
     if (len > s->dbc)
         len = s->dbc;
-    cpu_physical_memory_write(s->dnad, s->msg, len);
+    lsi_mem_write(s, s->dnad, s->msg, len);
     /* Linux drivers rely on the last byte being in the SIDL.  */
     s->sidl = s->msg[len - 1];
     s->msg_len -= len;
@@ -836,7 +909,7 @@ static void lsi_do_msgin(LSIState *s)
 static uint8_t lsi_get_msgbyte(LSIState *s)
 {
     uint8_t data;
-    cpu_physical_memory_read(s->dnad, &data, 1);
+    lsi_fetch(s, s->dnad, &data, 1);
     s->dnad++;
     s->dbc--;
     return data;
@@ -925,7 +998,7 @@ static void lsi_memcpy(LSIState *s, uint32_t dest, uint32_t src, int count)
     while (count) {
         n = (count > LSI_BUF_SIZE) ? LSI_BUF_SIZE : count;
         cpu_physical_memory_read(src, buf, n);
-        cpu_physical_memory_write(dest, buf, n);
+        lsi_mem_write(s, dest, buf, n);
         src += n;
         dest += n;
         count -= n;
@@ -957,6 +1030,7 @@ static void lsi_execute_script(LSIState *s)
     int insn_processed = 0;
 
     s->istat1 |= LSI_ISTAT1_SRUN;
+    lsi_prefetch_flush(s);
 again:
     insn_processed++;
     insn = read_dword(s, s->dsp);
@@ -993,7 +1067,7 @@ again:
 
             /* 32-bit Table indirect */
             offset = sxt24(addr);
-            cpu_physical_memory_read(s->dsa + offset, (uint8_t *)buf, 8);
+            lsi_fetch(s, s->dsa + offset, buf, 8);
             /* byte count is stored in bits 0:23 only */
             s->dbc = cpu_to_le32(buf[0]) & 0xffffff;
             s->rbc = s->dbc;
@@ -1363,7 +1437,7 @@ again:
                 for (i = 0; i < n; i++) {
                     data[i] = lsi_reg_readb(s, reg + i);
                 }
-                cpu_physical_memory_write(addr, data, n);
+                lsi_mem_write(s, addr, data, n);
             }
         }
     }
@@ -1721,6 +1795,9 @@ static void lsi_reg_writeb(LSIState *s, int offset, uint8_t val)
         s->sbr = val;
         break;
     case 0x3b: /* DCNTL */
+        if (val & LSI_DCNTL_PFF) {
+            lsi_prefetch_flush(s);
+        }
         s->dcntl = val & ~(LSI_DCNTL_PFF | LSI_DCNTL_STD);
         if ((val & LSI_DCNTL_STD) && (s->istat1 & LSI_ISTAT1_SRUN) == 0)
             lsi_execute_script(s);
@@ -91,18 +91,20 @@ typedef struct RTCState {
     /* periodic timer */
     QEMUTimer *periodic_timer;
     int64_t next_periodic_time;
-    /* second update */
+    /* second update, see rtc_update_time */
     int64_t next_second_time;
     uint16_t irq_reinject_on_ack_count;
     uint32_t irq_coalesced;
     uint32_t period;
     QEMUTimer *coalesced_timer;
     QEMUTimer *second_timer;
-    QEMUTimer *second_timer2;
+    QEMUTimer *second_timer2;   /* only ever loaded from older versions */
 } RTCState;
 
 static void rtc_set_time(RTCState *s);
 static void rtc_copy_date(RTCState *s);
+static void rtc_update_time(RTCState *s, int64_t now);
+static void rtc_second_timer_update(RTCState *s);
 
 #ifdef TARGET_I386
 static void rtc_coalesced_timer_update(RTCState *s)
@@ -224,6 +226,7 @@ static void cmos_ioport_write(void *opaque, uint32_t addr, uint32_t data)
         case RTC_DAY_OF_MONTH:
         case RTC_MONTH:
         case RTC_YEAR:
+            rtc_update_time(s, qemu_get_clock(rtc_clock));
             s->cmos_data[s->cmos_index] = data;
             /* if in set mode, do not update the time */
             if (!(s->cmos_data[RTC_REG_B] & REG_B_SET)) {
@@ -231,15 +234,16 @@ static void cmos_ioport_write(void *opaque, uint32_t addr, uint32_t data)
             }
             break;
         case RTC_REG_A:
-            /* UIP bit is read only */
-            s->cmos_data[RTC_REG_A] = (data & ~REG_A_UIP) |
-                (s->cmos_data[RTC_REG_A] & REG_A_UIP);
+            /* the seconds so far went by with the old divider */
+            rtc_update_time(s, qemu_get_clock(rtc_clock));
+            /* UIP bit is read only, and computed when read */
+            s->cmos_data[RTC_REG_A] = data & ~REG_A_UIP;
             rtc_timer_update(s, qemu_get_clock(rtc_clock));
             break;
         case RTC_REG_B:
+            rtc_update_time(s, qemu_get_clock(rtc_clock));
             if (data & REG_B_SET) {
-                /* set mode: reset UIP mode */
-                s->cmos_data[RTC_REG_A] &= ~REG_A_UIP;
+                /* set mode: no update interrupts */
                 data &= ~REG_B_UIE;
             } else {
                 /* if disabling set mode, update the time */
@@ -257,6 +261,7 @@ static void cmos_ioport_write(void *opaque, uint32_t addr, uint32_t data)
                 s->cmos_data[RTC_REG_B] = data;
             }
             rtc_timer_update(s, qemu_get_clock(rtc_clock));
+            rtc_second_timer_update(s);
             break;
         case RTC_REG_C:
         case RTC_REG_D:
@@ -385,71 +390,85 @@ static void rtc_next_second(struct tm *tm)
 }
 
 
-static void rtc_update_second(void *opaque)
-{
-    RTCState *s = opaque;
-    int64_t delay;
+/*
+ * The clock is not kept ticking by a timer.  The time registers, the update
+ * in progress bit and the update ended flag are brought up to date from
+ * rtc_clock when the guest looks at them, and second_timer only runs while
+ * the guest wants the update ended or alarm interrupts.
+ *
+ * An update starts at next_second_time and lasts UIP_LENGTH, at the end of
+ * which the time registers change.  It should be 244 us = 8 / 32768
+ * seconds, but currently the timers do not have the necessary resolution.
+ */
+#define UIP_LENGTH (get_ticks_per_sec() / 100)
 
-    /* if the oscillator is not in normal operation, we do not update */
-    if ((s->cmos_data[RTC_REG_A] & 0x70) != 0x20) {
+/* Do the updates that ended by now */
+static void rtc_update_time(RTCState *s, int64_t now)
+{
+    while (now >= s->next_second_time + UIP_LENGTH) {
         s->next_second_time += get_ticks_per_sec();
-        qemu_mod_timer(s->second_timer, s->next_second_time);
-    } else {
-        rtc_next_second(&s->current_tm);
 
+        /* if the oscillator is not in normal operation, we do not update */
+        if ((s->cmos_data[RTC_REG_A] & 0x70) != 0x20) {
+            continue;
+        }
+        rtc_next_second(&s->current_tm);
         if (!(s->cmos_data[RTC_REG_B] & REG_B_SET)) {
-            /* update in progress bit */
-            s->cmos_data[RTC_REG_A] |= REG_A_UIP;
+            rtc_copy_date(s);
         }
-        /* should be 244 us = 8 / 32768 seconds, but currently the
-           timers do not have the necessary resolution. */
-        delay = (get_ticks_per_sec() * 1) / 100;
-        if (delay < 1)
-            delay = 1;
-        qemu_mod_timer(s->second_timer2,
-                       s->next_second_time + delay);
-    }
-}
-
-static void rtc_update_second2(void *opaque)
-{
-    RTCState *s = opaque;
 
-    if (!(s->cmos_data[RTC_REG_B] & REG_B_SET)) {
-        rtc_copy_date(s);
-    }
+        /* check alarm */
+        if (s->cmos_data[RTC_REG_B] & REG_B_AIE) {
+            if (((s->cmos_data[RTC_SECONDS_ALARM] & 0xc0) == 0xc0 ||
+                 rtc_from_bcd(s, s->cmos_data[RTC_SECONDS_ALARM]) == s->current_tm.tm_sec) &&
+                ((s->cmos_data[RTC_MINUTES_ALARM] & 0xc0) == 0xc0 ||
+                 rtc_from_bcd(s, s->cmos_data[RTC_MINUTES_ALARM]) == s->current_tm.tm_min) &&
+                ((s->cmos_data[RTC_HOURS_ALARM] & 0xc0) == 0xc0 ||
+                 rtc_from_bcd(s, s->cmos_data[RTC_HOURS_ALARM]) == s->current_tm.tm_hour)) {
 
-    /* check alarm */
-    if (s->cmos_data[RTC_REG_B] & REG_B_AIE) {
-        if (((s->cmos_data[RTC_SECONDS_ALARM] & 0xc0) == 0xc0 ||
-             rtc_from_bcd(s, s->cmos_data[RTC_SECONDS_ALARM]) == s->current_tm.tm_sec) &&
-            ((s->cmos_data[RTC_MINUTES_ALARM] & 0xc0) == 0xc0 ||
-             rtc_from_bcd(s, s->cmos_data[RTC_MINUTES_ALARM]) == s->current_tm.tm_min) &&
-            ((s->cmos_data[RTC_HOURS_ALARM] & 0xc0) == 0xc0 ||
-             rtc_from_bcd(s, s->cmos_data[RTC_HOURS_ALARM]) == s->current_tm.tm_hour)) {
+                s->cmos_data[RTC_REG_C] |= 0xa0;
+                qemu_irq_raise(s->irq);
+            }
+        }
 
-            s->cmos_data[RTC_REG_C] |= 0xa0;
+        /* update ended interrupt */
+        s->cmos_data[RTC_REG_C] |= REG_C_UF;
+        if (s->cmos_data[RTC_REG_B] & REG_B_UIE) {
+            s->cmos_data[RTC_REG_C] |= REG_C_IRQF;
             qemu_irq_raise(s->irq);
         }
     }
+}
 
-    /* update ended interrupt */
-    s->cmos_data[RTC_REG_C] |= REG_C_UF;
-    if (s->cmos_data[RTC_REG_B] & REG_B_UIE) {
-        s->cmos_data[RTC_REG_C] |= REG_C_IRQF;
-        qemu_irq_raise(s->irq);
+/* Whether an update is in progress, once those that ended are done */
+static int rtc_update_in_progress(RTCState *s, int64_t now)
+{
+    return !(s->cmos_data[RTC_REG_B] & REG_B_SET) &&
+           (s->cmos_data[RTC_REG_A] & 0x70) == 0x20 &&
+           now >= s->next_second_time;
+}
+
+static void rtc_second_timer_update(RTCState *s)
+{
+    if (s->cmos_data[RTC_REG_B] & (REG_B_UIE | REG_B_AIE)) {
+        qemu_mod_timer(s->second_timer, s->next_second_time + UIP_LENGTH);
+    } else {
+        qemu_del_timer(s->second_timer);
     }
+}
 
-    /* clear update in progress bit */
-    s->cmos_data[RTC_REG_A] &= ~REG_A_UIP;
+static void rtc_update_second(void *opaque)
+{
+    RTCState *s = opaque;
 
-    s->next_second_time += get_ticks_per_sec();
-    qemu_mod_timer(s->second_timer, s->next_second_time);
+    rtc_update_time(s, qemu_get_clock(rtc_clock));
+    rtc_second_timer_update(s);
 }
 
 static uint32_t cmos_ioport_read(void *opaque, uint32_t addr)
 {
     RTCState *s = opaque;
+    int64_t now;
     int ret;
     if ((addr & 1) == 0) {
         return 0xff;
@@ -462,12 +481,19 @@ static uint32_t cmos_ioport_read(void *opaque, uint32_t addr)
         case RTC_DAY_OF_MONTH:
         case RTC_MONTH:
         case RTC_YEAR:
+            rtc_update_time(s, qemu_get_clock(rtc_clock));
             ret = s->cmos_data[s->cmos_index];
             break;
         case RTC_REG_A:
+            now = qemu_get_clock(rtc_clock);
+            rtc_update_time(s, now);
             ret = s->cmos_data[s->cmos_index];
+            if (rtc_update_in_progress(s, now)) {
+                ret |= REG_A_UIP;
+            }
             break;
         case RTC_REG_C:
+            rtc_update_time(s, qemu_get_clock(rtc_clock));
             ret = s->cmos_data[s->cmos_index];
             qemu_irq_lower(s->irq);
 #ifdef TARGET_I386
@@ -531,11 +557,35 @@ static void rtc_set_date_from_host(ISADevice *dev)
     rtc_set_memory(dev, REG_IBM_PS2_CENTURY_BYTE, val);
 }
 
+static void rtc_pre_save(void *opaque)
+{
+    RTCState *s = opaque;
+
+    rtc_update_time(s, qemu_get_clock(rtc_clock));
+    /* an older QEMU only updates the time from second_timer */
+    if (!qemu_timer_pending(s->second_timer)) {
+        qemu_mod_timer(s->second_timer, s->next_second_time);
+    }
+}
+
 static int rtc_post_load(void *opaque, int version_id)
 {
-#ifdef TARGET_I386
     RTCState *s = opaque;
 
+    /* an older QEMU may have been halfway through an update, with the time
+       ticked already but not copied to the registers */
+    if (qemu_timer_pending(s->second_timer2)) {
+        qemu_del_timer(s->second_timer2);
+        if (!(s->cmos_data[RTC_REG_B] & REG_B_SET)) {
+            rtc_copy_date(s);
+        }
+        s->cmos_data[RTC_REG_C] |= REG_C_UF;
+        s->next_second_time += get_ticks_per_sec();
+    }
+    s->cmos_data[RTC_REG_A] &= ~REG_A_UIP;
+    rtc_second_timer_update(s);
+
+#ifdef TARGET_I386
     if (version_id >= 2) {
         if (rtc_td_hack) {
             rtc_coalesced_timer_update(s);
@@ -550,6 +600,7 @@ static const VMStateDescription vmstate_rtc = {
     .version_id = 2,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .pre_save = rtc_pre_save,
     .post_load = rtc_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_BUFFER(cmos_data, RTCState),
@@ -576,8 +627,10 @@ static void rtc_reset(void *opaque)
 {
     RTCState *s = opaque;
 
+    rtc_update_time(s, qemu_get_clock(rtc_clock));
     s->cmos_data[RTC_REG_B] &= ~(REG_B_PIE | REG_B_AIE | REG_B_SQWE);
     s->cmos_data[RTC_REG_C] &= ~(REG_C_UF | REG_C_IRQF | REG_C_PF | REG_C_AF);
+    rtc_second_timer_update(s);
 
     qemu_irq_lower(s->irq);
 
@@ -606,15 +659,17 @@ static int rtc_initfn(ISADevice *dev)
             qemu_new_timer(rtc_clock, rtc_coalesced_timer, s);
 #endif
     s->second_timer = qemu_new_timer(rtc_clock, rtc_update_second, s);
-    s->second_timer2 = qemu_new_timer(rtc_clock, rtc_update_second2, s);
+    s->second_timer2 = qemu_new_timer(rtc_clock, rtc_update_second, s);
 
     s->next_second_time =
         qemu_get_clock(rtc_clock) + (get_ticks_per_sec() * 99) / 100;
-    qemu_mod_timer(s->second_timer2, s->next_second_time);
 
     register_ioport_write(base, 2, 1, cmos_ioport_write, s);
     register_ioport_read(base, 2, 1, cmos_ioport_read, s);
     isa_init_ioport_range(dev, base, 2);
+    /* A write to the index only matters to the next access to the data
+       port, which exits anyway */
+    qemu_register_coalesced_pio(base, 1);
 
     qdev_set_legacy_instance_id(&dev->qdev, base, 2);
     qemu_register_reset(rtc_reset, s);
@@ -102,6 +102,37 @@ static inline uint8_t msi_pending_off(const PCIDevice* dev, bool msi64bit)
     return dev->msi_cap + (msi64bit ? PCI_MSI_PENDING_64 : PCI_MSI_PENDING_32);
 }
 
+static uint64_t msi_direct_base;
+static uint64_t msi_direct_size;
+static MSIDeliverFunc *msi_direct_deliver;
+
+void msi_set_direct_delivery(uint64_t base, uint64_t size,
+                             MSIDeliverFunc *deliver)
+{
+    msi_direct_base = base;
+    msi_direct_size = size;
+    msi_direct_deliver = deliver;
+}
+
+MSIDeliverFunc *msi_direct_route(uint64_t addr)
+{
+    if (addr - msi_direct_base < msi_direct_size) {
+        return msi_direct_deliver;
+    }
+    return NULL;
+}
+
+void msi_send_message(uint64_t addr, uint32_t data)
+{
+    MSIDeliverFunc *deliver = msi_direct_route(addr);
+
+    if (deliver) {
+        deliver(addr, data);
+    } else {
+        stl_phys(addr, data);
+    }
+}
+
 bool msi_enabled(const PCIDevice *dev)
 {
     return msi_present(dev) &&
@@ -241,7 +272,7 @@ void msi_notify(PCIDevice *dev, unsigned int vector)
                    "notify vector 0x%x"
                    " address: 0x%"PRIx64" data: 0x%"PRIx32"\n",
                    vector, address, data);
-    stl_phys(address, data);
+    msi_send_message(address, data);
 }
 
 /* call this function after updating configs by pci_default_write_config(). */
@@ -24,6 +24,17 @@
 #include "qemu-common.h"
 #include "pci.h"
 
+/* Delivers a message written to the interrupt controller's MSI window */
+typedef void MSIDeliverFunc(uint64_t addr, uint32_t data);
+
+/* Messages to [base, base + size) go straight to deliver rather than
+   through the memory map */
+void msi_set_direct_delivery(uint64_t base, uint64_t size,
+                             MSIDeliverFunc *deliver);
+/* The function that delivers messages to addr directly, or NULL */
+MSIDeliverFunc *msi_direct_route(uint64_t addr);
+void msi_send_message(uint64_t addr, uint32_t data);
+
 bool msi_enabled(const PCIDevice *dev);
 int msi_init(struct PCIDevice *dev, uint8_t offset,
              unsigned int nr_vectors, bool msi64bit, bool msi_per_vector_mask);
@@ -12,9 +12,11 @@
  */
 
 #include "hw.h"
+#include "msi.h"
 #include "msix.h"
 #include "pci.h"
 #include "range.h"
+#include "host-utils.h"
 
 /* MSI-X capability structure */
 #define MSIX_TABLE_OFFSET 4
@@ -43,9 +45,23 @@
 #define MSIX_MAX_ENTRIES 32
 
 
+/* What a vector's table entry says, decoded on its first notification after
+ * the entry changed; the mask bits are still looked up every time. */
+typedef struct MSIXRoute {
+    uint64_t addr;
+    uint32_t data;
+    bool valid;
+    MSIDeliverFunc *deliver;    /* NULL to go through the memory map */
+} MSIXRoute;
+
 /* Flag for interrupt controller to declare MSI-X support */
 int msix_supported;
 
+/* Devices with messages held back by msix_notify_deferred() */
+static QLIST_HEAD(, PCIDevice) msix_deferred_devices =
+    QLIST_HEAD_INITIALIZER(msix_deferred_devices);
+static QEMUBH *msix_deferred_bh;
+
 /* Add MSI-X capability to the config space for the device. */
 /* Given a bar and its size, add MSI-X table on top of it
  * and fill MSI-X capability in the config space.
@@ -186,6 +202,9 @@ static void msix_mmio_writel(void *opaque, target_phys_addr_t addr,
     unsigned int offset = addr & (MSIX_PAGE_SIZE - 1) & ~0x3;
     int vector = offset / MSIX_ENTRY_SIZE;
     pci_set_long(dev->msix_table_page + offset, val);
+    if (offset < MSIX_PAGE_PENDING) {
+        dev->msix_routes[vector].valid = false;
+    }
     msix_handle_mask_update(dev, vector);
 }
 
@@ -248,6 +267,8 @@ int msix_init(struct PCIDevice *dev, unsigned short nentries,
                                         sizeof *dev->msix_entry_used);
 
     dev->msix_table_page = qemu_mallocz(MSIX_PAGE_SIZE);
+    dev->msix_routes = qemu_mallocz(MSIX_MAX_ENTRIES *
+                                    sizeof *dev->msix_routes);
     msix_mask_all(dev, nentries);
 
     dev->msix_mmio_index = cpu_register_io_memory(msix_mmio_read,
@@ -272,6 +293,8 @@ err_config:
 err_index:
     qemu_free(dev->msix_table_page);
     dev->msix_table_page = NULL;
+    qemu_free(dev->msix_routes);
+    dev->msix_routes = NULL;
     qemu_free(dev->msix_entry_used);
     dev->msix_entry_used = NULL;
     return ret;
@@ -283,6 +306,7 @@ static void msix_free_irq_entries(PCIDevice *dev)
 
     for (vector = 0; vector < dev->msix_entries_nr; ++vector) {
         dev->msix_entry_used[vector] = 0;
+        dev->msix_routes[vector].valid = false;
         msix_clr_pending(dev, vector);
     }
 }
@@ -295,10 +319,16 @@ int msix_uninit(PCIDevice *dev)
     pci_del_capability(dev, PCI_CAP_ID_MSIX, MSIX_CAP_LENGTH);
     dev->msix_cap = 0;
     msix_free_irq_entries(dev);
+    if (dev->msix_deferred) {
+        QLIST_REMOVE(dev, msix_deferred_next);
+        dev->msix_deferred = 0;
+    }
     dev->msix_entries_nr = 0;
     cpu_unregister_io_memory(dev->msix_mmio_index);
     qemu_free(dev->msix_table_page);
     dev->msix_table_page = NULL;
+    qemu_free(dev->msix_routes);
+    dev->msix_routes = NULL;
     qemu_free(dev->msix_entry_used);
     dev->msix_entry_used = NULL;
     dev->cap_present &= ~QEMU_PCI_CAP_MSIX;
@@ -352,12 +382,23 @@ uint32_t msix_bar_size(PCIDevice *dev)
         dev->msix_bar_size : 0;
 }
 
+static void msix_route_update(PCIDevice *dev, unsigned vector)
+{
+    uint8_t *table_entry = dev->msix_table_page + vector * MSIX_ENTRY_SIZE;
+    MSIXRoute *route = &dev->msix_routes[vector];
+
+    route->addr = pci_get_long(table_entry + MSIX_MSG_UPPER_ADDR);
+    route->addr = (route->addr << 32) |
+                  pci_get_long(table_entry + MSIX_MSG_ADDR);
+    route->data = pci_get_long(table_entry + MSIX_MSG_DATA);
+    route->deliver = msi_direct_route(route->addr);
+    route->valid = true;
+}
+
 /* Send an MSI-X message */
 void msix_notify(PCIDevice *dev, unsigned vector)
 {
-    uint8_t *table_entry = dev->msix_table_page + vector * MSIX_ENTRY_SIZE;
-    uint64_t address;
-    uint32_t data;
+    MSIXRoute *route;
 
     if (vector >= dev->msix_entries_nr || !dev->msix_entry_used[vector])
         return;
@@ -366,10 +407,51 @@ void msix_notify(PCIDevice *dev, unsigned vector)
         return;
     }
 
-    address = pci_get_long(table_entry + MSIX_MSG_UPPER_ADDR);
-    address = (address << 32) | pci_get_long(table_entry + MSIX_MSG_ADDR);
-    data = pci_get_long(table_entry + MSIX_MSG_DATA);
-    stl_phys(address, data);
+    route = &dev->msix_routes[vector];
+    if (!route->valid) {
+        msix_route_update(dev, vector);
+    }
+    if (route->deliver) {
+        route->deliver(route->addr, route->data);
+    } else {
+        stl_phys(route->addr, route->data);
+    }
+}
+
+static void msix_deferred_flush(void *opaque)
+{
+    PCIDevice *dev;
+    uint32_t vectors;
+
+    while ((dev = QLIST_FIRST(&msix_deferred_devices))) {
+        QLIST_REMOVE(dev, msix_deferred_next);
+        vectors = dev->msix_deferred;
+        dev->msix_deferred = 0;
+        while (vectors) {
+            msix_notify(dev, ctz32(vectors));
+            vectors &= vectors - 1;
+        }
+    }
+}
+
+/* Like msix_notify(), but the message goes out when the bottom halves run at
+ * the end of the main loop iteration, once for every vector however often it
+ * was notified until then.  Only for the main loop: a vcpu thread would have
+ * to wake it up first.  vm_stop() drains the bottom halves, so nothing held
+ * back is missing from a snapshot or migration. */
+void msix_notify_deferred(PCIDevice *dev, unsigned vector)
+{
+    if (vector >= dev->msix_entries_nr) {
+        return;
+    }
+    if (!msix_deferred_bh) {
+        msix_deferred_bh = qemu_bh_new(msix_deferred_flush, NULL);
+    }
+    if (!dev->msix_deferred) {
+        QLIST_INSERT_HEAD(&msix_deferred_devices, dev, msix_deferred_next);
+    }
+    dev->msix_deferred |= 1U << vector;
+    qemu_bh_schedule_idle(msix_deferred_bh);
 }
 
 void msix_reset(PCIDevice *dev)
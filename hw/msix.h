@@ -28,6 +28,7 @@ void msix_vector_unuse(PCIDevice *dev, unsigned vector);
 void msix_unuse_all_vectors(PCIDevice *dev);
 
 void msix_notify(PCIDevice *dev, unsigned vector);
+void msix_notify_deferred(PCIDevice *dev, unsigned vector);
 
 void msix_reset(PCIDevice *dev);
 
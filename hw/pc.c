@@ -36,6 +36,7 @@
 #include "elf.h"
 #include "multiboot.h"
 #include "mc146818rtc.h"
+#include "msi.h"
 #include "msix.h"
 #include "sysbus.h"
 #include "sysemu.h"
@@ -584,9 +585,9 @@ static void *bochs_bios_init(void)
     register_ioport_write(0x500, 1, 1, bochs_bios_write, NULL);
     register_ioport_write(0x503, 1, 1, bochs_bios_write, NULL);
 
-    fw_cfg = fw_cfg_init(BIOS_CFG_IOPORT, BIOS_CFG_IOPORT + 1, 0, 0);
+    fw_cfg = fw_cfg_init(BIOS_CFG_IOPORT, BIOS_CFG_IOPORT + 1,
+                         BIOS_CFG_IOPORT + 4, 0, 0);
 
-    fw_cfg_add_i32(fw_cfg, FW_CFG_ID, 1);
     fw_cfg_add_i64(fw_cfg, FW_CFG_RAM_SIZE, (uint64_t)ram_size);
     fw_cfg_add_bytes(fw_cfg, FW_CFG_ACPI_TABLES, (uint8_t *)acpi_tables,
                      acpi_tables_len);
@@ -645,7 +646,7 @@ static void load_linux(void *fw_cfg,
                        target_phys_addr_t max_ram_size)
 {
     uint16_t protocol;
-    int setup_size, kernel_size, initrd_size = 0, cmdline_size;
+    int setup_size, kernel_size, initrd_size = 0, cmdline_size, file_size;
     uint32_t initrd_max;
     uint8_t header[8192], *setup, *kernel, *initrd_data;
     target_phys_addr_t real_addr, prot_addr, cmdline_addr, initrd_addr = 0;
@@ -767,8 +768,8 @@ static void load_linux(void *fw_cfg,
 	    exit(1);
 	}
 
-	initrd_size = get_image_size(initrd_filename);
-        if (initrd_size < 0) {
+        initrd_data = map_image(initrd_filename, &initrd_size);
+        if (!initrd_data) {
             fprintf(stderr, "qemu: error reading initrd %s\n",
                     initrd_filename);
             exit(1);
@@ -776,9 +777,6 @@ static void load_linux(void *fw_cfg,
 
         initrd_addr = (initrd_max-initrd_size) & ~4095;
 
-        initrd_data = qemu_malloc(initrd_size);
-        load_image(initrd_filename, initrd_data);
-
         fw_cfg_add_i32(fw_cfg, FW_CFG_INITRD_ADDR, initrd_addr);
         fw_cfg_add_i32(fw_cfg, FW_CFG_INITRD_SIZE, initrd_size);
         fw_cfg_add_bytes(fw_cfg, FW_CFG_INITRD_DATA, initrd_data, initrd_size);
@@ -794,19 +792,20 @@ static void load_linux(void *fw_cfg,
     setup_size = (setup_size+1)*512;
     kernel_size -= setup_size;
 
-    setup  = qemu_malloc(setup_size);
-    kernel = qemu_malloc(kernel_size);
-    fseek(f, 0, SEEK_SET);
-    if (fread(setup, 1, setup_size, f) != setup_size) {
-        fprintf(stderr, "fread() failed\n");
-        exit(1);
-    }
-    if (fread(kernel, 1, kernel_size, f) != kernel_size) {
-        fprintf(stderr, "fread() failed\n");
+    fclose(f);
+    kernel = map_image(kernel_filename, &file_size);
+    if (!kernel || file_size != setup_size + kernel_size) {
+        fprintf(stderr, "qemu: error reading kernel %s\n", kernel_filename);
         exit(1);
     }
-    fclose(f);
+    /* the setup is patched, the kernel goes to fw_cfg as it is */
+    setup = qemu_malloc(setup_size);
     memcpy(setup, header, MIN(sizeof(header), setup_size));
+    if (setup_size > sizeof(header)) {
+        memcpy(setup + sizeof(header), kernel + sizeof(header),
+               setup_size - sizeof(header));
+    }
+    kernel += setup_size;
 
     fw_cfg_add_i32(fw_cfg, FW_CFG_KERNEL_ADDR, prot_addr);
     fw_cfg_add_i32(fw_cfg, FW_CFG_KERNEL_SIZE, kernel_size);
@@ -874,6 +873,7 @@ static DeviceState *apic_init(void *env, uint8_t apic_id)
            on the global memory bus. */
         /* XXX: what if the base changes? */
         sysbus_mmio_map(d, 0, MSI_ADDR_BASE);
+        msi_set_direct_delivery(MSI_ADDR_BASE, MSI_ADDR_SIZE, apic_send_msi);
         apic_mapped = 1;
     }
 
@@ -1101,6 +1101,8 @@ void pc_basic_device_init(qemu_irq *isa_irq,
     qemu_irq *cpu_exit_irq;
 
     register_ioport_write(0x80, 1, 1, ioport80_write, NULL);
+    /* Guests use it as an I/O delay, so keep it off the global mutex */
+    ioport_set_unlocked(0x80, 1, NULL);
 
     register_ioport_write(0xf0, 1, 1, ioportF0_write, NULL);
 
@@ -78,6 +78,14 @@ struct PCIHostBus {
 };
 static QLIST_HEAD(, PCIHostBus) host_buses;
 
+struct PCIBusIndex {
+    PCIBus *bus[256];
+    unsigned int gen[256];      /* pci_bus_gen that bus[] is good for */
+};
+
+/* Bumped whenever a bus number could have moved to another bus */
+static unsigned int pci_bus_gen = 1;
+
 static const VMStateDescription vmstate_pcibus = {
     .name = "PCIBUS",
     .version_id = 1,
@@ -194,6 +202,7 @@ void pci_bus_reset(PCIBus *bus)
 {
     int i;
 
+    pci_bus_numbers_changed();
     for (i = 0; i < bus->nirq; i++) {
         bus->irq_count[i] = 0;
     }
@@ -339,6 +348,7 @@ static int get_pci_config_device(QEMUFile *f, void *pv, size_t size)
     memcpy(s->config, config, size);
 
     pci_update_mappings(s);
+    pci_bus_numbers_changed();
 
     qemu_free(config);
     return 0;
@@ -1090,6 +1100,13 @@ void pci_default_write_config(PCIDevice *d, uint32_t addr, uint32_t val, int l)
 
     if (range_covers_byte(addr, l, PCI_COMMAND))
         pci_update_irq_disabled(d, was_irq_disabled);
+
+    if ((d->config[PCI_HEADER_TYPE] & ~PCI_HEADER_TYPE_MULTI_FUNCTION) ==
+        PCI_HEADER_TYPE_BRIDGE &&
+        (ranges_overlap(addr, l, PCI_PRIMARY_BUS, 3) ||
+         ranges_overlap(addr, l, PCI_BRIDGE_CONTROL, 2))) {
+        pci_bus_numbers_changed();
+    }
 }
 
 /***********************************************************/
@@ -1569,17 +1586,14 @@ static bool pci_secondary_bus_in_range(PCIDevice *dev, int bus_num)
         bus_num <= dev->config[PCI_SUBORDINATE_BUS];
 }
 
-PCIBus *pci_find_bus(PCIBus *bus, int bus_num)
+void pci_bus_numbers_changed(void)
 {
-    PCIBus *sec;
-
-    if (!bus) {
-        return NULL;
-    }
+    pci_bus_gen++;
+}
 
-    if (pci_bus_num(bus) == bus_num) {
-        return bus;
-    }
+static PCIBus *pci_find_bus_walk(PCIBus *bus, int bus_num)
+{
+    PCIBus *sec;
 
     /* Consider all bus numbers in range for the host pci bridge. */
     if (bus->parent_dev &&
@@ -1603,6 +1617,34 @@ PCIBus *pci_find_bus(PCIBus *bus, int bus_num)
     return NULL;
 }
 
+/* Config space accesses look the bus up every time, so a host bus
+   remembers the walk's result for every bus number */
+PCIBus *pci_find_bus(PCIBus *bus, int bus_num)
+{
+    struct PCIBusIndex *index;
+
+    if (!bus) {
+        return NULL;
+    }
+
+    if (pci_bus_num(bus) == bus_num) {
+        return bus;
+    }
+
+    if (bus->parent_dev || bus_num < 0 || bus_num > 255) {
+        return pci_find_bus_walk(bus, bus_num);
+    }
+    if (!bus->index) {
+        bus->index = qemu_mallocz(sizeof(*bus->index));
+    }
+    index = bus->index;
+    if (index->gen[bus_num] != pci_bus_gen) {
+        index->bus[bus_num] = pci_find_bus_walk(bus, bus_num);
+        index->gen[bus_num] = pci_bus_gen;
+    }
+    return index->bus[bus_num];
+}
+
 PCIDevice *pci_find_device(PCIBus *bus, int bus_num, int slot, int function)
 {
     bus = pci_find_bus(bus, bus_num);
@@ -1778,11 +1820,6 @@ static uint8_t pci_find_capability_list(PCIDevice *pdev, uint8_t cap_id,
     return next;
 }
 
-static void pci_map_option_rom(PCIDevice *pdev, int region_num, pcibus_t addr, pcibus_t size, int type)
-{
-    cpu_register_physical_memory(addr, size, pdev->rom_offset);
-}
-
 /* Patch the PCI vendor and device ids in a PCI rom image if necessary.
    This is needed for an option rom which is used for more than one device. */
 static void pci_patch_ids(PCIDevice *pdev, uint8_t *ptr, int size)
@@ -1839,12 +1876,40 @@ static void pci_patch_ids(PCIDevice *pdev, uint8_t *ptr, int size)
     }
 }
 
+static void pci_load_option_rom(PCIDevice *pdev, pcibus_t size)
+{
+    void *ptr = qemu_get_ram_ptr(pdev->rom_offset);
+    int len = get_image_size(pdev->rom_path);
+
+    /* the BAR was sized for the file as it was when the device was created */
+    if (len < 0 || len > size || load_image(pdev->rom_path, ptr) != len) {
+        error_report("%s: failed to load romfile \"%s\"",
+                     __FUNCTION__, pdev->romfile);
+    } else if (pdev->rom_patch_ids) {
+        /* Only the default rom images will be patched (if needed). */
+        pci_patch_ids(pdev, ptr, size);
+    }
+}
+
+static void pci_map_option_rom(PCIDevice *pdev, int region_num, pcibus_t addr, pcibus_t size, int type)
+{
+    if (pdev->rom_path) {
+        /* A mapping made while the VM is stopped comes from loading its
+         * state, which brought the rom contents along */
+        if (vm_running) {
+            pci_load_option_rom(pdev, size);
+        }
+        qemu_free(pdev->rom_path);
+        pdev->rom_path = NULL;
+    }
+    cpu_register_physical_memory(addr, size, pdev->rom_offset);
+}
+
 /* Add an option rom for the device */
 static int pci_add_option_rom(PCIDevice *pdev, bool is_default_rom)
 {
     int size;
     char *path;
-    void *ptr;
     char name[32];
 
     if (!pdev->romfile)
@@ -1885,16 +1950,12 @@ static int pci_add_option_rom(PCIDevice *pdev, bool is_default_rom)
         snprintf(name, sizeof(name), "%s.rom", pdev->qdev.info->vmsd->name);
     else
         snprintf(name, sizeof(name), "%s.rom", pdev->qdev.info->name);
-    pdev->rom_offset = qemu_ram_alloc(&pdev->qdev, name, size);
-
-    ptr = qemu_get_ram_ptr(pdev->rom_offset);
-    load_image(path, ptr);
-    qemu_free(path);
-
-    if (is_default_rom) {
-        /* Only the default rom images will be patched (if needed). */
-        pci_patch_ids(pdev, ptr, size);
-    }
+    /* Nothing is read until the BAR is mapped, which only the guest's
+     * firmware does, so the file is not on the way to its first
+     * instruction */
+    pdev->rom_offset = qemu_ram_alloc_lazy(&pdev->qdev, name, size);
+    pdev->rom_path = path;
+    pdev->rom_patch_ids = is_default_rom;
 
     pci_register_bar(pdev, PCI_ROM_SLOT, size,
                      0, pci_map_option_rom);
@@ -1909,6 +1970,8 @@ static void pci_del_option_rom(PCIDevice *pdev)
 
     qemu_ram_free(pdev->rom_offset);
     pdev->rom_offset = 0;
+    qemu_free(pdev->rom_path);
+    pdev->rom_path = NULL;
 }
 
 /*
@@ -174,8 +174,14 @@ struct PCIDevice {
     int msix_mmio_index;
     /* Reference-count for entries actually in use by driver. */
     unsigned *msix_entry_used;
+    /* Messages decoded from the table, see msix_notify() */
+    struct MSIXRoute *msix_routes;
     /* Region including the MSI-X table */
     uint32_t msix_bar_size;
+    /* Vectors that msix_notify_deferred() holds back, and the link on the
+       list of devices that have some */
+    uint32_t msix_deferred;
+    QLIST_ENTRY(PCIDevice) msix_deferred_next;
     /* Version id needed for VMState */
     int32_t version_id;
 
@@ -189,6 +195,9 @@ struct PCIDevice {
     char *romfile;
     ram_addr_t rom_offset;
     uint32_t rom_bar;
+    /* Until the rom BAR is first mapped, the file to fill it from */
+    char *rom_path;
+    bool rom_patch_ids;
 };
 
 PCIDevice *pci_register_device(PCIBus *bus, const char *name,
@@ -217,6 +217,7 @@ void pci_bridge_reset_reg(PCIDevice *dev)
     pci_set_word(conf + PCI_PREF_LIMIT_UPPER32, 0);
 
     pci_set_word(conf + PCI_BRIDGE_CONTROL, 0);
+    pci_bus_numbers_changed();
 }
 
 /* default reset function for PCI-to-PCI bridge */
@@ -249,6 +250,7 @@ int pci_bridge_initfn(PCIDevice *dev)
 
     QLIST_INIT(&sec_bus->child);
     QLIST_INSERT_HEAD(&parent->child, sec_bus, sibling);
+    pci_bus_numbers_changed();
     return 0;
 }
 
@@ -258,6 +260,7 @@ int pci_bridge_exitfn(PCIDevice *pci_dev)
     PCIBridge *s = DO_UPCAST(PCIBridge, dev, pci_dev);
     assert(QLIST_EMPTY(&s->sec_bus.child));
     QLIST_REMOVE(&s->sec_bus, sibling);
+    pci_bus_numbers_changed();
     /* qbus_free() is called automatically by qdev_free() */
     return 0;
 }
@@ -58,6 +58,7 @@ void pci_data_write(PCIBus *s, uint32_t addr, uint32_t val, int len)
     PCI_DPRINTF("%s: %s: addr=%02" PRIx32 " val=%08" PRIx32 " len=%d\n",
                 __func__, pci_dev->name, config_addr, val, len);
     pci_dev->config_write(pci_dev, config_addr, val, len);
+    qdev_state_changed(&pci_dev->qdev);
 }
 
 uint32_t pci_data_read(PCIBus *s, uint32_t addr, int len)
@@ -29,12 +29,20 @@ struct PCIBus {
     QLIST_HEAD(, PCIBus) child; /* this will be replaced by qdev later */
     QLIST_ENTRY(PCIBus) sibling;/* this will be replaced by qdev later */
 
+    /* Host buses only: the bus behind each bus number, filled in as
+       pci_find_bus() looks them up */
+    struct PCIBusIndex *index;
+
     /* The bus IRQ state is the logical OR of the connected devices.
        Keep a count of the number of devices with raised IRQs.  */
     int nirq;
     int *irq_count;
 };
 
+/* Forgets the buses that pci_find_bus() found, after bridges were added or
+   removed or their bus numbers changed */
+void pci_bus_numbers_changed(void);
+
 struct PCIBridge {
     PCIDevice dev;
 
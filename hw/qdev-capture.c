@@ -0,0 +1,251 @@
+/*
+ * Capture of the state of many devices, formatted in parallel
+ *
+ * Formatting the state of a whole machine is mostly spent creating the
+ * objects for every field and converting them to JSON, not reading the
+ * devices.  So the fields of all devices are first copied into private
+ * blobs with vmstate_plan_capture(), one device after the other under the
+ * global mutex, and then the blobs are decoded, and converted to JSON if
+ * asked to, by a pool of worker threads while the mutex is dropped.  The
+ * results are kept in the order the devices were added.  Without thread
+ * support, the caller formats the blobs itself, still without the mutex.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-arena.h"
+#include "qjson.h"
+#include "qlist.h"
+#include "vmstate-plan.h"
+#include "qdev-capture.h"
+#ifdef CONFIG_THREAD
+#include "qemu-thread.h"
+#endif
+
+#define DEVICE_CAPTURE_MAX_WORKERS  8
+
+/* Below this many devices, waking up the workers costs more than it saves */
+#define DEVICE_CAPTURE_MIN_PARALLEL 4
+
+typedef struct DeviceCapture {
+    VMStatePlan *plan;
+    void *blob;
+    size_t len;
+    QObject *data;              /* the fields are added to this QDict */
+    QString *json;
+} DeviceCapture;
+
+struct DeviceCaptureSet {
+    DeviceCapture *captures;
+    int n;
+    int capacity;
+    int full;
+    int json;
+    int pretty;
+};
+
+static void device_capture_format_one(DeviceCaptureSet *set,
+                                      DeviceCapture *c)
+{
+    QList *qlist = qlist_new();
+
+    if (c->plan) {
+        vmstate_plan_decode(c->plan, c->blob, c->len, qlist, set->full);
+    }
+    qdict_put_obj(qobject_to_qdict(c->data), "fields", QOBJECT(qlist));
+    qemu_free(c->blob);
+    c->blob = NULL;
+
+    if (set->json) {
+        c->json = set->pretty ? qobject_to_json_pretty(c->data) :
+                                qobject_to_json(c->data);
+        qobject_decref(c->data);
+        c->data = NULL;
+    }
+}
+
+#ifdef CONFIG_THREAD
+typedef struct DeviceCapturePool {
+    int n_workers;
+    QemuThread *threads;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    DeviceCaptureSet *set;      /* being formatted, or NULL */
+    int next;                   /* capture to hand out next */
+    int busy;                   /* workers still formatting the set */
+} DeviceCapturePool;
+
+static DeviceCapturePool *device_capture_pool;
+static int device_capture_cpus;
+
+static void *device_capture_worker(void *opaque)
+{
+    DeviceCapturePool *pool = opaque;
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        DeviceCaptureSet *set;
+
+        while (!pool->set || pool->next == pool->set->n) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        set = pool->set;
+        pool->busy++;
+        while (pool->next < set->n) {
+            DeviceCapture *c = &set->captures[pool->next++];
+
+            qemu_mutex_unlock(&pool->lock);
+            device_capture_format_one(set, c);
+            qemu_mutex_lock(&pool->lock);
+        }
+        if (--pool->busy == 0) {
+            qemu_cond_signal(&pool->done_cond);
+        }
+    }
+    return NULL;
+}
+
+/* The workers live as long as the program, started on first use.  Returns
+   NULL on a single host CPU, where the caller is better off alone. */
+static DeviceCapturePool *device_capture_get_pool(void)
+{
+    DeviceCapturePool *pool = device_capture_pool;
+    int i;
+
+    if (pool) {
+        return pool;
+    }
+    if (!device_capture_cpus) {
+        device_capture_cpus = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+    if (device_capture_cpus == 1) {
+        return NULL;
+    }
+    pool = qemu_mallocz(sizeof(*pool));
+    pool->n_workers = MIN(device_capture_cpus, DEVICE_CAPTURE_MAX_WORKERS);
+    pool->threads = qemu_mallocz(pool->n_workers * sizeof(*pool->threads));
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+    for (i = 0; i < pool->n_workers; i++) {
+        qemu_thread_create(&pool->threads[i], device_capture_worker, pool);
+    }
+    device_capture_pool = pool;
+    return pool;
+}
+
+static void device_capture_run_pool(DeviceCapturePool *pool,
+                                    DeviceCaptureSet *set)
+{
+    qemu_mutex_lock(&pool->lock);
+    pool->set = set;
+    pool->next = 0;
+    qemu_cond_broadcast(&pool->work_cond);
+    while (pool->next < set->n || pool->busy) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pool->set = NULL;
+    qemu_mutex_unlock(&pool->lock);
+}
+#endif
+
+DeviceCaptureSet *device_capture_new(void)
+{
+    return qemu_mallocz(sizeof(DeviceCaptureSet));
+}
+
+void device_capture_free(DeviceCaptureSet *set)
+{
+    int i;
+
+    for (i = 0; i < set->n; i++) {
+        DeviceCapture *c = &set->captures[i];
+
+        qemu_free(c->blob);
+        qobject_decref(c->data);
+        QDECREF(c->json);
+    }
+    qemu_free(set->captures);
+    qemu_free(set);
+}
+
+/* Copy the fields of dev, if it has a vmsd, to be added to data (a QDict,
+   of which the set takes the reference) by device_capture_format().  Must
+   be called with the global mutex held. */
+void device_capture_add(DeviceCaptureSet *set, DeviceState *dev,
+                        QObject *data)
+{
+    DeviceCapture *c;
+
+    if (set->n == set->capacity) {
+        set->capacity = MAX(set->capacity * 2, 16);
+        set->captures = qemu_realloc(set->captures,
+                                     set->capacity * sizeof(*c));
+    }
+    c = &set->captures[set->n++];
+    if (dev->info->vmsd) {
+        c->plan = vmstate_plan_get(dev->info->vmsd);
+        c->blob = vmstate_plan_capture(c->plan, dev, &c->len);
+    } else {
+        c->plan = NULL;
+        c->blob = NULL;
+        c->len = 0;
+    }
+    c->data = data;
+    c->json = NULL;
+}
+
+/* Decode all captures as device_show does, and with json replace each of
+   them by its JSON text.  Called with the global mutex held, which is
+   dropped until all captures are done. */
+void device_capture_format(DeviceCaptureSet *set, int full, int json,
+                           int pretty)
+{
+    /* The current arena is only for code under the global mutex */
+    QemuArena *arena = qemu_arena_set_current(NULL);
+#ifdef CONFIG_THREAD
+    DeviceCapturePool *pool = NULL;
+#endif
+    int i;
+
+    set->full = full;
+    set->json = json;
+    set->pretty = pretty;
+
+    qemu_mutex_unlock_iothread();
+#ifdef CONFIG_THREAD
+    if (set->n >= DEVICE_CAPTURE_MIN_PARALLEL) {
+        pool = device_capture_get_pool();
+    }
+    if (pool) {
+        device_capture_run_pool(pool, set);
+    } else
+#endif
+    {
+        for (i = 0; i < set->n; i++) {
+            device_capture_format_one(set, &set->captures[i]);
+        }
+    }
+    qemu_mutex_lock_iothread();
+    qemu_arena_set_current(arena);
+}
+
+int device_capture_count(const DeviceCaptureSet *set)
+{
+    return set->n;
+}
+
+/* The state of the i-th device, if not converted to JSON */
+QObject *device_capture_data(const DeviceCaptureSet *set, int i)
+{
+    return set->captures[i].data;
+}
+
+/* The JSON text of the state of the i-th device, if converted */
+QString *device_capture_json(const DeviceCaptureSet *set, int i)
+{
+    return set->captures[i].json;
+}
@@ -0,0 +1,28 @@
+/*
+ * Capture of the state of many devices, formatted in parallel
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_QDEV_CAPTURE_H
+#define QEMU_QDEV_CAPTURE_H
+
+#include "qdev.h"
+#include "qstring.h"
+
+typedef struct DeviceCaptureSet DeviceCaptureSet;
+
+DeviceCaptureSet *device_capture_new(void);
+void device_capture_free(DeviceCaptureSet *set);
+
+void device_capture_add(DeviceCaptureSet *set, DeviceState *dev,
+                        QObject *data);
+void device_capture_format(DeviceCaptureSet *set, int full, int json,
+                           int pretty);
+
+int device_capture_count(const DeviceCaptureSet *set);
+QObject *device_capture_data(const DeviceCaptureSet *set, int i);
+QString *device_capture_json(const DeviceCaptureSet *set, int i);
+
+#endif
@@ -0,0 +1,307 @@
+/*
+ * Periodic export of the state of all devices in a fixed binary format
+ *
+ * Every interval milliseconds, the state of every device with a state
+ * description is copied into one record per device and the records are
+ * written to a character device as one sweep frame.  A record holds the
+ * fixed-size fields of the device's description at the same offsets for
+ * every device and every sweep, as announced by a layout frame the first
+ * time the description shows up on a connection.  A collector can thus
+ * read "device X, field Y" of many guests by offset, without parsing.
+ *
+ * All frames start with a DeviceExportFrame header; everything is in host
+ * byte order, without padding:
+ *
+ * Layout frame (DEVICE_EXPORT_LAYOUT):
+ *   DeviceExportLayout, then the description name (name_len bytes), then
+ *   n_fields times a DeviceExportField followed by the field's path
+ *   (name_len bytes).
+ *
+ * Sweep frame (DEVICE_EXPORT_SWEEP):
+ *   DeviceExportSweep, then n_records times a DeviceExportRecord followed
+ *   by the record, of the size given by its layout.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qdev.h"
+#include "monitor.h"
+#include "qemu-char.h"
+#include "qemu-timer.h"
+#include "vmstate-plan.h"
+
+#define DEVICE_EXPORT_DEFAULT_INTERVAL 1000 /* ms */
+
+#define DEVICE_EXPORT_MAGIC     0x51445358  /* "QDSX" */
+#define DEVICE_EXPORT_VERSION   1
+
+enum {
+    DEVICE_EXPORT_LAYOUT = 1,
+    DEVICE_EXPORT_SWEEP = 2,
+};
+
+typedef struct DeviceExportFrame {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint8_t big_endian;
+    uint8_t reserved;
+    uint32_t len;               /* of what follows the header */
+} __attribute__((packed)) DeviceExportFrame;
+
+typedef struct DeviceExportLayout {
+    uint32_t id;
+    uint32_t version_id;
+    uint32_t record_size;
+    uint32_t n_fields;
+    uint16_t name_len;
+} __attribute__((packed)) DeviceExportLayout;
+
+typedef struct DeviceExportField {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t count;
+    uint8_t kind;               /* VMStateLayoutKind */
+    uint16_t name_len;
+} __attribute__((packed)) DeviceExportField;
+
+typedef struct DeviceExportSweep {
+    int64_t timestamp;          /* rt_clock, ns */
+    uint64_t generation;        /* qdev_state_generation */
+    uint32_t n_records;
+} __attribute__((packed)) DeviceExportSweep;
+
+typedef struct DeviceExportRecord {
+    uint32_t layout;
+    uint32_t instance;          /* as in the "device" of device_show */
+    uint64_t generation;        /* 0 if the device does not track changes */
+} __attribute__((packed)) DeviceExportRecord;
+
+typedef struct DeviceExportBuffer {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+} DeviceExportBuffer;
+
+typedef struct DeviceExport {
+    CharDriverState *chr;
+    int64_t interval;
+    QEMUTimer *timer;
+    uint8_t *announced;         /* by layout id, on this connection */
+    int n_announced;
+    DeviceExportBuffer layouts;
+    DeviceExportBuffer sweep;   /* kept from one sweep to the next */
+    uint32_t n_records;
+    QTAILQ_ENTRY(DeviceExport) next;
+} DeviceExport;
+
+static QTAILQ_HEAD(, DeviceExport) device_exports =
+    QTAILQ_HEAD_INITIALIZER(device_exports);
+
+static void *device_export_reserve(DeviceExportBuffer *b, size_t len)
+{
+    void *p;
+
+    if (b->len + len > b->capacity) {
+        b->capacity = MAX(b->capacity * 2, b->len + len);
+        b->data = qemu_realloc(b->data, b->capacity);
+    }
+    p = b->data + b->len;
+    b->len += len;
+    return p;
+}
+
+static void device_export_put(DeviceExportBuffer *b, const void *buf,
+                              size_t len)
+{
+    memcpy(device_export_reserve(b, len), buf, len);
+}
+
+static void device_export_frame(DeviceExportBuffer *b, int type)
+{
+    DeviceExportFrame frame = {
+        .magic = DEVICE_EXPORT_MAGIC,
+        .version = DEVICE_EXPORT_VERSION,
+        .type = type,
+#ifdef HOST_WORDS_BIGENDIAN
+        .big_endian = 1,
+#endif
+    };
+
+    device_export_put(b, &frame, sizeof(frame));
+}
+
+/* Fill in the length of the frame that starts at start */
+static void device_export_frame_end(DeviceExportBuffer *b, size_t start)
+{
+    DeviceExportFrame *frame = (DeviceExportFrame *)(b->data + start);
+
+    frame->len = b->len - start - sizeof(*frame);
+}
+
+static void device_export_announce(DeviceExport *e, VMStatePlan *plan,
+                                   const VMStateLayout *layout)
+{
+    DeviceExportLayout hdr = {
+        .id = layout->id,
+        .version_id = plan->vmsd->version_id,
+        .record_size = layout->size,
+        .n_fields = layout->n_fields,
+        .name_len = strlen(plan->vmsd->name),
+    };
+    size_t start = e->layouts.len;
+    int i;
+
+    if (layout->id >= e->n_announced) {
+        e->announced = qemu_realloc(e->announced, layout->id + 1);
+        memset(e->announced + e->n_announced, 0,
+               layout->id + 1 - e->n_announced);
+        e->n_announced = layout->id + 1;
+    }
+    e->announced[layout->id] = 1;
+
+    device_export_frame(&e->layouts, DEVICE_EXPORT_LAYOUT);
+    device_export_put(&e->layouts, &hdr, sizeof(hdr));
+    device_export_put(&e->layouts, plan->vmsd->name, hdr.name_len);
+    for (i = 0; i < layout->n_fields; i++) {
+        const VMStateLayoutField *f = &layout->fields[i];
+        DeviceExportField field = {
+            .offset = f->offset,
+            .size = f->size,
+            .count = f->count,
+            .kind = f->kind,
+            .name_len = strlen(f->name),
+        };
+
+        device_export_put(&e->layouts, &field, sizeof(field));
+        device_export_put(&e->layouts, f->name, field.name_len);
+    }
+    device_export_frame_end(&e->layouts, start);
+}
+
+static void *device_export_one(DeviceState *dev, void *opaque)
+{
+    DeviceExport *e = opaque;
+    const VMStateLayout *layout;
+    DeviceExportRecord rec;
+    VMStatePlan *plan;
+
+    if (!dev->info->vmsd) {
+        return NULL;
+    }
+    plan = vmstate_plan_get(dev->info->vmsd);
+    layout = vmstate_plan_layout(plan);
+    if (layout->id >= e->n_announced || !e->announced[layout->id]) {
+        device_export_announce(e, plan, layout);
+    }
+
+    rec.layout = layout->id;
+    rec.instance = qdev_instance_no(dev);
+    rec.generation = dev->info->vmsd->tracks_changes ? dev->state_gen : 0;
+    device_export_put(&e->sweep, &rec, sizeof(rec));
+    vmstate_plan_record(plan, dev, device_export_reserve(&e->sweep,
+                                                         layout->size));
+    e->n_records++;
+    return NULL;
+}
+
+static void device_export_tick(void *opaque)
+{
+    DeviceExport *e = opaque;
+    DeviceExportSweep hdr;
+
+    e->layouts.len = 0;
+    e->sweep.len = 0;
+    e->n_records = 0;
+    device_export_frame(&e->sweep, DEVICE_EXPORT_SWEEP);
+    device_export_reserve(&e->sweep, sizeof(hdr));
+    qdev_iterate_recursive(NULL, device_export_one, e);
+
+    hdr.timestamp = qemu_get_clock_ns(rt_clock);
+    hdr.generation = qdev_state_generation;
+    hdr.n_records = e->n_records;
+    memcpy(e->sweep.data + sizeof(DeviceExportFrame), &hdr, sizeof(hdr));
+    device_export_frame_end(&e->sweep, 0);
+
+    /* Layouts go first, the sweep refers to them */
+    if (e->layouts.len) {
+        qemu_chr_write(e->chr, e->layouts.data, e->layouts.len);
+    }
+    qemu_chr_write(e->chr, e->sweep.data, e->sweep.len);
+
+    qemu_mod_timer(e->timer, qemu_get_clock(rt_clock) + e->interval);
+}
+
+/* A new collector knows no layouts yet */
+static void device_export_event(void *opaque, int event)
+{
+    DeviceExport *e = opaque;
+
+    if (event == CHR_EVENT_OPENED && e->announced) {
+        memset(e->announced, 0, e->n_announced);
+    }
+}
+
+static DeviceExport *device_export_find(CharDriverState *chr)
+{
+    DeviceExport *e;
+
+    QTAILQ_FOREACH(e, &device_exports, next) {
+        if (e->chr == chr) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void device_export_free(DeviceExport *e)
+{
+    QTAILQ_REMOVE(&device_exports, e, next);
+    qemu_chr_add_handlers(e->chr, NULL, NULL, NULL, NULL);
+    qemu_del_timer(e->timer);
+    qemu_free_timer(e->timer);
+    qemu_free(e->announced);
+    qemu_free(e->layouts.data);
+    qemu_free(e->sweep.data);
+    qemu_free(e);
+}
+
+int do_device_export(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *name = qdict_get_str(qdict, "chardev");
+    int64_t interval = qdict_get_try_int(qdict, "interval",
+                                         DEVICE_EXPORT_DEFAULT_INTERVAL);
+    CharDriverState *chr;
+    DeviceExport *e;
+
+    if (interval < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "interval",
+                      "a positive number of milliseconds, or 0");
+        return -1;
+    }
+
+    chr = qemu_chr_find(name);
+    if (!chr) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, name);
+        return -1;
+    }
+
+    e = device_export_find(chr);
+    if (interval == 0) {
+        if (e) {
+            device_export_free(e);
+        }
+        return 0;
+    }
+    if (!e) {
+        e = qemu_mallocz(sizeof(*e));
+        e->chr = chr;
+        e->timer = qemu_new_timer(rt_clock, device_export_tick, e);
+        QTAILQ_INSERT_TAIL(&device_exports, e, next);
+        qemu_chr_add_handlers(chr, NULL, NULL, device_export_event, e);
+    }
+    e->interval = interval;
+    qemu_mod_timer(e->timer, qemu_get_clock(rt_clock));
+    return 0;
+}
@@ -556,20 +556,62 @@ static Property *qdev_prop_walk(Property *props, const char *name)
     return NULL;
 }
 
-static Property *qdev_prop_find(DeviceState *dev, const char *name)
+static int qdev_prop_compare(const void *a, const void *b)
+{
+    return strcmp((*(Property **)a)->name, (*(Property **)b)->name);
+}
+
+/* Device properties, then the bus properties they don't shadow, sorted by
+   name so that lookups can bisect */
+static void qdev_prop_build_table(DeviceInfo *info)
 {
     Property *prop;
+    int n = 0;
 
-    /* device properties */
-    prop = qdev_prop_walk(dev->info->props, name);
-    if (prop)
-        return prop;
+    for (prop = info->props; prop && prop->name; prop++) {
+        n++;
+    }
+    for (prop = info->bus_info->props; prop && prop->name; prop++) {
+        n++;
+    }
+    info->prop_table = qemu_malloc(MAX(n, 1) * sizeof(*info->prop_table));
 
-    /* bus properties */
-    prop = qdev_prop_walk(dev->parent_bus->info->props, name);
-    if (prop)
-        return prop;
+    n = 0;
+    for (prop = info->props; prop && prop->name; prop++) {
+        info->prop_table[n++] = prop;
+    }
+    for (prop = info->bus_info->props; prop && prop->name; prop++) {
+        if (!qdev_prop_walk(info->props, prop->name)) {
+            info->prop_table[n++] = prop;
+        }
+    }
+    qsort(info->prop_table, n, sizeof(*info->prop_table), qdev_prop_compare);
+    info->prop_count = n;
+}
 
+static Property *qdev_prop_find(DeviceState *dev, const char *name)
+{
+    DeviceInfo *info = dev->info;
+    int lo = 0, hi;
+
+    assert(dev->parent_bus->info == info->bus_info);
+    if (!info->prop_table) {
+        qdev_prop_build_table(info);
+    }
+    hi = info->prop_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(name, info->prop_table[mid]->name);
+
+        if (cmp == 0) {
+            return info->prop_table[mid];
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
     return NULL;
 }
 
@@ -0,0 +1,703 @@
+/*
+ * Periodic device state sampler
+ *
+ * A sampler snapshots one device every interval milliseconds into a fixed
+ * ring of binary records.  The ring is allocated once when sampling starts,
+ * taking a sample neither allocates memory nor creates QObjects.  The whole
+ * ring is returned in one go by device_history.
+ *
+ * When only a few integer fields are of interest, such as ring indices or
+ * status registers, the sampler copies just those into one column per
+ * field instead, which is cheap enough for intervals of a millisecond, and
+ * device_history returns them as a time series.
+ *
+ * For long histories, the sampler keeps the snapshots as deltas instead:
+ * each sample is XBZRLE encoded against the previous one, so that an
+ * unchanged device costs a few bytes per sample.  Samples are grouped in
+ * segments that start with a complete snapshot, the keyframe, so that a
+ * sample is rebuilt from at most DEVICE_SAMPLE_KEYFRAME records, and the
+ * oldest segment is dropped as a whole when the history is full.
+ * Keyframes are encoded against zeroes, which mostly leaves out the unused
+ * parts of buffers.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qdev.h"
+#include "monitor.h"
+#include "qemu-timer.h"
+#include "qint.h"
+#include "qjson.h"
+#include "qbuffer.h"
+#include "vmstate-plan.h"
+#include "migration-xbzrle.h"
+
+#define DEVICE_SAMPLE_DEFAULT_INTERVAL 100 /* ms */
+#define DEVICE_SAMPLE_DEFAULT_SLOTS    256
+#define DEVICE_SAMPLE_MAX_SLOTS        65536
+#define DEVICE_SAMPLE_MAX_DELTA_SLOTS  (1 << 20)
+#define DEVICE_SAMPLE_MAX_FIELDS       16
+#define DEVICE_SAMPLE_KEYFRAME         64  /* samples per segment */
+
+/* Header of each record returned by device_history, host byte order */
+typedef struct DeviceSampleHeader {
+    int64_t timestamp;          /* rt_clock, ns */
+    uint32_t len;
+} __attribute__((packed)) DeviceSampleHeader;
+
+/* An integer field, resolved when sampling starts */
+typedef struct DeviceSampleField {
+    char *name;
+    void *addr;
+    size_t size;
+    uint8_t *column;            /* n_slots values of size bytes */
+} DeviceSampleField;
+
+/* A keyframe followed by the deltas of the next samples, each record
+   preceded by a DeviceSampleHeader.  A keyframe of size bytes is stored as
+   is, a shorter one is a delta against zeroes. */
+typedef struct DeviceSampleSegment {
+    int count;
+    size_t size;                /* of each sample */
+    int64_t last;               /* timestamp of the last sample */
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+    QTAILQ_ENTRY(DeviceSampleSegment) next;
+} DeviceSampleSegment;
+
+typedef struct DeviceSampler {
+    DeviceState *dev;
+    VMStatePlan *plan;
+    int64_t interval;
+    QEMUTimer *timer;
+    int n_slots;
+    size_t slot_size;
+    uint8_t *ring;              /* n_slots records of slot_size bytes */
+    int n_fields;               /* columns instead of the ring if not 0 */
+    DeviceSampleField *fields;
+    int64_t *timestamps;        /* rt_clock, ns, of each column slot */
+    int delta;                  /* segments instead of the ring if set */
+    QTAILQ_HEAD(DeviceSampleSegments, DeviceSampleSegment) segments;
+    uint8_t *prev;              /* last sample, the base of the next delta */
+    uint8_t *cur;
+    uint8_t *zero;              /* the base of keyframes */
+    size_t prev_len;
+    size_t buf_size;            /* of prev, cur and zero */
+    size_t delta_bytes;         /* held by the segments */
+    int head;                   /* next slot to write */
+    int count;                  /* valid records */
+    uint64_t dropped;           /* samples larger than a slot */
+    QTAILQ_ENTRY(DeviceSampler) next;
+} DeviceSampler;
+
+static QTAILQ_HEAD(, DeviceSampler) device_samplers =
+    QTAILQ_HEAD_INITIALIZER(device_samplers);
+
+static DeviceSampler *device_sampler_find(DeviceState *dev)
+{
+    DeviceSampler *s;
+
+    QTAILQ_FOREACH(s, &device_samplers, next) {
+        if (s->dev == dev) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void device_sample_advance(DeviceSampler *s)
+{
+    s->head = (s->head + 1) % s->n_slots;
+    if (s->count < s->n_slots) {
+        s->count++;
+    }
+}
+
+static void device_sample_snapshot(DeviceSampler *s)
+{
+    uint8_t *slot = s->ring + s->slot_size * s->head;
+    DeviceSampleHeader *hdr = (DeviceSampleHeader *)slot;
+    size_t len;
+
+    len = vmstate_plan_snapshot_to(s->plan, s->dev, slot + sizeof(*hdr),
+                                   s->slot_size - sizeof(*hdr));
+    if (len > s->slot_size - sizeof(*hdr)) {
+        s->dropped++;
+    } else {
+        hdr->timestamp = qemu_get_clock_ns(rt_clock);
+        hdr->len = len;
+        device_sample_advance(s);
+    }
+}
+
+static void *device_sample_segment_put(DeviceSampleSegment *seg,
+                                       int64_t timestamp, const void *buf,
+                                       size_t len)
+{
+    DeviceSampleHeader hdr = {
+        .timestamp = timestamp,
+        .len = len,
+    };
+    size_t need = seg->len + sizeof(hdr) + len;
+
+    if (need > seg->capacity) {
+        seg->capacity = MAX(seg->capacity * 2, need);
+        seg->data = qemu_realloc(seg->data, seg->capacity);
+    }
+    memcpy(seg->data + seg->len, &hdr, sizeof(hdr));
+    memcpy(seg->data + seg->len + sizeof(hdr), buf, len);
+    seg->len = need;
+    seg->count++;
+    seg->last = timestamp;
+    return seg->data + need - len;
+}
+
+static void device_sample_drop_segment(DeviceSampler *s)
+{
+    DeviceSampleSegment *seg = QTAILQ_FIRST(&s->segments);
+
+    QTAILQ_REMOVE(&s->segments, seg, next);
+    s->count -= seg->count;
+    s->delta_bytes -= seg->capacity;
+    qemu_free(seg->data);
+    qemu_free(seg);
+}
+
+static void device_sample_delta(DeviceSampler *s)
+{
+    DeviceSampleSegment *seg = QTAILQ_LAST(&s->segments,
+                                           DeviceSampleSegments);
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    size_t len, old_capacity;
+    uint8_t *tmp;
+    int dlen = -1;
+
+    /* Full, drop the oldest segment unless it is still being filled */
+    if (s->count == s->n_slots && QTAILQ_FIRST(&s->segments) != seg) {
+        device_sample_drop_segment(s);
+    }
+
+    len = vmstate_plan_snapshot_to(s->plan, s->dev, s->cur, s->buf_size);
+    if (len > s->buf_size) {
+        /* A variable sized field grew, the next sample is a keyframe */
+        s->buf_size = len * 2;
+        s->prev = qemu_realloc(s->prev, s->buf_size);
+        s->cur = qemu_realloc(s->cur, s->buf_size);
+        qemu_free(s->zero);
+        s->zero = qemu_mallocz(s->buf_size);
+        s->prev_len = 0;
+        len = vmstate_plan_snapshot_to(s->plan, s->dev, s->cur, s->buf_size);
+    }
+
+    /* The delta goes into the segment's spare room; when it is not smaller
+       than the sample, or the size changed, start a new segment instead */
+    if (seg && seg->count < DEVICE_SAMPLE_KEYFRAME && len == s->prev_len) {
+        old_capacity = seg->capacity;
+        tmp = device_sample_segment_put(seg, now, s->cur, len);
+        dlen = xbzrle_encode(s->prev, s->cur, len, tmp, len - 1);
+        if (dlen >= 0) {
+            seg->len -= len - dlen;
+            ((DeviceSampleHeader *)(tmp - sizeof(DeviceSampleHeader)))->len =
+                dlen;
+        } else {
+            seg->len -= sizeof(DeviceSampleHeader) + len;
+            seg->count--;
+        }
+        s->delta_bytes += seg->capacity - old_capacity;
+    }
+    if (dlen < 0) {
+        if (seg) {
+            /* Complete, give back the room reserved for the next sample */
+            s->delta_bytes -= seg->capacity - seg->len;
+            seg->capacity = seg->len;
+            seg->data = qemu_realloc(seg->data, seg->capacity);
+        }
+        if (s->count == s->n_slots) {
+            device_sample_drop_segment(s);
+        }
+        seg = qemu_mallocz(sizeof(*seg));
+        seg->size = len;
+        QTAILQ_INSERT_TAIL(&s->segments, seg, next);
+        tmp = device_sample_segment_put(seg, now, s->cur, len);
+        dlen = xbzrle_encode(s->zero, s->cur, len, tmp, len - 1);
+        if (dlen >= 0) {
+            seg->len -= len - dlen;
+            ((DeviceSampleHeader *)(tmp - sizeof(DeviceSampleHeader)))->len =
+                dlen;
+        }
+        s->delta_bytes += seg->capacity;
+    }
+    s->count++;
+
+    tmp = s->prev;
+    s->prev = s->cur;
+    s->cur = tmp;
+    s->prev_len = len;
+}
+
+/* Rebuild the samples of seg up to and including the n-th one, calling fn
+   for each with the header and the complete snapshot */
+static void device_sample_replay(const DeviceSampleSegment *seg, int n,
+                                 uint8_t *buf,
+                                 void (*fn)(const DeviceSampleHeader *hdr,
+                                            const uint8_t *buf, void *opaque),
+                                 void *opaque)
+{
+    const uint8_t *p = seg->data;
+    int i;
+
+    for (i = 0; i <= n && i < seg->count; i++) {
+        DeviceSampleHeader hdr;
+
+        memcpy(&hdr, p, sizeof(hdr));
+        p += sizeof(hdr);
+        if (i == 0 && hdr.len == seg->size) {
+            memcpy(buf, p, seg->size);
+        } else {
+            if (i == 0) {
+                memset(buf, 0, seg->size);
+            }
+            xbzrle_decode(p, hdr.len, buf, seg->size);
+        }
+        p += hdr.len;
+        hdr.len = seg->size;
+        fn(&hdr, buf, opaque);
+    }
+}
+
+static void device_sample_fields(DeviceSampler *s)
+{
+    int i;
+
+    /* Some devices only bring their migrated fields up to date here */
+    if (s->plan->vmsd->pre_save) {
+        s->plan->vmsd->pre_save(s->dev);
+    }
+    s->timestamps[s->head] = qemu_get_clock_ns(rt_clock);
+    for (i = 0; i < s->n_fields; i++) {
+        DeviceSampleField *f = &s->fields[i];
+
+        memcpy(f->column + f->size * s->head, f->addr, f->size);
+    }
+    device_sample_advance(s);
+}
+
+static void device_sample_tick(void *opaque)
+{
+    DeviceSampler *s = opaque;
+
+    if (s->n_fields) {
+        device_sample_fields(s);
+    } else if (s->delta) {
+        device_sample_delta(s);
+    } else {
+        device_sample_snapshot(s);
+    }
+
+    qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + s->interval);
+}
+
+static void device_sampler_free(DeviceSampler *s)
+{
+    int i;
+
+    if (s->timer) {
+        QTAILQ_REMOVE(&device_samplers, s, next);
+        qemu_del_timer(s->timer);
+        qemu_free_timer(s->timer);
+    }
+    for (i = 0; i < s->n_fields; i++) {
+        qemu_free(s->fields[i].name);
+        qemu_free(s->fields[i].column);
+    }
+    while (!QTAILQ_EMPTY(&s->segments)) {
+        device_sample_drop_segment(s);
+    }
+    qemu_free(s->prev);
+    qemu_free(s->cur);
+    qemu_free(s->zero);
+    qemu_free(s->fields);
+    qemu_free(s->timestamps);
+    qemu_free(s->ring);
+    qemu_free(s);
+}
+
+/* Resolve the comma separated integer fields to sample */
+static int device_sample_add_fields(DeviceSampler *s, const char *list)
+{
+    const char *p = list;
+
+    s->fields = qemu_mallocz(DEVICE_SAMPLE_MAX_FIELDS * sizeof(*s->fields));
+    while (*p) {
+        const char *end = strchr(p, ',') ? : p + strlen(p);
+        DeviceSampleField *f;
+
+        if (s->n_fields == DEVICE_SAMPLE_MAX_FIELDS) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "fields",
+                          "at most 16 fields");
+            return -1;
+        }
+        f = &s->fields[s->n_fields++];
+        f->name = qemu_strndup(p, end - p);
+        f->addr = vmstate_plan_lookup(s->plan, s->dev, f->name, &f->size);
+        if (!f->addr ||
+            (f->size != 1 && f->size != 2 && f->size != 4 && f->size != 8)) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "fields",
+                          "integer fields of the device");
+            return -1;
+        }
+        f->column = qemu_malloc(f->size * s->n_slots);
+        p = *end ? end + 1 : end;
+    }
+    s->timestamps = qemu_malloc(s->n_slots * sizeof(*s->timestamps));
+    return 0;
+}
+
+void device_sample_remove_dev(DeviceState *dev)
+{
+    DeviceSampler *s = device_sampler_find(dev);
+
+    if (s) {
+        device_sampler_free(s);
+    }
+}
+
+int do_device_sample(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *path = qdict_get_str(qdict, "path");
+    int64_t interval = qdict_get_try_int(qdict, "interval",
+                                         DEVICE_SAMPLE_DEFAULT_INTERVAL);
+    int64_t n_slots = qdict_get_try_int(qdict, "slots",
+                                        DEVICE_SAMPLE_DEFAULT_SLOTS);
+    const char *fields = qdict_get_try_str(qdict, "fields");
+    int delta = qdict_get_try_bool(qdict, "delta", 0);
+    DeviceSampler *s;
+    DeviceState *dev;
+    void *snapshot;
+    size_t len;
+
+    dev = qdev_find_with_state(path);
+    if (!dev) {
+        return -1;
+    }
+
+    s = device_sampler_find(dev);
+    if (s) {
+        device_sampler_free(s);
+    }
+    if (interval == 0) {
+        /* Just stop sampling */
+        return 0;
+    }
+    if (interval < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "interval",
+                      "a positive number of milliseconds");
+        return -1;
+    }
+    if (delta && fields) {
+        qerror_report(QERR_INVALID_PARAMETER, "fields");
+        return -1;
+    }
+    if (delta) {
+        if (n_slots < DEVICE_SAMPLE_KEYFRAME ||
+            n_slots > DEVICE_SAMPLE_MAX_DELTA_SLOTS) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "slots",
+                          "a number between 64 and 1048576");
+            return -1;
+        }
+    } else if (n_slots <= 0 || n_slots > DEVICE_SAMPLE_MAX_SLOTS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "slots",
+                      "a number between 1 and 65536");
+        return -1;
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+    s->dev = dev;
+    s->plan = vmstate_plan_get(dev->info->vmsd);
+    s->interval = interval;
+    s->n_slots = n_slots;
+    s->delta = delta;
+    QTAILQ_INIT(&s->segments);
+
+    if (delta) {
+        snapshot = vmstate_plan_snapshot(s->plan, dev, &len);
+        qemu_free(snapshot);
+        s->buf_size = MAX(len * 2, 64);
+        s->prev = qemu_malloc(s->buf_size);
+        s->cur = qemu_malloc(s->buf_size);
+        s->zero = qemu_mallocz(s->buf_size);
+    } else if (fields) {
+        if (device_sample_add_fields(s, fields) < 0) {
+            device_sampler_free(s);
+            return -1;
+        }
+    } else {
+        /* Size slots after the current state, leaving room for variable
+           sized fields to grow */
+        snapshot = vmstate_plan_snapshot(s->plan, dev, &len);
+        qemu_free(snapshot);
+        s->slot_size = (sizeof(DeviceSampleHeader) + MAX(len * 2, 64) + 7) &
+                       ~7;
+        s->ring = qemu_malloc(s->slot_size * s->n_slots);
+    }
+
+    s->timer = qemu_new_timer(rt_clock, device_sample_tick, s);
+    QTAILQ_INSERT_TAIL(&device_samplers, s, next);
+    qemu_mod_timer(s->timer, qemu_get_clock(rt_clock));
+
+    return 0;
+}
+
+/* One line per sample, time in ms since the first one, values in hex */
+static void device_history_print_fields(Monitor *mon, QList *timestamps,
+                                        QList *fields)
+{
+    QListEntry *t, *f, *values[DEVICE_SAMPLE_MAX_FIELDS];
+    int width[DEVICE_SAMPLE_MAX_FIELDS];
+    int64_t first = 0;
+    int i, n = 0;
+
+    monitor_printf(mon, "  %12s", "time_ms");
+    QLIST_FOREACH_ENTRY(fields, f) {
+        QDict *field = qobject_to_qdict(qlist_entry_obj(f));
+        const char *name = qdict_get_str(field, "name");
+
+        width[n] = MAX((int)strlen(name),
+                       (int)qdict_get_int(field, "size") * 2);
+        monitor_printf(mon, " %*s", width[n], name);
+        values[n++] = QTAILQ_FIRST(&qdict_get_qlist(field, "values")->head);
+    }
+    monitor_printf(mon, "\n");
+
+    QLIST_FOREACH_ENTRY(timestamps, t) {
+        int64_t ts = qint_get_int(qobject_to_qint(qlist_entry_obj(t)));
+
+        if (t == QTAILQ_FIRST(&timestamps->head)) {
+            first = ts;
+        }
+        monitor_printf(mon, "  %12.3f", (ts - first) / 1000000.0);
+        for (i = 0; i < n; i++) {
+            monitor_printf(mon, " %*" PRIx64, width[i],
+                           qint_get_int(qobject_to_qint(values[i]->value)));
+            values[i] = QTAILQ_NEXT(values[i], next);
+        }
+        monitor_printf(mon, "\n");
+    }
+}
+
+void device_history_user_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+
+    monitor_printf(mon, "dev: %s, id \"%s\", version %" PRId64 "\n",
+                   qdict_get_str(qdict, "device"),
+                   qdict_get_str(qdict, "id"),
+                   qdict_get_int(qdict, "version"));
+    monitor_printf(mon, "  %" PRId64 " samples every %" PRId64 " ms, %"
+                   PRId64 " dropped, %" PRId64 " bytes held",
+                   qdict_get_int(qdict, "samples"),
+                   qdict_get_int(qdict, "interval"),
+                   qdict_get_int(qdict, "dropped"),
+                   qdict_get_int(qdict, "bytes"));
+    if (qdict_haskey(qdict, "fields")) {
+        monitor_printf(mon, "\n");
+        device_history_print_fields(mon, qdict_get_qlist(qdict, "timestamps"),
+                                    qdict_get_qlist(qdict, "fields"));
+    } else {
+        QBuffer *qbuf = qobject_to_qbuffer(qdict_get(qdict, "data"));
+
+        monitor_printf(mon, ", %zu bytes returned\n",
+                       qbuffer_get_size(qbuf));
+    }
+}
+
+/* The columns, oldest sample first */
+static void device_history_fields(DeviceSampler *s, QDict *qdict)
+{
+    QList *timestamps = qlist_new();
+    QList *fields = qlist_new();
+    int i, j;
+
+    for (i = 0; i < s->count; i++) {
+        int slot = (s->head - s->count + i + s->n_slots) % s->n_slots;
+
+        qlist_append(timestamps, qint_from_int(s->timestamps[slot]));
+    }
+    for (j = 0; j < s->n_fields; j++) {
+        DeviceSampleField *f = &s->fields[j];
+        QList *values = qlist_new();
+
+        for (i = 0; i < s->count; i++) {
+            int slot = (s->head - s->count + i + s->n_slots) % s->n_slots;
+
+            qlist_append(values, qint_from_int(vmstate_plan_read_scalar(
+                             f->column + f->size * slot, f->size)));
+        }
+        qlist_append_obj(fields, qobject_from_jsonf(
+                             "{ 'name': %s, 'size': %d, 'values': %p }",
+                             f->name, (int)f->size, values));
+    }
+    qdict_put(qdict, "timestamps", timestamps);
+    qdict_put(qdict, "fields", fields);
+}
+
+typedef struct DeviceHistoryBuffer {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+    int samples;
+    int only_last;
+} DeviceHistoryBuffer;
+
+static void device_history_append(const DeviceSampleHeader *hdr,
+                                  const uint8_t *buf, void *opaque)
+{
+    DeviceHistoryBuffer *b = opaque;
+    size_t need;
+
+    if (b->only_last) {
+        b->len = 0;
+        b->samples = 0;
+    }
+    need = b->len + sizeof(*hdr) + hdr->len;
+    if (need > b->capacity) {
+        b->capacity = MAX(b->capacity * 2, need);
+        b->data = qemu_realloc(b->data, b->capacity);
+    }
+    memcpy(b->data + b->len, hdr, sizeof(*hdr));
+    memcpy(b->data + b->len + sizeof(*hdr), buf, hdr->len);
+    b->len = need;
+    b->samples++;
+}
+
+static int64_t device_sample_segment_first(const DeviceSampleSegment *seg)
+{
+    DeviceSampleHeader hdr;
+
+    memcpy(&hdr, seg->data, sizeof(hdr));
+    return hdr.timestamp;
+}
+
+/* Rebuild all samples, or with at only the last one taken at or before
+   that time */
+static void device_history_delta(DeviceSampler *s, DeviceHistoryBuffer *b,
+                                 int has_at, int64_t at)
+{
+    DeviceSampleSegment *seg;
+    uint8_t *buf = qemu_malloc(s->buf_size);
+
+    b->only_last = has_at;
+    QTAILQ_FOREACH(seg, &s->segments, next) {
+        const uint8_t *p = seg->data;
+        int n;
+
+        if (!has_at) {
+            device_sample_replay(seg, seg->count - 1, buf,
+                                 device_history_append, b);
+            continue;
+        }
+        if (device_sample_segment_first(seg) > at) {
+            break;
+        }
+        if (seg->last <= at && QTAILQ_NEXT(seg, next) &&
+            device_sample_segment_first(QTAILQ_NEXT(seg, next)) <= at) {
+            continue;
+        }
+        /* The sample is in this segment */
+        for (n = 0; n + 1 < seg->count; n++) {
+            DeviceSampleHeader hdr;
+
+            memcpy(&hdr, p, sizeof(hdr));
+            p += sizeof(hdr) + hdr.len;
+            memcpy(&hdr, p, sizeof(hdr));
+            if (hdr.timestamp > at) {
+                break;
+            }
+        }
+        device_sample_replay(seg, n, buf, device_history_append, b);
+        break;
+    }
+    qemu_free(buf);
+}
+
+/* Memory held by the samples */
+static size_t device_sample_bytes(const DeviceSampler *s)
+{
+    size_t bytes = s->slot_size * (s->ring ? s->n_slots : 0);
+    int i;
+
+    if (s->delta) {
+        bytes = s->delta_bytes + 3 * s->buf_size;
+    }
+    for (i = 0; i < s->n_fields; i++) {
+        bytes += s->fields[i].size * s->n_slots;
+    }
+    if (s->timestamps) {
+        bytes += s->n_slots * sizeof(*s->timestamps);
+    }
+    return bytes;
+}
+
+int do_device_history(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *path = qdict_get_str(qdict, "path");
+    int has_at = qdict_haskey(qdict, "at");
+    int64_t at = qdict_get_try_int(qdict, "at", 0);
+    DeviceHistoryBuffer b = { .only_last = has_at };
+    DeviceSampler *s;
+    DeviceState *dev;
+    int i;
+
+    dev = qdev_find_with_state(path);
+    if (!dev) {
+        return -1;
+    }
+    s = device_sampler_find(dev);
+    if (!s) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "path",
+                      "a device started with device_sample");
+        return -1;
+    }
+    if (has_at && s->n_fields) {
+        qerror_report(QERR_INVALID_PARAMETER, "at");
+        return -1;
+    }
+
+    *ret_data = device_state_header(dev);
+    qdict_put(qobject_to_qdict(*ret_data), "interval",
+              qint_from_int(s->interval));
+    qdict_put(qobject_to_qdict(*ret_data), "dropped",
+              qint_from_int(s->dropped));
+    qdict_put(qobject_to_qdict(*ret_data), "bytes",
+              qint_from_int(device_sample_bytes(s)));
+    if (s->n_fields) {
+        qdict_put(qobject_to_qdict(*ret_data), "samples",
+                  qint_from_int(s->count));
+        device_history_fields(s, qobject_to_qdict(*ret_data));
+        return 0;
+    }
+
+    if (s->delta) {
+        device_history_delta(s, &b, has_at, at);
+    } else {
+        /* Oldest record first */
+        for (i = 0; i < s->count; i++) {
+            int slot = (s->head - s->count + i + s->n_slots) % s->n_slots;
+            uint8_t *rec = s->ring + s->slot_size * slot;
+            DeviceSampleHeader *hdr = (DeviceSampleHeader *)rec;
+
+            if (has_at && hdr->timestamp > at) {
+                break;
+            }
+            device_history_append(hdr, rec + sizeof(*hdr), &b);
+        }
+    }
+
+    qdict_put(qobject_to_qdict(*ret_data), "samples",
+              qint_from_int(b.samples));
+    qdict_put(qobject_to_qdict(*ret_data), "data",
+              qbuffer_from_raw(b.data ? : qemu_malloc(1), b.len));
+    return 0;
+}
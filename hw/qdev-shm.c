@@ -0,0 +1,473 @@
+/*
+ * Export of the state of all devices through a shared memory segment
+ *
+ * Every interval milliseconds, the state of every device with a state
+ * description is copied into its slot of a file that other processes map,
+ * typically one in /dev/shm.  A reader gets a consistent record of a
+ * device with plain loads, no system calls and no monitor involved.
+ * Records use the same fixed layouts as device_export; devices that track
+ * changes are only copied again when they changed.
+ *
+ * Each slot is protected by a sequence count.  The writer makes it odd
+ * before touching the slot and even again afterwards, so a reader does:
+ *
+ *   do {
+ *       seq = slot->seq;            (retry while odd)
+ *       read barrier
+ *       copy the record, generation and timestamp
+ *       read barrier
+ *   } while (slot->seq != seq);
+ *
+ * The set of slots and the layouts are fixed for the lifetime of a
+ * segment.  When devices come or go, a new segment replaces the file and
+ * the old one gets stale set, after which readers should map the file
+ * again.  Everything is in host byte order:
+ *
+ *   DeviceShmHeader
+ *   layouts_offset: n_layouts times a DeviceShmLayout followed by the
+ *                   description name (name_len bytes), then n_fields times
+ *                   a DeviceShmField followed by the field's path
+ *                   (name_len bytes); len skips to the next layout
+ *   slots_offset:   n_slots times a DeviceShmSlot
+ *   then the strings, NUL-terminated, and the records, aligned to 8 bytes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <sys/mman.h>
+
+#include "qdev.h"
+#include "monitor.h"
+#include "qemu-barrier.h"
+#include "qemu-timer.h"
+#include "qerror.h"
+#include "vmstate-plan.h"
+
+#define DEVICE_SHM_DEFAULT_INTERVAL 1000 /* ms */
+
+#define DEVICE_SHM_MAGIC        0x51445348  /* "QDSH" */
+#define DEVICE_SHM_VERSION      1
+
+typedef struct DeviceShmHeader {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t big_endian;
+    uint8_t stale;              /* replaced, map the file again */
+    uint8_t reserved;
+    uint64_t size;              /* of the segment */
+    uint32_t n_layouts;
+    uint32_t n_slots;
+    uint64_t layouts_offset;
+    uint64_t slots_offset;
+    uint64_t sweeps;
+    int64_t timestamp;          /* of the last sweep, rt_clock, ns */
+} DeviceShmHeader;
+
+typedef struct DeviceShmLayout {
+    uint32_t len;               /* of the whole entry, with the names */
+    uint32_t id;
+    uint32_t version_id;
+    uint32_t record_size;
+    uint32_t n_fields;
+    uint16_t name_len;
+} __attribute__((packed)) DeviceShmLayout;
+
+typedef struct DeviceShmField {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t count;
+    uint8_t kind;               /* VMStateLayoutKind */
+    uint16_t name_len;
+} __attribute__((packed)) DeviceShmField;
+
+typedef struct DeviceShmSlot {
+    uint32_t seq;
+    uint32_t layout;
+    uint32_t instance;          /* as in the "device" of device_show */
+    uint32_t record_size;
+    uint64_t record_offset;
+    uint64_t name_offset;       /* "name.instance", as device_show */
+    uint64_t id_offset;         /* 0 if the device has no ID */
+    uint64_t generation;        /* changes whenever the record does, 0 if
+                                   the device does not track changes */
+    int64_t timestamp;          /* of the record, rt_clock, ns */
+} DeviceShmSlot;
+
+typedef struct DeviceShmDev {
+    DeviceState *dev;
+    VMStatePlan *plan;
+    const VMStateLayout *layout;
+} DeviceShmDev;
+
+typedef struct DeviceShm {
+    char *path;
+    int64_t interval;
+    QEMUTimer *timer;
+    unsigned int topology_gen;
+    DeviceShmDev *devs;
+    int n_devs;
+    uint8_t *map;
+    size_t size;
+    QTAILQ_ENTRY(DeviceShm) next;
+} DeviceShm;
+
+static QTAILQ_HEAD(, DeviceShm) device_shms =
+    QTAILQ_HEAD_INITIALIZER(device_shms);
+
+typedef struct DeviceShmList {
+    DeviceShmDev *devs;
+    int n_devs;
+} DeviceShmList;
+
+static void *device_shm_list_one(DeviceState *dev, void *opaque)
+{
+    DeviceShmList *list = opaque;
+    DeviceShmDev *d;
+
+    if (!dev->info->vmsd || dev->state != DEV_STATE_INITIALIZED) {
+        return NULL;
+    }
+    list->devs = qemu_realloc(list->devs,
+                              (list->n_devs + 1) * sizeof(*list->devs));
+    d = &list->devs[list->n_devs++];
+    d->dev = dev;
+    d->plan = vmstate_plan_get(dev->info->vmsd);
+    d->layout = vmstate_plan_layout(d->plan);
+    return NULL;
+}
+
+static bool device_shm_same_devs(DeviceShm *s, const DeviceShmList *list)
+{
+    int i;
+
+    if (!s->map || list->n_devs != s->n_devs) {
+        return false;
+    }
+    for (i = 0; i < list->n_devs; i++) {
+        if (list->devs[i].dev != s->devs[i].dev ||
+            list->devs[i].layout != s->devs[i].layout) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t device_shm_align(uint64_t off)
+{
+    return (off + 7) & ~(uint64_t)7;
+}
+
+/* Whether layout was already written by one of the first n devices */
+static bool device_shm_layout_seen(const DeviceShmList *list, int n,
+                                   const VMStateLayout *layout)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (list->devs[i].layout == layout) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static char *device_shm_name(DeviceState *dev)
+{
+    size_t len = strlen(dev->info->name) + 16;
+    char *name = qemu_malloc(len);
+
+    snprintf(name, len, "%s.%d", dev->info->name, qdev_instance_no(dev));
+    return name;
+}
+
+/*
+ * Lay out a segment for the devices of list into buf, or only compute its
+ * size if buf is NULL
+ */
+static uint64_t device_shm_fill(const DeviceShmList *list, uint8_t *buf)
+{
+    DeviceShmHeader *hdr = (DeviceShmHeader *)buf;
+    uint64_t off = device_shm_align(sizeof(DeviceShmHeader));
+    uint64_t slots_offset;
+    int n_layouts = 0;
+    int i, j;
+
+    if (buf) {
+        hdr->magic = DEVICE_SHM_MAGIC;
+        hdr->version = DEVICE_SHM_VERSION;
+#ifdef HOST_WORDS_BIGENDIAN
+        hdr->big_endian = 1;
+#endif
+        hdr->layouts_offset = off;
+    }
+    for (i = 0; i < list->n_devs; i++) {
+        const DeviceShmDev *d = &list->devs[i];
+        const char *vmsd_name = d->plan->vmsd->name;
+        uint64_t start = off;
+
+        if (device_shm_layout_seen(list, i, d->layout)) {
+            continue;
+        }
+        n_layouts++;
+        off += sizeof(DeviceShmLayout) + strlen(vmsd_name);
+        if (buf) {
+            memcpy(buf + off - strlen(vmsd_name), vmsd_name,
+                   strlen(vmsd_name));
+        }
+        for (j = 0; j < d->layout->n_fields; j++) {
+            const VMStateLayoutField *f = &d->layout->fields[j];
+            DeviceShmField field = {
+                .offset = f->offset,
+                .size = f->size,
+                .count = f->count,
+                .kind = f->kind,
+                .name_len = strlen(f->name),
+            };
+
+            if (buf) {
+                memcpy(buf + off, &field, sizeof(field));
+                memcpy(buf + off + sizeof(field), f->name, field.name_len);
+            }
+            off += sizeof(field) + field.name_len;
+        }
+        if (buf) {
+            DeviceShmLayout layout = {
+                .len = off - start,
+                .id = d->layout->id,
+                .version_id = d->plan->vmsd->version_id,
+                .record_size = d->layout->size,
+                .n_fields = d->layout->n_fields,
+                .name_len = strlen(vmsd_name),
+            };
+
+            memcpy(buf + start, &layout, sizeof(layout));
+        }
+    }
+
+    slots_offset = off = device_shm_align(off);
+    off += list->n_devs * sizeof(DeviceShmSlot);
+    for (i = 0; i < list->n_devs; i++) {
+        DeviceState *dev = list->devs[i].dev;
+        DeviceShmSlot *slot = NULL;
+        char *name = device_shm_name(dev);
+
+        if (buf) {
+            slot = (DeviceShmSlot *)(buf + slots_offset) + i;
+            slot->layout = list->devs[i].layout->id;
+            slot->instance = qdev_instance_no(dev);
+            slot->record_size = list->devs[i].layout->size;
+            slot->name_offset = off;
+            strcpy((char *)buf + off, name);
+        }
+        off += strlen(name) + 1;
+        qemu_free(name);
+        if (dev->id) {
+            if (buf) {
+                slot->id_offset = off;
+                strcpy((char *)buf + off, dev->id);
+            }
+            off += strlen(dev->id) + 1;
+        }
+    }
+    for (i = 0; i < list->n_devs; i++) {
+        off = device_shm_align(off);
+        if (buf) {
+            ((DeviceShmSlot *)(buf + slots_offset))[i].record_offset = off;
+        }
+        off += list->devs[i].layout->size;
+    }
+
+    if (buf) {
+        hdr->n_layouts = n_layouts;
+        hdr->n_slots = list->n_devs;
+        hdr->slots_offset = slots_offset;
+        hdr->size = off;
+    }
+    return off;
+}
+
+static void device_shm_unmap(DeviceShm *s)
+{
+    if (s->map) {
+        ((DeviceShmHeader *)s->map)->stale = 1;
+        munmap(s->map, s->size);
+        s->map = NULL;
+    }
+    qemu_free(s->devs);
+    s->devs = NULL;
+    s->n_devs = 0;
+}
+
+/*
+ * Build a segment for the devices of list in a new file and move it over
+ * the old one, so that a reader never maps a half-written segment.  Takes
+ * the list over on success.
+ */
+static int device_shm_create(DeviceShm *s, DeviceShmList *list)
+{
+    size_t len = strlen(s->path) + 8;
+    char *tmp = qemu_malloc(len);
+    uint64_t size = device_shm_fill(list, NULL);
+    uint8_t *map;
+    int fd;
+
+    snprintf(tmp, len, "%s.new", s->path);
+    fd = qemu_open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        qemu_free(tmp);
+        return -errno;
+    }
+    map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        int ret = -errno;
+
+        unlink(tmp);
+        qemu_free(tmp);
+        return ret;
+    }
+    device_shm_fill(list, map);
+    if (rename(tmp, s->path) < 0) {
+        int ret = -errno;
+
+        munmap(map, size);
+        unlink(tmp);
+        qemu_free(tmp);
+        return ret;
+    }
+    qemu_free(tmp);
+
+    device_shm_unmap(s);
+    s->map = map;
+    s->size = size;
+    s->devs = list->devs;
+    s->n_devs = list->n_devs;
+    list->devs = NULL;
+    return 0;
+}
+
+/* Replace the segment if devices came or went since it was built */
+static int device_shm_update_devs(DeviceShm *s)
+{
+    DeviceShmList list = { NULL, 0 };
+    int ret = 0;
+
+    if (s->map && s->topology_gen == qdev_topology_generation()) {
+        return 0;
+    }
+    qdev_iterate_recursive(NULL, device_shm_list_one, &list);
+    if (!device_shm_same_devs(s, &list)) {
+        ret = device_shm_create(s, &list);
+    }
+    if (ret == 0) {
+        s->topology_gen = qdev_topology_generation();
+    } else {
+        /* The old segment may name devices that are gone */
+        device_shm_unmap(s);
+    }
+    qemu_free(list.devs);
+    return ret;
+}
+
+static void device_shm_sweep(DeviceShm *s)
+{
+    DeviceShmHeader *hdr = (DeviceShmHeader *)s->map;
+    DeviceShmSlot *slots = (DeviceShmSlot *)(s->map + hdr->slots_offset);
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int i;
+
+    for (i = 0; i < s->n_devs; i++) {
+        DeviceShmDev *d = &s->devs[i];
+        DeviceShmSlot *slot = &slots[i];
+
+        if (slot->timestamp && !qdev_state_changed_since(d->dev,
+                                                         slot->generation)) {
+            continue;
+        }
+        slot->seq++;
+        smp_wmb();
+        vmstate_plan_record(d->plan, d->dev, s->map + slot->record_offset);
+        slot->generation = d->plan->vmsd->tracks_changes ?
+                           qdev_state_generation : 0;
+        slot->timestamp = now;
+        smp_wmb();
+        slot->seq++;
+    }
+    hdr->timestamp = now;
+    hdr->sweeps++;
+}
+
+static void device_shm_tick(void *opaque)
+{
+    DeviceShm *s = opaque;
+
+    /* On failure, try again next time */
+    if (device_shm_update_devs(s) == 0) {
+        device_shm_sweep(s);
+    }
+    qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + s->interval);
+}
+
+static DeviceShm *device_shm_find(const char *path)
+{
+    DeviceShm *s;
+
+    QTAILQ_FOREACH(s, &device_shms, next) {
+        if (strcmp(s->path, path) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void device_shm_free(DeviceShm *s)
+{
+    QTAILQ_REMOVE(&device_shms, s, next);
+    qemu_del_timer(s->timer);
+    qemu_free_timer(s->timer);
+    device_shm_unmap(s);
+    unlink(s->path);
+    qemu_free(s->path);
+    qemu_free(s);
+}
+
+int do_device_shm(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *path = qdict_get_str(qdict, "path");
+    int64_t interval = qdict_get_try_int(qdict, "interval",
+                                         DEVICE_SHM_DEFAULT_INTERVAL);
+    DeviceShm *s;
+
+    if (interval < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "interval",
+                      "a positive number of milliseconds, or 0");
+        return -1;
+    }
+
+    s = device_shm_find(path);
+    if (interval == 0) {
+        if (s) {
+            device_shm_free(s);
+        }
+        return 0;
+    }
+    if (!s) {
+        s = qemu_mallocz(sizeof(*s));
+        s->path = qemu_strdup(path);
+        if (device_shm_update_devs(s) < 0) {
+            qerror_report(QERR_OPEN_FILE_FAILED, path);
+            qemu_free(s->path);
+            qemu_free(s);
+            return -1;
+        }
+        s->timer = qemu_new_timer(rt_clock, device_shm_tick, s);
+        QTAILQ_INSERT_TAIL(&device_shms, s, next);
+    }
+    s->interval = interval;
+    qemu_mod_timer(s->timer, qemu_get_clock(rt_clock));
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Device state change subscriptions
+ *
+ * Each watch samples one device periodically and keeps the previous binary
+ * snapshot as a shadow copy.  Only fields that differ from the shadow are
+ * sent to QMP clients, as DEVICE_STATE_CHANGE events.  Devices that track
+ * their changes are not sampled again until their generation moves.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qdev.h"
+#include "monitor.h"
+#include "qemu-timer.h"
+#include "qint.h"
+#include "qjson.h"
+#include "vmstate-plan.h"
+
+#define DEVICE_WATCH_DEFAULT_INTERVAL 1000 /* ms */
+
+typedef struct DeviceWatch {
+    int id;
+    DeviceState *dev;
+    int64_t interval;
+    QEMUTimer *timer;
+    void *shadow;
+    size_t shadow_len;
+    uint64_t gen;               /* of the state in the shadow */
+    QTAILQ_ENTRY(DeviceWatch) next;
+} DeviceWatch;
+
+static QTAILQ_HEAD(, DeviceWatch) device_watches =
+    QTAILQ_HEAD_INITIALIZER(device_watches);
+static int device_watch_next_id;
+
+static void device_watch_tick(void *opaque)
+{
+    DeviceWatch *watch = opaque;
+    DeviceState *dev = watch->dev;
+    QList *changes = qlist_new();
+    QObject *data;
+    void *snapshot;
+    size_t len;
+
+    if (watch->shadow && !qdev_state_changed_since(dev, watch->gen)) {
+        QDECREF(changes);
+        goto out;
+    }
+    watch->gen = qdev_state_generation;
+
+    snapshot = vmstate_plan_diff(vmstate_plan_get(dev->info->vmsd), dev,
+                                 watch->shadow, watch->shadow_len, &len,
+                                 changes);
+    qemu_free(watch->shadow);
+    watch->shadow = snapshot;
+    watch->shadow_len = len;
+
+    if (qlist_empty(changes)) {
+        QDECREF(changes);
+    } else {
+        data = device_state_header(dev);
+        qdict_put(qobject_to_qdict(data), "watch", qint_from_int(watch->id));
+        qdict_put(qobject_to_qdict(data), "changes", changes);
+        monitor_protocol_event(QEVENT_DEVICE_STATE_CHANGE, data);
+        qobject_decref(data);
+    }
+
+out:
+    qemu_mod_timer(watch->timer,
+                   qemu_get_clock(rt_clock) + watch->interval);
+}
+
+static void device_watch_free(DeviceWatch *watch)
+{
+    QTAILQ_REMOVE(&device_watches, watch, next);
+    qemu_del_timer(watch->timer);
+    qemu_free_timer(watch->timer);
+    qemu_free(watch->shadow);
+    qemu_free(watch);
+}
+
+/* Drop all watches of a device that is going away */
+void device_watch_remove_dev(DeviceState *dev)
+{
+    DeviceWatch *watch, *next_watch;
+
+    QTAILQ_FOREACH_SAFE(watch, &device_watches, next, next_watch) {
+        if (watch->dev == dev) {
+            device_watch_free(watch);
+        }
+    }
+}
+
+void device_watch_user_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+
+    monitor_printf(mon, "watch %" PRId64 "\n", qdict_get_int(qdict, "id"));
+}
+
+int do_device_watch(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *path = qdict_get_str(qdict, "path");
+    int64_t interval = qdict_get_try_int(qdict, "interval",
+                                         DEVICE_WATCH_DEFAULT_INTERVAL);
+    DeviceWatch *watch;
+    DeviceState *dev;
+
+    if (interval <= 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "interval",
+                      "a positive number of milliseconds");
+        return -1;
+    }
+
+    dev = qdev_find_with_state(path);
+    if (!dev) {
+        return -1;
+    }
+
+    watch = qemu_mallocz(sizeof(*watch));
+    watch->id = device_watch_next_id++;
+    watch->dev = dev;
+    watch->interval = interval;
+    watch->timer = qemu_new_timer(rt_clock, device_watch_tick, watch);
+    QTAILQ_INSERT_TAIL(&device_watches, watch, next);
+
+    /* The first sample has no shadow and reports the complete state */
+    qemu_mod_timer(watch->timer, qemu_get_clock(rt_clock));
+
+    *ret_data = qobject_from_jsonf("{ 'id': %d }", watch->id);
+    return 0;
+}
+
+int do_device_unwatch(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    int id = qdict_get_int(qdict, "id");
+    DeviceWatch *watch;
+
+    QTAILQ_FOREACH(watch, &device_watches, next) {
+        if (watch->id == id) {
+            device_watch_free(watch);
+            return 0;
+        }
+    }
+    qerror_report(QERR_INVALID_PARAMETER_VALUE, "id", "an active watch");
+    return -1;
+}
@@ -32,6 +32,16 @@
 #include "qjson.h"
 #include "qbuffer.h"
 #include "qint.h"
+#include "qbool.h"
+#include "vmstate-plan.h"
+#include "qdev-capture.h"
+#include "qemu-timer.h"
+#include "qemu-arena.h"
+#include "trace.h"
+
+#ifdef CONFIG_FNMATCH
+#include <fnmatch.h>
+#endif
 
 static int qdev_hotplug = 0;
 static bool qdev_hot_added = false;
@@ -42,6 +52,65 @@ static BusState *main_system_bus;
 
 DeviceInfo *device_info_list;
 
+uint64_t qdev_state_generation;
+
+/* Generation at which the state of all devices was last replaced */
+static uint64_t qdev_state_all_gen;
+
+/* Devices with an ID, hashed by it, for qdev_find() and device_del */
+#define QDEV_ID_HASH_SIZE       256
+static QLIST_HEAD(, DeviceState) qdev_id_hash[QDEV_ID_HASH_SIZE];
+
+/* Absolute paths resolved by qdev_find(), valid while qdev_topology_gen is
+   what it was when they were resolved */
+#define QDEV_PATH_CACHE_SIZE    64
+
+typedef struct QDevPathCacheEntry {
+    char *path;
+    DeviceState *dev;
+    unsigned int gen;
+} QDevPathCacheEntry;
+
+static QDevPathCacheEntry qdev_path_cache[QDEV_PATH_CACHE_SIZE];
+
+/* Bumped whenever a device or bus comes or goes, or a device gets an ID */
+static unsigned int qdev_topology_gen = 1;
+
+unsigned int qdev_topology_generation(void)
+{
+    return qdev_topology_gen;
+}
+
+static unsigned int qdev_str_hash(const char *s)
+{
+    unsigned int h = 5381;
+
+    while (*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+static void qdev_id_index_add(DeviceState *dev)
+{
+    QLIST_INSERT_HEAD(&qdev_id_hash[qdev_str_hash(dev->id) %
+                                    QDEV_ID_HASH_SIZE], dev, id_link);
+    qdev_topology_gen++;
+}
+
+static DeviceState *qdev_id_index_find(const char *id)
+{
+    DeviceState *dev;
+
+    QLIST_FOREACH(dev, &qdev_id_hash[qdev_str_hash(id) % QDEV_ID_HASH_SIZE],
+                  id_link) {
+        if (strcmp(dev->id, id) == 0) {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
 static BusState *qbus_find_recursive(BusState *bus, const char *name,
                                      const BusInfo *info);
 
@@ -93,6 +162,7 @@ static DeviceState *qdev_create_from_info(BusState *bus, DeviceInfo *info)
     qdev_prop_set_defaults(dev, dev->parent_bus->info->props);
     qdev_prop_set_globals(dev);
     QLIST_INSERT_HEAD(&bus->children, dev, sibling);
+    qdev_topology_gen++;
     if (qdev_hotplug) {
         assert(bus->allow_hotplug);
         dev->hotplugged = 1;
@@ -258,6 +328,7 @@ DeviceState *qdev_device_add(QemuOpts *opts)
     id = qemu_opts_id(opts);
     if (id) {
         qdev->id = id;
+        qdev_id_index_add(qdev);
     }
     if (qemu_opt_foreach(opts, set_property, qdev, 1) != 0) {
         qdev_free(qdev);
@@ -278,10 +349,12 @@ DeviceState *qdev_device_add(QemuOpts *opts)
    Return 0 on success.  */
 int qdev_init(DeviceState *dev)
 {
+    int64_t start = get_clock();
     int rc;
 
     assert(dev->state == DEV_STATE_CREATED);
     rc = dev->info->init(dev, dev->info);
+    startup_profile_device(dev->info->name, dev->id, get_clock() - start);
     if (rc < 0) {
         qdev_free(dev);
         return rc;
@@ -293,6 +366,7 @@ int qdev_init(DeviceState *dev)
                                        dev->alias_required_for_version);
     }
     dev->state = DEV_STATE_INITIALIZED;
+    qdev_state_changed(dev);
     return 0;
 }
 
@@ -322,10 +396,24 @@ static int qdev_reset_one(DeviceState *dev, void *opaque)
     if (dev->info->reset) {
         dev->info->reset(dev);
     }
+    qdev_state_changed(dev);
 
     return 0;
 }
 
+void qdev_state_changed_all(void)
+{
+    qdev_state_all_gen = ++qdev_state_generation;
+}
+
+bool qdev_state_changed_since(DeviceState *dev, uint64_t gen)
+{
+    if (!dev->info->vmsd || !dev->info->vmsd->tracks_changes) {
+        return true;
+    }
+    return dev->state_gen > gen || qdev_state_all_gen > gen;
+}
+
 BusState *sysbus_get_default(void)
 {
     if (!main_system_bus) {
@@ -390,14 +478,21 @@ void qdev_free(DeviceState *dev)
             bus = QLIST_FIRST(&dev->child_bus);
             qbus_free(bus);
         }
-        if (dev->info->vmsd)
+        if (dev->info->vmsd) {
+            device_watch_remove_dev(dev);
+            device_sample_remove_dev(dev);
             vmstate_unregister(dev, dev->info->vmsd, dev);
+        }
         if (dev->info->exit)
             dev->info->exit(dev);
         if (dev->opts)
             qemu_opts_del(dev->opts);
     }
     QLIST_REMOVE(dev, sibling);
+    if (dev->id) {
+        QLIST_REMOVE(dev, id_link);
+    }
+    qdev_topology_gen++;
     for (prop = dev->info->props; prop && prop->name; prop++) {
         if (prop->info->free) {
             prop->info->free(dev, prop);
@@ -564,6 +659,9 @@ DeviceState *qdev_find_recursive(BusState *bus, const char *id)
     DeviceState *dev, *ret;
     BusState *child;
 
+    if (bus == main_system_bus) {
+        return qdev_id_index_find(id);
+    }
     QLIST_FOREACH(dev, &bus->children, sibling) {
         if (dev->id && strcmp(dev->id, id) == 0)
             return dev;
@@ -795,6 +893,7 @@ void qbus_create_inplace(BusState *bus, BusInfo *info,
     }
 
     QLIST_INIT(&bus->children);
+    qdev_topology_gen++;
     if (parent) {
         QLIST_INSERT_HEAD(&parent->child_bus, bus, sibling);
         parent->num_child_bus++;
@@ -830,6 +929,7 @@ void qbus_free(BusState *bus)
         qemu_unregister_reset(qbus_reset_all_fn, bus);
     }
     qemu_free((void*)bus->name);
+    qdev_topology_gen++;
     if (bus->qdev_allocated) {
         qemu_free(bus);
     }
@@ -997,40 +1097,28 @@ void *qdev_iterate_recursive(BusState *bus, qdev_iteratefn callback,
     return NULL;
 }
 
-static void *find_id_callback(DeviceState *dev, void *opaque)
-{
-    const char *id = opaque;
-
-    if (dev->id && strcmp(dev->id, id) == 0) {
-        return dev;
-    }
-    return NULL;
-}
-
-static DeviceState *qdev_find_id_recursive(BusState *bus, const char *id)
-{
-    return qdev_iterate_recursive(bus, find_id_callback, (void *)id);
-}
-
 DeviceState *qdev_find(const char *path, bool report_errors)
 {
+    QDevPathCacheEntry *e;
     char *dev_name;
     DeviceState *dev;
     char *bus_path;
     BusState *bus;
- 
-    //printf ("\n1. Within qdev_find(%s)\n", path);
-    /* search for unique ID recursively if path is not absolute */
+
+    /* look up unique ID in the index if path is not absolute */
     if (path[0] != '/') {
-        dev = qdev_find_id_recursive(main_system_bus, path);
+        dev = qdev_id_index_find(path);
         if (!dev && report_errors) {
-            //printf ("1.1 not found dev: Within qdev_find(%s)\n", path);
             qerror_report(QERR_DEVICE_NOT_FOUND, path);
         }
-        //printf ("1.1 found dev: Within qdev_find(%s)\n", path);
         return dev;
     }
 
+    e = &qdev_path_cache[qdev_str_hash(path) % QDEV_PATH_CACHE_SIZE];
+    if (e->gen == qdev_topology_gen && strcmp(e->path, path) == 0) {
+        return e->dev;
+    }
+
     dev_name = strrchr(path, '/') + 1;
 
     bus_path = qemu_strdup(path);
@@ -1050,10 +1138,17 @@ DeviceState *qdev_find(const char *path, bool report_errors)
     }
 
     dev = qbus_find_dev(bus, dev_name);
-    if (!dev && report_errors) {
-        qerror_report(QERR_DEVICE_NOT_FOUND, dev_name);
-        qbus_list_dev(bus);
+    if (!dev) {
+        if (report_errors) {
+            qerror_report(QERR_DEVICE_NOT_FOUND, dev_name);
+            qbus_list_dev(bus);
+        }
+        return NULL;
     }
+    qemu_free(e->path);
+    e->path = qemu_strdup(path);
+    e->dev = dev;
+    e->gen = qdev_topology_gen;
     return dev;
 }
 
@@ -1167,6 +1262,103 @@ static void print_field(Monitor *mon, const QDict *qfield, int indent)
         }
         elem_no++;
     }
+    if (qdict_get_try_bool(qfield, "more", 0)) {
+        monitor_printf(mon, "%*c%s: ...\n", indent, ' ', name);
+    }
+}
+
+static int compare_entry_keys(const void *a, const void *b)
+{
+    return strcmp(qdict_entry_key(*(const QDictEntry **)a),
+                  qdict_entry_key(*(const QDictEntry **)b));
+}
+
+static void print_state_dict(Monitor *mon, const QDict *qdict, int indent);
+
+/* Ints are printed in hex for addresses, whose keys end in "addr" */
+static void print_state_value(Monitor *mon, const char *key, QObject *obj,
+                              int indent)
+{
+    size_t len = strlen(key);
+    QListEntry *entry;
+    int i = 0;
+
+    /* scalars in a list have no key */
+    if (qobject_type(obj) != QTYPE_QDICT && qobject_type(obj) != QTYPE_QLIST) {
+        monitor_printf(mon, len ? " %s=" : " ", key);
+    }
+
+    switch (qobject_type(obj)) {
+    case QTYPE_QINT:
+        monitor_printf(mon, len >= 4 && !strcmp(key + len - 4, "addr") ?
+                       "0x%" PRIx64 : "%" PRId64,
+                       qint_get_int(qobject_to_qint(obj)));
+        break;
+    case QTYPE_QBOOL:
+        monitor_printf(mon, "%s",
+                       qbool_get_int(qobject_to_qbool(obj)) ? "yes" : "no");
+        break;
+    case QTYPE_QSTRING:
+        monitor_printf(mon, "\"%s\"",
+                       qstring_get_str(qobject_to_qstring(obj)));
+        break;
+    case QTYPE_QDICT:
+        monitor_printf(mon, "%*c%s:", indent, ' ', key);
+        print_state_dict(mon, qobject_to_qdict(obj), indent + 2);
+        break;
+    case QTYPE_QLIST:
+        QLIST_FOREACH_ENTRY(qobject_to_qlist(obj), entry) {
+            QObject *elem = qlist_entry_obj(entry);
+
+            if (qobject_type(elem) == QTYPE_QDICT) {
+                monitor_printf(mon, "%*c%s[%d]:", indent, ' ', key, i++);
+                print_state_dict(mon, qobject_to_qdict(elem), indent + 2);
+            } else {
+                if (i++ == 0) {
+                    monitor_printf(mon, "%*c%s:", indent, ' ', key);
+                }
+                print_state_value(mon, "", elem, indent);
+            }
+        }
+        if (i && qobject_type(qlist_peek(qobject_to_qlist(obj))) !=
+            QTYPE_QDICT) {
+            monitor_printf(mon, "\n");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Scalars on the current line, sorted by key, then lists and dicts below */
+static void print_state_dict(Monitor *mon, const QDict *qdict, int indent)
+{
+    const QDictEntry **entries;
+    const QDictEntry *e;
+    int n = 0, i, pass;
+
+    entries = qemu_malloc(qdict_size(qdict) * sizeof(*entries));
+    for (e = qdict_first(qdict); e; e = qdict_next(qdict, e)) {
+        entries[n++] = e;
+    }
+    qsort(entries, n, sizeof(*entries), compare_entry_keys);
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < n; i++) {
+            QObject *obj = qdict_entry_value(entries[i]);
+            bool nested = qobject_type(obj) == QTYPE_QDICT ||
+                          qobject_type(obj) == QTYPE_QLIST;
+
+            if (nested == pass) {
+                print_state_value(mon, qdict_entry_key(entries[i]), obj,
+                                  indent);
+            }
+        }
+        if (pass == 0) {
+            monitor_printf(mon, "\n");
+        }
+    }
+    qemu_free(entries);
 }
 
 void device_user_print(Monitor *mon, const QObject *data)
@@ -1179,172 +1371,778 @@ void device_user_print(Monitor *mon, const QObject *data)
                    qdict_get_str(qdict, "device"),
                    qdict_get_str(qdict, "id"),
                    qdict_get_int(qdict, "version"));
+    if (qdict_haskey(qdict, "migration")) {
+        QDict *mig = qdict_get_qdict(qdict, "migration");
+
+        monitor_printf(mon, "  last migration: saved %" PRId64 " bytes in %"
+                       PRId64 " us, loaded %" PRId64 " bytes in %" PRId64
+                       " us\n", qdict_get_int(mig, "save-bytes"),
+                       qdict_get_int(mig, "save-ns") / 1000,
+                       qdict_get_int(mig, "load-bytes"),
+                       qdict_get_int(mig, "load-ns") / 1000);
+    }
 
     QLIST_FOREACH_ENTRY(qlist, entry) {
         print_field(mon, qobject_to_qdict(qlist_entry_obj(entry)), 2);
     }
+    if (qdict_haskey(qdict, "guest-state")) {
+        monitor_printf(mon, "  guest state:");
+        print_state_dict(mon, qdict_get_qdict(qdict, "guest-state"), 4);
+    }
+    if (qdict_haskey(qdict, "continue")) {
+        monitor_printf(mon, "  ... continue with %s\n",
+                       qdict_get_str(qdict, "continue"));
+    }
 }
 
-static size_t parse_vmstate(const VMStateDescription *vmsd, void *opaque,
-                            QList *qlist, int full_buffers)
+/* With show, devices that only have a show hook are taken as well */
+static DeviceState *qdev_find_state(const char *path, bool show)
 {
-    VMStateField *field;
-    size_t overall_size = 0;
-
-    field = vmsd->fields;
-    if (vmsd->pre_save) {
-        vmsd->pre_save(opaque);
-    }
-    while(field->name) {
-        if (!field->field_exists ||
-            field->field_exists(opaque, vmsd->version_id)) {
-            void *base_addr = opaque + field->offset;
-            int i, n_elems = 1;
-            int is_array = 1;
-            size_t size = field->size;
-            size_t real_size = 0;
-            size_t dump_size;
-            QDict *qfield = qdict_new();
-            QList *qelems = qlist_new();
-
-            qlist_append_obj(qlist, QOBJECT(qfield));
-
-            if (field->flags & (VMS_BITFIELD))
-            {
-              field->name = field->bit_field_name;
-            }
+    DeviceState *dev;
 
-            qdict_put_obj(qfield, "name",
-                          QOBJECT(qstring_from_str(field->name)));
-            qdict_put_obj(qfield, "elems", QOBJECT(qelems));
+    dev = qdev_find(path, true);
+    if (!dev) {
+        return NULL;
+    }
 
-            if (field->flags & VMS_VBUFFER) {
-                size = *(int32_t *)(opaque + field->size_offset);
-                if (field->flags & VMS_MULTIPLY) {
-                    size *= field->size;
-                }
-            }
-            if (field->start_index) {
-                qdict_put_obj(qfield, "start",
-                              QOBJECT(qstring_from_str(field->start_index)));
-            }
+    if (!dev->info->vmsd && !(show && dev->info->show)) {
+        qerror_report(QERR_DEVICE_NO_STATE, dev->info->name);
+        error_printf_unless_qmp("Note: device may simply lack complete qdev "
+                                "conversion\n");
+        return NULL;
+    }
+    return dev;
+}
+
+/* Look up a device for the device state commands, it must have a vmsd */
+DeviceState *qdev_find_with_state(const char *path)
+{
+    return qdev_find_state(path, false);
+}
+
+/* What the show hook of the device finds, such as rings in guest memory */
+static void device_show_guest_state(DeviceState *dev, QObject *data)
+{
+    QDict *state;
+
+    if (!dev->info->show) {
+        return;
+    }
+    state = qdict_new();
+    dev->info->show(dev, state);
+    qdict_put(qobject_to_qdict(data), "guest-state", state);
+}
+
+/* The fields of the device, if it has a vmsd, and its guest state */
+static void device_show_state(DeviceState *dev, QObject *data, int full)
+{
+    QList *qlist = qlist_new();
+
+    if (dev->info->vmsd) {
+        vmstate_plan_dump(vmstate_plan_get(dev->info->vmsd), dev, qlist,
+                          full);
+    }
+    qdict_put_obj(qobject_to_qdict(data), "fields", QOBJECT(qlist));
+    device_show_guest_state(dev, data);
+}
+
+QObject *device_state_header(DeviceState *dev)
+{
+    const VMStateDescription *vmsd = dev->info->vmsd;
+    VMStateStats save, load;
+    QObject *data;
+    int name_len;
+    char *name;
+
+    name_len = strlen(dev->info->name) + 16;
+    name = qemu_malloc(name_len);
+    snprintf(name, name_len, "%s.%d", dev->info->name, qdev_instance_no(dev));
+    data = qobject_from_jsonf("{ 'device': %s, 'id': %s, 'version': %d }",
+                              name, dev->id ? : "",
+                              vmsd ? vmsd->version_id : 0);
+    qemu_free(name);
+
+    if (!vmsd) {
+        return data;
+    }
+
+    if (vmsd->tracks_changes) {
+        qdict_put(qobject_to_qdict(data), "generation",
+                  qint_from_int(MAX(dev->state_gen, qdev_state_all_gen)));
+    }
+
+    /* What the device cost the last migration, while the guest was stopped */
+    if (vmstate_get_stats(vmsd, dev, &save, &load) == 0 &&
+        (save.bytes || load.bytes)) {
+        qdict_put_obj(qobject_to_qdict(data), "migration", qobject_from_jsonf(
+                          "{ 'save-bytes': %" PRId64 ", 'save-ns': %" PRId64
+                          ", 'load-bytes': %" PRId64 ", 'load-ns': %" PRId64
+                          " }", save.bytes, save.ns, load.bytes, load.ns));
+    }
+    return data;
+}
+
+/* Fills budget from the arguments of device_show.  Returns whether a limit
+   or a continuation token was given, or -1 if an argument is wrong. */
+static int device_show_get_budget(const QDict *qdict, int64_t start_ns,
+                                  VMStateDumpBudget *budget)
+{
+    int64_t max_bytes = qdict_get_try_int(qdict, "max-bytes", 0);
+    int64_t max_elems = qdict_get_try_int(qdict, "max-elems", 0);
+    int64_t max_us = qdict_get_try_int(qdict, "max-us", 0);
+    const char *token = qdict_get_try_str(qdict, "continue");
+    int n = 0;
+
+    if (max_bytes < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "max-bytes",
+                      "a positive number, or 0");
+        return -1;
+    }
+    if (max_elems < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "max-elems",
+                      "a positive number, or 0");
+        return -1;
+    }
+    if (max_us < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "max-us",
+                      "a positive number, or 0");
+        return -1;
+    }
+
+    memset(budget, 0, sizeof(*budget));
+    budget->max_bytes = max_bytes;
+    budget->max_elems = max_elems;
+    budget->deadline = max_us ? start_ns + max_us * 1000 : 0;
+    if (token && (sscanf(token, "%d:%d%n", &budget->field, &budget->elem,
+                         &n) != 2 || token[n])) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "continue",
+                      "a token returned by device_show");
+        return -1;
+    }
+    if ((max_bytes || max_elems || max_us || token) &&
+        qdict_get_try_bool(qdict, "capture", 0)) {
+        qerror_report(QERR_INVALID_PARAMETER, "capture");
+        return -1;
+    }
+    return max_bytes || max_elems || max_us || token;
+}
+
+/* Dump the fields of dev within budget into data, adding the token to
+   continue with if it stops early */
+static int device_show_budgeted(DeviceState *dev, QObject *data, int full,
+                                VMStateDumpBudget *budget)
+{
+    QList *qlist = qlist_new();
+    char token[32];
+    int ret;
+
+    ret = vmstate_plan_dump_budget(vmstate_plan_get(dev->info->vmsd), dev,
+                                   qlist, full, budget);
+    if (ret < 0) {
+        QDECREF(qlist);
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "continue",
+                      "a token returned by device_show for this device");
+        return -1;
+    }
+    qdict_put_obj(qobject_to_qdict(data), "fields", QOBJECT(qlist));
+    if (ret) {
+        snprintf(token, sizeof(token), "%d:%d", budget->field, budget->elem);
+        qdict_put(qobject_to_qdict(data), "continue",
+                  qstring_from_str(token));
+    }
+    return 0;
+}
+
+int do_device_show(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *path = qdict_get_str(qdict, "path");
+    int full = qdict_get_try_bool(qdict, "full", 0);
+    int64_t start_ns = get_clock();
+    VMStateDumpBudget budget;
+    VMStatePlan *plan;
+    DeviceState *dev;
+    QList *qlist;
+    int budgeted;
+
+    trace_device_show(path);
+    budgeted = device_show_get_budget(qdict, start_ns, &budget);
+    dev = budgeted < 0 ? NULL : qdev_find_state(path, true);
+    if (!dev) {
+        trace_device_show_done(path, get_clock() - start_ns, -1);
+        return -1;
+    }
+
+    *ret_data = device_state_header(dev);
+    if (dev->info->vmsd && budgeted) {
+        /* Later pages only have fields */
+        if (!qdict_haskey(qdict, "continue")) {
+            device_show_guest_state(dev, *ret_data);
+        }
+        if (device_show_budgeted(dev, *ret_data, full, &budget) < 0) {
+            qobject_decref(*ret_data);
+            *ret_data = NULL;
+            trace_device_show_done(path, get_clock() - start_ns, -1);
+            return -1;
+        }
+    } else if (dev->info->vmsd && qdict_get_try_bool(qdict, "capture", 0)) {
+        size_t len;
+        void *blob;
+        QemuArena *arena;
+
+        plan = vmstate_plan_get(dev->info->vmsd);
+        blob = vmstate_plan_capture(plan, dev, &len);
+        /* Guest memory is not part of the copy */
+        device_show_guest_state(dev, *ret_data);
+
+        /* Formatting only reads the private copy, let vCPUs run meanwhile;
+           the current arena is only for code under the global mutex */
+        arena = qemu_arena_set_current(NULL);
+        qlist = qlist_new();
+        qemu_mutex_unlock_iothread();
+        vmstate_plan_decode(plan, blob, len, qlist, full);
+        qemu_mutex_lock_iothread();
+        qemu_arena_set_current(arena);
+        qemu_free(blob);
+        qdict_put_obj(qobject_to_qdict(*ret_data), "fields", QOBJECT(qlist));
+    } else {
+        device_show_state(dev, *ret_data, full);
+    }
+
+    trace_device_show_done(path, get_clock() - start_ns, 0);
+    return 0;
+}
+
+typedef struct DeviceShowAll {
+    Monitor *mon;
+    const char *pattern;
+    int64_t since;
+    DeviceCaptureSet *capture;  /* formatted once the tree is walked */
+} DeviceShowAll;
+
+static bool device_name_matches(const char *pattern, const char *name)
+{
+#ifdef CONFIG_FNMATCH
+    return fnmatch(pattern, name, 0) == 0;
+#else
+    return strcmp(pattern, name) == 0;
+#endif
+}
+
+static void *device_show_all_one(DeviceState *dev, void *opaque)
+{
+    DeviceShowAll *s = opaque;
+    QObject *data;
+
+    if ((!dev->info->vmsd && !dev->info->show) ||
+        !qdev_state_changed_since(dev, s->since)) {
+        return NULL;
+    }
 
-            printf ("\nName: %s, field->offset: %d", field->name, field->offset);
-            if (field->flags & VMS_ARRAY) {
-                n_elems = field->num;
-            } else if (field->flags & VMS_VARRAY_INT32) {
-                n_elems = *(int32_t *)(opaque + field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT16) {
-                n_elems = *(uint16_t *)(opaque + field->num_offset);
+    data = device_state_header(dev);
+    if (s->pattern &&
+        !device_name_matches(s->pattern, dev->info->name) &&
+        !device_name_matches(s->pattern,
+                             qdict_get_str(qobject_to_qdict(data), "device")) &&
+        !(dev->id && device_name_matches(s->pattern, dev->id))) {
+        qobject_decref(data);
+        return NULL;
+    }
+
+    if (s->capture) {
+        device_show_guest_state(dev, data);
+        device_capture_add(s->capture, dev, data);
+        return NULL;
+    }
+
+    device_show_state(dev, data, 0);
+
+    /* Send each device right away instead of collecting all of them */
+    if (monitor_cur_is_qmp()) {
+        monitor_stream_append(s->mon, data);
+    } else {
+        device_user_print(s->mon, data);
+    }
+    qobject_decref(data);
+    return NULL;
+}
+
+static void *device_dump_one(DeviceState *dev, void *opaque)
+{
+    FILE *f = opaque;
+    QString *json;
+    QObject *data;
+
+    if (!dev->info->vmsd && !dev->info->show) {
+        return NULL;
+    }
+
+    data = device_state_header(dev);
+    device_show_state(dev, data, 1);
+
+    json = qobject_to_json(data);
+    fprintf(f, "%s\n", qstring_get_str(json));
+    QDECREF(json);
+    qobject_decref(data);
+    return NULL;
+}
+
+/* One line per device, each the JSON object device_show would return */
+void qdev_dump_state(FILE *f)
+{
+    qdev_iterate_recursive(NULL, device_dump_one, f);
+}
+
+int do_device_show_all(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    DeviceShowAll s = {
+        .mon = mon,
+        .pattern = qdict_get_try_str(qdict, "pattern"),
+        .since = qdict_get_try_int(qdict, "since", 0),
+    };
+    int qmp = monitor_cur_is_qmp();
+    int i;
+
+    if (qdict_get_try_bool(qdict, "capture", 0)) {
+        s.capture = device_capture_new();
+    }
+    if (qmp) {
+        monitor_stream_begin(mon);
+    }
+    qdev_iterate_recursive(NULL, device_show_all_one, &s);
+    if (s.capture) {
+        device_capture_format(s.capture, 0, qmp,
+                              qmp && monitor_stream_pretty(mon));
+
+        for (i = 0; i < device_capture_count(s.capture); i++) {
+            if (qmp) {
+                monitor_stream_append_json(mon,
+                                           device_capture_json(s.capture, i));
             } else {
-                is_array = 0;
-            }
-            if (field->flags & VMS_POINTER) {
-                base_addr = *(void **)base_addr + field->start;
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-                QList *sub_elems = qelems;
-                int val;
-
-                if (is_array) {
-                    sub_elems = qlist_new();
-                    qlist_append_obj(qelems, QOBJECT(sub_elems));
-                }
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    real_size = parse_vmstate(field->vmsd, addr,
-                                              sub_elems, full_buffers);
-                } else {
-                    real_size = size;
-                    if (field->flags & (VMS_BUFFER | VMS_VBUFFER)) {
-                        dump_size = (full_buffers || size <= 16) ? size : 16;
-                        qlist_append_obj(sub_elems,
-                                QOBJECT(qbuffer_from_data(addr, dump_size)));
-                    } else {
-
-                        if (field->flags & VMS_QUEUE)
-                        {
-                          //QLIST_FOREACH_ENTRY(field->name, entry) {
-                            field->queue_print_cb ((void *) addr);  
-//                          }
-                        }
-                        else
-                        {
-                          switch (size) {
-                            case 1:
-                              val = *(uint8_t *)addr;
-                              break;
-                            case 2:
-                              val = *(uint16_t *)addr;
-                              break;
-                            case 4:
-                              val = *(uint32_t *)addr;
-                              break;
-                            case 8:
-                              val = *(uint64_t *)addr;
-                              break;
-                            default:
-                              assert(0);
-                          }
-                          
-                          // If it's a bitfield, we apply the
-                          // mask on the value and only specify
-                          // if the bit is set or not.
-                          if (field->flags & (VMS_BITFIELD))
-                            {
-                              val = val & (field->bit_field_mask);
-                              val = !(val == 0);
-                            }
-   
-                          qlist_append_obj(sub_elems,
-                                           QOBJECT(qint_from_int(val)));
-                        }
-                    }
-                }
-                overall_size += real_size;
+                device_user_print(mon, device_capture_data(s.capture, i));
             }
-            qdict_put_obj(qfield, "size", QOBJECT(qint_from_int(real_size)));
         }
-        field++;
+        device_capture_free(s.capture);
+    }
+    if (qmp) {
+        monitor_stream_end(mon);
     }
-    return overall_size;
+    return 0;
 }
 
+/* Default and maximum number of elements returned by device_queue */
+#define DEVICE_QUEUE_COUNT     64
+#define DEVICE_QUEUE_MAX_COUNT 4096
 
-int do_device_show(Monitor *mon, const QDict *qdict, QObject **ret_data)
+int do_device_queue(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     const char *path = qdict_get_str(qdict, "path");
-    const VMStateDescription *vmsd;
+    const char *field = qdict_get_str(qdict, "field");
+    int64_t start = qdict_get_try_int(qdict, "start", 0);
+    int64_t count = qdict_get_try_int(qdict, "count", DEVICE_QUEUE_COUNT);
+    const VMStatePlan *plan;
     DeviceState *dev;
-    QList *qlist;
-    int name_len;
-    char *name;
+    QDict *qfield;
+    QList *qelems, *qlist;
+    int more;
 
-    dev = qdev_find(path, true);
+    if (start < 0 || start > INT_MAX) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "start",
+                      "a positive number");
+        return -1;
+    }
+    if (count <= 0 || count > DEVICE_QUEUE_MAX_COUNT) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "count",
+                      "a number between 1 and 4096");
+        return -1;
+    }
+
+    dev = qdev_find_with_state(path);
     if (!dev) {
         return -1;
     }
 
-    vmsd = dev->info->vmsd;
-    if (!vmsd) {
-        qerror_report(QERR_DEVICE_NO_STATE, dev->info->name);
-        error_printf_unless_qmp("Note: device may simply lack complete qdev "
-                                "conversion\n");
+    plan = vmstate_plan_get(dev->info->vmsd);
+    qelems = qlist_new();
+    more = vmstate_plan_dump_queue(plan, dev, field, start, count, qelems,
+                                   qdict_get_try_bool(qdict, "full", 0));
+    if (more < 0) {
+        QDECREF(qelems);
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "field",
+                      "a queue field of the device");
         return -1;
     }
 
-    name_len = strlen(dev->info->name) + 16;
-    name = qemu_malloc(name_len);
-    snprintf(name, name_len, "%s.%d", dev->info->name, qdev_instance_no(dev));
-    *ret_data = qobject_from_jsonf("{ 'device': %s, 'id': %s, 'version': %d }",
-                                   name, dev->id ? : "", vmsd->version_id);
-    qemu_free(name);
+    qfield = qdict_new();
+    qdict_put(qfield, "name", qstring_from_str(field));
+    qdict_put(qfield, "size", qint_from_int(0));
+    qdict_put(qfield, "elems", qelems);
+    if (more) {
+        qdict_put(qfield, "more", qbool_from_int(1));
+    }
     qlist = qlist_new();
-    parse_vmstate(vmsd, dev, qlist, 0 /*qdict_get_int(qdict, "full")*/);
-    qdict_put_obj(qobject_to_qdict(*ret_data), "fields", QOBJECT(qlist));
+    qlist_append(qlist, qfield);
+
+    *ret_data = device_state_header(dev);
+    qdict_put(qobject_to_qdict(*ret_data), "first", qint_from_int(start));
+    qdict_put(qobject_to_qdict(*ret_data), "fields", qlist);
+    return 0;
+}
+
+/* Default window returned by device_buffer when no length is given */
+#define DEVICE_BUFFER_CHUNK (64 * 1024)
+
+void device_buffer_user_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    int64_t offset = qdict_get_int(qdict, "offset");
+    QBuffer *qbuf;
+    const uint8_t *buf;
+    size_t i, len;
+
+    monitor_printf(mon, "%s: %" PRId64 " of %" PRId64 " bytes at %" PRId64
+                   "\n", qdict_get_str(qdict, "field"),
+                   qdict_get_int(qdict, "length"),
+                   qdict_get_int(qdict, "total"), offset);
+    if (!qdict_haskey(qdict, "data")) {
+        return;
+    }
+    qbuf = qobject_to_qbuffer(qdict_get(qdict, "data"));
+    buf = qbuffer_get_data(qbuf);
+    len = qbuffer_get_size(qbuf);
+    for (i = 0; i < len; i++) {
+        if (i % 16 == 0) {
+            monitor_printf(mon, "%08" PRIx64 ":", offset + i);
+        }
+        monitor_printf(mon, " %02x", buf[i]);
+        if (i % 16 == 15 || i == len - 1) {
+            monitor_printf(mon, "\n");
+        }
+    }
+}
+
+int do_device_buffer(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *path = qdict_get_str(qdict, "path");
+    const char *field = qdict_get_str(qdict, "field");
+    const char *fdname = qdict_get_try_str(qdict, "fd");
+    int64_t offset = qdict_get_try_int(qdict, "offset", 0);
+    int64_t length;
+    DeviceState *dev;
+    uint8_t *addr;
+    size_t total;
+    QDict *qresult;
+
+    dev = qdev_find_with_state(path);
+    if (!dev) {
+        return -1;
+    }
+
+    addr = vmstate_plan_lookup(vmstate_plan_get(dev->info->vmsd), dev, field,
+                               &total);
+    if (!addr) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "field",
+                      "a field of the device");
+        return -1;
+    }
+    if (offset < 0 || offset > total) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "offset",
+                      "an offset within the field");
+        return -1;
+    }
+
+    /* Inline data is returned in bounded windows, a file descriptor gets
+       everything up to the end of the field by default */
+    length = total - offset;
+    if (!fdname) {
+        length = MIN(length, DEVICE_BUFFER_CHUNK);
+    }
+    length = MIN(qdict_get_try_int(qdict, "length", length), total - offset);
+    if (length < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "length",
+                      "a positive number");
+        return -1;
+    }
+
+    if (fdname) {
+        int fd = monitor_get_fd(mon, fdname);
+        ssize_t ret;
+
+        if (fd == -1) {
+            qerror_report(QERR_FD_NOT_FOUND, fdname);
+            return -1;
+        }
+        ret = qemu_write_full(fd, addr + offset, length);
+        close(fd);
+        if (ret != length) {
+            qerror_report(QERR_UNDEFINED_ERROR);
+            return -1;
+        }
+    }
+
+    qresult = qdict_new();
+    qdict_put(qresult, "field", qstring_from_str(field));
+    qdict_put(qresult, "offset", qint_from_int(offset));
+    qdict_put(qresult, "length", qint_from_int(length));
+    qdict_put(qresult, "total", qint_from_int(total));
+    if (!fdname) {
+        qdict_put(qresult, "data", qbuffer_from_data(addr + offset, length));
+    }
+    *ret_data = QOBJECT(qresult);
+    return 0;
+}
+
+void device_snapshot_user_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    QBuffer *qbuf = qobject_to_qbuffer(qdict_get(qdict, "data"));
+
+    monitor_printf(mon, "dev: %s, id \"%s\", version %" PRId64
+                   ", %zu bytes\n",
+                   qdict_get_str(qdict, "device"),
+                   qdict_get_str(qdict, "id"),
+                   qdict_get_int(qdict, "version"),
+                   qbuffer_get_size(qbuf));
+}
+
+int do_device_snapshot(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *path = qdict_get_str(qdict, "path");
+    DeviceState *dev;
+    void *data;
+    size_t len;
 
+    dev = qdev_find_with_state(path);
+    if (!dev) {
+        return -1;
+    }
+
+    *ret_data = device_state_header(dev);
+    data = vmstate_plan_snapshot(vmstate_plan_get(dev->info->vmsd), dev, &len);
+    qdict_put(qobject_to_qdict(*ret_data), "data", qbuffer_from_raw(data, len));
+
+    return 0;
+}
+
+static int print_schema_entries(Monitor *mon, QListEntry *entry, int n,
+                                int indent)
+{
+    int done = 0;
+
+    while (entry && done < n) {
+        QDict *qentry = qobject_to_qdict(qlist_entry_obj(entry));
+        int children = qdict_get_int(qentry, "children");
+
+        monitor_printf(mon, "%*c%s: %s, size %" PRId64 ", elems %" PRId64
+                       "%s%s%s\n", indent, ' ',
+                       qdict_get_str(qentry, "name"),
+                       qdict_get_str(qentry, "kind"),
+                       qdict_get_int(qentry, "size"),
+                       qdict_get_int(qentry, "elems"),
+                       qdict_get_bool(qentry, "optional") ? ", optional" : "",
+                       qdict_get_bool(qentry, "variable-elems") ?
+                       ", variable elems" : "",
+                       qdict_get_bool(qentry, "variable-size") ?
+                       ", variable size" : "");
+        entry = QTAILQ_NEXT(entry, next);
+        done++;
+        if (children) {
+            int i = print_schema_entries(mon, entry, children, indent + 2);
+
+            done += i;
+            while (i--) {
+                entry = QTAILQ_NEXT(entry, next);
+            }
+        }
+    }
+    return done;
+}
+
+static void print_schema_name(QObject *obj, void *opaque)
+{
+    monitor_printf(opaque, " %s", qstring_get_str(qobject_to_qstring(obj)));
+}
+
+void device_schema_user_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    QList *qlist = qdict_get_qlist(qdict, "entries");
+
+    monitor_printf(mon, "vmsd: %s, version %" PRId64 "\n",
+                   qdict_get_str(qdict, "name"),
+                   qdict_get_int(qdict, "version"));
+    print_schema_entries(mon, QTAILQ_FIRST(&qlist->head), INT_MAX, 2);
+    if (qdict_haskey(qdict, "subsections")) {
+        monitor_printf(mon, "  subsections:");
+        qlist_iter(qdict_get_qlist(qdict, "subsections"),
+                   print_schema_name, mon);
+        monitor_printf(mon, "\n");
+    }
+}
+
+int do_device_schema(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *path = qdict_get_str(qdict, "path");
+    DeviceState *dev;
+
+    dev = qdev_find_with_state(path);
+    if (!dev) {
+        return -1;
+    }
+
+    *ret_data = vmstate_plan_schema(vmstate_plan_get(dev->info->vmsd));
+    return 0;
+}
+
+typedef struct VMStateSchemaSet {
+    const VMStateDescription **vmsds;
+    int n;
+    QList *unstructured;
+} VMStateSchemaSet;
+
+/* Add vmsd, and every description it refers to, to the set */
+static void vmstate_schemas_add(VMStateSchemaSet *set,
+                                const VMStateDescription *vmsd)
+{
+    const VMStateSubsection *sub;
+    VMStateField *field;
+    int i;
+
+    for (i = 0; i < set->n; i++) {
+        if (set->vmsds[i] == vmsd) {
+            return;
+        }
+    }
+    set->vmsds = qemu_realloc(set->vmsds, (set->n + 1) * sizeof(vmsd));
+    set->vmsds[set->n++] = vmsd;
+
+    for (field = vmsd->fields; field->name; field++) {
+        if ((field->flags & (VMS_STRUCT | VMS_QUEUE)) && field->vmsd) {
+            vmstate_schemas_add(set, field->vmsd);
+        }
+    }
+    for (sub = vmsd->subsections; sub && sub->vmsd; sub++) {
+        vmstate_schemas_add(set, sub->vmsd);
+    }
+}
+
+static void vmstate_schemas_add_section(const char *idstr,
+                                        const VMStateDescription *vmsd,
+                                        void *opaque)
+{
+    VMStateSchemaSet *set = opaque;
+    QListEntry *e;
+
+    if (vmsd) {
+        vmstate_schemas_add(set, vmsd);
+        return;
+    }
+    QLIST_FOREACH_ENTRY(set->unstructured, e) {
+        if (!strcmp(qstring_get_str(qobject_to_qstring(e->value)), idstr)) {
+            return;
+        }
+    }
+    qlist_append(set->unstructured, qstring_from_str(idstr));
+}
+
+/* By name and version, so that the order does not depend on the order in
+   which devices were created */
+static int vmstate_schemas_compare(const void *a, const void *b)
+{
+    const VMStateDescription *va = *(const VMStateDescription **)a;
+    const VMStateDescription *vb = *(const VMStateDescription **)b;
+    int ret = strcmp(va->name, vb->name);
+
+    if (ret) {
+        return ret;
+    }
+    return va->version_id - vb->version_id;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t vmstate_schemas_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void vmstate_schemas_user_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    QListEntry *e;
+
+    monitor_printf(mon, "hash: %s\n", qdict_get_str(qdict, "hash"));
+    if (!qdict_haskey(qdict, "schemas")) {
+        return;
+    }
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(qdict, "schemas"), e) {
+        QDict *qschema = qobject_to_qdict(e->value);
+        QList *qentries = qdict_get_qlist(qschema, "entries");
+        int n = 0;
+        QListEntry *entry;
+
+        QLIST_FOREACH_ENTRY(qentries, entry) {
+            n++;
+        }
+        monitor_printf(mon, "%s, version %" PRId64 ", %d entries",
+                       qdict_get_str(qschema, "name"),
+                       qdict_get_int(qschema, "version"), n);
+        if (qdict_haskey(qschema, "subsections")) {
+            monitor_printf(mon, ", subsections:");
+            qlist_iter(qdict_get_qlist(qschema, "subsections"),
+                       print_schema_name, mon);
+        }
+        monitor_printf(mon, "\n");
+    }
+    if (!qlist_empty(qdict_get_qlist(qdict, "unstructured"))) {
+        monitor_printf(mon, "without description:");
+        qlist_iter(qdict_get_qlist(qdict, "unstructured"),
+                   print_schema_name, mon);
+        monitor_printf(mon, "\n");
+    }
+}
+
+int do_vmstate_schemas(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *known = qdict_get_try_str(qdict, "hash");
+    VMStateSchemaSet set = { .unstructured = qlist_new() };
+    QList *qschemas = qlist_new();
+    QDict *qresult;
+    QString *json;
+    DeviceInfo *info;
+    char hash[17];
+    int i;
+
+    vmstate_foreach_section(vmstate_schemas_add_section, &set);
+    for (info = device_info_list; info; info = info->next) {
+        if (info->vmsd) {
+            vmstate_schemas_add(&set, info->vmsd);
+        }
+    }
+    qsort(set.vmsds, set.n, sizeof(*set.vmsds), vmstate_schemas_compare);
+    for (i = 0; i < set.n; i++) {
+        qlist_append_obj(qschemas,
+                         vmstate_plan_schema(vmstate_plan_get(set.vmsds[i])));
+    }
+    qemu_free(set.vmsds);
+
+    qresult = qdict_new();
+    qdict_put(qresult, "schemas", qschemas);
+    qdict_put(qresult, "unstructured", set.unstructured);
+    json = qobject_to_json(QOBJECT(qresult));
+    snprintf(hash, sizeof(hash), "%016" PRIx64,
+             vmstate_schemas_hash(qstring_get_str(json)));
+    QDECREF(json);
+
+    if (known && !strcmp(known, hash)) {
+        QDECREF(qresult);
+        qresult = qdict_new();
+    }
+    qdict_put(qresult, "hash", qstring_from_str(hash));
+    *ret_data = QOBJECT(qresult);
     return 0;
 }
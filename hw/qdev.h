@@ -43,8 +43,10 @@ struct DeviceState {
     QLIST_HEAD(, BusState) child_bus;
     int num_child_bus;
     QLIST_ENTRY(DeviceState) sibling;
+    QLIST_ENTRY(DeviceState) id_link;   /* in the index of IDs, if id */
     int instance_id_alias;
     int alias_required_for_version;
+    uint64_t state_gen;                 /* see qdev_state_changed() */
 };
 
 typedef void (*bus_dev_printfn)(Monitor *mon, DeviceState *dev, int indent);
@@ -146,6 +148,7 @@ typedef int (*qdev_initfn)(DeviceState *dev, DeviceInfo *info);
 typedef int (*qdev_event)(DeviceState *dev);
 typedef void (*qdev_resetfn)(DeviceState *dev);
 typedef void *(*qdev_iteratefn)(DeviceState *dev, void *opaque);
+typedef void (*qdev_showfn)(DeviceState *dev, QDict *state);
 
 
 struct DeviceInfo {
@@ -162,6 +165,9 @@ struct DeviceInfo {
 
     /* device state */
     const VMStateDescription *vmsd;
+    /* adds state that vmsd cannot describe, such as structures in guest
+       memory, to the "guest-state" of device_show */
+    qdev_showfn show;
 
     /* Private to qdev / bus.  */
     qdev_initfn init;
@@ -169,6 +175,9 @@ struct DeviceInfo {
     qdev_event exit;
     BusInfo *bus_info;
     struct DeviceInfo *next;
+    /* device and bus properties sorted by name, built on first lookup */
+    Property **prop_table;
+    int prop_count;
 };
 extern DeviceInfo *device_info_list;
 
@@ -218,6 +227,56 @@ void do_info_qdm(Monitor *mon);
 int do_device_add(Monitor *mon, const QDict *qdict, QObject **ret_data);
 int do_device_del(Monitor *mon, const QDict *qdict, QObject **ret_data);
 int do_device_show(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_device_show_all(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_device_queue(Monitor *mon, const QDict *qdict, QObject **ret_data);
+void device_buffer_user_print(Monitor *mon, const QObject *data);
+int do_device_buffer(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_device_snapshot(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_device_schema(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_vmstate_schemas(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_vmstate_bench(Monitor *mon, const QDict *qdict, QObject **ret_data);
+DeviceState *qdev_find_with_state(const char *path);
+QObject *device_state_header(DeviceState *dev);
+void qdev_dump_state(FILE *f);
+
+/*
+ * Generations of device state.  Every tracked change takes the next
+ * generation, so that a reader can tell whether a device changed since
+ * it last looked without comparing its state.  Only devices whose vmsd
+ * sets tracks_changes are tracked, the others are always assumed changed.
+ */
+extern uint64_t qdev_state_generation;
+
+static inline void qdev_state_changed(DeviceState *dev)
+{
+    dev->state_gen = ++qdev_state_generation;
+}
+
+/* The state of all devices was replaced, by loading a saved one */
+void qdev_state_changed_all(void);
+bool qdev_state_changed_since(DeviceState *dev, uint64_t gen);
+
+/*** qdev-watch.c ***/
+
+void device_watch_remove_dev(DeviceState *dev);
+void device_watch_user_print(Monitor *mon, const QObject *data);
+int do_device_watch(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_device_unwatch(Monitor *mon, const QDict *qdict, QObject **ret_data);
+
+/*** qdev-sample.c ***/
+
+void device_sample_remove_dev(DeviceState *dev);
+void device_history_user_print(Monitor *mon, const QObject *data);
+int do_device_sample(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_device_history(Monitor *mon, const QDict *qdict, QObject **ret_data);
+
+/*** qdev-export.c ***/
+
+int do_device_export(Monitor *mon, const QDict *qdict, QObject **ret_data);
+
+/*** qdev-shm.c ***/
+
+int do_device_shm(Monitor *mon, const QDict *qdict, QObject **ret_data);
 
 /*** qdev-properties.c ***/
 
@@ -332,6 +391,12 @@ char *qdev_get_fw_dev_path(DeviceState *dev);
 /* This is a nasty hack to allow passing a NULL bus to qdev_create.  */
 extern struct BusInfo system_bus_info;
 int qdev_instance_no(DeviceState *dev);
+/* Changes whenever a device or bus comes or goes */
+unsigned int qdev_topology_generation(void);
 void device_user_print(Monitor *mon, const QObject *data);
+void device_snapshot_user_print(Monitor *mon, const QObject *data);
+void device_schema_user_print(Monitor *mon, const QObject *data);
+void vmstate_schemas_user_print(Monitor *mon, const QObject *data);
+void vmstate_bench_user_print(Monitor *mon, const QObject *data);
 
 #endif
@@ -19,6 +19,7 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "qemu-timer.h"
 #include "qxl.h"
 
 static void qxl_flip(PCIQXLDevice *qxl, QXLRect *rect)
@@ -70,15 +71,132 @@ void qxl_render_resize(PCIQXLDevice *qxl)
     }
 }
 
+/*
+ * update_area makes the spice worker render all the commands queued for
+ * the primary surface, which can take a while.  It runs in a thread of
+ * its own so that the iothread only collects the rectangles of the
+ * previous update at each display refresh and asks for the next one.
+ */
+static void *qxl_render_thread(void *opaque)
+{
+    PCIQXLDevice *qxl = opaque;
+    QXLRect dirty[32], update;
+    int64_t ns;
+    int i, n;
+
+    qemu_mutex_lock(&qxl->render.lock);
+    for (;;) {
+        while (!qxl->render.pending) {
+            qemu_cond_wait(&qxl->render.cond, &qxl->render.lock);
+        }
+        qxl->render.pending = 0;
+        qxl->render.busy = 1;
+        qemu_mutex_unlock(&qxl->render.lock);
+
+        update.left   = 0;
+        update.right  = qxl->guest_primary.surface.width;
+        update.top    = 0;
+        update.bottom = qxl->guest_primary.surface.height;
+
+        memset(dirty, 0, sizeof(dirty));
+        qxl->ssd.worker->update_area(qxl->ssd.worker, 0, &update,
+                                     dirty, ARRAY_SIZE(dirty), 1);
+
+        for (n = 0; n < ARRAY_SIZE(dirty); n++) {
+            if (qemu_spice_rect_is_empty(dirty+n)) {
+                break;
+            }
+            if (qxl->guest_primary.flipped) {
+                qxl_flip(qxl, dirty+n);
+            }
+        }
+
+        qemu_mutex_lock(&qxl->render.lock);
+        for (i = 0; i < n; i++) {
+            if (qxl->render.num_dirty == ARRAY_SIZE(qxl->render.dirty)) {
+                /* not shown yet and too many: redraw everything */
+                qxl->render.dirty[0] = update;
+                qxl->render.num_dirty = 1;
+                break;
+            }
+            qxl->render.dirty[qxl->render.num_dirty++] = dirty[i];
+        }
+        qxl->render.busy = 0;
+
+        ns = get_clock() - qxl->render.requested;
+        qxl->stats.renders++;
+        qxl->stats.render_ns_sum += ns;
+        qxl->stats.render_ns_last = ns;
+        if (ns > qxl->stats.render_ns_max) {
+            qxl->stats.render_ns_max = ns;
+        }
+        qemu_cond_broadcast(&qxl->render.cond);
+    }
+    return NULL;
+}
+
+void qxl_render_init(PCIQXLDevice *qxl)
+{
+    qemu_mutex_init(&qxl->render.lock);
+    qemu_cond_init(&qxl->render.cond);
+    qemu_thread_create(&qxl->render.thread, qxl_render_thread, qxl);
+    qxl->render.started = 1;
+}
+
+/* Wait until the update asked for has been rendered.  Must precede
+   anything that destroys or replaces the primary surface.  */
+void qxl_render_wait(PCIQXLDevice *qxl)
+{
+    if (!qxl->render.started) {
+        return;
+    }
+    qemu_mutex_unlock_iothread();
+    qemu_mutex_lock(&qxl->render.lock);
+    while (qxl->render.pending || qxl->render.busy) {
+        qemu_cond_wait(&qxl->render.cond, &qxl->render.lock);
+    }
+    qemu_mutex_unlock(&qxl->render.lock);
+    qemu_mutex_lock_iothread();
+}
+
+/* Show what the render thread has finished, ask for the next update */
+static void qxl_render_collect(PCIQXLDevice *qxl, int request)
+{
+    VGACommonState *vga = &qxl->vga;
+    QXLRect dirty[ARRAY_SIZE(qxl->render.dirty)];
+    int i, n;
+
+    qemu_mutex_lock(&qxl->render.lock);
+    n = qxl->render.num_dirty;
+    memcpy(dirty, qxl->render.dirty, n * sizeof(dirty[0]));
+    qxl->render.num_dirty = 0;
+    if (request && qxl->guest_primary.commands &&
+        !qxl->render.pending && !qxl->render.busy) {
+        qxl->guest_primary.commands = 0;
+        qxl->render.pending = 1;
+        qxl->render.requested = get_clock();
+        qemu_cond_broadcast(&qxl->render.cond);
+    }
+    qemu_mutex_unlock(&qxl->render.lock);
+
+    for (i = 0; i < n; i++) {
+        dpy_update(vga->ds,
+                   dirty[i].left, dirty[i].top,
+                   dirty[i].right - dirty[i].left,
+                   dirty[i].bottom - dirty[i].top);
+    }
+}
+
 void qxl_render_update(PCIQXLDevice *qxl)
 {
     VGACommonState *vga = &qxl->vga;
-    QXLRect dirty[32], update;
     void *ptr;
-    int i;
 
     if (qxl->guest_primary.resized) {
+        /* the thread may still be flipping into the old buffer */
+        qxl_render_wait(qxl);
         qxl->guest_primary.resized = 0;
+        qxl->render.num_dirty = 0;
 
         if (qxl->guest_primary.flipped) {
             qemu_free(qxl->guest_primary.flipped);
@@ -113,32 +231,16 @@ void qxl_render_update(PCIQXLDevice *qxl)
         dpy_resize(vga->ds);
     }
 
-    if (!qxl->guest_primary.commands) {
-        return;
-    }
-    qxl->guest_primary.commands = 0;
-
-    update.left   = 0;
-    update.right  = qxl->guest_primary.surface.width;
-    update.top    = 0;
-    update.bottom = qxl->guest_primary.surface.height;
-
-    memset(dirty, 0, sizeof(dirty));
-    qxl->ssd.worker->update_area(qxl->ssd.worker, 0, &update,
-                                 dirty, ARRAY_SIZE(dirty), 1);
+    qxl_render_collect(qxl, 1);
+}
 
-    for (i = 0; i < ARRAY_SIZE(dirty); i++) {
-        if (qemu_spice_rect_is_empty(dirty+i)) {
-            break;
-        }
-        if (qxl->guest_primary.flipped) {
-            qxl_flip(qxl, dirty+i);
-        }
-        dpy_update(vga->ds,
-                   dirty[i].left, dirty[i].top,
-                   dirty[i].right - dirty[i].left,
-                   dirty[i].bottom - dirty[i].top);
-    }
+/* For screen dumps: render everything queued so far before returning */
+void qxl_render_update_sync(PCIQXLDevice *qxl)
+{
+    qxl_render_wait(qxl);
+    qxl_render_update(qxl);
+    qxl_render_wait(qxl);
+    qxl_render_collect(qxl, 0);
 }
 
 static QEMUCursor *qxl_cursor(PCIQXLDevice *qxl, QXLCursor *cursor)
@@ -24,6 +24,7 @@
 #include "qemu-timer.h"
 #include "qemu-queue.h"
 #include "monitor.h"
+#include "qemu-objects.h"
 #include "sysemu.h"
 
 #include "qxl.h"
@@ -118,6 +119,8 @@ static QXLMode qxl_modes[] = {
 };
 
 static PCIQXLDevice *qxl0;
+static QTAILQ_HEAD(, PCIQXLDevice) qxl_devices =
+    QTAILQ_HEAD_INITIALIZER(qxl_devices);
 
 static void qxl_send_events(PCIQXLDevice *d, uint32_t events);
 static void qxl_destroy_primary(PCIQXLDevice *d);
@@ -374,6 +377,7 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
             qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
         }
         qxl->guest_primary.commands++;
+        qxl->stats.commands++;
         qxl_track_command(qxl, ext);
         qxl_log_command(qxl, "cmd", ext);
         return true;
@@ -794,6 +798,7 @@ static void qxl_reset_memslots(PCIQXLDevice *d)
 static void qxl_reset_surfaces(PCIQXLDevice *d)
 {
     dprint(d, 1, "%s:\n", __FUNCTION__);
+    qxl_render_wait(d);
     d->mode = QXL_MODE_UNDEFINED;
     qemu_mutex_unlock_iothread();
     d->ssd.worker->destroy_surfaces(d->ssd.worker);
@@ -829,6 +834,7 @@ static void qxl_create_guest_primary(PCIQXLDevice *qxl, int loadvm)
     QXLSurfaceCreate *sc = &qxl->guest_primary.surface;
 
     assert(qxl->mode != QXL_MODE_NATIVE);
+    qxl_render_wait(qxl);
     qxl_exit_vga_mode(qxl);
 
     dprint(qxl, 1, "%s: %dx%d\n", __FUNCTION__,
@@ -865,6 +871,7 @@ static void qxl_destroy_primary(PCIQXLDevice *d)
 
     dprint(d, 1, "%s\n", __FUNCTION__);
 
+    qxl_render_wait(d);
     d->mode = QXL_MODE_UNDEFINED;
     qemu_mutex_unlock_iothread();
     d->ssd.worker->destroy_primary_surface(d->ssd.worker, 0);
@@ -915,6 +922,36 @@ static void qxl_set_mode(PCIQXLDevice *d, int modenr, int loadvm)
     qxl_rom_set_dirty(d);
 }
 
+/*
+ * Guest notifies are coalesced: the worker is woken once per main loop
+ * iteration and then takes every command queued on the rings in one go.
+ */
+static void qxl_wakeup_bh(void *opaque)
+{
+    PCIQXLDevice *d = opaque;
+
+    d->wakeup_pending = 0;
+    d->stats.wakeups++;
+    d->ssd.worker->wakeup(d->ssd.worker);
+}
+
+static void qxl_wakeup(PCIQXLDevice *d)
+{
+    if (!d->wakeup_pending) {
+        d->wakeup_pending = 1;
+        qemu_bh_schedule(d->wakeup_bh);
+    }
+}
+
+/* Synchronous requests to the worker must see the commands queued before */
+static void qxl_wakeup_flush(PCIQXLDevice *d)
+{
+    if (d->wakeup_pending) {
+        qemu_bh_cancel(d->wakeup_bh);
+        qxl_wakeup_bh(d);
+    }
+}
+
 static void ioport_write(void *opaque, uint32_t addr, uint32_t val)
 {
     PCIQXLDevice *d = opaque;
@@ -938,6 +975,7 @@ static void ioport_write(void *opaque, uint32_t addr, uint32_t val)
     case QXL_IO_UPDATE_AREA:
     {
         QXLRect update = d->ram->update_area;
+        qxl_wakeup_flush(d);
         qemu_mutex_unlock_iothread();
         d->ssd.worker->update_area(d->ssd.worker, d->ram->update_surface,
                                    &update, NULL, 0, 0);
@@ -945,10 +983,20 @@ static void ioport_write(void *opaque, uint32_t addr, uint32_t val)
         break;
     }
     case QXL_IO_NOTIFY_CMD:
-        d->ssd.worker->wakeup(d->ssd.worker);
+    {
+        QXLCommandRing *ring = &d->ram->cmd_ring;
+        uint32_t depth = ring->prod - ring->cons;
+
+        d->stats.notifies++;
+        d->stats.ring_depth_sum += depth;
+        if (depth > d->stats.ring_depth_max) {
+            d->stats.ring_depth_max = depth;
+        }
+        qxl_wakeup(d);
         break;
+    }
     case QXL_IO_NOTIFY_CURSOR:
-        d->ssd.worker->wakeup(d->ssd.worker);
+        qxl_wakeup(d);
         break;
     case QXL_IO_UPDATE_IRQ:
         qxl_set_irq(d);
@@ -1141,7 +1189,7 @@ static void qxl_hw_screen_dump(void *opaque, const char *filename)
     switch (qxl->mode) {
     case QXL_MODE_COMPAT:
     case QXL_MODE_NATIVE:
-        qxl_render_update(qxl);
+        qxl_render_update_sync(qxl);
         ppm_save(filename, qxl->ssd.ds->surface);
         break;
     case QXL_MODE_VGA:
@@ -1166,6 +1214,10 @@ static void qxl_hw_text_update(void *opaque, console_ch_t *chardata)
 static void qxl_vm_change_state_handler(void *opaque, int running, int reason)
 {
     PCIQXLDevice *qxl = opaque;
+
+    if (!running) {
+        qxl_render_wait(qxl);
+    }
     qemu_spice_vm_change_state_handler(&qxl->ssd, running, reason);
 
     if (!running && qxl->mode == QXL_MODE_NATIVE) {
@@ -1177,6 +1229,87 @@ static void qxl_vm_change_state_handler(void *opaque, int running, int reason)
     }
 }
 
+/* monitor */
+
+static const char *qxl_mode_names[] = {
+    [QXL_MODE_UNDEFINED] = "undefined",
+    [QXL_MODE_VGA]       = "vga",
+    [QXL_MODE_COMPAT]    = "compat",
+    [QXL_MODE_NATIVE]    = "native",
+};
+
+static void qxl_info_iter(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *qdict = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "qxl-%" PRId64 ": mode %s\n",
+                   qdict_get_int(qdict, "id"), qdict_get_str(qdict, "mode"));
+    monitor_printf(mon, "  command ring: %" PRId64 " notifies, %" PRId64
+                   " wakeups, %" PRId64 " commands,"
+                   " depth avg %.1f max %" PRId64 "\n",
+                   qdict_get_int(qdict, "notifies"),
+                   qdict_get_int(qdict, "wakeups"),
+                   qdict_get_int(qdict, "commands"),
+                   qdict_get_double(qdict, "ring-depth-avg"),
+                   qdict_get_int(qdict, "ring-depth-max"));
+    if (qdict_haskey(qdict, "renders")) {
+        monitor_printf(mon, "  local render: %" PRId64 " updates,"
+                       " latency avg %" PRId64 " us, max %" PRId64
+                       " us, last %" PRId64 " us\n",
+                       qdict_get_int(qdict, "renders"),
+                       qdict_get_int(qdict, "render-avg-us"),
+                       qdict_get_int(qdict, "render-max-us"),
+                       qdict_get_int(qdict, "render-last-us"));
+    }
+}
+
+void do_info_qxl_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No qxl device\n");
+        return;
+    }
+    qlist_iter(list, qxl_info_iter, mon);
+}
+
+void do_info_qxl(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+    PCIQXLDevice *d;
+
+    QTAILQ_FOREACH(d, &qxl_devices, next) {
+        struct qxl_stats *st = &d->stats;
+        QDict *qdict = qdict_new();
+
+        qdict_put(qdict, "id", qint_from_int(d->id));
+        qdict_put(qdict, "mode", qstring_from_str(qxl_mode_names[d->mode]));
+        qdict_put(qdict, "notifies", qint_from_int(st->notifies));
+        qdict_put(qdict, "wakeups", qint_from_int(st->wakeups));
+        qdict_put(qdict, "commands", qint_from_int(st->commands));
+        qdict_put(qdict, "ring-depth-avg",
+                  qfloat_from_double(st->notifies ?
+                                     (double)st->ring_depth_sum / st->notifies
+                                     : 0));
+        qdict_put(qdict, "ring-depth-max", qint_from_int(st->ring_depth_max));
+        if (d->render.started) {
+            qdict_put(qdict, "renders", qint_from_int(st->renders));
+            qdict_put(qdict, "render-avg-us",
+                      qint_from_int(st->renders ?
+                                    st->render_ns_sum / st->renders / 1000
+                                    : 0));
+            qdict_put(qdict, "render-max-us",
+                      qint_from_int(st->render_ns_max / 1000));
+            qdict_put(qdict, "render-last-us",
+                      qint_from_int(st->render_ns_last / 1000));
+        }
+        qlist_append(list, qdict);
+    }
+    *ret_data = QOBJECT(list);
+}
+
 /* display change listener */
 
 static void display_update(struct DisplayState *ds, int x, int y, int w, int h)
@@ -1250,7 +1383,8 @@ static int qxl_init_common(PCIQXLDevice *qxl)
         qxl->vram_size = 4096;
     }
     qxl->vram_size = msb_mask(qxl->vram_size * 2 - 1);
-    qxl->vram_offset = qemu_ram_alloc(&qxl->pci.qdev, "qxl.vram", qxl->vram_size);
+    qxl->vram_offset = qemu_ram_alloc_lazy(&qxl->pci.qdev, "qxl.vram",
+                                           qxl->vram_size);
 
     io_size = msb_mask(QXL_IO_RANGE_SIZE * 2 - 1);
     if (qxl->revision == 1) {
@@ -1277,7 +1411,9 @@ static int qxl_init_common(PCIQXLDevice *qxl)
     qemu_add_vm_change_state_handler(qxl_vm_change_state_handler, qxl);
 
     init_pipe_signaling(qxl);
+    qxl->wakeup_bh = qemu_bh_new(qxl_wakeup_bh, qxl);
     qxl_reset_state(qxl);
+    QTAILQ_INSERT_TAIL(&qxl_devices, qxl, next);
 
     return 0;
 }
@@ -1303,12 +1439,14 @@ static int qxl_init_primary(PCIDevice *dev)
 
     vga->ds = graphic_console_init(qxl_hw_update, qxl_hw_invalidate,
                                    qxl_hw_screen_dump, qxl_hw_text_update, qxl);
+    vga->ds->precise_updates = 1;
     qxl->ssd.ds = vga->ds;
     qxl->ssd.bufsize = (16 * 1024 * 1024);
     qxl->ssd.buf = qemu_malloc(qxl->ssd.bufsize);
 
     qxl0 = qxl;
     register_displaychangelistener(vga->ds, &display_listener);
+    qxl_render_init(qxl);
 
     pci_config_set_class(dev->config, PCI_CLASS_DISPLAY_VGA);
     return qxl_init_common(qxl);
@@ -1326,8 +1464,8 @@ static int qxl_init_secondary(PCIDevice *dev)
         ram_size = 16 * 1024 * 1024;
     }
     qxl->vga.vram_size = ram_size;
-    qxl->vga.vram_offset = qemu_ram_alloc(&qxl->pci.qdev, "qxl.vgavram",
-                                          qxl->vga.vram_size);
+    qxl->vga.vram_offset = qemu_ram_alloc_lazy(&qxl->pci.qdev, "qxl.vgavram",
+                                               qxl->vga.vram_size);
     qxl->vga.vram_ptr = qemu_get_ram_ptr(qxl->vga.vram_offset);
 
     pci_config_set_class(dev->config, PCI_CLASS_DISPLAY_OTHER);
@@ -5,6 +5,7 @@
 #include "pci.h"
 #include "vga_int.h"
 
+#include "qemu-thread.h"
 #include "ui/qemu-spice.h"
 #include "ui/spice-display.h"
 
@@ -59,6 +60,37 @@ typedef struct PCIQXLDevice {
     pthread_t          main;
     int                pipe[2];
 
+    /* worker wakeups, one per main loop iteration however many notifies */
+    QEMUBH             *wakeup_bh;
+    int                wakeup_pending;
+
+    /* local rendering (qxl-render.c), update_area runs in its own thread */
+    struct render {
+        QemuThread     thread;
+        QemuMutex      lock;
+        QemuCond       cond;
+        int            started;
+        int            pending;         /* update requested */
+        int            busy;            /* update_area in progress */
+        int64_t        requested;       /* get_clock() of the request */
+        QXLRect        dirty[32];       /* rendered, not yet shown */
+        int            num_dirty;
+    } render;
+
+    /* statistics for 'info qxl' */
+    struct qxl_stats {
+        uint64_t       notifies;        /* QXL_IO_NOTIFY_CMD writes */
+        uint64_t       wakeups;         /* worker wakeups they turned into */
+        uint64_t       commands;        /* taken off the command ring */
+        uint64_t       ring_depth_sum;  /* ring fill at each notify */
+        uint32_t       ring_depth_max;
+        uint64_t       renders;
+        int64_t        render_ns_sum;   /* request to rendered */
+        int64_t        render_ns_max;
+        int64_t        render_ns_last;
+    } stats;
+    QTAILQ_ENTRY(PCIQXLDevice) next;
+
     /* ram pci bar */
     QXLRam             *ram;
     VGACommonState     vga;
@@ -103,6 +135,9 @@ void qxl_log_cmd_cursor(PCIQXLDevice *qxl, QXLCursorCmd *cmd, int group_id);
 void qxl_log_command(PCIQXLDevice *qxl, const char *ring, QXLCommandExt *ext);
 
 /* qxl-render.c */
+void qxl_render_init(PCIQXLDevice *qxl);
 void qxl_render_resize(PCIQXLDevice *qxl);
 void qxl_render_update(PCIQXLDevice *qxl);
+void qxl_render_update_sync(PCIQXLDevice *qxl);
+void qxl_render_wait(PCIQXLDevice *qxl);
 void qxl_render_cursor(PCIQXLDevice *qxl, QXLCommandExt *ext);
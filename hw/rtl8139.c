@@ -51,8 +51,12 @@
 #include "pci.h"
 #include "qemu-timer.h"
 #include "net.h"
+#include "net/checksum.h"
+#include "net/tap.h"
 #include "loader.h"
 #include "sysemu.h"
+#include "iov.h"
+#include "virtio-net.h"
 
 /* debug RTL8139 card */
 //#define DEBUG_RTL8139 1
@@ -491,6 +495,9 @@ typedef struct RTL8139State {
     int        cplus_txbuffer_len;
     int        cplus_txbuffer_offset;
 
+    /* The peer is a tap that takes virtio_net_hdr, for TSO and checksums */
+    int        has_vnet_hdr;
+
     /* PCI interrupt timer */
     QEMUTimer *timer;
     int64_t TimerExpire;
@@ -970,15 +977,14 @@ static ssize_t rtl8139_do_receive(VLANClientState *nc, const uint8_t *buf, size_
                descriptor, s->RxRingAddrHI, s->RxRingAddrLO, (uint64_t)cplus_rx_ring_desc));
 
         uint32_t val, rxdw0,rxdw1,rxbufLO,rxbufHI;
+        uint32_t desc[4];
 
-        cpu_physical_memory_read(cplus_rx_ring_desc,    (uint8_t *)&val, 4);
-        rxdw0 = le32_to_cpu(val);
-        cpu_physical_memory_read(cplus_rx_ring_desc+4,  (uint8_t *)&val, 4);
-        rxdw1 = le32_to_cpu(val);
-        cpu_physical_memory_read(cplus_rx_ring_desc+8,  (uint8_t *)&val, 4);
-        rxbufLO = le32_to_cpu(val);
-        cpu_physical_memory_read(cplus_rx_ring_desc+12, (uint8_t *)&val, 4);
-        rxbufHI = le32_to_cpu(val);
+        /* the whole descriptor at once */
+        cpu_physical_memory_read(cplus_rx_ring_desc, (uint8_t *)desc, 16);
+        rxdw0 = le32_to_cpu(desc[0]);
+        rxdw1 = le32_to_cpu(desc[1]);
+        rxbufLO = le32_to_cpu(desc[2]);
+        rxbufHI = le32_to_cpu(desc[3]);
 
         DEBUG_PRINT(("RTL8139: +++ C+ mode RX descriptor %d %08x %08x %08x %08x\n",
                descriptor,
@@ -1083,10 +1089,9 @@ static ssize_t rtl8139_do_receive(VLANClientState *nc, const uint8_t *buf, size_
         rxdw1 &= ~CP_RX_TAVA;
 
         /* update ring data */
-        val = cpu_to_le32(rxdw0);
-        cpu_physical_memory_write(cplus_rx_ring_desc,    (uint8_t *)&val, 4);
-        val = cpu_to_le32(rxdw1);
-        cpu_physical_memory_write(cplus_rx_ring_desc+4,  (uint8_t *)&val, 4);
+        desc[0] = cpu_to_le32(rxdw0);
+        desc[1] = cpu_to_le32(rxdw1);
+        cpu_physical_memory_write(cplus_rx_ring_desc, (uint8_t *)desc, 8);
 
         /* update tally counter */
         ++s->tally_counters.RxOk;
@@ -1165,9 +1170,41 @@ static ssize_t rtl8139_do_receive(VLANClientState *nc, const uint8_t *buf, size_
 
 static ssize_t rtl8139_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
 {
+    RTL8139State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+
+    /* No offloads are enabled on the tap, so the header is always empty */
+    if (s->has_vnet_hdr) {
+        if (size < sizeof(struct virtio_net_hdr)) {
+            return -1;
+        }
+        buf += sizeof(struct virtio_net_hdr);
+        size -= sizeof(struct virtio_net_hdr);
+    }
+
     return rtl8139_do_receive(nc, buf, size, 1);
 }
 
+/* Several packets from the peer, with a single interrupt for all of them.
+ * Outside C+ mode the receive buffer has flow control, so the rest of the
+ * packets are left to the net layer once it is full. */
+static int rtl8139_receive_batch(VLANClientState *nc, const struct iovec *pkts,
+                                 int count)
+{
+    RTL8139State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+    int hdr_len = s->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+    int i;
+
+    for (i = 0; i < count && rtl8139_can_receive(nc); i++) {
+        if (pkts[i].iov_len < hdr_len) {
+            continue;
+        }
+        rtl8139_do_receive(nc, (uint8_t *)pkts[i].iov_base + hdr_len,
+                           pkts[i].iov_len - hdr_len, 0);
+    }
+    rtl8139_update_irq(s);
+    return i;
+}
+
 static void rtl8139_reset_rxring(RTL8139State *s, uint32_t bufferSize)
 {
     s->RxBufferSize = bufferSize;
@@ -1753,6 +1790,18 @@ static void rtl8139_transfer_frame(RTL8139State *s, const uint8_t *buf, int size
         DEBUG_PRINT(("RTL8139: +++ transmit loopback mode\n"));
         rtl8139_do_receive(&s->nic->nc, buf, size, do_interrupt);
     }
+    else if (s->has_vnet_hdr)
+    {
+        struct virtio_net_hdr hdr;
+        struct iovec iov[2];
+
+        memset(&hdr, 0, sizeof(hdr));
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = (uint8_t *)buf;
+        iov[1].iov_len = size;
+        qemu_sendv_packet(&s->nic->nc, iov, 2);
+    }
     else
     {
         qemu_send_packet(&s->nic->nc, buf, size);
@@ -1913,16 +1962,14 @@ static int rtl8139_cplus_transmit_one(RTL8139State *s)
            descriptor, s->TxAddr[1], s->TxAddr[0], cplus_tx_ring_desc));
 
     uint32_t val, txdw0,txdw1,txbufLO,txbufHI;
+    uint32_t desc[4];
 
-    cpu_physical_memory_read(cplus_tx_ring_desc,    (uint8_t *)&val, 4);
-    txdw0 = le32_to_cpu(val);
+    cpu_physical_memory_read(cplus_tx_ring_desc, (uint8_t *)desc, 16);
+    txdw0 = le32_to_cpu(desc[0]);
     /* TODO: implement VLAN tagging support, VLAN tag data is read to txdw1 */
-    cpu_physical_memory_read(cplus_tx_ring_desc+4,  (uint8_t *)&val, 4);
-    txdw1 = le32_to_cpu(val);
-    cpu_physical_memory_read(cplus_tx_ring_desc+8,  (uint8_t *)&val, 4);
-    txbufLO = le32_to_cpu(val);
-    cpu_physical_memory_read(cplus_tx_ring_desc+12, (uint8_t *)&val, 4);
-    txbufHI = le32_to_cpu(val);
+    txdw1 = le32_to_cpu(desc[1]);
+    txbufLO = le32_to_cpu(desc[2]);
+    txbufHI = le32_to_cpu(desc[3]);
 
     DEBUG_PRINT(("RTL8139: +++ C+ mode TX descriptor %d %08x %08x %08x %08x\n",
            descriptor,
@@ -2323,13 +2370,267 @@ static int rtl8139_cplus_transmit_one(RTL8139State *s)
     return 1;
 }
 
+/* Descriptors read from the C+ mode ring at once */
+#define CP_TX_BATCH 16
+
+/* Fill in the virtio_net_hdr that has a tap peer do the offloads of txdw0
+ * for the frame whose first len bytes are in buf, computing what goes in
+ * the headers themselves.  Returns 0 if the frame is not one a tap can
+ * take. */
+static int rtl8139_cplus_offload_hdr(uint8_t *buf, int len, int size,
+                                     uint32_t txdw0,
+                                     struct virtio_net_hdr *hdr)
+{
+    ip_header *ip = (ip_header *)(buf + ETH_HLEN);
+    int hlen, l4_len, l4_hlen, ip_protocol, csum_offset = 0;
+    uint32_t sum;
+
+    if (len < ETH_HLEN + sizeof(ip_header) ||
+        be16_to_cpup((uint16_t *)(buf + 12)) != ETH_P_IP ||
+        IP_HEADER_VERSION(ip) != IP_HEADER_VERSION_4) {
+        return 0;
+    }
+    hlen = IP_HEADER_LENGTH(ip);
+    ip_protocol = ip->ip_p;
+    l4_len = be16_to_cpu(ip->ip_len) - hlen;
+    if (hlen < sizeof(ip_header) || ETH_HLEN + hlen > len || l4_len < 0 ||
+        ETH_HLEN + hlen + l4_len > size) {
+        return 0;
+    }
+
+    if (txdw0 & CP_TX_IPCS) {
+        ip->ip_sum = 0;
+        ip->ip_sum = ip_checksum(ip, hlen);
+    }
+
+    if ((txdw0 & CP_TX_LGSEN) && ip_protocol == IP_PROTO_TCP) {
+        tcp_header *tcp = (tcp_header *)(buf + ETH_HLEN + hlen);
+
+        if (ETH_HLEN + hlen + sizeof(tcp_header) > len) {
+            return 0;
+        }
+        l4_hlen = TCP_HEADER_DATA_OFFSET(tcp);
+        if (l4_hlen < sizeof(tcp_header) || l4_hlen > l4_len ||
+            ETH_HLEN + hlen + l4_hlen > len) {
+            return 0;
+        }
+        /* the same segment size as rtl8139_cplus_transmit_one uses */
+        if (l4_len - l4_hlen > ETH_MTU - hlen - l4_hlen) {
+            hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            hdr->gso_size = ETH_MTU - hlen - l4_hlen;
+            hdr->hdr_len = ETH_HLEN + hlen + l4_hlen;
+        }
+        csum_offset = 16;
+    } else if (txdw0 & CP_TX_LGSEN) {
+        return 1;
+    } else if ((txdw0 & CP_TX_TCPCS) && ip_protocol == IP_PROTO_TCP) {
+        csum_offset = 16;
+    } else if ((txdw0 & CP_TX_UDPCS) && ip_protocol == IP_PROTO_UDP) {
+        csum_offset = 6;
+    } else {
+        return 1;
+    }
+    if (ETH_HLEN + hlen + csum_offset + 2 > len) {
+        return 0;
+    }
+
+    /* the pseudo-header sum is in place, the peer adds the rest */
+    sum = net_checksum_add(8, (uint8_t *)&ip->ip_src) + ip_protocol + l4_len;
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    cpu_to_be16wu((uint16_t *)(buf + ETH_HLEN + hlen + csum_offset), sum);
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->csum_start = ETH_HLEN + hlen;
+    hdr->csum_offset = csum_offset;
+    return 1;
+}
+
+/* Send the frame of count descriptors in desc, gathered straight from
+ * guest memory.  Only the headers are copied, when a tap peer is asked to
+ * do the offloads.  Returns 0 if the frame needs the copying path. */
+static int rtl8139_cplus_transmit_frame(RTL8139State *s, uint32_t (*desc)[4],
+                                        int count)
+{
+    uint32_t txdw0 = le32_to_cpu(desc[count - 1][0]);
+    struct iovec iov[CP_TX_BATCH + 2], *frag = iov + 2;
+    void *map[CP_TX_BATCH];
+    target_phys_addr_t map_len[CP_TX_BATCH];
+    struct virtio_net_hdr hdr;
+    uint8_t header[ETH_HLEN + 60 + 60];
+    int i, nmap = 0, nfrag, skip = 0, size = 0, ret = 0;
+
+    for (i = 0; i < count; i++) {
+        target_phys_addr_t len = le32_to_cpu(desc[i][0]) &
+                                 CP_TX_BUFFER_SIZE_MASK;
+
+        if (!len) {
+            continue;
+        }
+        map_len[nmap] = len;
+        map[nmap] = cpu_physical_memory_map(
+            rtl8139_addr64(le32_to_cpu(desc[i][2]), le32_to_cpu(desc[i][3])),
+            &map_len[nmap], 0);
+        if (!map[nmap]) {
+            goto out;
+        }
+        nmap++;
+        if (map_len[nmap - 1] != len) {
+            goto out;
+        }
+        frag[nmap - 1].iov_base = map[nmap - 1];
+        frag[nmap - 1].iov_len = len;
+        size += len;
+    }
+    if (!size) {
+        goto out;
+    }
+    nfrag = nmap;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (txdw0 & (CP_TX_IPCS | CP_TX_UDPCS | CP_TX_TCPCS | CP_TX_LGSEN)) {
+        if (!s->has_vnet_hdr) {
+            goto out;
+        }
+        skip = iov_to_buf(frag, nfrag, header, 0, sizeof(header));
+        if (!rtl8139_cplus_offload_hdr(header, skip, size, txdw0, &hdr)) {
+            goto out;
+        }
+        /* the copy, with its checksums, stands in for the guest's headers */
+        *--frag = (struct iovec) { header, skip };
+        nfrag++;
+        for (i = 1; skip; ) {
+            if (frag[i].iov_len <= skip) {
+                skip -= frag[i].iov_len;
+                memmove(&frag[i], &frag[i + 1],
+                        (nfrag - i - 1) * sizeof(*frag));
+                nfrag--;
+            } else {
+                frag[i].iov_base = (uint8_t *)frag[i].iov_base + skip;
+                frag[i].iov_len -= skip;
+                skip = 0;
+            }
+        }
+    }
+    if (s->has_vnet_hdr) {
+        *--frag = (struct iovec) { &hdr, sizeof(hdr) };
+        nfrag++;
+    }
+
+    ++s->tally_counters.TxOk;
+
+    DEBUG_PRINT(("RTL8139: +++ C+ mode transmitting %d bytes packet from %d descriptors\n",
+                 size, count));
+
+    qemu_sendv_packet(&s->nic->nc, frag, nfrag);
+    ret = 1;
+
+out:
+    for (i = 0; i < nmap; i++) {
+        cpu_physical_memory_unmap(map[i], map_len[i], 0, map_len[i]);
+    }
+    return ret;
+}
+
+/* Transmit the complete frames at the head of the ring without copying
+ * them.  Returns the number of descriptors that were sent, 0 if there are
+ * none to send, or -1 if the first one has to go through
+ * rtl8139_cplus_transmit_one. */
+static int rtl8139_cplus_transmit_fast(RTL8139State *s)
+{
+    uint32_t desc[CP_TX_BATCH][4];
+    target_phys_addr_t ring;
+    int first = s->currCPlusTxDesc, n = MIN(CP_TX_BATCH, 64 - first);
+    int i = 0, j, done = 0;
+
+    if (!rtl8139_transmitter_enabled(s) || !rtl8139_cp_transmitter_enabled(s))
+    {
+        return 0;
+    }
+    /* loopback wants the frame in one piece */
+    if (TxLoopBack == (s->TxConfig & TxLoopBack))
+    {
+        return -1;
+    }
+
+    ring = rtl8139_addr64(s->TxAddr[0], s->TxAddr[1]) + 16 * first;
+    cpu_physical_memory_read(ring, (uint8_t *)desc, 16 * n);
+
+    while (i < n)
+    {
+        uint32_t txdw0 = le32_to_cpu(desc[i][0]);
+
+        if (!(txdw0 & CP_TX_OWN))
+        {
+            return done;
+        }
+        if (!(txdw0 & CP_TX_FS))
+        {
+            break;
+        }
+
+        /* the frame must be all there, and not wrap around the ring */
+        for (j = i; j < n; j++)
+        {
+            txdw0 = le32_to_cpu(desc[j][0]);
+            if (!(txdw0 & CP_TX_OWN) || (txdw0 & (CP_TX_LS | CP_TX_EOR)))
+            {
+                break;
+            }
+        }
+        if (j == n || !(txdw0 & CP_TX_OWN) || !(txdw0 & CP_TX_LS))
+        {
+            break;
+        }
+        if (!rtl8139_cplus_transmit_frame(s, desc + i, j - i + 1))
+        {
+            break;
+        }
+
+        /* a frame started by rtl8139_cplus_transmit_one is abandoned */
+        s->cplus_txbuffer_offset = 0;
+
+        /* transfer ownership of the whole frame to the guest at once */
+        for (; i <= j; i++)
+        {
+            txdw0 = le32_to_cpu(desc[i][0]);
+            txdw0 &= ~(CP_TX_OWN | CP_TX_STATUS_UNF | CP_TX_STATUS_TES |
+                       CP_TX_STATUS_OWC | CP_TX_STATUS_LNKF |
+                       CP_TX_STATUS_EXC);
+            desc[i][0] = cpu_to_le32(txdw0);
+        }
+        cpu_physical_memory_write(ring + 16 * done, (uint8_t *)desc[done],
+                                  16 * (i - done));
+        done = i;
+
+        if (txdw0 & CP_TX_EOR || first + i >= 64)
+        {
+            s->currCPlusTxDesc = 0;
+            break;
+        }
+        s->currCPlusTxDesc = first + i;
+    }
+
+    return done ? done : -1;
+}
+
 static void rtl8139_cplus_transmit(RTL8139State *s)
 {
     int txcount = 0;
 
-    while (rtl8139_cplus_transmit_one(s))
+    for (;;)
     {
-        ++txcount;
+        int ret = rtl8139_cplus_transmit_fast(s);
+
+        if (ret < 0)
+        {
+            ret = rtl8139_cplus_transmit_one(s);
+        }
+        if (!ret)
+        {
+            break;
+        }
+        txcount += ret;
     }
 
     /* Mark transfer completed */
@@ -3361,6 +3662,7 @@ static NetClientInfo net_rtl8139_info = {
     .size = sizeof(NICState),
     .can_receive = rtl8139_can_receive,
     .receive = rtl8139_receive,
+    .receive_batch = rtl8139_receive_batch,
     .cleanup = rtl8139_cleanup,
 };
 
@@ -3396,6 +3698,14 @@ static int pci_rtl8139_init(PCIDevice *dev)
                           dev->qdev.info->name, dev->qdev.id, s);
     qemu_format_nic_info_str(&s->nic->nc, s->conf.macaddr.a);
 
+    /* C+ mode TSO frames and checksums are left to a tap peer that
+     * understands virtio_net_hdr; what it sends us still comes complete. */
+    if (s->nic->nc.peer && s->nic->nc.peer->info->type == NET_CLIENT_TYPE_TAP &&
+        tap_has_vnet_hdr(s->nic->nc.peer)) {
+        tap_using_vnet_hdr(s->nic->nc.peer, 1);
+        s->has_vnet_hdr = 1;
+    }
+
     s->cplus_txbuffer = NULL;
     s->cplus_txbuffer_len = 0;
     s->cplus_txbuffer_offset = 0;
@@ -18,6 +18,7 @@
  */
 
 #include "virtio-net.h"
+#include "virtio-blk.h"
 
 #define VIRTIO_DEV_OFFS_TYPE		0	/* 8 bits */
 #define VIRTIO_DEV_OFFS_NUM_VQ		1	/* 8 bits */
@@ -46,6 +47,7 @@ typedef struct VirtIOS390Device {
     /* Max. number of ports we can have for a the virtio-serial device */
     uint32_t max_virtserial_ports;
     virtio_net_conf net;
+    virtio_blk_conf blk;
 } VirtIOS390Device;
 
 typedef struct VirtIOS390Bus {
@@ -333,6 +333,7 @@ static void scsi_req_xfer_mode(SCSIRequest *req)
     case WRITE_LONG_2:
     case PERSISTENT_RESERVE_OUT:
     case MAINTENANCE_OUT:
+    case UNMAP:
         req->cmd.mode = SCSI_XFER_TO_DEV;
         break;
     default:
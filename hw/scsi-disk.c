@@ -39,6 +39,8 @@ do { fprintf(stderr, "scsi-disk: " fmt , ## __VA_ARGS__); } while (0)
 #include "blockdev.h"
 
 #define SCSI_DMA_BUF_SIZE    131072
+#define SCSI_MAX_XFER_SIZE   (1024 * 1024)
+#define SCSI_UNMAP_MAX_DESCRIPTORS ((SCSI_DMA_BUF_SIZE - 8) / 16)
 #define SCSI_MAX_INQUIRY_LEN 256
 
 #define SCSI_REQ_STATUS_RETRY           0x01
@@ -60,6 +62,7 @@ typedef struct SCSIDiskReq {
     /* Both sector and sector_count are in terms of qemu 512 byte blocks.  */
     uint64_t sector;
     uint32_t sector_count;
+    uint32_t buf_len;
     struct iovec iov;
     QEMUIOVector qiov;
     uint32_t status;
@@ -91,10 +94,42 @@ static SCSIDiskReq *scsi_new_request(SCSIDiskState *s, uint32_t tag,
 
     req = scsi_req_alloc(sizeof(SCSIDiskReq), &s->qdev, tag, lun);
     r = DO_UPCAST(SCSIDiskReq, req, req);
-    r->iov.iov_base = qemu_blockalign(s->bs, SCSI_DMA_BUF_SIZE);
     return r;
 }
 
+/*
+ * Reads and writes get a buffer for the whole transfer, up to
+ * SCSI_MAX_XFER_SIZE, so that a large request is a single AIO request and a
+ * single data phase for the HBA instead of one per SCSI_DMA_BUF_SIZE chunk.
+ * Small ones do not pay for a large buffer.  The other commands get
+ * SCSI_DMA_BUF_SIZE, which is what their parameter lists and replies need.
+ */
+static void scsi_alloc_buf(SCSIDiskReq *r)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+
+    switch (r->req.cmd.buf[0]) {
+    case READ_6:
+    case READ_10:
+    case READ_12:
+    case READ_16:
+    case WRITE_6:
+    case WRITE_10:
+    case WRITE_12:
+    case WRITE_16:
+    case WRITE_VERIFY:
+    case WRITE_VERIFY_12:
+    case WRITE_VERIFY_16:
+        r->buf_len = MIN(MAX(r->req.cmd.xfer, s->qdev.blocksize),
+                         SCSI_MAX_XFER_SIZE);
+        break;
+    default:
+        r->buf_len = SCSI_DMA_BUF_SIZE;
+        break;
+    }
+    r->iov.iov_base = qemu_blockalign(s->bs, r->buf_len);
+}
+
 static void scsi_remove_request(SCSIDiskReq *r)
 {
     qemu_vfree(r->iov.iov_base);
@@ -192,8 +227,8 @@ static void scsi_read_request(SCSIDiskReq *r)
     assert(r->req.aiocb == NULL);
 
     n = r->sector_count;
-    if (n > SCSI_DMA_BUF_SIZE / 512)
-        n = SCSI_DMA_BUF_SIZE / 512;
+    if (n > r->buf_len / 512)
+        n = r->buf_len / 512;
 
     r->iov.iov_len = n * 512;
     qemu_iovec_init_external(&r->qiov, &r->iov, 1);
@@ -273,8 +308,8 @@ static void scsi_write_complete(void * opaque, int ret)
         scsi_command_complete(r, GOOD, NO_SENSE);
     } else {
         len = r->sector_count * 512;
-        if (len > SCSI_DMA_BUF_SIZE) {
-            len = SCSI_DMA_BUF_SIZE;
+        if (len > r->buf_len) {
+            len = r->buf_len;
         }
         r->iov.iov_len = len;
         DPRINTF("Write complete tag=0x%x more=%d\n", r->req.tag, len);
@@ -282,6 +317,44 @@ static void scsi_write_complete(void * opaque, int ret)
     }
 }
 
+/*
+ * The parameter list of UNMAP is an 8 byte header followed by 16 byte
+ * block descriptors, each a 64 bit LBA and a 32 bit block count.  The
+ * ranges are discarded together, see bdrv_discard_ranges().
+ */
+static void scsi_disk_emulate_unmap(SCSIDiskReq *r)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    uint8_t *buf = r->iov.iov_base;
+    BlockDiscardRange *ranges;
+    int len, i, n = 0;
+    int ret;
+
+    len = MIN(r->iov.iov_len, 8 + ((buf[2] << 8) | buf[3]));
+    ranges = qemu_malloc(sizeof(*ranges) * (len / 16 + 1));
+    for (i = 8; i + 16 <= len; i += 16) {
+        uint64_t lba = be64_to_cpu(*(uint64_t *)(buf + i));
+        uint32_t count = be32_to_cpu(*(uint32_t *)(buf + i + 8));
+
+        if (lba > s->max_lba || count > s->max_lba + 1 - lba) {
+            qemu_free(ranges);
+            scsi_command_complete(r, CHECK_CONDITION, HARDWARE_ERROR);
+            return;
+        }
+        ranges[n].sector_num = lba * s->cluster_size;
+        ranges[n].nb_sectors = (int64_t)count * s->cluster_size;
+        n++;
+    }
+
+    ret = bdrv_discard_ranges(s->bs, ranges, n);
+    qemu_free(ranges);
+    if (ret < 0) {
+        scsi_command_complete(r, CHECK_CONDITION, ILLEGAL_REQUEST);
+        return;
+    }
+    scsi_command_complete(r, GOOD, NO_SENSE);
+}
+
 static void scsi_write_request(SCSIDiskReq *r)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
@@ -290,6 +363,12 @@ static void scsi_write_request(SCSIDiskReq *r)
     /* No data transfer may already be in progress */
     assert(r->req.aiocb == NULL);
 
+    if (r->req.cmd.buf[0] == UNMAP) {
+        /* the parameter list is in */
+        scsi_disk_emulate_unmap(r);
+        return;
+    }
+
     n = r->iov.iov_len / 512;
     if (n) {
         qemu_iovec_init_external(&r->qiov, &r->iov, 1);
@@ -497,6 +576,17 @@ static int scsi_disk_emulate_inquiry(SCSIRequest *req, uint8_t *outbuf)
             outbuf[14] = (opt_io_size >> 8) & 0xff;
             outbuf[15] = opt_io_size & 0xff;
 
+            if (unmap_sectors) {
+                /* maximum unmap LBA count, unlimited */
+                outbuf[20] = outbuf[21] = outbuf[22] = outbuf[23] = 0xff;
+
+                /* maximum unmap block descriptor count */
+                outbuf[24] = (SCSI_UNMAP_MAX_DESCRIPTORS >> 24) & 0xff;
+                outbuf[25] = (SCSI_UNMAP_MAX_DESCRIPTORS >> 16) & 0xff;
+                outbuf[26] = (SCSI_UNMAP_MAX_DESCRIPTORS >> 8) & 0xff;
+                outbuf[27] = SCSI_UNMAP_MAX_DESCRIPTORS & 0xff;
+            }
+
             /* optimal unmap granularity */
             outbuf[28] = (unmap_sectors >> 24) & 0xff;
             outbuf[29] = (unmap_sectors >> 16) & 0xff;
@@ -508,7 +598,7 @@ static int scsi_disk_emulate_inquiry(SCSIRequest *req, uint8_t *outbuf)
         {
             outbuf[3] = buflen = 8;
             outbuf[4] = 0;
-            outbuf[5] = 0x40; /* write same with unmap supported */
+            outbuf[5] = 0xc0; /* unmap, write same with unmap supported */
             outbuf[6] = 0;
             outbuf[7] = 0;
             break;
@@ -1046,7 +1136,6 @@ static int32_t scsi_send_command(SCSIDevice *d, uint32_t tag,
     /* ??? Tags are not unique for different luns.  We only implement a
        single lun, so this should not matter.  */
     r = scsi_new_request(s, tag, lun);
-    outbuf = (uint8_t *)r->iov.iov_base;
     is_write = 0;
     DPRINTF("Command: lun=%d tag=0x%x data=0x%02x", lun, tag, buf[0]);
 
@@ -1054,6 +1143,8 @@ static int32_t scsi_send_command(SCSIDevice *d, uint32_t tag,
         BADF("Unsupported command length, command %x\n", command);
         goto fail;
     }
+    scsi_alloc_buf(r);
+    outbuf = (uint8_t *)r->iov.iov_base;
 #ifdef DEBUG_SCSI
     {
         int i;
@@ -1141,6 +1232,16 @@ static int32_t scsi_send_command(SCSIDevice *d, uint32_t tag,
             goto fail;
         }
         break;
+    case UNMAP:
+        DPRINTF("Unmap (len %lu)\n", (long)r->req.cmd.xfer);
+        if (!s->qdev.conf.discard_granularity ||
+            r->req.cmd.xfer > SCSI_DMA_BUF_SIZE) {
+            goto fail;
+        }
+        /* the parameter list goes to the buffer, see scsi_write_request() */
+        r->iov.iov_len = r->req.cmd.xfer;
+        is_write = 1;
+        break;
     case SEEK_6:
     case SEEK_10:
         DPRINTF("Seek(%d) (sector %" PRId64 ")\n", command == SEEK_6 ? 6 : 10,
@@ -251,7 +251,10 @@ static void usb_msd_command_complete(SCSIBus *bus, int reason, uint32_t tag,
     s->scsi_buf = s->scsi_dev->info->get_buf(s->scsi_dev, tag);
     if (p) {
         usb_msd_copy_data(s);
-        if (s->usb_len == 0) {
+        /* Copying the last of the data may have completed the command, and
+           the packet with it.  */
+        p = s->packet;
+        if (p && s->usb_len == 0) {
             /* Set s->packet to NULL before calling usb_packet_complete
                because annother request may be issued before
                usb_packet_complete returns.  */
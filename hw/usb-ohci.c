@@ -1558,8 +1558,18 @@ static void ohci_mem_write(void *ptr, target_phys_addr_t addr, uint32_t val)
         /* Bits written as '0' remain unchanged in the register */
         ohci->status |= val;
 
-        if (ohci->status & OHCI_STATUS_HCR)
+        if (ohci->status & OHCI_STATUS_HCR) {
             ohci_reset(ohci);
+            break;
+        }
+
+        /* The driver just queued control or bulk TDs: run them now rather
+           than at the end of the frame, which would add up to a
+           millisecond to every stage of a transfer.  */
+        if ((val & (OHCI_STATUS_CLF | OHCI_STATUS_BLF)) &&
+            (ohci->ctl & OHCI_CTL_HCFS) == OHCI_USB_OPERATIONAL) {
+            ohci_process_lists(ohci, 0);
+        }
         break;
 
     case 3: /* HcInterruptStatus */
@@ -73,6 +73,14 @@
 
 #define FRAME_MAX_LOOPS  100
 
+/*
+ * After this many frames without an active TD the frame timer only fires
+ * every FRAME_IDLE_STEP frames, and runs the frames that have passed in one
+ * go.  Any activity, or a register access, returns to one tick per frame.
+ */
+#define FRAME_IDLE_FRAMES 64
+#define FRAME_IDLE_STEP   8
+
 #define NB_PORTS 2
 
 #ifdef DEBUG
@@ -139,6 +147,7 @@ typedef struct UHCIState {
     uint8_t status2; /* bit 0 and 1 are used to generate UHCI_STS_USBINT */
     int64_t expire_time;
     QEMUTimer *frame_timer;
+    uint32_t idle_frames;
     UHCIPort ports[NB_PORTS];
 
     /* Interrupts that should be raised at the end of the current frame.  */
@@ -328,6 +337,17 @@ static void uhci_update_irq(UHCIState *s)
     qemu_set_irq(s->dev.irq[3], level);
 }
 
+/* Something happened: tick every frame again */
+static void uhci_busy(UHCIState *s)
+{
+    if (s->idle_frames >= FRAME_IDLE_FRAMES && (s->cmd & UHCI_CMD_RS)) {
+        qemu_mod_timer(s->frame_timer, s->expire_time);
+    }
+    s->idle_frames = 0;
+}
+
+static void uhci_run_frames(UHCIState *s);
+
 static void uhci_reset(void *opaque)
 {
     UHCIState *s = opaque;
@@ -437,11 +457,13 @@ static void uhci_ioport_writew(void *opaque, uint32_t addr, uint32_t val)
     addr &= 0x1f;
     DPRINTF("uhci: writew port=0x%04x val=0x%04x\n", addr, val);
 
+    uhci_busy(s);
     switch(addr) {
     case 0x00:
         if ((val & UHCI_CMD_RS) && !(s->cmd & UHCI_CMD_RS)) {
             /* start frame processing */
-            qemu_mod_timer(s->frame_timer, qemu_get_clock(vm_clock));
+            s->expire_time = qemu_get_clock(vm_clock);
+            qemu_mod_timer(s->frame_timer, s->expire_time);
             s->status &= ~UHCI_STS_HCHALTED;
         } else if (!(val & UHCI_CMD_RS)) {
             s->status |= UHCI_STS_HCHALTED;
@@ -528,6 +550,8 @@ static uint32_t uhci_ioport_readw(void *opaque, uint32_t addr)
         val = s->intr;
         break;
     case 0x06:
+        /* the frames skipped while idle have passed by now */
+        uhci_run_frames(s);
         val = s->frnum;
         break;
     case 0x10 ... 0x1f:
@@ -781,6 +805,8 @@ static int uhci_handle_td(UHCIState *s, uint32_t addr, UHCI_TD *td, uint32_t *in
     if (!(td->ctrl & TD_CTRL_ACTIVE))
         return 1;
 
+    uhci_busy(s);
+
     /* token field is not unique for isochronous requests,
      * so use the destination buffer 
      */
@@ -1057,43 +1083,70 @@ static void uhci_process_frame(UHCIState *s)
     s->pending_int_mask |= int_mask;
 }
 
-static void uhci_frame_timer(void *opaque)
+/* Run the frames that are due, one at a time */
+static void uhci_run_frames(UHCIState *s)
 {
-    UHCIState *s = opaque;
+    int64_t now = qemu_get_clock(vm_clock);
 
-    /* prepare the timer for the next frame */
-    s->expire_time += (get_ticks_per_sec() / FRAME_TIMER_FREQ);
+    while (s->expire_time <= now) {
+        /* prepare the timer for the next frame */
+        s->expire_time += (get_ticks_per_sec() / FRAME_TIMER_FREQ);
 
-    if (!(s->cmd & UHCI_CMD_RS)) {
-        /* Full stop */
-        qemu_del_timer(s->frame_timer);
-        /* set hchalted bit in status - UHCI11D 2.1.2 */
-        s->status |= UHCI_STS_HCHALTED;
+        if (!(s->cmd & UHCI_CMD_RS)) {
+            /* Full stop */
+            qemu_del_timer(s->frame_timer);
+            /* set hchalted bit in status - UHCI11D 2.1.2 */
+            s->status |= UHCI_STS_HCHALTED;
 
-        DPRINTF("uhci: halted\n");
-        return;
-    }
+            DPRINTF("uhci: halted\n");
+            return;
+        }
 
-    /* Complete the previous frame */
-    if (s->pending_int_mask) {
-        s->status2 |= s->pending_int_mask;
-        s->status  |= UHCI_STS_USBINT;
-        uhci_update_irq(s);
-    }
-    s->pending_int_mask = 0;
+        /* Complete the previous frame */
+        if (s->pending_int_mask) {
+            s->status2 |= s->pending_int_mask;
+            s->status  |= UHCI_STS_USBINT;
+            uhci_update_irq(s);
+        }
+        s->pending_int_mask = 0;
+
+        /* Start new frame */
+        s->frnum = (s->frnum + 1) & 0x7ff;
 
-    /* Start new frame */
-    s->frnum = (s->frnum + 1) & 0x7ff;
+        DPRINTF("uhci: new frame #%u\n" , s->frnum);
+
+        if (s->idle_frames < FRAME_IDLE_FRAMES) {
+            s->idle_frames++;
+        }
 
-    DPRINTF("uhci: new frame #%u\n" , s->frnum);
+        uhci_async_validate_begin(s);
 
-    uhci_async_validate_begin(s);
+        uhci_process_frame(s);
+
+        uhci_async_validate_end(s);
+
+        if (s->async_pending) {
+            s->idle_frames = 0;
+        }
+    }
+}
 
-    uhci_process_frame(s);
+static void uhci_frame_timer(void *opaque)
+{
+    UHCIState *s = opaque;
+    int64_t next;
 
-    uhci_async_validate_end(s);
+    uhci_run_frames(s);
+    if (!(s->cmd & UHCI_CMD_RS)) {
+        return;
+    }
 
-    qemu_mod_timer(s->frame_timer, s->expire_time);
+    next = s->expire_time;
+    if (s->idle_frames >= FRAME_IDLE_FRAMES) {
+        next += (FRAME_IDLE_STEP - 1) *
+            (get_ticks_per_sec() / FRAME_TIMER_FREQ);
+    }
+    qemu_mod_timer(s->frame_timer, next);
 }
 
 static void uhci_map(PCIDevice *pci_dev, int region_num,
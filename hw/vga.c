@@ -28,6 +28,9 @@
 #include "vga_int.h"
 #include "pixel_ops.h"
 #include "qemu-timer.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 //#define DEBUG_VGA
 //#define DEBUG_VGA_MEM
@@ -1612,6 +1615,35 @@ void vga_dirty_log_restart(VGACommonState *s)
     vga_dirty_log_start(s);
 }
 
+/* Return 1 if nothing needs to be redrawn on a linearly addressed screen,
+   testing the dirty bitmap of the whole frame in one pass rather than
+   line by line.  */
+static int vga_graphic_is_clean(VGACommonState *s, uint32_t addr1,
+                                int line_offset, int bwidth, int height)
+{
+    uint32_t end;
+    int i;
+
+    if ((s->cr[0x17] & 3) != 3 || s->line_compare < height) {
+        return 0;
+    }
+    for (i = 0; i < (height + 31) >> 5; i++) {
+        if (s->invalidated_y_table[i]) {
+            return 0;
+        }
+    }
+    end = addr1 + line_offset * (height - 1) + bwidth;
+    if (end > s->vram_size) {
+        end = s->vram_size;
+    }
+    if (end <= addr1) {
+        return 0;
+    }
+    return !cpu_physical_memory_get_dirty_range(s->vram_offset + addr1,
+                                                s->vram_offset + end,
+                                                VGA_DIRTY_FLAG);
+}
+
 /*
  * graphic modes
  */
@@ -1756,6 +1788,10 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 #endif
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
+    if (!full_update && vga_graphic_is_clean(s, addr1, line_offset,
+                                             bwidth, height)) {
+        return;
+    }
     y_start = -1;
     page_min = -1;
     page_max = 0;
@@ -1775,14 +1811,10 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         }
         page0 = s->vram_offset + (addr & TARGET_PAGE_MASK);
         page1 = s->vram_offset + ((addr + bwidth - 1) & TARGET_PAGE_MASK);
-        update = full_update |
-            cpu_physical_memory_get_dirty(page0, VGA_DIRTY_FLAG) |
-            cpu_physical_memory_get_dirty(page1, VGA_DIRTY_FLAG);
-        if ((page1 - page0) > TARGET_PAGE_SIZE) {
-            /* if wide line, can use another page */
-            update |= cpu_physical_memory_get_dirty(page0 + TARGET_PAGE_SIZE,
-                                                    VGA_DIRTY_FLAG);
-        }
+        update = full_update ||
+            cpu_physical_memory_get_dirty_range(page0,
+                                                page1 + TARGET_PAGE_SIZE,
+                                                VGA_DIRTY_FLAG);
         /* explicit invalidation for the hardware cursor */
         update |= (s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1;
         if (update) {
@@ -2236,7 +2268,7 @@ void vga_common_init(VGACommonState *s, int vga_ram_size)
 #else
     s->is_vbe_vmstate = 0;
 #endif
-    s->vram_offset = qemu_ram_alloc(NULL, "vga.vram", vga_ram_size);
+    s->vram_offset = qemu_ram_alloc_lazy(NULL, "vga.vram", vga_ram_size);
     s->vram_ptr = qemu_get_ram_ptr(s->vram_offset);
     s->vram_size = vga_ram_size;
     s->get_bpp = vga_get_bpp;
@@ -41,6 +41,43 @@
 #define PIXEL_NAME DEPTH
 #endif /* BGR_FORMAT */
 
+#if DEPTH == 32 && defined(__SSE2__) && \
+    !defined(HOST_WORDS_BIGENDIAN) && !defined(TARGET_WORDS_BIGENDIAN)
+#define VGA_SSE2
+
+/* Convert four 15 or 16 bit pixels, zero extended to 32 bits, to the
+   display format.  */
+static inline __m128i glue(vga_rgb15_to_pixel_, PIXEL_NAME)(__m128i v)
+{
+    __m128i r, g, b;
+
+#ifdef BGR_FORMAT
+    r = _mm_and_si128(_mm_srli_epi32(v, 7), _mm_set1_epi32(0xf8));
+    b = _mm_and_si128(_mm_slli_epi32(v, 19), _mm_set1_epi32(0xf80000));
+#else
+    r = _mm_and_si128(_mm_slli_epi32(v, 9), _mm_set1_epi32(0xf80000));
+    b = _mm_and_si128(_mm_slli_epi32(v, 3), _mm_set1_epi32(0xf8));
+#endif
+    g = _mm_and_si128(_mm_slli_epi32(v, 6), _mm_set1_epi32(0xf800));
+    return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+static inline __m128i glue(vga_rgb16_to_pixel_, PIXEL_NAME)(__m128i v)
+{
+    __m128i r, g, b;
+
+#ifdef BGR_FORMAT
+    r = _mm_and_si128(_mm_srli_epi32(v, 8), _mm_set1_epi32(0xf8));
+    b = _mm_and_si128(_mm_slli_epi32(v, 19), _mm_set1_epi32(0xf80000));
+#else
+    r = _mm_and_si128(_mm_slli_epi32(v, 8), _mm_set1_epi32(0xf80000));
+    b = _mm_and_si128(_mm_slli_epi32(v, 3), _mm_set1_epi32(0xf8));
+#endif
+    g = _mm_and_si128(_mm_slli_epi32(v, 5), _mm_set1_epi32(0xfc00));
+    return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+#endif
+
 #if DEPTH != 15 && !defined(BGR_FORMAT)
 
 static inline void glue(vga_draw_glyph_line_, DEPTH)(uint8_t *d,
@@ -424,7 +461,21 @@ static void glue(vga_draw_line15_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t v, r, g, b;
 
     w = width;
-    do {
+#ifdef VGA_SSE2
+    for (; w >= 8; w -= 8) {
+        __m128i v8 = _mm_loadu_si128((const __m128i *)s);
+        __m128i zero = _mm_setzero_si128();
+
+        _mm_storeu_si128((__m128i *)d, glue(vga_rgb15_to_pixel_, PIXEL_NAME)
+                         (_mm_unpacklo_epi16(v8, zero)));
+        _mm_storeu_si128((__m128i *)(d + 16),
+                         glue(vga_rgb15_to_pixel_, PIXEL_NAME)
+                         (_mm_unpackhi_epi16(v8, zero)));
+        s += 16;
+        d += 32;
+    }
+#endif
+    for (; w > 0; w--) {
         v = lduw_raw((void *)s);
         r = (v >> 7) & 0xf8;
         g = (v >> 2) & 0xf8;
@@ -432,7 +483,7 @@ static void glue(vga_draw_line15_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
         ((PIXEL_TYPE *)d)[0] = glue(rgb_to_pixel, PIXEL_NAME)(r, g, b);
         s += 2;
         d += BPP;
-    } while (--w != 0);
+    }
 #endif
 }
 
@@ -449,7 +500,21 @@ static void glue(vga_draw_line16_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t v, r, g, b;
 
     w = width;
-    do {
+#ifdef VGA_SSE2
+    for (; w >= 8; w -= 8) {
+        __m128i v8 = _mm_loadu_si128((const __m128i *)s);
+        __m128i zero = _mm_setzero_si128();
+
+        _mm_storeu_si128((__m128i *)d, glue(vga_rgb16_to_pixel_, PIXEL_NAME)
+                         (_mm_unpacklo_epi16(v8, zero)));
+        _mm_storeu_si128((__m128i *)(d + 16),
+                         glue(vga_rgb16_to_pixel_, PIXEL_NAME)
+                         (_mm_unpackhi_epi16(v8, zero)));
+        s += 16;
+        d += 32;
+    }
+#endif
+    for (; w > 0; w--) {
         v = lduw_raw((void *)s);
         r = (v >> 8) & 0xf8;
         g = (v >> 3) & 0xfc;
@@ -457,7 +522,7 @@ static void glue(vga_draw_line16_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
         ((PIXEL_TYPE *)d)[0] = glue(rgb_to_pixel, PIXEL_NAME)(r, g, b);
         s += 2;
         d += BPP;
-    } while (--w != 0);
+    }
 #endif
 }
 
@@ -500,7 +565,21 @@ static void glue(vga_draw_line32_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t r, g, b;
 
     w = width;
-    do {
+#if defined(VGA_SSE2) && defined(BGR_FORMAT)
+    /* swap the red and blue bytes of four pixels at a time */
+    for (; w >= 4; w -= 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+
+        v = _mm_or_si128(_mm_or_si128(
+                _mm_and_si128(_mm_slli_epi32(v, 16), _mm_set1_epi32(0xff0000)),
+                _mm_and_si128(v, _mm_set1_epi32(0xff00))),
+                _mm_and_si128(_mm_srli_epi32(v, 16), _mm_set1_epi32(0xff)));
+        _mm_storeu_si128((__m128i *)d, v);
+        s += 16;
+        d += 16;
+    }
+#endif
+    for (; w > 0; w--) {
 #if defined(TARGET_WORDS_BIGENDIAN)
         r = s[1];
         g = s[2];
@@ -513,11 +592,12 @@ static void glue(vga_draw_line32_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
         ((PIXEL_TYPE *)d)[0] = glue(rgb_to_pixel, PIXEL_NAME)(r, g, b);
         s += 4;
         d += BPP;
-    } while (--w != 0);
+    }
 #endif
 }
 
 #undef PUT_PIXEL2
+#undef VGA_SSE2
 #undef DEPTH
 #undef BPP
 #undef PIXEL_TYPE
@@ -16,42 +16,74 @@
 #include "range.h"
 #include <linux/vhost.h>
 
+/* Merge the dirty bits the kernel logged for [rfirst, rlast], which is
+ * mapped at ruser, into the dirty map of guest RAM.  A log word covers 64
+ * pages; clean words are skipped with a plain read, and dirty ones are
+ * merged whole when a log page is a target page. */
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   uint64_t mfirst, uint64_t mlast,
-                                  uint64_t rfirst, uint64_t rlast)
+                                  uint64_t rfirst, uint64_t rlast,
+                                  uint64_t ruser)
 {
     uint64_t start = MAX(mfirst, rfirst);
     uint64_t end = MIN(mlast, rlast);
-    vhost_log_chunk_t *from = dev->log + start / VHOST_LOG_CHUNK;
-    vhost_log_chunk_t *to = dev->log + end / VHOST_LOG_CHUNK + 1;
-    uint64_t addr = (start / VHOST_LOG_CHUNK) * VHOST_LOG_CHUNK;
+    uint64_t first = start / VHOST_LOG_PAGE;
+    uint64_t last = end / VHOST_LOG_PAGE;
+    uint64_t w;
 
-    assert(end / VHOST_LOG_CHUNK < dev->log_size);
-    assert(start / VHOST_LOG_CHUNK < dev->log_size);
     if (end < start) {
         return;
     }
-    for (;from < to; ++from) {
+    assert(last / VHOST_LOG_BITS < dev->log_size);
+
+    for (w = first / VHOST_LOG_BITS; w <= last / VHOST_LOG_BITS; w++) {
+        vhost_log_chunk_t mask = ~(vhost_log_chunk_t)0;
         vhost_log_chunk_t log;
+        uint64_t page = w * VHOST_LOG_BITS;
+        ram_addr_t ram_addr;
         int bit;
+
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
-        if (!*from) {
-            addr += VHOST_LOG_CHUNK;
+        if (!dev->log[w]) {
             continue;
         }
+        /* Only take the bits of this region, a word can be shared with
+         * the next one */
+        if (w == first / VHOST_LOG_BITS) {
+            mask &= mask << (first % VHOST_LOG_BITS);
+        }
+        if (w == last / VHOST_LOG_BITS) {
+            mask &= mask >> (VHOST_LOG_BITS - 1 - last % VHOST_LOG_BITS);
+        }
         /* Data must be read atomically. We don't really
          * need the barrier semantics of __sync
          * builtins, but it's easier to use them than
          * roll our own. */
-        log = __sync_fetch_and_and(from, 0);
+        log = __sync_fetch_and_and(&dev->log[w], ~mask) & mask;
+        if (!log) {
+            continue;
+        }
+
+        /* The log is indexed by guest physical address, the dirty map by
+         * RAM offset */
+        if (page < rfirst / VHOST_LOG_PAGE) {
+            log >>= rfirst / VHOST_LOG_PAGE - page;
+            page = rfirst / VHOST_LOG_PAGE;
+        }
+        ram_addr = qemu_ram_addr_from_host_nofail((void *)(uintptr_t)
+            (ruser + page * VHOST_LOG_PAGE - rfirst));
+
+        if (VHOST_LOG_PAGE == TARGET_PAGE_SIZE) {
+            cpu_physical_memory_set_dirty_bits(ram_addr, log);
+            continue;
+        }
         while ((bit = sizeof(log) > sizeof(int) ?
                 ffsll(log) : ffs(log))) {
             bit -= 1;
-            cpu_physical_memory_set_dirty(addr + bit * VHOST_LOG_PAGE);
+            cpu_physical_memory_set_dirty(ram_addr + bit * VHOST_LOG_PAGE);
             log &= ~(0x1ull << bit);
         }
-        addr += VHOST_LOG_CHUNK;
     }
 }
 
@@ -69,12 +101,14 @@ static int vhost_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
         vhost_dev_sync_region(dev, start_addr, end_addr,
                               reg->guest_phys_addr,
                               range_get_last(reg->guest_phys_addr,
-                                             reg->memory_size));
+                                             reg->memory_size),
+                              reg->userspace_addr);
     }
     for (i = 0; i < dev->nvqs; ++i) {
         struct vhost_virtqueue *vq = dev->vqs + i;
         vhost_dev_sync_region(dev, start_addr, end_addr, vq->used_phys,
-                              range_get_last(vq->used_phys, vq->used_size));
+                              range_get_last(vq->used_phys, vq->used_size),
+                              (uintptr_t)vq->used);
     }
     return 0;
 }
@@ -245,10 +279,13 @@ static uint64_t vhost_get_log_size(struct vhost_dev *dev)
     return log_size;
 }
 
+/* Switch the kernel to a log of size words.  What it logged so far is
+ * carried over to the new log word by word, rather than synced out; only
+ * what no longer fits has to be synced. */
 static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
 {
     vhost_log_chunk_t *log;
-    uint64_t log_base;
+    uint64_t log_base, i;
     int r;
     if (size) {
         log = qemu_mallocz(size * sizeof *log);
@@ -258,8 +295,17 @@ static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
     log_base = (uint64_t)(unsigned long)log;
     r = ioctl(dev->control, VHOST_SET_LOG_BASE, &log_base);
     assert(r >= 0);
-    vhost_client_sync_dirty_bitmap(&dev->client, 0,
-                                   (target_phys_addr_t)~0x0ull);
+    /* The kernel writes to the new log from now on */
+    for (i = 0; i < MIN(size, dev->log_size); i++) {
+        if (dev->log[i]) {
+            __sync_fetch_and_or(&log[i], dev->log[i]);
+        }
+    }
+    if (dev->log_size > size) {
+        vhost_client_sync_dirty_bitmap(&dev->client,
+                                       size * VHOST_LOG_CHUNK,
+                                       (target_phys_addr_t)~0x0ull);
+    }
     if (dev->log) {
         qemu_free(dev->log);
     }
@@ -453,49 +499,50 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
     struct vhost_vring_state state = {
         .index = idx,
     };
-    struct VirtQueue *vvq = virtio_get_queue(vdev, idx);
+    int vdev_idx = dev->vq_index + idx;
+    struct VirtQueue *vvq = virtio_get_queue(vdev, vdev_idx);
 
     if (!vdev->binding->set_host_notifier) {
         fprintf(stderr, "binding does not support host notifiers\n");
         return -ENOSYS;
     }
 
-    vq->num = state.num = virtio_queue_get_num(vdev, idx);
+    vq->num = state.num = virtio_queue_get_num(vdev, vdev_idx);
     r = ioctl(dev->control, VHOST_SET_VRING_NUM, &state);
     if (r) {
         return -errno;
     }
 
-    state.num = virtio_queue_get_last_avail_idx(vdev, idx);
+    state.num = virtio_queue_get_last_avail_idx(vdev, vdev_idx);
     r = ioctl(dev->control, VHOST_SET_VRING_BASE, &state);
     if (r) {
         return -errno;
     }
 
-    s = l = virtio_queue_get_desc_size(vdev, idx);
-    a = virtio_queue_get_desc_addr(vdev, idx);
+    s = l = virtio_queue_get_desc_size(vdev, vdev_idx);
+    a = virtio_queue_get_desc_addr(vdev, vdev_idx);
     vq->desc = cpu_physical_memory_map(a, &l, 0);
     if (!vq->desc || l != s) {
         r = -ENOMEM;
         goto fail_alloc_desc;
     }
-    s = l = virtio_queue_get_avail_size(vdev, idx);
-    a = virtio_queue_get_avail_addr(vdev, idx);
+    s = l = virtio_queue_get_avail_size(vdev, vdev_idx);
+    a = virtio_queue_get_avail_addr(vdev, vdev_idx);
     vq->avail = cpu_physical_memory_map(a, &l, 0);
     if (!vq->avail || l != s) {
         r = -ENOMEM;
         goto fail_alloc_avail;
     }
-    vq->used_size = s = l = virtio_queue_get_used_size(vdev, idx);
-    vq->used_phys = a = virtio_queue_get_used_addr(vdev, idx);
+    vq->used_size = s = l = virtio_queue_get_used_size(vdev, vdev_idx);
+    vq->used_phys = a = virtio_queue_get_used_addr(vdev, vdev_idx);
     vq->used = cpu_physical_memory_map(a, &l, 1);
     if (!vq->used || l != s) {
         r = -ENOMEM;
         goto fail_alloc_used;
     }
 
-    vq->ring_size = s = l = virtio_queue_get_ring_size(vdev, idx);
-    vq->ring_phys = a = virtio_queue_get_ring_addr(vdev, idx);
+    vq->ring_size = s = l = virtio_queue_get_ring_size(vdev, vdev_idx);
+    vq->ring_phys = a = virtio_queue_get_ring_addr(vdev, vdev_idx);
     vq->ring = cpu_physical_memory_map(a, &l, 1);
     if (!vq->ring || l != s) {
         r = -ENOMEM;
@@ -507,7 +554,7 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
         r = -errno;
         goto fail_alloc;
     }
-    r = vdev->binding->set_host_notifier(vdev->binding_opaque, idx, true);
+    r = vdev->binding->set_host_notifier(vdev->binding_opaque, vdev_idx, true);
     if (r < 0) {
         fprintf(stderr, "Error binding host notifier: %d\n", -r);
         goto fail_host_notifier;
@@ -531,19 +578,19 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
 
 fail_call:
 fail_kick:
-    vdev->binding->set_host_notifier(vdev->binding_opaque, idx, false);
+    vdev->binding->set_host_notifier(vdev->binding_opaque, vdev_idx, false);
 fail_host_notifier:
 fail_alloc:
-    cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, idx),
+    cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, vdev_idx),
                               0, 0);
 fail_alloc_ring:
-    cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, idx),
+    cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, vdev_idx),
                               0, 0);
 fail_alloc_used:
-    cpu_physical_memory_unmap(vq->avail, virtio_queue_get_avail_size(vdev, idx),
+    cpu_physical_memory_unmap(vq->avail, virtio_queue_get_avail_size(vdev, vdev_idx),
                               0, 0);
 fail_alloc_avail:
-    cpu_physical_memory_unmap(vq->desc, virtio_queue_get_desc_size(vdev, idx),
+    cpu_physical_memory_unmap(vq->desc, virtio_queue_get_desc_size(vdev, vdev_idx),
                               0, 0);
 fail_alloc_desc:
     return r;
@@ -557,8 +604,9 @@ static void vhost_virtqueue_cleanup(struct vhost_dev *dev,
     struct vhost_vring_state state = {
         .index = idx,
     };
+    int vdev_idx = dev->vq_index + idx;
     int r;
-    r = vdev->binding->set_host_notifier(vdev->binding_opaque, idx, false);
+    r = vdev->binding->set_host_notifier(vdev->binding_opaque, vdev_idx, false);
     if (r < 0) {
         fprintf(stderr, "vhost VQ %d host cleanup failed: %d\n", idx, r);
         fflush(stderr);
@@ -571,14 +619,14 @@ static void vhost_virtqueue_cleanup(struct vhost_dev *dev,
     }
     virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     assert (r >= 0);
-    cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, idx),
-                              0, virtio_queue_get_ring_size(vdev, idx));
-    cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, idx),
-                              1, virtio_queue_get_used_size(vdev, idx));
-    cpu_physical_memory_unmap(vq->avail, virtio_queue_get_avail_size(vdev, idx),
-                              0, virtio_queue_get_avail_size(vdev, idx));
-    cpu_physical_memory_unmap(vq->desc, virtio_queue_get_desc_size(vdev, idx),
-                              0, virtio_queue_get_desc_size(vdev, idx));
+    cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, vdev_idx),
+                              0, virtio_queue_get_ring_size(vdev, vdev_idx));
+    cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, vdev_idx),
+                              1, virtio_queue_get_used_size(vdev, vdev_idx));
+    cpu_physical_memory_unmap(vq->avail, virtio_queue_get_avail_size(vdev, vdev_idx),
+                              0, virtio_queue_get_avail_size(vdev, vdev_idx));
+    cpu_physical_memory_unmap(vq->desc, virtio_queue_get_desc_size(vdev, vdev_idx),
+                              0, virtio_queue_get_desc_size(vdev, vdev_idx));
 }
 
 int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force)
@@ -640,17 +688,6 @@ bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev)
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
     int i, r;
-    if (!vdev->binding->set_guest_notifiers) {
-        fprintf(stderr, "binding does not support guest notifiers\n");
-        r = -ENOSYS;
-        goto fail;
-    }
-
-    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, true);
-    if (r < 0) {
-        fprintf(stderr, "Error binding guest notifier: %d\n", -r);
-        goto fail_notifiers;
-    }
 
     r = vhost_dev_set_features(hdev, hdev->log_enabled);
     if (r < 0) {
@@ -696,15 +733,12 @@ fail_vq:
     }
 fail_mem:
 fail_features:
-    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
-fail_notifiers:
-fail:
     return r;
 }
 
 void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
-    int i, r;
+    int i;
 
     for (i = 0; i < hdev->nvqs; ++i) {
         vhost_virtqueue_cleanup(hdev,
@@ -714,12 +748,6 @@ void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
     vhost_client_sync_dirty_bitmap(&hdev->client, 0,
                                    (target_phys_addr_t)~0x0ull);
-    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
-    if (r < 0) {
-        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
-        fflush(stderr);
-    }
-    assert (r >= 0);
 
     hdev->started = false;
     qemu_free(hdev->log);
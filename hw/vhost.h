@@ -31,6 +31,8 @@ struct vhost_dev {
     struct vhost_memory *mem;
     struct vhost_virtqueue *vqs;
     int nvqs;
+    /* the first virtio queue of the device the vqs stand for */
+    int vq_index;
     unsigned long long features;
     unsigned long long acked_features;
     unsigned long long backend_features;
@@ -44,6 +46,7 @@ struct vhost_dev {
 int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force);
 void vhost_dev_cleanup(struct vhost_dev *hdev);
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev);
+/* The guest notifiers of vdev must be set up before starting */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev);
 void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev);
 
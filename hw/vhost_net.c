@@ -50,6 +50,9 @@ unsigned vhost_net_get_features(struct vhost_net *net, unsigned features)
     if (!(net->dev.features & (1 << VIRTIO_RING_F_INDIRECT_DESC))) {
         features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
     }
+    if (!(net->dev.features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
+    }
     if (!(net->dev.features & (1 << VIRTIO_NET_F_MRG_RXBUF))) {
         features &= ~(1 << VIRTIO_NET_F_MRG_RXBUF);
     }
@@ -65,6 +68,9 @@ void vhost_net_ack_features(struct vhost_net *net, unsigned features)
     if (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) {
         net->dev.acked_features |= (1 << VIRTIO_RING_F_INDIRECT_DESC);
     }
+    if (features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        net->dev.acked_features |= (1 << VIRTIO_RING_F_EVENT_IDX);
+    }
     if (features & (1 << VIRTIO_NET_F_MRG_RXBUF)) {
         net->dev.acked_features |= (1 << VIRTIO_NET_F_MRG_RXBUF);
     }
@@ -127,8 +133,9 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return vhost_dev_query(&net->dev, dev);
 }
 
-int vhost_net_start(struct vhost_net *net,
-                    VirtIODevice *dev)
+static int vhost_net_start_one(struct vhost_net *net,
+                               VirtIODevice *dev,
+                               int vq_index)
 {
     struct vhost_vring_file file = { };
     int r;
@@ -139,6 +146,7 @@ int vhost_net_start(struct vhost_net *net,
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.vq_index = vq_index;
     r = vhost_dev_start(&net->dev, dev);
     if (r < 0) {
         return r;
@@ -169,8 +177,8 @@ fail:
     return r;
 }
 
-void vhost_net_stop(struct vhost_net *net,
-                    VirtIODevice *dev)
+static void vhost_net_stop_one(struct vhost_net *net,
+                               VirtIODevice *dev)
 {
     struct vhost_vring_file file = { .fd = -1 };
 
@@ -185,6 +193,56 @@ void vhost_net_stop(struct vhost_net *net,
     }
 }
 
+/* Start the vhost-net instances of the n queue pairs of dev; pair i is
+ * made of virtio queues 2 * i and 2 * i + 1, and each instance has a
+ * kernel worker of its own.
+ */
+int vhost_net_start(VirtIODevice *dev, struct vhost_net **nets, int n)
+{
+    int i, r;
+
+    if (!dev->binding->set_guest_notifiers) {
+        fprintf(stderr, "binding does not support guest notifiers\n");
+        return -ENOSYS;
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, true);
+    if (r < 0) {
+        fprintf(stderr, "Error binding guest notifier: %d\n", -r);
+        return r;
+    }
+
+    for (i = 0; i < n; i++) {
+        r = vhost_net_start_one(nets[i], dev, i * 2);
+        if (r < 0) {
+            goto fail;
+        }
+    }
+    return 0;
+fail:
+    while (--i >= 0) {
+        vhost_net_stop_one(nets[i], dev);
+    }
+    dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    return r;
+}
+
+void vhost_net_stop(VirtIODevice *dev, struct vhost_net **nets, int n)
+{
+    int i, r;
+
+    for (i = 0; i < n; i++) {
+        vhost_net_stop_one(nets[i], dev);
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    if (r < 0) {
+        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
+        fflush(stderr);
+    }
+    assert(r >= 0);
+}
+
 void vhost_net_cleanup(struct vhost_net *net)
 {
     vhost_dev_cleanup(&net->dev);
@@ -205,13 +263,11 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return false;
 }
 
-int vhost_net_start(struct vhost_net *net,
-		    VirtIODevice *dev)
+int vhost_net_start(VirtIODevice *dev, struct vhost_net **nets, int n)
 {
     return -ENOSYS;
 }
-void vhost_net_stop(struct vhost_net *net,
-		    VirtIODevice *dev)
+void vhost_net_stop(VirtIODevice *dev, struct vhost_net **nets, int n)
 {
 }
 
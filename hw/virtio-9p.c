@@ -75,18 +75,49 @@ void cred_init(FsCred *credp)
     credp->fc_rdev = -1;
 }
 
+/*
+ * The v9fs_do_* helpers are called by the worker threads with s->lock held
+ * and drop it around the file system operation, so that other requests go
+ * on while this one blocks.  The paths are copied first, a rename may change
+ * those of the fids meanwhile.
+ */
+static void v9fs_unlock(V9fsState *s)
+{
+    qemu_mutex_unlock(&s->lock);
+}
+
+/* Take s->lock back and free the copies, errno is left alone */
+static void v9fs_relock(V9fsState *s, char *copy, char *copy2)
+{
+    int err = errno;
+
+    qemu_mutex_lock(&s->lock);
+    qemu_free(copy);
+    qemu_free(copy2);
+    errno = err;
+}
+
 static int v9fs_do_lstat(V9fsState *s, V9fsString *path, struct stat *stbuf)
 {
-    return s->ops->lstat(&s->ctx, path->data, stbuf);
+    char *p = qemu_strdup(path->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->lstat(&s->ctx, p, stbuf);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static ssize_t v9fs_do_readlink(V9fsState *s, V9fsString *path, V9fsString *buf)
 {
+    char *p = qemu_strdup(path->data);
     ssize_t len;
 
     buf->data = qemu_malloc(1024);
 
-    len = s->ops->readlink(&s->ctx, path->data, buf->data, 1024 - 1);
+    v9fs_unlock(s);
+    len = s->ops->readlink(&s->ctx, p, buf->data, 1024 - 1);
+    v9fs_relock(s, p, NULL);
     if (len > -1) {
         buf->size = len;
         buf->data[len] = 0;
@@ -107,12 +138,24 @@ static int v9fs_do_closedir(V9fsState *s, DIR *dir)
 
 static int v9fs_do_open(V9fsState *s, V9fsString *path, int flags)
 {
-    return s->ops->open(&s->ctx, path->data, flags);
+    char *p = qemu_strdup(path->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->open(&s->ctx, p, flags);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static DIR *v9fs_do_opendir(V9fsState *s, V9fsString *path)
 {
-    return s->ops->opendir(&s->ctx, path->data);
+    char *p = qemu_strdup(path->data);
+    DIR *dir;
+
+    v9fs_unlock(s);
+    dir = s->ops->opendir(&s->ctx, p);
+    v9fs_relock(s, p, NULL);
+    return dir;
 }
 
 static void v9fs_do_rewinddir(V9fsState *s, DIR *dir)
@@ -127,7 +170,12 @@ static off_t v9fs_do_telldir(V9fsState *s, DIR *dir)
 
 static struct dirent *v9fs_do_readdir(V9fsState *s, DIR *dir)
 {
-    return s->ops->readdir(&s->ctx, dir);
+    struct dirent *dent;
+
+    v9fs_unlock(s);
+    dent = s->ops->readdir(&s->ctx, dir);
+    v9fs_relock(s, NULL, NULL);
+    return dent;
 }
 
 static void v9fs_do_seekdir(V9fsState *s, DIR *dir, off_t off)
@@ -138,57 +186,91 @@ static void v9fs_do_seekdir(V9fsState *s, DIR *dir, off_t off)
 static int v9fs_do_preadv(V9fsState *s, int fd, const struct iovec *iov,
                             int iovcnt, int64_t offset)
 {
-    return s->ops->preadv(&s->ctx, fd, iov, iovcnt, offset);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->preadv(&s->ctx, fd, iov, iovcnt, offset);
+    v9fs_relock(s, NULL, NULL);
+    return ret;
 }
 
 static int v9fs_do_pwritev(V9fsState *s, int fd, const struct iovec *iov,
                        int iovcnt, int64_t offset)
 {
-    return s->ops->pwritev(&s->ctx, fd, iov, iovcnt, offset);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->pwritev(&s->ctx, fd, iov, iovcnt, offset);
+    v9fs_relock(s, NULL, NULL);
+    return ret;
 }
 
 static int v9fs_do_chmod(V9fsState *s, V9fsString *path, mode_t mode)
 {
+    char *p = qemu_strdup(path->data);
     FsCred cred;
+    int ret;
+
     cred_init(&cred);
     cred.fc_mode = mode;
-    return s->ops->chmod(&s->ctx, path->data, &cred);
+    v9fs_unlock(s);
+    ret = s->ops->chmod(&s->ctx, p, &cred);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static int v9fs_do_mknod(V9fsState *s, char *name,
         mode_t mode, dev_t dev, uid_t uid, gid_t gid)
 {
+    char *p = qemu_strdup(name);
     FsCred cred;
+    int ret;
+
     cred_init(&cred);
     cred.fc_uid = uid;
     cred.fc_gid = gid;
     cred.fc_mode = mode;
     cred.fc_rdev = dev;
-    return s->ops->mknod(&s->ctx, name, &cred);
+    v9fs_unlock(s);
+    ret = s->ops->mknod(&s->ctx, p, &cred);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static int v9fs_do_mkdir(V9fsState *s, char *name, mode_t mode,
                 uid_t uid, gid_t gid)
 {
+    char *p = qemu_strdup(name);
     FsCred cred;
+    int ret;
 
     cred_init(&cred);
     cred.fc_uid = uid;
     cred.fc_gid = gid;
     cred.fc_mode = mode;
 
-    return s->ops->mkdir(&s->ctx, name, &cred);
+    v9fs_unlock(s);
+    ret = s->ops->mkdir(&s->ctx, p, &cred);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static int v9fs_do_fstat(V9fsState *s, int fd, struct stat *stbuf)
 {
-    return s->ops->fstat(&s->ctx, fd, stbuf);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->fstat(&s->ctx, fd, stbuf);
+    v9fs_relock(s, NULL, NULL);
+    return ret;
 }
 
 static int v9fs_do_open2(V9fsState *s, char *fullname, uid_t uid, gid_t gid,
         int flags, int mode)
 {
+    char *p = qemu_strdup(fullname);
     FsCred cred;
+    int ret;
 
     cred_init(&cred);
     cred.fc_uid = uid;
@@ -196,96 +278,172 @@ static int v9fs_do_open2(V9fsState *s, char *fullname, uid_t uid, gid_t gid,
     cred.fc_mode = mode & 07777;
     flags = flags;
 
-    return s->ops->open2(&s->ctx, fullname, flags, &cred);
+    v9fs_unlock(s);
+    ret = s->ops->open2(&s->ctx, p, flags, &cred);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static int v9fs_do_symlink(V9fsState *s, V9fsFidState *fidp,
         const char *oldpath, const char *newpath, gid_t gid)
 {
+    char *p = qemu_strdup(oldpath), *p2 = qemu_strdup(newpath);
     FsCred cred;
+    int ret;
+
     cred_init(&cred);
     cred.fc_uid = fidp->uid;
     cred.fc_gid = gid;
     cred.fc_mode = 0777;
 
-    return s->ops->symlink(&s->ctx, oldpath, newpath, &cred);
+    v9fs_unlock(s);
+    ret = s->ops->symlink(&s->ctx, p, p2, &cred);
+    v9fs_relock(s, p, p2);
+    return ret;
 }
 
 static int v9fs_do_link(V9fsState *s, V9fsString *oldpath, V9fsString *newpath)
 {
-    return s->ops->link(&s->ctx, oldpath->data, newpath->data);
+    char *p = qemu_strdup(oldpath->data), *p2 = qemu_strdup(newpath->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->link(&s->ctx, p, p2);
+    v9fs_relock(s, p, p2);
+    return ret;
 }
 
 static int v9fs_do_truncate(V9fsState *s, V9fsString *path, off_t size)
 {
-    return s->ops->truncate(&s->ctx, path->data, size);
+    char *p = qemu_strdup(path->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->truncate(&s->ctx, p, size);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static int v9fs_do_rename(V9fsState *s, V9fsString *oldpath,
                             V9fsString *newpath)
 {
-    return s->ops->rename(&s->ctx, oldpath->data, newpath->data);
+    char *p = qemu_strdup(oldpath->data), *p2 = qemu_strdup(newpath->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->rename(&s->ctx, p, p2);
+    v9fs_relock(s, p, p2);
+    return ret;
 }
 
 static int v9fs_do_chown(V9fsState *s, V9fsString *path, uid_t uid, gid_t gid)
 {
+    char *p = qemu_strdup(path->data);
     FsCred cred;
+    int ret;
+
     cred_init(&cred);
     cred.fc_uid = uid;
     cred.fc_gid = gid;
 
-    return s->ops->chown(&s->ctx, path->data, &cred);
+    v9fs_unlock(s);
+    ret = s->ops->chown(&s->ctx, p, &cred);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static int v9fs_do_utimensat(V9fsState *s, V9fsString *path,
                                            const struct timespec times[2])
 {
-    return s->ops->utimensat(&s->ctx, path->data, times);
+    char *p = qemu_strdup(path->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->utimensat(&s->ctx, p, times);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static int v9fs_do_remove(V9fsState *s, V9fsString *path)
 {
-    return s->ops->remove(&s->ctx, path->data);
+    char *p = qemu_strdup(path->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->remove(&s->ctx, p);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static int v9fs_do_fsync(V9fsState *s, int fd, int datasync)
 {
-    return s->ops->fsync(&s->ctx, fd, datasync);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->fsync(&s->ctx, fd, datasync);
+    v9fs_relock(s, NULL, NULL);
+    return ret;
 }
 
 static int v9fs_do_statfs(V9fsState *s, V9fsString *path, struct statfs *stbuf)
 {
-    return s->ops->statfs(&s->ctx, path->data, stbuf);
+    char *p = qemu_strdup(path->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->statfs(&s->ctx, p, stbuf);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static ssize_t v9fs_do_lgetxattr(V9fsState *s, V9fsString *path,
                              V9fsString *xattr_name,
                              void *value, size_t size)
 {
-    return s->ops->lgetxattr(&s->ctx, path->data,
-                             xattr_name->data, value, size);
+    char *p = qemu_strdup(path->data), *p2 = qemu_strdup(xattr_name->data);
+    ssize_t ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->lgetxattr(&s->ctx, p, p2, value, size);
+    v9fs_relock(s, p, p2);
+    return ret;
 }
 
 static ssize_t v9fs_do_llistxattr(V9fsState *s, V9fsString *path,
                               void *value, size_t size)
 {
-    return s->ops->llistxattr(&s->ctx, path->data,
-                              value, size);
+    char *p = qemu_strdup(path->data);
+    ssize_t ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->llistxattr(&s->ctx, p, value, size);
+    v9fs_relock(s, p, NULL);
+    return ret;
 }
 
 static int v9fs_do_lsetxattr(V9fsState *s, V9fsString *path,
                              V9fsString *xattr_name,
                              void *value, size_t size, int flags)
 {
-    return s->ops->lsetxattr(&s->ctx, path->data,
-                             xattr_name->data, value, size, flags);
+    char *p = qemu_strdup(path->data), *p2 = qemu_strdup(xattr_name->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->lsetxattr(&s->ctx, p, p2, value, size, flags);
+    v9fs_relock(s, p, p2);
+    return ret;
 }
 
 static int v9fs_do_lremovexattr(V9fsState *s, V9fsString *path,
                                 V9fsString *xattr_name)
 {
-    return s->ops->lremovexattr(&s->ctx, path->data,
-                                xattr_name->data);
+    char *p = qemu_strdup(path->data), *p2 = qemu_strdup(xattr_name->data);
+    int ret;
+
+    v9fs_unlock(s);
+    ret = s->ops->lremovexattr(&s->ctx, p, p2);
+    v9fs_relock(s, p, p2);
+    return ret;
 }
 
 
@@ -513,19 +671,50 @@ static int free_fid(V9fsState *s, int32_t fid)
     fidp = *fidpp;
     *fidpp = fidp->next;
 
-    if (fidp->fid_type == P9_FID_FILE) {
-        v9fs_do_close(s, fidp->fs.fd);
-    } else if (fidp->fid_type == P9_FID_DIR) {
-        v9fs_do_closedir(s, fidp->fs.dir);
-    } else if (fidp->fid_type == P9_FID_XATTR) {
+    if (fidp->fid_type == P9_FID_XATTR) {
         retval = v9fs_xattr_fid_clunk(s, fidp);
+        fidp->fid_type = P9_FID_NONE;
     }
-    v9fs_string_free(&fidp->path);
-    qemu_free(fidp);
+
+    /* requests in flight may still use it, see reclaim_fids() */
+    fidp->clunk_seq = s->seq;
+    fidp->next = s->reclaim_list;
+    s->reclaim_list = fidp;
 
     return retval;
 }
 
+/* Release the clunked fids that no request started before could still use */
+static void reclaim_fids(V9fsState *s)
+{
+    V9fsFidState **fidpp, *fidp;
+    uint64_t oldest = s->seq + 1;
+    int i;
+
+    for (i = 0; i < s->nr_workers; i++) {
+        if (s->workers[i].seq && s->workers[i].seq < oldest) {
+            oldest = s->workers[i].seq;
+        }
+    }
+
+    fidpp = &s->reclaim_list;
+    while ((fidp = *fidpp) != NULL) {
+        if (fidp->clunk_seq >= oldest) {
+            fidpp = &fidp->next;
+            continue;
+        }
+        *fidpp = fidp->next;
+
+        if (fidp->fid_type == P9_FID_FILE) {
+            v9fs_do_close(s, fidp->fs.fd);
+        } else if (fidp->fid_type == P9_FID_DIR) {
+            v9fs_do_closedir(s, fidp->fs.dir);
+        }
+        v9fs_string_free(&fidp->path);
+        qemu_free(fidp);
+    }
+}
+
 #define P9_QID_TYPE_DIR         0x80
 #define P9_QID_TYPE_SYMLINK     0x02
 
@@ -857,6 +1046,7 @@ static size_t pdu_marshal(V9fsPDU *pdu, size_t offset, const char *fmt, ...)
 static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
 {
     int8_t id = pdu->id + 1; /* Response */
+    int i;
 
     if (len < 0) {
         int err = -len;
@@ -886,13 +1076,21 @@ static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
     pdu->size = len;
     pdu->id = id;
 
-    /* push onto queue and notify */
-    virtqueue_push(s->vq, &pdu->elem, len);
+    /* the I/O thread pushes it onto the queue and notifies */
+    for (i = 0; i < s->nr_workers; i++) {
+        if (s->workers[i].pdu == pdu) {
+            s->workers[i].pdu = NULL;
+        }
+    }
+    QTAILQ_INSERT_TAIL(&s->done, pdu, entry);
+    event_notifier_set(&s->done_notifier);
 
-    /* FIXME: we should batch these completions */
-    virtio_notify(&s->vdev, s->vq);
+    if (pdu->flush) {
+        V9fsPDU *flush = pdu->flush;
 
-    free_pdu(s, pdu);
+        pdu->flush = NULL;
+        complete_pdu(s, flush, 7);
+    }
 }
 
 static mode_t v9mode_to_mode(uint32_t mode, V9fsString *extension)
@@ -1181,6 +1379,7 @@ static void v9fs_version(V9fsState *s, V9fsPDU *pdu)
     size_t offset = 7;
 
     pdu_unmarshal(pdu, offset, "ds", &s->msize, &version);
+    s->msize = MIN(s->msize, V9FS_MAX_MSIZE);
 
     if (!strcmp(version.data, "9P2000.u")) {
         s->proto_version = V9FS_PROTO_2000U;
@@ -2631,9 +2830,42 @@ out:
     qemu_free(vs);
 }
 
+/* The pdu with tag that has not been answered yet, if any */
+static V9fsPDU *v9fs_find_pdu(V9fsState *s, uint16_t tag)
+{
+    V9fsPDU *pdu;
+    int i;
+
+    QTAILQ_FOREACH(pdu, &s->pending, entry) {
+        if (pdu->tag == tag) {
+            return pdu;
+        }
+    }
+    for (i = 0; i < s->nr_workers; i++) {
+        pdu = s->workers[i].pdu;
+        if (pdu && pdu->tag == tag && pdu->id != P9_TFLUSH) {
+            return pdu;
+        }
+    }
+    return NULL;
+}
+
 static void v9fs_flush(V9fsState *s, V9fsPDU *pdu)
 {
-    /* A nop call with no return */
+    V9fsPDU *old;
+    int16_t tag;
+
+    pdu_unmarshal(pdu, 7, "w", &tag);
+
+    /* Requests are not cancelled, Rflush just has to follow their answer */
+    old = v9fs_find_pdu(s, tag);
+    if (old) {
+        while (old->flush) {
+            old = old->flush;
+        }
+        old->flush = pdu;
+        return;
+    }
     complete_pdu(s, pdu, 7);
 }
 
@@ -3586,20 +3818,55 @@ static pdu_handler_t *pdu_handlers[] = {
     [P9_TREMOVE] = v9fs_remove,
 };
 
-static void submit_pdu(V9fsState *s, V9fsPDU *pdu)
+static void *v9fs_worker_thread(void *opaque)
 {
-    pdu_handler_t *handler;
+    V9fsWorker *w = opaque;
+    V9fsState *s = w->s;
+    V9fsPDU *pdu;
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        while (QTAILQ_EMPTY(&s->pending)) {
+            s->idle_workers++;
+            qemu_cond_wait(&s->cond, &s->lock);
+            s->idle_workers--;
+        }
+        pdu = QTAILQ_FIRST(&s->pending);
+        QTAILQ_REMOVE(&s->pending, pdu, entry);
+
+        w->pdu = pdu;
+        w->seq = ++s->seq;
+        pdu_handlers[pdu->id](s, pdu);
+        w->pdu = NULL;
+        w->seq = 0;
 
+        reclaim_fids(s);
+    }
+    return NULL;
+}
+
+static void submit_pdu(V9fsState *s, V9fsPDU *pdu)
+{
     if (debug_9p_pdu) {
         pprint_pdu(pdu);
     }
 
     BUG_ON(pdu->id >= ARRAY_SIZE(pdu_handlers));
+    BUG_ON(pdu_handlers[pdu->id] == NULL);
 
-    handler = pdu_handlers[pdu->id];
-    BUG_ON(handler == NULL);
+    pdu->flush = NULL;
 
-    handler(s, pdu);
+    qemu_mutex_lock(&s->lock);
+    QTAILQ_INSERT_TAIL(&s->pending, pdu, entry);
+    if (s->idle_workers) {
+        qemu_cond_signal(&s->cond);
+    } else if (s->nr_workers < V9FS_MAX_WORKERS) {
+        V9fsWorker *w = &s->workers[s->nr_workers++];
+
+        w->s = s;
+        qemu_thread_create(&w->thread, v9fs_worker_thread, w);
+    }
+    qemu_mutex_unlock(&s->lock);
 }
 
 static void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
@@ -3627,6 +3894,36 @@ static void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
     free_pdu(s, pdu);
 }
 
+/* I/O thread: answer the requests the workers are done with */
+static void v9fs_complete_done(void *opaque)
+{
+    V9fsState *s = opaque;
+    QTAILQ_HEAD(, V9fsPDU) done = QTAILQ_HEAD_INITIALIZER(done);
+    V9fsPDU *pdu;
+
+    event_notifier_test_and_clear(&s->done_notifier);
+
+    qemu_mutex_lock(&s->lock);
+    while ((pdu = QTAILQ_FIRST(&s->done)) != NULL) {
+        QTAILQ_REMOVE(&s->done, pdu, entry);
+        QTAILQ_INSERT_TAIL(&done, pdu, entry);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    if (QTAILQ_EMPTY(&done)) {
+        return;
+    }
+    while ((pdu = QTAILQ_FIRST(&done)) != NULL) {
+        QTAILQ_REMOVE(&done, pdu, entry);
+        virtqueue_push(s->vq, &pdu->elem, pdu->size);
+        free_pdu(s, pdu);
+    }
+    virtio_notify(&s->vdev, s->vq);
+
+    /* requests may have been left in the queue for lack of a pdu */
+    handle_9p_output(&s->vdev, s->vq);
+}
+
 static uint32_t virtio_9p_get_features(VirtIODevice *vdev, uint32_t features)
 {
     features |= 1 << VIRTIO_9P_MOUNT_TAG;
@@ -3671,7 +3968,18 @@ VirtIODevice *virtio_9p_init(DeviceState *dev, V9fsConf *conf)
 	QLIST_INSERT_HEAD(&s->free_list, &s->pdus[i], next);
     }
 
-    s->vq = virtio_add_queue(&s->vdev, MAX_REQ, handle_9p_output);
+    s->vq = virtio_add_queue(&s->vdev, V9FS_QUEUE_SIZE, handle_9p_output);
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    QTAILQ_INIT(&s->pending);
+    QTAILQ_INIT(&s->done);
+    if (event_notifier_init(&s->done_notifier, 0) < 0) {
+        fprintf(stderr, "virtio-9p: cannot create the completion notifier\n");
+        exit(1);
+    }
+    qemu_set_fd_handler(event_notifier_get_fd(&s->done_notifier),
+                        v9fs_complete_done, NULL, s);
 
     fse = get_fsdev_fsentry(conf->fsdev_id);
 
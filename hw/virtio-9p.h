@@ -7,6 +7,8 @@
 #include <utime.h>
 
 #include "file-op-9p.h"
+#include "qemu-thread.h"
+#include "event_notifier.h"
 
 /* The feature bitmap for virtio 9P */
 /* The mount point is specified in a config variable */
@@ -117,6 +119,8 @@ struct V9fsPDU
     uint8_t id;
     VirtQueueElement elem;
     QLIST_ENTRY(V9fsPDU) next;
+    QTAILQ_ENTRY(V9fsPDU) entry;    /* pending or done */
+    V9fsPDU *flush;                 /* Tflush answered after this one */
 };
 
 
@@ -131,6 +135,12 @@ struct V9fsPDU
 #define MAX_REQ         128
 #define MAX_TAG_LEN     32
 
+/* Enough descriptors for a whole V9FS_MAX_MSIZE payload in 4k pages */
+#define V9FS_QUEUE_SIZE VIRTQUEUE_MAX_SIZE
+#define V9FS_MAX_MSIZE  (1 << 20)
+
+#define V9FS_MAX_WORKERS 16
+
 #define BUG_ON(cond) assert(!(cond))
 
 typedef struct V9fsFidState V9fsFidState;
@@ -197,8 +207,17 @@ struct V9fsFidState
     } fs;
     uid_t uid;
     V9fsFidState *next;
+    uint64_t clunk_seq;     /* requests started when it was clunked */
 };
 
+typedef struct V9fsWorker
+{
+    struct V9fsState *s;
+    QemuThread thread;
+    V9fsPDU *pdu;               /* being handled, not answered yet */
+    uint64_t seq;               /* of the request handled, or 0 */
+} V9fsWorker;
+
 typedef struct V9fsState
 {
     VirtIODevice vdev;
@@ -213,6 +232,22 @@ typedef struct V9fsState
     size_t config_size;
     enum p9_proto_version proto_version;
     int32_t msize;
+
+    /*
+     * Requests are handled by a pool of worker threads, with lock held
+     * except around the file system operations.  Clunked fids wait on
+     * reclaim_list until the requests that may still use them are over.
+     */
+    QemuMutex lock;
+    QemuCond cond;                  /* a request was queued */
+    QTAILQ_HEAD(, V9fsPDU) pending;
+    QTAILQ_HEAD(, V9fsPDU) done;    /* for the I/O thread to push */
+    EventNotifier done_notifier;
+    V9fsWorker workers[V9FS_MAX_WORKERS];
+    int nr_workers;
+    int idle_workers;
+    uint64_t seq;                   /* of the last request started */
+    V9fsFidState *reclaim_list;
 } V9fsState;
 
 typedef struct V9fsCreateState {
@@ -309,7 +344,7 @@ typedef struct V9fsReadState {
     int32_t total;
     int64_t off;
     V9fsFidState *fidp;
-    struct iovec iov[128]; /* FIXME: bad, bad, bad */
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
     struct iovec *sg;
     off_t dir_pos;
     struct dirent *dent;
@@ -329,7 +364,7 @@ typedef struct V9fsWriteState {
     int32_t total;
     int64_t off;
     V9fsFidState *fidp;
-    struct iovec iov[128]; /* FIXME: bad, bad, bad */
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
     struct iovec *sg;
     int cnt;
 } V9fsWriteState;
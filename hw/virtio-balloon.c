@@ -36,7 +36,7 @@
 typedef struct VirtIOBalloon
 {
     VirtIODevice vdev;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *rvq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
@@ -51,15 +51,56 @@ static VirtIOBalloon *to_virtio_balloon(VirtIODevice *vdev)
     return (VirtIOBalloon *)vdev;
 }
 
-static void balloon_page(void *addr, int deflate)
+static int balloon_can_discard(void)
 {
 #if defined(__linux__)
-    if (!kvm_enabled() || kvm_has_sync_mmu())
-        qemu_madvise(addr, TARGET_PAGE_SIZE,
-                deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+    return !kvm_enabled() || kvm_has_sync_mmu();
+#else
+    return 0;
 #endif
 }
 
+/* Guest pages that are contiguous in RAM as well, to go to the host with one
+   madvise() */
+typedef struct BalloonRange {
+    ram_addr_t start;
+    ram_addr_t len;
+    int deflate;
+} BalloonRange;
+
+static void balloon_range_flush(BalloonRange *r)
+{
+    if (!r->len) {
+        return;
+    }
+    /* Using qemu_get_ram_ptr is bending the rules a bit, but should be OK
+       because the range lies in a single RAM block */
+    qemu_madvise(qemu_get_ram_ptr(r->start), r->len,
+                 r->deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+    if (!r->deflate) {
+        ram_discard_range(r->start, r->len);
+    }
+    r->len = 0;
+}
+
+static void balloon_range_add(BalloonRange *r, target_phys_addr_t pa)
+{
+    ram_addr_t addr;
+
+    addr = cpu_get_physical_page_desc(pa);
+    if ((addr & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
+        return;
+    }
+    if (r->len && addr == r->start + r->len &&
+        qemu_get_ram_ptr(addr) == qemu_get_ram_ptr(r->start) + r->len) {
+        r->len += TARGET_PAGE_SIZE;
+        return;
+    }
+    balloon_range_flush(r);
+    r->start = addr;
+    r->len = TARGET_PAGE_SIZE;
+}
+
 /*
  * reset_stats - Mark all items in the stats array as unset
  *
@@ -104,27 +145,49 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBalloon *s = to_virtio_balloon(vdev);
     VirtQueueElement elem;
 
+    BalloonRange r = { .deflate = vq == s->dvq };
+
     while (virtqueue_pop(vq, &elem)) {
         size_t offset = 0;
         uint32_t pfn;
 
         while (iov_to_buf(elem.out_sg, elem.out_num, &pfn, offset, 4) == 4) {
-            ram_addr_t pa;
-            ram_addr_t addr;
-
-            pa = (ram_addr_t)ldl_p(&pfn) << VIRTIO_BALLOON_PFN_SHIFT;
             offset += 4;
+            if (balloon_can_discard()) {
+                balloon_range_add(&r, (target_phys_addr_t)ldl_p(&pfn) <<
+                                      VIRTIO_BALLOON_PFN_SHIFT);
+            }
+        }
+        balloon_range_flush(&r);
 
-            addr = cpu_get_physical_page_desc(pa);
-            if ((addr & ~TARGET_PAGE_MASK) != IO_MEM_RAM)
-                continue;
+        virtqueue_push(vq, &elem, offset);
+        virtio_notify(vdev, vq);
+    }
+}
 
-            /* Using qemu_get_ram_ptr is bending the rules a bit, but
-               should be OK because we only want a single page.  */
-            balloon_page(qemu_get_ram_ptr(addr), !!(vq == s->dvq));
+/* Each buffer is a list of free guest memory ranges, page aligned, which the
+   host may drop; the guest does not touch them until it is given the buffer
+   back */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement elem;
+    BalloonRange r = { .deflate = 0 };
+    target_phys_addr_t pa, end;
+    int i;
+
+    while (virtqueue_pop(vq, &elem)) {
+        for (i = 0; i < elem.in_num && balloon_can_discard(); i++) {
+            pa = elem.in_addr[i];
+            end = (pa + elem.in_sg[i].iov_len) & TARGET_PAGE_MASK;
+            for (pa = TARGET_PAGE_ALIGN(pa); pa < end;
+                 pa += TARGET_PAGE_SIZE) {
+                balloon_range_add(&r, pa);
+            }
         }
+        balloon_range_flush(&r);
 
-        virtqueue_push(vq, &elem, offset);
+        /* nothing was written, the pages must not be dirtied */
+        virtqueue_push(vq, &elem, 0);
         virtio_notify(vdev, vq);
     }
 }
@@ -197,6 +260,9 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
 static uint32_t virtio_balloon_get_features(VirtIODevice *vdev, uint32_t f)
 {
     f |= (1 << VIRTIO_BALLOON_F_STATS_VQ);
+    if (!balloon_can_discard()) {
+        f &= ~(1 << VIRTIO_BALLOON_F_REPORTING);
+    }
     return f;
 }
 
@@ -272,6 +338,9 @@ VirtIODevice *virtio_balloon_init(DeviceState *dev)
     s->ivq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(&s->vdev, 128, virtio_balloon_receive_stats);
+    /* the guest finds it at the next index after the stats queue, as there
+       is no free page hinting queue */
+    s->rvq = virtio_add_queue(&s->vdev, 32, virtio_balloon_handle_report);
 
     reset_stats(s);
     qemu_add_balloon_handler(virtio_balloon_to_target, s);
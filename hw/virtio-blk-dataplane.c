@@ -0,0 +1,894 @@
+/*
+ * Event loop thread for virtio-blk I/O processing
+ *
+ * With x-data-plane=on, a virtio-blk device hands its virtqueue over to an
+ * event loop thread while the guest driver is running.  The thread waits
+ * for guest kicks on the ioeventfd, takes requests off the ring and
+ * submits them with Linux AIO straight to the image file, then puts them
+ * on the used ring and sets the guest notifier.  None of this takes the
+ * global mutex: the I/O thread only injects the interrupt once the guest
+ * notifier fires.
+ *
+ * The thread is the IOThread named by x-iothread, which several devices
+ * can share, or else one the device keeps to itself.
+ *
+ * The thread translates guest addresses with a table of the RAM regions of
+ * its own, kept up to date by a physical memory client, instead of
+ * cpu_physical_memory_map().  It does not log its writes to guest memory,
+ * so the device goes back to the normal request path while the dirty log
+ * is on for migration.
+ *
+ * Only raw images opened with cache=none,aio=native qualify, and the
+ * ioeventfd needs KVM.  I/O errors are always reported to the guest,
+ * werror and rerror do not apply.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <libaio.h>
+#include <poll.h>
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "iothread.h"
+#include "qemu-error.h"
+#include "qemu-barrier.h"
+#include "iov.h"
+#include "range.h"
+#include "blockdev.h"
+#include "kvm.h"
+#include "virtio-blk.h"
+#include "virtio-blk-dataplane.h"
+
+/* The virtqueue has 128 entries, and seg_max is 126 plus the headers */
+#define DATA_PLANE_MAX_REQS     128
+#define DATA_PLANE_MAX_SEGS     128
+
+typedef struct HostMemRegion {
+    target_phys_addr_t guest_addr;
+    target_phys_addr_t size;
+    uint8_t *host;
+} HostMemRegion;
+
+typedef struct DataPlaneReq {
+    struct iocb iocb;
+    unsigned int head;
+    uint8_t *status;
+    uint32_t in_len;            /* bytes written to guest memory */
+    bool is_write;
+    size_t size;                /* of the data */
+    struct iovec *data_iov;
+    unsigned int data_niov;
+    void *bounce;               /* for buffers O_DIRECT can't take */
+    struct iovec bounce_iov;
+    unsigned int niov;
+    unsigned int out_num;       /* the first out_num of iov are read only */
+    struct iovec iov[DATA_PLANE_MAX_SEGS];
+    struct DataPlaneReq *next_free;
+} DataPlaneReq;
+
+struct VirtIOBlockDataPlane {
+    VirtIODevice *vdev;
+    VirtQueue *vq;
+    BlockDriverState *bs;
+    const char *serial;
+    unsigned int alignment;
+    unsigned short sector_mask;
+    bool started;
+    bool switching;             /* start or stop in progress */
+    bool disabled;              /* cannot run with this drive */
+
+    /* guest RAM, locked for the thread */
+    CPUPhysMemoryClient client;
+    QemuMutex lock;
+    HostMemRegion *regions;
+    int nregions;
+    bool migration_log;
+
+    IOThread *iothread;
+    bool own_iothread;
+
+    /* set up by start, used by the iothread only while started */
+    EventNotifier *host_notifier;
+    EventNotifier *guest_notifier;
+    EventNotifier io_notifier;
+    io_context_t io_ctx;
+    int fd;
+    bool read_only;
+    uint64_t nb_sectors;
+    bool event_idx;
+    bool notify_on_empty;
+    unsigned int num;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    uint16_t signalled_used;
+    bool signalled_used_valid;
+    int completed;              /* not yet published in the used index */
+    bool broken;
+    int in_flight;
+    DataPlaneReq *free_reqs;
+    DataPlaneReq reqs[DATA_PLANE_MAX_REQS];
+    struct iocb *pending[DATA_PLANE_MAX_REQS];
+    int npending;
+};
+
+/* Remove [start, start + size) from the region table */
+static void hostmem_remove(VirtIOBlockDataPlane *s, target_phys_addr_t start,
+                           target_phys_addr_t size)
+{
+    target_phys_addr_t end = start + size;
+    int i = 0;
+
+    while (i < s->nregions) {
+        HostMemRegion *r = &s->regions[i];
+        target_phys_addr_t rend = r->guest_addr + r->size;
+
+        if (!ranges_overlap(r->guest_addr, r->size, start, size)) {
+            i++;
+        } else if (r->guest_addr < start && rend > end) {
+            /* the tail goes to the end of the table */
+            s->regions = qemu_realloc(s->regions,
+                                      sizeof(*r) * (s->nregions + 1));
+            r = &s->regions[i];
+            s->regions[s->nregions].guest_addr = end;
+            s->regions[s->nregions].size = rend - end;
+            s->regions[s->nregions].host = r->host + (end - r->guest_addr);
+            s->nregions++;
+            r->size = start - r->guest_addr;
+            i++;
+        } else if (r->guest_addr < start) {
+            r->size = start - r->guest_addr;
+            i++;
+        } else if (rend > end) {
+            r->host += end - r->guest_addr;
+            r->size = rend - end;
+            r->guest_addr = end;
+            i++;
+        } else {
+            s->regions[i] = s->regions[--s->nregions];
+        }
+    }
+}
+
+static void hostmem_add(VirtIOBlockDataPlane *s, target_phys_addr_t start,
+                        target_phys_addr_t size, uint8_t *host)
+{
+    HostMemRegion *r;
+    int i;
+
+    for (i = 0; i < s->nregions; i++) {
+        r = &s->regions[i];
+        if (r->guest_addr + r->size == start && r->host + r->size == host) {
+            r->size += size;
+            return;
+        }
+        if (start + size == r->guest_addr && host + size == r->host) {
+            r->guest_addr = start;
+            r->host = host;
+            r->size += size;
+            return;
+        }
+    }
+
+    s->regions = qemu_realloc(s->regions, sizeof(*r) * (s->nregions + 1));
+    r = &s->regions[s->nregions++];
+    r->guest_addr = start;
+    r->size = size;
+    r->host = host;
+}
+
+/* Host address of the guest RAM at addr, and in *plen how many of the len
+   bytes from there are contiguous; NULL if it is not RAM */
+static void *hostmem_lookup(VirtIOBlockDataPlane *s, target_phys_addr_t addr,
+                            target_phys_addr_t len, target_phys_addr_t *plen)
+{
+    void *host = NULL;
+    int i;
+
+    qemu_mutex_lock(&s->lock);
+    for (i = 0; i < s->nregions; i++) {
+        HostMemRegion *r = &s->regions[i];
+
+        if (addr >= r->guest_addr && addr - r->guest_addr < r->size) {
+            host = r->host + (addr - r->guest_addr);
+            *plen = MIN(len, r->size - (addr - r->guest_addr));
+            break;
+        }
+    }
+    qemu_mutex_unlock(&s->lock);
+    return host;
+}
+
+/* The whole of [addr, addr + len) in host memory, or NULL */
+static void *hostmem_map(VirtIOBlockDataPlane *s, target_phys_addr_t addr,
+                         target_phys_addr_t len)
+{
+    target_phys_addr_t l;
+    void *host = hostmem_lookup(s, addr, len, &l);
+
+    return host && l == len ? host : NULL;
+}
+
+/* RAM that goes away stays allocated, so the thread may go on using
+   pointers into it until it is stopped */
+static void data_plane_set_memory(CPUPhysMemoryClient *client,
+                                  target_phys_addr_t start_addr,
+                                  ram_addr_t size,
+                                  ram_addr_t phys_offset)
+{
+    VirtIOBlockDataPlane *s = container_of(client, VirtIOBlockDataPlane,
+                                           client);
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+
+    qemu_mutex_lock(&s->lock);
+    hostmem_remove(s, start_addr, size);
+    if (flags == IO_MEM_RAM) {
+        hostmem_add(s, start_addr, size, qemu_get_ram_ptr(phys_offset));
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+static int data_plane_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                        target_phys_addr_t start_addr,
+                                        target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int data_plane_migration_log(CPUPhysMemoryClient *client, int enable)
+{
+    VirtIOBlockDataPlane *s = container_of(client, VirtIOBlockDataPlane,
+                                           client);
+    VirtIODevice *vdev = s->vdev;
+
+    s->migration_log = enable;
+    if (enable) {
+        virtio_blk_data_plane_stop(s);
+    } else if (vdev->vm_running &&
+               (vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        virtio_blk_data_plane_start(s);
+    }
+    return 0;
+}
+
+static void data_plane_fail(VirtIOBlockDataPlane *s, const char *msg)
+{
+    /* the ring is left alone until the device is stopped */
+    fprintf(stderr, "virtio-blk data plane: %s\n", msg);
+    s->broken = true;
+    iothread_set_fd_handler(s->iothread,
+                            event_notifier_get_fd(s->host_notifier),
+                            NULL, NULL, NULL);
+}
+
+/* Add the guest buffer at addr to the iovec of req */
+static int data_plane_map_buffer(VirtIOBlockDataPlane *s, DataPlaneReq *req,
+                                 uint64_t addr, uint32_t len)
+{
+    while (len > 0) {
+        target_phys_addr_t l;
+        void *host;
+
+        if (req->niov == DATA_PLANE_MAX_SEGS) {
+            return -1;
+        }
+        host = hostmem_lookup(s, addr, len, &l);
+        if (!host) {
+            return -1;
+        }
+        req->iov[req->niov].iov_base = host;
+        req->iov[req->niov].iov_len = l;
+        req->niov++;
+        addr += l;
+        len -= l;
+    }
+    return 0;
+}
+
+/* Gather the descriptor chain at head; the read only descriptors have to
+   come first */
+static int data_plane_read_chain(VirtIOBlockDataPlane *s, DataPlaneReq *req,
+                                 unsigned int head)
+{
+    VRingDesc *desc = s->desc;
+    unsigned int num = s->num, i = head, count = 0;
+
+    req->niov = 0;
+    req->out_num = 0;
+    for (;;) {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t flags;
+
+        if (i >= num || ++count > num) {
+            return -1;
+        }
+        addr = ldq_p(&desc[i].addr);
+        len = ldl_p(&desc[i].len);
+        flags = lduw_p(&desc[i].flags);
+
+        if (flags & VRING_DESC_F_INDIRECT) {
+            if (desc != s->desc || !len || len % sizeof(VRingDesc)) {
+                return -1;
+            }
+            desc = hostmem_map(s, addr, len);
+            if (!desc) {
+                return -1;
+            }
+            num = len / sizeof(VRingDesc);
+            i = 0;
+            count = 0;
+            continue;
+        }
+
+        if (!(flags & VRING_DESC_F_WRITE) && req->niov != req->out_num) {
+            return -1;
+        }
+        if (data_plane_map_buffer(s, req, addr, len) < 0) {
+            return -1;
+        }
+        if (!(flags & VRING_DESC_F_WRITE)) {
+            req->out_num = req->niov;
+        }
+
+        if (!(flags & VRING_DESC_F_NEXT)) {
+            return 0;
+        }
+        i = lduw_p(&desc[i].next);
+    }
+}
+
+/* Put req on the used ring; the index is published by
+   data_plane_flush_used() */
+static void data_plane_complete(VirtIOBlockDataPlane *s, DataPlaneReq *req,
+                                int status)
+{
+    VRingUsedElem *e = &s->used->ring[s->used_idx % s->num];
+
+    stb_p(req->status, status);
+    stl_p(&e->id, req->head);
+    stl_p(&e->len, req->in_len);
+    s->used_idx++;
+    s->completed++;
+
+    req->next_free = s->free_reqs;
+    s->free_reqs = req;
+}
+
+static inline bool vring_need_event(uint16_t event, uint16_t new,
+                                    uint16_t old)
+{
+    return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+/* Same as vring_notify() in virtio.c */
+static bool data_plane_need_notify(VirtIOBlockDataPlane *s)
+{
+    uint16_t old, new;
+    bool v;
+
+    if (s->notify_on_empty && !s->in_flight &&
+        lduw_p(&s->avail->idx) == s->last_avail_idx) {
+        return true;
+    }
+
+    if (!s->event_idx) {
+        return !(lduw_p(&s->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    v = s->signalled_used_valid;
+    s->signalled_used_valid = true;
+    old = s->signalled_used;
+    new = s->signalled_used = s->used_idx;
+    return !v || vring_need_event(lduw_p(&s->avail->ring[s->num]), new, old);
+}
+
+static void data_plane_flush_used(VirtIOBlockDataPlane *s)
+{
+    if (!s->completed) {
+        return;
+    }
+    s->completed = 0;
+
+    /* the used elements before the index, the index before the flags
+       and used event are looked at */
+    smp_wmb();
+    stw_p(&s->used->idx, s->used_idx);
+    smp_mb();
+
+    if (data_plane_need_notify(s)) {
+        event_notifier_set(s->guest_notifier);
+    }
+}
+
+static bool data_plane_iov_aligned(VirtIOBlockDataPlane *s,
+                                   const struct iovec *iov, unsigned int niov)
+{
+    unsigned int i;
+
+    for (i = 0; i < niov; i++) {
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) &
+            (s->alignment - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void data_plane_submit_pending(VirtIOBlockDataPlane *s)
+{
+    int done = 0;
+
+    while (done < s->npending) {
+        int ret = io_submit(s->io_ctx, s->npending - done,
+                            &s->pending[done]);
+
+        if (ret <= 0) {
+            /* nothing more goes through, fail the rest */
+            for (; done < s->npending; done++) {
+                DataPlaneReq *req = container_of(s->pending[done],
+                                                 DataPlaneReq, iocb);
+
+                qemu_vfree(req->bounce);
+                req->bounce = NULL;
+                s->in_flight--;
+                data_plane_complete(s, req, VIRTIO_BLK_S_IOERR);
+            }
+            break;
+        }
+        done += ret;
+    }
+    s->npending = 0;
+}
+
+static void data_plane_submit_rw(VirtIOBlockDataPlane *s, DataPlaneReq *req,
+                                 bool is_write, uint64_t sector)
+{
+    struct iovec *iov = req->data_iov;
+    unsigned int niov = req->data_niov;
+
+    req->is_write = is_write;
+    if (!data_plane_iov_aligned(s, iov, niov)) {
+        req->bounce = qemu_memalign(s->alignment, req->size);
+        if (is_write) {
+            iov_to_buf(iov, niov, req->bounce, 0, req->size);
+        }
+        req->bounce_iov.iov_base = req->bounce;
+        req->bounce_iov.iov_len = req->size;
+        iov = &req->bounce_iov;
+        niov = 1;
+    }
+
+    if (is_write) {
+        io_prep_pwritev(&req->iocb, s->fd, iov, niov,
+                        sector * BDRV_SECTOR_SIZE);
+    } else {
+        io_prep_preadv(&req->iocb, s->fd, iov, niov,
+                       sector * BDRV_SECTOR_SIZE);
+    }
+    io_set_eventfd(&req->iocb, event_notifier_get_fd(&s->io_notifier));
+    req->iocb.data = req;
+
+    s->pending[s->npending++] = &req->iocb;
+    s->in_flight++;
+}
+
+static void data_plane_handle_request(VirtIOBlockDataPlane *s,
+                                      unsigned int head)
+{
+    DataPlaneReq *req = s->free_reqs;
+    struct virtio_blk_outhdr *out;
+    unsigned int in_num;
+    uint32_t type;
+
+    if (data_plane_read_chain(s, req, head) < 0) {
+        data_plane_fail(s, "invalid descriptor chain");
+        return;
+    }
+    in_num = req->niov - req->out_num;
+    if (req->out_num < 1 || in_num < 1 ||
+        req->iov[0].iov_len < sizeof(*out) ||
+        req->iov[req->niov - 1].iov_len < sizeof(struct virtio_blk_inhdr)) {
+        data_plane_fail(s, "header not in correct element");
+        return;
+    }
+
+    s->free_reqs = req->next_free;
+    req->head = head;
+    req->status = req->iov[req->niov - 1].iov_base;
+    req->in_len = sizeof(struct virtio_blk_inhdr);
+    req->bounce = NULL;
+    out = req->iov[0].iov_base;
+    type = ldl_p(&out->type);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        /* the writes of this batch go first */
+        data_plane_submit_pending(s);
+        data_plane_complete(s, req, qemu_fdatasync(s->fd) == 0 ?
+                            VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        data_plane_complete(s, req, VIRTIO_BLK_S_UNSUPP);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        struct iovec *iov = &req->iov[req->out_num];
+        size_t len = MIN(iov->iov_len, BLOCK_SERIAL_STRLEN);
+
+        memcpy(iov->iov_base, s->serial, len);
+        req->in_len += len;
+        data_plane_complete(s, req, VIRTIO_BLK_S_OK);
+    } else {
+        bool is_write = type & VIRTIO_BLK_T_OUT;
+        uint64_t sector = ldq_p(&out->sector);
+        uint64_t nb_sectors;
+
+        if (is_write) {
+            req->data_iov = &req->iov[1];
+            req->data_niov = req->out_num - 1;
+        } else {
+            req->data_iov = &req->iov[req->out_num];
+            req->data_niov = in_num - 1;
+        }
+        req->size = iov_size(req->data_iov, req->data_niov);
+        nb_sectors = req->size / BDRV_SECTOR_SIZE;
+
+        if ((sector & s->sector_mask) || req->size % BDRV_SECTOR_SIZE ||
+            sector > s->nb_sectors || nb_sectors > s->nb_sectors - sector ||
+            (is_write && s->read_only)) {
+            data_plane_complete(s, req, VIRTIO_BLK_S_IOERR);
+            return;
+        }
+        data_plane_submit_rw(s, req, is_write, sector);
+    }
+}
+
+/* Take everything off the avail ring */
+static void data_plane_handle_ring(VirtIOBlockDataPlane *s)
+{
+    uint16_t *avail_event = (uint16_t *)&s->used->ring[s->num];
+
+    while (!s->broken && s->free_reqs) {
+        uint16_t avail_idx = lduw_p(&s->avail->idx);
+
+        if ((uint16_t)(avail_idx - s->last_avail_idx) > s->num) {
+            data_plane_fail(s, "avail index out of range");
+            break;
+        }
+
+        if (avail_idx == s->last_avail_idx) {
+            if (!s->event_idx) {
+                break;
+            }
+            /* ask for a kick on the next request, and look again for
+               one that came in before the guest could see that */
+            stw_p(avail_event, s->last_avail_idx);
+            smp_mb();
+            if (lduw_p(&s->avail->idx) == s->last_avail_idx) {
+                break;
+            }
+            continue;
+        }
+
+        /* the ring entries after the index */
+        smp_rmb();
+        while (s->last_avail_idx != avail_idx && s->free_reqs) {
+            unsigned int head =
+                lduw_p(&s->avail->ring[s->last_avail_idx % s->num]);
+
+            data_plane_handle_request(s, head);
+            if (s->broken) {
+                break;
+            }
+            s->last_avail_idx++;
+        }
+    }
+
+    data_plane_submit_pending(s);
+}
+
+static void data_plane_reap(VirtIOBlockDataPlane *s)
+{
+    struct io_event events[DATA_PLANE_MAX_REQS];
+    struct timespec ts = { 0, 0 };
+    int i, n;
+
+    do {
+        n = io_getevents(s->io_ctx, 0, DATA_PLANE_MAX_REQS, events, &ts);
+        for (i = 0; i < n; i++) {
+            DataPlaneReq *req = events[i].data;
+            int status = VIRTIO_BLK_S_IOERR;
+
+            /* the number of bytes, or a negative errno */
+            if ((long)events[i].res == req->size) {
+                status = VIRTIO_BLK_S_OK;
+                if (!req->is_write) {
+                    if (req->bounce) {
+                        iov_from_buf(req->data_iov, req->data_niov,
+                                     req->bounce, req->size);
+                    }
+                    req->in_len += req->size;
+                }
+            }
+            qemu_vfree(req->bounce);
+            req->bounce = NULL;
+            s->in_flight--;
+            data_plane_complete(s, req, status);
+        }
+    } while (n == DATA_PLANE_MAX_REQS);
+}
+
+/* The guest kicked */
+static void data_plane_handle_kick(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    event_notifier_test_and_clear(s->host_notifier);
+    data_plane_handle_ring(s);
+    data_plane_flush_used(s);
+}
+
+/* Requests completed, the ring may hold more that had to wait for them */
+static void data_plane_handle_io(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    event_notifier_test_and_clear(&s->io_notifier);
+    data_plane_reap(s);
+    data_plane_handle_ring(s);
+    data_plane_flush_used(s);
+}
+
+/* In the iothread: wait for kicks and completions.  The host notifier
+   starts out set, so the ring is looked at right away */
+static void data_plane_attach(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    iothread_set_fd_handler(s->iothread,
+                            event_notifier_get_fd(&s->io_notifier),
+                            data_plane_handle_io, NULL, s);
+    iothread_set_fd_handler(s->iothread,
+                            event_notifier_get_fd(s->host_notifier),
+                            data_plane_handle_kick, NULL, s);
+}
+
+/* In the iothread: leave kicks to the normal request path and wait for
+   the requests in flight.  Other devices of the iothread wait meanwhile,
+   but stopping is rare */
+static void data_plane_detach(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    struct pollfd pfd;
+
+    iothread_set_fd_handler(s->iothread,
+                            event_notifier_get_fd(s->host_notifier),
+                            NULL, NULL, NULL);
+
+    pfd.fd = event_notifier_get_fd(&s->io_notifier);
+    pfd.events = POLLIN;
+    while (s->in_flight) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "virtio-blk data plane: poll: %s\n",
+                    strerror(errno));
+            abort();
+        }
+        event_notifier_test_and_clear(&s->io_notifier);
+        data_plane_reap(s);
+    }
+    data_plane_flush_used(s);
+
+    iothread_set_fd_handler(s->iothread,
+                            event_notifier_get_fd(&s->io_notifier),
+                            NULL, NULL, NULL);
+}
+
+static int data_plane_map_ring(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+
+    s->num = virtio_queue_get_num(vdev, 0);
+    s->desc = hostmem_map(s, virtio_queue_get_desc_addr(vdev, 0),
+                          sizeof(VRingDesc) * s->num);
+    /* up to and including used_event */
+    s->avail = hostmem_map(s, virtio_queue_get_avail_addr(vdev, 0),
+                           offsetof(VRingAvail, ring[s->num]) +
+                           sizeof(uint16_t));
+    /* up to and including avail_event */
+    s->used = hostmem_map(s, virtio_queue_get_used_addr(vdev, 0),
+                          offsetof(VRingUsed, ring[s->num]) +
+                          sizeof(uint16_t));
+    return s->desc && s->avail && s->used ? 0 : -1;
+}
+
+/* Hand the virtqueue over to the thread, if the device can do that.  The
+   normal request path goes on while this returns false. */
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *b = vdev->binding;
+    int i, r;
+
+    if (s->started) {
+        return true;
+    }
+    /* switching catches the kicks flushed out by the notifier changes */
+    if (s->switching || s->disabled || s->migration_log ||
+        s->bs->io_limits_enabled) {
+        return false;
+    }
+    if (!virtio_queue_get_addr(vdev, 0) ||
+        virtio_queue_get_num(vdev, 0) > DATA_PLANE_MAX_REQS ||
+        data_plane_map_ring(s) < 0) {
+        return false;
+    }
+
+    s->fd = raw_get_aio_fd(s->bs);
+    if (s->fd < 0) {
+        error_report("virtio-blk data plane needs a raw image with "
+                     "cache=none,aio=native");
+        s->disabled = true;
+        return false;
+    }
+    r = io_setup(DATA_PLANE_MAX_REQS, &s->io_ctx);
+    if (r < 0) {
+        error_report("virtio-blk data plane: io_setup: %s", strerror(-r));
+        return false;
+    }
+    r = event_notifier_init(&s->io_notifier, 0);
+    if (r < 0) {
+        goto fail_io_notifier;
+    }
+
+    s->switching = true;
+    r = b->set_host_notifier(vdev->binding_opaque, 0, true);
+    if (r < 0) {
+        error_report("virtio-blk data plane: cannot set host notifier: %s",
+                     strerror(-r));
+        s->disabled = true;
+        goto fail_host_notifier;
+    }
+    r = b->set_guest_notifiers(vdev->binding_opaque, true);
+    if (r < 0) {
+        error_report("virtio-blk data plane: cannot set guest notifiers: %s",
+                     strerror(-r));
+        s->disabled = true;
+        goto fail_guest_notifiers;
+    }
+
+    /* nothing else may touch the ring from now on */
+    bdrv_drain_all();
+
+    s->host_notifier = virtio_queue_get_host_notifier(s->vq);
+    s->guest_notifier = virtio_queue_get_guest_notifier(s->vq);
+    s->read_only = bdrv_is_read_only(s->bs);
+    bdrv_get_geometry(s->bs, &s->nb_sectors);
+    s->event_idx = vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX);
+    s->notify_on_empty =
+        vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY);
+    s->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, 0);
+    s->used_idx = lduw_p(&s->used->idx);
+    s->signalled_used_valid = false;
+    s->completed = 0;
+    s->broken = false;
+    s->in_flight = 0;
+    s->npending = 0;
+    s->free_reqs = NULL;
+    for (i = 0; i < DATA_PLANE_MAX_REQS; i++) {
+        s->reqs[i].next_free = s->free_reqs;
+        s->free_reqs = &s->reqs[i];
+    }
+
+    iothread_run(s->iothread, data_plane_attach, s);
+    s->started = true;
+    s->switching = false;
+    return true;
+
+fail_guest_notifiers:
+    b->set_host_notifier(vdev->binding_opaque, 0, false);
+fail_host_notifier:
+    s->switching = false;
+    event_notifier_cleanup(&s->io_notifier);
+fail_io_notifier:
+    io_destroy(s->io_ctx);
+    return false;
+}
+
+/* Wait for the requests in flight and give the virtqueue back */
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *b = vdev->binding;
+
+    if (!s->started || s->switching) {
+        return;
+    }
+    s->switching = true;
+
+    iothread_run(s->iothread, data_plane_detach, s);
+    io_destroy(s->io_ctx);
+    event_notifier_cleanup(&s->io_notifier);
+
+    virtio_queue_set_last_avail_idx(vdev, 0, s->last_avail_idx);
+    virtio_queue_invalidate_signalled_used(vdev, 0);
+
+    if (event_notifier_test_and_clear(s->guest_notifier)) {
+        virtio_irq(s->vq);
+    }
+    b->set_guest_notifiers(vdev->binding_opaque, false);
+    /* kicks that came in meanwhile go through the normal path here */
+    s->started = false;
+    b->set_host_notifier(vdev->binding_opaque, 0, false);
+    s->switching = false;
+}
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial,
+                                                   const char *iothread)
+{
+    VirtIOBlockDataPlane *s;
+    IOThread *iot = NULL;
+
+    if (!kvm_enabled() || !kvm_has_many_ioeventfds()) {
+        error_report("virtio-blk data plane needs KVM with ioeventfd");
+        return NULL;
+    }
+    if (raw_get_aio_fd(conf->bs) < 0) {
+        error_report("virtio-blk data plane needs a raw image with "
+                     "cache=none,aio=native");
+        return NULL;
+    }
+    if (iothread) {
+        iot = iothread_find(iothread);
+        if (!iot) {
+            error_report("virtio-blk data plane: no iothread '%s'", iothread);
+            return NULL;
+        }
+    } else {
+        iot = iothread_new(NULL);
+        if (!iot) {
+            return NULL;
+        }
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+    s->iothread = iot;
+    s->own_iothread = !iothread;
+    s->vdev = vdev;
+    s->vq = virtio_get_queue(vdev, 0);
+    s->bs = conf->bs;
+    s->serial = serial;
+    s->alignment = conf->logical_block_size;
+    s->sector_mask = (conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
+    s->fd = -1;
+    qemu_mutex_init(&s->lock);
+
+    s->client.set_memory = data_plane_set_memory;
+    s->client.sync_dirty_bitmap = data_plane_sync_dirty_bitmap;
+    s->client.migration_log = data_plane_migration_log;
+    s->client.log_start = NULL;
+    s->client.log_stop = NULL;
+    cpu_register_phys_memory_client(&s->client);
+    return s;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+    virtio_blk_data_plane_stop(s);
+    if (s->own_iothread) {
+        iothread_destroy(s->iothread);
+    }
+    cpu_unregister_phys_memory_client(&s->client);
+    qemu_mutex_destroy(&s->lock);
+    qemu_free(s->regions);
+    qemu_free(s);
+}
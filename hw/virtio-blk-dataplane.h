@@ -0,0 +1,24 @@
+/*
+ * Event loop thread for virtio-blk I/O processing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_VIRTIO_BLK_DATAPLANE_H
+#define QEMU_VIRTIO_BLK_DATAPLANE_H
+
+#include "virtio.h"
+
+typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial,
+                                                   const char *iothread);
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s);
+
+#endif
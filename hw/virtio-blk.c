@@ -16,6 +16,9 @@
 #include "trace.h"
 #include "blockdev.h"
 #include "virtio-blk.h"
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "virtio-blk-dataplane.h"
+#endif
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
@@ -31,6 +34,9 @@ typedef struct VirtIOBlock
     unsigned short sector_mask;
     char sn[BLOCK_SERIAL_STRLEN];
     DeviceState *qdev;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -38,10 +44,13 @@ static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
     return (VirtIOBlock *)vdev;
 }
 
+/* Requests taken off the ring at once */
+#define VIRTIO_BLK_POP_BATCH 32
+
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
-    VirtQueueElement elem;
+    VirtQueueCompactElement *elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
     struct virtio_scsi_inhdr *scsi;
@@ -56,9 +65,11 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
+    virtqueue_push_compact(s->vq, req->elem,
+                           req->qiov.size + sizeof(*req->in));
     virtio_notify(&s->vdev, s->vq);
 
+    virtqueue_free_compact(req->elem);
     qemu_free(req);
 }
 
@@ -92,6 +103,7 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlockReq *req = opaque;
 
     trace_virtio_blk_rw_complete(req, ret);
+    virtqueue_latency_complete(req->dev->vq, req->elem->index);
 
     if (ret) {
         int is_read = !(ldl_p(&req->out->type) & VIRTIO_BLK_T_OUT);
@@ -106,6 +118,7 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
 
+    virtqueue_latency_complete(req->dev->vq, req->elem->index);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, 0)) {
             return;
@@ -115,29 +128,17 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
 }
 
-static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s,
+                                                VirtQueueCompactElement *elem)
 {
     VirtIOBlockReq *req = qemu_malloc(sizeof(*req));
     req->dev = s;
+    req->elem = elem;
     req->qiov.size = 0;
     req->next = NULL;
     return req;
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
-{
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-
-    if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
-            qemu_free(req);
-            return NULL;
-        }
-    }
-
-    return req;
-}
-
 #ifdef __linux__
 static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
 {
@@ -153,7 +154,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
      * We also at least require the virtio_blk_inhdr, the virtio_scsi_inhdr
      * and the sense buffer pointer in the input segments.
      */
-    if (req->elem.out_num < 2 || req->elem.in_num < 3) {
+    if (req->elem->out_num < 2 || req->elem->in_num < 3) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         return;
     }
@@ -161,7 +162,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     /*
      * No support for bidirection commands yet.
      */
-    if (req->elem.out_num > 2 && req->elem.in_num > 3) {
+    if (req->elem->out_num > 2 && req->elem->in_num > 3) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
         return;
     }
@@ -170,38 +171,38 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
      * The scsi inhdr is placed in the second-to-last input segment, just
      * before the regular inhdr.
      */
-    req->scsi = (void *)req->elem.in_sg[req->elem.in_num - 2].iov_base;
+    req->scsi = (void *)req->elem->in_sg[req->elem->in_num - 2].iov_base;
 
     memset(&hdr, 0, sizeof(struct sg_io_hdr));
     hdr.interface_id = 'S';
-    hdr.cmd_len = req->elem.out_sg[1].iov_len;
-    hdr.cmdp = req->elem.out_sg[1].iov_base;
+    hdr.cmd_len = req->elem->out_sg[1].iov_len;
+    hdr.cmdp = req->elem->out_sg[1].iov_base;
     hdr.dxfer_len = 0;
 
-    if (req->elem.out_num > 2) {
+    if (req->elem->out_num > 2) {
         /*
          * If there are more than the minimally required 2 output segments
          * there is write payload starting from the third iovec.
          */
         hdr.dxfer_direction = SG_DXFER_TO_DEV;
-        hdr.iovec_count = req->elem.out_num - 2;
+        hdr.iovec_count = req->elem->out_num - 2;
 
         for (i = 0; i < hdr.iovec_count; i++)
-            hdr.dxfer_len += req->elem.out_sg[i + 2].iov_len;
+            hdr.dxfer_len += req->elem->out_sg[i + 2].iov_len;
 
-        hdr.dxferp = req->elem.out_sg + 2;
+        hdr.dxferp = req->elem->out_sg + 2;
 
-    } else if (req->elem.in_num > 3) {
+    } else if (req->elem->in_num > 3) {
         /*
          * If we have more than 3 input segments the guest wants to actually
          * read data.
          */
         hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-        hdr.iovec_count = req->elem.in_num - 3;
+        hdr.iovec_count = req->elem->in_num - 3;
         for (i = 0; i < hdr.iovec_count; i++)
-            hdr.dxfer_len += req->elem.in_sg[i].iov_len;
+            hdr.dxfer_len += req->elem->in_sg[i].iov_len;
 
-        hdr.dxferp = req->elem.in_sg;
+        hdr.dxferp = req->elem->in_sg;
     } else {
         /*
          * Some SCSI commands don't actually transfer any data.
@@ -209,8 +210,8 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
         hdr.dxfer_direction = SG_DXFER_NONE;
     }
 
-    hdr.sbp = req->elem.in_sg[req->elem.in_num - 3].iov_base;
-    hdr.mx_sb_len = req->elem.in_sg[req->elem.in_num - 3].iov_len;
+    hdr.sbp = req->elem->in_sg[req->elem->in_num - 3].iov_base;
+    hdr.mx_sb_len = req->elem->in_sg[req->elem->in_num - 3].iov_len;
 
     ret = bdrv_ioctl(req->dev->bs, SG_IO, &hdr);
     if (ret) {
@@ -237,29 +238,77 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
 }
 #endif /* __linux__ */
 
+/*
+ * Read or write requests of one kick, submitted together so that the block
+ * layer can merge them.  The batch grows as needed; it is submitted when the
+ * kind of request changes or when it would grow past IOV_MAX vectors.
+ */
 typedef struct MultiReqBuffer {
-    BlockRequest        blkreq[32];
-    unsigned int        num_writes;
+    BlockRequest        *blkreq;
+    unsigned int        num_reqs;
+    unsigned int        max_reqs;
+    unsigned int        niov;
+    bool                is_write;
 } MultiReqBuffer;
 
-static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
+static void virtio_submit_multireq(BlockDriverState *bs, MultiReqBuffer *mrb)
 {
     int i, ret;
 
-    if (!mrb->num_writes) {
+    if (!mrb->num_reqs) {
         return;
     }
 
-    ret = bdrv_aio_multiwrite(bs, mrb->blkreq, mrb->num_writes);
+    for (i = 0; i < mrb->num_reqs; i++) {
+        VirtIOBlockReq *req = mrb->blkreq[i].opaque;
+
+        virtqueue_latency_submit(req->dev->vq, req->elem->index);
+    }
+
+    if (mrb->is_write) {
+        ret = bdrv_aio_multiwrite(bs, mrb->blkreq, mrb->num_reqs);
+    } else {
+        ret = bdrv_aio_multiread(bs, mrb->blkreq, mrb->num_reqs);
+    }
     if (ret != 0) {
-        for (i = 0; i < mrb->num_writes; i++) {
+        for (i = 0; i < mrb->num_reqs; i++) {
             if (mrb->blkreq[i].error) {
                 virtio_blk_rw_complete(mrb->blkreq[i].opaque, -EIO);
             }
         }
     }
 
-    mrb->num_writes = 0;
+    mrb->num_reqs = 0;
+    mrb->niov = 0;
+}
+
+static void virtio_blk_add_request(VirtIOBlockReq *req, MultiReqBuffer *mrb,
+                                   uint64_t sector, bool is_write)
+{
+    BlockRequest *blkreq;
+
+    if (mrb->num_reqs && (mrb->is_write != is_write ||
+                          mrb->niov + req->qiov.niov > IOV_MAX)) {
+        virtio_submit_multireq(req->dev->bs, mrb);
+    }
+
+    if (mrb->num_reqs == mrb->max_reqs) {
+        mrb->max_reqs = mrb->max_reqs ? mrb->max_reqs * 2 : 32;
+        mrb->blkreq = qemu_realloc(mrb->blkreq,
+                                   mrb->max_reqs * sizeof(*mrb->blkreq));
+    }
+
+    blkreq = &mrb->blkreq[mrb->num_reqs];
+    blkreq->sector = sector;
+    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+    blkreq->qiov = &req->qiov;
+    blkreq->cb = virtio_blk_rw_complete;
+    blkreq->opaque = req;
+    blkreq->error = 0;
+
+    mrb->num_reqs++;
+    mrb->niov += req->qiov.niov;
+    mrb->is_write = is_write;
 }
 
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
@@ -269,8 +318,9 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     /*
      * Make sure all outstanding writes are posted to the backing device.
      */
-    virtio_submit_multiwrite(req->dev->bs, mrb);
+    virtio_submit_multireq(req->dev->bs, mrb);
 
+    virtqueue_latency_submit(req->dev->vq, req->elem->index);
     acb = bdrv_aio_flush(req->dev->bs, virtio_blk_flush_complete, req);
     if (!acb) {
         virtio_blk_flush_complete(req, -EIO);
@@ -279,7 +329,6 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
-    BlockRequest *blkreq;
     uint64_t sector;
 
     sector = ldq_p(&req->out->sector);
@@ -291,24 +340,11 @@ static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
         return;
     }
 
-    if (mrb->num_writes == 32) {
-        virtio_submit_multiwrite(req->dev->bs, mrb);
-    }
-
-    blkreq = &mrb->blkreq[mrb->num_writes];
-    blkreq->sector = sector;
-    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
-    blkreq->qiov = &req->qiov;
-    blkreq->cb = virtio_blk_rw_complete;
-    blkreq->opaque = req;
-    blkreq->error = 0;
-
-    mrb->num_writes++;
+    virtio_blk_add_request(req, mrb, sector, true);
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_read(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
-    BlockDriverAIOCB *acb;
     uint64_t sector;
 
     sector = ldq_p(&req->out->sector);
@@ -318,12 +354,7 @@ static void virtio_blk_handle_read(VirtIOBlockReq *req)
         return;
     }
 
-    acb = bdrv_aio_readv(req->dev->bs, sector, &req->qiov,
-                         req->qiov.size / BDRV_SECTOR_SIZE,
-                         virtio_blk_rw_complete, req);
-    if (!acb) {
-        virtio_blk_rw_complete(req, -EIO);
-    }
+    virtio_blk_add_request(req, mrb, sector, false);
 }
 
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
@@ -331,19 +362,19 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
 {
     uint32_t type;
 
-    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+    if (req->elem->out_num < 1 || req->elem->in_num < 1) {
         error_report("virtio-blk missing headers");
         exit(1);
     }
 
-    if (req->elem.out_sg[0].iov_len < sizeof(*req->out) ||
-        req->elem.in_sg[req->elem.in_num - 1].iov_len < sizeof(*req->in)) {
+    if (req->elem->out_sg[0].iov_len < sizeof(*req->out) ||
+        req->elem->in_sg[req->elem->in_num - 1].iov_len < sizeof(*req->in)) {
         error_report("virtio-blk header not in correct element");
         exit(1);
     }
 
-    req->out = (void *)req->elem.out_sg[0].iov_base;
-    req->in = (void *)req->elem.in_sg[req->elem.in_num - 1].iov_base;
+    req->out = (void *)req->elem->out_sg[0].iov_base;
+    req->in = (void *)req->elem->in_sg[req->elem->in_num - 1].iov_base;
 
     type = ldl_p(&req->out->type);
 
@@ -354,33 +385,49 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
     } else if (type & VIRTIO_BLK_T_GET_ID) {
         VirtIOBlock *s = req->dev;
 
-        memcpy(req->elem.in_sg[0].iov_base, s->sn,
-               MIN(req->elem.in_sg[0].iov_len, sizeof(s->sn)));
+        memcpy(req->elem->in_sg[0].iov_base, s->sn,
+               MIN(req->elem->in_sg[0].iov_len, sizeof(s->sn)));
         virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     } else if (type & VIRTIO_BLK_T_OUT) {
-        qemu_iovec_init_external(&req->qiov, &req->elem.out_sg[1],
-                                 req->elem.out_num - 1);
+        qemu_iovec_init_external(&req->qiov, &req->elem->out_sg[1],
+                                 req->elem->out_num - 1);
         virtio_blk_handle_write(req, mrb);
     } else {
-        qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
-                                 req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        qemu_iovec_init_external(&req->qiov, &req->elem->in_sg[0],
+                                 req->elem->in_num - 1);
+        virtio_blk_handle_read(req, mrb);
     }
 }
 
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
-    VirtIOBlockReq *req;
+    VirtQueueCompactElement *elems[VIRTIO_BLK_POP_BATCH];
     MultiReqBuffer mrb = {
-        .num_writes = 0,
+        .num_reqs = 0,
     };
+    int i, n;
 
-    while ((req = virtio_blk_get_request(s))) {
-        virtio_blk_handle_request(req, &mrb);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Requests held back by werror/rerror go first */
+    if (s->dataplane && !s->rq &&
+        virtio_blk_data_plane_start(s->dataplane)) {
+        return;
+    }
+#endif
+
+    /* Submit all requests of this kick to the host at once */
+    bdrv_io_plug(s->bs);
+    while ((n = virtqueue_pop_batch(s->vq, elems, VIRTIO_BLK_POP_BATCH))) {
+        for (i = 0; i < n; i++) {
+            virtio_blk_handle_request(virtio_blk_alloc_request(s, elems[i]),
+                                      &mrb);
+        }
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multireq(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
+    qemu_free(mrb.blkreq);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -394,7 +441,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     VirtIOBlock *s = opaque;
     VirtIOBlockReq *req = s->rq;
     MultiReqBuffer mrb = {
-        .num_writes = 0,
+        .num_reqs = 0,
     };
 
     qemu_bh_delete(s->bh);
@@ -402,12 +449,15 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multireq(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
+    qemu_free(mrb.blkreq);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
@@ -423,13 +473,31 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
     }
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (!s->dataplane) {
+        return;
+    }
+    if (vdev->vm_running && (status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        if (!s->rq) {
+            virtio_blk_data_plane_start(s->dataplane);
+        }
+    } else {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+}
+#endif
+
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
      */
-    qemu_aio_flush();
+    bdrv_drain_all();
 }
 
 /* coalesce internal state, copy to pci i/o region 0
@@ -485,7 +553,7 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     
     while (req) {
         qemu_put_sbyte(f, 1);
-        qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        virtqueue_save_compact(f, req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -500,15 +568,15 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
 
     virtio_load(&s->vdev, f);
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-        qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        VirtQueueCompactElement *elem = virtqueue_load_compact(s->vq, f);
+        VirtIOBlockReq *req;
+
+        if (!elem) {
+            return -EINVAL;
+        }
+        req = virtio_blk_alloc_request(s, elem);
         req->next = s->rq;
         s->rq = req;
-
-        virtqueue_map_sg(req->elem.in_sg, req->elem.in_addr,
-            req->elem.in_num, 1);
-        virtqueue_map_sg(req->elem.out_sg, req->elem.out_addr,
-            req->elem.out_num, 0);
     }
 
     return 0;
@@ -523,7 +591,8 @@ static void virtio_blk_change_cb(void *opaque, int reason)
     }
 }
 
-VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
+VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
+                              virtio_blk_conf *blk)
 {
     VirtIOBlock *s;
     int cylinders, heads, secs;
@@ -538,6 +607,12 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
         error_report("Device needs media, but drive is empty");
         return NULL;
     }
+#ifndef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (blk->data_plane) {
+        error_report("virtio-blk data plane support is not compiled in");
+        return NULL;
+    }
+#endif
 
     s = (VirtIOBlock *)virtio_common_init("virtio-blk", VIRTIO_ID_BLOCK,
                                           sizeof(struct virtio_blk_config),
@@ -560,6 +635,18 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
 
     s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (blk->data_plane) {
+        s->dataplane = virtio_blk_data_plane_create(&s->vdev, conf, s->sn,
+                                                    blk->iothread);
+        if (!s->dataplane) {
+            virtio_cleanup(&s->vdev);
+            return NULL;
+        }
+        s->vdev.set_status = virtio_blk_set_status;
+    }
+#endif
+
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
     register_savevm(dev, "virtio-blk", virtio_blk_id++, 2,
@@ -576,5 +663,8 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_blk_data_plane_destroy(s->dataplane);
+#endif
     unregister_savevm(s->qdev, "virtio-blk", s);
 }
@@ -95,6 +95,12 @@ struct virtio_scsi_inhdr
     uint32_t residual;
 };
 
+typedef struct virtio_blk_conf
+{
+    uint32_t data_plane;
+    char *iothread;             /* for the data plane */
+} virtio_blk_conf;
+
 #ifdef __linux__
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
         DEFINE_VIRTIO_COMMON_FEATURES(_state, _field), \
@@ -11,6 +11,7 @@
  */
 
 #include "qemu-char.h"
+#include "iov.h"
 #include "virtio-serial.h"
 
 typedef struct VirtConsole {
@@ -27,6 +28,32 @@ static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
     return qemu_chr_write(vcon->chr, buf, len);
 }
 
+/* The char device can take more of what the guest sent */
+static void chr_write_unblocked(void *opaque)
+{
+    VirtConsole *vcon = opaque;
+
+    virtio_serial_throttle_port(&vcon->port, false);
+}
+
+/* The same, many of the guest's buffers in one write */
+static ssize_t flush_iov(VirtIOSerialPort *port, const struct iovec *iov,
+                         int iovcnt)
+{
+    VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
+    ssize_t ret;
+
+    ret = qemu_chr_writev(vcon->chr, iov, iovcnt);
+    if (ret == -EAGAIN || (ret >= 0 && ret < iov_size(iov, iovcnt))) {
+        /* The port stays throttled until the char device drains */
+        if (qemu_chr_notify_writable(vcon->chr, chr_write_unblocked) < 0) {
+            /* ...which it never tells, so what it didn't take is lost */
+            return iov_size(iov, iovcnt);
+        }
+    }
+    return ret;
+}
+
 /* Readiness of the guest to accept data on a port */
 static int chr_can_read(void *opaque)
 {
@@ -65,6 +92,7 @@ static int generic_port_init(VirtConsole *vcon, VirtIOSerialDevice *dev)
         qemu_chr_add_handlers(vcon->chr, chr_can_read, chr_read, chr_event,
                               vcon);
         vcon->port.info->have_data = flush_buf;
+        vcon->port.info->have_data_iov = flush_iov;
     }
     return 0;
 }
@@ -86,6 +114,7 @@ static int virtconsole_exitfn(VirtIOSerialDevice *dev)
 
     if (vcon->chr) {
         port->info->have_data = NULL;
+        port->info->have_data_iov = NULL;
         qemu_chr_close(vcon->chr);
     }
 
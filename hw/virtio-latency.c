@@ -0,0 +1,300 @@
+/*
+ * Latency of virtio requests, stage by stage
+ *
+ * Follows each request of a queue from the kick that made the guest's
+ * buffers visible, through the pop, the submission to the backend and its
+ * completion, to the push onto the used ring and the interrupt that told
+ * the guest about it, and keeps a log2 histogram of every stage.  Stages
+ * that a request skips, such as the backend for a request answered on the
+ * spot, are left out of their histogram rather than counted as zero.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "qemu-timer.h"
+#include "qemu-objects.h"
+#include "host-utils.h"
+#include "virtio-latency.h"
+
+#define VIRTIO_LATENCY_BUCKETS  40      /* up to 2^40 ns, about 18 minutes */
+
+enum {
+    VIRTIO_LATENCY_KICK_POP,
+    VIRTIO_LATENCY_POP_SUBMIT,
+    VIRTIO_LATENCY_SUBMIT_COMPLETE,
+    VIRTIO_LATENCY_COMPLETE_PUSH,
+    VIRTIO_LATENCY_PUSH_NOTIFY,
+    VIRTIO_LATENCY_TOTAL,
+    VIRTIO_LATENCY_STAGES,
+};
+
+static const char * const virtio_latency_stages[VIRTIO_LATENCY_STAGES] = {
+    [VIRTIO_LATENCY_KICK_POP]        = "kick-to-pop",
+    [VIRTIO_LATENCY_POP_SUBMIT]      = "pop-to-submit",
+    [VIRTIO_LATENCY_SUBMIT_COMPLETE] = "submit-to-complete",
+    [VIRTIO_LATENCY_COMPLETE_PUSH]   = "complete-to-push",
+    [VIRTIO_LATENCY_PUSH_NOTIFY]     = "push-to-notify",
+    [VIRTIO_LATENCY_TOTAL]           = "total",
+};
+
+typedef struct VirtioLatencyStage {
+    uint64_t count;
+    int64_t total_ns;
+    uint64_t buckets[VIRTIO_LATENCY_BUCKETS];
+} VirtioLatencyStage;
+
+/* When the request with this head went through each stage, 0 if not yet */
+typedef struct VirtioLatencyStamps {
+    int64_t kick;
+    int64_t pop;
+    int64_t submit;
+    int64_t complete;
+    int64_t push;
+} VirtioLatencyStamps;
+
+struct VirtioLatency {
+    char *device;
+    char *path;
+    int queue;
+    unsigned int num;
+    int64_t kick;               /* oldest kick not yet served, or 0 */
+    VirtioLatencyStamps *stamps;
+    uint16_t *pushed;           /* heads pushed since the last interrupt */
+    unsigned int npushed;
+    VirtioLatencyStage stages[VIRTIO_LATENCY_STAGES];
+    QTAILQ_ENTRY(VirtioLatency) next;
+};
+
+static QTAILQ_HEAD(, VirtioLatency) virtio_latency_list =
+    QTAILQ_HEAD_INITIALIZER(virtio_latency_list);
+
+static void virtio_latency_account(VirtioLatency *l, int stage, int64_t ns)
+{
+    VirtioLatencyStage *s = &l->stages[stage];
+    int bucket = ns > 1 ? 63 - clz64(ns) : 0;
+
+    s->count++;
+    s->total_ns += ns;
+    s->buckets[MIN(bucket, VIRTIO_LATENCY_BUCKETS - 1)]++;
+}
+
+VirtioLatency *virtio_latency_new(const char *device, const char *path,
+                                  int queue, unsigned int num)
+{
+    VirtioLatency *l = qemu_mallocz(sizeof(*l));
+
+    l->device = qemu_strdup(device);
+    l->path = path ? qemu_strdup(path) : NULL;
+    l->queue = queue;
+    l->num = num;
+    l->stamps = qemu_mallocz(num * sizeof(*l->stamps));
+    l->pushed = qemu_malloc(num * sizeof(*l->pushed));
+    QTAILQ_INSERT_TAIL(&virtio_latency_list, l, next);
+    return l;
+}
+
+void virtio_latency_delete(VirtioLatency *l)
+{
+    QTAILQ_REMOVE(&virtio_latency_list, l, next);
+    qemu_free(l->device);
+    qemu_free(l->path);
+    qemu_free(l->stamps);
+    qemu_free(l->pushed);
+    qemu_free(l);
+}
+
+void virtio_latency_kick(VirtioLatency *l)
+{
+    if (!l->kick) {
+        l->kick = get_clock();
+    }
+}
+
+void virtio_latency_idle(VirtioLatency *l)
+{
+    l->kick = 0;
+}
+
+void virtio_latency_pop(VirtioLatency *l, unsigned int head)
+{
+    VirtioLatencyStamps *t;
+
+    if (head >= l->num) {
+        return;
+    }
+    t = &l->stamps[head];
+    memset(t, 0, sizeof(*t));
+    t->kick = l->kick;
+    t->pop = get_clock();
+    if (t->kick) {
+        virtio_latency_account(l, VIRTIO_LATENCY_KICK_POP, t->pop - t->kick);
+    }
+}
+
+void virtio_latency_submit(VirtioLatency *l, unsigned int head)
+{
+    VirtioLatencyStamps *t;
+
+    if (head >= l->num || !l->stamps[head].pop) {
+        return;
+    }
+    t = &l->stamps[head];
+    t->submit = get_clock();
+    virtio_latency_account(l, VIRTIO_LATENCY_POP_SUBMIT, t->submit - t->pop);
+}
+
+void virtio_latency_complete(VirtioLatency *l, unsigned int head)
+{
+    VirtioLatencyStamps *t;
+
+    if (head >= l->num || !l->stamps[head].submit) {
+        return;
+    }
+    t = &l->stamps[head];
+    t->complete = get_clock();
+    virtio_latency_account(l, VIRTIO_LATENCY_SUBMIT_COMPLETE,
+                           t->complete - t->submit);
+}
+
+void virtio_latency_push(VirtioLatency *l, unsigned int head)
+{
+    VirtioLatencyStamps *t;
+
+    if (head >= l->num || !l->stamps[head].pop) {
+        return;
+    }
+    t = &l->stamps[head];
+    t->push = get_clock();
+    if (t->complete) {
+        virtio_latency_account(l, VIRTIO_LATENCY_COMPLETE_PUSH,
+                               t->push - t->complete);
+    }
+
+    /* A guest that polls the used ring may never be interrupted; what it
+     * consumed that way has no push-to-notify stage */
+    if (l->npushed == l->num) {
+        l->npushed = 0;
+    }
+    l->pushed[l->npushed++] = head;
+}
+
+void virtio_latency_notify(VirtioLatency *l)
+{
+    int64_t now = get_clock();
+    unsigned int i;
+
+    for (i = 0; i < l->npushed; i++) {
+        VirtioLatencyStamps *t = &l->stamps[l->pushed[i]];
+
+        /* popped again since, without an interrupt in between */
+        if (!t->push) {
+            continue;
+        }
+        virtio_latency_account(l, VIRTIO_LATENCY_PUSH_NOTIFY, now - t->push);
+        virtio_latency_account(l, VIRTIO_LATENCY_TOTAL,
+                               now - (t->kick ? t->kick : t->pop));
+        t->push = 0;
+    }
+    l->npushed = 0;
+}
+
+void virtio_latency_reset(VirtioLatency *l)
+{
+    l->kick = 0;
+    l->npushed = 0;
+    memset(l->stamps, 0, l->num * sizeof(*l->stamps));
+}
+
+static QObject *virtio_latency_stage_to_qobject(const VirtioLatencyStage *s)
+{
+    QList *histogram = qlist_new();
+    int i, n = VIRTIO_LATENCY_BUCKETS;
+
+    while (n > 1 && !s->buckets[n - 1]) {
+        n--;
+    }
+    for (i = 0; i < n; i++) {
+        qlist_append(histogram, qint_from_int(s->buckets[i]));
+    }
+    return qobject_from_jsonf("{ 'count': %" PRId64 ", 'time-ns': %" PRId64
+                              ", 'histogram': %p }", s->count, s->total_ns,
+                              histogram);
+}
+
+void virtio_latency_info(Monitor *mon, QObject **ret_data)
+{
+    QList *queues = qlist_new();
+    VirtioLatency *l;
+
+    QTAILQ_FOREACH(l, &virtio_latency_list, next) {
+        QDict *queue = qdict_new();
+        int i;
+
+        qdict_put(queue, "device", qstring_from_str(l->device));
+        if (l->path) {
+            qdict_put(queue, "path", qstring_from_str(l->path));
+        }
+        qdict_put(queue, "queue", qint_from_int(l->queue));
+        for (i = 0; i < VIRTIO_LATENCY_STAGES; i++) {
+            qdict_put_obj(queue, virtio_latency_stages[i],
+                          virtio_latency_stage_to_qobject(&l->stages[i]));
+        }
+        qlist_append(queues, queue);
+    }
+
+    *ret_data = QOBJECT(queues);
+}
+
+/* Upper bound of the bucket holding the given fraction of the samples */
+static int64_t virtio_latency_percentile(QList *histogram, int64_t count,
+                                         double frac)
+{
+    int64_t seen = 0;
+    QListEntry *e;
+    int i = 0;
+
+    QLIST_FOREACH_ENTRY(histogram, e) {
+        seen += qint_get_int(qobject_to_qint(e->value));
+        if (seen && seen >= count * frac) {
+            return 2LL << i;
+        }
+        i++;
+    }
+    return 0;
+}
+
+static void virtio_latency_print_queue(QObject *data, void *opaque)
+{
+    QDict *queue = qobject_to_qdict(data);
+    Monitor *mon = opaque;
+    int i;
+
+    monitor_printf(mon, "%s", qdict_get_str(queue, "device"));
+    if (qdict_haskey(queue, "path")) {
+        monitor_printf(mon, " (%s)", qdict_get_str(queue, "path"));
+    }
+    monitor_printf(mon, " queue %" PRId64 ":\n",
+                   qdict_get_int(queue, "queue"));
+
+    for (i = 0; i < VIRTIO_LATENCY_STAGES; i++) {
+        QDict *stage = qdict_get_qdict(queue, virtio_latency_stages[i]);
+        QList *histogram = qdict_get_qlist(stage, "histogram");
+        int64_t count = qdict_get_int(stage, "count");
+
+        monitor_printf(mon, "  %-18s count=%" PRId64 " avg_ns=%" PRId64
+                       " p50_ns=%" PRId64 " p99_ns=%" PRId64 "\n",
+                       virtio_latency_stages[i], count,
+                       qdict_get_int(stage, "time-ns") / MAX(count, 1),
+                       virtio_latency_percentile(histogram, count, 0.5),
+                       virtio_latency_percentile(histogram, count, 0.99));
+    }
+}
+
+void virtio_latency_print(Monitor *mon, const QObject *data)
+{
+    qlist_iter(qobject_to_qlist(data), virtio_latency_print_queue, mon);
+}
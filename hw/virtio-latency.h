@@ -0,0 +1,47 @@
+/*
+ * Latency of virtio requests, stage by stage
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_VIRTIO_LATENCY_H
+#define QEMU_VIRTIO_LATENCY_H
+
+#include "monitor.h"
+
+typedef struct VirtioLatency VirtioLatency;
+
+/*
+ * Only built with --enable-virtio-latency.  A request is identified by
+ * the head of its descriptor chain, which is below num; everything runs
+ * under the global mutex.
+ */
+
+/* Statistics for one queue of a device, listed until
+   virtio_latency_delete(); path may be NULL */
+VirtioLatency *virtio_latency_new(const char *device, const char *path,
+                                  int queue, unsigned int num);
+void virtio_latency_delete(VirtioLatency *l);
+
+/* The guest kicked the queue */
+void virtio_latency_kick(VirtioLatency *l);
+
+/* The device found the queue empty; later requests were not kicked */
+void virtio_latency_idle(VirtioLatency *l);
+
+void virtio_latency_pop(VirtioLatency *l, unsigned int head);
+void virtio_latency_submit(VirtioLatency *l, unsigned int head);
+void virtio_latency_complete(VirtioLatency *l, unsigned int head);
+void virtio_latency_push(VirtioLatency *l, unsigned int head);
+
+/* The guest was interrupted for what was pushed so far */
+void virtio_latency_notify(VirtioLatency *l);
+
+/* Forget the requests in flight, on device reset */
+void virtio_latency_reset(VirtioLatency *l);
+
+void virtio_latency_info(Monitor *mon, QObject **ret_data);
+void virtio_latency_print(Monitor *mon, const QObject *data);
+
+#endif
@@ -14,6 +14,7 @@
 #include "iov.h"
 #include "virtio.h"
 #include "net.h"
+#include "monitor.h"
 #include "net/checksum.h"
 #include "net/tap.h"
 #include "qemu-error.h"
@@ -26,26 +27,86 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* How tx=adaptive flushes a TX queue when the guest kicks it */
+enum {
+    VIRTIO_NET_TX_IMMEDIATE,    /* in the kick handler */
+    VIRTIO_NET_TX_BH,           /* in a bottom half */
+    VIRTIO_NET_TX_TIMER,        /* after tx_interval */
+};
+
+/* tx=adaptive picks the mode again every TX_ADAPT_WINDOW ns, from the
+ * packet rate and bytes per kick it measured during the window: sparse
+ * small packets are sent at once, for latency, and the more traffic
+ * there is the more kicks are batched, for throughput. */
+#define TX_ADAPT_WINDOW         10000000        /* 10 ms */
+#define TX_ADAPT_LOW_RATE       5000            /* packets/s */
+#define TX_ADAPT_HIGH_RATE      50000           /* packets/s */
+#define TX_ADAPT_BULK_BYTES     4096            /* bytes per kick */
+#define TX_ADAPT_BATCH          32              /* packets per timer flush */
+#define TX_ADAPT_MIN_INTERVAL   20000           /* 20 us */
+
+/* rx buffers popped ahead for zero-copy receive */
+#define VIRTIO_NET_RX_STASH     64
+
+struct VirtIONet;
+
+/* An RX/TX queue pair, with the NIC client that connects it to its queue
+ * of the backend */
+typedef struct VirtIONetQueue {
+    VirtQueue *rx_vq;
+    VirtQueue *tx_vq;
+    QEMUTimer *tx_timer;
+    QEMUBH *tx_bh;
+    int tx_waiting;
+    int64_t tx_interval;
+    int tx_mode;
+    struct {
+        VirtQueueCompactElement *elem;
+        ssize_t len;
+    } async_tx;
+    struct {
+        uint64_t kicks;
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t immediate;
+        uint64_t bh;
+        uint64_t timer;
+    } tx_stats;
+    struct {
+        int64_t start;
+        uint64_t kicks;
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t rate;          /* packets/s in the last window */
+        uint64_t bytes_per_kick;
+    } tx_adapt;
+    struct {
+        VirtQueueCompactElement *elems[VIRTIO_NET_RX_STASH];
+        int num;
+    } rx_stash;
+    NICState *nic;
+    NICConf conf;
+    struct VirtIONet *n;
+} VirtIONetQueue;
+
 typedef struct VirtIONet
 {
     VirtIODevice vdev;
     uint8_t mac[ETH_ALEN];
     uint16_t status;
-    VirtQueue *rx_vq;
-    VirtQueue *tx_vq;
+    VirtIONetQueue *vqs;
     VirtQueue *ctrl_vq;
     NICState *nic;
-    QEMUTimer *tx_timer;
-    QEMUBH *tx_bh;
     uint32_t tx_timeout;
     int32_t tx_burst;
-    int tx_waiting;
+    int tx_timer_mode;
+    int tx_adaptive;
     uint32_t has_vnet_hdr;
     uint8_t has_ufo;
-    struct {
-        VirtQueueElement elem;
-        ssize_t len;
-    } async_tx;
+    int max_queues;
+    int curr_queues;
+    int multiqueue;
+    size_t config_size;
     int mergeable_rx_bufs;
     uint8_t promisc;
     uint8_t allmulti;
@@ -74,14 +135,32 @@ static VirtIONet *to_virtio_net(VirtIODevice *vdev)
     return (VirtIONet *)vdev;
 }
 
+static VirtIONetQueue *virtio_net_get_queue(VLANClientState *nc)
+{
+    return DO_UPCAST(NICState, nc, nc)->opaque;
+}
+
+/* The queue pair of a RX or TX virtqueue; the control queue comes last */
+static VirtIONetQueue *virtio_net_vq_to_queue(VirtIONet *n, VirtQueue *vq)
+{
+    return &n->vqs[virtio_get_queue_index(vq) / 2];
+}
+
+static int virtio_net_queue_index(VirtIONetQueue *q)
+{
+    return q - q->n->vqs;
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
+    uint16_t max_queues = n->max_queues;
 
     netcfg.status = lduw_p(&n->status);
+    netcfg.max_virtqueue_pairs = lduw_p(&max_queues);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
-    memcpy(config, &netcfg, sizeof(netcfg));
+    memcpy(config, &netcfg, n->config_size);
 }
 
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -89,7 +168,7 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
-    memcpy(&netcfg, config, sizeof(netcfg));
+    memcpy(&netcfg, config, n->config_size);
 
     if (memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
@@ -97,75 +176,129 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     }
 }
 
+/* Give the guest back the rx buffers popped for zero-copy receive that no
+ * packet went into yet; anything else that looks at the rx queue has to
+ * do so first. */
+static void virtio_net_rx_unstash(VirtIONetQueue *q)
+{
+    while (q->rx_stash.num) {
+        virtqueue_discard_compact(q->rx_vq,
+                                  q->rx_stash.elems[--q->rx_stash.num]);
+    }
+}
+
 static bool virtio_net_started(VirtIONet *n, uint8_t status)
 {
     return (status & VIRTIO_CONFIG_S_DRIVER_OK) &&
         (n->status & VIRTIO_NET_S_LINK_UP) && n->vdev.vm_running;
 }
 
-static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
+/* The vhost-net instance of the backend of queue pair i, if any */
+static struct vhost_net *virtio_net_get_vhost_net(VirtIONet *n, int i)
 {
-    if (!n->nic->nc.peer) {
-        return;
-    }
-    if (n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP) {
-        return;
+    VLANClientState *peer = n->vqs[i].nic ? n->vqs[i].nic->nc.peer : NULL;
+
+    if (!peer || peer->info->type != NET_CLIENT_TYPE_TAP) {
+        return NULL;
     }
+    return tap_get_vhost_net(peer);
+}
+
+static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
+{
+    struct vhost_net *nets[VIRTIO_NET_QUEUES_MAX];
+    int i, queues = n->multiqueue ? n->max_queues : 1;
 
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
+    if (!virtio_net_get_vhost_net(n, 0)) {
         return;
     }
     if (!!n->vhost_started == virtio_net_started(n, status)) {
         return;
     }
+    for (i = 0; i < queues; i++) {
+        nets[i] = virtio_net_get_vhost_net(n, i);
+        if (!nets[i]) {
+            return;
+        }
+    }
     if (!n->vhost_started) {
         int r;
-        if (!vhost_net_query(tap_get_vhost_net(n->nic->nc.peer), &n->vdev)) {
+        if (!vhost_net_query(nets[0], &n->vdev)) {
             return;
         }
-        r = vhost_net_start(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        r = vhost_net_start(&n->vdev, nets, queues);
         if (r < 0) {
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
         } else {
-            n->vhost_started = 1;
+            n->vhost_started = queues;
         }
     } else {
-        vhost_net_stop(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
+        vhost_net_stop(&n->vdev, nets, n->vhost_started);
         n->vhost_started = 0;
     }
 }
 
+/* Run a pending flush of the TX queue of q */
+static void virtio_net_tx_resume(VirtIONetQueue *q)
+{
+    if (q->tx_timer && (!q->tx_bh || q->tx_mode == VIRTIO_NET_TX_TIMER)) {
+        qemu_mod_timer(q->tx_timer, qemu_get_clock(vm_clock) + q->tx_interval);
+    } else {
+        qemu_bh_schedule(q->tx_bh);
+    }
+}
+
+static void virtio_net_tx_cancel(VirtIONetQueue *q)
+{
+    if (q->tx_timer) {
+        qemu_del_timer(q->tx_timer);
+    }
+    if (q->tx_bh) {
+        qemu_bh_cancel(q->tx_bh);
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
+
+    /* vhost and migration pick up from the avail index */
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_rx_unstash(&n->vqs[i]);
+    }
 
     virtio_net_vhost_status(n, status);
 
-    if (!n->tx_waiting) {
-        return;
-    }
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
 
-    if (virtio_net_started(n, status) && !n->vhost_started) {
-        if (n->tx_timer) {
-            qemu_mod_timer(n->tx_timer,
-                           qemu_get_clock(vm_clock) + n->tx_timeout);
-        } else {
-            qemu_bh_schedule(n->tx_bh);
+        if (!q->tx_waiting) {
+            continue;
         }
-    } else {
-        if (n->tx_timer) {
-            qemu_del_timer(n->tx_timer);
+
+        if (virtio_net_started(n, status) && !n->vhost_started &&
+            i < n->curr_queues) {
+            virtio_net_tx_resume(q);
         } else {
-            qemu_bh_cancel(n->tx_bh);
+            virtio_net_tx_cancel(q);
         }
     }
 }
 
 static void virtio_net_set_link_status(VLANClientState *nc)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONet *n = virtio_net_get_queue(nc)->n;
     uint16_t old_status = n->status;
+    int i;
+
+    /* All the queue pairs share the link */
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].nic) {
+            n->vqs[i].nic->nc.link_down = nc->link_down;
+        }
+    }
 
     if (nc->link_down)
         n->status &= ~VIRTIO_NET_S_LINK_UP;
@@ -178,10 +311,97 @@ static void virtio_net_set_link_status(VLANClientState *nc)
     virtio_net_set_status(&n->vdev, n->vdev.status);
 }
 
+static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_tx_adaptive(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq);
+
+static void virtio_net_add_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+
+    q->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    if (n->tx_adaptive) {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256,
+                                    virtio_net_handle_tx_adaptive);
+    } else if (n->tx_timer_mode) {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
+    } else {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
+    }
+}
+
+static void virtio_net_del_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+
+    virtio_net_rx_unstash(q);
+    qemu_purge_queued_packets(&q->nic->nc);
+    if (q->async_tx.elem) {
+        virtqueue_free_compact(q->async_tx.elem);
+        q->async_tx.elem = NULL;
+        q->async_tx.len = 0;
+    }
+    q->tx_waiting = 0;
+    virtio_net_tx_cancel(q);
+
+    virtio_del_queue(&n->vdev, index * 2 + 1);
+    virtio_del_queue(&n->vdev, index * 2);
+    q->rx_vq = NULL;
+    q->tx_vq = NULL;
+}
+
+/* With VIRTIO_NET_F_MQ there are max_queues queue pairs before the control
+ * queue, without it there is only one.  Features are acked before the guest
+ * sets the queues up, so they can be replaced at that point. */
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
+{
+    int i, queues = multiqueue ? n->max_queues : 1;
+
+    if (!!n->multiqueue == !!multiqueue) {
+        return;
+    }
+    n->multiqueue = multiqueue;
+
+    virtio_del_queue(&n->vdev, virtio_get_queue_index(n->ctrl_vq));
+    for (i = n->max_queues - 1; i >= queues; i--) {
+        virtio_net_del_queue(n, i);
+    }
+    for (i = 1; i < queues; i++) {
+        virtio_net_add_queue(n, i);
+    }
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+}
+
+/* Let the backend spread packets only over the queues the guest uses */
+static void virtio_net_set_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VLANClientState *peer = n->vqs[i].nic->nc.peer;
+
+        if (!peer || peer->info->type != NET_CLIENT_TYPE_TAP) {
+            continue;
+        }
+        if (i < n->curr_queues) {
+            tap_enable(peer);
+        } else {
+            tap_disable(peer);
+        }
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
+    /* Back to a single queue pair until the guest acks VIRTIO_NET_F_MQ */
+    virtio_net_set_multiqueue(n, 0);
+    n->curr_queues = 1;
+    virtio_net_set_queues(n);
+
     /* Reset back to compatibility mode */
     n->promisc = 1;
     n->allmulti = 0;
@@ -199,6 +419,11 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memset(n->vlans, 0, MAX_VLAN >> 3);
 }
 
+static VLANClientState *virtio_net_queue_peer(VirtIONet *n, int i)
+{
+    return n->vqs[i].nic->nc.peer;
+}
+
 static int peer_has_vnet_hdr(VirtIONet *n)
 {
     if (!n->nic->nc.peer)
@@ -228,8 +453,16 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
 
     features |= (1 << VIRTIO_NET_F_MAC);
 
+    if (n->max_queues == 1 || !(features & (1 << VIRTIO_NET_F_CTRL_VQ))) {
+        features &= ~(0x1 << VIRTIO_NET_F_MQ);
+    }
+
     if (peer_has_vnet_hdr(n)) {
-        tap_using_vnet_hdr(n->nic->nc.peer, 1);
+        int i;
+
+        for (i = 0; i < n->max_queues; i++) {
+            tap_using_vnet_hdr(virtio_net_queue_peer(n, i), 1);
+        }
     } else {
         features &= ~(0x1 << VIRTIO_NET_F_CSUM);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
@@ -247,14 +480,10 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP) {
+    if (!virtio_net_get_vhost_net(n, 0)) {
         return features;
     }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
-        return features;
-    }
-    return vhost_net_get_features(tap_get_vhost_net(n->nic->nc.peer), features);
+    return vhost_net_get_features(virtio_net_get_vhost_net(n, 0), features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -272,28 +501,37 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
     return features;
 }
 
-static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
+static void virtio_net_set_offload(VirtIONet *n, uint32_t features)
 {
-    VirtIONet *n = to_virtio_net(vdev);
-
-    n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
+    int i;
 
-    if (n->has_vnet_hdr) {
-        tap_set_offload(n->nic->nc.peer,
+    for (i = 0; i < n->max_queues; i++) {
+        tap_set_offload(virtio_net_queue_peer(n, i),
                         (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
                         (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
                         (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
                         (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
                         (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
     }
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP) {
-        return;
+}
+
+static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+    int i;
+
+    n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
+
+    virtio_net_set_multiqueue(n, !!(features & (1 << VIRTIO_NET_F_MQ)));
+
+    if (n->has_vnet_hdr) {
+        virtio_net_set_offload(n, features);
     }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
-        return;
+    for (i = 0; i < n->max_queues; i++) {
+        if (virtio_net_get_vhost_net(n, i)) {
+            vhost_net_ack_features(virtio_net_get_vhost_net(n, i), features);
+        }
     }
-    vhost_net_ack_features(tap_get_vhost_net(n->nic->nc.peer), features);
 }
 
 static int virtio_net_handle_rx_mode(VirtIONet *n, uint8_t cmd,
@@ -403,6 +641,33 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                VirtQueueElement *elem)
+{
+    uint16_t queues;
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || !n->multiqueue ||
+        elem->out_num != 2 || elem->out_sg[1].iov_len != sizeof(queues)) {
+        error_report("virtio-net ctrl invalid multiqueue command");
+        return VIRTIO_NET_ERR;
+    }
+
+    queues = lduw_p(elem->out_sg[1].iov_base);
+
+    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+        queues > n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->curr_queues = queues;
+    /* stop or kick the TX of the queues that went out of or into use */
+    virtio_net_set_status(&n->vdev, n->vdev.status);
+    virtio_net_set_queues(n);
+
+    return VIRTIO_NET_OK;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -431,6 +696,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_mac(n, ctrl.cmd, &elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_VLAN)
             status = virtio_net_handle_vlan_table(n, ctrl.cmd, &elem);
+        else if (ctrl.class == VIRTIO_NET_CTRL_MQ)
+            status = virtio_net_handle_mq(n, ctrl.cmd, &elem);
 
         stb_p(elem.in_sg[elem.in_num - 1].iov_base, status);
 
@@ -445,7 +712,7 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
-    qemu_flush_queued_packets(&n->nic->nc);
+    qemu_flush_queued_packets(&virtio_net_vq_to_queue(n, vq)->nic->nc);
 
     /* We now have RX buffers, signal to the IO thread to break out of the
      * select to re-poll the tap file descriptor */
@@ -454,36 +721,44 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 
 static int virtio_net_can_receive(VLANClientState *nc)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
+
     if (!n->vdev.vm_running) {
         return 0;
     }
 
-    if (!virtio_queue_ready(n->rx_vq) ||
+    if (virtio_net_queue_index(q) >= n->curr_queues) {
+        return 0;
+    }
+
+    if (!virtio_queue_ready(q->rx_vq) ||
         !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return 0;
 
     return 1;
 }
 
-static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
-    if (virtio_queue_empty(n->rx_vq) ||
+    VirtIONet *n = q->n;
+
+    if (virtio_queue_empty(q->rx_vq) ||
         (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(n->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(n->rx_vq, 1);
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(n->rx_vq) ||
+        if (virtio_queue_empty(q->rx_vq) ||
             (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(n->rx_vq, bufsize, 0)))
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0)))
             return 0;
     }
 
-    virtio_queue_set_notification(n->rx_vq, 0);
+    virtio_queue_set_notification(q->rx_vq, 0);
     return 1;
 }
 
@@ -501,14 +776,20 @@ static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
  * we should provide a mechanism to disable it to avoid polluting the host
  * cache.
  */
-static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
-                                        const uint8_t *buf, size_t size)
+static bool is_broken_dhclient_packet(const struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size)
 {
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
         (size > 27 && size < 1500) && /* normal sized MTU */
         (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
         (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+        (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
+static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
+                                        const uint8_t *buf, size_t size)
+{
+    if (is_broken_dhclient_packet(hdr, buf, size)) {
         /* FIXME this cast is evil */
         net_checksum_calculate((uint8_t *)buf, size);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
@@ -592,22 +873,28 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
+/* Fill the used ring with one packet, *filled entries past those of the
+ * packets before it in this batch.  The caller flushes and notifies. */
+static ssize_t virtio_net_receive_one(VLANClientState *nc, const uint8_t *buf,
+                                      size_t size, unsigned int *filled)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t guest_hdr_len, offset, i, host_hdr_len;
 
-    if (!virtio_net_can_receive(&n->nic->nc))
+    if (!virtio_net_can_receive(nc))
         return -1;
 
+    virtio_net_rx_unstash(q);
+
     /* hdr_len refers to the header we supply to the guest */
     guest_hdr_len = n->mergeable_rx_bufs ?
         sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
 
 
     host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
-    if (!virtio_net_has_buffers(n, size + guest_hdr_len - host_hdr_len))
+    if (!virtio_net_has_buffers(q, size + guest_hdr_len - host_hdr_len))
         return 0;
 
     if (!receive_filter(n, buf, size))
@@ -616,13 +903,14 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueCompactElement *elem;
         int len, total;
         struct iovec sg[VIRTQUEUE_MAX_SIZE];
 
         total = 0;
 
-        if (virtqueue_pop(n->rx_vq, &elem) == 0) {
+        elem = virtqueue_pop_compact(q->rx_vq);
+        if (!elem) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -633,29 +921,29 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
             exit(1);
         }
 
-        if (elem.in_num < 1) {
+        if (elem->in_num < 1) {
             error_report("virtio-net receive queue contains no in buffers");
             exit(1);
         }
 
-        if (!n->mergeable_rx_bufs && elem.in_sg[0].iov_len != guest_hdr_len) {
+        if (!n->mergeable_rx_bufs && elem->in_sg[0].iov_len != guest_hdr_len) {
             error_report("virtio-net header not in first element");
             exit(1);
         }
 
-        memcpy(&sg, &elem.in_sg[0], sizeof(sg[0]) * elem.in_num);
+        memcpy(&sg, &elem->in_sg[0], sizeof(sg[0]) * elem->in_num);
 
         if (i == 0) {
             if (n->mergeable_rx_bufs)
                 mhdr = (struct virtio_net_hdr_mrg_rxbuf *)sg[0].iov_base;
 
-            offset += receive_header(n, sg, elem.in_num,
+            offset += receive_header(n, sg, elem->in_num,
                                      buf + offset, size - offset, guest_hdr_len);
             total += guest_hdr_len;
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num,
+        len = iov_from_buf(sg, elem->in_num,
                            buf + offset, size - offset);
         total += len;
         offset += len;
@@ -670,42 +958,248 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
                          i, n->mergeable_rx_bufs,
                          offset, size, guest_hdr_len, host_hdr_len);
 #endif
+            virtqueue_free_compact(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(n->rx_vq, &elem, total, i++);
+        virtqueue_fill_compact(q->rx_vq, elem, total, *filled + i++);
+        virtqueue_free_compact(elem);
     }
 
     if (mhdr) {
         mhdr->num_buffers = lduw_p(&i);
     }
-
-    virtqueue_flush(n->rx_vq, i);
-    virtio_notify(&n->vdev, n->rx_vq);
+    *filled += i;
 
     return size;
 }
 
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
+static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    unsigned int filled = 0;
+    ssize_t ret;
+
+    ret = virtio_net_receive_one(nc, buf, size, &filled);
+    if (filled) {
+        virtqueue_flush(q->rx_vq, filled);
+        virtio_notify(&q->n->vdev, q->rx_vq);
+    }
+    return ret;
+}
+
+/* Several packets from the peer: one used ring update and one interrupt
+ * for all of them.  Stops at the first packet there is no room for. */
+static int virtio_net_receive_batch(VLANClientState *nc,
+                                    const struct iovec *pkts, int count)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    unsigned int filled = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!virtio_net_receive_one(nc, pkts[i].iov_base, pkts[i].iov_len,
+                                    &filled)) {
+            break;
+        }
+    }
+    if (filled) {
+        virtqueue_flush(q->rx_vq, filled);
+        virtio_notify(&q->n->vdev, q->rx_vq);
+    }
+    return i;
+}
+
+/* Copy size bytes from or to the stashed rx buffers, offset bytes into
+ * the first one */
+static size_t virtio_net_stash_copy(VirtIONetQueue *q, size_t offset,
+                                    uint8_t *buf, size_t size, int to_guest)
+{
+    size_t done = 0;
+    int i, j;
+
+    for (i = 0; i < q->rx_stash.num && done < size; i++) {
+        VirtQueueCompactElement *elem = q->rx_stash.elems[i];
+
+        for (j = 0; j < elem->in_num && done < size; j++) {
+            uint8_t *base = elem->in_sg[j].iov_base;
+            size_t len = elem->in_sg[j].iov_len;
+
+            if (offset >= len) {
+                offset -= len;
+                continue;
+            }
+            len = MIN(len - offset, size - done);
+            if (to_guest) {
+                memcpy(base + offset, buf + done, len);
+            } else {
+                memcpy(buf + done, base + offset, len);
+            }
+            done += len;
+            offset = 0;
+        }
+    }
+    return done;
+}
+
+/* Zero-copy receive, with mergeable rx buffers: the peer reads the packet
+ * straight into guest buffers, popped ahead of it.  Those the packet does
+ * not need are kept for the next one.  The virtio_net_hdr from the peer,
+ * if any, goes to the start of the guest header and the packet after it,
+ * as receive_header would place them. */
+static int virtio_net_receive_buffers(VLANClientState *nc, struct iovec *iov,
+                                      int iovcnt, size_t hdr_len, size_t size)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
+    size_t guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    size_t avail = 0, need;
+    int i, j, cnt = 0;
+
+    if (!n->mergeable_rx_bufs ||
+        hdr_len != (n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0)) {
+        return 0;
+    }
+    need = size - hdr_len + guest_hdr_len;
+
+    for (i = 0; avail < need; i++) {
+        VirtQueueCompactElement *elem;
+
+        if (i == q->rx_stash.num) {
+            if (i == VIRTIO_NET_RX_STASH) {
+                return 0;
+            }
+            elem = virtqueue_pop_compact(q->rx_vq);
+            if (!elem) {
+                return 0;
+            }
+            /* any of them may come first, and hold the header */
+            if (elem->in_num < 1 || elem->in_sg[0].iov_len < guest_hdr_len) {
+                virtqueue_discard_compact(q->rx_vq, elem);
+                return 0;
+            }
+            q->rx_stash.elems[q->rx_stash.num++] = elem;
+        }
+
+        elem = q->rx_stash.elems[i];
+        for (j = 0; j < elem->in_num && avail < need; j++) {
+            struct iovec sg = elem->in_sg[j];
+
+            if (i == 0 && j == 0) {
+                if (hdr_len) {
+                    if (cnt == iovcnt) {
+                        return 0;
+                    }
+                    iov[cnt].iov_base = sg.iov_base;
+                    iov[cnt++].iov_len = hdr_len;
+                }
+                sg.iov_base += guest_hdr_len;
+                sg.iov_len -= guest_hdr_len;
+                avail += guest_hdr_len;
+                if (!sg.iov_len) {
+                    continue;
+                }
+            }
+            if (cnt == iovcnt) {
+                return 0;
+            }
+            iov[cnt++] = sg;
+            avail += sg.iov_len;
+        }
+    }
+    return cnt;
+}
+
+static void virtio_net_receive_complete(VLANClientState *nc, ssize_t len)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
+    size_t guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    size_t host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+    struct virtio_net_hdr_mrg_rxbuf *mhdr;
+    uint8_t head[sizeof(struct virtio_net_hdr) + 64] = { 0 };
+    size_t size, total;
+    uint16_t i;
+
+    /* nothing read, the buffers stay for the next packet */
+    if (len <= (ssize_t)host_hdr_len) {
+        return;
+    }
+    size = len - host_hdr_len;
+    mhdr = q->rx_stash.elems[0]->in_sg[0].iov_base;
+
+    /* receive_filter wants the packet after the host header */
+    memcpy(head, &mhdr->hdr, host_hdr_len);
+    virtio_net_stash_copy(q, guest_hdr_len, head + host_hdr_len,
+                          MIN(size, sizeof(head) - host_hdr_len), 0);
+    if (!receive_filter(n, head, len)) {
+        return;
+    }
+
+    if (!n->has_vnet_hdr) {
+        mhdr->hdr.flags = 0;
+        mhdr->hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    } else if (is_broken_dhclient_packet(&mhdr->hdr, head + host_hdr_len,
+                                         size)) {
+        uint8_t frame[1500];
+
+        virtio_net_stash_copy(q, guest_hdr_len, frame, size, 0);
+        work_around_broken_dhclient(&mhdr->hdr, frame, size);
+        virtio_net_stash_copy(q, guest_hdr_len, frame, size, 1);
+    }
+
+    /* the header has to be complete before the buffers are unmapped */
+    total = guest_hdr_len + size;
+    for (i = 0; total; i++) {
+        VirtQueueCompactElement *elem = q->rx_stash.elems[i];
+
+        total -= MIN(total, iov_size(elem->in_sg, elem->in_num));
+    }
+    mhdr->num_buffers = lduw_p(&i);
+
+    total = guest_hdr_len + size;
+    for (i = 0; total; i++) {
+        VirtQueueCompactElement *elem = q->rx_stash.elems[i];
+        size_t used = MIN(total, iov_size(elem->in_sg, elem->in_num));
+
+        virtqueue_fill_compact(q->rx_vq, elem, used, i);
+        virtqueue_free_compact(elem);
+        total -= used;
+    }
+    q->rx_stash.num -= i;
+    memmove(q->rx_stash.elems, q->rx_stash.elems + i,
+            q->rx_stash.num * sizeof(q->rx_stash.elems[0]));
+
+    virtqueue_flush(q->rx_vq, i);
+    virtio_notify(&n->vdev, q->rx_vq);
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(VLANClientState *nc, ssize_t len)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
 
-    virtqueue_push(n->tx_vq, &n->async_tx.elem, n->async_tx.len);
-    virtio_notify(&n->vdev, n->tx_vq);
+    virtqueue_latency_complete(q->tx_vq, q->async_tx.elem->index);
+    virtqueue_push_compact(q->tx_vq, q->async_tx.elem, q->async_tx.len);
+    virtio_notify(&n->vdev, q->tx_vq);
 
-    n->async_tx.elem.out_num = n->async_tx.len = 0;
+    virtqueue_free_compact(q->async_tx.elem);
+    q->async_tx.elem = NULL;
+    q->async_tx.len = 0;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
-    VirtQueueElement elem;
+    VirtIONet *n = q->n;
+    VirtQueue *vq = q->tx_vq;
+    VirtQueueCompactElement *elem;
     int32_t num_packets = 0;
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
@@ -713,15 +1207,15 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 
     assert(n->vdev.vm_running);
 
-    if (n->async_tx.elem.out_num) {
-        virtio_queue_set_notification(n->tx_vq, 0);
+    if (q->async_tx.elem) {
+        virtio_queue_set_notification(vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop_compact(vq))) {
         ssize_t ret, len = 0;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
+        unsigned int out_num = elem->out_num;
+        struct iovec *out_sg = &elem->out_sg[0];
         unsigned hdr_len;
 
         /* hdr_len refers to the header received from the guest */
@@ -746,19 +1240,24 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             len += hdr_len;
         }
 
-        ret = qemu_sendv_packet_async(&n->nic->nc, out_sg, out_num,
+        virtqueue_latency_submit(vq, elem->index);
+        ret = qemu_sendv_packet_async(&q->nic->nc, out_sg, out_num,
                                       virtio_net_tx_complete);
         if (ret == 0) {
-            virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
-            n->async_tx.len  = len;
+            virtio_queue_set_notification(vq, 0);
+            q->async_tx.elem = elem;
+            q->async_tx.len  = len;
             return -EBUSY;
         }
 
+        virtqueue_latency_complete(vq, elem->index);
+        q->tx_stats.packets++;
+        q->tx_stats.bytes += ret;
         len += ret;
 
-        virtqueue_push(vq, &elem, len);
+        virtqueue_push_compact(vq, elem, len);
         virtio_notify(&n->vdev, vq);
+        virtqueue_free_compact(elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
@@ -770,22 +1269,25 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_vq_to_queue(n, vq);
+
+    q->tx_stats.kicks++;
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         return;
     }
 
-    if (n->tx_waiting) {
+    if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
-        qemu_del_timer(n->tx_timer);
-        n->tx_waiting = 0;
-        virtio_net_flush_tx(n, vq);
+        qemu_del_timer(q->tx_timer);
+        q->tx_waiting = 0;
+        virtio_net_flush_tx(q);
     } else {
-        qemu_mod_timer(n->tx_timer,
-                       qemu_get_clock(vm_clock) + n->tx_timeout);
-        n->tx_waiting = 1;
+        qemu_mod_timer(q->tx_timer,
+                       qemu_get_clock(vm_clock) + q->tx_interval);
+        q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
 }
@@ -793,48 +1295,143 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_vq_to_queue(n, vq);
 
-    if (unlikely(n->tx_waiting)) {
+    q->tx_stats.kicks++;
+
+    if (unlikely(q->tx_waiting)) {
         return;
     }
-    n->tx_waiting = 1;
+    q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(n->tx_bh);
+    qemu_bh_schedule(q->tx_bh);
+}
+
+/* Pick the TX mode of q for the next window from the last one */
+static void virtio_net_tx_adapt(VirtIONetQueue *q, int64_t now)
+{
+    VirtIONet *n = q->n;
+    int64_t elapsed = now - q->tx_adapt.start;
+    uint64_t kicks, packets, bytes, low = TX_ADAPT_LOW_RATE;
+    uint64_t high = TX_ADAPT_HIGH_RATE;
+
+    if (elapsed < TX_ADAPT_WINDOW) {
+        return;
+    }
+
+    kicks = q->tx_stats.kicks - q->tx_adapt.kicks;
+    packets = q->tx_stats.packets - q->tx_adapt.packets;
+    bytes = q->tx_stats.bytes - q->tx_adapt.bytes;
+    q->tx_adapt.rate = packets * get_ticks_per_sec() / elapsed;
+    q->tx_adapt.bytes_per_kick = kicks ? bytes / kicks : bytes;
+
+    /* Only leave a mode for one that batches less once the rate clearly
+     * dropped, so that it does not flap around a threshold */
+    if (q->tx_mode != VIRTIO_NET_TX_IMMEDIATE) {
+        low = low * 3 / 4;
+    }
+    if (q->tx_mode == VIRTIO_NET_TX_TIMER) {
+        high = high * 3 / 4;
+    }
+
+    if (q->tx_adapt.rate < low &&
+        q->tx_adapt.bytes_per_kick < TX_ADAPT_BULK_BYTES) {
+        q->tx_mode = VIRTIO_NET_TX_IMMEDIATE;
+    } else if (q->tx_adapt.rate < high) {
+        q->tx_mode = VIRTIO_NET_TX_BH;
+    } else {
+        /* about TX_ADAPT_BATCH packets per flush */
+        q->tx_mode = VIRTIO_NET_TX_TIMER;
+        q->tx_interval = TX_ADAPT_BATCH * get_ticks_per_sec() /
+            q->tx_adapt.rate;
+        q->tx_interval = MAX(q->tx_interval, TX_ADAPT_MIN_INTERVAL);
+        q->tx_interval = MIN(q->tx_interval, n->tx_timeout);
+    }
+
+    q->tx_adapt.start = now;
+    q->tx_adapt.kicks = q->tx_stats.kicks;
+    q->tx_adapt.packets = q->tx_stats.packets;
+    q->tx_adapt.bytes = q->tx_stats.bytes;
+}
+
+static void virtio_net_handle_tx_adaptive(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_vq_to_queue(n, vq);
+
+    q->tx_stats.kicks++;
+
+    if (unlikely(q->tx_waiting)) {
+        return;
+    }
+    /* This happens when device was stopped but VCPU wasn't. */
+    if (!n->vdev.vm_running) {
+        q->tx_waiting = 1;
+        return;
+    }
+
+    virtio_net_tx_adapt(q, qemu_get_clock(vm_clock));
+
+    switch (q->tx_mode) {
+    case VIRTIO_NET_TX_IMMEDIATE:
+        q->tx_stats.immediate++;
+        if (virtio_net_flush_tx(q) >= n->tx_burst) {
+            /* leave the rest to the bottom half */
+            virtio_queue_set_notification(vq, 0);
+            qemu_bh_schedule(q->tx_bh);
+            q->tx_waiting = 1;
+        }
+        break;
+    case VIRTIO_NET_TX_BH:
+        virtio_queue_set_notification(vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+        break;
+    case VIRTIO_NET_TX_TIMER:
+        virtio_queue_set_notification(vq, 0);
+        qemu_mod_timer(q->tx_timer, qemu_get_clock(vm_clock) + q->tx_interval);
+        q->tx_waiting = 1;
+        break;
+    }
 }
 
 static void virtio_net_tx_timer(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
+    q->tx_stats.timer++;
 
     /* Just in case the driver is not ready on more */
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 static void virtio_net_tx_bh(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     int32_t ret;
 
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
+    q->tx_stats.bh++;
 
     /* Just in case the driver is not ready on more */
     if (unlikely(!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)))
         return;
 
-    ret = virtio_net_flush_tx(n, n->tx_vq);
+    ret = virtio_net_flush_tx(q);
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
@@ -842,25 +1439,26 @@ static void virtio_net_tx_bh(void *opaque)
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
         return;
     }
 
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(n->tx_vq, 1);
-    if (virtio_net_flush_tx(n, n->tx_vq) > 0) {
-        virtio_queue_set_notification(n->tx_vq, 0);
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (virtio_net_flush_tx(q) > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
     }
 }
 
 static void virtio_net_save(QEMUFile *f, void *opaque)
 {
     VirtIONet *n = opaque;
+    int i;
 
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
@@ -868,7 +1466,7 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     virtio_save(&n->vdev, f);
 
     qemu_put_buffer(f, n->mac, ETH_ALEN);
-    qemu_put_be32(f, n->tx_waiting);
+    qemu_put_be32(f, n->vqs[0].tx_waiting);
     qemu_put_be32(f, n->mergeable_rx_bufs);
     qemu_put_be16(f, n->status);
     qemu_put_byte(f, n->promisc);
@@ -884,6 +1482,16 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     qemu_put_byte(f, n->nouni);
     qemu_put_byte(f, n->nobcast);
     qemu_put_byte(f, n->has_ufo);
+
+    /* Only devices with several queue pairs have these, so that single
+     * queue devices keep the same format */
+    if (n->max_queues > 1) {
+        qemu_put_be16(f, n->max_queues);
+        qemu_put_be16(f, n->curr_queues);
+        for (i = 1; i < n->curr_queues; i++) {
+            qemu_put_be32(f, n->vqs[i].tx_waiting);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -897,7 +1505,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     virtio_load(&n->vdev, f);
 
     qemu_get_buffer(f, n->mac, ETH_ALEN);
-    n->tx_waiting = qemu_get_be32(f);
+    n->vqs[0].tx_waiting = qemu_get_be32(f);
     n->mergeable_rx_bufs = qemu_get_be32(f);
 
     if (version_id >= 3)
@@ -936,13 +1544,10 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (n->has_vnet_hdr) {
-            tap_using_vnet_hdr(n->nic->nc.peer, 1);
-            tap_set_offload(n->nic->nc.peer,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+            for (i = 0; i < n->max_queues; i++) {
+                tap_using_vnet_hdr(virtio_net_queue_peer(n, i), 1);
+            }
+            virtio_net_set_offload(n, n->vdev.guest_features);
         }
     }
 
@@ -965,6 +1570,25 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (n->max_queues > 1) {
+        if (qemu_get_be16(f) != n->max_queues) {
+            error_report("virtio-net: saved image has a different number "
+                         "of queue pairs");
+            return -1;
+        }
+        n->curr_queues = qemu_get_be16(f);
+        if (n->curr_queues < 1 || n->curr_queues > n->max_queues ||
+            (!n->multiqueue && n->curr_queues > 1)) {
+            error_report("virtio-net: invalid number of queue pairs in use "
+                         "%d", n->curr_queues);
+            return -1;
+        }
+        for (i = 1; i < n->curr_queues; i++) {
+            n->vqs[i].tx_waiting = qemu_get_be32(f);
+        }
+        virtio_net_set_queues(n);
+    }
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -977,9 +1601,37 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
 
 static void virtio_net_cleanup(VLANClientState *nc)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+
+    q->nic = NULL;
+    if (q == &q->n->vqs[0]) {
+        q->n->nic = NULL;
+    }
+}
 
-    n->nic = NULL;
+static void virtio_net_print_info(VLANClientState *nc, Monitor *mon)
+{
+    static const char *modes[] = {
+        [VIRTIO_NET_TX_IMMEDIATE] = "immediate",
+        [VIRTIO_NET_TX_BH] = "bh",
+        [VIRTIO_NET_TX_TIMER] = "timer",
+    };
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
+
+    monitor_printf(mon, "    tx=%s", n->tx_adaptive ? "adaptive" :
+                   n->tx_timer_mode ? "timer" : "bh");
+    if (n->tx_adaptive) {
+        monitor_printf(mon, " (%s, %" PRIu64 " packets/s, %" PRIu64
+                       " bytes/kick, interval %" PRId64 " us)",
+                       modes[q->tx_mode], q->tx_adapt.rate,
+                       q->tx_adapt.bytes_per_kick, q->tx_interval / 1000);
+    }
+    monitor_printf(mon, ": kicks=%" PRIu64 " packets=%" PRIu64
+                   " bytes=%" PRIu64 " immediate=%" PRIu64 " bh=%" PRIu64
+                   " timer=%" PRIu64 "\n",
+                   q->tx_stats.kicks, q->tx_stats.packets, q->tx_stats.bytes,
+                   q->tx_stats.immediate, q->tx_stats.bh, q->tx_stats.timer);
 }
 
 static NetClientInfo net_virtio_info = {
@@ -989,16 +1641,46 @@ static NetClientInfo net_virtio_info = {
     .receive = virtio_net_receive,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
+    .print_info = virtio_net_print_info,
+    .receive_buffers = virtio_net_receive_buffers,
+    .receive_complete = virtio_net_receive_complete,
+    .receive_batch = virtio_net_receive_batch,
 };
 
+/* The backend of each queue pair: the netdev of the device is the first
+ * one, the other queues of a multiqueue tap the others */
+static int virtio_net_count_queues(NICConf *conf)
+{
+    int queues = 1;
+
+    if (!conf->peer) {
+        return 1;
+    }
+    while (queues < VIRTIO_NET_QUEUES_MAX) {
+        VLANClientState *peer = qemu_find_netdev_queue(conf->peer, queues);
+
+        if (!peer || peer->peer) {
+            break;
+        }
+        queues++;
+    }
+    return queues;
+}
+
 VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               virtio_net_conf *net)
 {
     VirtIONet *n;
+    int i, max_queues = virtio_net_count_queues(conf);
+    size_t config_size = sizeof(struct virtio_net_config);
+
+    /* max_virtqueue_pairs is only there with VIRTIO_NET_F_MQ */
+    if (max_queues == 1) {
+        config_size = offsetof(struct virtio_net_config, max_virtqueue_pairs);
+    }
 
     n = (VirtIONet *)virtio_common_init("virtio-net", VIRTIO_ID_NET,
-                                        sizeof(struct virtio_net_config),
-                                        sizeof(VirtIONet));
+                                        config_size, sizeof(VirtIONet));
 
     n->vdev.get_config = virtio_net_get_config;
     n->vdev.set_config = virtio_net_set_config;
@@ -1007,33 +1689,58 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->vdev.bad_features = virtio_net_bad_features;
     n->vdev.reset = virtio_net_reset;
     n->vdev.set_status = virtio_net_set_status;
-    n->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    n->config_size = config_size;
+    n->max_queues = max_queues;
+    n->curr_queues = 1;
+    n->vqs = qemu_mallocz(sizeof(VirtIONetQueue) * max_queues);
 
-    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
+    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh") &&
+        strcmp(net->tx, "adaptive")) {
         error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
-                     net->tx);
+                     "Unknown option tx=%s, valid options: \"timer\" \"bh\" "
+                     "\"adaptive\"", net->tx);
         error_report("Defaulting to \"bh\"");
     }
 
-    if (net->tx && !strcmp(net->tx, "timer")) {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
-        n->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, n);
-        n->tx_timeout = net->txtimer;
-    } else {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
-        n->tx_bh = qemu_bh_new(virtio_net_tx_bh, n);
+    n->tx_timer_mode = net->tx && !strcmp(net->tx, "timer");
+    n->tx_adaptive = net->tx && !strcmp(net->tx, "adaptive");
+    n->tx_timeout = net->txtimer;
+    for (i = 0; i < max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->n = n;
+        q->tx_interval = n->tx_timeout;
+        q->tx_mode = VIRTIO_NET_TX_IMMEDIATE;
+        if (n->tx_timer_mode || n->tx_adaptive) {
+            q->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, q);
+        }
+        if (!n->tx_timer_mode) {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
     }
+    virtio_net_add_queue(n, 0);
     n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
     qemu_macaddr_default_if_unset(&conf->macaddr);
     memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
     n->status = VIRTIO_NET_S_LINK_UP;
 
-    n->nic = qemu_new_nic(&net_virtio_info, conf, dev->info->name, dev->id, n);
-
+    n->vqs[0].nic = qemu_new_nic(&net_virtio_info, conf, dev->info->name,
+                                 dev->id, &n->vqs[0]);
+    n->nic = n->vqs[0].nic;
     qemu_format_nic_info_str(&n->nic->nc, conf->macaddr.a);
 
-    n->tx_waiting = 0;
+    for (i = 1; i < max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        char name[256];
+
+        snprintf(name, sizeof(name), "%s.%d", n->nic->nc.name, i);
+        q->conf = *conf;
+        q->conf.peer = qemu_find_netdev_queue(conf->peer, i);
+        q->nic = qemu_new_nic(&net_virtio_info, &q->conf, dev->info->name,
+                              name, q);
+        qemu_format_nic_info_str(&q->nic->nc, conf->macaddr.a);
+    }
+
     n->tx_burst = net->txburst;
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
@@ -1051,27 +1758,44 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     return &n->vdev;
 }
 
+/* Number of RX/TX queue pairs the device may use, for sizing MSI-X */
+int virtio_net_get_max_queues(VirtIODevice *vdev)
+{
+    return DO_UPCAST(VirtIONet, vdev, vdev)->max_queues;
+}
+
 void virtio_net_exit(VirtIODevice *vdev)
 {
     VirtIONet *n = DO_UPCAST(VirtIONet, vdev, vdev);
+    int i;
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
-    qemu_purge_queued_packets(&n->nic->nc);
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_purge_queued_packets(&n->vqs[i].nic->nc);
+    }
 
     unregister_savevm(n->qdev, "virtio-net", n);
 
     qemu_free(n->mac_table.macs);
     qemu_free(n->vlans);
 
-    if (n->tx_timer) {
-        qemu_del_timer(n->tx_timer);
-        qemu_free_timer(n->tx_timer);
-    } else {
-        qemu_bh_delete(n->tx_bh);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->tx_timer) {
+            qemu_del_timer(q->tx_timer);
+            qemu_free_timer(q->tx_timer);
+        }
+        if (q->tx_bh) {
+            qemu_bh_delete(q->tx_bh);
+        }
     }
 
     virtio_cleanup(&n->vdev);
-    qemu_del_vlan_client(&n->nic->nc);
+    for (i = n->max_queues - 1; i >= 0; i--) {
+        qemu_del_vlan_client(&n->vqs[i].nic->nc);
+    }
+    qemu_free(n->vqs);
 }
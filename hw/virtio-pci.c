@@ -18,6 +18,7 @@
 #include "virtio.h"
 #include "virtio-blk.h"
 #include "virtio-net.h"
+#include "virtio-balloon.h"
 #include "pci.h"
 #include "qemu-error.h"
 #include "msix.h"
@@ -112,6 +113,7 @@ typedef struct {
     /* Max. number of ports we can have for a the virtio-serial device */
     uint32_t max_virtserial_ports;
     virtio_net_conf net;
+    virtio_blk_conf blk;
     bool ioeventfd_disabled;
     bool ioeventfd_started;
 } VirtIOPCIProxy;
@@ -121,9 +123,15 @@ typedef struct {
 static void virtio_pci_notify(void *opaque, uint16_t vector)
 {
     VirtIOPCIProxy *proxy = opaque;
-    if (msix_enabled(&proxy->pci_dev))
-        msix_notify(&proxy->pci_dev, vector);
-    else
+    if (msix_enabled(&proxy->pci_dev)) {
+        /* Completions that the main loop handles in one go share a message
+           per vector; a vcpu that completes something sends it right away */
+        if (cpu_single_env) {
+            msix_notify(&proxy->pci_dev, vector);
+        } else {
+            msix_notify_deferred(&proxy->pci_dev, vector);
+        }
+    } else
         qemu_set_irq(proxy->pci_dev.irq[0], proxy->vdev->isr & 1);
 }
 
@@ -321,6 +329,13 @@ static void virtio_pci_reset(DeviceState *d)
     proxy->flags &= ~VIRTIO_PCI_FLAG_BUS_MASTER_BUG;
 }
 
+static void virtio_pci_show(DeviceState *d, QDict *state)
+{
+    VirtIOPCIProxy *proxy = container_of(d, VirtIOPCIProxy, pci_dev.qdev);
+
+    virtio_show_queues(proxy->vdev, state);
+}
+
 static void virtio_ioport_write(void *opaque, uint32_t addr, uint32_t val)
 {
     VirtIOPCIProxy *proxy = opaque;
@@ -678,6 +693,7 @@ static void virtio_init_pci(VirtIOPCIProxy *proxy, VirtIODevice *vdev,
     uint32_t size;
 
     proxy->vdev = vdev;
+    vdev->qdev = &proxy->pci_dev.qdev;
 
     config = proxy->pci_dev.config;
     pci_config_set_vendor_id(config, vendor);
@@ -731,7 +747,7 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
         proxy->class_code != PCI_CLASS_STORAGE_OTHER)
         proxy->class_code = PCI_CLASS_STORAGE_SCSI;
 
-    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block);
+    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block, &proxy->blk);
     if (!vdev) {
         return -1;
     }
@@ -800,6 +816,13 @@ static int virtio_net_init_pci(PCIDevice *pci_dev)
 
     vdev = virtio_net_init(&pci_dev->qdev, &proxy->nic, &proxy->net);
 
+    /* One vector per queue, plus config; a single queue pair and the
+     * control queue keep sharing the default of 3 */
+    if (proxy->nvectors == DEV_NVECTORS_UNSPECIFIED) {
+        int queues = virtio_net_get_max_queues(vdev);
+
+        proxy->nvectors = queues > 1 ? 2 * queues + 2 : 3;
+    }
     vdev->nvectors = proxy->nvectors;
     virtio_init_pci(proxy, vdev,
                     PCI_VENDOR_ID_REDHAT_QUMRANET,
@@ -867,10 +890,14 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                             VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
             DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
+            DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, blk.data_plane,
+                            0, false),
+            DEFINE_PROP_STRING("x-iothread", VirtIOPCIProxy, blk.iothread),
             DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
+        .qdev.show = virtio_pci_show,
     },{
         .qdev.name  = "virtio-net-pci",
         .qdev.size  = sizeof(VirtIOPCIProxy),
@@ -880,7 +907,8 @@ static PCIDeviceInfo virtio_info[] = {
         .qdev.props = (Property[]) {
             DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                             VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, false),
-            DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 3),
+            DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                               DEV_NVECTORS_UNSPECIFIED),
             DEFINE_VIRTIO_NET_FEATURES(VirtIOPCIProxy, host_features),
             DEFINE_NIC_PROPERTIES(VirtIOPCIProxy, nic),
             DEFINE_PROP_UINT32("x-txtimer", VirtIOPCIProxy,
@@ -891,6 +919,7 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
+        .qdev.show = virtio_pci_show,
     },{
         .qdev.name = "virtio-serial-pci",
         .qdev.alias = "virtio-serial",
@@ -907,6 +936,7 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
+        .qdev.show = virtio_pci_show,
     },{
         .qdev.name = "virtio-balloon-pci",
         .qdev.size = sizeof(VirtIOPCIProxy),
@@ -914,9 +944,12 @@ static PCIDeviceInfo virtio_info[] = {
         .exit      = virtio_exit_pci,
         .qdev.props = (Property[]) {
             DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+            DEFINE_PROP_BIT("free-page-reporting", VirtIOPCIProxy,
+                            host_features, VIRTIO_BALLOON_F_REPORTING, true),
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
+        .qdev.show = virtio_pci_show,
     },{
 #ifdef CONFIG_VIRTFS
         .qdev.name = "virtio-9p-pci",
@@ -929,6 +962,7 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_STRING("fsdev", VirtIOPCIProxy, fsconf.fsdev_id),
             DEFINE_PROP_END_OF_LIST(),
         },
+        .qdev.show = virtio_pci_show,
     }, {
 #endif
         /* end of list */
@@ -126,12 +126,152 @@ static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
     virtio_notify(vdev, vq);
 }
 
+#define VIRTIO_SERIAL_BATCH 64      /* elements per write to a have_data_iov app */
+
+/* Bytes left in the element that a short write stopped in, from iov[] on */
+static size_t port_elem_remainder(VirtIOSerialPort *port, struct iovec *iov,
+                                  int *cnt)
+{
+    size_t size = 0;
+    unsigned int i;
+
+    for (i = port->iov_idx; i < port->elem.out_num; i++) {
+        iov[*cnt] = port->elem.out_sg[i];
+        if (i == port->iov_idx) {
+            iov[*cnt].iov_base += port->iov_offset;
+            iov[*cnt].iov_len -= port->iov_offset;
+        }
+        size += iov[(*cnt)++].iov_len;
+    }
+    return size;
+}
+
+/* Leave off in port->elem, done bytes from where it was left off */
+static void port_elem_advance(VirtIOSerialPort *port, size_t done)
+{
+    while (done) {
+        size_t len = port->elem.out_sg[port->iov_idx].iov_len -
+                     port->iov_offset;
+
+        if (done < len) {
+            port->iov_offset += done;
+            return;
+        }
+        done -= len;
+        port->iov_idx++;
+        port->iov_offset = 0;
+    }
+}
+
+/* port->elem is what migrates, so that is where a partly written element
+   goes */
+static void port_elem_set(VirtIOSerialPort *port,
+                          const VirtQueueCompactElement *elem, size_t done)
+{
+    port->elem.index = elem->index;
+    port->elem.in_num = elem->in_num;
+    port->elem.out_num = elem->out_num;
+    memcpy(port->elem.in_sg, elem->in_sg, elem->in_num * sizeof(struct iovec));
+    memcpy(port->elem.out_sg, elem->out_sg,
+           elem->out_num * sizeof(struct iovec));
+    memcpy(port->elem.in_addr, elem->in_addr,
+           elem->in_num * sizeof(target_phys_addr_t));
+    memcpy(port->elem.out_addr, elem->out_addr,
+           elem->out_num * sizeof(target_phys_addr_t));
+    port->iov_idx = 0;
+    port->iov_offset = 0;
+    port_elem_advance(port, done);
+}
+
+/*
+ * Hand the guest's buffers to the app as many at a time as one vectored
+ * write takes.  Only the element a short write stops in stays popped, in
+ * port->elem as for have_data; those behind it go back to the guest.
+ */
+static void do_flush_queued_data_iov(VirtIOSerialPort *port, VirtQueue *vq)
+{
+    VirtQueueCompactElement *elems[VIRTIO_SERIAL_BATCH];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+
+    while (!port->throttled) {
+        size_t size, left = 0, done;
+        int i, n, cnt = 0, filled = 0;
+        ssize_t ret;
+
+        if (port->elem.out_num) {
+            left = port_elem_remainder(port, iov, &cnt);
+        }
+        size = left;
+        n = virtqueue_pop_batch(vq, elems, VIRTIO_SERIAL_BATCH);
+        for (i = 0; i < n && cnt + elems[i]->out_num <= ARRAY_SIZE(iov); i++) {
+            memcpy(iov + cnt, elems[i]->out_sg,
+                   elems[i]->out_num * sizeof(iov[0]));
+            cnt += elems[i]->out_num;
+            size += iov_size(elems[i]->out_sg, elems[i]->out_num);
+        }
+        while (n > i) {
+            virtqueue_discard_compact(vq, elems[--n]);
+        }
+        if (!n && !port->elem.out_num) {
+            break;
+        }
+
+        ret = port->info->have_data_iov(port, iov, cnt);
+        if (ret == -EAGAIN) {
+            done = 0;
+        } else if (ret < 0) {
+            done = size;
+        } else {
+            done = ret;
+        }
+
+        if (port->elem.out_num) {
+            if (done < left) {
+                port_elem_advance(port, done);
+                done = 0;
+            } else {
+                done -= left;
+                virtqueue_push(vq, &port->elem, 0);
+                port->elem.out_num = 0;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            size_t len = iov_size(elems[i]->out_sg, elems[i]->out_num);
+
+            if (done < len) {
+                break;
+            }
+            done -= len;
+            virtqueue_fill_compact(vq, elems[i], 0, filled++);
+            virtqueue_free_compact(elems[i]);
+        }
+        if (i < n && done && !port->elem.out_num) {
+            port_elem_set(port, elems[i], done);
+            virtqueue_free_compact(elems[i++]);
+        }
+        while (n > i) {
+            virtqueue_discard_compact(vq, elems[--n]);
+        }
+        virtqueue_flush(vq, filled);
+
+        if (ret == -EAGAIN || (ret >= 0 && ret < size)) {
+            virtio_serial_throttle_port(port, true);
+        }
+    }
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
     assert(port);
     assert(virtio_queue_ready(vq));
 
+    if (port->info->have_data_iov) {
+        do_flush_queued_data_iov(port, vq);
+        virtio_notify(vdev, vq);
+        return;
+    }
+
     while (!port->throttled) {
         unsigned int i;
 
@@ -276,6 +416,10 @@ size_t virtio_serial_guest_ready(VirtIOSerialPort *port)
         return 0;
     }
 
+    /* Let a backend with a lot to send fill many buffers in one go */
+    if (virtqueue_avail_bytes(vq, 65536, 0)) {
+        return 65536;
+    }
     if (virtqueue_avail_bytes(vq, 4096, 0)) {
         return 4096;
     }
@@ -448,7 +592,8 @@ static void handle_output(VirtIODevice *vdev, VirtQueue *vq)
     port = find_port_by_vq(vser, vq);
 
     discard = false;
-    if (!port || !port->host_connected || !port->info->have_data) {
+    if (!port || !port->host_connected ||
+        (!port->info->have_data && !port->info->have_data_iov)) {
         discard = true;
     }
 
@@ -159,6 +159,15 @@ struct VirtIOSerialPortInfo {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          size_t len);
+
+    /*
+     * The same for apps that can take many of the guest's buffers in
+     * one go; it takes precedence over have_data.  -EAGAIN stands for
+     * nothing taken, and other errors drop the data.  A throttled app
+     * unthrottles the port once it can take more.
+     */
+    ssize_t (*have_data_iov)(VirtIOSerialPort *port, const struct iovec *iov,
+                             int iovcnt);
 };
 
 /* Interface to the virtio-serial bus */
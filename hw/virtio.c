@@ -17,70 +17,161 @@
 #include "qemu-error.h"
 #include "virtio.h"
 #include "sysemu.h"
+#include "qemu-barrier.h"
+#include "range.h"
+#include "qemu-objects.h"
+#ifdef CONFIG_VIRTIO_LATENCY
+#include "virtio-latency.h"
+#endif
 
 /* The alignment to use between consumer and producer parts of vring.
  * x86 pagesize again. */
 #define VIRTIO_PCI_VRING_ALIGN         4096
 
-/* QEMU doesn't strictly need write barriers since everything runs in
- * lock-step.  We'll leave the calls to wmb() in though to make it obvious for
- * KVM or if kqemu gets SMP support.
- * In any case, we must prevent the compiler from reordering the code.
- * TODO: we likely need some rmb()/mb() as well.
- */
-
-#define wmb() __asm__ __volatile__("": : :"memory")
-
-typedef struct VRingDesc
-{
-    uint64_t addr;
-    uint32_t len;
-    uint16_t flags;
-    uint16_t next;
-} VRingDesc;
-
-typedef struct VRingAvail
-{
-    uint16_t flags;
-    uint16_t idx;
-    uint16_t ring[0];
-} VRingAvail;
-
-typedef struct VRingUsedElem
-{
-    uint32_t id;
-    uint32_t len;
-} VRingUsedElem;
-
-typedef struct VRingUsed
-{
-    uint16_t flags;
-    uint16_t idx;
-    VRingUsedElem ring[0];
-} VRingUsed;
-
 typedef struct VRing
 {
     unsigned int num;
     target_phys_addr_t desc;
     target_phys_addr_t avail;
     target_phys_addr_t used;
+    /* Host mapping of the whole ring, NULL if it is not plain RAM */
+    void *host;
+    target_phys_addr_t host_len;
+    ram_addr_t used_ram_addr;
+    VRingDesc *desc_host;
+    VRingAvail *avail_host;
+    VRingUsed *used_host;
 } VRing;
 
+/* Compact elements are kept in per-queue free lists, one for each power
+ * of two of descriptors up to VIRTQUEUE_MAX_SIZE */
+#define VIRTQUEUE_SLAB_CLASSES 11
+
 struct VirtQueue
 {
     VRing vring;
     target_phys_addr_t pa;
     uint16_t last_avail_idx;
+    /* Last used index value we have signalled on */
+    uint16_t signalled_used;
+    /* Whether signalled_used is valid */
+    bool signalled_used_valid;
+    /* Notification enabled? */
+    bool notification;
     int inuse;
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    VirtQueueCompactElement *free_elems[VIRTQUEUE_SLAB_CLASSES];
+    unsigned int nfree_elems[VIRTQUEUE_SLAB_CLASSES];
+#ifdef CONFIG_VIRTIO_LATENCY
+    VirtioLatency *latency;
+#endif
 };
 
+#ifdef CONFIG_VIRTIO_LATENCY
+/* Created on first use, once the transport has named the device */
+static VirtioLatency *virtqueue_latency(VirtQueue *vq)
+{
+    VirtIODevice *vdev = vq->vdev;
+    DeviceState *dev = vdev->qdev;
+    char *path = NULL;
+
+    if (!vq->latency) {
+        if (dev && dev->parent_bus && dev->parent_bus->info->get_dev_path) {
+            path = dev->parent_bus->info->get_dev_path(dev);
+        }
+        vq->latency = virtio_latency_new(dev && dev->id ? dev->id : vdev->name,
+                                         path, vq - vdev->vq, vq->vring.num);
+        qemu_free(path);
+    }
+    return vq->latency;
+}
+
+static void virtqueue_latency_delete(VirtQueue *vq)
+{
+    if (vq->latency) {
+        virtio_latency_delete(vq->latency);
+        vq->latency = NULL;
+    }
+}
+
+void virtqueue_latency_submit(VirtQueue *vq, unsigned int head)
+{
+    virtio_latency_submit(virtqueue_latency(vq), head);
+}
+
+void virtqueue_latency_complete(VirtQueue *vq, unsigned int head)
+{
+    virtio_latency_complete(virtqueue_latency(vq), head);
+}
+
+#define VIRTQUEUE_LATENCY(vq, stage, ...) \
+    virtio_latency_##stage(virtqueue_latency(vq), ## __VA_ARGS__)
+#else
+static inline void virtqueue_latency_delete(VirtQueue *vq)
+{
+}
+
+#define VIRTQUEUE_LATENCY(vq, stage, ...) do { } while (0)
+#endif
+
+/* Chains are collected here before they are copied into a compact
+ * element.  Device emulation runs under the global mutex. */
+static VirtQueueElement virtqueue_scratch;
+
 /* virt queue functions */
+static void vring_unmap(VRing *vring)
+{
+    if (vring->host) {
+        cpu_physical_memory_unmap(vring->host, vring->host_len, 0, 0);
+    }
+    vring->host = NULL;
+    vring->desc_host = NULL;
+    vring->avail_host = NULL;
+    vring->used_host = NULL;
+}
+
+/* Map the ring into host memory once, so that the accessors below don't
+ * have to look up every field in the physical memory map.  Rings that are
+ * not in contiguous RAM keep going through the ld*_phys/st*_phys path. */
+static void vring_map(VRing *vring)
+{
+    target_phys_addr_t len, l;
+    ram_addr_t first, last;
+    void *host;
+
+    vring_unmap(vring);
+    if (!vring->desc || !vring->num) {
+        return;
+    }
+
+    /* up to and including avail_event */
+    len = vring->used - vring->desc +
+        offsetof(VRingUsed, ring[vring->num]) + sizeof(uint16_t);
+    l = len;
+    host = cpu_physical_memory_map(vring->desc, &l, 1);
+    if (!host) {
+        return;
+    }
+    /* a bounce buffer or several RAM blocks won't do */
+    if (l != len || qemu_ram_addr_from_host(host, &first) ||
+        qemu_ram_addr_from_host(host + len - 1, &last) ||
+        last - first != len - 1) {
+        cpu_physical_memory_unmap(host, l, 0, 0);
+        return;
+    }
+
+    vring->host = host;
+    vring->host_len = len;
+    vring->used_ram_addr = first + (vring->used - vring->desc);
+    vring->desc_host = host;
+    vring->avail_host = host + (vring->avail - vring->desc);
+    vring->used_host = host + (vring->used - vring->desc);
+}
+
 static void virtqueue_init(VirtQueue *vq)
 {
     target_phys_addr_t pa = vq->pa;
@@ -90,32 +181,52 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    vring_map(&vq->vring);
+    vq->signalled_used_valid = false;
 }
 
-static inline uint64_t vring_desc_addr(target_phys_addr_t desc_pa, int i)
+/* The descriptor accessors get desc, the host mapping of the table at
+ * desc_pa, or NULL for indirect tables and rings that are not mapped. */
+static inline uint64_t vring_desc_addr(VRingDesc *desc,
+                                       target_phys_addr_t desc_pa, int i)
 {
     target_phys_addr_t pa;
+    if (desc) {
+        return ldq_p(&desc[i].addr);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
     return ldq_phys(pa);
 }
 
-static inline uint32_t vring_desc_len(target_phys_addr_t desc_pa, int i)
+static inline uint32_t vring_desc_len(VRingDesc *desc,
+                                      target_phys_addr_t desc_pa, int i)
 {
     target_phys_addr_t pa;
+    if (desc) {
+        return ldl_p(&desc[i].len);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
     return ldl_phys(pa);
 }
 
-static inline uint16_t vring_desc_flags(target_phys_addr_t desc_pa, int i)
+static inline uint16_t vring_desc_flags(VRingDesc *desc,
+                                        target_phys_addr_t desc_pa, int i)
 {
     target_phys_addr_t pa;
+    if (desc) {
+        return lduw_p(&desc[i].flags);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
     return lduw_phys(pa);
 }
 
-static inline uint16_t vring_desc_next(target_phys_addr_t desc_pa, int i)
+static inline uint16_t vring_desc_next(VRingDesc *desc,
+                                       target_phys_addr_t desc_pa, int i)
 {
     target_phys_addr_t pa;
+    if (desc) {
+        return lduw_p(&desc[i].next);
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
     return lduw_phys(pa);
 }
@@ -123,6 +234,9 @@ static inline uint16_t vring_desc_next(target_phys_addr_t desc_pa, int i)
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    if (vq->vring.avail_host) {
+        return lduw_p(&vq->vring.avail_host->flags);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
     return lduw_phys(pa);
 }
@@ -130,6 +244,9 @@ static inline uint16_t vring_avail_flags(VirtQueue *vq)
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    if (vq->vring.avail_host) {
+        return lduw_p(&vq->vring.avail_host->idx);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
     return lduw_phys(pa);
 }
@@ -137,13 +254,36 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+    if (vq->vring.avail_host) {
+        return lduw_p(&vq->vring.avail_host->ring[i]);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
     return lduw_phys(pa);
 }
 
+static inline uint16_t vring_used_event(VirtQueue *vq)
+{
+    return vring_avail_ring(vq, vq->vring.num);
+}
+
+/* Stores through the host mapping have to mark the page dirty themselves */
+static inline void vring_used_set_dirty(VirtQueue *vq, size_t offset)
+{
+    ram_addr_t addr = vq->vring.used_ram_addr + offset;
+
+    if (!cpu_physical_memory_is_dirty(addr)) {
+        cpu_physical_memory_set_dirty_flags(addr, 0xff & ~CODE_DIRTY_FLAG);
+    }
+}
+
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_host) {
+        stl_p(&vq->vring.used_host->ring[i].id, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[i].id));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
     stl_phys(pa, val);
 }
@@ -151,6 +291,11 @@ static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_host) {
+        stl_p(&vq->vring.used_host->ring[i].len, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[i].len));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
     stl_phys(pa, val);
 }
@@ -158,6 +303,9 @@ static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_host) {
+        return lduw_p(&vq->vring.used_host->idx);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     return lduw_phys(pa);
 }
@@ -165,6 +313,11 @@ static uint16_t vring_used_idx(VirtQueue *vq)
 static inline void vring_used_idx_increment(VirtQueue *vq, uint16_t val)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_host) {
+        stw_p(&vq->vring.used_host->idx, vring_used_idx(vq) + val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, idx));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     stw_phys(pa, vring_used_idx(vq) + val);
 }
@@ -172,6 +325,12 @@ static inline void vring_used_idx_increment(VirtQueue *vq, uint16_t val)
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_host) {
+        uint16_t *flags = &vq->vring.used_host->flags;
+        stw_p(flags, lduw_p(flags) | mask);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, flags));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
     stw_phys(pa, lduw_phys(pa) | mask);
 }
@@ -179,16 +338,46 @@ static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_host) {
+        uint16_t *flags = &vq->vring.used_host->flags;
+        stw_p(flags, lduw_p(flags) & ~mask);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, flags));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
     stw_phys(pa, lduw_phys(pa) & ~mask);
 }
 
+static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
+{
+    target_phys_addr_t pa;
+    size_t offset = offsetof(VRingUsed, ring[vq->vring.num]);
+
+    if (vq->vring.used_host) {
+        stw_p((uint8_t *)vq->vring.used_host + offset, val);
+        vring_used_set_dirty(vq, offset);
+        return;
+    }
+    pa = vq->vring.used + offset;
+    stw_phys(pa, val);
+}
+
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
-    if (enable)
+    vq->notification = enable;
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        /* the guest cannot be told not to kick at all, only when */
+        vring_avail_event(vq, vring_avail_idx(vq));
+    } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
-    else
+    } else {
         vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+    }
+    if (enable) {
+        /* Expose avail event/used flags before the caller checks the
+         * ring again */
+        smp_mb();
+    }
 }
 
 int virtio_queue_ready(VirtQueue *vq)
@@ -201,44 +390,68 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_fill_sg(VirtQueue *vq, unsigned int index,
+                              const struct iovec *in_sg, unsigned int in_num,
+                              const struct iovec *out_sg, unsigned int out_num,
+                              unsigned int len, unsigned int idx)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
-    for (i = 0; i < elem->in_num; i++) {
-        size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
+    for (i = 0; i < in_num; i++) {
+        size_t size = MIN(len - offset, in_sg[i].iov_len);
 
-        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
-                                  elem->in_sg[i].iov_len,
+        cpu_physical_memory_unmap(in_sg[i].iov_base, in_sg[i].iov_len,
                                   1, size);
 
-        offset += elem->in_sg[i].iov_len;
+        offset += in_sg[i].iov_len;
     }
 
-    for (i = 0; i < elem->out_num; i++)
-        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
-                                  elem->out_sg[i].iov_len,
-                                  0, elem->out_sg[i].iov_len);
+    for (i = 0; i < out_num; i++)
+        cpu_physical_memory_unmap(out_sg[i].iov_base, out_sg[i].iov_len,
+                                  0, out_sg[i].iov_len);
 
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
-    vring_used_ring_id(vq, idx, elem->index);
+    vring_used_ring_id(vq, idx, index);
     vring_used_ring_len(vq, idx, len);
+    VIRTQUEUE_LATENCY(vq, push, index);
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+    virtqueue_fill_sg(vq, elem->index, elem->in_sg, elem->in_num,
+                      elem->out_sg, elem->out_num, len, idx);
+}
+
+void virtqueue_fill_compact(VirtQueue *vq,
+                            const VirtQueueCompactElement *elem,
+                            unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+    virtqueue_fill_sg(vq, elem->index, elem->in_sg, elem->in_num,
+                      elem->out_sg, elem->out_num, len, idx);
 }
 
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
+    uint16_t old, new;
+
     /* Make sure buffer is written before we update index. */
-    wmb();
+    smp_wmb();
     trace_virtqueue_flush(vq, count);
+    old = vring_used_idx(vq);
+    new = old + count;
     vring_used_idx_increment(vq, count);
     vq->inuse -= count;
+    /* the used index wrapped past what we signalled on */
+    if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old))) {
+        vq->signalled_used_valid = false;
+    }
 }
 
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
@@ -248,6 +461,14 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+void virtqueue_push_compact(VirtQueue *vq,
+                            const VirtQueueCompactElement *elem,
+                            unsigned int len)
+{
+    virtqueue_fill_compact(vq, elem, len, 0);
+    virtqueue_flush(vq, 1);
+}
+
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
     uint16_t num_heads = vring_avail_idx(vq) - idx;
@@ -258,6 +479,10 @@ static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
                      idx, vring_avail_idx(vq));
         exit(1);
     }
+    /* Read the ring entries and the descriptors only after the index */
+    if (num_heads) {
+        smp_rmb();
+    }
 
     return num_heads;
 }
@@ -279,19 +504,20 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(target_phys_addr_t desc_pa,
+static unsigned virtqueue_next_desc(VRingDesc *desc,
+                                    target_phys_addr_t desc_pa,
                                     unsigned int i, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(vring_desc_flags(desc, desc_pa, i) & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = vring_desc_next(desc, desc_pa, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
-    wmb();
+    barrier();
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -312,15 +538,17 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
         target_phys_addr_t desc_pa;
+        VRingDesc *desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        desc = vq->vring.desc_host;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(desc, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(desc, desc_pa, i) % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -333,9 +561,10 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = vring_desc_len(desc, desc_pa, i) / sizeof(VRingDesc);
+            desc_pa = vring_desc_addr(desc, desc_pa, i);
+            desc = NULL;
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
         }
 
         do {
@@ -345,16 +574,16 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+            if (vring_desc_flags(desc, desc_pa, i) & VRING_DESC_F_WRITE) {
                 if (in_bytes > 0 &&
-                    (in_total += vring_desc_len(desc_pa, i)) >= in_bytes)
+                    (in_total += vring_desc_len(desc, desc_pa, i)) >= in_bytes)
                     return 1;
             } else {
                 if (out_bytes > 0 &&
-                    (out_total += vring_desc_len(desc_pa, i)) >= out_bytes)
+                    (out_total += vring_desc_len(desc, desc_pa, i)) >= out_bytes)
                     return 1;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(desc, desc_pa, i, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -381,13 +610,12 @@ void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+/* Collect the next chain the guest made available, without mapping it */
+static void virtqueue_read_elem(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
     target_phys_addr_t desc_pa = vq->vring.desc;
-
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    VRingDesc *desc = vq->vring.desc_host;
 
     /* When we start there are none of either input nor output. */
     elem->out_num = elem->in_num = 0;
@@ -396,15 +624,20 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(desc, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(desc, desc_pa, i) % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = vring_desc_len(desc, desc_pa, i) / sizeof(VRingDesc);
+        if (max > VIRTQUEUE_MAX_SIZE) {
+            error_report("Indirect buffer table too large");
+            exit(1);
+        }
+        desc_pa = vring_desc_addr(desc, desc_pa, i);
+        desc = NULL;
         i = 0;
     }
 
@@ -412,35 +645,246 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+        if (vring_desc_flags(desc, desc_pa, i) & VRING_DESC_F_WRITE) {
+            elem->in_addr[elem->in_num] = vring_desc_addr(desc, desc_pa, i);
             sg = &elem->in_sg[elem->in_num++];
         } else {
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = vring_desc_addr(desc, desc_pa, i);
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = vring_desc_len(desc, desc_pa, i);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(desc, desc_pa, i, max)) != max);
+
+    elem->index = head;
+    VIRTQUEUE_LATENCY(vq, pop, head);
+
+    /* ask for a kick once the guest adds past what we took */
+    if ((vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) &&
+        vq->notification) {
+        vring_avail_event(vq, vq->last_avail_idx);
+    }
+}
+
+int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+{
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        VIRTQUEUE_LATENCY(vq, idle);
+        return 0;
+    }
+
+    virtqueue_read_elem(vq, elem);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
     virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
 
-    elem->index = head;
-
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
     return elem->in_num + elem->out_num;
 }
 
+/* compact elements */
+static unsigned int virtqueue_slab_class(unsigned int num)
+{
+    unsigned int class = 0;
+
+    while ((1U << class) < num) {
+        class++;
+    }
+    return class;
+}
+
+/* Get an element with room for num descriptors, the scatter-gather and
+ * address arrays follow it in the same allocation */
+static VirtQueueCompactElement *virtqueue_alloc_compact(VirtQueue *vq,
+                                                        unsigned int num)
+{
+    unsigned int class = virtqueue_slab_class(num);
+    VirtQueueCompactElement *elem = vq->free_elems[class];
+
+    if (elem) {
+        vq->free_elems[class] = elem->next_free;
+        vq->nfree_elems[class]--;
+    } else {
+        unsigned int max = 1U << class;
+
+        elem = qemu_malloc(sizeof(*elem) +
+                           max * (sizeof(struct iovec) +
+                                  sizeof(target_phys_addr_t)));
+        elem->vq = vq;
+        elem->slab_class = class;
+        elem->sg = (struct iovec *)(elem + 1);
+        elem->addr = (target_phys_addr_t *)(elem->sg + max);
+    }
+    elem->next_free = NULL;
+    return elem;
+}
+
+void virtqueue_free_compact(VirtQueueCompactElement *elem)
+{
+    VirtQueue *vq = elem->vq;
+    unsigned int class = elem->slab_class;
+
+    /* never more in flight than the ring holds */
+    if (vq->nfree_elems[class] >= vq->vring.num) {
+        qemu_free(elem);
+        return;
+    }
+    elem->next_free = vq->free_elems[class];
+    vq->free_elems[class] = elem;
+    vq->nfree_elems[class]++;
+}
+
+/* Give the guest back an element that was popped but not used.  Elements
+ * can only go back newest first, and before anything else is popped. */
+void virtqueue_discard_compact(VirtQueue *vq, VirtQueueCompactElement *elem)
+{
+    unsigned int i;
+
+    /* we may have written to it, keep it dirty */
+    for (i = 0; i < elem->in_num; i++) {
+        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
+                                  elem->in_sg[i].iov_len,
+                                  1, elem->in_sg[i].iov_len);
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
+                                  elem->out_sg[i].iov_len,
+                                  0, elem->out_sg[i].iov_len);
+    }
+
+    vq->last_avail_idx--;
+    vq->inuse--;
+    virtqueue_free_compact(elem);
+}
+
+static void virtqueue_free_slab(VirtQueue *vq)
+{
+    int i;
+
+    for (i = 0; i < VIRTQUEUE_SLAB_CLASSES; i++) {
+        while (vq->free_elems[i]) {
+            VirtQueueCompactElement *elem = vq->free_elems[i];
+
+            vq->free_elems[i] = elem->next_free;
+            qemu_free(elem);
+        }
+        vq->nfree_elems[i] = 0;
+    }
+}
+
+/* Copy a full element into a compact one sized to its chain */
+static VirtQueueCompactElement *virtqueue_compact(VirtQueue *vq,
+                                                  const VirtQueueElement *full)
+{
+    VirtQueueCompactElement *elem;
+
+    elem = virtqueue_alloc_compact(vq, full->in_num + full->out_num);
+    elem->index = full->index;
+    elem->in_num = full->in_num;
+    elem->out_num = full->out_num;
+    elem->in_sg = elem->sg;
+    elem->out_sg = elem->sg + full->in_num;
+    elem->in_addr = elem->addr;
+    elem->out_addr = elem->addr + full->in_num;
+    memcpy(elem->in_sg, full->in_sg, sizeof(struct iovec) * full->in_num);
+    memcpy(elem->out_sg, full->out_sg, sizeof(struct iovec) * full->out_num);
+    memcpy(elem->in_addr, full->in_addr,
+           sizeof(target_phys_addr_t) * full->in_num);
+    memcpy(elem->out_addr, full->out_addr,
+           sizeof(target_phys_addr_t) * full->out_num);
+    return elem;
+}
+
+static VirtQueueCompactElement *virtqueue_pop_head(VirtQueue *vq)
+{
+    VirtQueueCompactElement *elem;
+
+    virtqueue_read_elem(vq, &virtqueue_scratch);
+    elem = virtqueue_compact(vq, &virtqueue_scratch);
+
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem;
+}
+
+/* Like virtqueue_pop, but the element comes from the queue's slab and is
+ * only as large as the chain; NULL if the queue is empty.  Give it back
+ * with virtqueue_free_compact once it has been pushed. */
+VirtQueueCompactElement *virtqueue_pop_compact(VirtQueue *vq)
+{
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        VIRTQUEUE_LATENCY(vq, idle);
+        return NULL;
+    }
+    return virtqueue_pop_head(vq);
+}
+
+/* Pop up to max elements, reading the avail index only once */
+int virtqueue_pop_batch(VirtQueue *vq, VirtQueueCompactElement **elems,
+                        int max)
+{
+    int i, n;
+
+    n = MIN(virtqueue_num_heads(vq, vq->last_avail_idx), max);
+    if (!n) {
+        VIRTQUEUE_LATENCY(vq, idle);
+    }
+    for (i = 0; i < n; i++) {
+        elems[i] = virtqueue_pop_head(vq);
+    }
+    return n;
+}
+
+/* Requests in flight migrate in the layout of VirtQueueElement */
+void virtqueue_save_compact(QEMUFile *f, const VirtQueueCompactElement *elem)
+{
+    VirtQueueElement *full = &virtqueue_scratch;
+
+    memset(full, 0, sizeof(*full));
+    full->index = elem->index;
+    full->in_num = elem->in_num;
+    full->out_num = elem->out_num;
+    memcpy(full->in_sg, elem->in_sg, sizeof(struct iovec) * elem->in_num);
+    memcpy(full->out_sg, elem->out_sg, sizeof(struct iovec) * elem->out_num);
+    memcpy(full->in_addr, elem->in_addr,
+           sizeof(target_phys_addr_t) * elem->in_num);
+    memcpy(full->out_addr, elem->out_addr,
+           sizeof(target_phys_addr_t) * elem->out_num);
+    qemu_put_buffer(f, (unsigned char *)full, sizeof(*full));
+}
+
+VirtQueueCompactElement *virtqueue_load_compact(VirtQueue *vq, QEMUFile *f)
+{
+    VirtQueueElement *full = &virtqueue_scratch;
+    VirtQueueCompactElement *elem;
+
+    qemu_get_buffer(f, (unsigned char *)full, sizeof(*full));
+    if (full->in_num > VIRTQUEUE_MAX_SIZE ||
+        full->out_num > VIRTQUEUE_MAX_SIZE ||
+        full->in_num + full->out_num > VIRTQUEUE_MAX_SIZE) {
+        error_report("virtio: invalid element in migration stream");
+        return NULL;
+    }
+
+    elem = virtqueue_compact(vq, full);
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    return elem;
+}
+
 /* virtio device */
 static void virtio_notify_vector(VirtIODevice *vdev, uint16_t vector)
 {
@@ -472,12 +916,20 @@ void virtio_reset(void *opaque)
     virtio_notify_vector(vdev, vdev->config_vector);
 
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vring_unmap(&vdev->vq[i].vring);
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].signalled_used_valid = false;
+        vdev->vq[i].notification = true;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
+#ifdef CONFIG_VIRTIO_LATENCY
+        if (vdev->vq[i].latency) {
+            virtio_latency_reset(vdev->vq[i].latency);
+        }
+#endif
     }
 }
 
@@ -531,6 +983,9 @@ void virtio_config_writeb(VirtIODevice *vdev, uint32_t addr, uint32_t data)
 
     if (vdev->set_config)
         vdev->set_config(vdev, vdev->config);
+    if (vdev->qdev) {
+        qdev_state_changed(vdev->qdev);
+    }
 }
 
 void virtio_config_writew(VirtIODevice *vdev, uint32_t addr, uint32_t data)
@@ -544,6 +999,9 @@ void virtio_config_writew(VirtIODevice *vdev, uint32_t addr, uint32_t data)
 
     if (vdev->set_config)
         vdev->set_config(vdev, vdev->config);
+    if (vdev->qdev) {
+        qdev_state_changed(vdev->qdev);
+    }
 }
 
 void virtio_config_writel(VirtIODevice *vdev, uint32_t addr, uint32_t data)
@@ -557,6 +1015,9 @@ void virtio_config_writel(VirtIODevice *vdev, uint32_t addr, uint32_t data)
 
     if (vdev->set_config)
         vdev->set_config(vdev, vdev->config);
+    if (vdev->qdev) {
+        qdev_state_changed(vdev->qdev);
+    }
 }
 
 void virtio_queue_set_addr(VirtIODevice *vdev, int n, target_phys_addr_t addr)
@@ -580,6 +1041,7 @@ void virtio_queue_notify_vq(VirtQueue *vq)
     if (vq->vring.desc) {
         VirtIODevice *vdev = vq->vdev;
         trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+        VIRTQUEUE_LATENCY(vq, kick);
         vq->handle_output(vdev, vq);
     }
 }
@@ -622,6 +1084,33 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+/* Remove queue n, which has to be the last one, so that the queues stay
+ * contiguous; devices use this when the set of queues depends on the
+ * features the guest acked. */
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq;
+
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    vq = &vdev->vq[n];
+    vring_unmap(&vq->vring);
+    virtqueue_free_slab(vq);
+    virtqueue_latency_delete(vq);
+    vq->vring.num = 0;
+    vq->vring.desc = 0;
+    vq->vring.avail = 0;
+    vq->vring.used = 0;
+    vq->last_avail_idx = 0;
+    vq->signalled_used_valid = false;
+    vq->notification = true;
+    vq->pa = 0;
+    vq->vector = VIRTIO_NO_VECTOR;
+    vq->handle_output = NULL;
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
@@ -629,15 +1118,48 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+/* Whether the used index moved from old to new past event; the same test
+ * as the guest's vring_need_event */
+static inline bool vring_need_event(uint16_t event, uint16_t new,
+                                    uint16_t old)
+{
+    return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
+    uint16_t old, new;
+    bool v;
+
     /* Always notify when queue is empty (when feature acknowledge) */
-    if ((vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT) &&
-        (!(vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) ||
-         (vq->inuse || vring_avail_idx(vq) != vq->last_avail_idx)))
+    if ((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        !vq->inuse && vring_avail_idx(vq) == vq->last_avail_idx) {
+        return true;
+    }
+
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vring_used_idx(vq);
+    return !v || vring_need_event(vring_used_event(vq), new, old);
+}
+
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    /* The used ring must be visible before we look at the avail flags
+     * or used event */
+    smp_mb();
+
+    if (!vring_notify(vdev, vq)) {
         return;
+    }
 
     trace_virtio_notify(vdev, vq);
+    VIRTQUEUE_LATENCY(vq, notify);
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
@@ -751,6 +1273,14 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    cpu_unregister_phys_memory_client(&vdev->memory_client);
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vring_unmap(&vdev->vq[i].vring);
+        virtqueue_free_slab(&vdev->vq[i]);
+        virtqueue_latency_delete(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     if (vdev->config)
         qemu_free(vdev->config);
@@ -776,6 +1306,42 @@ static void virtio_vmstate_change(void *opaque, int running, int reason)
     }
 }
 
+/* Remap the rings that the guest memory map change touches */
+static void virtio_client_set_memory(CPUPhysMemoryClient *client,
+                                     target_phys_addr_t start_addr,
+                                     ram_addr_t size,
+                                     ram_addr_t phys_offset)
+{
+    VirtIODevice *vdev = container_of(client, VirtIODevice, memory_client);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        VRing *vring = &vdev->vq[i].vring;
+
+        if (vring->num == 0) {
+            break;
+        }
+        if (vring->desc &&
+            ranges_overlap(start_addr, size, vring->desc,
+                           virtio_queue_get_ring_size(vdev, i))) {
+            vring_map(vring);
+        }
+    }
+}
+
+static int virtio_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                           target_phys_addr_t start_addr,
+                                           target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int virtio_client_migration_log(CPUPhysMemoryClient *client,
+                                       int enable)
+{
+    return 0;
+}
+
 VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
                                  size_t config_size, size_t struct_size)
 {
@@ -793,6 +1359,7 @@ VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
+        vdev->vq[i].notification = true;
     }
 
     vdev->name = name;
@@ -804,6 +1371,13 @@ VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
 
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change, vdev);
 
+    vdev->memory_client.set_memory = virtio_client_set_memory;
+    vdev->memory_client.sync_dirty_bitmap = virtio_client_sync_dirty_bitmap;
+    vdev->memory_client.migration_log = virtio_client_migration_log;
+    vdev->memory_client.log_start = NULL;
+    vdev->memory_client.log_stop = NULL;
+    cpu_register_phys_memory_client(&vdev->memory_client);
+
     return vdev;
 }
 
@@ -842,13 +1416,13 @@ target_phys_addr_t virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 target_phys_addr_t virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
     return offsetof(VRingAvail, ring) +
-        sizeof(uint64_t) * vdev->vq[n].vring.num;
+        sizeof(uint64_t) * vdev->vq[n].vring.num + sizeof(uint16_t);
 }
 
 target_phys_addr_t virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
     return offsetof(VRingUsed, ring) +
-        sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
+        sizeof(VRingUsedElem) * vdev->vq[n].vring.num + sizeof(uint16_t);
 }
 
 target_phys_addr_t virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
@@ -857,6 +1431,156 @@ target_phys_addr_t virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
 	    virtio_queue_get_used_size(vdev, n);
 }
 
+/* Ring state for device_show.  The whole ring is decoded from one view of
+ * guest memory: the host mapping kept by vring_map, or else a copy made
+ * with a single read, and an indirect table is read as a whole as well.
+ * The guest may be changing the ring meanwhile, so nothing read from it is
+ * trusted and nothing in the queue is changed. */
+#define VIRTIO_SHOW_MAX_CHAINS  64
+
+static QObject *virtio_show_desc(VRingDesc *desc)
+{
+    uint16_t flags = lduw_p(&desc->flags);
+
+    return qobject_from_jsonf("{ 'addr': %" PRId64 ", 'len': %" PRId64
+                              ", 'write': %i }", ldq_p(&desc->addr),
+                              (int64_t)ldl_p(&desc->len),
+                              !!(flags & VRING_DESC_F_WRITE));
+}
+
+/* The chain starting at head, or a description of what is wrong with it */
+static QObject *virtio_show_chain(VRingDesc *table, unsigned int num,
+                                  unsigned int head)
+{
+    VRingDesc *indirect = NULL;
+    QList *descs = qlist_new();
+    QDict *chain = qdict_new();
+    unsigned int i = head, n = 0;
+    const char *error = NULL;
+
+    qdict_put(chain, "head", qint_from_int(head));
+    if (head >= num) {
+        error = "head out of range";
+        goto out;
+    }
+
+    if (lduw_p(&table[head].flags) & VRING_DESC_F_INDIRECT) {
+        uint64_t addr = ldq_p(&table[head].addr);
+        uint32_t len = ldl_p(&table[head].len);
+
+        qdict_put(chain, "indirect", qint_from_int(addr));
+        if (len % sizeof(VRingDesc) || !len ||
+            len / sizeof(VRingDesc) > VIRTQUEUE_MAX_SIZE) {
+            error = "bad indirect table size";
+            goto out;
+        }
+        indirect = qemu_malloc(len);
+        cpu_physical_memory_read(addr, (uint8_t *)indirect, len);
+        table = indirect;
+        num = len / sizeof(VRingDesc);
+        i = 0;
+    }
+
+    for (;;) {
+        qlist_append_obj(descs, virtio_show_desc(&table[i]));
+        if (!(lduw_p(&table[i].flags) & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = lduw_p(&table[i].next);
+        if (i >= num) {
+            error = "next out of range";
+            break;
+        }
+        if (++n >= num) {
+            error = "looped descriptors";
+            break;
+        }
+    }
+    qemu_free(indirect);
+
+out:
+    qdict_put(chain, "descs", descs);
+    if (error) {
+        qdict_put(chain, "error", qstring_from_str(error));
+    }
+    return QOBJECT(chain);
+}
+
+static QObject *virtio_show_queue(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    unsigned int num = vq->vring.num;
+    target_phys_addr_t desc_pa = virtio_queue_get_desc_addr(vdev, n);
+    target_phys_addr_t len = virtio_queue_get_ring_size(vdev, n);
+    uint8_t *ring = vq->vring.host, *copy = NULL;
+    uint16_t avail_idx, used_idx, pending;
+    VRingAvail *avail;
+    VRingUsed *used;
+    QList *chains;
+    QDict *queue;
+    unsigned int i;
+
+    if (!ring) {
+        ring = copy = qemu_malloc(len);
+        cpu_physical_memory_read(desc_pa, ring, len);
+    }
+    avail = (VRingAvail *)(ring + (virtio_queue_get_avail_addr(vdev, n) -
+                                   desc_pa));
+    used = (VRingUsed *)(ring + (virtio_queue_get_used_addr(vdev, n) -
+                                 desc_pa));
+    avail_idx = lduw_p(&avail->idx);
+    used_idx = lduw_p(&used->idx);
+    pending = avail_idx - vq->last_avail_idx;
+
+    queue = qobject_to_qdict(qobject_from_jsonf(
+        "{ 'index': %d, 'num': %d, 'desc-addr': %" PRId64
+        ", 'avail-addr': %" PRId64 ", 'used-addr': %" PRId64
+        ", 'mapped': %i, 'avail-idx': %d, 'avail-flags': %d"
+        ", 'used-idx': %d, 'used-flags': %d, 'last-avail-idx': %d"
+        ", 'pending': %d, 'inuse': %d }",
+        n, num, (int64_t)desc_pa,
+        (int64_t)virtio_queue_get_avail_addr(vdev, n),
+        (int64_t)virtio_queue_get_used_addr(vdev, n), !copy,
+        avail_idx, lduw_p(&avail->flags), used_idx, lduw_p(&used->flags),
+        vq->last_avail_idx, pending, vq->inuse));
+
+    /* Chains the guest made available that were not popped yet; popped
+       ones are only counted in inuse */
+    if (pending > num) {
+        qdict_put(queue, "error", qstring_from_str("avail index too far "
+                                                   "ahead"));
+    } else {
+        chains = qlist_new();
+        for (i = 0; i < MIN(pending, VIRTIO_SHOW_MAX_CHAINS); i++) {
+            uint16_t head = lduw_p(&avail->ring[(vq->last_avail_idx + i) %
+                                                num]);
+
+            qlist_append_obj(chains, virtio_show_chain((VRingDesc *)ring,
+                                                       num, head));
+        }
+        qdict_put(queue, "chains", chains);
+        if (pending > VIRTIO_SHOW_MAX_CHAINS) {
+            qdict_put(queue, "more", qbool_from_int(1));
+        }
+    }
+
+    qemu_free(copy);
+    return QOBJECT(queue);
+}
+
+void virtio_show_queues(VirtIODevice *vdev, QDict *state)
+{
+    QList *queues = qlist_new();
+    int n;
+
+    for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
+        if (vdev->vq[n].vring.num && vdev->vq[n].vring.desc) {
+            qlist_append_obj(queues, virtio_show_queue(vdev, n));
+        }
+    }
+    qdict_put(state, "virtqueues", queues);
+}
+
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 {
     return vdev->vq[n].last_avail_idx;
@@ -867,11 +1591,22 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].last_avail_idx = idx;
 }
 
+/* Someone else moved the used index, signal on the next notify */
+void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
+{
+    vdev->vq[n].signalled_used_valid = false;
+}
+
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
 {
     return vdev->vq + n;
 }
 
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq - vq->vdev->vq;
+}
+
 EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq)
 {
     return &vq->guest_notifier;
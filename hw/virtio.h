@@ -46,6 +46,11 @@
 #define VIRTIO_F_NOTIFY_ON_EMPTY        24
 /* We support indirect buffer descriptors */
 #define VIRTIO_RING_F_INDIRECT_DESC     28
+/* The Guest publishes the used index for which it expects an interrupt
+ * at the end of the avail ring. Host should ignore the avail->flags field. */
+/* The Host publishes the avail index for which it expects a kick
+ * at the end of the used ring. Guest should ignore the used->flags field. */
+#define VIRTIO_RING_F_EVENT_IDX         29
 /* A guest should never accept this.  It implies negotiation is broken. */
 #define VIRTIO_F_BAD_FEATURE		30
 
@@ -63,6 +68,35 @@
 /* This means don't interrupt guest when buffer consumed. */
 #define VRING_AVAIL_F_NO_INTERRUPT      1
 
+/* The layout of the ring in guest memory */
+typedef struct VRingDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDesc;
+
+typedef struct VRingAvail
+{
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[0];
+} VRingAvail;
+
+typedef struct VRingUsedElem
+{
+    uint32_t id;
+    uint32_t len;
+} VRingUsedElem;
+
+typedef struct VRingUsed
+{
+    uint16_t flags;
+    uint16_t idx;
+    VRingUsedElem ring[0];
+} VRingUsed;
+
 struct VirtQueue;
 
 static inline target_phys_addr_t vring_align(target_phys_addr_t addr,
@@ -86,6 +120,25 @@ typedef struct VirtQueueElement
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElement;
 
+/* Same as VirtQueueElement, but with arrays sized to the chain */
+typedef struct VirtQueueCompactElement VirtQueueCompactElement;
+struct VirtQueueCompactElement
+{
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    target_phys_addr_t *in_addr;
+    target_phys_addr_t *out_addr;
+    struct iovec *in_sg;
+    struct iovec *out_sg;
+    /* private to virtio.c */
+    VirtQueue *vq;
+    unsigned int slab_class;
+    struct iovec *sg;
+    target_phys_addr_t *addr;
+    VirtQueueCompactElement *next_free;
+};
+
 typedef struct {
     void (*notify)(void * opaque, uint16_t vector);
     void (*save_config)(void * opaque, QEMUFile *f);
@@ -124,9 +177,12 @@ struct VirtIODevice
     VirtQueue *vq;
     const VirtIOBindings *binding;
     void *binding_opaque;
+    /* The transport's device, if it is one */
+    DeviceState *qdev;
     uint16_t device_id;
     bool vm_running;
     VMChangeStateEntry *vmstate;
+    CPUPhysMemoryClient memory_client;
 };
 
 static inline void virtio_set_status(VirtIODevice *vdev, uint8_t val)
@@ -140,6 +196,7 @@ static inline void virtio_set_status(VirtIODevice *vdev, uint8_t val)
 VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
                             void (*handle_output)(VirtIODevice *,
                                                   VirtQueue *));
+void virtio_del_queue(VirtIODevice *vdev, int n);
 
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len);
@@ -152,6 +209,36 @@ void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
 int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes);
 
+VirtQueueCompactElement *virtqueue_pop_compact(VirtQueue *vq);
+int virtqueue_pop_batch(VirtQueue *vq, VirtQueueCompactElement **elems,
+                        int max);
+void virtqueue_fill_compact(VirtQueue *vq,
+                            const VirtQueueCompactElement *elem,
+                            unsigned int len, unsigned int idx);
+void virtqueue_push_compact(VirtQueue *vq,
+                            const VirtQueueCompactElement *elem,
+                            unsigned int len);
+void virtqueue_free_compact(VirtQueueCompactElement *elem);
+void virtqueue_discard_compact(VirtQueue *vq, VirtQueueCompactElement *elem);
+void virtqueue_save_compact(QEMUFile *f, const VirtQueueCompactElement *elem);
+VirtQueueCompactElement *virtqueue_load_compact(VirtQueue *vq, QEMUFile *f);
+
+/* The request with this head was handed to the backend, and the backend
+ * is done with it; for --enable-virtio-latency */
+#ifdef CONFIG_VIRTIO_LATENCY
+void virtqueue_latency_submit(VirtQueue *vq, unsigned int head);
+void virtqueue_latency_complete(VirtQueue *vq, unsigned int head);
+#else
+static inline void virtqueue_latency_submit(VirtQueue *vq, unsigned int head)
+{
+}
+
+static inline void virtqueue_latency_complete(VirtQueue *vq,
+                                              unsigned int head)
+{
+}
+#endif
+
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq);
 
 void virtio_save(VirtIODevice *vdev, QEMUFile *f);
@@ -191,7 +278,9 @@ void virtio_bind_device(VirtIODevice *vdev, const VirtIOBindings *binding,
                         void *opaque);
 
 /* Base devices.  */
-VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf);
+struct virtio_blk_conf;
+VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
+                              struct virtio_blk_conf *blk);
 struct virtio_net_conf;
 VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               struct virtio_net_conf *net);
@@ -202,13 +291,16 @@ VirtIODevice *virtio_9p_init(DeviceState *dev, V9fsConf *conf);
 #endif
 
 
+int virtio_net_get_max_queues(VirtIODevice *vdev);
 void virtio_net_exit(VirtIODevice *vdev);
 void virtio_blk_exit(VirtIODevice *vdev);
 void virtio_serial_exit(VirtIODevice *vdev);
 
 #define DEFINE_VIRTIO_COMMON_FEATURES(_state, _field) \
 	DEFINE_PROP_BIT("indirect_desc", _state, _field, \
-			VIRTIO_RING_F_INDIRECT_DESC, true)
+			VIRTIO_RING_F_INDIRECT_DESC, true), \
+	DEFINE_PROP_BIT("event_idx", _state, _field, \
+			VIRTIO_RING_F_EVENT_IDX, true)
 
 target_phys_addr_t virtio_queue_get_desc_addr(VirtIODevice *vdev, int n);
 target_phys_addr_t virtio_queue_get_avail_addr(VirtIODevice *vdev, int n);
@@ -218,9 +310,13 @@ target_phys_addr_t virtio_queue_get_desc_size(VirtIODevice *vdev, int n);
 target_phys_addr_t virtio_queue_get_avail_size(VirtIODevice *vdev, int n);
 target_phys_addr_t virtio_queue_get_used_size(VirtIODevice *vdev, int n);
 target_phys_addr_t virtio_queue_get_ring_size(VirtIODevice *vdev, int n);
+/* Adds the state of the rings in guest memory as "virtqueues" */
+void virtio_show_queues(VirtIODevice *vdev, QDict *state);
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx);
+void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n);
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
+int virtio_get_queue_index(VirtQueue *vq);
 EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq);
 EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq);
 void virtio_queue_notify_vq(VirtQueue *vq);
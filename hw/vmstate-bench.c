@@ -0,0 +1,348 @@
+/*
+ * Cost of the device state walkers, device by device
+ *
+ * Runs each of the ways device state is walked many times over every
+ * device with a state description and reports the time, bytes and
+ * allocations of one call:
+ *
+ *   dump      the field objects of device_show (vmstate_plan_dump)
+ *   snapshot  the binary format of device_snapshot (vmstate_plan_snapshot)
+ *   save      the migration stream (vmstate_save_state)
+ *   load      loading it back (vmstate_load_state)
+ *
+ * The guest is stopped meanwhile, as for savevm, and every device ends up
+ * with the state it had.  Allocations count qemu_malloc() and friends as
+ * well as the QObjects that the visualiser takes from an arena.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qdev.h"
+#include "monitor.h"
+#include "sysemu.h"
+#include "qemu-arena.h"
+#include "qemu-error.h"
+#include "qemu-objects.h"
+#include "qemu-timer.h"
+#include "vmstate-plan.h"
+#include "bench.h"
+
+#define VMSTATE_BENCH_ITERATIONS        1000
+#define VMSTATE_BENCH_MAX_ITERATIONS    1000000
+
+enum {
+    VMSTATE_BENCH_DUMP,
+    VMSTATE_BENCH_SNAPSHOT,
+    VMSTATE_BENCH_SAVE,
+    VMSTATE_BENCH_LOAD,
+    VMSTATE_BENCH_PATHS,
+};
+
+static const char * const vmstate_bench_paths[VMSTATE_BENCH_PATHS] = {
+    [VMSTATE_BENCH_DUMP]     = "dump",
+    [VMSTATE_BENCH_SNAPSHOT] = "snapshot",
+    [VMSTATE_BENCH_SAVE]     = "save",
+    [VMSTATE_BENCH_LOAD]     = "load",
+};
+
+typedef struct VMStateBenchCounters {
+    int64_t ns;
+    uint64_t mallocs;
+    uint64_t arena_allocs;
+} VMStateBenchCounters;
+
+typedef struct VMStateBench {
+    int iterations;
+    QemuArena *arena;           /* for the QObjects of dump */
+    QList *results;
+} VMStateBench;
+
+/* The migration stream of one save, which the loads read over and over */
+typedef struct VMStateBenchStream {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+} VMStateBenchStream;
+
+/* Keeps what is written to a stream, or drops it without one */
+static int vmstate_bench_put(void *opaque, const uint8_t *buf, int64_t pos,
+                             int size)
+{
+    VMStateBenchStream *s = opaque;
+
+    if (s) {
+        if (s->len + size > s->capacity) {
+            s->capacity = MAX(s->capacity * 2, s->len + size);
+            s->data = qemu_realloc(s->data, s->capacity);
+        }
+        memcpy(s->data + s->len, buf, size);
+        s->len += size;
+    }
+    return size;
+}
+
+static int vmstate_bench_get(void *opaque, uint8_t *buf, int64_t pos,
+                             int size)
+{
+    VMStateBenchStream *s = opaque;
+    int done = 0;
+
+    while (done < size) {
+        size_t start = (pos + done) % s->len;
+        int n = MIN(size - done, s->len - start);
+
+        memcpy(buf + done, s->data + start, n);
+        done += n;
+    }
+    return size;
+}
+
+static int vmstate_bench_close(void *opaque)
+{
+    return 0;
+}
+
+static void vmstate_bench_start(VMStateBench *b, VMStateBenchCounters *c)
+{
+    c->mallocs = qemu_malloc_calls();
+    c->arena_allocs = qemu_arena_allocs(b->arena);
+    c->ns = get_clock();
+}
+
+static QObject *vmstate_bench_stop(VMStateBench *b, VMStateBenchCounters *c,
+                                   int fields, int64_t bytes)
+{
+    double calls = b->iterations;
+    double ns = get_clock() - c->ns;
+    double allocs = qemu_malloc_calls() - c->mallocs +
+                    qemu_arena_allocs(b->arena) - c->arena_allocs;
+
+    return qobject_from_jsonf("{ 'ns': %" PRId64 ", 'ns-per-field': %f, "
+                              "'bytes': %" PRId64 ", 'allocs': %f }",
+                              (int64_t)(ns / calls),
+                              ns / calls / MAX(fields, 1), bytes,
+                              allocs / calls);
+}
+
+static void *vmstate_bench_one(DeviceState *dev, void *opaque)
+{
+    const VMStateDescription *vmsd = dev->info->vmsd;
+    VMStateBench *b = opaque;
+    VMStateBenchStream stream = { };
+    VMStateBenchCounters c;
+    VMStatePlan *plan;
+    QemuArena *arena;
+    QObject *paths[VMSTATE_BENCH_PATHS];
+    QDict *result;
+    QEMUFile *f;
+    void *blob;
+    size_t len;
+    int64_t bytes;
+    int i, ret = 0;
+    char *name;
+
+    if (!vmsd) {
+        return NULL;
+    }
+    plan = vmstate_plan_get(vmsd);
+
+    /* The visualiser, with its QObjects in an arena as under the monitor */
+    arena = qemu_arena_set_current(b->arena);
+    bytes = 0;
+    vmstate_bench_start(b, &c);
+    for (i = 0; i < b->iterations; i++) {
+        QList *qlist = qlist_new();
+
+        bytes = vmstate_plan_dump(plan, dev, qlist, 0);
+        QDECREF(qlist);
+        qemu_arena_reset(b->arena);
+    }
+    paths[VMSTATE_BENCH_DUMP] = vmstate_bench_stop(b, &c, plan->n_entries,
+                                                   bytes);
+    qemu_arena_set_current(arena);
+
+    blob = vmstate_plan_snapshot(plan, dev, &len);
+    vmstate_bench_start(b, &c);
+    for (i = 0; i < b->iterations; i++) {
+        vmstate_plan_snapshot_to(plan, dev, blob, len);
+    }
+    paths[VMSTATE_BENCH_SNAPSHOT] = vmstate_bench_stop(b, &c, plan->n_entries,
+                                                       len);
+    qemu_free(blob);
+
+    /* Migration: one save is kept for the loads, the timed ones are not */
+    f = qemu_fopen_ops(&stream, vmstate_bench_put, NULL, vmstate_bench_close,
+                       NULL, NULL, NULL);
+    vmstate_save_state(f, vmsd, dev);
+    /* Like the end of stream marker after the last section, so that the
+       load does not take the next copy for a subsection */
+    qemu_put_byte(f, 0);
+    qemu_fclose(f);
+    bytes = stream.len - 1;
+
+    f = qemu_fopen_ops(NULL, vmstate_bench_put, NULL, vmstate_bench_close,
+                       NULL, NULL, NULL);
+    vmstate_bench_start(b, &c);
+    for (i = 0; i < b->iterations; i++) {
+        vmstate_save_state(f, vmsd, dev);
+    }
+    qemu_fflush(f);
+    paths[VMSTATE_BENCH_SAVE] = vmstate_bench_stop(b, &c, plan->n_entries,
+                                                   bytes);
+    qemu_fclose(f);
+
+    f = qemu_fopen_ops(&stream, NULL, vmstate_bench_get, vmstate_bench_close,
+                       NULL, NULL, NULL);
+    vmstate_bench_start(b, &c);
+    for (i = 0; i < b->iterations && ret == 0; i++) {
+        ret = vmstate_load_state(f, vmsd, dev, vmsd->version_id);
+        qemu_get_byte(f);
+    }
+    paths[VMSTATE_BENCH_LOAD] = vmstate_bench_stop(b, &c, plan->n_entries,
+                                                   bytes);
+    qemu_fclose(f);
+    qemu_free(stream.data);
+    if (ret < 0) {
+        qdict_put(qobject_to_qdict(paths[VMSTATE_BENCH_LOAD]), "error",
+                  qstring_from_str("load failed"));
+    }
+
+    name = qemu_malloc(strlen(dev->info->name) + 16);
+    sprintf(name, "%s.%d", dev->info->name, qdev_instance_no(dev));
+    result = qobject_to_qdict(qobject_from_jsonf(
+        "{ 'device': %s, 'vmsd': %s, 'fields': %d }", name, vmsd->name,
+        plan->n_entries));
+    qemu_free(name);
+    for (i = 0; i < VMSTATE_BENCH_PATHS; i++) {
+        qdict_put_obj(result, vmstate_bench_paths[i], paths[i]);
+    }
+    qlist_append(b->results, result);
+    return NULL;
+}
+
+static QList *vmstate_bench_run(int iterations)
+{
+    static QemuArena *bench_arena;
+    int saved_vm_running = vm_running;
+    VMStateBench b = {
+        .iterations = iterations,
+        .results = qlist_new(),
+    };
+
+    if (!bench_arena) {
+        bench_arena = qemu_arena_new("vmstate_bench");
+    }
+    b.arena = bench_arena;
+
+    vm_stop(VMSTOP_SAVEVM);
+    qdev_iterate_recursive(NULL, vmstate_bench_one, &b);
+    if (saved_vm_running) {
+        vm_start();
+    }
+    return b.results;
+}
+
+/* To the monitor, or to stdout without one */
+static void GCC_FMT_ATTR(2, 3) vmstate_bench_printf(Monitor *mon,
+                                                    const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (mon) {
+        monitor_vprintf(mon, fmt, ap);
+    } else {
+        vprintf(fmt, ap);
+    }
+    va_end(ap);
+}
+
+static void vmstate_bench_print_one(QObject *data, void *opaque)
+{
+    QDict *result = qobject_to_qdict(data);
+    Monitor *mon = opaque;
+    int i;
+
+    vmstate_bench_printf(mon, "%s (%s), %" PRId64 " fields:\n",
+                         qdict_get_str(result, "device"),
+                         qdict_get_str(result, "vmsd"),
+                         qdict_get_int(result, "fields"));
+    for (i = 0; i < VMSTATE_BENCH_PATHS; i++) {
+        QDict *path = qdict_get_qdict(result, vmstate_bench_paths[i]);
+
+        vmstate_bench_printf(mon, "  %-9s %8" PRId64 " ns %7.1f ns/field %7"
+                             PRId64 " bytes %7.1f allocs%s%s\n",
+                             vmstate_bench_paths[i],
+                             qdict_get_int(path, "ns"),
+                             qdict_get_double(path, "ns-per-field"),
+                             qdict_get_int(path, "bytes"),
+                             qdict_get_double(path, "allocs"),
+                             qdict_haskey(path, "error") ? ", " : "",
+                             qdict_haskey(path, "error") ?
+                             qdict_get_str(path, "error") : "");
+    }
+}
+
+void vmstate_bench_user_print(Monitor *mon, const QObject *data)
+{
+    qlist_iter(qobject_to_qlist(data), vmstate_bench_print_one, mon);
+}
+
+int do_vmstate_bench(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    int64_t iterations = qdict_get_try_int(qdict, "iterations",
+                                           VMSTATE_BENCH_ITERATIONS);
+
+    if (iterations <= 0 || iterations > VMSTATE_BENCH_MAX_ITERATIONS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "iterations",
+                      "a number between 1 and 1000000");
+        return -1;
+    }
+    *ret_data = QOBJECT(vmstate_bench_run(iterations));
+    return 0;
+}
+
+static void vmstate_bench_report_one(QObject *data, void *opaque)
+{
+    QDict *result = qobject_to_qdict(data);
+    const char *device = qdict_get_str(result, "device");
+    char test[128];
+    int i;
+
+    for (i = 0; i < VMSTATE_BENCH_PATHS; i++) {
+        QDict *path = qdict_get_qdict(result, vmstate_bench_paths[i]);
+
+        snprintf(test, sizeof(test), "%s %s", device, vmstate_bench_paths[i]);
+        bench_result(test, qdict_get_int(path, "ns"), "ns");
+        snprintf(test, sizeof(test), "%s %s allocs", device,
+                 vmstate_bench_paths[i]);
+        bench_result(test, qdict_get_double(path, "allocs"), "allocs");
+    }
+}
+
+/*
+ * Run the benchmark over the devices of a machine that never ran, for
+ * -vmstate-bench, print the results to stdout and hand them to
+ * bench_result(), so that QEMU_BENCH_JSON collects them as for the bench-*
+ * programs.
+ */
+int vmstate_bench(const char *arg)
+{
+    char *end;
+    long iterations = strtol(arg, &end, 0);
+    QList *results;
+
+    if (*end || iterations <= 0 || iterations > VMSTATE_BENCH_MAX_ITERATIONS) {
+        error_report("-vmstate-bench: iterations must be a number between 1 "
+                     "and 1000000");
+        return -1;
+    }
+
+    bench_init("vmstate");
+    results = vmstate_bench_run(iterations);
+    vmstate_bench_user_print(NULL, QOBJECT(results));
+    qlist_iter(results, vmstate_bench_report_one, NULL);
+    QDECREF(results);
+    return 0;
+}
@@ -0,0 +1,1224 @@
+/*
+ * Precompiled VMState field plans
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "vmstate-plan.h"
+#include "qdict.h"
+#include "qint.h"
+#include "qstring.h"
+#include "qbuffer.h"
+#include "qbool.h"
+#include "host-utils.h"
+#include "qemu-timer.h"
+#include "trace.h"
+
+/* Buffers are truncated to this many bytes unless a full dump is asked for */
+#define VMSTATE_PLAN_SHORT_BUFFER 16
+
+/* Queue elements included in a device dump, use vmstate_plan_dump_queue()
+   for the rest */
+#define VMSTATE_PLAN_QUEUE_ELEMS 16
+
+static QLIST_HEAD(, VMStatePlan) vmstate_plans =
+    QLIST_HEAD_INITIALIZER(vmstate_plans);
+
+static int vmstate_plan_count_fields(const VMStateDescription *vmsd)
+{
+    const VMStateField *field;
+    int n = 0;
+
+    for (field = vmsd->fields; field->name; field++) {
+        n++;
+        if (field->flags & (VMS_STRUCT | VMS_QUEUE)) {
+            n += vmstate_plan_count_fields(field->vmsd);
+        }
+    }
+    return n;
+}
+
+static VMStatePlanKind vmstate_plan_kind(const VMStateField *field)
+{
+    if (field->flags & VMS_STRUCT) {
+        return VMSTATE_PLAN_STRUCT;
+    }
+    if (field->flags & VMS_QUEUE) {
+        return VMSTATE_PLAN_QUEUE;
+    }
+    if (field->flags & (VMS_BUFFER | VMS_VBUFFER)) {
+        return VMSTATE_PLAN_BUFFER;
+    }
+    switch (field->size) {
+    case 1:
+    case 2:
+    case 4:
+    case 8:
+        break;
+    default:
+        /* Not an integer we know how to read, show the raw bytes */
+        return VMSTATE_PLAN_BUFFER;
+    }
+    if (field->flags & VMS_BITFIELD) {
+        return VMSTATE_PLAN_BITFIELD;
+    }
+    return VMSTATE_PLAN_SCALAR;
+}
+
+/* Fill entries for vmsd and all nested descriptions, returns the number of
+   entries written. */
+static int vmstate_plan_fill(const VMStateDescription *vmsd,
+                             VMStatePlanEntry *entries)
+{
+    const VMStateField *field;
+    VMStatePlanEntry *e = entries;
+
+    for (field = vmsd->fields; field->name; field++) {
+        e->field = field;
+        e->name = field->name;
+        e->start_index = field->start_index;
+        e->kind = vmstate_plan_kind(field);
+        e->offset = field->offset;
+        e->size = field->size;
+        e->size_offset = field->size_offset;
+        e->vbuffer = !!(field->flags & VMS_VBUFFER);
+        e->multiply = !!(field->flags & VMS_MULTIPLY);
+        e->pointer = !!(field->flags & VMS_POINTER);
+        e->start = field->start;
+        e->array_of_pointer = !!(field->flags & VMS_ARRAY_OF_POINTER);
+        e->num = field->num;
+        e->num_offset = field->num_offset;
+        e->version_id = vmsd->version_id;
+        e->field_exists = field->field_exists;
+        e->pre_save = NULL;
+        e->n_children = 0;
+
+        if (field->flags & VMS_ARRAY) {
+            e->count = VMSTATE_PLAN_COUNT_FIXED;
+        } else if (field->flags & VMS_VARRAY_INT32) {
+            e->count = VMSTATE_PLAN_COUNT_INT32;
+        } else if (field->flags & VMS_VARRAY_UINT16) {
+            e->count = VMSTATE_PLAN_COUNT_UINT16;
+        } else {
+            e->count = VMSTATE_PLAN_COUNT_SINGLE;
+        }
+
+        if (field->flags & VMS_BITFIELD) {
+            e->bits = field->bits;
+        }
+
+        if (e->kind == VMSTATE_PLAN_STRUCT || e->kind == VMSTATE_PLAN_QUEUE) {
+            e->pre_save = field->vmsd->pre_save;
+            e->n_children = vmstate_plan_fill(field->vmsd, e + 1);
+        }
+        e += 1 + e->n_children;
+    }
+    return e - entries;
+}
+
+static VMStatePlan *vmstate_plan_compile(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan;
+
+    plan = qemu_mallocz(sizeof(*plan));
+    plan->vmsd = vmsd;
+    plan->n_entries = vmstate_plan_count_fields(vmsd);
+    plan->entries = qemu_mallocz(sizeof(VMStatePlanEntry) *
+                                 (plan->n_entries + 1));
+    vmstate_plan_fill(vmsd, plan->entries);
+    return plan;
+}
+
+/* Return the cached plan for vmsd, compiling it on first use.  Plans are
+   never freed, descriptions are static for the lifetime of the process. */
+VMStatePlan *vmstate_plan_get(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan;
+
+    QLIST_FOREACH(plan, &vmstate_plans, next) {
+        if (plan->vmsd == vmsd) {
+            return plan;
+        }
+    }
+    plan = vmstate_plan_compile(vmsd);
+    QLIST_INSERT_HEAD(&vmstate_plans, plan, next);
+    return plan;
+}
+
+static size_t vmstate_plan_dump_entries(const VMStatePlanEntry *e, int n,
+                                        void *opaque, QList *qlist,
+                                        int full_buffers,
+                                        VMStateDumpBudget *budget);
+
+/* Whether the walk should stop before the next top-level element.  At
+   least one element is dumped, so that every call makes progress. */
+static bool vmstate_dump_budget_spent(VMStateDumpBudget *budget)
+{
+    if (!budget || budget->depth || !budget->elems) {
+        return false;
+    }
+    return (budget->max_elems && budget->elems >= budget->max_elems) ||
+           (budget->max_bytes && budget->bytes >= budget->max_bytes) ||
+           (budget->deadline && get_clock() >= budget->deadline);
+}
+
+/* Record where the next call resumes */
+static void vmstate_dump_budget_stop(VMStateDumpBudget *budget,
+                                     const VMStatePlanEntry *e, int elem)
+{
+    budget->field = e - budget->entries;
+    budget->elem = elem;
+    budget->stopped = true;
+}
+
+/* Append one field object per named bit range of the register value val,
+   like the fields of a nested struct */
+static void vmstate_plan_dump_bits(const VMStateBit *bit, uint64_t val,
+                                   QList *qlist)
+{
+    for (; bit->name; bit++) {
+        int shift = ctz64(bit->mask);
+        int width = 64 - clz64(bit->mask >> shift);
+        QDict *qbit = qdict_new();
+        QList *qelems = qlist_new();
+
+        qlist_append(qelems, qint_from_int((val & bit->mask) >> shift));
+        qdict_put(qbit, "name", qstring_from_str(bit->name));
+        qdict_put(qbit, "size", qint_from_int((width + 7) / 8));
+        qdict_put(qbit, "elems", qelems);
+        qlist_append(qlist, qbit);
+    }
+}
+
+/* Append up to max elements of the queue at addr, starting with element
+   number start, to qelems.  Only the elements up to the last one dumped are
+   visited.  Returns whether more elements follow. */
+static bool vmstate_plan_dump_queue_elems(const VMStatePlanEntry *e,
+                                          void *addr, int start, int max,
+                                          QList *qelems, int full_buffers,
+                                          VMStateDumpBudget *budget)
+{
+    void *elem;
+    int i;
+
+    elem = e->field->queue_first(addr);
+    for (i = 0; elem && i < start; i++) {
+        elem = e->field->queue_next(elem);
+    }
+    for (i = 0; elem && i < max; i++) {
+        QList *sub_elems;
+
+        if (vmstate_dump_budget_spent(budget)) {
+            vmstate_dump_budget_stop(budget, e, start + i);
+            break;
+        }
+        sub_elems = qlist_new();
+        qlist_append_obj(qelems, QOBJECT(sub_elems));
+        if (e->pre_save) {
+            e->pre_save(elem);
+        }
+        if (budget) {
+            budget->depth++;
+        }
+        vmstate_plan_dump_entries(e + 1, e->n_children, elem, sub_elems,
+                                  full_buffers, budget);
+        if (budget) {
+            budget->depth--;
+            budget->elems++;
+        }
+        elem = e->field->queue_next(elem);
+    }
+    return elem != NULL;
+}
+
+/* Append the value of one non-struct element at addr to qelems */
+static void vmstate_plan_dump_value(const VMStatePlanEntry *e,
+                                    const void *addr, size_t size,
+                                    QList *qelems, int full_buffers,
+                                    VMStateDumpBudget *budget)
+{
+    size_t dump_size = size;
+
+    switch (e->kind) {
+    case VMSTATE_PLAN_BUFFER:
+        if (!full_buffers && size > VMSTATE_PLAN_SHORT_BUFFER) {
+            dump_size = VMSTATE_PLAN_SHORT_BUFFER;
+        }
+        /* What does not fit in the budget is cut as for a short dump */
+        if (budget && budget->max_bytes) {
+            size_t left = budget->bytes < budget->max_bytes ?
+                          budget->max_bytes - budget->bytes : 0;
+
+            dump_size = MIN(dump_size, MAX(left, VMSTATE_PLAN_SHORT_BUFFER));
+        }
+        qlist_append(qelems, qbuffer_from_data(addr, dump_size));
+        break;
+    case VMSTATE_PLAN_BITFIELD:
+        vmstate_plan_dump_bits(e->bits, vmstate_plan_read_scalar(addr, size),
+                               qelems);
+        break;
+    case VMSTATE_PLAN_SCALAR:
+        qlist_append(qelems,
+                     qint_from_int(vmstate_plan_read_scalar(addr, size)));
+        break;
+    default:
+        break;
+    }
+    if (budget) {
+        budget->bytes += dump_size;
+    }
+}
+
+/* Add a field object named after e to qlist, returns its element list */
+static QList *vmstate_plan_dump_field(const VMStatePlanEntry *e, QList *qlist,
+                                      QDict **qfield)
+{
+    QList *qelems = qlist_new();
+
+    *qfield = qdict_new();
+    qlist_append_obj(qlist, QOBJECT(*qfield));
+    qdict_put_obj(*qfield, "name", QOBJECT(qstring_from_str(e->name)));
+    qdict_put_obj(*qfield, "elems", QOBJECT(qelems));
+    if (e->start_index) {
+        qdict_put_obj(*qfield, "start",
+                      QOBJECT(qstring_from_str(e->start_index)));
+    }
+    return qelems;
+}
+
+static size_t vmstate_plan_dump_entries(const VMStatePlanEntry *e, int n,
+                                        void *opaque, QList *qlist,
+                                        int full_buffers,
+                                        VMStateDumpBudget *budget)
+{
+    const VMStatePlanEntry *end = e + n;
+    size_t overall_size = 0;
+    /* element to resume at in the first field dumped at the top level */
+    int first = 0;
+
+    if (budget && !budget->depth) {
+        const VMStatePlanEntry *resume = budget->entries + budget->field;
+
+        while (e < resume) {
+            e += 1 + e->n_children;
+        }
+        first = budget->elem;
+    }
+
+    for (; e < end; e += 1 + e->n_children, first = 0) {
+        void *base_addr;
+        int i, n_elems;
+        size_t size, real_size = 0;
+        QDict *qfield;
+        QList *qelems;
+
+        if (!vmstate_plan_present(e, opaque)) {
+            continue;
+        }
+        if (vmstate_dump_budget_spent(budget)) {
+            vmstate_dump_budget_stop(budget, e, first);
+            break;
+        }
+
+        qelems = vmstate_plan_dump_field(e, qlist, &qfield);
+        if (first) {
+            qdict_put(qfield, "first", qint_from_int(first));
+        }
+        trace_vmstate_parse_field(e->name, e->offset);
+        if (e->kind == VMSTATE_PLAN_QUEUE) {
+            if (vmstate_plan_dump_queue_elems(e, opaque + e->offset, first,
+                                              VMSTATE_PLAN_QUEUE_ELEMS - first,
+                                              qelems, full_buffers, budget)) {
+                qdict_put(qfield, "more", qbool_from_int(1));
+            }
+            qdict_put(qfield, "size", qint_from_int(e->size));
+            if (budget && budget->stopped) {
+                break;
+            }
+            continue;
+        }
+        size = vmstate_plan_elem_size(e, opaque);
+        n_elems = vmstate_plan_n_elems(e, opaque);
+        base_addr = vmstate_plan_base(e, opaque);
+
+        for (i = first; i < n_elems; i++) {
+            void *addr = vmstate_plan_elem(e, base_addr, size, i);
+            QList *sub_elems = qelems;
+
+            if (i > first && vmstate_dump_budget_spent(budget)) {
+                vmstate_dump_budget_stop(budget, e, i);
+                break;
+            }
+            if (e->count != VMSTATE_PLAN_COUNT_SINGLE) {
+                sub_elems = qlist_new();
+                qlist_append_obj(qelems, QOBJECT(sub_elems));
+            }
+
+            real_size = size;
+            if (e->kind == VMSTATE_PLAN_STRUCT) {
+                if (e->pre_save) {
+                    e->pre_save(addr);
+                }
+                if (budget) {
+                    budget->depth++;
+                }
+                real_size = vmstate_plan_dump_entries(e + 1, e->n_children,
+                                                      addr, sub_elems,
+                                                      full_buffers, budget);
+                if (budget) {
+                    budget->depth--;
+                }
+            } else {
+                vmstate_plan_dump_value(e, addr, size, sub_elems,
+                                        full_buffers, budget);
+            }
+            if (budget) {
+                budget->elems++;
+            }
+            overall_size += real_size;
+        }
+        qdict_put_obj(qfield, "size", QOBJECT(qint_from_int(real_size)));
+        if (budget && budget->stopped) {
+            break;
+        }
+    }
+    return overall_size;
+}
+
+/* Append one QDict per present field of opaque to qlist, in the format
+   expected by device_user_print().  Returns the dumped state size. */
+size_t vmstate_plan_dump(const VMStatePlan *plan, void *opaque,
+                         QList *qlist, int full_buffers)
+{
+    size_t size;
+
+    trace_vmstate_parse(plan->vmsd->name, opaque);
+    if (plan->vmsd->pre_save) {
+        plan->vmsd->pre_save(opaque);
+    }
+    size = vmstate_plan_dump_entries(plan->entries, plan->n_entries, opaque,
+                                     qlist, full_buffers, NULL);
+    trace_vmstate_parse_done(plan->vmsd->name, size);
+    return size;
+}
+
+/* Like vmstate_plan_dump(), but starting at budget->field and elem and
+   stopping before the top-level element that would exceed the budget.
+   Returns 1 if it stopped, with the position to resume at in budget, 0 if
+   the dump is complete and -1 if the position is not that of a top-level
+   field. */
+int vmstate_plan_dump_budget(const VMStatePlan *plan, void *opaque,
+                             QList *qlist, int full_buffers,
+                             VMStateDumpBudget *budget)
+{
+    const VMStatePlanEntry *e = plan->entries;
+    size_t size;
+
+    if (budget->field < 0 || budget->field > plan->n_entries ||
+        budget->elem < 0) {
+        return -1;
+    }
+    while (e < plan->entries + budget->field) {
+        e += 1 + e->n_children;
+    }
+    if (e != plan->entries + budget->field) {
+        return -1;
+    }
+
+    budget->entries = plan->entries;
+    budget->depth = 0;
+    budget->bytes = 0;
+    budget->elems = 0;
+    budget->stopped = false;
+
+    trace_vmstate_parse(plan->vmsd->name, opaque);
+    if (plan->vmsd->pre_save) {
+        plan->vmsd->pre_save(opaque);
+    }
+    size = vmstate_plan_dump_entries(plan->entries, plan->n_entries, opaque,
+                                     qlist, full_buffers, budget);
+    trace_vmstate_parse_done(plan->vmsd->name, size);
+    return budget->stopped;
+}
+
+static const char *vmstate_plan_kind_name(VMStatePlanKind kind)
+{
+    static const char *const names[] = {
+        [VMSTATE_PLAN_SCALAR]   = "scalar",
+        [VMSTATE_PLAN_BITFIELD] = "bitfield",
+        [VMSTATE_PLAN_BUFFER]   = "buffer",
+        [VMSTATE_PLAN_STRUCT]   = "struct",
+        [VMSTATE_PLAN_QUEUE]    = "queue",
+    };
+    return names[kind];
+}
+
+static QObject *vmstate_plan_build_schema(const VMStatePlan *plan)
+{
+    QDict *qschema = qdict_new();
+    QList *qentries = qlist_new();
+    int i;
+
+    qdict_put(qschema, "name", qstring_from_str(plan->vmsd->name));
+    qdict_put(qschema, "version", qint_from_int(plan->vmsd->version_id));
+#ifdef HOST_WORDS_BIGENDIAN
+    qdict_put(qschema, "big-endian", qbool_from_int(1));
+#else
+    qdict_put(qschema, "big-endian", qbool_from_int(0));
+#endif
+
+    for (i = 0; i < plan->n_entries; i++) {
+        const VMStatePlanEntry *e = &plan->entries[i];
+        QDict *qentry = qdict_new();
+
+        qdict_put(qentry, "name", qstring_from_str(e->name));
+        qdict_put(qentry, "kind",
+                  qstring_from_str(vmstate_plan_kind_name(e->kind)));
+        qdict_put(qentry, "size", qint_from_int(e->vbuffer ? 0 : e->size));
+        qdict_put(qentry, "elems",
+                  qint_from_int(e->count == VMSTATE_PLAN_COUNT_FIXED ?
+                                e->num : 1));
+        qdict_put(qentry, "array",
+                  qbool_from_int(e->count != VMSTATE_PLAN_COUNT_SINGLE));
+        qdict_put(qentry, "optional", qbool_from_int(!!e->field_exists));
+        qdict_put(qentry, "variable-elems",
+                  qbool_from_int(e->count == VMSTATE_PLAN_COUNT_INT32 ||
+                                 e->count == VMSTATE_PLAN_COUNT_UINT16));
+        qdict_put(qentry, "variable-size", qbool_from_int(e->vbuffer));
+        qdict_put(qentry, "children", qint_from_int(e->n_children));
+        if (e->start_index) {
+            qdict_put(qentry, "start", qstring_from_str(e->start_index));
+        }
+        if (e->kind == VMSTATE_PLAN_BITFIELD) {
+            const VMStateBit *bit;
+            QList *qbits = qlist_new();
+
+            for (bit = e->bits; bit->name; bit++) {
+                QDict *qbit = qdict_new();
+
+                qdict_put(qbit, "name", qstring_from_str(bit->name));
+                qdict_put(qbit, "mask", qint_from_int(bit->mask));
+                qlist_append(qbits, qbit);
+            }
+            qdict_put(qentry, "bits", qbits);
+        }
+        qlist_append(qentries, qentry);
+    }
+    qdict_put(qschema, "entries", qentries);
+
+    if (plan->vmsd->subsections) {
+        const VMStateSubsection *sub;
+        QList *qsubs = qlist_new();
+
+        for (sub = plan->vmsd->subsections; sub->vmsd; sub++) {
+            qlist_append(qsubs, qstring_from_str(sub->vmsd->name));
+        }
+        qdict_put(qschema, "subsections", qsubs);
+    }
+    return QOBJECT(qschema);
+}
+
+/* Return a new reference to the schema describing snapshots of plan.  The
+   schema only depends on the description and is built once. */
+QObject *vmstate_plan_schema(VMStatePlan *plan)
+{
+    if (!plan->schema) {
+        plan->schema = vmstate_plan_build_schema(plan);
+    }
+    qobject_incref(plan->schema);
+    return plan->schema;
+}
+
+typedef struct VMStateBlob {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+    bool fixed;                 /* caller buffer, never grown */
+    bool hooks;                 /* run pre_save of nested descriptions */
+} VMStateBlob;
+
+static void vmstate_blob_put(VMStateBlob *blob, const void *buf, size_t len)
+{
+    if (blob->len + len > blob->capacity) {
+        if (blob->fixed) {
+            /* Only count, the caller checks the final length */
+            blob->len += len;
+            return;
+        }
+        blob->capacity = MAX(blob->capacity * 2, blob->len + len);
+        blob->data = qemu_realloc(blob->data, blob->capacity);
+    }
+    memcpy(blob->data + blob->len, buf, len);
+    blob->len += len;
+}
+
+static void vmstate_blob_put_u32(VMStateBlob *blob, uint32_t val)
+{
+    vmstate_blob_put(blob, &val, sizeof(val));
+}
+
+static void vmstate_plan_snapshot_entries(const VMStatePlanEntry *e, int n,
+                                          void *opaque, VMStateBlob *blob)
+{
+    const VMStatePlanEntry *end = e + n;
+
+    for (; e < end; e += 1 + e->n_children) {
+        void *base_addr;
+        int i, n_elems;
+        size_t size;
+
+        if (e->field_exists) {
+            uint8_t present = vmstate_plan_present(e, opaque);
+
+            vmstate_blob_put(blob, &present, 1);
+            if (!present) {
+                continue;
+            }
+        }
+
+        size = vmstate_plan_elem_size(e, opaque);
+        n_elems = vmstate_plan_n_elems(e, opaque);
+        base_addr = vmstate_plan_base(e, opaque);
+        if (e->count == VMSTATE_PLAN_COUNT_INT32 ||
+            e->count == VMSTATE_PLAN_COUNT_UINT16) {
+            vmstate_blob_put_u32(blob, n_elems);
+        }
+        if (e->vbuffer) {
+            vmstate_blob_put_u32(blob, size);
+        }
+
+        if (e->kind == VMSTATE_PLAN_QUEUE) {
+            continue;
+        }
+        if (e->kind != VMSTATE_PLAN_STRUCT && !e->array_of_pointer) {
+            /* Elements are contiguous, copy them in one go */
+            vmstate_blob_put(blob, base_addr, size * n_elems);
+            continue;
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *addr = vmstate_plan_elem(e, base_addr, size, i);
+
+            if (e->kind == VMSTATE_PLAN_STRUCT) {
+                if (e->pre_save && blob->hooks) {
+                    e->pre_save(addr);
+                }
+                vmstate_plan_snapshot_entries(e + 1, e->n_children, addr,
+                                              blob);
+            } else {
+                vmstate_blob_put(blob, addr, size);
+            }
+        }
+    }
+}
+
+/* Copy the state of opaque into one binary blob laid out as described by
+   vmstate_plan_schema().  The caller owns the returned buffer. */
+void *vmstate_plan_snapshot(VMStatePlan *plan, void *opaque, size_t *len)
+{
+    VMStateBlob blob;
+
+    blob.len = 0;
+    blob.capacity = MAX(plan->snapshot_hint, 64);
+    blob.data = qemu_malloc(blob.capacity);
+    blob.fixed = false;
+    blob.hooks = true;
+
+    if (plan->vmsd->pre_save) {
+        plan->vmsd->pre_save(opaque);
+    }
+    vmstate_plan_snapshot_entries(plan->entries, plan->n_entries, opaque,
+                                  &blob);
+    plan->snapshot_hint = blob.len;
+    *len = blob.len;
+    return blob.data;
+}
+
+/* Like vmstate_plan_snapshot(), but write into the size bytes at buf.
+   Returns the snapshot length; if it exceeds size, buf is incomplete. */
+size_t vmstate_plan_snapshot_to(VMStatePlan *plan, void *opaque,
+                                void *buf, size_t size)
+{
+    VMStateBlob blob;
+
+    blob.len = 0;
+    blob.capacity = size;
+    blob.data = buf;
+    blob.fixed = true;
+    blob.hooks = true;
+
+    if (plan->vmsd->pre_save) {
+        plan->vmsd->pre_save(opaque);
+    }
+    vmstate_plan_snapshot_entries(plan->entries, plan->n_entries, opaque,
+                                  &blob);
+    return blob.len;
+}
+
+/* Like vmstate_plan_snapshot(), but without running any pre_save hook.
+   Only field memory is copied, so this is cheap enough to run with the
+   global mutex held and has no side effects on the device. */
+void *vmstate_plan_capture(VMStatePlan *plan, void *opaque, size_t *len)
+{
+    VMStateBlob blob;
+
+    blob.len = 0;
+    blob.capacity = MAX(plan->snapshot_hint, 64);
+    blob.data = qemu_malloc(blob.capacity);
+    blob.fixed = false;
+    blob.hooks = false;
+
+    vmstate_plan_snapshot_entries(plan->entries, plan->n_entries, opaque,
+                                  &blob);
+    *len = blob.len;
+    return blob.data;
+}
+
+typedef struct VMStateReader {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+} VMStateReader;
+
+static const void *vmstate_reader_get(VMStateReader *r, size_t len)
+{
+    const void *p = r->data + r->pos;
+
+    if (len > r->len - r->pos) {
+        return NULL;
+    }
+    r->pos += len;
+    return p;
+}
+
+static int vmstate_reader_get_u32(VMStateReader *r, uint32_t *val)
+{
+    const void *p = vmstate_reader_get(r, sizeof(*val));
+
+    if (!p) {
+        return -1;
+    }
+    memcpy(val, p, sizeof(*val));
+    return 0;
+}
+
+static int vmstate_plan_decode_entries(const VMStatePlanEntry *e, int n,
+                                       VMStateReader *r, QList *qlist,
+                                       int full_buffers)
+{
+    const VMStatePlanEntry *end = e + n;
+
+    for (; e < end; e += 1 + e->n_children) {
+        uint32_t i, n_elems, size = e->size;
+        QDict *qfield;
+        QList *qelems;
+
+        if (e->field_exists) {
+            const uint8_t *present = vmstate_reader_get(r, 1);
+
+            if (!present) {
+                return -1;
+            }
+            if (!*present) {
+                continue;
+            }
+        }
+        n_elems = e->count == VMSTATE_PLAN_COUNT_FIXED ? e->num : 1;
+        if (e->count == VMSTATE_PLAN_COUNT_INT32 ||
+            e->count == VMSTATE_PLAN_COUNT_UINT16) {
+            if (vmstate_reader_get_u32(r, &n_elems) < 0) {
+                return -1;
+            }
+        }
+        if (e->vbuffer && vmstate_reader_get_u32(r, &size) < 0) {
+            return -1;
+        }
+
+        qelems = vmstate_plan_dump_field(e, qlist, &qfield);
+        qdict_put(qfield, "size", qint_from_int(size));
+        if (e->kind == VMSTATE_PLAN_QUEUE) {
+            /* Not part of snapshots, only device_queue can show these */
+            qdict_put(qfield, "more", qbool_from_int(1));
+            continue;
+        }
+
+        for (i = 0; i < n_elems; i++) {
+            QList *sub_elems = qelems;
+            const void *addr;
+
+            if (e->count != VMSTATE_PLAN_COUNT_SINGLE) {
+                sub_elems = qlist_new();
+                qlist_append(qelems, sub_elems);
+            }
+            if (e->kind == VMSTATE_PLAN_STRUCT) {
+                if (vmstate_plan_decode_entries(e + 1, e->n_children, r,
+                                                sub_elems, full_buffers) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            addr = vmstate_reader_get(r, size);
+            if (!addr) {
+                return -1;
+            }
+            vmstate_plan_dump_value(e, addr, size, sub_elems, full_buffers,
+                                    NULL);
+        }
+    }
+    return 0;
+}
+
+/* Build the device_user_print() format of vmstate_plan_dump() from a blob
+   taken with vmstate_plan_snapshot() or vmstate_plan_capture().  Only the
+   blob and the plan are accessed, not the device, so this can run without
+   the global mutex.  Queue fields are reported with no elements.  Returns
+   -1 if the blob is truncated. */
+int vmstate_plan_decode(const VMStatePlan *plan, const void *blob, size_t len,
+                        QList *qlist, int full_buffers)
+{
+    VMStateReader r = {
+        .data = blob,
+        .len = len,
+    };
+
+    return vmstate_plan_decode_entries(plan->entries, plan->n_entries, &r,
+                                       qlist, full_buffers);
+}
+
+typedef struct VMStateDiff {
+    const uint8_t *old;
+    size_t old_len;
+    bool resync;                /* layout changed, everything differs */
+    QList *changes;
+} VMStateDiff;
+
+/* Append buf to blob, returns whether it differs from the same range of
+   the previous snapshot. */
+static bool vmstate_diff_put(VMStateBlob *blob, VMStateDiff *diff,
+                             const void *buf, size_t len)
+{
+    bool changed = diff->resync || blob->len + len > diff->old_len ||
+                   memcmp(diff->old + blob->len, buf, len) != 0;
+
+    vmstate_blob_put(blob, buf, len);
+    return changed;
+}
+
+/* Layout headers must match exactly, otherwise offsets into the previous
+   snapshot are meaningless from here on. */
+static void vmstate_diff_put_header(VMStateBlob *blob, VMStateDiff *diff,
+                                    const void *buf, size_t len)
+{
+    if (vmstate_diff_put(blob, diff, buf, len)) {
+        diff->resync = true;
+    }
+}
+
+static void vmstate_diff_add_change(VMStateDiff *diff,
+                                    const VMStatePlanEntry *e,
+                                    const char *path, int index, void *addr,
+                                    size_t size)
+{
+    QDict *qchange = qdict_new();
+    uint64_t val;
+
+    qdict_put(qchange, "field", qstring_from_str(path));
+    if (index >= 0) {
+        qdict_put(qchange, "index", qint_from_int(index));
+    }
+    switch (e->kind) {
+    case VMSTATE_PLAN_SCALAR:
+    case VMSTATE_PLAN_BITFIELD:
+        val = vmstate_plan_read_scalar(addr, size);
+        qdict_put(qchange, "value", qint_from_int(val));
+        break;
+    default:
+        qdict_put(qchange, "value", qbuffer_from_data(addr, size));
+        break;
+    }
+    qlist_append(diff->changes, qchange);
+}
+
+static void vmstate_plan_diff_entries(const VMStatePlanEntry *e, int n,
+                                      void *opaque, VMStateBlob *blob,
+                                      VMStateDiff *diff, const char *prefix)
+{
+    const VMStatePlanEntry *end = e + n;
+    char path[256];
+
+    for (; e < end; e += 1 + e->n_children) {
+        void *base_addr;
+        int i, n_elems, is_array;
+        size_t size;
+
+        if (e->field_exists) {
+            uint8_t present = vmstate_plan_present(e, opaque);
+
+            vmstate_diff_put_header(blob, diff, &present, 1);
+            if (!present) {
+                continue;
+            }
+        }
+
+        size = vmstate_plan_elem_size(e, opaque);
+        n_elems = vmstate_plan_n_elems(e, opaque);
+        base_addr = vmstate_plan_base(e, opaque);
+        if (e->count == VMSTATE_PLAN_COUNT_INT32 ||
+            e->count == VMSTATE_PLAN_COUNT_UINT16) {
+            uint32_t val = n_elems;
+
+            vmstate_diff_put_header(blob, diff, &val, sizeof(val));
+        }
+        if (e->vbuffer) {
+            uint32_t val = size;
+
+            vmstate_diff_put_header(blob, diff, &val, sizeof(val));
+        }
+
+        if (e->kind == VMSTATE_PLAN_QUEUE) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s%s", prefix, e->name);
+        is_array = e->count != VMSTATE_PLAN_COUNT_SINGLE;
+
+        if (e->kind != VMSTATE_PLAN_STRUCT && !e->array_of_pointer) {
+            size_t start = blob->len;
+
+            /* Compare the whole run first, nothing changed most of the time */
+            if (!vmstate_diff_put(blob, diff, base_addr, size * n_elems)) {
+                continue;
+            }
+            for (i = 0; i < n_elems; i++) {
+                size_t pos = start + size * i;
+
+                if (diff->resync || pos + size > diff->old_len ||
+                    memcmp(diff->old + pos, base_addr + size * i, size)) {
+                    vmstate_diff_add_change(diff, e, path, is_array ? i : -1,
+                                            base_addr + size * i, size);
+                }
+            }
+            continue;
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *addr = vmstate_plan_elem(e, base_addr, size, i);
+
+            if (e->kind == VMSTATE_PLAN_STRUCT) {
+                char sub_prefix[sizeof(path) + 16];
+
+                if (is_array) {
+                    snprintf(sub_prefix, sizeof(sub_prefix), "%s[%d].",
+                             path, i);
+                } else {
+                    snprintf(sub_prefix, sizeof(sub_prefix), "%s.", path);
+                }
+                if (e->pre_save) {
+                    e->pre_save(addr);
+                }
+                vmstate_plan_diff_entries(e + 1, e->n_children, addr, blob,
+                                          diff, sub_prefix);
+            } else if (vmstate_diff_put(blob, diff, addr, size)) {
+                vmstate_diff_add_change(diff, e, path, is_array ? i : -1,
+                                        addr, size);
+            }
+        }
+    }
+}
+
+/* Like vmstate_plan_snapshot(), but also append one change record per
+   field element that differs from the previous snapshot old to changes.
+   Pass a NULL old snapshot to report every element. */
+void *vmstate_plan_diff(VMStatePlan *plan, void *opaque,
+                        const void *old, size_t old_len, size_t *len,
+                        QList *changes)
+{
+    VMStateBlob blob;
+    VMStateDiff diff;
+
+    blob.len = 0;
+    blob.capacity = MAX(plan->snapshot_hint, 64);
+    blob.data = qemu_malloc(blob.capacity);
+    blob.fixed = false;
+    blob.hooks = true;
+
+    diff.old = old;
+    diff.old_len = old ? old_len : 0;
+    diff.resync = !old;
+    diff.changes = changes;
+
+    if (plan->vmsd->pre_save) {
+        plan->vmsd->pre_save(opaque);
+    }
+    vmstate_plan_diff_entries(plan->entries, plan->n_entries, opaque, &blob,
+                              &diff, "");
+    plan->snapshot_hint = blob.len;
+    *len = blob.len;
+    return blob.data;
+}
+
+/* Find the entry named by the first component of path among the n entries
+   starting at e.  A component may select one array element with [index].
+   Field names may contain dots themselves (like "current_tm.tm_min"), so
+   the longest matching name wins. */
+static const VMStatePlanEntry *vmstate_plan_find_component(
+    const VMStatePlanEntry *e, int n, const char *path, const char **rest,
+    int *index)
+{
+    const VMStatePlanEntry *end = e + n;
+    const VMStatePlanEntry *found = NULL;
+    size_t len = 0;
+    char *p;
+
+    for (; e < end; e += 1 + e->n_children) {
+        size_t name_len = strlen(e->name);
+
+        if (name_len > len && !strncmp(e->name, path, name_len) &&
+            strchr(".[", path[name_len])) {
+            found = e;
+            len = name_len;
+        }
+    }
+    if (!found) {
+        return NULL;
+    }
+
+    *index = -1;
+    *rest = path + len;
+    if (**rest == '[') {
+        *index = strtol(*rest + 1, &p, 10);
+        if (p == *rest + 1 || *p != ']' || *index < 0) {
+            return NULL;
+        }
+        *rest = p + 1;
+    }
+    if (**rest == '.') {
+        (*rest)++;
+    } else if (**rest) {
+        return NULL;
+    }
+    return found;
+}
+
+/* Resolve a field path like "tx.data" or "rx[3].status" to its entry.  On
+   return, *opaque points to the state the entry is relative to and *index
+   is the selected element or -1.  Returns NULL if path does not name a
+   present field. */
+static const VMStatePlanEntry *vmstate_plan_resolve(const VMStatePlan *plan,
+                                                    void **opaque,
+                                                    const char *path,
+                                                    int *index)
+{
+    const VMStatePlanEntry *e = plan->entries;
+    int n = plan->n_entries;
+
+    if (plan->vmsd->pre_save) {
+        plan->vmsd->pre_save(*opaque);
+    }
+    for (;;) {
+        const char *rest;
+        void *base_addr;
+        int n_elems;
+
+        e = vmstate_plan_find_component(e, n, path, &rest, index);
+        if (!e || !vmstate_plan_present(e, *opaque)) {
+            return NULL;
+        }
+        if (e->kind != VMSTATE_PLAN_STRUCT || !*rest) {
+            return *rest ? NULL : e;
+        }
+
+        n_elems = vmstate_plan_n_elems(e, *opaque);
+        if (*index >= n_elems || (*index < 0 && n_elems != 1)) {
+            return NULL;
+        }
+        base_addr = vmstate_plan_base(e, *opaque);
+        *opaque = vmstate_plan_elem(e, base_addr,
+                                    vmstate_plan_elem_size(e, *opaque),
+                                    *index < 0 ? 0 : *index);
+        if (e->pre_save) {
+            e->pre_save(*opaque);
+        }
+        path = rest;
+        n = e->n_children;
+        e++;
+    }
+}
+
+/* Return the memory holding the field named by path and its size in *size.
+   Without an index, array fields resolve to all their elements if they are
+   contiguous.  Returns NULL if path does not name a present, non-struct,
+   non-queue field. */
+void *vmstate_plan_lookup(const VMStatePlan *plan, void *opaque,
+                          const char *path, size_t *size)
+{
+    const VMStatePlanEntry *e;
+    void *base_addr;
+    int index, n_elems;
+    size_t elem_size;
+
+    e = vmstate_plan_resolve(plan, &opaque, path, &index);
+    if (!e || e->kind == VMSTATE_PLAN_STRUCT ||
+        e->kind == VMSTATE_PLAN_QUEUE) {
+        return NULL;
+    }
+    elem_size = vmstate_plan_elem_size(e, opaque);
+    n_elems = vmstate_plan_n_elems(e, opaque);
+    base_addr = vmstate_plan_base(e, opaque);
+    if (index >= n_elems) {
+        return NULL;
+    }
+    if (index >= 0) {
+        *size = elem_size;
+        return vmstate_plan_elem(e, base_addr, elem_size, index);
+    }
+    if (e->array_of_pointer && n_elems != 1) {
+        return NULL;
+    }
+    *size = elem_size * n_elems;
+    return vmstate_plan_elem(e, base_addr, elem_size, 0);
+}
+
+/* Append up to max elements of the queue field named by path, starting
+   with element number start, to qelems in the format of
+   vmstate_plan_dump().  Returns 1 if more elements follow, 0 if not, and
+   -1 if path does not name a queue. */
+int vmstate_plan_dump_queue(const VMStatePlan *plan, void *opaque,
+                            const char *path, int start, int max,
+                            QList *qelems, int full_buffers)
+{
+    const VMStatePlanEntry *e;
+    int index;
+
+    e = vmstate_plan_resolve(plan, &opaque, path, &index);
+    if (!e || e->kind != VMSTATE_PLAN_QUEUE || index >= 0) {
+        return -1;
+    }
+    return vmstate_plan_dump_queue_elems(e, opaque + e->offset, start, max,
+                                         qelems, full_buffers, NULL);
+}
+
+/* With layout set, adds the fields of the fixed-size part of the state to
+   it; otherwise copies them from opaque, which is NULL if absent, into
+   record.  Either way pos advances the same, so that both agree on every
+   offset. */
+typedef struct VMStateLayoutWalk {
+    VMStateLayout *layout;
+    uint8_t *record;
+    size_t pos;
+} VMStateLayoutWalk;
+
+static void vmstate_layout_add(VMStateLayout *layout, const char *name,
+                               size_t offset, size_t size, int count,
+                               VMStateLayoutKind kind)
+{
+    VMStateLayoutField *f;
+
+    layout->fields = qemu_realloc(layout->fields, (layout->n_fields + 1) *
+                                  sizeof(*layout->fields));
+    f = &layout->fields[layout->n_fields++];
+    f->name = qemu_strdup(name);
+    f->offset = offset;
+    f->size = size;
+    f->count = count;
+    f->kind = kind;
+}
+
+static void vmstate_layout_entries(const VMStatePlanEntry *e, int n,
+                                   const char *prefix, void *opaque,
+                                   VMStateLayoutWalk *w)
+{
+    const VMStatePlanEntry *end = e + n;
+
+    for (; e < end; e += 1 + e->n_children) {
+        void *base_addr = NULL;
+        char name[256];
+        int i, n_elems, present = 1;
+
+        /* Variable parts have no fixed offset, they stay in snapshots */
+        if (e->kind == VMSTATE_PLAN_QUEUE || e->vbuffer ||
+            (e->count != VMSTATE_PLAN_COUNT_SINGLE &&
+             e->count != VMSTATE_PLAN_COUNT_FIXED)) {
+            continue;
+        }
+        n_elems = vmstate_plan_n_elems(e, NULL);
+        snprintf(name, sizeof(name), "%s%s", prefix, e->name);
+
+        if (e->field_exists) {
+            if (w->layout) {
+                vmstate_layout_add(w->layout, name, w->pos, 1, 1,
+                                   VMSTATE_LAYOUT_PRESENT);
+            } else if (opaque) {
+                present = vmstate_plan_present(e, opaque);
+                w->record[w->pos] = present;
+            }
+            w->pos++;
+        }
+        if (!w->layout && opaque && present) {
+            base_addr = vmstate_plan_base(e, opaque);
+        }
+
+        if (e->kind == VMSTATE_PLAN_STRUCT) {
+            for (i = 0; i < n_elems; i++) {
+                char sub[256];
+                void *addr = NULL;
+
+                if (e->count == VMSTATE_PLAN_COUNT_SINGLE) {
+                    snprintf(sub, sizeof(sub), "%s.", name);
+                } else {
+                    snprintf(sub, sizeof(sub), "%s[%d].", name, i);
+                }
+                if (base_addr) {
+                    addr = vmstate_plan_elem(e, base_addr, e->size, i);
+                    if (e->pre_save) {
+                        e->pre_save(addr);
+                    }
+                }
+                vmstate_layout_entries(e + 1, e->n_children, sub, addr, w);
+            }
+            continue;
+        }
+
+        if (w->layout) {
+            vmstate_layout_add(w->layout, name, w->pos, e->size, n_elems,
+                               e->kind == VMSTATE_PLAN_BUFFER ?
+                               VMSTATE_LAYOUT_BUFFER : VMSTATE_LAYOUT_SCALAR);
+        } else if (base_addr) {
+            for (i = 0; i < n_elems; i++) {
+                memcpy(w->record + w->pos + i * e->size,
+                       vmstate_plan_elem(e, base_addr, e->size, i), e->size);
+            }
+        }
+        w->pos += e->size * n_elems;
+    }
+}
+
+/* Return the layout of records filled by vmstate_plan_record().  Fields of
+   fixed size and count are at the same offset in every record of the
+   description's version; variable-sized arrays, buffers and queues are
+   left out. */
+const VMStateLayout *vmstate_plan_layout(VMStatePlan *plan)
+{
+    static int next_id;
+    VMStateLayoutWalk w = { NULL };
+
+    if (!plan->layout) {
+        w.layout = qemu_mallocz(sizeof(*w.layout));
+        w.layout->id = next_id++;
+        vmstate_layout_entries(plan->entries, plan->n_entries, "", NULL, &w);
+        w.layout->size = w.pos;
+        plan->layout = w.layout;
+    }
+    return plan->layout;
+}
+
+/* Copy the state of opaque into record, of the size of the layout */
+void vmstate_plan_record(VMStatePlan *plan, void *opaque, void *record)
+{
+    VMStateLayoutWalk w = { NULL };
+
+    w.record = record;
+    memset(record, 0, vmstate_plan_layout(plan)->size);
+    if (plan->vmsd->pre_save) {
+        plan->vmsd->pre_save(opaque);
+    }
+    vmstate_layout_entries(plan->entries, plan->n_entries, "", opaque, &w);
+}
@@ -0,0 +1,203 @@
+/*
+ * Precompiled VMState field plans
+ *
+ * A plan flattens a VMStateDescription, including all nested VMS_STRUCT
+ * descriptions, into one contiguous array of entries.  Everything that
+ * only depends on the description (offsets, element counts and sizes,
+ * value kinds) is resolved once when the plan is built, so walking device
+ * state for device_show no longer needs to interpret the field flags.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_VMSTATE_PLAN_H
+#define QEMU_VMSTATE_PLAN_H
+
+#include "hw.h"
+#include "qlist.h"
+
+typedef enum VMStatePlanKind {
+    VMSTATE_PLAN_SCALAR,        /* 1, 2, 4 or 8 byte integer */
+    VMSTATE_PLAN_BITFIELD,      /* integer decoded into named bits */
+    VMSTATE_PLAN_BUFFER,        /* opaque byte range */
+    VMSTATE_PLAN_STRUCT,        /* nested description, see n_children */
+    VMSTATE_PLAN_QUEUE,         /* linked list, see n_children */
+} VMStatePlanKind;
+
+typedef enum VMStatePlanCount {
+    VMSTATE_PLAN_COUNT_SINGLE,  /* not an array */
+    VMSTATE_PLAN_COUNT_FIXED,   /* VMS_ARRAY, num elements */
+    VMSTATE_PLAN_COUNT_INT32,   /* VMS_VARRAY_INT32 at num_offset */
+    VMSTATE_PLAN_COUNT_UINT16,  /* VMS_VARRAY_UINT16 at num_offset */
+} VMStatePlanCount;
+
+typedef struct VMStatePlanEntry {
+    const VMStateField *field;
+    const char *name;
+    const char *start_index;
+    VMStatePlanKind kind;
+    VMStatePlanCount count;
+    int num;
+    size_t num_offset;
+    size_t offset;
+    size_t size;
+    size_t size_offset;         /* VMS_VBUFFER: int32_t size location */
+    bool vbuffer;
+    bool multiply;
+    bool pointer;
+    size_t start;               /* VMS_POINTER: offset into pointed buffer */
+    bool array_of_pointer;
+    const VMStateBit *bits;     /* VMSTATE_PLAN_BITFIELD */
+    int version_id;             /* passed to field_exists */
+    bool (*field_exists)(void *opaque, int version_id);
+    void (*pre_save)(void *opaque);     /* nested description hook */
+    int n_children;             /* entries following this one that describe
+                                   one element of a VMSTATE_PLAN_STRUCT or
+                                   VMSTATE_PLAN_QUEUE */
+} VMStatePlanEntry;
+
+typedef enum VMStateLayoutKind {
+    VMSTATE_LAYOUT_SCALAR,      /* count integers of size bytes */
+    VMSTATE_LAYOUT_BUFFER,      /* count opaque ranges of size bytes */
+    VMSTATE_LAYOUT_PRESENT,     /* 1 if the optional field that follows
+                                   is present, 0 if it was left zeroed */
+} VMStateLayoutKind;
+
+typedef struct VMStateLayoutField {
+    char *name;                 /* path as for vmstate_plan_lookup() */
+    uint32_t offset;
+    uint32_t size;
+    uint32_t count;
+    VMStateLayoutKind kind;
+} VMStateLayoutField;
+
+/* Fixed-size record of the state of a description at one version, see
+   vmstate_plan_layout() */
+typedef struct VMStateLayout {
+    int id;                     /* unique among all layouts */
+    size_t size;
+    int n_fields;
+    VMStateLayoutField *fields;
+} VMStateLayout;
+
+typedef struct VMStatePlan {
+    const VMStateDescription *vmsd;
+    int n_entries;
+    VMStatePlanEntry *entries;
+    QObject *schema;            /* cached, see vmstate_plan_schema() */
+    VMStateLayout *layout;      /* cached, see vmstate_plan_layout() */
+    size_t snapshot_hint;       /* size of the last binary snapshot */
+    QLIST_ENTRY(VMStatePlan) next;
+} VMStatePlan;
+
+/* Limits of one vmstate_plan_dump_budget() call, 0 for none, and the
+   top-level field and element it resumes at */
+typedef struct VMStateDumpBudget {
+    size_t max_bytes;           /* of dumped values */
+    int64_t max_elems;
+    int64_t deadline;           /* get_clock() */
+    int field;                  /* index into the plan's entries */
+    int elem;
+    /* private */
+    const VMStatePlanEntry *entries;
+    int depth;
+    size_t bytes;
+    int64_t elems;
+    bool stopped;
+} VMStateDumpBudget;
+
+VMStatePlan *vmstate_plan_get(const VMStateDescription *vmsd);
+
+size_t vmstate_plan_dump(const VMStatePlan *plan, void *opaque,
+                         QList *qlist, int full_buffers);
+int vmstate_plan_dump_budget(const VMStatePlan *plan, void *opaque,
+                             QList *qlist, int full_buffers,
+                             VMStateDumpBudget *budget);
+QObject *vmstate_plan_schema(VMStatePlan *plan);
+void *vmstate_plan_snapshot(VMStatePlan *plan, void *opaque, size_t *len);
+size_t vmstate_plan_snapshot_to(VMStatePlan *plan, void *opaque,
+                                void *buf, size_t size);
+void *vmstate_plan_capture(VMStatePlan *plan, void *opaque, size_t *len);
+int vmstate_plan_decode(const VMStatePlan *plan, const void *blob, size_t len,
+                        QList *qlist, int full_buffers);
+void *vmstate_plan_lookup(const VMStatePlan *plan, void *opaque,
+                          const char *path, size_t *size);
+int vmstate_plan_dump_queue(const VMStatePlan *plan, void *opaque,
+                            const char *path, int start, int max,
+                            QList *qelems, int full_buffers);
+void *vmstate_plan_diff(VMStatePlan *plan, void *opaque,
+                        const void *old, size_t old_len, size_t *len,
+                        QList *changes);
+const VMStateLayout *vmstate_plan_layout(VMStatePlan *plan);
+void vmstate_plan_record(VMStatePlan *plan, void *opaque, void *record);
+
+static inline int vmstate_plan_present(const VMStatePlanEntry *e,
+                                       void *opaque)
+{
+    return !e->field_exists || e->field_exists(opaque, e->version_id);
+}
+
+static inline int vmstate_plan_n_elems(const VMStatePlanEntry *e,
+                                       void *opaque)
+{
+    switch (e->count) {
+    case VMSTATE_PLAN_COUNT_FIXED:
+        return e->num;
+    case VMSTATE_PLAN_COUNT_INT32:
+        return *(int32_t *)(opaque + e->num_offset);
+    case VMSTATE_PLAN_COUNT_UINT16:
+        return *(uint16_t *)(opaque + e->num_offset);
+    default:
+        return 1;
+    }
+}
+
+static inline size_t vmstate_plan_elem_size(const VMStatePlanEntry *e,
+                                            void *opaque)
+{
+    size_t size;
+
+    if (!e->vbuffer) {
+        return e->size;
+    }
+    size = *(int32_t *)(opaque + e->size_offset);
+    return e->multiply ? size * e->size : size;
+}
+
+static inline void *vmstate_plan_base(const VMStatePlanEntry *e, void *opaque)
+{
+    void *base_addr = opaque + e->offset;
+
+    if (e->pointer) {
+        base_addr = *(void **)base_addr + e->start;
+    }
+    return base_addr;
+}
+
+static inline void *vmstate_plan_elem(const VMStatePlanEntry *e,
+                                      void *base_addr, size_t size, int i)
+{
+    void *addr = base_addr + size * i;
+
+    if (e->array_of_pointer) {
+        addr = *(void **)addr;
+    }
+    return addr;
+}
+
+static inline uint64_t vmstate_plan_read_scalar(const void *addr, size_t size)
+{
+    switch (size) {
+    case 1:
+        return *(uint8_t *)addr;
+    case 2:
+        return *(uint16_t *)addr;
+    case 4:
+        return *(uint32_t *)addr;
+    default:
+        return *(uint64_t *)addr;
+    }
+}
+
+#endif
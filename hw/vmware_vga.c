@@ -1207,6 +1207,8 @@ static void vmsvga_init(struct vmsvga_state_s *s, int vga_ram_size)
                                      vmsvga_invalidate_display,
                                      vmsvga_screen_dump,
                                      vmsvga_text_update, s);
+    /* in SVGA mode the screen is only redrawn for SVGA_CMD_UPDATE rects */
+    s->vga.ds->precise_updates = 1;
 
 
     s->fifo_size = SVGA_FIFO_SIZE;
@@ -597,18 +597,25 @@ cleanup:
     free(vec);
 }
 
+/*
+ * Notifications that queued up since the last wakeup are all taken before
+ * the device looks at its rings, so that it does so once for all of them.
+ */
 static void xen_be_evtchn_event(void *opaque)
 {
     struct XenDevice *xendev = opaque;
-    evtchn_port_t port;
+    int port;
 
     port = xc_evtchn_pending(xendev->evtchndev);
-    if (port != xendev->local_port) {
-	xen_be_printf(xendev, 0, "xc_evtchn_pending returned %d (expected %d)\n",
-		      port, xendev->local_port);
-	return;
-    }
-    xc_evtchn_unmask(xendev->evtchndev, port);
+    do {
+        if (port != xendev->local_port) {
+            xen_be_printf(xendev, 0, "xc_evtchn_pending returned %d "
+                          "(expected %d)\n", port, xendev->local_port);
+            return;
+        }
+        xc_evtchn_unmask(xendev->evtchndev, port);
+        port = xc_evtchn_pending(xendev->evtchndev);
+    } while (port != -1);
 
     if (xendev->ops->event)
 	xendev->ops->event(xendev);
@@ -658,6 +665,9 @@ int xen_be_bind_evtchn(struct XenDevice *xendev)
 	return -1;
     }
     xen_be_printf(xendev, 2, "bind evtchn port %d\n", xendev->local_port);
+    /* lets xen_be_evtchn_event() find out that nothing is pending anymore */
+    fcntl(xc_evtchn_fd(xendev->evtchndev), F_SETFL,
+          fcntl(xc_evtchn_fd(xendev->evtchndev), F_GETFL) | O_NONBLOCK);
     qemu_set_fd_handler(xc_evtchn_fd(xendev->evtchndev),
 			xen_be_evtchn_event, NULL, xendev);
     return 0;
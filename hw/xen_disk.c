@@ -56,6 +56,18 @@ static int use_aio      = 1;
 #define BLOCK_SIZE  512
 #define IOCB_COUNT  (BLKIF_MAX_SEGMENTS_PER_REQUEST + 2)
 
+/* Frontends may share a ring of up to 1 << MAX_RING_PAGE_ORDER pages */
+#define MAX_RING_PAGE_ORDER 2
+
+/*
+ * Grants the frontend promised to reuse ("feature-persistent") stay mapped
+ * until disconnect, in an open addressed table at most half full.
+ */
+struct PersistentGrant {
+    uint32_t            gref;
+    void                *page;
+};
+
 struct ioreq {
     blkif_request_t     req;
     int16_t             status;
@@ -72,6 +84,7 @@ struct ioreq {
     int                 prot;
     void                *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
     void                *pages;
+    int                 num_unmap;
 
     /* aio status */
     int                 aio_inflight;
@@ -90,7 +103,8 @@ struct XenBlkDev {
     char                *devtype;
     const char          *fileproto;
     const char          *filename;
-    int                 ring_ref;
+    int                 ring_ref[1 << MAX_RING_PAGE_ORDER];
+    int                 nr_ring_ref;
     void                *sring;
     int64_t             file_blk;
     int64_t             file_size;
@@ -99,14 +113,28 @@ struct XenBlkDev {
     int                 more_work;
     int                 cnt_map;
 
+    /* persistent grants */
+    int                 feature_persistent;
+    struct PersistentGrant *persistent_gnts;
+    unsigned int        persistent_gnt_size;
+    unsigned int        persistent_gnt_count;
+    unsigned int        max_grants;
+
     /* request lists */
     QLIST_HEAD(inflight_head, ioreq) inflight;
     QLIST_HEAD(finished_head, ioreq) finished;
     QLIST_HEAD(freelist_head, ioreq) freelist;
+    int                 max_requests;   /* grows with the ring */
     int                 requests_total;
     int                 requests_inflight;
     int                 requests_finished;
 
+    /* reads or writes of one notification, submitted together */
+    BlockRequest        *blkreq;
+    int                 num_blkreq;
+    int                 niov_blkreq;
+    int                 blkreq_is_write;
+
     /* qemu block driver */
     DriveInfo           *dinfo;
     BlockDriverState    *bs;
@@ -120,7 +148,7 @@ static struct ioreq *ioreq_start(struct XenBlkDev *blkdev)
     struct ioreq *ioreq = NULL;
 
     if (QLIST_EMPTY(&blkdev->freelist)) {
-	if (blkdev->requests_total >= max_requests)
+	if (blkdev->requests_total >= blkdev->max_requests)
 	    goto out;
 	/* allocate new struct */
 	ioreq = qemu_mallocz(sizeof(*ioreq));
@@ -237,23 +265,56 @@ err:
     return -1;
 }
 
+static struct PersistentGrant *persistent_gnt_find(struct XenBlkDev *blkdev,
+                                                   uint32_t gref)
+{
+    unsigned int mask = blkdev->persistent_gnt_size - 1;
+    unsigned int i = gref & mask;
+
+    /* stops at the grant, or at the free slot it would go to */
+    while (blkdev->persistent_gnts[i].page &&
+           blkdev->persistent_gnts[i].gref != gref)
+        i = (i + 1) & mask;
+    return &blkdev->persistent_gnts[i];
+}
+
+static void persistent_gnt_destroy_all(struct XenBlkDev *blkdev)
+{
+    int gnt = blkdev->xendev.gnttabdev;
+    unsigned int i;
+
+    if (!blkdev->persistent_gnts)
+        return;
+    for (i = 0; i < blkdev->persistent_gnt_size; i++) {
+        if (!blkdev->persistent_gnts[i].page)
+            continue;
+        if (xc_gnttab_munmap(gnt, blkdev->persistent_gnts[i].page, 1) != 0)
+            xen_be_printf(&blkdev->xendev, 0, "xc_gnttab_munmap failed: %s\n",
+                          strerror(errno));
+        blkdev->cnt_map--;
+    }
+    qemu_free(blkdev->persistent_gnts);
+    blkdev->persistent_gnts = NULL;
+    blkdev->persistent_gnt_count = 0;
+}
+
 static void ioreq_unmap(struct ioreq *ioreq)
 {
     int gnt = ioreq->blkdev->xendev.gnttabdev;
     int i;
 
-    if (ioreq->v.niov == 0)
+    if (ioreq->num_unmap == 0)
         return;
     if (batch_maps) {
 	if (!ioreq->pages)
 	    return;
-	if (xc_gnttab_munmap(gnt, ioreq->pages, ioreq->v.niov) != 0)
+	if (xc_gnttab_munmap(gnt, ioreq->pages, ioreq->num_unmap) != 0)
 	    xen_be_printf(&ioreq->blkdev->xendev, 0, "xc_gnttab_munmap failed: %s\n",
 			  strerror(errno));
-	ioreq->blkdev->cnt_map -= ioreq->v.niov;
+	ioreq->blkdev->cnt_map -= ioreq->num_unmap;
 	ioreq->pages = NULL;
     } else {
-	for (i = 0; i < ioreq->v.niov; i++) {
+	for (i = 0; i < ioreq->num_unmap; i++) {
 	    if (!ioreq->page[i])
 		continue;
 	    if (xc_gnttab_munmap(gnt, ioreq->page[i], 1) != 0)
@@ -263,43 +324,97 @@ static void ioreq_unmap(struct ioreq *ioreq)
 	    ioreq->page[i] = NULL;
 	}
     }
+    ioreq->num_unmap = 0;
 }
 
+/*
+ * Map the segments that are not persistently mapped yet, each grant once.
+ * The new mappings are kept if the frontend reuses its grants and the table
+ * has room, otherwise ioreq_unmap() drops them when the request is done.
+ */
 static int ioreq_map(struct ioreq *ioreq)
 {
-    int gnt = ioreq->blkdev->xendev.gnttabdev;
-    int i;
+    struct XenBlkDev *blkdev = ioreq->blkdev;
+    int gnt = blkdev->xendev.gnttabdev;
+    uint32_t domids[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    uint32_t refs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    void *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    void *mapped[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    int slot[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    struct PersistentGrant *grant;
+    int i, j, new_maps = 0;
 
     if (ioreq->v.niov == 0)
         return 0;
-    if (batch_maps) {
+    for (i = 0; i < ioreq->v.niov; i++) {
+        page[i] = NULL;
+        if (blkdev->feature_persistent) {
+            grant = persistent_gnt_find(blkdev, ioreq->refs[i]);
+            if (grant->page) {
+                page[i] = grant->page;
+                continue;
+            }
+        }
+        for (j = 0; j < new_maps; j++)
+            if (refs[j] == ioreq->refs[i])
+                break;
+        if (j == new_maps) {
+            domids[new_maps] = ioreq->domids[i];
+            refs[new_maps]   = ioreq->refs[i];
+            new_maps++;
+        }
+        slot[i] = j;
+    }
+
+    /* a persistent mapping may serve reads and writes later on */
+    if (blkdev->feature_persistent)
+        ioreq->prot = PROT_READ | PROT_WRITE;
+
+    if (new_maps && batch_maps) {
 	ioreq->pages = xc_gnttab_map_grant_refs
-	    (gnt, ioreq->v.niov, ioreq->domids, ioreq->refs, ioreq->prot);
+	    (gnt, new_maps, domids, refs, ioreq->prot);
 	if (ioreq->pages == NULL) {
-	    xen_be_printf(&ioreq->blkdev->xendev, 0,
+	    xen_be_printf(&blkdev->xendev, 0,
 			  "can't map %d grant refs (%s, %d maps)\n",
-			  ioreq->v.niov, strerror(errno), ioreq->blkdev->cnt_map);
+			  new_maps, strerror(errno), blkdev->cnt_map);
 	    return -1;
 	}
-	for (i = 0; i < ioreq->v.niov; i++)
-	    ioreq->v.iov[i].iov_base = ioreq->pages + i * XC_PAGE_SIZE +
-		(uintptr_t)ioreq->v.iov[i].iov_base;
-	ioreq->blkdev->cnt_map += ioreq->v.niov;
-    } else  {
-	for (i = 0; i < ioreq->v.niov; i++) {
-	    ioreq->page[i] = xc_gnttab_map_grant_ref
-		(gnt, ioreq->domids[i], ioreq->refs[i], ioreq->prot);
-	    if (ioreq->page[i] == NULL) {
-		xen_be_printf(&ioreq->blkdev->xendev, 0,
+	for (j = 0; j < new_maps; j++)
+	    mapped[j] = ioreq->pages + j * XC_PAGE_SIZE;
+	blkdev->cnt_map += new_maps;
+    } else if (new_maps) {
+	for (j = 0; j < new_maps; j++) {
+	    ioreq->page[j] = xc_gnttab_map_grant_ref
+		(gnt, domids[j], refs[j], ioreq->prot);
+	    if (ioreq->page[j] == NULL) {
+		xen_be_printf(&blkdev->xendev, 0,
 			      "can't map grant ref %d (%s, %d maps)\n",
-			      ioreq->refs[i], strerror(errno), ioreq->blkdev->cnt_map);
+			      refs[j], strerror(errno), blkdev->cnt_map);
+		ioreq->num_unmap = j;
 		ioreq_unmap(ioreq);
 		return -1;
 	    }
-	    ioreq->v.iov[i].iov_base = ioreq->page[i] + (uintptr_t)ioreq->v.iov[i].iov_base;
-	    ioreq->blkdev->cnt_map++;
+	    mapped[j] = ioreq->page[j];
+	    blkdev->cnt_map++;
 	}
     }
+    ioreq->num_unmap = new_maps;
+
+    if (blkdev->feature_persistent && new_maps &&
+        blkdev->persistent_gnt_count + new_maps <= blkdev->max_grants) {
+        for (j = 0; j < new_maps; j++) {
+            grant = persistent_gnt_find(blkdev, refs[j]);
+            grant->gref = refs[j];
+            grant->page = mapped[j];
+            blkdev->persistent_gnt_count++;
+        }
+        ioreq->num_unmap = 0;
+        ioreq->pages = NULL;
+    }
+
+    for (i = 0; i < ioreq->v.niov; i++)
+        ioreq->v.iov[i].iov_base = (page[i] ? page[i] : mapped[slot[i]]) +
+            (uintptr_t)ioreq->v.iov[i].iov_base;
     return 0;
 }
 
@@ -388,6 +503,51 @@ static void qemu_aio_complete(void *opaque, int ret)
     qemu_bh_schedule(ioreq->blkdev->bh);
 }
 
+/* submit the queued reads or writes, letting the block layer merge them */
+static void blk_submit_requests(struct XenBlkDev *blkdev)
+{
+    int i, ret;
+
+    if (!blkdev->num_blkreq)
+        return;
+
+    if (blkdev->blkreq_is_write)
+        ret = bdrv_aio_multiwrite(blkdev->bs, blkdev->blkreq, blkdev->num_blkreq);
+    else
+        ret = bdrv_aio_multiread(blkdev->bs, blkdev->blkreq, blkdev->num_blkreq);
+    if (ret != 0) {
+        for (i = 0; i < blkdev->num_blkreq; i++) {
+            if (blkdev->blkreq[i].error)
+                qemu_aio_complete(blkdev->blkreq[i].opaque, -EIO);
+        }
+    }
+
+    blkdev->num_blkreq = 0;
+    blkdev->niov_blkreq = 0;
+}
+
+static void blk_queue_request(struct ioreq *ioreq, int is_write)
+{
+    struct XenBlkDev *blkdev = ioreq->blkdev;
+    BlockRequest *blkreq;
+
+    if (blkdev->num_blkreq && (blkdev->blkreq_is_write != is_write ||
+                               blkdev->niov_blkreq + ioreq->v.niov > IOV_MAX))
+        blk_submit_requests(blkdev);
+
+    /* at most blkdev->max_requests are in flight, so the array never overflows */
+    blkreq = &blkdev->blkreq[blkdev->num_blkreq++];
+    blkreq->sector     = ioreq->start / BLOCK_SIZE;
+    blkreq->nb_sectors = ioreq->v.size / BLOCK_SIZE;
+    blkreq->qiov       = &ioreq->v;
+    blkreq->cb         = qemu_aio_complete;
+    blkreq->opaque     = ioreq;
+    blkreq->error      = 0;
+
+    blkdev->niov_blkreq += ioreq->v.niov;
+    blkdev->blkreq_is_write = is_write;
+}
+
 static int ioreq_runio_qemu_aio(struct ioreq *ioreq)
 {
     struct XenBlkDev *blkdev = ioreq->blkdev;
@@ -395,6 +555,10 @@ static int ioreq_runio_qemu_aio(struct ioreq *ioreq)
     if (ioreq->req.nr_segments && ioreq_map(ioreq) == -1)
 	goto err;
 
+    /* barriers order against everything queued before them */
+    if (ioreq->presync || ioreq->postsync)
+        blk_submit_requests(blkdev);
+
     ioreq->aio_inflight++;
     if (ioreq->presync)
 	bdrv_flush(blkdev->bs); /* FIXME: aio_flush() ??? */
@@ -402,15 +566,17 @@ static int ioreq_runio_qemu_aio(struct ioreq *ioreq)
     switch (ioreq->req.operation) {
     case BLKIF_OP_READ:
         ioreq->aio_inflight++;
-        bdrv_aio_readv(blkdev->bs, ioreq->start / BLOCK_SIZE,
-                       &ioreq->v, ioreq->v.size / BLOCK_SIZE,
-                       qemu_aio_complete, ioreq);
+        blk_queue_request(ioreq, 0);
 	break;
     case BLKIF_OP_WRITE:
     case BLKIF_OP_WRITE_BARRIER:
-        ioreq->aio_inflight++;
         if (!ioreq->req.nr_segments)
             break;
+        ioreq->aio_inflight++;
+        if (!ioreq->postsync) {
+            blk_queue_request(ioreq, 1);
+            break;
+        }
         bdrv_aio_writev(blkdev->bs, ioreq->start / BLOCK_SIZE,
                         &ioreq->v, ioreq->v.size / BLOCK_SIZE,
                         qemu_aio_complete, ioreq);
@@ -517,47 +683,59 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
 {
     RING_IDX rc, rp;
     struct ioreq *ioreq;
+    int more_requests;
 
     blkdev->more_work = 0;
 
     rc = blkdev->rings.common.req_cons;
-    rp = blkdev->rings.common.sring->req_prod;
-    xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
     if (use_aio)
         blk_send_response_all(blkdev);
-    while (rc != rp) {
-        /* pull request from ring */
-        if (RING_REQUEST_CONS_OVERFLOW(&blkdev->rings.common, rc))
-            break;
-        ioreq = ioreq_start(blkdev);
-        if (ioreq == NULL) {
-            blkdev->more_work++;
-            break;
-        }
-        blk_get_request(blkdev, ioreq, rc);
-        blkdev->rings.common.req_cons = ++rc;
-
-        /* parse them */
-        if (ioreq_parse(ioreq) != 0) {
-            if (blk_send_response_one(ioreq))
-                xen_be_send_notify(&blkdev->xendev);
-            ioreq_release(ioreq);
-            continue;
+    bdrv_io_plug(blkdev->bs);
+    do {
+        rp = blkdev->rings.common.sring->req_prod;
+        xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
+
+        while (rc != rp) {
+            /* pull request from ring */
+            if (RING_REQUEST_CONS_OVERFLOW(&blkdev->rings.common, rc))
+                goto out;
+            ioreq = ioreq_start(blkdev);
+            if (ioreq == NULL) {
+                blkdev->more_work++;
+                goto out;
+            }
+            blk_get_request(blkdev, ioreq, rc);
+            blkdev->rings.common.req_cons = ++rc;
+
+            /* parse them */
+            if (ioreq_parse(ioreq) != 0) {
+                if (blk_send_response_one(ioreq))
+                    xen_be_send_notify(&blkdev->xendev);
+                ioreq_release(ioreq);
+                continue;
+            }
+
+            if (use_aio) {
+                /* run i/o in aio mode */
+                ioreq_runio_qemu_aio(ioreq);
+            } else {
+                /* run i/o in sync mode */
+                ioreq_runio_qemu_sync(ioreq);
+            }
         }
 
-        if (use_aio) {
-            /* run i/o in aio mode */
-            ioreq_runio_qemu_aio(ioreq);
-        } else {
-            /* run i/o in sync mode */
-            ioreq_runio_qemu_sync(ioreq);
-        }
-    }
+        /* take whatever the frontend queued meanwhile, then ask for events */
+        RING_FINAL_CHECK_FOR_REQUESTS(&blkdev->rings.common, more_requests);
+    } while (more_requests);
+
+out:
+    blk_submit_requests(blkdev);
+    bdrv_io_unplug(blkdev->bs);
     if (!use_aio)
         blk_send_response_all(blkdev);
 
-    if (blkdev->more_work && blkdev->requests_inflight < max_requests)
+    if (blkdev->more_work && blkdev->requests_inflight < blkdev->max_requests)
         qemu_bh_schedule(blkdev->bh);
 }
 
@@ -662,6 +840,9 @@ static int blk_init(struct XenDevice *xendev)
 
     /* fill info */
     xenstore_write_be_int(&blkdev->xendev, "feature-barrier", have_barriers);
+    xenstore_write_be_int(&blkdev->xendev, "feature-persistent", 1);
+    xenstore_write_be_int(&blkdev->xendev, "max-ring-page-order",
+                          MAX_RING_PAGE_ORDER);
     xenstore_write_be_int(&blkdev->xendev, "info",            info);
     xenstore_write_be_int(&blkdev->xendev, "sector-size",     blkdev->file_blk);
     xenstore_write_be_int(&blkdev->xendev, "sectors",
@@ -672,12 +853,38 @@ static int blk_init(struct XenDevice *xendev)
 static int blk_connect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
+    uint32_t domids[1 << MAX_RING_PAGE_ORDER];
+    uint32_t refs[1 << MAX_RING_PAGE_ORDER];
+    int order, i;
+
+    if (xenstore_read_fe_int(&blkdev->xendev, "ring-page-order", &order) == -1)
+        order = 0;
+    if (order < 0 || order > MAX_RING_PAGE_ORDER) {
+        xen_be_printf(&blkdev->xendev, 0, "ring-page-order %d not supported\n",
+                      order);
+        return -1;
+    }
+    blkdev->nr_ring_ref = 1 << order;
+    if (order == 0) {
+        if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref",
+                                 &blkdev->ring_ref[0]) == -1)
+            return -1;
+    } else {
+        for (i = 0; i < blkdev->nr_ring_ref; i++) {
+            char node[16];
 
-    if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref", &blkdev->ring_ref) == -1)
-	return -1;
+            snprintf(node, sizeof(node), "ring-ref%d", i);
+            if (xenstore_read_fe_int(&blkdev->xendev, node,
+                                     &blkdev->ring_ref[i]) == -1)
+                return -1;
+        }
+    }
     if (xenstore_read_fe_int(&blkdev->xendev, "event-channel",
                              &blkdev->xendev.remote_port) == -1)
 	return -1;
+    if (xenstore_read_fe_int(&blkdev->xendev, "feature-persistent",
+                             &blkdev->feature_persistent) == -1)
+        blkdev->feature_persistent = 0;
 
     blkdev->protocol = BLKIF_PROTOCOL_NATIVE;
     if (blkdev->xendev.protocol) {
@@ -687,43 +894,73 @@ static int blk_connect(struct XenDevice *xendev)
             blkdev->protocol = BLKIF_PROTOCOL_X86_64;
     }
 
-    blkdev->sring = xc_gnttab_map_grant_ref(blkdev->xendev.gnttabdev,
-					    blkdev->xendev.dom,
-					    blkdev->ring_ref,
-					    PROT_READ | PROT_WRITE);
+    if (blkdev->nr_ring_ref == 1) {
+        blkdev->sring = xc_gnttab_map_grant_ref(blkdev->xendev.gnttabdev,
+                                                blkdev->xendev.dom,
+                                                blkdev->ring_ref[0],
+                                                PROT_READ | PROT_WRITE);
+    } else {
+        for (i = 0; i < blkdev->nr_ring_ref; i++) {
+            domids[i] = blkdev->xendev.dom;
+            refs[i] = blkdev->ring_ref[i];
+        }
+        blkdev->sring = xc_gnttab_map_grant_refs(blkdev->xendev.gnttabdev,
+                                                 blkdev->nr_ring_ref, domids,
+                                                 refs, PROT_READ | PROT_WRITE);
+    }
     if (!blkdev->sring)
 	return -1;
-    blkdev->cnt_map++;
+    blkdev->cnt_map += blkdev->nr_ring_ref;
+
+    /* one page holds as many requests as the default allows in flight */
+    blkdev->max_requests = max_requests * blkdev->nr_ring_ref;
+    qemu_free(blkdev->blkreq);
+    blkdev->blkreq = qemu_mallocz(blkdev->max_requests *
+                                  sizeof(*blkdev->blkreq));
+
+    if (blkdev->feature_persistent) {
+        blkdev->max_grants = blkdev->max_requests *
+                             BLKIF_MAX_SEGMENTS_PER_REQUEST;
+        blkdev->persistent_gnt_size = 1;
+        while (blkdev->persistent_gnt_size < 2 * blkdev->max_grants)
+            blkdev->persistent_gnt_size <<= 1;
+        blkdev->persistent_gnts = qemu_mallocz(blkdev->persistent_gnt_size *
+                                               sizeof(struct PersistentGrant));
+    }
 
     switch (blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
     {
 	blkif_sring_t *sring_native = blkdev->sring;
-	BACK_RING_INIT(&blkdev->rings.native, sring_native, XC_PAGE_SIZE);
+	BACK_RING_INIT(&blkdev->rings.native, sring_native,
+                       XC_PAGE_SIZE * blkdev->nr_ring_ref);
 	break;
     }
     case BLKIF_PROTOCOL_X86_32:
     {
 	blkif_x86_32_sring_t *sring_x86_32 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32,
+                       XC_PAGE_SIZE * blkdev->nr_ring_ref);
 	break;
     }
     case BLKIF_PROTOCOL_X86_64:
     {
 	blkif_x86_64_sring_t *sring_x86_64 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64,
+                       XC_PAGE_SIZE * blkdev->nr_ring_ref);
 	break;
     }
     }
 
     xen_be_bind_evtchn(&blkdev->xendev);
 
-    xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, ring-ref %d, "
-		  "remote port %d, local port %d\n",
-		  blkdev->xendev.protocol, blkdev->ring_ref,
-		  blkdev->xendev.remote_port, blkdev->xendev.local_port);
+    xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, ring-ref %d (%d pages), "
+		  "remote port %d, local port %d, persistent grants %d\n",
+		  blkdev->xendev.protocol, blkdev->ring_ref[0], blkdev->nr_ring_ref,
+		  blkdev->xendev.remote_port, blkdev->xendev.local_port,
+		  blkdev->feature_persistent);
     return 0;
 }
 
@@ -740,10 +977,12 @@ static void blk_disconnect(struct XenDevice *xendev)
 	blkdev->bs = NULL;
     }
     xen_be_unbind_evtchn(&blkdev->xendev);
+    persistent_gnt_destroy_all(blkdev);
 
     if (blkdev->sring) {
-	xc_gnttab_munmap(blkdev->xendev.gnttabdev, blkdev->sring, 1);
-	blkdev->cnt_map--;
+	xc_gnttab_munmap(blkdev->xendev.gnttabdev, blkdev->sring,
+                         blkdev->nr_ring_ref);
+	blkdev->cnt_map -= blkdev->nr_ring_ref;
 	blkdev->sring = NULL;
     }
 }
@@ -765,6 +1004,7 @@ static int blk_free(struct XenDevice *xendev)
     qemu_free(blkdev->type);
     qemu_free(blkdev->dev);
     qemu_free(blkdev->devtype);
+    qemu_free(blkdev->blkreq);
     qemu_bh_delete(blkdev->bh);
     return 0;
 }
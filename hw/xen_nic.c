@@ -47,6 +47,9 @@
 
 /* ------------------------------------------------------------- */
 
+/* tx requests whose grants are mapped, and responses pushed, together */
+#define NET_TX_BATCH 32
+
 struct XenNetDev {
     struct XenDevice      xendev;  /* must be first */
     char                  *mac;
@@ -63,11 +66,11 @@ struct XenNetDev {
 
 /* ------------------------------------------------------------- */
 
+/* Queues a response; the guest sees it on the next net_tx_push() */
 static void net_tx_response(struct XenNetDev *netdev, netif_tx_request_t *txp, int8_t st)
 {
     RING_IDX i = netdev->tx_ring.rsp_prod_pvt;
     netif_tx_response_t *resp;
-    int notify;
 
     resp = RING_GET_RESPONSE(&netdev->tx_ring, i);
     resp->id     = txp->id;
@@ -79,6 +82,13 @@ static void net_tx_response(struct XenNetDev *netdev, netif_tx_request_t *txp, i
 #endif
 
     netdev->tx_ring.rsp_prod_pvt = ++i;
+}
+
+static void net_tx_push(struct XenNetDev *netdev)
+{
+    RING_IDX i = netdev->tx_ring.rsp_prod_pvt;
+    int notify;
+
     RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&netdev->tx_ring, notify);
     if (notify)
 	xen_be_send_notify(&netdev->xendev);
@@ -114,79 +124,127 @@ static void net_tx_error(struct XenNetDev *netdev, netif_tx_request_t *txp, RING
 #endif
 }
 
+/* Whether a tx request is one we can handle; answers it if not */
+static int net_tx_check(struct XenNetDev *netdev, netif_tx_request_t *txreq,
+                        RING_IDX rc)
+{
+#if 1
+    /* should not happen in theory, we don't announce the *
+     * feature-{sg,gso,whatelse} flags in xenstore (yet?) */
+    if (txreq->flags & NETTXF_extra_info) {
+	xen_be_printf(&netdev->xendev, 0, "FIXME: extra info flag\n");
+	net_tx_error(netdev, txreq, rc);
+	return 0;
+    }
+    if (txreq->flags & NETTXF_more_data) {
+	xen_be_printf(&netdev->xendev, 0, "FIXME: more data flag\n");
+	net_tx_error(netdev, txreq, rc);
+	return 0;
+    }
+#endif
+
+    if (txreq->size < 14) {
+	xen_be_printf(&netdev->xendev, 0, "bad packet size: %d\n", txreq->size);
+	net_tx_error(netdev, txreq, rc);
+	return 0;
+    }
+
+    if ((txreq->offset + txreq->size) > XC_PAGE_SIZE) {
+	xen_be_printf(&netdev->xendev, 0, "error: page crossing\n");
+	net_tx_error(netdev, txreq, rc);
+	return 0;
+    }
+
+    xen_be_printf(&netdev->xendev, 3, "tx packet ref %d, off %d, len %d, flags 0x%x%s%s%s%s\n",
+		  txreq->gref, txreq->offset, txreq->size, txreq->flags,
+		  (txreq->flags & NETTXF_csum_blank)     ? " csum_blank"     : "",
+		  (txreq->flags & NETTXF_data_validated) ? " data_validated" : "",
+		  (txreq->flags & NETTXF_more_data)      ? " more_data"      : "",
+		  (txreq->flags & NETTXF_extra_info)     ? " extra_info"     : "");
+    return 1;
+}
+
+static void net_tx_send(struct XenNetDev *netdev, netif_tx_request_t *txreq,
+                        void *page, void **tmpbuf)
+{
+    if (txreq->flags & NETTXF_csum_blank) {
+        /* have read-only mapping -> can't fill checksum in-place */
+        if (!*tmpbuf)
+            *tmpbuf = qemu_malloc(XC_PAGE_SIZE);
+        memcpy(*tmpbuf, page + txreq->offset, txreq->size);
+        net_checksum_calculate(*tmpbuf, txreq->size);
+        qemu_send_packet(&netdev->nic->nc, *tmpbuf, txreq->size);
+    } else {
+        qemu_send_packet(&netdev->nic->nc, page + txreq->offset, txreq->size);
+    }
+}
+
+/*
+ * Requests are taken off the ring NET_TX_BATCH at a time, their grants
+ * mapped with a single call and unmapped with a single munmap, and their
+ * responses pushed to the guest with at most one notification.  If the
+ * batch can't be mapped as a whole, each grant is mapped on its own so
+ * that only the bad ones fail.
+ */
 static void net_tx_packets(struct XenNetDev *netdev)
 {
-    netif_tx_request_t txreq;
+    netif_tx_request_t txreqs[NET_TX_BATCH];
+    uint32_t domids[NET_TX_BATCH];
+    uint32_t refs[NET_TX_BATCH];
     RING_IDX rc, rp;
-    void *page;
+    void *pages, *page;
     void *tmpbuf = NULL;
+    int i, n, overflow;
 
     for (;;) {
 	rc = netdev->tx_ring.req_cons;
 	rp = netdev->tx_ring.sring->req_prod;
 	xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
-	while ((rc != rp)) {
-	    if (RING_REQUEST_CONS_OVERFLOW(&netdev->tx_ring, rc))
-		break;
-	    memcpy(&txreq, RING_GET_REQUEST(&netdev->tx_ring, rc), sizeof(txreq));
-	    netdev->tx_ring.req_cons = ++rc;
-
-#if 1
-	    /* should not happen in theory, we don't announce the *
-	     * feature-{sg,gso,whatelse} flags in xenstore (yet?) */
-	    if (txreq.flags & NETTXF_extra_info) {
-		xen_be_printf(&netdev->xendev, 0, "FIXME: extra info flag\n");
-		net_tx_error(netdev, &txreq, rc);
-		continue;
-	    }
-	    if (txreq.flags & NETTXF_more_data) {
-		xen_be_printf(&netdev->xendev, 0, "FIXME: more data flag\n");
-		net_tx_error(netdev, &txreq, rc);
-		continue;
-	    }
-#endif
-
-	    if (txreq.size < 14) {
-		xen_be_printf(&netdev->xendev, 0, "bad packet size: %d\n", txreq.size);
-		net_tx_error(netdev, &txreq, rc);
-		continue;
-	    }
-
-	    if ((txreq.offset + txreq.size) > XC_PAGE_SIZE) {
-		xen_be_printf(&netdev->xendev, 0, "error: page crossing\n");
-		net_tx_error(netdev, &txreq, rc);
-		continue;
+	overflow = 0;
+	while (rc != rp && !overflow) {
+	    n = 0;
+	    while (rc != rp && n < NET_TX_BATCH) {
+		if (RING_REQUEST_CONS_OVERFLOW(&netdev->tx_ring, rc)) {
+		    overflow = 1;
+		    break;
+		}
+		memcpy(&txreqs[n], RING_GET_REQUEST(&netdev->tx_ring, rc),
+		       sizeof(txreqs[n]));
+		netdev->tx_ring.req_cons = ++rc;
+		if (!net_tx_check(netdev, &txreqs[n], rc))
+		    continue;
+		domids[n] = netdev->xendev.dom;
+		refs[n] = txreqs[n].gref;
+		n++;
 	    }
 
-	    xen_be_printf(&netdev->xendev, 3, "tx packet ref %d, off %d, len %d, flags 0x%x%s%s%s%s\n",
-			  txreq.gref, txreq.offset, txreq.size, txreq.flags,
-			  (txreq.flags & NETTXF_csum_blank)     ? " csum_blank"     : "",
-			  (txreq.flags & NETTXF_data_validated) ? " data_validated" : "",
-			  (txreq.flags & NETTXF_more_data)      ? " more_data"      : "",
-			  (txreq.flags & NETTXF_extra_info)     ? " extra_info"     : "");
-
-	    page = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-					   netdev->xendev.dom,
-					   txreq.gref, PROT_READ);
-	    if (page == NULL) {
-		xen_be_printf(&netdev->xendev, 0, "error: tx gref dereference failed (%d)\n",
-                              txreq.gref);
-		net_tx_error(netdev, &txreq, rc);
-		continue;
+	    pages = NULL;
+	    if (n > 1)
+		pages = xc_gnttab_map_grant_refs(netdev->xendev.gnttabdev, n,
+						 domids, refs, PROT_READ);
+	    for (i = 0; i < n; i++) {
+		if (pages) {
+		    page = pages + i * XC_PAGE_SIZE;
+		} else {
+		    page = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
+						   netdev->xendev.dom,
+						   refs[i], PROT_READ);
+		    if (page == NULL) {
+			xen_be_printf(&netdev->xendev, 0, "error: tx gref dereference failed (%d)\n",
+				      refs[i]);
+			net_tx_error(netdev, &txreqs[i], rc);
+			continue;
+		    }
+		}
+		net_tx_send(netdev, &txreqs[i], page, &tmpbuf);
+		if (!pages)
+		    xc_gnttab_munmap(netdev->xendev.gnttabdev, page, 1);
+		net_tx_response(netdev, &txreqs[i], NETIF_RSP_OKAY);
 	    }
-	    if (txreq.flags & NETTXF_csum_blank) {
-                /* have read-only mapping -> can't fill checksum in-place */
-                if (!tmpbuf)
-                    tmpbuf = qemu_malloc(XC_PAGE_SIZE);
-                memcpy(tmpbuf, page + txreq.offset, txreq.size);
-		net_checksum_calculate(tmpbuf, txreq.size);
-                qemu_send_packet(&netdev->nic->nc, tmpbuf, txreq.size);
-            } else {
-                qemu_send_packet(&netdev->nic->nc, page + txreq.offset, txreq.size);
-            }
-	    xc_gnttab_munmap(netdev->xendev.gnttabdev, page, 1);
-	    net_tx_response(netdev, &txreq, NETIF_RSP_OKAY);
+	    if (pages)
+		xc_gnttab_munmap(netdev->xendev.gnttabdev, pages, n);
+	    net_tx_push(netdev);
 	}
 	if (!netdev->tx_work)
 	    break;
@@ -1001,6 +1001,8 @@ wait_more:
                                     NULL,
                                     NULL,
                                     fb);
+    /* the frontend tells us which rectangles it modified */
+    fb->c.ds->precise_updates = 1;
     fb->have_console = 1;
 
     /* vkbd */
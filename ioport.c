@@ -27,6 +27,7 @@
 
 #include "ioport.h"
 #include "trace.h"
+#include "qemu-barrier.h"
 
 /***********************************************************/
 /* IO Port */
@@ -51,6 +52,8 @@
 static void *ioport_opaque[MAX_IOPORTS];
 static IOPortReadFunc *ioport_read_table[3][MAX_IOPORTS];
 static IOPortWriteFunc *ioport_write_table[3][MAX_IOPORTS];
+static uint8_t ioport_unlocked[MAX_IOPORTS];
+static struct QemuMutex *ioport_lock[MAX_IOPORTS];
 
 static IOPortReadFunc default_ioport_readb, default_ioport_readw, default_ioport_readl;
 static IOPortWriteFunc default_ioport_writeb, default_ioport_writew, default_ioport_writel;
@@ -136,6 +139,16 @@ static int ioport_bsize(int size, int *bsize)
     return 0;
 }
 
+static void ioport_clear_unlocked(pio_addr_t start, int length)
+{
+    int i;
+
+    for (i = start; i < start + length; i++) {
+        ioport_unlocked[i] = 0;
+        ioport_lock[i] = NULL;
+    }
+}
+
 /* size is the word size in byte */
 int register_ioport_read(pio_addr_t start, int length, int size,
                          IOPortReadFunc *func, void *opaque)
@@ -146,6 +159,7 @@ int register_ioport_read(pio_addr_t start, int length, int size,
         hw_error("register_ioport_read: invalid size");
         return -1;
     }
+    ioport_clear_unlocked(start, length);
     for(i = start; i < start + length; i += size) {
         ioport_read_table[bsize][i] = func;
         if (ioport_opaque[i] != NULL && ioport_opaque[i] != opaque)
@@ -165,6 +179,7 @@ int register_ioport_write(pio_addr_t start, int length, int size,
         hw_error("register_ioport_write: invalid size");
         return -1;
     }
+    ioport_clear_unlocked(start, length);
     for(i = start; i < start + length; i += size) {
         ioport_write_table[bsize][i] = func;
         if (ioport_opaque[i] != NULL && ioport_opaque[i] != opaque)
@@ -253,6 +268,49 @@ void isa_unassign_ioport(pio_addr_t start, int length)
 
         ioport_opaque[i] = NULL;
     }
+    ioport_clear_unlocked(start, length);
+}
+
+void ioport_set_unlocked(pio_addr_t start, int length, struct QemuMutex *lock)
+{
+    int i;
+
+    for (i = start; i < start + length; i++) {
+        ioport_lock[i] = lock;
+        smp_wmb();
+        ioport_unlocked[i] = 1;
+    }
+}
+
+bool ioport_get_lock(pio_addr_t addr, struct QemuMutex **lock)
+{
+    if (!ioport_unlocked[addr & IOPORTS_MASK]) {
+        return false;
+    }
+    smp_rmb();
+    *lock = ioport_lock[addr & IOPORTS_MASK];
+    return true;
+}
+
+/* Whether a device reads the port, at any width */
+bool ioport_has_read_handler(pio_addr_t addr)
+{
+    static IOPortReadFunc * const default_func[3] = {
+        default_ioport_readb,
+        default_ioport_readw,
+        default_ioport_readl
+    };
+    int i;
+
+    addr &= IOPORTS_MASK;
+    for (i = 0; i < 3; i++) {
+        IOPortReadFunc *func = ioport_read_table[i][addr];
+
+        if (func && func != default_func[i]) {
+            return true;
+        }
+    }
+    return false;
 }
 
 /***********************************************************/
@@ -37,6 +37,8 @@ typedef uint32_t pio_addr_t;
 typedef void (IOPortWriteFunc)(void *opaque, uint32_t address, uint32_t data);
 typedef uint32_t (IOPortReadFunc)(void *opaque, uint32_t address);
 
+struct QemuMutex;
+
 void ioport_register(IORange *iorange);
 int register_ioport_read(pio_addr_t start, int length, int size,
                          IOPortReadFunc *func, void *opaque);
@@ -44,6 +46,23 @@ int register_ioport_write(pio_addr_t start, int length, int size,
                           IOPortWriteFunc *func, void *opaque);
 void isa_unassign_ioport(pio_addr_t start, int length);
 
+/* Let KVM vcpu threads run the handlers of a range without taking
+ * qemu_global_mutex.  They take lock instead, or nothing at all if lock is
+ * NULL and the handlers are thread safe.  The handlers must not look at
+ * cpu_single_env or touch state that is protected by the global mutex.
+ * Registering new handlers on a port makes it locked again.
+ */
+void ioport_set_unlocked(pio_addr_t start, int length, struct QemuMutex *lock);
+bool ioport_get_lock(pio_addr_t addr, struct QemuMutex **lock);
+
+bool ioport_has_read_handler(pio_addr_t addr);
+
+/* Like qemu_register_coalesced_mmio, for port writes.  KVM also coalesces
+ * hot ports that have no read handler on its own.
+ */
+void qemu_register_coalesced_pio(pio_addr_t addr, uint32_t size);
+void qemu_unregister_coalesced_pio(pio_addr_t addr, uint32_t size);
+
 
 void cpu_outb(pio_addr_t addr, uint8_t val);
 void cpu_outw(pio_addr_t addr, uint16_t val);
@@ -0,0 +1,521 @@
+/*
+ * Event loop threads
+ *
+ * An IOThread is an event loop of its own, with its own fd handlers,
+ * bottom halves and timers, running in a thread of its own.  They are
+ * created with -iothread id=<name>, and devices that can do their I/O
+ * without the global mutex are bound to one by its id, so that several
+ * host cores share the device emulation of a VM.
+ *
+ * Nothing in an IOThread takes the global mutex.  Its fd handlers and
+ * timers are only touched by its own thread; other threads use
+ * iothread_run() or a bottom half, which can be scheduled from anywhere.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <poll.h>
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "hw/event_notifier.h"
+#include "iothread.h"
+
+typedef struct IOThreadHandler {
+    int fd;
+    IOHandler *fd_read;
+    IOHandler *fd_write;
+    void *opaque;
+    bool deleted;
+    QLIST_ENTRY(IOThreadHandler) next;
+} IOThreadHandler;
+
+struct IOThreadBH {
+    IOThread *iot;
+    QEMUBHFunc *cb;
+    void *opaque;
+    bool scheduled;
+    bool deleted;
+    QLIST_ENTRY(IOThreadBH) next;
+};
+
+struct IOThreadTimer {
+    IOThread *iot;
+    QEMUTimerCB *cb;
+    void *opaque;
+    int64_t expire_time;
+    bool pending;
+    QTAILQ_ENTRY(IOThreadTimer) next;
+};
+
+struct IOThread {
+    char *id;
+    QemuThread thread;
+    bool stopping;
+    EventNotifier wakeup;
+
+    /* protects the list of bottom halves and their flags */
+    QemuMutex lock;
+    QemuCond run_cond;
+    QLIST_HEAD(, IOThreadBH) bhs;
+    bool bhs_deleted;
+
+    QLIST_HEAD(, IOThreadHandler) handlers;
+    bool handlers_deleted;
+    /* there are only a few per thread, a sorted list does */
+    QTAILQ_HEAD(, IOThreadTimer) timers;
+
+    /* what the thread polls, rebuilt on every iteration */
+    struct pollfd *pollfds;
+    IOThreadHandler **pollh;
+    int npollfds_max;
+
+    QTAILQ_ENTRY(IOThread) next;
+};
+
+typedef struct IOThreadRun {
+    void (*fn)(void *opaque);
+    void *opaque;
+    IOThreadBH *bh;
+    bool done;
+} IOThreadRun;
+
+static QTAILQ_HEAD(, IOThread) iothreads =
+    QTAILQ_HEAD_INITIALIZER(iothreads);
+
+static bool iothread_is_self(IOThread *iot)
+{
+    QemuThread me;
+
+    qemu_thread_self(&me);
+    return qemu_thread_equal(&me, &iot->thread);
+}
+
+/***********************************************************/
+/* fd handlers */
+
+void iothread_set_fd_handler(IOThread *iot, int fd, IOHandler *fd_read,
+                             IOHandler *fd_write, void *opaque)
+{
+    IOThreadHandler *ioh;
+
+    QLIST_FOREACH(ioh, &iot->handlers, next) {
+        if (ioh->fd == fd && !ioh->deleted) {
+            break;
+        }
+    }
+
+    if (!fd_read && !fd_write) {
+        if (ioh) {
+            ioh->deleted = true;
+            iot->handlers_deleted = true;
+        }
+        return;
+    }
+
+    if (!ioh) {
+        ioh = qemu_mallocz(sizeof(*ioh));
+        QLIST_INSERT_HEAD(&iot->handlers, ioh, next);
+    }
+    ioh->fd = fd;
+    ioh->fd_read = fd_read;
+    ioh->fd_write = fd_write;
+    ioh->opaque = opaque;
+}
+
+static void iothread_free_deleted_handlers(IOThread *iot)
+{
+    IOThreadHandler *ioh, *pioh;
+
+    if (!iot->handlers_deleted) {
+        return;
+    }
+    iot->handlers_deleted = false;
+
+    QLIST_FOREACH_SAFE(ioh, &iot->handlers, next, pioh) {
+        if (ioh->deleted) {
+            QLIST_REMOVE(ioh, next);
+            qemu_free(ioh);
+        }
+    }
+}
+
+/***********************************************************/
+/* bottom halves */
+
+IOThreadBH *iothread_bh_new(IOThread *iot, QEMUBHFunc *cb, void *opaque)
+{
+    IOThreadBH *bh = qemu_mallocz(sizeof(*bh));
+
+    bh->iot = iot;
+    bh->cb = cb;
+    bh->opaque = opaque;
+    qemu_mutex_lock(&iot->lock);
+    QLIST_INSERT_HEAD(&iot->bhs, bh, next);
+    qemu_mutex_unlock(&iot->lock);
+    return bh;
+}
+
+void iothread_bh_schedule(IOThreadBH *bh)
+{
+    IOThread *iot = bh->iot;
+    bool wake;
+
+    qemu_mutex_lock(&iot->lock);
+    wake = !bh->scheduled;
+    bh->scheduled = true;
+    qemu_mutex_unlock(&iot->lock);
+
+    if (wake) {
+        event_notifier_set(&iot->wakeup);
+    }
+}
+
+void iothread_bh_cancel(IOThreadBH *bh)
+{
+    qemu_mutex_lock(&bh->iot->lock);
+    bh->scheduled = false;
+    qemu_mutex_unlock(&bh->iot->lock);
+}
+
+void iothread_bh_delete(IOThreadBH *bh)
+{
+    IOThread *iot = bh->iot;
+
+    qemu_mutex_lock(&iot->lock);
+    bh->scheduled = false;
+    bh->deleted = true;
+    iot->bhs_deleted = true;
+    qemu_mutex_unlock(&iot->lock);
+}
+
+static bool iothread_bh_pending(IOThread *iot)
+{
+    IOThreadBH *bh;
+    bool pending = false;
+
+    qemu_mutex_lock(&iot->lock);
+    QLIST_FOREACH(bh, &iot->bhs, next) {
+        if (bh->scheduled) {
+            pending = true;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&iot->lock);
+    return pending;
+}
+
+static void iothread_bh_poll(IOThread *iot)
+{
+    IOThreadBH *bh, *pbh;
+
+    /* new bottom halves go to the head, the walk goes on past them */
+    qemu_mutex_lock(&iot->lock);
+    QLIST_FOREACH(bh, &iot->bhs, next) {
+        if (bh->scheduled) {
+            bh->scheduled = false;
+            qemu_mutex_unlock(&iot->lock);
+            bh->cb(bh->opaque);
+            qemu_mutex_lock(&iot->lock);
+        }
+    }
+
+    if (iot->bhs_deleted) {
+        iot->bhs_deleted = false;
+        QLIST_FOREACH_SAFE(bh, &iot->bhs, next, pbh) {
+            if (bh->deleted) {
+                QLIST_REMOVE(bh, next);
+                qemu_free(bh);
+            }
+        }
+    }
+    qemu_mutex_unlock(&iot->lock);
+}
+
+/***********************************************************/
+/* timers */
+
+IOThreadTimer *iothread_timer_new(IOThread *iot, QEMUTimerCB *cb,
+                                  void *opaque)
+{
+    IOThreadTimer *ts = qemu_mallocz(sizeof(*ts));
+
+    ts->iot = iot;
+    ts->cb = cb;
+    ts->opaque = opaque;
+    return ts;
+}
+
+void iothread_timer_del(IOThreadTimer *ts)
+{
+    if (ts->pending) {
+        QTAILQ_REMOVE(&ts->iot->timers, ts, next);
+        ts->pending = false;
+    }
+}
+
+void iothread_timer_mod(IOThreadTimer *ts, int64_t expire_time)
+{
+    IOThreadTimer *t;
+
+    iothread_timer_del(ts);
+    ts->expire_time = expire_time;
+    QTAILQ_FOREACH(t, &ts->iot->timers, next) {
+        if (t->expire_time > expire_time) {
+            break;
+        }
+    }
+    if (t) {
+        QTAILQ_INSERT_BEFORE(t, ts, next);
+    } else {
+        QTAILQ_INSERT_TAIL(&ts->iot->timers, ts, next);
+    }
+    ts->pending = true;
+}
+
+void iothread_timer_free(IOThreadTimer *ts)
+{
+    iothread_timer_del(ts);
+    qemu_free(ts);
+}
+
+static void iothread_run_timers(IOThread *iot)
+{
+    IOThreadTimer *ts;
+    int64_t now = get_clock();
+
+    while ((ts = QTAILQ_FIRST(&iot->timers)) && ts->expire_time <= now) {
+        iothread_timer_del(ts);
+        ts->cb(ts->opaque);
+    }
+}
+
+/***********************************************************/
+/* the loop */
+
+/* Milliseconds until the first timer, rounded up, or -1 */
+static int iothread_timeout(IOThread *iot)
+{
+    IOThreadTimer *ts = QTAILQ_FIRST(&iot->timers);
+    int64_t delta;
+
+    if (iothread_bh_pending(iot)) {
+        return 0;
+    }
+    if (!ts) {
+        return -1;
+    }
+    delta = ts->expire_time - get_clock();
+    if (delta <= 0) {
+        return 0;
+    }
+    return MIN((delta + 999999) / 1000000, INT_MAX);
+}
+
+static void iothread_wait(IOThread *iot)
+{
+    IOThreadHandler *ioh;
+    int i, n = 1, ret;
+
+    QLIST_FOREACH(ioh, &iot->handlers, next) {
+        n++;
+    }
+    if (n > iot->npollfds_max) {
+        iot->npollfds_max = n * 2;
+        iot->pollfds = qemu_realloc(iot->pollfds,
+                                    sizeof(*iot->pollfds) * iot->npollfds_max);
+        iot->pollh = qemu_realloc(iot->pollh,
+                                  sizeof(*iot->pollh) * iot->npollfds_max);
+    }
+
+    iot->pollfds[0].fd = event_notifier_get_fd(&iot->wakeup);
+    iot->pollfds[0].events = POLLIN;
+    n = 1;
+    QLIST_FOREACH(ioh, &iot->handlers, next) {
+        if (ioh->deleted) {
+            continue;
+        }
+        iot->pollfds[n].fd = ioh->fd;
+        iot->pollfds[n].events = (ioh->fd_read ? POLLIN : 0) |
+                                 (ioh->fd_write ? POLLOUT : 0);
+        iot->pollh[n] = ioh;
+        n++;
+    }
+
+    ret = poll(iot->pollfds, n, iothread_timeout(iot));
+    if (ret < 0 && errno != EINTR) {
+        fprintf(stderr, "iothread %s: poll: %s\n", iot->id ? iot->id : "",
+                strerror(errno));
+        abort();
+    }
+
+    if (ret > 0) {
+        if (iot->pollfds[0].revents & POLLIN) {
+            event_notifier_test_and_clear(&iot->wakeup);
+        }
+        for (i = 1; i < n; i++) {
+            int revents = iot->pollfds[i].revents;
+
+            ioh = iot->pollh[i];
+            if (!ioh->deleted && ioh->fd_read &&
+                (revents & (POLLIN | POLLHUP | POLLERR))) {
+                ioh->fd_read(ioh->opaque);
+            }
+            if (!ioh->deleted && ioh->fd_write &&
+                (revents & (POLLOUT | POLLERR))) {
+                ioh->fd_write(ioh->opaque);
+            }
+        }
+    }
+
+    iothread_bh_poll(iot);
+    iothread_run_timers(iot);
+    iothread_free_deleted_handlers(iot);
+}
+
+static void *iothread_thread(void *opaque)
+{
+    IOThread *iot = opaque;
+
+    while (!iot->stopping) {
+        iothread_wait(iot);
+    }
+    return NULL;
+}
+
+static void iothread_run_bh(void *opaque)
+{
+    IOThreadRun *r = opaque;
+    IOThread *iot = r->bh->iot;
+
+    r->fn(r->opaque);
+    iothread_bh_delete(r->bh);
+
+    qemu_mutex_lock(&iot->lock);
+    r->done = true;
+    qemu_cond_broadcast(&iot->run_cond);
+    qemu_mutex_unlock(&iot->lock);
+}
+
+void iothread_run(IOThread *iot, void (*fn)(void *opaque), void *opaque)
+{
+    IOThreadRun r = {
+        .fn = fn,
+        .opaque = opaque,
+    };
+
+    if (iothread_is_self(iot)) {
+        fn(opaque);
+        return;
+    }
+
+    r.bh = iothread_bh_new(iot, iothread_run_bh, &r);
+    iothread_bh_schedule(r.bh);
+
+    qemu_mutex_lock(&iot->lock);
+    while (!r.done) {
+        qemu_cond_wait(&iot->run_cond, &iot->lock);
+    }
+    qemu_mutex_unlock(&iot->lock);
+}
+
+/***********************************************************/
+/* creation */
+
+/* Start an event loop thread, id is NULL for one a device keeps to
+   itself */
+IOThread *iothread_new(const char *id)
+{
+    IOThread *iot;
+
+    if (id && iothread_find(id)) {
+        error_report("iothread '%s' already exists", id);
+        return NULL;
+    }
+
+    iot = qemu_mallocz(sizeof(*iot));
+    if (event_notifier_init(&iot->wakeup, 0) < 0) {
+        error_report("iothread: cannot create an event notifier");
+        qemu_free(iot);
+        return NULL;
+    }
+    iot->id = id ? qemu_strdup(id) : NULL;
+    qemu_mutex_init(&iot->lock);
+    qemu_cond_init(&iot->run_cond);
+    QLIST_INIT(&iot->bhs);
+    QLIST_INIT(&iot->handlers);
+    QTAILQ_INIT(&iot->timers);
+    if (id) {
+        QTAILQ_INSERT_TAIL(&iothreads, iot, next);
+    }
+
+    qemu_thread_create(&iot->thread, iothread_thread, iot);
+    return iot;
+}
+
+static void iothread_stop(void *opaque)
+{
+    IOThread *iot = opaque;
+
+    iot->stopping = true;
+}
+
+/* The users of iot must be gone */
+void iothread_destroy(IOThread *iot)
+{
+    IOThreadBH *bh, *pbh;
+    IOThreadHandler *ioh, *pioh;
+
+    iothread_run(iot, iothread_stop, iot);
+    qemu_thread_join(&iot->thread);
+
+    if (iot->id) {
+        QTAILQ_REMOVE(&iothreads, iot, next);
+    }
+    QLIST_FOREACH_SAFE(bh, &iot->bhs, next, pbh) {
+        qemu_free(bh);
+    }
+    QLIST_FOREACH_SAFE(ioh, &iot->handlers, next, pioh) {
+        qemu_free(ioh);
+    }
+    event_notifier_cleanup(&iot->wakeup);
+    qemu_cond_destroy(&iot->run_cond);
+    qemu_mutex_destroy(&iot->lock);
+    qemu_free(iot->pollfds);
+    qemu_free(iot->pollh);
+    qemu_free(iot->id);
+    qemu_free(iot);
+}
+
+IOThread *iothread_find(const char *id)
+{
+    IOThread *iot;
+
+    QTAILQ_FOREACH(iot, &iothreads, next) {
+        if (!strcmp(iot->id, id)) {
+            return iot;
+        }
+    }
+    return NULL;
+}
+
+const char *iothread_get_id(IOThread *iot)
+{
+    return iot->id;
+}
+
+/* -iothread id=<name> */
+int iothread_add(QemuOpts *opts)
+{
+    const char *id = qemu_opts_id(opts);
+
+    if (!id) {
+        error_report("iothread: no id specified");
+        return -1;
+    }
+    return iothread_new(id) ? 0 : -1;
+}
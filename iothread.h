@@ -0,0 +1,48 @@
+/*
+ * Event loop threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_IOTHREAD_H
+#define QEMU_IOTHREAD_H
+
+#include "qemu-common.h"
+#include "qemu-char.h"
+#include "qemu-option.h"
+#include "qemu-timer.h"
+
+typedef struct IOThread IOThread;
+typedef struct IOThreadBH IOThreadBH;
+typedef struct IOThreadTimer IOThreadTimer;
+
+int iothread_add(QemuOpts *opts);
+IOThread *iothread_find(const char *id);
+IOThread *iothread_new(const char *id);
+void iothread_destroy(IOThread *iot);
+const char *iothread_get_id(IOThread *iot);
+
+/* Run fn in the thread of iot and wait until it returns */
+void iothread_run(IOThread *iot, void (*fn)(void *opaque), void *opaque);
+
+/* Only in the thread of iot */
+void iothread_set_fd_handler(IOThread *iot, int fd, IOHandler *fd_read,
+                             IOHandler *fd_write, void *opaque);
+
+/* Bottom halves can be used from any thread */
+IOThreadBH *iothread_bh_new(IOThread *iot, QEMUBHFunc *cb, void *opaque);
+void iothread_bh_schedule(IOThreadBH *bh);
+void iothread_bh_cancel(IOThreadBH *bh);
+void iothread_bh_delete(IOThreadBH *bh);
+
+/* Only in the thread of iot.  Timers expire at a time of get_clock(), in
+   nanoseconds */
+IOThreadTimer *iothread_timer_new(IOThread *iot, QEMUTimerCB *cb,
+                                  void *opaque);
+void iothread_timer_mod(IOThreadTimer *ts, int64_t expire_time);
+void iothread_timer_del(IOThreadTimer *ts);
+void iothread_timer_free(IOThreadTimer *ts);
+
+#endif
@@ -68,3 +68,108 @@ size_t iov_size(const struct iovec *iov, const unsigned int iovcnt)
     }
     return len;
 }
+
+/* Fills size bytes from offset with fillc, returns how many were filled */
+size_t iov_memset(const struct iovec *iov, const unsigned int iovcnt,
+                  size_t offset, int fillc, size_t size)
+{
+    size_t done = 0;
+    unsigned int i;
+
+    for (i = 0; i < iovcnt && done < size; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        size_t len = MIN(iov[i].iov_len - offset, size - done);
+
+        memset(iov[i].iov_base + offset, fillc, len);
+        done += len;
+        offset = 0;
+    }
+    return done;
+}
+
+/* Copies size bytes from src_offset in one scatter list to dst_offset in
+   another, without going through a flat buffer; returns how many were
+   copied */
+size_t iov_copy_data(const struct iovec *dst_iov, unsigned int dst_cnt,
+                     size_t dst_offset, const struct iovec *src_iov,
+                     unsigned int src_cnt, size_t src_offset, size_t size)
+{
+    unsigned int d = 0, s = 0;
+    size_t done = 0;
+
+    while (d < dst_cnt && dst_offset >= dst_iov[d].iov_len) {
+        dst_offset -= dst_iov[d++].iov_len;
+    }
+    while (s < src_cnt && src_offset >= src_iov[s].iov_len) {
+        src_offset -= src_iov[s++].iov_len;
+    }
+    while (done < size && d < dst_cnt && s < src_cnt) {
+        size_t len = MIN(dst_iov[d].iov_len - dst_offset,
+                         src_iov[s].iov_len - src_offset);
+
+        len = MIN(len, size - done);
+        memcpy(dst_iov[d].iov_base + dst_offset,
+               src_iov[s].iov_base + src_offset, len);
+        done += len;
+        dst_offset += len;
+        src_offset += len;
+        if (dst_offset == dst_iov[d].iov_len) {
+            dst_offset = 0;
+            d++;
+        }
+        if (src_offset == src_iov[s].iov_len) {
+            src_offset = 0;
+            s++;
+        }
+    }
+    return done;
+}
+
+/* Makes dst_iov describe size bytes of iov from offset, pointing into the
+   same memory; returns the number of elements used, at most dst_cnt */
+unsigned int iov_copy(struct iovec *dst_iov, unsigned int dst_cnt,
+                      const struct iovec *iov, unsigned int iovcnt,
+                      size_t offset, size_t size)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < iovcnt && n < dst_cnt && size; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        size_t len = MIN(iov[i].iov_len - offset, size);
+
+        dst_iov[n].iov_base = iov[i].iov_base + offset;
+        dst_iov[n].iov_len = len;
+        n++;
+        size -= len;
+        offset = 0;
+    }
+    return n;
+}
+
+/* Drops size bytes from the front of the scatter list, by advancing
+   *iov and trimming its first element in place; returns how many were
+   dropped */
+size_t iov_skip(struct iovec **iov, unsigned int *iovcnt, size_t size)
+{
+    size_t done = 0;
+
+    while (*iovcnt && done < size) {
+        struct iovec *cur = *iov;
+
+        if (cur->iov_len > size - done) {
+            cur->iov_base += size - done;
+            cur->iov_len -= size - done;
+            return size;
+        }
+        done += cur->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    return done;
+}
@@ -17,3 +17,12 @@ size_t iov_from_buf(struct iovec *iov, unsigned int iovcnt,
 size_t iov_to_buf(const struct iovec *iov, const unsigned int iovcnt,
                   void *buf, size_t offset, size_t size);
 size_t iov_size(const struct iovec *iov, const unsigned int iovcnt);
+size_t iov_memset(const struct iovec *iov, const unsigned int iovcnt,
+                  size_t offset, int fillc, size_t size);
+size_t iov_copy_data(const struct iovec *dst_iov, unsigned int dst_cnt,
+                     size_t dst_offset, const struct iovec *src_iov,
+                     unsigned int src_cnt, size_t src_offset, size_t size);
+unsigned int iov_copy(struct iovec *dst_iov, unsigned int dst_cnt,
+                      const struct iovec *iov, unsigned int iovcnt,
+                      size_t offset, size_t size);
+size_t iov_skip(struct iovec **iov, unsigned int *iovcnt, size_t size);
@@ -575,3 +575,433 @@ QObject *json_parser_parse(QList *tokens, va_list *ap)
 
     return result;
 }
+
+/**
+ * Single-pass parser
+ *
+ * json_parser_parse_buf() works directly on the bytes of a complete
+ * message.  Tokens are recognized with a character class table and a
+ * switch on their first byte, and every value is built as soon as its
+ * last byte has been seen, so no token objects are allocated and string
+ * contents are copied in runs instead of one character at a time.
+ */
+
+#define JSON_MAX_NESTING 1024
+
+enum {
+    JSON_CLASS_WS    = 0x01,
+    JSON_CLASS_DIGIT = 0x02,
+    JSON_CLASS_HEX   = 0x04,
+    JSON_CLASS_ALPHA = 0x08,
+    /* may appear unescaped in either kind of string */
+    JSON_CLASS_PLAIN = 0x10,
+};
+
+static const uint8_t json_char_class[256] = {
+    [1 ... 0xFF] = JSON_CLASS_PLAIN,
+    [' '] = JSON_CLASS_PLAIN | JSON_CLASS_WS,
+    ['\t'] = JSON_CLASS_PLAIN | JSON_CLASS_WS,
+    ['\r'] = JSON_CLASS_PLAIN | JSON_CLASS_WS,
+    ['\n'] = JSON_CLASS_PLAIN | JSON_CLASS_WS,
+    ['0' ... '9'] = JSON_CLASS_PLAIN | JSON_CLASS_DIGIT | JSON_CLASS_HEX,
+    ['a' ... 'f'] = JSON_CLASS_PLAIN | JSON_CLASS_ALPHA | JSON_CLASS_HEX,
+    ['g' ... 'z'] = JSON_CLASS_PLAIN | JSON_CLASS_ALPHA,
+    ['A' ... 'F'] = JSON_CLASS_PLAIN | JSON_CLASS_HEX,
+    ['"'] = 0,
+    ['\''] = 0,
+    ['\\'] = 0,
+};
+
+typedef struct JSONBufParser
+{
+    const char *ptr;
+    const char *end;
+    va_list *ap;
+    int depth;
+} JSONBufParser;
+
+static QObject *buf_parse_value(JSONBufParser *p);
+
+static int buf_is(JSONBufParser *p, int class)
+{
+    return p->ptr < p->end && (json_char_class[(uint8_t)*p->ptr] & class);
+}
+
+/* Skip whitespace and return the next byte, or -1 at the end of input */
+static int buf_peek(JSONBufParser *p)
+{
+    while (buf_is(p, JSON_CLASS_WS)) {
+        p->ptr++;
+    }
+    return p->ptr < p->end ? (uint8_t)*p->ptr : -1;
+}
+
+static int buf_match(JSONBufParser *p, const char *word)
+{
+    size_t len = strlen(word);
+
+    if ((size_t)(p->end - p->ptr) < len || memcmp(p->ptr, word, len) != 0) {
+        return 0;
+    }
+    p->ptr += len;
+    return 1;
+}
+
+static QString *buf_parse_string(JSONBufParser *p)
+{
+    char quote = *p->ptr++;
+    QString *str = qstring_new();
+
+    for (;;) {
+        const char *run = p->ptr;
+        char ch;
+
+        while (buf_is(p, JSON_CLASS_PLAIN)) {
+            p->ptr++;
+        }
+        if (p->ptr > run) {
+            qstring_append_len(str, run, p->ptr - run);
+        }
+        if (p->ptr == p->end) {
+            goto out;
+        }
+
+        ch = *p->ptr++;
+        if (ch == quote) {
+            return str;
+        }
+        if (ch == '"' || ch == '\'') {
+            qstring_append_chr(str, ch);
+            continue;
+        }
+        if (ch != '\\' || p->ptr == p->end) {
+            goto out;
+        }
+
+        switch (*p->ptr++) {
+        case '"':
+            qstring_append_chr(str, '"');
+            break;
+        case '\'':
+            qstring_append_chr(str, '\'');
+            break;
+        case '\\':
+            qstring_append_chr(str, '\\');
+            break;
+        case '/':
+            qstring_append_chr(str, '/');
+            break;
+        case 'b':
+            qstring_append_chr(str, '\b');
+            break;
+        case 'f':
+            qstring_append_chr(str, '\f');
+            break;
+        case 'n':
+            qstring_append_chr(str, '\n');
+            break;
+        case 'r':
+            qstring_append_chr(str, '\r');
+            break;
+        case 't':
+            qstring_append_chr(str, '\t');
+            break;
+        case 'u': {
+            uint16_t unicode_char = 0;
+            char utf8_char[4];
+            int i;
+
+            for (i = 0; i < 4; i++) {
+                if (!buf_is(p, JSON_CLASS_HEX)) {
+                    parse_error(NULL, NULL,
+                                "invalid hex escape sequence in string");
+                    goto out;
+                }
+                unicode_char = (unicode_char << 4) | hex2decimal(*p->ptr++);
+            }
+
+            wchar_to_utf8(unicode_char, utf8_char, sizeof(utf8_char));
+            qstring_append(str, utf8_char);
+        }   break;
+        default:
+            parse_error(NULL, NULL, "invalid escape sequence in string");
+            goto out;
+        }
+    }
+
+out:
+    QDECREF(str);
+    return NULL;
+}
+
+/*
+ * -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][-+]?[0-9]+)?, except that like the
+ * token table in json-lexer.c an exponent is not accepted right after a
+ * bare zero.
+ */
+static QObject *buf_parse_number(JSONBufParser *p)
+{
+    const char *start = p->ptr;
+    char tmp[64], *str;
+    int is_float = 0, zero;
+    QObject *obj;
+
+    if (*p->ptr == '-') {
+        p->ptr++;
+    }
+    if (!buf_is(p, JSON_CLASS_DIGIT)) {
+        return NULL;
+    }
+    zero = *p->ptr == '0';
+    if (zero) {
+        p->ptr++;
+        if (buf_is(p, JSON_CLASS_DIGIT)) {
+            return NULL;
+        }
+    } else {
+        while (buf_is(p, JSON_CLASS_DIGIT)) {
+            p->ptr++;
+        }
+    }
+
+    if (p->ptr < p->end && *p->ptr == '.') {
+        p->ptr++;
+        if (!buf_is(p, JSON_CLASS_DIGIT)) {
+            return NULL;
+        }
+        while (buf_is(p, JSON_CLASS_DIGIT)) {
+            p->ptr++;
+        }
+        is_float = 1;
+        zero = 0;
+    }
+
+    if (!zero && p->ptr < p->end && (*p->ptr == 'e' || *p->ptr == 'E')) {
+        p->ptr++;
+        if (p->ptr < p->end && (*p->ptr == '-' || *p->ptr == '+')) {
+            p->ptr++;
+        }
+        if (!buf_is(p, JSON_CLASS_DIGIT)) {
+            return NULL;
+        }
+        while (buf_is(p, JSON_CLASS_DIGIT)) {
+            p->ptr++;
+        }
+        is_float = 1;
+    }
+
+    /* the buffer need not be NUL terminated */
+    if ((size_t)(p->ptr - start) < sizeof(tmp)) {
+        str = tmp;
+        memcpy(str, start, p->ptr - start);
+        str[p->ptr - start] = 0;
+    } else {
+        str = qemu_strndup(start, p->ptr - start);
+    }
+
+    if (is_float) {
+        /* FIXME dependent on locale */
+        obj = QOBJECT(qfloat_from_double(strtod(str, NULL)));
+    } else {
+        obj = QOBJECT(qint_from_int(strtoll(str, NULL, 10)));
+    }
+
+    if (str != tmp) {
+        qemu_free(str);
+    }
+    return obj;
+}
+
+static QObject *buf_parse_keyword(JSONBufParser *p)
+{
+    const char *start = p->ptr;
+
+    while (buf_is(p, JSON_CLASS_ALPHA)) {
+        p->ptr++;
+    }
+
+    if (p->ptr - start == 4 && memcmp(start, "true", 4) == 0) {
+        return QOBJECT(qbool_from_int(true));
+    } else if (p->ptr - start == 5 && memcmp(start, "false", 5) == 0) {
+        return QOBJECT(qbool_from_int(false));
+    }
+
+    parse_error(NULL, NULL, "invalid keyword `%.*s'",
+                (int)(p->ptr - start), start);
+    return NULL;
+}
+
+static QObject *buf_parse_escape(JSONBufParser *p)
+{
+    va_list *ap = p->ap;
+
+    if (ap == NULL) {
+        return NULL;
+    }
+
+    if (buf_match(p, "%p")) {
+        return va_arg(*ap, QObject *);
+    } else if (buf_match(p, "%i")) {
+        return QOBJECT(qbool_from_int(va_arg(*ap, int)));
+    } else if (buf_match(p, "%d")) {
+        return QOBJECT(qint_from_int(va_arg(*ap, int)));
+    } else if (buf_match(p, "%ld")) {
+        return QOBJECT(qint_from_int(va_arg(*ap, long)));
+    } else if (buf_match(p, "%lld") || buf_match(p, "%I64d")) {
+        return QOBJECT(qint_from_int(va_arg(*ap, long long)));
+    } else if (buf_match(p, "%s")) {
+        return QOBJECT(qstring_from_str(va_arg(*ap, const char *)));
+    } else if (buf_match(p, "%f")) {
+        return QOBJECT(qfloat_from_double(va_arg(*ap, double)));
+    }
+
+    return NULL;
+}
+
+static QObject *buf_parse_object(JSONBufParser *p)
+{
+    QDict *dict = qdict_new();
+    QObject *key = NULL, *value;
+    int ch;
+
+    p->ptr++;
+    if (buf_peek(p) == '}') {
+        p->ptr++;
+        return QOBJECT(dict);
+    }
+
+    for (;;) {
+        key = buf_parse_value(p);
+        if (!key || qobject_type(key) != QTYPE_QSTRING) {
+            parse_error(NULL, NULL, "key is not a string in object");
+            goto out;
+        }
+
+        if (buf_peek(p) != ':') {
+            parse_error(NULL, NULL, "missing : in object pair");
+            goto out;
+        }
+        p->ptr++;
+
+        value = buf_parse_value(p);
+        if (value == NULL) {
+            parse_error(NULL, NULL, "Missing value in dict");
+            goto out;
+        }
+
+        qdict_put_obj(dict, qstring_get_str(qobject_to_qstring(key)), value);
+        qobject_decref(key);
+        key = NULL;
+
+        ch = buf_peek(p);
+        if (ch == '}') {
+            p->ptr++;
+            return QOBJECT(dict);
+        }
+        if (ch != ',') {
+            parse_error(NULL, NULL, "expected separator in dict");
+            goto out;
+        }
+        p->ptr++;
+    }
+
+out:
+    qobject_decref(key);
+    QDECREF(dict);
+    return NULL;
+}
+
+static QObject *buf_parse_array(JSONBufParser *p)
+{
+    QList *list = qlist_new();
+    QObject *obj;
+    int ch;
+
+    p->ptr++;
+    if (buf_peek(p) == ']') {
+        p->ptr++;
+        return QOBJECT(list);
+    }
+
+    for (;;) {
+        obj = buf_parse_value(p);
+        if (obj == NULL) {
+            parse_error(NULL, NULL, "expecting value");
+            goto out;
+        }
+        qlist_append_obj(list, obj);
+
+        ch = buf_peek(p);
+        if (ch == ']') {
+            p->ptr++;
+            return QOBJECT(list);
+        }
+        if (ch != ',') {
+            parse_error(NULL, NULL, "expected separator in list");
+            goto out;
+        }
+        p->ptr++;
+    }
+
+out:
+    QDECREF(list);
+    return NULL;
+}
+
+static QObject *buf_parse_value(JSONBufParser *p)
+{
+    QObject *obj;
+
+    switch (buf_peek(p)) {
+    case '{':
+    case '[':
+        if (p->depth == JSON_MAX_NESTING) {
+            parse_error(NULL, NULL, "too deeply nested");
+            return NULL;
+        }
+        p->depth++;
+        if (*p->ptr == '{') {
+            obj = buf_parse_object(p);
+        } else {
+            obj = buf_parse_array(p);
+        }
+        p->depth--;
+        return obj;
+    case '"':
+    case '\'':
+        return QOBJECT(buf_parse_string(p));
+    case '-':
+    case '0' ... '9':
+        return buf_parse_number(p);
+    case 'a' ... 'z':
+        return buf_parse_keyword(p);
+    case '%':
+        return buf_parse_escape(p);
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * json_parser_parse_buf(): Parse the JSON value in the LEN bytes at BUF
+ *
+ * The buffer must hold exactly one value, optionally surrounded by
+ * whitespace, and need not be NUL terminated.  Returns NULL on error.
+ */
+QObject *json_parser_parse_buf(const char *buf, size_t len, va_list *ap)
+{
+    JSONBufParser p = {
+        .ptr = buf,
+        .end = buf + len,
+        .ap = ap,
+    };
+    QObject *result;
+
+    result = buf_parse_value(&p);
+    if (result && buf_peek(&p) != -1) {
+        qobject_decref(result);
+        return NULL;
+    }
+
+    return result;
+}
@@ -18,5 +18,6 @@
 #include "qlist.h"
 
 QObject *json_parser_parse(QList *tokens, va_list *ap);
+QObject *json_parser_parse_buf(const char *buf, size_t len, va_list *ap);
 
 #endif
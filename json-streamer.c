@@ -86,3 +86,189 @@ void json_message_parser_destroy(JSONMessageParser *parser)
     json_lexer_destroy(&parser->lexer);
     QDECREF(parser->tokens);
 }
+
+/*
+ * Message splitter
+ *
+ * Scalars at the top level end at the first byte that cannot be part of
+ * them; stray closing brackets are passed on as a message of their own so
+ * that the parser reports them instead of the splitter getting stuck.
+ */
+
+enum {
+    SPLIT_START,
+    SPLIT_SCALAR,
+    SPLIT_VALUE,
+    SPLIT_DQ_STRING,
+    SPLIT_DQ_ESCAPE,
+    SPLIT_SQ_STRING,
+    SPLIT_SQ_ESCAPE,
+};
+
+enum {
+    SPLIT_OTHER = 0,
+    SPLIT_WS,
+    SPLIT_OPEN,
+    SPLIT_CLOSE,
+    SPLIT_DQ,
+    SPLIT_SQ,
+    SPLIT_BACKSLASH,
+    SPLIT_SEPARATOR,
+};
+
+static const uint8_t json_split_class[256] = {
+    [' '] = SPLIT_WS,
+    ['\t'] = SPLIT_WS,
+    ['\r'] = SPLIT_WS,
+    ['\n'] = SPLIT_WS,
+    ['{'] = SPLIT_OPEN,
+    ['['] = SPLIT_OPEN,
+    ['}'] = SPLIT_CLOSE,
+    [']'] = SPLIT_CLOSE,
+    ['"'] = SPLIT_DQ,
+    ['\''] = SPLIT_SQ,
+    ['\\'] = SPLIT_BACKSLASH,
+    [','] = SPLIT_SEPARATOR,
+    [':'] = SPLIT_SEPARATOR,
+};
+
+void json_message_splitter_init(JSONMessageSplitter *splitter,
+                                void (*func)(JSONMessageSplitter *,
+                                             const char *, size_t))
+{
+    splitter->emit = func;
+    splitter->state = SPLIT_START;
+    splitter->depth = 0;
+    splitter->buf = NULL;
+    splitter->len = 0;
+    splitter->size = 0;
+}
+
+static void json_message_splitter_save(JSONMessageSplitter *splitter,
+                                       const char *buffer, size_t size)
+{
+    if (splitter->len + size > splitter->size) {
+        splitter->size = MAX(splitter->size * 2, splitter->len + size);
+        splitter->buf = qemu_realloc(splitter->buf, splitter->size);
+    }
+    memcpy(splitter->buf + splitter->len, buffer, size);
+    splitter->len += size;
+}
+
+/* Pass on the message made of the saved bytes plus BUFFER[0..SIZE) */
+static void json_message_splitter_emit(JSONMessageSplitter *splitter,
+                                       const char *buffer, size_t size)
+{
+    splitter->state = SPLIT_START;
+    splitter->depth = 0;
+
+    if (splitter->len == 0) {
+        splitter->emit(splitter, buffer, size);
+        return;
+    }
+
+    json_message_splitter_save(splitter, buffer, size);
+    size = splitter->len;
+    splitter->len = 0;
+    splitter->emit(splitter, splitter->buf, size);
+}
+
+void json_message_splitter_feed(JSONMessageSplitter *splitter,
+                                const char *buffer, size_t size)
+{
+    size_t start = 0, i;
+
+    for (i = 0; i < size; i++) {
+        int class = json_split_class[(uint8_t)buffer[i]];
+
+        switch (splitter->state) {
+        case SPLIT_START:
+            start = i;
+            switch (class) {
+            case SPLIT_WS:
+                break;
+            case SPLIT_OPEN:
+                splitter->depth = 1;
+                splitter->state = SPLIT_VALUE;
+                break;
+            case SPLIT_CLOSE:
+            case SPLIT_SEPARATOR:
+                json_message_splitter_emit(splitter, buffer + i, 1);
+                break;
+            case SPLIT_DQ:
+                splitter->state = SPLIT_DQ_STRING;
+                break;
+            case SPLIT_SQ:
+                splitter->state = SPLIT_SQ_STRING;
+                break;
+            default:
+                splitter->state = SPLIT_SCALAR;
+                break;
+            }
+            break;
+        case SPLIT_SCALAR:
+            if (class != SPLIT_OTHER) {
+                json_message_splitter_emit(splitter, buffer + start,
+                                           i - start);
+                i--;
+            }
+            break;
+        case SPLIT_VALUE:
+            switch (class) {
+            case SPLIT_OPEN:
+                splitter->depth++;
+                break;
+            case SPLIT_CLOSE:
+                if (--splitter->depth == 0) {
+                    json_message_splitter_emit(splitter, buffer + start,
+                                               i + 1 - start);
+                }
+                break;
+            case SPLIT_DQ:
+                splitter->state = SPLIT_DQ_STRING;
+                break;
+            case SPLIT_SQ:
+                splitter->state = SPLIT_SQ_STRING;
+                break;
+            }
+            break;
+        case SPLIT_DQ_STRING:
+        case SPLIT_SQ_STRING:
+            if (class == SPLIT_BACKSLASH) {
+                splitter->state++;
+            } else if (class == (splitter->state == SPLIT_DQ_STRING ?
+                                 SPLIT_DQ : SPLIT_SQ)) {
+                if (splitter->depth) {
+                    splitter->state = SPLIT_VALUE;
+                } else {
+                    json_message_splitter_emit(splitter, buffer + start,
+                                               i + 1 - start);
+                }
+            }
+            break;
+        case SPLIT_DQ_ESCAPE:
+        case SPLIT_SQ_ESCAPE:
+            splitter->state--;
+            break;
+        }
+    }
+
+    if (splitter->state != SPLIT_START) {
+        json_message_splitter_save(splitter, buffer + start, size - start);
+    }
+}
+
+void json_message_splitter_flush(JSONMessageSplitter *splitter)
+{
+    if (splitter->state == SPLIT_SCALAR) {
+        json_message_splitter_emit(splitter, NULL, 0);
+    }
+    splitter->state = SPLIT_START;
+    splitter->depth = 0;
+    splitter->len = 0;
+}
+
+void json_message_splitter_destroy(JSONMessageSplitter *splitter)
+{
+    qemu_free(splitter->buf);
+}
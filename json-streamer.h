@@ -36,4 +36,30 @@ int json_message_parser_flush(JSONMessageParser *parser);
 
 void json_message_parser_destroy(JSONMessageParser *parser);
 
+/*
+ * JSONMessageSplitter only looks for the end of each top-level value and
+ * hands the raw bytes of the whole message to json_parser_parse_buf().
+ */
+typedef struct JSONMessageSplitter
+{
+    void (*emit)(struct JSONMessageSplitter *splitter,
+                 const char *buf, size_t len);
+    int state;
+    int depth;
+    char *buf;
+    size_t len;
+    size_t size;
+} JSONMessageSplitter;
+
+void json_message_splitter_init(JSONMessageSplitter *splitter,
+                                void (*func)(JSONMessageSplitter *,
+                                             const char *, size_t));
+
+void json_message_splitter_feed(JSONMessageSplitter *splitter,
+                                const char *buffer, size_t size);
+
+void json_message_splitter_flush(JSONMessageSplitter *splitter);
+
+void json_message_splitter_destroy(JSONMessageSplitter *splitter);
+
 #endif
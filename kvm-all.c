@@ -27,6 +27,15 @@
 #include "gdbstub.h"
 #include "kvm.h"
 #include "bswap.h"
+#include "ioport.h"
+#include "host-utils.h"
+#include "monitor.h"
+#include "qjson.h"
+#include "qlist.h"
+#include "qint.h"
+#ifdef CONFIG_IOTHREAD
+#include "qemu-thread.h"
+#endif
 
 /* This check must be after config-host.h is included */
 #ifdef CONFIG_EVENTFD
@@ -53,17 +62,55 @@ typedef struct KVMSlot
     ram_addr_t phys_offset;
     int slot;
     int flags;
+    unsigned long *dirty_bitmap;    /* buffer for KVM_GET_DIRTY_LOG */
 } KVMSlot;
 
 typedef struct kvm_dirty_log KVMDirtyLog;
 
+/*
+ * Profile of the port writes that exit to userspace, used to coalesce hot
+ * write-only ports without the device asking for it.  Entries are direct
+ * mapped on the port number and start over when another port takes them.
+ */
+#define KVM_PIO_PROFILE_SIZE    64
+#define KVM_PIO_PROFILE_WINDOW  8192    /* port I/O exits between reviews */
+#define KVM_PIO_HOT_WRITES      1024    /* writes in a window to coalesce */
+
+typedef struct KVMPioProfile {
+    uint32_t port;
+    uint32_t writes;
+    int size;
+} KVMPioProfile;
+
+/* An ioeventfd that the kernel did not take, signalled by the vcpu thread */
+typedef struct KVMPioNotifier {
+    uint16_t addr;
+    uint16_t val;
+    int fd;
+    QLIST_ENTRY(KVMPioNotifier) next;
+} KVMPioNotifier;
+
+/* A range of MMIO reads handled by the vcpu thread without the mutex */
+#define KVM_MMIO_UNLOCKED_MAX   4
+
+typedef struct KVMMMIOUnlocked {
+    uint64_t addr;
+    uint64_t size;
+    KVMMMIOReadFunc *read;
+    void *opaque;
+} KVMMMIOUnlocked;
+
 struct KVMState
 {
     KVMSlot slots[32];
     int fd;
     int vmfd;
     int coalesced_mmio;
+    int coalesced_pio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
+    KVMPioProfile pio_profile[KVM_PIO_PROFILE_SIZE];
+    int pio_profile_exits;
+    unsigned long pio_read_seen[MAX_IOPORTS / HOST_LONG_BITS];
     int broken_set_mem_region;
     int migration_log;
     int vcpu_events;
@@ -76,6 +123,14 @@ struct KVMState
     int pit_in_kernel;
     int xsave, xcrs;
     int many_ioeventfds;
+    KVMMMIOUnlocked mmio_unlocked[KVM_MMIO_UNLOCKED_MAX];
+    int nr_mmio_unlocked;
+#ifdef CONFIG_IOTHREAD
+    QemuMutex pio_notifier_lock;
+    QemuMutex pio_profile_lock;
+    QLIST_HEAD(, KVMPioNotifier) pio_notifiers;
+    int nr_pio_notifiers;
+#endif
 };
 
 KVMState *kvm_state;
@@ -195,6 +250,43 @@ int kvm_pit_in_kernel(void)
     return kvm_state->pit_in_kernel;
 }
 
+/*
+ * Exit statistics, per vcpu: how often each exit reason and each hot port
+ * or MMIO address comes up, and how long userspace takes from the exit to
+ * the next KVM_RUN.  The vcpu thread updates them without a lock, the
+ * monitor reads them as they are.
+ */
+#define KVM_EXIT_STATS_REASONS  32      /* later reasons share the last */
+#define KVM_EXIT_STATS_BUCKETS  32      /* log2 of the nanoseconds */
+#define KVM_EXIT_STATS_ADDRS    64
+#define KVM_EXIT_STATS_PROBES   4
+
+typedef struct KVMExitHistogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint32_t buckets[KVM_EXIT_STATS_BUCKETS];
+} KVMExitHistogram;
+
+typedef struct KVMExitAddrStats {
+    uint64_t addr;
+    int mmio;
+    KVMExitHistogram hist;
+} KVMExitAddrStats;
+
+typedef struct KVMExitStats KVMExitStats;
+
+struct KVMExitStats {
+    int64_t exit_at;            /* 0 unless an exit is being handled */
+    uint32_t reason;
+    int type;                   /* KVM_EXIT_IO, KVM_EXIT_MMIO, or -1 */
+    uint64_t addr;
+    KVMExitHistogram reasons[KVM_EXIT_STATS_REASONS];
+    /* open addressing with a few probes; an address that finds no room
+       takes over the probed entry with the fewest exits, so that a hot
+       address shows up even after the firmware has filled the table */
+    KVMExitAddrStats addrs[KVM_EXIT_STATS_ADDRS];
+};
+
 int kvm_init_vcpu(CPUState *env)
 {
     KVMState *s = kvm_state;
@@ -232,6 +324,8 @@ int kvm_init_vcpu(CPUState *env)
             (void *)env->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    env->kvm_exit_stats = qemu_mallocz(sizeof(*env->kvm_exit_stats));
+
     ret = kvm_arch_init_vcpu(env);
     if (ret == 0) {
         qemu_register_reset(kvm_reset_vcpu, env);
@@ -314,45 +408,60 @@ static int kvm_set_migration_log(int enable)
 }
 
 /* get kvm's dirty pages bitmap and update qemu's */
-static int kvm_get_dirty_pages_log_range(unsigned long start_addr,
-                                         unsigned long *bitmap,
-                                         unsigned long offset,
-                                         unsigned long mem_size)
+static int kvm_slot_sync_dirty_bitmap(KVMState *s, KVMSlot *mem)
 {
-    unsigned int i, j;
-    unsigned long page_number, addr, addr1, c;
-    ram_addr_t ram_addr;
-    unsigned int len = ((mem_size / TARGET_PAGE_SIZE) + HOST_LONG_BITS - 1) /
-        HOST_LONG_BITS;
+    ram_addr_t pages = mem->memory_size >> TARGET_PAGE_BITS;
+    ram_addr_t i;
+    uint64_t bits;
+    KVMDirtyLog d;
 
     /*
-     * bitmap-traveling is faster than memory-traveling (for addr...)
-     * especially when most of the memory is not dirty.
+     * The buffer lives as long as the slot.  KVM rewrites all of it on
+     * every call, and the rounding up to whole 64-bit words beyond that
+     * stays zero.
      */
-    for (i = 0; i < len; i++) {
-        if (bitmap[i] != 0) {
-            c = leul_to_cpu(bitmap[i]);
-            do {
-                j = ffsl(c) - 1;
-                c &= ~(1ul << j);
-                page_number = i * HOST_LONG_BITS + j;
-                addr1 = page_number * TARGET_PAGE_SIZE;
-                addr = offset + addr1;
-                ram_addr = cpu_get_physical_page_desc(addr);
-                cpu_physical_memory_set_dirty(ram_addr);
-            } while (c != 0);
+    if (!mem->dirty_bitmap) {
+        mem->dirty_bitmap = qemu_mallocz(((pages + 63) / 64) * 8);
+    }
+
+    d.dirty_bitmap = mem->dirty_bitmap;
+    d.slot = mem->slot;
+    if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
+        DPRINTF("ioctl failed %d\n", errno);
+        return -1;
+    }
+
+    /*
+     * A slot is contiguous in ram_addr_t too, so the bitmap is merged 64
+     * pages at a time without looking up each page, and the mostly clean
+     * words cost a single test.
+     */
+    for (i = 0; i < pages; i += 64) {
+        bits = leul_to_cpu(mem->dirty_bitmap[i / HOST_LONG_BITS]);
+#if HOST_LONG_BITS == 32
+        bits |= (uint64_t)leul_to_cpu(mem->dirty_bitmap[i / 32 + 1]) << 32;
+#endif
+        if (bits) {
+            cpu_physical_memory_set_dirty_bits(mem->phys_offset +
+                                               (i << TARGET_PAGE_BITS), bits);
         }
     }
     return 0;
 }
 
-#define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
+static int kvm_slot_is_logging(KVMState *s, KVMSlot *mem)
+{
+    return s->migration_log || (mem->flags & KVM_MEM_LOG_DIRTY_PAGES);
+}
 
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using cpu_physical_memory_set_dirty().
  * This means all bits are set to dirty.
  *
+ * KVM hands out and clears the log a whole slot at a time, so only the
+ * slots overlapping the range are synced, but all of each one is.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
  */
@@ -360,42 +469,21 @@ static int kvm_physical_sync_dirty_bitmap(target_phys_addr_t start_addr,
                                           target_phys_addr_t end_addr)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
-    KVMDirtyLog d;
     KVMSlot *mem;
-    int ret = 0;
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
         if (mem == NULL) {
             break;
         }
-
-        size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS), HOST_LONG_BITS) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = qemu_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = qemu_realloc(d.dirty_bitmap, size);
-        }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
-
-        d.slot = mem->slot;
-
-        if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
-            DPRINTF("ioctl failed %d\n", errno);
-            ret = -1;
-            break;
+        if (kvm_slot_is_logging(s, mem) &&
+            kvm_slot_sync_dirty_bitmap(s, mem) < 0) {
+            return -1;
         }
-
-        kvm_get_dirty_pages_log_range(mem->start_addr, d.dirty_bitmap,
-                                      mem->start_addr, mem->memory_size);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    qemu_free(d.dirty_bitmap);
 
-    return ret;
+    return 0;
 }
 
 int kvm_coalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
@@ -408,6 +496,7 @@ int kvm_coalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
 
         zone.addr = start;
         zone.size = size;
+        zone.pad = 0;
 
         ret = kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
     }
@@ -425,6 +514,7 @@ int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
 
         zone.addr = start;
         zone.size = size;
+        zone.pad = 0;
 
         ret = kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
     }
@@ -432,6 +522,138 @@ int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
     return ret;
 }
 
+/* Port writes in the range are queued in the coalesced MMIO ring, and
+   reach the device at the next exit or flush */
+int kvm_coalesce_pio_region(pio_addr_t start, uint32_t size)
+{
+    int ret = -ENOSYS;
+#ifdef KVM_CAP_COALESCED_PIO
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        ret = kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+    }
+#endif
+
+    return ret;
+}
+
+int kvm_uncoalesce_pio_region(pio_addr_t start, uint32_t size)
+{
+    int ret = -ENOSYS;
+#ifdef KVM_CAP_COALESCED_PIO
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        ret = kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    }
+#endif
+
+    return ret;
+}
+
+static int kvm_pio_read_seen(KVMState *s, pio_addr_t port)
+{
+    return (s->pio_read_seen[port / HOST_LONG_BITS] >>
+            (port % HOST_LONG_BITS)) & 1;
+}
+
+/* The profile is also updated by the exits that complete without
+   qemu_global_mutex */
+static void kvm_pio_profile_lock(KVMState *s)
+{
+#ifdef CONFIG_IOTHREAD
+    qemu_mutex_lock(&s->pio_profile_lock);
+#endif
+}
+
+static void kvm_pio_profile_unlock(KVMState *s)
+{
+#ifdef CONFIG_IOTHREAD
+    qemu_mutex_unlock(&s->pio_profile_lock);
+#endif
+}
+
+/* Coalesce the ports that took KVM_PIO_HOT_WRITES writes in the last
+   window.  Only ports that have no read handler and were never read are
+   taken: nothing can poll them for the effect of a write, so the only
+   difference for the guest is that the effect comes at the next exit.
+   Called with qemu_global_mutex held. */
+static void kvm_pio_profile_review(KVMState *s)
+{
+    KVMPioProfile profile[KVM_PIO_PROFILE_SIZE];
+    int i, j;
+
+    if (!s->coalesced_pio) {
+        return;
+    }
+    kvm_pio_profile_lock(s);
+    if (s->pio_profile_exits < KVM_PIO_PROFILE_WINDOW) {
+        kvm_pio_profile_unlock(s);
+        return;
+    }
+    memcpy(profile, s->pio_profile, sizeof(profile));
+    memset(s->pio_profile, 0, sizeof(s->pio_profile));
+    s->pio_profile_exits = 0;
+    kvm_pio_profile_unlock(s);
+
+    for (i = 0; i < KVM_PIO_PROFILE_SIZE; i++) {
+        KVMPioProfile *p = &profile[i];
+
+        if (p->writes < KVM_PIO_HOT_WRITES) {
+            continue;
+        }
+        for (j = 0; j < p->size; j++) {
+            pio_addr_t port = (p->port + j) & IOPORTS_MASK;
+
+            if (kvm_pio_read_seen(s, port) || ioport_has_read_handler(port)) {
+                break;
+            }
+        }
+        if (j == p->size && kvm_coalesce_pio_region(p->port, p->size) == 0) {
+            DPRINTF("coalescing port 0x%x/%d after %d writes\n",
+                    p->port, p->size, p->writes);
+        }
+    }
+}
+
+static void kvm_pio_profile_exit(KVMState *s, struct kvm_run *run)
+{
+    KVMPioProfile *p;
+    uint16_t port = run->io.port;
+
+    if (!s->coalesced_pio) {
+        return;
+    }
+    kvm_pio_profile_lock(s);
+    if (run->io.direction == KVM_EXIT_IO_IN) {
+        s->pio_read_seen[port / HOST_LONG_BITS] |= 1ul << (port % HOST_LONG_BITS);
+    } else if (run->io.count == 1) {
+        p = &s->pio_profile[port % KVM_PIO_PROFILE_SIZE];
+        if (p->port != port) {
+            p->port = port;
+            p->writes = 0;
+            p->size = 0;
+        }
+        p->writes++;
+        p->size = MAX(p->size, run->io.size);
+    }
+    s->pio_profile_exits++;
+    kvm_pio_profile_unlock(s);
+}
+
 int kvm_check_extension(KVMState *s, unsigned int extension)
 {
     int ret;
@@ -451,7 +673,9 @@ static int kvm_check_many_ioeventfds(void)
      * support SIGIO it cannot interrupt the vcpu.
      *
      * Older kernels have a 6 device limit on the KVM io bus.  Find out so we
-     * can avoid creating too many ioeventfds.
+     * can avoid creating too many ioeventfds.  Port I/O ioeventfds past the
+     * limit are signalled from the vcpu thread, so this only fails without
+     * ioeventfd support in the headers.
      */
 #if defined(CONFIG_EVENTFD) && defined(CONFIG_IOTHREAD)
     int ioeventfds[7];
@@ -523,6 +747,13 @@ static void kvm_set_phys_mem(target_phys_addr_t start_addr, ram_addr_t size,
             return;
         }
 
+        /* the dirty log goes away with the slot */
+        if (kvm_slot_is_logging(s, mem)) {
+            kvm_slot_sync_dirty_bitmap(s, mem);
+        }
+        qemu_free(mem->dirty_bitmap);
+        mem->dirty_bitmap = NULL;
+
         old = *mem;
 
         /* unregister the overlapping slot */
@@ -713,6 +944,10 @@ int kvm_init(void)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+#ifdef KVM_CAP_COALESCED_PIO
+    s->coalesced_pio = s->coalesced_mmio &&
+                       kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
+#endif
 
     s->broken_set_mem_region = 1;
 #ifdef KVM_CAP_JOIN_MEMORY_REGIONS_WORKS
@@ -756,6 +991,12 @@ int kvm_init(void)
     kvm_state = s;
     cpu_register_phys_memory_client(&kvm_cpu_phys_memory_client);
 
+#ifdef CONFIG_IOTHREAD
+    qemu_mutex_init(&s->pio_notifier_lock);
+    qemu_mutex_init(&s->pio_profile_lock);
+    QLIST_INIT(&s->pio_notifiers);
+#endif
+
     s->many_ioeventfds = kvm_check_many_ioeventfds();
 
     return 0;
@@ -811,6 +1052,145 @@ static void kvm_handle_io(uint16_t port, void *data, int direction, int size,
     }
 }
 
+#ifdef CONFIG_IOTHREAD
+/* Signal the notifier of a port write that the kernel did not take.  The
+ * lookup and the write both happen under pio_notifier_lock, so the fd
+ * cannot be closed under our feet.
+ */
+static bool kvm_pio_notify(KVMState *s, struct kvm_run *run)
+{
+    KVMPioNotifier *n;
+    uint16_t val;
+    bool found = false;
+
+    if (!s->nr_pio_notifiers || run->io.direction != KVM_EXIT_IO_OUT ||
+        run->io.size != 2 || run->io.count != 1) {
+        return false;
+    }
+    val = lduw_p((uint8_t *)run + run->io.data_offset);
+
+    qemu_mutex_lock(&s->pio_notifier_lock);
+    QLIST_FOREACH(n, &s->pio_notifiers, next) {
+        if (n->addr == run->io.port && n->val == val) {
+            uint64_t one = 1;
+            ssize_t ret;
+
+            do {
+                ret = write(n->fd, &one, sizeof(one));
+            } while (ret < 0 && errno == EINTR);
+            found = true;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&s->pio_notifier_lock);
+    return found;
+}
+
+/* Complete a read from a range of kvm_set_mmio_read_unlocked().  Entries
+ * are never changed once nr_mmio_unlocked counts them.
+ */
+static bool kvm_mmio_read_unlocked(KVMState *s, struct kvm_run *run)
+{
+    int i, n = s->nr_mmio_unlocked;
+    uint64_t addr = run->mmio.phys_addr, val;
+    unsigned len = run->mmio.len;
+
+    if (!n || run->mmio.is_write) {
+        return false;
+    }
+    smp_rmb();
+    for (i = 0; i < n; i++) {
+        KVMMMIOUnlocked *m = &s->mmio_unlocked[i];
+
+        if (addr < m->addr || addr - m->addr + len > m->size) {
+            continue;
+        }
+        if (!m->read(m->opaque, addr - m->addr, len, &val)) {
+            return false;
+        }
+        switch (len) {
+        case 1:
+            stb_p(run->mmio.data, val);
+            break;
+        case 2:
+            stw_p(run->mmio.data, val);
+            break;
+        case 4:
+            stl_p(run->mmio.data, val);
+            break;
+        default:
+            stq_p(run->mmio.data, val);
+            break;
+        }
+        return true;
+    }
+    return false;
+}
+
+/* Complete, without qemu_global_mutex, the exits that do not need it:
+ * ioeventfd writes that the kernel did not take, ports whose handlers
+ * have a lock of their own, and reads of the MMIO ranges that asked for
+ * it.  Coalesced MMIO writes have to reach the
+ * devices before any later I/O, so there is no fast path while the ring
+ * has entries.  Return true to go straight back into the guest.
+ *
+ * Skipping kvm_arch_pre_run() and kvm_arch_post_run() here is fine: an
+ * interrupt or exit request kicks the thread with SIG_IPI, which stays
+ * pending until the next KVM_RUN and makes it fail with EINTR at once.
+ */
+static bool kvm_handle_exit_unlocked(CPUState *env, struct kvm_run *run)
+{
+    KVMState *s = kvm_state;
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+    QemuMutex *lock;
+
+    if (env->exit_request || (ring && ring->first != ring->last)) {
+        return false;
+    }
+
+    if (run->exit_reason == KVM_EXIT_MMIO) {
+        if (!kvm_mmio_read_unlocked(s, run)) {
+            return false;
+        }
+        qemu_mutex_iothread_bypassed(IOTHREAD_LOCK_VCPU_MMIO);
+        return true;
+    }
+    if (run->exit_reason != KVM_EXIT_IO) {
+        return false;
+    }
+
+    if (kvm_pio_notify(s, run)) {
+        qemu_mutex_iothread_bypassed(IOTHREAD_LOCK_VCPU_PIO);
+        return true;
+    }
+
+    if (!ioport_get_lock(run->io.port, &lock)) {
+        return false;
+    }
+    kvm_pio_profile_exit(s, run);
+    if (lock) {
+        qemu_mutex_lock(lock);
+    }
+    kvm_handle_io(run->io.port, (uint8_t *)run + run->io.data_offset,
+                  run->io.direction, run->io.size, run->io.count);
+    if (lock) {
+        qemu_mutex_unlock(lock);
+    }
+    qemu_mutex_iothread_bypassed(IOTHREAD_LOCK_VCPU_PIO);
+    return true;
+}
+#else
+static bool kvm_pio_notify(KVMState *s, struct kvm_run *run)
+{
+    return false;
+}
+
+static bool kvm_handle_exit_unlocked(CPUState *env, struct kvm_run *run)
+{
+    return false;
+}
+#endif
+
 #ifdef KVM_CAP_INTERNAL_ERROR_DATA
 static int kvm_handle_internal_error(CPUState *env, struct kvm_run *run)
 {
@@ -850,13 +1230,277 @@ void kvm_flush_coalesced_mmio_buffer(void)
 
             ent = &ring->coalesced_mmio[ring->first];
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+#ifdef KVM_CAP_COALESCED_PIO
+            if (ent->pio) {
+                kvm_handle_io(ent->phys_addr, ent->data, KVM_EXIT_IO_OUT,
+                              ent->len, 1);
+            } else
+#endif
+            {
+                cpu_physical_memory_write(ent->phys_addr, ent->data,
+                                          ent->len);
+            }
             smp_wmb();
             ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
         }
     }
 }
 
+static const char * const kvm_exit_reason_names[KVM_EXIT_STATS_REASONS] = {
+    [KVM_EXIT_UNKNOWN]          = "unknown",
+    [KVM_EXIT_EXCEPTION]        = "exception",
+    [KVM_EXIT_IO]               = "io",
+    [KVM_EXIT_HYPERCALL]        = "hypercall",
+    [KVM_EXIT_DEBUG]            = "debug",
+    [KVM_EXIT_HLT]              = "hlt",
+    [KVM_EXIT_MMIO]             = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN]  = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN]         = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY]       = "fail-entry",
+    [KVM_EXIT_INTR]             = "intr",
+    [KVM_EXIT_SET_TPR]          = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS]       = "tpr-access",
+    [KVM_EXIT_S390_SIEIC]       = "s390-sieic",
+    [KVM_EXIT_S390_RESET]       = "s390-reset",
+    [KVM_EXIT_DCR]              = "dcr",
+    [KVM_EXIT_NMI]              = "nmi",
+#ifdef KVM_CAP_INTERNAL_ERROR_DATA
+    [KVM_EXIT_INTERNAL_ERROR]   = "internal-error",
+#endif
+    [KVM_EXIT_STATS_REASONS - 1] = "other",
+};
+
+static void kvm_exit_stats_begin(CPUState *env, struct kvm_run *run, int ret)
+{
+    KVMExitStats *st = env->kvm_exit_stats;
+
+    st->exit_at = get_clock();
+    st->type = -1;
+    if (ret < 0) {
+        st->reason = KVM_EXIT_INTR;
+        return;
+    }
+    st->reason = MIN(run->exit_reason, KVM_EXIT_STATS_REASONS - 1);
+    if (run->exit_reason == KVM_EXIT_IO) {
+        st->type = KVM_EXIT_IO;
+        st->addr = run->io.port;
+    } else if (run->exit_reason == KVM_EXIT_MMIO) {
+        st->type = KVM_EXIT_MMIO;
+        st->addr = run->mmio.phys_addr;
+    }
+}
+
+static void kvm_exit_histogram_add(KVMExitHistogram *h, int64_t ns)
+{
+    int bucket = ns > 1 ? 63 - clz64(ns) : 0;
+
+    h->count++;
+    h->total_ns += ns;
+    h->buckets[MIN(bucket, KVM_EXIT_STATS_BUCKETS - 1)]++;
+}
+
+static void kvm_exit_stats_end(CPUState *env)
+{
+    KVMExitStats *st = env->kvm_exit_stats;
+    KVMExitAddrStats *a, *victim = NULL;
+    int mmio, i, h;
+    int64_t ns;
+
+    if (!st->exit_at) {
+        return;
+    }
+    ns = get_clock() - st->exit_at;
+    st->exit_at = 0;
+    kvm_exit_histogram_add(&st->reasons[st->reason], ns);
+
+    if (st->type < 0) {
+        return;
+    }
+    mmio = st->type == KVM_EXIT_MMIO;
+    h = ((st->addr ^ mmio) * 0x9e3779b97f4a7c15ULL) >> 58;
+    for (i = 0; i < KVM_EXIT_STATS_PROBES; i++) {
+        a = &st->addrs[(h + i) % KVM_EXIT_STATS_ADDRS];
+        if (!a->hist.count) {
+            a->addr = st->addr;
+            a->mmio = mmio;
+        } else if (a->addr != st->addr || a->mmio != mmio) {
+            if (!victim || a->hist.count < victim->hist.count) {
+                victim = a;
+            }
+            continue;
+        }
+        kvm_exit_histogram_add(&a->hist, ns);
+        return;
+    }
+    memset(victim, 0, sizeof(*victim));
+    victim->addr = st->addr;
+    victim->mmio = mmio;
+    kvm_exit_histogram_add(&victim->hist, ns);
+}
+
+static QObject *kvm_exit_histogram_to_qobject(const KVMExitHistogram *h)
+{
+    QList *buckets = qlist_new();
+    int i, last;
+
+    for (last = KVM_EXIT_STATS_BUCKETS - 1; last > 0; last--) {
+        if (h->buckets[last]) {
+            break;
+        }
+    }
+    for (i = 0; i <= last; i++) {
+        qlist_append(buckets, qint_from_int(h->buckets[i]));
+    }
+    return qobject_from_jsonf("{ 'count': %" PRId64 ", 'time-ns': %" PRId64
+                              ", 'histogram': %p }",
+                              h->count, h->total_ns, QOBJECT(buckets));
+}
+
+static int kvm_exit_addr_cmp(const void *a, const void *b)
+{
+    const KVMExitAddrStats *x = *(KVMExitAddrStats * const *)a;
+    const KVMExitAddrStats *y = *(KVMExitAddrStats * const *)b;
+
+    if (x->hist.total_ns != y->hist.total_ns) {
+        return x->hist.total_ns < y->hist.total_ns ? 1 : -1;
+    }
+    return 0;
+}
+
+void kvm_info_exit_stats(Monitor *mon, QObject **ret_data)
+{
+    QList *cpus = qlist_new();
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        KVMExitStats *st = env->kvm_exit_stats;
+        KVMExitAddrStats *hot[KVM_EXIT_STATS_ADDRS];
+        QList *exits, *addrs;
+        QObject *obj;
+        int i, n;
+
+        if (!st) {
+            continue;
+        }
+        exits = qlist_new();
+        for (i = 0; i < KVM_EXIT_STATS_REASONS; i++) {
+            if (!st->reasons[i].count) {
+                continue;
+            }
+            obj = kvm_exit_histogram_to_qobject(&st->reasons[i]);
+            if (kvm_exit_reason_names[i]) {
+                qdict_put(qobject_to_qdict(obj), "reason",
+                          qstring_from_str(kvm_exit_reason_names[i]));
+            } else {
+                qdict_put(qobject_to_qdict(obj), "reason", qint_from_int(i));
+            }
+            qlist_append_obj(exits, obj);
+        }
+
+        for (i = n = 0; i < KVM_EXIT_STATS_ADDRS; i++) {
+            if (st->addrs[i].hist.count) {
+                hot[n++] = &st->addrs[i];
+            }
+        }
+        qsort(hot, n, sizeof(hot[0]), kvm_exit_addr_cmp);
+        addrs = qlist_new();
+        for (i = 0; i < n; i++) {
+            obj = kvm_exit_histogram_to_qobject(&hot[i]->hist);
+            qdict_put(qobject_to_qdict(obj), "type",
+                      qstring_from_str(hot[i]->mmio ? "mmio" : "pio"));
+            qdict_put(qobject_to_qdict(obj), "address",
+                      qint_from_int(hot[i]->addr));
+            qlist_append_obj(addrs, obj);
+        }
+
+        qlist_append_obj(cpus, qobject_from_jsonf("{ 'cpu': %d, 'exits': %p, "
+                                                  "'addresses': %p }",
+                                                  env->cpu_index,
+                                                  QOBJECT(exits),
+                                                  QOBJECT(addrs)));
+    }
+    *ret_data = QOBJECT(cpus);
+}
+
+/* Upper bound, in nanoseconds, of the bucket holding the exit at frac */
+static int64_t kvm_exit_percentile(QDict *stats, double frac)
+{
+    QList *buckets = qdict_get_qlist(stats, "histogram");
+    int64_t target = qdict_get_int(stats, "count") * frac;
+    int64_t seen = 0;
+    QListEntry *e;
+    int i = 0;
+
+    QLIST_FOREACH_ENTRY(buckets, e) {
+        seen += qint_get_int(qobject_to_qint(e->value));
+        if (seen > target) {
+            break;
+        }
+        i++;
+    }
+    return 2LL << i;
+}
+
+static void kvm_exit_stats_print_row(Monitor *mon, const char *what,
+                                     QDict *stats)
+{
+    int64_t count = qdict_get_int(stats, "count");
+    int64_t ns = qdict_get_int(stats, "time-ns");
+
+    monitor_printf(mon, "  %-18s %10" PRId64 " %10.3f %10" PRId64
+                   " %10" PRId64 " %10" PRId64 "\n",
+                   what, count, ns / 1e6, ns / MAX(count, 1),
+                   kvm_exit_percentile(stats, 0.5),
+                   kvm_exit_percentile(stats, 0.99));
+}
+
+#define KVM_EXIT_STATS_PRINT_ADDRS 10
+
+void kvm_info_exit_stats_print(Monitor *mon, const QObject *data)
+{
+    QListEntry *c, *e;
+
+    if (qlist_empty(qobject_to_qlist(data))) {
+        monitor_printf(mon, "no KVM exit statistics\n");
+        return;
+    }
+    QLIST_FOREACH_ENTRY(qobject_to_qlist(data), c) {
+        QDict *cpu = qobject_to_qdict(c->value);
+        int n = 0;
+
+        monitor_printf(mon, "cpu %" PRId64 ":\n", qdict_get_int(cpu, "cpu"));
+        monitor_printf(mon, "  %-18s %10s %10s %10s %10s %10s\n", "exit",
+                       "count", "total(ms)", "avg(ns)", "p50(ns)<",
+                       "p99(ns)<");
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(cpu, "exits"), e) {
+            QDict *stats = qobject_to_qdict(e->value);
+            QObject *reason = qdict_get(stats, "reason");
+            char buf[32];
+
+            if (qobject_type(reason) == QTYPE_QSTRING) {
+                pstrcpy(buf, sizeof(buf),
+                        qstring_get_str(qobject_to_qstring(reason)));
+            } else {
+                snprintf(buf, sizeof(buf), "reason %" PRId64,
+                         qint_get_int(qobject_to_qint(reason)));
+            }
+            kvm_exit_stats_print_row(mon, buf, stats);
+        }
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(cpu, "addresses"), e) {
+            QDict *stats = qobject_to_qdict(e->value);
+            char buf[32];
+
+            if (n++ == KVM_EXIT_STATS_PRINT_ADDRS) {
+                break;
+            }
+            snprintf(buf, sizeof(buf), "%s 0x%" PRIx64,
+                     qdict_get_str(stats, "type"),
+                     qdict_get_int(stats, "address"));
+            kvm_exit_stats_print_row(mon, buf, stats);
+        }
+    }
+}
+
 static void do_kvm_cpu_synchronize_state(void *_env)
 {
     CPUState *env = _env;
@@ -919,13 +1563,27 @@ int kvm_cpu_exec(CPUState *env)
         cpu_single_env = NULL;
         qemu_mutex_unlock_iothread();
 
-        ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+        do {
+            kvm_exit_stats_end(env);
+            ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+            kvm_exit_stats_begin(env, run, ret);
+        } while (ret == 0 && kvm_handle_exit_unlocked(env, run));
 
         qemu_mutex_lock_iothread();
+        if (ret < 0) {
+            qemu_mutex_iothread_set_site(IOTHREAD_LOCK_VCPU);
+        } else if (run->exit_reason == KVM_EXIT_IO) {
+            qemu_mutex_iothread_set_site(IOTHREAD_LOCK_VCPU_PIO);
+        } else if (run->exit_reason == KVM_EXIT_MMIO) {
+            qemu_mutex_iothread_set_site(IOTHREAD_LOCK_VCPU_MMIO);
+        } else {
+            qemu_mutex_iothread_set_site(IOTHREAD_LOCK_VCPU);
+        }
         cpu_single_env = env;
         kvm_arch_post_run(env, run);
 
         kvm_flush_coalesced_mmio_buffer();
+        kvm_pio_profile_review(kvm_state);
 
         if (ret == -EINTR || ret == -EAGAIN) {
             DPRINTF("io window exit\n");
@@ -942,6 +1600,11 @@ int kvm_cpu_exec(CPUState *env)
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
+            if (kvm_pio_notify(kvm_state, run)) {
+                ret = 1;
+                break;
+            }
+            kvm_pio_profile_exit(kvm_state, run);
             kvm_handle_io(run->io.port,
                           (uint8_t *)run + run->io.data_offset,
                           run->io.direction,
@@ -999,6 +1662,7 @@ int kvm_cpu_exec(CPUState *env)
     ret = EXCP_INTERRUPT;
 
 out:
+    kvm_exit_stats_end(env);
     env->exit_request = 0;
     cpu_single_env = NULL;
     return ret;
@@ -1093,6 +1757,28 @@ int kvm_has_many_ioeventfds(void)
     return kvm_state->many_ioeventfds;
 }
 
+int kvm_set_mmio_read_unlocked(uint64_t addr, uint64_t size,
+                               KVMMMIOReadFunc *read, void *opaque)
+{
+    KVMState *s = kvm_state;
+    KVMMMIOUnlocked *m;
+
+    if (!kvm_enabled()) {
+        return -ENOSYS;
+    }
+    if (s->nr_mmio_unlocked == KVM_MMIO_UNLOCKED_MAX) {
+        return -ENOSPC;
+    }
+    m = &s->mmio_unlocked[s->nr_mmio_unlocked];
+    m->addr = addr;
+    m->size = size;
+    m->read = read;
+    m->opaque = opaque;
+    smp_wmb();
+    s->nr_mmio_unlocked++;
+    return 0;
+}
+
 void kvm_setup_guest_memory(void *start, size_t size)
 {
     if (!kvm_has_sync_mmu()) {
@@ -1340,6 +2026,42 @@ int kvm_set_ioeventfd_mmio_long(int fd, uint32_t addr, uint32_t val, bool assign
 #endif
 }
 
+#ifdef CONFIG_IOTHREAD
+static void kvm_add_pio_notifier(KVMState *s, int fd, uint16_t addr,
+                                 uint16_t val)
+{
+    KVMPioNotifier *n = qemu_mallocz(sizeof(*n));
+
+    n->fd = fd;
+    n->addr = addr;
+    n->val = val;
+    qemu_mutex_lock(&s->pio_notifier_lock);
+    QLIST_INSERT_HEAD(&s->pio_notifiers, n, next);
+    s->nr_pio_notifiers++;
+    qemu_mutex_unlock(&s->pio_notifier_lock);
+}
+
+static bool kvm_del_pio_notifier(KVMState *s, int fd, uint16_t addr,
+                                 uint16_t val)
+{
+    KVMPioNotifier *n;
+    bool found = false;
+
+    qemu_mutex_lock(&s->pio_notifier_lock);
+    QLIST_FOREACH(n, &s->pio_notifiers, next) {
+        if (n->fd == fd && n->addr == addr && n->val == val) {
+            QLIST_REMOVE(n, next);
+            s->nr_pio_notifiers--;
+            qemu_free(n);
+            found = true;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&s->pio_notifier_lock);
+    return found;
+}
+#endif
+
 int kvm_set_ioeventfd_pio_word(int fd, uint16_t addr, uint16_t val, bool assign)
 {
 #ifdef KVM_IOEVENTFD
@@ -1357,7 +2079,19 @@ int kvm_set_ioeventfd_pio_word(int fd, uint16_t addr, uint16_t val, bool assign)
     if (!assign) {
         kick.flags |= KVM_IOEVENTFD_FLAG_DEASSIGN;
     }
+#ifdef CONFIG_IOTHREAD
+    if (!assign && kvm_del_pio_notifier(kvm_state, fd, addr, val)) {
+        return 0;
+    }
+#endif
     r = kvm_vm_ioctl(kvm_state, KVM_IOEVENTFD, &kick);
+#ifdef CONFIG_IOTHREAD
+    /* The io bus of the kernel is full */
+    if (r == -ENOSPC && assign) {
+        kvm_add_pio_notifier(kvm_state, fd, addr, val);
+        r = 0;
+    }
+#endif
     if (r < 0) {
         return r;
     }
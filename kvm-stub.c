@@ -16,6 +16,7 @@
 #include "exec-all.h"
 #include "gdbstub.h"
 #include "kvm.h"
+#include "qlist.h"
 
 int kvm_irqchip_in_kernel(void)
 {
@@ -43,6 +44,16 @@ int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
     return -ENOSYS;
 }
 
+int kvm_coalesce_pio_region(pio_addr_t start, uint32_t size)
+{
+    return -ENOSYS;
+}
+
+int kvm_uncoalesce_pio_region(pio_addr_t start, uint32_t size)
+{
+    return -ENOSYS;
+}
+
 int kvm_check_extension(KVMState *s, unsigned int extension)
 {
     return 0;
@@ -127,6 +138,12 @@ int kvm_set_signal_mask(CPUState *env, const sigset_t *sigset)
 }
 #endif
 
+int kvm_set_mmio_read_unlocked(uint64_t addr, uint64_t size,
+                               KVMMMIOReadFunc *read, void *opaque)
+{
+    return -ENOSYS;
+}
+
 int kvm_set_ioeventfd_pio_word(int fd, uint16_t addr, uint16_t val, bool assign)
 {
     return -ENOSYS;
@@ -146,3 +163,13 @@ int kvm_on_sigbus(int code, void *addr)
 {
     return 1;
 }
+
+void kvm_info_exit_stats(Monitor *mon, QObject **ret_data)
+{
+    *ret_data = QOBJECT(qlist_new());
+}
+
+void kvm_info_exit_stats_print(Monitor *mon, const QObject *data)
+{
+    monitor_printf(mon, "no KVM exit statistics\n");
+}
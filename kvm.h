@@ -17,6 +17,8 @@
 #include <errno.h>
 #include "config-host.h"
 #include "qemu-queue.h"
+#include "ioport.h"
+#include "qobject.h"
 
 #ifdef CONFIG_KVM
 #include <linux/kvm.h>
@@ -52,6 +54,22 @@ int kvm_has_xsave(void);
 int kvm_has_xcrs(void);
 int kvm_has_many_ioeventfds(void);
 
+/* MMIO reads that KVM vcpu threads complete without qemu_global_mutex, for
+ * registers that guests poll all the time, like a clocksource counter.
+ * read gets the offset into the range and the access size, and returns
+ * false to send the exit down the usual locked path.  It runs concurrently
+ * with everything else, so it may only look at state that it can read
+ * safely without the mutex.  Ranges cannot be unregistered.
+ */
+typedef bool KVMMMIOReadFunc(void *opaque, uint64_t offset, unsigned size,
+                             uint64_t *val);
+int kvm_set_mmio_read_unlocked(uint64_t addr, uint64_t size,
+                               KVMMMIOReadFunc *read, void *opaque);
+
+/* info kvmstat / query-kvmstat */
+void kvm_info_exit_stats(Monitor *mon, QObject **ret_data);
+void kvm_info_exit_stats_print(Monitor *mon, const QObject *data);
+
 #ifdef NEED_CPU_H
 int kvm_init_vcpu(CPUState *env);
 
@@ -62,6 +80,8 @@ void kvm_setup_guest_memory(void *start, size_t size);
 
 int kvm_coalesce_mmio_region(target_phys_addr_t start, ram_addr_t size);
 int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size);
+int kvm_coalesce_pio_region(pio_addr_t start, uint32_t size);
+int kvm_uncoalesce_pio_region(pio_addr_t start, uint32_t size);
 void kvm_flush_coalesced_mmio_buffer(void);
 #endif
 
@@ -40,6 +40,14 @@ struct qemu_laio_state {
     int efd;
     int count;
     QLIST_HEAD(, qemu_laiocb) completed_reqs;
+
+    /* requests queued between laio_io_plug() and laio_io_unplug() */
+    int plugged;
+    int plug_context_id;
+    struct iocb *pending[MAX_EVENTS];
+    int n_pending;
+
+    struct io_event events[MAX_EVENTS];
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -115,7 +123,7 @@ static void qemu_laio_completion_cb(void *opaque)
     struct qemu_laio_state *s = opaque;
 
     while (1) {
-        struct io_event events[MAX_EVENTS];
+        struct io_event *events = s->events;
         uint64_t val;
         ssize_t ret;
         struct timespec ts = { 0 };
@@ -131,18 +139,56 @@ static void qemu_laio_completion_cb(void *opaque)
         if (ret != 8)
             break;
 
+        /*
+         * Reap everything that has completed by now, not only what the
+         * eventfd counted: completions that come in meanwhile are handled
+         * in the same batch instead of waking us up once more.
+         */
         do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+            do {
+                nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
+
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
+
+                laiocb->ret = io_event_ret(&events[i]);
+                qemu_laio_enqueue_completed(s, laiocb);
+            }
+        } while (nevents == MAX_EVENTS);
+    }
+}
+
+/*
+ * Submits the queued requests with as few io_submit calls as possible.
+ * The requests the kernel refuses are completed with its error.
+ */
+static void laio_submit_pending(struct qemu_laio_state *s)
+{
+    struct iocb *iocbs[MAX_EVENTS];
+    int n = s->n_pending, done = 0;
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
+    /* completion callbacks may queue new requests */
+    memcpy(iocbs, s->pending, n * sizeof(iocbs[0]));
+    s->n_pending = 0;
+
+    while (done < n) {
+        int ret = io_submit(s->ctx, n - done, &iocbs[done]);
+
+        if (ret == -EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            /* fail the first request, the others may still get through */
             struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+                container_of(iocbs[done], struct qemu_laiocb, iocb);
 
-            laiocb->ret = io_event_ret(&events[i]);
+            laiocb->ret = ret < 0 ? ret : -EIO;
             qemu_laio_enqueue_completed(s, laiocb);
+            ret = 1;
         }
+        done += ret;
     }
 }
 
@@ -150,6 +196,10 @@ static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* whoever waits for the queued requests must not wait forever */
+    if (s->n_pending) {
+        laio_submit_pending(s);
+    }
     return (s->count > 0) ? 1 : 0;
 }
 
@@ -162,6 +212,10 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    if (laiocb->ctx->n_pending) {
+        laio_submit_pending(laiocb->ctx);
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -223,6 +277,19 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
+    /*
+     * While plugged, requests from the plugging context are only queued.
+     * Requests from a nested context (emulated synchronous I/O) go out
+     * immediately, as their issuer waits for them before unplugging.
+     */
+    if (s->plugged && laiocb->async_context_id == s->plug_context_id) {
+        s->pending[s->n_pending++] = iocbs;
+        if (s->n_pending == MAX_EVENTS) {
+            laio_submit_pending(s);
+        }
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
@@ -234,6 +301,29 @@ out_dec_count:
     return NULL;
 }
 
+/*
+ * Batches the requests submitted until the matching laio_io_unplug() into a
+ * single io_submit call.  Plugging nests.
+ */
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    if (s->plugged++ == 0) {
+        s->plug_context_id = get_async_context_id();
+    }
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0 && s->n_pending) {
+        laio_submit_pending(s);
+    }
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
@@ -34,6 +34,7 @@
 #include "tcg.h"
 #include "qemu-timer.h"
 #include "envlist.h"
+#include "tb-cache.h"
 
 #define DEBUG_LOGFILE "/tmp/qemu.log"
 
@@ -2647,6 +2648,7 @@ static void usage(void)
            "-E var=value      sets/modifies targets environment variable(s)\n"
            "-U var            unsets targets environment variable(s)\n"
            "-0 argv0          forces target process argv[0] to be argv0\n"
+           "-tb-cache file    keep the translated code in file across runs\n"
 #if defined(CONFIG_USE_GUEST_BASE)
            "-B address        set guest_base address to address\n"
            "-R size           reserve size bytes for guest virtual address space\n"
@@ -2656,11 +2658,13 @@ static void usage(void)
            "-d options   activate log (logfile=%s)\n"
            "-p pagesize  set the host page size to 'pagesize'\n"
            "-singlestep  always run in singlestep mode\n"
+           "-no-tcg-optimize  do not optimize the ops before generating code\n"
            "-strace      log system calls\n"
            "\n"
            "Environment variables:\n"
            "QEMU_STRACE       Print system calls and arguments similar to the\n"
            "                  'strace' program.  Enable by setting to any value.\n"
+           "QEMU_TB_CACHE     File to keep the translated code in, as -tb-cache\n"
            "You can use -E and -U options to set/unset environment variables\n"
            "for target process.  It is possible to provide several variables\n"
            "by repeating the option.  For example:\n"
@@ -2715,6 +2719,7 @@ int main(int argc, char **argv, char **envp)
 {
     const char *filename;
     const char *cpu_model;
+    const char *tb_cache_path = NULL;
     struct target_pt_regs regs1, *regs = &regs1;
     struct image_info info1, *info = &info1;
     struct linux_binprm bprm;
@@ -2891,8 +2896,15 @@ int main(int argc, char **argv, char **envp)
             (void) envlist_unsetenv(envlist, "LD_PRELOAD");
         } else if (!strcmp(r, "singlestep")) {
             singlestep = 1;
+        } else if (!strcmp(r, "no-tcg-optimize")) {
+            tcg_optimize_enabled = 0;
         } else if (!strcmp(r, "strace")) {
             do_strace = 1;
+        } else if (!strcmp(r, "tb-cache")) {
+            tb_cache_path = argv[optind++];
+            if (tb_cache_path == NULL) {
+                usage();
+            }
         } else if (!strcmp(r, "version")) {
             version();
             exit(0);
@@ -3103,6 +3115,13 @@ int main(int argc, char **argv, char **envp)
     tcg_prologue_init(&tcg_ctx);
 #endif
 
+    if (!tb_cache_path) {
+        tb_cache_path = getenv("QEMU_TB_CACHE");
+    }
+    if (tb_cache_path && tb_cache_init(tb_cache_path, cpu_model) < 0) {
+        _exit(1);
+    }
+
 #if defined(TARGET_I386)
     cpu_x86_set_cpl(env, 3);
 
@@ -221,33 +221,37 @@ unsigned long last_brk;
 static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
     abi_ulong addr;
-    abi_ulong last_addr;
-    int prot;
+    target_ulong range_start, range_end;
     int looped = 0;
 
     if (size > RESERVED_VA) {
         return (abi_ulong)-1;
     }
 
-    last_addr = start;
-    for (addr = start; last_addr + size != addr; addr += qemu_host_page_size) {
-        if (last_addr + size >= RESERVED_VA
-            || (abi_ulong)(last_addr + size) < last_addr) {
+    /* Jump over whole mapped ranges rather than probing the flags of
+       every page in between.  */
+    addr = start;
+    for (;;) {
+        if (addr + size >= RESERVED_VA
+            || (abi_ulong)(addr + size) < addr) {
             if (looped) {
                 return (abi_ulong)-1;
             }
-            last_addr = qemu_host_page_size;
-            addr = 0;
+            addr = qemu_host_page_size;
             looped = 1;
             continue;
         }
-        prot = page_get_flags(addr);
-        if (prot) {
-            last_addr = addr + qemu_host_page_size;
+        if (!page_find_range(addr, addr + size, &range_start, &range_end)) {
+            break;
+        }
+        addr = HOST_PAGE_ALIGN(range_end);
+        if (addr == 0) {
+            /* the range ends at the top of the address space */
+            addr = RESERVED_VA;
         }
     }
-    mmap_next_start = addr;
-    return last_addr;
+    mmap_next_start = addr + size;
+    return addr;
 }
 
 /*
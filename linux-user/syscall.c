@@ -93,6 +93,8 @@ int __clone2(int (*fn)(void *), void *child_stack_base,
 
 #include "qemu.h"
 #include "qemu-common.h"
+#include "exec-all.h"
+#include "tb-cache.h"
 
 #if defined(CONFIG_USE_NPTL)
 #define CLONE_NPTL_FLAGS2 (CLONE_SETTLS | \
@@ -4283,6 +4285,11 @@ static int do_futex(target_ulong uaddr, int op, int val, target_ulong timeout,
 #endif
     switch (base_op) {
     case FUTEX_WAIT:
+#ifdef FUTEX_WAIT_BITSET
+    case FUTEX_WAIT_BITSET:
+#endif
+        /* The BITSET variants take an absolute timeout and a mask in
+           val3 that is never compared with guest memory.  */
         if (timeout) {
             pts = &ts;
             target_to_host_timespec(pts, timeout);
@@ -4290,9 +4297,12 @@ static int do_futex(target_ulong uaddr, int op, int val, target_ulong timeout,
             pts = NULL;
         }
         return get_errno(sys_futex(g2h(uaddr), op, tswap32(val),
-                         pts, NULL, 0));
+                         pts, NULL, val3));
     case FUTEX_WAKE:
-        return get_errno(sys_futex(g2h(uaddr), op, val, NULL, NULL, 0));
+#ifdef FUTEX_WAKE_BITSET
+    case FUTEX_WAKE_BITSET:
+#endif
+        return get_errno(sys_futex(g2h(uaddr), op, val, NULL, NULL, val3));
     case FUTEX_FD:
         return get_errno(sys_futex(g2h(uaddr), op, val, NULL, NULL, 0));
     case FUTEX_REQUEUE:
@@ -4422,6 +4432,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_save();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -6047,6 +6058,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_save();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
@@ -0,0 +1,377 @@
+/*
+ * Extra migration connections for RAM pages
+ *
+ * A single TCP connection rarely fills a fast or bonded link, so RAM pages
+ * can be striped over extra connections to the destination, each drained
+ * by a sender thread on the source and loaded by a receiver thread on the
+ * destination.  Device state and the section framing stay on the main
+ * connection.
+ *
+ * Every channel carries page records like those of the RAM section, up to
+ * an end of stream record sent once all RAM is through.  The source always
+ * sends a given page on the same channel, so that a newer copy of it never
+ * overtakes an older one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu_socket.h"
+#include "qemu-timer.h"
+#include "migration.h"
+#include "migration-channels.h"
+
+#ifdef CONFIG_THREAD
+
+#include "qemu-thread.h"
+
+typedef struct MigrationChannel {
+    MigrationChannels *cs;
+    int fd;
+    QEMUFile *file;
+    QemuThread thread;
+    QemuCond cond;
+    uint8_t *buffer;            /* queued for the sender thread */
+    size_t size;
+    size_t capacity;
+    size_t in_flight;           /* being sent by the sender thread */
+    int error;
+} MigrationChannel;
+
+struct MigrationChannels {
+    int n;
+    MigrationChannel *channels;
+    QemuMutex lock;
+    bool quit;
+    MigrationChannelLoadFunc *load;
+    int64_t window;             /* start of the rate limiting window */
+    uint64_t window_bytes;      /* bytes queued since then */
+};
+
+static MigrationChannels *migration_channels_new(int n)
+{
+    MigrationChannels *cs;
+    int i;
+
+    cs = qemu_mallocz(sizeof(*cs));
+    cs->n = n;
+    cs->channels = qemu_mallocz(sizeof(*cs->channels) * n);
+    qemu_mutex_init(&cs->lock);
+    for (i = 0; i < n; i++) {
+        cs->channels[i].cs = cs;
+        cs->channels[i].fd = -1;
+        qemu_cond_init(&cs->channels[i].cond);
+    }
+    return cs;
+}
+
+static void migration_channels_free(MigrationChannels *cs)
+{
+    int i;
+
+    for (i = 0; i < cs->n; i++) {
+        qemu_cond_destroy(&cs->channels[i].cond);
+        qemu_free(cs->channels[i].buffer);
+    }
+    qemu_mutex_destroy(&cs->lock);
+    qemu_free(cs->channels);
+    qemu_free(cs);
+}
+
+static void *migration_channel_send_thread(void *opaque)
+{
+    MigrationChannel *c = opaque;
+    MigrationChannels *cs = c->cs;
+    uint8_t *buf = NULL;
+    size_t capacity = 0;
+
+    qemu_mutex_lock(&cs->lock);
+    for (;;) {
+        uint8_t *full;
+        size_t full_capacity, size;
+        int error = 0;
+
+        while (!c->size && !cs->quit) {
+            qemu_cond_wait(&c->cond, &cs->lock);
+        }
+        if (!c->size) {
+            break;
+        }
+
+        /* Take what is queued, leave our empty buffer in its place */
+        full = c->buffer;
+        full_capacity = c->capacity;
+        size = c->size;
+        c->buffer = buf;
+        c->capacity = capacity;
+        c->size = 0;
+        buf = full;
+        capacity = full_capacity;
+        c->in_flight = size;
+        qemu_mutex_unlock(&cs->lock);
+
+        if (qemu_write_full(c->fd, buf, size) != size) {
+            error = -errno;
+        }
+
+        qemu_mutex_lock(&cs->lock);
+        c->in_flight = 0;
+        if (error && !c->error) {
+            c->error = error;
+        }
+    }
+    qemu_mutex_unlock(&cs->lock);
+
+    qemu_free(buf);
+    return NULL;
+}
+
+static int migration_channel_put_buffer(void *opaque, const uint8_t *buf,
+                                        int64_t pos, int size)
+{
+    MigrationChannel *c = opaque;
+    MigrationChannels *cs = c->cs;
+    int ret = size;
+
+    qemu_mutex_lock(&cs->lock);
+    if (c->error) {
+        ret = c->error;
+    } else {
+        if (c->size + size > c->capacity) {
+            c->capacity = MAX(c->size + size, c->capacity * 2);
+            c->buffer = qemu_realloc(c->buffer, c->capacity);
+        }
+        memcpy(c->buffer + c->size, buf, size);
+        c->size += size;
+        cs->window_bytes += size;
+        qemu_cond_signal(&c->cond);
+    }
+    qemu_mutex_unlock(&cs->lock);
+    return ret;
+}
+
+static int migration_channel_close(void *opaque)
+{
+    return 0;
+}
+
+/* Connect n extra channels to the destination of the current migration */
+MigrationChannels *migration_channels_open(int n)
+{
+    MigrationChannels *cs = migration_channels_new(n);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        MigrationChannel *c = &cs->channels[i];
+
+        c->fd = tcp_open_migration_channel();
+        if (c->fd == -1) {
+            fprintf(stderr, "migration: cannot open channel %d\n", i);
+            break;
+        }
+        c->file = qemu_fopen_ops(c, migration_channel_put_buffer, NULL,
+                                 migration_channel_close, NULL, NULL, NULL);
+        qemu_thread_create(&c->thread, migration_channel_send_thread, c);
+    }
+    if (i < n) {
+        cs->n = i;
+        migration_channels_abort(cs);
+        return NULL;
+    }
+
+    cs->window = qemu_get_clock(rt_clock);
+    return cs;
+}
+
+QEMUFile *migration_channel_file(MigrationChannels *cs, int i)
+{
+    return cs->channels[i].file;
+}
+
+/* Whether more than limit bytes went to the channels in the current
+   100 ms, or more than that is still waiting to be sent.  limit is the
+   per tick limit of the main migration file. */
+int migration_channels_rate_limit(MigrationChannels *cs, int64_t limit)
+{
+    int64_t now = qemu_get_clock(rt_clock);
+    int i, ret = 0;
+
+    qemu_mutex_lock(&cs->lock);
+    if (now - cs->window >= 100) {
+        cs->window = now;
+        cs->window_bytes = 0;
+    }
+    if (cs->window_bytes > limit) {
+        ret = 1;
+    }
+    for (i = 0; i < cs->n && !ret; i++) {
+        if (cs->channels[i].size + cs->channels[i].in_flight > limit) {
+            ret = 1;
+        }
+    }
+    qemu_mutex_unlock(&cs->lock);
+    return ret;
+}
+
+bool migration_channels_has_error(MigrationChannels *cs)
+{
+    bool error = false;
+    int i;
+
+    qemu_mutex_lock(&cs->lock);
+    for (i = 0; i < cs->n; i++) {
+        error |= cs->channels[i].error != 0;
+    }
+    qemu_mutex_unlock(&cs->lock);
+    return error;
+}
+
+/* Send everything queued on the channels and close them */
+int migration_channels_finish(MigrationChannels *cs)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < cs->n; i++) {
+        qemu_fflush(cs->channels[i].file);
+    }
+
+    qemu_mutex_lock(&cs->lock);
+    cs->quit = true;
+    for (i = 0; i < cs->n; i++) {
+        qemu_cond_signal(&cs->channels[i].cond);
+    }
+    qemu_mutex_unlock(&cs->lock);
+
+    for (i = 0; i < cs->n; i++) {
+        MigrationChannel *c = &cs->channels[i];
+
+        qemu_thread_join(&c->thread);
+        if (qemu_fclose(c->file) < 0 || c->error) {
+            ret = -EIO;
+        }
+        close(c->fd);
+    }
+    migration_channels_free(cs);
+    return ret;
+}
+
+/* Close the channels without waiting for the destination */
+void migration_channels_abort(MigrationChannels *cs)
+{
+    int i;
+
+    for (i = 0; i < cs->n; i++) {
+        shutdown(cs->channels[i].fd, SHUT_RDWR);
+    }
+    migration_channels_finish(cs);
+}
+
+static void *migration_channel_load_thread(void *opaque)
+{
+    MigrationChannel *c = opaque;
+
+    c->error = c->cs->load(c->file);
+    qemu_fclose(c->file);
+    close(c->fd);
+    return NULL;
+}
+
+/* Accept the n channels of an incoming migration, and load each with load
+   in a thread of its own */
+MigrationChannels *migration_channels_accept(int n,
+                                             MigrationChannelLoadFunc *load)
+{
+    MigrationChannels *cs;
+    int i;
+
+    if (n > MIGRATION_CHANNELS_MAX) {
+        return NULL;
+    }
+
+    cs = migration_channels_new(n);
+    cs->load = load;
+    for (i = 0; i < n; i++) {
+        MigrationChannel *c = &cs->channels[i];
+
+        c->fd = tcp_accept_migration_channel();
+        if (c->fd == -1) {
+            fprintf(stderr, "migration: channel %d did not connect\n", i);
+            break;
+        }
+        c->file = qemu_fopen_socket(c->fd);
+        qemu_thread_create(&c->thread, migration_channel_load_thread, c);
+    }
+    if (i < n) {
+        /* Unblock the threads already started */
+        cs->n = i;
+        for (i = 0; i < cs->n; i++) {
+            shutdown(cs->channels[i].fd, SHUT_RDWR);
+        }
+        migration_channels_join(cs);
+        return NULL;
+    }
+    return cs;
+}
+
+/* Wait until all channels are loaded; fails if any of them failed */
+int migration_channels_join(MigrationChannels *cs)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < cs->n; i++) {
+        qemu_thread_join(&cs->channels[i].thread);
+        if (cs->channels[i].error < 0) {
+            ret = cs->channels[i].error;
+        }
+    }
+    migration_channels_free(cs);
+    return ret;
+}
+
+#else
+
+MigrationChannels *migration_channels_open(int n)
+{
+    return NULL;
+}
+
+QEMUFile *migration_channel_file(MigrationChannels *cs, int i)
+{
+    abort();
+}
+
+int migration_channels_rate_limit(MigrationChannels *cs, int64_t limit)
+{
+    abort();
+}
+
+bool migration_channels_has_error(MigrationChannels *cs)
+{
+    abort();
+}
+
+int migration_channels_finish(MigrationChannels *cs)
+{
+    abort();
+}
+
+void migration_channels_abort(MigrationChannels *cs)
+{
+    abort();
+}
+
+MigrationChannels *migration_channels_accept(int n,
+                                             MigrationChannelLoadFunc *load)
+{
+    fprintf(stderr, "migration channels need thread support\n");
+    return NULL;
+}
+
+int migration_channels_join(MigrationChannels *cs)
+{
+    abort();
+}
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * Extra migration connections for RAM pages
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_CHANNELS_H
+#define QEMU_MIGRATION_CHANNELS_H
+
+#include "hw/hw.h"
+
+#define MIGRATION_CHANNELS_MAX 16
+
+typedef struct MigrationChannels MigrationChannels;
+typedef int (MigrationChannelLoadFunc)(QEMUFile *f);
+
+/* Source side */
+MigrationChannels *migration_channels_open(int n);
+QEMUFile *migration_channel_file(MigrationChannels *cs, int i);
+int migration_channels_rate_limit(MigrationChannels *cs, int64_t limit);
+bool migration_channels_has_error(MigrationChannels *cs);
+int migration_channels_finish(MigrationChannels *cs);
+void migration_channels_abort(MigrationChannels *cs);
+
+/* Destination side */
+MigrationChannels *migration_channels_accept(int n,
+                                             MigrationChannelLoadFunc *load);
+int migration_channels_join(MigrationChannels *cs);
+
+#endif
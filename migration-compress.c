@@ -0,0 +1,240 @@
+/*
+ * Parallel page compression for RAM migration
+ *
+ * Pages are queued as a batch of jobs, then the batch is compressed by a
+ * pool of worker threads, each with its own zlib stream.  The caller
+ * waits until the whole batch is done and emits the results in the order
+ * the pages were queued, so the stream layout does not depend on the
+ * number of workers.  Without thread support, the batch is compressed by
+ * the caller.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <zlib.h>
+
+#include "qemu-common.h"
+#include "migration-compress.h"
+#ifdef CONFIG_THREAD
+#include "qemu-thread.h"
+#endif
+
+typedef struct CompressJob {
+    const uint8_t *src;
+    uint8_t *dst;
+    size_t len;                 /* 0 if the page did not get smaller */
+} CompressJob;
+
+typedef struct CompressWorker {
+    CompressPool *pool;
+    int index;
+    z_stream stream;
+#ifdef CONFIG_THREAD
+    QemuThread thread;
+#endif
+} CompressWorker;
+
+struct CompressPool {
+    size_t page_size;
+    int max_jobs;
+    int n_jobs;
+    CompressJob *jobs;
+    uint8_t *out;               /* max_jobs output pages */
+    int n_workers;
+    CompressWorker *workers;
+#ifdef CONFIG_THREAD
+    bool threaded;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    uint64_t generation;        /* bumped for every batch */
+    int busy;                   /* workers still compressing this batch */
+    bool quit;
+#endif
+};
+
+static void compress_worker_job(CompressWorker *w, CompressJob *job)
+{
+    z_stream *s = &w->stream;
+
+    deflateReset(s);
+    s->next_in = (Bytef *)job->src;
+    s->avail_in = w->pool->page_size;
+    s->next_out = job->dst;
+    /* Only keep results that are smaller than the page itself */
+    s->avail_out = w->pool->page_size - 1;
+
+    if (deflate(s, Z_FINISH) == Z_STREAM_END) {
+        job->len = s->total_out;
+    } else {
+        job->len = 0;
+    }
+}
+
+static void compress_worker_batch(CompressWorker *w)
+{
+    CompressPool *pool = w->pool;
+    int i;
+
+    for (i = w->index; i < pool->n_jobs; i += pool->n_workers) {
+        compress_worker_job(w, &pool->jobs[i]);
+    }
+}
+
+#ifdef CONFIG_THREAD
+static void *compress_worker_thread(void *opaque)
+{
+    CompressWorker *w = opaque;
+    CompressPool *pool = w->pool;
+    uint64_t generation = 0;
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->generation == generation) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        generation = pool->generation;
+        qemu_mutex_unlock(&pool->lock);
+
+        compress_worker_batch(w);
+
+        qemu_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            qemu_cond_signal(&pool->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+    return NULL;
+}
+#endif
+
+/* Create a pool compressing batches of up to max_jobs pages of page_size
+   bytes with the given zlib level.  threads workers are started if thread
+   support is available; with threads <= 1 the caller does the work. */
+CompressPool *compress_pool_new(int threads, int level, size_t page_size,
+                                int max_jobs)
+{
+    CompressPool *pool;
+    int i;
+
+    pool = qemu_mallocz(sizeof(*pool));
+    pool->page_size = page_size;
+    pool->max_jobs = max_jobs;
+    pool->jobs = qemu_mallocz(sizeof(*pool->jobs) * max_jobs);
+    pool->out = qemu_malloc(page_size * max_jobs);
+    for (i = 0; i < max_jobs; i++) {
+        pool->jobs[i].dst = pool->out + page_size * i;
+    }
+
+#ifdef CONFIG_THREAD
+    pool->n_workers = MAX(threads, 1);
+#else
+    pool->n_workers = 1;
+#endif
+    pool->workers = qemu_mallocz(sizeof(*pool->workers) * pool->n_workers);
+    for (i = 0; i < pool->n_workers; i++) {
+        CompressWorker *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->index = i;
+        if (deflateInit(&w->stream, level) != Z_OK) {
+            pool->n_workers = i;
+            compress_pool_free(pool);
+            return NULL;
+        }
+    }
+
+#ifdef CONFIG_THREAD
+    pool->threaded = pool->n_workers > 1;
+    if (pool->threaded) {
+        qemu_mutex_init(&pool->lock);
+        qemu_cond_init(&pool->work_cond);
+        qemu_cond_init(&pool->done_cond);
+        for (i = 0; i < pool->n_workers; i++) {
+            qemu_thread_create(&pool->workers[i].thread,
+                               compress_worker_thread, &pool->workers[i]);
+        }
+    }
+#endif
+    return pool;
+}
+
+void compress_pool_free(CompressPool *pool)
+{
+    int i;
+
+#ifdef CONFIG_THREAD
+    if (pool->threaded) {
+        qemu_mutex_lock(&pool->lock);
+        pool->quit = true;
+        qemu_cond_broadcast(&pool->work_cond);
+        qemu_mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->n_workers; i++) {
+            qemu_thread_join(&pool->workers[i].thread);
+        }
+        qemu_cond_destroy(&pool->done_cond);
+        qemu_cond_destroy(&pool->work_cond);
+        qemu_mutex_destroy(&pool->lock);
+    }
+#endif
+    for (i = 0; i < pool->n_workers; i++) {
+        deflateEnd(&pool->workers[i].stream);
+    }
+    qemu_free(pool->workers);
+    qemu_free(pool->out);
+    qemu_free(pool->jobs);
+    qemu_free(pool);
+}
+
+/* Queue a page for the next batch.  The page must stay mapped until
+   compress_pool_run() returns.  Returns the job number, or -1 if the batch
+   is full. */
+int compress_pool_add(CompressPool *pool, const uint8_t *page)
+{
+    if (pool->n_jobs == pool->max_jobs) {
+        return -1;
+    }
+    pool->jobs[pool->n_jobs].src = page;
+    pool->jobs[pool->n_jobs].len = 0;
+    return pool->n_jobs++;
+}
+
+/* Compress all queued pages, returns when the whole batch is done */
+void compress_pool_run(CompressPool *pool)
+{
+    if (!pool->n_jobs) {
+        return;
+    }
+#ifdef CONFIG_THREAD
+    if (pool->threaded) {
+        qemu_mutex_lock(&pool->lock);
+        pool->busy = pool->n_workers;
+        pool->generation++;
+        qemu_cond_broadcast(&pool->work_cond);
+        while (pool->busy) {
+            qemu_cond_wait(&pool->done_cond, &pool->lock);
+        }
+        qemu_mutex_unlock(&pool->lock);
+        return;
+    }
+#endif
+    compress_worker_batch(&pool->workers[0]);
+}
+
+/* Return the compressed data of a job of the last batch, or NULL if the
+   page does not compress and should be sent as is */
+const uint8_t *compress_pool_result(CompressPool *pool, int job, size_t *len)
+{
+    *len = pool->jobs[job].len;
+    return *len ? pool->jobs[job].dst : NULL;
+}
+
+void compress_pool_clear(CompressPool *pool)
+{
+    pool->n_jobs = 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * Parallel page compression for RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qemu-common.h"
+
+typedef struct CompressPool CompressPool;
+
+CompressPool *compress_pool_new(int threads, int level, size_t page_size,
+                                int max_jobs);
+void compress_pool_free(CompressPool *pool);
+
+int compress_pool_add(CompressPool *pool, const uint8_t *page);
+void compress_pool_run(CompressPool *pool);
+const uint8_t *compress_pool_result(CompressPool *pool, int job, size_t *len);
+void compress_pool_clear(CompressPool *pool);
+
+#endif
@@ -0,0 +1,245 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * Records the stream of an outgoing migration in a file, and replays a
+ * recorded stream into an incoming one, as fast as it loads or at a given
+ * rate, optionally reporting how long each section took to load and how
+ * the RAM pages were encoded.  This measures the destination side of
+ * migration in isolation, with the same stream every time.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "qemu-option.h"
+#include "migration.h"
+#include "sysemu.h"
+#include "buffered_file.h"
+#include "block.h"
+#include "hw/hw.h"
+#include "qemu-objects.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+typedef struct FileReplay {
+    int fd;
+    int64_t rate;               /* bytes per second, 0 for unlimited */
+    int report;
+    int64_t start;
+    int64_t bytes;
+    QEMUFile *file;
+} FileReplay;
+
+static int file_errno(FdMigrationState *s)
+{
+    return errno;
+}
+
+static int file_write(FdMigrationState *s, const void * buf, size_t size)
+{
+    return write(s->fd, buf, size);
+}
+
+static int file_close(FdMigrationState *s)
+{
+    int ret = 0;
+
+    DPRINTF("file_close\n");
+    if (s->fd != -1) {
+        if (close(s->fd) < 0) {
+            ret = -1;
+        }
+        s->fd = -1;
+    }
+    return ret;
+}
+
+MigrationState *file_start_outgoing_migration(Monitor *mon,
+                                              const char *path,
+                                              int64_t bandwidth_limit,
+                                              int detach,
+                                              int blk,
+                                              int inc)
+{
+    FdMigrationState *s;
+
+    s = qemu_mallocz(sizeof(*s));
+
+    s->fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (s->fd == -1) {
+        DPRINTF("Unable to open %s\n", path);
+        qemu_free(s);
+        return NULL;
+    }
+
+    s->get_error = file_errno;
+    s->write = file_write;
+    s->close = file_close;
+    s->mig_state.cancel = migrate_fd_cancel;
+    s->mig_state.get_status = migrate_fd_get_status;
+    s->mig_state.release = migrate_fd_release;
+
+    s->mig_state.blk = blk;
+    s->mig_state.shared = inc;
+
+    s->state = MIG_STATE_ACTIVE;
+    s->mon = NULL;
+    s->bandwidth_limit = bandwidth_limit;
+
+    if (!detach) {
+        migrate_fd_monitor_suspend(s, mon);
+    }
+
+    migrate_fd_connect(s);
+    return &s->mig_state;
+}
+
+/* Reads no faster than the rate, sleeping until the bytes are due */
+static int file_replay_get_buffer(void *opaque, uint8_t *buf,
+                                  int64_t pos, int size)
+{
+    FileReplay *s = opaque;
+    ssize_t len;
+
+    if (s->rate) {
+        int64_t due = s->start + s->bytes * 1000000000LL / s->rate;
+        int64_t now = get_clock();
+
+        if (now < due) {
+            struct timespec ts = { (due - now) / 1000000000LL,
+                                   (due - now) % 1000000000LL };
+
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+            }
+        }
+    }
+
+    do {
+        len = read(s->fd, buf, size);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) {
+        return -errno;
+    }
+    s->bytes += len;
+    return len;
+}
+
+static int file_replay_close(void *opaque)
+{
+    FileReplay *s = opaque;
+
+    close(s->fd);
+    qemu_free(s);
+    return 0;
+}
+
+static void file_replay_report(FileReplay *s, int64_t ns)
+{
+    QObject *breakdown = qemu_loadvm_breakdown();
+    QObject *pages = ram_load_page_stats();
+    QDict *qdict = qobject_to_qdict(pages);
+    QListEntry *e;
+
+    fprintf(stderr, "replay: %" PRId64 " bytes in %" PRId64 " ms, "
+            "%.1f MB/s\n", s->bytes, ns / 1000000,
+            ns ? s->bytes * 1e9 / ns / (1 << 20) : 0);
+    if (breakdown) {
+        fprintf(stderr, "load breakdown:\n");
+        QLIST_FOREACH_ENTRY(qobject_to_qlist(breakdown), e) {
+            QDict *section = qobject_to_qdict(qlist_entry_obj(e));
+
+            fprintf(stderr, "  %s.%" PRId64 ": %" PRId64 " bytes, %" PRId64
+                    " us\n", qdict_get_str(section, "device"),
+                    qdict_get_int(section, "instance"),
+                    qdict_get_int(section, "bytes"),
+                    qdict_get_int(section, "time-ns") / 1000);
+        }
+        qobject_decref(breakdown);
+    }
+    fprintf(stderr, "ram pages: dup %" PRId64 ", full %" PRId64 ", zlib %"
+            PRId64 ", xbzrle %" PRId64 ", continue %" PRId64 "\n",
+            qdict_get_int(qdict, "dup"), qdict_get_int(qdict, "full"),
+            qdict_get_int(qdict, "zlib"), qdict_get_int(qdict, "xbzrle"),
+            qdict_get_int(qdict, "continue"));
+    qobject_decref(pages);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    FileReplay *s = opaque;
+    QEMUFile *f = s->file;
+
+    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    s->start = get_clock();
+    process_incoming_migration(f);
+    if (s->report) {
+        file_replay_report(s, get_clock() - s->start);
+    }
+    qemu_fclose(f);
+}
+
+/* path[,rate=bytes per second][,report=on|off] */
+int file_start_incoming_migration(const char *spec)
+{
+    static const char * const params[] = { "rate", "report", NULL };
+    const char *opts = strchr(spec, ',');
+    char *path;
+    char buf[64];
+    FileReplay *s;
+    int fd;
+
+    s = qemu_mallocz(sizeof(*s));
+    if (opts) {
+        char *end;
+
+        path = qemu_strndup(spec, opts - spec);
+        opts++;
+        if (check_params(buf, sizeof(buf), params, opts) < 0) {
+            fprintf(stderr, "file migration: invalid option '%s'\n", buf);
+            goto fail;
+        }
+        if (get_param_value(buf, sizeof(buf), "rate", opts)) {
+            s->rate = strtosz_suffix(buf, &end, STRTOSZ_DEFSUFFIX_B);
+            if (s->rate < 0 || *end) {
+                fprintf(stderr, "file migration: invalid rate '%s'\n", buf);
+                goto fail;
+            }
+        }
+        if (get_param_value(buf, sizeof(buf), "report", opts)) {
+            s->report = !strcmp(buf, "on");
+        }
+    } else {
+        path = qemu_strdup(spec);
+    }
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+    fd = qemu_open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "file migration: could not open %s: %s\n",
+                path, strerror(errno));
+        goto fail;
+    }
+    qemu_free(path);
+
+    s->fd = fd;
+    s->file = qemu_fopen_ops(s, NULL, file_replay_get_buffer,
+                             file_replay_close, NULL, NULL, NULL);
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, s);
+    return 0;
+
+fail:
+    qemu_free(path);
+    qemu_free(s);
+    return -EINVAL;
+}
@@ -0,0 +1,465 @@
+/*
+ * Post-copy migration, destination side
+ *
+ * In post-copy mode the guest starts running on the destination before
+ * its RAM has arrived.  Guest RAM is emptied and registered with
+ * userfaultfd; a fault thread asks the source for every page the guest
+ * touches that is still missing, while a load thread receives the pages
+ * the source pushes, requested ones first, and maps them in, waking up
+ * the faulting threads.
+ *
+ * Requests go back to the source over the migration socket, one per
+ * page, addressed like the pages of the migration stream:
+ *
+ *   u8 idstr length, idstr of the RAM block, be64 offset in the block
+ *
+ * The same machinery restores RAM lazily from a snapshot; the fault thread
+ * then has a local source read the requested pages, while the load thread
+ * prefetches the others.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "migration-postcopy.h"
+
+#if defined(CONFIG_USERFAULTFD) && defined(CONFIG_THREAD)
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "qemu-thread.h"
+
+typedef struct PostcopyRange {
+    char idstr[256];
+    uint8_t *host;
+    size_t length;
+} PostcopyRange;
+
+typedef struct PostcopyState {
+    size_t page_size;
+    PostcopyLoadFunc *load;
+    PostcopyRequestFunc *request;
+    void *opaque;               /* of load and request */
+    PostcopyRange *ranges;
+    int n_ranges;
+    QEMUFile *file;
+    int fd;                     /* migration socket, for page requests */
+    int uffd;
+    int quit_pipe[2];
+    QemuThread fault_thread;
+    QemuThread load_thread;
+    bool started;
+    volatile bool done;         /* set by the load thread once it is over */
+} PostcopyState;
+
+static PostcopyState postcopy_state;
+
+/* Prepare for a post-copy migration, to be started once the device state
+   arrives.  load receives the pages that follow it in the stream. */
+int postcopy_incoming_init(size_t page_size, PostcopyLoadFunc *load)
+{
+    PostcopyState *s = &postcopy_state;
+
+    if (s->started && !s->done) {
+        fprintf(stderr, "post-copy migration already started\n");
+        return -EBUSY;
+    }
+    s->started = false;
+    s->done = false;
+    if (page_size != getpagesize()) {
+        fprintf(stderr, "post-copy migration needs %zd byte pages\n",
+                (ssize_t)getpagesize());
+        return -ENOTSUP;
+    }
+    qemu_free(s->ranges);
+    s->ranges = NULL;
+    s->n_ranges = 0;
+    s->page_size = page_size;
+    s->load = load;
+    return 0;
+}
+
+/* Add guest memory that is only filled in as it is faulted in */
+void postcopy_incoming_add_range(const char *idstr, void *host, size_t length)
+{
+    PostcopyState *s = &postcopy_state;
+    PostcopyRange *r;
+
+    s->ranges = qemu_realloc(s->ranges, sizeof(*r) * (s->n_ranges + 1));
+    r = &s->ranges[s->n_ranges++];
+    pstrcpy(r->idstr, sizeof(r->idstr), idstr);
+    r->host = host;
+    r->length = length;
+}
+
+static void postcopy_request_page(PostcopyState *s, uint64_t addr)
+{
+    uint64_t offset;
+    int i;
+
+    for (i = 0; i < s->n_ranges; i++) {
+        PostcopyRange *r = &s->ranges[i];
+
+        if (addr >= (uintptr_t)r->host &&
+            addr < (uintptr_t)r->host + r->length) {
+            break;
+        }
+    }
+    if (i == s->n_ranges) {
+        return;
+    }
+
+    offset = (addr - (uintptr_t)s->ranges[i].host) & ~(s->page_size - 1);
+    s->request(s->opaque, s->ranges[i].idstr, offset);
+}
+
+/* Ask the source of the migration on the socket for a page */
+static void postcopy_socket_request(void *opaque, const char *idstr,
+                                    uint64_t offset)
+{
+    PostcopyState *s = &postcopy_state;
+    uint8_t buf[1 + 255 + 8];
+    int len;
+
+    len = strlen(idstr);
+    buf[0] = len;
+    memcpy(buf + 1, idstr, len);
+    cpu_to_be64wu((uint64_t *)(buf + 1 + len), offset);
+    if (qemu_write_full(s->fd, buf, 1 + len + 8) != 1 + len + 8) {
+        fprintf(stderr, "post-copy: cannot request page: %s\n",
+                strerror(errno));
+    }
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    PostcopyState *s = opaque;
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+    ssize_t ret;
+
+    pfd[0].fd = s->uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = s->quit_pipe[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        if (!(pfd[0].revents & POLLIN)) {
+            continue;
+        }
+
+        ret = read(s->uffd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            break;
+        }
+        if (msg.event == UFFD_EVENT_PAGEFAULT) {
+            postcopy_request_page(s, msg.arg.pagefault.address);
+        }
+    }
+    return NULL;
+}
+
+static void *postcopy_load_thread(void *opaque)
+{
+    PostcopyState *s = opaque;
+    int i;
+
+    if (s->load(s->opaque) < 0) {
+        /* The guest cannot go on without the rest of its memory */
+        fprintf(stderr, "post-copy migration failed, guest memory is "
+                "incomplete\n");
+        exit(1);
+    }
+
+    /* Everything is there, stop listening for faults */
+    if (write(s->quit_pipe[1], "", 1) != 1) {
+        abort();
+    }
+    qemu_thread_join(&s->fault_thread);
+
+    for (i = 0; i < s->n_ranges; i++) {
+        struct uffdio_range range;
+
+        range.start = (uintptr_t)s->ranges[i].host;
+        range.len = s->ranges[i].length;
+        ioctl(s->uffd, UFFDIO_UNREGISTER, &range);
+    }
+    close(s->uffd);
+    close(s->quit_pipe[0]);
+    close(s->quit_pipe[1]);
+
+    if (s->file) {
+        qemu_fclose(s->file);
+        close(s->fd);
+    }
+    s->done = true;
+    return NULL;
+}
+
+static int postcopy_start(PostcopyState *s)
+{
+    struct uffdio_api api;
+    int i;
+
+    if (!s->load) {
+        fprintf(stderr, "post-copy migration was not prepared\n");
+        return -EINVAL;
+    }
+
+    s->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (s->uffd < 0) {
+        fprintf(stderr, "post-copy: userfaultfd: %s\n", strerror(errno));
+        return -errno;
+    }
+    api.api = UFFD_API;
+    api.features = 0;
+    if (ioctl(s->uffd, UFFDIO_API, &api) < 0) {
+        fprintf(stderr, "post-copy: UFFDIO_API: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    for (i = 0; i < s->n_ranges; i++) {
+        PostcopyRange *r = &s->ranges[i];
+        struct uffdio_register reg;
+
+        /* Drop what is there, so that every access faults */
+        if (madvise(r->host, r->length, MADV_DONTNEED) < 0) {
+            fprintf(stderr, "post-copy: cannot discard %s: %s\n",
+                    r->idstr, strerror(errno));
+            goto fail;
+        }
+
+        reg.range.start = (uintptr_t)r->host;
+        reg.range.len = r->length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(s->uffd, UFFDIO_REGISTER, &reg) < 0 ||
+            !(reg.ioctls & (1ULL << _UFFDIO_COPY))) {
+            fprintf(stderr, "post-copy: cannot register %s: %s\n",
+                    r->idstr, strerror(errno));
+            goto fail;
+        }
+    }
+
+    if (pipe(s->quit_pipe) < 0) {
+        goto fail;
+    }
+
+    s->started = true;
+    qemu_thread_create(&s->fault_thread, postcopy_fault_thread, s);
+    qemu_thread_create(&s->load_thread, postcopy_load_thread, s);
+    qemu_thread_detach(&s->load_thread);
+    return 0;
+
+fail:
+    close(s->uffd);
+    return -EINVAL;
+}
+
+/* Empty guest memory and start faulting it in from f, the rest of the
+   incoming migration stream.  On success, f and its socket belong to the
+   post-copy threads. */
+int postcopy_incoming_start(QEMUFile *f)
+{
+    PostcopyState *s = &postcopy_state;
+    int ret;
+
+    s->fd = qemu_file_socket_fd(f);
+    if (s->fd < 0) {
+        fprintf(stderr, "post-copy migration needs a socket\n");
+        return -EINVAL;
+    }
+    s->file = f;
+    s->request = postcopy_socket_request;
+    s->opaque = f;
+
+    ret = postcopy_start(s);
+    if (ret < 0) {
+        s->file = NULL;
+    }
+    return ret;
+}
+
+/* Empty guest memory and start faulting it in from a local source: request
+   is called in the fault thread for every missing page the guest touches,
+   and has to place it.  load runs in a thread of its own until all of guest
+   memory is placed; both get opaque. */
+int postcopy_incoming_start_local(PostcopyRequestFunc *request, void *opaque)
+{
+    PostcopyState *s = &postcopy_state;
+
+    s->file = NULL;
+    s->request = request;
+    s->opaque = opaque;
+    return postcopy_start(s);
+}
+
+/* Whether the incoming migration file was handed to post-copy */
+bool postcopy_incoming_started(void)
+{
+    return postcopy_state.started;
+}
+
+/* Whether guest memory is still being faulted in */
+bool postcopy_incoming_active(void)
+{
+    return postcopy_state.started && !postcopy_state.done;
+}
+
+/* Map in a page of data at host, waking up the threads waiting for it */
+int postcopy_place_page(void *host, const void *data)
+{
+    PostcopyState *s = &postcopy_state;
+    struct uffdio_copy copy;
+
+    copy.dst = (uintptr_t)host;
+    copy.src = (uintptr_t)data;
+    copy.len = s->page_size;
+    copy.mode = 0;
+    copy.copy = 0;
+    if (ioctl(s->uffd, UFFDIO_COPY, &copy) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    PostcopyState *s = &postcopy_state;
+    struct uffdio_zeropage zero;
+
+    zero.range.start = (uintptr_t)host;
+    zero.range.len = s->page_size;
+    zero.mode = 0;
+    zero.zeropage = 0;
+    if (ioctl(s->uffd, UFFDIO_ZEROPAGE, &zero) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+/* Map in n pages at once; the ones already there are left alone */
+int postcopy_place_pages(void *host, const void *data, size_t n)
+{
+    PostcopyState *s = &postcopy_state;
+    struct uffdio_copy copy;
+    size_t i;
+    int ret;
+
+    copy.dst = (uintptr_t)host;
+    copy.src = (uintptr_t)data;
+    copy.len = s->page_size * n;
+    copy.mode = 0;
+    copy.copy = 0;
+    if (ioctl(s->uffd, UFFDIO_COPY, &copy) == 0) {
+        return 0;
+    } else if (errno != EEXIST) {
+        return -errno;
+    }
+
+    for (i = 0; i < n; i++) {
+        ret = postcopy_place_page((uint8_t *)host + s->page_size * i,
+                                  (const uint8_t *)data + s->page_size * i);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int postcopy_place_zero_pages(void *host, size_t n)
+{
+    PostcopyState *s = &postcopy_state;
+    struct uffdio_zeropage zero;
+    size_t i;
+    int ret;
+
+    zero.range.start = (uintptr_t)host;
+    zero.range.len = s->page_size * n;
+    zero.mode = 0;
+    zero.zeropage = 0;
+    if (ioctl(s->uffd, UFFDIO_ZEROPAGE, &zero) == 0) {
+        return 0;
+    } else if (errno != EEXIST) {
+        return -errno;
+    }
+
+    for (i = 0; i < n; i++) {
+        ret = postcopy_place_zero_page((uint8_t *)host + s->page_size * i);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+#else
+
+int postcopy_incoming_init(size_t page_size, PostcopyLoadFunc *load)
+{
+    fprintf(stderr, "post-copy migration is not supported by this host\n");
+    return -ENOTSUP;
+}
+
+void postcopy_incoming_add_range(const char *idstr, void *host, size_t length)
+{
+}
+
+int postcopy_incoming_start(QEMUFile *f)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_incoming_start_local(PostcopyRequestFunc *request, void *opaque)
+{
+    return -ENOTSUP;
+}
+
+bool postcopy_incoming_started(void)
+{
+    return false;
+}
+
+bool postcopy_incoming_active(void)
+{
+    return false;
+}
+
+int postcopy_place_page(void *host, const void *data)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_place_pages(void *host, const void *data, size_t n)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_place_zero_pages(void *host, size_t n)
+{
+    return -ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Post-copy migration, destination side
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_POSTCOPY_H
+#define QEMU_MIGRATION_POSTCOPY_H
+
+#include "hw/hw.h"
+
+typedef int (PostcopyLoadFunc)(void *opaque);
+typedef void (PostcopyRequestFunc)(void *opaque, const char *idstr,
+                                   uint64_t offset);
+
+int postcopy_incoming_init(size_t page_size, PostcopyLoadFunc *load);
+void postcopy_incoming_add_range(const char *idstr, void *host, size_t length);
+int postcopy_incoming_start(QEMUFile *f);
+int postcopy_incoming_start_local(PostcopyRequestFunc *request, void *opaque);
+bool postcopy_incoming_started(void);
+bool postcopy_incoming_active(void);
+
+int postcopy_place_page(void *host, const void *data);
+int postcopy_place_zero_page(void *host);
+int postcopy_place_pages(void *host, const void *data, size_t n);
+int postcopy_place_zero_pages(void *host, size_t n);
+
+#endif
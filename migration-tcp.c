@@ -18,6 +18,7 @@
 #include "sysemu.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "migration-channels.h"
 
 //#define DEBUG_MIGRATION_TCP
 
@@ -29,6 +30,12 @@
     do { } while (0)
 #endif
 
+/* Destination of the outgoing migration, for its extra channels */
+static struct sockaddr_in outgoing_addr;
+
+/* Listening socket of the incoming migration, for its extra channels */
+static int incoming_listen_fd = -1;
+
 static int socket_errno(FdMigrationState *s)
 {
     return socket_error();
@@ -89,6 +96,7 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
 
     if (parse_host_port(&addr, host_port) < 0)
         return NULL;
+    outgoing_addr = addr;
 
     s = qemu_mallocz(sizeof(*s));
 
@@ -135,13 +143,67 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
     return &s->mig_state;
 }
 
+/* Open another connection to the destination of the outgoing migration.
+   This blocks until connected, the destination is already listening. */
+int tcp_open_migration_channel(void)
+{
+    int fd, ret;
+
+    fd = qemu_socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    do {
+        ret = connect(fd, (struct sockaddr *)&outgoing_addr,
+                      sizeof(outgoing_addr));
+    } while (ret == -1 && socket_error() == EINTR);
+
+    if (ret == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Accept another connection of the incoming migration, giving up after
+   10 seconds */
+int tcp_accept_migration_channel(void)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    struct timeval tv;
+    fd_set rfds;
+    int c, ret;
+
+    if (incoming_listen_fd == -1) {
+        return -1;
+    }
+
+    do {
+        FD_ZERO(&rfds);
+        FD_SET(incoming_listen_fd, &rfds);
+        tv.tv_sec = 10;
+        tv.tv_usec = 0;
+        ret = select(incoming_listen_fd + 1, &rfds, NULL, NULL, &tv);
+    } while (ret == -1 && socket_error() == EINTR);
+    if (ret <= 0) {
+        return -1;
+    }
+
+    do {
+        c = qemu_accept(incoming_listen_fd, (struct sockaddr *)&addr,
+                        &addrlen);
+    } while (c == -1 && socket_error() == EINTR);
+    return c;
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
     int s = (unsigned long)opaque;
     QEMUFile *f;
-    int c;
+    int c, ret;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
@@ -160,7 +222,13 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    incoming_listen_fd = s;
+    ret = process_incoming_migration(f);
+    incoming_listen_fd = -1;
+    if (ret) {
+        /* Post-copy goes on with the rest of RAM, and closes f and c */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
@@ -190,7 +258,8 @@ int tcp_start_incoming_migration(const char *host_port)
     if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1)
         goto err;
 
-    if (listen(s, 1) == -1)
+    /* Extra channels connect while the main connection is being loaded */
+    if (listen(s, MIGRATION_CHANNELS_MAX) == -1)
         goto err;
 
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
@@ -168,12 +168,18 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
-    qemu_fclose(f);
+    if (process_incoming_migration(f)) {
+        /* Post-copy goes on with the rest of RAM, and closes f and c */
+        c = -1;
+    } else {
+        qemu_fclose(f);
+    }
 out:
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
     close(s);
-    close(c);
+    if (c != -1) {
+        close(c);
+    }
 }
 
 int unix_start_incoming_migration(const char *path)
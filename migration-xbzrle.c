@@ -0,0 +1,179 @@
+/*
+ * Delta encoding of re-dirtied RAM pages for migration
+ *
+ * The source keeps a copy of the last version of recently sent pages in a
+ * direct mapped cache indexed by RAM address.  When a cached page is dirty
+ * again, only the bytes that changed are sent, run length encoded against
+ * the cached copy, which is what the destination has in memory.
+ *
+ * An encoded page is a sequence of runs; each starts with the number of
+ * unchanged bytes, followed, unless the end of the page is reached, by the
+ * number of changed bytes and their new values.  Lengths are unsigned
+ * LEB128 numbers.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "migration-xbzrle.h"
+
+typedef struct XBZRLECacheSlot {
+    uint64_t addr;
+    bool valid;
+} XBZRLECacheSlot;
+
+struct XBZRLECache {
+    size_t page_size;
+    size_t n_slots;
+    XBZRLECacheSlot *slots;
+    uint8_t *data;              /* n_slots pages */
+};
+
+/* Create a cache of about size bytes of pages of page_size bytes */
+XBZRLECache *xbzrle_cache_new(size_t size, size_t page_size)
+{
+    XBZRLECache *cache;
+
+    cache = qemu_mallocz(sizeof(*cache));
+    cache->page_size = page_size;
+    cache->n_slots = MAX(size / page_size, 1);
+    cache->slots = qemu_mallocz(sizeof(*cache->slots) * cache->n_slots);
+    cache->data = qemu_malloc(page_size * cache->n_slots);
+    return cache;
+}
+
+void xbzrle_cache_free(XBZRLECache *cache)
+{
+    qemu_free(cache->data);
+    qemu_free(cache->slots);
+    qemu_free(cache);
+}
+
+static size_t xbzrle_cache_slot(XBZRLECache *cache, uint64_t addr)
+{
+    return (addr / cache->page_size) % cache->n_slots;
+}
+
+/* Return the cached copy of the page at addr, or NULL */
+uint8_t *xbzrle_cache_lookup(XBZRLECache *cache, uint64_t addr)
+{
+    size_t i = xbzrle_cache_slot(cache, addr);
+
+    if (!cache->slots[i].valid || cache->slots[i].addr != addr) {
+        return NULL;
+    }
+    return cache->data + cache->page_size * i;
+}
+
+/* Return the buffer for the page at addr, replacing whatever page used the
+   same slot.  The caller fills in the contents. */
+uint8_t *xbzrle_cache_insert(XBZRLECache *cache, uint64_t addr)
+{
+    size_t i = xbzrle_cache_slot(cache, addr);
+
+    cache->slots[i].addr = addr;
+    cache->slots[i].valid = true;
+    return cache->data + cache->page_size * i;
+}
+
+static int xbzrle_put_uleb128(uint8_t *dst, int pos, int dst_len,
+                              uint32_t val)
+{
+    do {
+        uint8_t byte = val & 0x7f;
+
+        val >>= 7;
+        if (val) {
+            byte |= 0x80;
+        }
+        if (pos >= dst_len) {
+            return -1;
+        }
+        dst[pos++] = byte;
+    } while (val);
+    return pos;
+}
+
+static int xbzrle_get_uleb128(const uint8_t *src, int pos, int len,
+                              uint32_t *val)
+{
+    int shift = 0;
+
+    *val = 0;
+    do {
+        if (pos >= len || shift > 28) {
+            return -1;
+        }
+        *val |= (uint32_t)(src[pos] & 0x7f) << shift;
+        shift += 7;
+    } while (src[pos++] & 0x80);
+    return pos;
+}
+
+/* Encode the changes from old to new, both size bytes long, into dst.
+   Returns the encoded length, or -1 if it does not fit in dst_len bytes. */
+int xbzrle_encode(const uint8_t *old, const uint8_t *new, int size,
+                  uint8_t *dst, int dst_len)
+{
+    int i = 0, pos = 0;
+
+    for (;;) {
+        int start = i;
+
+        /* Unchanged run, mostly a long one, compare a word at a time */
+        while (i + (int)sizeof(long) <= size &&
+               !memcmp(old + i, new + i, sizeof(long))) {
+            i += sizeof(long);
+        }
+        while (i < size && old[i] == new[i]) {
+            i++;
+        }
+        pos = xbzrle_put_uleb128(dst, pos, dst_len, i - start);
+        if (pos < 0) {
+            return -1;
+        }
+        if (i == size) {
+            return pos;
+        }
+
+        start = i;
+        while (i < size && old[i] != new[i]) {
+            i++;
+        }
+        pos = xbzrle_put_uleb128(dst, pos, dst_len, i - start);
+        if (pos < 0 || pos + (i - start) > dst_len) {
+            return -1;
+        }
+        memcpy(dst + pos, new + start, i - start);
+        pos += i - start;
+    }
+}
+
+/* Apply len bytes of changes encoded by xbzrle_encode() to the size bytes
+   at dst.  Returns 0, or -1 if the encoded data is corrupt. */
+int xbzrle_decode(const uint8_t *src, int len, uint8_t *dst, int size)
+{
+    int i = 0, pos = 0;
+    uint32_t run;
+
+    for (;;) {
+        pos = xbzrle_get_uleb128(src, pos, len, &run);
+        if (pos < 0 || run > size - i) {
+            return -1;
+        }
+        i += run;
+        if (i == size) {
+            return pos == len ? 0 : -1;
+        }
+
+        pos = xbzrle_get_uleb128(src, pos, len, &run);
+        if (pos < 0 || run == 0 || run > size - i || run > len - pos) {
+            return -1;
+        }
+        memcpy(dst + i, src + pos, run);
+        i += run;
+        pos += run;
+    }
+}
@@ -0,0 +1,25 @@
+/*
+ * Delta encoding of re-dirtied RAM pages for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_XBZRLE_H
+#define QEMU_MIGRATION_XBZRLE_H
+
+#include "qemu-common.h"
+
+typedef struct XBZRLECache XBZRLECache;
+
+XBZRLECache *xbzrle_cache_new(size_t size, size_t page_size);
+void xbzrle_cache_free(XBZRLECache *cache);
+uint8_t *xbzrle_cache_lookup(XBZRLECache *cache, uint64_t addr);
+uint8_t *xbzrle_cache_insert(XBZRLECache *cache, uint64_t addr);
+
+int xbzrle_encode(const uint8_t *old, const uint8_t *new, int size,
+                  uint8_t *dst, int dst_len);
+int xbzrle_decode(const uint8_t *src, int len, uint8_t *dst, int size);
+
+#endif
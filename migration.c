@@ -16,10 +16,14 @@
 #include "monitor.h"
 #include "buffered_file.h"
 #include "sysemu.h"
+#include "cpus.h"
 #include "block.h"
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qemu-objects.h"
+#include "arch_init.h"
+#include "migration-postcopy.h"
+#include "migration-channels.h"
 
 //#define DEBUG_MIGRATION
 
@@ -36,6 +40,9 @@ static int64_t max_throttle = (32 << 20);
 
 static MigrationState *current_migration;
 
+/* The running migration switches to post-copy */
+static int postcopy;
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -53,6 +60,8 @@ int qemu_start_incoming_migration(const char *uri)
         ret = unix_start_incoming_migration(p);
     else if (strstart(uri, "fd:", &p))
         ret = fd_start_incoming_migration(p);
+    else if (strstart(uri, "file:", &p))
+        ret = file_start_incoming_migration(p);
 #endif
     else {
         fprintf(stderr, "unknown migration protocol: %s\n", uri);
@@ -61,7 +70,9 @@ int qemu_start_incoming_migration(const char *uri)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+/* Returns 1 if f now belongs to post-copy, which goes on receiving RAM
+   in the background, and must not be closed */
+int process_incoming_migration(QEMUFile *f)
 {
     if (qemu_loadvm_state(f) < 0) {
         fprintf(stderr, "load of migration failed\n");
@@ -74,6 +85,8 @@ void process_incoming_migration(QEMUFile *f)
 
     if (autostart)
         vm_start();
+
+    return postcopy_incoming_started();
 }
 
 int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
@@ -83,6 +96,7 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
     int detach = qdict_get_try_bool(qdict, "detach", 0);
     int blk = qdict_get_try_bool(qdict, "blk", 0);
     int inc = qdict_get_try_bool(qdict, "inc", 0);
+    int pc = qdict_get_try_bool(qdict, "postcopy", 0);
     const char *uri = qdict_get_str(qdict, "uri");
 
     if (current_migration &&
@@ -95,6 +109,24 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
         return -1;
     }
 
+    if (pc) {
+#ifndef CONFIG_THREAD
+        monitor_printf(mon, "post-copy migration needs thread support\n");
+        return -1;
+#endif
+        /* Pages are requested back over the migration socket */
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            monitor_printf(mon, "post-copy migration needs a tcp or unix "
+                           "uri\n");
+            return -1;
+        }
+    }
+    if (migrate_channels() > 1 && !strstart(uri, "tcp:", NULL)) {
+        monitor_printf(mon, "migration channels need a tcp uri\n");
+        return -1;
+    }
+    postcopy = pc;
+
     if (strstart(uri, "tcp:", &p)) {
         s = tcp_start_outgoing_migration(mon, p, max_throttle, detach,
                                          blk, inc);
@@ -108,6 +140,9 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
     } else if (strstart(uri, "fd:", &p)) {
         s = fd_start_outgoing_migration(mon, p, max_throttle, detach, 
                                         blk, inc);
+    } else if (strstart(uri, "file:", &p)) {
+        s = file_start_outgoing_migration(mon, p, max_throttle, detach,
+                                          blk, inc);
 #endif
     } else {
         monitor_printf(mon, "unknown migration protocol: %s\n", uri);
@@ -180,6 +215,142 @@ int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+int migrate_postcopy(void)
+{
+    return postcopy;
+}
+
+/* Connections to stripe RAM pages over, 1 for just the main one */
+static int channels = 1;
+
+int migrate_channels(void)
+{
+    return channels;
+}
+
+int do_migrate_set_channels(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+
+    if (value < 1 || value > MIGRATION_CHANNELS_MAX) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a number between 1 and 16");
+        return -1;
+    }
+#ifndef CONFIG_THREAD
+    if (value > 1) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "1, extra channels need thread support");
+        return -1;
+    }
+#endif
+    channels = value;
+
+    return 0;
+}
+
+/* Throttle the vcpus when the guest dirties memory too fast to converge */
+static int auto_converge;
+
+int migrate_auto_converge(void)
+{
+    return auto_converge;
+}
+
+int do_migrate_set_auto_converge(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data)
+{
+    auto_converge = qdict_get_bool(qdict, "value");
+    if (!auto_converge) {
+        cpu_throttle_set(0);
+    }
+
+    return 0;
+}
+
+/* Reads block migration may keep in flight per device */
+static int block_queue_depth = 16;
+
+int migrate_block_queue_depth(void)
+{
+    return block_queue_depth;
+}
+
+int do_migrate_set_block_queue_depth(Monitor *mon, const QDict *qdict,
+                                     QObject **ret_data)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+
+    if (value < 1 || value > BLK_MIG_QUEUE_DEPTH_MAX) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a number between 1 and 256");
+        return -1;
+    }
+    block_queue_depth = value;
+
+    return 0;
+}
+
+/* RAM page compression, off with 0 threads */
+static int compress_threads;
+static int compress_level = 1;
+
+int migrate_compress_threads(void)
+{
+    return compress_threads;
+}
+
+int migrate_compress_level(void)
+{
+    return compress_level;
+}
+
+int do_migrate_set_compression(Monitor *mon, const QDict *qdict,
+                               QObject **ret_data)
+{
+    int64_t threads = qdict_get_int(qdict, "threads");
+    int64_t level = qdict_get_try_int(qdict, "level", compress_level);
+
+    if (threads < 0 || threads > 64) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "threads",
+                      "a number between 0 and 64");
+        return -1;
+    }
+    if (level < 1 || level > 9) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "level",
+                      "a number between 1 and 9");
+        return -1;
+    }
+    compress_threads = threads;
+    compress_level = level;
+
+    return 0;
+}
+
+/* Size of the cache of sent pages for delta encoding, off with 0 */
+static int64_t xbzrle_cache_size;
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    return xbzrle_cache_size;
+}
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+
+    if (value < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a positive size");
+        return -1;
+    }
+    xbzrle_cache_size = value;
+
+    return 0;
+}
+
 static void migrate_print_status(Monitor *mon, const char *name,
                                  const QDict *status_dict)
 {
@@ -195,14 +366,57 @@ static void migrate_print_status(Monitor *mon, const char *name,
                         qdict_get_int(qdict, "total") >> 10);
 }
 
+static void migrate_print_convergence(Monitor *mon, const QDict *status_dict)
+{
+    QDict *qdict;
+
+    qdict = qobject_to_qdict(qdict_get(status_dict, "convergence"));
+
+    monitor_printf(mon, "iterations: %" PRId64 "\n",
+                   qdict_get_int(qdict, "iterations"));
+    monitor_printf(mon, "dirty rate: %" PRId64 " kbytes/s\n",
+                   qdict_get_int(qdict, "dirty-rate") >> 10);
+    monitor_printf(mon, "transfer rate: %" PRId64 " kbytes/s\n",
+                   qdict_get_int(qdict, "transfer-rate") >> 10);
+    if (qdict_get_int(qdict, "expected-downtime") >= 0) {
+        monitor_printf(mon, "expected downtime: %" PRId64 " ms\n",
+                       qdict_get_int(qdict, "expected-downtime"));
+    }
+    if (qdict_get_int(qdict, "converge-time") >= 0) {
+        monitor_printf(mon, "expected to converge in: %" PRId64 " ms\n",
+                       qdict_get_int(qdict, "converge-time"));
+    } else {
+        monitor_printf(mon, "expected to converge in: never\n");
+    }
+    monitor_printf(mon, "vcpu throttle: %" PRId64 " %%\n",
+                   qdict_get_int(qdict, "throttle"));
+}
+
+static void migrate_print_breakdown(Monitor *mon, const QDict *status_dict)
+{
+    QListEntry *e;
+
+    monitor_printf(mon, "downtime breakdown:\n");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(status_dict, "downtime-breakdown"), e) {
+        QDict *qdict = qobject_to_qdict(qlist_entry_obj(e));
+
+        monitor_printf(mon, "  %s.%" PRId64 ": %" PRId64 " bytes, %" PRId64
+                       " us\n", qdict_get_str(qdict, "device"),
+                       qdict_get_int(qdict, "instance"),
+                       qdict_get_int(qdict, "bytes"),
+                       qdict_get_int(qdict, "time-ns") / 1000);
+    }
+}
+
 void do_info_migrate_print(Monitor *mon, const QObject *data)
 {
     QDict *qdict;
 
     qdict = qobject_to_qdict(data);
 
-    monitor_printf(mon, "Migration status: %s\n",
-                   qdict_get_str(qdict, "status"));
+    monitor_printf(mon, "Migration status: %s%s\n",
+                   qdict_get_str(qdict, "status"),
+                   qdict_haskey(qdict, "postcopy") ? " (post-copy)" : "");
 
     if (qdict_haskey(qdict, "ram")) {
         migrate_print_status(mon, "ram", qdict);
@@ -211,6 +425,14 @@ void do_info_migrate_print(Monitor *mon, const QObject *data)
     if (qdict_haskey(qdict, "disk")) {
         migrate_print_status(mon, "disk", qdict);
     }
+
+    if (qdict_haskey(qdict, "convergence")) {
+        migrate_print_convergence(mon, qdict);
+    }
+
+    if (qdict_haskey(qdict, "downtime-breakdown")) {
+        migrate_print_breakdown(mon, qdict);
+    }
 }
 
 static void migrate_put_status(QDict *qdict, const char *name,
@@ -234,6 +456,9 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
         case MIG_STATE_ACTIVE:
             qdict = qdict_new();
             qdict_put(qdict, "status", qstring_from_str("active"));
+            if (migrate_to_fms(s)->postcopy) {
+                qdict_put(qdict, "postcopy", qbool_from_int(1));
+            }
 
             migrate_put_status(qdict, "ram", ram_bytes_transferred(),
                                ram_bytes_remaining(), ram_bytes_total());
@@ -244,11 +469,32 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
                                    blk_mig_bytes_total());
             }
 
+            if (!migrate_to_fms(s)->postcopy && ram_iterations() > 0) {
+                qdict_put_obj(qdict, "convergence", qobject_from_jsonf(
+                                  "{ 'iterations': %d, "
+                                  "'dirty-rate': %" PRId64 ", "
+                                  "'transfer-rate': %" PRId64 ", "
+                                  "'expected-downtime': %" PRId64 ", "
+                                  "'converge-time': %" PRId64 ", "
+                                  "'throttle': %d }",
+                                  ram_iterations(), ram_dirty_rate(),
+                                  ram_transfer_rate(), ram_expected_downtime(),
+                                  ram_converge_time(), cpu_throttle_get()));
+            }
+
             *ret_data = QOBJECT(qdict);
             break;
-        case MIG_STATE_COMPLETED:
-            *ret_data = qobject_from_jsonf("{ 'status': 'completed' }");
+        case MIG_STATE_COMPLETED: {
+            QObject *breakdown = qemu_savevm_downtime_breakdown();
+
+            qdict = qdict_new();
+            qdict_put(qdict, "status", qstring_from_str("completed"));
+            if (breakdown) {
+                qdict_put_obj(qdict, "downtime-breakdown", breakdown);
+            }
+            *ret_data = QOBJECT(qdict);
             break;
+        }
         case MIG_STATE_ERROR:
             *ret_data = qobject_from_jsonf("{ 'status': 'failed' }");
             break;
@@ -285,6 +531,8 @@ int migrate_fd_cleanup(FdMigrationState *s)
     int ret = 0;
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    postcopy = 0;
+    cpu_throttle_set(0);
 
     if (s->file) {
         DPRINTF("closing file\n");
@@ -315,15 +563,8 @@ void migrate_fd_put_notify(void *opaque)
     qemu_file_put_notify(s->file);
 }
 
-ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
+static ssize_t migrate_fd_put_result(FdMigrationState *s, ssize_t ret)
 {
-    FdMigrationState *s = opaque;
-    ssize_t ret;
-
-    do {
-        ret = s->write(s, data, size);
-    } while (ret == -1 && ((s->get_error(s)) == EINTR));
-
     if (ret == -1)
         ret = -(s->get_error(s));
 
@@ -340,6 +581,74 @@ ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
     return ret;
 }
 
+ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
+{
+    FdMigrationState *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = s->write(s, data, size);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    return migrate_fd_put_result(s, ret);
+}
+
+#ifndef _WIN32
+/* All transports are file descriptors, sockets included */
+ssize_t migrate_fd_writev_buffer(void *opaque, struct iovec *iov, int iovcnt)
+{
+    FdMigrationState *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = writev(s->fd, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    return migrate_fd_put_result(s, ret);
+}
+#endif
+
+/* Write all of data, waiting for the fd to become writable as needed.
+   Runs in the writer thread of the buffered file, so only touches the fd;
+   gives up once the migration is no longer active. */
+ssize_t migrate_fd_write(void *opaque, const void *data, size_t size)
+{
+    FdMigrationState *s = opaque;
+    size_t offset = 0;
+    ssize_t ret;
+
+    while (offset < size) {
+        ret = s->write(s, (const uint8_t *)data + offset, size - offset);
+        if (ret > 0) {
+            offset += ret;
+            continue;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        if (s->get_error(s) == EINTR) {
+            continue;
+        }
+        if (s->get_error(s) != EAGAIN) {
+            return -(s->get_error(s));
+        }
+
+        do {
+            fd_set wfds;
+            struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+
+            if (s->state != MIG_STATE_ACTIVE) {
+                return -EINTR;
+            }
+            FD_ZERO(&wfds);
+            FD_SET(s->fd, &wfds);
+            ret = select(s->fd + 1, NULL, &wfds, NULL, &tv);
+        } while (ret == 0 || (ret == -1 && errno == EINTR));
+    }
+
+    return size;
+}
+
 void migrate_fd_connect(FdMigrationState *s)
 {
     int ret;
@@ -347,6 +656,12 @@ void migrate_fd_connect(FdMigrationState *s)
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
+#ifndef _WIN32
+                                      migrate_fd_writev_buffer,
+#else
+                                      NULL,
+#endif
+                                      migrate_fd_write,
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
@@ -363,6 +678,59 @@ void migrate_fd_connect(FdMigrationState *s)
     migrate_fd_put_ready(s);
 }
 
+/* Page requests of a post-copy destination, see migration-postcopy.c */
+static void migrate_fd_postcopy_read(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    uint8_t *req = s->postcopy_req;
+    ssize_t ret;
+    char idstr[256];
+    int len;
+
+    ret = recv(s->fd, (void *)(req + s->postcopy_req_len),
+               sizeof(s->postcopy_req) - s->postcopy_req_len, 0);
+    if (ret <= 0) {
+        if (ret < 0 && (s->get_error(s) == EAGAIN ||
+                        s->get_error(s) == EINTR)) {
+            return;
+        }
+        /* The destination is gone, and with it the guest */
+        DPRINTF("post-copy destination closed the connection\n");
+        qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+        return;
+    }
+    s->postcopy_req_len += ret;
+
+    while (s->postcopy_req_len > 0 &&
+           s->postcopy_req_len >= 1 + req[0] + 8) {
+        len = req[0];
+        memcpy(idstr, req + 1, len);
+        idstr[len] = 0;
+        ram_postcopy_request(s->file, idstr, be64_to_cpu(*
+                                 (uint64_t *)(req + 1 + len)));
+
+        len += 1 + 8;
+        memmove(req, req + len, s->postcopy_req_len - len);
+        s->postcopy_req_len -= len;
+    }
+    qemu_fflush(s->file);
+}
+
+static void migrate_fd_postcopy_push(FdMigrationState *s)
+{
+    int ret;
+
+    ret = ram_postcopy_push(s->file);
+    if (ret < 0 || (ret == 1 && migrate_fd_cleanup(s) < 0)) {
+        /* The guest stays stopped here, the destination may have run it */
+        migrate_fd_error(s);
+    } else if (ret == 1) {
+        DPRINTF("post-copy done\n");
+        s->state = MIG_STATE_COMPLETED;
+        notifier_list_notify(&migration_state_notifiers);
+    }
+}
+
 void migrate_fd_put_ready(void *opaque)
 {
     FdMigrationState *s = opaque;
@@ -371,6 +739,15 @@ void migrate_fd_put_ready(void *opaque)
         DPRINTF("put_ready returning because of non-active state\n");
         return;
     }
+    if (qemu_file_has_error(s->file)) {
+        DPRINTF("put_ready failing because of a write error\n");
+        migrate_fd_error(s);
+        return;
+    }
+    if (s->postcopy) {
+        migrate_fd_postcopy_push(s);
+        return;
+    }
 
     DPRINTF("iterate\n");
     if (qemu_savevm_state_iterate(s->mon, s->file) == 1) {
@@ -380,6 +757,24 @@ void migrate_fd_put_ready(void *opaque)
         DPRINTF("done iterating\n");
         vm_stop(VMSTOP_MIGRATE);
 
+        if (postcopy) {
+            if (qemu_savevm_state_complete_postcopy(s->mon, s->file) < 0) {
+                if (old_vm_running) {
+                    vm_start();
+                }
+                migrate_fd_error(s);
+                return;
+            }
+            /* From here on, the guest runs on the destination */
+            DPRINTF("switched to post-copy\n");
+            s->postcopy = 1;
+            s->postcopy_req_len = 0;
+            qemu_set_fd_handler2(s->fd, NULL, migrate_fd_postcopy_read, NULL,
+                                 s);
+            notifier_list_notify(&migration_state_notifiers);
+            return;
+        }
+
         if ((qemu_savevm_state_complete(s->mon, s->file)) < 0) {
             if (old_vm_running) {
                 vm_start();
@@ -49,9 +49,12 @@ struct FdMigrationState
     int (*close)(struct FdMigrationState*);
     int (*write)(struct FdMigrationState*, const void *, size_t);
     void *opaque;
+    int postcopy;               /* the guest runs on the destination */
+    uint8_t postcopy_req[1 + 255 + 8];
+    int postcopy_req_len;
 };
 
-void process_incoming_migration(QEMUFile *f);
+int process_incoming_migration(QEMUFile *f);
 
 int qemu_start_incoming_migration(const char *uri);
 
@@ -66,6 +69,35 @@ uint64_t migrate_max_downtime(void);
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data);
 
+int migrate_postcopy(void);
+
+int migrate_channels(void);
+
+int do_migrate_set_channels(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data);
+
+int migrate_auto_converge(void);
+
+int do_migrate_set_auto_converge(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data);
+
+int migrate_block_queue_depth(void);
+
+int do_migrate_set_block_queue_depth(Monitor *mon, const QDict *qdict,
+                                     QObject **ret_data);
+
+int migrate_compress_threads(void);
+
+int migrate_compress_level(void);
+
+int do_migrate_set_compression(Monitor *mon, const QDict *qdict,
+                               QObject **ret_data);
+
+int64_t migrate_xbzrle_cache_size(void);
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
@@ -88,6 +120,10 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
 					     int blk,
 					     int inc);
 
+int tcp_open_migration_channel(void);
+
+int tcp_accept_migration_channel(void);
+
 int unix_start_incoming_migration(const char *path);
 
 MigrationState *unix_start_outgoing_migration(Monitor *mon,
@@ -106,6 +142,15 @@ MigrationState *fd_start_outgoing_migration(Monitor *mon,
 					    int blk,
 					    int inc);
 
+int file_start_incoming_migration(const char *spec);
+
+MigrationState *file_start_outgoing_migration(Monitor *mon,
+                                              const char *path,
+                                              int64_t bandwidth_limit,
+                                              int detach,
+                                              int blk,
+                                              int inc);
+
 void migrate_fd_monitor_suspend(FdMigrationState *s, Monitor *mon);
 
 void migrate_fd_error(FdMigrationState *s);
@@ -116,6 +161,10 @@ void migrate_fd_put_notify(void *opaque);
 
 ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size);
 
+ssize_t migrate_fd_writev_buffer(void *opaque, struct iovec *iov, int iovcnt);
+
+ssize_t migrate_fd_write(void *opaque, const void *data, size_t size);
+
 void migrate_fd_connect(FdMigrationState *s);
 
 void migrate_fd_put_ready(void *opaque);
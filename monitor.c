@@ -40,10 +40,13 @@
 #include "readline.h"
 #include "console.h"
 #include "blockdev.h"
+#include "block-stream.h"
+#include "block-cache.h"
 #include "audio/audio.h"
 #include "disas.h"
 #include "balloon.h"
 #include "qemu-timer.h"
+#include "qemu-thread.h"
 #include "migration.h"
 #include "kvm.h"
 #include "acl.h"
@@ -60,6 +63,11 @@
 #ifdef CONFIG_SIMPLE_TRACE
 #include "trace.h"
 #endif
+#include "qemu-lockstat.h"
+#include "qemu-arena.h"
+#ifdef CONFIG_VIRTIO_LATENCY
+#include "hw/virtio-latency.h"
+#endif
 #include "ui/qemu-spice.h"
 
 //#define DEBUG
@@ -131,10 +139,15 @@ struct mon_fd_t {
     QLIST_ENTRY(mon_fd_t) next;
 };
 
+typedef struct QMPRequest QMPRequest;
+
 typedef struct MonitorControl {
     QObject *id;
-    JSONMessageParser parser;
+    JSONMessageSplitter parser;
     int command_mode;
+    int stream_elems;
+    int streamed;       /* response already sent by monitor_stream_end() */
+    QLIST_HEAD(, QMPRequest) requests;  /* commands still running */
 } MonitorControl;
 
 struct Monitor {
@@ -154,6 +167,7 @@ struct Monitor {
     int print_calls_nr;
 #endif
     QError *error;
+    QemuArena *arena;           /* for the QObjects of a command */
     QLIST_HEAD(,mon_fd_t) fds;
     QLIST_ENTRY(Monitor) entry;
 };
@@ -254,14 +268,12 @@ void monitor_flush(Monitor *mon)
 }
 
 /* flush at every end of line or if the buffer is full */
-static void monitor_puts(Monitor *mon, const char *str)
+static void monitor_write(Monitor *mon, const char *str, size_t len)
 {
     char c;
 
-    for(;;) {
+    while (len--) {
         c = *str++;
-        if (c == '\0')
-            break;
         if (c == '\n')
             mon->outbuf[mon->outbuf_index++] = '\r';
         mon->outbuf[mon->outbuf_index++] = c;
@@ -271,6 +283,11 @@ static void monitor_puts(Monitor *mon, const char *str)
     }
 }
 
+static void monitor_puts(Monitor *mon, const char *str)
+{
+    monitor_write(mon, str, strlen(str));
+}
+
 void monitor_vprintf(Monitor *mon, const char *fmt, va_list ap)
 {
     char buf[4096];
@@ -355,18 +372,23 @@ static inline int monitor_has_error(const Monitor *mon)
     return mon->error != NULL;
 }
 
-static void monitor_json_emitter(Monitor *mon, const QObject *data)
+static void monitor_json_write(void *opaque, const char *buf, size_t len)
 {
-    QString *json;
-
-    json = mon->flags & MONITOR_USE_PRETTY ? qobject_to_json_pretty(data) :
-                                             qobject_to_json(data);
-    assert(json != NULL);
+    monitor_write(opaque, buf, len);
+}
 
-    qstring_append_chr(json, '\n');
-    monitor_puts(mon, qstring_get_str(json));
+/* The JSON text goes through the output buffer to the chardev as it is
+   generated, so a big response is never held in memory as a whole */
+static void monitor_json_put(Monitor *mon, const QObject *data)
+{
+    qobject_to_json_stream(data, mon->flags & MONITOR_USE_PRETTY,
+                           monitor_json_write, mon);
+}
 
-    QDECREF(json);
+static void monitor_json_emitter(Monitor *mon, const QObject *data)
+{
+    monitor_json_put(mon, data);
+    monitor_puts(mon, "\n");
 }
 
 static void monitor_protocol_emitter(Monitor *mon, QObject *data)
@@ -402,6 +424,55 @@ static void monitor_protocol_emitter(Monitor *mon, QObject *data)
     QDECREF(qmp);
 }
 
+/*
+ * Streamed responses: instead of returning one big QList, a QMP command
+ * handler can send its "return" array one element at a time with
+ * monitor_stream_begin(), monitor_stream_append() and monitor_stream_end().
+ * The handler must not fail once the stream has begun.
+ */
+void monitor_stream_begin(Monitor *mon)
+{
+    assert(monitor_ctrl_mode(mon));
+    mon->mc->stream_elems = 0;
+    monitor_puts(mon, "{\"return\": [");
+}
+
+void monitor_stream_append(Monitor *mon, const QObject *data)
+{
+    if (mon->mc->stream_elems++) {
+        monitor_puts(mon, ", ");
+    }
+    monitor_json_put(mon, data);
+}
+
+/* Append an element already converted to JSON, pretty printed if
+   monitor_stream_pretty() */
+void monitor_stream_append_json(Monitor *mon, const QString *json)
+{
+    if (mon->mc->stream_elems++) {
+        monitor_puts(mon, ", ");
+    }
+    monitor_puts(mon, qstring_get_str(json));
+}
+
+int monitor_stream_pretty(Monitor *mon)
+{
+    return !!(mon->flags & MONITOR_USE_PRETTY);
+}
+
+void monitor_stream_end(Monitor *mon)
+{
+    monitor_puts(mon, "]");
+    if (mon->mc->id) {
+        monitor_puts(mon, ", \"id\": ");
+        qobject_to_json_stream(mon->mc->id, 0, monitor_json_write, mon);
+        qobject_decref(mon->mc->id);
+        mon->mc->id = NULL;
+    }
+    monitor_puts(mon, "}\n");
+    mon->mc->streamed = 1;
+}
+
 static void timestamp_put(QDict *qdict)
 {
     int err;
@@ -474,6 +545,15 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_DEVICE_STATE_CHANGE:
+            event_name = "DEVICE_STATE_CHANGE";
+            break;
+        case QEVENT_BLOCK_JOB_COMPLETED:
+            event_name = "BLOCK_JOB_COMPLETED";
+            break;
+        case QEVENT_BLOCK_JOB_CANCELLED:
+            event_name = "BLOCK_JOB_CANCELLED";
+            break;
         default:
             abort();
             break;
@@ -645,21 +725,212 @@ static void user_monitor_complete(void *opaque, QObject *ret_data)
     qemu_free(data);
 }
 
+/*
+ * QMP requests
+ *
+ * A command that completes after its handler has returned (an async one,
+ * or a query run by the worker thread) keeps its own "id" in a QMPRequest,
+ * and its response goes out whenever it is ready, possibly before the
+ * responses to commands received earlier.
+ */
+struct QMPRequest {
+    Monitor *mon;
+    const mon_cmd_t *cmd;
+    QObject *id;
+    QObject *data;      /* result of a query run by the worker thread */
+    int closed;         /* the client has gone, drop the response */
+    QLIST_ENTRY(QMPRequest) next;
+    QTAILQ_ENTRY(QMPRequest) queue;
+};
+
+static QMPRequest *qmp_request_new(Monitor *mon, const mon_cmd_t *cmd)
+{
+    QMPRequest *req = qemu_mallocz(sizeof(*req));
+
+    req->mon = mon;
+    req->cmd = cmd;
+    req->id = mon->mc->id;
+    mon->mc->id = NULL;
+    QLIST_INSERT_HEAD(&mon->mc->requests, req, next);
+    return req;
+}
+
+/* Send the response to REQ, as an error if its monitor has one pending */
+static void qmp_request_complete(QMPRequest *req, QObject *data)
+{
+    Monitor *mon = req->mon;
+    QObject *id;
+
+    if (!req->closed) {
+        /* another command may be running in a nested event loop */
+        id = mon->mc->id;
+        mon->mc->id = req->id;
+        monitor_protocol_emitter(mon, data);
+        mon->mc->id = id;
+        QLIST_REMOVE(req, next);
+    } else {
+        qobject_decref(req->id);
+    }
+    qemu_free(req);
+}
+
+/* Called when the client goes away with commands still running */
+static void qmp_request_close_all(Monitor *mon)
+{
+    QMPRequest *req, *next_req;
+
+    QLIST_FOREACH_SAFE(req, &mon->mc->requests, next, next_req) {
+        QLIST_REMOVE(req, next);
+        req->closed = 1;
+    }
+}
+
+static int qmp_request_id_in_use(Monitor *mon, QObject *id)
+{
+    QMPRequest *req;
+    QString *json, *other;
+    int found = 0;
+
+    if (!id || QLIST_EMPTY(&mon->mc->requests)) {
+        return 0;
+    }
+
+    json = qobject_to_json(id);
+    QLIST_FOREACH(req, &mon->mc->requests, next) {
+        if (req->id) {
+            other = qobject_to_json(req->id);
+            found = !strcmp(qstring_get_str(json), qstring_get_str(other));
+            QDECREF(other);
+            if (found) {
+                qerror_report(QERR_DUPLICATE_ID, qstring_get_str(json),
+                              "request");
+                break;
+            }
+        }
+    }
+    QDECREF(json);
+    return found;
+}
+
 static void qmp_monitor_complete(void *opaque, QObject *ret_data)
 {
-    monitor_protocol_emitter(opaque, ret_data);
+    qmp_request_complete(opaque, ret_data);
 }
 
-static int qmp_async_cmd_handler(Monitor *mon, const mon_cmd_t *cmd,
-                                 const QDict *params)
+static void qmp_async_cmd_handler(Monitor *mon, const mon_cmd_t *cmd,
+                                  const QDict *params)
 {
-    return cmd->mhandler.cmd_async(mon, params, qmp_monitor_complete, mon);
+    QMPRequest *req = qmp_request_new(mon, cmd);
+
+    if (cmd->mhandler.cmd_async(mon, params, qmp_monitor_complete, req)) {
+        /* emit the error response */
+        qmp_request_complete(req, NULL);
+    }
 }
 
 static void qmp_async_info_handler(Monitor *mon, const mon_cmd_t *cmd)
 {
-    cmd->mhandler.info_async(mon, qmp_monitor_complete, mon);
+    QMPRequest *req = qmp_request_new(mon, cmd);
+
+    cmd->mhandler.info_async(mon, qmp_monitor_complete, req);
+    if (monitor_has_error(mon)) {
+        qmp_request_complete(req, NULL);
+    }
+}
+
+#ifdef CONFIG_IOTHREAD
+/*
+ * Queries flagged MONITOR_CMD_THREAD only read state that is fixed after
+ * startup or a single word, so they can run outside the global mutex: a
+ * worker thread runs them and a bottom half sends the responses.
+ */
+static QemuMutex qmp_worker_lock;
+static QemuCond qmp_worker_cond;
+static QemuThread qmp_worker_thread;
+static QEMUBH *qmp_worker_bh;
+static QTAILQ_HEAD(, QMPRequest) qmp_worker_queue =
+    QTAILQ_HEAD_INITIALIZER(qmp_worker_queue);
+static QTAILQ_HEAD(, QMPRequest) qmp_worker_done =
+    QTAILQ_HEAD_INITIALIZER(qmp_worker_done);
+
+static void *qmp_worker(void *opaque)
+{
+    QMPRequest *req;
+
+    qemu_mutex_lock(&qmp_worker_lock);
+    for (;;) {
+        while (QTAILQ_EMPTY(&qmp_worker_queue)) {
+            qemu_cond_wait(&qmp_worker_cond, &qmp_worker_lock);
+        }
+        req = QTAILQ_FIRST(&qmp_worker_queue);
+        QTAILQ_REMOVE(&qmp_worker_queue, req, queue);
+        qemu_mutex_unlock(&qmp_worker_lock);
+
+        req->cmd->mhandler.info_new(req->mon, &req->data);
+
+        qemu_mutex_lock(&qmp_worker_lock);
+        QTAILQ_INSERT_TAIL(&qmp_worker_done, req, queue);
+        qemu_bh_schedule(qmp_worker_bh);
+    }
+    return NULL;
+}
+
+static void qmp_worker_bh_cb(void *opaque)
+{
+    QMPRequest *req;
+    Monitor *mon;
+    QError *error;
+    QObject *data;
+
+    qemu_mutex_lock(&qmp_worker_lock);
+    while ((req = QTAILQ_FIRST(&qmp_worker_done)) != NULL) {
+        QTAILQ_REMOVE(&qmp_worker_done, req, queue);
+        qemu_mutex_unlock(&qmp_worker_lock);
+
+        /* the error of a command running in a nested loop isn't ours */
+        mon = req->mon;
+        data = req->data;
+        error = mon->error;
+        mon->error = NULL;
+        qmp_request_complete(req, data);
+        mon->error = error;
+        qobject_decref(data);
+
+        qemu_mutex_lock(&qmp_worker_lock);
+    }
+    qemu_mutex_unlock(&qmp_worker_lock);
+}
+
+/* Returns false if CMD has to run in the I/O thread */
+static bool qmp_worker_submit(Monitor *mon, const mon_cmd_t *cmd)
+{
+    QMPRequest *req;
+
+    /* without an id, the client relies on responses coming in order */
+    if (!(cmd->flags & MONITOR_CMD_THREAD) || !mon->mc->id) {
+        return false;
+    }
+
+    if (!qmp_worker_bh) {
+        qemu_mutex_init(&qmp_worker_lock);
+        qemu_cond_init(&qmp_worker_cond);
+        qmp_worker_bh = qemu_bh_new(qmp_worker_bh_cb, NULL);
+        qemu_thread_create(&qmp_worker_thread, qmp_worker, NULL);
+    }
+
+    req = qmp_request_new(mon, cmd);
+    qemu_mutex_lock(&qmp_worker_lock);
+    QTAILQ_INSERT_TAIL(&qmp_worker_queue, req, queue);
+    qemu_cond_signal(&qmp_worker_cond);
+    qemu_mutex_unlock(&qmp_worker_lock);
+    return true;
+}
+#else
+static bool qmp_worker_submit(Monitor *mon, const mon_cmd_t *cmd)
+{
+    return false;
 }
+#endif
 
 static void user_async_cmd_handler(Monitor *mon, const mon_cmd_t *cmd,
                                    const QDict *params)
@@ -970,6 +1241,24 @@ static void do_info_jit(Monitor *mon)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_tbprofile(Monitor *mon, const QDict *qdict)
+{
+    if (kvm_enabled()) {
+        monitor_printf(mon, "TB profiling is not available with KVM\n");
+        return;
+    }
+    if (qdict_get_bool(qdict, "enable")) {
+        tb_profile_start(mon_get_cpu());
+    } else {
+        tb_profile_stop(mon_get_cpu());
+    }
+}
+
+static void do_info_tbprofile(Monitor *mon)
+{
+    dump_tb_profile((FILE *)mon, monitor_fprintf, 30);
+}
+
 static void do_info_history(Monitor *mon)
 {
     int i;
@@ -2503,6 +2792,20 @@ static void do_info_profile(Monitor *mon)
 }
 #endif
 
+static void do_info_mutexes(Monitor *mon)
+{
+#ifdef CONFIG_MUTEX_STATS
+    qemu_lock_stats_dump((FILE *)mon, monitor_fprintf);
+#else
+    monitor_printf(mon, "Mutex statistics not compiled\n");
+#endif
+}
+
+static void do_info_arenas(Monitor *mon)
+{
+    qemu_arena_dump((FILE *)mon, monitor_fprintf);
+}
+
 /* Capture support */
 static QLIST_HEAD (capture_list_head, CaptureState) capture_head;
 
@@ -2788,10 +3091,11 @@ static void do_loadvm(Monitor *mon, const QDict *qdict)
 {
     int saved_vm_running  = vm_running;
     const char *name = qdict_get_str(qdict, "name");
+    int lazy = qdict_get_try_bool(qdict, "lazy", 0);
 
     vm_stop(VMSTOP_LOADVM);
 
-    if (load_vmstate(name) == 0 && saved_vm_running) {
+    if (load_vmstate(name, lazy) == 0 && saved_vm_running) {
         vm_start();
     }
 }
@@ -2866,6 +3170,22 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-cache",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the backing file cache statistics",
+        .user_print = block_cache_info_print,
+        .mhandler.info_new = block_cache_info,
+    },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the running block jobs",
+        .user_print = do_info_block_jobs_print,
+        .mhandler.info_new = do_info_block_jobs,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -2935,6 +3255,13 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.info = do_info_jit,
     },
+    {
+        .name       = "tbprofile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the most executed translated blocks",
+        .mhandler.info = do_info_tbprofile,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -2943,6 +3270,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_kvm_print,
         .mhandler.info_new = do_info_kvm,
     },
+    {
+        .name       = "kvmstat",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show KVM exit statistics",
+        .user_print = kvm_info_exit_stats_print,
+        .mhandler.info_new = kvm_info_exit_stats,
+    },
     {
         .name       = "numa",
         .args_type  = "",
@@ -2971,6 +3306,37 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show profiling information",
         .mhandler.info = do_info_profile,
     },
+    {
+        .name       = "lockstats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show global mutex statistics",
+        .mhandler.info = do_info_lockstats,
+    },
+    {
+        .name       = "mutexes",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show contention statistics of named mutexes",
+        .mhandler.info = do_info_mutexes,
+    },
+    {
+        .name       = "arenas",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show allocation statistics of the arenas",
+        .mhandler.info = do_info_arenas,
+    },
+#ifdef CONFIG_VIRTIO_LATENCY
+    {
+        .name       = "virtio-latency",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show stage latencies of virtio requests, by queue",
+        .user_print = virtio_latency_print,
+        .mhandler.info_new = virtio_latency_info,
+    },
+#endif
     {
         .name       = "capture",
         .args_type  = "",
@@ -3025,6 +3391,16 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_spice_print,
         .mhandler.info_new = do_info_spice,
     },
+#endif
+#if defined(CONFIG_SPICE) && defined(TARGET_I386)
+    {
+        .name       = "qxl",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show qxl command ring and local rendering statistics",
+        .user_print = do_info_qxl_print,
+        .mhandler.info_new = do_info_qxl,
+    },
 #endif
     {
         .name       = "name",
@@ -3132,6 +3508,7 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .help       = "show the version of QEMU",
         .user_print = do_info_version_print,
         .mhandler.info_new = do_info_version,
+        .flags      = MONITOR_CMD_THREAD,
     },
     {
         .name       = "commands",
@@ -3140,6 +3517,7 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .help       = "list QMP available commands",
         .user_print = monitor_user_noop,
         .mhandler.info_new = do_info_commands,
+        .flags      = MONITOR_CMD_THREAD,
     },
     {
         .name       = "chardev",
@@ -3165,6 +3543,32 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+#ifdef CONFIG_VIRTIO_LATENCY
+    {
+        .name       = "virtio-latency",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show stage latencies of virtio requests, by queue",
+        .user_print = virtio_latency_print,
+        .mhandler.info_new = virtio_latency_info,
+    },
+#endif
+    {
+        .name       = "block-cache",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the backing file cache statistics",
+        .user_print = block_cache_info_print,
+        .mhandler.info_new = block_cache_info,
+    },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the running block jobs",
+        .user_print = do_info_block_jobs_print,
+        .mhandler.info_new = do_info_block_jobs,
+    },
     {
         .name       = "cpus",
         .args_type  = "",
@@ -3188,6 +3592,15 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .help       = "show KVM information",
         .user_print = do_info_kvm_print,
         .mhandler.info_new = do_info_kvm,
+        .flags      = MONITOR_CMD_THREAD,
+    },
+    {
+        .name       = "kvmstat",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show KVM exit statistics",
+        .user_print = kvm_info_exit_stats_print,
+        .mhandler.info_new = kvm_info_exit_stats,
     },
     {
         .name       = "status",
@@ -3196,6 +3609,7 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .help       = "show the current VM status (running|paused)",
         .user_print = do_info_status_print,
         .mhandler.info_new = do_info_status,
+        .flags      = MONITOR_CMD_THREAD,
     },
     {
         .name       = "mice",
@@ -3222,6 +3636,16 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = do_info_spice_print,
         .mhandler.info_new = do_info_spice,
     },
+#endif
+#if defined(CONFIG_SPICE) && defined(TARGET_I386)
+    {
+        .name       = "qxl",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show qxl command ring and local rendering statistics",
+        .user_print = do_info_qxl_print,
+        .mhandler.info_new = do_info_qxl,
+    },
 #endif
     {
         .name       = "name",
@@ -3230,6 +3654,7 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .help       = "show the current VM name",
         .user_print = do_info_name_print,
         .mhandler.info_new = do_info_name,
+        .flags      = MONITOR_CMD_THREAD,
     },
     {
         .name       = "uuid",
@@ -3238,6 +3663,7 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .help       = "show the current VM UUID",
         .user_print = do_info_uuid_print,
         .mhandler.info_new = do_info_uuid,
+        .flags      = MONITOR_CMD_THREAD,
     },
     {
         .name       = "migrate",
@@ -4406,10 +4832,30 @@ static void handler_audit(Monitor *mon, const mon_cmd_t *cmd, int ret)
 #endif
 }
 
+/*
+ * The QObjects a command creates, from its arguments to its result, are
+ * normally gone when it returns, so they come from the monitor's arena,
+ * which is then reset in one go.  Monitors of our own, like the one
+ * human-monitor-command runs in, have none.
+ */
+static QemuArena *monitor_arena_enter(Monitor *mon)
+{
+    return qemu_arena_set_current(mon->arena);
+}
+
+static void monitor_arena_leave(Monitor *mon, QemuArena *prev)
+{
+    qemu_arena_set_current(prev);
+    if (mon->arena && prev != mon->arena) {
+        qemu_arena_reset(mon->arena);
+    }
+}
+
 static void handle_user_command(Monitor *mon, const char *cmdline)
 {
     QDict *qdict;
     const mon_cmd_t *cmd;
+    QemuArena *prev = monitor_arena_enter(mon);
 
     qdict = qdict_new();
 
@@ -4435,6 +4881,7 @@ static void handle_user_command(Monitor *mon, const char *cmdline)
 
 out:
     QDECREF(qdict);
+    monitor_arena_leave(mon, prev);
 }
 
 static void cmd_completion(const char *name, const char *list)
@@ -4816,6 +5263,7 @@ static int check_client_args_type(const QDict *client_args,
         switch (qstring_get_str(arg_type)[0]) {
         case 'F':
         case 'B':
+        case 'Q':
         case 's':
             if (qobject_type(client_arg) != QTYPE_QSTRING) {
                 qerror_report(QERR_INVALID_PARAMETER_TYPE, client_arg_name,
@@ -5008,7 +5456,7 @@ static QDict *qmp_check_input_obj(QObject *input_obj)
                 return NULL;
             }
         } else if (!strcmp(arg_name, "id")) {
-            /* FIXME: check duplicated IDs for async commands */
+            /* checked against the running commands by the caller */
         } else {
             qerror_report(QERR_QMP_EXTRA_MEMBER, arg_name);
             return NULL;
@@ -5029,9 +5477,8 @@ static void qmp_call_query_cmd(Monitor *mon, const mon_cmd_t *cmd)
 
     if (handler_is_async(cmd)) {
         qmp_async_info_handler(mon, cmd);
-        if (monitor_has_error(mon)) {
-            monitor_protocol_emitter(mon, NULL);
-        }
+    } else if (qmp_worker_submit(mon, cmd)) {
+        return;
     } else {
         cmd->mhandler.info_new(mon, &ret_data);
         monitor_protocol_emitter(mon, ret_data);
@@ -5049,11 +5496,17 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
 
     ret = cmd->mhandler.cmd_new(mon, params, &data);
     handler_audit(mon, cmd, ret);
-    monitor_protocol_emitter(mon, data);
+    if (mon->mc->streamed) {
+        assert(!data && !monitor_has_error(mon));
+        mon->mc->streamed = 0;
+    } else {
+        monitor_protocol_emitter(mon, data);
+    }
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void handle_qmp_command(JSONMessageSplitter *parser, const char *buf,
+                               size_t len)
 {
     int err;
     QObject *obj;
@@ -5061,13 +5514,14 @@ static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
     const mon_cmd_t *cmd;
     Monitor *mon = cur_mon;
     const char *cmd_name, *query_cmd;
+    QemuArena *prev = monitor_arena_enter(mon);
 
     query_cmd = NULL;
     args = input = NULL;
 
-    obj = json_parser_parse(tokens, NULL);
+    obj = json_parser_parse_buf(buf, len, NULL);
     if (!obj) {
-        // FIXME: should be triggered in json_parser_parse()
+        // FIXME: should be triggered in json_parser_parse_buf()
         qerror_report(QERR_JSON_PARSING);
         goto err_out;
     }
@@ -5078,6 +5532,9 @@ static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
         goto err_out;
     }
 
+    if (qmp_request_id_in_use(mon, qdict_get(input, "id"))) {
+        goto err_out;
+    }
     mon->mc->id = qdict_get(input, "id");
     qobject_incref(mon->mc->id);
 
@@ -5114,11 +5571,7 @@ static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
     if (query_cmd) {
         qmp_call_query_cmd(mon, cmd);
     } else if (handler_is_async(cmd)) {
-        err = qmp_async_cmd_handler(mon, cmd, args);
-        if (err) {
-            /* emit the error response */
-            goto err_out;
-        }
+        qmp_async_cmd_handler(mon, cmd, args);
     } else {
         qmp_call_cmd(mon, cmd, args);
     }
@@ -5130,6 +5583,7 @@ err_out:
 out:
     QDECREF(input);
     QDECREF(args);
+    monitor_arena_leave(mon, prev);
 }
 
 /**
@@ -5141,7 +5595,7 @@ static void monitor_control_read(void *opaque, const uint8_t *buf, int size)
 
     cur_mon = opaque;
 
-    json_message_parser_feed(&cur_mon->mc->parser, (const char *) buf, size);
+    json_message_splitter_feed(&cur_mon->mc->parser, (const char *) buf, size);
 
     cur_mon = old_mon;
 }
@@ -5208,13 +5662,14 @@ static void monitor_control_event(void *opaque, int event)
     switch (event) {
     case CHR_EVENT_OPENED:
         mon->mc->command_mode = 0;
-        json_message_parser_init(&mon->mc->parser, handle_qmp_command);
+        json_message_splitter_init(&mon->mc->parser, handle_qmp_command);
         data = get_qmp_greeting();
         monitor_json_emitter(mon, data);
         qobject_decref(data);
         break;
     case CHR_EVENT_CLOSED:
-        json_message_parser_destroy(&mon->mc->parser);
+        json_message_splitter_destroy(&mon->mc->parser);
+        qmp_request_close_all(mon);
         break;
     }
 }
@@ -5282,6 +5737,7 @@ void monitor_init(CharDriverState *chr, int flags)
 
     mon->chr = chr;
     mon->flags = flags;
+    mon->arena = qemu_arena_new(chr->label);
     if (flags & MONITOR_USE_READLINE) {
         mon->rs = readline_init(mon, monitor_find_completion);
         monitor_read_command(mon, 0);
@@ -19,6 +19,7 @@ extern Monitor *default_mon;
 /* flags for monitor commands */
 #define MONITOR_CMD_ASYNC       0x0001
 #define MONITOR_CMD_USER_ONLY   0x0002
+#define MONITOR_CMD_THREAD      0x0004  /* QMP query safe outside the lock */
 
 /* QMP events */
 typedef enum MonitorEvent {
@@ -36,6 +37,9 @@ typedef enum MonitorEvent {
     QEVENT_SPICE_CONNECTED,
     QEVENT_SPICE_INITIALIZED,
     QEVENT_SPICE_DISCONNECTED,
+    QEVENT_DEVICE_STATE_CHANGE,
+    QEVENT_BLOCK_JOB_COMPLETED,
+    QEVENT_BLOCK_JOB_CANCELLED,
     QEVENT_MAX,
 } MonitorEvent;
 
@@ -59,6 +63,12 @@ void monitor_printf(Monitor *mon, const char *fmt, ...) GCC_FMT_ATTR(2, 3);
 void monitor_print_filename(Monitor *mon, const char *filename);
 void monitor_flush(Monitor *mon);
 
+void monitor_stream_begin(Monitor *mon);
+void monitor_stream_append(Monitor *mon, const QObject *data);
+void monitor_stream_append_json(Monitor *mon, const QString *json);
+int monitor_stream_pretty(Monitor *mon);
+void monitor_stream_end(Monitor *mon);
+
 typedef void (MonitorCompletion)(void *opaque, QObject *ret_data);
 
 void monitor_set_error(Monitor *mon, QError *qerror);
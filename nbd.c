@@ -49,7 +49,6 @@
 
 /* This is all part of the "official" NBD API */
 
-#define NBD_REPLY_SIZE		(4 + 4 + 8)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
 
@@ -529,15 +528,21 @@ int nbd_client(int fd)
 }
 #endif
 
-int nbd_send_request(int csock, struct nbd_request *request)
+/* Fill the NBD_REQUEST_SIZE bytes of buf with the wire format of request */
+void nbd_encode_request(uint8_t *buf, const struct nbd_request *request)
 {
-	uint8_t buf[4 + 4 + 8 + 8 + 4];
-
 	cpu_to_be32w((uint32_t*)buf, NBD_REQUEST_MAGIC);
 	cpu_to_be32w((uint32_t*)(buf + 4), request->type);
 	cpu_to_be64w((uint64_t*)(buf + 8), request->handle);
 	cpu_to_be64w((uint64_t*)(buf + 16), request->from);
 	cpu_to_be32w((uint32_t*)(buf + 24), request->len);
+}
+
+int nbd_send_request(int csock, struct nbd_request *request)
+{
+	uint8_t buf[NBD_REQUEST_SIZE];
+
+	nbd_encode_request(buf, request);
 
 	TRACE("Sending request to client");
 
@@ -550,17 +555,12 @@ int nbd_send_request(int csock, struct nbd_request *request)
 }
 
 
-static int nbd_receive_request(int csock, struct nbd_request *request)
+/* Parse the NBD_REQUEST_SIZE bytes of buf into request, -1 if they are
+   not a request */
+int nbd_decode_request(const uint8_t *buf, struct nbd_request *request)
 {
-	uint8_t buf[4 + 4 + 8 + 8 + 4];
 	uint32_t magic;
 
-	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-		LOG("read failed");
-		errno = EINVAL;
-		return -1;
-	}
-
 	/* Request
 	   [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
 	   [ 4 ..  7]   type    (0 == READ, 1 == WRITE)
@@ -587,12 +587,9 @@ static int nbd_receive_request(int csock, struct nbd_request *request)
 	return 0;
 }
 
-int nbd_receive_reply(int csock, struct nbd_reply *reply)
+static int nbd_receive_request(int csock, struct nbd_request *request)
 {
-	uint8_t buf[NBD_REPLY_SIZE];
-	uint32_t magic;
-
-	memset(buf, 0xAA, sizeof(buf));
+	uint8_t buf[NBD_REQUEST_SIZE];
 
 	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
 		LOG("read failed");
@@ -600,6 +597,15 @@ int nbd_receive_reply(int csock, struct nbd_reply *reply)
 		return -1;
 	}
 
+	return nbd_decode_request(buf, request);
+}
+
+/* Parse the NBD_REPLY_SIZE bytes of buf into reply, -1 if they are not
+   a reply */
+int nbd_decode_reply(const uint8_t *buf, struct nbd_reply *reply)
+{
+	uint32_t magic;
+
 	/* Reply
 	   [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
 	   [ 4 ..  7]    error   (0 == no error)
@@ -622,10 +628,24 @@ int nbd_receive_reply(int csock, struct nbd_reply *reply)
 	return 0;
 }
 
-static int nbd_send_reply(int csock, struct nbd_reply *reply)
+int nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
-	uint8_t buf[4 + 4 + 8];
+	uint8_t buf[NBD_REPLY_SIZE];
+
+	memset(buf, 0xAA, sizeof(buf));
+
+	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+		LOG("read failed");
+		errno = EINVAL;
+		return -1;
+	}
+
+	return nbd_decode_reply(buf, reply);
+}
 
+/* Fill the NBD_REPLY_SIZE bytes of buf with the wire format of reply */
+void nbd_encode_reply(uint8_t *buf, const struct nbd_reply *reply)
+{
 	/* Reply
 	   [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
 	   [ 4 ..  7]    error   (0 == no error)
@@ -634,6 +654,13 @@ static int nbd_send_reply(int csock, struct nbd_reply *reply)
 	cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
 	cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
 	cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
+}
+
+static int nbd_send_reply(int csock, struct nbd_reply *reply)
+{
+	uint8_t buf[NBD_REPLY_SIZE];
+
+	nbd_encode_reply(buf, reply);
 
 	TRACE("Sending response to client");
 
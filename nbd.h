@@ -44,6 +44,9 @@ enum {
 
 #define NBD_DEFAULT_PORT	10809
 
+#define NBD_REQUEST_SIZE	(4 + 4 + 8 + 8 + 4)
+#define NBD_REPLY_SIZE		(4 + 4 + 8)
+
 size_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int tcp_socket_outgoing(const char *address, uint16_t port);
 int tcp_socket_incoming(const char *address, uint16_t port);
@@ -54,6 +57,10 @@ int nbd_negotiate(int csock, off_t size);
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
                           off_t *size, size_t *blocksize);
 int nbd_init(int fd, int csock, off_t size, size_t blocksize);
+void nbd_encode_request(uint8_t *buf, const struct nbd_request *request);
+int nbd_decode_reply(const uint8_t *buf, struct nbd_reply *reply);
+int nbd_decode_request(const uint8_t *buf, struct nbd_request *request);
+void nbd_encode_reply(uint8_t *buf, const struct nbd_reply *reply);
 int nbd_send_request(int csock, struct nbd_request *request);
 int nbd_receive_reply(int csock, struct nbd_reply *reply);
 int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
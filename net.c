@@ -35,6 +35,7 @@
 #include "sysemu.h"
 #include "qemu-common.h"
 #include "qemu_socket.h"
+#include "qemu-timer.h"
 #include "hw/qdev.h"
 
 static QTAILQ_HEAD(, VLANState) vlans;
@@ -220,6 +221,221 @@ static ssize_t qemu_deliver_packet_iov(VLANClientState *sender,
                                        int iovcnt,
                                        void *opaque);
 
+/* A vlan with just two clients is a point-to-point link: each sends
+ * straight to the other, as netdev peers do, instead of going around
+ * the vlan.  Any third client, like a dump, brings back the hub. */
+static void qemu_vlan_update_peers(VLANState *vlan)
+{
+    VLANClientState *vc, *first, *second;
+    int n = 0;
+
+    QTAILQ_FOREACH(vc, &vlan->clients, next) {
+        vc->vlan_peer = NULL;
+        n++;
+    }
+    if (n == 2) {
+        first = QTAILQ_FIRST(&vlan->clients);
+        second = QTAILQ_NEXT(first, next);
+        first->vlan_peer = second;
+        second->vlan_peer = first;
+    }
+}
+
+/* The only client a packet from sender goes to, if there is just one */
+static VLANClientState *qemu_direct_peer(VLANClientState *sender)
+{
+    return sender->peer ? sender->peer : sender->vlan_peer;
+}
+
+/* Traffic shaping between a netdev and its NIC.  Each direction has a
+ * token bucket for bytes and one for packets, filled at the configured
+ * rate up to a tenth of a second's worth.  A packet goes through if both
+ * buckets hold something, and may take them below zero; otherwise the
+ * delivery handler refuses it as a busy receiver would, so the packet
+ * waits in the send queue and a sender with a completion callback is
+ * held off.  A timer flushes the queue once the buckets have refilled.
+ *
+ * The limits belong to the netdev and are shared by all its queues. */
+enum {
+    NET_SHAPE_TX,               /* guest to netdev */
+    NET_SHAPE_RX,               /* netdev to guest */
+    NET_SHAPE_MAX,
+};
+
+typedef struct NetBucket {
+    uint32_t rate;              /* per second, 0 for no limit */
+    int64_t level;
+    int64_t last;               /* when level was last brought up to date */
+} NetBucket;
+
+typedef struct NetShaper {
+    NetBucket bytes;
+    NetBucket packets;
+    QEMUTimer *timer;
+    VLANClientState *netdev;
+    int dir;
+    uint64_t throttled;         /* times traffic had to wait */
+} NetShaper;
+
+struct NetShaping {
+    NetShaper dir[NET_SHAPE_MAX];
+};
+
+static void net_bucket_set_rate(NetBucket *b, uint32_t rate, int64_t now)
+{
+    b->rate = rate;
+    b->level = MAX(rate / 10, 1);
+    b->last = now;
+}
+
+static void net_bucket_refill(NetBucket *b, int64_t now)
+{
+    int64_t burst = MAX(b->rate / 10, 1);
+    int64_t tokens;
+
+    if (now <= b->last) {
+        return;
+    }
+    tokens = muldiv64(now - b->last, b->rate, get_ticks_per_sec());
+    if (b->level + tokens >= burst) {
+        b->level = burst;
+        b->last = now;
+    } else if (tokens) {
+        b->level += tokens;
+        /* keep the time the fraction of a token took */
+        b->last += muldiv64(tokens, get_ticks_per_sec(), b->rate);
+    }
+}
+
+/* When the bucket will hold a token again */
+static int64_t net_bucket_ready(NetBucket *b)
+{
+    return b->last + muldiv64(1 - b->level, get_ticks_per_sec(), b->rate);
+}
+
+static NetShaper *qemu_net_shaper(VLANClientState *sender)
+{
+    VLANClientState *peer = sender->peer;
+
+    if (!peer) {
+        return NULL;
+    }
+    if (sender->shaping) {
+        return &sender->shaping->dir[NET_SHAPE_RX];
+    }
+    if (peer->shaping) {
+        return &peer->shaping->dir[NET_SHAPE_TX];
+    }
+    return NULL;
+}
+
+/* Whether sender may send a packet of size bytes now */
+static bool qemu_net_shaper_admit(VLANClientState *sender, size_t size)
+{
+    NetShaper *sh = qemu_net_shaper(sender);
+    int64_t now, ready = 0;
+
+    if (!sh || (!sh->bytes.rate && !sh->packets.rate)) {
+        return true;
+    }
+
+    now = qemu_get_clock_ns(vm_clock);
+    if (sh->bytes.rate) {
+        net_bucket_refill(&sh->bytes, now);
+        if (sh->bytes.level <= 0) {
+            ready = net_bucket_ready(&sh->bytes);
+        }
+    }
+    if (sh->packets.rate) {
+        net_bucket_refill(&sh->packets, now);
+        if (sh->packets.level <= 0) {
+            ready = MAX(ready, net_bucket_ready(&sh->packets));
+        }
+    }
+    if (ready) {
+        if (!qemu_timer_pending(sh->timer)) {
+            qemu_mod_timer(sh->timer, ready);
+            sh->throttled++;
+        }
+        return false;
+    }
+
+    if (sh->bytes.rate) {
+        sh->bytes.level -= size;
+    }
+    if (sh->packets.rate) {
+        sh->packets.level--;
+    }
+    return true;
+}
+
+static void qemu_net_shaper_timer(void *opaque)
+{
+    NetShaper *sh = opaque;
+    VLANClientState *queue;
+    int i;
+
+    for (i = 0; (queue = qemu_find_netdev_queue(sh->netdev, i)); i++) {
+        VLANClientState *receiver;
+
+        receiver = sh->dir == NET_SHAPE_RX ? queue->peer : queue;
+        if (receiver) {
+            qemu_flush_queued_packets(receiver);
+        }
+    }
+}
+
+/* Set the limits of a netdev, in bytes and packets per second for each
+ * direction; 0 means no limit. */
+static void qemu_net_set_limits(VLANClientState *netdev,
+                                const uint32_t bps[NET_SHAPE_MAX],
+                                const uint32_t pps[NET_SHAPE_MAX])
+{
+    NetShaping *shaping = netdev->shaping;
+    VLANClientState *queue;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int i;
+
+    if (!shaping) {
+        shaping = qemu_mallocz(sizeof(*shaping));
+        for (i = 0; i < NET_SHAPE_MAX; i++) {
+            shaping->dir[i].netdev = netdev;
+            shaping->dir[i].dir = i;
+            shaping->dir[i].timer = qemu_new_timer(vm_clock,
+                                                   qemu_net_shaper_timer,
+                                                   &shaping->dir[i]);
+        }
+        for (i = 0; (queue = qemu_find_netdev_queue(netdev, i)); i++) {
+            queue->shaping = shaping;
+        }
+    }
+
+    for (i = 0; i < NET_SHAPE_MAX; i++) {
+        NetShaper *sh = &shaping->dir[i];
+
+        net_bucket_set_rate(&sh->bytes, bps[i], now);
+        net_bucket_set_rate(&sh->packets, pps[i], now);
+        /* whatever waits goes by the new limits */
+        qemu_del_timer(sh->timer);
+        qemu_net_shaper_timer(sh);
+    }
+}
+
+static void qemu_net_free_shaping(VLANClientState *vc)
+{
+    NetShaping *shaping = vc->shaping;
+    int i;
+
+    vc->shaping = NULL;
+    if (!shaping || vc->queue_index) {
+        return;
+    }
+    for (i = 0; i < NET_SHAPE_MAX; i++) {
+        qemu_free_timer(shaping->dir[i].timer);
+    }
+    qemu_free(shaping);
+}
+
 VLANClientState *qemu_new_net_client(NetClientInfo *info,
                                      VLANState *vlan,
                                      VLANClientState *peer,
@@ -244,6 +460,7 @@ VLANClientState *qemu_new_net_client(NetClientInfo *info,
         assert(!peer);
         vc->vlan = vlan;
         QTAILQ_INSERT_TAIL(&vc->vlan->clients, vc, next);
+        qemu_vlan_update_peers(vlan);
     } else {
         if (peer) {
             assert(!peer->peer);
@@ -283,8 +500,12 @@ NICState *qemu_new_nic(NetClientInfo *info,
 
 static void qemu_cleanup_vlan_client(VLANClientState *vc)
 {
+    qemu_net_free_shaping(vc);
+
     if (vc->vlan) {
         QTAILQ_REMOVE(&vc->vlan->clients, vc, next);
+        qemu_vlan_update_peers(vc->vlan);
+        vc->vlan_peer = NULL;
     } else {
         QTAILQ_REMOVE(&non_vlan_clients, vc, next);
     }
@@ -388,13 +609,12 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
 int qemu_can_send_packet(VLANClientState *sender)
 {
     VLANState *vlan = sender->vlan;
-    VLANClientState *vc;
+    VLANClientState *vc = qemu_direct_peer(sender);
 
-    if (sender->peer) {
-        if (sender->peer->receive_disabled) {
+    if (vc) {
+        if (vc->receive_disabled) {
             return 0;
-        } else if (sender->peer->info->can_receive &&
-                   !sender->peer->info->can_receive(sender->peer)) {
+        } else if (vc->info->can_receive && !vc->info->can_receive(vc)) {
             return 0;
         } else {
             return 1;
@@ -418,6 +638,74 @@ int qemu_can_send_packet(VLANClientState *sender)
     return 0;
 }
 
+/* Zero-copy receive: a backend that reads packets itself can have them
+ * placed straight into the buffers of its peer, skipping the send queue.
+ * Only a peer of its own will do: a vlan may have other clients, like a
+ * dump, that need to see the packet too.
+ *
+ * Fills iov with at most iovcnt buffers that can take a packet of up to
+ * size bytes, led by a hdr_len bytes virtio_net_hdr (or nothing), and
+ * returns how many were used.  Returns 0 if the packet has to go the
+ * usual way.  Each successful call must be followed by one call to
+ * qemu_receive_complete with the length actually read, or -1. */
+int qemu_get_receive_buffers(VLANClientState *sender, struct iovec *iov,
+                             int iovcnt, size_t hdr_len, size_t size)
+{
+    VLANClientState *peer = sender->peer;
+
+    if (sender->vlan || !peer || sender->link_down ||
+        !peer->info->receive_buffers || peer->receive_disabled ||
+        qemu_net_shaper(sender)) {
+        return 0;
+    }
+    if (peer->info->can_receive && !peer->info->can_receive(peer)) {
+        return 0;
+    }
+    return peer->info->receive_buffers(peer, iov, iovcnt, hdr_len, size);
+}
+
+void qemu_receive_complete(VLANClientState *sender, ssize_t len)
+{
+    sender->peer->info->receive_complete(sender->peer, len);
+}
+
+/* Batched receive: a backend that has read several packets can hand them
+ * to its peer in one call, and the peer signals the guest once for all
+ * of them.  As with zero-copy receive, only a peer of its own will do. */
+int qemu_can_send_packet_batch(VLANClientState *sender)
+{
+    VLANClientState *peer = sender->peer;
+
+    return !sender->vlan && peer && peer->info->receive_batch &&
+           !qemu_net_shaper(sender);
+}
+
+/* Send count packets, one per iovec.  Whatever the peer's receive_batch
+ * does not take goes through qemu_send_packet_async, so packets are never
+ * lost or reordered.  Returns the number of packets sent before one had
+ * to be queued; if that is less than count, the rest are queued too and
+ * sent_cb is called once the queue drains. */
+int qemu_send_packet_batch(VLANClientState *sender, const struct iovec *pkts,
+                           int count, NetPacketSent *sent_cb)
+{
+    VLANClientState *peer = sender->peer;
+    int i = 0, sent = -1;
+
+    if (qemu_can_send_packet_batch(sender) && !sender->link_down &&
+        !peer->link_down && !peer->receive_disabled) {
+        i = peer->info->receive_batch(peer, pkts, count);
+    }
+
+    for (; i < count; i++) {
+        if (!qemu_send_packet_async(sender, pkts[i].iov_base,
+                                    pkts[i].iov_len, sent_cb) && sent < 0) {
+            sent = i;
+        }
+    }
+
+    return sent < 0 ? count : sent;
+}
+
 static ssize_t qemu_deliver_packet(VLANClientState *sender,
                                    unsigned flags,
                                    const uint8_t *data,
@@ -435,6 +723,11 @@ static ssize_t qemu_deliver_packet(VLANClientState *sender,
         return 0;
     }
 
+    if (!qemu_net_shaper_admit(sender, size)) {
+        vc->receive_disabled = 1;
+        return 0;
+    }
+
     if (flags & QEMU_NET_PACKET_FLAG_RAW && vc->info->receive_raw) {
         ret = vc->info->receive_raw(vc, data, size);
     } else {
@@ -492,6 +785,42 @@ static ssize_t qemu_vlan_deliver_packet(VLANClientState *sender,
     return ret;
 }
 
+/* Point-to-point fast path: with a single receiver and nothing queued
+ * ahead, hand the packet straight to it rather than through the queue's
+ * deliver handler.  Returns 0 if the packet has to take the queue. */
+static ssize_t qemu_deliver_direct(VLANClientState *sender, NetQueue *queue,
+                                   unsigned flags, const uint8_t *buf,
+                                   size_t size)
+{
+    VLANClientState *vc = qemu_direct_peer(sender);
+    ssize_t ret;
+
+    if (!vc || vc->receive_disabled || !qemu_net_queue_enter(queue)) {
+        return 0;
+    }
+    ret = qemu_deliver_packet(sender, flags, buf, size, vc);
+    qemu_net_queue_leave(queue);
+
+    return ret;
+}
+
+static ssize_t qemu_deliver_direct_iov(VLANClientState *sender,
+                                       NetQueue *queue,
+                                       const struct iovec *iov, int iovcnt)
+{
+    VLANClientState *vc = qemu_direct_peer(sender);
+    ssize_t ret;
+
+    if (!vc || vc->receive_disabled || !qemu_net_queue_enter(queue)) {
+        return 0;
+    }
+    ret = qemu_deliver_packet_iov(sender, QEMU_NET_PACKET_FLAG_NONE,
+                                  iov, iovcnt, vc);
+    qemu_net_queue_leave(queue);
+
+    return ret;
+}
+
 void qemu_purge_queued_packets(VLANClientState *vc)
 {
     NetQueue *queue;
@@ -530,6 +859,7 @@ static ssize_t qemu_send_packet_async_with_flags(VLANClientState *sender,
                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
+    ssize_t ret;
 
 #ifdef DEBUG_NET
     printf("qemu_send_packet_async:\n");
@@ -546,6 +876,11 @@ static ssize_t qemu_send_packet_async_with_flags(VLANClientState *sender,
         queue = sender->vlan->send_queue;
     }
 
+    ret = qemu_deliver_direct(sender, queue, flags, buf, size);
+    if (ret) {
+        return ret;
+    }
+
     return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
 }
 
@@ -608,6 +943,11 @@ static ssize_t qemu_deliver_packet_iov(VLANClientState *sender,
         return calc_iov_length(iov, iovcnt);
     }
 
+    if (!qemu_net_shaper_admit(sender, calc_iov_length(iov, iovcnt))) {
+        vc->receive_disabled = 1;
+        return 0;
+    }
+
     if (vc->info->receive_iov) {
         return vc->info->receive_iov(vc, iov, iovcnt);
     } else {
@@ -656,6 +996,7 @@ ssize_t qemu_sendv_packet_async(VLANClientState *sender,
                                 NetPacketSent *sent_cb)
 {
     NetQueue *queue;
+    ssize_t ret;
 
     if (sender->link_down || (!sender->peer && !sender->vlan)) {
         return calc_iov_length(iov, iovcnt);
@@ -667,6 +1008,11 @@ ssize_t qemu_sendv_packet_async(VLANClientState *sender,
         queue = sender->vlan->send_queue;
     }
 
+    ret = qemu_deliver_direct_iov(sender, queue, iov, iovcnt);
+    if (ret) {
+        return ret;
+    }
+
     return qemu_net_queue_send_iov(queue, sender,
                                    QEMU_NET_PACKET_FLAG_NONE,
                                    iov, iovcnt, sent_cb);
@@ -719,6 +1065,24 @@ VLANClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+/* Queue index of the netdev vc, which is queue 0; the other queues of a
+   netdev with several of them are named "<id>.<index>" */
+VLANClientState *qemu_find_netdev_queue(VLANClientState *vc, int index)
+{
+    VLANClientState *queue;
+    char name[256];
+
+    if (index == 0) {
+        return vc;
+    }
+    snprintf(name, sizeof(name), "%s.%d", vc->name, index);
+    queue = qemu_find_netdev(name);
+    if (!queue || queue->queue_index != index) {
+        return NULL;
+    }
+    return queue;
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -874,6 +1238,22 @@ static int net_init_nic(QemuOpts *opts,
         .name = "name",                            \
         .type = QEMU_OPT_STRING,                   \
         .help = "identifier for monitor commands", \
+     }, {                                          \
+        .name = "bps_tx",                          \
+        .type = QEMU_OPT_SIZE,                     \
+        .help = "bytes/s the guest may send",      \
+     }, {                                          \
+        .name = "bps_rx",                          \
+        .type = QEMU_OPT_SIZE,                     \
+        .help = "bytes/s the guest may receive",   \
+     }, {                                          \
+        .name = "pps_tx",                          \
+        .type = QEMU_OPT_NUMBER,                   \
+        .help = "packets/s the guest may send",    \
+     }, {                                          \
+        .name = "pps_rx",                          \
+        .type = QEMU_OPT_NUMBER,                   \
+        .help = "packets/s the guest may receive", \
      }
 
 typedef int (*net_client_init_func)(QemuOpts *opts,
@@ -882,7 +1262,7 @@ typedef int (*net_client_init_func)(QemuOpts *opts,
                                     VLANState *vlan);
 
 /* magic number, but compiler will warn if too small */
-#define NET_MAX_DESC 20
+#define NET_MAX_DESC 24
 
 static const struct {
     const char *type;
@@ -1025,6 +1405,10 @@ static const struct {
                 .name = "vhostfd",
                 .type = QEMU_OPT_STRING,
                 .help = "file descriptor of an already opened vhost net device",
+            }, {
+                .name = "queues",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of queues of a multiqueue tap interface",
             },
 #endif /* _WIN32 */
             { /* end of list */ }
@@ -1050,10 +1434,23 @@ static const struct {
                 .name = "mcast",
                 .type = QEMU_OPT_STRING,
                 .help = "UDP multicast address and port number",
+            }, {
+                .name = "udp",
+                .type = QEMU_OPT_STRING,
+                .help = "UDP unicast address and port number",
             }, {
                 .name = "localaddr",
                 .type = QEMU_OPT_STRING,
-                .help = "source address for multicast packets",
+                .help = "source address for multicast packets, "
+                        "or address and port to bind for udp",
+            }, {
+                .name = "coalesce",
+                .type = QEMU_OPT_SIZE,
+                .help = "pack frames into UDP datagrams of up to this size",
+            }, {
+                .name = "sockbuf",
+                .type = QEMU_OPT_SIZE,
+                .help = "send and receive buffer size of the UDP socket",
             },
             { /* end of list */ }
         },
@@ -1096,6 +1493,14 @@ static const struct {
                 .name = "file",
                 .type = QEMU_OPT_STRING,
                 .help = "dump file path (default is qemu-vlan0.pcap)",
+            }, {
+                .name = "bufsize",
+                .type = QEMU_OPT_SIZE,
+                .help = "packets buffered for the writer (1M default)",
+            }, {
+                .name = "maxsize",
+                .type = QEMU_OPT_SIZE,
+                .help = "start a new file past this size, keeping one",
             },
             { /* end of list */ }
         },
@@ -1103,6 +1508,43 @@ static const struct {
     { /* end of list */ }
 };
 
+static const char *net_limit_names[2][NET_SHAPE_MAX] = {
+    { "bps_tx", "bps_rx" },
+    { "pps_tx", "pps_rx" },
+};
+
+/* Read the limits of a netdev from opts.  Returns the name of one that is
+ * set, NULL if none is, or "" on error. */
+static const char *net_client_get_limits(QemuOpts *opts, uint32_t *bps,
+                                         uint32_t *pps)
+{
+    const char *set = NULL;
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < NET_SHAPE_MAX; j++) {
+            const char *name = net_limit_names[i][j];
+            uint64_t val;
+
+            if (i == 0) {
+                val = qemu_opt_get_size(opts, name, 0);
+            } else {
+                val = qemu_opt_get_number(opts, name, 0);
+            }
+            if (val > UINT32_MAX) {
+                qerror_report(QERR_INVALID_PARAMETER_VALUE, name,
+                              "a limit of at most 4G");
+                return "";
+            }
+            (i == 0 ? bps : pps)[j] = val;
+            if (val) {
+                set = name;
+            }
+        }
+    }
+    return set;
+}
+
 int net_client_init(Monitor *mon, QemuOpts *opts, int is_netdev)
 {
     const char *name;
@@ -1151,12 +1593,30 @@ int net_client_init(Monitor *mon, QemuOpts *opts, int is_netdev)
     for (i = 0; net_client_types[i].type != NULL; i++) {
         if (!strcmp(net_client_types[i].type, type)) {
             VLANState *vlan = NULL;
+            uint32_t bps[NET_SHAPE_MAX], pps[NET_SHAPE_MAX];
+            const char *shaped;
             int ret;
 
             if (qemu_opts_validate(opts, &net_client_types[i].desc[0]) == -1) {
                 return -1;
             }
 
+            shaped = net_client_get_limits(opts, bps, pps);
+            if (shaped && !*shaped) {
+                return -1;
+            }
+            if (shaped && !is_netdev) {
+                qerror_report(QERR_INVALID_PARAMETER, shaped);
+                error_printf_unless_qmp("Limits are only supported "
+                                        "with -netdev\n");
+                return -1;
+            }
+            if (shaped && qemu_opt_get_bool(opts, "vhost", 0)) {
+                qerror_report(QERR_INVALID_PARAMETER, "vhost");
+                error_printf_unless_qmp("vhost traffic can't be limited\n");
+                return -1;
+            }
+
             /* Do not add to a vlan if it's a -netdev or a nic with a
              * netdev= parameter. */
             if (!(is_netdev ||
@@ -1173,6 +1633,9 @@ int net_client_init(Monitor *mon, QemuOpts *opts, int is_netdev)
                     return -1;
                 }
             }
+            if (shaped) {
+                qemu_net_set_limits(qemu_find_netdev(name), bps, pps);
+            }
             return ret;
         }
     }
@@ -1263,18 +1726,53 @@ int do_netdev_add(Monitor *mon, const QDict *qdict, QObject **ret_data)
 int do_netdev_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     const char *id = qdict_get_str(qdict, "id");
-    VLANClientState *vc;
+    VLANClientState *vc, *queue;
+    int i;
 
     vc = qemu_find_netdev(id);
-    if (!vc || vc->info->type == NET_CLIENT_TYPE_NIC) {
+    if (!vc || vc->info->type == NET_CLIENT_TYPE_NIC || vc->queue_index) {
         qerror_report(QERR_DEVICE_NOT_FOUND, id);
         return -1;
     }
+    for (i = 1; (queue = qemu_find_netdev_queue(vc, i)); i++) {
+        qemu_del_vlan_client(queue);
+    }
     qemu_del_vlan_client(vc);
     qemu_opts_del(qemu_opts_find(qemu_find_opts("netdev"), id));
     return 0;
 }
 
+/* Only for queues that were ever needed */
+static void print_net_queue(Monitor *mon, const char *prefix, NetQueue *queue)
+{
+    NetQueueStats stats;
+
+    qemu_net_queue_get_stats(queue, &stats);
+    if (!stats.queued) {
+        return;
+    }
+    monitor_printf(mon, "%squeue: %u/%u packets (peak %u), %" PRIu64
+                   " queued, %" PRIu64 " dropped, spare buffers %u+%u\n",
+                   prefix, stats.len, stats.max_len, stats.peak_len,
+                   stats.queued, stats.dropped,
+                   stats.pooled[0], stats.pooled[1]);
+}
+
+static void print_net_limits(Monitor *mon, NetShaping *shaping)
+{
+    static const char *dirs[NET_SHAPE_MAX] = { "tx", "rx" };
+    int i;
+
+    for (i = 0; i < NET_SHAPE_MAX; i++) {
+        NetShaper *sh = &shaping->dir[i];
+
+        monitor_printf(mon, "    %s limit: %" PRIu32 " bytes/s %" PRIu32
+                       " packets/s, throttled %" PRIu64 " times\n",
+                       dirs[i], sh->bytes.rate, sh->packets.rate,
+                       sh->throttled);
+    }
+}
+
 void do_info_network(Monitor *mon)
 {
     VLANState *vlan;
@@ -1285,7 +1783,11 @@ void do_info_network(Monitor *mon)
 
         QTAILQ_FOREACH(vc, &vlan->clients, next) {
             monitor_printf(mon, "  %s: %s\n", vc->name, vc->info_str);
+            if (vc->info->print_info) {
+                vc->info->print_info(vc, mon);
+            }
         }
+        print_net_queue(mon, "  ", vlan->send_queue);
     }
     monitor_printf(mon, "Devices not on any VLAN:\n");
     QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
@@ -1294,6 +1796,13 @@ void do_info_network(Monitor *mon)
             monitor_printf(mon, " peer=%s", vc->peer->name);
         }
         monitor_printf(mon, "\n");
+        if (vc->info->print_info) {
+            vc->info->print_info(vc, mon);
+        }
+        if (vc->shaping && !vc->queue_index) {
+            print_net_limits(mon, vc->shaping);
+        }
+        print_net_queue(mon, "    ", vc->send_queue);
     }
 }
 
@@ -1327,6 +1836,47 @@ done:
     return 0;
 }
 
+int do_netdev_set_limits(Monitor *mon, const QDict *qdict,
+                         QObject **ret_data)
+{
+    const char *id = qdict_get_str(qdict, "id");
+    VLANClientState *vc = qemu_find_netdev(id);
+    uint32_t limits[2][NET_SHAPE_MAX];
+    int i, j;
+
+    if (!vc || vc->info->type == NET_CLIENT_TYPE_NIC || vc->queue_index) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, id);
+        return -1;
+    }
+    if (vc->info->type == NET_CLIENT_TYPE_TAP && tap_get_vhost_net(vc)) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "id",
+                      "a netdev without vhost");
+        return -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < NET_SHAPE_MAX; j++) {
+            NetShaper *sh = vc->shaping ? &vc->shaping->dir[j] : NULL;
+            int64_t val;
+
+            if (!qdict_haskey(qdict, net_limit_names[i][j])) {
+                limits[i][j] = !sh ? 0 : i ? sh->packets.rate : sh->bytes.rate;
+                continue;
+            }
+            val = qdict_get_int(qdict, net_limit_names[i][j]);
+            if (val < 0 || val > UINT32_MAX) {
+                qerror_report(QERR_INVALID_PARAMETER_VALUE,
+                              net_limit_names[i][j], "a limit of at most 4G");
+                return -1;
+            }
+            limits[i][j] = val;
+        }
+    }
+
+    qemu_net_set_limits(vc, limits[0], limits[1]);
+    return 0;
+}
+
 void net_cleanup(void)
 {
     VLANState *vlan;
@@ -28,6 +28,8 @@ typedef struct NICConf {
 
 /* VLANs support */
 
+typedef struct NetShaping NetShaping;
+
 typedef enum {
     NET_CLIENT_TYPE_NONE,
     NET_CLIENT_TYPE_NIC,
@@ -44,6 +46,11 @@ typedef ssize_t (NetReceive)(VLANClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(VLANClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (VLANClientState *);
 typedef void (LinkStatusChanged)(VLANClientState *);
+typedef void (NetPrintInfo)(VLANClientState *, Monitor *);
+typedef int (NetReceiveBuffers)(VLANClientState *, struct iovec *, int,
+                                size_t, size_t);
+typedef void (NetReceiveComplete)(VLANClientState *, ssize_t);
+typedef int (NetReceiveBatch)(VLANClientState *, const struct iovec *, int);
 
 typedef struct NetClientInfo {
     net_client_type type;
@@ -55,6 +62,10 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    NetPrintInfo *print_info;   /* extra lines for info network */
+    NetReceiveBuffers *receive_buffers;     /* zero-copy receive */
+    NetReceiveComplete *receive_complete;
+    NetReceiveBatch *receive_batch;         /* one packet per iovec */
 } NetClientInfo;
 
 struct VLANClientState {
@@ -63,11 +74,14 @@ struct VLANClientState {
     QTAILQ_ENTRY(VLANClientState) next;
     struct VLANState *vlan;
     VLANClientState *peer;
+    VLANClientState *vlan_peer;     /* the other client of a two-client vlan */
     NetQueue *send_queue;
     char *model;
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
+    int queue_index;            /* in a netdev with several queues */
+    NetShaping *shaping;        /* limits of a netdev, shared by its queues */
 };
 
 typedef struct NICState {
@@ -86,6 +100,7 @@ struct VLANState {
 
 VLANState *qemu_find_vlan(int id, int allocate);
 VLANClientState *qemu_find_netdev(const char *id);
+VLANClientState *qemu_find_netdev_queue(VLANClientState *vc, int index);
 VLANClientState *qemu_new_net_client(NetClientInfo *info,
                                      VLANState *vlan,
                                      VLANClientState *peer,
@@ -110,6 +125,12 @@ void qemu_send_packet(VLANClientState *vc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(VLANClientState *vc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(VLANClientState *vc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_get_receive_buffers(VLANClientState *sender, struct iovec *iov,
+                             int iovcnt, size_t hdr_len, size_t size);
+void qemu_receive_complete(VLANClientState *sender, ssize_t len);
+int qemu_can_send_packet_batch(VLANClientState *sender);
+int qemu_send_packet_batch(VLANClientState *sender, const struct iovec *pkts,
+                           int count, NetPacketSent *sent_cb);
 void qemu_purge_queued_packets(VLANClientState *vc);
 void qemu_flush_queued_packets(VLANClientState *vc);
 void qemu_format_nic_info_str(VLANClientState *vc, uint8_t macaddr[6]);
@@ -121,6 +142,8 @@ int qemu_find_nic_model(NICInfo *nd, const char * const *models,
 
 void do_info_network(Monitor *mon);
 int do_set_link(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_netdev_set_limits(Monitor *mon, const QDict *qdict,
+                         QObject **ret_data);
 
 /* NIC info */
 
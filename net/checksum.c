@@ -15,21 +15,79 @@
  *  along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "qemu-common.h"
+#include "bswap.h"
 #include "net/checksum.h"
 
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
+static uint32_t net_checksum_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+/*
+ * The one's complement sum does not care about byte order as long as all
+ * words are added the same way, so add host-order 32-bit words into a
+ * 64-bit accumulator, a loop that the compiler can vectorize, and only
+ * swap the folded result to the big-endian words of the Internet checksum.
+ */
 uint32_t net_checksum_add(int len, uint8_t *buf)
 {
-    uint32_t sum = 0;
+    uint64_t sum = 0;
+    uint32_t w;
     int i;
 
-    for (i = 0; i < len; i++) {
-	if (i & 1)
-	    sum += (uint32_t)buf[i];
-	else
-	    sum += (uint32_t)buf[i] << 8;
+    for (i = 0; i + 4 <= len; i += 4) {
+        memcpy(&w, buf + i, 4);
+        sum += w;
+    }
+    for (; i + 2 <= len; i += 2) {
+        uint16_t h;
+
+        memcpy(&h, buf + i, 2);
+        sum += h;
+    }
+    sum = net_checksum_fold(sum);
+#ifndef HOST_WORDS_BIGENDIAN
+    sum = bswap16(sum);
+#endif
+    if (i < len) {
+        sum += (uint32_t)buf[i] << 8;
+    }
+    return sum;
+}
+
+uint32_t net_checksum_add_iov(const struct iovec *iov, unsigned int iovcnt,
+                              size_t offset, size_t len)
+{
+    uint32_t sum = 0;
+    size_t pos = 0;
+    unsigned int i;
+
+    for (i = 0; i < iovcnt && pos < len; i++) {
+        uint32_t s;
+        size_t n;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        n = MIN(iov[i].iov_len - offset, len - pos);
+        s = net_checksum_fold(net_checksum_add(n,
+                                               iov[i].iov_base + offset));
+        /* A piece starting at an odd position has its words shifted by
+           one byte */
+        if (pos & 1) {
+            s = bswap16(s);
+        }
+        sum += s;
+        pos += n;
+        offset = 0;
     }
     return sum;
 }
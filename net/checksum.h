@@ -18,9 +18,15 @@
 #ifndef QEMU_NET_CHECKSUM_H
 #define QEMU_NET_CHECKSUM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+struct iovec;
+
 uint32_t net_checksum_add(int len, uint8_t *buf);
+/* Sums len bytes of a scatter list from offset, as if they were flat */
+uint32_t net_checksum_add_iov(const struct iovec *iov, unsigned int iovcnt,
+                              size_t offset, size_t len);
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
@@ -27,11 +27,53 @@
 #include "sysemu.h"
 #include "qemu-error.h"
 #include "qemu-log.h"
+#include "monitor.h"
+#ifdef CONFIG_THREAD
+#include "qemu-thread.h"
+#endif
+
+/*
+ * Packets are copied into a ring buffer on the delivery path and written
+ * out by a thread, or by a bottom half without thread support, so that a
+ * slow disk never stalls the vlan.  When the ring is full, packets are
+ * dropped and counted rather than waited for.
+ *
+ * All positions are byte offsets in the stream of records since the dump
+ * was started; the ring index is the offset modulo the ring size.  With a
+ * size limit, the producer decides where each file ends and queues the
+ * offset, and the writer starts a new file when it gets there.
+ */
+
+#define DUMP_MAX_ROTATIONS 8
 
 typedef struct DumpState {
     VLANClientState nc;
     int fd;
     int pcap_caplen;
+    char *filename;
+    int64_t maxsize;            /* 0 for no limit */
+
+    uint8_t *ring;
+    size_t ring_size;
+    uint64_t queued;            /* end of the last record queued */
+    uint64_t written;           /* end of what the writer is done with */
+    uint64_t file_start;        /* offset the current file starts at */
+    uint64_t rotate_at[DUMP_MAX_ROTATIONS];
+    int rotate_head, rotate_count;
+    bool error;                 /* stop dumping, the writer failed */
+
+    uint64_t packets;
+    uint64_t dropped;
+    unsigned int rotations;
+
+#ifdef CONFIG_THREAD
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    bool quit;
+#else
+    QEMUBH *bh;
+#endif
 } DumpState;
 
 #define PCAP_MAGIC 0xa1b2c3d4
@@ -55,32 +97,206 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
+#ifdef CONFIG_THREAD
+static void dump_lock(DumpState *s)
+{
+    qemu_mutex_lock(&s->lock);
+}
+
+static void dump_unlock(DumpState *s)
+{
+    qemu_mutex_unlock(&s->lock);
+}
+#else
+static void dump_lock(DumpState *s)
+{
+}
+
+static void dump_unlock(DumpState *s)
+{
+}
+#endif
+
+static int dump_open(const char *filename, int snaplen)
+{
+    struct pcap_file_hdr hdr;
+    int fd;
+
+    fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    hdr.magic = PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = snaplen;
+    hdr.linktype = 1;
+
+    if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Keep the full file as <file>.1, replacing the one before, and start
+   a new one.  Called from the writer. */
+static int dump_rotate(DumpState *s)
+{
+    char *old;
+    int ret = 0;
+
+    close(s->fd);
+    old = qemu_malloc(strlen(s->filename) + 3);
+    sprintf(old, "%s.1", s->filename);
+    if (rename(s->filename, old) < 0 ||
+        (s->fd = dump_open(s->filename, s->pcap_caplen)) < 0) {
+        s->fd = -1;
+        ret = -1;
+    }
+    qemu_free(old);
+    return ret;
+}
+
+/* Write out what is queued, called with the lock held */
+static void dump_flush(DumpState *s)
+{
+    while (!s->error && s->written != s->queued) {
+        uint64_t end = s->queued;
+        size_t pos = s->written % s->ring_size;
+        size_t len;
+        ssize_t ret;
+
+        if (s->rotate_count) {
+            uint64_t at = s->rotate_at[s->rotate_head];
+
+            if (s->written == at) {
+                s->rotate_head = (s->rotate_head + 1) % DUMP_MAX_ROTATIONS;
+                s->rotate_count--;
+                s->rotations++;
+                dump_unlock(s);
+                ret = dump_rotate(s);
+                dump_lock(s);
+                if (ret < 0) {
+                    qemu_log("-net dump: can't rotate %s - stop dump\n",
+                             s->filename);
+                    s->error = true;
+                }
+                continue;
+            }
+            end = MIN(end, at);
+        }
+        len = MIN(end - s->written, s->ring_size - pos);
+
+        /* The producer only ever appends, so the range is ours */
+        dump_unlock(s);
+        ret = write(s->fd, s->ring + pos, len);
+        dump_lock(s);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            qemu_log("-net dump write error - stop dump\n");
+            s->error = true;
+            break;
+        }
+        s->written += ret;
+    }
+}
+
+#ifdef CONFIG_THREAD
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->quit && s->written == s->queued) {
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+        dump_flush(s);
+        if (s->quit) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&s->lock);
+    return NULL;
+}
+#else
+static void dump_bh(void *opaque)
+{
+    dump_flush(opaque);
+}
+#endif
+
+static void dump_copy(DumpState *s, const void *buf, size_t len)
+{
+    size_t pos = s->queued % s->ring_size;
+    size_t n = MIN(len, s->ring_size - pos);
+
+    memcpy(s->ring + pos, buf, n);
+    memcpy(s->ring, (const uint8_t *)buf + n, len - n);
+    s->queued += len;
+}
+
 static ssize_t dump_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
     struct pcap_sf_pkthdr hdr;
     int64_t ts;
     int caplen;
-
-    /* Early return in case of previous error. */
-    if (s->fd < 0) {
-        return size;
-    }
+    size_t len;
+    bool idle;
 
     ts = muldiv64(qemu_get_clock(vm_clock), 1000000, get_ticks_per_sec());
     caplen = size > s->pcap_caplen ? s->pcap_caplen : size;
+    len = sizeof(hdr) + caplen;
 
     hdr.ts.tv_sec = ts / 1000000;
     hdr.ts.tv_usec = ts % 1000000;
     hdr.caplen = caplen;
     hdr.len = size;
-    if (write(s->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
-        write(s->fd, buf, caplen) != caplen) {
-        qemu_log("-net dump write error - stop dump\n");
-        close(s->fd);
-        s->fd = -1;
+
+    dump_lock(s);
+    /* Early return in case of previous error. */
+    if (s->error) {
+        dump_unlock(s);
+        return size;
+    }
+    if (s->maxsize && s->queued + len - s->file_start +
+        sizeof(struct pcap_file_hdr) > s->maxsize &&
+        s->queued != s->file_start) {
+        if (s->rotate_count == DUMP_MAX_ROTATIONS) {
+            goto drop;
+        }
+        s->rotate_at[(s->rotate_head + s->rotate_count++) %
+                     DUMP_MAX_ROTATIONS] = s->queued;
+        s->file_start = s->queued;
+    }
+    if (s->ring_size - (s->queued - s->written) < len) {
+        goto drop;
+    }
+
+    idle = s->written == s->queued;
+    dump_copy(s, &hdr, sizeof(hdr));
+    dump_copy(s, buf, caplen);
+    s->packets++;
+    if (idle) {
+#ifdef CONFIG_THREAD
+        qemu_cond_signal(&s->cond);
+#else
+        qemu_bh_schedule(s->bh);
+#endif
     }
+    dump_unlock(s);
+    return size;
 
+drop:
+    s->dropped++;
+    dump_unlock(s);
     return size;
 }
 
@@ -88,7 +304,37 @@ static void dump_cleanup(VLANClientState *nc)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
 
-    close(s->fd);
+    /* Whatever is queued still goes to the file */
+#ifdef CONFIG_THREAD
+    qemu_mutex_lock(&s->lock);
+    s->quit = true;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+    qemu_thread_join(&s->thread);
+    qemu_cond_destroy(&s->cond);
+    qemu_mutex_destroy(&s->lock);
+#else
+    qemu_bh_delete(s->bh);
+    dump_flush(s);
+#endif
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    qemu_free(s->ring);
+    qemu_free(s->filename);
+}
+
+static void dump_print_info(VLANClientState *nc, Monitor *mon)
+{
+    DumpState *s = DO_UPCAST(DumpState, nc, nc);
+
+    dump_lock(s);
+    monitor_printf(mon, "    packets=%" PRIu64 " dropped=%" PRIu64
+                   " buffered=%" PRIu64 "/%zu rotations=%u%s\n",
+                   s->packets, s->dropped, s->queued - s->written,
+                   s->ring_size, s->rotations,
+                   s->error ? " (stopped on error)" : "");
+    dump_unlock(s);
 }
 
 static NetClientInfo net_dump_info = {
@@ -96,52 +342,59 @@ static NetClientInfo net_dump_info = {
     .size = sizeof(DumpState),
     .receive = dump_receive,
     .cleanup = dump_cleanup,
+    .print_info = dump_print_info,
 };
 
 static int net_dump_init(VLANState *vlan, const char *device,
-                         const char *name, const char *filename, int len)
+                         const char *name, const char *filename, int len,
+                         size_t bufsize, int64_t maxsize)
 {
-    struct pcap_file_hdr hdr;
     VLANClientState *nc;
     DumpState *s;
     int fd;
 
-    fd = open(filename, O_CREAT | O_WRONLY | O_BINARY, 0644);
+    fd = dump_open(filename, len);
     if (fd < 0) {
-        error_report("-net dump: can't open %s", filename);
-        return -1;
-    }
-
-    hdr.magic = PCAP_MAGIC;
-    hdr.version_major = 2;
-    hdr.version_minor = 4;
-    hdr.thiszone = 0;
-    hdr.sigfigs = 0;
-    hdr.snaplen = len;
-    hdr.linktype = 1;
-
-    if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
-        error_report("-net dump write error: %s", strerror(errno));
-        close(fd);
+        error_report("-net dump: can't open %s: %s", filename,
+                     strerror(errno));
         return -1;
     }
 
     nc = qemu_new_net_client(&net_dump_info, vlan, NULL, device, name);
 
-    snprintf(nc->info_str, sizeof(nc->info_str),
-             "dump to %s (len=%d)", filename, len);
+    if (maxsize) {
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "dump to %s (len=%d, maxsize=%" PRId64 ")",
+                 filename, len, maxsize);
+    } else {
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "dump to %s (len=%d)", filename, len);
+    }
 
     s = DO_UPCAST(DumpState, nc, nc);
 
     s->fd = fd;
     s->pcap_caplen = len;
+    s->filename = qemu_strdup(filename);
+    s->maxsize = maxsize;
+    s->ring_size = bufsize;
+    s->ring = qemu_malloc(bufsize);
 
+#ifdef CONFIG_THREAD
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    qemu_thread_create(&s->thread, dump_thread, s);
+#else
+    s->bh = qemu_bh_new(dump_bh, s);
+#endif
     return 0;
 }
 
 int net_init_dump(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
 {
     int len;
+    size_t bufsize;
+    int64_t maxsize;
     const char *file;
     char def_file[128];
 
@@ -154,6 +407,14 @@ int net_init_dump(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vla
     }
 
     len = qemu_opt_get_size(opts, "len", 65536);
+    bufsize = qemu_opt_get_size(opts, "bufsize", 1024 * 1024);
+    maxsize = qemu_opt_get_size(opts, "maxsize", 0);
+
+    /* A ring that can't hold one full packet would drop them all */
+    if (len <= 0 || bufsize < sizeof(struct pcap_sf_pkthdr) + len) {
+        error_report("-net dump: bufsize must be larger than len");
+        return -1;
+    }
 
-    return net_dump_init(vlan, "dump", name, file, len);
+    return net_dump_init(vlan, "dump", name, file, len, bufsize, maxsize);
 }
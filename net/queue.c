@@ -35,14 +35,30 @@
  * the packet.
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
- * unbounded queueing.
+ * unbounded queueing.  Packets queued without a sent callback, while a
+ * delivery is in progress, are dropped too once the queue holds
+ * NET_QUEUE_MAX_LEN packets.
+ *
+ * Queued packets are copied into buffers of two fixed sizes, one for
+ * standard frames and one for jumbo frames, that are kept for reuse once
+ * the packet is delivered.  Only larger (GSO) packets are allocated one
+ * by one.
  */
 
+#define NET_QUEUE_MAX_LEN   1024
+#define NET_QUEUE_POOL_MAX  256     /* spare buffers kept of each size */
+
+static const size_t net_queue_pool_size[NET_QUEUE_POOLS] = {
+    2048,                           /* 1500 MTU, with vnet header */
+    9216 + 64,                      /* jumbo frames */
+};
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     VLANClientState *sender;
     unsigned flags;
     int size;
+    int pool;                       /* -1 if allocated on its own */
     NetPacketSent *sent_cb;
     uint8_t data[0];
 };
@@ -53,10 +69,70 @@ struct NetQueue {
     void *opaque;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) pool[NET_QUEUE_POOLS];
+    NetQueueStats stats;
 
     unsigned delivering : 1;
 };
 
+static NetPacket *qemu_net_queue_alloc(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+    int i;
+
+    for (i = 0; i < NET_QUEUE_POOLS; i++) {
+        if (size > net_queue_pool_size[i]) {
+            continue;
+        }
+        packet = QTAILQ_FIRST(&queue->pool[i]);
+        if (packet) {
+            QTAILQ_REMOVE(&queue->pool[i], packet, entry);
+            queue->stats.pooled[i]--;
+        } else {
+            packet = qemu_malloc(sizeof(NetPacket) + net_queue_pool_size[i]);
+            packet->pool = i;
+        }
+        return packet;
+    }
+
+    packet = qemu_malloc(sizeof(NetPacket) + size);
+    packet->pool = -1;
+    return packet;
+}
+
+static void qemu_net_queue_free(NetQueue *queue, NetPacket *packet)
+{
+    int i = packet->pool;
+
+    queue->stats.len--;
+    if (i < 0 || queue->stats.pooled[i] >= NET_QUEUE_POOL_MAX) {
+        qemu_free(packet);
+        return;
+    }
+    QTAILQ_INSERT_HEAD(&queue->pool[i], packet, entry);
+    queue->stats.pooled[i]++;
+}
+
+/* Room for one more packet?  Those with a sent callback are always taken:
+ * their sender stops until the callback, so it bounds the queue itself. */
+static bool qemu_net_queue_full(NetQueue *queue, NetPacketSent *sent_cb)
+{
+    if (sent_cb || queue->stats.len < NET_QUEUE_MAX_LEN) {
+        return false;
+    }
+    queue->stats.dropped++;
+    return true;
+}
+
+static void qemu_net_queue_insert(NetQueue *queue, NetPacket *packet)
+{
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    queue->stats.queued++;
+    if (++queue->stats.len > queue->stats.peak_len) {
+        queue->stats.peak_len = queue->stats.len;
+    }
+}
+
 NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
                              NetPacketDeliverIOV *deliver_iov,
                              void *opaque)
@@ -70,6 +146,9 @@ NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
     queue->opaque = opaque;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool[0]);
+    QTAILQ_INIT(&queue->pool[1]);
+    queue->stats.max_len = NET_QUEUE_MAX_LEN;
 
     queue->delivering = 0;
 
@@ -79,15 +158,27 @@ NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
+    int i;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         qemu_free(packet);
     }
+    for (i = 0; i < NET_QUEUE_POOLS; i++) {
+        QTAILQ_FOREACH_SAFE(packet, &queue->pool[i], entry, next) {
+            QTAILQ_REMOVE(&queue->pool[i], packet, entry);
+            qemu_free(packet);
+        }
+    }
 
     qemu_free(queue);
 }
 
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    *stats = queue->stats;
+}
+
 static ssize_t qemu_net_queue_append(NetQueue *queue,
                                      VLANClientState *sender,
                                      unsigned flags,
@@ -97,14 +188,18 @@ static ssize_t qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    packet = qemu_malloc(sizeof(NetPacket) + size);
+    if (qemu_net_queue_full(queue, sent_cb)) {
+        return size;
+    }
+
+    packet = qemu_net_queue_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 
     return size;
 }
@@ -124,7 +219,11 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = qemu_malloc(sizeof(NetPacket) + max_len);
+    if (qemu_net_queue_full(queue, sent_cb)) {
+        return max_len;
+    }
+
+    packet = qemu_net_queue_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -137,7 +236,7 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 
     return packet->size;
 }
@@ -220,6 +319,25 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* For a caller that delivers a packet itself, bypassing the deliver
+ * handler: returns false if packets are queued or a delivery is under
+ * way, as the packet must then wait its turn.  Otherwise the queue is
+ * marked busy, so that packets sent meanwhile are queued, until
+ * qemu_net_queue_leave(). */
+bool qemu_net_queue_enter(NetQueue *queue)
+{
+    if (queue->delivering || !QTAILQ_EMPTY(&queue->packets)) {
+        return false;
+    }
+    queue->delivering = 1;
+    return true;
+}
+
+void qemu_net_queue_leave(NetQueue *queue)
+{
+    queue->delivering = 0;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from)
 {
     NetPacket *packet, *next;
@@ -227,7 +345,7 @@ void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            qemu_free(packet);
+            qemu_net_queue_free(queue, packet);
         }
     }
 }
@@ -255,6 +373,6 @@ void qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        qemu_free(packet);
+        qemu_net_queue_free(queue, packet);
     }
 }
@@ -46,10 +46,22 @@ typedef ssize_t (NetPacketDeliverIOV) (VLANClientState *sender,
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
+#define NET_QUEUE_POOLS 2
+
+typedef struct NetQueueStats {
+    uint64_t queued;            /* packets that could not be delivered */
+    uint64_t dropped;           /* ... and found the queue full */
+    unsigned int len;
+    unsigned int max_len;
+    unsigned int peak_len;
+    unsigned int pooled[NET_QUEUE_POOLS];   /* spare buffers, by size */
+} NetQueueStats;
+
 NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
                              NetPacketDeliverIOV *deliver_iov,
                              void *opaque);
 void qemu_del_net_queue(NetQueue *queue);
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
 
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             VLANClientState *sender,
@@ -65,6 +77,9 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+bool qemu_net_queue_enter(NetQueue *queue);
+void qemu_net_queue_leave(NetQueue *queue);
+
 void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from);
 void qemu_net_queue_flush(NetQueue *queue);
 
@@ -30,8 +30,28 @@
 #include "qemu-common.h"
 #include "qemu-error.h"
 #include "qemu-option.h"
+#include "monitor.h"
 #include "qemu_socket.h"
 
+/* Datagram sockets move up to SOCKET_BATCH datagrams per system call,
+ * with sendmmsg and recvmmsg where the host has them.  Packets from the
+ * guest are held until a bottom half runs, after the NIC is done with the
+ * burst it is sending, and go out together.
+ *
+ * With coalescing, several frames are packed into each datagram, each
+ * after a 16 bit big endian length; both ends must be told to coalesce. */
+#define SOCKET_BATCH            32
+#define SOCKET_DGRAM_MAX        65536
+#define SOCKET_COALESCE_MAX     65507   /* largest UDP payload */
+#define SOCKET_RX_PKTS          256     /* frames handed to the peer at once */
+
+typedef struct NetSocketStats {
+    uint64_t packets;
+    uint64_t datagrams;
+    uint64_t calls;
+    uint64_t dropped;
+} NetSocketStats;
+
 typedef struct NetSocketState {
     VLANClientState nc;
     int fd;
@@ -40,6 +60,15 @@ typedef struct NetSocketState {
     unsigned int packet_len;
     uint8_t buf[4096];
     struct sockaddr_in dgram_dst; /* contains inet host and port destination iff connectionless (SOCK_DGRAM) */
+
+    /* datagram sockets only */
+    int coalesce;               /* datagram size to pack frames in, or 0 */
+    uint8_t *rx_bufs;           /* SOCKET_BATCH slots of SOCKET_DGRAM_MAX */
+    uint8_t *tx_bufs;
+    size_t tx_len[SOCKET_BATCH];
+    int tx_count;
+    QEMUBH *tx_bh;
+    NetSocketStats tx_stats, rx_stats;
 } NetSocketState;
 
 typedef struct NetSocketListenState {
@@ -60,12 +89,88 @@ static ssize_t net_socket_receive(VLANClientState *nc, const uint8_t *buf, size_
     return send_all(s->fd, buf, size);
 }
 
+/* Send what was collected since the last flush */
+static void net_socket_flush_dgram(NetSocketState *s)
+{
+    int i, done = 0;
+#ifdef CONFIG_MMSG
+    struct mmsghdr msgs[SOCKET_BATCH];
+    struct iovec iov[SOCKET_BATCH];
+
+    for (i = 0; i < s->tx_count; i++) {
+        iov[i].iov_base = s->tx_bufs + i * SOCKET_DGRAM_MAX;
+        iov[i].iov_len = s->tx_len[i];
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &s->dgram_dst;
+        msgs[i].msg_hdr.msg_namelen = sizeof(s->dgram_dst);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (done < s->tx_count) {
+        int ret = sendmmsg(s->fd, msgs + done, s->tx_count - done, 0);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        s->tx_stats.calls++;
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+#else
+    for (i = 0; i < s->tx_count; i++) {
+        s->tx_stats.calls++;
+        if (sendto(s->fd, (const void *)(s->tx_bufs + i * SOCKET_DGRAM_MAX),
+                   s->tx_len[i], 0, (struct sockaddr *)&s->dgram_dst,
+                   sizeof(s->dgram_dst)) >= 0) {
+            done++;
+        }
+    }
+#endif
+    s->tx_stats.datagrams += done;
+    s->tx_stats.dropped += s->tx_count - done;
+    s->tx_count = 0;
+}
+
+static void net_socket_flush_bh(void *opaque)
+{
+    net_socket_flush_dgram(opaque);
+}
+
 static ssize_t net_socket_receive_dgram(VLANClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    size_t need = s->coalesce ? size + 2 : size;
+    size_t limit = s->coalesce ? s->coalesce : SOCKET_DGRAM_MAX;
+    uint8_t *p;
+
+    if (need > SOCKET_DGRAM_MAX) {
+        s->tx_stats.dropped++;
+        return size;
+    }
+
+    /* Pack it after the last frame if that leaves the datagram in size */
+    if (!s->coalesce || !s->tx_count ||
+        s->tx_len[s->tx_count - 1] + need > limit) {
+        if (s->tx_count == SOCKET_BATCH) {
+            net_socket_flush_dgram(s);
+        }
+        s->tx_len[s->tx_count++] = 0;
+    }
+
+    p = s->tx_bufs + (s->tx_count - 1) * SOCKET_DGRAM_MAX +
+        s->tx_len[s->tx_count - 1];
+    if (s->coalesce) {
+        cpu_to_be16wu((uint16_t *)p, size);
+        p += 2;
+    }
+    memcpy(p, buf, size);
+    s->tx_len[s->tx_count - 1] += need;
+    s->tx_stats.packets++;
 
-    return sendto(s->fd, (const void *)buf, size, 0,
-                  (struct sockaddr *)&s->dgram_dst, sizeof(s->dgram_dst));
+    qemu_bh_schedule(s->tx_bh);
+    return size;
 }
 
 static void net_socket_send(void *opaque)
@@ -133,20 +238,109 @@ static void net_socket_send(void *opaque)
     }
 }
 
+static void net_socket_send_dgram(void *opaque);
+
+static void net_socket_read_poll(NetSocketState *s, int enable)
+{
+    qemu_set_fd_handler(s->fd, enable ? net_socket_send_dgram : NULL,
+                        NULL, s);
+}
+
+static void net_socket_send_completed(VLANClientState *nc, ssize_t len)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    net_socket_read_poll(s, 1);
+}
+
+/* Receive up to SOCKET_BATCH datagrams, returns how many */
+static int net_socket_recv_dgrams(NetSocketState *s, struct iovec *iov)
+{
+    int i, count = 0;
+#ifdef CONFIG_MMSG
+    struct mmsghdr msgs[SOCKET_BATCH];
+
+    for (i = 0; i < SOCKET_BATCH; i++) {
+        iov[i].iov_base = s->rx_bufs + i * SOCKET_DGRAM_MAX;
+        iov[i].iov_len = SOCKET_DGRAM_MAX;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    do {
+        count = recvmmsg(s->fd, msgs, SOCKET_BATCH, MSG_DONTWAIT, NULL);
+    } while (count < 0 && errno == EINTR);
+    s->rx_stats.calls++;
+    for (i = 0; i < count; i++) {
+        iov[i].iov_len = msgs[i].msg_len;
+    }
+#else
+    for (i = 0; i < SOCKET_BATCH; i++) {
+        int size;
+
+        iov[i].iov_base = s->rx_bufs + i * SOCKET_DGRAM_MAX;
+        size = recv(s->fd, iov[i].iov_base, SOCKET_DGRAM_MAX, 0);
+        s->rx_stats.calls++;
+        if (size < 0) {
+            break;
+        }
+        iov[i].iov_len = size;
+        count++;
+    }
+#endif
+    if (count > 0) {
+        s->rx_stats.datagrams += count;
+    }
+    return count;
+}
+
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
-    int size;
+    struct iovec dgrams[SOCKET_BATCH], pkts[SOCKET_RX_PKTS];
+    int i, n, count = 0, queued = 0;
+
+    n = net_socket_recv_dgrams(s, dgrams);
+    for (i = 0; i < n; i++) {
+        uint8_t *p = dgrams[i].iov_base;
+        size_t left = dgrams[i].iov_len;
+
+        while (left) {
+            size_t len = left;
+
+            if (s->coalesce) {
+                len = left < 2 ? left : (p[0] << 8) | p[1];
+                if (left < 2 || len > left - 2) {
+                    s->rx_stats.dropped++;
+                    break;
+                }
+                p += 2;
+                left -= 2;
+            }
+            if (len) {
+                if (count == SOCKET_RX_PKTS) {
+                    queued |= qemu_send_packet_batch(&s->nc, pkts, count,
+                                  net_socket_send_completed) < count;
+                    count = 0;
+                }
+                pkts[count].iov_base = p;
+                pkts[count].iov_len = len;
+                count++;
+                s->rx_stats.packets++;
+            }
+            p += len;
+            left -= len;
+        }
+    }
+    if (count) {
+        queued |= qemu_send_packet_batch(&s->nc, pkts, count,
+                                         net_socket_send_completed) < count;
+    }
 
-    size = recv(s->fd, (void *)s->buf, sizeof(s->buf), 0);
-    if (size < 0)
-        return;
-    if (size == 0) {
-        /* end of connection */
-        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
-        return;
+    /* Some had to be queued, wait for the peer before reading more */
+    if (queued) {
+        net_socket_read_poll(s, 0);
     }
-    qemu_send_packet(&s->nc, s->buf, size);
 }
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
@@ -230,11 +424,40 @@ static void net_socket_cleanup(VLANClientState *nc)
     close(s->fd);
 }
 
+static void net_socket_cleanup_dgram(VLANClientState *nc)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    net_socket_flush_dgram(s);
+    qemu_bh_delete(s->tx_bh);
+    net_socket_cleanup(nc);
+    qemu_free(s->tx_bufs);
+    qemu_free(s->rx_bufs);
+}
+
+static void net_socket_print_stats(Monitor *mon, const char *dir,
+                                   NetSocketStats *stats)
+{
+    monitor_printf(mon, "    %s: packets=%" PRIu64 " datagrams=%" PRIu64
+                   " calls=%" PRIu64 " dropped=%" PRIu64 "\n", dir,
+                   stats->packets, stats->datagrams, stats->calls,
+                   stats->dropped);
+}
+
+static void net_socket_print_info(VLANClientState *nc, Monitor *mon)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    net_socket_print_stats(mon, "tx", &s->tx_stats);
+    net_socket_print_stats(mon, "rx", &s->rx_stats);
+}
+
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_TYPE_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
-    .cleanup = net_socket_cleanup,
+    .cleanup = net_socket_cleanup_dgram,
+    .print_info = net_socket_print_info,
 };
 
 static NetSocketState *net_socket_fd_init_dgram(VLANState *vlan,
@@ -289,8 +512,11 @@ static NetSocketState *net_socket_fd_init_dgram(VLANState *vlan,
     s = DO_UPCAST(NetSocketState, nc, nc);
 
     s->fd = fd;
+    s->rx_bufs = qemu_malloc(SOCKET_BATCH * SOCKET_DGRAM_MAX);
+    s->tx_bufs = qemu_malloc(SOCKET_BATCH * SOCKET_DGRAM_MAX);
+    s->tx_bh = qemu_bh_new(net_socket_flush_bh, s);
 
-    qemu_set_fd_handler(s->fd, net_socket_send_dgram, NULL, s);
+    net_socket_read_poll(s, 1);
 
     /* mcast: save bound address as dst */
     if (is_connected) s->dgram_dst=saddr;
@@ -479,11 +705,26 @@ static int net_socket_connect_init(VLANState *vlan,
     return 0;
 }
 
+/* Coalescing and the socket buffer sizes, for the datagram modes */
+static void net_socket_dgram_setup(NetSocketState *s, int coalesce,
+                                   int sockbuf)
+{
+    s->coalesce = coalesce;
+    if (sockbuf &&
+        (setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF,
+                    (const char *)&sockbuf, sizeof(sockbuf)) < 0 ||
+         setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF,
+                    (const char *)&sockbuf, sizeof(sockbuf)) < 0)) {
+        error_report("socket: can't set buffer size: %s", strerror(errno));
+    }
+}
+
 static int net_socket_mcast_init(VLANState *vlan,
                                  const char *model,
                                  const char *name,
                                  const char *host_str,
-                                 const char *localaddr_str)
+                                 const char *localaddr_str,
+                                 int coalesce, int sockbuf)
 {
     NetSocketState *s;
     int fd;
@@ -510,6 +751,7 @@ static int net_socket_mcast_init(VLANState *vlan,
         return -1;
 
     s->dgram_dst = saddr;
+    net_socket_dgram_setup(s, coalesce, sockbuf);
 
     snprintf(s->nc.info_str, sizeof(s->nc.info_str),
              "socket: mcast=%s:%d",
@@ -518,19 +760,89 @@ static int net_socket_mcast_init(VLANState *vlan,
 
 }
 
+static int net_socket_udp_init(VLANState *vlan,
+                               const char *model,
+                               const char *name,
+                               const char *rhost,
+                               const char *lhost,
+                               int coalesce, int sockbuf)
+{
+    NetSocketState *s;
+    int fd, val, ret;
+    struct sockaddr_in laddr, raddr;
+
+    if (parse_host_port(&laddr, lhost) < 0) {
+        return -1;
+    }
+
+    if (parse_host_port(&raddr, rhost) < 0) {
+        return -1;
+    }
+
+    fd = qemu_socket(PF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket(PF_INET, SOCK_DGRAM)");
+        return -1;
+    }
+    val = 1;
+    ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+                     (const char *)&val, sizeof(val));
+    if (ret < 0) {
+        perror("setsockopt(SOL_SOCKET, SO_REUSEADDR)");
+        closesocket(fd);
+        return -1;
+    }
+    ret = bind(fd, (struct sockaddr *)&laddr, sizeof(laddr));
+    if (ret < 0) {
+        perror("bind");
+        closesocket(fd);
+        return -1;
+    }
+    socket_set_nonblock(fd);
+
+    s = net_socket_fd_init(vlan, model, name, fd, 0);
+    if (!s) {
+        return -1;
+    }
+
+    s->dgram_dst = raddr;
+    net_socket_dgram_setup(s, coalesce, sockbuf);
+
+    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+             "socket: udp=%s:%d%s",
+             inet_ntoa(raddr.sin_addr), ntohs(raddr.sin_port),
+             coalesce ? " (coalescing)" : "");
+    return 0;
+}
+
 int net_init_socket(QemuOpts *opts,
                     Monitor *mon,
                     const char *name,
                     VLANState *vlan)
 {
+    int64_t coalesce = qemu_opt_get_size(opts, "coalesce", 0);
+    int64_t sockbuf = qemu_opt_get_size(opts, "sockbuf", 0);
+
+    if ((coalesce || sockbuf) &&
+        !qemu_opt_get(opts, "mcast") && !qemu_opt_get(opts, "udp")) {
+        error_report("coalesce= and sockbuf= need mcast= or udp=");
+        return -1;
+    }
+    if (coalesce > SOCKET_COALESCE_MAX || sockbuf > INT_MAX) {
+        error_report("coalesce= is at most %d bytes, sockbuf= at most %d",
+                     SOCKET_COALESCE_MAX, INT_MAX);
+        return -1;
+    }
+
     if (qemu_opt_get(opts, "fd")) {
         int fd;
 
         if (qemu_opt_get(opts, "listen") ||
             qemu_opt_get(opts, "connect") ||
             qemu_opt_get(opts, "mcast") ||
+            qemu_opt_get(opts, "udp") ||
             qemu_opt_get(opts, "localaddr")) {
-            error_report("listen=, connect=, mcast= and localaddr= is invalid with fd=\n");
+            error_report("listen=, connect=, mcast=, udp= and localaddr= is invalid with fd=\n");
             return -1;
         }
 
@@ -549,8 +861,9 @@ int net_init_socket(QemuOpts *opts,
         if (qemu_opt_get(opts, "fd") ||
             qemu_opt_get(opts, "connect") ||
             qemu_opt_get(opts, "mcast") ||
+            qemu_opt_get(opts, "udp") ||
             qemu_opt_get(opts, "localaddr")) {
-            error_report("fd=, connect=, mcast= and localaddr= is invalid with listen=\n");
+            error_report("fd=, connect=, mcast=, udp= and localaddr= is invalid with listen=\n");
             return -1;
         }
 
@@ -565,8 +878,9 @@ int net_init_socket(QemuOpts *opts,
         if (qemu_opt_get(opts, "fd") ||
             qemu_opt_get(opts, "listen") ||
             qemu_opt_get(opts, "mcast") ||
+            qemu_opt_get(opts, "udp") ||
             qemu_opt_get(opts, "localaddr")) {
-            error_report("fd=, listen=, mcast= and localaddr= is invalid with connect=\n");
+            error_report("fd=, listen=, mcast=, udp= and localaddr= is invalid with connect=\n");
             return -1;
         }
 
@@ -580,19 +894,42 @@ int net_init_socket(QemuOpts *opts,
 
         if (qemu_opt_get(opts, "fd") ||
             qemu_opt_get(opts, "connect") ||
-            qemu_opt_get(opts, "listen")) {
-            error_report("fd=, connect= and listen= is invalid with mcast=");
+            qemu_opt_get(opts, "listen") ||
+            qemu_opt_get(opts, "udp")) {
+            error_report("fd=, connect=, listen= and udp= is invalid with mcast=");
             return -1;
         }
 
         mcast = qemu_opt_get(opts, "mcast");
         localaddr = qemu_opt_get(opts, "localaddr");
 
-        if (net_socket_mcast_init(vlan, "socket", name, mcast, localaddr) == -1) {
+        if (net_socket_mcast_init(vlan, "socket", name, mcast, localaddr,
+                                  coalesce, sockbuf) == -1) {
+            return -1;
+        }
+    } else if (qemu_opt_get(opts, "udp")) {
+        const char *udp, *localaddr;
+
+        if (qemu_opt_get(opts, "fd") ||
+            qemu_opt_get(opts, "connect") ||
+            qemu_opt_get(opts, "listen")) {
+            error_report("fd=, connect= and listen= is invalid with udp=");
+            return -1;
+        }
+
+        udp = qemu_opt_get(opts, "udp");
+        localaddr = qemu_opt_get(opts, "localaddr");
+        if (!localaddr) {
+            error_report("udp= requires localaddr=");
+            return -1;
+        }
+
+        if (net_socket_udp_init(vlan, "socket", name, udp, localaddr,
+                                coalesce, sockbuf) == -1) {
             return -1;
         }
     } else {
-        error_report("-socket requires fd=, listen=, connect= or mcast=");
+        error_report("-socket requires fd=, listen=, connect=, mcast= or udp=");
         return -1;
     }
 
@@ -35,7 +35,8 @@
 
 #define PATH_NET_TUN "/dev/net/tun"
 
-int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required)
+int tap_open(char *ifname, int ifname_size, int *vnet_hdr,
+             int vnet_hdr_required, int mq_required)
 {
     struct ifreq ifr;
     int fd, ret;
@@ -67,6 +68,19 @@ int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required
         }
     }
 
+    if (mq_required) {
+        unsigned int features;
+
+        if (ioctl(fd, TUNGETFEATURES, &features) != 0 ||
+            !(features & IFF_MULTI_QUEUE)) {
+            error_report("queues= requested, but no kernel "
+                         "support for IFF_MULTI_QUEUE available");
+            close(fd);
+            return -1;
+        }
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+
     if (ifname[0] != '\0')
         pstrcpy(ifr.ifr_name, IFNAMSIZ, ifname);
     else
@@ -163,6 +177,32 @@ void tap_fd_set_vnet_hdr_len(int fd, int len)
     }
 }
 
+/* Attach or detach a queue of a multiqueue tap; the kernel only spreads
+ * packets over the queues that are attached.
+ */
+static int tap_fd_set_queue(int fd, int flags)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = flags;
+    if (ioctl(fd, TUNSETQUEUE, (void *) &ifr) != 0) {
+        error_report("TUNSETQUEUE ioctl() failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int tap_fd_enable(int fd)
+{
+    return tap_fd_set_queue(fd, IFF_ATTACH_QUEUE);
+}
+
+int tap_fd_disable(int fd)
+{
+    return tap_fd_set_queue(fd, IFF_DETACH_QUEUE);
+}
+
 void tap_fd_set_offload(int fd, int csum, int tso4,
                         int tso6, int ecn, int ufo)
 {
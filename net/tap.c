@@ -49,16 +49,27 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* guest buffers a packet may be read into at once */
+#define TAP_DIRECT_IOV 64
+
+/* Batched receive: packets read per wakeup, and the room for them after
+ * the first one.  Each read needs TAP_BUFSIZE free, so small packets
+ * batch well and GSO ones mostly go one at a time. */
+#define TAP_BATCH       32
+#define TAP_BATCH_ROOM  (TAP_BATCH * 2048)
+
 typedef struct TAPState {
     VLANClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[TAP_BUFSIZE];
+    uint8_t buf[TAP_BUFSIZE + TAP_BATCH_ROOM];
     unsigned int read_poll : 1;
     unsigned int write_poll : 1;
     unsigned int using_vnet_hdr : 1;
     unsigned int has_ufo: 1;
+    unsigned int mq : 1;
+    unsigned int enabled : 1;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
 } TAPState;
@@ -189,6 +200,77 @@ static void tap_send_completed(VLANClientState *nc, ssize_t len)
     tap_read_poll(s, 1);
 }
 
+#ifndef __sun__
+/* Read the next packet straight into the buffers of our peer.  Returns
+ * the size read, 0 if it has to be read into s->buf instead, or -1 if
+ * there is nothing to read. */
+static int tap_read_direct(TAPState *s)
+{
+    struct iovec iov[TAP_DIRECT_IOV];
+    int iovcnt;
+    ssize_t size;
+
+    /* a header we would have to strip */
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        return 0;
+    }
+
+    iovcnt = qemu_get_receive_buffers(&s->nc, iov, ARRAY_SIZE(iov),
+                                      s->host_vnet_hdr_len, TAP_BUFSIZE);
+    if (!iovcnt) {
+        return 0;
+    }
+
+    size = readv(s->fd, iov, iovcnt);
+    qemu_receive_complete(&s->nc, size);
+    return size > 0 ? size : -1;
+}
+#else
+static int tap_read_direct(TAPState *s)
+{
+    return 0;
+}
+#endif
+
+/* Read up to TAP_BATCH packets back to back into s->buf and hand them to
+ * the peer in one go.  Returns what tap_send expects of a single packet:
+ * the number sent, 0 if some had to be queued, or -1 if none was read. */
+static int tap_send_batch(TAPState *s)
+{
+    struct iovec pkts[TAP_BATCH];
+    size_t hdr_len = 0, offset = 0;
+    int count = 0, size, sent;
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        hdr_len = s->host_vnet_hdr_len;
+    }
+
+    while (count < TAP_BATCH && sizeof(s->buf) - offset >= TAP_BUFSIZE) {
+        size = tap_read_packet(s->fd, s->buf + offset,
+                               sizeof(s->buf) - offset);
+        if (size <= 0) {
+            break;
+        }
+        if ((size_t)size <= hdr_len) {
+            continue;
+        }
+        pkts[count].iov_base = s->buf + offset + hdr_len;
+        pkts[count].iov_len = size - hdr_len;
+        count++;
+        offset += size;
+    }
+    if (!count) {
+        return -1;
+    }
+
+    sent = qemu_send_packet_batch(&s->nc, pkts, count, tap_send_completed);
+    if (sent < count) {
+        tap_read_poll(s, 0);
+        return 0;
+    }
+    return count;
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
@@ -197,7 +279,17 @@ static void tap_send(void *opaque)
     do {
         uint8_t *buf = s->buf;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+        size = tap_read_direct(s);
+        if (size) {
+            continue;
+        }
+
+        if (qemu_can_send_packet_batch(&s->nc)) {
+            size = tap_send_batch(s);
+            continue;
+        }
+
+        size = tap_read_packet(s->fd, s->buf, TAP_BUFSIZE);
         if (size <= 0) {
             break;
         }
@@ -276,6 +368,41 @@ void tap_set_offload(VLANClientState *nc, int csum, int tso4,
     tap_fd_set_offload(s->fd, csum, tso4, tso6, ecn, ufo);
 }
 
+/* Let the kernel pass packets to this queue of a multiqueue tap, or stop
+ * it; single queue taps are always enabled.
+ */
+int tap_enable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+
+    if (!s->mq || s->enabled) {
+        return 0;
+    }
+    if (tap_fd_enable(s->fd) < 0) {
+        return -1;
+    }
+    s->enabled = 1;
+    return 0;
+}
+
+int tap_disable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+
+    if (!s->mq || !s->enabled) {
+        return 0;
+    }
+    if (tap_fd_disable(s->fd) < 0) {
+        return -1;
+    }
+    s->enabled = 0;
+    return 0;
+}
+
 static void tap_cleanup(VLANClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -341,6 +468,7 @@ static TAPState *net_tap_fd_init(VLANState *vlan,
     s->has_ufo = tap_probe_has_ufo(s->fd);
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     tap_read_poll(s, 1);
+    s->enabled = 1;
     s->vhost_net = NULL;
     return s;
 }
@@ -389,7 +517,7 @@ static int launch_script(const char *setup_script, const char *ifname, int fd)
     return -1;
 }
 
-static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
+static int net_tap_init(QemuOpts *opts, int *vnet_hdr, int mq)
 {
     int fd, vnet_hdr_required;
     char ifname[128] = {0,};
@@ -406,7 +534,8 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required,
+                      mq));
     if (fd < 0) {
         return -1;
     }
@@ -425,10 +554,102 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
     return fd;
 }
 
+static int net_tap_init_vhost(TAPState *s, QemuOpts *opts, Monitor *mon)
+{
+    if (qemu_opt_get_bool(opts, "vhost", !!qemu_opt_get(opts, "vhostfd") ||
+                          qemu_opt_get_bool(opts, "vhostforce", false))) {
+        int vhostfd, r;
+        bool force = qemu_opt_get_bool(opts, "vhostforce", false);
+        if (qemu_opt_get(opts, "vhostfd")) {
+            r = net_handle_fd_param(mon, qemu_opt_get(opts, "vhostfd"));
+            if (r == -1) {
+                return -1;
+            }
+            vhostfd = r;
+        } else {
+            vhostfd = -1;
+        }
+        s->vhost_net = vhost_net_init(&s->nc, vhostfd, force);
+        if (!s->vhost_net) {
+            error_report("vhost-net requested but could not be initialized");
+            return -1;
+        }
+    } else if (qemu_opt_get(opts, "vhostfd")) {
+        error_report("vhostfd= is not valid without vhost");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Open the queues after the first one of a multiqueue tap, on the
+ * interface the first one created.  Each queue is a netdev of its own,
+ * named "<name>.<index>", with its own vhost-net instance, so that the
+ * queue pairs of a multiqueue NIC can run in parallel.
+ */
+static int net_tap_init_queues(QemuOpts *opts, Monitor *mon,
+                               const char *name, int queues, int vnet_hdr)
+{
+    const char *ifname = qemu_opt_get(opts, "ifname");
+    char queue_name[256], dev_ifname[128];
+    int i;
+
+    for (i = 1; i < queues; i++) {
+        TAPState *s;
+        int fd, queue_vnet_hdr = vnet_hdr;
+
+        snprintf(queue_name, sizeof(queue_name), "%s.%d", name, i);
+        if (qemu_find_netdev(queue_name)) {
+            error_report("netdev %s already exists", queue_name);
+            return -1;
+        }
+
+        pstrcpy(dev_ifname, sizeof(dev_ifname), ifname);
+        TFR(fd = tap_open(dev_ifname, sizeof(dev_ifname), &queue_vnet_hdr,
+                          vnet_hdr, 1));
+        if (fd < 0) {
+            return -1;
+        }
+
+        s = net_tap_fd_init(NULL, "tap", queue_name, fd, vnet_hdr);
+        if (!s) {
+            close(fd);
+            return -1;
+        }
+        s->mq = 1;
+        s->nc.queue_index = i;
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                 "ifname=%s,queue=%d", ifname, i);
+
+        if (tap_set_sndbuf(s->fd, opts) < 0 ||
+            net_tap_init_vhost(s, opts, mon) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
 {
     TAPState *s;
     int fd, vnet_hdr = 0;
+    int queues = qemu_opt_get_number(opts, "queues", 1);
+
+    if (queues < 1 || queues > TAP_QUEUES_MAX) {
+        error_report("queues= must be between 1 and %d", TAP_QUEUES_MAX);
+        return -1;
+    }
+    if (queues > 1) {
+        if (vlan) {
+            error_report("queues= is only valid with -netdev");
+            return -1;
+        }
+        if (qemu_opt_get(opts, "fd") || qemu_opt_get(opts, "vhostfd")) {
+            error_report("fd= and vhostfd= are invalid with queues=");
+            return -1;
+        }
+    }
 
     if (qemu_opt_get(opts, "fd")) {
         if (qemu_opt_get(opts, "ifname") ||
@@ -456,7 +677,7 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
             qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
         }
 
-        fd = net_tap_init(opts, &vnet_hdr);
+        fd = net_tap_init(opts, &vnet_hdr, queues > 1);
         if (fd == -1) {
             return -1;
         }
@@ -467,6 +688,7 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
         close(fd);
         return -1;
     }
+    s->mq = queues > 1;
 
     if (tap_set_sndbuf(s->fd, opts) < 0) {
         return -1;
@@ -491,26 +713,19 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
         }
     }
 
-    if (qemu_opt_get_bool(opts, "vhost", !!qemu_opt_get(opts, "vhostfd") ||
-                          qemu_opt_get_bool(opts, "vhostforce", false))) {
-        int vhostfd, r;
-        bool force = qemu_opt_get_bool(opts, "vhostforce", false);
-        if (qemu_opt_get(opts, "vhostfd")) {
-            r = net_handle_fd_param(mon, qemu_opt_get(opts, "vhostfd"));
-            if (r == -1) {
-                return -1;
-            }
-            vhostfd = r;
-        } else {
-            vhostfd = -1;
-        }
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd, force);
-        if (!s->vhost_net) {
-            error_report("vhost-net requested but could not be initialized");
-            return -1;
+    if (net_tap_init_vhost(s, opts, mon) < 0) {
+        return -1;
+    }
+
+    if (queues > 1 &&
+        net_tap_init_queues(opts, mon, name, queues, vnet_hdr) < 0) {
+        VLANClientState *queue;
+        int i;
+
+        for (i = 1; (queue = qemu_find_netdev_queue(&s->nc, i)); i++) {
+            qemu_del_vlan_client(queue);
         }
-    } else if (qemu_opt_get(opts, "vhostfd")) {
-        error_report("vhostfd= is not valid without vhost");
+        qemu_del_vlan_client(&s->nc);
         return -1;
     }
 
@@ -126,7 +126,7 @@ void qemu_del_wait_object(HANDLE handle, WaitObjectFunc *func, void *opaque)
         w->num--;
 }
 
-void os_host_main_loop_wait(int *timeout)
+void os_host_main_loop_wait(int64_t *timeout)
 {
     int ret, ret2, i;
     PollingEntry *pe;
@@ -140,7 +140,8 @@ void os_host_main_loop_wait(int *timeout)
         int err;
         WaitObjects *w = &wait_objects;
 
-        ret = WaitForMultipleObjects(w->num, w->events, FALSE, *timeout);
+        ret = WaitForMultipleObjects(w->num, w->events, FALSE,
+                                     (*timeout + 999999) / 1000000);
         if (WAIT_OBJECT_0 + 0 <= ret && ret <= WAIT_OBJECT_0 + w->num - 1) {
             if (w->func[ret - WAIT_OBJECT_0])
                 w->func[ret - WAIT_OBJECT_0](w->opaque[ret - WAIT_OBJECT_0]);
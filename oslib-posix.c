@@ -61,9 +61,22 @@ void *qemu_memalign(size_t alignment, size_t size)
 }
 
 /* alloc shared memory pages */
+#if defined(__linux__) && defined(__x86_64__)
+/* Large allocations are aligned to a transparent huge page, so that guest
+   RAM can be backed by huge pages from its first byte */
+#define QEMU_VMALLOC_ALIGN (2 * 1024 * 1024)
+#else
+#define QEMU_VMALLOC_ALIGN getpagesize()
+#endif
+
 void *qemu_vmalloc(size_t size)
 {
-    return qemu_memalign(getpagesize(), size);
+    size_t align = QEMU_VMALLOC_ALIGN;
+
+    if (size < align) {
+        align = getpagesize();
+    }
+    return qemu_memalign(align, size);
 }
 
 void qemu_vfree(void *ptr)
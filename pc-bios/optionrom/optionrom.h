@@ -24,6 +24,8 @@
 
 #define BIOS_CFG_IOPORT_CFG	0x510
 #define BIOS_CFG_IOPORT_DATA	0x511
+#define BIOS_CFG_DMA_ADDR_HIGH	0x514
+#define BIOS_CFG_DMA_ADDR_LOW	0x518
 
 /* Break the translation block flow so -d cpu shows us values */
 #define DEBUG_HERE \
@@ -87,6 +89,65 @@
 	*/						\
 	.dc.b		0x67,0xf3,0x6c
 
+/*
+ * Push an FWCfgDmaAccess that reads all of a blob to its _ADDR.
+ * Requires _ADDR, _SIZE and _DATA values for the parameter.
+ *
+ * Clobbers:	%eax, %edx
+ */
+#define read_fw_dma_push(var)				\
+	read_fw		var ## _ADDR;			\
+	bswap		%eax;				\
+	pushl		%eax;				\
+	xor		%eax, %eax;			\
+	pushl		%eax;				\
+	read_fw		var ## _SIZE;			\
+	bswap		%eax;				\
+	pushl		%eax;				\
+	mov		$((var ## _DATA << 16) | FW_CFG_DMA_CTL_SELECT | \
+			  FW_CFG_DMA_CTL_READ), %eax;	\
+	bswap		%eax;				\
+	pushl		%eax
+
+/*
+ * Hand the FWCfgDmaAccess at physical address %eax, which is the top of
+ * the stack, to the fw_cfg device and pop it once it is done.
+ *
+ * Clobbers:	%eax, %ecx, %edx
+ */
+#define read_fw_dma_run					\
+	bswap		%eax;				\
+	mov		%eax, %ecx;			\
+	xor		%eax, %eax;			\
+	mov		$BIOS_CFG_DMA_ADDR_HIGH, %dx;	\
+	outl		%eax, (%dx);			\
+	mov		%ecx, %eax;			\
+	mov		$BIOS_CFG_DMA_ADDR_LOW, %dx;	\
+	outl		%eax, (%dx);			\
+	add		$16, %esp
+
+/*
+ * Read a blob with a single DMA transfer if the fw_cfg device can do it,
+ * and with the given fallback if it can't.  For 16-bit code with a real
+ * mode stack segment; the descriptor goes on the stack.
+ *
+ * Clobbers:	%eax, %edx, %es, %ecx, %edi
+ */
+#define read_fw_blob_dma(var, fallback)			\
+	read_fw		FW_CFG_ID;			\
+	test		$FW_CFG_VERSION_DMA, %al;	\
+	jnz		1f;				\
+	fallback(var);					\
+	jmp		2f;				\
+1:	read_fw_dma_push(var);				\
+	xor		%eax, %eax;			\
+	mov		%ss, %ax;			\
+	shl		$4, %eax;			\
+	movzwl		%sp, %ecx;			\
+	add		%ecx, %eax;			\
+	read_fw_dma_run;				\
+2:
+
 #define OPTION_ROM_START					\
     .code16;						\
     .text;						\
@@ -26,8 +26,10 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "qemu-common.h"
+#include "qemu-timer.h"
 #include "trace.h"
 #include "block_int.h"
+#include "qemu-lockstat.h"
 
 #include "block/raw-posix-aio.h"
 
@@ -45,6 +47,7 @@ struct qemu_paiocb {
     int ev_signo;
     off_t aio_offset;
 
+    PosixAioPool *pool;
     QTAILQ_ENTRY(qemu_paiocb) node;
     int aio_type;
     ssize_t ret;
@@ -60,14 +63,72 @@ typedef struct PosixAioState {
 } PosixAioState;
 
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-static pthread_t thread_id;
+/*
+ * Every image file has a pool of worker threads of its own, so that a slow
+ * file cannot hold up the requests of the others.  Threads are added while
+ * requests would otherwise wait longer than creating a thread takes, as
+ * estimated from the queue and the time requests take, and idle ones go
+ * away: soon if the pool has more threads than requests in flight lately,
+ * eventually anyway.
+ */
+#define PAIO_MAX_THREADS        64
+#define PAIO_SPAWN_COST_NS      50000LL
+#define PAIO_IDLE_TIMEOUT       10      /* seconds */
+#define PAIO_SHORT_IDLE_TIMEOUT 1       /* seconds, for surplus threads */
+
+/* Moving averages weigh the latest sample 1/8, depths are in 1/16 */
+#define PAIO_AVG_SHIFT          3
+#define PAIO_DEPTH_SHIFT        4
+
+/*
+ * Requests whose buffers are not aligned for O_DIRECT go through an
+ * aligned bounce buffer.  Pools for O_DIRECT files keep a few of them
+ * preallocated on a free list that the threads share without a lock.
+ * The head of the list holds the index of the first free buffer plus one
+ * in its low 32 bits, and a count of the changes to the list in its high
+ * bits, so that a thread cannot mistake a list that changed back and
+ * forth for the one it looked at.
+ */
+#define PAIO_BOUNCE_BUFFERS     16
+#define PAIO_BOUNCE_SIZE        (128 * 1024)
+#define PAIO_BOUNCE_ALIGN       4096
+
+struct PosixAioPool {
+    pthread_mutex_t lock;
+#ifdef CONFIG_MUTEX_STATS
+    QemuLockStats *lock_stats;
+#endif
+    pthread_cond_t cond;        /* a request was queued, or quit was set */
+    pthread_cond_t exit_cond;   /* a thread exited */
+    int max_threads;
+    int cur_threads;
+    int idle_threads;
+    int waiting;                /* idle threads blocked on cond */
+    int queued;
+    bool quit;
+    QTAILQ_HEAD(, qemu_paiocb) request_list;
+
+    uint64_t requests;          /* completed */
+    int64_t avg_latency;        /* ns */
+    int avg_depth;              /* requests in flight when one is queued */
+
+    int acbs;                   /* not released yet, main thread only */
+
+    uint8_t *bounce_mem;        /* NULL if there are no bounce buffers */
+    volatile int bounce_next[PAIO_BOUNCE_BUFFERS];  /* -1 ends the list */
+    volatile uint64_t bounce_head;
+    uint64_t bounces;           /* updated atomically */
+    uint64_t bounce_allocs;
+};
+
 static pthread_attr_t attr;
-static int max_threads = 64;
-static int cur_threads = 0;
-static int idle_threads = 0;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+
+/* Whether a completion signal is on its way to the main thread */
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool notify_pending;
+#ifdef CONFIG_MUTEX_STATS
+static QemuLockStats *notify_lock_stats;
+#endif
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -86,11 +147,13 @@ static void die(const char *what)
     die2(errno, what);
 }
 
+#ifndef CONFIG_MUTEX_STATS
 static void mutex_lock(pthread_mutex_t *mutex)
 {
     int ret = pthread_mutex_lock(mutex);
     if (ret) die2(ret, "pthread_mutex_lock");
 }
+#endif
 
 static void mutex_unlock(pthread_mutex_t *mutex)
 {
@@ -106,12 +169,93 @@ static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
     return ret;
 }
 
+static void cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int ret = pthread_cond_wait(cond, mutex);
+    if (ret) die2(ret, "pthread_cond_wait");
+}
+
 static void cond_signal(pthread_cond_t *cond)
 {
     int ret = pthread_cond_signal(cond);
     if (ret) die2(ret, "pthread_cond_signal");
 }
 
+static void cond_broadcast(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_broadcast(cond);
+    if (ret) die2(ret, "pthread_cond_broadcast");
+}
+
+/*
+ * The pool and notification locks, which keep contention statistics when
+ * built with --enable-mutex-stats.  The lock functions are not inlined, so
+ * that their return address is the site that locks.
+ */
+static QEMU_NOINLINE void pool_lock(PosixAioPool *pool)
+{
+#ifdef CONFIG_MUTEX_STATS
+    int ret = qemu_lock_stats_lock(pool->lock_stats, &pool->lock,
+                                   __builtin_return_address(0));
+    if (ret) die2(ret, "pthread_mutex_lock");
+#else
+    mutex_lock(&pool->lock);
+#endif
+}
+
+static void pool_unlock(PosixAioPool *pool)
+{
+#ifdef CONFIG_MUTEX_STATS
+    qemu_lock_stats_release(pool->lock_stats);
+#endif
+    mutex_unlock(&pool->lock);
+}
+
+static int pool_cond_timedwait(PosixAioPool *pool, pthread_cond_t *cond,
+                               struct timespec *ts)
+{
+    int ret;
+
+#ifdef CONFIG_MUTEX_STATS
+    qemu_lock_stats_release(pool->lock_stats);
+#endif
+    ret = cond_timedwait(cond, &pool->lock, ts);
+#ifdef CONFIG_MUTEX_STATS
+    qemu_lock_stats_resume(pool->lock_stats);
+#endif
+    return ret;
+}
+
+static void pool_cond_wait(PosixAioPool *pool, pthread_cond_t *cond)
+{
+#ifdef CONFIG_MUTEX_STATS
+    qemu_lock_stats_release(pool->lock_stats);
+#endif
+    cond_wait(cond, &pool->lock);
+#ifdef CONFIG_MUTEX_STATS
+    qemu_lock_stats_resume(pool->lock_stats);
+#endif
+}
+
+static QEMU_NOINLINE void notify_lock_lock(void)
+{
+#ifdef CONFIG_MUTEX_STATS
+    int ret = qemu_lock_stats_lock(notify_lock_stats, &notify_lock,
+                                   __builtin_return_address(0));
+    if (ret) die2(ret, "pthread_mutex_lock");
+#else
+    mutex_lock(&notify_lock);
+#endif
+}
+
+static void notify_lock_unlock(void)
+{
+#ifdef CONFIG_MUTEX_STATS
+    qemu_lock_stats_release(notify_lock_stats);
+#endif
+    mutex_unlock(&notify_lock);
+}
+
 static void thread_create(pthread_t *thread, pthread_attr_t *attr,
                           void *(*start_routine)(void*), void *arg)
 {
@@ -232,6 +376,55 @@ static ssize_t handle_aiocb_rw_linear(struct qemu_paiocb *aiocb, char *buf)
     return offset;
 }
 
+static uint64_t paio_bounce_head(uint64_t head, int index)
+{
+    return (((head >> 32) + 1) << 32) | (uint32_t)(index + 1);
+}
+
+static uint8_t *paio_bounce_get(struct qemu_paiocb *aiocb)
+{
+    PosixAioPool *pool = aiocb->pool;
+    uint64_t head;
+    int i = -1;
+
+    __sync_fetch_and_add(&pool->bounces, 1);
+    if (pool->bounce_mem && aiocb->aio_nbytes <= PAIO_BOUNCE_SIZE) {
+        do {
+            head = pool->bounce_head;
+            i = (int)(uint32_t)head - 1;
+            if (i < 0) {
+                break;
+            }
+        } while (!__sync_bool_compare_and_swap(&pool->bounce_head, head,
+                     paio_bounce_head(head, pool->bounce_next[i])));
+    }
+    if (i >= 0) {
+        return pool->bounce_mem + i * PAIO_BOUNCE_SIZE;
+    }
+
+    __sync_fetch_and_add(&pool->bounce_allocs, 1);
+    return qemu_blockalign(aiocb->common.bs, aiocb->aio_nbytes);
+}
+
+static void paio_bounce_put(PosixAioPool *pool, uint8_t *buf)
+{
+    uint64_t head;
+    int i;
+
+    if (!pool->bounce_mem || buf < pool->bounce_mem ||
+        buf >= pool->bounce_mem + PAIO_BOUNCE_BUFFERS * PAIO_BOUNCE_SIZE) {
+        qemu_vfree(buf);
+        return;
+    }
+
+    i = (buf - pool->bounce_mem) / PAIO_BOUNCE_SIZE;
+    do {
+        head = pool->bounce_head;
+        pool->bounce_next[i] = (int)(uint32_t)head - 1;
+    } while (!__sync_bool_compare_and_swap(&pool->bounce_head, head,
+                                           paio_bounce_head(head, i)));
+}
+
 static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
 {
     ssize_t nbytes;
@@ -271,7 +464,7 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
      * Ok, we have to do it the hard way, copy all segments into
      * a single aligned buffer.
      */
-    buf = qemu_blockalign(aiocb->common.bs, aiocb->aio_nbytes);
+    buf = (char *)paio_bounce_get(aiocb);
     if (aiocb->aio_type & QEMU_AIO_WRITE) {
         char *p = buf;
         int i;
@@ -297,42 +490,95 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
             count -= copy;
         }
     }
-    qemu_vfree(buf);
+    paio_bounce_put(aiocb->pool, (uint8_t *)buf);
 
     return nbytes;
 }
 
-static void *aio_thread(void *unused)
+/* Takes the first queued request.  Called with the pool locked. */
+static struct qemu_paiocb *paio_take_request(PosixAioPool *pool)
+{
+    struct qemu_paiocb *aiocb = QTAILQ_FIRST(&pool->request_list);
+
+    if (aiocb) {
+        QTAILQ_REMOVE(&pool->request_list, aiocb, node);
+        aiocb->active = 1;
+        pool->queued--;
+        pool->idle_threads--;
+    }
+    return aiocb;
+}
+
+/*
+ * Waits for a request, or returns NULL once the thread has been idle for
+ * long enough.  Called with the pool locked.
+ */
+static struct qemu_paiocb *paio_wait_request(PosixAioPool *pool)
+{
+    qemu_timeval tv;
+    struct timespec ts;
+    int ret = 0;
+
+    qemu_gettimeofday(&tv);
+    ts.tv_sec = tv.tv_sec + PAIO_IDLE_TIMEOUT;
+    if (pool->cur_threads > 1 &&
+        pool->cur_threads << PAIO_DEPTH_SHIFT > pool->avg_depth) {
+        ts.tv_sec = tv.tv_sec + PAIO_SHORT_IDLE_TIMEOUT;
+    }
+    ts.tv_nsec = 0;
+
+    pool->waiting++;
+    while (QTAILQ_EMPTY(&pool->request_list) && !pool->quit &&
+           !(ret == ETIMEDOUT)) {
+        ret = pool_cond_timedwait(pool, &pool->cond, &ts);
+    }
+    pool->waiting--;
+
+    return paio_take_request(pool);
+}
+
+/*
+ * Wakes up the main thread, unless a wakeup is already on its way: as
+ * posix_aio_read() rearms the notification before it looks at the
+ * requests, it will see this completion as well.
+ */
+static void paio_notify(pid_t pid, int signo)
+{
+    bool kick;
+
+    notify_lock_lock();
+    kick = !notify_pending;
+    notify_pending = true;
+    notify_lock_unlock();
+
+    if (kick && kill(pid, signo)) die("kill failed");
+}
+
+static void *aio_thread(void *opaque)
 {
+    PosixAioPool *pool = opaque;
+    struct qemu_paiocb *aiocb;
     pid_t pid;
 
     pid = getpid();
 
-    while (1) {
-        struct qemu_paiocb *aiocb;
+    aiocb = NULL;
+    for (;;) {
         ssize_t ret = 0;
-        qemu_timeval tv;
-        struct timespec ts;
-
-        qemu_gettimeofday(&tv);
-        ts.tv_sec = tv.tv_sec + 10;
-        ts.tv_nsec = 0;
+        int64_t start, latency;
+        int ev_signo;
 
-        mutex_lock(&lock);
-
-        while (QTAILQ_EMPTY(&request_list) &&
-               !(ret == ETIMEDOUT)) {
-            ret = cond_timedwait(&cond, &lock, &ts);
+        if (!aiocb) {
+            pool_lock(pool);
+            aiocb = paio_wait_request(pool);
+            if (!aiocb) {
+                break;
+            }
+            pool_unlock(pool);
         }
+        ev_signo = aiocb->ev_signo;
 
-        if (QTAILQ_EMPTY(&request_list))
-            break;
-
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
-        aiocb->active = 1;
-        idle_threads--;
-        mutex_unlock(&lock);
+        start = get_clock();
 
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
         case QEMU_AIO_READ:
@@ -351,56 +597,101 @@ static void *aio_thread(void *unused)
             break;
         }
 
-        mutex_lock(&lock);
+        latency = get_clock() - start;
+
+        /*
+         * Completing a request and taking the next one share a critical
+         * section, so a busy thread takes the lock once per request.  The
+         * request may be gone as soon as the lock is dropped.
+         */
+        pool_lock(pool);
         aiocb->ret = ret;
-        idle_threads++;
-        mutex_unlock(&lock);
+        pool->idle_threads++;
+        pool->requests++;
+        pool->avg_latency += (latency - pool->avg_latency) >> PAIO_AVG_SHIFT;
+        aiocb = paio_take_request(pool);
+        pool_unlock(pool);
 
-        if (kill(pid, aiocb->ev_signo)) die("kill failed");
+        paio_notify(pid, ev_signo);
     }
 
-    idle_threads--;
-    cur_threads--;
-    mutex_unlock(&lock);
+    pool->idle_threads--;
+    pool->cur_threads--;
+    cond_signal(&pool->exit_cond);
+    pool_unlock(pool);
 
     return NULL;
 }
 
-static void spawn_thread(void)
+static void spawn_thread(PosixAioPool *pool)
 {
     sigset_t set, oldset;
+    pthread_t thread_id;
 
-    cur_threads++;
-    idle_threads++;
+    pool->cur_threads++;
+    pool->idle_threads++;
 
     /* block all signals */
     if (sigfillset(&set)) die("sigfillset");
     if (sigprocmask(SIG_SETMASK, &set, &oldset)) die("sigprocmask");
 
-    thread_create(&thread_id, &attr, aio_thread, NULL);
+    thread_create(&thread_id, &attr, aio_thread, pool);
 
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
 
+/*
+ * Whether the queued requests would wait longer for the busy threads than
+ * it takes to create one more.  Called with the pool locked.
+ */
+static bool paio_need_thread(PosixAioPool *pool)
+{
+    int backlog = pool->queued - pool->idle_threads;
+    int busy = pool->cur_threads - pool->idle_threads;
+
+    if (backlog <= 0 || pool->cur_threads >= pool->max_threads) {
+        return false;
+    }
+    if (busy == 0 || pool->requests == 0) {
+        return true;
+    }
+    return backlog * pool->avg_latency / busy > PAIO_SPAWN_COST_NS;
+}
+
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
+    PosixAioPool *pool = aiocb->pool;
+    int depth;
+    bool wake;
+
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
-    mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
-        spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
-    mutex_unlock(&lock);
-    cond_signal(&cond);
+    pool_lock(pool);
+    QTAILQ_INSERT_TAIL(&pool->request_list, aiocb, node);
+    pool->queued++;
+
+    depth = (pool->queued + pool->cur_threads - pool->idle_threads)
+        << PAIO_DEPTH_SHIFT;
+    pool->avg_depth += (depth - pool->avg_depth) >> PAIO_AVG_SHIFT;
+
+    if (paio_need_thread(pool)) {
+        spawn_thread(pool);
+    }
+    /* busy threads look at the queue before they wait */
+    wake = pool->waiting > 0;
+    pool_unlock(pool);
+    if (wake) {
+        cond_signal(&pool->cond);
+    }
 }
 
 static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
 {
     ssize_t ret;
 
-    mutex_lock(&lock);
+    pool_lock(aiocb->pool);
     ret = aiocb->ret;
-    mutex_unlock(&lock);
+    pool_unlock(aiocb->pool);
 
     return ret;
 }
@@ -417,6 +708,12 @@ static int qemu_paio_error(struct qemu_paiocb *aiocb)
     return ret;
 }
 
+static void paio_release(struct qemu_paiocb *acb)
+{
+    acb->pool->acbs--;
+    qemu_aio_release(acb);
+}
+
 static int posix_aio_process_queue(void *opaque)
 {
     PosixAioState *s = opaque;
@@ -442,7 +739,7 @@ static int posix_aio_process_queue(void *opaque)
             if (ret == ECANCELED) {
                 /* remove the request */
                 *pacb = acb->next;
-                qemu_aio_release(acb);
+                paio_release(acb);
                 result = 1;
             } else if (ret != EINPROGRESS) {
                 /* end of aio */
@@ -459,7 +756,7 @@ static int posix_aio_process_queue(void *opaque)
                 *pacb = acb->next;
                 /* call the callback */
                 acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
+                paio_release(acb);
                 result = 1;
                 break;
             } else {
@@ -476,6 +773,11 @@ static void posix_aio_read(void *opaque)
     PosixAioState *s = opaque;
     ssize_t len;
 
+    /* completions from now on need another wakeup */
+    notify_lock_lock();
+    notify_pending = false;
+    notify_lock_unlock();
+
     /* read all bytes from signal pipe */
     for (;;) {
         char bytes[16];
@@ -525,7 +827,7 @@ static void paio_remove(struct qemu_paiocb *acb)
             break;
         } else if (*pacb == acb) {
             *pacb = acb->next;
-            qemu_aio_release(acb);
+            paio_release(acb);
             break;
         }
         pacb = &(*pacb)->next;
@@ -537,14 +839,15 @@ static void paio_cancel(BlockDriverAIOCB *blockacb)
     struct qemu_paiocb *acb = (struct qemu_paiocb *)blockacb;
     int active = 0;
 
-    mutex_lock(&lock);
+    pool_lock(acb->pool);
     if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
+        QTAILQ_REMOVE(&acb->pool->request_list, acb, node);
+        acb->pool->queued--;
         acb->ret = -ECANCELED;
     } else if (acb->ret == -EINPROGRESS) {
         active = 1;
     }
-    mutex_unlock(&lock);
+    pool_unlock(acb->pool);
 
     if (active) {
         /* fail safe: if the aio could not be canceled, we wait for
@@ -561,8 +864,8 @@ static AIOPool raw_aio_pool = {
     .cancel             = paio_cancel,
 };
 
-BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
-        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+BlockDriverAIOCB *paio_submit(BlockDriverState *bs, PosixAioPool *pool,
+        int fd, int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
 {
     struct qemu_paiocb *acb;
@@ -570,6 +873,7 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
+    acb->pool = pool;
     acb->aio_type = type;
     acb->aio_fildes = fd;
     acb->ev_signo = SIGUSR2;
@@ -584,14 +888,15 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
 
     acb->next = posix_aio_state->first_aio;
     posix_aio_state->first_aio = acb;
+    pool->acbs++;
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     qemu_paio_submit(acb);
     return &acb->common;
 }
 
-BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
-        unsigned long int req, void *buf,
+BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, PosixAioPool *pool,
+        int fd, unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     struct qemu_paiocb *acb;
@@ -599,6 +904,7 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
+    acb->pool = pool;
     acb->aio_type = QEMU_AIO_IOCTL;
     acb->aio_fildes = fd;
     acb->ev_signo = SIGUSR2;
@@ -609,6 +915,7 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
 
     acb->next = posix_aio_state->first_aio;
     posix_aio_state->first_aio = acb;
+    pool->acbs++;
 
     qemu_paio_submit(acb);
     return &acb->common;
@@ -654,8 +961,85 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
+#ifdef CONFIG_MUTEX_STATS
+    notify_lock_stats = qemu_lock_stats_new("posix-aio notify");
+#endif
 
     posix_aio_state = s;
     return 0;
 }
+
+PosixAioPool *paio_pool_new(void)
+{
+    PosixAioPool *pool = qemu_mallocz(sizeof(*pool));
+    int ret;
+
+    ret = pthread_mutex_init(&pool->lock, NULL);
+    if (ret) die2(ret, "pthread_mutex_init");
+#ifdef CONFIG_MUTEX_STATS
+    pool->lock_stats = qemu_lock_stats_new("posix-aio pool");
+#endif
+    ret = pthread_cond_init(&pool->cond, NULL);
+    if (ret) die2(ret, "pthread_cond_init");
+    ret = pthread_cond_init(&pool->exit_cond, NULL);
+    if (ret) die2(ret, "pthread_cond_init");
+
+    pool->max_threads = PAIO_MAX_THREADS;
+    QTAILQ_INIT(&pool->request_list);
+    return pool;
+}
+
+void paio_pool_free(PosixAioPool *pool)
+{
+    /* requests in flight refer to the pool */
+    if (pool->acbs) {
+        qemu_aio_flush();
+    }
+
+    pool_lock(pool);
+    assert(QTAILQ_EMPTY(&pool->request_list));
+    pool->quit = true;
+    cond_broadcast(&pool->cond);
+    while (pool->cur_threads > 0) {
+        pool_cond_wait(pool, &pool->exit_cond);
+    }
+    pool_unlock(pool);
+
+    pthread_cond_destroy(&pool->exit_cond);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    qemu_vfree(pool->bounce_mem);
+    qemu_free(pool);
+}
+
+/* Preallocate bounce buffers for the misaligned requests of the pool */
+void paio_pool_init_bounce(PosixAioPool *pool)
+{
+    int i;
+
+    if (pool->bounce_mem) {
+        return;
+    }
+    pool->bounce_mem = qemu_memalign(PAIO_BOUNCE_ALIGN,
+                                     PAIO_BOUNCE_BUFFERS * PAIO_BOUNCE_SIZE);
+    for (i = 0; i < PAIO_BOUNCE_BUFFERS; i++) {
+        pool->bounce_next[i] = i + 1 < PAIO_BOUNCE_BUFFERS ? i + 1 : -1;
+    }
+    pool->bounce_head = paio_bounce_head(0, 0);
+}
+
+void paio_pool_get_stats(PosixAioPool *pool, PosixAioPoolStats *stats)
+{
+    pool_lock(pool);
+    stats->threads = pool->cur_threads;
+    stats->idle_threads = pool->idle_threads;
+    stats->max_threads = pool->max_threads;
+    stats->queued = pool->queued;
+    stats->requests = pool->requests;
+    stats->avg_latency_ns = pool->avg_latency;
+    stats->avg_queue_depth = (pool->avg_depth + (1 << (PAIO_DEPTH_SHIFT - 1)))
+        >> PAIO_DEPTH_SHIFT;
+    stats->bounces = pool->bounces;
+    stats->bounce_allocs = pool->bounce_allocs;
+    pool_unlock(pool);
+}
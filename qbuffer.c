@@ -41,6 +41,24 @@ QBuffer *qbuffer_from_data(const void *data, size_t size)
     return qb;
 }
 
+/**
+ * qbuffer_from_raw(): Create a new QBuffer that takes over a data blob
+ * allocated with qemu_malloc()
+ *
+ * Returns strong reference.
+ */
+QBuffer *qbuffer_from_raw(void *data, size_t size)
+{
+    QBuffer *qb;
+
+    qb = qemu_malloc(sizeof(*qb));
+    qb->data = data;
+    qb->size = size;
+    QOBJECT_INIT(qb, &qbuffer_type);
+
+    return qb;
+}
+
 /**
  * qbuffer_from_qstring(): Create a new QBuffer from a QString object that
  * contains the data as a stream of hex-encoded bytes
@@ -25,6 +25,7 @@ typedef struct QBuffer {
 } QBuffer;
 
 QBuffer *qbuffer_from_data(const void *data, size_t size);
+QBuffer *qbuffer_from_raw(void *data, size_t size);
 QBuffer *qbuffer_from_qstring(const QString *string);
 const void *qbuffer_get_data(const QBuffer *qb);
 size_t qbuffer_get_size(const QBuffer *qb);
@@ -35,8 +35,10 @@ QDict *qdict_new(void)
 {
     QDict *qdict;
 
-    qdict = qemu_mallocz(sizeof(*qdict));
+    qdict = qobject_alloc(sizeof(*qdict));
     QOBJECT_INIT(qdict, &qdict_type);
+    qdict->entries = qdict->inline_entries;
+    qdict->max = QDICT_INLINE_MAX;
 
     return qdict;
 }
@@ -68,18 +70,118 @@ static unsigned int tdb_hash(const char *name)
     return (1103515243 * value + 12345);
 }
 
-/**
- * alloc_entry(): allocate a new QDictEntry
+/*
+ * Keys are interned: all the entries with the same key share one
+ * refcounted copy of it, whatever QDict they are in.  Dicts are built in
+ * more than one thread, so the table has a lock of its own; it is only
+ * taken to add an entry or drop one.
  */
-static QDictEntry *alloc_entry(const char *key, QObject *value)
+typedef struct QDictKey {
+    unsigned int refcnt;
+    unsigned int hash;
+    char str[];
+} QDictKey;
+
+static QDictKey **key_table;
+static QDictKey key_deleted;
+static unsigned int key_table_mask;
+static size_t key_table_used;   /* including deleted slots */
+static size_t key_count;
+static int key_table_busy;
+
+static void key_table_lock(void)
 {
-    QDictEntry *entry;
+    while (__sync_lock_test_and_set(&key_table_busy, 1)) {
+        while (*(volatile int *)&key_table_busy) {
+            /* spin */
+        }
+    }
+}
+
+static void key_table_unlock(void)
+{
+    __sync_lock_release(&key_table_busy);
+}
+
+static void key_table_resize(void)
+{
+    QDictKey **old = key_table;
+    unsigned int old_size = key_table ? key_table_mask + 1 : 0;
+    unsigned int size = 64;
+    unsigned int i, j;
+
+    while (size < key_count * 4) {
+        size *= 2;
+    }
+    key_table = qemu_mallocz(size * sizeof(*key_table));
+    key_table_mask = size - 1;
+    for (i = 0; i < old_size; i++) {
+        if (old[i] && old[i] != &key_deleted) {
+            for (j = old[i]->hash & key_table_mask; key_table[j];
+                 j = (j + 1) & key_table_mask) {
+                /* find a free slot */
+            }
+            key_table[j] = old[i];
+        }
+    }
+    key_table_used = key_count;
+    qemu_free(old);
+}
+
+static char *key_intern(const char *key, unsigned int hash)
+{
+    QDictKey *k;
+    unsigned int i;
+    int free_slot = -1;
+
+    key_table_lock();
+    if (!key_table || (key_table_used + 1) * 4 > (key_table_mask + 1) * 3) {
+        key_table_resize();
+    }
+    for (i = hash & key_table_mask; (k = key_table[i]) != NULL;
+         i = (i + 1) & key_table_mask) {
+        if (k == &key_deleted) {
+            if (free_slot < 0) {
+                free_slot = i;
+            }
+        } else if (k->hash == hash && !strcmp(k->str, key)) {
+            k->refcnt++;
+            key_table_unlock();
+            return k->str;
+        }
+    }
 
-    entry = qemu_mallocz(sizeof(*entry));
-    entry->key = qemu_strdup(key);
-    entry->value = value;
+    k = qemu_malloc(sizeof(*k) + strlen(key) + 1);
+    k->refcnt = 1;
+    k->hash = hash;
+    strcpy(k->str, key);
+    if (free_slot >= 0) {
+        i = free_slot;
+    } else {
+        key_table_used++;
+    }
+    key_table[i] = k;
+    key_count++;
+    key_table_unlock();
+    return k->str;
+}
 
-    return entry;
+static void key_release(char *str)
+{
+    QDictKey *k = (QDictKey *)(str - offsetof(QDictKey, str));
+    unsigned int i;
+
+    key_table_lock();
+    if (--k->refcnt == 0) {
+        for (i = k->hash & key_table_mask; key_table[i] != k;
+             i = (i + 1) & key_table_mask) {
+            /* it is in the table */
+        }
+        key_table[i] = &key_deleted;
+        key_count--;
+        qemu_free(k);
+    }
+    key_table_unlock();
 }
 
 /**
@@ -104,18 +206,98 @@ const char *qdict_entry_key(const QDictEntry *entry)
 }
 
 /**
- * qdict_find(): List lookup function
+ * qdict_index_insert(): Add entries[n] to the hash index
  */
-static QDictEntry *qdict_find(const QDict *qdict,
-                              const char *key, unsigned int bucket)
+static void qdict_index_insert(QDict *qdict, int n)
 {
-    QDictEntry *entry;
+    unsigned int i;
+
+    for (i = qdict->entries[n].hash & qdict->index_mask;
+         qdict->index[i] >= 0; i = (i + 1) & qdict->index_mask) {
+        /* find a free slot */
+    }
+    qdict->index[i] = n;
+}
+
+/**
+ * qdict_reindex(): Rebuild the hash index, at least twice as big as the
+ * entries array
+ */
+static void qdict_reindex(QDict *qdict)
+{
+    unsigned int size = 16;
+    int n;
+
+    while (size < qdict->max * 2) {
+        size *= 2;
+    }
+    if (!qdict->index || qdict->index_mask + 1 != size) {
+        qemu_free(qdict->index);
+        qdict->index = qemu_malloc(size * sizeof(*qdict->index));
+        qdict->index_mask = size - 1;
+    }
+    memset(qdict->index, -1, size * sizeof(*qdict->index));
+    for (n = 0; n < qdict->size; n++) {
+        qdict_index_insert(qdict, n);
+    }
+}
+
+/**
+ * qdict_grow(): Make room for one more entry
+ */
+static void qdict_grow(QDict *qdict)
+{
+    qdict->max *= 2;
+    if (qdict->entries == qdict->inline_entries) {
+        qdict->entries = qemu_malloc(qdict->max * sizeof(QDictEntry));
+        memcpy(qdict->entries, qdict->inline_entries,
+               qdict->size * sizeof(QDictEntry));
+    } else {
+        qdict->entries = qemu_realloc(qdict->entries,
+                                      qdict->max * sizeof(QDictEntry));
+    }
+    qdict_reindex(qdict);
+}
+
+/**
+ * qdict_find(): Return the position of 'key' in the entries array, or -1
+ *
+ * 'hash' is only looked at if the dict has an index.  Interned keys
+ * match by address before strcmp() is tried.
+ */
+static int qdict_find(const QDict *qdict, const char *key, unsigned int hash)
+{
+    const QDictEntry *entry;
+    unsigned int i;
+    int n;
+
+    if (!qdict->index) {
+        for (n = 0; n < qdict->size; n++) {
+            entry = &qdict->entries[n];
+            if (entry->key == key || !strcmp(entry->key, key)) {
+                return n;
+            }
+        }
+        return -1;
+    }
 
-    QLIST_FOREACH(entry, &qdict->table[bucket], next)
-        if (!strcmp(entry->key, key))
-            return entry;
+    for (i = hash & qdict->index_mask; (n = qdict->index[i]) >= 0;
+         i = (i + 1) & qdict->index_mask) {
+        entry = &qdict->entries[n];
+        if (entry->hash == hash &&
+            (entry->key == key || !strcmp(entry->key, key))) {
+            return n;
+        }
+    }
+    return -1;
+}
 
-    return NULL;
+/**
+ * qdict_lookup(): qdict_find() that hashes 'key' only if it has to
+ */
+static int qdict_lookup(const QDict *qdict, const char *key)
+{
+    return qdict_find(qdict, key, qdict->index ? tdb_hash(key) : 0);
 }
 
 /**
@@ -131,19 +313,28 @@ static QDictEntry *qdict_find(const QDict *qdict,
  */
 void qdict_put_obj(QDict *qdict, const char *key, QObject *value)
 {
-    unsigned int bucket;
+    unsigned int hash = tdb_hash(key);
     QDictEntry *entry;
+    int n;
 
-    bucket = tdb_hash(key) % QDICT_BUCKET_MAX;
-    entry = qdict_find(qdict, key, bucket);
-    if (entry) {
+    n = qdict_find(qdict, key, hash);
+    if (n >= 0) {
         /* replace key's value */
+        entry = &qdict->entries[n];
         qobject_decref(entry->value);
         entry->value = value;
     } else {
-        /* allocate a new entry */
-        entry = alloc_entry(key, value);
-        QLIST_INSERT_HEAD(&qdict->table[bucket], entry, next);
+        /* add a new entry */
+        if (qdict->size == qdict->max) {
+            qdict_grow(qdict);
+        }
+        entry = &qdict->entries[qdict->size];
+        entry->key = key_intern(key, hash);
+        entry->value = value;
+        entry->hash = hash;
+        if (qdict->index) {
+            qdict_index_insert(qdict, qdict->size);
+        }
         qdict->size++;
     }
 }
@@ -156,10 +347,9 @@ void qdict_put_obj(QDict *qdict, const char *key, QObject *value)
  */
 QObject *qdict_get(const QDict *qdict, const char *key)
 {
-    QDictEntry *entry;
+    int n = qdict_lookup(qdict, key);
 
-    entry = qdict_find(qdict, key, tdb_hash(key) % QDICT_BUCKET_MAX);
-    return (entry == NULL ? NULL : entry->value);
+    return (n < 0 ? NULL : qdict->entries[n].value);
 }
 
 /**
@@ -169,8 +359,7 @@ QObject *qdict_get(const QDict *qdict, const char *key)
  */
 int qdict_haskey(const QDict *qdict, const char *key)
 {
-    unsigned int bucket = tdb_hash(key) % QDICT_BUCKET_MAX;
-    return (qdict_find(qdict, key, bucket) == NULL ? 0 : 1);
+    return (qdict_lookup(qdict, key) < 0 ? 0 : 1);
 }
 
 /**
@@ -348,32 +537,17 @@ const char *qdict_get_try_str(const QDict *qdict, const char *key)
  * qdict_iter(): Iterate over all the dictionary's stored values.
  *
  * This function allows the user to provide an iterator, which will be
- * called for each stored value in the dictionary.
+ * called for each stored value in the dictionary, in insertion order.
  */
 void qdict_iter(const QDict *qdict,
                 void (*iter)(const char *key, QObject *obj, void *opaque),
                 void *opaque)
 {
-    int i;
-    QDictEntry *entry;
-
-    for (i = 0; i < QDICT_BUCKET_MAX; i++) {
-        QLIST_FOREACH(entry, &qdict->table[i], next)
-            iter(entry->key, entry->value, opaque);
-    }
-}
-
-static QDictEntry *qdict_next_entry(const QDict *qdict, int first_bucket)
-{
-    int i;
+    int n;
 
-    for (i = first_bucket; i < QDICT_BUCKET_MAX; i++) {
-        if (!QLIST_EMPTY(&qdict->table[i])) {
-            return QLIST_FIRST(&qdict->table[i]);
-        }
+    for (n = 0; n < qdict->size; n++) {
+        iter(qdict->entries[n].key, qdict->entries[n].value, opaque);
     }
-
-    return NULL;
 }
 
 /**
@@ -381,7 +555,7 @@ static QDictEntry *qdict_next_entry(const QDict *qdict, int first_bucket)
  */
 const QDictEntry *qdict_first(const QDict *qdict)
 {
-    return qdict_next_entry(qdict, 0);
+    return qdict->size ? &qdict->entries[0] : NULL;
 }
 
 /**
@@ -389,15 +563,9 @@ const QDictEntry *qdict_first(const QDict *qdict)
  */
 const QDictEntry *qdict_next(const QDict *qdict, const QDictEntry *entry)
 {
-    QDictEntry *ret;
-
-    ret = QLIST_NEXT(entry, next);
-    if (!ret) {
-        unsigned int bucket = tdb_hash(entry->key) % QDICT_BUCKET_MAX;
-        ret = qdict_next_entry(qdict, bucket + 1);
-    }
+    int n = entry - qdict->entries + 1;
 
-    return ret;
+    return n < qdict->size ? &qdict->entries[n] : NULL;
 }
 
 /**
@@ -410,24 +578,29 @@ static void qentry_destroy(QDictEntry *e)
     assert(e->value != NULL);
 
     qobject_decref(e->value);
-    qemu_free(e->key);
-    qemu_free(e);
+    key_release(e->key);
 }
 
 /**
  * qdict_del(): Delete a 'key:value' pair from the dictionary
  *
- * This will destroy all data allocated by this entry.
+ * This will destroy all data allocated by this entry.  The entries after
+ * it move down to keep the insertion order, so a big dict has its index
+ * rebuilt.
  */
 void qdict_del(QDict *qdict, const char *key)
 {
-    QDictEntry *entry;
+    int n;
 
-    entry = qdict_find(qdict, key, tdb_hash(key) % QDICT_BUCKET_MAX);
-    if (entry) {
-        QLIST_REMOVE(entry, next);
-        qentry_destroy(entry);
+    n = qdict_lookup(qdict, key);
+    if (n >= 0) {
+        qentry_destroy(&qdict->entries[n]);
         qdict->size--;
+        memmove(&qdict->entries[n], &qdict->entries[n + 1],
+                (qdict->size - n) * sizeof(QDictEntry));
+        if (qdict->index) {
+            qdict_reindex(qdict);
+        }
     }
 }
 
@@ -436,21 +609,18 @@ void qdict_del(QDict *qdict, const char *key)
  */
 static void qdict_destroy_obj(QObject *obj)
 {
-    int i;
+    int n;
     QDict *qdict;
 
     assert(obj != NULL);
     qdict = qobject_to_qdict(obj);
 
-    for (i = 0; i < QDICT_BUCKET_MAX; i++) {
-        QDictEntry *entry = QLIST_FIRST(&qdict->table[i]);
-        while (entry) {
-            QDictEntry *tmp = QLIST_NEXT(entry, next);
-            QLIST_REMOVE(entry, next);
-            qentry_destroy(entry);
-            entry = tmp;
-        }
+    for (n = 0; n < qdict->size; n++) {
+        qentry_destroy(&qdict->entries[n]);
     }
-
-    qemu_free(qdict);
+    if (qdict->entries != qdict->inline_entries) {
+        qemu_free(qdict->entries);
+    }
+    qemu_free(qdict->index);
+    qobject_free(obj);
 }
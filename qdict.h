@@ -18,18 +18,24 @@
 #include "qemu-queue.h"
 #include <stdint.h>
 
-#define QDICT_BUCKET_MAX 512
+/* Dicts up to this size keep their entries inline and are searched
+   linearly; bigger ones move them out and add a hash index */
+#define QDICT_INLINE_MAX 8
 
 typedef struct QDictEntry {
     char *key;
     QObject *value;
-    QLIST_ENTRY(QDictEntry) next;
+    unsigned int hash;
 } QDictEntry;
 
 typedef struct QDict {
     QObject_HEAD;
     size_t size;
-    QLIST_HEAD(,QDictEntry) table[QDICT_BUCKET_MAX];
+    size_t max;
+    QDictEntry *entries;        /* in insertion order */
+    int *index;                 /* open addressing, -1 marks a free slot */
+    unsigned int index_mask;
+    QDictEntry inline_entries[QDICT_INLINE_MAX];
 } QDict;
 
 /* Object API */
@@ -0,0 +1,221 @@
+/*
+ * Arenas for short-lived allocations
+ *
+ * Memory is carved out of blocks of ARENA_BLOCK_SIZE bytes, and a reset
+ * puts them aside for the next generation, up to ARENA_SPARE_BLOCKS of
+ * them.  Every allocation is preceded by a pointer to the generation of
+ * the arena it came from, that is the blocks handed out since the last
+ * reset, so that freeing it needs no lookup, and a generation whose
+ * allocations outlive a reset can be retired and freed on its own once
+ * the last of them goes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-arena.h"
+
+#define ARENA_BLOCK_SIZE    16384
+#define ARENA_SPARE_BLOCKS  8
+#define ARENA_ALIGN         8
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    uint64_t data[];
+} ArenaBlock;
+
+typedef struct ArenaGen {
+    QemuArena *arena;
+    ArenaBlock *blocks;         /* the first one is bumped */
+    size_t live;                /* allocations not freed yet */
+    int retired;
+} ArenaGen;
+
+typedef union ArenaHeader {
+    ArenaGen *gen;
+    uint64_t align;
+} ArenaHeader;
+
+struct QemuArena {
+    const char *name;
+    ArenaGen *gen;
+    ArenaBlock *spare;
+    int nspare;
+    size_t gen_bytes;           /* handed out by the current generation */
+    size_t peak_bytes;
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t resets;
+    uint64_t deferred;          /* resets that had to retire a generation */
+    uint64_t blocks;            /* ever allocated */
+    int retired;                /* retired generations still alive */
+    QemuArena *next;
+};
+
+static QemuArena *arena_list;
+
+/* Only set and used under the global mutex */
+static QemuArena *arena_current;
+
+static ArenaGen *arena_gen_new(QemuArena *a)
+{
+    ArenaGen *gen = qemu_mallocz(sizeof(*gen));
+
+    gen->arena = a;
+    return gen;
+}
+
+static void arena_free_blocks(ArenaBlock *b)
+{
+    while (b) {
+        ArenaBlock *next = b->next;
+
+        qemu_free(b);
+        b = next;
+    }
+}
+
+static ArenaBlock *arena_block_new(QemuArena *a, size_t size)
+{
+    ArenaBlock *b;
+
+    if (size == ARENA_BLOCK_SIZE && a->spare) {
+        b = a->spare;
+        a->spare = b->next;
+        a->nspare--;
+    } else {
+        b = qemu_malloc(sizeof(*b) + size);
+        b->size = size;
+        a->blocks++;
+    }
+    b->used = 0;
+    return b;
+}
+
+QemuArena *qemu_arena_new(const char *name)
+{
+    QemuArena *a = qemu_mallocz(sizeof(*a));
+
+    a->name = name;
+    a->gen = arena_gen_new(a);
+    a->next = arena_list;
+    arena_list = a;
+    return a;
+}
+
+void *qemu_arena_alloc(QemuArena *a, size_t size)
+{
+    size_t need = (sizeof(ArenaHeader) + size + ARENA_ALIGN - 1) &
+                  ~(size_t)(ARENA_ALIGN - 1);
+    ArenaGen *gen = a->gen;
+    ArenaBlock *b = gen->blocks;
+    ArenaHeader *h;
+
+    if (need > ARENA_BLOCK_SIZE / 4) {
+        /* A block of its own, behind the one being bumped */
+        b = arena_block_new(a, need);
+        if (gen->blocks) {
+            b->next = gen->blocks->next;
+            gen->blocks->next = b;
+        } else {
+            b->next = NULL;
+            gen->blocks = b;
+        }
+    } else if (!b || b->size - b->used < need) {
+        b = arena_block_new(a, ARENA_BLOCK_SIZE);
+        b->next = gen->blocks;
+        gen->blocks = b;
+    }
+
+    h = (ArenaHeader *)((char *)b->data + b->used);
+    b->used += need;
+    h->gen = gen;
+    gen->live++;
+
+    a->allocs++;
+    a->bytes += size;
+    a->gen_bytes += need;
+    a->peak_bytes = MAX(a->peak_bytes, a->gen_bytes);
+    return h + 1;
+}
+
+void qemu_arena_free(void *p)
+{
+    ArenaHeader *h = (ArenaHeader *)p - 1;
+    ArenaGen *gen = h->gen;
+
+    assert(gen->live > 0);
+    if (--gen->live == 0 && gen->retired) {
+        gen->arena->retired--;
+        arena_free_blocks(gen->blocks);
+        qemu_free(gen);
+    }
+}
+
+void qemu_arena_reset(QemuArena *a)
+{
+    ArenaGen *gen = a->gen;
+
+    a->resets++;
+    a->gen_bytes = 0;
+    if (gen->live) {
+        gen->retired = 1;
+        a->retired++;
+        a->deferred++;
+        a->gen = arena_gen_new(a);
+        return;
+    }
+    while (gen->blocks) {
+        ArenaBlock *b = gen->blocks;
+
+        gen->blocks = b->next;
+        /* Don't keep a large allocation's block around */
+        if (b->size == ARENA_BLOCK_SIZE && a->nspare < ARENA_SPARE_BLOCKS) {
+            b->next = a->spare;
+            a->spare = b;
+            a->nspare++;
+        } else {
+            qemu_free(b);
+        }
+    }
+}
+
+QemuArena *qemu_arena_set_current(QemuArena *a)
+{
+    QemuArena *prev = arena_current;
+
+    arena_current = a;
+    return prev;
+}
+
+void *qemu_arena_current_alloc(size_t size)
+{
+    return arena_current ? qemu_arena_alloc(arena_current, size) : NULL;
+}
+
+uint64_t qemu_arena_allocs(QemuArena *a)
+{
+    return a->allocs;
+}
+
+void qemu_arena_dump(FILE *f, int (*fprintf_fn)(FILE *f, const char *fmt, ...))
+{
+    QemuArena *a;
+
+    for (a = arena_list; a; a = a->next) {
+        fprintf_fn(f, "%s: %" PRIu64 " allocations, %" PRIu64 " bytes, "
+                   "%" PRIu64 " resets\n", a->name, a->allocs, a->bytes,
+                   a->resets);
+        fprintf_fn(f, "  avg %" PRIu64 " allocations and %" PRIu64
+                   " bytes per reset, peak %zu bytes\n",
+                   a->allocs / MAX(a->resets, 1),
+                   a->bytes / MAX(a->resets, 1), a->peak_bytes);
+        fprintf_fn(f, "  %" PRIu64 " blocks allocated, %" PRIu64
+                   " resets deferred by live allocations, %d generations "
+                   "still alive\n", a->blocks, a->deferred, a->retired);
+    }
+}
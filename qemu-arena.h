@@ -0,0 +1,47 @@
+/*
+ * Arenas for short-lived allocations
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_ARENA_H
+#define QEMU_ARENA_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct QemuArena QemuArena;
+
+/*
+ * An arena hands out memory by bumping a pointer and takes it all back at
+ * once with qemu_arena_reset().  Each allocation must still be given back
+ * with qemu_arena_free() when its user is done with it, which only counts
+ * it as dead: a reset that finds allocations still alive leaves them, and
+ * the blocks they are in, alone until the last of them is freed, so
+ * memory that outlives the work the arena was meant for is never reused
+ * under its feet.
+ *
+ * An arena is used by one thread at a time.
+ */
+
+/* An arena that lives as long as the program, listed under name */
+QemuArena *qemu_arena_new(const char *name);
+
+void *qemu_arena_alloc(QemuArena *a, size_t size);
+void qemu_arena_free(void *p);
+void qemu_arena_reset(QemuArena *a);
+
+/* The arena that qemu_arena_current_alloc() uses in the calling thread,
+   NULL for none; returns the previous one */
+QemuArena *qemu_arena_set_current(QemuArena *a);
+
+/* Allocates from the calling thread's current arena, or returns NULL */
+void *qemu_arena_current_alloc(size_t size);
+
+/* Allocations from a so far */
+uint64_t qemu_arena_allocs(QemuArena *a);
+
+void qemu_arena_dump(FILE *f, int (*fprintf_fn)(FILE *f, const char *fmt, ...));
+
+#endif
@@ -4,6 +4,12 @@
 /* FIXME: arch dependant, x86 version */
 #define smp_wmb()   asm volatile("" ::: "memory")
 
+/* x86 does not reorder loads with other loads */
+#define smp_rmb()   asm volatile("" ::: "memory")
+
+/* Full barrier: stores may pass later loads even on x86 */
+#define smp_mb()    __sync_synchronize()
+
 /* Compiler barrier */
 #define barrier()   asm volatile("" ::: "memory")
 
@@ -32,6 +32,7 @@
 #include "hw/baum.h"
 #include "hw/msmouse.h"
 #include "qemu-objects.h"
+#include "iov.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -145,6 +146,36 @@ int qemu_chr_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+int qemu_chr_writev(CharDriverState *s, const struct iovec *iov, int iovcnt)
+{
+    int i, ret, done = 0;
+
+    if (s->chr_writev) {
+        return s->chr_writev(s, iov, iovcnt);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        ret = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return done ? done : ret;
+        }
+        done += ret;
+        if (ret < iov[i].iov_len) {
+            break;
+        }
+    }
+    return done;
+}
+
+int qemu_chr_notify_writable(CharDriverState *s, IOHandler *fd_write_ready)
+{
+    if (!s->chr_update_write_handler) {
+        return -ENOTSUP;
+    }
+    s->chr_write_ready = fd_write_ready;
+    s->chr_update_write_handler(s);
+    return 0;
+}
+
 int qemu_chr_ioctl(CharDriverState *s, int cmd, void *arg)
 {
     if (!s->chr_ioctl)
@@ -518,8 +549,17 @@ int send_all(int fd, const void *_buf, int len1)
     while (len > 0) {
         ret = write(fd, buf, len);
         if (ret < 0) {
-            if (errno != EINTR && errno != EAGAIN)
+            if (errno == EAGAIN && fd < FD_SETSIZE) {
+                fd_set wfds;
+
+                /* The reader is behind: sleep until it catches up
+                   instead of spinning */
+                FD_ZERO(&wfds);
+                FD_SET(fd, &wfds);
+                select(fd + 1, NULL, &wfds, NULL, NULL);
+            } else if (errno != EINTR && errno != EAGAIN) {
                 return -1;
+            }
         } else if (ret == 0) {
             break;
         } else {
@@ -531,6 +571,306 @@ int send_all(int fd, const void *_buf, int len1)
 }
 #endif /* !_WIN32 */
 
+/***********************************************************/
+/* Output buffering for fd backends */
+
+/*
+ * What a slow reader can't take yet waits in a ring that the fd's write
+ * handler drains, so that it doesn't stall the iothread.  When the ring
+ * is full, the overflow policy either drops the oldest or the newest
+ * data, or pushes back: qemu_chr_writev() comes short for the device
+ * models that handle it, and qemu_chr_write() waits for the reader as it
+ * does without a ring.
+ */
+
+#define CHR_OUTBUF_DEFAULT_SIZE 65536
+
+typedef enum {
+    CHR_OVERFLOW_BACKPRESSURE,
+    CHR_OVERFLOW_DROP_OLD,
+    CHR_OVERFLOW_DROP_NEW,
+} CharOverflow;
+
+struct CharOutBuf {
+    uint8_t *buf;
+    size_t size;
+    size_t head;                /* oldest byte */
+    size_t len;
+    int fd;                     /* that the ring is for */
+    CharOverflow overflow;
+    uint64_t dropped;           /* bytes */
+};
+
+static ssize_t chr_fd_sendv(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+#ifndef _WIN32
+    do {
+        ret = writev(fd, iov, MIN(iovcnt, IOV_MAX));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        return -errno;
+    }
+#else
+    int i;
+
+    for (i = 0, ret = 0; i < iovcnt; i++) {
+        int n = send(fd, iov[i].iov_base, iov[i].iov_len, 0);
+
+        if (n < 0) {
+            errno = WSAGetLastError();
+            if (ret == 0) {
+                return errno == WSAEWOULDBLOCK ? -EAGAIN : -errno;
+            }
+            break;
+        }
+        ret += n;
+        if (n < iov[i].iov_len) {
+            break;
+        }
+    }
+#endif
+    return ret;
+}
+
+/* Sleeps until fd can take more, as send_all does */
+static void chr_fd_wait_writable(int fd)
+{
+    fd_set wfds;
+
+#ifndef _WIN32
+    if (fd >= FD_SETSIZE) {
+        return;
+    }
+#endif
+    FD_ZERO(&wfds);
+    FD_SET(fd, &wfds);
+    select(fd + 1, NULL, &wfds, NULL, NULL);
+}
+
+static int chr_overflow_parse(const char *overflow)
+{
+    if (!overflow || !strcmp(overflow, "backpressure")) {
+        return CHR_OVERFLOW_BACKPRESSURE;
+    } else if (!strcmp(overflow, "drop-old")) {
+        return CHR_OVERFLOW_DROP_OLD;
+    } else if (!strcmp(overflow, "drop-new")) {
+        return CHR_OVERFLOW_DROP_NEW;
+    }
+    return -1;
+}
+
+/* opts were checked by qemu_chr_open_opts() */
+static void chr_outbuf_init(CharDriverState *chr, QemuOpts *opts)
+{
+    uint64_t size = qemu_opt_get_size(opts, "outbuf",
+                                      CHR_OUTBUF_DEFAULT_SIZE);
+    CharOutBuf *ob;
+
+    if (!size) {
+        return;
+    }
+    ob = qemu_mallocz(sizeof(*ob));
+    ob->buf = qemu_malloc(size);
+    ob->size = size;
+    ob->fd = -1;
+    ob->overflow = chr_overflow_parse(qemu_opt_get(opts, "overflow"));
+    chr->outbuf = ob;
+}
+
+/* Throws away what the ring holds, when the reader is gone */
+static void chr_outbuf_reset(CharDriverState *chr)
+{
+    CharOutBuf *ob = chr->outbuf;
+
+    if (ob) {
+        ob->dropped += ob->len;
+        ob->head = ob->len = 0;
+    }
+}
+
+static void chr_outbuf_free(CharDriverState *chr)
+{
+    if (chr->outbuf) {
+        qemu_free(chr->outbuf->buf);
+        qemu_free(chr->outbuf);
+        chr->outbuf = NULL;
+    }
+}
+
+static void chr_outbuf_drop_old(CharOutBuf *ob, size_t len)
+{
+    ob->head = (ob->head + len) % ob->size;
+    ob->len -= len;
+    ob->dropped += len;
+}
+
+/* Appends len bytes of iov from offset on; they must fit */
+static void chr_outbuf_put(CharOutBuf *ob, const struct iovec *iov,
+                           int iovcnt, size_t offset, size_t len)
+{
+    size_t tail = (ob->head + ob->len) % ob->size;
+    size_t first = MIN(len, ob->size - tail);
+
+    iov_to_buf(iov, iovcnt, ob->buf + tail, offset, first);
+    iov_to_buf(iov, iovcnt, ob->buf, offset + first, len - first);
+    ob->len += len;
+}
+
+static void chr_outbuf_drain(CharDriverState *chr)
+{
+    CharOutBuf *ob = chr->outbuf;
+    size_t first = MIN(ob->len, ob->size - ob->head);
+    struct iovec iov[2] = {
+        { .iov_base = ob->buf + ob->head, .iov_len = first },
+        { .iov_base = ob->buf, .iov_len = ob->len - first },
+    };
+    ssize_t ret;
+
+    ret = chr_fd_sendv(ob->fd, iov, first < ob->len ? 2 : 1);
+    if (ret < 0) {
+        if (ret != -EAGAIN) {
+            chr_outbuf_reset(chr);
+        }
+        return;
+    }
+    ob->head = (ob->head + ret) % ob->size;
+    ob->len -= ret;
+    if (!ob->len) {
+        ob->head = 0;
+    }
+}
+
+static void chr_fd_write_ready(void *opaque)
+{
+    CharDriverState *chr = opaque;
+    IOHandler *fd_write_ready;
+
+    if (chr->outbuf && chr->outbuf->len) {
+        chr_outbuf_drain(chr);
+        if (chr->outbuf->len) {
+            return;
+        }
+    }
+    fd_write_ready = chr->chr_write_ready;
+    chr->chr_write_ready = NULL;
+    chr->chr_update_write_handler(chr);
+    if (fd_write_ready) {
+        fd_write_ready(chr->handler_opaque);
+    }
+}
+
+/* The write handler that fd backends register, NULL while they have
+   nothing to wait for */
+static IOHandler *chr_write_handler(CharDriverState *chr)
+{
+    if ((chr->outbuf && chr->outbuf->len) || chr->chr_write_ready) {
+        return chr_fd_write_ready;
+    }
+    return NULL;
+}
+
+/*
+ * Writes iov to fd through the ring, if the chardev has one.  A partial
+ * write, for qemu_chr_writev(), returns what was taken or -EAGAIN when
+ * the backpressure policy keeps it out; otherwise all of iov is taken.
+ */
+static int chr_fd_writev(CharDriverState *chr, int fd,
+                         const struct iovec *iov, int iovcnt, bool partial)
+{
+    CharOutBuf *ob = chr->outbuf;
+    size_t total = iov_size(iov, iovcnt);
+    size_t done = 0, left, avail, skip;
+    ssize_t ret;
+    int i;
+
+    if (!ob) {
+        assert(partial);
+        return chr_fd_sendv(fd, iov, iovcnt);
+    }
+
+    ob->fd = fd;
+    if (ob->len) {
+        chr_outbuf_drain(chr);
+    }
+    if (!ob->len) {
+        ret = chr_fd_sendv(fd, iov, iovcnt);
+        if (ret < 0 && ret != -EAGAIN) {
+            return ret;
+        }
+        done = MAX(ret, 0);
+    }
+    if (done == total) {
+        return total;
+    }
+
+    left = total - done;
+    avail = ob->size - ob->len;
+    if (left > avail) {
+        switch (ob->overflow) {
+        case CHR_OVERFLOW_DROP_NEW:
+            ob->dropped += left - avail;
+            left = avail;
+            break;
+        case CHR_OVERFLOW_DROP_OLD:
+            if (left > ob->size) {
+                ob->dropped += left - ob->size;
+                done += left - ob->size;
+                left = ob->size;
+            }
+            chr_outbuf_drop_old(ob, left - (ob->size - ob->len));
+            break;
+        case CHR_OVERFLOW_BACKPRESSURE:
+            if (partial) {
+                if (!done && !avail) {
+                    return -EAGAIN;
+                }
+                total = done + avail;
+                left = avail;
+                break;
+            }
+            while (ob->len && left > ob->size - ob->len) {
+                chr_fd_wait_writable(fd);
+                chr_outbuf_drain(chr);
+            }
+            if (left > ob->size) {
+                /* More than the ring holds: the old way, from where the
+                   direct write left off */
+                for (i = 0, skip = done; i < iovcnt; i++) {
+                    if (skip >= iov[i].iov_len) {
+                        skip -= iov[i].iov_len;
+                        continue;
+                    }
+                    ret = send_all(fd, iov[i].iov_base + skip,
+                                   iov[i].iov_len - skip);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                    skip = 0;
+                }
+                return total;
+            }
+            break;
+        }
+    }
+
+    chr_outbuf_put(ob, iov, iovcnt, done, left);
+    chr->chr_update_write_handler(chr);
+    return total;
+}
+
+static int chr_fd_write(CharDriverState *chr, int fd, const uint8_t *buf,
+                        int len)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+    if (!chr->outbuf) {
+        return send_all(fd, buf, len);
+    }
+    return chr_fd_writev(chr, fd, &iov, 1, false);
+}
+
 #ifndef _WIN32
 
 typedef struct {
@@ -544,7 +884,14 @@ static int stdio_nb_clients = 0;
 static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     FDCharDriver *s = chr->opaque;
-    return send_all(s->fd_out, buf, len);
+    return chr_fd_write(chr, s->fd_out, buf, len);
+}
+
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+    return chr_fd_writev(chr, s->fd_out, iov, iovcnt, true);
 }
 
 static int fd_chr_read_poll(void *opaque)
@@ -587,12 +934,25 @@ static void fd_chr_update_read_handler(CharDriverState *chr)
     if (s->fd_in >= 0) {
         if (display_type == DT_NOGRAPHIC && s->fd_in == 0) {
         } else {
-            qemu_set_fd_handler2(s->fd_in, fd_chr_read_poll,
-                                 fd_chr_read, NULL, chr);
+            qemu_set_fd_handler2(s->fd_in, fd_chr_read_poll, fd_chr_read,
+                                 s->fd_out == s->fd_in ?
+                                 chr_write_handler(chr) : NULL, chr);
         }
     }
 }
 
+static void fd_chr_update_write_handler(CharDriverState *chr)
+{
+    FDCharDriver *s = chr->opaque;
+
+    if (s->fd_out == s->fd_in) {
+        fd_chr_update_read_handler(chr);
+    } else {
+        qemu_set_fd_handler2(s->fd_out, NULL, NULL, chr_write_handler(chr),
+                             chr);
+    }
+}
+
 static void fd_chr_close(struct CharDriverState *chr)
 {
     FDCharDriver *s = chr->opaque;
@@ -603,6 +963,9 @@ static void fd_chr_close(struct CharDriverState *chr)
             qemu_set_fd_handler2(s->fd_in, NULL, NULL, NULL, NULL);
         }
     }
+    if (chr->outbuf && s->fd_out != s->fd_in) {
+        qemu_set_fd_handler2(s->fd_out, NULL, NULL, NULL, NULL);
+    }
 
     qemu_free(s);
     qemu_chr_event(chr, CHR_EVENT_CLOSED);
@@ -628,6 +991,21 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     return chr;
 }
 
+/* Buffers what the guest writes to fd_out, see chr_fd_writev() */
+static CharDriverState *fd_chr_init_outbuf(CharDriverState *chr,
+                                           QemuOpts *opts)
+{
+    FDCharDriver *s = chr->opaque;
+
+    chr_outbuf_init(chr, opts);
+    if (chr->outbuf) {
+        socket_set_nonblock(s->fd_out);
+        chr->chr_writev = fd_chr_writev;
+        chr->chr_update_write_handler = fd_chr_update_write_handler;
+    }
+    return chr;
+}
+
 static CharDriverState *qemu_chr_open_file_out(QemuOpts *opts)
 {
     int fd_out;
@@ -636,7 +1014,7 @@ static CharDriverState *qemu_chr_open_file_out(QemuOpts *opts)
                       O_WRONLY | O_TRUNC | O_CREAT | O_BINARY, 0666));
     if (fd_out < 0)
         return NULL;
-    return qemu_chr_open_fd(-1, fd_out);
+    return fd_chr_init_outbuf(qemu_chr_open_fd(-1, fd_out), opts);
 }
 
 static CharDriverState *qemu_chr_open_pipe(QemuOpts *opts)
@@ -663,7 +1041,7 @@ static CharDriverState *qemu_chr_open_pipe(QemuOpts *opts)
         if (fd_in < 0)
             return NULL;
     }
-    return qemu_chr_open_fd(fd_in, fd_out);
+    return fd_chr_init_outbuf(qemu_chr_open_fd(fd_in, fd_out), opts);
 }
 
 
@@ -860,7 +1238,19 @@ static int pty_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
         pty_chr_update_read_handler(chr);
         return 0;
     }
-    return send_all(s->fd, buf, len);
+    return chr_fd_write(chr, s->fd, buf, len);
+}
+
+static int pty_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    PtyCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        pty_chr_update_read_handler(chr);
+        return iov_size(iov, iovcnt);
+    }
+    return chr_fd_writev(chr, s->fd, iov, iovcnt, true);
 }
 
 static int pty_chr_read_poll(void *opaque)
@@ -901,7 +1291,7 @@ static void pty_chr_update_read_handler(CharDriverState *chr)
     PtyCharDriver *s = chr->opaque;
 
     qemu_set_fd_handler2(s->fd, pty_chr_read_poll,
-                         pty_chr_read, NULL, chr);
+                         pty_chr_read, chr_write_handler(chr), chr);
     s->polling = 1;
     /*
      * Short timeout here: just need wait long enougth that qemu makes
@@ -914,12 +1304,26 @@ static void pty_chr_update_read_handler(CharDriverState *chr)
     qemu_mod_timer(s->timer, qemu_get_clock(rt_clock) + 10);
 }
 
+static void pty_chr_update_write_handler(CharDriverState *chr)
+{
+    PtyCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        chr->chr_write_ready = NULL;
+        return;
+    }
+    qemu_set_fd_handler2(s->fd, pty_chr_read_poll,
+                         pty_chr_read, chr_write_handler(chr), chr);
+}
+
 static void pty_chr_state(CharDriverState *chr, int connected)
 {
     PtyCharDriver *s = chr->opaque;
 
     if (!connected) {
         qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+        chr_outbuf_reset(chr);
+        chr->chr_write_ready = NULL;
         s->connected = 0;
         s->polling = 0;
         /* (re-)connect poll interval for idle guests: once per second.
@@ -998,8 +1402,12 @@ static CharDriverState *qemu_chr_open_pty(QemuOpts *opts)
 
     chr->opaque = s;
     chr->chr_write = pty_chr_write;
+    chr->chr_writev = pty_chr_writev;
     chr->chr_update_read_handler = pty_chr_update_read_handler;
+    chr->chr_update_write_handler = pty_chr_update_write_handler;
     chr->chr_close = pty_chr_close;
+    chr_outbuf_init(chr, opts);
+    socket_set_nonblock(s->fd);
 
     s->timer = qemu_new_timer(rt_clock, pty_chr_timer, chr);
 
@@ -1899,6 +2307,9 @@ return_err:
 /***********************************************************/
 /* TCP Net console */
 
+/* Frontends such as virtio-serial can take far more than a page at once */
+#define TCP_READ_BUF_LEN 65536
+
 typedef struct {
     int fd, listen_fd;
     int connected;
@@ -1915,13 +2326,40 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     TCPCharDriver *s = chr->opaque;
     if (s->connected) {
-        return send_all(s->fd, buf, len);
+        return chr_fd_write(chr, s->fd, buf, len);
     } else {
         /* XXX: indicate an error ? */
         return len;
     }
 }
 
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        /* XXX: indicate an error ? */
+        return iov_size(iov, iovcnt);
+    }
+    return chr_fd_writev(chr, s->fd, iov, iovcnt, true);
+}
+
+static void tcp_chr_read(void *opaque);
+static int tcp_chr_read_poll(void *opaque);
+
+static void tcp_chr_update_write_handler(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        chr->chr_write_ready = NULL;
+        return;
+    }
+    qemu_set_fd_handler2(s->fd, tcp_chr_read_poll, tcp_chr_read,
+                         chr_write_handler(chr), chr);
+}
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2051,7 +2489,7 @@ static void tcp_chr_read(void *opaque)
 {
     CharDriverState *chr = opaque;
     TCPCharDriver *s = chr->opaque;
-    uint8_t buf[READ_BUF_LEN];
+    uint8_t buf[TCP_READ_BUF_LEN];
     int len, size;
 
     if (!s->connected || s->max_size <= 0)
@@ -2069,6 +2507,8 @@ static void tcp_chr_read(void *opaque)
         qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
         closesocket(s->fd);
         s->fd = -1;
+        chr_outbuf_reset(chr);
+        chr->chr_write_ready = NULL;
         qemu_chr_event(chr, CHR_EVENT_CLOSED);
     } else if (size > 0) {
         if (s->do_telnetopt)
@@ -2091,6 +2531,7 @@ static void tcp_chr_connect(void *opaque)
     TCPCharDriver *s = chr->opaque;
 
     s->connected = 1;
+    chr->chr_write_ready = NULL;
     qemu_set_fd_handler2(s->fd, tcp_chr_read_poll,
                          tcp_chr_read, NULL, chr);
     qemu_chr_generic_open(chr);
@@ -2222,8 +2663,11 @@ static CharDriverState *qemu_chr_open_socket(QemuOpts *opts)
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+    chr->chr_writev = tcp_chr_writev;
+    chr->chr_update_write_handler = tcp_chr_update_write_handler;
     chr->chr_close = tcp_chr_close;
     chr->get_msgfd = tcp_get_msgfd;
+    chr_outbuf_init(chr, opts);
 
     if (is_listen) {
         s->listen_fd = fd;
@@ -2265,6 +2709,7 @@ static CharDriverState *qemu_chr_open_socket(QemuOpts *opts)
  fail:
     if (fd >= 0)
         closesocket(fd);
+    chr_outbuf_free(chr);
     qemu_free(s);
     qemu_free(chr);
     return NULL;
@@ -2515,6 +2960,11 @@ CharDriverState *qemu_chr_open_opts(QemuOpts *opts,
                 qemu_opt_get(opts, "backend"));
         return NULL;
     }
+    if (chr_overflow_parse(qemu_opt_get(opts, "overflow")) < 0) {
+        fprintf(stderr, "chardev: unknown overflow policy \"%s\"\n",
+                qemu_opt_get(opts, "overflow"));
+        return NULL;
+    }
 
     chr = backend_table[i].open(opts);
     if (!chr) {
@@ -2573,8 +3023,13 @@ void qemu_chr_set_echo(struct CharDriverState *chr, bool echo)
 void qemu_chr_close(CharDriverState *chr)
 {
     QTAILQ_REMOVE(&chardevs, chr, next);
+    if (chr->outbuf && chr->outbuf->len) {
+        /* last chance for what the reader didn't take yet */
+        chr_outbuf_drain(chr);
+    }
     if (chr->chr_close)
         chr->chr_close(chr);
+    chr_outbuf_free(chr);
     qemu_free(chr->filename);
     qemu_free(chr->label);
     qemu_free(chr);
@@ -2586,8 +3041,14 @@ static void qemu_chr_qlist_iter(QObject *obj, void *opaque)
     Monitor *mon = opaque;
 
     chr_dict = qobject_to_qdict(obj);
-    monitor_printf(mon, "%s: filename=%s\n", qdict_get_str(chr_dict, "label"),
-                                         qdict_get_str(chr_dict, "filename"));
+    monitor_printf(mon, "%s: filename=%s", qdict_get_str(chr_dict, "label"),
+                                       qdict_get_str(chr_dict, "filename"));
+    if (qdict_haskey(chr_dict, "dropped")) {
+        monitor_printf(mon, " buffered=%" PRId64 " dropped=%" PRId64,
+                       qdict_get_int(chr_dict, "buffered"),
+                       qdict_get_int(chr_dict, "dropped"));
+    }
+    monitor_printf(mon, "\n");
 }
 
 void qemu_chr_info_print(Monitor *mon, const QObject *ret_data)
@@ -2605,6 +3066,13 @@ void qemu_chr_info(Monitor *mon, QObject **ret_data)
     QTAILQ_FOREACH(chr, &chardevs, next) {
         QObject *obj = qobject_from_jsonf("{ 'label': %s, 'filename': %s }",
                                           chr->label, chr->filename);
+
+        if (chr->outbuf) {
+            QDict *dict = qobject_to_qdict(obj);
+
+            qdict_put(dict, "buffered", qint_from_int(chr->outbuf->len));
+            qdict_put(dict, "dropped", qint_from_int(chr->outbuf->dropped));
+        }
         qlist_append_obj(chr_list, obj);
     }
 
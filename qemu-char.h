@@ -51,21 +51,28 @@ typedef struct {
 
 typedef void IOEventHandler(void *opaque, int event);
 
+typedef struct CharOutBuf CharOutBuf;
+
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     void (*chr_update_read_handler)(struct CharDriverState *s);
+    void (*chr_update_write_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
     int (*get_msgfd)(struct CharDriverState *s);
     IOEventHandler *chr_event;
     IOCanReadHandler *chr_can_read;
     IOReadHandler *chr_read;
+    IOHandler *chr_write_ready;
     void *handler_opaque;
     void (*chr_send_event)(struct CharDriverState *chr, int event);
     void (*chr_close)(struct CharDriverState *chr);
     void (*chr_accept_input)(struct CharDriverState *chr);
     void (*chr_set_echo)(struct CharDriverState *chr, bool echo);
     void *opaque;
+    CharOutBuf *outbuf;
     QEMUBH *bh;
     char *label;
     char *filename;
@@ -82,6 +89,15 @@ void qemu_chr_close(CharDriverState *chr);
 void qemu_chr_printf(CharDriverState *s, const char *fmt, ...)
     GCC_FMT_ATTR(2, 3);
 int qemu_chr_write(CharDriverState *s, const uint8_t *buf, int len);
+/* Writes as much of iov as the backend takes without blocking and returns
+   how much that was, or -EAGAIN if it took nothing.  Backends that cannot
+   tell block until they took it all, as qemu_chr_write does. */
+int qemu_chr_writev(CharDriverState *s, const struct iovec *iov, int iovcnt);
+/* Calls fd_write_ready with the handlers' opaque, once, when the backend
+   can take more after qemu_chr_writev came short; NULL cancels it.  It is
+   dropped if the backend closes, which comes with CHR_EVENT_CLOSED.
+   Returns -ENOTSUP for backends that don't come short but for errors. */
+int qemu_chr_notify_writable(CharDriverState *s, IOHandler *fd_write_ready);
 void qemu_chr_send_event(CharDriverState *s, int event);
 void qemu_chr_add_handlers(CharDriverState *s,
                            IOCanReadHandler *fd_can_read,
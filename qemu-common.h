@@ -5,6 +5,7 @@
 #include "config-host.h"
 
 #define QEMU_NORETURN __attribute__ ((__noreturn__))
+#define QEMU_NOINLINE __attribute__ ((__noinline__))
 #ifdef CONFIG_GCC_ATTRIBUTE_WARN_UNUSED_RESULT
 #define QEMU_WARN_UNUSED_RESULT __attribute__((warn_unused_result))
 #else
@@ -137,7 +138,11 @@ void qemu_bh_schedule_idle(QEMUBH *bh);
 void qemu_bh_cancel(QEMUBH *bh);
 void qemu_bh_delete(QEMUBH *bh);
 int qemu_bh_poll(void);
-void qemu_bh_update_timeout(int *timeout);
+void qemu_bh_update_timeout(int64_t *timeout);
+
+/* Schedule bh once, the next time guest RAM whose VGA_DIRTY_FLAG has
+ * been cleared is written again (exec.c).  NULL disarms.  */
+void cpu_physical_memory_arm_display_wakeup(QEMUBH *bh);
 
 void qemu_get_timedate(struct tm *tm, int offset);
 int qemu_timedate_diff(struct tm *tm);
@@ -150,6 +155,8 @@ int stristart(const char *str, const char *val, const char **ptr);
 int qemu_strnlen(const char *s, int max_len);
 time_t mktimegm(struct tm *tm);
 int qemu_fls(int i);
+int buffer_is_filled(const void *buf, int c, size_t len);
+int buffer_is_zero(const void *buf, size_t len);
 int qemu_fdatasync(int fd);
 int fcntl_setfl(int fd, int flag);
 
@@ -200,10 +207,27 @@ void *qemu_mallocz(size_t size);
 void qemu_free(void *ptr);
 char *qemu_strdup(const char *str);
 char *qemu_strndup(const char *str, size_t size);
+/* Calls of qemu_malloc(), qemu_mallocz() and qemu_realloc() so far, for
+   benchmarks; not exact while several threads allocate */
+uint64_t qemu_malloc_calls(void);
 
 void qemu_mutex_lock_iothread(void);
 void qemu_mutex_unlock_iothread(void);
 
+/* What the holder of the iothread mutex is doing, for info lockstats */
+enum {
+    IOTHREAD_LOCK_OTHER,
+    IOTHREAD_LOCK_MAIN_LOOP,
+    IOTHREAD_LOCK_VCPU,
+    IOTHREAD_LOCK_VCPU_PIO,
+    IOTHREAD_LOCK_VCPU_MMIO,
+    IOTHREAD_LOCK_MAX,
+};
+
+void qemu_mutex_iothread_set_site(int site);
+/* Count an exit that site handled without taking the mutex */
+void qemu_mutex_iothread_bypassed(int site);
+
 int qemu_open(const char *name, int flags, ...);
 ssize_t qemu_write_full(int fd, const void *buf, size_t count)
     QEMU_WARN_UNUSED_RESULT;
@@ -276,6 +300,9 @@ typedef uint64_t pcibus_t;
 
 void cpu_exec_init_all(unsigned long tb_size);
 
+/* Whether TCG optimizes the ops before it generates code from them */
+extern int tcg_optimize_enabled;
+
 /* CPU save/load.  */
 void cpu_save(QEMUFile *f, void *opaque);
 int cpu_load(QEMUFile *f, void *opaque, int version_id);
@@ -79,6 +79,49 @@ static QemuOptsList qemu_drive_opts = {
         },{
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "bps_rd",
+            .type = QEMU_OPT_SIZE,
+            .help = "limit read bandwidth (bytes per second)",
+        },{
+            .name = "bps_wr",
+            .type = QEMU_OPT_SIZE,
+            .help = "limit write bandwidth (bytes per second)",
+        },{
+            .name = "iops_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read requests per second",
+        },{
+            .name = "iops_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write requests per second",
+        },{
+            .name = "metadata_cache_size",
+            .type = QEMU_OPT_SIZE,
+            .help = "memory for the image format's metadata cache",
+        },{
+            .name = "elevator",
+            .type = QEMU_OPT_BOOL,
+            .help = "sort and merge the requests issued together",
+        },{
+            .name = "copy-on-read",
+            .type = QEMU_OPT_BOOL,
+            .help = "copy what is read from the backing file to the image",
+        },
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_backing_cache_opts = {
+    .name = "backing-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_backing_cache_opts.head),
+    .desc = {
+        {
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+        },{
+            .name = "path",
+            .type = QEMU_OPT_STRING,
         },
         { /* end of list */ }
     },
@@ -152,6 +195,12 @@ static QemuOptsList qemu_chardev_opts = {
         },{
             .name = "debug",
             .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "outbuf",
+            .type = QEMU_OPT_SIZE,
+        },{
+            .name = "overflow",
+            .type = QEMU_OPT_STRING,
         },
         { /* end of list */ }
     },
@@ -435,6 +484,38 @@ QemuOptsList qemu_spice_opts = {
     },
 };
 
+#ifdef CONFIG_IOTHREAD
+static QemuOptsList qemu_iothread_opts = {
+    .name = "iothread",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_iothread_opts.head),
+    .desc = {
+        { /* end of list */ }
+    },
+};
+
+static QemuOptsList qemu_vcpu_opts = {
+    .name = "vcpu",
+    .implied_opt_name = "vcpu",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_vcpu_opts.head),
+    .desc = {
+        {
+            .name = "vcpu",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "host-cpus",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "fifo",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "halt-poll",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end of list */ }
+    },
+};
+#endif
+
 QemuOptsList qemu_option_rom_opts = {
     .name = "option-rom",
     .implied_opt_name = "romfile",
@@ -453,6 +534,7 @@ QemuOptsList qemu_option_rom_opts = {
 
 static QemuOptsList *vm_config_groups[32] = {
     &qemu_drive_opts,
+    &qemu_backing_cache_opts,
     &qemu_chardev_opts,
     &qemu_device_opts,
     &qemu_netdev_opts,
@@ -465,26 +547,78 @@ static QemuOptsList *vm_config_groups[32] = {
     &qemu_trace_opts,
 #endif
     &qemu_option_rom_opts,
+#ifdef CONFIG_IOTHREAD
+    &qemu_iothread_opts,
+    &qemu_vcpu_opts,
+#endif
     NULL,
 };
 
-static QemuOptsList *find_list(QemuOptsList **lists, const char *group)
+#define CONFIG_GROUP_HASH_SIZE 64   /* open addressing, at least 2x groups */
+
+/* The groups of a NULL terminated array, hashed by name */
+typedef struct ConfigGroupIndex {
+    QemuOptsList **lists;       /* NULL until built */
+    QemuOptsList *slots[CONFIG_GROUP_HASH_SIZE];
+} ConfigGroupIndex;
+
+/* Dropped by qemu_add_opts() */
+static ConfigGroupIndex vm_config_index;
+
+static unsigned int config_group_hash(const char *s)
+{
+    unsigned int h = 5381;
+
+    while (*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h % CONFIG_GROUP_HASH_SIZE;
+}
+
+static void config_group_index_build(ConfigGroupIndex *idx,
+                                     QemuOptsList **lists)
 {
     int i;
 
+    memset(idx->slots, 0, sizeof(idx->slots));
     for (i = 0; lists[i] != NULL; i++) {
-        if (strcmp(lists[i]->name, group) == 0)
-            break;
+        unsigned int h = config_group_hash(lists[i]->name);
+
+        assert(i < CONFIG_GROUP_HASH_SIZE / 2);
+        while (idx->slots[h]) {
+            /* keep the first of two groups with the same name */
+            if (strcmp(idx->slots[h]->name, lists[i]->name) == 0) {
+                break;
+            }
+            h = (h + 1) % CONFIG_GROUP_HASH_SIZE;
+        }
+        if (!idx->slots[h]) {
+            idx->slots[h] = lists[i];
+        }
     }
-    if (lists[i] == NULL) {
-        error_report("there is no option group \"%s\"", group);
+    idx->lists = lists;
+}
+
+static QemuOptsList *find_list(ConfigGroupIndex *idx, const char *group)
+{
+    unsigned int h = config_group_hash(group);
+
+    while (idx->slots[h]) {
+        if (strcmp(idx->slots[h]->name, group) == 0) {
+            return idx->slots[h];
+        }
+        h = (h + 1) % CONFIG_GROUP_HASH_SIZE;
     }
-    return lists[i];
+    error_report("there is no option group \"%s\"", group);
+    return NULL;
 }
 
 QemuOptsList *qemu_find_opts(const char *group)
 {
-    return find_list(vm_config_groups, group);
+    if (vm_config_index.lists != vm_config_groups) {
+        config_group_index_build(&vm_config_index, vm_config_groups);
+    }
+    return find_list(&vm_config_index, group);
 }
 
 void qemu_add_opts(QemuOptsList *list)
@@ -496,6 +630,7 @@ void qemu_add_opts(QemuOptsList *list)
     for (i = 0; i < entries; i++) {
         if (vm_config_groups[i] == NULL) {
             vm_config_groups[i] = list;
+            vm_config_index.lists = NULL;
             return;
         }
     }
@@ -598,10 +733,20 @@ int qemu_config_parse(FILE *fp, QemuOptsList **lists, const char *fname)
 {
     char line[1024], group[64], id[64], arg[64], value[1024];
     Location loc;
+    ConfigGroupIndex local_index = { NULL }, *idx = &local_index;
     QemuOptsList *list = NULL;
     QemuOpts *opts = NULL;
     int res = -1, lno = 0;
 
+    /* Hash the groups once for the whole file rather than scanning them
+     * for every section */
+    if (lists == vm_config_groups) {
+        idx = &vm_config_index;
+    }
+    if (idx->lists != lists) {
+        config_group_index_build(idx, lists);
+    }
+
     loc_push_none(&loc);
     while (fgets(line, sizeof(line), fp) != NULL) {
         loc_set_file(fname, ++lno);
@@ -615,7 +760,7 @@ int qemu_config_parse(FILE *fp, QemuOptsList **lists, const char *fname)
         }
         if (sscanf(line, "[%63s \"%63[^\"]\"]", group, id) == 2) {
             /* group with id */
-            list = find_list(lists, group);
+            list = find_list(idx, group);
             if (list == NULL)
                 goto out;
             opts = qemu_opts_create(list, id, 1);
@@ -623,7 +768,7 @@ int qemu_config_parse(FILE *fp, QemuOptsList **lists, const char *fname)
         }
         if (sscanf(line, "[%63[^]]]", group) == 1) {
             /* group without id */
-            list = find_list(lists, group);
+            list = find_list(idx, group);
             if (list == NULL)
                 goto out;
             opts = qemu_opts_create(list, NULL, 0);
@@ -27,8 +27,13 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "qemu-timer.h"
 #include <stdio.h>
 
+#ifdef CONFIG_POSIX
+#include "qemu-thread.h"
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #endif
@@ -73,6 +78,8 @@ static void help(void)
            "    name=value format. Use -o ? for an overview of the options supported by the\n"
            "    used format\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '-p' show progress of command (only certain commands)\n"
+           "  '-m' number of chunks copied at the same time by convert (default 8)\n"
            "  '-u' enables unsafe rebasing. It is assumed that old and new backing file\n"
            "       match exactly. The image doesn't need a working backing file before\n"
            "       rebasing in this case (useful for renaming the backing file)\n"
@@ -497,13 +504,7 @@ static int img_commit(int argc, char **argv)
 
 static int is_not_zero(const uint8_t *sector, int len)
 {
-    int i;
-    len >>= 2;
-    for(i = 0;i < len; i++) {
-        if (((uint32_t *)sector)[i] != 0)
-            return 1;
-    }
-    return 0;
+    return !buffer_is_zero(sector, len);
 }
 
 /*
@@ -564,16 +565,600 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/*
+ * img_convert() keeps a number of chunks of the image in flight: they are
+ * read with AIO, and as soon as a chunk is read its writes are submitted,
+ * in the order of the output so that formats that allocate clusters lay
+ * them out sequentially.  Compressed clusters are compressed by a pool of
+ * threads and written in order by the main thread.
+ */
+
+/* Chunks of up to IO_BUF_SIZE in flight by default */
+#define CONVERT_CHUNKS 8
+
+/* Compression threads at most */
+#define CONVERT_MAX_THREADS 16
+
+enum {
+    CHUNK_READING,
+    CHUNK_READ,
+    CHUNK_COMPRESSING,
+    CHUNK_COMPRESSED,
+    CHUNK_WRITING,
+};
+
+typedef struct ConvertState ConvertState;
+
+typedef struct ConvertChunk {
+    ConvertState *s;
+    int state;
+    int64_t sector_num;         /* in the output */
+    int nb_sectors;
+    uint8_t *buf;
+    int pending;                /* reads or writes in flight */
+    int ret;
+    int zero;                   /* a compressed cluster of zeroes */
+    uint8_t *out_buf;           /* compressed cluster */
+    int out_len;
+    QTAILQ_ENTRY(ConvertChunk) entry;
+    QTAILQ_ENTRY(ConvertChunk) job_entry;
+} ConvertChunk;
+
+typedef struct ConvertIO {
+    ConvertChunk *chunk;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} ConvertIO;
+
+struct ConvertState {
+    BlockDriverState **bs;
+    int64_t *bs_start;          /* first sector of each input, and the end */
+    int bs_n;
+    BlockDriverState *out_bs;
+    int64_t total_sectors;
+    int64_t sector_num;         /* where the next chunk starts */
+    int64_t done_sectors;
+    int has_zero_init;
+    int out_baseimg;
+    int compress;
+    int cluster_sectors;
+    int max_chunks;
+    int nb_chunks;
+    BlockExtent extent;         /* last block map extent of an input */
+    int extent_bs;              /* which input, or -1 */
+    QTAILQ_HEAD(, ConvertChunk) chunks;     /* in the order of the output */
+    int ret;
+    const char *error;
+
+    int progress;
+    int64_t start_time;
+    int64_t last_print;
+
+#ifdef CONFIG_POSIX
+    /* compression threads */
+    int nb_threads;
+    QemuThread threads[CONVERT_MAX_THREADS];
+    QemuMutex lock;
+    QemuCond cond;
+    QTAILQ_HEAD(, ConvertChunk) jobs;       /* to compress */
+    QTAILQ_HEAD(, ConvertChunk) jobs_done;
+    int nb_jobs;                /* queued, running or done */
+    int quit;
+    int notify_fds[2];
+#endif
+};
+
+static void convert_error(ConvertState *s, int ret, const char *error)
+{
+    if (!s->ret) {
+        s->ret = ret;
+        s->error = error;
+    }
+}
+
+static void convert_print_progress(ConvertState *s, int force)
+{
+    int64_t now = get_clock();
+    double secs, rate;
+
+    if (!s->progress || (!force && now - s->last_print < 500000000LL)) {
+        return;
+    }
+    s->last_print = now;
+
+    secs = (now - s->start_time) / 1000000000.0;
+    rate = secs > 0 ? s->done_sectors * 512 / secs / (1024 * 1024) : 0;
+    printf("    (%.2f/100%%) %.1f MB/s\r",
+           s->total_sectors ? s->done_sectors * 100.0 / s->total_sectors : 100,
+           rate);
+    if (force) {
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static void convert_chunk_free(ConvertChunk *chunk)
+{
+    ConvertState *s = chunk->s;
+
+    QTAILQ_REMOVE(&s->chunks, chunk, entry);
+    s->nb_chunks--;
+    s->done_sectors += chunk->nb_sectors;
+    qemu_vfree(chunk->buf);
+    qemu_free(chunk->out_buf);
+    qemu_free(chunk);
+}
+
+#ifdef CONFIG_POSIX
+static void *convert_compress_thread(void *opaque)
+{
+    ConvertState *s = opaque;
+    ConvertChunk *chunk;
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        while (QTAILQ_EMPTY(&s->jobs) && !s->quit) {
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->quit) {
+            break;
+        }
+        chunk = QTAILQ_FIRST(&s->jobs);
+        QTAILQ_REMOVE(&s->jobs, chunk, job_entry);
+        qemu_mutex_unlock(&s->lock);
+
+        chunk->out_len = bdrv_compress_cluster(s->out_bs, chunk->buf,
+                                               chunk->out_buf);
+
+        qemu_mutex_lock(&s->lock);
+        QTAILQ_INSERT_TAIL(&s->jobs_done, chunk, job_entry);
+        if (write(s->notify_fds[1], "", 1) < 0) {
+            /* the pipe is full, the main thread is woken up anyway */
+        }
+    }
+    qemu_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static void convert_compress_done(void *opaque)
+{
+    ConvertState *s = opaque;
+    ConvertChunk *chunk;
+    char buf[64];
+
+    while (read(s->notify_fds[0], buf, sizeof(buf)) > 0) {
+        /* drain */
+    }
+
+    qemu_mutex_lock(&s->lock);
+    while ((chunk = QTAILQ_FIRST(&s->jobs_done)) != NULL) {
+        QTAILQ_REMOVE(&s->jobs_done, chunk, job_entry);
+        chunk->state = CHUNK_COMPRESSED;
+        s->nb_jobs--;
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+static int convert_compress_flush(void *opaque)
+{
+    ConvertState *s = opaque;
+
+    return s->nb_jobs > 0;
+}
+
+static void convert_start_threads(ConvertState *s)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (!bdrv_can_compress_cluster(s->out_bs) || qemu_pipe(s->notify_fds)) {
+        return;
+    }
+    fcntl(s->notify_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->notify_fds[1], F_SETFL, O_NONBLOCK);
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    QTAILQ_INIT(&s->jobs);
+    QTAILQ_INIT(&s->jobs_done);
+    qemu_aio_set_fd_handler(s->notify_fds[0], convert_compress_done, NULL,
+                            convert_compress_flush, NULL, s);
+
+    s->nb_threads = MIN(MAX(ncpus, 1), CONVERT_MAX_THREADS);
+    for (i = 0; i < s->nb_threads; i++) {
+        qemu_thread_create(&s->threads[i], convert_compress_thread, s);
+    }
+}
+
+static void convert_stop_threads(ConvertState *s)
+{
+    int i;
+
+    if (!s->nb_threads) {
+        return;
+    }
+    qemu_mutex_lock(&s->lock);
+    s->quit = 1;
+    qemu_cond_broadcast(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+    for (i = 0; i < s->nb_threads; i++) {
+        qemu_thread_join(&s->threads[i]);
+    }
+
+    qemu_aio_set_fd_handler(s->notify_fds[0], NULL, NULL, NULL, NULL, NULL);
+    close(s->notify_fds[0]);
+    close(s->notify_fds[1]);
+    qemu_cond_destroy(&s->cond);
+    qemu_mutex_destroy(&s->lock);
+}
+#endif
+
+/* A compressed cluster is read, compress it if it has data */
+static void convert_compress(ConvertChunk *chunk)
+{
+    ConvertState *s = chunk->s;
+    int cluster_size = s->cluster_sectors * 512;
+
+    if (chunk->nb_sectors < s->cluster_sectors) {
+        memset(chunk->buf + chunk->nb_sectors * 512, 0,
+               cluster_size - chunk->nb_sectors * 512);
+    }
+    if (!is_not_zero(chunk->buf, cluster_size)) {
+        chunk->zero = 1;
+        chunk->state = CHUNK_COMPRESSED;
+        return;
+    }
+
+#ifdef CONFIG_POSIX
+    if (s->nb_threads) {
+        chunk->out_buf = qemu_malloc(cluster_size);
+        chunk->state = CHUNK_COMPRESSING;
+        s->nb_jobs++;
+        qemu_mutex_lock(&s->lock);
+        QTAILQ_INSERT_TAIL(&s->jobs, chunk, job_entry);
+        qemu_cond_signal(&s->cond);
+        qemu_mutex_unlock(&s->lock);
+        return;
+    }
+#endif
+
+    /* bdrv_write_compressed() compresses it */
+    chunk->state = CHUNK_COMPRESSED;
+}
+
+/* One of the reads of chunk is done */
+static void convert_chunk_read(ConvertChunk *chunk, int ret)
+{
+    if (ret < 0 && !chunk->ret) {
+        chunk->ret = ret;
+    }
+    if (--chunk->pending > 0) {
+        return;
+    }
+
+    if (chunk->ret < 0) {
+        convert_error(chunk->s, chunk->ret, "error while reading");
+        chunk->state = CHUNK_READ;
+    } else if (chunk->s->compress) {
+        convert_compress(chunk);
+    } else {
+        chunk->state = CHUNK_READ;
+    }
+}
+
+static void convert_read_cb(void *opaque, int ret)
+{
+    ConvertIO *io = opaque;
+    ConvertChunk *chunk = io->chunk;
+
+    qemu_free(io);
+    convert_chunk_read(chunk, ret);
+}
+
+/* One of the writes of chunk is done */
+static void convert_chunk_written(ConvertChunk *chunk, int ret)
+{
+    if (ret < 0) {
+        convert_error(chunk->s, ret, "error while writing");
+    }
+    if (--chunk->pending == 0) {
+        convert_chunk_free(chunk);
+    }
+}
+
+static void convert_write_cb(void *opaque, int ret)
+{
+    ConvertIO *io = opaque;
+    ConvertChunk *chunk = io->chunk;
+
+    qemu_free(io);
+    convert_chunk_written(chunk, ret);
+}
+
+static ConvertIO *convert_io_new(ConvertChunk *chunk, uint8_t *buf, int n)
+{
+    ConvertIO *io = qemu_malloc(sizeof(*io));
+
+    io->chunk = chunk;
+    io->iov.iov_base = buf;
+    io->iov.iov_len = n * 512;
+    qemu_iovec_init_external(&io->qiov, &io->iov, 1);
+    return io;
+}
+
+/* The block map flags of the output sectors from sector_num on, in input
+   i; *pnum is set to the number of sectors in the same state */
+static int convert_get_extent(ConvertState *s, int i, int64_t sector_num,
+                              int64_t *pnum)
+{
+    BlockExtent *e = &s->extent;
+    int64_t local = sector_num - s->bs_start[i];
+
+    if (s->extent_bs != i || local < e->sector_num ||
+        local >= e->sector_num + e->nb_sectors) {
+        if (bdrv_get_block_map(s->bs[i], local,
+                               s->bs_start[i + 1] - sector_num, e, 1) <= 0) {
+            /* no map, copy everything */
+            s->extent_bs = -1;
+            *pnum = s->bs_start[i + 1] - sector_num;
+            return BDRV_EXTENT_ALLOCATED;
+        }
+        s->extent_bs = i;
+    }
+    *pnum = e->sector_num + e->nb_sectors - local;
+    return e->flags;
+}
+
+/* Find the next chunk to convert, 0 if there is none left */
+static int convert_next_chunk(ConvertState *s, int64_t *sector_num, int *n)
+{
+    while (s->sector_num < s->total_sectors) {
+        int64_t left = s->total_sectors - s->sector_num;
+        int64_t n1;
+        int i, flags;
+
+        for (i = 0; s->sector_num >= s->bs_start[i + 1]; i++) {
+            /* find the input */
+        }
+
+        if (s->compress) {
+            *n = MIN(left, s->cluster_sectors);
+            /* clusters of zeroes are not written, don't even read them */
+            if ((convert_get_extent(s, i, s->sector_num, &n1) &
+                 BDRV_EXTENT_ZERO) && n1 >= *n &&
+                s->sector_num % s->cluster_sectors == 0) {
+                n1 -= n1 % s->cluster_sectors;
+                n1 = n1 ? n1 : *n;
+                s->sector_num += n1;
+                s->done_sectors += n1;
+                continue;
+            }
+            *sector_num = s->sector_num;
+            s->sector_num += *n;
+            return 1;
+        }
+
+        *n = MIN(MIN(left, IO_BUF_SIZE / 512),
+                 s->bs_start[i + 1] - s->sector_num);
+
+        if (s->has_zero_init) {
+            flags = convert_get_extent(s, i, s->sector_num, &n1);
+
+            /* If the output image is being created as a copy on write image,
+               assume that sectors which are unallocated in the input image
+               are present in both the output's and input's base images (no
+               need to copy them).  Otherwise what reads as zeroes in the
+               input is zero in the output already. */
+            if (s->out_baseimg ? !(flags & BDRV_EXTENT_ALLOCATED) :
+                (flags & BDRV_EXTENT_ZERO)) {
+                s->sector_num += n1;
+                s->done_sectors += n1;
+                continue;
+            }
+            /* The next 'n1' sectors are allocated in the input image. Copy
+               only those as they may be followed by unallocated sectors. */
+            *n = MIN(*n, n1);
+        }
+
+        *sector_num = s->sector_num;
+        s->sector_num += *n;
+        return 1;
+    }
+    return 0;
+}
+
+/* Start reading the next chunk, 0 if there is none left */
+static int convert_start_chunk(ConvertState *s)
+{
+    ConvertChunk *chunk;
+    int64_t sector_num;
+    int n, i = 0;
+    uint8_t *buf;
+
+    if (!convert_next_chunk(s, &sector_num, &n)) {
+        return 0;
+    }
+
+    chunk = qemu_mallocz(sizeof(*chunk));
+    chunk->s = s;
+    chunk->state = CHUNK_READING;
+    chunk->sector_num = sector_num;
+    chunk->nb_sectors = n;
+    chunk->buf = qemu_blockalign(s->bs[0], s->compress ?
+                                 s->cluster_sectors * 512 : n * 512);
+    QTAILQ_INSERT_TAIL(&s->chunks, chunk, entry);
+    s->nb_chunks++;
+
+    /* a compressed cluster may span several inputs; the extra reference
+       keeps the chunk from completing before all of them are submitted */
+    chunk->pending = 1;
+    buf = chunk->buf;
+    while (n > 0) {
+        ConvertIO *io;
+        int nlow;
+
+        while (sector_num >= s->bs_start[i + 1]) {
+            i++;
+        }
+        nlow = MIN(n, s->bs_start[i + 1] - sector_num);
+
+        io = convert_io_new(chunk, buf, nlow);
+        chunk->pending++;
+        if (!bdrv_aio_readv(s->bs[i], sector_num - s->bs_start[i], &io->qiov,
+                            nlow, convert_read_cb, io)) {
+            convert_read_cb(io, -EIO);
+        }
+        sector_num += nlow;
+        buf += nlow * 512;
+        n -= nlow;
+    }
+    convert_chunk_read(chunk, 0);
+    return 1;
+}
+
+/* Submit the writes of a chunk that is read */
+static void convert_write_chunk(ConvertChunk *chunk)
+{
+    ConvertState *s = chunk->s;
+    int64_t sector_num = chunk->sector_num;
+    uint8_t *buf = chunk->buf;
+    int n = chunk->nb_sectors, n1;
+
+    chunk->state = CHUNK_WRITING;
+    chunk->pending = 1;
+
+    /* NOTE: at the same time we convert, we do not write zero
+       sectors to have a chance to compress the image. Ideally, we
+       should add a specific call to have the info to go faster */
+    while (n > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        int write = 1;
+
+        if (!s->has_zero_init || s->out_baseimg) {
+            n1 = n;
+        } else {
+            write = is_allocated_sectors(buf, n, &n1);
+        }
+        if (write) {
+            ConvertIO *io = convert_io_new(chunk, buf, n1);
+
+            chunk->pending++;
+            if (!bdrv_aio_writev(s->out_bs, sector_num, &io->qiov, n1,
+                                 convert_write_cb, io)) {
+                convert_write_cb(io, -EIO);
+            }
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * 512;
+    }
+    convert_chunk_written(chunk, 0);
+}
+
+static void convert_write_compressed(ConvertChunk *chunk)
+{
+    ConvertState *s = chunk->s;
+    int ret = 0;
+
+    if (chunk->zero) {
+        /* nothing to write */
+    } else if (chunk->out_buf) {
+        if (chunk->out_len < 0) {
+            ret = chunk->out_len;
+        } else {
+            ret = bdrv_write_compressed_cluster(s->out_bs, chunk->sector_num,
+                                                chunk->buf, chunk->out_buf,
+                                                chunk->out_len);
+        }
+    } else {
+        ret = bdrv_write_compressed(s->out_bs, chunk->sector_num, chunk->buf,
+                                    s->cluster_sectors);
+    }
+    if (ret < 0) {
+        convert_error(s, ret, "error while compressing");
+    }
+    convert_chunk_free(chunk);
+}
+
+/* Write the chunks that are ready, in order */
+static void convert_process_chunks(ConvertState *s)
+{
+    ConvertChunk *chunk, *next;
+
+    QTAILQ_FOREACH_SAFE(chunk, &s->chunks, entry, next) {
+        if (chunk->state == CHUNK_READING ||
+            chunk->state == CHUNK_COMPRESSING) {
+            break;
+        } else if (s->ret) {
+            /* drop what is read, wait for what is in flight */
+            if (chunk->state != CHUNK_WRITING) {
+                convert_chunk_free(chunk);
+            }
+        } else if (chunk->state == CHUNK_READ) {
+            convert_write_chunk(chunk);
+        } else if (chunk->state == CHUNK_COMPRESSED) {
+            convert_write_compressed(chunk);
+        }
+    }
+}
+
+/* Copy the inputs to the output, returns 0 or -errno */
+static int convert_copy(ConvertState *s)
+{
+    QTAILQ_INIT(&s->chunks);
+    s->start_time = get_clock();
+    s->last_print = 0;
+    convert_print_progress(s, 0);
+
+#ifdef CONFIG_POSIX
+    if (s->compress) {
+        convert_start_threads(s);
+    }
+#endif
+
+    for (;;) {
+        while (!s->ret && s->nb_chunks < s->max_chunks &&
+               convert_start_chunk(s)) {
+            /* fill the pipeline */
+        }
+        convert_process_chunks(s);
+        if (QTAILQ_EMPTY(&s->chunks) &&
+            (s->ret || s->sector_num >= s->total_sectors)) {
+            break;
+        }
+        qemu_aio_wait();
+        convert_print_progress(s, 0);
+    }
+
+#ifdef CONFIG_POSIX
+    convert_stop_threads(s);
+#endif
+
+    if (s->ret) {
+        error_report("%s", s->error);
+        return s->ret;
+    }
+    convert_print_progress(s, 1);
+    return 0;
+}
+
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size;
+    int progress = 0, nb_chunks = CONVERT_CHUNKS;
     const char *fmt, *out_fmt, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    ConvertState state;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -584,8 +1169,9 @@ static int img_convert(int argc, char **argv)
     out_fmt = "raw";
     out_baseimg = NULL;
     compress = 0;
+    state.bs_start = NULL;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pm:");
         if (c == -1) {
             break;
         }
@@ -620,6 +1206,17 @@ static int img_convert(int argc, char **argv)
         case 's':
             snapshot_name = optarg;
             break;
+        case 'p':
+            progress = 1;
+            break;
+        case 'm':
+            nb_chunks = atoi(optarg);
+            if (nb_chunks < 1 || nb_chunks > 64) {
+                error_report("Invalid number of requests '%s', it must be "
+                             "between 1 and 64", optarg);
+                return 1;
+            }
+            break;
         }
     }
 
@@ -754,10 +1351,23 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_malloc(IO_BUF_SIZE);
+    memset(&state, 0, sizeof(state));
+    state.bs = bs;
+    state.bs_n = bs_n;
+    state.bs_start = qemu_malloc((bs_n + 1) * sizeof(int64_t));
+    state.bs_start[0] = 0;
+    for (bs_i = 0; bs_i < bs_n; bs_i++) {
+        bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        state.bs_start[bs_i + 1] = state.bs_start[bs_i] + bs_sectors;
+    }
+    state.out_bs = out_bs;
+    state.total_sectors = total_sectors;
+    state.has_zero_init = bdrv_has_zero_init(out_bs);
+    state.out_baseimg = out_baseimg != NULL;
+    state.compress = compress;
+    state.max_chunks = nb_chunks;
+    state.progress = progress;
+    state.extent_bs = -1;
 
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -771,153 +1381,20 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading");
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
+        state.cluster_sectors = cluster_size >> 9;
+        /* as much data in flight as without compression */
+        state.max_chunks = nb_chunks * (IO_BUF_SIZE / cluster_size);
+    }
 
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (is_not_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64,
-                          sector_num);
-                    goto out;
-                }
-            }
-            sector_num += n;
-        }
+    ret = convert_copy(&state);
+    if (ret == 0 && compress) {
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading");
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors(buf1, n, &n1)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing");
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-        }
     }
 out:
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_free(buf);
+    qemu_free(state.bs_start);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1058,6 +1535,91 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+static const char *extent_type(int flags)
+{
+    switch (flags) {
+    case BDRV_EXTENT_ALLOCATED:
+        return "data";
+    case BDRV_EXTENT_ALLOCATED | BDRV_EXTENT_ZERO:
+        return "zero";
+    case BDRV_EXTENT_ZERO:
+        return "unallocated";
+    default:
+        return "backing file";
+    }
+}
+
+static int img_map(int argc, char **argv)
+{
+    int c, i, n, ret = 0;
+    const char *filename, *fmt;
+    BlockDriverState *bs;
+    BlockExtent extents[64], cur;
+    int64_t sector_num, total_sectors;
+
+    fmt = NULL;
+    for(;;) {
+        c = getopt(argc, argv, "f:h");
+        if (c == -1) {
+            break;
+        }
+        switch(c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS);
+    if (!bs) {
+        return 1;
+    }
+    total_sectors = bdrv_getlength(bs) / 512;
+
+    printf("%-20s%-20s%s\n", "Offset", "Length", "Type");
+    cur.nb_sectors = 0;
+    for (sector_num = 0; sector_num < total_sectors; ) {
+        n = bdrv_get_block_map(bs, sector_num, total_sectors - sector_num,
+                               extents, ARRAY_SIZE(extents));
+        if (n < 0) {
+            error_report("Could not read the block map: %s", strerror(-n));
+            ret = 1;
+            break;
+        } else if (n == 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (cur.nb_sectors && cur.flags == extents[i].flags) {
+                cur.nb_sectors += extents[i].nb_sectors;
+                continue;
+            }
+            if (cur.nb_sectors) {
+                printf("%#-20" PRIx64 "%#-20" PRIx64 "%s\n",
+                       cur.sector_num * 512, cur.nb_sectors * 512,
+                       extent_type(cur.flags));
+            }
+            cur = extents[i];
+        }
+        sector_num = extents[n - 1].sector_num + extents[n - 1].nb_sectors;
+    }
+    if (cur.nb_sectors) {
+        printf("%#-20" PRIx64 "%#-20" PRIx64 "%s\n",
+               cur.sector_num * 512, cur.nb_sectors * 512,
+               extent_type(cur.flags));
+    }
+
+    bdrv_delete(bs);
+    return ret;
+}
+
 #define SNAPSHOT_LIST   1
 #define SNAPSHOT_CREATE 2
 #define SNAPSHOT_APPLY  3
@@ -1292,7 +1854,7 @@ static int img_rebase(int argc, char **argv)
     if (!unsafe) {
         uint64_t num_sectors;
         uint64_t sector;
-        int n;
+        int64_t n;
         uint8_t * buf_old;
         uint8_t * buf_new;
 
@@ -1302,20 +1864,27 @@ static int img_rebase(int argc, char **argv)
         bdrv_get_geometry(bs, &num_sectors);
 
         for (sector = 0; sector < num_sectors; sector += n) {
+            BlockExtent extent;
 
-            /* How many sectors can we handle with the next read? */
-            if (sector + (IO_BUF_SIZE / 512) <= num_sectors) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = num_sectors - sector;
+            ret = bdrv_get_block_map(bs, sector, num_sectors - sector,
+                                     &extent, 1);
+            if (ret < 0) {
+                error_report("Could not read the block map: %s",
+                             strerror(-ret));
+                goto out;
+            } else if (ret == 0) {
+                break;
             }
 
-            /* If the cluster is allocated, we don't need to take action */
-            ret = bdrv_is_allocated(bs, sector, n, &n);
-            if (ret) {
+            /* If the clusters are allocated, we don't need to take action */
+            n = extent.nb_sectors;
+            if (extent.flags & BDRV_EXTENT_ALLOCATED) {
                 continue;
             }
 
+            /* How many sectors can we handle with the next read? */
+            n = MIN(n, IO_BUF_SIZE / 512);
+
             /* Read old and new backing file */
             ret = bdrv_read(bs_old_backing, sector, buf_old, n);
             if (ret < 0) {
@@ -15,6 +15,7 @@
 #include <libgen.h>
 
 #include "qemu-common.h"
+#include "qemu-timer.h"
 #include "block_int.h"
 #include "cmd.h"
 
@@ -1568,6 +1569,286 @@ static const cmdinfo_t map_cmd = {
        .oneline        = "prints the allocated areas of a file",
 };
 
+/*
+ * Benchmark mode: keeps a number of requests in flight for a given time,
+ * like fio, and reports the IOPS, bandwidth and latency percentiles of
+ * the reads and the writes.
+ */
+
+struct bench_stats {
+	int64_t		*lat;		/* ns, one per completed request */
+	int		nr, alloc;
+	int64_t		bytes;
+	int64_t		total_ns;
+};
+
+struct bench_req {
+	struct bench_state *s;
+	QEMUIOVector	qiov;
+	struct iovec	iov;
+	void		*buf;
+	int		is_write;
+	int64_t		start;
+};
+
+struct bench_state {
+	int64_t		offset, length;	/* the range requests go to */
+	int64_t		next;		/* next sequential offset */
+	int		bsize;
+	int		read_pct;
+	int		random_pct;
+	int64_t		end;		/* stop submitting, in ns */
+	int		in_flight;
+	int		errors;
+	struct bench_stats stats[2];	/* reads, writes */
+};
+
+static void bench_submit(struct bench_req *req);
+
+static void
+bench_add(struct bench_stats *st, int64_t ns, int bytes)
+{
+	if (st->nr == st->alloc) {
+		st->alloc = st->alloc ? st->alloc * 2 : 65536;
+		st->lat = qemu_realloc(st->lat, st->alloc * sizeof(*st->lat));
+	}
+	st->lat[st->nr++] = ns;
+	st->bytes += bytes;
+	st->total_ns += ns;
+}
+
+static void
+bench_done(void *opaque, int ret)
+{
+	struct bench_req *req = opaque;
+	struct bench_state *s = req->s;
+
+	s->in_flight--;
+	if (ret < 0) {
+		if (!s->errors++) {
+			printf("%s failed: %s\n", req->is_write ? "write" : "read",
+			       strerror(-ret));
+		}
+	} else {
+		bench_add(&s->stats[req->is_write], get_clock() - req->start,
+			  s->bsize);
+	}
+	if (!s->errors && get_clock() < s->end) {
+		bench_submit(req);
+	}
+}
+
+static void
+bench_submit(struct bench_req *req)
+{
+	struct bench_state *s = req->s;
+	int64_t blocks = s->length / s->bsize;
+	int64_t offset;
+	BlockDriverAIOCB *acb;
+
+	if (rand() % 100 < s->random_pct) {
+		offset = (((int64_t)rand() << 31) ^ rand()) % blocks;
+	} else {
+		offset = s->next;
+		s->next = (s->next + 1) % blocks;
+	}
+	offset = s->offset + offset * s->bsize;
+	req->is_write = rand() % 100 >= s->read_pct;
+
+	s->in_flight++;
+	req->start = get_clock();
+	if (req->is_write) {
+		acb = bdrv_aio_writev(bs, offset >> 9, &req->qiov,
+				      s->bsize >> 9, bench_done, req);
+	} else {
+		acb = bdrv_aio_readv(bs, offset >> 9, &req->qiov,
+				     s->bsize >> 9, bench_done, req);
+	}
+	if (!acb) {
+		bench_done(req, -EIO);
+	}
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int64_t
+bench_percentile(struct bench_stats *st, double frac)
+{
+	return st->lat[MIN((int)(st->nr * frac), st->nr - 1)];
+}
+
+static void
+bench_report(const char *op, struct bench_stats *st, double secs, int Cflag)
+{
+	char s1[64], s2[64];
+
+	if (!st->nr) {
+		return;
+	}
+	qsort(st->lat, st->nr, sizeof(*st->lat), bench_cmp);
+	if (Cflag) {
+		/* op,ops,bytes,secs,ops/sec,bytes/sec,avg,p50,p90,p99,p99.9,max */
+		printf("%s,%d,%" PRId64 ",%.3f,%.3f,%.3f,%" PRId64 ",%" PRId64
+		       ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "\n",
+		       op, st->nr, st->bytes, secs, st->nr / secs,
+		       st->bytes / secs, st->total_ns / st->nr,
+		       bench_percentile(st, 0.5), bench_percentile(st, 0.9),
+		       bench_percentile(st, 0.99), bench_percentile(st, 0.999),
+		       st->lat[st->nr - 1]);
+		return;
+	}
+	cvtstr((double)st->bytes, s1, sizeof(s1));
+	cvtstr(st->bytes / secs, s2, sizeof(s2));
+	printf("%-5s: %d ops, %s; %.1f ops/sec, %s/sec\n",
+	       op, st->nr, s1, st->nr / secs, s2);
+	printf("       latency us: avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+	       "p99.9 %.1f, max %.1f\n",
+	       st->total_ns / st->nr / 1e3,
+	       bench_percentile(st, 0.5) / 1e3,
+	       bench_percentile(st, 0.9) / 1e3,
+	       bench_percentile(st, 0.99) / 1e3,
+	       bench_percentile(st, 0.999) / 1e3,
+	       st->lat[st->nr - 1] / 1e3);
+}
+
+static void
+bench_help(void)
+{
+	printf(
+"\n"
+" runs a benchmark with several requests in flight\n"
+"\n"
+" Example:\n"
+" 'bench -d 32 -s 4k -R 100 -r 70 -t 10' - 10 seconds of random 4k I/O,\n"
+" 70%% reads and 30%% writes, with 32 requests in flight\n"
+"\n"
+" Keeps submitting asynchronous requests to the range of the currently\n"
+" open file until the time is up, and reports the operations and bytes\n"
+" per second and the latency percentiles of reads and writes.\n"
+" Writes overwrite the data with a pattern (0xcd).\n"
+" -d, -- requests in flight (default 1)\n"
+" -s, -- request size (default 4k)\n"
+" -r, -- percentage of reads, the rest are writes (default 100)\n"
+" -R, -- percentage of random requests, the rest are sequential\n"
+"        (default 0)\n"
+" -t, -- duration in seconds (default 5)\n"
+" -o, -- start of the range (default 0)\n"
+" -l, -- length of the range (default up to the end of the file)\n"
+" -C, -- report statistics in a machine parsable format\n"
+"\n");
+}
+
+static int bench_f(int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+	.name		= "bench",
+	.cfunc		= bench_f,
+	.argmin		= 0,
+	.argmax		= -1,
+	.args		= "[-C] [-d depth] [-s size] [-r read%] [-R random%] "
+			  "[-t secs] [-o off] [-l len]",
+	.oneline	= "measures the performance of the block driver",
+	.help		= bench_help,
+};
+
+static int
+bench_f(int argc, char **argv)
+{
+	struct bench_state s;
+	struct bench_req *reqs;
+	int depth = 1, secs = 5, Cflag = 0;
+	int64_t start, elapsed, size;
+	int c, i;
+
+	memset(&s, 0, sizeof(s));
+	s.bsize = 4096;
+	s.read_pct = 100;
+	s.length = -1;
+
+	while ((c = getopt(argc, argv, "Cd:s:r:R:t:o:l:")) != EOF) {
+		switch (c) {
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 's':
+			s.bsize = cvtnum(optarg);
+			break;
+		case 'r':
+			s.read_pct = atoi(optarg);
+			break;
+		case 'R':
+			s.random_pct = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 'o':
+			s.offset = cvtnum(optarg);
+			break;
+		case 'l':
+			s.length = cvtnum(optarg);
+			break;
+		default:
+			return command_usage(&bench_cmd);
+		}
+	}
+	if (optind != argc) {
+		return command_usage(&bench_cmd);
+	}
+
+	size = bdrv_getlength(bs);
+	if (s.length < 0) {
+		s.length = size - s.offset;
+	}
+	if (depth < 1 || secs < 1 || s.bsize <= 0 || (s.bsize & 0x1ff) ||
+	    (s.offset & 0x1ff) || s.offset < 0 || s.length < s.bsize ||
+	    s.offset + s.length > size ||
+	    s.read_pct < 0 || s.read_pct > 100 ||
+	    s.random_pct < 0 || s.random_pct > 100) {
+		printf("invalid benchmark parameters\n");
+		return 0;
+	}
+
+	reqs = qemu_mallocz(depth * sizeof(*reqs));
+	for (i = 0; i < depth; i++) {
+		reqs[i].s = &s;
+		reqs[i].buf = qemu_io_alloc(s.bsize, 0xcd);
+		reqs[i].iov.iov_base = reqs[i].buf;
+		reqs[i].iov.iov_len = s.bsize;
+		qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+	}
+
+	start = get_clock();
+	s.end = start + secs * 1000000000LL;
+	for (i = 0; i < depth && !s.errors; i++) {
+		bench_submit(&reqs[i]);
+	}
+	while (s.in_flight) {
+		qemu_aio_wait();
+	}
+	elapsed = get_clock() - start;
+
+	bench_report("read", &s.stats[0], elapsed / 1e9, Cflag);
+	bench_report("write", &s.stats[1], elapsed / 1e9, Cflag);
+
+	for (i = 0; i < depth; i++) {
+		qemu_io_free(reqs[i].buf);
+	}
+	qemu_free(reqs);
+	qemu_free(s.stats[0].lat);
+	qemu_free(s.stats[1].lat);
+	return 0;
+}
+
 
 static int
 close_f(int argc, char **argv)
@@ -1807,6 +2088,7 @@ int main(int argc, char **argv)
 	add_command(&discard_cmd);
 	add_command(&alloc_cmd);
 	add_command(&map_cmd);
+	add_command(&bench_cmd);
 
 	add_args_command(init_args_command);
 	add_check_command(init_check_command);
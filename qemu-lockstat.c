@@ -0,0 +1,276 @@
+/*
+ * Contention statistics for mutexes
+ *
+ * Counts the acquisitions of a mutex and how many of them found it taken,
+ * keeps log2 histograms of the time spent waiting for it and holding it,
+ * and attributes acquisitions and waits to the code that took the mutex,
+ * by return address.  Waiting threads only update the statistics once
+ * they hold the mutex, so the statistics need no lock of their own.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <dlfcn.h>
+#include <time.h>
+
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "qemu-lockstat.h"
+
+#define LOCK_STATS_BUCKETS  40      /* up to 2^40 ns, about 18 minutes */
+#define LOCK_STATS_CALLERS  32
+#define LOCK_STATS_TOP      8
+
+typedef struct LockCaller {
+    void *addr;
+    uint64_t count;
+    uint64_t contended;
+    int64_t wait_ns;
+} LockCaller;
+
+struct QemuLockStats {
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t contended;
+    int64_t wait_ns;
+    int64_t hold_ns;
+    int64_t max_wait_ns;
+    int64_t max_hold_ns;
+    uint64_t wait_hist[LOCK_STATS_BUCKETS];
+    uint64_t hold_hist[LOCK_STATS_BUCKETS];
+    LockCaller callers[LOCK_STATS_CALLERS];
+    uint64_t other_callers;     /* acquisitions once callers[] is full */
+    int64_t held_since;         /* 0 if not held, or not timed */
+    QemuLockStats *next;
+};
+
+static QemuLockStats *lock_stats_list;
+static pthread_mutex_t lock_stats_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t lock_stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void lock_stats_hist_add(uint64_t *hist, int64_t ns)
+{
+    int bucket = ns > 1 ? 63 - clz64(ns) : 0;
+
+    hist[MIN(bucket, LOCK_STATS_BUCKETS - 1)]++;
+}
+
+QemuLockStats *qemu_lock_stats_new(const char *name)
+{
+    QemuLockStats *s = qemu_mallocz(sizeof(*s));
+
+    s->name = name;
+    pthread_mutex_lock(&lock_stats_list_lock);
+    s->next = lock_stats_list;
+    lock_stats_list = s;
+    pthread_mutex_unlock(&lock_stats_list_lock);
+    return s;
+}
+
+static void lock_stats_account(QemuLockStats *s, void *caller,
+                               int contended, int64_t wait_ns)
+{
+    int i;
+
+    s->acquisitions++;
+    if (contended) {
+        s->contended++;
+        s->wait_ns += wait_ns;
+        s->max_wait_ns = MAX(s->max_wait_ns, wait_ns);
+    }
+    lock_stats_hist_add(s->wait_hist, wait_ns);
+
+    for (i = 0; i < LOCK_STATS_CALLERS; i++) {
+        LockCaller *c = &s->callers[i];
+
+        if (c->addr == caller || !c->addr) {
+            c->addr = caller;
+            c->count++;
+            c->contended += contended;
+            c->wait_ns += wait_ns;
+            break;
+        }
+    }
+    if (i == LOCK_STATS_CALLERS) {
+        s->other_callers++;
+    }
+}
+
+int qemu_lock_stats_lock(QemuLockStats *s, pthread_mutex_t *lock,
+                         void *caller)
+{
+    int64_t start, now;
+    int err;
+
+    err = pthread_mutex_trylock(lock);
+    if (err == 0) {
+        now = lock_stats_clock();
+        lock_stats_account(s, caller, 0, 0);
+        s->held_since = now;
+        return 0;
+    }
+    if (err != EBUSY) {
+        return err;
+    }
+
+    start = lock_stats_clock();
+    err = pthread_mutex_lock(lock);
+    if (err) {
+        return err;
+    }
+    now = lock_stats_clock();
+    lock_stats_account(s, caller, 1, now - start);
+    s->held_since = now;
+    return 0;
+}
+
+void qemu_lock_stats_acquired(QemuLockStats *s, void *caller)
+{
+    lock_stats_account(s, caller, 0, 0);
+    s->held_since = lock_stats_clock();
+}
+
+void qemu_lock_stats_release(QemuLockStats *s)
+{
+    int64_t hold;
+
+    if (!s->held_since) {
+        return;
+    }
+    hold = lock_stats_clock() - s->held_since;
+    s->held_since = 0;
+    s->hold_ns += hold;
+    s->max_hold_ns = MAX(s->max_hold_ns, hold);
+    lock_stats_hist_add(s->hold_hist, hold);
+}
+
+void qemu_lock_stats_resume(QemuLockStats *s)
+{
+    s->held_since = lock_stats_clock();
+}
+
+/* Upper bound of the bucket holding the given fraction of the samples */
+static int64_t lock_stats_percentile(const uint64_t *hist, uint64_t total,
+                                     double frac)
+{
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < LOCK_STATS_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen && seen >= total * frac) {
+            return 2LL << i;
+        }
+    }
+    return 0;
+}
+
+static int compare_callers(const void *a, const void *b)
+{
+    const LockCaller *ca = a, *cb = b;
+
+    if (ca->wait_ns != cb->wait_ns) {
+        return ca->wait_ns < cb->wait_ns ? 1 : -1;
+    }
+    if (ca->count != cb->count) {
+        return ca->count < cb->count ? 1 : -1;
+    }
+    return 0;
+}
+
+/* The object and offset of addr, for addr2line -e */
+static void lock_stats_symbolize(void *addr, char *buf, int size)
+{
+    Dl_info info;
+
+    if (dladdr(addr, &info) && info.dli_fname) {
+        const char *base = strrchr(info.dli_fname, '/');
+
+        if (info.dli_sname && info.dli_saddr) {
+            snprintf(buf, size, "%s+0x%lx", info.dli_sname,
+                     (unsigned long)((char *)addr - (char *)info.dli_saddr));
+        } else {
+            snprintf(buf, size, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+                     (unsigned long)((char *)addr - (char *)info.dli_fbase));
+        }
+    } else {
+        snprintf(buf, size, "%p", addr);
+    }
+}
+
+static void lock_stats_dump_hist(FILE *f,
+                                 int (*fprintf_fn)(FILE *f,
+                                                   const char *fmt, ...),
+                                 const char *what, const uint64_t *hist)
+{
+    int i;
+
+    fprintf_fn(f, "  %s histogram (ns, count):", what);
+    for (i = 0; i < LOCK_STATS_BUCKETS; i++) {
+        if (hist[i]) {
+            fprintf_fn(f, " <%" PRId64 ":%" PRIu64, 2LL << i, hist[i]);
+        }
+    }
+    fprintf_fn(f, "\n");
+}
+
+void qemu_lock_stats_dump(FILE *f,
+                          int (*fprintf_fn)(FILE *f, const char *fmt, ...))
+{
+    QemuLockStats *s;
+
+    pthread_mutex_lock(&lock_stats_list_lock);
+    for (s = lock_stats_list; s; s = s->next) {
+        LockCaller callers[LOCK_STATS_CALLERS];
+        uint64_t n = s->acquisitions;
+        int i;
+
+        fprintf_fn(f, "%s: %" PRIu64 " acquisitions, %" PRIu64
+                   " contended (%.2f%%)\n", s->name, n, s->contended,
+                   s->contended * 100.0 / MAX(n, 1));
+        if (!n) {
+            continue;
+        }
+        fprintf_fn(f, "  wait ns: avg %" PRId64 " (contended), p50 %"
+                   PRId64 ", p99 %" PRId64 ", max %" PRId64 "\n",
+                   s->wait_ns / (int64_t)MAX(s->contended, 1),
+                   lock_stats_percentile(s->wait_hist, n, 0.5),
+                   lock_stats_percentile(s->wait_hist, n, 0.99),
+                   s->max_wait_ns);
+        fprintf_fn(f, "  hold ns: avg %" PRId64 ", p50 %" PRId64 ", p99 %"
+                   PRId64 ", max %" PRId64 "\n", s->hold_ns / (int64_t)n,
+                   lock_stats_percentile(s->hold_hist, n, 0.5),
+                   lock_stats_percentile(s->hold_hist, n, 0.99),
+                   s->max_hold_ns);
+        lock_stats_dump_hist(f, fprintf_fn, "wait", s->wait_hist);
+        lock_stats_dump_hist(f, fprintf_fn, "hold", s->hold_hist);
+
+        memcpy(callers, s->callers, sizeof(callers));
+        qsort(callers, LOCK_STATS_CALLERS, sizeof(callers[0]),
+              compare_callers);
+        fprintf_fn(f, "  top callers by wait:\n");
+        for (i = 0; i < LOCK_STATS_TOP && callers[i].addr; i++) {
+            char sym[256];
+
+            lock_stats_symbolize(callers[i].addr, sym, sizeof(sym));
+            fprintf_fn(f, "    %-40s %10" PRIu64 " acq %10" PRIu64
+                       " contended %12" PRId64 " ns waited\n", sym,
+                       callers[i].count, callers[i].contended,
+                       callers[i].wait_ns);
+        }
+        if (s->other_callers) {
+            fprintf_fn(f, "    (%" PRIu64 " acquisitions by other callers)\n",
+                       s->other_callers);
+        }
+    }
+    pthread_mutex_unlock(&lock_stats_list_lock);
+}
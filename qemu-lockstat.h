@@ -0,0 +1,45 @@
+/*
+ * Contention statistics for mutexes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_LOCKSTAT_H
+#define QEMU_LOCKSTAT_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+typedef struct QemuLockStats QemuLockStats;
+
+/*
+ * Only built with --enable-mutex-stats.  Every function but
+ * qemu_lock_stats_new() and qemu_lock_stats_dump() must be called by
+ * the holder of the mutex, or by the thread about to take it, so that
+ * the statistics are only touched with the mutex held.
+ */
+
+/* Statistics that live as long as the program, listed under name */
+QemuLockStats *qemu_lock_stats_new(const char *name);
+
+/* pthread_mutex_lock(), noting whether it had to wait and for how long;
+   caller is the code the acquisition is attributed to */
+int qemu_lock_stats_lock(QemuLockStats *s, pthread_mutex_t *lock,
+                         void *caller);
+
+/* An acquisition that did not go through qemu_lock_stats_lock() */
+void qemu_lock_stats_acquired(QemuLockStats *s, void *caller);
+
+/* The mutex is about to be released, or to be given up by a wait on a
+   condition variable */
+void qemu_lock_stats_release(QemuLockStats *s);
+
+/* The mutex is held again after a wait on a condition variable; this is
+   not counted as an acquisition */
+void qemu_lock_stats_resume(QemuLockStats *s);
+
+void qemu_lock_stats_dump(FILE *f,
+                          int (*fprintf_fn)(FILE *f, const char *fmt, ...));
+
+#endif
@@ -25,6 +25,13 @@
 #include "trace.h"
 #include <stdlib.h>
 
+static uint64_t malloc_calls;
+
+uint64_t qemu_malloc_calls(void)
+{
+    return malloc_calls;
+}
+
 void qemu_free(void *ptr)
 {
     trace_qemu_free(ptr);
@@ -47,6 +54,7 @@ void *qemu_malloc(size_t size)
         abort();
     }
     ptr = qemu_oom_check(malloc(size ? size : 1));
+    malloc_calls++;
     trace_qemu_malloc(size, ptr);
     return ptr;
 }
@@ -58,6 +66,7 @@ void *qemu_realloc(void *ptr, size_t size)
         abort();
     }
     newptr = qemu_oom_check(realloc(ptr, size ? size : 1));
+    malloc_calls++;
     trace_qemu_realloc(ptr, size, newptr);
     return newptr;
 }
@@ -69,6 +78,7 @@ void *qemu_mallocz(size_t size)
         abort();
     }
     ptr = qemu_oom_check(calloc(1, size ? size : 1));
+    malloc_calls++;
     trace_qemu_malloc(size, ptr);
     return ptr;
 }
@@ -18,6 +18,7 @@
 
 #include <qemu-common.h>
 #include "block_int.h"
+#include "qemu_socket.h"
 #include "nbd.h"
 
 #include <stdarg.h>
@@ -31,13 +32,419 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <libgen.h>
+#ifdef CONFIG_LINUX
+#include <sys/sendfile.h>
+#endif
 
 #define SOCKET_PATH    "/var/lock/qemu-nbd-%s"
 
 #define NBD_BUFFER_SIZE (1024*1024)
 
+/* Requests of a client that are served at the same time */
+#define NBD_MAX_REQUESTS 16
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
 static int verbose;
 
+/*
+ * The server: every client socket is driven by AIO fd handlers, and its
+ * requests go to the block layer asynchronously, so that many clients
+ * with many requests each are served at once.  Replies go out in the
+ * order the requests complete.
+ *
+ * Reads of an image whose data is a host file as is are answered with
+ * sendfile() from that file, without copying the data through qemu-nbd.
+ */
+
+typedef struct NBDClient NBDClient;
+
+typedef struct NBDServerRequest {
+    NBDClient *client;
+    struct nbd_request request;
+    uint8_t reply[NBD_REPLY_SIZE];
+    uint8_t *data;              /* NULL if it is sent from the host file */
+    struct iovec iov;
+    QEMUIOVector qiov;
+    size_t received;            /* of the data of a write */
+    size_t sent;                /* of the reply, then of the data */
+    size_t data_len;            /* to send after the reply */
+    QTAILQ_ENTRY(NBDServerRequest) entry;
+} NBDServerRequest;
+
+struct NBDClient {
+    int sock;
+    uint8_t request_buf[NBD_REQUEST_SIZE];
+    size_t request_received;
+    NBDServerRequest *receiving;    /* the write whose data comes in */
+    QTAILQ_HEAD(, NBDServerRequest) replies;    /* ready to be sent */
+    int nb_requests;            /* received and not completely answered */
+    int closing;
+};
+
+typedef struct NBDExport {
+    BlockDriverState *bs;
+    off_t size;
+    off_t dev_offset;
+    bool readonly;
+    int fd;                     /* host file with the data, or -1 */
+    bool sendfile;              /* reads are sent from fd */
+    int listen_fd;
+    int nb_clients;
+    int max_clients;
+} NBDExport;
+
+static NBDExport export;
+
+static void nbd_client_read(void *opaque);
+static void nbd_client_write(void *opaque);
+static void nbd_accept(void *opaque);
+
+static void nbd_update_listen_handler(void)
+{
+    qemu_aio_set_fd_handler(export.listen_fd,
+                            export.nb_clients < export.max_clients ?
+                            nbd_accept : NULL, NULL, NULL, NULL, NULL);
+}
+
+static void nbd_client_update_handlers(NBDClient *c)
+{
+    int can_read = c->receiving || c->nb_requests < NBD_MAX_REQUESTS;
+
+    qemu_aio_set_fd_handler(c->sock, can_read ? nbd_client_read : NULL,
+                            QTAILQ_EMPTY(&c->replies) ?
+                            NULL : nbd_client_write,
+                            NULL, NULL, c);
+}
+
+/* A closing client goes away once the block layer is done with all of its
+   requests */
+static void nbd_client_put(NBDClient *c)
+{
+    if (!c->closing || c->nb_requests) {
+        return;
+    }
+    close(c->sock);
+    qemu_free(c);
+    export.nb_clients--;
+    nbd_update_listen_handler();
+}
+
+static void nbd_request_free(NBDServerRequest *req)
+{
+    NBDClient *c = req->client;
+
+    if (req->data) {
+        qemu_vfree(req->data);
+    }
+    qemu_free(req);
+    c->nb_requests--;
+    nbd_client_put(c);
+}
+
+static void nbd_client_close(NBDClient *c)
+{
+    NBDServerRequest *req;
+
+    if (c->closing) {
+        return;
+    }
+    c->closing = 1;
+    qemu_aio_set_fd_handler(c->sock, NULL, NULL, NULL, NULL, NULL);
+
+    /* keep c alive until the loops are done */
+    c->nb_requests++;
+    if (c->receiving) {
+        nbd_request_free(c->receiving);
+        c->receiving = NULL;
+    }
+    while ((req = QTAILQ_FIRST(&c->replies)) != NULL) {
+        QTAILQ_REMOVE(&c->replies, req, entry);
+        nbd_request_free(req);
+    }
+    c->nb_requests--;
+    nbd_client_put(c);
+}
+
+/* Queue the reply to req; it is sent by the write handler */
+static void nbd_request_reply(NBDServerRequest *req, int error)
+{
+    NBDClient *c = req->client;
+    struct nbd_reply reply;
+
+    if (c->closing) {
+        nbd_request_free(req);
+        return;
+    }
+
+    reply.handle = req->request.handle;
+    reply.error = error;
+    nbd_encode_reply(req->reply, &reply);
+    if (req->request.type == NBD_CMD_READ && !error) {
+        req->data_len = req->request.len;
+    }
+
+    QTAILQ_INSERT_TAIL(&c->replies, req, entry);
+    nbd_client_update_handlers(c);
+}
+
+static void nbd_aio_done(void *opaque, int ret)
+{
+    NBDServerRequest *req = opaque;
+
+    nbd_request_reply(req, ret < 0 ? -ret : 0);
+}
+
+/* Start serving req, whose data is there if it is a write */
+static void nbd_request_start(NBDServerRequest *req)
+{
+    struct nbd_request *request = &req->request;
+    int64_t sector_num = (request->from + export.dev_offset) / 512;
+    BlockDriverAIOCB *acb;
+
+    if (request->type == NBD_CMD_READ) {
+        if (export.sendfile) {
+            nbd_request_reply(req, 0);
+            return;
+        }
+        req->data = qemu_blockalign(export.bs, request->len);
+        req->iov.iov_base = req->data;
+        req->iov.iov_len = request->len;
+        qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+        acb = bdrv_aio_readv(export.bs, sector_num, &req->qiov,
+                             request->len / 512, nbd_aio_done, req);
+    } else if (export.readonly) {
+        nbd_request_reply(req, EPERM);
+        return;
+    } else {
+        req->iov.iov_base = req->data;
+        req->iov.iov_len = request->len;
+        qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+        acb = bdrv_aio_writev(export.bs, sector_num, &req->qiov,
+                              request->len / 512, nbd_aio_done, req);
+    }
+    if (!acb) {
+        nbd_request_reply(req, EIO);
+    }
+}
+
+/* Whether the request header just received makes sense */
+static int nbd_request_check(struct nbd_request *request)
+{
+    if (request->len + NBD_REPLY_SIZE > NBD_BUFFER_SIZE) {
+        fprintf(stderr, "qemu-nbd: len (%u) is larger than max len (%u)\n",
+                request->len + NBD_REPLY_SIZE, NBD_BUFFER_SIZE);
+        return -1;
+    }
+    if (request->from + request->len < request->from ||
+        request->from + request->len > (uint64_t)export.size) {
+        fprintf(stderr, "qemu-nbd: request past EOF, from %" PRIu64
+                ", len %u\n", request->from, request->len);
+        return -1;
+    }
+    return 0;
+}
+
+static void nbd_client_read(void *opaque)
+{
+    NBDClient *c = opaque;
+    NBDServerRequest *req;
+    ssize_t ret;
+
+    for (;;) {
+        req = c->receiving;
+        if (req) {
+            ret = recv(c->sock, req->data + req->received,
+                       req->request.len - req->received, 0);
+            if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+                break;
+            } else if (ret <= 0) {
+                nbd_client_close(c);
+                return;
+            }
+            req->received += ret;
+            if (req->received == req->request.len) {
+                c->receiving = NULL;
+                nbd_request_start(req);
+            }
+            continue;
+        }
+
+        if (c->nb_requests >= NBD_MAX_REQUESTS) {
+            /* resumed by the write handler once a reply went out */
+            break;
+        }
+
+        ret = recv(c->sock, c->request_buf + c->request_received,
+                   NBD_REQUEST_SIZE - c->request_received, 0);
+        if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        } else if (ret <= 0) {
+            nbd_client_close(c);
+            return;
+        }
+        c->request_received += ret;
+        if (c->request_received < NBD_REQUEST_SIZE) {
+            continue;
+        }
+        c->request_received = 0;
+
+        req = qemu_mallocz(sizeof(*req));
+        req->client = c;
+        c->nb_requests++;
+        if (nbd_decode_request(c->request_buf, &req->request) == -1) {
+            goto fail;
+        }
+
+        switch (req->request.type) {
+        case NBD_CMD_READ:
+            if (nbd_request_check(&req->request) == -1) {
+                goto fail;
+            }
+            nbd_request_start(req);
+            break;
+        case NBD_CMD_WRITE:
+            if (nbd_request_check(&req->request) == -1) {
+                goto fail;
+            }
+            req->data = qemu_blockalign(export.bs, req->request.len);
+            if (req->request.len) {
+                c->receiving = req;
+            } else {
+                nbd_request_start(req);
+            }
+            break;
+        case NBD_CMD_DISC:
+            goto fail;
+        default:
+            fprintf(stderr, "qemu-nbd: unknown command %u\n",
+                    req->request.type);
+            goto fail;
+        }
+    }
+    nbd_client_update_handlers(c);
+    return;
+
+fail:
+    /* the client is gone, or does not speak NBD */
+    nbd_request_free(req);
+    nbd_client_close(c);
+}
+
+/* Send the data of req that follows the reply straight from the host file */
+static ssize_t nbd_sendfile(NBDClient *c, NBDServerRequest *req)
+{
+    size_t done = req->sent - NBD_REPLY_SIZE;
+    off_t offset = export.dev_offset + req->request.from + done;
+    ssize_t ret = -1;
+
+#ifdef CONFIG_LINUX
+    ret = sendfile(c->sock, export.fd, &offset, req->data_len - done);
+#else
+    errno = ENOSYS;
+#endif
+    if (ret == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        /* not for this kind of file, use the block layer from now on */
+        export.sendfile = false;
+    }
+    return ret;
+}
+
+/* Copy the data of a read that was to be sent with sendfile() */
+static int nbd_read_from_file(NBDServerRequest *req)
+{
+    off_t offset = export.dev_offset + req->request.from;
+    size_t done = 0;
+
+    req->data = qemu_blockalign(export.bs, req->data_len);
+    while (done < req->data_len) {
+        ssize_t ret = pread(export.fd, req->data + done,
+                            req->data_len - done, offset + done);
+
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static void nbd_client_write(void *opaque)
+{
+    NBDClient *c = opaque;
+    NBDServerRequest *req;
+
+    while ((req = QTAILQ_FIRST(&c->replies)) != NULL) {
+        size_t size = NBD_REPLY_SIZE + req->data_len;
+        ssize_t ret;
+
+        if (req->sent < NBD_REPLY_SIZE) {
+            ret = send(c->sock, req->reply + req->sent,
+                       NBD_REPLY_SIZE - req->sent,
+                       MSG_NOSIGNAL | (req->data_len ? MSG_MORE : 0));
+        } else if (req->data) {
+            ret = send(c->sock, req->data + req->sent - NBD_REPLY_SIZE,
+                       size - req->sent, MSG_NOSIGNAL);
+        } else if (export.sendfile) {
+            ret = nbd_sendfile(c, req);
+            if (ret == -1 && !export.sendfile) {
+                continue;
+            }
+        } else {
+            if (nbd_read_from_file(req) < 0) {
+                nbd_client_close(c);
+                return;
+            }
+            continue;
+        }
+        if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        } else if (ret <= 0) {
+            nbd_client_close(c);
+            return;
+        }
+
+        req->sent += ret;
+        if (req->sent == size) {
+            QTAILQ_REMOVE(&c->replies, req, entry);
+            nbd_request_free(req);
+        }
+    }
+    nbd_client_update_handlers(c);
+}
+
+static void nbd_accept(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    NBDClient *c;
+    int sock;
+
+    sock = accept(export.listen_fd, (struct sockaddr *)&addr, &addr_len);
+    if (sock == -1) {
+        return;
+    }
+    if (nbd_negotiate(sock, export.size) == -1) {
+        close(sock);
+        return;
+    }
+    socket_set_nonblock(sock);
+
+    c = qemu_mallocz(sizeof(*c));
+    c->sock = sock;
+    QTAILQ_INIT(&c->replies);
+    export.nb_clients++;
+    nbd_update_listen_handler();
+    nbd_client_update_handlers(c);
+}
+
 static void usage(const char *name)
 {
     printf(
@@ -184,13 +591,10 @@ int main(int argc, char **argv)
 {
     BlockDriverState *bs;
     off_t dev_offset = 0;
-    off_t offset = 0;
     bool readonly = false;
     bool disconnect = false;
     const char *bindto = "0.0.0.0";
     int port = NBD_DEFAULT_PORT;
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
     off_t fd_size;
     char *device = NULL;
     char *socket = NULL;
@@ -222,13 +626,8 @@ int main(int argc, char **argv)
     int partition = -1;
     int ret;
     int shared = 1;
-    uint8_t *data;
-    fd_set fds;
-    int *sharing_fds;
+    int listen_fd;
     int fd;
-    int i;
-    int nb_fds = 0;
-    int max_fd;
     int persistent = 0;
     uint32_t nbdflags;
 
@@ -431,67 +830,37 @@ int main(int argc, char **argv)
         /* children */
     }
 
-    sharing_fds = qemu_malloc((shared + 1) * sizeof(int));
-
     if (socket) {
-        sharing_fds[0] = unix_socket_incoming(socket);
+        listen_fd = unix_socket_incoming(socket);
     } else {
-        sharing_fds[0] = tcp_socket_incoming(bindto, port);
+        listen_fd = tcp_socket_incoming(bindto, port);
     }
 
-    if (sharing_fds[0] == -1)
+    if (listen_fd == -1)
         return 1;
-    max_fd = sharing_fds[0];
-    nb_fds++;
 
-    data = qemu_blockalign(bs, NBD_BUFFER_SIZE);
-    if (data == NULL)
-        errx(EXIT_FAILURE, "Cannot allocate data buffer");
+    export.bs = bs;
+    export.size = fd_size;
+    export.dev_offset = dev_offset;
+    export.readonly = readonly;
+    export.fd = bdrv_get_fd(bs);
+    if (export.fd < 0) {
+        export.fd = -1;
+    }
+#ifdef CONFIG_LINUX
+    export.sendfile = export.fd != -1;
+#endif
+    export.listen_fd = listen_fd;
+    export.max_clients = shared;
+    nbd_update_listen_handler();
 
     do {
+        qemu_aio_wait();
+    } while (persistent || export.nb_clients > 0);
 
-        FD_ZERO(&fds);
-        for (i = 0; i < nb_fds; i++)
-            FD_SET(sharing_fds[i], &fds);
-
-        ret = select(max_fd + 1, &fds, NULL, NULL, NULL);
-        if (ret == -1)
-            break;
-
-        if (FD_ISSET(sharing_fds[0], &fds))
-            ret--;
-        for (i = 1; i < nb_fds && ret; i++) {
-            if (FD_ISSET(sharing_fds[i], &fds)) {
-                if (nbd_trip(bs, sharing_fds[i], fd_size, dev_offset,
-                    &offset, readonly, data, NBD_BUFFER_SIZE) != 0) {
-                    close(sharing_fds[i]);
-                    nb_fds--;
-                    sharing_fds[i] = sharing_fds[nb_fds];
-                    i--;
-                }
-                ret--;
-            }
-        }
-        /* new connection ? */
-        if (FD_ISSET(sharing_fds[0], &fds)) {
-            if (nb_fds < shared + 1) {
-                sharing_fds[nb_fds] = accept(sharing_fds[0],
-                                             (struct sockaddr *)&addr,
-                                             &addr_len);
-                if (sharing_fds[nb_fds] != -1 &&
-                    nbd_negotiate(sharing_fds[nb_fds], fd_size) != -1) {
-                        if (sharing_fds[nb_fds] > max_fd)
-                            max_fd = sharing_fds[nb_fds];
-                        nb_fds++;
-                }
-            }
-        }
-    } while (persistent || nb_fds > 1);
-    qemu_vfree(data);
-
-    close(sharing_fds[0]);
+    qemu_aio_set_fd_handler(listen_fd, NULL, NULL, NULL, NULL, NULL);
+    close(listen_fd);
     bdrv_close(bs);
-    qemu_free(sharing_fds);
     if (socket)
         unlink(socket);
 
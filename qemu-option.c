@@ -505,6 +505,7 @@ void print_option_help(QEMUOptionParameter *list)
 struct QemuOpt {
     const char   *name;
     const char   *str;
+    unsigned int hash;          /* of name */
 
     const QemuOptDesc *desc;
     union {
@@ -522,14 +523,98 @@ struct QemuOpts {
     Location loc;
     QTAILQ_HEAD(QemuOptHead, QemuOpt) head;
     QTAILQ_ENTRY(QemuOpts) next;
+    QLIST_ENTRY(QemuOpts) id_link;
 };
 
+#define QEMU_OPTS_ID_HASH_SIZE 256
+
+/*
+ * Built the first time a list is looked up by id or gets an option set,
+ * so that config files and command lines with hundreds of -drive and
+ * -device don't scan the whole list for each of them.
+ */
+typedef struct QemuOptsIndex {
+    QLIST_HEAD(, QemuOpts) ids[QEMU_OPTS_ID_HASH_SIZE];
+    const QemuOptDesc **descs;  /* sorted by name, then position */
+    int ndescs;
+} QemuOptsIndex;
+
+static unsigned int qemu_opts_str_hash(const char *s)
+{
+    unsigned int h = 5381;
+
+    while (*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+static int compare_descs(const void *a, const void *b)
+{
+    const QemuOptDesc *da = *(const QemuOptDesc **)a;
+    const QemuOptDesc *db = *(const QemuOptDesc **)b;
+    int ret = strcmp(da->name, db->name);
+
+    if (ret == 0) {
+        ret = da < db ? -1 : da > db;
+    }
+    return ret;
+}
+
+static QemuOptsIndex *qemu_opts_index(QemuOptsList *list)
+{
+    QemuOptsIndex *idx = list->index;
+    int i;
+
+    if (idx) {
+        return idx;
+    }
+    idx = qemu_mallocz(sizeof(*idx));
+    for (i = 0; list->desc[i].name != NULL; i++) {
+        /* nothing */
+    }
+    idx->ndescs = i;
+    idx->descs = qemu_malloc(MAX(i, 1) * sizeof(*idx->descs));
+    for (i = 0; i < idx->ndescs; i++) {
+        idx->descs[i] = &list->desc[i];
+    }
+    qsort(idx->descs, idx->ndescs, sizeof(*idx->descs), compare_descs);
+
+    /* qemu_opts_create() builds the index before it adds the first opts
+     * with an id, so there is nothing on the list to hash yet */
+    list->index = idx;
+    return idx;
+}
+
+/* The first entry of the list's desc with that name, or NULL */
+static const QemuOptDesc *qemu_opts_find_desc(QemuOptsList *list,
+                                              const char *name)
+{
+    QemuOptsIndex *idx = qemu_opts_index(list);
+    int lo = 0, hi = idx->ndescs;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (strcmp(idx->descs[mid]->name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < idx->ndescs && strcmp(idx->descs[lo]->name, name) == 0) {
+        return idx->descs[lo];
+    }
+    return NULL;
+}
+
 static QemuOpt *qemu_opt_find(QemuOpts *opts, const char *name)
 {
+    unsigned int hash = qemu_opts_str_hash(name);
     QemuOpt *opt;
 
     QTAILQ_FOREACH_REVERSE(opt, &opts->head, QemuOptHead, next) {
-        if (strcmp(opt->name, name) != 0)
+        if (opt->hash != hash || strcmp(opt->name, name) != 0)
             continue;
         return opt;
     }
@@ -602,16 +687,10 @@ static void qemu_opt_del(QemuOpt *opt)
 int qemu_opt_set(QemuOpts *opts, const char *name, const char *value)
 {
     QemuOpt *opt;
-    const QemuOptDesc *desc = opts->list->desc;
-    int i;
+    const QemuOptDesc *desc = qemu_opts_find_desc(opts->list, name);
 
-    for (i = 0; desc[i].name != NULL; i++) {
-        if (strcmp(desc[i].name, name) == 0) {
-            break;
-        }
-    }
-    if (desc[i].name == NULL) {
-        if (i == 0) {
+    if (desc == NULL) {
+        if (opts->list->index->ndescs == 0) {
             /* empty list -> allow any */;
         } else {
             qerror_report(QERR_INVALID_PARAMETER, name);
@@ -621,11 +700,10 @@ int qemu_opt_set(QemuOpts *opts, const char *name, const char *value)
 
     opt = qemu_mallocz(sizeof(*opt));
     opt->name = qemu_strdup(name);
+    opt->hash = qemu_opts_str_hash(name);
     opt->opts = opts;
     QTAILQ_INSERT_TAIL(&opts->head, opt, next);
-    if (desc[i].name != NULL) {
-        opt->desc = desc+i;
-    }
+    opt->desc = desc;
     if (value) {
         opt->str = qemu_strdup(value);
     }
@@ -652,16 +730,14 @@ int qemu_opt_foreach(QemuOpts *opts, qemu_opt_loopfunc func, void *opaque,
 
 QemuOpts *qemu_opts_find(QemuOptsList *list, const char *id)
 {
+    QemuOptsIndex *idx = qemu_opts_index(list);
     QemuOpts *opts;
 
-    QTAILQ_FOREACH(opts, &list->head, next) {
-        if (!opts->id) {
-            continue;
+    QLIST_FOREACH(opts, &idx->ids[qemu_opts_str_hash(id) %
+                                  QEMU_OPTS_ID_HASH_SIZE], id_link) {
+        if (strcmp(opts->id, id) == 0) {
+            return opts;
         }
-        if (strcmp(opts->id, id) != 0) {
-            continue;
-        }
-        return opts;
     }
     return NULL;
 }
@@ -703,7 +779,11 @@ QemuOpts *qemu_opts_create(QemuOptsList *list, const char *id, int fail_if_exist
     }
     opts = qemu_mallocz(sizeof(*opts));
     if (id) {
+        QemuOptsIndex *idx = qemu_opts_index(list);
+
         opts->id = qemu_strdup(id);
+        QLIST_INSERT_HEAD(&idx->ids[qemu_opts_str_hash(id) %
+                                    QEMU_OPTS_ID_HASH_SIZE], opts, id_link);
     }
     opts->list = list;
     loc_save(&opts->loc);
@@ -754,6 +834,9 @@ void qemu_opts_del(QemuOpts *opts)
         qemu_opt_del(opt);
     }
     QTAILQ_REMOVE(&opts->list->head, opts, next);
+    if (opts->id) {
+        QLIST_REMOVE(opts, id_link);
+    }
     qemu_free(opts->id);
     qemu_free(opts);
 }
@@ -101,6 +101,7 @@ struct QemuOptsList {
     const char *name;
     const char *implied_opt_name;
     QTAILQ_HEAD(, QemuOpts) head;
+    struct QemuOptsIndex *index;    /* ids and desc by name, built on use */
     QemuOptDesc desc[];
 };
 
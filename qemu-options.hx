@@ -66,12 +66,42 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "          [,host-nodes=node[-node]][,policy=default|preferred|bind|interleave]\n",
+    QEMU_ARCH_ALL)
 STEXI
 @item -numa @var{opts}
 @findex -numa
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
 are split equally.
+
+@option{host-nodes} places the node's share of guest RAM on the given host
+NUMA nodes, with the memory policy @option{policy} (@code{bind} if
+@option{host-nodes} is given and @option{policy} is not).  Guest nodes take
+their share of RAM in the order they are listed.
+ETEXI
+
+DEF("vcpu", HAS_ARG, QEMU_OPTION_vcpu,
+    "-vcpu [vcpu=]cpu[-cpu][,host-cpus=cpu[-cpu]][,fifo=prio][,halt-poll=us]\n"
+    "                set up the host threads of KVM vcpus\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -vcpu [vcpu=]@var{cpu}[-@var{cpu}][,host-cpus=@var{cpu}[-@var{cpu}]][,fifo=@var{prio}][,halt-poll=@var{us}]
+@findex -vcpu
+Set up the host threads of the given vcpus, or of all vcpus if none are
+given.  When several @option{-vcpu} options cover a vcpu, later ones take
+precedence for the settings they give.
+
+@option{host-cpus} restricts the threads to the given host CPUs.
+@option{fifo} runs them with the real-time policy @code{SCHED_FIFO} at
+priority @var{prio}, which needs the privilege to do so.
+@option{halt-poll} lets a vcpu that executed @code{HLT} spin for up to
+@var{us} microseconds before it goes to sleep, so that an interrupt that
+comes soon does not have to wake the thread up.  The time actually spent
+spinning adapts to how long the vcpu stays halted, and drops to nothing
+for vcpus that are idle for long.
+
+Only with KVM and the I/O thread.
 ETEXI
 
 DEF("fda", HAS_ARG, QEMU_OPTION_fda,
@@ -120,7 +150,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,readonly=on|off][,bps_rd=b][,bps_wr=b][,iops_rd=r][,iops_wr=r]\n"
+    "       [,metadata_cache_size=size][,elevator=on|off][,copy-on-read=on|off]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -160,6 +191,28 @@ an untrusted format header.
 This option specifies the serial number to assign to the device.
 @item addr=@var{addr}
 Specify the controller's PCI address (if=virtio only).
+@item bps_rd=@var{b},bps_wr=@var{b}
+Limit the read and write bandwidth of the drive to @var{b} bytes per second.
+@item iops_rd=@var{r},iops_wr=@var{r}
+Limit the read and write requests of the drive to @var{r} per second.
+Requests over a limit wait until it lets them through; the limits can be
+changed with the @code{block_set_io_throttle} monitor command.
+@item metadata_cache_size=@var{size}
+Memory the image format may cache its metadata in, e.g. the L2 tables of
+a qcow2 or QED image.  By default, qcow2 caches enough tables to map the
+whole image, up to 16 MB, and QED caches 50 tables; large images read at
+random need more to avoid a metadata read for each guest read.
+@item elevator=@var{elevator}
+@var{elevator} is "on" or "off" (the default).  When on, the reads and
+writes the guest issues together, e.g. in one main loop iteration or one
+virtio notification, are sorted by sector and those that follow each other
+on the disk are merged into larger requests.  This helps rotating disks.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off" (the default).  When on, the clusters
+the guest reads from the backing file of the image, or from the image
+itself with @option{snapshot=on}, are also written to the image, so that
+they are only read once from a slow or remote backing file.  See also the
+@code{block_stream} monitor command.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -233,6 +286,22 @@ qemu -hda a -hdb b
 @end example
 ETEXI
 
+DEF("backing-cache", HAS_ARG, QEMU_OPTION_backing_cache,
+    "-backing-cache size=size[,path=dir]\n"
+    "                cache what is read from backing files, in size bytes of\n"
+    "                memory shared by all drives, or in a file in dir\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -backing-cache size=@var{size}[,path=@var{dir}]
+@findex -backing-cache
+Keep what the drives read from their backing files in a cache of @var{size}
+bytes; drives with the same base image share what is cached of it, which
+saves reading it from the storage again with @option{cache=none}.  The
+cache is allocated from a temporary file in @var{dir} if given, e.g. on
+hugetlbfs for huge pages or on an SSD.  A backing file must not change
+while it is cached.  @code{info block-cache} shows the hit rates.
+ETEXI
+
 DEF("set", HAS_ARG, QEMU_OPTION_set,
     "-set group.id.arg=value\n"
     "                set <arg> parameter for item <id> of type <group>\n"
@@ -337,11 +406,12 @@ ETEXI
 
 #ifdef MAP_POPULATE
 DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
-    "-mem-prealloc   preallocate guest memory (use with -mem-path)\n",
+    "-mem-prealloc   preallocate guest memory\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -mem-prealloc
-Preallocate memory when using -mem-path.
+Fault in all of guest RAM at startup, with one thread per host CPU, instead
+of when the guest first touches it.
 ETEXI
 #endif
 
@@ -483,6 +553,21 @@ possible drivers and properties, use @code{-device ?} and
 @code{-device @var{driver},?}.
 ETEXI
 
+DEF("iothread", HAS_ARG, QEMU_OPTION_iothread,
+    "-iothread id=name\n"
+    "                start an event loop thread that devices can be bound to\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -iothread id=@var{name}
+@findex -iothread
+Start an event loop thread called @var{name}.  Devices that can do their
+I/O outside of the main event loop run it in this thread when they are
+bound to it, and several devices can share one thread.  For now these are
+virtio-blk devices with the data plane, e.g.
+@code{-device virtio-blk-pci,drive=hd0,x-data-plane=on,x-iothread=@var{name}}.
+Only available with the I/O thread.
+ETEXI
+
 DEFHEADING(File system options:)
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
@@ -651,6 +736,19 @@ STEXI
 Use Right-Ctrl to grab mouse (instead of Ctrl-Alt).
 ETEXI
 
+#ifdef CONFIG_SDL
+DEF("sdl-gl", 0, QEMU_OPTION_sdl_gl,
+    "-sdl-gl         draw the SDL window with OpenGL\n", QEMU_ARCH_ALL)
+#endif
+STEXI
+@item -sdl-gl
+@findex -sdl-gl
+Draw the SDL window with OpenGL.  Only the changed parts of the guest
+screen are uploaded each frame, and scaling the window and converting the
+guest pixel format are done by the graphics card.  Needs QEMU built with
+@code{--enable-sdl-gl}.
+ETEXI
+
 #ifdef CONFIG_SDL
 DEF("no-quit", 0, QEMU_OPTION_no_quit,
     "-no-quit        disable SDL window close capability\n", QEMU_ARCH_ALL)
@@ -741,6 +839,27 @@ Enable/disable audio stream compression (using celt 0.5.1).  Default is on.
 @end table
 ETEXI
 
+DEF("refresh-rate", HAS_ARG, QEMU_OPTION_refresh_rate,
+    "-refresh-rate [min=hz][,max=hz]\n"
+    "                bound how often displays are refreshed (default: min=0.5,max=33)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -refresh-rate [min=@var{hz}][,max=@var{hz}]
+@findex -refresh-rate
+Bound how often displays without input of their own to poll (VNC) look for
+guest screen changes.  While the screen changes they refresh @var{max}
+times per second.  When it stops changing they back off to @var{min}
+refreshes per second, and come back at once on the first guest write to
+the framebuffer.  @option{min=0} stops idle polling altogether, which
+costs nothing while the console is idle but also freezes the blinking
+text mode cursor and register-only changes such as palette updates until
+the next framebuffer write.  With KVM, @option{min=0} is not allowed
+because a directly mapped framebuffer can only be seen by polling.
+Local SDL and curses windows poll their own input, so they always refresh
+@var{max} times per second.  Without a display client no refresh timer
+runs at all.
+ETEXI
+
 DEF("portrait", 0, QEMU_OPTION_portrait,
     "-portrait       rotate graphical output 90 deg left (only PXA LCD)\n",
     QEMU_ARCH_ALL)
@@ -913,6 +1032,24 @@ option is set, VNC client may receive lossy framebuffer updates
 depending on its encoding settings. Enabling this option can save
 a lot of bandwidth at the expense of quality.
 
+Unless @option{non-adaptive} is also given, the tight encoder then picks
+the compression per region: regions updated several times per second
+(video) are sent as JPEG with a quality that follows the measured client
+bandwidth, other regions are sent lossless, and regions sent lossy are
+resent lossless once they stop changing.
+
+@item non-adaptive
+
+Disable the adaptive encoding described for @option{lossy} and use the
+client requested JPEG quality and compression level everywhere.
+
+@item workers=@var{n}
+
+Encode framebuffer updates with @var{n} threads (default 1). Updates
+for one client are always encoded in order by a single thread, so this
+helps when several clients are connected. Only available when QEMU is
+built with the VNC encoding thread.
+
 @end table
 ETEXI
 
@@ -1050,7 +1187,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' and use the\n"
     "                network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1064,12 +1201,19 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to open n queues of a multiqueue TAP interface (netdev only)\n"
 #endif
     "-net socket[,vlan=n][,name=str][,fd=h][,listen=[host]:port][,connect=host:port]\n"
     "                connect the vlan 'n' to another VLAN using a socket connection\n"
     "-net socket[,vlan=n][,name=str][,fd=h][,mcast=maddr:port[,localaddr=addr]]\n"
     "                connect the vlan 'n' to multicast maddr and port\n"
     "                use 'localaddr=addr' to specify the host address to send packets from\n"
+    "-net socket[,vlan=n][,name=str],udp=host:port,localaddr=host:port\n"
+    "                connect the vlan 'n' to another VLAN using UDP, from localaddr\n"
+    "                to udp, and back\n"
+    "                use 'coalesce=size' with udp or mcast to pack several frames into\n"
+    "                each datagram of up to 'size' bytes; the other ends must agree\n"
+    "                use 'sockbuf=size' to set the UDP socket buffer sizes\n"
 #ifdef CONFIG_VDE
     "-net vde[,vlan=n][,name=str][,sock=socketpath][,port=n][,group=groupname][,mode=octalmode]\n"
     "                connect the vlan 'n' to port 'n' of a vde switch running\n"
@@ -1077,8 +1221,10 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
 #endif
-    "-net dump[,vlan=n][,file=f][,len=n]\n"
+    "-net dump[,vlan=n][,file=f][,len=n][,bufsize=n][,maxsize=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
+    "                buffering up to 'bufsize' bytes and, with 'maxsize', moving\n"
+    "                the file to 'f.1' when it reaches that size\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
     "                is provided, the default is '-net nic -net user'\n", QEMU_ARCH_ALL)
 DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
@@ -1090,7 +1236,10 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #ifdef CONFIG_VDE
     "vde|"
 #endif
-    "socket],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
+    "socket],id=str[,option][,option][,...]\n"
+    "                [,bps_tx=n][,bps_rx=n][,pps_tx=n][,pps_rx=n]\n"
+    "                limit the bytes and packets per second the guest may send\n"
+    "                (tx) and receive (rx) through the netdev\n", QEMU_ARCH_ALL)
 STEXI
 @item -net nic[,vlan=@var{n}][,macaddr=@var{mac}][,model=@var{type}] [,name=@var{name}][,addr=@var{addr}][,vectors=@var{v}]
 @findex -net
@@ -1223,7 +1372,7 @@ processed and applied to -net user. Mixing them with the new configuration
 syntax gives undefined results. Their use for new applications is discouraged
 as they will be removed from future versions.
 
-@item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,ifname=@var{name}] [,script=@var{file}][,downscript=@var{dfile}]
+@item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,ifname=@var{name}] [,script=@var{file}][,downscript=@var{dfile}][,queues=@var{n}]
 Connect the host TAP network interface @var{name} to VLAN @var{n}, use
 the network script @var{file} to configure it and the network script
 @var{dfile} to deconfigure it. If @var{name} is not provided, the OS
@@ -1243,6 +1392,18 @@ qemu linux.img -net nic,vlan=0 -net tap,vlan=0,ifname=tap0 \
                -net nic,vlan=1 -net tap,vlan=1,ifname=tap1
 @end example
 
+With @option{-netdev}, @option{queues}=@var{n} opens @var{n} queues of a
+multiqueue TAP interface (IFF_MULTI_QUEUE).  The netdev @var{id} is the first
+queue and @var{id}.1 to @var{id}.@var{n-1} the others; a virtio-net device
+connected to @var{id} gets one RX/TX queue pair and two MSI-X vectors per
+queue, so that the guest can process each pair on its own CPU.  With
+@option{vhost=on} each queue pair gets a vhost-net instance with a kernel
+thread of its own.
+@example
+qemu linux.img -netdev tap,id=net0,ifname=tap0,queues=4,vhost=on \
+               -device virtio-net-pci,netdev=net0
+@end example
+
 @item -net socket[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}] [,listen=[@var{host}]:@var{port}][,connect=@var{host}:@var{port}]
 
 Connect the VLAN @var{n} to a remote VLAN in another QEMU virtual
@@ -1309,6 +1470,30 @@ qemu linux.img -net nic,macaddr=52:54:00:12:34:56 \
                -net socket,mcast=239.192.168.1:1102,localaddr=1.2.3.4
 @end example
 
+@item -net socket[,vlan=@var{n}][,name=@var{name}],udp=@var{host}:@var{port},localaddr=@var{host}:@var{port}[,coalesce=@var{size}][,sockbuf=@var{size}]
+
+Connect VLAN @var{n} to another QEMU, usually on another host, with UDP
+unicast: packets are sent to @option{udp} from the address and port given by
+@option{localaddr}, and received on the latter.  This is a point to point
+tunnel; a bus needs @option{mcast}.
+
+UDP and multicast sockets send and receive several datagrams per system
+call.  With @option{coalesce}, small frames, such as TCP acknowledgements,
+are also packed together into datagrams of at most @var{size} bytes.  This
+changes the format of the datagrams, so all ends must use it.
+@option{sockbuf} sets the size of the socket's send and receive buffers,
+which the host may cap; larger buffers drop fewer packets in bursts.
+
+Example:
+@example
+# on host 1.2.3.4
+qemu linux.img -net nic,macaddr=52:54:00:12:34:56 \
+               -net socket,udp=5.6.7.8:1234,localaddr=1.2.3.4:1234
+# on host 5.6.7.8
+qemu linux.img -net nic,macaddr=52:54:00:12:34:57 \
+               -net socket,udp=1.2.3.4:1234,localaddr=5.6.7.8:1234
+@end example
+
 @item -net vde[,vlan=@var{n}][,name=@var{name}][,sock=@var{socketpath}] [,port=@var{n}][,group=@var{groupname}][,mode=@var{octalmode}]
 Connect VLAN @var{n} to PORT @var{n} of a vde switch running on host and
 listening for incoming connections on @var{socketpath}. Use GROUP @var{groupname}
@@ -1324,11 +1509,26 @@ vde_switch -F -sock /tmp/myswitch
 qemu linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
-@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
+@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}][,bufsize=@var{size}][,maxsize=@var{size}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
 libpcap, so it can be analyzed with tools such as tcpdump or Wireshark.
 
+Packets are buffered in memory, @var{bufsize} bytes (1M by default), and written
+to the file in the background.  If the file can't keep up and the buffer fills,
+packets are dropped; @code{info network} shows how many.  With @var{maxsize}, the
+file is renamed to @file{@var{file}.1}, replacing any older one, once it reaches
+that size, and a new file is started.
+
+@item -netdev @var{type},id=@var{id}[,bps_tx=@var{n}][,bps_rx=@var{n}][,pps_tx=@var{n}][,pps_rx=@var{n}][,...]
+Limit the traffic between a netdev and its NIC, in bytes (@option{bps_tx},
+@option{bps_rx}) and packets (@option{pps_tx}, @option{pps_rx}) per second
+sent (tx) and received (rx) by the guest.  Traffic over a limit is held
+back, not dropped, and bursts of up to a tenth of a second's worth go
+through at once.  The limits cover all queues of the netdev together, and
+can be changed at run time with the @code{netdev_set_limits} monitor
+command.  They work with any backend, but not with vhost.
+
 @item -net none
 Indicate that no network devices should be configured. It is used to
 override the default configuration (@option{-net nic -net user}) which
@@ -1373,6 +1573,8 @@ DEF("chardev", HAS_ARG, QEMU_OPTION_chardev,
 #if defined(CONFIG_SPICE)
     "-chardev spicevmc,id=id,name=name[,debug=debug]\n"
 #endif
+    "socket, and on hosts other than Windows pty, file and pipe, also take\n"
+    "         [,outbuf=size][,overflow=backpressure|drop-old|drop-new]\n"
     , QEMU_ARCH_ALL
 )
 
@@ -1408,6 +1610,17 @@ A character device may be used in multiplexing mode by multiple front-ends.
 The key sequence of @key{Control-a} and @key{c} will rotate the input focus
 between attached front-ends. Specify @option{mux=on} to enable this mode.
 
+The @option{socket} backend, and the @option{pty}, @option{file} and
+@option{pipe} backends on hosts other than Windows, keep what the reader
+cannot take yet in an output buffer of @option{outbuf} bytes, 64k by
+default, instead of making the guest wait for it. @option{outbuf=0} turns
+the buffer off. @option{overflow} says what happens once the buffer is
+full: @option{drop-old} throws away its oldest data and @option{drop-new}
+the data that doesn't fit, while @option{backpressure}, the default, makes
+the devices that support it, such as virtio-serial ports, wait for the
+reader, and the others wait as they do without a buffer. @code{info
+chardev} shows how much is buffered and how much was dropped.
+
 Options to each backend are described below.
 
 @item -chardev null ,id=@var{id}
@@ -1919,6 +2132,19 @@ STEXI
 Run the emulation in single step mode.
 ETEXI
 
+DEF("no-tcg-optimize", 0, QEMU_OPTION_no_tcg_optimize, \
+    "-no-tcg-optimize\n"
+    "                generate code from the ops as the front end emits them\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -no-tcg-optimize
+@findex -no-tcg-optimize
+Do not run the TCG optimizer, which propagates constants and copies
+between the ops of a translation block and simplifies the ops whose
+result is known, before host code is generated from them.  This is meant
+for debugging the optimizer and for comparing its effect.
+ETEXI
+
 DEF("S", 0, QEMU_OPTION_S, \
     "-S              freeze CPU at startup (use 'c' to start execution)\n",
     QEMU_ARCH_ALL)
@@ -2054,6 +2280,36 @@ STEXI
 Start right away with a saved state (@code{loadvm} in monitor)
 ETEXI
 
+DEF("dump-vmstate", HAS_ARG, QEMU_OPTION_dump_vmstate, \
+    "-dump-vmstate file[,snapshot=tag]\n" \
+    "                print the device state saved in a migration stream or\n" \
+    "                a snapshot and exit\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -dump-vmstate @var{file}[,snapshot=@var{tag}]
+@findex -dump-vmstate
+Load the device state of the migration stream saved in @var{file}, for
+example with @code{migrate "exec:cat > file"}, or with @code{snapshot} the
+VM state of snapshot @var{tag} of image @var{file}, print the state of
+every device as a line with what @code{device_show} returns in QMP, and
+exit.  The guest never runs and RAM is skipped, not loaded; neither
+@var{file} nor the disks are written to.  The machine and devices must be
+configured as for @option{-incoming} with the same state.
+ETEXI
+
+DEF("vmstate-bench", HAS_ARG, QEMU_OPTION_vmstate_bench, \
+    "-vmstate-bench iterations\n" \
+    "                measure the device state walkers on every device and exit\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -vmstate-bench @var{iterations}
+@findex -vmstate-bench
+Once the machine is set up, run @code{vmstate_bench} on its devices, print
+the results and exit.  The guest never runs.  When the environment
+variable @env{QEMU_BENCH_JSON} names a file, the results are also appended
+to it as for the @code{bench} make target.
+ETEXI
+
 #ifndef _WIN32
 DEF("daemonize", 0, QEMU_OPTION_daemonize, \
     "-daemonize      daemonize QEMU after initializing\n", QEMU_ARCH_ALL)
@@ -2244,6 +2500,12 @@ STEXI
 @item -incoming @var{port}
 @findex -incoming
 Prepare for incoming migration, listen on @var{port}.
+
+With file:@var{path}[,rate=@var{bytes}][,report=on], replay a stream
+recorded with the file: migration protocol, as fast as it loads or at
+@var{bytes} per second (k, M and G suffixes allowed).  report=on prints
+the replay throughput, how long each section took to load and how the RAM
+pages were encoded to stderr once it is loaded.
 ETEXI
 
 DEF("nodefaults", 0, QEMU_OPTION_nodefaults, \
@@ -2254,6 +2516,27 @@ STEXI
 Don't create default devices.
 ETEXI
 
+DEF("startup-profile", 0, QEMU_OPTION_startup_profile, \
+    "-startup-profile\n"
+    "                print how long each phase of startup took, up to the\n"
+    "                guest's first instruction\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -startup-profile
+@findex -startup-profile
+Print to stderr, when the guest is about to run its first instruction,
+how many milliseconds went into each phase of startup: parsing the command
+line, initializing the accelerator, opening the block devices, creating
+the machine and the devices, loading the ROMs, resetting, and so on, up to
+the first instruction itself, which with @option{-S} or @option{-incoming}
+includes the wait for the guest to be started.  Some of the work done along
+the way, such as allocating guest memory, mapping ROM files and copying
+them into guest memory, is also listed on its own, and so are the device
+drivers that took longest to create their devices.  The same phases and
+the creation of each device are available as the @code{startup_phase} and
+@code{startup_device} trace events.
+ETEXI
+
 #ifndef _WIN32
 DEF("chroot", HAS_ARG, QEMU_OPTION_chroot, \
     "-chroot dir     chroot to dir just before starting the VM\n",
@@ -26,7 +26,7 @@
 #ifndef QEMU_OS_POSIX_H
 #define QEMU_OS_POSIX_H
 
-static inline void os_host_main_loop_wait(int *timeout)
+static inline void os_host_main_loop_wait(int64_t *timeout)
 {
 }
 
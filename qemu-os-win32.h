@@ -40,7 +40,7 @@ typedef void WaitObjectFunc(void *opaque);
 int qemu_add_wait_object(HANDLE handle, WaitObjectFunc *func, void *opaque);
 void qemu_del_wait_object(HANDLE handle, WaitObjectFunc *func, void *opaque);
 
-void os_host_main_loop_wait(int *timeout);
+void os_host_main_loop_wait(int64_t *timeout);
 
 static inline void os_setup_signal_handling(void) {}
 static inline void os_daemonize(void) {}
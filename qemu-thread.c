@@ -32,6 +32,16 @@ void qemu_mutex_init(QemuMutex *mutex)
     err = pthread_mutex_init(&mutex->lock, NULL);
     if (err)
         error_exit(err, __func__);
+#ifdef CONFIG_MUTEX_STATS
+    mutex->stats = NULL;
+#endif
+}
+
+void qemu_mutex_set_name(QemuMutex *mutex, const char *name)
+{
+#ifdef CONFIG_MUTEX_STATS
+    mutex->stats = qemu_lock_stats_new(name);
+#endif
 }
 
 void qemu_mutex_destroy(QemuMutex *mutex)
@@ -43,18 +53,44 @@ void qemu_mutex_destroy(QemuMutex *mutex)
         error_exit(err, __func__);
 }
 
-void qemu_mutex_lock(QemuMutex *mutex)
+void qemu_mutex_lock_caller(QemuMutex *mutex, void *caller)
 {
     int err;
 
+#ifdef CONFIG_MUTEX_STATS
+    if (mutex->stats) {
+        err = qemu_lock_stats_lock(mutex->stats, &mutex->lock, caller);
+        if (err)
+            error_exit(err, __func__);
+        return;
+    }
+#endif
     err = pthread_mutex_lock(&mutex->lock);
     if (err)
         error_exit(err, __func__);
 }
 
+void qemu_mutex_lock(QemuMutex *mutex)
+{
+    qemu_mutex_lock_caller(mutex, __builtin_return_address(0));
+}
+
+int qemu_mutex_trylock_caller(QemuMutex *mutex, void *caller)
+{
+    int err;
+
+    err = pthread_mutex_trylock(&mutex->lock);
+#ifdef CONFIG_MUTEX_STATS
+    if (!err && mutex->stats) {
+        qemu_lock_stats_acquired(mutex->stats, caller);
+    }
+#endif
+    return err;
+}
+
 int qemu_mutex_trylock(QemuMutex *mutex)
 {
-    return pthread_mutex_trylock(&mutex->lock);
+    return qemu_mutex_trylock_caller(mutex, __builtin_return_address(0));
 }
 
 static void timespec_add_ms(struct timespec *ts, uint64_t msecs)
@@ -78,6 +114,11 @@ int qemu_mutex_timedlock(QemuMutex *mutex, uint64_t msecs)
     err = pthread_mutex_timedlock(&mutex->lock, &ts);
     if (err && err != ETIMEDOUT)
         error_exit(err, __func__);
+#ifdef CONFIG_MUTEX_STATS
+    if (!err && mutex->stats) {
+        qemu_lock_stats_acquired(mutex->stats, __builtin_return_address(0));
+    }
+#endif
     return err;
 }
 
@@ -85,6 +126,11 @@ void qemu_mutex_unlock(QemuMutex *mutex)
 {
     int err;
 
+#ifdef CONFIG_MUTEX_STATS
+    if (mutex->stats) {
+        qemu_lock_stats_release(mutex->stats);
+    }
+#endif
     err = pthread_mutex_unlock(&mutex->lock);
     if (err)
         error_exit(err, __func__);
@@ -130,9 +176,19 @@ void qemu_cond_wait(QemuCond *cond, QemuMutex *mutex)
 {
     int err;
 
+#ifdef CONFIG_MUTEX_STATS
+    if (mutex->stats) {
+        qemu_lock_stats_release(mutex->stats);
+    }
+#endif
     err = pthread_cond_wait(&cond->cond, &mutex->lock);
     if (err)
         error_exit(err, __func__);
+#ifdef CONFIG_MUTEX_STATS
+    if (mutex->stats) {
+        qemu_lock_stats_resume(mutex->stats);
+    }
+#endif
 }
 
 int qemu_cond_timedwait(QemuCond *cond, QemuMutex *mutex, uint64_t msecs)
@@ -143,9 +199,19 @@ int qemu_cond_timedwait(QemuCond *cond, QemuMutex *mutex, uint64_t msecs)
     clock_gettime(CLOCK_REALTIME, &ts);
     timespec_add_ms(&ts, msecs);
 
+#ifdef CONFIG_MUTEX_STATS
+    if (mutex->stats) {
+        qemu_lock_stats_release(mutex->stats);
+    }
+#endif
     err = pthread_cond_timedwait(&cond->cond, &mutex->lock, &ts);
     if (err && err != ETIMEDOUT)
         error_exit(err, __func__);
+#ifdef CONFIG_MUTEX_STATS
+    if (mutex->stats) {
+        qemu_lock_stats_resume(mutex->stats);
+    }
+#endif
     return err;
 }
 
@@ -190,3 +256,23 @@ void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
 }
+
+void qemu_thread_join(QemuThread *thread)
+{
+    int err;
+
+    err = pthread_join(thread->thread, NULL);
+    if (err) {
+        error_exit(err, __func__);
+    }
+}
+
+void qemu_thread_detach(QemuThread *thread)
+{
+    int err;
+
+    err = pthread_detach(thread->thread);
+    if (err) {
+        error_exit(err, __func__);
+    }
+}
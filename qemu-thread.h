@@ -1,10 +1,15 @@
 #ifndef __QEMU_THREAD_H
 #define __QEMU_THREAD_H 1
+#include "config-host.h"
 #include "semaphore.h"
 #include "pthread.h"
+#include "qemu-lockstat.h"
 
 struct QemuMutex {
     pthread_mutex_t lock;
+#ifdef CONFIG_MUTEX_STATS
+    QemuLockStats *stats;       /* NULL unless the mutex has a name */
+#endif
 };
 
 struct QemuCond {
@@ -22,9 +27,16 @@ typedef struct QemuThread QemuThread;
 void qemu_mutex_init(QemuMutex *mutex);
 void qemu_mutex_destroy(QemuMutex *mutex);
 void qemu_mutex_lock(QemuMutex *mutex);
+/* For wrappers that lock for their own callers, so that mutex statistics
+   attribute the acquisition to caller rather than to the wrapper */
+void qemu_mutex_lock_caller(QemuMutex *mutex, void *caller);
 int qemu_mutex_trylock(QemuMutex *mutex);
+int qemu_mutex_trylock_caller(QemuMutex *mutex, void *caller);
 int qemu_mutex_timedlock(QemuMutex *mutex, uint64_t msecs);
 void qemu_mutex_unlock(QemuMutex *mutex);
+/* Collects contention statistics for the mutex when built with
+   --enable-mutex-stats, shown by "info mutexes"; name must stay valid */
+void qemu_mutex_set_name(QemuMutex *mutex, const char *name);
 
 void qemu_cond_init(QemuCond *cond);
 void qemu_cond_destroy(QemuCond *cond);
@@ -40,5 +52,7 @@ void qemu_thread_signal(QemuThread *thread, int sig);
 void qemu_thread_self(QemuThread *thread);
 int qemu_thread_equal(QemuThread *thread1, QemuThread *thread2);
 void qemu_thread_exit(void *retval);
+void qemu_thread_join(QemuThread *thread);
+void qemu_thread_detach(QemuThread *thread);
 
 #endif
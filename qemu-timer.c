@@ -48,6 +48,11 @@
 #include "hpet.h"
 #endif
 
+#ifdef CONFIG_TIMERFD
+#include <sys/timerfd.h>
+#include "qemu-char.h"
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #include <mmsystem.h>
@@ -163,7 +168,8 @@ struct QEMUTimer {
     int64_t expire_time;
     QEMUTimerCB *cb;
     void *opaque;
-    struct QEMUTimer *next;
+    int index;              /* in the heap of its clock, -1 if not pending */
+    uint64_t seq;           /* timers due at the same time run in order */
 };
 
 struct qemu_alarm_timer {
@@ -218,6 +224,12 @@ static void unix_stop_timer(struct qemu_alarm_timer *t);
 
 #ifdef __linux__
 
+#if defined(CONFIG_TIMERFD) && defined(CONFIG_IOTHREAD)
+static int timerfd_start_timer(struct qemu_alarm_timer *t);
+static void timerfd_stop_timer(struct qemu_alarm_timer *t);
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t);
+#endif
+
 static int dynticks_start_timer(struct qemu_alarm_timer *t);
 static void dynticks_stop_timer(struct qemu_alarm_timer *t);
 static void dynticks_rearm_timer(struct qemu_alarm_timer *t);
@@ -290,6 +302,11 @@ int64_t qemu_icount_round(int64_t count)
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
 #ifdef __linux__
+#if defined(CONFIG_TIMERFD) && defined(CONFIG_IOTHREAD)
+    /* no signals, the I/O thread waits for the timerfd */
+    {"timerfd", timerfd_start_timer,
+     timerfd_stop_timer, timerfd_rearm_timer, NULL},
+#endif
     {"dynticks", dynticks_start_timer,
      dynticks_stop_timer, dynticks_rearm_timer, NULL},
     /* HPET - if available - is preferred */
@@ -377,7 +394,101 @@ QEMUClock *rt_clock;
 QEMUClock *vm_clock;
 QEMUClock *host_clock;
 
-static QEMUTimer *active_timers[QEMU_NUM_CLOCKS];
+/*
+ * The pending timers of each clock are kept in a binary min-heap, so that
+ * arming and cancelling a timer take O(log n) and the next one to expire
+ * is always active_timers[type].heap[0].
+ *
+ * NOTE: the deadline code reads the first timer from a signal handler, so
+ * the heap array is grown by copying it before the old one is freed.  A
+ * signal may still see a timer that is not the first one yet; then the
+ * alarm only fires a bit early or late and is rearmed after the change.
+ */
+typedef struct QEMUTimerHeap {
+    QEMUTimer **heap;
+    int n;
+    int size;
+} QEMUTimerHeap;
+
+static QEMUTimerHeap active_timers[QEMU_NUM_CLOCKS];
+static uint64_t timer_seq;
+
+static QEMUTimer *timer_heap_first(int type)
+{
+    QEMUTimerHeap *h = &active_timers[type];
+
+    return h->n ? h->heap[0] : NULL;
+}
+
+static bool timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+        (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+static void timer_heap_set(QEMUTimerHeap *h, int i, QEMUTimer *ts)
+{
+    h->heap[i] = ts;
+    ts->index = i;
+}
+
+/* Move the timer at i to its place, returns where it ended up */
+static int timer_heap_sift(QEMUTimerHeap *h, int i)
+{
+    QEMUTimer *ts = h->heap[i];
+
+    while (i > 0 && timer_before(ts, h->heap[(i - 1) / 2])) {
+        timer_heap_set(h, i, h->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= h->n) {
+            break;
+        }
+        if (child + 1 < h->n && timer_before(h->heap[child + 1],
+                                             h->heap[child])) {
+            child++;
+        }
+        if (!timer_before(h->heap[child], ts)) {
+            break;
+        }
+        timer_heap_set(h, i, h->heap[child]);
+        i = child;
+    }
+    timer_heap_set(h, i, ts);
+    return i;
+}
+
+static void timer_heap_remove(QEMUTimerHeap *h, QEMUTimer *ts)
+{
+    int i = ts->index;
+
+    ts->index = -1;
+    h->n--;
+    if (i != h->n) {
+        timer_heap_set(h, i, h->heap[h->n]);
+        timer_heap_sift(h, i);
+    }
+}
+
+static int timer_heap_insert(QEMUTimerHeap *h, QEMUTimer *ts)
+{
+    if (h->n == h->size) {
+        QEMUTimer **heap, **old = h->heap;
+
+        h->size = h->size ? h->size * 2 : 16;
+        heap = qemu_malloc(h->size * sizeof(*heap));
+        if (h->n) {
+            memcpy(heap, old, h->n * sizeof(*heap));
+        }
+        h->heap = heap;
+        qemu_free(old);
+    }
+    timer_heap_set(h, h->n++, ts);
+    return timer_heap_sift(h, h->n - 1);
+}
 
 static QEMUClock *qemu_new_clock(int type)
 {
@@ -401,6 +512,7 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
     ts->clock = clock;
     ts->cb = cb;
     ts->opaque = opaque;
+    ts->index = -1;
     return ts;
 }
 
@@ -412,20 +524,8 @@ void qemu_free_timer(QEMUTimer *ts)
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    if (ts->index >= 0) {
+        timer_heap_remove(&active_timers[ts->clock->type], ts);
     }
 }
 
@@ -433,28 +533,19 @@ void qemu_del_timer(QEMUTimer *ts)
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    qemu_del_timer(ts);
+    QEMUTimerHeap *h = &active_timers[ts->clock->type];
+    int i;
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t->expire_time > expire_time)
-            break;
-        pt = &t->next;
-    }
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_seq++;
+    if (ts->index >= 0) {
+        i = timer_heap_sift(h, ts->index);
+    } else {
+        i = timer_heap_insert(h, ts);
+    }
 
     /* Rearm if necessary  */
-    if (pt == &active_timers[ts->clock->type]) {
+    if (i == 0) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -466,12 +557,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 int qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for(t = active_timers[ts->clock->type]; t != NULL; t = t->next) {
-        if (t == ts)
-            return 1;
-    }
-    return 0;
+    return ts->index >= 0;
 }
 
 int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -483,21 +569,19 @@ int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
 
 static void qemu_run_timers(QEMUClock *clock)
 {
-    QEMUTimer **ptimer_head, *ts;
+    QEMUTimer *ts;
     int64_t current_time;
    
     if (!clock->enabled)
         return;
 
     current_time = qemu_get_clock (clock);
-    ptimer_head = &active_timers[clock->type];
     for(;;) {
-        ts = *ptimer_head;
+        ts = timer_heap_first(clock->type);
         if (!ts || ts->expire_time > current_time)
             break;
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        qemu_del_timer(ts);
 
         /* run the callback (the timer list can be modified) */
         ts->cb(ts->opaque);
@@ -691,12 +775,12 @@ int64_t qemu_next_deadline(void)
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
 
-    if (active_timers[QEMU_CLOCK_VIRTUAL]) {
-        delta = active_timers[QEMU_CLOCK_VIRTUAL]->expire_time -
+    if (timer_heap_first(QEMU_CLOCK_VIRTUAL)) {
+        delta = timer_heap_first(QEMU_CLOCK_VIRTUAL)->expire_time -
                      qemu_get_clock_ns(vm_clock);
     }
-    if (active_timers[QEMU_CLOCK_HOST]) {
-        int64_t hdelta = active_timers[QEMU_CLOCK_HOST]->expire_time -
+    if (timer_heap_first(QEMU_CLOCK_HOST)) {
+        int64_t hdelta = timer_heap_first(QEMU_CLOCK_HOST)->expire_time -
                  qemu_get_clock_ns(host_clock);
         if (hdelta < delta)
             delta = hdelta;
@@ -713,20 +797,20 @@ static int64_t qemu_next_alarm_deadline(void)
     int64_t delta;
     int64_t rtdelta;
 
-    if (!use_icount && active_timers[QEMU_CLOCK_VIRTUAL]) {
-        delta = active_timers[QEMU_CLOCK_VIRTUAL]->expire_time -
+    if (!use_icount && timer_heap_first(QEMU_CLOCK_VIRTUAL)) {
+        delta = timer_heap_first(QEMU_CLOCK_VIRTUAL)->expire_time -
                      qemu_get_clock(vm_clock);
     } else {
         delta = INT32_MAX;
     }
-    if (active_timers[QEMU_CLOCK_HOST]) {
-        int64_t hdelta = active_timers[QEMU_CLOCK_HOST]->expire_time -
+    if (timer_heap_first(QEMU_CLOCK_HOST)) {
+        int64_t hdelta = timer_heap_first(QEMU_CLOCK_HOST)->expire_time -
                  qemu_get_clock_ns(host_clock);
         if (hdelta < delta)
             delta = hdelta;
     }
-    if (active_timers[QEMU_CLOCK_REALTIME]) {
-        rtdelta = (active_timers[QEMU_CLOCK_REALTIME]->expire_time * 1000000 -
+    if (timer_heap_first(QEMU_CLOCK_REALTIME)) {
+        rtdelta = (timer_heap_first(QEMU_CLOCK_REALTIME)->expire_time * 1000000 -
                  qemu_get_clock_ns(rt_clock));
         if (rtdelta < delta)
             delta = rtdelta;
@@ -838,6 +922,88 @@ static void rtc_stop_timer(struct qemu_alarm_timer *t)
     close(rtc_fd);
 }
 
+#if defined(CONFIG_TIMERFD) && defined(CONFIG_IOTHREAD)
+
+/* The timerfd is read by the main loop, so it only works when the guest
+   CPUs run in threads of their own and need not be interrupted */
+static void timerfd_alarm_handler(void *opaque)
+{
+    struct qemu_alarm_timer *t = opaque;
+    uint64_t expirations;
+    ssize_t ret;
+
+    do {
+        ret = read((long)t->priv, &expirations, sizeof(expirations));
+    } while (ret < 0 && errno == EINTR);
+
+    t->expired = 1;
+    t->pending = 1;
+}
+
+static int timerfd_start_timer(struct qemu_alarm_timer *t)
+{
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    t->priv = (void *)(long)fd;
+    qemu_set_fd_handler(fd, timerfd_alarm_handler, NULL, t);
+
+    return 0;
+}
+
+static void timerfd_stop_timer(struct qemu_alarm_timer *t)
+{
+    int fd = (long)t->priv;
+
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    close(fd);
+}
+
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t)
+{
+    int fd = (long)t->priv;
+    struct itimerspec timeout;
+    int64_t nearest_delta_ns;
+    int64_t current_ns;
+
+    assert(alarm_has_dynticks(t));
+    if (!timer_heap_first(QEMU_CLOCK_REALTIME) &&
+        !timer_heap_first(QEMU_CLOCK_VIRTUAL) &&
+        !timer_heap_first(QEMU_CLOCK_HOST))
+        return;
+
+    /* there is no signal to amortize, only keep clear of zero, which
+       would disarm the timer */
+    nearest_delta_ns = qemu_next_alarm_deadline();
+    if (nearest_delta_ns < 1)
+        nearest_delta_ns = 1;
+
+    if (timerfd_gettime(fd, &timeout)) {
+        perror("timerfd_gettime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+    current_ns = timeout.it_value.tv_sec * 1000000000LL + timeout.it_value.tv_nsec;
+    if (current_ns && current_ns <= nearest_delta_ns)
+        return;
+
+    timeout.it_interval.tv_sec = 0;
+    timeout.it_interval.tv_nsec = 0; /* 0 for one-shot timer */
+    timeout.it_value.tv_sec =  nearest_delta_ns / 1000000000;
+    timeout.it_value.tv_nsec = nearest_delta_ns % 1000000000;
+    if (timerfd_settime(fd, 0 /* RELATIVE */, &timeout, NULL)) {
+        perror("timerfd_settime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+}
+
+#endif /* CONFIG_TIMERFD && CONFIG_IOTHREAD */
+
 static int dynticks_start_timer(struct qemu_alarm_timer *t)
 {
     struct sigevent ev;
@@ -888,9 +1054,9 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     int64_t current_ns;
 
     assert(alarm_has_dynticks(t));
-    if (!active_timers[QEMU_CLOCK_REALTIME] &&
-        !active_timers[QEMU_CLOCK_VIRTUAL] &&
-        !active_timers[QEMU_CLOCK_HOST])
+    if (!timer_heap_first(QEMU_CLOCK_REALTIME) &&
+        !timer_heap_first(QEMU_CLOCK_VIRTUAL) &&
+        !timer_heap_first(QEMU_CLOCK_HOST))
         return;
 
     nearest_delta_ns = qemu_next_alarm_deadline();
@@ -1008,9 +1174,9 @@ static void win32_rearm_timer(struct qemu_alarm_timer *t)
     struct qemu_alarm_win32 *data = t->priv;
 
     assert(alarm_has_dynticks(t));
-    if (!active_timers[QEMU_CLOCK_REALTIME] &&
-        !active_timers[QEMU_CLOCK_VIRTUAL] &&
-        !active_timers[QEMU_CLOCK_HOST])
+    if (!timer_heap_first(QEMU_CLOCK_REALTIME) &&
+        !timer_heap_first(QEMU_CLOCK_VIRTUAL) &&
+        !timer_heap_first(QEMU_CLOCK_HOST))
         return;
 
     timeKillEvent(data->timerId);
@@ -1074,21 +1240,22 @@ void quit_timers(void)
     t->stop(t);
 }
 
-int qemu_calculate_timeout(void)
+/* How long the main loop may wait, in nanoseconds */
+int64_t qemu_calculate_timeout(void)
 {
-    int timeout;
+    int64_t timeout;
 
 #ifdef CONFIG_IOTHREAD
     /* When using icount, making forward progress with qemu_icount when the
        guest CPU is idle is critical. We only use the static io-thread timeout
        for non icount runs.  */
     if (!use_icount) {
-        return 1000;
+        return 1000000000;
     }
 #endif
 
     if (!vm_running)
-        timeout = 5000;
+        timeout = 5000000000LL;
     else {
      /* XXX: use timeout computed from timers */
         int64_t add;
@@ -1098,7 +1265,7 @@ int qemu_calculate_timeout(void)
         if (delta > 0) {
             /* If virtual time is ahead of real time then just
                wait for IO.  */
-            timeout = (delta + 999999) / 1000000;
+            timeout = delta;
         } else {
             /* Wait for either IO to occur or the next
                timer event.  */
@@ -1110,7 +1277,7 @@ int qemu_calculate_timeout(void)
                 add = 10000000;
             delta += add;
             qemu_icount += qemu_icount_round (add);
-            timeout = delta / 1000000;
+            timeout = delta;
             if (timeout < 0)
                 timeout = 0;
         }
@@ -49,7 +49,7 @@ int qemu_alarm_pending(void);
 int64_t qemu_next_deadline(void);
 void configure_alarms(char const *opt);
 void configure_icount(const char *option);
-int qemu_calculate_timeout(void);
+int64_t qemu_calculate_timeout(void);
 void init_clocks(void);
 int init_timer_alarm(void);
 void quit_timers(void);
@@ -20,6 +20,7 @@
 #include <sys/time.h>
 
 QEMUClock *rt_clock;
+QEMUClock *vm_clock;
 
 FILE *logfile;
 
@@ -73,6 +74,38 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
 {
 }
 
+int64_t qemu_get_clock(QEMUClock *clock)
+{
+    return get_clock() / 1000000;
+}
+
+int64_t qemu_get_clock_ns(QEMUClock *clock)
+{
+    return get_clock();
+}
+
+QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
+{
+    return NULL;
+}
+
+void qemu_free_timer(QEMUTimer *ts)
+{
+}
+
+void qemu_del_timer(QEMUTimer *ts)
+{
+}
+
+void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
+{
+}
+
+int qemu_timer_pending(QEMUTimer *ts)
+{
+    return 0;
+}
+
 QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
 {
     QEMUBH *bh;
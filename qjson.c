@@ -11,9 +11,7 @@
  *
  */
 
-#include "json-lexer.h"
 #include "json-parser.h"
-#include "json-streamer.h"
 #include "qjson.h"
 #include "qint.h"
 #include "qlist.h"
@@ -23,31 +21,9 @@
 #include "qbuffer.h"
 #include "base64.h"
 
-typedef struct JSONParsingState
-{
-    JSONMessageParser parser;
-    va_list *ap;
-    QObject *result;
-} JSONParsingState;
-
-static void parse_json(JSONMessageParser *parser, QList *tokens)
-{
-    JSONParsingState *s = container_of(parser, JSONParsingState, parser);
-    s->result = json_parser_parse(tokens, s->ap);
-}
-
 QObject *qobject_from_jsonv(const char *string, va_list *ap)
 {
-    JSONParsingState state = {};
-
-    state.ap = ap;
-
-    json_message_parser_init(&state.parser, parse_json);
-    json_message_parser_feed(&state.parser, string, strlen(string));
-    json_message_parser_flush(&state.parser);
-    json_message_parser_destroy(&state.parser);
-
-    return state.result;
+    return json_parser_parse_buf(string, strlen(string), ap);
 }
 
 QObject *qobject_from_json(const char *string)
@@ -77,168 +53,179 @@ typedef struct ToJsonIterState
     int indent;
     int pretty;
     int count;
-    QString *str;
+    JSONEmitFunc *emit;
+    void *opaque;
 } ToJsonIterState;
 
-static void to_json(const QObject *obj, QString *str, int pretty, int indent);
+static void to_json(ToJsonIterState *s, const QObject *obj, int indent);
+
+static void emit_str(ToJsonIterState *s, const char *str)
+{
+    s->emit(s->opaque, str, strlen(str));
+}
+
+static void emit_indent(ToJsonIterState *s, int indent)
+{
+    int j;
+
+    s->emit(s->opaque, "\n", 1);
+    for (j = 0 ; j < indent ; j++)
+        s->emit(s->opaque, "    ", 4);
+}
+
+static void to_json_string(ToJsonIterState *s, const char *ptr)
+{
+    const char *run;
+
+    emit_str(s, "\"");
+    while (*ptr) {
+        /* copy characters that need no escape in one go */
+        for (run = ptr; *ptr && !(*ptr & 0x80) && *ptr > 0x1F &&
+             *ptr != '\"' && *ptr != '\\'; ptr++) {
+            /* nothing */
+        }
+        if (ptr > run) {
+            s->emit(s->opaque, run, ptr - run);
+        }
+        if (!*ptr) {
+            break;
+        }
+
+        if ((ptr[0] & 0xE0) == 0xE0 &&
+            (ptr[1] & 0x80) && (ptr[2] & 0x80)) {
+            uint16_t wchar;
+            char escape[7];
+
+            wchar  = (ptr[0] & 0x0F) << 12;
+            wchar |= (ptr[1] & 0x3F) << 6;
+            wchar |= (ptr[2] & 0x3F);
+            ptr += 2;
+
+            snprintf(escape, sizeof(escape), "\\u%04X", wchar);
+            emit_str(s, escape);
+        } else if ((ptr[0] & 0xE0) == 0xC0 && (ptr[1] & 0x80)) {
+            uint16_t wchar;
+            char escape[7];
+
+            wchar  = (ptr[0] & 0x1F) << 6;
+            wchar |= (ptr[1] & 0x3F);
+            ptr++;
+
+            snprintf(escape, sizeof(escape), "\\u%04X", wchar);
+            emit_str(s, escape);
+        } else switch (ptr[0]) {
+            case '\"':
+                emit_str(s, "\\\"");
+                break;
+            case '\\':
+                emit_str(s, "\\\\");
+                break;
+            case '\b':
+                emit_str(s, "\\b");
+                break;
+            case '\f':
+                emit_str(s, "\\f");
+                break;
+            case '\n':
+                emit_str(s, "\\n");
+                break;
+            case '\r':
+                emit_str(s, "\\r");
+                break;
+            case '\t':
+                emit_str(s, "\\t");
+                break;
+            default: {
+                if (ptr[0] <= 0x1F) {
+                    char escape[7];
+                    snprintf(escape, sizeof(escape), "\\u%04X", ptr[0]);
+                    emit_str(s, escape);
+                } else {
+                    s->emit(s->opaque, ptr, 1);
+                }
+                break;
+            }
+            }
+        ptr++;
+    }
+    emit_str(s, "\"");
+}
 
 static void to_json_dict_iter(const char *key, QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
-    QString *qkey;
-    int j;
 
     if (s->count)
-        qstring_append(s->str, ", ");
+        emit_str(s, ", ");
 
     if (s->pretty) {
-        qstring_append(s->str, "\n");
-        for (j = 0 ; j < s->indent ; j++)
-            qstring_append(s->str, "    ");
+        emit_indent(s, s->indent);
     }
 
-    qkey = qstring_from_str(key);
-    to_json(QOBJECT(qkey), s->str, s->pretty, s->indent);
-    QDECREF(qkey);
-
-    qstring_append(s->str, ": ");
-    to_json(obj, s->str, s->pretty, s->indent);
+    to_json_string(s, key);
+    emit_str(s, ": ");
+    to_json(s, obj, s->indent);
     s->count++;
 }
 
 static void to_json_list_iter(QObject *obj, void *opaque)
 {
     ToJsonIterState *s = opaque;
-    int j;
 
     if (s->count)
-        qstring_append(s->str, ", ");
+        emit_str(s, ", ");
 
     if (s->pretty) {
-        qstring_append(s->str, "\n");
-        for (j = 0 ; j < s->indent ; j++)
-            qstring_append(s->str, "    ");
+        emit_indent(s, s->indent);
     }
 
-    to_json(obj, s->str, s->pretty, s->indent);
+    to_json(s, obj, s->indent);
     s->count++;
 }
 
-static void to_json(const QObject *obj, QString *str, int pretty, int indent)
+static void to_json(ToJsonIterState *parent, const QObject *obj, int indent)
 {
+    ToJsonIterState s = *parent;
+
     switch (qobject_type(obj)) {
     case QTYPE_QINT: {
         QInt *val = qobject_to_qint(obj);
         char buffer[1024];
 
         snprintf(buffer, sizeof(buffer), "%" PRId64, qint_get_int(val));
-        qstring_append(str, buffer);
+        emit_str(&s, buffer);
         break;
     }
     case QTYPE_QSTRING: {
         QString *val = qobject_to_qstring(obj);
-        const char *ptr;
-
-        ptr = qstring_get_str(val);
-        qstring_append(str, "\"");
-        while (*ptr) {
-            if ((ptr[0] & 0xE0) == 0xE0 &&
-                (ptr[1] & 0x80) && (ptr[2] & 0x80)) {
-                uint16_t wchar;
-                char escape[7];
-
-                wchar  = (ptr[0] & 0x0F) << 12;
-                wchar |= (ptr[1] & 0x3F) << 6;
-                wchar |= (ptr[2] & 0x3F);
-                ptr += 2;
-
-                snprintf(escape, sizeof(escape), "\\u%04X", wchar);
-                qstring_append(str, escape);
-            } else if ((ptr[0] & 0xE0) == 0xC0 && (ptr[1] & 0x80)) {
-                uint16_t wchar;
-                char escape[7];
-
-                wchar  = (ptr[0] & 0x1F) << 6;
-                wchar |= (ptr[1] & 0x3F);
-                ptr++;
-
-                snprintf(escape, sizeof(escape), "\\u%04X", wchar);
-                qstring_append(str, escape);
-            } else switch (ptr[0]) {
-                case '\"':
-                    qstring_append(str, "\\\"");
-                    break;
-                case '\\':
-                    qstring_append(str, "\\\\");
-                    break;
-                case '\b':
-                    qstring_append(str, "\\b");
-                    break;
-                case '\f':
-                    qstring_append(str, "\\f");
-                    break;
-                case '\n':
-                    qstring_append(str, "\\n");
-                    break;
-                case '\r':
-                    qstring_append(str, "\\r");
-                    break;
-                case '\t':
-                    qstring_append(str, "\\t");
-                    break;
-                default: {
-                    if (ptr[0] <= 0x1F) {
-                        char escape[7];
-                        snprintf(escape, sizeof(escape), "\\u%04X", ptr[0]);
-                        qstring_append(str, escape);
-                    } else {
-                        char buf[2] = { ptr[0], 0 };
-                        qstring_append(str, buf);
-                    }
-                    break;
-                }
-                }
-            ptr++;
-        }
-        qstring_append(str, "\"");
+
+        to_json_string(&s, qstring_get_str(val));
         break;
     }
     case QTYPE_QDICT: {
-        ToJsonIterState s;
         QDict *val = qobject_to_qdict(obj);
 
         s.count = 0;
-        s.str = str;
         s.indent = indent + 1;
-        s.pretty = pretty;
-        qstring_append(str, "{");
+        emit_str(&s, "{");
         qdict_iter(val, to_json_dict_iter, &s);
-        if (pretty) {
-            int j;
-            qstring_append(str, "\n");
-            for (j = 0 ; j < indent ; j++)
-                qstring_append(str, "    ");
+        if (s.pretty) {
+            emit_indent(&s, indent);
         }
-        qstring_append(str, "}");
+        emit_str(&s, "}");
         break;
     }
     case QTYPE_QLIST: {
-        ToJsonIterState s;
         QList *val = qobject_to_qlist(obj);
 
         s.count = 0;
-        s.str = str;
         s.indent = indent + 1;
-        s.pretty = pretty;
-        qstring_append(str, "[");
+        emit_str(&s, "[");
         qlist_iter(val, (void *)to_json_list_iter, &s);
-        if (pretty) {
-            int j;
-            qstring_append(str, "\n");
-            for (j = 0 ; j < indent ; j++)
-                qstring_append(str, "    ");
+        if (s.pretty) {
+            emit_indent(&s, indent);
         }
-        qstring_append(str, "]");
+        emit_str(&s, "]");
         break;
     }
     case QTYPE_QFLOAT: {
@@ -257,30 +244,37 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
             buffer[len] = 0;
         }
         
-        qstring_append(str, buffer);
+        emit_str(&s, buffer);
         break;
     }
     case QTYPE_QBOOL: {
         QBool *val = qobject_to_qbool(obj);
 
         if (qbool_get_int(val)) {
-            qstring_append(str, "true");
+            emit_str(&s, "true");
         } else {
-            qstring_append(str, "false");
+            emit_str(&s, "false");
         }
         break;
     }
     case QTYPE_QBUFFER: {
         QBuffer *val = qobject_to_qbuffer(obj);
+        const uint8_t *data = qbuffer_get_data(val);
         size_t data_size = qbuffer_get_size(val);
-        size_t str_len = ((data_size + 2) / 3) * 4;
-        char *buffer = qemu_malloc(str_len + 1);
-
-        base64_encode(qbuffer_get_data(val), data_size, buffer);
-        qstring_append(str, "{\"__class__\": \"buffer\", \"data\": \"");
-        qstring_append(str, buffer);
-        qstring_append(str, "\"}");
-        qemu_free(buffer);
+        char buffer[1024 + 1];
+
+        /* encode a chunk at a time, a multiple of 3 bytes keeps the
+           output the same as for the whole buffer */
+        emit_str(&s, "{\"__class__\": \"buffer\", \"data\": \"");
+        while (data_size) {
+            size_t n = MIN(data_size, 768);
+
+            base64_encode(data, n, buffer);
+            emit_str(&s, buffer);
+            data += n;
+            data_size -= n;
+        }
+        emit_str(&s, "\"}");
         break;
     }
     case QTYPE_QERROR:
@@ -290,11 +284,32 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
     }
 }
 
+/**
+ * qobject_to_json_stream(): Encode 'obj' to JSON, passing the text to
+ * 'emit' a piece at a time instead of building it in memory
+ */
+void qobject_to_json_stream(const QObject *obj, int pretty,
+                            JSONEmitFunc *emit, void *opaque)
+{
+    ToJsonIterState s = {
+        .pretty = pretty,
+        .emit = emit,
+        .opaque = opaque,
+    };
+
+    to_json(&s, obj, 0);
+}
+
+static void to_qstring(void *opaque, const char *buf, size_t len)
+{
+    qstring_append_len(opaque, buf, len);
+}
+
 QString *qobject_to_json(const QObject *obj)
 {
     QString *str = qstring_new();
 
-    to_json(obj, str, 0, 0);
+    qobject_to_json_stream(obj, 0, to_qstring, str);
 
     return str;
 }
@@ -303,7 +318,7 @@ QString *qobject_to_json_pretty(const QObject *obj)
 {
     QString *str = qstring_new();
 
-    to_json(obj, str, 1, 0);
+    qobject_to_json_stream(obj, 1, to_qstring, str);
 
     return str;
 }
@@ -25,4 +25,8 @@ QObject *qobject_from_jsonv(const char *string, va_list *ap) GCC_FMT_ATTR(1, 0);
 QString *qobject_to_json(const QObject *obj);
 QString *qobject_to_json_pretty(const QObject *obj);
 
+typedef void (JSONEmitFunc)(void *opaque, const char *buf, size_t len);
+void qobject_to_json_stream(const QObject *obj, int pretty,
+                            JSONEmitFunc *emit, void *opaque);
+
 #endif /* QJSON_H */
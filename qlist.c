@@ -31,7 +31,7 @@ QList *qlist_new(void)
 {
     QList *qlist;
 
-    qlist = qemu_malloc(sizeof(*qlist));
+    qlist = qobject_alloc(sizeof(*qlist));
     QTAILQ_INIT(&qlist->head);
     QOBJECT_INIT(qlist, &qlist_type);
 
@@ -153,5 +153,5 @@ static void qlist_destroy_obj(QObject *obj)
         qemu_free(entry);
     }
 
-    qemu_free(qlist);
+    qobject_free(obj);
 }
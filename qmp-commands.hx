@@ -338,14 +338,681 @@ Example:
 EQMP
     {
         .name       = "device_show",
-        .args_type  = "path:Q",
-        .params     = "device [-f]",
-        .help       = "show device state (specify -f for full buffer dumping)",
+        .args_type  = "full:-f,capture:-c,path:Q,max-bytes:i?,max-elems:i?,"
+                      "max-us:i?,continue:s?",
+        .params     = "[-f] [-c] device [max-bytes [max-elems [max-us [continue]]]]",
+        .help       = "show device state (specify -f for full buffer dumping, "
+                      "-c to format a copy without pre_save hooks); stop "
+                      "after max-bytes, max-elems or max-us (0 for no limit) "
+                      "and resume with the continue token",
         .user_print = device_user_print,
         .mhandler.cmd_new = do_device_show,
     },
 
 SQMP
+device_show
+-----------
+
+Return the state of a device.
+
+Arguments:
+
+- "path": the device's qtree path or ID (json-string)
+- "full": dump buffers completely instead of their first 16 bytes
+  (json-bool, optional)
+- "capture": copy the raw field memory first and build the result from the
+  copy without holding the global mutex.  The device's pre_save hooks are
+  not called and queue fields have no elements (json-bool, optional)
+- "max-bytes": stop once this many bytes of values were returned; a full
+  buffer is cut to what is left, at least 16 bytes (json-int, optional)
+- "max-elems": stop once this many top-level elements were returned, an
+  element of an array of structs or of a queue counting with everything in
+  it (json-int, optional)
+- "max-us": stop once this many microseconds passed (json-int, optional)
+- "continue": resume where the previous call stopped (json-string,
+  optional)
+
+The limits are 0 for none.  They are checked between the elements of
+top-level fields, so at least one element is returned and the command
+holds the global mutex for little more than "max-us".  When the command
+stops early, the result has a "continue" json-string to pass to the next
+call, and the first field of that call has "first", the index of its first
+element (json-int).  The device may change between calls.  Only the first
+call returns "guest-state", and the limits cannot be used with "capture".
+
+Devices that track the changes of their state also return the
+"generation" of the last change (json-int).  Generations are shared by all
+devices and only go up, see device_show_all.
+
+Once the device has been migrated or snapshotted, the result also has a
+"migration" json-object with the bytes and nanoseconds its state took in the
+last save ("save-bytes", "save-ns") and load ("load-bytes", "load-ns"),
+counting only the part done with the guest stopped.
+
+Devices that keep state in guest memory add a "guest-state" json-object,
+read from guest memory at the time of the command even with "capture".
+Virtio devices, which have no state description and return no "fields",
+put a "virtqueues" json-array in it, one json-object per configured queue:
+
+- "index", "num": the queue and its size (json-int)
+- "desc-addr", "avail-addr", "used-addr": guest addresses of the
+  descriptor table and the rings (json-int)
+- "mapped": whether the rings were read through a host mapping rather than
+  copied (json-bool)
+- "avail-idx", "avail-flags", "used-idx", "used-flags": as in the rings
+  (json-int)
+- "last-avail-idx": the next available entry the device will take
+  (json-int)
+- "pending": chains made available that the device did not take yet
+  (json-int)
+- "inuse": chains taken but not completed yet (json-int)
+- "chains": the first 64 pending chains, each with its "head" (json-int),
+  "indirect", the address of its indirect table if it has one (json-int,
+  optional), and "descs", a json-array of "addr", "len" (json-int) and
+  "write" (json-bool) (json-array)
+- "more": true if there are more pending chains (json-bool, optional)
+- "error": what is wrong with the ring, such as an available index too far
+  ahead, in which case there are no "chains"; chains that cannot be
+  followed have an "error" as well (json-string, optional)
+
+Example:
+
+-> { "execute": "device_show", "arguments": { "path": "rtc" } }
+<- { "return": { "device": "mc146818rtc.0", "id": "rtc", "version": 2,
+                 "fields": [ ... ] } }
+
+EQMP
+
+    {
+        .name       = "device_buffer",
+        .args_type  = "path:Q,field:s,offset:i?,length:i?,fd:s?",
+        .params     = "device field [offset [length [fd]]]",
+        .help       = "dump length bytes of a device state field starting at offset",
+        .user_print = device_buffer_user_print,
+        .mhandler.cmd_new = do_device_buffer,
+    },
+
+SQMP
+device_buffer
+-------------
+
+Return a window of the raw contents of a device state field, so that large
+buffers can be read in chunks.  The data is copied straight from the
+device state, without building per-byte objects.
+
+Arguments:
+
+- "path": the device's qtree path or ID (json-string)
+- "field": field name, nested fields and array elements are selected like
+  "rx[3].status"; without an index, a whole array is returned (json-string)
+- "offset": first byte to return, default 0 (json-int, optional)
+- "length": number of bytes to return, default and maximum is the rest of
+  the field, but at most 65536 bytes without "fd" (json-int, optional)
+- "fd": write the data to this file descriptor, previously passed with
+  getfd, instead of returning it.  The descriptor is closed afterwards
+  (json-string, optional)
+
+Return a json-object with the following information:
+
+- "field": the field name (json-string)
+- "offset": offset of the returned data (json-int)
+- "length": number of bytes returned or written (json-int)
+- "total": size of the field (json-int)
+- "data": the data (buffer object, base64 encoded), not present with "fd"
+
+Example:
+
+-> { "execute": "device_buffer",
+     "arguments": { "path": "rtc", "field": "cmos_data", "offset": 8,
+                    "length": 4 } }
+<- { "return": { "field": "cmos_data", "offset": 8, "length": 4,
+                 "total": 128,
+                 "data": { "__class__": "buffer", "data": "AQEQIA==" } } }
+
+EQMP
+
+    {
+        .name       = "device_queue",
+        .args_type  = "full:-f,path:Q,field:s,start:i?,count:i?",
+        .params     = "[-f] device field [start [count]]",
+        .help       = "show count elements of a device state queue starting at start",
+        .user_print = device_user_print,
+        .mhandler.cmd_new = do_device_queue,
+    },
+
+SQMP
+device_queue
+------------
+
+Return a page of the elements of a queue in the state of a device.
+device_show only includes the first 16 elements of each queue and sets
+"more" in the queue's field object if there are others.  Only the elements
+up to the last one returned are visited.
+
+Arguments:
+
+- "path": the device's qtree path or ID (json-string)
+- "field": the queue field name (json-string)
+- "start": number of the first element to return, default 0
+  (json-int, optional)
+- "count": maximum number of elements to return, default 64, at most
+  4096 (json-int, optional)
+- "full": dump buffers completely (json-bool, optional)
+
+Return a json-object in the format of device_show with one field object
+for the queue, whose "elems" list has one list of field objects per queue
+element, plus:
+
+- "first": number of the first returned element (json-int)
+
+Example:
+
+-> { "execute": "device_queue",
+     "arguments": { "path": "dev0", "field": "requests", "count": 1 } }
+<- { "return": { "device": "foo.0", "id": "dev0", "version": 1,
+                 "first": 0, "fields": [ { "name": "requests", "size": 0,
+                 "elems": [ [ { "name": "tag", "size": 4,
+                                "elems": [ 3 ] } ] ], "more": true } ] } }
+
+EQMP
+
+    {
+        .name       = "device_show_all",
+        .args_type  = "capture:-c,pattern:s?,since:l?",
+        .params     = "[-c] [pattern [since]]",
+        .help       = "show the state of all devices, or of those matching pattern; "
+                      "with since, only of those that may have changed after "
+                      "that generation (-c to format copies in parallel "
+                      "without pre_save hooks)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_show_all,
+    },
+
+SQMP
+device_show_all
+---------------
+
+Return the state of all devices in the device tree that have a state
+description or guest state (see device_show), in one response.  Devices are serialized one by one while
+the tree is walked, the complete result is never held in memory.
+
+Arguments:
+
+- "pattern": only include devices whose driver name, instance name or ID
+  match this shell wildcard pattern (json-string, optional)
+- "since": leave out devices that track their state changes and did not
+  change after this generation (json-int, optional)
+- "capture": copy the raw field memory of all devices first, in one pass,
+  and build the results from the copies on worker threads without holding
+  the global mutex.  As for device_show, pre_save hooks are not called and
+  queue fields have no elements; the results of all devices are held in
+  memory until they are sent (json-bool, optional)
+
+Return a json-array with one json-object per device, in the same format
+as device_show.  To only get what changed, pass the highest "generation"
+seen so far as "since"; the devices that do not track their changes are
+always included.
+
+Example:
+
+-> { "execute": "device_show_all", "arguments": { "pattern": "e1000*" } }
+<- { "return": [ { "device": "e1000.0", "id": "", "version": 2,
+                   "fields": [ ... ] } ] }
+
+EQMP
+
+    {
+        .name       = "device_snapshot",
+        .args_type  = "path:Q",
+        .params     = "device",
+        .help       = "take a binary snapshot of the device state",
+        .user_print = device_snapshot_user_print,
+        .mhandler.cmd_new = do_device_snapshot,
+    },
+
+SQMP
+device_snapshot
+---------------
+
+Copy the state of a device into one binary blob.  Unlike device_show, no
+per-value objects are created; the blob must be decoded with the layout
+returned by device_schema, which only changes with the device's version.
+
+Arguments:
+
+- "path": the device's qtree path or ID (json-string)
+
+Return a json-object with the following information:
+
+- "device": device name and instance number (json-string)
+- "id": device ID, empty if not set (json-string)
+- "version": state version (json-int)
+- "data": the snapshot (buffer object, base64 encoded)
+
+The blob contains the schema entries in order, in host byte order.  For
+each entry, a one byte presence flag is present first if the entry is
+"optional" (the entry is skipped when it is zero), followed by a 32-bit
+element count if "variable-elems" is set and a 32-bit element size if
+"variable-size" is set.  Then all elements follow; scalar, bitfield and
+buffer elements are "size" bytes each, struct elements consist of the
+following "children" entries, queue entries and their children carry no data.
+
+Example:
+
+-> { "execute": "device_snapshot", "arguments": { "path": "rtc" } }
+<- { "return": { "device": "mc146818rtc.0", "id": "rtc", "version": 2,
+                 "data": { "__class__": "buffer", "data": "QQAzABMABBQQ..." } } }
+
+EQMP
+
+    {
+        .name       = "device_schema",
+        .args_type  = "path:Q",
+        .params     = "device",
+        .help       = "show the layout of device_snapshot blobs for a device",
+        .user_print = device_schema_user_print,
+        .mhandler.cmd_new = do_device_schema,
+    },
+
+SQMP
+device_schema
+-------------
+
+Return the layout of the device_snapshot blobs of a device.  Clients are
+expected to cache it by device state name and version.
+
+Arguments:
+
+- "path": the device's qtree path or ID (json-string)
+
+Return a json-object with the following information:
+
+- "name": state description name (json-string)
+- "version": state version (json-int)
+- "big-endian": byte order of snapshot values (json-bool)
+- "entries": json-array of json-objects, flattened in depth-first order:
+  - "name": field name (json-string)
+  - "kind": one of "scalar", "bitfield", "buffer", "struct", "queue"
+    (json-string)
+  - "size": element size, 0 if variable (json-int)
+  - "elems": element count, 1 if variable (json-int)
+  - "array": whether the field is an array (json-bool)
+  - "optional": whether the field may be absent (json-bool)
+  - "variable-elems": element count is stored in the blob (json-bool)
+  - "variable-size": element size is stored in the blob (json-bool)
+  - "children": number of following entries making up one struct or queue
+    element (json-int)
+  - "start": name of the start index, optional (json-string)
+  - "bits": named bits of bitfield entries, optional (json-array of
+    json-objects with "name" (json-string) and "mask" (json-int); values of
+    multi-bit masks are shifted to bit 0)
+- "subsections": names of the subsection descriptions, which are only sent
+  by migration and are not part of snapshots, optional (json-array of
+  json-string)
+
+Example:
+
+-> { "execute": "device_schema", "arguments": { "path": "rtc" } }
+<- { "return": { "name": "mc146818rtc", "version": 2, "big-endian": false,
+                 "entries": [ { "name": "cmos_data", "kind": "buffer",
+                                "size": 128, "elems": 1, "array": false,
+                                "optional": false, "variable-elems": false,
+                                "variable-size": false, "children": 0 },
+                              ... ] } }
+
+EQMP
+
+    {
+        .name       = "vmstate_schemas",
+        .args_type  = "hash:s?",
+        .params     = "[hash]",
+        .help       = "show the layouts of all device state descriptions",
+        .user_print = vmstate_schemas_user_print,
+        .mhandler.cmd_new = do_vmstate_schemas,
+    },
+
+SQMP
+vmstate_schemas
+---------------
+
+Return the schemas of all state descriptions that this QEMU knows about:
+those of the registered migration sections, of all device types, and all
+descriptions they nest or have as subsections.  The result only changes
+with the QEMU binary and, for sections that are not devices, with the
+machine, so clients are expected to fetch it once and then revalidate it
+by hash.
+
+Arguments:
+
+- "hash": hash of the schemas the client has cached, optional (json-string)
+
+Return a json-object with the following information:
+
+- "hash": content hash of "schemas" and "unstructured" (json-string)
+- "schemas": json-array of schemas sorted by name and version, in the
+  format returned by device_schema; left out if "hash" was given and
+  matches
+- "unstructured": names of the migration sections without a description,
+  whose state cannot be decoded with a schema; left out if "hash" was given
+  and matches (json-array of json-string)
+
+Example:
+
+-> { "execute": "vmstate_schemas" }
+<- { "return": { "hash": "9b1e0c43a7d25f10",
+                 "schemas": [ { "name": "8254 pit", "version": 2, ... },
+                              ... ],
+                 "unstructured": [ "block", "ram", ... ] } }
+
+-> { "execute": "vmstate_schemas",
+     "arguments": { "hash": "9b1e0c43a7d25f10" } }
+<- { "return": { "hash": "9b1e0c43a7d25f10" } }
+
+EQMP
+
+    {
+        .name       = "vmstate_bench",
+        .args_type  = "iterations:i?",
+        .params     = "[iterations]",
+        .help       = "measure the device state walkers on every device",
+        .user_print = vmstate_bench_user_print,
+        .mhandler.cmd_new = do_vmstate_bench,
+    },
+
+SQMP
+vmstate_bench
+-------------
+
+Measure the device state walkers: dump, snapshot, save and load the state
+of every device with a state description iterations times, and return
+what one call cost.  The guest is stopped meanwhile.  Every device ends up
+with the state it had, but its pre_save and post_load hooks run once per
+iteration.  See also the -vmstate-bench option.
+
+Arguments:
+
+- "iterations": default 1000, at most 1000000 (json-int, optional)
+
+Return a json-array with one json-object per device:
+
+- "device": instance name, as in device_show (json-string)
+- "vmsd": name of the state description (json-string)
+- "fields": number of fields of the description, nested ones included
+  (json-int)
+- "dump": the field objects of device_show; "snapshot": the binary format
+  of device_snapshot; "save": the migration format; "load": loading that
+  back.  Each a json-object with:
+  - "ns": nanoseconds per call (json-int)
+  - "ns-per-field": "ns" divided by "fields" (json-number)
+  - "bytes": size of the state walked, or of the snapshot or migration
+    data (json-int)
+  - "allocs": memory allocations per call, QObjects included (json-number)
+  - "error": set if loading failed (json-string, optional)
+
+Example:
+
+-> { "execute": "vmstate_bench", "arguments": { "iterations": 100 } }
+<- { "return": [ { "device": "mc146818rtc.0", "vmsd": "mc146818rtc",
+                   "fields": 10,
+                   "dump": { "ns": 5210, "ns-per-field": 521.0,
+                             "bytes": 108, "allocs": 65.0 },
+                   ... }, ... ] }
+
+EQMP
+
+    {
+        .name       = "device_watch",
+        .args_type  = "path:Q,interval:i?",
+        .params     = "device [interval]",
+        .help       = "report device state changes every interval ms as QMP events",
+        .user_print = device_watch_user_print,
+        .mhandler.cmd_new = do_device_watch,
+    },
+
+SQMP
+device_watch
+------------
+
+Subscribe to changes of a device's state.  The device is sampled
+periodically and each sample is compared against the previous one; if any
+field element changed, a DEVICE_STATE_CHANGE event listing only the changed
+elements is emitted.  The first sample reports the complete state.
+
+Arguments:
+
+- "path": the device's qtree path or ID (json-string)
+- "interval": sampling interval in milliseconds, default 1000 (json-int,
+  optional)
+
+Return a json-object with the following information:
+
+- "id": the watch ID, used for device_unwatch and in events (json-int)
+
+Example:
+
+-> { "execute": "device_watch", "arguments": { "path": "rtc",
+                                              "interval": 100 } }
+<- { "return": { "id": 0 } }
+
+EQMP
+
+    {
+        .name       = "device_unwatch",
+        .args_type  = "id:i",
+        .params     = "id",
+        .help       = "stop a device_watch subscription",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_unwatch,
+    },
+
+SQMP
+device_unwatch
+--------------
+
+Stop a device state watch.  Watches also end when their device is removed.
+
+Arguments:
+
+- "id": the watch ID returned by device_watch (json-int)
+
+Example:
+
+-> { "execute": "device_unwatch", "arguments": { "id": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "device_sample",
+        .args_type  = "delta:-d,path:Q,interval:i?,slots:i?,fields:s?",
+        .params     = "[-d] device [interval [slots [fields]]]",
+        .help       = "sample device state, or only the given fields, every interval ms into a ring of slots records (interval 0 stops, -d to keep deltas)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_sample,
+    },
+
+SQMP
+device_sample
+-------------
+
+Start sampling a device's state into an in-memory ring.  Every sample is a
+device_snapshot blob; sampling does not involve the monitor, so short-lived
+states are caught without polling.  Starting again discards the history.
+
+With "fields", only the named integer fields are sampled, one column each.
+This is cheap enough to follow queue indices or status registers every
+millisecond.  The fields are looked up when sampling starts.
+
+With "delta", every sample is kept as an XBZRLE delta against the previous
+one, so that hours of history of a device that changes little fit in a
+few hundred kilobytes.  Every 64th sample is kept whole, so that any sample
+is rebuilt from at most 64 records; when the history is full, the oldest
+64 samples are dropped at once.
+
+Arguments:
+
+- "path": the device's qtree path or ID (json-string)
+- "interval": sampling interval in milliseconds, default 100, 0 stops
+  sampling (json-int, optional)
+- "slots": number of samples kept, default 256 (json-int, optional)
+- "fields": comma separated paths of up to 16 integer fields, as in
+  device_buffer, e.g. "cmos_index,current_tm.tm_sec" (json-string, optional)
+- "delta": keep the samples as deltas, then "slots" may be between 64 and
+  1048576; not together with "fields" (json-bool, optional)
+
+Example:
+
+-> { "execute": "device_sample", "arguments": { "path": "rtc",
+                                               "interval": 10 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "device_history",
+        .args_type  = "path:Q,at:l?",
+        .params     = "device [at]",
+        .help       = "return the samples collected by device_sample",
+        .user_print = device_history_user_print,
+        .mhandler.cmd_new = do_device_history,
+    },
+
+SQMP
+device_history
+--------------
+
+Return all samples currently held in a device's sample ring.  Samples
+kept as deltas are rebuilt into complete device_snapshot blobs.
+
+Arguments:
+
+- "path": the device's qtree path or ID (json-string)
+- "at": only return the last sample taken at or before this rt_clock time
+  in nanoseconds, not when sampling fields (json-int, optional)
+
+Return a json-object with the following information:
+
+- "device": device name and instance number (json-string)
+- "id": device ID, empty if not set (json-string)
+- "version": state version (json-int)
+- "interval": sampling interval in milliseconds (json-int)
+- "samples": number of samples in "data" (json-int)
+- "dropped": samples lost because they outgrew their slot (json-int)
+- "bytes": memory held by the samples (json-int)
+- "data": the samples, oldest first (buffer object, base64 encoded).  Each
+  sample starts with a 64-bit rt_clock timestamp in nanoseconds and a 32-bit
+  length, in host byte order and without padding, followed by a
+  device_snapshot blob of that length.  Not present when sampling fields.
+- "timestamps": rt_clock time of each sample in nanoseconds, oldest first,
+  when sampling fields (json-array of json-int)
+- "fields": when sampling fields, a json-array of json-objects containing:
+    - "name": the field's path (json-string)
+    - "size": the field's size in bytes (json-int)
+    - "values": the field's value in each sample, in the order of
+                "timestamps" (json-array of json-int)
+
+Examples:
+
+-> { "execute": "device_history", "arguments": { "path": "rtc" } }
+<- { "return": { "device": "mc146818rtc.0", "id": "rtc", "version": 2,
+                 "interval": 10, "samples": 256, "dropped": 0,
+                 "bytes": 108544,
+                 "data": { "__class__": "buffer", "data": "..." } } }
+
+-> { "execute": "device_sample", "arguments": { "path": "rtc",
+                                               "interval": 1,
+                                               "fields": "cmos_index" } }
+<- { "return": {} }
+-> { "execute": "device_history", "arguments": { "path": "rtc" } }
+<- { "return": { "device": "mc146818rtc.0", "id": "rtc", "version": 2,
+                 "interval": 1, "samples": 3, "dropped": 0, "bytes": 2304,
+                 "timestamps": [ 81529004112, 81530006410, 81531004871 ],
+                 "fields": [ { "name": "cmos_index", "size": 1,
+                               "values": [ 0, 10, 10 ] } ] } }
+
+EQMP
+
+    {
+        .name       = "device_export",
+        .args_type  = "chardev:s,interval:i?",
+        .params     = "chardev [interval]",
+        .help       = "write the state of all devices to chardev every interval ms in a fixed binary layout (interval 0 stops)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_export,
+    },
+
+SQMP
+device_export
+-------------
+
+Start writing the state of all devices with a state description to a
+character device, for a collector that compares many guests.  Every
+interval, one sweep frame holds a record per device.  The fields of fixed
+size of a description are at the same offset in each of its records, so a
+collector reads them without parsing.  The first time a description is
+exported on a connection, a layout frame listing the path, offset, size
+and element count of each field precedes the sweep.  Variable-sized
+arrays, buffers and queues are not exported; device_snapshot has them.
+
+Frames are in host byte order, the format is described in
+hw/qdev-export.c.  Starting again on the same character device changes
+the interval.
+
+Arguments:
+
+- "chardev": ID of a character device used for nothing else, such as a
+  unix socket (json-string)
+- "interval": interval in milliseconds, default 1000, 0 stops
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "device_export", "arguments": { "chardev": "export0",
+                                               "interval": 5000 } }
+<- { "return": {} }
+
+EQMP
+
+#ifdef CONFIG_POSIX
+    {
+        .name       = "device_shm",
+        .args_type  = "path:F,interval:i?",
+        .params     = "path [interval]",
+        .help       = "copy the state of all devices into shared memory file path every interval ms (interval 0 stops)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_device_shm,
+    },
+#endif
+
+SQMP
+device_shm
+----------
+
+Start copying the state of all devices with a state description into a
+file that other processes map, such as one in /dev/shm, for readers that
+want the state often without going through the monitor.  Every interval,
+each device's record is copied into its slot, under a sequence count that
+is odd while the slot is written; a reader copies the record and retries
+if the count was odd or changed meanwhile.  Devices that track changes
+are only copied when they changed.  Records have the fixed layouts of
+device_export, described at the start of the file.
+
+When devices are added or removed, a new file replaces the old one, and
+the old one is marked stale so that readers map the file again.  The
+format is described in hw/qdev-shm.c.  Starting again with the same path
+changes the interval; stopping removes the file.
+
+Arguments:
+
+- "path": file to create, replaced if it exists (json-string)
+- "interval": interval in milliseconds, default 1000, 0 stops
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "device_shm", "arguments": { "path": "/dev/shm/vm1-devices",
+                                            "interval": 20 } }
+<- { "return": {} }
 
 EQMP
 
@@ -443,13 +1110,15 @@ EQMP
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
-        .params     = "[-d] [-b] [-i] uri",
+        .args_type  = "detach:-d,blk:-b,inc:-i,postcopy:-p,uri:s",
+        .params     = "[-d] [-b] [-i] [-p] uri",
         .help       = "migrate to URI (using -d to not wait for completion)"
 		      "\n\t\t\t -b for migration without shared storage with"
 		      " full copy of disk\n\t\t\t -i for migration without "
 		      "shared storage with incremental copy of disk "
-		      "(base image shared between src and destination)",
+		      "(base image shared between src and destination)"
+		      "\n\t\t\t -p to run the guest on the destination "
+		      "right away and copy RAM after it (post-copy)",
         .user_print = monitor_user_noop,	
 	.mhandler.cmd_new = do_migrate,
     },
@@ -464,6 +1133,9 @@ Arguments:
 
 - "blk": block migration, full disk copy (json-bool, optional)
 - "inc": incremental disk copy (json-bool, optional)
+- "postcopy": start the guest on the destination right away and copy its
+  RAM afterwards, as the guest touches it; needs a "tcp:" or "unix:" URI
+  (json-bool, optional)
 - "uri": Destination URI (json-string)
 
 Example:
@@ -590,6 +1262,159 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate_set_compression",
+        .args_type  = "threads:i,level:i?",
+        .params     = "threads [level]",
+        .help       = "compress RAM pages of the next migrations with threads threads (0 to disable)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compression,
+    },
+
+SQMP
+migrate_set_compression
+-----------------------
+
+Compress RAM pages of the following migrations with zlib.  Batches of
+dirty pages are compressed in parallel and sent in order; pages that do
+not get smaller are sent as is.  The destination must support compressed
+pages.
+
+Arguments:
+
+- "threads": number of compression threads, 0 disables compression
+  (json-int)
+- "level": zlib compression level from 1 (fastest, default) to 9
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate_set_compression", "arguments": { "threads": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set the cache of sent pages for delta encoding of the next migrations to value bytes (0 to disable)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+SQMP
+migrate_set_cache_size
+----------------------
+
+Set the size of the cache of sent RAM pages used by the following
+migrations.  A page that is dirtied again while its previous version is
+in the cache is sent as a run length encoding of the bytes that changed,
+unless that is not smaller than half a page.
+
+Arguments:
+
+- "value": cache size in bytes, 0 disables the cache (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_cache_size", "arguments": { "value": 67108864 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_channels",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "stripe RAM pages of the next tcp migrations over value connections",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_channels,
+    },
+
+SQMP
+migrate_set_channels
+--------------------
+
+Set the number of connections RAM pages are striped over by the following
+tcp migrations.  With more than 1, that many extra connections are opened
+to the destination, static stripes of 64 pages are assigned to them, and
+only device state and section framing go over the main connection.
+Pages that go through compression threads or post-copy still use the main
+connection.  The migration speed limit applies to the extra connections
+as a whole.
+
+Arguments:
+
+- "value": connections to stripe pages over, 1 to 16, 1 keeps them on the
+  main connection (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_channels", "arguments": { "value": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_auto_converge",
+        .args_type  = "value:b",
+        .params     = "on|off",
+        .help       = "throttle the guest when migration does not converge",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_auto_converge,
+    },
+
+SQMP
+migrate_set_auto_converge
+-------------------------
+
+Throttle the vcpus of a migrating guest that dirties memory faster than it
+is sent.  Once migration is predicted not to converge for a few iterations,
+the vcpus are kept off for 20% of the time, and 10% more every few
+iterations after that, up to 90%.
+
+Arguments:
+
+- "value": true to enable throttling (json-bool)
+
+Example:
+
+-> { "execute": "migrate_set_auto_converge", "arguments": { "value": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_block_queue_depth",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "let block migration have up to value reads in flight per device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_block_queue_depth,
+    },
+
+SQMP
+migrate_set_block_queue_depth
+-----------------------------
+
+Set the maximum number of reads block migration keeps in flight per device.
+Each device starts with 2; every 100 ms of reading, it takes one more if
+its read bandwidth went up by more than 10%, and one less if it went down
+by as much.  Reads already waiting to be sent are limited by the
+migration speed as before.
+
+Arguments:
+
+- "value": reads in flight per device, 1 to 256, 16 by default (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_block_queue_depth", "arguments": { "value": 64 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -676,6 +1501,127 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps_rd:o,bps_wr:o,iops_rd:i,iops_wr:i",
+        .params     = "device bps_rd bps_wr iops_rd iops_wr",
+        .help       = "limit the I/O rate of a block device (0 for no limit)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+SQMP
+block_set_io_throttle
+---------------------
+
+Change the I/O limits of a block device.  Guest requests over the limits
+are queued until the limits let them through.
+
+Arguments:
+
+- "device": the device's ID, must be unique (json-string)
+- "bps_rd": read bandwidth limit in bytes per second, 0 for none (json-int)
+- "bps_wr": write bandwidth limit in bytes per second, 0 for none (json-int)
+- "iops_rd": read requests per second limit, 0 for none (json-int)
+- "iops_wr": write requests per second limit, 0 for none (json-int)
+
+Example:
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                                        "bps_rd": 0,
+                                                        "bps_wr": 1048576,
+                                                        "iops_rd": 0,
+                                                        "iops_wr": 200 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .help       = "copy the backing file of a block device into its image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+SQMP
+block_stream
+------------
+
+Start copying the data a block device reads from its backing file chain
+into its image, in the background.  Once the image holds all of it, the
+backing file is dropped and BLOCK_JOB_COMPLETED is emitted.  The guest
+keeps running meanwhile; what it reads is copied into the image too.
+
+Arguments:
+
+- "device": the device's ID, must be unique (json-string)
+- "speed": copy at most this many bytes per second, the default 0 means
+  no limit (json-int, optional)
+
+Example:
+
+-> { "execute": "block_stream", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set the speed limit of a block job (0 for no limit)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+SQMP
+block_job_set_speed
+-------------------
+
+Change the speed limit of the block job of a device.
+
+Arguments:
+
+- "device": the device's ID, must be unique (json-string)
+- "value": the limit in bytes per second, 0 for none (json-int)
+
+Example:
+
+-> { "execute": "block_job_set_speed", "arguments": { "device": "virtio0",
+                                                      "value": 10485760 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop the block job of a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+SQMP
+block_job_cancel
+----------------
+
+Stop the block job of a device and emit BLOCK_JOB_CANCELLED.  What a
+stream job copied stays in the image.
+
+Arguments:
+
+- "device": the device's ID, must be unique (json-string)
+
+Example:
+
+-> { "execute": "block_job_cancel", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -730,6 +1676,39 @@ Example:
 -> { "execute": "set_link", "arguments": { "name": "e1000.0", "up": false } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "netdev_set_limits",
+        .args_type  = "id:s,bps_tx:o?,bps_rx:o?,pps_tx:i?,pps_rx:i?",
+        .params     = "id [bps_tx] [bps_rx] [pps_tx] [pps_rx]",
+        .help       = "limit the bandwidth and packet rate of a netdev",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_netdev_set_limits,
+    },
+
+SQMP
+netdev_set_limits
+-----------------
+
+Limit the traffic between a netdev and its NIC.  Packets over a limit are
+held back, not dropped.  A limit of 0 removes it; limits not given keep
+their current value.
+
+Arguments:
+
+- "id": the netdev's id (json-string)
+- "bps_tx": bytes per second the guest may send (json-int, optional)
+- "bps_rx": bytes per second the guest may receive (json-int, optional)
+- "pps_tx": packets per second the guest may send (json-int, optional)
+- "pps_rx": packets per second the guest may receive (json-int, optional)
+
+Example:
+
+-> { "execute": "netdev_set_limits",
+     "arguments": { "id": "net0", "bps_tx": 1048576, "pps_rx": 10000 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1019,6 +1998,10 @@ Each json-object contain the following:
 
 - "label": device's label (json-string)
 - "filename": device's file (json-string)
+- "buffered": bytes waiting in the output buffer, only present for devices
+              with one (json-int)
+- "dropped": bytes the output buffer threw away or could not deliver, only
+             present for devices with one (json-int)
 
 Example:
 
@@ -1066,6 +2049,10 @@ Each json-object contain the following:
                                 "tftp", "vdi", "vmdk", "vpc", "vvfat"
          - "backing_file": backing file name (json-string, optional)
          - "encrypted": true if encrypted, false otherwise (json-bool)
+         - "bps_rd", "bps_wr": bandwidth limits in bytes per second, 0 if
+           unlimited (json-int, only present if the device is throttled)
+         - "iops_rd", "iops_wr": request rate limits, 0 if unlimited
+           (json-int, only present if the device is throttled)
 
 Example:
 
@@ -1124,8 +2111,45 @@ Each json-object contain the following:
     - "wr_bytes": bytes written (json-int)
     - "rd_operations": read operations (json-int)
     - "wr_operations": write operations (json-int)
+    - "rd_merged", "wr_merged": read and write operations merged into
+                                others before being submitted (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_latency", "wr_latency", "flush_latency": only present for
+                    devices, the time from submission to completion of
+                    their requests, json-objects with:
+        - "count": requests completed (json-int)
+        - "time-ns": total time they took (json-int)
+        - "histogram": json-array of json-int, element i counts the
+                       requests that took from 2^i to 2^(i+1) ns; it
+                       ends at the last non-empty element
+    - "queue_depth": only present for devices, json-array of json-int,
+                     element 0 counts the requests submitted while no
+                     other was in flight, element i those that found from
+                     2^(i-1) to 2^i - 1
+    - "metadata_cache": only present for formats that cache their metadata
+                        (qcow2), a json-object of json-int counters:
+        - "l2_tables", "refcount_blocks": tables the caches hold
+        - "l2_hits", "refcount_hits": lookups found in the cache
+        - "l2_misses", "refcount_misses": lookups that read the image
+        - "l2_evictions", "refcount_evictions": tables replaced
+    - "thread_pool": only present for host files and devices, a json-object
+                     describing the worker threads of the file:
+        - "threads": threads started (json-int)
+        - "idle_threads": threads waiting for requests (json-int)
+        - "max_threads": most threads the pool starts (json-int)
+        - "queued": requests waiting for a thread (json-int)
+        - "requests": requests completed (json-int)
+        - "avg_latency_ns": moving average of the time a request takes,
+                            in nanoseconds (json-int)
+        - "avg_queue_depth": moving average of the requests in flight
+                             (json-int)
+        - "bounces": requests whose buffers were not aligned for
+                     cache=none, and were copied to an aligned buffer
+                     (json-int)
+        - "bounce_allocs": bounced requests for which none of the
+                           preallocated buffers was free or large
+                           enough (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1190,6 +2214,123 @@ Example:
 
 EQMP
 
+SQMP
+query-virtio-latency
+--------------------
+
+Show how long the requests of every virtio queue spent in each stage, from
+the guest's kick to the interrupt that reported their completion.  Only
+available when QEMU was configured with --enable-virtio-latency.
+
+A request is timed from the kick that preceded its pop; requests popped
+without a kick, such as receive buffers taken when a packet arrives, start
+at the pop.  Requests that skip a stage, for instance because they were
+answered without the backend, or because the guest did not want an
+interrupt, are left out of that stage.
+
+Return a json-array of json-objects, one per queue, each containing:
+
+- "device": the device's id, or its type when it has none (json-string)
+- "path": the device's address on its bus (json-string, optional)
+- "queue": the queue's index (json-int)
+- "kick-to-pop", "pop-to-submit", "submit-to-complete", "complete-to-push",
+  "push-to-notify", "total": json-objects containing:
+    - "count": requests timed (json-int)
+    - "time-ns": their total latency in nanoseconds (json-int)
+    - "histogram": counts of requests by latency; bucket i counts latencies
+                   from 2^i to 2^(i+1) nanoseconds, trailing empty
+                   buckets are omitted (json-array of json-int)
+
+Example:
+
+-> { "execute": "query-virtio-latency" }
+<- {
+      "return":[
+         {
+            "device":"virtio0",
+            "path":"0000:00:04.0",
+            "queue":0,
+            "kick-to-pop":{ "count":2, "time-ns":9218,
+                            "histogram":[0,0,0,0,0,0,0,0,0,0,0,0,2] },
+            "pop-to-submit":{ "count":2, "time-ns":3190,
+                              "histogram":[0,0,0,0,0,0,0,0,0,0,1,1] },
+            "submit-to-complete":{ "count":2, "time-ns":168033,
+                                   "histogram":[0,0,0,0,0,0,0,0,0,0,0,0,0,
+                                                0,0,0,1,1] },
+            "complete-to-push":{ "count":2, "time-ns":1544,
+                                 "histogram":[0,0,0,0,0,0,0,0,0,2] },
+            "push-to-notify":{ "count":2, "time-ns":2210,
+                               "histogram":[0,0,0,0,0,0,0,0,0,1,1] },
+            "total":{ "count":2, "time-ns":184195,
+                      "histogram":[0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1] }
+         }
+      ]
+   }
+
+EQMP
+
+SQMP
+query-block-cache
+-----------------
+
+Show the statistics of the backing file cache, see -backing-cache.
+
+Return a json-object with the following information:
+
+- "enabled": true if there is a cache (json-bool); the other members are
+  only there if it is true
+- "size": cache size in bytes (json-int)
+- "file": true if the cache is in a file (json-bool)
+- "used": bytes in use (json-int)
+- "hits": reads served from the cache (json-int)
+- "misses": reads that went to the backing files (json-int)
+- "evictions": cache lines evicted for others (json-int)
+- "images": json-array of json-objects, one per backing file:
+  - "file": real path of the backing file (json-string)
+  - "used": bytes cached of it (json-int)
+  - "hits": its reads served from the cache (json-int)
+  - "misses": its reads that went to the file (json-int)
+
+Example:
+
+-> { "execute": "query-block-cache" }
+<- { "return": { "enabled": true, "size": 1073741824, "file": false,
+                 "used": 268435456, "hits": 41316, "misses": 4096,
+                 "evictions": 0,
+                 "images": [ { "file": "/images/base.qcow2",
+                               "used": 268435456,
+                               "hits": 41316, "misses": 4096 } ] } }
+
+EQMP
+
+SQMP
+query-block-jobs
+----------------
+
+Show the running block jobs.
+
+Each job is described by a json-object and the returned value is a
+json-array of all jobs.
+
+Each json-object contains the following:
+
+- "device": device name (json-string)
+- "type": job type, "stream" (json-string)
+- "len": bytes the job has to go through (json-int)
+- "offset": bytes it went through (json-int)
+- "speed": speed limit in bytes per second, 0 for none (json-int)
+
+Example:
+
+-> { "execute": "query-block-jobs" }
+<- { "return":[
+        { "device": "virtio0", "type": "stream", "len": 10737418240,
+          "offset": 134217728, "speed": 0 }
+      ]
+   }
+
+EQMP
+
 SQMP
 query-cpus
 ----------
@@ -1458,6 +2599,46 @@ Example:
 
 EQMP
 
+SQMP
+query-kvmstat
+-------------
+
+Show KVM exit statistics, counted since each vcpu was created.
+
+Return a json-array with a json-object per vcpu:
+
+- "cpu": CPU index (json-int)
+- "exits": json-array of the exit reasons seen, each a json-object with:
+    - "reason": exit reason, e.g. "io" or "mmio" (json-string, or json-int for
+                reasons this QEMU has no name for)
+    - "count": number of exits (json-int)
+    - "time-ns": total time from the exit to the next KVM_RUN, in
+                 nanoseconds (json-int)
+    - "histogram": number of exits that took 1-2 ns, 2-4 ns, 4-8 ns and so
+                   on, up to the last non-empty bucket (json-array of json-int)
+- "addresses": json-array of the busiest I/O ports and MMIO addresses,
+               sorted by "time-ns", each a json-object with:
+    - "type": "pio" or "mmio" (json-string)
+    - "address": port number or guest physical address (json-int)
+    - "count", "time-ns", "histogram": as above
+
+Without KVM the array is empty.
+
+Example:
+
+-> { "execute": "query-kvmstat" }
+<- { "return": [
+        { "cpu": 0,
+          "exits": [ { "reason": "io", "count": 1520, "time-ns": 3207461,
+                       "histogram": [ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 12,
+                                      1402, 106 ] } ],
+          "addresses": [ { "type": "pio", "address": 112, "count": 1520,
+                           "time-ns": 3207461,
+                           "histogram": [ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          12, 1402, 106 ] } ] } ] }
+
+EQMP
+
 SQMP
 query-status
 ------------
@@ -1640,6 +2821,40 @@ Example:
 
 EQMP
 
+SQMP
+query-qxl
+---------
+
+Show qxl device statistics, counted since each device was created.
+
+Return a json-array with a json-object per qxl device:
+
+- "id": device index, 0 for the VGA compatible one (json-int)
+- "mode": "undefined", "vga", "compat" or "native" (json-string)
+- "notifies": guest command ring notifications (json-int)
+- "wakeups": spice worker wakeups the notifications were coalesced
+             into (json-int)
+- "commands": commands taken from the command ring (json-int)
+- "ring-depth-avg": average command ring fill at a notification (json-double)
+- "ring-depth-max": highest command ring fill at a notification (json-int)
+- "renders": local rendering updates, device 0 only (json-int, optional)
+- "render-avg-us", "render-max-us", "render-last-us": time from the request
+  of a local rendering update to its completion, in microseconds
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "query-qxl" }
+<- { "return": [
+       { "id": 0, "mode": "native", "notifies": 5320, "wakeups": 4107,
+         "commands": 96011, "ring-depth-avg": 7.4, "ring-depth-max": 31,
+         "renders": 2210, "render-avg-us": 1830, "render-max-us": 21472,
+         "render-last-us": 912 }
+     ]
+   }
+
+EQMP
+
 SQMP
 query-name
 ----------
@@ -1688,6 +2903,8 @@ The main json-object contains the following:
 
 - "status": migration status (json-string)
      - Possible values: "active", "completed", "failed", "cancelled"
+- "postcopy": only present if "status" is "active" and the guest already
+  runs on the destination of a post-copy migration, true (json-bool)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -1698,6 +2915,25 @@ The main json-object contains the following:
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+- "convergence": only present if "status" is "active" and RAM is still
+  being sent iteratively, it is a json-object with the following:
+         - "iterations": iterations over dirty memory so far (json-int)
+         - "dirty-rate": bytes per second the guest dirties (json-int)
+         - "transfer-rate": bytes per second sent (json-int)
+         - "expected-downtime": pause in ms needed to send the remaining
+           RAM, or -1 while unknown (json-int)
+         - "converge-time": ms until the remaining RAM can be sent within
+           the maximum downtime, or -1 if the guest dirties memory too
+           fast (json-int)
+         - "throttle": percentage of the time the vcpus are kept off, see
+           migrate_set_auto_converge (json-int)
+- "downtime-breakdown": only present if "status" is "completed", a
+  json-array of what each section sent while the guest was stopped, the
+  slowest first, each a json-object with:
+         - "device": section name (json-string)
+         - "instance": section instance (json-int)
+         - "bytes": bytes sent (json-int)
+         - "time-ns": time taken to save it (json-int)
 
 Examples:
 
@@ -1709,7 +2945,12 @@ Examples:
 2. Migration is done and has succeeded
 
 -> { "execute": "query-migrate" }
-<- { "return": { "status": "completed" } }
+<- { "return": { "status": "completed",
+                 "downtime-breakdown": [
+                     { "device": "ram", "instance": 0, "bytes": 1123576,
+                       "time-ns": 2915044 },
+                     { "device": "mc146818rtc", "instance": 0, "bytes": 52,
+                       "time-ns": 2410 } ] } }
 
 3. Migration is done and has failed
 
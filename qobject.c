@@ -0,0 +1,42 @@
+/*
+ * QEMU Object Model: allocation
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qobject.h"
+#include "qemu-common.h"
+#include "qemu-arena.h"
+
+/**
+ * qobject_alloc(): Allocate a zeroed object of the given size, from the
+ * current arena if there is one (see qemu-arena.h)
+ *
+ * The object must start with QObject_HEAD and be freed with
+ * qobject_free().
+ */
+void *qobject_alloc(size_t size)
+{
+    QObject *obj = qemu_arena_current_alloc(size);
+
+    if (obj) {
+        memset(obj, 0, size);
+        obj->in_arena = 1;
+    } else {
+        obj = qemu_mallocz(size);
+    }
+    return obj;
+}
+
+/**
+ * qobject_free(): Free an object allocated with qobject_alloc()
+ */
+void qobject_free(QObject *obj)
+{
+    if (obj->in_arena) {
+        qemu_arena_free(obj);
+    } else {
+        qemu_free(obj);
+    }
+}
@@ -57,6 +57,7 @@ typedef struct QType {
 typedef struct QObject {
     const QType *type;
     size_t refcnt;
+    int in_arena;
 } QObject;
 
 /* Objects definitions must include this */
@@ -79,6 +80,9 @@ typedef struct QObject {
     obj->base.refcnt = 1;               \
     obj->base.type   = qtype_type
 
+void *qobject_alloc(size_t size);
+void qobject_free(QObject *obj);
+
 /**
  * qobject_incref(): Increment QObject's reference count
  */
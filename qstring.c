@@ -40,7 +40,7 @@ QString *qstring_from_substr(const char *str, int start, int end)
 {
     QString *qstring;
 
-    qstring = qemu_malloc(sizeof(*qstring));
+    qstring = qobject_alloc(sizeof(*qstring));
 
     qstring->length = end - start + 1;
     qstring->capacity = qstring->length;
@@ -78,8 +78,13 @@ static void capacity_increase(QString *qstring, size_t len)
  */
 void qstring_append(QString *qstring, const char *str)
 {
-    size_t len = strlen(str);
+    qstring_append_len(qstring, str, strlen(str));
+}
 
+/* qstring_append_len(): Append the first 'len' bytes of 'str' to a QString
+ */
+void qstring_append_len(QString *qstring, const char *str, size_t len)
+{
     capacity_increase(qstring, len);
     memcpy(qstring->string + qstring->length, str, len);
     qstring->length += len;
@@ -137,5 +142,5 @@ static void qstring_destroy_obj(QObject *obj)
     assert(obj != NULL);
     qs = qobject_to_qstring(obj);
     qemu_free(qs->string);
-    qemu_free(qs);
+    qobject_free(obj);
 }
@@ -0,0 +1,305 @@
+/*
+ * Lazy restore of guest RAM from snapshots
+ *
+ * Incremental snapshots store every page of guest RAM at a fixed place in
+ * the VM state area of the image, so a page can be read as soon as the
+ * guest touches it.  loadvm -l only loads the device state; guest RAM is
+ * faulted in with the post-copy machinery, reading the pages the guest
+ * touches directly from the image file, while a thread prefetches all the
+ * others in order.
+ *
+ * The block layer is not thread safe, so where the VM state area lies in
+ * the image file is looked up before the guest starts, and the image file
+ * is read on a descriptor of its own.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "migration-postcopy.h"
+#include "savevm-lazy.h"
+
+/* Pages prefetched at once */
+#define LAZY_PREFETCH_PAGES 64
+
+typedef struct LazyExtent {
+    uint64_t offset;            /* in the block */
+    uint64_t length;
+    int64_t file_offset;        /* -1 if it reads as zeroes */
+} LazyExtent;
+
+typedef struct LazyBlock {
+    char idstr[256];
+    uint8_t *host;
+    uint64_t length;
+    uint8_t *zero;              /* one bit per page stored as zeroes */
+    LazyExtent *extents;
+    int n_extents;
+} LazyBlock;
+
+typedef struct LazyRestore {
+    BlockDriverState *bs;
+    int fd;
+    size_t page_size;
+    LazyBlock *blocks;
+    int n_blocks;
+    uint8_t *fault_buf;         /* for the fault thread */
+    uint8_t *prefetch_buf;      /* for the prefetch thread */
+} LazyRestore;
+
+static LazyRestore lazy_restore = { .fd = -1 };
+
+static void lazy_restore_free(LazyRestore *s)
+{
+    int i;
+
+    for (i = 0; i < s->n_blocks; i++) {
+        qemu_free(s->blocks[i].zero);
+        qemu_free(s->blocks[i].extents);
+    }
+    qemu_free(s->blocks);
+    qemu_free(s->fault_buf);
+    qemu_free(s->prefetch_buf);
+    if (s->fd != -1) {
+        close(s->fd);
+    }
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+static bool lazy_page_is_zero(LazyBlock *b, uint64_t page)
+{
+    return b->zero[page / 8] & (1 << (page % 8));
+}
+
+/* Read len bytes at offset of the stored image of b */
+static int lazy_read(LazyRestore *s, LazyBlock *b, uint64_t offset,
+                     uint8_t *buf, size_t len)
+{
+    int lo = 0, hi = b->n_extents - 1;
+
+    while (len > 0) {
+        LazyExtent *e;
+        size_t n;
+
+        /* the extent with offset, they are sorted and cover the block */
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+
+            if (b->extents[mid].offset <= offset) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        e = &b->extents[lo];
+        n = MIN(len, e->offset + e->length - offset);
+
+        if (e->file_offset == -1) {
+            memset(buf, 0, n);
+        } else {
+            int64_t pos = e->file_offset + (offset - e->offset);
+            size_t done = 0;
+
+            while (done < n) {
+                ssize_t ret = pread(s->fd, buf + done, n - done, pos + done);
+
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                } else if (ret <= 0) {
+                    return ret < 0 ? -errno : -EIO;
+                }
+                done += ret;
+            }
+        }
+
+        offset += n;
+        buf += n;
+        len -= n;
+        hi = b->n_extents - 1;
+    }
+    return 0;
+}
+
+/* Fault thread: place the page the guest is waiting for */
+static void lazy_restore_request(void *opaque, const char *idstr,
+                                 uint64_t offset)
+{
+    LazyRestore *s = opaque;
+    LazyBlock *b = NULL;
+    int i, ret;
+
+    for (i = 0; i < s->n_blocks; i++) {
+        if (!strcmp(s->blocks[i].idstr, idstr)) {
+            b = &s->blocks[i];
+            break;
+        }
+    }
+    if (!b || offset >= b->length) {
+        return;
+    }
+
+    if (lazy_page_is_zero(b, offset / s->page_size)) {
+        ret = postcopy_place_zero_page(b->host + offset);
+    } else {
+        ret = lazy_read(s, b, offset, s->fault_buf, s->page_size);
+        if (ret == 0) {
+            ret = postcopy_place_page(b->host + offset, s->fault_buf);
+        }
+    }
+    if (ret < 0) {
+        fprintf(stderr, "lazy restore: cannot restore %s+0x%" PRIx64
+                ": %s\n", idstr, offset, strerror(-ret));
+        exit(1);
+    }
+}
+
+/* Load thread: place all the pages, in order */
+static int lazy_restore_prefetch(void *opaque)
+{
+    LazyRestore *s = opaque;
+    int i, ret;
+
+    for (i = 0; i < s->n_blocks; i++) {
+        LazyBlock *b = &s->blocks[i];
+        uint64_t offset;
+
+        for (offset = 0; offset < b->length;
+             offset += LAZY_PREFETCH_PAGES * s->page_size) {
+            uint64_t page = offset / s->page_size;
+            size_t n = MIN(LAZY_PREFETCH_PAGES,
+                           (b->length - offset) / s->page_size);
+            size_t j, zero = 0;
+
+            for (j = 0; j < n; j++) {
+                zero += lazy_page_is_zero(b, page + j);
+            }
+            if (zero == n) {
+                ret = postcopy_place_zero_pages(b->host + offset, n);
+            } else {
+                ret = lazy_read(s, b, offset, s->prefetch_buf,
+                                n * s->page_size);
+                for (j = 0; j < n && ret == 0; j++) {
+                    /* the area may still hold an older version */
+                    if (lazy_page_is_zero(b, page + j)) {
+                        memset(s->prefetch_buf + j * s->page_size, 0,
+                               s->page_size);
+                    }
+                }
+                if (ret == 0) {
+                    ret = postcopy_place_pages(b->host + offset,
+                                               s->prefetch_buf, n);
+                }
+            }
+            if (ret < 0) {
+                fprintf(stderr, "lazy restore: cannot prefetch %s: %s\n",
+                        b->idstr, strerror(-ret));
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Prepare to restore guest RAM lazily from the VM state of bs, which
+   has to be stored in a plain file */
+int lazy_restore_init(BlockDriverState *bs, size_t page_size)
+{
+    LazyRestore *s = &lazy_restore;
+    int ret;
+
+    if (postcopy_incoming_active()) {
+        return -EBUSY;
+    }
+    /* a previous restore is over, its threads are gone */
+    lazy_restore_free(s);
+
+    if (!bs->drv->bdrv_map_vmstate || !bs->file || !bs->file->drv ||
+        strcmp(bs->file->drv->format_name, "file")) {
+        fprintf(stderr, "lazy restore needs an image file that maps its VM "
+                "state\n");
+        return -ENOTSUP;
+    }
+
+    ret = postcopy_incoming_init(page_size, lazy_restore_prefetch);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->fd = qemu_open(bs->file->filename, O_RDONLY);
+    if (s->fd < 0) {
+        ret = -errno;
+        fprintf(stderr, "lazy restore: cannot open %s: %s\n",
+                bs->file->filename, strerror(errno));
+        return ret;
+    }
+    s->bs = bs;
+    s->page_size = page_size;
+    s->fault_buf = qemu_memalign(page_size, page_size);
+    s->prefetch_buf = qemu_memalign(page_size,
+                                    page_size * LAZY_PREFETCH_PAGES);
+    return 0;
+}
+
+/* Add a RAM block of length bytes at host, stored at pos of the VM state,
+   except for the pages set in zero, one bit per page */
+int lazy_restore_add_block(const char *idstr, void *host, uint64_t length,
+                           int64_t pos, const uint8_t *zero)
+{
+    LazyRestore *s = &lazy_restore;
+    size_t bitmap_size = (length / s->page_size + 7) / 8;
+    LazyBlock *b;
+    uint64_t offset;
+
+    s->blocks = qemu_realloc(s->blocks, sizeof(*b) * (s->n_blocks + 1));
+    b = &s->blocks[s->n_blocks++];
+    memset(b, 0, sizeof(*b));
+    pstrcpy(b->idstr, sizeof(b->idstr), idstr);
+    b->host = host;
+    b->length = length;
+    b->zero = qemu_malloc(bitmap_size);
+    memcpy(b->zero, zero, bitmap_size);
+
+    for (offset = 0; offset < length; ) {
+        LazyExtent *e = b->n_extents ? &b->extents[b->n_extents - 1] : NULL;
+        int64_t file_offset, n;
+
+        n = bdrv_map_vmstate(s->bs, pos + offset, length - offset,
+                             &file_offset);
+        if (n <= 0) {
+            return n < 0 ? n : -EIO;
+        }
+
+        if (e && ((e->file_offset == -1 && file_offset == -1) ||
+                  (e->file_offset != -1 &&
+                   e->file_offset + e->length == file_offset))) {
+            e->length += n;
+        } else {
+            b->extents = qemu_realloc(b->extents,
+                                      sizeof(*e) * (b->n_extents + 1));
+            e = &b->extents[b->n_extents++];
+            e->offset = offset;
+            e->length = n;
+            e->file_offset = file_offset;
+        }
+        offset += n;
+    }
+
+    postcopy_incoming_add_range(idstr, host, length);
+    return 0;
+}
+
+/* Empty guest RAM and start faulting it in */
+int lazy_restore_start(void)
+{
+    return postcopy_incoming_start_local(lazy_restore_request, &lazy_restore);
+}
+
+/* Give up on a lazy restore that was not started */
+void lazy_restore_abort(void)
+{
+    lazy_restore_free(&lazy_restore);
+}
@@ -0,0 +1,18 @@
+/*
+ * Lazy restore of guest RAM from snapshots
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_SAVEVM_LAZY_H
+#define QEMU_SAVEVM_LAZY_H
+
+int lazy_restore_init(BlockDriverState *bs, size_t page_size);
+int lazy_restore_add_block(const char *idstr, void *host, uint64_t length,
+                           int64_t pos, const uint8_t *zero);
+int lazy_restore_start(void);
+void lazy_restore_abort(void);
+
+#endif
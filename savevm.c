@@ -73,6 +73,7 @@
 #include "qemu-common.h"
 #include "hw/hw.h"
 #include "hw/qdev.h"
+#include "hw/vmstate-plan.h"
 #include "net.h"
 #include "monitor.h"
 #include "sysemu.h"
@@ -80,8 +81,12 @@
 #include "qemu-char.h"
 #include "audio/audio.h"
 #include "migration.h"
+#include "migration-postcopy.h"
 #include "qemu_socket.h"
 #include "qemu-queue.h"
+#include "qjson.h"
+#include "qlist.h"
+#include "trace.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -156,9 +161,12 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define IO_IOV_SIZE 64
+#define IO_REF_SIZE (8 * IO_BUF_SIZE)
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
+    QEMUFileWritevBufferFunc *writev_buffer;
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
     QEMUFileRateLimit *rate_limit;
@@ -173,6 +181,13 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /* With writev_buffer, what is written is gathered here: ranges of buf,
+       and the memory passed to qemu_put_buffer_ref(), which is not copied */
+    struct iovec iov[IO_IOV_SIZE];
+    int iovcnt;
+    int iov_buf_mark;   /* buf up to here is in iov */
+    int ref_bytes;      /* referenced, not in buf */
+
     int has_error;
 };
 
@@ -332,6 +347,64 @@ QEMUFile *qemu_fopen_socket(int fd)
     return s->file;
 }
 
+/* Return the socket of a file opened by qemu_fopen_socket(), or -1 */
+int qemu_file_socket_fd(QEMUFile *f)
+{
+    if (f->get_buffer != socket_get_buffer) {
+        return -1;
+    }
+    return ((QEMUFileSocket *)f->opaque)->fd;
+}
+
+/* A file in memory, for data that is sent as one piece */
+typedef struct QEMUFileBuffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} QEMUFileBuffer;
+
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (s->size + size > s->capacity) {
+        s->capacity = MAX(s->capacity * 2, s->size + size);
+        s->data = qemu_realloc(s->data, s->capacity);
+    }
+    memcpy(s->data + s->size, buf, size);
+    s->size += size;
+    return size;
+}
+
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos >= s->size) {
+        return 0;
+    }
+    size = MIN(size, s->size - pos);
+    memcpy(buf, s->data + pos, size);
+    return size;
+}
+
+static int buffer_close(void *opaque)
+{
+    return 0;
+}
+
+/* The data stays with the caller after qemu_fclose() */
+static QEMUFile *qemu_fopen_buffer(QEMUFileBuffer *s, int is_writable)
+{
+    if (is_writable) {
+        return qemu_fopen_ops(s, buffer_put_buffer, NULL, buffer_close,
+                              NULL, NULL, NULL);
+    }
+    return qemu_fopen_ops(s, NULL, buffer_get_buffer, buffer_close,
+                          NULL, NULL, NULL);
+}
+
 static int file_put_buffer(void *opaque, const uint8_t *buf,
                             int64_t pos, int size)
 {
@@ -402,6 +475,16 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
 }
 
+/* Return the image of a file opened by qemu_fopen_bdrv(), or NULL */
+BlockDriverState *qemu_file_bdrv(QEMUFile *f)
+{
+    if (f->put_buffer != block_put_buffer &&
+        f->get_buffer != block_get_buffer) {
+        return NULL;
+    }
+    return f->opaque;
+}
+
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileGetBufferFunc *get_buffer,
                          QEMUFileCloseFunc *close,
@@ -435,8 +518,64 @@ void qemu_file_set_error(QEMUFile *f)
     f->has_error = 1;
 }
 
+/* Lets qemu_put_buffer_ref() hand memory to the file without copying it */
+void qemu_file_set_writev(QEMUFile *f,
+                          QEMUFileWritevBufferFunc *writev_buffer)
+{
+    qemu_fflush(f);
+    f->writev_buffer = writev_buffer;
+}
+
+static void qemu_iov_add(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (f->iovcnt) {
+        struct iovec *last = &f->iov[f->iovcnt - 1];
+
+        if ((uint8_t *)last->iov_base + last->iov_len == buf) {
+            last->iov_len += size;
+            return;
+        }
+    }
+    f->iov[f->iovcnt].iov_base = (void *)buf;
+    f->iov[f->iovcnt].iov_len = size;
+    f->iovcnt++;
+}
+
+static void qemu_iov_add_staged(QEMUFile *f)
+{
+    if (f->buf_index > f->iov_buf_mark) {
+        qemu_iov_add(f, f->buf + f->iov_buf_mark,
+                     f->buf_index - f->iov_buf_mark);
+        f->iov_buf_mark = f->buf_index;
+    }
+}
+
+static void qemu_fflush_iov(QEMUFile *f)
+{
+    int len, size;
+
+    qemu_iov_add_staged(f);
+    if (f->is_write && f->iovcnt) {
+        size = f->buf_index + f->ref_bytes;
+        len = f->writev_buffer(f->opaque, f->iov, f->iovcnt, f->buf_offset);
+        if (len > 0)
+            f->buf_offset += size;
+        else
+            f->has_error = 1;
+    }
+    f->buf_index = 0;
+    f->iov_buf_mark = 0;
+    f->iovcnt = 0;
+    f->ref_bytes = 0;
+}
+
 void qemu_fflush(QEMUFile *f)
 {
+    if (f->writev_buffer) {
+        qemu_fflush_iov(f);
+        return;
+    }
+
     if (!f->put_buffer)
         return;
 
@@ -510,6 +649,34 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+/* Like qemu_put_buffer(), but when the file can take scattered data buf
+   is only referenced, so it must stay valid until the next flush; what it
+   holds then is what gets written */
+void qemu_put_buffer_ref(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+    if (f->has_error || size <= 0) {
+        return;
+    }
+
+    qemu_iov_add_staged(f);
+    qemu_iov_add(f, buf, size);
+    f->is_write = 1;
+    f->ref_bytes += size;
+    if (f->iovcnt > IO_IOV_SIZE - 2 || f->ref_bytes >= IO_REF_SIZE) {
+        qemu_fflush(f);
+    }
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
@@ -578,7 +745,7 @@ int qemu_get_byte(QEMUFile *f)
 
 int64_t qemu_ftell(QEMUFile *f)
 {
-    return f->buf_offset - f->buf_size + f->buf_index;
+    return f->buf_offset - f->buf_size + f->buf_index + f->ref_bytes;
 }
 
 int64_t qemu_fseek(QEMUFile *f, int64_t pos, int whence)
@@ -674,6 +841,109 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
+/* Arrays of fixed-width integers.  Each chunk that fits in the buffer is
+   converted with one bounds check, in a loop the compiler can vectorize;
+   an element straddling the end of the buffer goes through the scalar
+   functions, which flush or refill it.  Elements that are not packed, or
+   a write to a file that still holds read data, are left to the scalar
+   functions entirely. */
+
+#define VMSTATE_INT_ARRAY_CODEC(bits)                                   \
+static int get_array_##bits(QEMUFile *f, void *pv, size_t size, int n)  \
+{                                                                       \
+    uint##bits##_t *v = pv;                                             \
+    int i, chunk;                                                       \
+                                                                        \
+    while (n > 0) {                                                     \
+        if (size != sizeof(*v)) {                                       \
+            qemu_get_be##bits##s(f, v);                                 \
+            v = (void *)v + size;                                       \
+            n--;                                                        \
+            continue;                                                   \
+        }                                                               \
+        chunk = MIN(n, (f->buf_size - f->buf_index) / (int)sizeof(*v)); \
+        if (chunk <= 0) {                                               \
+            qemu_get_be##bits##s(f, v++);                               \
+            n--;                                                        \
+            continue;                                                   \
+        }                                                               \
+        for (i = 0; i < chunk; i++) {                                   \
+            uint##bits##_t x;                                           \
+                                                                        \
+            memcpy(&x, f->buf + f->buf_index + i * sizeof(x), sizeof(x)); \
+            v[i] = be##bits##_to_cpu(x);                                \
+        }                                                               \
+        f->buf_index += chunk * sizeof(*v);                             \
+        v += chunk;                                                     \
+        n -= chunk;                                                     \
+    }                                                                   \
+    return 0;                                                           \
+}                                                                       \
+                                                                        \
+static void put_array_##bits(QEMUFile *f, void *pv, size_t size, int n) \
+{                                                                       \
+    uint##bits##_t *v = pv;                                             \
+    int i, chunk;                                                       \
+                                                                        \
+    while (n > 0) {                                                     \
+        if (size != sizeof(*v) || (!f->is_write && f->buf_index > 0)) { \
+            qemu_put_be##bits##s(f, v);                                 \
+            v = (void *)v + size;                                       \
+            n--;                                                        \
+            continue;                                                   \
+        }                                                               \
+        chunk = MIN(n, (IO_BUF_SIZE - f->buf_index) / (int)sizeof(*v)); \
+        if (chunk <= 0) {                                               \
+            qemu_put_be##bits##s(f, v++);                               \
+            n--;                                                        \
+            continue;                                                   \
+        }                                                               \
+        for (i = 0; i < chunk; i++) {                                   \
+            uint##bits##_t x = cpu_to_be##bits(v[i]);                   \
+                                                                        \
+            memcpy(f->buf + f->buf_index + i * sizeof(x), &x, sizeof(x)); \
+        }                                                               \
+        f->is_write = 1;                                                \
+        f->buf_index += chunk * sizeof(*v);                             \
+        v += chunk;                                                     \
+        n -= chunk;                                                     \
+        if (f->buf_index >= IO_BUF_SIZE) {                              \
+            qemu_fflush(f);                                             \
+        }                                                               \
+    }                                                                   \
+}
+
+VMSTATE_INT_ARRAY_CODEC(16)
+VMSTATE_INT_ARRAY_CODEC(32)
+VMSTATE_INT_ARRAY_CODEC(64)
+
+static int get_array_8(QEMUFile *f, void *pv, size_t size, int n)
+{
+    if (size != 1) {
+        int i;
+
+        for (i = 0; i < n; i++) {
+            qemu_get_8s(f, pv + i * size);
+        }
+    } else {
+        qemu_get_buffer(f, pv, n);
+    }
+    return 0;
+}
+
+static void put_array_8(QEMUFile *f, void *pv, size_t size, int n)
+{
+    if (size != 1) {
+        int i;
+
+        for (i = 0; i < n; i++) {
+            qemu_put_8s(f, pv + i * size);
+        }
+    } else {
+        qemu_put_buffer(f, pv, n);
+    }
+}
+
 /* bool */
 
 static int get_bool(QEMUFile *f, void *pv, size_t size)
@@ -711,9 +981,11 @@ static void put_int8(QEMUFile *f, void *pv, size_t size)
 }
 
 const VMStateInfo vmstate_info_int8 = {
-    .name = "int8",
-    .get  = get_int8,
-    .put  = put_int8,
+    .name      = "int8",
+    .get       = get_int8,
+    .put       = put_int8,
+    .get_array = get_array_8,
+    .put_array = put_array_8,
 };
 
 /* 16 bit int */
@@ -732,9 +1004,11 @@ static void put_int16(QEMUFile *f, void *pv, size_t size)
 }
 
 const VMStateInfo vmstate_info_int16 = {
-    .name = "int16",
-    .get  = get_int16,
-    .put  = put_int16,
+    .name      = "int16",
+    .get       = get_int16,
+    .put       = put_int16,
+    .get_array = get_array_16,
+    .put_array = put_array_16,
 };
 
 /* 32 bit int */
@@ -753,9 +1027,11 @@ static void put_int32(QEMUFile *f, void *pv, size_t size)
 }
 
 const VMStateInfo vmstate_info_int32 = {
-    .name = "int32",
-    .get  = get_int32,
-    .put  = put_int32,
+    .name      = "int32",
+    .get       = get_int32,
+    .put       = put_int32,
+    .get_array = get_array_32,
+    .put_array = put_array_32,
 };
 
 /* 32 bit int. See that the received value is the same than the one
@@ -814,9 +1090,11 @@ static void put_int64(QEMUFile *f, void *pv, size_t size)
 }
 
 const VMStateInfo vmstate_info_int64 = {
-    .name = "int64",
-    .get  = get_int64,
-    .put  = put_int64,
+    .name      = "int64",
+    .get       = get_int64,
+    .put       = put_int64,
+    .get_array = get_array_64,
+    .put_array = put_array_64,
 };
 
 /* 8 bit unsigned int */
@@ -835,9 +1113,11 @@ static void put_uint8(QEMUFile *f, void *pv, size_t size)
 }
 
 const VMStateInfo vmstate_info_uint8 = {
-    .name = "uint8",
-    .get  = get_uint8,
-    .put  = put_uint8,
+    .name      = "uint8",
+    .get       = get_uint8,
+    .put       = put_uint8,
+    .get_array = get_array_8,
+    .put_array = put_array_8,
 };
 
 /* 16 bit unsigned int */
@@ -856,9 +1136,11 @@ static void put_uint16(QEMUFile *f, void *pv, size_t size)
 }
 
 const VMStateInfo vmstate_info_uint16 = {
-    .name = "uint16",
-    .get  = get_uint16,
-    .put  = put_uint16,
+    .name      = "uint16",
+    .get       = get_uint16,
+    .put       = put_uint16,
+    .get_array = get_array_16,
+    .put_array = put_array_16,
 };
 
 /* 32 bit unsigned int */
@@ -877,9 +1159,11 @@ static void put_uint32(QEMUFile *f, void *pv, size_t size)
 }
 
 const VMStateInfo vmstate_info_uint32 = {
-    .name = "uint32",
-    .get  = get_uint32,
-    .put  = put_uint32,
+    .name      = "uint32",
+    .get       = get_uint32,
+    .put       = put_uint32,
+    .get_array = get_array_32,
+    .put_array = put_array_32,
 };
 
 /* 64 bit unsigned int */
@@ -898,9 +1182,11 @@ static void put_uint64(QEMUFile *f, void *pv, size_t size)
 }
 
 const VMStateInfo vmstate_info_uint64 = {
-    .name = "uint64",
-    .get  = get_uint64,
-    .put  = put_uint64,
+    .name      = "uint64",
+    .get       = get_uint64,
+    .put       = put_uint64,
+    .get_array = get_array_64,
+    .put_array = put_array_64,
 };
 
 /* 8 bit int. See that the received value is the same than the one
@@ -1039,6 +1325,9 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int no_migrate;
+    VMStateStats save_stats;
+    VMStateStats load_stats;
+    VMStateStats load_total;    /* every section, not just the last */
 } SaveStateEntry;
 
 
@@ -1214,6 +1503,9 @@ int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
     se->vmsd = vmsd;
     se->alias_id = alias_id;
 
+    /* Compile the field plan now so device_show never has to */
+    vmstate_plan_get(vmsd);
+
     if (dev && dev->parent_bus && dev->parent_bus->info->get_dev_path) {
         char *id = dev->parent_bus->info->get_dev_path(dev);
         if (id) {
@@ -1248,6 +1540,20 @@ int vmstate_register(DeviceState *dev, int instance_id,
                                           opaque, -1, 0);
 }
 
+/* Call fn for every registered section; vmsd is NULL for sections that
+   are saved by hand */
+void vmstate_foreach_section(void (*fn)(const char *idstr,
+                                        const VMStateDescription *vmsd,
+                                        void *opaque),
+                             void *opaque)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        fn(se->idstr, se->vmsd, opaque);
+    }
+}
+
 void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
                         void *opaque)
 {
@@ -1273,23 +1579,34 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
     VMStateField *field = vmsd->fields;
+    int64_t pos = qemu_ftell(f);
+    int fields = 0;
     int ret;
 
+    trace_vmstate_load_state(vmsd->name, version_id);
     if (version_id > vmsd->version_id) {
-        return -EINVAL;
+        ret = -EINVAL;
+        goto out;
     }
     if (version_id < vmsd->minimum_version_id_old) {
-        return -EINVAL;
+        ret = -EINVAL;
+        goto out;
     }
     if  (version_id < vmsd->minimum_version_id) {
-        return vmsd->load_state_old(f, opaque, version_id);
+        ret = vmsd->load_state_old(f, opaque, version_id);
+        goto out;
     }
     if (vmsd->pre_load) {
-        int ret = vmsd->pre_load(opaque);
+        ret = vmsd->pre_load(opaque);
         if (ret)
-            return ret;
+            goto out;
     }
     while(field->name) {
+        if (field->flags & (VMS_QUEUE | VMS_BITFIELD)) {
+            /* Only used by the device state commands */
+            field++;
+            continue;
+        }
         if ((field->field_exists &&
              field->field_exists(opaque, version_id)) ||
             (!field->field_exists &&
@@ -1298,6 +1615,7 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             int i, n_elems = 1;
             int size = field->size;
 
+            fields++;
             if (field->flags & VMS_VBUFFER) {
                 size = *(int32_t *)(opaque+field->size_offset);
                 if (field->flags & VMS_MULTIPLY) {
@@ -1314,6 +1632,14 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             if (field->flags & VMS_POINTER) {
                 base_addr = *(void **)base_addr + field->start;
             }
+            if (n_elems > 1 && field->info && field->info->get_array &&
+                !(field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER))) {
+                ret = field->info->get_array(f, base_addr, size, n_elems);
+                if (ret < 0) {
+                    goto out;
+                }
+                n_elems = 0;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -1327,7 +1653,7 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
 
                 }
                 if (ret < 0) {
-                    return ret;
+                    goto out;
                 }
             }
         }
@@ -1335,29 +1661,40 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
     }
     ret = vmstate_subsection_load(f, vmsd, opaque);
     if (ret != 0) {
-        return ret;
+        goto out;
     }
     if (vmsd->post_load) {
-        return vmsd->post_load(opaque, version_id);
+        ret = vmsd->post_load(opaque, version_id);
     }
-    return 0;
+out:
+    trace_vmstate_load_state_done(vmsd->name, fields, qemu_ftell(f) - pos,
+                                  ret);
+    return ret;
 }
 
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque)
 {
     VMStateField *field = vmsd->fields;
+    int64_t pos = qemu_ftell(f);
+    int fields = 0;
 
+    trace_vmstate_save_state(vmsd->name, opaque);
     if (vmsd->pre_save) {
         vmsd->pre_save(opaque);
     }
     while(field->name) {
+        if (field->flags & (VMS_QUEUE | VMS_BITFIELD)) {
+            field++;
+            continue;
+        }
         if (!field->field_exists ||
             field->field_exists(opaque, vmsd->version_id)) {
             void *base_addr = opaque + field->offset;
             int i, n_elems = 1;
             int size = field->size;
 
+            fields++;
             if (field->flags & VMS_VBUFFER) {
                 size = *(int32_t *)(opaque+field->size_offset);
                 if (field->flags & VMS_MULTIPLY) {
@@ -1374,6 +1711,11 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
             if (field->flags & VMS_POINTER) {
                 base_addr = *(void **)base_addr + field->start;
             }
+            if (n_elems > 1 && field->info && field->info->put_array &&
+                !(field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER))) {
+                field->info->put_array(f, base_addr, size, n_elems);
+                n_elems = 0;
+            }
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -1390,6 +1732,7 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
         field++;
     }
     vmstate_subsection_save(f, vmsd, opaque);
+    trace_vmstate_save_state_done(vmsd->name, fields, qemu_ftell(f) - pos);
 }
 
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se, int version_id)
@@ -1419,6 +1762,46 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
+
+/* Each section is bracketed by trace events saying how many bytes it took
+   and how long, to find which device dominates the downtime */
+typedef struct SectionTrace {
+    int section_type;
+    int64_t pos;
+    int64_t start_ns;
+} SectionTrace;
+
+static void savevm_section_start(QEMUFile *f, SaveStateEntry *se,
+                                 int section_type, SectionTrace *t)
+{
+    t->section_type = section_type;
+    t->pos = qemu_ftell(f);
+    t->start_ns = get_clock();
+    trace_savevm_section_start(se->idstr, se->instance_id, section_type);
+}
+
+/* The last and full sections are those written with the guest stopped,
+   so their sum is what each device added to the downtime */
+static void savevm_account(VMStateStats *stats, int section_type,
+                           int64_t bytes, int64_t ns)
+{
+    if (section_type == QEMU_VM_SECTION_END ||
+        section_type == QEMU_VM_SECTION_FULL) {
+        stats->bytes += bytes;
+        stats->ns += ns;
+    }
+}
+
+static void savevm_section_end(QEMUFile *f, SaveStateEntry *se,
+                               SectionTrace *t)
+{
+    int64_t bytes = qemu_ftell(f) - t->pos;
+    int64_t ns = get_clock() - t->start_ns;
+
+    trace_savevm_section_end(se->idstr, se->instance_id, bytes, ns);
+    savevm_account(&se->save_stats, t->section_type, bytes, ns);
+}
 
 bool qemu_savevm_state_blocked(Monitor *mon)
 {
@@ -1438,7 +1821,9 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
                             int shared)
 {
     SaveStateEntry *se;
+    int64_t pos = qemu_ftell(f);
 
+    trace_savevm_state_begin();
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if(se->set_params == NULL) {
             continue;
@@ -1450,11 +1835,13 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        SectionTrace t;
         int len;
 
         if (se->save_live_state == NULL)
             continue;
 
+        savevm_section_start(f, se, QEMU_VM_SECTION_START, &t);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_START);
         qemu_put_be32(f, se->section_id);
@@ -1468,30 +1855,39 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
         qemu_put_be32(f, se->version_id);
 
         se->save_live_state(mon, f, QEMU_VM_SECTION_START, se->opaque);
+        savevm_section_end(f, se, &t);
     }
 
     if (qemu_file_has_error(f)) {
         qemu_savevm_state_cancel(mon, f);
+        trace_savevm_state_begin_done(qemu_ftell(f) - pos, -EIO);
         return -EIO;
     }
 
+    trace_savevm_state_begin_done(qemu_ftell(f) - pos, 0);
     return 0;
 }
 
 int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t pos = qemu_ftell(f);
     int ret = 1;
 
+    trace_savevm_state_iterate();
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        SectionTrace t;
+
         if (se->save_live_state == NULL)
             continue;
 
+        savevm_section_start(f, se, QEMU_VM_SECTION_PART, &t);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_PART);
         qemu_put_be32(f, se->section_id);
 
         ret = se->save_live_state(mon, f, QEMU_VM_SECTION_PART, se->opaque);
+        savevm_section_end(f, se, &t);
         if (!ret) {
             /* Do not proceed to the next vmstate before this one reported
                completion of the current stage. This serializes the migration
@@ -1501,40 +1897,55 @@ int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
         }
     }
 
-    if (ret)
-        return 1;
-
-    if (qemu_file_has_error(f)) {
+    if (ret) {
+        ret = 1;
+    } else if (qemu_file_has_error(f)) {
         qemu_savevm_state_cancel(mon, f);
-        return -EIO;
+        ret = -EIO;
     }
 
-    return 0;
+    trace_savevm_state_iterate_done(qemu_ftell(f) - pos, ret);
+    return ret;
 }
 
-int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+static void qemu_savevm_state_live_end(Monitor *mon, QEMUFile *f)
 {
     SaveStateEntry *se;
 
-    cpu_synchronize_all_states();
+    /* The stopped part of a save starts here, for the live and the
+       device sections alike */
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        memset(&se->save_stats, 0, sizeof(se->save_stats));
+    }
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        SectionTrace t;
+
         if (se->save_live_state == NULL)
             continue;
 
+        savevm_section_start(f, se, QEMU_VM_SECTION_END, &t);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
         se->save_live_state(mon, f, QEMU_VM_SECTION_END, se->opaque);
+        savevm_section_end(f, se, &t);
     }
+}
+
+static void qemu_savevm_state_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        SectionTrace t;
         int len;
 
 	if (se->save_state == NULL && se->vmsd == NULL)
 	    continue;
 
+        savevm_section_start(f, se, QEMU_VM_SECTION_FULL, &t);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_FULL);
         qemu_put_be32(f, se->section_id);
@@ -1548,9 +1959,51 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
         qemu_put_be32(f, se->version_id);
 
         vmstate_save(f, se);
+        savevm_section_end(f, se, &t);
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
+}
+
+int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+{
+    int64_t pos = qemu_ftell(f);
+    int ret = 0;
+
+    trace_savevm_state_complete();
+    cpu_synchronize_all_states();
+
+    qemu_savevm_state_live_end(mon, f);
+    qemu_savevm_state_devices(f);
+
+    if (qemu_file_has_error(f))
+        ret = -EIO;
+
+    trace_savevm_state_complete_done(qemu_ftell(f) - pos, ret);
+    return ret;
+}
+
+/* Complete a post-copy migration: the live handlers only say that they
+   go on after the switch, and the device state is sent as one package,
+   so that the destination can load it while already faulting in RAM
+   from the rest of the stream */
+int qemu_savevm_state_complete_postcopy(Monitor *mon, QEMUFile *f)
+{
+    QEMUFileBuffer package = { NULL };
+    QEMUFile *pf;
+
+    cpu_synchronize_all_states();
+
+    qemu_savevm_state_live_end(mon, f);
+
+    pf = qemu_fopen_buffer(&package, 1);
+    qemu_savevm_state_devices(pf);
+    qemu_fclose(pf);
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+    qemu_put_be32(f, package.size);
+    qemu_put_buffer(f, package.data, package.size);
+    qemu_free(package.data);
 
     if (qemu_file_has_error(f))
         return -EIO;
@@ -1698,30 +2151,36 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+static int qemu_loadvm_postcopy_package(QEMUFile *f);
+
+/* Load sections up to the end of the state, or up to a post-copy package
+   after which the rest of the stream belongs to post-copy */
+static int loadvm_section(QEMUFile *f, LoadStateEntry *le, int section_type)
+{
+    int64_t pos = qemu_ftell(f), start_ns = get_clock();
+    int64_t bytes, ns;
+    int ret;
+
+    trace_loadvm_section_start(le->se->idstr, le->se->instance_id,
+                               section_type);
+    ret = vmstate_load(f, le->se, le->version_id);
+    bytes = qemu_ftell(f) - pos;
+    ns = get_clock() - start_ns;
+    trace_loadvm_section_end(le->se->idstr, le->se->instance_id,
+                             bytes, ns, ret);
+    savevm_account(&le->se->load_stats, section_type, bytes, ns);
+    le->se->load_total.bytes += bytes;
+    le->se->load_total.ns += ns;
+    return ret;
+}
+
+static int qemu_loadvm_sections(QEMUFile *f)
 {
     QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
         QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
     uint8_t section_type;
-    unsigned int v;
-    int ret;
-
-    if (qemu_savevm_state_blocked(default_mon)) {
-        return -EINVAL;
-    }
-
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
-
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
-    }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+    int ret = 0;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -1764,7 +2223,7 @@ int qemu_loadvm_state(QEMUFile *f)
             le->version_id = version_id;
             QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            ret = loadvm_section(f, le, section_type);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
@@ -1786,13 +2245,16 @@ int qemu_loadvm_state(QEMUFile *f)
                 goto out;
             }
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            ret = loadvm_section(f, le, section_type);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
                 goto out;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            ret = qemu_loadvm_postcopy_package(f);
+            goto out;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
             ret = -EINVAL;
@@ -1800,22 +2262,174 @@ int qemu_loadvm_state(QEMUFile *f)
         }
     }
 
-    cpu_synchronize_all_post_init();
-
-    ret = 0;
-
 out:
     QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
         QLIST_REMOVE(le, entry);
         qemu_free(le);
     }
 
-    if (qemu_file_has_error(f))
+    return ret;
+}
+
+/* Start post-copy on the rest of f, then load the device state */
+static int qemu_loadvm_postcopy_package(QEMUFile *f)
+{
+    QEMUFileBuffer package = { NULL };
+    QEMUFile *pf;
+    int ret;
+
+    package.size = package.capacity = qemu_get_be32(f);
+    package.data = qemu_malloc(package.size);
+    qemu_get_buffer(f, package.data, package.size);
+    if (qemu_file_has_error(f)) {
         ret = -EIO;
+        goto out;
+    }
 
+    /* Whatever follows is RAM only */
+    if (!loadvm_skip_ram()) {
+        ret = postcopy_incoming_start(f);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    pf = qemu_fopen_buffer(&package, 0);
+    ret = qemu_loadvm_sections(pf);
+    if (qemu_file_has_error(pf)) {
+        ret = -EIO;
+    }
+    qemu_fclose(pf);
+
+out:
+    qemu_free(package.data);
     return ret;
 }
 
+int qemu_loadvm_state(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(default_mon)) {
+        return -EINVAL;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        memset(&se->load_stats, 0, sizeof(se->load_stats));
+        memset(&se->load_total, 0, sizeof(se->load_total));
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    ret = qemu_loadvm_sections(f);
+    if (ret == 0) {
+        cpu_synchronize_all_post_init();
+    }
+    qdev_state_changed_all();
+
+    /* After a post-copy switch, f is no longer ours to look at */
+    if (!postcopy_incoming_started() && qemu_file_has_error(f))
+        ret = -EIO;
+
+    return ret;
+}
+
+int vmstate_get_stats(const VMStateDescription *vmsd, void *opaque,
+                      VMStateStats *save, VMStateStats *load)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (se->vmsd == vmsd && se->opaque == opaque) {
+            *save = se->save_stats;
+            *load = se->load_stats;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+typedef struct SectionStats {
+    SaveStateEntry *se;
+    VMStateStats *stats;
+} SectionStats;
+
+static int compare_section_ns(const void *a, const void *b)
+{
+    const SectionStats *sa = a, *sb = b;
+
+    if (sa->stats->ns != sb->stats->ns) {
+        return sa->stats->ns < sb->stats->ns ? 1 : -1;
+    }
+    return 0;
+}
+
+/* The sections with the given stats, slowest first; NULL if none has any
+   bytes */
+static QObject *savevm_breakdown(int load)
+{
+    SaveStateEntry *se;
+    SectionStats *tab;
+    QList *list;
+    int i, n = 0;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        n++;
+    }
+    tab = qemu_malloc(n * sizeof(*tab));
+    n = 0;
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        VMStateStats *stats = load ? &se->load_total : &se->save_stats;
+
+        if (stats->bytes) {
+            tab[n].se = se;
+            tab[n].stats = stats;
+            n++;
+        }
+    }
+    if (!n) {
+        qemu_free(tab);
+        return NULL;
+    }
+    qsort(tab, n, sizeof(*tab), compare_section_ns);
+
+    list = qlist_new();
+    for (i = 0; i < n; i++) {
+        qlist_append_obj(list, qobject_from_jsonf(
+            "{ 'device': %s, 'instance': %d, 'bytes': %" PRId64
+            ", 'time-ns': %" PRId64 " }", tab[i].se->idstr,
+            tab[i].se->instance_id, tab[i].stats->bytes, tab[i].stats->ns));
+    }
+    qemu_free(tab);
+    return QOBJECT(list);
+}
+
+/* What each section of the last save added to the downtime, slowest
+   first; NULL if nothing has been saved yet */
+QObject *qemu_savevm_downtime_breakdown(void)
+{
+    return savevm_breakdown(0);
+}
+
+/* How long each device took to load all of its sections of the last
+   incoming state, slowest first; NULL if nothing has been loaded yet */
+QObject *qemu_loadvm_breakdown(void)
+{
+    return savevm_breakdown(1);
+}
+
 static int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
                               const char *name)
 {
@@ -1865,6 +2479,31 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+/* Whether the snapshot being saved stores RAM in place, so that the next
+   one only writes what changed */
+static int incremental;
+
+int savevm_incremental(void)
+{
+    return incremental;
+}
+
+/* Whether the snapshot being loaded restores RAM as the guest runs */
+static int lazy_loadvm;
+
+int loadvm_lazy(void)
+{
+    return lazy_loadvm;
+}
+
+/* Whether the state being loaded is only looked at, see dump_vmstate() */
+static int skip_ram_loadvm;
+
+int loadvm_skip_ram(void)
+{
+    return skip_ram_loadvm;
+}
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
@@ -1882,6 +2521,11 @@ void do_savevm(Monitor *mon, const QDict *qdict)
 #endif
     const char *name = qdict_get_try_str(qdict, "name");
 
+    if (postcopy_incoming_active()) {
+        monitor_printf(mon, "Guest RAM is still being restored\n");
+        return;
+    }
+
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
@@ -1950,7 +2594,9 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "Could not open VM state file\n");
         goto the_end;
     }
+    incremental = qdict_get_try_bool(qdict, "incremental", 0);
     ret = qemu_savevm_state(mon, f);
+    incremental = 0;
     vm_state_size = qemu_ftell(f);
     qemu_fclose(f);
     if (ret < 0) {
@@ -1978,13 +2624,18 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         vm_start();
 }
 
-int load_vmstate(const char *name)
+int load_vmstate(const char *name, int lazy)
 {
     BlockDriverState *bs, *bs_vm_state;
     QEMUSnapshotInfo sn;
     QEMUFile *f;
     int ret;
 
+    if (postcopy_incoming_active()) {
+        error_report("Guest RAM is still being restored");
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2023,7 +2674,7 @@ int load_vmstate(const char *name)
     }
 
     /* Flush all IO requests so they don't interfere with the new state.  */
-    qemu_aio_flush();
+    bdrv_drain_all();
 
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
@@ -2044,7 +2695,9 @@ int load_vmstate(const char *name)
         return -EINVAL;
     }
 
+    lazy_loadvm = lazy;
     ret = qemu_loadvm_state(f);
+    lazy_loadvm = 0;
 
     qemu_fclose(f);
     if (ret < 0) {
@@ -2055,6 +2708,73 @@ int load_vmstate(const char *name)
     return 0;
 }
 
+/*
+ * Load the device state saved in a file by migrate "exec:cat > file", or
+ * with snapshot=tag the VM state of that snapshot of an image, into the
+ * devices of a guest that never ran, and print it in the format of
+ * device_show.  RAM is read past rather than loaded, and neither the file
+ * nor the image are written to.
+ */
+int dump_vmstate(const char *arg)
+{
+    BlockDriverState *bs = NULL;
+    QEMUSnapshotInfo sn;
+    char filename[1024], tag[256];
+    const char *p;
+    QEMUFile *f;
+    int ret;
+
+    p = get_opt_value(filename, sizeof(filename), arg);
+    if (*p == ',') {
+        p++;
+    }
+    if (get_param_value(tag, sizeof(tag), "snapshot", p)) {
+        bs = bdrv_new("");
+        ret = bdrv_open(bs, filename, 0, NULL);
+        if (ret < 0) {
+            error_report("Could not open '%s'", filename);
+            goto out;
+        }
+        ret = bdrv_snapshot_find(bs, &sn, tag);
+        if (ret == 0 && sn.vm_state_size == 0) {
+            ret = -EINVAL;
+        }
+        if (ret == 0) {
+            ret = bdrv_snapshot_load_tmp(bs, tag);
+        }
+        if (ret < 0) {
+            error_report("No VM state for snapshot '%s' in '%s'", tag,
+                         filename);
+            goto out;
+        }
+        f = qemu_fopen_bdrv(bs, 0);
+    } else {
+        f = qemu_fopen(filename, "rb");
+    }
+    if (!f) {
+        error_report("Could not open VM state file");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    skip_ram_loadvm = 1;
+    ret = qemu_loadvm_state(f);
+    skip_ram_loadvm = 0;
+
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_report("Error %d while loading VM state", ret);
+        goto out;
+    }
+    qdev_dump_state(stdout);
+
+out:
+    if (bs) {
+        bdrv_delete(bs);
+    }
+    return ret;
+}
+
 void do_delvm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
@@ -16,6 +16,7 @@ import re
 header_event_id = 0xffffffffffffffff
 header_magic    = 0xf2b177cb0aa429b4
 header_version  = 0
+dropped_event_id = 0xfffffffffffffffe
 
 trace_fmt = '=QQQQQQQQ'
 trace_len = struct.calcsize(trace_fmt)
@@ -78,6 +79,10 @@ class Formatter(object):
         delta_ns = rec[1] - self.last_timestamp
         self.last_timestamp = rec[1]
 
+        if rec[0] == dropped_event_id:
+            return 'dropped_events %0.3f num_events=%d' % (delta_ns / 1000.0,
+                                                           rec[2])
+
         event = self.events[rec[0]]
         fields = [event[0], '%0.3f' % (delta_ns / 1000.0)]
         for i in xrange(1, len(event)):
@@ -11,8 +11,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include "qemu-timer.h"
+#include "qemu-barrier.h"
 #include "trace.h"
 
 /** Trace file header event ID */
@@ -24,6 +28,12 @@
 /** Trace file version number, bump if format changes */
 #define HEADER_VERSION 0
 
+/** Records lost because the buffer was full, count in x1 */
+#define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
+
+/** Set in the event of a record once all of it has been written */
+#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
+
 /** Trace buffer entry */
 typedef struct {
     uint64_t event;
@@ -37,11 +47,36 @@ typedef struct {
 } TraceRecord;
 
 enum {
-    TRACE_BUF_LEN = 64 * 1024 / sizeof(TraceRecord),
+    TRACE_BUF_LEN = 4096,
+    TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
+/*
+ * The buffer is a ring that any thread can trace into.  A thread reserves
+ * a slot by moving trace_idx forward atomically, fills it in, and marks it
+ * valid last.  The writer thread takes the valid records in order from
+ * writeout_idx, clears them and moves writeout_idx past them, and only
+ * then can the slots be reserved again: when the ring is full, records
+ * are dropped and counted rather than overwritten.  The writer is woken
+ * every TRACE_BUF_FLUSH_THRESHOLD records, so tracing threads never do
+ * the file I/O themselves.
+ *
+ * trace_lock protects the wakeups and flush requests, trace_file_lock the
+ * trace file.  Only the writer thread and the monitor take the latter.
+ */
 static TraceRecord trace_buf[TRACE_BUF_LEN];
 static unsigned int trace_idx;
+static unsigned int writeout_idx;
+static unsigned int dropped_events;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_available_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t trace_flushed_cond = PTHREAD_COND_INITIALIZER;
+static bool trace_available;
+static bool writeout_thread_started;
+static unsigned int flush_requested, flush_done;
+
+static pthread_mutex_t trace_file_lock = PTHREAD_MUTEX_INITIALIZER;
 static FILE *trace_fp;
 static char *trace_file_name = NULL;
 static bool trace_file_enabled = false;
@@ -63,6 +98,129 @@ static bool write_header(FILE *fp)
     return fwrite(&header, sizeof header, 1, fp) == 1;
 }
 
+static void write_records(const TraceRecord *recs, unsigned int n)
+{
+    pthread_mutex_lock(&trace_file_lock);
+    if (!trace_file_enabled) {
+        goto out;
+    }
+
+    /* If the trace file is not open yet, open it now */
+    if (!trace_fp) {
+        trace_fp = fopen(trace_file_name, "w");
+        if (!trace_fp) {
+            /* Avoid repeatedly trying to open file on failure */
+            trace_file_enabled = false;
+            goto out;
+        }
+        write_header(trace_fp);
+    }
+
+    if (n) {
+        size_t unused; /* for when fwrite(3) is declared warn_unused_result */
+        unused = fwrite(recs, n * sizeof(recs[0]), 1, trace_fp);
+    }
+    fflush(trace_fp);
+out:
+    pthread_mutex_unlock(&trace_file_lock);
+}
+
+/* Move the valid records at writeout_idx to the trace file, or discard
+ * them if it is off.  Runs in the writer thread only.
+ */
+static void writeout_records(void)
+{
+    static TraceRecord recs[TRACE_BUF_FLUSH_THRESHOLD + 1];
+    unsigned int n, dropped;
+    bool full;
+
+    do {
+        for (n = 0; n < TRACE_BUF_FLUSH_THRESHOLD; n++) {
+            TraceRecord *rec = &trace_buf[writeout_idx % TRACE_BUF_LEN];
+
+            if (!(rec->event & TRACE_RECORD_VALID)) {
+                break;
+            }
+            smp_rmb();
+            recs[n] = *rec;
+            recs[n].event &= ~TRACE_RECORD_VALID;
+            rec->event = 0;
+            smp_wmb();
+            writeout_idx++;
+        }
+        full = n == TRACE_BUF_FLUSH_THRESHOLD;
+
+        dropped = __sync_fetch_and_and(&dropped_events, 0);
+        if (dropped) {
+            memset(&recs[n], 0, sizeof(recs[n]));
+            recs[n].event = DROPPED_EVENT_ID;
+            recs[n].timestamp_ns = get_clock();
+            recs[n].x1 = dropped;
+            n++;
+        }
+        write_records(recs, n);
+    } while (full);
+}
+
+static void *writeout_thread(void *opaque)
+{
+    unsigned int requested;
+
+    pthread_mutex_lock(&trace_lock);
+    for (;;) {
+        while (!trace_available) {
+            pthread_cond_wait(&trace_available_cond, &trace_lock);
+        }
+        trace_available = false;
+        requested = flush_requested;
+        pthread_mutex_unlock(&trace_lock);
+
+        writeout_records();
+
+        pthread_mutex_lock(&trace_lock);
+        flush_done = requested;
+        pthread_cond_broadcast(&trace_flushed_cond);
+    }
+    return NULL;
+}
+
+static void start_writeout_thread(void)
+{
+    sigset_t set, oldset;
+    pthread_t thread;
+
+    if (writeout_thread_started) {
+        return;
+    }
+
+    /* block all signals, the writer only ever waits on trace_lock */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    if (pthread_create(&thread, NULL, writeout_thread, NULL) == 0) {
+        pthread_detach(thread);
+        writeout_thread_started = true;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+/* Wake up the writer thread, and if wait is set, let it write out what the
+ * buffer holds now before returning.
+ */
+static void flush_trace_buffer(bool wait)
+{
+    unsigned int ticket;
+
+    pthread_mutex_lock(&trace_lock);
+    trace_available = true;
+    ticket = ++flush_requested;
+    pthread_cond_signal(&trace_available_cond);
+    while (wait && writeout_thread_started &&
+           (int)(flush_done - ticket) < 0) {
+        pthread_cond_wait(&trace_flushed_cond, &trace_lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
 /**
  * set_trace_file : To set the name of a trace file.
  * @file : pointer to the name to be set.
@@ -71,6 +229,7 @@ static bool write_header(FILE *fp)
 bool st_set_trace_file(const char *file)
 {
     st_set_trace_file_enabled(false);
+    start_writeout_thread();
 
     free(trace_file_name);
 
@@ -90,33 +249,10 @@ bool st_set_trace_file(const char *file)
     return true;
 }
 
-static void flush_trace_file(void)
-{
-    /* If the trace file is not open yet, open it now */
-    if (!trace_fp) {
-        trace_fp = fopen(trace_file_name, "w");
-        if (!trace_fp) {
-            /* Avoid repeatedly trying to open file on failure */
-            trace_file_enabled = false;
-            return;
-        }
-        write_header(trace_fp);
-    }
-
-    if (trace_fp) {
-        size_t unused; /* for when fwrite(3) is declared warn_unused_result */
-        unused = fwrite(trace_buf, trace_idx * sizeof(trace_buf[0]), 1, trace_fp);
-    }
-}
-
 void st_flush_trace_buffer(void)
 {
-    if (trace_file_enabled) {
-        flush_trace_file();
-    }
-
-    /* Discard written trace records */
-    trace_idx = 0;
+    /* Write out or discard the records, according to the trace file */
+    flush_trace_buffer(true);
 }
 
 void st_set_trace_file_enabled(bool enable)
@@ -128,25 +264,37 @@ void st_set_trace_file_enabled(bool enable)
     /* Flush/discard trace buffer */
     st_flush_trace_buffer();
 
+    pthread_mutex_lock(&trace_file_lock);
     /* To disable, close trace file */
-    if (!enable) {
+    if (!enable && trace_fp) {
         fclose(trace_fp);
         trace_fp = NULL;
     }
 
     trace_file_enabled = enable;
+    pthread_mutex_unlock(&trace_file_lock);
 }
 
 static void trace(TraceEventID event, uint64_t x1, uint64_t x2, uint64_t x3,
                   uint64_t x4, uint64_t x5, uint64_t x6)
 {
-    TraceRecord *rec = &trace_buf[trace_idx];
+    TraceRecord *rec;
+    unsigned int idx;
 
     if (!trace_list[event].state) {
         return;
     }
 
-    rec->event = event;
+    /* Reserve a slot, unless the writer has not emptied it yet */
+    do {
+        idx = trace_idx;
+        if (idx - *(volatile unsigned int *)&writeout_idx >= TRACE_BUF_LEN) {
+            __sync_fetch_and_add(&dropped_events, 1);
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&trace_idx, idx, idx + 1));
+
+    rec = &trace_buf[idx % TRACE_BUF_LEN];
     rec->timestamp_ns = get_clock();
     rec->x1 = x1;
     rec->x2 = x2;
@@ -154,9 +302,11 @@ static void trace(TraceEventID event, uint64_t x1, uint64_t x2, uint64_t x3,
     rec->x4 = x4;
     rec->x5 = x5;
     rec->x6 = x6;
+    smp_wmb();
+    rec->event = event | TRACE_RECORD_VALID;
 
-    if (++trace_idx == TRACE_BUF_LEN) {
-        st_flush_trace_buffer();
+    if ((idx + 1) % TRACE_BUF_FLUSH_THRESHOLD == 0) {
+        flush_trace_buffer(false);
     }
 }
 
@@ -205,14 +355,19 @@ static void __attribute__((constructor)) st_init(void)
 
 void st_print_trace(FILE *stream, int (*stream_printf)(FILE *stream, const char *fmt, ...))
 {
-    unsigned int i;
+    unsigned int i, end = trace_idx;
 
-    for (i = 0; i < trace_idx; i++) {
+    /* The records that the writer has not taken yet */
+    for (i = writeout_idx; i != end; i++) {
+        TraceRecord rec = trace_buf[i % TRACE_BUF_LEN];
+
+        if (!(rec.event & TRACE_RECORD_VALID)) {
+            continue;
+        }
         stream_printf(stream, "Event %" PRIu64 " : %" PRIx64 " %" PRIx64
                       " %" PRIx64 " %" PRIx64 " %" PRIx64 " %" PRIx64 "\n",
-                      trace_buf[i].event, trace_buf[i].x1, trace_buf[i].x2,
-                      trace_buf[i].x3, trace_buf[i].x4, trace_buf[i].x5,
-                      trace_buf[i].x6);
+                      rec.event & ~TRACE_RECORD_VALID, rec.x1, rec.x2,
+                      rec.x3, rec.x4, rec.x5, rec.x6);
     }
 }
 
@@ -200,7 +200,7 @@ if_start(Slirp *slirp)
 	}
 
 	/* Encapsulate the packet for sending */
-        if_encap(slirp, (uint8_t *)ifm->m_data, ifm->m_len);
+        if_encap(slirp, ifm);
 
         m_free(ifm);
 
@@ -42,5 +42,6 @@ extern int tcp_keepintvl;
 #define PROTO_PPP 0x2
 #endif
 
-void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len);
+void if_encap(Slirp *slirp, struct mbuf *ifm);
+void slirp_select_forget(struct socket *so);
 ssize_t slirp_send(struct socket *so, const void *buf, size_t len, int flags);
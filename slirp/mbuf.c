@@ -17,7 +17,11 @@
 
 #include <slirp.h>
 
-#define MBUF_THRESH 30
+/*
+ * Freed mbufs are kept for reuse up to this many, so that a busy
+ * connection gets its mbufs from the free list rather than malloc()
+ */
+#define MBUF_POOL_MAX 512
 
 /*
  * Find a nice value for msize
@@ -32,19 +36,32 @@ m_init(Slirp *slirp)
     slirp->m_usedlist.m_next = slirp->m_usedlist.m_prev = &slirp->m_usedlist;
 }
 
+void
+m_cleanup(Slirp *slirp)
+{
+    struct mbuf *m, *next;
+
+    for (m = slirp->m_freelist.m_next; m != &slirp->m_freelist; m = next) {
+        next = m->m_next;
+        free(m);
+    }
+    slirp->m_freelist.m_next = slirp->m_freelist.m_prev = &slirp->m_freelist;
+    slirp->mbuf_alloced -= slirp->mbuf_free;
+    slirp->mbuf_free = 0;
+}
+
 /*
  * Get an mbuf from the free list, if there are none
  * malloc one
  *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * The free list only holds up to MBUF_POOL_MAX mbufs: m_free() gives
+ * back to malloc what is freed beyond that, so that a burst of traffic
+ * does not pin its mbufs forever
  */
 struct mbuf *
 m_get(Slirp *slirp)
 {
 	register struct mbuf *m;
-	int flags = 0;
 
 	DEBUG_CALL("m_get");
 
@@ -52,17 +69,16 @@ m_get(Slirp *slirp)
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
 		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
 		m->slirp = slirp;
 	} else {
 		m = slirp->m_freelist.m_next;
 		remque(m);
+		slirp->mbuf_free--;
 	}
 
 	/* Insert it in the used list */
 	insque(m,&slirp->m_usedlist);
-	m->m_flags = (flags | M_USEDLIST);
+	m->m_flags = M_USEDLIST;
 
 	/* Initialise it */
 	m->m_size = SLIRP_MSIZE - offsetof(struct mbuf, m_dat);
@@ -94,11 +110,14 @@ m_free(struct mbuf *m)
 	/*
 	 * Either free() it or put it on the free list
 	 */
-	if (m->m_flags & M_DOFREE) {
+	if (m->m_flags & M_FREELIST) {
+		/* already there */
+	} else if (m->slirp->mbuf_free >= MBUF_POOL_MAX) {
 		m->slirp->mbuf_alloced--;
 		free(m);
-	} else if ((m->m_flags & M_FREELIST) == 0) {
+	} else {
 		insque(m,&m->slirp->m_freelist);
+		m->slirp->mbuf_free++;
 		m->m_flags = M_FREELIST; /* Clobber other flags */
 	}
   } /* if(m) */
@@ -54,6 +54,31 @@ sbreserve(struct sbuf *sb, int size)
 	}
 }
 
+/*
+ * Double the size of sb, up to max, keeping what is in it.  Connections
+ * start with small buffers and grow them each time they fill one, so
+ * that bulk transfers get large windows and idle connections stay small
+ */
+void
+sbgrow(struct sbuf *sb, int max)
+{
+	int size = sb->sb_datalen * 2;
+	char *data;
+
+	if (size > max)
+		size = max;
+	if (size <= (int)sb->sb_datalen)
+		return;
+	data = (char *)malloc(size);
+	if (!data)
+		return;
+	sbcopy(sb, 0, sb->sb_cc, data);
+	free(sb->sb_data);
+	sb->sb_data = sb->sb_rptr = data;
+	sb->sb_wptr = data + sb->sb_cc;
+	sb->sb_datalen = size;
+}
+
 /*
  * Try and write() to the socket, whatever doesn't get written
  * append to the buffer... for a host with a fast net connection,
@@ -24,6 +24,7 @@ struct sbuf {
 void sbfree(struct sbuf *);
 void sbdrop(struct sbuf *, int);
 void sbreserve(struct sbuf *, int);
+void sbgrow(struct sbuf *, int);
 void sbappend(struct socket *, struct mbuf *);
 void sbcopy(struct sbuf *, int, int, char *);
 
@@ -44,6 +44,14 @@ u_int curtime;
 static u_int time_fasttimo, last_slowtimo;
 static int do_slowtimo;
 
+/*
+ * The sockets slirp_select_fill() put in the fd sets, by fd.  select()
+ * tells which fds are ready, so slirp_select_poll() goes over those
+ * instead of over every socket of every instance.
+ */
+static struct socket *polled_socks[FD_SETSIZE];
+static int polled_max_fd = -1;
+
 static QTAILQ_HEAD(slirp_instances, Slirp) slirp_instances =
     QTAILQ_HEAD_INITIALIZER(slirp_instances);
 
@@ -242,10 +250,20 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
 void slirp_cleanup(Slirp *slirp)
 {
+    struct socket *so;
+
     QTAILQ_REMOVE(&slirp_instances, slirp, entry);
 
     unregister_savevm(NULL, "slirp", slirp);
 
+    for (so = slirp->tcb.so_next; so != &slirp->tcb; so = so->so_next) {
+        slirp_select_forget(so);
+    }
+    for (so = slirp->udb.so_next; so != &slirp->udb; so = so->so_next) {
+        slirp_select_forget(so);
+    }
+    m_cleanup(slirp);
+
     qemu_free(slirp->tftp_prefix);
     qemu_free(slirp->bootp_filename);
     qemu_free(slirp);
@@ -255,6 +273,24 @@ void slirp_cleanup(Slirp *slirp)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
 
+static inline void slirp_poll_socket(struct socket *so)
+{
+    if (so->s >= 0 && so->s < FD_SETSIZE) {
+        polled_socks[so->s] = so;
+        if (polled_max_fd < so->s) {
+            polled_max_fd = so->s;
+        }
+    }
+}
+
+/* For sofree(), in case it happens while slirp_select_poll() runs */
+void slirp_select_forget(struct socket *so)
+{
+    if (so->s >= 0 && so->s < FD_SETSIZE && polled_socks[so->s] == so) {
+        polled_socks[so->s] = NULL;
+    }
+}
+
 void slirp_select_fill(int *pnfds,
                        fd_set *readfds, fd_set *writefds, fd_set *xfds)
 {
@@ -308,6 +344,7 @@ void slirp_select_fill(int *pnfds,
 			if (so->so_state & SS_FACCEPTCONN) {
                                 FD_SET(so->s, readfds);
 				UPD_NFDS(so->s);
+				slirp_poll_socket(so);
 				continue;
 			}
 
@@ -317,6 +354,7 @@ void slirp_select_fill(int *pnfds,
 			if (so->so_state & SS_ISFCONNECTING) {
 				FD_SET(so->s, writefds);
 				UPD_NFDS(so->s);
+				slirp_poll_socket(so);
 				continue;
 			}
 
@@ -327,6 +365,7 @@ void slirp_select_fill(int *pnfds,
 			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
 				FD_SET(so->s, writefds);
 				UPD_NFDS(so->s);
+				slirp_poll_socket(so);
 			}
 
 			/*
@@ -337,6 +376,7 @@ void slirp_select_fill(int *pnfds,
 				FD_SET(so->s, readfds);
 				FD_SET(so->s, xfds);
 				UPD_NFDS(so->s);
+				slirp_poll_socket(so);
 			}
 		}
 
@@ -371,6 +411,7 @@ void slirp_select_fill(int *pnfds,
 			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
 				FD_SET(so->s, readfds);
 				UPD_NFDS(so->s);
+				slirp_poll_socket(so);
 			}
 		}
 	}
@@ -378,12 +419,125 @@ void slirp_select_fill(int *pnfds,
         *pnfds = nfds;
 }
 
+/*
+ * Handle a TCP socket select() found ready
+ */
+static void slirp_poll_tcp(struct socket *so, fd_set *readfds,
+                           fd_set *writefds, fd_set *xfds)
+{
+	int ret;
+
+	/*
+	 * Check for URG data
+	 * This will soread as well, so no need to
+	 * test for readfds below if this succeeds
+	 */
+	if (FD_ISSET(so->s, xfds))
+	   sorecvoob(so);
+	/*
+	 * Check sockets for reading
+	 */
+	else if (FD_ISSET(so->s, readfds)) {
+		/*
+		 * Check for incoming connections
+		 */
+		if (so->so_state & SS_FACCEPTCONN) {
+			tcp_connect(so);
+			return;
+		} /* else */
+		ret = soread(so);
+
+		/* Output it if we read something */
+		if (ret > 0)
+		   tcp_output(sototcpcb(so));
+	}
+
+	/*
+	 * Check sockets for writing
+	 */
+	if (FD_ISSET(so->s, writefds)) {
+	  /*
+	   * Check for non-blocking, still-connecting sockets
+	   */
+	  if (so->so_state & SS_ISFCONNECTING) {
+	    /* Connected */
+	    so->so_state &= ~SS_ISFCONNECTING;
+
+	    ret = send(so->s, (const void *) &ret, 0, 0);
+	    if (ret < 0) {
+	      /* XXXXX Must fix, zero bytes is a NOP */
+	      if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		  errno == EINPROGRESS || errno == ENOTCONN)
+		return;
+
+	      /* else failed */
+	      so->so_state &= SS_PERSISTENT_MASK;
+	      so->so_state |= SS_NOFDREF;
+	    }
+	    /* else so->so_state &= ~SS_ISFCONNECTING; */
+
+	    /*
+	     * Continue tcp_input
+	     */
+	    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+	    /* return; */
+	  } else {
+	    ret = sowrite(so);
+	    /*
+	     * If we wrote something, the window may have opened
+	     * enough for an update; tcp_output() decides.  Without
+	     * one, the guest would sit in persist until its next
+	     * window probe.
+	     */
+	    if (ret > 0 && so->so_tcpcb)
+	      tcp_output(sototcpcb(so));
+	  }
+	}
+
+	/*
+	 * Probe a still-connecting, non-blocking socket
+	 * to check if it's still alive
+	 */
+#ifdef PROBE_CONN
+	if (so->so_state & SS_ISFCONNECTING) {
+	  ret = recv(so->s, (char *)&ret, 0,0);
+
+	  if (ret < 0) {
+	    /* XXX */
+	    if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		errno == EINPROGRESS || errno == ENOTCONN)
+	      return; /* Still connecting, continue */
+
+	    /* else failed */
+	    so->so_state &= SS_PERSISTENT_MASK;
+	    so->so_state |= SS_NOFDREF;
+
+	    /* tcp_input will take care of it */
+	  } else {
+	    ret = send(so->s, &ret, 0,0);
+	    if (ret < 0) {
+	      /* XXX */
+	      if (errno == EAGAIN || errno == EWOULDBLOCK ||
+		  errno == EINPROGRESS || errno == ENOTCONN)
+		return;
+	      /* else failed */
+	      so->so_state &= SS_PERSISTENT_MASK;
+	      so->so_state |= SS_NOFDREF;
+	    } else
+	      so->so_state &= ~SS_ISFCONNECTING;
+
+	  }
+	  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
+	} /* SS_ISFCONNECTING */
+#endif
+}
+
 void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
                        int select_error)
 {
     Slirp *slirp;
-    struct socket *so, *so_next;
-    int ret;
+    struct socket *so;
+    int fd, max_fd;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
@@ -408,145 +562,47 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 			tcp_slowtimo(slirp);
 			last_slowtimo = curtime;
 		}
+    }
 
 	/*
-	 * Check sockets
+	 * Check sockets, those that were put in the fd sets.  Entries are
+	 * cleared as they are looked at, sofree() clears those of sockets
+	 * that go away meanwhile.
 	 */
-	if (!select_error) {
-		/*
-		 * Check TCP sockets
-		 */
-		for (so = slirp->tcb.so_next; so != &slirp->tcb;
-		     so = so_next) {
-			so_next = so->so_next;
-
+	max_fd = polled_max_fd;
+	polled_max_fd = -1;
+	for (fd = 0; fd <= max_fd; fd++) {
+		so = polled_socks[fd];
+		if (!so)
+			continue;
+		polled_socks[fd] = NULL;
+		if (select_error || !(FD_ISSET(fd, readfds) ||
+				      FD_ISSET(fd, writefds) ||
+				      FD_ISSET(fd, xfds)))
+			continue;
+
+		if (so->so_tcpcb) {
 			/*
 			 * FD_ISSET is meaningless on these sockets
 			 * (and they can crash the program)
 			 */
 			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
-
-			/*
-			 * Check for URG data
-			 * This will soread as well, so no need to
-			 * test for readfds below if this succeeds
-			 */
-			if (FD_ISSET(so->s, xfds))
-			   sorecvoob(so);
-			/*
-			 * Check sockets for reading
-			 */
-			else if (FD_ISSET(so->s, readfds)) {
-				/*
-				 * Check for incoming connections
-				 */
-				if (so->so_state & SS_FACCEPTCONN) {
-					tcp_connect(so);
-					continue;
-				} /* else */
-				ret = soread(so);
-
-				/* Output it if we read something */
-				if (ret > 0)
-				   tcp_output(sototcpcb(so));
-			}
-
-			/*
-			 * Check sockets for writing
-			 */
-			if (FD_ISSET(so->s, writefds)) {
-			  /*
-			   * Check for non-blocking, still-connecting sockets
-			   */
-			  if (so->so_state & SS_ISFCONNECTING) {
-			    /* Connected */
-			    so->so_state &= ~SS_ISFCONNECTING;
-
-			    ret = send(so->s, (const void *) &ret, 0, 0);
-			    if (ret < 0) {
-			      /* XXXXX Must fix, zero bytes is a NOP */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
 				continue;
-
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    }
-			    /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-			    /*
-			     * Continue tcp_input
-			     */
-			    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-			    /* continue; */
-			  } else
-			    ret = sowrite(so);
-			  /*
-			   * XXXXX If we wrote something (a lot), there
-			   * could be a need for a window update.
-			   * In the worst case, the remote will send
-			   * a window probe to get things going again
-			   */
-			}
-
+			slirp_poll_tcp(so, readfds, writefds, xfds);
+		} else if (so->s != -1 && FD_ISSET(so->s, readfds)) {
 			/*
-			 * Probe a still-connecting, non-blocking socket
-			 * to check if it's still alive
-	 	 	 */
-#ifdef PROBE_CONN
-			if (so->so_state & SS_ISFCONNECTING) {
-			  ret = recv(so->s, (char *)&ret, 0,0);
-
-			  if (ret < 0) {
-			    /* XXX */
-			    if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				errno == EINPROGRESS || errno == ENOTCONN)
-			      continue; /* Still connecting, continue */
-
-			    /* else failed */
-			    so->so_state &= SS_PERSISTENT_MASK;
-			    so->so_state |= SS_NOFDREF;
-
-			    /* tcp_input will take care of it */
-			  } else {
-			    ret = send(so->s, &ret, 0,0);
-			    if (ret < 0) {
-			      /* XXX */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    } else
-			      so->so_state &= ~SS_ISFCONNECTING;
-
-			  }
-			  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
-			} /* SS_ISFCONNECTING */
-#endif
-		}
-
-		/*
-		 * Now UDP sockets.
-		 * Incoming packets are sent straight away, they're not buffered.
-		 * Incoming UDP data isn't buffered either.
-		 */
-		for (so = slirp->udb.so_next; so != &slirp->udb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                            sorecvfrom(so);
-                        }
+			 * UDP: incoming packets are sent straight away,
+			 * they're not buffered.  Incoming UDP data isn't
+			 * buffered either.
+			 */
+			sorecvfrom(so);
 		}
 	}
 
 	/*
 	 * See if we can start outputting
 	 */
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
 	if (slirp->if_queued) {
 	    if_start(slirp);
 	}
@@ -688,10 +744,13 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 }
 
 /* output the IP packet to the ethernet device */
-void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len)
+void if_encap(Slirp *slirp, struct mbuf *ifm)
 {
     uint8_t buf[1600];
-    struct ethhdr *eh = (struct ethhdr *)buf;
+    struct ethhdr *eh;
+    const uint8_t *ip_data = (const uint8_t *)ifm->m_data;
+    int ip_data_len = ifm->m_len;
+    char *start = (ifm->m_flags & M_EXT) ? ifm->m_ext : ifm->m_dat;
 
     if (ip_data_len + ETH_HLEN > sizeof(buf))
         return;
@@ -728,13 +787,21 @@ void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len)
         slirp->client_ipaddr = iph->ip_dst;
         slirp_output(slirp->opaque, arp_req, sizeof(arp_req));
     } else {
+        /* mbufs keep room for link headers in front of the IP header,
+           the Ethernet header goes there rather than the packet being
+           copied behind one */
+        if (ifm->m_data - start >= ETH_HLEN) {
+            eh = (struct ethhdr *)(ifm->m_data - ETH_HLEN);
+        } else {
+            eh = (struct ethhdr *)buf;
+            memcpy(buf + sizeof(struct ethhdr), ip_data, ip_data_len);
+        }
         memcpy(eh->h_dest, slirp->client_ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 4);
         /* XXX: not correct */
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
-        memcpy(buf + sizeof(struct ethhdr), ip_data, ip_data_len);
-        slirp_output(slirp->opaque, buf, ip_data_len + ETH_HLEN);
+        slirp_output(slirp->opaque, (uint8_t *)eh, ip_data_len + ETH_HLEN);
     }
 }
 
@@ -192,7 +192,8 @@ struct Slirp {
 
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
-    int mbuf_alloced;
+    int mbuf_alloced;       /* all mbufs, used or on the free list */
+    int mbuf_free;          /* mbufs on the free list */
 
     /* if states */
     int if_queued;          /* number of packets queued so far */
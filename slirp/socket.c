@@ -73,6 +73,7 @@ sofree(struct socket *so)
       slirp->udp_last_so = &slirp->udb;
   }
   m_free(so->so_m);
+  slirp_select_forget(so);
 
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
@@ -202,6 +203,10 @@ soread(struct socket *so)
 	sb->sb_wptr += nn;
 	if (sb->sb_wptr >= (sb->sb_data + sb->sb_datalen))
 		sb->sb_wptr -= sb->sb_datalen;
+
+	/* The host sends faster than the guest takes it, make room */
+	if (sbspace(sb) < so->so_tcpcb->t_maxseg)
+		sbgrow(sb, TCP_SBMAX(so->so_tcpcb->t_maxseg));
 	return nn;
 }
 
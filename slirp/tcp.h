@@ -40,6 +40,8 @@ typedef	uint32_t tcp_seq;
 
 #define TCP_SNDSPACE 8192
 #define TCP_RCVSPACE 8192
+/* socket buffers grow up to the largest window, in whole segments */
+#define TCP_SBMAX(mss) (TCP_MAXWIN - TCP_MAXWIN % (mss))
 
 /*
  * TCP header.
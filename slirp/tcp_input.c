@@ -486,6 +486,12 @@ findso:
 			 * we have enough buffer space to take it.
 			 */
 			tp->rcv_nxt += ti->ti_len;
+			/*
+			 * The guest filled the window we offered, offer
+			 * a larger one with the ACK below.
+			 */
+			if (SEQ_GEQ(tp->rcv_nxt, tp->rcv_adv))
+				sbgrow(&so->so_rcv, TCP_SBMAX(tp->t_maxseg));
 			/*
 			 * Add data to socket buffer.
 			 */
@@ -53,6 +53,12 @@ void vm_stop(int reason);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+QObject *ram_load_page_stats(void);
+int ram_iterations(void);
+uint64_t ram_dirty_rate(void);
+uint64_t ram_transfer_rate(void);
+int64_t ram_expected_downtime(void);
+int64_t ram_converge_time(void);
 
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
@@ -75,10 +81,18 @@ void qemu_remove_exit_notifier(Notifier *notify);
 void qemu_add_machine_init_done_notifier(Notifier *notify);
 
 void do_savevm(Monitor *mon, const QDict *qdict);
-int load_vmstate(const char *name);
+int load_vmstate(const char *name, int lazy);
+int savevm_incremental(void);
+int loadvm_lazy(void);
+int loadvm_skip_ram(void);
+int dump_vmstate(const char *arg);
+int vmstate_bench(const char *arg);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon);
 
+void do_lockstats(Monitor *mon, const QDict *qdict);
+void do_info_lockstats(Monitor *mon);
+
 void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
 void cpu_synchronize_all_post_init(void);
@@ -92,8 +106,11 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
                             int shared);
 int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f);
 int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f);
+int qemu_savevm_state_complete_postcopy(Monitor *mon, QEMUFile *f);
 void qemu_savevm_state_cancel(Monitor *mon, QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
+QObject *qemu_savevm_downtime_breakdown(void);
+QObject *qemu_loadvm_breakdown(void);
 
 /* SLIRP */
 void do_info_slirp(Monitor *mon);
@@ -116,6 +133,16 @@ extern int autostart;
 extern int incoming_expected;
 extern int bios_size;
 
+/* -startup-profile: how long each phase of startup took, reported when
+   the guest is about to run its first instruction, how much of that went
+   into some of the work done along the way and into creating devices.
+   Phases and devices are also traced, with or without -startup-profile. */
+void startup_profile_mark(const char *phase);
+void startup_profile_account(const char *what, int64_t ns);
+void startup_profile_device(const char *driver, const char *id, int64_t ns);
+/* Called before every entry into guest code; the first one ends startup */
+void startup_profile_cpu_exec(void);
+
 typedef enum {
     VGA_NONE, VGA_STD, VGA_CIRRUS, VGA_VMWARE, VGA_XENFB, VGA_QXL,
 } VGAInterfaceType;
@@ -137,6 +164,7 @@ extern int win2k_install_hack;
 extern int rtc_td_hack;
 extern int alt_grab;
 extern int ctrl_grab;
+extern int sdl_opengl;
 extern int usb_enabled;
 extern int smp_cpus;
 extern int max_cpus;
@@ -153,6 +181,16 @@ extern QEMUClock *rtc_clock;
 extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern uint64_t node_cpumask[MAX_NODES];
+extern uint64_t node_host_nodes[MAX_NODES];
+extern int node_policy[MAX_NODES];
+
+/* Placement of a guest node's memory on the host-nodes= of -numa */
+enum {
+    NUMA_POLICY_DEFAULT,
+    NUMA_POLICY_PREFERRED,
+    NUMA_POLICY_BIND,
+    NUMA_POLICY_INTERLEAVE,
+};
 
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
@@ -3512,11 +3512,36 @@ static void gen_nop_hint(DisasContext *s, int val)
 
 #define CPU_V001 cpu_V0, cpu_V0, cpu_V1
 
+/* dest = a + b (or a - b) on the 8 or 16 bit lanes of a word, without a
+   helper call: the top bit of each lane is left out of the add so that no
+   carry crosses lanes, and put back with an xor.  */
+static void gen_neon_addsub_lanes(int size, int sub, TCGv dest, TCGv a, TCGv b)
+{
+    uint32_t h = size ? 0x80008000 : 0x80808080;
+    TCGv t = new_tmp();
+    TCGv x = new_tmp();
+
+    tcg_gen_xor_i32(t, a, b);
+    tcg_gen_andi_i32(t, t, h);
+    tcg_gen_andi_i32(x, b, ~h);
+    if (sub) {
+        tcg_gen_xori_i32(t, t, h);
+        tcg_gen_ori_i32(dest, a, h);
+        tcg_gen_sub_i32(dest, dest, x);
+    } else {
+        tcg_gen_andi_i32(dest, a, ~h);
+        tcg_gen_add_i32(dest, dest, x);
+    }
+    tcg_gen_xor_i32(dest, dest, t);
+    dead_tmp(x);
+    dead_tmp(t);
+}
+
 static inline int gen_neon_add(int size, TCGv t0, TCGv t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_add_u8(t0, t0, t1); break;
-    case 1: gen_helper_neon_add_u16(t0, t0, t1); break;
+    case 0:
+    case 1: gen_neon_addsub_lanes(size, 0, t0, t0, t1); break;
     case 2: tcg_gen_add_i32(t0, t0, t1); break;
     default: return 1;
     }
@@ -3526,8 +3551,8 @@ static inline int gen_neon_add(int size, TCGv t0, TCGv t1)
 static inline void gen_neon_rsb(int size, TCGv t0, TCGv t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_sub_u8(t0, t1, t0); break;
-    case 1: gen_helper_neon_sub_u16(t0, t1, t0); break;
+    case 0:
+    case 1: gen_neon_addsub_lanes(size, 1, t0, t1, t0); break;
     case 2: tcg_gen_sub_i32(t0, t1, t0); break;
     default: return;
     }
@@ -4438,8 +4463,8 @@ static int disas_neon_data_insn(CPUState * env, DisasContext *s, uint32_t insn)
                     return 1;
             } else { /* VSUB */
                 switch (size) {
-                case 0: gen_helper_neon_sub_u8(tmp, tmp, tmp2); break;
-                case 1: gen_helper_neon_sub_u16(tmp, tmp, tmp2); break;
+                case 0:
+                case 1: gen_neon_addsub_lanes(size, 1, tmp, tmp, tmp2); break;
                 case 2: tcg_gen_sub_i32(tmp, tmp, tmp2); break;
                 default: return 1;
                 }
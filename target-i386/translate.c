@@ -3060,6 +3060,108 @@ static struct sse_op_helper_s sse_op_table7[256] = {
     [0x63] = SSE42_OP(pcmpistri),
 };
 
+/* dest = a + b (or a - b) on the lanes of a 64 bit value whose top bits
+   are in h.  The top bit of each lane is left out of the add so that no
+   carry crosses lanes, and put back with an xor.  */
+static void gen_op_addsub_lanes(int sub, TCGv_i64 a, TCGv_i64 b, uint64_t h)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_xor_i64(t, a, b);
+    tcg_gen_andi_i64(t, t, h);
+    tcg_gen_andi_i64(b, b, ~h);
+    if (sub) {
+        tcg_gen_xori_i64(t, t, h);
+        tcg_gen_ori_i64(a, a, h);
+        tcg_gen_sub_i64(a, a, b);
+    } else {
+        tcg_gen_andi_i64(a, a, ~h);
+        tcg_gen_add_i64(a, a, b);
+    }
+    tcg_gen_xor_i64(a, a, t);
+    tcg_temp_free_i64(t);
+}
+
+/* Integer MMX/SSE operations that are expanded on the 64 bit halves of
+   the registers instead of calling their ops_sse.h helper.  Return 0 if
+   b is not one of them.  */
+static int gen_sse_inline(int b, int op1_offset, int op2_offset, int is_xmm)
+{
+    TCGv_i64 t0, t1;
+    int i;
+
+    switch (b) {
+    case 0x54 ... 0x57: /* andps, andnps, orps, xorps and pd forms */
+    case 0xd4: /* paddq */
+    case 0xdb: /* pand */
+    case 0xdf: /* pandn */
+    case 0xeb: /* por */
+    case 0xef: /* pxor */
+    case 0xf4: /* pmuludq */
+    case 0xf8 ... 0xfe: /* psubb/w/d/q, paddb/w/d */
+        break;
+    default:
+        return 0;
+    }
+    t0 = tcg_temp_new_i64();
+    t1 = tcg_temp_new_i64();
+    for (i = 0; i < (is_xmm ? 2 : 1); i++) {
+        tcg_gen_ld_i64(t0, cpu_env, op1_offset + i * 8);
+        tcg_gen_ld_i64(t1, cpu_env, op2_offset + i * 8);
+        switch (b) {
+        case 0x54:
+        case 0xdb:
+            tcg_gen_and_i64(t0, t0, t1);
+            break;
+        case 0x55:
+        case 0xdf:
+            tcg_gen_andc_i64(t0, t1, t0);
+            break;
+        case 0x56:
+        case 0xeb:
+            tcg_gen_or_i64(t0, t0, t1);
+            break;
+        case 0x57:
+        case 0xef:
+            tcg_gen_xor_i64(t0, t0, t1);
+            break;
+        case 0xd4:
+            tcg_gen_add_i64(t0, t0, t1);
+            break;
+        case 0xfb:
+            tcg_gen_sub_i64(t0, t0, t1);
+            break;
+        case 0xf4:
+            tcg_gen_ext32u_i64(t0, t0);
+            tcg_gen_ext32u_i64(t1, t1);
+            tcg_gen_mul_i64(t0, t0, t1);
+            break;
+        case 0xf8:
+            gen_op_addsub_lanes(1, t0, t1, 0x8080808080808080ULL);
+            break;
+        case 0xf9:
+            gen_op_addsub_lanes(1, t0, t1, 0x8000800080008000ULL);
+            break;
+        case 0xfa:
+            gen_op_addsub_lanes(1, t0, t1, 0x8000000080000000ULL);
+            break;
+        case 0xfc:
+            gen_op_addsub_lanes(0, t0, t1, 0x8080808080808080ULL);
+            break;
+        case 0xfd:
+            gen_op_addsub_lanes(0, t0, t1, 0x8000800080008000ULL);
+            break;
+        case 0xfe:
+            gen_op_addsub_lanes(0, t0, t1, 0x8000000080000000ULL);
+            break;
+        }
+        tcg_gen_st_i64(t0, cpu_env, op1_offset + i * 8);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    return 1;
+}
+
 static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
 {
     int b1, op1_offset, op2_offset, is_xmm, val, ot;
@@ -4047,6 +4149,9 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
             ((void (*)(TCGv_ptr, TCGv_ptr, TCGv))sse_op2)(cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_inline(b, op1_offset, op2_offset, is_xmm)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             ((void (*)(TCGv_ptr, TCGv_ptr))sse_op2)(cpu_ptr0, cpu_ptr1);
@@ -0,0 +1,585 @@
+/*
+ * Persistent translation cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * Short-lived user mode processes spend most of their time translating
+ * the same code, run after run.  With a cache file, the host code of the
+ * TBs of a run is written out on exit, and the next run of the same QEMU
+ * binary with the same CPU model copies it back instead of translating,
+ * after checking that the guest code it was translated from still has
+ * the same hash.  The TCG backend records the references of the code to
+ * host addresses outside of it, so that the code can be loaded at another
+ * address of the translation buffer.
+ *
+ * The cache holds host code that is run as is: it must not be writable by
+ * anybody who is not trusted with running code as the user of QEMU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "cpu.h"
+#include "exec-all.h"
+#include "tcg.h"
+#include "elf.h"
+#include "qemu-common.h"
+#include "tb-cache.h"
+
+/* The i386 translator embeds no host pointer in the code but that of the
+   TB, which the backend records */
+#if defined(TARGET_I386) && defined(TCG_TARGET_HAS_HOST_RELOCS)
+#define TB_CACHE_SUPPORTED
+#endif
+
+#define TB_CACHE_MAGIC          "QEMUTBC"
+#define TB_CACHE_VERSION        1
+#define TB_CACHE_HASH_BITS      16
+#define TB_CACHE_MAX_ENTRIES    (128 * 1024)
+#define TB_CACHE_MAX_FILE_SIZE  (256 * 1024 * 1024)
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID         3
+#endif
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_records;
+    uint64_t key;               /* of the build and the translation setup */
+    uint64_t checksum;          /* of the records */
+} TBCacheHeader;
+
+/* Followed by nb_relocs TCGHostReloc and by the code; a record is padded
+   to 8 bytes.  The value of the immediate relocations is relative to the
+   TB, that of the others is absolute. */
+typedef struct TBCacheRecord {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint64_t guest_hash;
+    uint32_t code_size;
+    uint16_t guest_size;
+    uint16_t nb_relocs;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+} TBCacheRecord;
+
+typedef struct TBCacheEntry {
+    TBCacheRecord *rec;
+    struct TBCacheEntry *next;
+    int used;                   /* loaded into this run */
+    int is_new;                 /* translated in this run, rec is ours */
+} TBCacheEntry;
+
+int tb_cache_enabled;
+static char *tb_cache_path;
+static uint64_t tb_cache_key;
+static uint8_t *tb_cache_file;
+static TBCacheEntry *tb_cache_hash_table[1 << TB_CACHE_HASH_BITS];
+static int tb_cache_nb_new;
+static int tb_cache_hits;
+static int tb_cache_misses;
+
+static inline uint64_t rol64(uint64_t word, unsigned int shift)
+{
+    return (word << shift) | (word >> (64 - shift));
+}
+
+/* Can be chained over buffers whose length is a multiple of 8 */
+static uint64_t tb_cache_hash(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint64_t w;
+
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        h = rol64(h ^ (w * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        h = rol64(h ^ (*p++ * 0x87c37b91114253d5ULL), 31) *
+            0x4cf5ad432745937fULL;
+    }
+    return h;
+}
+
+static uint64_t tb_cache_hash_final(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t tb_cache_guest_hash(target_ulong pc, unsigned int size)
+{
+    return tb_cache_hash_final(tb_cache_hash(size, g2h(pc), size));
+}
+
+static inline unsigned int tb_cache_bucket(target_ulong pc)
+{
+    return (pc ^ (pc >> TB_CACHE_HASH_BITS)) & ((1 << TB_CACHE_HASH_BITS) - 1);
+}
+
+static inline size_t tb_cache_record_size(const TBCacheRecord *rec)
+{
+    return (sizeof(*rec) + rec->nb_relocs * sizeof(TCGHostReloc) +
+            rec->code_size + 7) & ~7;
+}
+
+static inline TCGHostReloc *tb_cache_relocs(TBCacheRecord *rec)
+{
+    return (TCGHostReloc *)(rec + 1);
+}
+
+static inline uint8_t *tb_cache_code(TBCacheRecord *rec)
+{
+    return (uint8_t *)(tb_cache_relocs(rec) + rec->nb_relocs);
+}
+
+/* Breakpoints and single stepping change the code of a TB */
+static inline int tb_cache_usable(CPUState *env, TranslationBlock *tb)
+{
+    return tb->cflags == 0 && QTAILQ_EMPTY(&env->breakpoints) &&
+           !env->singlestep_enabled;
+}
+
+static TBCacheEntry *tb_cache_find(const TBCacheRecord *rec)
+{
+    TBCacheEntry *e;
+
+    for (e = tb_cache_hash_table[tb_cache_bucket(rec->pc)]; e; e = e->next) {
+        if (e->rec->pc == rec->pc && e->rec->cs_base == rec->cs_base &&
+            e->rec->flags == rec->flags &&
+            e->rec->guest_hash == rec->guest_hash) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void tb_cache_insert(TBCacheRecord *rec, int is_new)
+{
+    TBCacheEntry *e = qemu_mallocz(sizeof(*e));
+    unsigned int h = tb_cache_bucket(rec->pc);
+
+    e->rec = rec;
+    e->is_new = is_new;
+    e->next = tb_cache_hash_table[h];
+    tb_cache_hash_table[h] = e;
+    tb_cache_nb_new += is_new;
+}
+
+/* Check that the immediate of value has the encoding the backend chose
+   for the original, so that retranslating for cpu_restore_state gives
+   the same code */
+static int tb_cache_imm_ok(int type, tcg_target_long value)
+{
+    switch (type) {
+    case TCG_HOST_RELOC_IMM32U:
+        return value != 0 && value == (uint32_t)value;
+    case TCG_HOST_RELOC_IMM32S:
+        return value == (int32_t)value && value != (uint32_t)value;
+    case TCG_HOST_RELOC_IMM64:
+        return value != (int32_t)value && value != (uint32_t)value;
+    }
+    return 0;
+}
+
+static int tb_cache_relocate(TBCacheRecord *rec, TranslationBlock *tb)
+{
+    TCGHostReloc *r = tb_cache_relocs(rec);
+    uint8_t *code = tb->tc_ptr;
+    tcg_target_long value;
+    uint64_t val64;
+    uint32_t val32;
+    int i;
+
+    memcpy(code, tb_cache_code(rec), rec->code_size);
+    for (i = 0; i < rec->nb_relocs; i++, r++) {
+        uint8_t *p = code + r->offset;
+
+        if (r->type == TCG_HOST_RELOC_PCREL32) {
+            value = r->value - (tcg_target_long)(p + 4);
+            if (value != (int32_t)value) {
+                return 0;
+            }
+        } else {
+            value = (tcg_target_long)tb + r->value;
+            if (!tb_cache_imm_ok(r->type, value)) {
+                return 0;
+            }
+        }
+        if (r->type == TCG_HOST_RELOC_IMM64) {
+            val64 = value;
+            memcpy(p, &val64, 8);
+        } else {
+            val32 = value;
+            memcpy(p, &val32, 4);
+        }
+    }
+    flush_icache_range((unsigned long)code,
+                       (unsigned long)code + rec->code_size);
+    return 1;
+}
+
+int tb_cache_do_load(CPUState *env, TranslationBlock *tb, int *code_size)
+{
+    TBCacheEntry *e;
+    TBCacheRecord *rec;
+
+    if (!tb_cache_usable(env, tb)) {
+        return 0;
+    }
+    for (e = tb_cache_hash_table[tb_cache_bucket(tb->pc)]; e; e = e->next) {
+        rec = e->rec;
+        if (rec->pc != tb->pc || rec->cs_base != tb->cs_base ||
+            rec->flags != tb->flags) {
+            continue;
+        }
+        if (page_check_range(tb->pc, rec->guest_size, PAGE_READ) < 0 ||
+            tb_cache_guest_hash(tb->pc, rec->guest_size) != rec->guest_hash) {
+            continue;
+        }
+        if (!tb_cache_relocate(rec, tb)) {
+            continue;
+        }
+        tb->size = rec->guest_size;
+        tb->tb_next_offset[0] = rec->tb_next_offset[0];
+        tb->tb_next_offset[1] = rec->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+        tb->tb_jmp_offset[0] = rec->tb_jmp_offset[0];
+        tb->tb_jmp_offset[1] = rec->tb_jmp_offset[1];
+#endif
+        *code_size = rec->code_size;
+        e->used = 1;
+        tb_cache_hits++;
+        return 1;
+    }
+    tb_cache_misses++;
+    return 0;
+}
+
+void tb_cache_do_store(CPUState *env, TranslationBlock *tb, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheRecord key, *rec;
+    TCGHostReloc *r;
+    size_t size;
+    int i;
+
+    if (!tb_cache_usable(env, tb) || s->nb_host_relocs < 0 ||
+        tb_cache_nb_new >= TB_CACHE_MAX_ENTRIES) {
+        return;
+    }
+    memset(&key, 0, sizeof(key));
+    key.pc = tb->pc;
+    key.cs_base = tb->cs_base;
+    key.flags = tb->flags;
+    key.guest_hash = tb_cache_guest_hash(tb->pc, tb->size);
+    if (tb_cache_find(&key)) {
+        return;
+    }
+
+    key.code_size = code_size;
+    key.guest_size = tb->size;
+    key.nb_relocs = s->nb_host_relocs;
+    key.tb_next_offset[0] = tb->tb_next_offset[0];
+    key.tb_next_offset[1] = tb->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+    key.tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    key.tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+#else
+    key.tb_jmp_offset[0] = key.tb_jmp_offset[1] = 0xffff;
+#endif
+    size = tb_cache_record_size(&key);
+    rec = qemu_mallocz(size);
+    *rec = key;
+
+    r = tb_cache_relocs(rec);
+    memcpy(r, s->host_relocs, rec->nb_relocs * sizeof(*r));
+    for (i = 0; i < rec->nb_relocs; i++, r++) {
+        /* exit_tb returns the TB, with the jump in the low bits */
+        if (r->type != TCG_HOST_RELOC_PCREL32) {
+            r->value -= (tcg_target_long)tb;
+            if (r->value < 0 || r->value > 3) {
+                qemu_free(rec);
+                return;
+            }
+        }
+    }
+    memcpy(tb_cache_code(rec), tb->tc_ptr, code_size);
+    tb_cache_insert(rec, 1);
+}
+
+static int tb_cache_check_record(TBCacheRecord *rec, size_t len)
+{
+    TCGHostReloc *r;
+    int i;
+
+    if (len < sizeof(*rec) || rec->nb_relocs > TCG_MAX_HOST_RELOCS ||
+        rec->code_size > TCG_MAX_OP_SIZE * OPC_MAX_SIZE ||
+        rec->guest_size == 0 || tb_cache_record_size(rec) > len) {
+        return 0;
+    }
+    for (i = 0; i < 2; i++) {
+        if ((rec->tb_next_offset[i] != 0xffff &&
+             rec->tb_next_offset[i] > rec->code_size) ||
+            (rec->tb_jmp_offset[i] != 0xffff &&
+             rec->tb_jmp_offset[i] + 4 > rec->code_size)) {
+            return 0;
+        }
+    }
+    r = tb_cache_relocs(rec);
+    for (i = 0; i < rec->nb_relocs; i++, r++) {
+        if (r->type > TCG_HOST_RELOC_IMM64 ||
+            r->offset + (r->type == TCG_HOST_RELOC_IMM64 ? 8 : 4) >
+            rec->code_size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void tb_cache_read(void)
+{
+    TBCacheHeader *hdr;
+    struct stat st;
+    size_t len, size;
+    uint8_t *p;
+    int fd, i;
+
+    fd = open(tb_cache_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr) ||
+        st.st_size > TB_CACHE_MAX_FILE_SIZE) {
+        close(fd);
+        return;
+    }
+    len = st.st_size;
+    tb_cache_file = qemu_malloc(len);
+    if (read(fd, tb_cache_file, len) != len) {
+        goto fail;
+    }
+
+    hdr = (TBCacheHeader *)tb_cache_file;
+    if (memcmp(hdr->magic, TB_CACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != TB_CACHE_VERSION || hdr->key != tb_cache_key) {
+        /* written by another build or setup, the next save replaces it */
+        goto fail;
+    }
+    p = tb_cache_file + sizeof(*hdr);
+    len -= sizeof(*hdr);
+    if ((len & 7) || tb_cache_hash(hdr->key, p, len) != hdr->checksum) {
+        qemu_log("tb-cache: %s is corrupt\n", tb_cache_path);
+        goto fail;
+    }
+    for (i = 0; i < hdr->nb_records; i++) {
+        if (!tb_cache_check_record((TBCacheRecord *)p, len)) {
+            qemu_log("tb-cache: %s has a bad record\n", tb_cache_path);
+            break;
+        }
+        size = tb_cache_record_size((TBCacheRecord *)p);
+        tb_cache_insert((TBCacheRecord *)p, 0);
+        p += size;
+        len -= size;
+    }
+    close(fd);
+    return;
+
+fail:
+    qemu_free(tb_cache_file);
+    tb_cache_file = NULL;
+    close(fd);
+}
+
+static int tb_cache_write_entries(FILE *f, uint64_t *checksum, int used,
+                                  int *nb_records)
+{
+    TBCacheEntry *e;
+    size_t size;
+    int i;
+
+    for (i = 0; i < (1 << TB_CACHE_HASH_BITS); i++) {
+        for (e = tb_cache_hash_table[i]; e; e = e->next) {
+            if ((e->used || e->is_new) != used) {
+                continue;
+            }
+            if (*nb_records == TB_CACHE_MAX_ENTRIES) {
+                return 0;
+            }
+            size = tb_cache_record_size(e->rec);
+            if (fwrite(e->rec, size, 1, f) != 1) {
+                return -1;
+            }
+            *checksum = tb_cache_hash(*checksum, e->rec, size);
+            (*nb_records)++;
+        }
+    }
+    return 0;
+}
+
+/* Write the cache out again if this run translated anything new.  The
+   TBs this run used go first, so that what is not needed any more falls
+   off the end.  Concurrent runs each replace the file as a whole. */
+void tb_cache_save(void)
+{
+    TBCacheHeader hdr;
+    char *tmp;
+    FILE *f;
+    int fd, nb_records = 0;
+
+    if (!tb_cache_enabled || !tb_cache_nb_new) {
+        return;
+    }
+
+    spin_lock(&tb_lock);
+    tmp = qemu_malloc(strlen(tb_cache_path) + 8);
+    sprintf(tmp, "%s.XXXXXX", tb_cache_path);
+    fd = mkstemp(tmp);
+    f = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!f) {
+        goto out;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TB_CACHE_VERSION;
+    hdr.key = tb_cache_key;
+    hdr.checksum = tb_cache_key;
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        tb_cache_write_entries(f, &hdr.checksum, 1, &nb_records) < 0 ||
+        tb_cache_write_entries(f, &hdr.checksum, 0, &nb_records) < 0) {
+        goto fail;
+    }
+    hdr.nb_records = nb_records;
+    if (fseek(f, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fclose(f) != 0) {
+        f = NULL;
+        goto fail;
+    }
+    f = NULL;
+    if (rename(tmp, tb_cache_path) < 0) {
+        goto fail;
+    }
+    qemu_log("tb-cache: %d TBs loaded, %d translated, %d saved\n",
+             tb_cache_hits, tb_cache_misses, nb_records);
+    tb_cache_nb_new = 0;
+    goto out;
+
+fail:
+    if (f) {
+        fclose(f);
+    }
+    unlink(tmp);
+out:
+    qemu_free(tmp);
+    spin_unlock(&tb_lock);
+}
+
+/* The GNU build ID of the QEMU executable, or else its size, time and
+   inode */
+static uint64_t tb_cache_build_id(uint64_t h)
+{
+#if HOST_LONG_BITS == 64
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr;
+#else
+    Elf32_Ehdr ehdr;
+    Elf32_Phdr phdr;
+#endif
+    Elf32_Nhdr *nhdr;
+    uint8_t notes[1024], *p;
+    struct stat st;
+    size_t len;
+    int fd, i;
+
+    fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0) {
+        return h;
+    }
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+        memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+        ehdr.e_phentsize != sizeof(phdr)) {
+        goto stat;
+    }
+    for (i = 0; i < ehdr.e_phnum; i++) {
+        if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) !=
+            sizeof(phdr)) {
+            break;
+        }
+        if (phdr.p_type != PT_NOTE) {
+            continue;
+        }
+        len = MIN(phdr.p_filesz, sizeof(notes));
+        if (pread(fd, notes, len, phdr.p_offset) != len) {
+            continue;
+        }
+        for (p = notes; p + sizeof(*nhdr) <= notes + len;) {
+            nhdr = (Elf32_Nhdr *)p;
+            p += sizeof(*nhdr) + ((nhdr->n_namesz + 3) & ~3);
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                p + nhdr->n_descsz <= notes + len &&
+                !memcmp(nhdr + 1, "GNU", 4)) {
+                close(fd);
+                return tb_cache_hash(h, p, nhdr->n_descsz);
+            }
+            p += (nhdr->n_descsz + 3) & ~3;
+        }
+    }
+
+stat:
+    if (fstat(fd, &st) == 0) {
+        h = tb_cache_hash(h, &st.st_ino, sizeof(st.st_ino));
+        h = tb_cache_hash(h, &st.st_size, sizeof(st.st_size));
+        h = tb_cache_hash(h, &st.st_mtime, sizeof(st.st_mtime));
+    }
+    close(fd);
+    return h;
+}
+
+/* Everything but the guest code that the translation depends on, with
+   the TCG prologue standing for the addresses of the executable */
+static uint64_t tb_cache_key_init(const char *cpu_model)
+{
+    uint64_t h = TB_CACHE_VERSION, v[7];
+
+    h = tb_cache_build_id(h);
+    h = tb_cache_hash(h, TARGET_ARCH, strlen(TARGET_ARCH));
+    h = tb_cache_hash(h, cpu_model, strlen(cpu_model));
+    v[0] = GUEST_BASE;
+    v[1] = singlestep;
+    v[2] = (uintptr_t)code_gen_prologue;
+    v[3] = sizeof(TBCacheRecord);
+    v[4] = sizeof(TCGHostReloc);
+    v[5] = sizeof(CPUState);
+    v[6] = tcg_optimize_enabled;
+    return tb_cache_hash_final(tb_cache_hash(h, v, sizeof(v)));
+}
+
+int tb_cache_init(const char *path, const char *cpu_model)
+{
+#ifdef TB_CACHE_SUPPORTED
+    tb_cache_path = qemu_strdup(path);
+    tb_cache_key = tb_cache_key_init(cpu_model);
+    tb_cache_read();
+    tb_cache_enabled = 1;
+    return 0;
+#else
+    fprintf(stderr, "qemu: the translation cache is not supported for "
+            "this target or host\n");
+    return -1;
+#endif
+}
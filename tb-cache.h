@@ -0,0 +1,45 @@
+/*
+ * Persistent translation cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef TB_CACHE_H
+#define TB_CACHE_H
+
+#ifdef CONFIG_LINUX_USER
+extern int tb_cache_enabled;
+
+int tb_cache_init(const char *path, const char *cpu_model);
+void tb_cache_save(void);
+int tb_cache_do_load(CPUState *env, TranslationBlock *tb, int *code_size);
+void tb_cache_do_store(CPUState *env, TranslationBlock *tb, int code_size);
+#endif
+
+/* Fill tb with the code of an earlier run, if the guest code it was
+   translated from is unchanged */
+static inline int tb_cache_load(CPUState *env, TranslationBlock *tb,
+                                int *code_size)
+{
+#ifdef CONFIG_LINUX_USER
+    if (tb_cache_enabled) {
+        return tb_cache_do_load(env, tb, code_size);
+    }
+#endif
+    return 0;
+}
+
+/* Remember the code just generated for tb, for the next runs */
+static inline void tb_cache_store(CPUState *env, TranslationBlock *tb,
+                                  int code_size)
+{
+#ifdef CONFIG_LINUX_USER
+    if (tb_cache_enabled) {
+        tb_cache_do_store(env, tb, code_size);
+    }
+#endif
+}
+
+#endif
@@ -539,6 +539,20 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     }
 }
 
+/* Record the pointer loaded by the tcg_out_movi just emitted */
+static void tcg_host_reloc_movi(TCGContext *s, tcg_target_long arg)
+{
+    if (arg == 0) {
+        return;
+    } else if (TCG_TARGET_REG_BITS == 32 || arg == (uint32_t)arg) {
+        tcg_host_reloc(s, TCG_HOST_RELOC_IMM32U, s->code_ptr - 4, arg);
+    } else if (arg == (int32_t)arg) {
+        tcg_host_reloc(s, TCG_HOST_RELOC_IMM32S, s->code_ptr - 4, arg);
+    } else {
+        tcg_host_reloc(s, TCG_HOST_RELOC_IMM64, s->code_ptr - 8, arg);
+    }
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -939,10 +953,13 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
         tcg_out32(s, disp);
+        tcg_host_reloc(s, TCG_HOST_RELOC_PCREL32, s->code_ptr - 4, dest);
     } else {
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
+        /* the code would not be the same at another address */
+        s->nb_host_relocs = -1;
     }
 }
 
@@ -1445,6 +1462,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     switch(opc) {
     case INDEX_op_exit_tb:
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        tcg_host_reloc_movi(s, args[0]);
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
@@ -1457,6 +1475,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
             /* indirect jump method */
             tcg_out_modrm_offset(s, OPC_GRP5, EXT5_JMPN_Ev, -1,
                                  (tcg_target_long)(s->tb_next + args[0]));
+            s->nb_host_relocs = -1;
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
@@ -1466,6 +1485,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         } else {
             /* call *reg */
             tcg_out_modrm(s, OPC_GRP5, EXT5_CALLN_Ev, args[0]);
+            s->nb_host_relocs = -1;
         }
         break;
     case INDEX_op_jmp:
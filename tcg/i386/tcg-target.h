@@ -74,6 +74,9 @@ enum {
 #define TCG_TARGET_STACK_ALIGN 16
 #define TCG_TARGET_CALL_STACK_OFFSET 0
 
+/* the backend records the host references of generated code */
+#define TCG_TARGET_HAS_HOST_RELOCS
+
 /* optional instructions */
 #define TCG_TARGET_HAS_div2_i32
 #define TCG_TARGET_HAS_rot_i32
@@ -0,0 +1,790 @@
+/*
+ * Optimizations for Tiny Code Generator for QEMU
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * A forward pass over the ops of a TB, run before the liveness analysis.
+ * Within a basic block it knows which temps hold a constant and which
+ * hold a copy of another temp.  It replaces the inputs of ops by the
+ * temp they are a copy of, folds ops whose inputs are constant into
+ * movi, and turns ops with a trivial result (x + 0, x & 0, x ^ x, ...)
+ * into mov or movi.  The liveness analysis then removes the movs and the
+ * computations nobody uses any more.
+ *
+ * Ops are only ever replaced in place, by mov, movi, br or nop, which
+ * take no more parameters than the op they replace: the op indexes stay
+ * valid for gen_opc_pc and cpu_restore_state.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "qemu-common.h"
+#include "tcg-op.h"
+
+int tcg_optimize_enabled = 1;
+
+#if TCG_TARGET_REG_BITS == 64
+#define CASE_OP_32_64(x)                        \
+        glue(glue(case INDEX_op_, x), _i32):    \
+        glue(glue(case INDEX_op_, x), _i64)
+#else
+#define CASE_OP_32_64(x)                        \
+        glue(glue(case INDEX_op_, x), _i32)
+#endif
+
+typedef enum {
+    TCG_TEMP_UNDEF = 0,
+    TCG_TEMP_CONST,             /* val is the value */
+    TCG_TEMP_COPY,              /* val is the temp this is a copy of */
+    TCG_TEMP_HAS_COPY,          /* other temps are copies of this one */
+    TCG_TEMP_ANY
+} TCGTempState;
+
+/* The copies of a temp and the temp itself form a circular list; the
+   temp they are copies of is never a global, as calls and qemu_ld/st
+   may change globals behind the back of the ops */
+struct tcg_temp_info {
+    TCGTempState state;
+    uint16_t prev_copy;
+    uint16_t next_copy;
+    tcg_target_ulong val;
+};
+
+static struct tcg_temp_info temps[TCG_MAX_TEMPS];
+
+/* Forget what is known about temp, and make one of its copies stand for
+   the others if it had some */
+static void reset_temp(TCGArg temp, int nb_globals)
+{
+    TCGArg i, new_base = (TCGArg)-1;
+
+    if (temps[temp].state == TCG_TEMP_HAS_COPY) {
+        for (i = temps[temp].next_copy; i != temp; i = temps[i].next_copy) {
+            if (i >= nb_globals) {
+                temps[i].state = TCG_TEMP_HAS_COPY;
+                new_base = i;
+                break;
+            }
+        }
+        for (i = temps[temp].next_copy; i != temp; i = temps[i].next_copy) {
+            if (new_base == (TCGArg)-1) {
+                temps[i].state = TCG_TEMP_ANY;
+            } else if (i != new_base) {
+                temps[i].val = new_base;
+            }
+        }
+        temps[temps[temp].next_copy].prev_copy = temps[temp].prev_copy;
+        temps[temps[temp].prev_copy].next_copy = temps[temp].next_copy;
+    } else if (temps[temp].state == TCG_TEMP_COPY) {
+        temps[temps[temp].next_copy].prev_copy = temps[temp].prev_copy;
+        temps[temps[temp].prev_copy].next_copy = temps[temp].next_copy;
+        new_base = temps[temp].val;
+    }
+    temps[temp].state = TCG_TEMP_ANY;
+    if (new_base != (TCGArg)-1 && temps[new_base].next_copy == new_base) {
+        temps[new_base].state = TCG_TEMP_ANY;
+    }
+}
+
+static void reset_all_temps(int nb_temps)
+{
+    memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+}
+
+static void reset_globals(int nb_globals)
+{
+    int i;
+
+    for (i = 0; i < nb_globals; i++) {
+        reset_temp(i, nb_globals);
+    }
+}
+
+static int temps_are_copies(TCGArg arg1, TCGArg arg2)
+{
+    if (arg1 == arg2) {
+        return 1;
+    }
+    if (temps[arg1].state == TCG_TEMP_COPY) {
+        arg1 = temps[arg1].val;
+    }
+    if (temps[arg2].state == TCG_TEMP_COPY) {
+        arg2 = temps[arg2].val;
+    }
+    return arg1 == arg2 && temps[arg1].state == TCG_TEMP_HAS_COPY;
+}
+
+static inline int temp_is_const(TCGArg arg)
+{
+    return temps[arg].state == TCG_TEMP_CONST;
+}
+
+static int op_bits(TCGOpcode op)
+{
+    switch (op) {
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_mov_i64:
+    case INDEX_op_movi_i64:
+    case INDEX_op_setcond_i64:
+    case INDEX_op_brcond_i64:
+    case INDEX_op_add_i64:
+    case INDEX_op_sub_i64:
+    case INDEX_op_mul_i64:
+    case INDEX_op_and_i64:
+    case INDEX_op_or_i64:
+    case INDEX_op_xor_i64:
+    case INDEX_op_shl_i64:
+    case INDEX_op_shr_i64:
+    case INDEX_op_sar_i64:
+#ifdef TCG_TARGET_HAS_rot_i64
+    case INDEX_op_rotl_i64:
+    case INDEX_op_rotr_i64:
+#endif
+#ifdef TCG_TARGET_HAS_not_i64
+    case INDEX_op_not_i64:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+    case INDEX_op_neg_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i64
+    case INDEX_op_ext8s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i64
+    case INDEX_op_ext8u_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+    case INDEX_op_ext16s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i64
+    case INDEX_op_ext16u_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32s_i64
+    case INDEX_op_ext32s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32u_i64
+    case INDEX_op_ext32u_i64:
+#endif
+        return 64;
+#endif
+    default:
+        return 32;
+    }
+}
+
+static TCGOpcode op_to_mov(TCGOpcode op)
+{
+    return op_bits(op) == 32 ? INDEX_op_mov_i32 : INDEX_op_mov_i64;
+}
+
+static TCGOpcode op_to_movi(TCGOpcode op)
+{
+    return op_bits(op) == 32 ? INDEX_op_movi_i32 : INDEX_op_movi_i64;
+}
+
+static void tcg_opt_gen_mov(TCGArg *gen_args, TCGArg dst, TCGArg src,
+                            int nb_globals)
+{
+    reset_temp(dst, nb_globals);
+    if (src >= nb_globals) {
+        if (temps[src].state != TCG_TEMP_HAS_COPY) {
+            temps[src].state = TCG_TEMP_HAS_COPY;
+            temps[src].next_copy = src;
+            temps[src].prev_copy = src;
+        }
+        temps[dst].state = TCG_TEMP_COPY;
+        temps[dst].val = src;
+        temps[dst].next_copy = temps[src].next_copy;
+        temps[dst].prev_copy = src;
+        temps[temps[dst].next_copy].prev_copy = dst;
+        temps[src].next_copy = dst;
+    }
+    gen_args[0] = dst;
+    gen_args[1] = src;
+}
+
+static void tcg_opt_gen_movi(TCGArg *gen_args, TCGArg dst, TCGArg val,
+                             int nb_globals)
+{
+    reset_temp(dst, nb_globals);
+    temps[dst].state = TCG_TEMP_CONST;
+    temps[dst].val = val;
+    gen_args[0] = dst;
+    gen_args[1] = val;
+}
+
+/* Returns 0 if the op cannot be folded, e.g. for out of range shifts */
+static int do_constant_folding_2(TCGOpcode op, TCGArg x, TCGArg y,
+                                 TCGArg *res)
+{
+    switch (op) {
+    CASE_OP_32_64(add):
+        *res = x + y;
+        break;
+    CASE_OP_32_64(sub):
+        *res = x - y;
+        break;
+    CASE_OP_32_64(mul):
+        *res = x * y;
+        break;
+    CASE_OP_32_64(and):
+        *res = x & y;
+        break;
+    CASE_OP_32_64(or):
+        *res = x | y;
+        break;
+    CASE_OP_32_64(xor):
+        *res = x ^ y;
+        break;
+    case INDEX_op_shl_i32:
+        if ((uint32_t)y >= 32) {
+            return 0;
+        }
+        *res = (uint32_t)x << y;
+        break;
+    case INDEX_op_shr_i32:
+        if ((uint32_t)y >= 32) {
+            return 0;
+        }
+        *res = (uint32_t)x >> y;
+        break;
+    case INDEX_op_sar_i32:
+        if ((uint32_t)y >= 32) {
+            return 0;
+        }
+        *res = (int32_t)x >> y;
+        break;
+#ifdef TCG_TARGET_HAS_rot_i32
+    case INDEX_op_rotl_i32:
+    case INDEX_op_rotr_i32:
+        if ((uint32_t)y >= 32) {
+            return 0;
+        }
+        x = (uint32_t)x;
+        if (op == INDEX_op_rotr_i32) {
+            y = (32 - y) & 31;
+        }
+        *res = y ? (x << y) | (x >> (32 - y)) : x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_not_i32
+    case INDEX_op_not_i32:
+        *res = ~x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_neg_i32
+    case INDEX_op_neg_i32:
+        *res = -x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i32
+    case INDEX_op_ext8s_i32:
+        *res = (int8_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i32
+    case INDEX_op_ext8u_i32:
+        *res = (uint8_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i32
+    case INDEX_op_ext16s_i32:
+        *res = (int16_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i32
+    case INDEX_op_ext16u_i32:
+        *res = (uint16_t)x;
+        break;
+#endif
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_shl_i64:
+        if ((uint64_t)y >= 64) {
+            return 0;
+        }
+        *res = (uint64_t)x << y;
+        break;
+    case INDEX_op_shr_i64:
+        if ((uint64_t)y >= 64) {
+            return 0;
+        }
+        *res = (uint64_t)x >> y;
+        break;
+    case INDEX_op_sar_i64:
+        if ((uint64_t)y >= 64) {
+            return 0;
+        }
+        *res = (int64_t)x >> y;
+        break;
+#ifdef TCG_TARGET_HAS_rot_i64
+    case INDEX_op_rotl_i64:
+    case INDEX_op_rotr_i64:
+        if ((uint64_t)y >= 64) {
+            return 0;
+        }
+        if (op == INDEX_op_rotr_i64) {
+            y = (64 - y) & 63;
+        }
+        *res = y ? (x << y) | (x >> (64 - y)) : x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_not_i64
+    case INDEX_op_not_i64:
+        *res = ~x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+    case INDEX_op_neg_i64:
+        *res = -x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i64
+    case INDEX_op_ext8s_i64:
+        *res = (int8_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i64
+    case INDEX_op_ext8u_i64:
+        *res = (uint8_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+    case INDEX_op_ext16s_i64:
+        *res = (int16_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i64
+    case INDEX_op_ext16u_i64:
+        *res = (uint16_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext32s_i64
+    case INDEX_op_ext32s_i64:
+        *res = (int32_t)x;
+        break;
+#endif
+#ifdef TCG_TARGET_HAS_ext32u_i64
+    case INDEX_op_ext32u_i64:
+        *res = (uint32_t)x;
+        break;
+#endif
+#endif
+    default:
+        return 0;
+    }
+#if TCG_TARGET_REG_BITS == 64
+    if (op_bits(op) == 32) {
+        *res &= 0xffffffff;
+    }
+#endif
+    return 1;
+}
+
+static int do_constant_folding_cond(TCGOpcode op, TCGArg x, TCGArg y,
+                                    TCGCond c)
+{
+    if (op_bits(op) == 32) {
+        x = (uint32_t)x;
+        y = (uint32_t)y;
+        switch (c) {
+        case TCG_COND_LT:
+            return (int32_t)x < (int32_t)y;
+        case TCG_COND_GE:
+            return (int32_t)x >= (int32_t)y;
+        case TCG_COND_LE:
+            return (int32_t)x <= (int32_t)y;
+        case TCG_COND_GT:
+            return (int32_t)x > (int32_t)y;
+        default:
+            break;
+        }
+    } else {
+        switch (c) {
+        case TCG_COND_LT:
+            return (int64_t)x < (int64_t)y;
+        case TCG_COND_GE:
+            return (int64_t)x >= (int64_t)y;
+        case TCG_COND_LE:
+            return (int64_t)x <= (int64_t)y;
+        case TCG_COND_GT:
+            return (int64_t)x > (int64_t)y;
+        default:
+            break;
+        }
+    }
+    switch (c) {
+    case TCG_COND_EQ:
+        return x == y;
+    case TCG_COND_NE:
+        return x != y;
+    case TCG_COND_LTU:
+        return x < y;
+    case TCG_COND_GEU:
+        return x >= y;
+    case TCG_COND_LEU:
+        return x <= y;
+    case TCG_COND_GTU:
+        return x > y;
+    default:
+        tcg_abort();
+    }
+}
+
+/* Whether a constant is 0, in the width of op */
+static int const_is_zero(TCGOpcode op, TCGArg arg)
+{
+    if (!temp_is_const(arg)) {
+        return 0;
+    }
+    return op_bits(op) == 32 ? (uint32_t)temps[arg].val == 0
+                             : temps[arg].val == 0;
+}
+
+/* Optimize the ops of tcg_opc_ptr - gen_opc_buf ops and their parameters
+   at args; returns the new end of the parameters */
+TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
+                     TCGArg *args, TCGOpDef *tcg_op_defs)
+{
+    int i, nb_ops, op_index, nb_temps, nb_globals, nb_args, call_flags;
+    TCGOpcode op;
+    const TCGOpDef *def;
+    TCGArg *gen_args;
+    TCGArg tmp, res;
+
+    nb_temps = s->nb_temps;
+    nb_globals = s->nb_globals;
+    reset_all_temps(nb_temps);
+
+    nb_ops = tcg_opc_ptr - gen_opc_buf;
+    gen_args = args;
+    for (op_index = 0; op_index < nb_ops; op_index++) {
+        op = gen_opc_buf[op_index];
+        def = &tcg_op_defs[op];
+
+        /* Do copy propagation */
+        if (op != INDEX_op_call && op != INDEX_op_nopn) {
+            for (i = def->nb_oargs; i < def->nb_oargs + def->nb_iargs; i++) {
+                if (temps[args[i]].state == TCG_TEMP_COPY) {
+                    args[i] = temps[args[i]].val;
+                }
+            }
+        }
+
+        /* For commutative operations make the constant the second
+           argument */
+        switch (op) {
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(mul):
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+            if (temp_is_const(args[1]) && !temp_is_const(args[2])) {
+                tmp = args[1];
+                args[1] = args[2];
+                args[2] = tmp;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Simplify ops whose result does not depend on one input */
+        switch (op) {
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+        CASE_OP_32_64(shl):
+        CASE_OP_32_64(shr):
+        CASE_OP_32_64(sar):
+#ifdef TCG_TARGET_HAS_rot_i32
+        case INDEX_op_rotl_i32:
+        case INDEX_op_rotr_i32:
+#endif
+#if TCG_TARGET_REG_BITS == 64 && defined(TCG_TARGET_HAS_rot_i64)
+        case INDEX_op_rotl_i64:
+        case INDEX_op_rotr_i64:
+#endif
+            /* x op 0 => x */
+            if (!temp_is_const(args[1]) && const_is_zero(op, args[2])) {
+                goto do_mov;
+            }
+            break;
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(mul):
+            /* x op 0 => 0 */
+            if (const_is_zero(op, args[2])) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], 0, nb_globals);
+                args += 3;
+                gen_args += 2;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        switch (op) {
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(and):
+            /* x op x => x */
+            if (temps_are_copies(args[1], args[2])) {
+                goto do_mov;
+            }
+            break;
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(xor):
+            /* x op x => 0 */
+            if (temps_are_copies(args[1], args[2])) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], 0, nb_globals);
+                args += 3;
+                gen_args += 2;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Propagate constants and copies, fold constant expressions */
+        switch (op) {
+        CASE_OP_32_64(mov):
+            if (temps_are_copies(args[0], args[1])) {
+                gen_opc_buf[op_index] = INDEX_op_nop;
+                args += 2;
+                break;
+            }
+            if (temp_is_const(args[1])) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], temps[args[1]].val,
+                                 nb_globals);
+            } else {
+                tcg_opt_gen_mov(gen_args, args[0], args[1], nb_globals);
+            }
+            gen_args += 2;
+            args += 2;
+            break;
+        CASE_OP_32_64(movi):
+            tcg_opt_gen_movi(gen_args, args[0], args[1], nb_globals);
+            gen_args += 2;
+            args += 2;
+            break;
+#ifdef TCG_TARGET_HAS_not_i32
+        case INDEX_op_not_i32:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i32
+        case INDEX_op_neg_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i32
+        case INDEX_op_ext8s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i32
+        case INDEX_op_ext8u_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i32
+        case INDEX_op_ext16s_i32:
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i32
+        case INDEX_op_ext16u_i32:
+#endif
+#if TCG_TARGET_REG_BITS == 64
+#ifdef TCG_TARGET_HAS_not_i64
+        case INDEX_op_not_i64:
+#endif
+#ifdef TCG_TARGET_HAS_neg_i64
+        case INDEX_op_neg_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext8s_i64
+        case INDEX_op_ext8s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext8u_i64
+        case INDEX_op_ext8u_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16s_i64
+        case INDEX_op_ext16s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext16u_i64
+        case INDEX_op_ext16u_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32s_i64
+        case INDEX_op_ext32s_i64:
+#endif
+#ifdef TCG_TARGET_HAS_ext32u_i64
+        case INDEX_op_ext32u_i64:
+#endif
+#endif
+            if (temp_is_const(args[1]) &&
+                do_constant_folding_2(op, temps[args[1]].val, 0, &res)) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], res, nb_globals);
+            } else {
+                reset_temp(args[0], nb_globals);
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+            }
+            gen_args += 2;
+            args += 2;
+            break;
+        CASE_OP_32_64(add):
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(mul):
+        CASE_OP_32_64(and):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
+        CASE_OP_32_64(shl):
+        CASE_OP_32_64(shr):
+        CASE_OP_32_64(sar):
+#ifdef TCG_TARGET_HAS_rot_i32
+        case INDEX_op_rotl_i32:
+        case INDEX_op_rotr_i32:
+#endif
+#if TCG_TARGET_REG_BITS == 64 && defined(TCG_TARGET_HAS_rot_i64)
+        case INDEX_op_rotl_i64:
+        case INDEX_op_rotr_i64:
+#endif
+            if (temp_is_const(args[1]) && temp_is_const(args[2]) &&
+                do_constant_folding_2(op, temps[args[1]].val,
+                                      temps[args[2]].val, &res)) {
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], res, nb_globals);
+                gen_args += 2;
+            } else {
+                reset_temp(args[0], nb_globals);
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+                gen_args[2] = args[2];
+                gen_args += 3;
+            }
+            args += 3;
+            break;
+        CASE_OP_32_64(setcond):
+            if (temp_is_const(args[1]) && temp_is_const(args[2])) {
+                res = do_constant_folding_cond(op, temps[args[1]].val,
+                                               temps[args[2]].val, args[3]);
+                gen_opc_buf[op_index] = op_to_movi(op);
+                tcg_opt_gen_movi(gen_args, args[0], res, nb_globals);
+                gen_args += 2;
+            } else {
+                reset_temp(args[0], nb_globals);
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+                gen_args[2] = args[2];
+                gen_args[3] = args[3];
+                gen_args += 4;
+            }
+            args += 4;
+            break;
+        CASE_OP_32_64(brcond):
+            if (temp_is_const(args[0]) && temp_is_const(args[1])) {
+                if (do_constant_folding_cond(op, temps[args[0]].val,
+                                             temps[args[1]].val, args[2])) {
+                    gen_opc_buf[op_index] = INDEX_op_br;
+                    gen_args[0] = args[3];
+                    gen_args += 1;
+                } else {
+                    gen_opc_buf[op_index] = INDEX_op_nop;
+                }
+            } else {
+                gen_args[0] = args[0];
+                gen_args[1] = args[1];
+                gen_args[2] = args[2];
+                gen_args[3] = args[3];
+                gen_args += 4;
+            }
+            reset_all_temps(nb_temps);
+            args += 4;
+            break;
+        case INDEX_op_call:
+            nb_args = (args[0] >> 16) + (args[0] & 0xffff);
+            call_flags = args[nb_args + 1];
+            if (!(call_flags & (TCG_CALL_CONST | TCG_CALL_PURE))) {
+                reset_globals(nb_globals);
+            }
+            for (i = 0; i < (args[0] >> 16); i++) {
+                reset_temp(args[i + 1], nb_globals);
+            }
+            nb_args += 3;
+            for (i = 0; i < nb_args; i++) {
+                gen_args[i] = args[i];
+            }
+            args += nb_args;
+            gen_args += nb_args;
+            break;
+        case INDEX_op_set_label:
+        case INDEX_op_jmp:
+        case INDEX_op_br:
+            reset_all_temps(nb_temps);
+            for (i = 0; i < def->nb_args; i++) {
+                gen_args[i] = args[i];
+            }
+            args += def->nb_args;
+            gen_args += def->nb_args;
+            break;
+        case INDEX_op_nopn:
+            /* the parameters need not be kept */
+            gen_opc_buf[op_index] = INDEX_op_nop;
+            args += args[0];
+            break;
+        default:
+            /* Anything not handled above: the outputs are unknown, and
+               calls or the end of the basic block change more */
+            if (def->flags & TCG_OPF_BB_END) {
+                reset_all_temps(nb_temps);
+            } else {
+                for (i = 0; i < def->nb_oargs; i++) {
+                    reset_temp(args[i], nb_globals);
+                }
+                if (def->flags & TCG_OPF_CALL_CLOBBER) {
+                    reset_globals(nb_globals);
+                }
+            }
+            for (i = 0; i < def->nb_args; i++) {
+                gen_args[i] = args[i];
+            }
+            args += def->nb_args;
+            gen_args += def->nb_args;
+            break;
+        }
+        continue;
+
+    do_mov:
+        /* the result of the op is its first input */
+        if (temps_are_copies(args[0], args[1])) {
+            gen_opc_buf[op_index] = INDEX_op_nop;
+        } else if (temp_is_const(args[1])) {
+            gen_opc_buf[op_index] = op_to_movi(op);
+            tcg_opt_gen_movi(gen_args, args[0], temps[args[1]].val,
+                             nb_globals);
+            gen_args += 2;
+        } else {
+            gen_opc_buf[op_index] = op_to_mov(op);
+            tcg_opt_gen_mov(gen_args, args[0], args[1], nb_globals);
+            gen_args += 2;
+        }
+        args += 3;
+    }
+
+    return gen_args;
+}
@@ -156,6 +156,26 @@ int gen_new_label(void)
     return idx;
 }
 
+#ifdef TCG_TARGET_HAS_HOST_RELOCS
+static void tcg_host_reloc(TCGContext *s, int type, uint8_t *ptr,
+                           tcg_target_long value)
+{
+    TCGHostReloc *r;
+
+    if (s->nb_host_relocs < 0) {
+        return;
+    }
+    if (s->nb_host_relocs == TCG_MAX_HOST_RELOCS) {
+        s->nb_host_relocs = -1;
+        return;
+    }
+    r = &s->host_relocs[s->nb_host_relocs++];
+    r->offset = ptr - s->code_buf;
+    r->type = type;
+    r->value = value;
+}
+#endif
+
 #include "tcg-target.c"
 
 /* pool based memory allocation */
@@ -270,6 +290,7 @@ void tcg_func_start(TCGContext *s)
     s->labels = tcg_malloc(sizeof(TCGLabel) * TCG_MAX_LABELS);
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->nb_host_relocs = 0;
 
     gen_opc_ptr = gen_opc_buf;
     gen_opparam_ptr = gen_opparam_buf;
@@ -1955,14 +1976,18 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
 #ifdef CONFIG_PROFILER
 
 static int64_t tcg_table_op_count[NB_OPS];
+static int64_t tcg_table_op_count_before[NB_OPS];
 
+/* Ops generated by the front end, and ops left after the optimizer and
+   the liveness analysis */
 static void dump_op_count(void)
 {
     int i;
     FILE *f;
     f = fopen("/tmp/op.log", "w");
     for(i = INDEX_op_end; i < NB_OPS; i++) {
-        fprintf(f, "%s %" PRId64 "\n", tcg_op_defs[i].name, tcg_table_op_count[i]);
+        fprintf(f, "%s %" PRId64 " %" PRId64 "\n", tcg_op_defs[i].name,
+                tcg_table_op_count_before[i], tcg_table_op_count[i]);
     }
     fclose(f);
 }
@@ -1986,6 +2011,27 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     }
 #endif
 
+#ifdef CONFIG_PROFILER
+    {
+        uint16_t *opc_ptr;
+
+        for (opc_ptr = gen_opc_buf; opc_ptr < gen_opc_ptr; opc_ptr++) {
+            tcg_table_op_count_before[*opc_ptr]++;
+        }
+    }
+#endif
+
+    if (tcg_optimize_enabled) {
+#ifdef CONFIG_PROFILER
+        s->opt_time -= profile_getclock();
+#endif
+        gen_opparam_ptr = tcg_optimize(s, gen_opc_ptr, gen_opparam_buf,
+                                       tcg_op_defs);
+#ifdef CONFIG_PROFILER
+        s->opt_time += profile_getclock();
+#endif
+    }
+
 #ifdef CONFIG_PROFILER
     s->la_time -= profile_getclock();
 #endif
@@ -2158,6 +2204,8 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 (double)s->interm_time / tot * 100.0);
     cpu_fprintf(f, "  gen_code time     %0.1f%%\n", 
                 (double)s->code_time / tot * 100.0);
+    cpu_fprintf(f, "optim./code time    %0.1f%%\n",
+                (double)s->opt_time / (s->code_time ? s->code_time : 1) * 100.0);
     cpu_fprintf(f, "liveness/code time  %0.1f%%\n", 
                 (double)s->la_time / (s->code_time ? s->code_time : 1) * 100.0);
     cpu_fprintf(f, "cpu_restore count   %" PRId64 "\n",
@@ -91,6 +91,7 @@ typedef struct TCGPool {
 #define TCG_MAX_LABELS 512
 
 #define TCG_MAX_TEMPS 512
+#define TCG_MAX_HOST_RELOCS 64
 
 /* when the size of the arguments of a called function is smaller than
    this value, they are statically allocated in the TB stack frame */
@@ -268,6 +269,21 @@ typedef struct TCGHelperInfo {
 
 typedef struct TCGContext TCGContext;
 
+/* References from generated code to host addresses outside of it, which
+   have to be fixed up when the code is copied to another address */
+enum {
+    TCG_HOST_RELOC_PCREL32,     /* 32-bit displacement to value */
+    TCG_HOST_RELOC_IMM32U,      /* 32-bit immediate, zero-extended */
+    TCG_HOST_RELOC_IMM32S,      /* 32-bit immediate, sign-extended */
+    TCG_HOST_RELOC_IMM64,       /* 64-bit immediate */
+};
+
+typedef struct TCGHostReloc {
+    uint32_t offset;            /* from the start of the code */
+    uint32_t type;
+    tcg_target_long value;
+} TCGHostReloc;
+
 struct TCGContext {
     uint8_t *pool_cur, *pool_end;
     TCGPool *pool_first, *pool_current;
@@ -285,6 +301,11 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* host references of the last generated code, -1 if it has some
+       that cannot be fixed up (TCG_TARGET_HAS_HOST_RELOCS only) */
+    TCGHostReloc host_relocs[TCG_MAX_HOST_RELOCS];
+    int nb_host_relocs;
+
     /* liveness analysis */
     uint16_t *op_dead_iargs; /* for each operation, each bit tells if the
                                 corresponding input argument is dead */
@@ -319,6 +340,7 @@ struct TCGContext {
     int64_t code_out_len;
     int64_t interm_time;
     int64_t code_time;
+    int64_t opt_time;
     int64_t la_time;
     int64_t restore_count;
     int64_t restore_time;
@@ -441,6 +463,9 @@ do {\
 
 void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 
+TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
+                     TCGOpDef *tcg_op_defs);
+
 #if TCG_TARGET_REG_BITS == 32
 #define tcg_const_ptr tcg_const_i32
 #define tcg_add_ptr tcg_add_i32
@@ -28,7 +28,7 @@
 #include "cpu.h"
 #include "exec-all.h"
 #include "disas.h"
-#include "tcg.h"
+#include "tcg-op.h"
 #include "qemu-timer.h"
 
 /* code generation context */
@@ -48,6 +48,19 @@ void cpu_gen_init(void)
                   CPU_TEMP_BUF_NLONGS * sizeof(long));
 }
 
+/* count the executions of the TB ahead of its guest code */
+static void gen_tb_profile(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_ptr((tcg_target_long)&tb->exec_count);
+    TCGv_i64 count = tcg_temp_new_i64();
+
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+}
+
 /* return non zero if the very first instruction is invalid so that
    the virtual CPU can trigger an exception.
 
@@ -70,6 +83,9 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
     tcg_func_start(s);
 
+    if (tb_profile_enabled) {
+        gen_tb_profile(tb);
+    }
     gen_intermediate_code(env, tb);
 
     /* generate machine code */
@@ -127,6 +143,9 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     tcg_func_start(s);
 
+    if (tb_profile_enabled) {
+        gen_tb_profile(tb);
+    }
     gen_intermediate_code_pc(env, tb);
 
     if (use_icount) {
@@ -42,6 +42,10 @@ int qemu_spice_migrate_info(const char *hostname, int port, int tls_port,
 void do_info_spice_print(Monitor *mon, const QObject *data);
 void do_info_spice(Monitor *mon, QObject **ret_data);
 
+/* hw/qxl.c */
+void do_info_qxl_print(Monitor *mon, const QObject *data);
+void do_info_qxl(Monitor *mon, QObject **ret_data);
+
 CharDriverState *qemu_chr_open_spice(QemuOpts *opts);
 
 #else  /* CONFIG_SPICE */
@@ -27,6 +27,9 @@
 
 #include <SDL.h>
 #include <SDL_syswm.h>
+#ifdef CONFIG_SDL_GL
+#include <SDL_opengl.h>
+#endif
 
 #ifndef _WIN32
 #include <signal.h>
@@ -63,6 +66,246 @@ static SDL_PixelFormat host_format;
 static int scaling_active = 0;
 static Notifier mouse_mode_notifier;
 
+#ifdef CONFIG_SDL_GL
+/* OpenGL output: the guest surface lives in system memory and is uploaded
+ * into a texture once per refresh, covering only the rows and columns
+ * touched since the last frame.  The GPU does the pixel format conversion
+ * (through the format/type of the upload) and the scaling to the window
+ * size (a linearly filtered textured quad), so resizing the window costs
+ * nothing on the CPU.  When the driver has pixel buffer objects, the dirty
+ * box is staged through an orphaned PBO so that glTexSubImage2D returns
+ * without waiting for the transfer. */
+static int gl_active;
+static GLuint gl_texture;
+static int gl_tex_w, gl_tex_h;        /* texture size, power of two */
+static int gl_surf_w, gl_surf_h;      /* guest size the texture holds */
+static GLenum gl_format, gl_type;
+static int gl_bytes_pp;
+static SDL_Surface *gl_convert;       /* staging for formats GL can't take */
+static int gl_dirty_x1, gl_dirty_y1, gl_dirty_x2, gl_dirty_y2;
+static int gl_redraw;
+
+static GLuint gl_pbo;
+static void (APIENTRY *gl_gen_buffers)(GLsizei, GLuint *);
+static void (APIENTRY *gl_delete_buffers)(GLsizei, const GLuint *);
+static void (APIENTRY *gl_bind_buffer)(GLenum, GLuint);
+static void (APIENTRY *gl_buffer_data)(GLenum, GLsizeiptrARB, const GLvoid *,
+                                       GLenum);
+static GLvoid *(APIENTRY *gl_map_buffer)(GLenum, GLenum);
+static GLboolean (APIENTRY *gl_unmap_buffer)(GLenum);
+
+static void sdl_gl_dirty(int x, int y, int w, int h)
+{
+    if (gl_dirty_x1 >= gl_dirty_x2) {
+        gl_dirty_x1 = x;
+        gl_dirty_y1 = y;
+        gl_dirty_x2 = x + w;
+        gl_dirty_y2 = y + h;
+        return;
+    }
+    gl_dirty_x1 = MIN(gl_dirty_x1, x);
+    gl_dirty_y1 = MIN(gl_dirty_y1, y);
+    gl_dirty_x2 = MAX(gl_dirty_x2, x + w);
+    gl_dirty_y2 = MAX(gl_dirty_y2, y + h);
+}
+
+static void sdl_gl_init_pbo(void)
+{
+    const char *ext = (const char *)glGetString(GL_EXTENSIONS);
+
+    gl_pbo = 0;
+    if (!ext || !strstr(ext, "GL_ARB_pixel_buffer_object")) {
+        return;
+    }
+    gl_gen_buffers = SDL_GL_GetProcAddress("glGenBuffersARB");
+    gl_delete_buffers = SDL_GL_GetProcAddress("glDeleteBuffersARB");
+    gl_bind_buffer = SDL_GL_GetProcAddress("glBindBufferARB");
+    gl_buffer_data = SDL_GL_GetProcAddress("glBufferDataARB");
+    gl_map_buffer = SDL_GL_GetProcAddress("glMapBufferARB");
+    gl_unmap_buffer = SDL_GL_GetProcAddress("glUnmapBufferARB");
+    if (!gl_gen_buffers || !gl_delete_buffers || !gl_bind_buffer ||
+        !gl_buffer_data || !gl_map_buffer || !gl_unmap_buffer) {
+        return;
+    }
+    gl_gen_buffers(1, &gl_pbo);
+}
+
+/* Called after every SDL_SetVideoMode: on some platforms that creates a
+ * fresh context, so the texture and PBO are rebuilt from scratch. */
+static void sdl_gl_init_context(void)
+{
+    glViewport(0, 0, real_screen->w, real_screen->h);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, 1, 1, 0, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glEnable(GL_TEXTURE_2D);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    glGenTextures(1, &gl_texture);
+    glBindTexture(GL_TEXTURE_2D, gl_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gl_tex_w = gl_tex_h = 0;
+    gl_surf_w = gl_surf_h = 0;
+
+    sdl_gl_init_pbo();
+}
+
+/* Pick the upload format/type matching the guest surface so the GPU does
+ * the conversion; anything else goes through a 32 bpp staging surface. */
+static void sdl_gl_setup_format(DisplayState *ds)
+{
+    PixelFormat *pf = &ds->surface->pf;
+
+    if (gl_convert) {
+        SDL_FreeSurface(gl_convert);
+        gl_convert = NULL;
+    }
+    gl_format = GL_BGRA;
+    gl_type = GL_UNSIGNED_INT_8_8_8_8_REV;
+    gl_bytes_pp = 4;
+    if (ds_get_bits_per_pixel(ds) == 32 && pf->rshift == 16 &&
+        pf->gshift == 8 && pf->bshift == 0) {
+        return;
+    }
+    if (ds_get_bits_per_pixel(ds) == 32 && pf->rshift == 0 &&
+        pf->gshift == 8 && pf->bshift == 16) {
+        gl_format = GL_RGBA;
+        return;
+    }
+    if (ds_get_bits_per_pixel(ds) == 16 && pf->rshift == 11) {
+        gl_format = GL_RGB;
+        gl_type = GL_UNSIGNED_SHORT_5_6_5;
+        gl_bytes_pp = 2;
+        return;
+    }
+    if (ds_get_bits_per_pixel(ds) == 16 && pf->rshift == 10) {
+        gl_type = GL_UNSIGNED_SHORT_1_5_5_5_REV;
+        gl_bytes_pp = 2;
+        return;
+    }
+    if (ds_get_bits_per_pixel(ds) == 24 && pf->rshift == 16) {
+        gl_format = GL_BGR;
+        gl_type = GL_UNSIGNED_BYTE;
+        gl_bytes_pp = 3;
+        return;
+    }
+    gl_convert = SDL_CreateRGBSurface(SDL_SWSURFACE, ds_get_width(ds),
+                                      ds_get_height(ds), 32, 0x00ff0000,
+                                      0x0000ff00, 0x000000ff, 0);
+}
+
+static void sdl_gl_resize(DisplayState *ds)
+{
+    int w = ds_get_width(ds), h = ds_get_height(ds);
+    int tw = 1, th = 1;
+
+    sdl_gl_setup_format(ds);
+    while (tw < w) {
+        tw <<= 1;
+    }
+    while (th < h) {
+        th <<= 1;
+    }
+    glBindTexture(GL_TEXTURE_2D, gl_texture);
+    if (tw != gl_tex_w || th != gl_tex_h) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, tw, th, 0, GL_BGRA,
+                     GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+        gl_tex_w = tw;
+        gl_tex_h = th;
+    }
+    if (gl_pbo) {
+        gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, gl_pbo);
+        gl_buffer_data(GL_PIXEL_UNPACK_BUFFER_ARB, w * h * gl_bytes_pp, NULL,
+                       GL_STREAM_DRAW_ARB);
+        gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+    }
+    gl_surf_w = w;
+    gl_surf_h = h;
+    gl_dirty_x1 = gl_dirty_x2 = 0;
+    sdl_gl_dirty(0, 0, w, h);
+}
+
+static void sdl_gl_upload(DisplayState *ds)
+{
+    int x = gl_dirty_x1, y = gl_dirty_y1;
+    int w = MIN(gl_dirty_x2, gl_surf_w) - x;
+    int h = MIN(gl_dirty_y2, gl_surf_h) - y;
+    int linesize = ds_get_linesize(ds);
+    uint8_t *src = ds_get_data(ds);
+    uint8_t *dst;
+    int i;
+
+    gl_dirty_x1 = gl_dirty_x2 = 0;
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+    if (gl_convert) {
+        SDL_Rect rec = { x, y, w, h };
+        SDL_BlitSurface(guest_screen, &rec, gl_convert, &rec);
+        src = gl_convert->pixels;
+        linesize = gl_convert->pitch;
+    }
+    src += y * linesize + x * gl_bytes_pp;
+
+    glBindTexture(GL_TEXTURE_2D, gl_texture);
+    if (gl_pbo) {
+        gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, gl_pbo);
+        /* Orphan the previous contents so mapping doesn't stall on a
+         * transfer still in flight. */
+        gl_buffer_data(GL_PIXEL_UNPACK_BUFFER_ARB,
+                       gl_surf_w * gl_surf_h * gl_bytes_pp, NULL,
+                       GL_STREAM_DRAW_ARB);
+        dst = gl_map_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+        if (dst) {
+            for (i = 0; i < h; i++) {
+                memcpy(dst + i * w * gl_bytes_pp, src + i * linesize,
+                       w * gl_bytes_pp);
+            }
+            gl_unmap_buffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, gl_format, gl_type,
+                            NULL);
+            gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+            return;
+        }
+        gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize / gl_bytes_pp);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, gl_format, gl_type, src);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+static void sdl_gl_draw(DisplayState *ds)
+{
+    GLfloat s, t;
+
+    if (!gl_redraw && gl_dirty_x1 >= gl_dirty_x2) {
+        return;
+    }
+    gl_redraw = 0;
+    if (gl_surf_w != ds_get_width(ds) || gl_surf_h != ds_get_height(ds)) {
+        sdl_gl_resize(ds);
+    }
+    sdl_gl_upload(ds);
+
+    s = (GLfloat)gl_surf_w / gl_tex_w;
+    t = (GLfloat)gl_surf_h / gl_tex_h;
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0); glVertex2f(0, 0);
+    glTexCoord2f(s, 0); glVertex2f(1, 0);
+    glTexCoord2f(s, t); glVertex2f(1, 1);
+    glTexCoord2f(0, t); glVertex2f(0, 1);
+    glEnd();
+    SDL_GL_SwapBuffers();
+}
+#endif
+
 static void sdl_update(DisplayState *ds, int x, int y, int w, int h)
 {
     //    printf("updating x=%d y=%d w=%d h=%d\n", x, y, w, h);
@@ -72,6 +315,12 @@ static void sdl_update(DisplayState *ds, int x, int y, int w, int h)
     rec.w = w;
     rec.h = h;
 
+#ifdef CONFIG_SDL_GL
+    if (gl_active) {
+        sdl_gl_dirty(x, y, w, h);
+        return;
+    }
+#endif
     if (guest_screen) {
         if (!scaling_active) {
             SDL_BlitSurface(guest_screen, &rec, real_screen, &rec);
@@ -102,6 +351,13 @@ static void do_sdl_resize(int new_width, int new_height, int bpp)
     //    printf("resizing to %d %d\n", w, h);
 
     flags = SDL_HWSURFACE|SDL_ASYNCBLIT|SDL_HWACCEL|SDL_RESIZABLE;
+#ifdef CONFIG_SDL_GL
+    if (gl_active) {
+        flags = SDL_OPENGL|SDL_RESIZABLE;
+        SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+        bpp = 0;
+    }
+#endif
     if (gui_fullscreen)
         flags |= SDL_FULLSCREEN;
     if (gui_noframe)
@@ -115,10 +371,29 @@ static void do_sdl_resize(int new_width, int new_height, int bpp)
 		height, bpp, SDL_GetError());
         exit(1);
     }
+#ifdef CONFIG_SDL_GL
+    if (gl_active) {
+        sdl_gl_init_context();
+        gl_redraw = 1;
+    }
+#endif
 }
 
 static void sdl_resize(DisplayState *ds)
 {
+#ifdef CONFIG_SDL_GL
+    if (gl_active) {
+        /* The window keeps its size once the user has scaled it; the
+         * texture follows the guest either way. */
+        if (!scaling_active) {
+            do_sdl_resize(ds_get_width(ds), ds_get_height(ds), 0);
+        }
+        sdl_setdata(ds);
+        sdl_gl_resize(ds);
+        gl_redraw = 1;
+        return;
+    }
+#endif
     if  (!allocator) {
         if (!scaling_active)
             do_sdl_resize(ds_get_width(ds), ds_get_height(ds), 0);
@@ -176,7 +451,21 @@ static DisplaySurface* sdl_create_displaysurface(int width, int height)
 
     surface->width = width;
     surface->height = height;
-    
+
+#ifdef CONFIG_SDL_GL
+    if (gl_active) {
+        /* Keep the guest in system memory in a layout GL uploads as is. */
+        surface->linesize = width * 4;
+        surface->pf = qemu_default_pixelformat(32);
+#ifdef HOST_WORDS_BIGENDIAN
+        surface->flags = QEMU_ALLOCATED_FLAG | QEMU_BIG_ENDIAN_FLAG;
+#else
+        surface->flags = QEMU_ALLOCATED_FLAG;
+#endif
+        surface->data = (uint8_t*) qemu_mallocz(surface->linesize * surface->height);
+        return surface;
+    }
+#endif
     if (scaling_active) {
         if (host_format.BytesPerPixel != 2 && host_format.BytesPerPixel != 4) {
             surface->linesize = width * 4;
@@ -564,6 +853,12 @@ static void sdl_refresh(DisplayState *ds)
     while (SDL_PollEvent(ev)) {
         switch (ev->type) {
         case SDL_VIDEOEXPOSE:
+#ifdef CONFIG_SDL_GL
+            if (gl_active) {
+                gl_redraw = 1;
+                break;
+            }
+#endif
             sdl_update(ds, 0, 0, real_screen->w, real_screen->h);
             break;
         case SDL_KEYDOWN:
@@ -740,6 +1035,15 @@ static void sdl_refresh(DisplayState *ds)
         {
 	    SDL_ResizeEvent *rev = &ev->resize;
             int bpp = real_screen->format->BitsPerPixel;
+#ifdef CONFIG_SDL_GL
+            if (gl_active) {
+                /* Scaling is just a different viewport for the quad. */
+                do_sdl_resize(rev->w, rev->h, 0);
+                scaling_active = 1;
+                vga_hw_invalidate();
+                break;
+            }
+#endif
             if (bpp != 16 && bpp != 32)
                 bpp = 32;
             do_sdl_resize(rev->w, rev->h, bpp);
@@ -756,11 +1060,23 @@ static void sdl_refresh(DisplayState *ds)
             break;
         }
     }
+#ifdef CONFIG_SDL_GL
+    if (gl_active) {
+        sdl_gl_draw(ds);
+    }
+#endif
 }
 
 static void sdl_fill(DisplayState *ds, int x, int y, int w, int h, uint32_t c)
 {
     SDL_Rect dst = { x, y, w, h };
+#ifdef CONFIG_SDL_GL
+    if (gl_active) {
+        SDL_FillRect(guest_screen, &dst, c);
+        sdl_gl_dirty(x, y, w, h);
+        return;
+    }
+#endif
     SDL_FillRect(real_screen, &dst, c);
 }
 
@@ -847,6 +1163,13 @@ void sdl_display_init(DisplayState *ds, int full_screen, int no_frame)
     }
     vi = SDL_GetVideoInfo();
     host_format = *(vi->vfmt);
+#ifdef CONFIG_SDL_GL
+    gl_active = sdl_opengl;
+#else
+    if (sdl_opengl) {
+        fprintf(stderr, "-sdl-gl: OpenGL output not compiled in, ignoring\n");
+    }
+#endif
 
     dcl = qemu_mallocz(sizeof(DisplayChangeListener));
     dcl->dpy_update = sdl_update;
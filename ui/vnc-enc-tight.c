@@ -38,7 +38,12 @@
 
 #include "qemu-common.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "bswap.h"
+#include "host-utils.h"
 #include "qint.h"
 #include "vnc.h"
 #include "vnc-enc-tight.h"
@@ -310,6 +315,51 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
     return (errors < tight_conf[compression].gradient_threshold);
 }
 
+/*
+ * Return the index of the first pixel at or after i that differs from c,
+ * or count if the run goes to the end.  Compares 16 bytes at a time when
+ * SSE2 is available.
+ */
+#ifdef __SSE2__
+#define DEFINE_SKIP_RUN_FUNCTION(bpp)                                   \
+                                                                        \
+    static inline size_t                                                \
+    tight_skip_run##bpp(const uint##bpp##_t *data, size_t i,            \
+                        size_t count, uint##bpp##_t c) {                \
+        const size_t step = 16 / sizeof(uint##bpp##_t);                 \
+        __m128i vc = _mm_set1_epi##bpp(c);                              \
+        int mask;                                                       \
+                                                                        \
+        for (; i + step <= count; i += step) {                          \
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));   \
+                                                                        \
+            mask = _mm_movemask_epi8(_mm_cmpeq_epi##bpp(v, vc));        \
+            if (mask != 0xFFFF) {                                       \
+                return i + ctz32(~mask) / sizeof(uint##bpp##_t);        \
+            }                                                           \
+        }                                                               \
+        while (i < count && data[i] == c) {                             \
+            i++;                                                        \
+        }                                                               \
+        return i;                                                       \
+    }
+#else
+#define DEFINE_SKIP_RUN_FUNCTION(bpp)                                   \
+                                                                        \
+    static inline size_t                                                \
+    tight_skip_run##bpp(const uint##bpp##_t *data, size_t i,            \
+                        size_t count, uint##bpp##_t c) {                \
+        while (i < count && data[i] == c) {                             \
+            i++;                                                        \
+        }                                                               \
+        return i;                                                       \
+    }
+#endif
+
+DEFINE_SKIP_RUN_FUNCTION(8)
+DEFINE_SKIP_RUN_FUNCTION(16)
+DEFINE_SKIP_RUN_FUNCTION(32)
+
 /*
  * Code to determine how many different colors used in rectangle.
  */
@@ -322,14 +372,12 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
                             VncPalette **palette) {                     \
         uint##bpp##_t *data;                                            \
         uint##bpp##_t c0, c1, ci;                                       \
-        int i, n0, n1;                                                  \
+        size_t i, j, n0, n1;                                            \
                                                                         \
         data = (uint##bpp##_t *)vs->tight.tight.buffer;                 \
                                                                         \
         c0 = data[0];                                                   \
-        i = 1;                                                          \
-        while (i < count && data[i] == c0)                              \
-            i++;                                                        \
+        i = tight_skip_run##bpp(data, 1, count, c0);                    \
         if (i >= count) {                                               \
             *bg = *fg = c0;                                             \
             return 1;                                                   \
@@ -342,12 +390,14 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
         n0 = i;                                                         \
         c1 = data[i];                                                   \
         n1 = 0;                                                         \
-        for (i++; i < count; i++) {                                     \
+        for (i++; i < count; i = j) {                                   \
             ci = data[i];                                               \
             if (ci == c0) {                                             \
-                n0++;                                                   \
+                j = tight_skip_run##bpp(data, i + 1, count, c0);        \
+                n0 += j - i;                                            \
             } else if (ci == c1) {                                      \
-                n1++;                                                   \
+                j = tight_skip_run##bpp(data, i + 1, count, c1);        \
+                n1 += j - i;                                            \
             } else                                                      \
                 break;                                                  \
         }                                                               \
@@ -366,20 +416,23 @@ tight_detect_smooth_image(VncState *vs, int w, int h)
             return 0;                                                   \
         }                                                               \
                                                                         \
-        *palette = palette_new(max, bpp);                               \
+        if (!vs->tight.palette) {                                       \
+            vs->tight.palette = palette_new(max, bpp);                  \
+        } else {                                                        \
+            palette_init(vs->tight.palette, max, bpp);                  \
+        }                                                               \
+        *palette = vs->tight.palette;                                   \
         palette_put(*palette, c0);                                      \
         palette_put(*palette, c1);                                      \
         palette_put(*palette, ci);                                      \
                                                                         \
-        for (i++; i < count; i++) {                                     \
-            if (data[i] == ci) {                                        \
-                continue;                                               \
-            } else {                                                    \
-                ci = data[i];                                           \
-                if (!palette_put(*palette, (uint32_t)ci)) {             \
-                    return 0;                                           \
-                }                                                       \
+        i = tight_skip_run##bpp(data, i + 1, count, ci);                \
+        while (i < count) {                                             \
+            ci = data[i];                                               \
+            if (!palette_put(*palette, (uint32_t)ci)) {                 \
+                return 0;                                               \
             }                                                           \
+            i = tight_skip_run##bpp(data, i + 1, count, ci);            \
         }                                                               \
                                                                         \
         return palette_size(*palette);                                  \
@@ -426,18 +479,15 @@ static int tight_fill_palette(VncState *vs, int x, int y,
                                    VncPalette *palette) {               \
         uint##bpp##_t *src;                                             \
         uint##bpp##_t rgb;                                              \
-        int i, rep;                                                     \
+        size_t i, j;                                                    \
         uint8_t idx;                                                    \
                                                                         \
         src = (uint##bpp##_t *) buf;                                    \
                                                                         \
-        for (i = 0; i < count; i++) {                                   \
-                                                                        \
-            rgb = *src++;                                               \
-            rep = 0;                                                    \
-            while (i < count && *src == rgb) {                          \
-                rep++, src++, i++;                                      \
-            }                                                           \
+        /* Indices are written behind the pixels still to be read */    \
+        for (i = 0; i < count; i = j) {                                 \
+            rgb = src[i];                                               \
+            j = tight_skip_run##bpp(src, i + 1, count, rgb);            \
             idx = palette_idx(palette, rgb);                            \
             /*                                                          \
              * Should never happen, but don't break everything          \
@@ -446,10 +496,7 @@ static int tight_fill_palette(VncState *vs, int x, int y,
             if (idx == (uint8_t)-1) {                                   \
                 idx = 0;                                                \
             }                                                           \
-            while (rep >= 0) {                                          \
-                *buf++ = idx;                                           \
-                rep--;                                                  \
-            }                                                           \
+            memset(buf + i, idx, j - i);                                \
         }                                                               \
     }
 
@@ -511,25 +558,96 @@ DEFINE_MONO_ENCODE_FUNCTION(8)
 DEFINE_MONO_ENCODE_FUNCTION(16)
 DEFINE_MONO_ENCODE_FUNCTION(32)
 
+/*
+ * Pack 32-bit pixels into 3 bytes each, in place if dst == src.  On
+ * little-endian hosts four pixels are assembled into three words so the
+ * row is written with word stores instead of byte stores.
+ */
+static inline uint32_t tight_rgb24(uint32_t pix, int rshift, int gshift,
+                                   int bshift)
+{
+    return (pix >> rshift & 0xFF) | (pix >> gshift & 0xFF) << 8 |
+        (pix >> bshift & 0xFF) << 16;
+}
+
+static void tight_pack24_row(uint8_t *dst, const uint32_t *src, size_t count,
+                             int rshift, int gshift, int bshift)
+{
+    uint32_t pix;
+
+#ifndef HOST_WORDS_BIGENDIAN
+    while (count >= 4) {
+        uint32_t t0, t1, t2, t3, words[3];
+
+        t0 = tight_rgb24(src[0], rshift, gshift, bshift);
+        t1 = tight_rgb24(src[1], rshift, gshift, bshift);
+        t2 = tight_rgb24(src[2], rshift, gshift, bshift);
+        t3 = tight_rgb24(src[3], rshift, gshift, bshift);
+        words[0] = t0 | t1 << 24;
+        words[1] = t1 >> 8 | t2 << 16;
+        words[2] = t2 >> 16 | t3 << 8;
+        memcpy(dst, words, sizeof(words));
+        src += 4;
+        dst += 12;
+        count -= 4;
+    }
+#endif
+    while (count--) {
+        pix = *src++;
+        *dst++ = (uint8_t)(pix >> rshift);
+        *dst++ = (uint8_t)(pix >> gshift);
+        *dst++ = (uint8_t)(pix >> bshift);
+    }
+}
+
+/*
+ * Gradient prediction for one pixel, done bytewise on all four bytes.
+ */
+static inline uint32_t tight_gradient_pixel(uint32_t here, uint32_t left,
+                                            uint32_t upper,
+                                            uint32_t upperleft)
+{
+    uint32_t diff = 0;
+    int prediction;
+    int i;
+
+    for (i = 0; i < 32; i += 8) {
+        prediction = (int)(left >> i & 0xFF) + (int)(upper >> i & 0xFF) -
+            (int)(upperleft >> i & 0xFF);
+        if (prediction < 0) {
+            prediction = 0;
+        } else if (prediction > 0xFF) {
+            prediction = 0xFF;
+        }
+        diff |= (((here >> i) - prediction) & 0xFF) << i;
+    }
+    return diff;
+}
+
 /*
  * ``Gradient'' filter for 24-bit color samples.
  * Should be called only when redMax, greenMax and blueMax are 255.
- * Color components assumed to be byte-aligned.
+ *
+ * The gradient buffer holds the previous and current rows, each preceded
+ * by a zero pixel for the left edge, and the filtered row.  The current
+ * row is copied out before the in-place output overwrites it.
  */
 
 static void
 tight_filter_gradient24(VncState *vs, uint8_t *buf, int w, int h)
 {
-    uint32_t *buf32;
-    uint32_t pix32;
+    uint32_t *buf32, *prev, *cur, *diff, *tmp;
+    uint32_t pix;
     int shift[3];
-    int *prev;
-    int here[3], upper[3], left[3], upperleft[3];
-    int prediction;
-    int x, y, c;
+    bool aligned;
+    int x, y;
 
     buf32 = (uint32_t *)buf;
-    memset(vs->tight.gradient.buffer, 0, w * 3 * sizeof(int));
+    prev = (uint32_t *)vs->tight.gradient.buffer;
+    cur = prev + w + 1;
+    diff = cur + w + 1;
+    memset(prev, 0, (w + 1) * sizeof(uint32_t));
+    cur[0] = 0;
 
     if ((vs->clientds.flags & QEMU_BIG_ENDIAN_FLAG) ==
         (vs->ds->surface->flags & QEMU_BIG_ENDIAN_FLAG)) {
@@ -542,30 +660,56 @@ tight_filter_gradient24(VncState *vs, uint8_t *buf, int w, int h)
         shift[2] = 24 - vs->clientds.pf.bshift;
     }
 
+    /* Components that straddle bytes are moved to bytes 2, 1 and 0 */
+    aligned = !((shift[0] | shift[1] | shift[2]) & 7);
+
     for (y = 0; y < h; y++) {
-        for (c = 0; c < 3; c++) {
-            upper[c] = 0;
-            here[c] = 0;
-        }
-        prev = (int *)vs->tight.gradient.buffer;
-        for (x = 0; x < w; x++) {
-            pix32 = *buf32++;
-            for (c = 0; c < 3; c++) {
-                upperleft[c] = upper[c];
-                left[c] = here[c];
-                upper[c] = *prev;
-                here[c] = (int)(pix32 >> shift[c] & 0xFF);
-                *prev++ = here[c];
-
-                prediction = left[c] + upper[c] - upperleft[c];
-                if (prediction < 0) {
-                    prediction = 0;
-                } else if (prediction > 0xFF) {
-                    prediction = 0xFF;
-                }
-                *buf++ = (char)(here[c] - prediction);
+        if (aligned) {
+            memcpy(cur + 1, buf32, w * sizeof(uint32_t));
+        } else {
+            for (x = 0; x < w; x++) {
+                pix = buf32[x];
+                cur[x + 1] = tight_rgb24(pix, shift[2], shift[1], shift[0]);
             }
         }
+        buf32 += w;
+
+        x = 0;
+#ifdef __SSE2__
+        for (; x + 4 <= w; x += 4) {
+            __m128i zero = _mm_setzero_si128();
+            __m128i here = _mm_loadu_si128((__m128i *)(cur + x + 1));
+            __m128i left = _mm_loadu_si128((__m128i *)(cur + x));
+            __m128i upper = _mm_loadu_si128((__m128i *)(prev + x + 1));
+            __m128i upperleft = _mm_loadu_si128((__m128i *)(prev + x));
+            __m128i lo, hi;
+
+            lo = _mm_sub_epi16(_mm_add_epi16(_mm_unpacklo_epi8(left, zero),
+                                             _mm_unpacklo_epi8(upper, zero)),
+                               _mm_unpacklo_epi8(upperleft, zero));
+            hi = _mm_sub_epi16(_mm_add_epi16(_mm_unpackhi_epi8(left, zero),
+                                             _mm_unpackhi_epi8(upper, zero)),
+                               _mm_unpackhi_epi8(upperleft, zero));
+            /* packus clamps the prediction to 0..255 */
+            _mm_storeu_si128((__m128i *)(diff + x),
+                             _mm_sub_epi8(here, _mm_packus_epi16(lo, hi)));
+        }
+#endif
+        for (; x < w; x++) {
+            diff[x] = tight_gradient_pixel(cur[x + 1], cur[x],
+                                           prev[x + 1], prev[x]);
+        }
+
+        if (aligned) {
+            tight_pack24_row(buf, diff, w, shift[0], shift[1], shift[2]);
+        } else {
+            tight_pack24_row(buf, diff, w, 16, 8, 0);
+        }
+        buf += w * 3;
+
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
     }
 }
 
@@ -873,12 +1017,8 @@ static int tight_compress_data(VncState *vs, int stream_id, size_t bytes,
  */
 static void tight_pack24(VncState *vs, uint8_t *buf, size_t count, size_t *ret)
 {
-    uint32_t *buf32;
-    uint32_t pix;
     int rshift, gshift, bshift;
 
-    buf32 = (uint32_t *)buf;
-
     if ((vs->clientds.flags & QEMU_BIG_ENDIAN_FLAG) ==
         (vs->ds->surface->flags & QEMU_BIG_ENDIAN_FLAG)) {
         rshift = vs->clientds.pf.rshift;
@@ -894,12 +1034,7 @@ static void tight_pack24(VncState *vs, uint8_t *buf, size_t count, size_t *ret)
         *ret = count * 3;
     }
 
-    while (count--) {
-        pix = *buf32++;
-        *buf++ = (char)(pix >> rshift);
-        *buf++ = (char)(pix >> gshift);
-        *buf++ = (char)(pix >> bshift);
-    }
+    tight_pack24_row(buf, (uint32_t *)buf, count, rshift, gshift, bshift);
 }
 
 static int send_full_color_rect(VncState *vs, int x, int y, int w, int h)
@@ -1037,7 +1172,7 @@ static bool send_gradient_rect(VncState *vs, int x, int y, int w, int h)
     vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
     vnc_write_u8(vs, VNC_TIGHT_FILTER_GRADIENT);
 
-    buffer_reserve(&vs->tight.gradient, w * 3 * sizeof (int));
+    buffer_reserve(&vs->tight.gradient, (w * 3 + 2) * sizeof (uint32_t));
 
     if (vs->tight.pixel24) {
         tight_filter_gradient24(vs, vs->tight.tight.buffer, w, h);
@@ -1127,17 +1262,12 @@ static void rgb_prepare_row24(VncState *vs, uint8_t *dst, int x, int y,
 {
     VncDisplay *vd = vs->vd;
     uint32_t *fbptr;
-    uint32_t pix;
 
     fbptr = (uint32_t *)(vd->server->data + y * ds_get_linesize(vs->ds) +
                          x * ds_get_bytes_per_pixel(vs->ds));
 
-    while (count--) {
-        pix = *fbptr++;
-        *dst++ = (uint8_t)(pix >> vs->ds->surface->pf.rshift);
-        *dst++ = (uint8_t)(pix >> vs->ds->surface->pf.gshift);
-        *dst++ = (uint8_t)(pix >> vs->ds->surface->pf.bshift);
-    }
+    tight_pack24_row(dst, fbptr, count, vs->ds->surface->pf.rshift,
+                     vs->ds->surface->pf.gshift, vs->ds->surface->pf.bshift);
 }
 
 #define DEFINE_RGB_GET_ROW_FUNCTION(bpp)                                \
@@ -1282,6 +1412,7 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
     tight_send_compact_size(vs, vs->tight.jpeg.offset);
     vnc_write(vs, vs->tight.jpeg.buffer, vs->tight.jpeg.offset);
     buffer_reset(&vs->tight.jpeg);
+    vnc_sent_lossy_rect(vs, x, y, w, h);
 
     return 1;
 }
@@ -1533,7 +1664,6 @@ static int send_sub_rect(VncState *vs, int x, int y, int w, int h)
     ret = send_sub_rect_nojpeg(vs, x, y, w, h, bg, fg, colors, palette);
 #endif
 
-    palette_destroy(palette);
     return ret;
 }
 
@@ -1659,11 +1789,33 @@ static int find_large_solid_color_rect(VncState *vs, int x, int y,
     return n + send_rect_simple(vs, x, y, w, h);
 }
 
+/*
+ * Size the scratch buffers for the largest sub-rectangle of the current
+ * level up front, instead of growing them a rectangle at a time.
+ */
+static void tight_reserve_buffers(VncState *vs)
+{
+    size_t pixels = tight_conf[vs->tight.compression].max_rect_size;
+    size_t width = tight_conf[vs->tight.compression].max_rect_width;
+
+    if (vs->tight.tight.capacity < pixels * 4) {
+        buffer_reserve(&vs->tight.tight, pixels * 4);
+    }
+    if (vs->tight.zlib.capacity < pixels * 4 + 64) {
+        buffer_reserve(&vs->tight.zlib, pixels * 4 + 64);
+    }
+    if (vs->tight.gradient.capacity < (width * 3 + 2) * sizeof(uint32_t)) {
+        buffer_reserve(&vs->tight.gradient, (width * 3 + 2) * sizeof(uint32_t));
+    }
+}
+
 static int tight_send_framebuffer_update(VncState *vs, int x, int y,
                                          int w, int h)
 {
     int max_rows;
 
+    tight_reserve_buffers(vs);
+
     if (vs->clientds.pf.bytes_per_pixel == 4 && vs->clientds.pf.rmax == 0xFF &&
         vs->clientds.pf.bmax == 0xFF && vs->clientds.pf.gmax == 0xFF) {
         vs->tight.pixel24 = true;
@@ -1682,18 +1834,83 @@ static int tight_send_framebuffer_update(VncState *vs, int x, int y,
     return find_large_solid_color_rect(vs, x, y, w, h, max_rows);
 }
 
+/*
+ * Adaptive encoding: send static regions lossless and video regions as
+ * JPEG with a quality that follows the estimated client bandwidth, and
+ * spend more zlib effort when the link rather than the CPU is the limit.
+ * The client settings are upper bounds for the JPEG quality.
+ */
+static void tight_adapt(VncState *vs, int x, int y, int w, int h)
+{
+    int64_t bw = vs->bandwidth;
+    int quality;
+
+    if (bw) {
+        if (bw < (1 << 20)) {
+            vs->tight.compression = 9;
+        } else if (bw < (8 << 20)) {
+            vs->tight.compression = 6;
+        } else {
+            vs->tight.compression = 1;
+        }
+    }
+
+    if (vs->tight.quality == (uint8_t)-1) {
+        /* the client does not accept JPEG */
+        return;
+    }
+    if (vnc_update_freq(vs, x, y, w, h) < VNC_VIDEO_FREQ) {
+        vs->tight.quality = -1;
+        return;
+    }
+    if (bw) {
+        if (bw < (256 << 10)) {
+            quality = 2;
+        } else if (bw < (1 << 20)) {
+            quality = 4;
+        } else if (bw < (4 << 20)) {
+            quality = 6;
+        } else if (bw < (16 << 20)) {
+            quality = 8;
+        } else {
+            quality = 9;
+        }
+        if (vs->rtt > 200 && quality > 0) {
+            quality--;
+        }
+        vs->tight.quality = MIN(vs->tight.quality, quality);
+    }
+}
+
+static int tight_send_adaptive(VncState *vs, int x, int y, int w, int h)
+{
+    uint8_t quality = vs->tight.quality;
+    uint8_t compression = vs->tight.compression;
+    int ret;
+
+    if (!vs->vd->lossy || vs->vd->non_adaptive) {
+        return tight_send_framebuffer_update(vs, x, y, w, h);
+    }
+
+    tight_adapt(vs, x, y, w, h);
+    ret = tight_send_framebuffer_update(vs, x, y, w, h);
+    vs->tight.quality = quality;
+    vs->tight.compression = compression;
+    return ret;
+}
+
 int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y,
                                       int w, int h)
 {
     vs->tight.type = VNC_ENCODING_TIGHT;
-    return tight_send_framebuffer_update(vs, x, y, w, h);
+    return tight_send_adaptive(vs, x, y, w, h);
 }
 
 int vnc_tight_png_send_framebuffer_update(VncState *vs, int x, int y,
                                           int w, int h)
 {
     vs->tight.type = VNC_ENCODING_TIGHT_PNG;
-    return tight_send_framebuffer_update(vs, x, y, w, h);
+    return tight_send_adaptive(vs, x, y, w, h);
 }
 
 void vnc_tight_clear(VncState *vs)
@@ -1708,6 +1925,8 @@ void vnc_tight_clear(VncState *vs)
     buffer_free(&vs->tight.tight);
     buffer_free(&vs->tight.zlib);
     buffer_free(&vs->tight.gradient);
+    palette_destroy(vs->tight.palette);
+    vs->tight.palette = NULL;
 #ifdef CONFIG_VNC_JPEG
     buffer_free(&vs->tight.jpeg);
 #endif
@@ -40,28 +40,38 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  * 		   	 if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is hold
- * to avoid screen corruptions (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not hold because the thread work on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds the VncDisplay lock in
+ * shared mode to avoid screen corruptions (this does not block vnc_refresh()
+ * because it uses trylock()) but the output lock is not hold because the
+ * thread work on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Several worker threads can share the queue.  Jobs of one client are
+ * always run one at a time and in order, because the tight and zlib
+ * encoders keep per client compression streams; jobs of different clients
+ * are encoded in parallel.
 */
 
+typedef struct VncJobQueue VncJobQueue;
+
+typedef struct VncWorker {
+    QemuThread thread;
+    Buffer buffer;
+    VncJobQueue *queue;
+} VncWorker;
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
+    int nb_workers;
+    int running_workers;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
-typedef struct VncJobQueue VncJobQueue;
-
 /*
- * We use a single global queue, but most of the functions are
- * already reetrant, so we can easilly add more than one encoding thread
+ * We use a single global queue, shared by all the encoding threads
  */
 static VncJobQueue *queue;
 
@@ -141,7 +151,7 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        if ((job->vs == vs || !vs) && !job->busy) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -157,10 +167,24 @@ void vnc_jobs_join(VncState *vs)
     vnc_unlock_queue(queue);
 }
 
+/*
+ * The copy of a client used for encoding.  zlib streams remember their
+ * own address, so the copy of a given client must stay at the same place
+ * whichever worker thread runs its jobs.
+ */
+static VncState *vnc_async_encoder(VncState *vs)
+{
+    if (!vs->encoder) {
+        vs->encoder = qemu_mallocz(sizeof(VncState));
+    }
+    return vs->encoder;
+}
+
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *buffer)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -171,7 +195,10 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->tight = orig->tight;
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
-    local->output =  queue->buffer;
+    local->lossy_rect = orig->lossy_rect;
+    local->bandwidth = orig->bandwidth;
+    local->rtt = orig->rtt;
+    local->output = *buffer;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
@@ -184,49 +211,71 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->hextile = local->hextile;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+/*
+ * Return the first job that can run now: it must be the oldest job of its
+ * client, and not already taken by another worker.
+ */
+static VncJob *vnc_queue_next_job(VncJobQueue *queue)
 {
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        for (prev = QTAILQ_FIRST(&queue->jobs); prev != job;
+             prev = QTAILQ_NEXT(prev, next)) {
+            if (prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job && !job->busy) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static int vnc_worker_thread_loop(VncWorker *worker)
+{
+    VncJobQueue *queue = worker->queue;
     VncJob *job;
     VncRectEntry *entry, *tmp;
-    VncState vs;
+    VncState *vs;
     int n_rectangles;
     int saved_offset;
     bool flush;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!(job = vnc_queue_next_job(queue)) && !queue->exit) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->busy = true;
+    vnc_unlock_queue(queue);
 
+    /* Make a local copy of vs and switch output buffers */
     vnc_lock_output(job->vs);
+    vs = vnc_async_encoder(job->vs);
+    vnc_async_encoding_start(job->vs, vs, &worker->buffer);
     if (job->vs->csock == -1 || job->vs->abort == true) {
         goto disconnected;
     }
     vnc_unlock_output(job->vs);
 
-    /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
-
     /* Start sending rectangles */
     n_rectangles = 0;
-    vnc_write_u8(&vs, VNC_MSG_SERVER_FRAMEBUFFER_UPDATE);
-    vnc_write_u8(&vs, 0);
-    saved_offset = vs.output.offset;
-    vnc_write_u16(&vs, 0);
+    vnc_write_u8(vs, VNC_MSG_SERVER_FRAMEBUFFER_UPDATE);
+    vnc_write_u8(vs, 0);
+    saved_offset = vs->output.offset;
+    vnc_write_u16(vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
             /* output mutex must be locked before going to
              * disconnected:
              */
@@ -234,7 +283,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
             goto disconnected;
         }
 
-        n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
+        n = vnc_send_framebuffer_update(vs, entry->rect.x, entry->rect.y,
                                         entry->rect.w, entry->rect.h);
 
         if (n >= 0) {
@@ -242,11 +291,11 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         qemu_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
-    vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
-    vs.output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
+    vs->output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
+    vs->output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
 
     /* Switch back buffers */
     vnc_lock_output(job->vs);
@@ -254,11 +303,13 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         goto disconnected;
     }
 
-    vnc_write(job->vs, vs.output.buffer, vs.output.offset);
+    vnc_write(job->vs, vs->output.buffer, vs->output.offset);
 
 disconnected:
+    /* Keep the (possibly reallocated) buffer for the next job */
+    worker->buffer = vs->output;
     /* Copy persistent encoding data */
-    vnc_async_encoding_end(job->vs, &vs);
+    vnc_async_encoding_end(job->vs, vs);
     flush = (job->vs->csock != -1 && job->vs->abort != true);
     vnc_unlock_output(job->vs);
 
@@ -288,22 +339,44 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     qemu_free(q);
     queue = NULL; /* Unset global queue */
 }
 
 static void *vnc_worker_thread(void *arg)
 {
-    VncJobQueue *queue = arg;
+    VncWorker *worker = arg;
+    VncJobQueue *queue = worker->queue;
+    bool last;
+
+    qemu_thread_self(&worker->thread);
+
+    while (!vnc_worker_thread_loop(worker)) ;
 
-    qemu_thread_self(&queue->thread);
+    buffer_free(&worker->buffer);
+    qemu_free(worker);
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    vnc_lock_queue(queue);
+    last = --queue->running_workers == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
+static void vnc_add_worker(VncJobQueue *q)
+{
+    VncWorker *worker = qemu_mallocz(sizeof(VncWorker));
+
+    worker->queue = q;
+    vnc_lock_queue(q);
+    q->nb_workers++;
+    q->running_workers++;
+    vnc_unlock_queue(q);
+    qemu_thread_create(&worker->thread, vnc_worker_thread, worker);
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
@@ -312,8 +385,21 @@ void vnc_start_worker_thread(void)
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q);
     queue = q; /* Set global queue */
+    vnc_add_worker(q);
+}
+
+/*
+ * Grow the pool of encoding threads to n threads.
+ */
+void vnc_set_worker_threads(int n)
+{
+    if (!vnc_worker_thread_running())
+        return ;
+
+    while (queue->nb_workers < n) {
+        vnc_add_worker(queue);
+    }
 }
 
 bool vnc_worker_thread_running(void)
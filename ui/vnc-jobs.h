@@ -41,6 +41,7 @@ void vnc_jobs_join(VncState *vs);
 #ifdef CONFIG_VNC_THREAD
 
 void vnc_start_worker_thread(void);
+void vnc_set_worker_threads(int n);
 bool vnc_worker_thread_running(void);
 void vnc_stop_worker_thread(void);
 
@@ -50,12 +51,40 @@ void vnc_stop_worker_thread(void);
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
 #ifdef CONFIG_VNC_THREAD
-    return qemu_mutex_trylock(&vd->mutex);
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -1;
+    }
+    /* the encoding threads are reading the server surface */
+    if (vd->readers) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -1;
+    }
+    return 0;
 #else
     return 0;
 #endif
 }
 
+/* Shared lock, taken by the encoding threads which only read the server
+   surface; it only excludes vnc_trylock_display().  */
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+#ifdef CONFIG_VNC_THREAD
+    qemu_mutex_lock(&vd->mutex);
+    vd->readers++;
+    qemu_mutex_unlock(&vd->mutex);
+#endif
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+#ifdef CONFIG_VNC_THREAD
+    qemu_mutex_lock(&vd->mutex);
+    vd->readers--;
+    qemu_mutex_unlock(&vd->mutex);
+#endif
+}
+
 static inline void vnc_lock_display(VncDisplay *vd)
 {
 #ifdef CONFIG_VNC_THREAD
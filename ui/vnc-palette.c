@@ -56,29 +56,32 @@ VncPalette *palette_new(size_t max, int bpp)
     VncPalette *palette;
 
     palette = qemu_mallocz(sizeof(*palette));
-    palette->max = max;
-    palette->bpp = bpp;
+    palette_init(palette, max, bpp);
     return palette;
 }
 
-void palette_destroy(VncPalette *palette)
+/*
+ * Empty a palette so it can be reused for another rectangle.  Entries
+ * come from the embedded pool, so only the buckets that were used need
+ * to be cleared.
+ */
+void palette_init(VncPalette *palette, size_t max, int bpp)
 {
-    int i;
+    size_t i;
 
-    if (palette == NULL) {
-        return ;
-    }
+    for (i = 0; i < palette->size; i++) {
+        uint32_t color = palette->pool[i].color;
 
-    for (i = 0; i < VNC_PALETTE_HASH_SIZE; i++) {
-        VncPaletteEntry *entry = QLIST_FIRST(&palette->table[i]);
-        while (entry) {
-            VncPaletteEntry *tmp = QLIST_NEXT(entry, next);
-            QLIST_REMOVE(entry, next);
-            qemu_free(entry);
-            entry = tmp;
-        }
+        QLIST_INIT(&palette->table[palette_hash(color, palette->bpp) %
+                                   VNC_PALETTE_HASH_SIZE]);
     }
+    palette->size = 0;
+    palette->max = max < VNC_PALETTE_MAX_SIZE ? max : VNC_PALETTE_MAX_SIZE;
+    palette->bpp = bpp;
+}
 
+void palette_destroy(VncPalette *palette)
+{
     qemu_free(palette);
 }
 
@@ -95,9 +98,7 @@ int palette_put(VncPalette *palette, uint32_t color)
         return 0;
     }
     if (!entry) {
-        VncPaletteEntry *entry;
-
-        entry = qemu_mallocz(sizeof(*entry));
+        entry = &palette->pool[idx];
         entry->color = color;
         entry->idx = idx;
         QLIST_INSERT_HEAD(&palette->table[hash], entry, next);
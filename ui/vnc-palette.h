@@ -34,6 +34,7 @@
 #include <stdint.h>
 
 #define VNC_PALETTE_HASH_SIZE 256
+#define VNC_PALETTE_MAX_SIZE  256
 
 typedef struct VncPaletteEntry {
     int idx;
@@ -47,9 +48,11 @@ typedef struct VncPalette {
     size_t max;
     int bpp;
     QLIST_HEAD(,VncPaletteEntry) table[VNC_PALETTE_HASH_SIZE];
+    VncPaletteEntry pool[VNC_PALETTE_MAX_SIZE];
 } VncPalette;
 
 VncPalette *palette_new(size_t max, int bpp);
+void palette_init(VncPalette *palette, size_t max, int bpp);
 void palette_destroy(VncPalette *palette);
 
 int palette_put(VncPalette *palette, uint32_t color);
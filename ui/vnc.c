@@ -31,10 +31,10 @@
 #include "qemu-timer.h"
 #include "acl.h"
 #include "qemu-objects.h"
+#include "host-utils.h"
 
-#define VNC_REFRESH_INTERVAL_BASE 30
-#define VNC_REFRESH_INTERVAL_INC  50
-#define VNC_REFRESH_INTERVAL_MAX  2000
+
+#define VNC_SCROLL_MIN_ROWS 16     /* smallest region moved with CopyRect */
 
 #include "vnc_keysym.h"
 #include "d3des.h"
@@ -417,6 +417,125 @@ static inline int vnc_and_bits(const uint32_t *d1, const uint32_t *d2,
     return 0;
 }
 
+/*
+ * Adaptive encoding.
+ *
+ * The update rate of each VNC_STAT_RECT tile of the server surface is
+ * recorded when vnc_refresh_server_surface() finds it modified; the
+ * encoders use it to send video regions lossy and everything else
+ * lossless.  Tiles sent lossy are resent once they stop changing.
+ * The client bandwidth is estimated from how fast the output buffer
+ * drains, the round trip from how long the client takes to ask for the
+ * next update.
+ */
+static void vnc_adapt_sample(int64_t *avg, int64_t sample)
+{
+    *avg = *avg ? (*avg * 3 + sample) / 4 : sample;
+}
+
+static void vnc_adapt_output_sent(VncState *vs, size_t bytes)
+{
+    int64_t now = qemu_get_clock(rt_clock);
+    int64_t elapsed;
+
+    if (!vs->write_start) {
+        vs->write_start = now;
+    }
+    vs->write_bytes += bytes;
+    if (vs->output.offset) {
+        return;
+    }
+
+    /* only samples long enough to be limited by the link count */
+    elapsed = now - vs->write_start;
+    if (elapsed >= 10 && vs->write_bytes >= 16384) {
+        vnc_adapt_sample(&vs->bandwidth, vs->write_bytes * 1000 / elapsed);
+    }
+    vs->write_start = 0;
+    vs->write_bytes = 0;
+    vs->update_drained = now;
+}
+
+static void vnc_stat_update(VncDisplay *vd, int x, int y, int64_t now)
+{
+    VncRectStat *rect = &vd->stats[y / VNC_STAT_RECT][x / VNC_STAT_RECT];
+    int last = (rect->idx + VNC_STAT_UPDATES - 1) % VNC_STAT_UPDATES;
+
+    if (rect->times[last] != now) {
+        rect->times[rect->idx] = now;
+        rect->idx = (rect->idx + 1) % VNC_STAT_UPDATES;
+    }
+}
+
+/* Updates per second of the most active tile under the rectangle */
+int vnc_update_freq(VncState *vs, int x, int y, int w, int h)
+{
+    VncDisplay *vd = vs->vd;
+    int64_t now = qemu_get_clock(rt_clock);
+    int i, j, k, n, freq = 0;
+
+    for (j = y / VNC_STAT_RECT; j <= (y + h - 1) / VNC_STAT_RECT; j++) {
+        for (i = x / VNC_STAT_RECT; i <= (x + w - 1) / VNC_STAT_RECT; i++) {
+            VncRectStat *rect = &vd->stats[j][i];
+
+            n = 0;
+            for (k = 0; k < VNC_STAT_UPDATES; k++) {
+                if (rect->times[k] && now - rect->times[k] < 1000) {
+                    n++;
+                }
+            }
+            freq = MAX(freq, n);
+        }
+    }
+    return freq;
+}
+
+void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h)
+{
+    int i, j;
+
+    for (j = y / VNC_STAT_RECT; j <= (y + h - 1) / VNC_STAT_RECT; j++) {
+        for (i = x / VNC_STAT_RECT; i <= (x + w - 1) / VNC_STAT_RECT; i++) {
+            vs->lossy_rect[j][i] = 1;
+        }
+    }
+}
+
+/* Mark the tiles that were sent lossy and are now static for a resend */
+static int vnc_refresh_lossy_rect(VncDisplay *vd)
+{
+    int64_t now = qemu_get_clock(rt_clock);
+    VncState *vs;
+    int i, j, y, has_dirty = 0;
+
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        for (j = 0; j < VNC_STAT_ROWS; j++) {
+            for (i = 0; i < VNC_STAT_COLS; i++) {
+                VncRectStat *rect = &vd->stats[j][i];
+                int last = (rect->idx + VNC_STAT_UPDATES - 1) % VNC_STAT_UPDATES;
+
+                if (!vs->lossy_rect[j][i] ||
+                    now - rect->times[last] < VNC_LOSSY_REFRESH) {
+                    continue;
+                }
+                vs->lossy_rect[j][i] = 0;
+                for (y = j * VNC_STAT_RECT;
+                     y < MIN((j + 1) * VNC_STAT_RECT, vd->server->height);
+                     y++) {
+                    int x;
+
+                    for (x = i * VNC_STAT_RECT / 16;
+                         x < (i + 1) * VNC_STAT_RECT / 16; x++) {
+                        vnc_set_bit(vs->dirty[y], x);
+                    }
+                }
+                has_dirty++;
+            }
+        }
+    }
+    return has_dirty;
+}
+
 static void vnc_dpy_update(DisplayState *ds, int x, int y, int w, int h)
 {
     int i;
@@ -440,6 +559,10 @@ static void vnc_dpy_update(DisplayState *ds, int x, int y, int w, int h)
     for (; y < h; y++)
         for (i = 0; i < w; i += 16)
             vnc_set_bit(s->dirty[y], (x + i) / 16);
+
+    if (vd->refresh) {
+        display_refresh_kick(vd->refresh);
+    }
 }
 
 void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
@@ -565,6 +688,7 @@ static void vnc_dpy_resize(DisplayState *ds)
         console_color_init(ds);
     *(vd->guest.ds) = *(ds->surface);
     memset(vd->guest.dirty, 0xFF, sizeof(vd->guest.dirty));
+    memset(vd->stats, 0, sizeof(vd->stats));
 
     QTAILQ_FOREACH(vs, &vd->clients, next) {
         vnc_colordepth(vs);
@@ -716,16 +840,20 @@ static void vnc_copy(VncState *vs, int src_x, int src_y, int dst_x, int dst_y, i
     vnc_flush(vs);
 }
 
-static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
+/*
+ * Move a region of the server surface, sending a CopyRect to the clients
+ * which support it and marking the changed tiles dirty for the others.
+ * The clients are first brought up to date with the server surface.
+ */
+static void vnc_copy_region(VncDisplay *vd, int src_x, int src_y,
+                            int dst_x, int dst_y, int w, int h)
 {
-    VncDisplay *vd = ds->opaque;
     VncState *vs, *vn;
     uint8_t *src_row;
     uint8_t *dst_row;
     int i,x,y,pitch,depth,inc,w_lim,s;
     int cmp_bytes;
 
-    vnc_refresh_server_surface(vd);
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
         if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
             vs->force_update = 1;
@@ -788,6 +916,14 @@ static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int
     }
 }
 
+static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
+{
+    VncDisplay *vd = ds->opaque;
+
+    vnc_refresh_server_surface(vd);
+    vnc_copy_region(vd, src_x, src_y, dst_x, dst_y, w, h);
+}
+
 static void vnc_mouse_set(int x, int y, int visible)
 {
     /* can we ask the client(s) to move the pointer ??? */
@@ -1024,6 +1160,7 @@ static void vnc_disconnect_finish(VncState *vs)
 
     vnc_zlib_clear(vs);
     vnc_tight_clear(vs);
+    qemu_free(vs->lossy_rect);
 
 #ifdef CONFIG_VNC_TLS
     vnc_tls_client_cleanup(vs);
@@ -1047,6 +1184,7 @@ static void vnc_disconnect_finish(VncState *vs)
 
 #ifdef CONFIG_VNC_THREAD
     qemu_mutex_destroy(&vs->output_mutex);
+    qemu_free(vs->encoder);
 #endif
     qemu_free(vs);
 }
@@ -1153,6 +1291,7 @@ static long vnc_client_write_plain(VncState *vs)
 
     memmove(vs->output.buffer, vs->output.buffer + ret, (vs->output.offset - ret));
     vs->output.offset -= ret;
+    vnc_adapt_output_sent(vs, ret);
 
     if (vs->output.offset == 0) {
         qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, NULL, vs);
@@ -1684,6 +1823,12 @@ static void framebuffer_update_request(VncState *vs, int incremental,
 
     int i;
     vs->need_update = 1;
+    if (vs->update_drained) {
+        /* the client asks for more once it has handled the last update */
+        vnc_adapt_sample(&vs->rtt,
+                         qemu_get_clock(rt_clock) - vs->update_drained);
+        vs->update_drained = 0;
+    }
     if (!incremental) {
         vs->force_update = 1;
         for (i = 0; i < h; i++) {
@@ -1897,9 +2042,7 @@ static int protocol_client_msg(VncState *vs, uint8_t *data, size_t len)
     VncDisplay *vd = vs->vd;
 
     if (data[0] > 3) {
-        vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
-        if (!qemu_timer_expired(vd->timer, qemu_get_clock(rt_clock) + vd->timer_interval))
-            qemu_mod_timer(vd->timer, qemu_get_clock(rt_clock) + vd->timer_interval);
+        display_refresh_kick(vd->refresh);
     }
 
     switch (data[0]) {
@@ -2265,11 +2408,15 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     uint32_t width_mask[VNC_DIRTY_WORDS];
     VncState *vs;
     int has_dirty = 0;
+    int precise = vd->ds->precise_updates;
+    int64_t now = qemu_get_clock(rt_clock);
 
     /*
      * Walk through the guest dirty map.
      * Check and copy modified bits from guest to server surface.
      * Update server dirty map.
+     * If the display device reports precise updates, the tiles it
+     * marked are trusted and copied without comparing them first.
      */
     vnc_set_bits(width_mask, (ds_get_width(vd->ds) / 16), VNC_DIRTY_WORDS);
     cmp_bytes = 16 * ds_get_bytes_per_pixel(vd->ds);
@@ -2289,9 +2436,12 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
                 if (!vnc_get_bit(vd->guest.dirty[y], (x / 16)))
                     continue;
                 vnc_clear_bit(vd->guest.dirty[y], (x / 16));
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
+                if (!precise && memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
                     continue;
                 memcpy(server_ptr, guest_ptr, cmp_bytes);
+                if (!vd->non_adaptive) {
+                    vnc_stat_update(vd, x, y, now);
+                }
                 QTAILQ_FOREACH(vs, &vd->clients, next) {
                     vnc_set_bit(vs->dirty[y], (x / 16));
                 }
@@ -2301,9 +2451,173 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         guest_row  += ds_get_linesize(vd->ds);
         server_row += ds_get_linesize(vd->ds);
     }
+    if (vd->lossy && !vd->non_adaptive) {
+        has_dirty += vnc_refresh_lossy_rect(vd);
+    }
     return has_dirty;
 }
 
+/*
+ * Scroll detection for display devices which never call dpy_copy.
+ * The rows of the box enclosing the guest dirty tiles are hashed both in
+ * the new frame and in the server surface, which still holds the previous
+ * one; every changed row votes for the vertical shifts that would bring it
+ * from an old row with the same hash.  The longest run of rows verified
+ * for the best shift is then moved with vnc_copy_region() and its tiles
+ * are no longer dirty, so only the uncovered lines are encoded.
+ */
+typedef struct VncRowHash {
+    uint32_t hash;
+    int y;
+} VncRowHash;
+
+static uint32_t vnc_row_hash(const uint8_t *p, int len)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i + 4 <= len; i += 4) {
+        h = (h ^ *(const uint32_t *)(p + i)) * 16777619u;
+    }
+    for (; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int vnc_row_hash_cmp(const void *a, const void *b)
+{
+    const VncRowHash *ra = a, *rb = b;
+
+    if (ra->hash != rb->hash) {
+        return ra->hash < rb->hash ? -1 : 1;
+    }
+    return ra->y - rb->y;
+}
+
+static void vnc_detect_scroll(VncDisplay *vd)
+{
+    uint32_t new_hash[VNC_MAX_HEIGHT];
+    uint32_t old_hash[VNC_MAX_HEIGHT];
+    VncRowHash sorted[VNC_MAX_HEIGHT];
+    int votes[2 * VNC_MAX_HEIGHT];
+    int pitch = ds_get_linesize(vd->ds);
+    int depth = ds_get_bytes_per_pixel(vd->ds);
+    int width = MIN(ds_get_width(vd->ds), VNC_MAX_WIDTH);
+    int height = MIN(ds_get_height(vd->ds), VNC_MAX_HEIGHT);
+    int y0 = -1, y1 = -1, t0 = VNC_DIRTY_WORDS * 32, t1 = -1;
+    int x, w, len, h, y, i, dy, best_dy, run, changed;
+    int best_start, best_len;
+    uint8_t *guest, *server;
+    VncState *vs;
+
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
+            break;
+        }
+    }
+    if (!vs) {
+        return;
+    }
+
+    /* bounding box of the dirty tiles */
+    for (y = 0; y < height; y++) {
+        for (i = 0; i < VNC_DIRTY_WORDS; i++) {
+            uint32_t bits = vd->guest.dirty[y][i];
+            if (bits) {
+                if (y0 < 0) {
+                    y0 = y;
+                }
+                y1 = y;
+                t0 = MIN(t0, i * 32 + ctz32(bits));
+                t1 = MAX(t1, i * 32 + 31 - clz32(bits));
+            }
+        }
+    }
+    h = y1 - y0 + 1;
+    if (y0 < 0 || h <= VNC_SCROLL_MIN_ROWS || t0 * 16 >= width) {
+        return;
+    }
+    x = t0 * 16;
+    w = MIN((t1 + 1) * 16, width) - x;
+    len = w * depth;
+
+    guest = vd->guest.ds->data + y0 * pitch + x * depth;
+    server = vd->server->data + y0 * pitch + x * depth;
+    for (i = 0; i < h; i++) {
+        new_hash[i] = vnc_row_hash(guest + i * pitch, len);
+        old_hash[i] = vnc_row_hash(server + i * pitch, len);
+        sorted[i].hash = old_hash[i];
+        sorted[i].y = i;
+    }
+    qsort(sorted, h, sizeof(sorted[0]), vnc_row_hash_cmp);
+
+    /* rows repeated more than a few times (blank lines...) carry no
+       information about the shift */
+    memset(votes, 0, 2 * h * sizeof(votes[0]));
+    for (i = 0; i < h; i++) {
+        int lo = 0, hi = h, n;
+
+        if (new_hash[i] == old_hash[i]) {
+            continue;
+        }
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (sorted[mid].hash < new_hash[i]) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (n = 0; lo + n < h && sorted[lo + n].hash == new_hash[i]; n++) {
+        }
+        if (n > 4) {
+            continue;
+        }
+        for (; n > 0; n--, lo++) {
+            votes[sorted[lo].y - i + h]++;
+        }
+    }
+    best_dy = 0;
+    for (dy = 1 - h; dy < h; dy++) {
+        if (votes[dy + h] > votes[best_dy + h]) {
+            best_dy = dy;
+        }
+    }
+    if (best_dy == 0 || votes[best_dy + h] < VNC_SCROLL_MIN_ROWS / 2) {
+        return;
+    }
+
+    /* longest run of rows really found best_dy rows below */
+    dy = best_dy;
+    best_start = best_len = 0;
+    run = changed = 0;
+    for (i = MAX(0, -dy); i <= MIN(h, h - dy); i++) {
+        if (i < MIN(h, h - dy) && new_hash[i] == old_hash[i + dy] &&
+            memcmp(guest + i * pitch, server + (i + dy) * pitch, len) == 0) {
+            run++;
+            changed += new_hash[i] != old_hash[i];
+            continue;
+        }
+        if (run > best_len && changed >= VNC_SCROLL_MIN_ROWS / 2) {
+            best_start = i - run;
+            best_len = run;
+        }
+        run = changed = 0;
+    }
+    if (best_len < VNC_SCROLL_MIN_ROWS) {
+        return;
+    }
+
+    vnc_copy_region(vd, x, y0 + best_start + dy, x, y0 + best_start,
+                    w, best_len);
+    for (y = y0 + best_start; y < y0 + best_start + best_len; y++) {
+        for (i = t0; i <= t1; i++) {
+            vnc_clear_bit(vd->guest.dirty[y], i);
+        }
+    }
+}
+
 static void vnc_refresh(void *opaque)
 {
     VncDisplay *vd = opaque;
@@ -2311,11 +2625,10 @@ static void vnc_refresh(void *opaque)
     int has_dirty, rects = 0;
 
     vga_hw_update();
+    vnc_detect_scroll(vd);
 
     if (vnc_trylock_display(vd)) {
-        vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
-        qemu_mod_timer(vd->timer, qemu_get_clock(rt_clock) +
-                       vd->timer_interval);
+        display_refresh_done(vd->refresh, 1);
         return;
     }
 
@@ -2327,38 +2640,27 @@ static void vnc_refresh(void *opaque)
         /* vs might be free()ed here */
     }
 
-    /* vd->timer could be NULL now if the last client disconnected,
+    /* vd->refresh could be NULL now if the last client disconnected,
      * in this case don't update the timer */
-    if (vd->timer == NULL)
+    if (vd->refresh == NULL)
         return;
 
-    if (has_dirty && rects) {
-        vd->timer_interval /= 2;
-        if (vd->timer_interval < VNC_REFRESH_INTERVAL_BASE)
-            vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
-    } else {
-        vd->timer_interval += VNC_REFRESH_INTERVAL_INC;
-        if (vd->timer_interval > VNC_REFRESH_INTERVAL_MAX)
-            vd->timer_interval = VNC_REFRESH_INTERVAL_MAX;
-    }
-    qemu_mod_timer(vd->timer, qemu_get_clock(rt_clock) + vd->timer_interval);
+    display_refresh_done(vd->refresh, has_dirty && rects);
 }
 
 static void vnc_init_timer(VncDisplay *vd)
 {
-    vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
-    if (vd->timer == NULL && !QTAILQ_EMPTY(&vd->clients)) {
-        vd->timer = qemu_new_timer(rt_clock, vnc_refresh, vd);
+    if (vd->refresh == NULL && !QTAILQ_EMPTY(&vd->clients)) {
+        vd->refresh = display_refresh_new(vnc_refresh, vd);
         vnc_refresh(vd);
     }
 }
 
 static void vnc_remove_timer(VncDisplay *vd)
 {
-    if (vd->timer != NULL && QTAILQ_EMPTY(&vd->clients)) {
-        qemu_del_timer(vd->timer);
-        qemu_free_timer(vd->timer);
-        vd->timer = NULL;
+    if (vd->refresh != NULL && QTAILQ_EMPTY(&vd->clients)) {
+        display_refresh_free(vd->refresh);
+        vd->refresh = NULL;
     }
 }
 
@@ -2366,6 +2668,7 @@ static void vnc_connect(VncDisplay *vd, int csock)
 {
     VncState *vs = qemu_mallocz(sizeof(VncState));
     vs->csock = csock;
+    vs->lossy_rect = qemu_mallocz(VNC_STAT_ROWS * sizeof(*vs->lossy_rect));
 
     VNC_DEBUG("New client on socket %d\n", csock);
     dcl->idle = 0;
@@ -2620,6 +2923,20 @@ int vnc_display_open(DisplayState *ds, const char *display)
 #endif
         } else if (strncmp(options, "lossy", 5) == 0) {
             vs->lossy = true;
+        } else if (strncmp(options, "non-adaptive", 12) == 0) {
+            vs->non_adaptive = true;
+#ifdef CONFIG_VNC_THREAD
+        } else if (strncmp(options, "workers=", 8) == 0) {
+            int workers = atoi(options + 8);
+
+            if (workers < 1) {
+                fprintf(stderr, "Invalid number of VNC workers\n");
+                qemu_free(vs->display);
+                vs->display = NULL;
+                return -1;
+            }
+            vnc_set_worker_threads(workers);
+#endif
         }
     }
 
@@ -80,6 +80,18 @@ typedef void VncSendHextileTile(VncState *vs,
 #define VNC_MAX_HEIGHT 2048
 #define VNC_DIRTY_WORDS (VNC_MAX_WIDTH / (16 * 32))
 
+/*
+ * Adaptive encoding: the screen is split in VNC_STAT_RECT square tiles
+ * whose update rate is tracked to tell video from static content.
+ */
+#define VNC_STAT_RECT  64
+#define VNC_STAT_COLS (VNC_MAX_WIDTH / VNC_STAT_RECT)
+#define VNC_STAT_ROWS (VNC_MAX_HEIGHT / VNC_STAT_RECT)
+#define VNC_STAT_UPDATES 8          /* update times remembered per tile */
+
+#define VNC_VIDEO_FREQ 5            /* updates/s above which a tile is video */
+#define VNC_LOSSY_REFRESH 1000      /* ms before a static lossy tile is resent */
+
 #define VNC_AUTH_CHALLENGE_SIZE 16
 
 typedef struct VncDisplay VncDisplay;
@@ -98,17 +110,23 @@ struct VncSurface
     DisplaySurface *ds;
 };
 
+typedef struct VncRectStat
+{
+    int64_t times[VNC_STAT_UPDATES];    /* rt_clock of the last updates */
+    int idx;
+} VncRectStat;
+
 struct VncDisplay
 {
     QTAILQ_HEAD(, VncState) clients;
-    QEMUTimer *timer;
-    int timer_interval;
+    DisplayRefresh *refresh;
     int lsock;
     DisplayState *ds;
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
 #ifdef CONFIG_VNC_THREAD
     QemuMutex mutex;
+    int readers;        /* encoding threads reading the server surface */
 #endif
 
     QEMUCursor *cursor;
@@ -117,12 +135,14 @@ struct VncDisplay
 
     struct VncSurface guest;   /* guest visible surface (aka ds->surface) */
     DisplaySurface *server;  /* vnc server surface */
+    VncRectStat stats[VNC_STAT_ROWS][VNC_STAT_COLS];
 
     char *display;
     char *password;
     time_t expires;
     int auth;
     bool lossy;
+    bool non_adaptive;
 #ifdef CONFIG_VNC_TLS
     int subauth; /* Used by VeNCrypt */
     VncDisplayTLS tls;
@@ -149,6 +169,7 @@ typedef struct VncTight {
 #endif
     int levels[4];
     z_stream stream[4];
+    struct VncPalette *palette;     /* reused by every palette rect */
 } VncTight;
 
 typedef struct VncHextile {
@@ -180,6 +201,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool busy;          /* taken by a worker thread */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -241,10 +263,20 @@ struct VncState
     QEMUPutLEDEntry *led;
 
     bool abort;
+
+    /* adaptive encoding, see vnc_adapt_*() */
+    uint8_t (*lossy_rect)[VNC_STAT_COLS]; /* tiles last sent lossy */
+    int64_t bandwidth;          /* estimated bytes/s, 0 if unknown */
+    int64_t rtt;                /* estimated round trip in ms, 0 if unknown */
+    int64_t write_start;        /* when the output buffer started to fill */
+    size_t write_bytes;         /* bytes sent since write_start */
+    int64_t update_drained;     /* when the last update left the buffer */
+
 #ifndef CONFIG_VNC_THREAD
     VncJob job;
 #else
     QemuMutex output_mutex;
+    VncState *encoder;          /* copy used by the encoding threads */
 #endif
 
     /* Encoding specific, if you add something here, don't forget to
@@ -483,6 +515,9 @@ void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v);
 /* Encodings */
 int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 
+int vnc_update_freq(VncState *vs, int x, int y, int w, int h);
+void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h);
+
 int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 
 int vnc_hextile_send_framebuffer_update(VncState *vs, int x,
@@ -47,6 +47,9 @@
 #include <dirent.h>
 #include <netdb.h>
 #include <sys/select.h>
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 #ifdef CONFIG_SIMPLE_TRACE
 #include "trace.h"
 #endif
@@ -138,6 +141,7 @@ int main(int argc, char **argv)
 #include "qemu-char.h"
 #include "cache-utils.h"
 #include "block.h"
+#include "block-cache.h"
 #include "blockdev.h"
 #include "block-migration.h"
 #include "dma.h"
@@ -151,6 +155,9 @@ int main(int argc, char **argv)
 #ifdef CONFIG_VIRTFS
 #include "fsdev/qemu-fsdev.h"
 #endif
+#ifdef CONFIG_IOTHREAD
+#include "iothread.h"
+#endif
 
 #include "disas.h"
 
@@ -225,6 +232,7 @@ int old_param = 0;
 const char *qemu_name;
 int alt_grab = 0;
 int ctrl_grab = 0;
+int sdl_opengl = 0;
 unsigned int nb_prom_envs = 0;
 const char *prom_envs[MAX_PROM_ENVS];
 int boot_menu;
@@ -243,6 +251,8 @@ QTAILQ_HEAD(, FWBootEntry) fw_boot_order = QTAILQ_HEAD_INITIALIZER(fw_boot_order
 int nb_numa_nodes;
 uint64_t node_mem[MAX_NODES];
 uint64_t node_cpumask[MAX_NODES];
+uint64_t node_host_nodes[MAX_NODES];
+int node_policy[MAX_NODES];
 
 static QEMUTimer *nographic_timer;
 
@@ -852,6 +862,40 @@ static void numa_add(const char *optarg)
             }
             node_cpumask[nodenr] = value;
         }
+        if (get_param_value(option, 128, "host-nodes", optarg) == 0) {
+            node_host_nodes[nodenr] = 0;
+        } else {
+            value = strtoull(option, &endptr, 10);
+            endvalue = value;
+            if (*endptr == '-') {
+                endvalue = strtoull(endptr + 1, &endptr, 10);
+            }
+            if (*endptr || value > endvalue || endvalue >= 64) {
+                fprintf(stderr, "qemu: invalid numa host-nodes: %s\n", option);
+                exit(1);
+            }
+            node_host_nodes[nodenr] = (2ULL << endvalue) - (1ULL << value);
+        }
+        if (get_param_value(option, 128, "policy", optarg) == 0) {
+            node_policy[nodenr] = node_host_nodes[nodenr] ?
+                NUMA_POLICY_BIND : NUMA_POLICY_DEFAULT;
+        } else if (!strcmp(option, "default")) {
+            node_policy[nodenr] = NUMA_POLICY_DEFAULT;
+        } else if (!strcmp(option, "preferred")) {
+            node_policy[nodenr] = NUMA_POLICY_PREFERRED;
+        } else if (!strcmp(option, "bind")) {
+            node_policy[nodenr] = NUMA_POLICY_BIND;
+        } else if (!strcmp(option, "interleave")) {
+            node_policy[nodenr] = NUMA_POLICY_INTERLEAVE;
+        } else {
+            fprintf(stderr, "qemu: invalid numa policy: %s\n", option);
+            exit(1);
+        }
+        if (node_policy[nodenr] != NUMA_POLICY_DEFAULT &&
+            !node_host_nodes[nodenr]) {
+            fprintf(stderr, "qemu: numa policy %s needs host-nodes\n", option);
+            exit(1);
+        }
         nb_numa_nodes++;
     }
     return;
@@ -1034,12 +1078,110 @@ typedef struct IOHandlerRecord {
     void *opaque;
     /* temporary data */
     struct pollfd *ufd;
+#ifdef CONFIG_EPOLL
+    uint32_t events;            /* registered with io_epoll_fd */
+    bool always_ready;          /* cannot be polled, e.g. a regular file */
+    bool on_polled_list;
+    QLIST_ENTRY(IOHandlerRecord) polled;
+#endif
     QLIST_ENTRY(IOHandlerRecord) next;
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
+static bool io_handlers_deleted;
+
+#ifdef CONFIG_EPOLL
+/*
+ * On Linux the handlers stay registered with an epoll instance, so that
+ * an iteration of the main loop only looks at the fds that are ready.
+ * What fd_read_poll says can change anytime though: the handlers that
+ * have one, and those epoll cannot watch, are on io_handlers_polled and
+ * looked at on every iteration.  select() remains the fallback.
+ */
+#define IO_EPOLL_EVENTS 128
 
+static int io_epoll_fd = -1;
+static bool io_epoll_failed;
+static QLIST_HEAD(, IOHandlerRecord) io_handlers_polled =
+    QLIST_HEAD_INITIALIZER(io_handlers_polled);
+
+static bool io_epoll_init(void)
+{
+    if (io_epoll_fd < 0 && !io_epoll_failed) {
+        io_epoll_fd = epoll_create(IO_EPOLL_EVENTS);
+        if (io_epoll_fd < 0) {
+            io_epoll_failed = true;
+        } else {
+            qemu_set_cloexec(io_epoll_fd);
+        }
+    }
+    return io_epoll_fd >= 0;
+}
+
+static void io_epoll_set_polled(IOHandlerRecord *ioh)
+{
+    bool polled = !ioh->deleted && (ioh->fd_read_poll || ioh->always_ready);
+
+    if (polled && !ioh->on_polled_list) {
+        QLIST_INSERT_HEAD(&io_handlers_polled, ioh, polled);
+    } else if (!polled && ioh->on_polled_list) {
+        QLIST_REMOVE(ioh, polled);
+    }
+    ioh->on_polled_list = polled;
+}
+
+/*
+ * Bring the epoll registration of ioh up to date.  force is for when the
+ * handler was set again: its fd might have been closed and reopened, and
+ * fd_read_poll is left for the main loop to call.
+ */
+static void io_epoll_update(IOHandlerRecord *ioh, bool force)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
+    int op, ret;
+
+    if (!ioh->deleted && !ioh->always_ready) {
+        if (ioh->fd_read && ioh->fd_read_poll && force) {
+            events |= ioh->events & EPOLLIN;
+        } else if (ioh->fd_read &&
+            (!ioh->fd_read_poll || ioh->fd_read_poll(ioh->opaque) != 0)) {
+            events |= EPOLLIN;
+        }
+        if (ioh->fd_write) {
+            events |= EPOLLOUT;
+        }
+    }
+    if (events == ioh->events && !(force && events)) {
+        return;
+    }
+
+    if (!events) {
+        op = EPOLL_CTL_DEL;
+    } else if (ioh->events) {
+        op = EPOLL_CTL_MOD;
+    } else {
+        op = EPOLL_CTL_ADD;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ioh;
+    ret = epoll_ctl(io_epoll_fd, op, ioh->fd, &ev);
+    if (ret < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        ret = epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, ioh->fd, &ev);
+    } else if (ret < 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+        ret = epoll_ctl(io_epoll_fd, EPOLL_CTL_MOD, ioh->fd, &ev);
+    }
+    if (ret < 0 && op != EPOLL_CTL_DEL) {
+        /* select() says such fds are always ready */
+        ioh->always_ready = true;
+        io_epoll_set_polled(ioh);
+        events = 0;
+    }
+    ioh->events = events;
+}
+#endif
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -1055,6 +1197,13 @@ int qemu_set_fd_handler2(int fd,
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
                 ioh->deleted = 1;
+                io_handlers_deleted = true;
+#ifdef CONFIG_EPOLL
+                if (io_epoll_init()) {
+                    io_epoll_update(ioh, false);
+                    io_epoll_set_polled(ioh);
+                }
+#endif
                 break;
             }
         }
@@ -1072,6 +1221,13 @@ int qemu_set_fd_handler2(int fd,
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+#ifdef CONFIG_EPOLL
+        if (io_epoll_init()) {
+            ioh->always_ready = false;
+            io_epoll_update(ioh, true);
+            io_epoll_set_polled(ioh);
+        }
+#endif
     }
     return 0;
 }
@@ -1131,7 +1287,7 @@ static QEMUMachine *find_default_machine(void)
 
 static void gui_update(void *opaque)
 {
-    uint64_t interval = GUI_REFRESH_INTERVAL;
+    uint64_t interval = display_refresh_fast;
     DisplayState *ds = opaque;
     DisplayChangeListener *dcl = ds->listeners;
 
@@ -1149,7 +1305,7 @@ static void gui_update(void *opaque)
 
 static void nographic_update(void *opaque)
 {
-    uint64_t interval = GUI_REFRESH_INTERVAL;
+    uint64_t interval = display_refresh_slow;
 
     qemu_flush_coalesced_mmio_buffer();
     qemu_mod_timer(nographic_timer, interval + qemu_get_clock(rt_clock));
@@ -1324,13 +1480,115 @@ void qemu_system_vmstop_request(int reason)
     qemu_notify_event();
 }
 
+/* Free the handlers deleted meanwhile */
+static void io_handlers_free_deleted(void)
+{
+    IOHandlerRecord *ioh, *pioh;
+
+    if (!io_handlers_deleted) {
+        return;
+    }
+    io_handlers_deleted = false;
+
+    QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
+        if (ioh->deleted) {
+            QLIST_REMOVE(ioh, next);
+            qemu_free(ioh);
+        }
+    }
+}
+
+/* Round a timeout in nanoseconds up, so that the wait does not end just
+   before the deadline */
+static void io_timeout_to_timeval(int64_t timeout, struct timeval *tv)
+{
+    int64_t us = (timeout + 999) / 1000;
+
+    tv->tv_sec = us / 1000000;
+    tv->tv_usec = us % 1000000;
+}
+
+#ifdef CONFIG_EPOLL
+static void io_epoll_wait(int64_t timeout)
+{
+    struct epoll_event events[IO_EPOLL_EVENTS];
+    IOHandlerRecord *ioh, *pioh;
+    fd_set rfds, wfds, xfds;
+    struct timeval tv;
+    int ret, nfds, i, n = 0;
+
+    QLIST_FOREACH_SAFE(ioh, &io_handlers_polled, polled, pioh) {
+        if (ioh->always_ready) {
+            timeout = 0;
+        } else {
+            io_epoll_update(ioh, false);
+        }
+    }
+
+    nfds = -1;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+
+    qemu_mutex_unlock_iothread();
+    if (nfds >= 0 || (timeout > 0 && timeout < 1000000)) {
+        /* slirp lives on select(), wait for the epoll fd along with it.
+           epoll_wait() also counts in milliseconds, while select() does
+           not round short deadlines to 0 or 1 ms */
+        FD_SET(io_epoll_fd, &rfds);
+        nfds = MAX(nfds, io_epoll_fd);
+        io_timeout_to_timeval(timeout, &tv);
+        ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+        if (ret > 0 && FD_ISSET(io_epoll_fd, &rfds)) {
+            n = epoll_wait(io_epoll_fd, events, IO_EPOLL_EVENTS, 0);
+        }
+    } else {
+        ret = n = epoll_wait(io_epoll_fd, events, IO_EPOLL_EVENTS,
+                             (timeout + 999999) / 1000000);
+    }
+    qemu_mutex_lock_iothread();
+    qemu_mutex_iothread_set_site(IOTHREAD_LOCK_MAIN_LOOP);
+
+    for (i = 0; i < n; i++) {
+        uint32_t revents = events[i].events;
+
+        ioh = events[i].data.ptr;
+        if (!ioh->deleted && ioh->fd_read && (ioh->events & EPOLLIN) &&
+            (revents & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            ioh->fd_read(ioh->opaque);
+        }
+        if (!ioh->deleted && ioh->fd_write && (ioh->events & EPOLLOUT) &&
+            (revents & (EPOLLOUT | EPOLLERR))) {
+            ioh->fd_write(ioh->opaque);
+        }
+    }
+    QLIST_FOREACH_SAFE(ioh, &io_handlers_polled, polled, pioh) {
+        if (!ioh->always_ready) {
+            continue;
+        }
+        if (!ioh->deleted && ioh->fd_read &&
+            (!ioh->fd_read_poll || ioh->fd_read_poll(ioh->opaque) != 0)) {
+            ioh->fd_read(ioh->opaque);
+        }
+        if (!ioh->deleted && ioh->fd_write) {
+            ioh->fd_write(ioh->opaque);
+        }
+    }
+
+    io_handlers_free_deleted();
+
+    slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+}
+#endif
+
 void main_loop_wait(int nonblocking)
 {
     IOHandlerRecord *ioh;
     fd_set rfds, wfds, xfds;
     int ret, nfds;
     struct timeval tv;
-    int timeout;
+    int64_t timeout;
 
     if (nonblocking)
         timeout = 0;
@@ -1341,6 +1599,13 @@ void main_loop_wait(int nonblocking)
 
     os_host_main_loop_wait(&timeout);
 
+#ifdef CONFIG_EPOLL
+    if (io_epoll_init()) {
+        io_epoll_wait(timeout);
+        goto out;
+    }
+#endif
+
     /* poll any events */
     /* XXX: separate device handlers from system ones */
     nfds = -1;
@@ -1364,35 +1629,33 @@ void main_loop_wait(int nonblocking)
         }
     }
 
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000) * 1000;
+    io_timeout_to_timeval(timeout, &tv);
 
     slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
 
     qemu_mutex_unlock_iothread();
     ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
     qemu_mutex_lock_iothread();
+    qemu_mutex_iothread_set_site(IOTHREAD_LOCK_MAIN_LOOP);
     if (ret > 0) {
-        IOHandlerRecord *pioh;
-
-        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
+        QLIST_FOREACH(ioh, &io_handlers, next) {
             if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, &rfds)) {
                 ioh->fd_read(ioh->opaque);
             }
             if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, &wfds)) {
                 ioh->fd_write(ioh->opaque);
             }
-
-            /* Do this last in case read/write handlers marked it for deletion */
-            if (ioh->deleted) {
-                QLIST_REMOVE(ioh, next);
-                qemu_free(ioh);
-            }
         }
     }
 
+    /* Do this last in case read/write handlers marked them for deletion */
+    io_handlers_free_deleted();
+
     slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
 
+#ifdef CONFIG_EPOLL
+out:
+#endif
     qemu_run_all_timers();
 
     /* Check bottom-halves last in case any of the earlier events triggered
@@ -1637,6 +1900,18 @@ static int chardev_init_func(QemuOpts *opts, void *opaque)
     return 0;
 }
 
+#ifdef CONFIG_IOTHREAD
+static int iothread_init_func(QemuOpts *opts, void *opaque)
+{
+    return iothread_add(opts);
+}
+
+static int vcpu_init_func(QemuOpts *opts, void *opaque)
+{
+    return vcpu_settings_add(opts);
+}
+#endif
+
 #ifdef CONFIG_VIRTFS
 static int fsdev_init_func(QemuOpts *opts, void *opaque)
 {
@@ -1877,6 +2152,130 @@ static void qemu_run_machine_init_done_notifiers(void)
     notifier_list_notify(&machine_init_done_notifiers);
 }
 
+#define STARTUP_PROFILE_MAX 32
+
+typedef struct StartupProfileEntry {
+    const char *name;
+    int64_t ns;
+    int count;
+} StartupProfileEntry;
+
+#define STARTUP_PROFILE_DEVICES 8    /* drivers listed in the report */
+
+static int startup_profile;
+static int startup_done;
+static int64_t startup_profile_start, startup_profile_last;
+static StartupProfileEntry startup_phases[STARTUP_PROFILE_MAX];
+static StartupProfileEntry startup_work[STARTUP_PROFILE_MAX];
+static StartupProfileEntry startup_devices[STARTUP_PROFILE_MAX];
+static int startup_nphases, startup_nwork, startup_ndevices;
+
+/* The phase that just ended */
+void startup_profile_mark(const char *phase)
+{
+    int64_t now;
+
+    if (startup_done) {
+        return;
+    }
+    now = get_clock();
+    trace_startup_phase(phase, now - startup_profile_start);
+    if (!startup_profile || startup_nphases == STARTUP_PROFILE_MAX) {
+        return;
+    }
+    startup_phases[startup_nphases].name = phase;
+    startup_phases[startup_nphases].ns = now - startup_profile_last;
+    startup_nphases++;
+    startup_profile_last = now;
+}
+
+static void startup_profile_add(StartupProfileEntry *table, int *n,
+                                const char *what, int64_t ns)
+{
+    int i;
+
+    for (i = 0; i < *n; i++) {
+        if (!strcmp(table[i].name, what)) {
+            break;
+        }
+    }
+    if (i == *n) {
+        if (*n == STARTUP_PROFILE_MAX) {
+            return;
+        }
+        table[(*n)++].name = what;
+    }
+    table[i].ns += ns;
+    table[i].count++;
+}
+
+/* Work within the phases, added up by name */
+void startup_profile_account(const char *what, int64_t ns)
+{
+    if (startup_profile) {
+        startup_profile_add(startup_work, &startup_nwork, what, ns);
+    }
+}
+
+/* Devices, added up by driver */
+void startup_profile_device(const char *driver, const char *id, int64_t ns)
+{
+    if (startup_done) {
+        return;
+    }
+    trace_startup_device(driver, id ? id : "", ns);
+    if (startup_profile) {
+        startup_profile_add(startup_devices, &startup_ndevices, driver, ns);
+    }
+}
+
+static int startup_profile_compare(const void *a, const void *b)
+{
+    const StartupProfileEntry *ea = a, *eb = b;
+
+    return ea->ns < eb->ns ? 1 : ea->ns > eb->ns ? -1 : 0;
+}
+
+static void startup_profile_report(void)
+{
+    int i;
+
+    fprintf(stderr, "startup profile (ms):\n");
+    for (i = 0; i < startup_nphases; i++) {
+        fprintf(stderr, "  %-24s %10.3f\n", startup_phases[i].name,
+                startup_phases[i].ns / 1e6);
+    }
+    fprintf(stderr, "  %-24s %10.3f\n", "total",
+            (startup_profile_last - startup_profile_start) / 1e6);
+    for (i = 0; i < startup_nwork; i++) {
+        fprintf(stderr, "  of which %-15s %10.3f (%d)\n",
+                startup_work[i].name, startup_work[i].ns / 1e6,
+                startup_work[i].count);
+    }
+
+    qsort(startup_devices, startup_ndevices, sizeof(startup_devices[0]),
+          startup_profile_compare);
+    for (i = 0; i < MIN(startup_ndevices, STARTUP_PROFILE_DEVICES); i++) {
+        fprintf(stderr, "  device %-17s %10.3f (%d)\n",
+                startup_devices[i].name, startup_devices[i].ns / 1e6,
+                startup_devices[i].count);
+    }
+}
+
+void startup_profile_cpu_exec(void)
+{
+    if (likely(startup_done)) {
+        return;
+    }
+    startup_profile_mark("first instruction");
+    if (startup_profile) {
+        startup_profile_report();
+    }
+
+    /* later resets and hotplugged devices are not startup */
+    startup_done = 1;
+}
+
 static const QEMUOption *lookup_opt(int argc, char **argv,
                                     const char **poptarg, int *poptind)
 {
@@ -1934,6 +2333,8 @@ int main(int argc, char **argv, char **envp)
     int optind;
     const char *optarg;
     const char *loadvm = NULL;
+    const char *dump_vmstate_arg = NULL;
+    const char *vmstate_bench_arg = NULL;
     QEMUMachine *machine;
     const char *cpu_model;
     int tb_size;
@@ -1949,6 +2350,7 @@ int main(int argc, char **argv, char **envp)
     error_set_progname(argv[0]);
 
     init_clocks();
+    startup_profile_start = startup_profile_last = get_clock();
 
     qemu_cache_utils_init(envp);
 
@@ -1969,6 +2371,8 @@ int main(int argc, char **argv, char **envp)
     for (i = 0; i < MAX_NODES; i++) {
         node_mem[i] = 0;
         node_cpumask[i] = 0;
+        node_host_nodes[i] = 0;
+        node_policy[i] = NUMA_POLICY_DEFAULT;
     }
 
     nb_numa_nodes = 0;
@@ -2080,6 +2484,15 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_drive:
                 drive_def(optarg);
 	        break;
+            case QEMU_OPTION_backing_cache:
+                opts = qemu_opts_parse(qemu_find_opts("backing-cache"),
+                                       optarg, 0);
+                if (!opts ||
+                    block_cache_init(qemu_opt_get_size(opts, "size", 0),
+                                     qemu_opt_get(opts, "path")) < 0) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_set:
                 if (qemu_set_option(optarg) != 0)
                     exit(1);
@@ -2327,6 +2740,9 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_singlestep:
                 singlestep = 1;
                 break;
+            case QEMU_OPTION_no_tcg_optimize:
+                tcg_optimize_enabled = 0;
+                break;
             case QEMU_OPTION_S:
                 autostart = 0;
                 break;
@@ -2402,6 +2818,28 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
                 break;
+            case QEMU_OPTION_iothread:
+                olist = qemu_find_opts("iothread");
+                if (!olist) {
+                    fprintf(stderr, "iothread is not supported by this qemu build.\n");
+                    exit(1);
+                }
+                opts = qemu_opts_parse(olist, optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_vcpu:
+                olist = qemu_find_opts("vcpu");
+                if (!olist) {
+                    fprintf(stderr, "vcpu is not supported by this qemu build.\n");
+                    exit(1);
+                }
+                opts = qemu_opts_parse(olist, optarg, 1);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_fsdev:
                 olist = qemu_find_opts("fsdev");
                 if (!olist) {
@@ -2518,6 +2956,12 @@ int main(int argc, char **argv, char **envp)
 	    case QEMU_OPTION_loadvm:
 		loadvm = optarg;
 		break;
+            case QEMU_OPTION_dump_vmstate:
+                dump_vmstate_arg = optarg;
+                break;
+            case QEMU_OPTION_vmstate_bench:
+                vmstate_bench_arg = optarg;
+                break;
             case QEMU_OPTION_full_screen:
                 full_screen = 1;
                 break;
@@ -2531,6 +2975,9 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_ctrl_grab:
                 ctrl_grab = 1;
                 break;
+            case QEMU_OPTION_sdl_gl:
+                sdl_opengl = 1;
+                break;
             case QEMU_OPTION_no_quit:
                 no_quit = 1;
                 break;
@@ -2538,6 +2985,11 @@ int main(int argc, char **argv, char **envp)
                 display_type = DT_SDL;
                 break;
 #endif
+            case QEMU_OPTION_refresh_rate:
+                if (display_refresh_set_rates(optarg) < 0) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_pidfile:
                 pid_file = optarg;
                 break;
@@ -2685,6 +3137,9 @@ int main(int argc, char **argv, char **envp)
                 incoming = optarg;
                 incoming_expected = true;
                 break;
+            case QEMU_OPTION_startup_profile:
+                startup_profile = 1;
+                break;
             case QEMU_OPTION_nodefaults:
                 default_serial = 0;
                 default_parallel = 0;
@@ -2871,6 +3326,20 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+#ifdef CONFIG_IOTHREAD
+    /* the threads would not survive os_daemonize() */
+    if (qemu_opts_foreach(qemu_find_opts("iothread"), iothread_init_func,
+                          NULL, 1) != 0) {
+        exit(1);
+    }
+    if (qemu_opts_foreach(qemu_find_opts("vcpu"), vcpu_init_func,
+                          NULL, 1) != 0) {
+        exit(1);
+    }
+#endif
+
+    startup_profile_mark("command line");
+
     if (kvm_allowed) {
         int ret = kvm_init();
         if (ret < 0) {
@@ -2881,12 +3350,21 @@ int main(int argc, char **argv, char **envp)
             }
             exit(1);
         }
+        /* Guest writes to a directly mapped framebuffer only show up in
+           the KVM dirty log, which nobody reads unless polled. */
+        if (!display_refresh_slow) {
+            fprintf(stderr, "qemu: warning: idle displays must be polled "
+                    "with KVM, using -refresh-rate min=%g\n",
+                    1000.0 / DISPLAY_REFRESH_SLOW);
+            display_refresh_slow = DISPLAY_REFRESH_SLOW;
+        }
     }
 
     if (qemu_init_main_loop()) {
         fprintf(stderr, "qemu_init_main_loop failed\n");
         exit(1);
     }
+    startup_profile_mark("accelerator");
     linux_boot = (kernel_filename != NULL);
 
     if (!linux_boot && *kernel_cmdline != '\0') {
@@ -2914,6 +3392,7 @@ int main(int argc, char **argv, char **envp)
     /* init the bluetooth world */
     if (foreach_device_config(DEV_BT, bt_parse))
         exit(1);
+    startup_profile_mark("timers and network");
 
     /* init the memory */
     if (ram_size == 0)
@@ -2921,6 +3400,7 @@ int main(int argc, char **argv, char **envp)
 
     /* init the dynamic translator */
     cpu_exec_init_all(tb_size * 1024 * 1024);
+    startup_profile_mark("translator");
 
     bdrv_init_with_whitelist();
 
@@ -2934,6 +3414,7 @@ int main(int argc, char **argv, char **envp)
 
     default_drive(default_cdrom, snapshot, machine->use_scsi,
                   IF_DEFAULT, 2, CDROM_OPTS);
+    startup_profile_mark("block devices");
     default_drive(default_floppy, snapshot, machine->use_scsi,
                   IF_FLOPPY, 0, FD_OPTS);
     default_drive(default_sdcard, snapshot, machine->use_scsi,
@@ -3015,6 +3496,7 @@ int main(int argc, char **argv, char **envp)
 
     machine->init(ram_size, boot_devices,
                   kernel_filename, kernel_cmdline, initrd_filename, cpu_model);
+    startup_profile_mark("machine");
 
     cpu_synchronize_all_post_init();
 
@@ -3034,6 +3516,7 @@ int main(int argc, char **argv, char **envp)
     /* init generic devices */
     if (qemu_opts_foreach(qemu_find_opts("device"), device_init_func, NULL, 1) != 0)
         exit(1);
+    startup_profile_mark("devices");
 
     net_check_clients();
 
@@ -3101,7 +3584,9 @@ int main(int argc, char **argv, char **envp)
         }
         dcl = dcl->next;
     }
-    if (ds->gui_timer == NULL) {
+    /* Without a local display only KVM's coalesced MMIO ring wants a
+       periodic flush, and every vcpu exit flushes it anyway.  */
+    if (ds->gui_timer == NULL && kvm_enabled() && display_refresh_slow) {
         nographic_timer = qemu_new_timer(rt_clock, nographic_update, NULL);
         qemu_mod_timer(nographic_timer, qemu_get_clock(rt_clock));
     }
@@ -3113,12 +3598,15 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    startup_profile_mark("displays");
+
     qdev_machine_creation_done();
 
     if (rom_load_all() != 0) {
         fprintf(stderr, "rom loading failed\n");
         exit(1);
     }
+    startup_profile_mark("roms");
 
     /* TODO: once all bus devices are qdevified, this should be done
      * when bus is created by qdev.c */
@@ -3126,10 +3614,18 @@ int main(int argc, char **argv, char **envp)
     qemu_run_machine_init_done_notifiers();
 
     qemu_system_reset();
+    startup_profile_mark("reset");
+    if (dump_vmstate_arg) {
+        exit(dump_vmstate(dump_vmstate_arg) < 0 ? 1 : 0);
+    }
+    if (vmstate_bench_arg) {
+        exit(vmstate_bench(vmstate_bench_arg) < 0 ? 1 : 0);
+    }
     if (loadvm) {
-        if (load_vmstate(loadvm) < 0) {
+        if (load_vmstate(loadvm, 0) < 0) {
             autostart = 0;
         }
+        startup_profile_mark("loadvm");
     }
 
     if (incoming) {
@@ -3142,6 +3638,7 @@ int main(int argc, char **argv, char **envp)
     } else if (autostart) {
         vm_start();
     }
+    startup_profile_mark("start");
 
     os_setup_post();
 